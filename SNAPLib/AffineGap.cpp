@@ -0,0 +1,354 @@
+/*++
+
+Module Name:
+
+    AffineGap.cpp
+
+Abstract:
+
+    Banded affine gap alignment for CIGAR strings.  See AffineGap.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "AffineGap.h"
+#include "Bam.h"
+
+#include "Simd.h"
+
+//
+// computeRowAVX2 is compiled for AVX2 by itself, so the rest of SNAP still runs on processors without it.  MSVC doesn't
+// need to be told.
+//
+#ifdef _MSC_VER
+#define AFFINE_GAP_VECTOR_TARGET(instructionSets)
+#else
+#define AFFINE_GAP_VECTOR_TARGET(instructionSets) __attribute__((target(instructionSets)))
+#endif
+
+AffineGapWithCigar::AffineGapWithCigar() :
+    gapOpenPenalty(DefaultGapOpenPenalty), rowCapacity(0), rows(NULL), actionCapacity(0), actions(NULL),
+    textCapacity(0), paddedText(NULL), opCapacity(0), ops(NULL)
+{
+}
+
+AffineGapWithCigar::~AffineGapWithCigar()
+{
+    delete[] rows;
+    delete[] actions;
+    delete[] paddedText;
+    delete[] ops;
+}
+
+    void
+AffineGapWithCigar::reserve(int patternLen, int stride)
+{
+    if (rowCapacity < stride) {
+        delete[] rows;
+        rowCapacity = stride;
+        rows = new int[5 * rowCapacity];
+    }
+    if (actionCapacity < (_int64)patternLen * stride) {
+        delete[] actions;
+        actionCapacity = (_int64)patternLen * stride;
+        actions = new _uint8[actionCapacity];
+    }
+    if (textCapacity < patternLen + stride) {
+        delete[] paddedText;
+        textCapacity = patternLen + stride;
+        paddedText = new char[textCapacity];
+    }
+    if (opCapacity < 2 * patternLen + stride) {
+        delete[] ops;
+        opCapacity = 2 * patternLen + stride;
+        ops = new char[opCapacity];
+    }
+}
+
+    void
+AffineGapWithCigar::computeRowScalar(
+    const int*  previousH,
+    const int*  previousOpen,
+    const int*  previousE,
+    int*        H,
+    int*        E,
+    _uint8*     action,
+    const char* text,
+    char        patternBase,
+    int         width,
+    int         gapOpenCost)
+{
+    for (int c = 0; c < width; c++) {
+        int match = previousH[c] + (text[c] == patternBase ? MatchScore : -MismatchPenalty);
+        int open = previousOpen[c + 1] - gapOpenCost;
+        int extend = previousE[c + 1] - GapExtendPenalty;
+        E[c] = __max(open, extend);
+        action[c] = extend > open ? ExtendsInsertion : 0;
+        if (E[c] > match) {
+            H[c] = E[c];
+            action[c] |= FromInsertion;
+        } else {
+            H[c] = match;
+        }
+    }
+}
+
+#ifdef SNAP_SIMD_X86
+    void AFFINE_GAP_VECTOR_TARGET("avx2")
+AffineGapWithCigar::computeRowAVX2(
+    const int*  previousH,
+    const int*  previousOpen,
+    const int*  previousE,
+    int*        H,
+    int*        E,
+    _uint8*     action,
+    const char* text,
+    char        patternBase,
+    int         width,
+    int         gapOpenCost)
+/*++
+
+Routine Description:
+
+    computeRowScalar eight cells at a time.  The text bytes are compared with the read base and widened to pick the
+    match score or mismatch penalty for each cell, and the actions are packed back down to bytes at the end.
+
+--*/
+{
+    const __m256i base = _mm256_set1_epi32(patternBase);
+    const __m256i matchScore = _mm256_set1_epi32(MatchScore);
+    const __m256i mismatchScore = _mm256_set1_epi32(-MismatchPenalty);
+    const __m256i openCost = _mm256_set1_epi32(gapOpenCost);
+    const __m256i extendCost = _mm256_set1_epi32(GapExtendPenalty);
+    const __m256i extendsInsertion = _mm256_set1_epi32(ExtendsInsertion);
+    const __m256i fromInsertion = _mm256_set1_epi32(FromInsertion);
+
+    for (int c = 0; c < width; c += VectorCells) {
+        __m256i textBases = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(text + c)));
+        __m256i score = _mm256_blendv_epi8(mismatchScore, matchScore, _mm256_cmpeq_epi32(textBases, base));
+        __m256i match = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(previousH + c)), score);
+
+        __m256i open = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(previousOpen + c + 1)), openCost);
+        __m256i extend = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(previousE + c + 1)), extendCost);
+        __m256i e = _mm256_max_epi32(open, extend);
+
+        __m256i cellAction = _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(extend, open), extendsInsertion),
+            _mm256_and_si256(_mm256_cmpgt_epi32(e, match), fromInsertion));
+
+        _mm256_storeu_si256((__m256i*)(E + c), e);
+        _mm256_storeu_si256((__m256i*)(H + c), _mm256_max_epi32(match, e));
+
+        //
+        // The actions are all small, so packing with saturation leaves each 128 bit lane's four in its low bytes.
+        //
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(cellAction, cellAction), _mm256_setzero_si256());
+        *(_uint32*)(action + c) = (_uint32)_mm_cvtsi128_si32(_mm256_castsi256_si128(packed));
+        *(_uint32*)(action + c + 4) = (_uint32)_mm_cvtsi128_si32(_mm256_extracti128_si256(packed, 1));
+    }
+}
+#endif // SNAP_SIMD_X86
+
+AffineGapWithCigar::RowFunction AffineGapWithCigar::computeRow = KernelChooser<AffineGapWithCigar::RowFunction>("affine gap")
+    .avx2(X86_ONLY(AffineGapWithCigar::computeRowAVX2)).scalar(AffineGapWithCigar::computeRowScalar);
+
+    int
+AffineGapWithCigar::computeAlignment(
+    const char* text,
+    int         textLen,
+    const char* pattern,
+    int         patternLen,
+    int         w,
+    char*       cigarBuf,
+    int         cigarBufLen,
+    bool        useM,
+    int*        o_cigarBufUsed,
+    int*        o_textUsed,
+    int*        o_netIndel)
+/*++
+
+Routine Description:
+
+    Gotoh's recurrence, in a band of diagonals.  Cell c of row i is the best alignment of the first i bases of the
+    pattern that ends at text position i + c - w; H is the best of all of them, E the best that ends in an insertion
+    and F the best that ends in a deletion.  Gaps may not be opened from the empty alignment in row 0, and the
+    answer is taken from alignments that end by aligning the last base, which is what keeps indels off the ends.
+
+    The last row is only needed for that, so it isn't filled in.  Ties go to aligning the bases, then to insertions:
+    since the traceback runs from the end, that puts indels as early in the read as they can go.
+
+Arguments:
+
+    text            - the reference, which has to have textLen bases
+    textLen         - how much of it the alignment may use
+    pattern         - the read
+    patternLen      - its length
+    w               - how far from the main diagonal the alignment may go
+    cigarBuf        - where to write the BAM CIGAR ops
+    cigarBufLen     - bytes available there
+    useM            - write M rather than = and X
+    o_cigarBufUsed  - the bytes written
+    o_textUsed      - the reference bases the alignment covers
+    o_netIndel      - deleted bases minus inserted ones
+
+Return Value:
+
+    NM for the alignment, -1 if there isn't one in the band or -2 if cigarBuf is too small.
+
+--*/
+{
+    if (patternLen <= 0 || textLen <= 0 || w < 0) {
+        return -1;
+    }
+
+    int width = 2 * w + 1;
+    int cells = (width + VectorCells - 1) / VectorCells * VectorCells;
+    int stride = cells + VectorCells;   // Room for reading the cell to the right of the last one, which is NoScore
+    int gapOpenCost = gapOpenPenalty + GapExtendPenalty;
+
+    reserve(patternLen, stride);
+
+    int* previousH = rows;
+    int* previousE = rows + rowCapacity;
+    int* H = rows + 2 * rowCapacity;
+    int* E = rows + 3 * rowCapacity;
+    int* noScore = rows + 4 * rowCapacity;
+    for (int c = 0; c < 5 * rowCapacity; c++) {
+        rows[c] = NoScore;
+    }
+    previousH[w] = 0;
+
+    //
+    // paddedText[i + c] is what cell c of row i + 1 aligns its read base against.  Past the end of the text it's zero,
+    // which matches nothing; positions there only lead further past it, and no answer is taken from them.
+    //
+    int textCopied = __min(textLen, patternLen + w);
+    memset(paddedText, 0, textCapacity);
+    memcpy(paddedText + w, text, textCopied);
+
+    for (int i = 1; i < patternLen; i++) {
+        _uint8* action = actions + (_int64)i * stride;
+        (*computeRow)(previousH, 1 == i ? noScore : previousH, previousE, H, E, action, paddedText + i - 1,
+            pattern[i - 1], cells, gapOpenCost);
+
+        for (int c = width; c < cells; c++) {
+            H[c] = E[c] = NoScore;
+        }
+
+        int F = NoScore;
+        for (int c = 1; c < width; c++) {
+            int open = H[c - 1] - gapOpenCost;
+            int extend = F - GapExtendPenalty;
+            if (extend > open) {
+                F = extend;
+                action[c] |= ExtendsDeletion;
+            } else {
+                F = open;
+            }
+            if (F > H[c]) {
+                H[c] = F;
+                action[c] = (action[c] & ~FromMask) | FromDeletion;
+            }
+        }
+
+        int* t = previousH; previousH = H; H = t;
+        t = previousE; previousE = E; E = t;
+    }
+
+    //
+    // Align the last base, trying the diagonals in order of distance from the main one, as LandauVishkin does.
+    //
+    int best = NoScore;
+    int bestC = -1;
+    for (int d = 0; d != -(w + 1); d = (d >= 0 ? -(d + 1) : -d)) {
+        int textUsed = patternLen + d;
+        if (textUsed < 1 || textUsed > textLen) {
+            continue;
+        }
+        int score = previousH[w + d] + (pattern[patternLen - 1] == text[textUsed - 1] ? MatchScore : -MismatchPenalty);
+        if (score > best) {
+            best = score;
+            bestC = w + d;
+        }
+    }
+
+    if (best <= NoScore / 2) {
+        return -1;
+    }
+
+    int nOps = 0;
+    int i = patternLen - 1;
+    int c = bestC;
+    ops[nOps++] = pattern[patternLen - 1] == text[i + c - w] ? '=' : 'X';
+
+    _uint8 state = FromMatch;
+    while (i > 0 || c != w || state != FromMatch) {
+        if (i <= 0 || c < 0 || c >= width || nOps >= opCapacity) {
+            _ASSERT(!"affine gap traceback left the array");
+            return -1;
+        }
+        _uint8 action = actions[(_int64)i * stride + c];
+        if (FromInsertion == state) {
+            ops[nOps++] = 'I';
+            state = (action & ExtendsInsertion) ? FromInsertion : FromMatch;
+            i--;
+            c++;
+        } else if (FromDeletion == state) {
+            ops[nOps++] = 'D';
+            state = (action & ExtendsDeletion) ? FromDeletion : FromMatch;
+            c--;
+        } else if (FromMatch == (action & FromMask)) {
+            ops[nOps++] = pattern[i - 1] == text[i - 1 + c - w] ? '=' : 'X';
+            i--;
+        } else {
+            state = action & FromMask;
+        }
+    }
+
+    //
+    // The ops are backward; write them forward in runs.
+    //
+    char* cigarBufStart = cigarBuf;
+    int editDistance = 0;
+    *o_netIndel = 0;
+    char runCode = 0;
+    int runLength = 0;
+    for (int op = nOps - 1; op >= -1; op--) {
+        char code = op >= 0 ? ops[op] : 0;
+        if (op >= 0) {
+            if ('=' != code) {
+                editDistance++;
+            }
+            if ('I' == code) {
+                (*o_netIndel)--;
+            } else if ('D' == code) {
+                (*o_netIndel)++;
+            }
+            if (useM && ('=' == code || 'X' == code)) {
+                code = 'M';
+            }
+        }
+        if (code == runCode) {
+            runLength++;
+            continue;
+        }
+        if (runLength > 0) {
+            if (cigarBufLen < (int)sizeof(_uint32)) {
+                return -2;
+            }
+            *(_uint32*)cigarBuf = ((_uint32)runLength << 4) | BAMAlignment::CigarToCode[(unsigned char)runCode];
+            cigarBuf += sizeof(_uint32);
+            cigarBufLen -= sizeof(_uint32);
+        }
+        runCode = code;
+        runLength = 1;
+    }
+
+    *o_cigarBufUsed = (int)(cigarBuf - cigarBufStart);
+    *o_textUsed = patternLen + bestC - w;
+    return editDistance;
+}
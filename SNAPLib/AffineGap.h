@@ -0,0 +1,100 @@
+/*++
+
+Module Name:
+
+    AffineGap.h
+
+Abstract:
+
+    Banded global alignment with affine gap penalties, for writing CIGAR strings.
+
+    LandauVishkinWithCigar finds an alignment with the fewest edits, which treats a three base deletion as three
+    separate events and will happily split one indel into two to save a mismatch.  With -G, it runs this on the
+    result instead: the same read against the same reference, in the band of diagonals the edit distance allows,
+    scored the way variant callers expect (BWA's defaults, apart from the gap open penalty, which is the -G value).
+    It's only ever run on the alignments that get written out, so its cost is per output line, not per candidate.
+
+    The dynamic programming array is kept by diagonal, so that a row (one base of the read) is 2w+1 contiguous
+    cells for diagonals -w to w.  Everything in a row except deletions comes from the row before, so that part is
+    done a vector at a time (see computeRowAVX2); deletions come from the cell to the left in the same row, and are
+    done by a scalar pass along it afterward.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class AffineGapWithCigar {
+public:
+    AffineGapWithCigar();
+
+    ~AffineGapWithCigar();
+
+    static const int MatchScore = 1;
+    static const int MismatchPenalty = 4;
+    static const int DefaultGapOpenPenalty = 6;
+    static const int GapExtendPenalty = 1;  // A gap of n bases costs gapOpenPenalty + n * GapExtendPenalty
+
+    void setGapOpenPenalty(int i_gapOpenPenalty) {gapOpenPenalty = i_gapOpenPenalty;}
+
+    //
+    // Align all of the pattern against a prefix of the text, both starting at the beginning, staying within w
+    // diagonals of the main one, and write the CIGAR as BAM ops.  The alignment begins and ends with bases aligned
+    // to each other (matching or not), so there's never an indel at either end.  Returns the number of mismatched,
+    // inserted and deleted bases (that is, NM), -1 if there's no alignment within the band, or -2 if the CIGAR
+    // doesn't fit in cigarBuf.  netIndel has the same sense as for LandauVishkinWithCigar: positive for deletions.
+    //
+    int computeAlignment(const char* text, int textLen, const char* pattern, int patternLen, int w,
+                         char* cigarBuf, int cigarBufLen, bool useM,
+                         int* o_cigarBufUsed, int* o_textUsed, int* o_netIndel);
+
+private:
+
+    //
+    // Fills in the cells of a row that come from the row before: aligning the read base to the text base (match or
+    // mismatch) or an insertion, either opened from H or extended from E in the diagonal above.  text[c] is the
+    // reference base that the read base lines up with on diagonal c - w.  It does width cells, a multiple of
+    // VectorCells; the ones past the band are cleaned up by the caller.
+    //
+    typedef void (*RowFunction)(const int* previousH, const int* previousOpen, const int* previousE, int* H, int* E,
+        _uint8* action, const char* text, char patternBase, int width, int gapOpenCost);
+
+    static void computeRowScalar(const int* previousH, const int* previousOpen, const int* previousE, int* H, int* E,
+        _uint8* action, const char* text, char patternBase, int width, int gapOpenCost);
+    static void computeRowAVX2(const int* previousH, const int* previousOpen, const int* previousE, int* H, int* E,
+        _uint8* action, const char* text, char patternBase, int width, int gapOpenCost);
+
+    static RowFunction computeRow;
+
+    static const int VectorCells = 8;   // ints in an AVX2 register
+
+    //
+    // What's in action for each cell: where H came from, and whether E and F there extend a gap or open one.
+    //
+    static const _uint8 FromMatch = 0;
+    static const _uint8 FromInsertion = 1;
+    static const _uint8 FromDeletion = 2;
+    static const _uint8 FromMask = 3;
+    static const _uint8 ExtendsInsertion = 4;
+    static const _uint8 ExtendsDeletion = 8;
+
+    static const int NoScore = -(1 << 28);  // Far enough below anything real that it stays there after adding penalties
+
+    void reserve(int patternLen, int stride);
+
+    int gapOpenPenalty;
+
+    int         rowCapacity;    // ints in each of the row buffers below
+    int*        rows;           // H, E and the all-NoScore row, twice over for the previous and current row
+    _int64      actionCapacity;
+    _uint8*     actions;        // [row][cell], stride ints per row
+    int         textCapacity;
+    char*       paddedText;     // the text, with zeroes (which never match) on both sides
+    int         opCapacity;
+    char*       ops;            // one per aligned, inserted or deleted base, backward from the end
+};
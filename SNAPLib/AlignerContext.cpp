@@ -36,19 +36,461 @@ Revision History:
 #include "Error.h"
 #include "Util.h"
 #include "CommandProcessor.h"
+#include "StageTiming.h"
+#include "PipelineTrace.h"
+#include "Autotune.h"
+#include "Simd.h"
+#include "GenericFile.h"
+#include "Bam.h"
+#include "ResourcePlan.h"
 
 using std::max;
 using std::min;
 
 //
-// Save the index & index directory globally so that we don't need to reload them on multiple runs.
+// The loaded indices, so that we don't need to reload them on multiple runs.  Each is keyed by its directory and the
+// -contigs it was loaded with, and counts the contexts using it.  Its lock is held while it's being loaded or packed,
+// so that a second command that wants it waits for the first to load it rather than loading its own copy.  Each also
+// knows how much memory it takes, so that the cache can stay under IndexCacheMemoryBudget.
 //
-GenomeIndex *g_index = NULL;
-char *g_indexDirectory = NULL;
+struct CachedIndex
+{
+    char                *directory;
+    char                *contigs;           // The -contigs the index was loaded with, or NULL if it's the whole thing
+    bool                 outOfCore;         // Loaded with -ooc
+    GenomeIndex         *index;             // NULL until it's loaded
+    GenomeIndex        **numaReplicas;      // With -numaReplicate, the per NUMA node copies of the index (index is the first one)
+    unsigned             nNumaReplicas;
+    bool                 loadFailed;
+    _int64               footprint;         // Bytes of memory, estimated from the index files until it's loaded
+    int                  refCount;
+    _int64               lastUsed;
+    ExclusiveLock        lock;
+    CachedIndex         *next;
+};
+
+struct IndexCache
+{
+    ExclusiveLock        lock;
+    CachedIndex         *entries;
+    unsigned             nEntries;
+    _int64               totalFootprint;
+
+    IndexCache() : entries(NULL), nEntries(0), totalFootprint(0) {
+        InitializeExclusiveLock(&lock);
+        SetExclusiveLockWholeProgramScope(&lock);
+    }
+};
+
+unsigned IndexCacheSize = 1;
+_int64 IndexCacheMemoryBudget = 0;
+bool AlignerContextsRunConcurrently = false;
+
+    static IndexCache *
+GetIndexCache()
+{
+    static IndexCache cache;    // Constructed the first time through, which C++ makes thread safe
+    return &cache;
+}
+
+    static void
+FreeCachedIndex(CachedIndex *entry)
+{
+    if (NULL != entry->numaReplicas) {
+        for (unsigned i = 0; i < entry->nNumaReplicas; i++) {
+            delete entry->numaReplicas[i];
+        }
+        delete[] entry->numaReplicas;
+    } else {
+        delete entry->index;
+    }
+    DestroyExclusiveLock(&entry->lock);
+    delete[] entry->directory;
+    delete[] entry->contigs;
+    delete entry;
+}
+
+//
+// Take entries that nothing is using out of the cache, least recently used first, until it's down to IndexCacheSize
+// entries and IndexCacheMemoryBudget bytes (or everything left is in use), and return them in a list for the caller to
+// free once it's dropped the cache lock.  Entries that failed to load go regardless.
+//
+    static CachedIndex *
+TrimIndexCache(IndexCache *cache)
+{
+    CachedIndex *trimmed = NULL;
+    for (;;) {
+        CachedIndex **victim = NULL;
+        for (CachedIndex **entry = &cache->entries; NULL != *entry; entry = &(*entry)->next) {
+            if (0 == (*entry)->refCount && ((*entry)->loadFailed || NULL == victim || (*entry)->lastUsed < (*victim)->lastUsed)) {
+                victim = entry;
+                if ((*entry)->loadFailed) {
+                    break;
+                }
+            }
+        }
+
+        bool withinBudget = 0 == IndexCacheMemoryBudget || cache->totalFootprint <= IndexCacheMemoryBudget;
+        if (NULL == victim || (cache->nEntries <= IndexCacheSize && withinBudget && !(*victim)->loadFailed)) {
+            return trimmed;
+        }
+
+        CachedIndex *entry = *victim;
+        *victim = entry->next;
+        cache->nEntries--;
+        cache->totalFootprint -= entry->footprint;
+        entry->next = trimmed;
+        trimmed = entry;
+    }
+}
+
+    static void
+FreeTrimmedIndices(CachedIndex *trimmed)
+{
+    while (NULL != trimmed) {
+        CachedIndex *next = trimmed->next;
+        FreeCachedIndex(trimmed);
+        trimmed = next;
+    }
+}
+
+//
+// Load the index that options asks for, or find it already loaded.  Returns its entry, with a reference held, or
+// NULL if it couldn't be loaded.
+//
+    static CachedIndex *
+AcquireIndex(AlignerOptions *options)
+{
+    IndexCache *cache = GetIndexCache();
+    AcquireExclusiveLock(&cache->lock);
+
+    CachedIndex *entry;
+    for (entry = cache->entries; NULL != entry; entry = entry->next) {
+        bool sameContigs = (NULL == entry->contigs) ? (NULL == options->restrictToContigs) :
+            (NULL != options->restrictToContigs && strcmp(entry->contigs, options->restrictToContigs) == 0);
+        if (!entry->loadFailed && sameContigs && entry->outOfCore == options->outOfCoreIndex && strcmp(entry->directory, options->indexDir) == 0) {
+            break;
+        }
+    }
+
+    if (NULL == entry) {
+        entry = new CachedIndex;
+        entry->directory = new char[strlen(options->indexDir) + 1];
+        strcpy(entry->directory, options->indexDir);
+        entry->contigs = NULL;
+        if (NULL != options->restrictToContigs) {
+            entry->contigs = new char[strlen(options->restrictToContigs) + 1];
+            strcpy(entry->contigs, options->restrictToContigs);
+        }
+        entry->outOfCore = options->outOfCoreIndex;
+        entry->index = NULL;
+        entry->numaReplicas = NULL;
+        entry->nNumaReplicas = 0;
+        entry->loadFailed = false;
+        entry->footprint = GenomeIndex::getSizeOnDisk(options->indexDir);
+        if (options->numaReplicateIndex && !options->mapIndex && !options->sharedMemoryIndex && !options->outOfCoreIndex && NULL == options->restrictToContigs) {
+            entry->footprint *= __max(GetNumberOfNumaNodes(), 1u);
+        }
+        entry->refCount = 0;
+        InitializeExclusiveLock(&entry->lock);
+        entry->next = cache->entries;
+        cache->entries = entry;
+        cache->nEntries++;
+        cache->totalFootprint += entry->footprint;
+    }
+
+    entry->refCount++;
+    entry->lastUsed = timeInMillis();
+
+    //
+    // Make room before loading, so that the old index is gone before the new one takes up memory.
+    //
+    CachedIndex *trimmed = TrimIndexCache(cache);
+    ReleaseExclusiveLock(&cache->lock);
+    FreeTrimmedIndices(trimmed);
+
+    AcquireExclusiveLock(&entry->lock);
+    if (NULL == entry->index && !entry->loadFailed) {
+        WriteStatusMessage("Loading index from directory... ");
+
+        fflush(stdout);
+        _int64 loadStart = timeInMillis();
+
+        //
+        // With -shm we map the shared memory copy of the index instead of the index itself.
+        //
+        char *indexDirToLoad = (char *)options->indexDir;
+        char *sharedIndexDir = NULL;
+        bool mapIndex = options->mapIndex;
+        if (options->sharedMemoryIndex) {
+            sharedIndexDir = GenomeIndex::getSharedMemoryCopy(options->indexDir);
+            if (NULL == sharedIndexDir) {
+                WriteErrorMessage("Unable to use a shared memory copy of the index, aborting.\n");
+                entry->loadFailed = true;
+            }
+            indexDirToLoad = sharedIndexDir;
+            mapIndex = true;
+        }
+
+        if ((options->numaInterleaveIndex || options->numaReplicateIndex) && mapIndex) {
+            WriteErrorMessage("-numa and -numaReplicate have no effect with -map or -shm\n");
+        }
+
+        if (NULL != options->restrictToContigs && (mapIndex || options->outOfCoreIndex || options->packGenome || options->numaInterleaveIndex ||
+                                                    options->numaReplicateIndex)) {
+            WriteErrorMessage("-contigs can't be used with -map, -shm, -ooc, -packGenome, -numa or -numaReplicate\n");
+            entry->loadFailed = true;
+        }
+
+        if (!entry->loadFailed) {
+            GenomeIndex::VerifyChecksums = !options->noVerifyIndex;
+            GenomeIndex *index = NULL;
+            if (options->numaReplicateIndex && !mapIndex && !options->outOfCoreIndex && NULL == options->restrictToContigs) {
+                entry->numaReplicas = GenomeIndex::loadReplicasForNumaNodes(indexDirToLoad, options->prefetchIndex, &entry->nNumaReplicas);
+                if (NULL != entry->numaReplicas) {
+                    index = entry->numaReplicas[0];
+                    WriteStatusMessage("(%d copies, one per NUMA node) ", entry->nNumaReplicas);
+                }
+            }
+
+            if (NULL == index) {
+                index = GenomeIndex::loadFromDirectory(indexDirToLoad, mapIndex, options->prefetchIndex,
+                                                       options->numaInterleaveIndex || options->numaReplicateIndex, options->restrictToContigs, NULL,
+                                                       options->outOfCoreIndex);
+            }
+
+            if (index == NULL) {
+                WriteErrorMessage("Index load failed, aborting.\n");
+                entry->loadFailed = true;
+            } else {
+                entry->index = index;
+
+                _int64 loadTime = timeInMillis() - loadStart;
+                WriteStatusMessage("%llds.  %u bases, seed size %d\n",
+                    loadTime / 1000, index->getGenome()->getCountOfBases(), index->getSeedLength());
+                if (NULL != index->getLongSeedIndex()) {
+                    WriteStatusMessage("Seed size %d for reads of at least %d bases\n", index->getLongSeedIndex()->getSeedLength(), options->longSeedMinReadLength);
+                }
+            }
+        }
+        delete[] sharedIndexDir;
+    }
+
+    if (!entry->loadFailed && options->packGenome) {
+        _int64 packStart = timeInMillis();
+        WriteStatusMessage("Packing genome... ");
+        bool packed = true;
+        if (NULL != entry->numaReplicas) {
+            for (unsigned i = 0; i < entry->nNumaReplicas; i++) {
+                packed = packed && entry->numaReplicas[i]->createPackedGenome();
+            }
+        } else {
+            packed = entry->index->createPackedGenome();
+        }
+
+        if (!packed) {
+            WriteErrorMessage("Unable to pack the genome, aborting.\n");
+            ReleaseExclusiveLock(&entry->lock);
+            AcquireExclusiveLock(&cache->lock);
+            entry->refCount--;
+            ReleaseExclusiveLock(&cache->lock);
+            return NULL;
+        }
+        WriteStatusMessage("%llds.\n", (timeInMillis() - packStart) / 1000);
+    }
+    bool loadFailed = entry->loadFailed;
+    _int64 footprint = 0;
+    if (NULL != entry->numaReplicas) {
+        for (unsigned i = 0; i < entry->nNumaReplicas; i++) {
+            footprint += entry->numaReplicas[i]->getMemoryFootprint();
+        }
+    } else if (NULL != entry->index) {
+        footprint = entry->index->getMemoryFootprint();
+    }
+    ReleaseExclusiveLock(&entry->lock);
+
+    //
+    // Now that we know how much it really takes, something else may have to go to stay in budget.
+    //
+    AcquireExclusiveLock(&cache->lock);
+    if (loadFailed) {
+        entry->refCount--;
+    } else {
+        cache->totalFootprint += footprint - entry->footprint;
+        entry->footprint = footprint;
+    }
+    trimmed = TrimIndexCache(cache);
+    ReleaseExclusiveLock(&cache->lock);
+    FreeTrimmedIndices(trimmed);
+
+    return loadFailed ? NULL : entry;
+}
+
+//
+// While the index loads, read the start of each input file (-ira megabytes in all) into the page cache on a thread of
+// its own, so that once the readers start, their first reads (and the gzip or BAM decompression that waits on them)
+// don't wait on storage.  The readers themselves can't start early, since SAM, BAM and CRAM input needs the genome.
+// The thread has its own copies of the file names, so it can outlive the run that started it.
+//
+struct InputReadaheadContext
+{
+    char               **fileNames;
+    int                  nFiles;
+    _int64               bytesPerFile;
+};
+
+    static void
+InputReadaheadThreadMain(void *param)
+{
+    InputReadaheadContext *context = (InputReadaheadContext *)param;
+    const size_t ioSize = 4 * 1024 * 1024;
+    char *buffer = new char[ioSize];
+
+    for (int i = 0; i < context->nFiles; i++) {
+        FILE *file = fopen(context->fileNames[i], "rb");
+        if (NULL != file) {
+            for (_int64 amountRead = 0; amountRead < context->bytesPerFile; ) {
+                size_t amountThisTime = fread(buffer, 1, (size_t)__min((_int64)ioSize, context->bytesPerFile - amountRead), file);
+                if (0 == amountThisTime) {
+                    break;
+                }
+                amountRead += amountThisTime;
+            }
+            fclose(file);
+        }
+        delete[] context->fileNames[i];
+    }
+
+    delete[] buffer;
+    delete[] context->fileNames;
+    delete context;
+}
+
+    static void
+StartInputReadahead(AlignerOptions *options)
+{
+    //
+    // Not for standard input or HDFS, which can't be read twice, or -inputPart, which doesn't start at the beginning,
+    // or -region or -unmappedOnly, which only read parts of it.
+    //
+    if (0 == options->inputReadaheadMB || options->nInputParts > 1 || NULL != options->inputRegion || options->unmappedOnly) {
+        return;
+    }
+
+    InputReadaheadContext *context = new InputReadaheadContext;
+    context->fileNames = new char *[2 * options->nInputs];
+    context->nFiles = 0;
+    for (int i = 0; i < options->nInputs; i++) {
+        const char *fileNames[2] = {options->inputs[i].isStdio ? NULL : options->inputs[i].fileName, options->inputs[i].secondFileName};
+        for (int j = 0; j < 2; j++) {
+            if (NULL != fileNames[j] && strcmp(fileNames[j], "-") != 0 && strncmp(fileNames[j], GenericFile::HDFS_PREFIX, strlen(GenericFile::HDFS_PREFIX)) != 0) {
+                context->fileNames[context->nFiles] = new char[strlen(fileNames[j]) + 1];
+                strcpy(context->fileNames[context->nFiles], fileNames[j]);
+                context->nFiles++;
+            }
+        }
+    }
+
+    if (0 == context->nFiles) {
+        delete[] context->fileNames;
+        delete context;
+        return;
+    }
+
+    context->bytesPerFile = (_int64)options->inputReadaheadMB * 1024 * 1024 / context->nFiles;
+    if (!StartNewThread(InputReadaheadThreadMain, context)) {
+        for (int i = 0; i < context->nFiles; i++) {
+            delete[] context->fileNames[i];
+        }
+        delete[] context->fileNames;
+        delete context;
+    }
+}
+
+    static void
+ReleaseIndex(CachedIndex *entry)
+{
+    IndexCache *cache = GetIndexCache();
+    AcquireExclusiveLock(&cache->lock);
+    _ASSERT(entry->refCount > 0);
+    entry->refCount--;
+    entry->lastUsed = timeInMillis();
+    CachedIndex *trimmed = TrimIndexCache(cache);
+    ReleaseExclusiveLock(&cache->lock);
+    FreeTrimmedIndices(trimmed);
+}
+
+    bool
+PreloadIndices(const char *configFileName)
+{
+    FILE *configFile = fopen(configFileName, "r");
+    if (NULL == configFile) {
+        WriteErrorMessage("Unable to open index config file '%s'\n", configFileName);
+        return false;
+    }
+
+    char *lineBuffer = NULL;
+    int lineBufferSize = 0;
+    unsigned nPreloaded = 0;
+    bool worked = true;
+    while (worked && NULL != reallocatingFgets(&lineBuffer, &lineBufferSize, configFile)) {
+        const int maxWords = 100;
+        const char *words[maxWords];
+        int nWords = 0;
+        char *comment = strchr(lineBuffer, '#');
+        if (NULL != comment) {
+            *comment = '\0';
+        }
+
+        for (char *word = strtok(lineBuffer, " \t\r\n"); NULL != word; word = strtok(NULL, " \t\r\n")) {
+            if (nWords == maxWords) {
+                WriteErrorMessage("Too many options on a line of index config file '%s'\n", configFileName);
+                worked = false;
+                break;
+            }
+            words[nWords++] = word;
+        }
+
+        if (!worked || 0 == nWords) {
+            continue;
+        }
+
+        AlignerOptions options("index config file");
+        options.indexDir = words[0];
+        for (int n = 1; n < nWords; n++) {
+            bool done;
+            if (!options.parse(words, nWords, n, &done)) {
+                WriteErrorMessage("Unknown or incomplete option '%s' for index '%s' in index config file '%s'\n", words[n], words[0], configFileName);
+                worked = false;
+                break;
+            }
+        }
+
+        if (worked) {
+            //
+            // Make sure the count limit doesn't push out the ones we've already loaded.  The memory budget still applies.
+            //
+            nPreloaded++;
+            IndexCacheSize = __max(IndexCacheSize, nPreloaded);
+
+            CachedIndex *entry = AcquireIndex(&options);
+            if (NULL == entry) {
+                worked = false;
+            } else {
+                ReleaseIndex(entry);
+            }
+        }
+    }
+
+    delete[] lineBuffer;
+    fclose(configFile);
+    return worked;
+}
 
 AlignerContext::AlignerContext(int i_argc, const char **i_argv, const char *i_version, AlignerExtension* i_extension)
     :
     index(NULL),
+    cachedIndex(NULL),
     writerSupplier(NULL),
     options(NULL),
     stats(NULL),
@@ -57,7 +499,13 @@ AlignerContext::AlignerContext(int i_argc, const char **i_argv, const char *i_ve
     argc(i_argc),
     argv(i_argv),
     version(i_version),
-    perfFile(NULL)
+    perfFile(NULL),
+    progress(NULL),
+    slowReads(NULL),
+    alignmentCache(NULL),
+    originalAlignments(NULL),
+    trimmer(NULL),
+    nOtherIndices(0)
 {
 }
 
@@ -83,18 +531,24 @@ void AlignerContext::runAlignment(int argc, const char **argv, const char *versi
 #endif
 	
 	if (!initialize()) {
+        releaseIndex();
 		return;
 	}
     extension->initialize();
     
     if (! extension->skipAlignment()) {
+        ReportVectorKernels();
         WriteStatusMessage("Aligning.\n");
 
-        beginIteration();
+        if (options->checkpointPieces > 1) {
+            runCheckpointedAlignment();
+        } else {
+            beginIteration();
 
-        runTask();
+            runTask();
             
-        finishIteration();
+            finishIteration();
+        }
 
         printStats();
 
@@ -102,8 +556,9 @@ void AlignerContext::runAlignment(int argc, const char **argv, const char *versi
     }
 
     extension->finishAlignment();
+    releaseIndex();
     PrintBigAllocProfile();
-    PrintWaitProfile();
+    PrintWaitProfile(options->waitProfile);
 }
 
     void
@@ -112,21 +567,47 @@ AlignerContext::initializeThread()
     stats = newStats(); // separate copy per thread
     stats->extra = extension->extraStats();
     readWriter = writerSupplier != NULL ? writerSupplier->getWriter() : NULL;
+    for (int i = 0; i < nOtherIndices; i++) {
+        otherReadWriters[i] = otherWriterSuppliers[i]->getWriter();
+    }
     extension = extension->copy();
 }
 
     void
 AlignerContext::runThread()
 {
+    if (NULL != cachedIndex && NULL != cachedIndex->numaReplicas) {
+        //
+        // Use the copy of the index on the node we're running on.  Unless we're bound to a processor (the default, but not
+        // with --b) the scheduler can move us to another node later, so this is only a good guess then.
+        //
+        index = cachedIndex->numaReplicas[GetNumaNodeOfCurrentThread() % cachedIndex->nNumaReplicas];
+    }
+
     extension->beginThread();
     runIterationThread();
     if (readWriter != NULL) {
         readWriter->close();
         delete readWriter;
     }
+    for (int i = 0; i < nOtherIndices; i++) {
+        otherReadWriters[i]->close();
+        delete otherReadWriters[i];
+    }
     extension->finishThread();
 }
     
+    void
+AlignerContext::beginInputUnit(_int64 unit)
+{
+    if (readWriter != NULL) {
+        readWriter->beginInputUnit(unit);
+    }
+    for (int i = 0; i < nOtherIndices; i++) {
+        otherReadWriters[i]->beginInputUnit(unit);
+    }
+}
+
     void
 AlignerContext::finishThread(AlignerContext* common)
 {
@@ -140,33 +621,21 @@ AlignerContext::finishThread(AlignerContext* common)
     bool
 AlignerContext::initialize()
 {
-    if (g_indexDirectory == NULL || strcmp(g_indexDirectory, options->indexDir) != 0) {
-        delete g_index;
-        g_index = NULL;
-        delete g_indexDirectory;
-        g_indexDirectory = new char [strlen(options->indexDir) + 1];
-        strcpy(g_indexDirectory, options->indexDir);
-
-        if (strcmp(options->indexDir, "-") != 0) {
-            WriteStatusMessage("Loading index from directory... ");
- 
-            fflush(stdout);
-            _int64 loadStart = timeInMillis();
-            index = GenomeIndex::loadFromDirectory((char*) options->indexDir, options->mapIndex, options->prefetchIndex);
-            if (index == NULL) {
-                WriteErrorMessage("Index load failed, aborting.\n");
-				return false;
-            }
-            g_index = index;
-
-            _int64 loadTime = timeInMillis() - loadStart;
-             WriteStatusMessage("%llds.  %u bases, seed size %d\n",
-                    loadTime / 1000, index->getGenome()->getCountOfBases(), index->getSeedLength());
-         } else {
-            WriteStatusMessage("no alignment, input/output only\n");
+    _ASSERT(NULL == cachedIndex);
+    PlanResources(options);
+    if (strcmp(options->indexDir, "-") != 0) {
+        StartInputReadahead(options);
+        cachedIndex = AcquireIndex(options);
+        if (NULL == cachedIndex) {
+            return false;
+        }
+        index = cachedIndex->index;
+        if (options->autotuneLoss >= 0) {
+            AutotuneAlignerOptions(index, options, isPaired());
         }
     } else {
-        index = g_index;
+        WriteStatusMessage("no alignment, input/output only\n");
+        index = NULL;
     }
 
     maxHits_ = options->maxHits;
@@ -190,6 +659,49 @@ AlignerContext::initialize()
 		return false;
 	}
 
+    if (options->discardOutput && (UnknownFileType == options->outputFile.fileType || options->sortOutput || options->splitOutput)) {
+        WriteErrorMessage("-discardOutput needs an output file (-o) that isn't sorted or split\n");
+        return false;
+    }
+
+    if (0 != options->nOtherIndices) {
+        //
+        // The other indices' alignments aren't cached, reused or checkpointed, and -long and -kmerFilter don't align
+        // the usual way.
+        //
+        if (NULL == index || UnknownFileType == options->outputFile.fileType || options->splitOutput || options->discardOutput ||
+            options->checkpointPieces > 1 || options->longReads || options->kmerFilterSeeds > 0 || 0 != options->dupCacheSize || 0 != options->reuseMinMAPQ) {
+            WriteErrorMessage("-otherIndex needs an index and an output file (-o), and doesn't work with -split, -discardOutput, -ckpt, -long, -kmerFilter, -dupCache or -reuse\n");
+            return false;
+        }
+
+        //
+        // They're loaded just as the main index is, from the cache if they're there, but for the whole genome.
+        //
+        const char *indexDir = options->indexDir;
+        const char *restrictToContigs = options->restrictToContigs;
+        options->restrictToContigs = NULL;
+        for (nOtherIndices = 0; nOtherIndices < options->nOtherIndices; nOtherIndices++) {
+            options->indexDir = options->otherIndexDirs[nOtherIndices];
+            otherCachedIndices[nOtherIndices] = AcquireIndex(options);
+            if (NULL == otherCachedIndices[nOtherIndices]) {
+                break;
+            }
+            otherIndices[nOtherIndices] = otherCachedIndices[nOtherIndices]->index;
+            if ((int)minReadLength < otherIndices[nOtherIndices]->getSeedLength()) {
+                WriteErrorMessage("The min read length (%d) must be at least the seed length of -otherIndex '%s' (%d)\n", minReadLength, options->indexDir,
+                    otherIndices[nOtherIndices]->getSeedLength());
+                ReleaseIndex(otherCachedIndices[nOtherIndices]);
+                break;
+            }
+        }
+        options->indexDir = indexDir;
+        options->restrictToContigs = restrictToContigs;
+        if (nOtherIndices < options->nOtherIndices) {
+            return false;
+        }
+    }
+
     if (options->perfFileName != NULL) {
         perfFile = fopen(options->perfFileName,"a");
         if (NULL == perfFile) {
@@ -199,10 +711,31 @@ AlignerContext::initialize()
     }
 
     DataSupplier::ThreadCount = options->numThreads;
+    ReserveHelperProcessors(options->helperProcessors);
+
+    if (AlignerContextsRunConcurrently) {
+        options->bindToProcessors = false;
+    }
 
     return true;
 }
 
+    void
+AlignerContext::releaseIndex()
+{
+    if (NULL != cachedIndex) {
+        ReleaseIndex(cachedIndex);
+        cachedIndex = NULL;
+        index = NULL;
+    }
+
+    for (int i = 0; i < nOtherIndices; i++) {
+        ReleaseIndex(otherCachedIndices[i]);
+        otherIndices[i] = NULL;
+    }
+    nOtherIndices = 0;
+}
+
 
     void
 AlignerContext::beginIteration()
@@ -222,24 +755,83 @@ AlignerContext::beginIteration()
     }
     stats = newStats();
     stats->extra = extension->extraStats();
+    ResetStageTimes();
+    if (!EnableHardwareCounters(options->hardwareCounters)) {
+        soft_exit(1);
+    }
+    if (NULL != options->traceFileName) {
+        StartPipelineTrace();
+    }
     extension->beginIteration();
+
+    //
+    // A mapped index lives in the page cache, where streaming through the input and output would push it out.
+    //
+    DataSupplier::DropBehind = AsyncFile::DropBehind = options->mapIndex || options->sharedMemoryIndex || options->outOfCoreIndex;
+    AsyncFile::DiscardWritesTo = options->discardOutput ? options->outputFile.fileName : NULL;
+    AsyncFile::DiscardedBytes = 0;
     
     memset(&readerContext, 0, sizeof(readerContext));
     readerContext.clipping = options->clipping;
+    readerContext.preserveClipping = options->preserveClipping;
+    readerContext.binQualities = options->binQualities;
+    readerContext.omitQualities = options->omitQualities;
+    readerContext.dropAuxData = options->dropAuxData;
+    readerContext.compressionLevel = BAMFile == options->outputFile.fileType ? options->compressionLevel : -1;
     readerContext.defaultReadGroup = options->defaultReadGroup;
     readerContext.genome = index != NULL ? index->getGenome() : NULL;
+    readerContext.junctions = index != NULL ? index->getSpliceJunctions() : NULL;
     readerContext.ignoreSecondaryAlignments = options->ignoreSecondaryAlignments;
     readerContext.ignoreSupplementaryAlignments = options->ignoreSecondaryAlignments;   // Maybe we should split them out
+    readerContext.inputPart = options->inputPart;
+    readerContext.nInputParts = options->nInputParts;
+    readerContext.region = options->inputRegion;
+    readerContext.unmappedOnly = options->unmappedOnly;
+    readerContext.inputOrder = options->inputOrder;
+    if (NULL != options->trimAdapter || 0 != options->trimQuality) {
+        trimmer = new ReadTrimmer(options->trimAdapter, options->trimQuality, options->trimWindow);
+        readerContext.trimmer = trimmer;
+    }
     DataSupplier::ExpansionFactor = options->expansionFactor;
+    if (options->ioUringQueueDepth > 0 && ! (DataSupplier::UseIoUring(options->ioUringQueueDepth) && AsyncFile::UseIoUring())) {
+        WriteErrorMessage("Warning: io_uring isn't available, so -iou is ignored\n");
+        options->ioUringQueueDepth = 0;
+    }
+    PairedReadReader::SpillUnpairedReads((size_t)options->matcherMemory * 1024 * 1024, options->outputFile.fileName);
+
+    //
+    // Before the readers start, so that it sees all of their work.
+    //
+    if (NULL != options->metricsFileName) {
+        progress = ProgressReporter::start(options->metricsFileName, options->metricsInterval, options->numThreads);  // Goes on without it if it can't
+    }
+    if (NULL != options->slowReadsFileName) {
+        slowReads = new SlowReadCollector(options->slowReadsFileName, options->nSlowReads, options->numThreads);
+    }
+    if (0 != options->dupCacheSize) {
+        alignmentCache = new AlignmentCache(options->dupCacheSize);
+    }
 
     typeSpecificBeginIteration();
 
+    if (0 != options->reuseMinMAPQ && NULL != readerContext.genome) {
+        if (! readerContext.headerMatchesIndex) {
+            WriteErrorMessage("Warning: -reuse needs SAM or BAM input aligned to the same reference as the index, so every read will be aligned\n");
+        } else if (maxSecondaryAlignmentAdditionalEditDistance >= 0) {
+            WriteErrorMessage("Warning: -reuse doesn't work with secondary alignments, so every read will be aligned\n");
+        } else {
+            originalAlignments = new OriginalAlignmentVerifier(readerContext.genome, options->reuseMinMAPQ);
+        }
+    }
+
     if (UnknownFileType != options->outputFile.fileType) {
         const FileFormat* format;
         if (SAMFile == options->outputFile.fileType) {
             format = FileFormat::SAM[options->useM];
         } else if (BAMFile == options->outputFile.fileType) {
             format = FileFormat::BAM[options->useM];
+        } else if (CRAMFile == options->outputFile.fileType) {
+            format = FileFormat::CRAM[options->useM];
         } else {
             //
             // This shouldn't happen, because the command line parser should catch it.  Perhaps you've added a new output file format and just
@@ -250,11 +842,32 @@ AlignerContext::beginIteration()
         }
         format->setupReaderContext(options, &readerContext);
 
-        writerSupplier = format->getWriterSupplier(options, readerContext.genome);
+        writerSupplier = options->splitOutput ? ReadWriterSupplier::createSplit(format, options, readerContext.genome) :
+            format->getWriterSupplier(options, readerContext.genome);
         ReadWriter* headerWriter = writerSupplier->getWriter();
-        headerWriter->writeHeader(readerContext, options->sortOutput, argc, argv, version, options->rgLineContents, options->outputFile.omitSQLines);
+        headerWriter->writeHeader(readerContext, ! options->sortOutput ? Unsorted : options->sortByName ? SortedByName : SortedByLocation, argc, argv, version, options->rgLineContents, options->outputFile.omitSQLines);
         headerWriter->close();
         delete headerWriter;
+
+        //
+        // Each -otherIndex output is written like -o, but for its own genome.  As with -split, the formats make their
+        // writers for options->outputFile.fileName, so point it at the other file while they do.
+        //
+        const char *outputFileName = options->outputFile.fileName;
+        for (int i = 0; i < nOtherIndices; i++) {
+            otherReaderContexts[i] = readerContext;
+            otherReaderContexts[i].genome = otherIndices[i]->getGenome();
+            otherReaderContexts[i].junctions = otherIndices[i]->getSpliceJunctions();
+            otherReaderContexts[i].headerMatchesIndex = false;
+
+            options->outputFile.fileName = options->otherOutputFileNames[i];
+            otherWriterSuppliers[i] = format->getWriterSupplier(options, otherReaderContexts[i].genome);
+            headerWriter = otherWriterSuppliers[i]->getWriter();
+            headerWriter->writeHeader(otherReaderContexts[i], ! options->sortOutput ? Unsorted : options->sortByName ? SortedByName : SortedByLocation, argc, argv, version, options->rgLineContents, options->outputFile.omitSQLines);
+            headerWriter->close();
+            delete headerWriter;
+        }
+        options->outputFile.fileName = outputFileName;
     }
 }
 
@@ -269,6 +882,37 @@ AlignerContext::finishIteration()
         writerSupplier = NULL;
     }
 
+    for (int i = 0; i < nOtherIndices; i++) {
+        otherWriterSuppliers[i]->close();
+        delete otherWriterSuppliers[i];
+        otherWriterSuppliers[i] = NULL;
+    }
+
+    if (NULL != options->traceFileName) {
+        WritePipelineTrace(options->traceFileName);
+    }
+
+    if (NULL != progress) {
+        progress->stop();
+        delete progress;
+        progress = NULL;
+    }
+
+    if (NULL != slowReads) {
+        slowReads->write();
+        delete slowReads;
+        slowReads = NULL;
+    }
+
+    delete alignmentCache;
+    alignmentCache = NULL;
+
+    delete originalAlignments;
+    originalAlignments = NULL;
+
+    delete trimmer;
+    trimmer = NULL;
+
     alignTime = /*timeInMillis() - alignStart -- use the time from ParallelTask.h, that may exclude memory allocation time*/ time;
 }
 
@@ -282,6 +926,134 @@ AlignerContext::nextIteration()
     return false;
 }
 
+static const _uint64 CheckpointMagic = 0x54504b4350414e53;    // "SNAPCKPT" as little endian bytes
+static const _uint64 CheckpointVersion = 1;
+
+//
+// out.bam becomes out.ckpt3.bam (with extension ".bam") or out.ckpt3.done (with ".done").
+//
+    static char *
+CheckpointFileName(const char *outputFileName, int piece, const char *extension)
+{
+    const char *baseName = strrchr(outputFileName, PATH_SEP);
+    const char *outputExtension = strrchr(NULL == baseName ? outputFileName : baseName, '.');
+    size_t prefixLength = NULL == outputExtension ? strlen(outputFileName) : outputExtension - outputFileName;
+    size_t size = prefixLength + strlen(extension) + 32;
+    char *fileName = new char[size];
+    snprintf(fileName, size, "%.*s.ckpt%d%s", (int)prefixLength, outputFileName, piece, extension);
+    return fileName;
+}
+
+    void
+AlignerContext::runCheckpointedAlignment()
+/*++
+
+Routine Description:
+
+    -ckpt: align the input as options->checkpointPieces -inputPart pieces, one after another, each into a sorted BAM file
+    of its own.  Once a piece's output is complete its statistics and alignment time go into a .done file (written under
+    another name and renamed, so it's there all or not at all), and a rerun skips the pieces that have one.  So an
+    interrupted run loses at most the piece it was on.  The pieces don't get duplicate marking, an index or metrics, since
+    the merge at the end does those.
+
+--*/
+{
+    const char *outputFileName = options->outputFile.fileName;
+    bool noIndex = options->noIndex;
+    bool nameIndex = options->nameIndex;
+    bool noDuplicateMarking = options->noDuplicateMarking;
+    const char *alignmentMetricsFile = options->alignmentMetricsFile;
+    int nPieces = options->checkpointPieces;
+
+    AlignerStats *totalStats = newStats();
+    _int64 totalAlignTime = 0;
+    char **pieceFileNames = new char *[nPieces];
+
+    for (int piece = 0; piece < nPieces; piece++) {
+        pieceFileNames[piece] = CheckpointFileName(outputFileName, piece, ".bam");
+        char *doneFileName = CheckpointFileName(outputFileName, piece, ".done");
+
+        FILE *doneFile = fopen(doneFileName, "rb");
+        if (NULL != doneFile) {
+            _uint64 header[4];
+            AlignerStats *pieceStats = newStats();
+            bool loaded = 1 == fread(header, sizeof(header), 1, doneFile) && CheckpointMagic == header[0] && CheckpointVersion == header[1] &&
+                (_uint64)isPaired() == header[2] && pieceStats->load(doneFile);
+            fclose(doneFile);
+            if (loaded) {
+                WriteStatusMessage("Piece %d of %d was aligned by an earlier run, skipping it\n", piece, nPieces);
+                totalStats->add(pieceStats);
+                totalAlignTime += (_int64)header[3];
+                delete pieceStats;
+                delete[] doneFileName;
+                continue;
+            }
+            WriteErrorMessage("%s isn't a -ckpt statistics file from this kind of alignment; aligning piece %d again\n", doneFileName, piece);
+            delete pieceStats;
+        }
+
+        WriteStatusMessage("Aligning piece %d of %d into %s\n", piece, nPieces, pieceFileNames[piece]);
+        options->outputFile.fileName = pieceFileNames[piece];
+        options->inputPart = piece;
+        options->nInputParts = nPieces;
+        options->noIndex = options->noDuplicateMarking = true;
+        options->nameIndex = false;
+        options->alignmentMetricsFile = NULL;
+
+        beginIteration();
+        runTask();
+        finishIteration();
+        typeSpecificNextIteration();
+
+        size_t tempNameSize = strlen(doneFileName) + 5;
+        char *tempDoneFileName = new char[tempNameSize];
+        snprintf(tempDoneFileName, tempNameSize, "%s.tmp", doneFileName);
+        doneFile = fopen(tempDoneFileName, "wb");
+        _uint64 header[4] = {CheckpointMagic, CheckpointVersion, (_uint64)isPaired(), (_uint64)alignTime};
+        bool saved = NULL != doneFile && 1 == fwrite(header, sizeof(header), 1, doneFile) && stats->save(doneFile);
+        saved = NULL != doneFile && 0 == fclose(doneFile) && saved;
+        if (!saved || !MoveSingleFile(tempDoneFileName, doneFileName)) {
+            //
+            // The piece is still done, there's just no record of it, so an interrupted run would align it again.
+            //
+            WriteErrorMessage("Warning: unable to write %s\n", doneFileName);
+        }
+        delete[] tempDoneFileName;
+        delete[] doneFileName;
+
+        totalStats->add(stats);
+        totalAlignTime += alignTime;
+    }
+
+    options->outputFile.fileName = outputFileName;
+    options->inputPart = options->nInputParts = 0;
+    options->noIndex = noIndex;
+    options->nameIndex = nameIndex;
+    options->noDuplicateMarking = noDuplicateMarking;
+    options->alignmentMetricsFile = alignmentMetricsFile;
+
+    WriteStatusMessage("Merging the %d pieces into %s\n", nPieces, outputFileName);
+    if (!MergeSortedBAMFiles(options, index->getGenome(), nPieces, (const char **)pieceFileNames)) {
+        WriteErrorMessage("Merging into %s failed; the pieces are left in %s and so on, and running again will retry the merge\n",
+            outputFileName, pieceFileNames[0]);
+        soft_exit(1);
+    }
+
+    for (int piece = 0; piece < nPieces; piece++) {
+        char *doneFileName = CheckpointFileName(outputFileName, piece, ".done");
+        if (!DeleteSingleFile(pieceFileNames[piece]) || !DeleteSingleFile(doneFileName)) {
+            WriteErrorMessage("Warning: unable to delete %s or %s\n", pieceFileNames[piece], doneFileName);
+        }
+        delete[] doneFileName;
+        delete[] pieceFileNames[piece];
+    }
+    delete[] pieceFileNames;
+
+    delete stats;
+    stats = totalStats;
+    alignTime = totalAlignTime;
+}
+
 extern char *FormatUIntWithCommas(_uint64 val, char *outputBuffer, size_t outputBufferSize);	// Relying on the one in Util.h results in an "internal compiler error" for Visual Studio.
 
 //
@@ -380,6 +1152,59 @@ AlignerContext::printStats()
 		FormatUIntWithCommas((alignTime + 500) / 1000, alignTimeString, strBufLen)
 		);
 
+    if (stats->exactMatchFastPathHits > 0) {
+        WriteStatusMessage("%s reads (%0.2f%%) were exact matches aligned without a full search\n",
+            FormatUIntWithCommas(stats->exactMatchFastPathHits, numReads, strBufLen), 100.0 * stats->exactMatchFastPathHits / max(stats->totalReads, (_int64)1));
+    }
+
+    if (stats->truncatedAlignments > 0) {
+        WriteStatusMessage("%s reads (%0.2f%%) ran out of -workBudget and got the best alignment found by then\n",
+            FormatUIntWithCommas(stats->truncatedAlignments, numReads, strBufLen), 100.0 * stats->truncatedAlignments / max(stats->totalReads, (_int64)1));
+    }
+
+    if (stats->lowQualitySeedsSkipped > 0) {
+        WriteStatusMessage("%s seeds (%0.2f per read) were moved off low quality bases by -sq\n",
+            FormatUIntWithCommas(stats->lowQualitySeedsSkipped, numReads, strBufLen), (double)stats->lowQualitySeedsSkipped / max(stats->totalReads, (_int64)1));
+    }
+
+    if (stats->readsGivenUp > 0) {
+        WriteStatusMessage("%s reads (%0.2f%%) were given up on by -giveUp when their first seeds had no usable hits\n",
+            FormatUIntWithCommas(stats->readsGivenUp, numReads, strBufLen), 100.0 * stats->readsGivenUp / max(stats->totalReads, (_int64)1));
+    }
+
+    if (options->kmerFilterSeeds > 0) {
+        WriteStatusMessage("(-kmerFilter: reads with %d of their first %d seeds in the index are counted as aligned with MAPQ < 10, the rest as unaligned)\n",
+            options->kmerFilterHits, options->kmerFilterSeeds);
+    }
+
+    if (stats->reusedAlignments > 0) {
+        WriteStatusMessage("%s reads (%0.2f%%) kept their input alignment (-reuse)\n",
+            FormatUIntWithCommas(stats->reusedAlignments, numReads, strBufLen), 100.0 * stats->reusedAlignments / max(stats->totalReads, (_int64)1));
+    }
+
+    for (int i = 0; i < nOtherIndices; i++) {
+        WriteStatusMessage("%s reads (%0.2f%%) aligned better to -otherIndex %s and went to %s\n",
+            FormatUIntWithCommas(stats->readsToOtherIndices[i], numReads, strBufLen), 100.0 * stats->readsToOtherIndices[i] / max(stats->totalReads, (_int64)1),
+            options->otherIndexDirs[i], options->otherOutputFileNames[i]);
+    }
+
+    if (stats->cachedAlignments > 0) {
+        WriteStatusMessage("%s reads (%0.2f%%) were duplicates that got their alignment from -dupCache\n",
+            FormatUIntWithCommas(stats->cachedAlignments, numReads, strBufLen), 100.0 * stats->cachedAlignments / max(stats->totalReads, (_int64)1));
+    }
+
+    if (stats->alignerMemoryTouched > 0) {
+        char touched[strBufLen], maxTouched[strBufLen];
+        WriteStatusMessage("Aligner memory touched: %s bytes in all threads, at most %s in one (see the reserved and used above)\n",
+            FormatUIntWithCommas(stats->alignerMemoryTouched, touched, strBufLen), FormatUIntWithCommas(stats->maxAlignerMemoryTouched, maxTouched, strBufLen));
+    }
+
+    if (options->discardOutput) {
+        char discarded[strBufLen];
+        WriteStatusMessage("Output discarded: %s bytes, %.1f MB/s\n", FormatUIntWithCommas(AsyncFile::DiscardedBytes, discarded, strBufLen),
+            (double)AsyncFile::DiscardedBytes / (1 << 20) * 1000 / max(alignTime, (_int64)1));
+    }
+
     if (NULL != perfFile) {
         fprintf(perfFile, "%d\t%d\t%0.2f%%\t%0.2f%%\t%0.2f%%\t%0.2f%%\t%0.2f%%\t%lld\t%lld\tt%.0f\n",
                 maxHits_, maxDist_, 
@@ -403,6 +1228,9 @@ AlignerContext::printStats()
     }
 #endif // TIME_HISTOGRAM
 
+#if STAGE_TIMING
+    PrintStageTimes(stats->totalReads);
+#endif // STAGE_TIMING
 
     stats->printHistograms(stdout);
 
@@ -472,12 +1300,6 @@ AlignerContext::parseOptions(
         SNAPFile input;
         if (SNAPFile::generateFromCommandLine(argv+i, argc-i, &argsConsumed, &input, paired, true)) {
             if (input.isStdio) {
-				if (CommandPipe != NULL) {
-					WriteErrorMessage("You may not use stdin/stdout in daemon mode\n");
-					delete options;
-					return NULL;
-				}
-
                 if (inputFromStdio) {
                     WriteErrorMessage("You specified stdin ('-') specified for more than one input, which isn't permitted.\n");
 					delete options;
@@ -531,6 +1353,65 @@ AlignerContext::parseOptions(
 		return NULL;
     }
 
+    if (options->kmerFilterSeeds > 0 && options->kmerFilterHits > options->kmerFilterSeeds) {
+        WriteErrorMessage("-kmerFilterHits (%d) can't be more than the number of seeds -kmerFilter looks up (%d)\n", options->kmerFilterHits, options->kmerFilterSeeds);
+		delete options;
+		return NULL;
+    }
+
+    if (options->splitOutput && (UnknownFileType == options->outputFile.fileType || AlignerOptions::outputToStdout)) {
+        WriteErrorMessage("-split needs an output file (-o) to name its files after, and not stdout\n");
+		delete options;
+		return NULL;
+    }
+
+    if (options->sortShards > 1 && (! options->sortOutput || AlignerOptions::outputToStdout ||
+            (BAMFile != options->outputFile.fileType && SAMFile != options->outputFile.fileType))) {
+        WriteErrorMessage("-shards needs sorted (-so) BAM or SAM output to a file\n");
+		delete options;
+		return NULL;
+    }
+
+    if (options->sortByName && ((BAMFile != options->outputFile.fileType && SAMFile != options->outputFile.fileType) || options->checkpointPieces > 1)) {
+        WriteErrorMessage("-son needs SAM or BAM output, and doesn't go with -ckpt\n");
+		delete options;
+		return NULL;
+    }
+
+    if ((NULL != options->alignmentMetricsFile && (! options->sortOutput || BAMFile != options->outputFile.fileType)) ||
+            (options->coverageBinSize > 0 && NULL == options->alignmentMetricsFile)) {
+        WriteErrorMessage("-alnMetrics needs sorted BAM output (-so or -son), and -mbin needs -alnMetrics\n");
+		delete options;
+		return NULL;
+    }
+
+    if (options->checkpointPieces > 1 && (! options->sortOutput || AlignerOptions::outputToStdout || BAMFile != options->outputFile.fileType ||
+            options->nInputParts > 1 || options->sortShards > 1 || options->splitOutput)) {
+        WriteErrorMessage("-ckpt needs sorted (-so) BAM output to a file, and doesn't go with -inputPart, -shards or -split\n");
+		delete options;
+		return NULL;
+    }
+
+    if (options->inputOrder && (options->sortOutput || options->splitOutput || 0 != options->umiField || 0 != options->readLookahead ||
+            options->checkpointPieces > 1 || nInputs > 1)) {
+        WriteErrorMessage("-inputOrder is for unsorted output from a single input, and doesn't go with -so, -son, -split, -umi, -la or -ckpt\n");
+		delete options;
+		return NULL;
+    }
+
+    if (options->nameIndex && (! options->sortOutput || AlignerOptions::outputToStdout || BAMFile != options->outputFile.fileType ||
+            options->splitOutput)) {
+        WriteErrorMessage("-nameIndex needs sorted (-so or -son) BAM output to a file, and doesn't go with -split (ExtractReads -index indexes other BAM files)\n");
+		delete options;
+		return NULL;
+    }
+
+    if (options->evenShards && options->sortShards <= 1) {
+        WriteErrorMessage("-evenShards goes with -shards\n");
+		delete options;
+		return NULL;
+    }
+
     options->nInputs = nInputs;
     options->inputs = new SNAPFile[nInputs];
     for (int j = nInputs - 1; j >= 0; j --) {
@@ -543,6 +1424,24 @@ AlignerContext::parseOptions(
     }
     _ASSERT(NULL == inputList);
 
+    for (int j = 0; j < nInputs && (NULL != options->inputRegion || options->unmappedOnly); j++) {
+        if (BAMFile != options->inputs[j].fileType || options->inputs[j].isStdio) {
+            WriteErrorMessage("%s needs BAM input files, with .bai indices, and '%s' isn't one\n",
+                NULL != options->inputRegion ? "-region" : "-unmappedOnly", options->inputs[j].fileName);
+            delete options;
+            return NULL;
+        }
+    }
+
+    for (int j = 0; j < nInputs && (options->nInputParts > 1 || options->checkpointPieces > 1); j++) {
+        if (! options->inputs[j].canReadInParts(paired)) {
+            WriteErrorMessage("%s can't split '%s': it needs uncompressed or BGZF FASTQ (paired files the same size or with -fqidx), or single-end SAM\n",
+                options->checkpointPieces > 1 ? "-ckpt" : "-inputPart", options->inputs[j].fileName);
+            delete options;
+            return NULL;
+        }
+    }
+
     *argsConsumed = i;
     return options;
 }
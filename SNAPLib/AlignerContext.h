@@ -30,14 +30,46 @@ Revision History:
 #include "AlignerStats.h"
 #include "ParallelTask.h"
 #include "GenomeIndex.h"
+#include "ProgressReport.h"
+#include "SlowReads.h"
+#include "AlignmentCache.h"
+#include "OriginalAlignment.h"
+#include "ReadTrimmer.h"
 
 class AlignerExtension;
+struct CachedIndex;
+
+//
+// How many loaded indices to keep for later commands (chained with ',' or sent to a daemon) to use.  An index that
+// a command is using is never dropped, so there can be more than this while several commands run at once.
+//
+extern unsigned IndexCacheSize;
+
+//
+// How many bytes of memory the loaded indices may take, or 0 for no limit.  Indices that aren't in use are dropped,
+// least recently used first, to stay under it.  A mapped index counts at its mapped size.
+//
+extern _int64 IndexCacheMemoryBudget;
+
+//
+// Load the indices listed in a config file into the cache, ahead of the commands that will use them.  Each line is an
+// index directory followed by any of the align options about loading it (-map, -pre, -numa, -numaReplicate, -shm,
+// -packGenome, -contigs); blank lines and anything after a # are ignored.  The cache keeps at least as many indices
+// as the file lists, memory budget permitting.  Returns false if any of them couldn't be loaded.
+//
+bool PreloadIndices(const char *configFileName);
+
+//
+// Set by a daemon that runs more than one command at once, so that they don't all bind their threads to the same
+// processors.
+//
+extern bool AlignerContextsRunConcurrently;
 
 
 /*++
     Common context state shared across threads during alignment process
 --*/
-class AlignerContext : public TaskContextBase
+class AlignerContext : public TaskContextBase, public InputUnitListener
 {
 public:
 
@@ -57,6 +89,9 @@ public:
 
     void finishThread(AlignerContext* common);
 
+    // -inputOrder: the thread's supplier has moved on to another input unit, so its writers do too
+    virtual void beginInputUnit(_int64 unit);
+
     void printStats();
     
     void beginIteration();
@@ -65,6 +100,9 @@ public:
     
     // advance to next iteration in range, return false when past end
     bool nextIteration();
+
+    // -ckpt: begin, run and finish an iteration for each piece of the input that isn't already done, then merge them
+    void runCheckpointedAlignment();
     
     // overrideable by concrete single/paired alignment subclasses
     
@@ -74,6 +112,9 @@ public:
     // initialize from options
     virtual bool initialize();
 
+    // let go of the index, which stays in the cache for later commands
+    void releaseIndex();
+
     // new stats object
     virtual AlignerStats* newStats() = 0;
     
@@ -92,6 +133,7 @@ public:
  
     // common state across all threads
     GenomeIndex                         *index;
+    CachedIndex                         *cachedIndex;       // where index came from, or NULL if there isn't one
     ReadWriterSupplier                  *writerSupplier;
     ReaderContext                        readerContext;
     _int64                               alignStart;
@@ -111,6 +153,16 @@ public:
     const char                         **argv;
     const char                          *version;
     FILE                                *perfFile;
+    ProgressReporter                    *progress;          // -metrics, or NULL
+    SlowReadCollector                   *slowReads;         // -slowReads, or NULL
+    AlignmentCache                      *alignmentCache;    // -dupCache, or NULL
+    OriginalAlignmentVerifier           *originalAlignments; // -reuse with input that matches the index, or NULL
+    ReadTrimmer                         *trimmer;           // -trimAdapter and -trimQuality, or NULL
+    int                                  nOtherIndices;     // -otherIndex: the other indices each read is aligned against
+    GenomeIndex                         *otherIndices[MAX_OTHER_INDICES];
+    CachedIndex                         *otherCachedIndices[MAX_OTHER_INDICES];
+    ReadWriterSupplier                  *otherWriterSuppliers[MAX_OTHER_INDICES];
+    ReaderContext                        otherReaderContexts[MAX_OTHER_INDICES];  // readerContext, with the other genome
     bool                                 noUkkonen;
     bool                                 noOrderedEvaluation;
 	bool								 noTruncation;
@@ -126,6 +178,7 @@ public:
 
     // Per-thread context state used during alignment process
     ReadWriter         *readWriter;
+    ReadWriter         *otherReadWriters[MAX_OTHER_INDICES];
 };
 
 // abstract class for extending base context
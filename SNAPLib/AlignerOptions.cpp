@@ -28,10 +28,13 @@ Revision History:
 #include "FASTQ.h"
 #include "SAM.h"
 #include "Bam.h"
+#include "Cram.h"
+#include "ReadPack.h"
 #include "exit.h"
 #include "Error.h"
 #include "BaseAligner.h"
 #include "CommandProcessor.h"
+#include "LookaheadReadSupplier.h"
 
 AlignerOptions::AlignerOptions(
     const char* i_commandLine,
@@ -41,22 +44,74 @@ AlignerOptions::AlignerOptions(
     indexDir(NULL),
     similarityMapFile(NULL),
     numThreads(GetNumberOfProcessors()),
+    numThreadsGiven(false),
     bindToProcessors(true),
+    helperProcessors(0),
     ignoreMismatchedIDs(false),
     clipping(ClipBack),
     sortOutput(false),
+    sortByName(false),
+    inputOrder(false),
     noIndex(false),
     noDuplicateMarking(false),
     noQualityCalibration(false),
     sortMemory(0),
+    sortInMemory(0),
+    sortTempDirectories(NULL),
+    sortMergeThreads(1),
+    sortShards(0),
+    evenShards(false),
+    sortTempZstd(false),
+    duplicateMetricsFile(NULL),
+    alignmentMetricsFile(NULL),
+    coverageBinSize(0),
+    csiIndex(false),
+    nameIndex(false),
+    compressionLevel(-1),
     filterFlags(0),
     explorePopularSeeds(false),
     stopOnFirstHit(false),
+    adaptiveSeeding(false),
+    minSeedQuality(0),
+    maxSeedsWithoutHits(0),
+    noExactMatchFastPath(false),
+    longReads(false),
+    longReadHelpers(3),
+    readLookahead(0),
+    memoryReport(false),
+    waitProfile(false),
+    hardwareCounters(false),
+    discardOutput(false),
+    autotuneLoss(-1),
+    autotuneReads(20000),
 	useM(true),
     gapPenalty(0),
 	extra(NULL),
     rgLineContents("@RG\tID:FASTQ\tPL:Illumina\tPU:pu\tLB:lb\tSM:sm"),
     perfFileName(NULL),
+    metricsFileName(NULL),
+    metricsInterval(10),
+    slowReadsFileName(NULL),
+    traceFileName(NULL),
+    nSlowReads(100),
+    workBudget(0),
+    dupCacheSize(0),
+    reuseMinMAPQ(0),
+    kmerFilterSeeds(0),
+    kmerFilterHits(2),
+    trimAdapter(NULL),
+    trimQuality(0),
+    trimWindow(4),
+    umiField(0),
+    umiPrefix(8),
+    splitOutput(false),
+    splitNameField(0),
+    nOtherIndices(0),
+    inputPart(0),
+    nInputParts(0),
+    inputRegion(NULL),
+    unmappedOnly(false),
+    checkpointPieces(0),
     useTimingBarrier(false),
     extraSearchDepth(2),
     defaultReadGroup("FASTQ"),
@@ -68,15 +123,31 @@ AlignerOptions::AlignerOptions(
 	maxSecondaryAlignments(0x7fffffff),
     maxSecondaryAlignmentsPerContig(-1),    // -1 means don't limit
     preserveClipping(false),
+    binQualities(false),
+    omitQualities(false),
+    dropAuxData(false),
     expansionFactor(1.0),
+    ioUringQueueDepth(0),
+    matcherMemory(0),
     noUkkonen(false),
     noOrderedEvaluation(false),
 	noTruncation(false),
 	minReadLength(DEFAULT_MIN_READ_LENGTH),
+    longSeedMinReadLength(DEFAULT_LONG_SEED_MIN_READ_LENGTH),
     maxDistFraction(0.0),
 	mapIndex(false),
 	prefetchIndex(false),
-    writeBufferSize(16 * 1024 * 1024)
+	outOfCoreIndex(false),
+	noVerifyIndex(false),
+    inputReadaheadMB(DEFAULT_INPUT_READAHEAD_MB),
+    numaInterleaveIndex(false),
+    numaReplicateIndex(false),
+    sharedMemoryIndex(false),
+    packGenome(false),
+    restrictToContigs(NULL),
+    writeBufferSize(16 * 1024 * 1024),
+    writeBufferSizeGiven(false),
+    memoryLimit(0)
 {
     if (forPairedEnd) {
         maxDist                 = 15;
@@ -113,15 +184,52 @@ AlignerOptions::usageMessage()
         "  -sc  Seed coverage (i.e., readSize/seedSize).  Floating point.  Exclusive with -n.  (default uses -n)\n"
         "  -h   maximum hits to consider per seed (default: %d)\n"
         "  -ms  minimum seed matches per location (default: %d)\n"
-        "  -t   number of threads (default is one per core)\n"
+        "  -t   number of threads (default is one per core, or per processor of a container's CPU quota)\n"
         "  -b   bind each thread to its processor (this is the default)\n"
         " --b   Don't bind each thread to its processor (note the double dash)\n"
+        "       Bound threads get a physical core each, spread over the sockets and L3 caches, before any two share a\n"
+        "       core's SMT threads.\n"
+        "  -ioc Set aside this many processors (the last ones the aligner threads would get, so SMT siblings first) for\n"
+        "       the threads that read, decompress and compress, and keep the aligner threads off them.  Default 0, where\n"
+        "       those threads run wherever the operating system puts them.\n"
         "  -P   disables cache prefetching in the genome; may be helpful for machines\n"
         "       with small caches or lots of cores/cache\n"
         "  -so  sort output file by alignment location\n"
-        "  -sm  memory to use for sorting in Gb\n"
+        "  -son sort SAM or BAM output by read name instead, in the same pass, for tools that want each read's (or pair's)\n"
+        "       records together.  The order is by a hash of the name, so the records are grouped as samtools collate\n"
+        "       groups them (the header says GO:query) rather than in samtools sort -n order; there's no index or\n"
+        "       duplicate marking.  Takes the same sort options as -so.\n"
+        "  -inputOrder write unsorted output in the order of the input (each read's or pair's records together, as they come),\n"
+        "       for streaming into tools that want that, without sorting it.  Each thread's output waits (in its own write\n"
+        "       buffers) until the input before it has been written, so a very slow read holds up the threads after it a bit.\n"
+        "       A single input only, and not with -so, -son, -split, -umi, -la or -ckpt\n"
+        "  -sm  memory to use for sorting in Gb (may be fractional).  Default 1 per thread, or what's left of a container's\n"
+        "       memory limit (or -memLimit) once the index and the threads have theirs, if that's less\n"
+        "  -smi keep up to this many Gb of sorted output in memory rather than writing it to the temporary file; if it\n"
+        "       all fits, the only file written is the output.  Default 0\n"
+        "  -std comma separated list of directories for the temporary sort files, preferably on different devices, rather\n"
+        "       than one file next to the output\n"
+        "  -stz compress the temporary sort files with zstd (in builds with it), for less disk space and I/O at the cost of\n"
+        "       the processor time to compress and decompress them\n"
+        "  -smt merge the sorted output on this many threads, each taking a range of contigs (and compressing, indexing\n"
+        "       and marking duplicates in it for BAM; duplicates whose mates are in different ranges aren't matched up).\n"
+        "       Default 1\n"
+        "  -shards write the sorted output as this many files, out.shard00.bam and so on for -o out.bam, each a range of\n"
+        "       the genome with about as many reads as the others (and the unaligned reads in the last one), with its own\n"
+        "       header and index.  BAM or SAM only, and they're merged in parallel, so -smt doesn't apply\n"
+        "  -evenShards with -shards, make each shard an equal part of the genome rather than of the reads, so that the\n"
+        "       shards of separate runs against the same index cover the same ranges and can be merged shard by shard\n"
         "  -x   explore some hits of overly popular seeds (useful for filtering)\n"
         "  -f   stop on first match within edit distance limit (filtering mode)\n"
+        "  -as  adaptive seeding: look up a first pass of non-overlapping seeds, then spend the rest of the seeds on the\n"
+        "       parts of the read where those got the fewest hits (single only)\n"
+        "  -sq  seed quality: in the first pass of seeds over each read, move seeds off windows that have a base with quality\n"
+        "       below this (Phred, so -sq 10 skips bases that are probably wrong at least one time in ten), since those are\n"
+        "       likely to miss and waste a lookup.  Later passes still use them.  Helps with low quality tails.  Default 0 (off)\n"
+        "  -giveUp  report a read unaligned as soon as this many of the seeds in the first pass over it (which don't overlap)\n"
+        "       have all missed the index or hit more than -h places, rather than trying the rest.  Saves most of the time\n"
+        "       that adapter dimers, contamination and low complexity reads take, but loses the odd read with an error in\n"
+        "       every one of those seeds.  Default 0 (off)\n"
         "  -F   filter output (a=aligned only, s=single hit only (MAPQ >= %d), u=unaligned only, l=long enough to align (see -mrl))\n"
         "  -E   an alternate (and fully general) way to specify filter options.  Emit only these types s = single hit (MAPQ >= %d), m = multiple hit (MAPQ < %d),\n"
         "       x = not long enough to align, u = unaligned, b = filter must apply to both ends of a paired-end read.  Combine the letters after\n"
@@ -131,6 +239,16 @@ AlignerOptions::usageMessage()
         "       Even if the read itself does not.  If you specify b mode, then a read will be emitted only if it and its partner both pass the filter.\n"
         "  -S   suppress additional processing (sorted BAM output only)\n"
         "       i=index, d=duplicate marking\n"
+        "  -dmm write Picard style duplication metrics (as from MarkDuplicates) to this file when marking duplicates\n"
+        "  -alnMetrics write alignment metrics for sorted BAM output to this file as it's written: flag counts (as from\n"
+        "       samtools flagstat, but without duplicates), MAPQs, insert sizes, and reads and mean depth for each contig\n"
+        "  -mbin with -alnMetrics, also write the mean depth in bins of this many bases to the metrics file's name.bedgraph\n"
+        "  -csi write a CSI index (.csi) rather than a BAI for sorted BAM output.  SNAP does this anyway when a contig is\n"
+        "       longer than 512Mb, which BAI can't index\n"
+        "  -nameIndex also index sorted BAM output by read name, into the output file name with .rni on the end, for\n"
+        "       ExtractReads to pull reads out of it by name without reading the whole file\n"
+        "  -cl  compression level for BAM output, 0 (none, just BGZF framing) to 9 (smallest); default 6.  1 is much faster,\n"
+        "       for files that are going to be read again soon.  For .sam.zst output it's the zstd level, default 3\n"
 #if     USE_DEVTEAM_OPTIONS
         "  -I   ignore IDs that don't match in the paired-end aligner\n"
 #ifdef  _MSC_VER    // Only need this on Windows, since memory allocation is fast on Linux
@@ -142,10 +260,83 @@ AlignerOptions::usageMessage()
         "  -M   indicates that CIGAR strings in the generated SAM file should use M (alignment\n"
         "       match) rather than = and X (sequence (mis-)match).  This is the default\n"
         "  -=   use the new style CIGAR strings with = and X rather than M.  The opposite of -M\n"
-        "  -G   specify a gap penalty to use when generating CIGAR strings\n"
+        "  -G   write CIGAR strings from an affine gap alignment with this gap open penalty (6 is BWA's), rather than\n"
+        "       the one with the fewest edits; each gap base costs another 1 and a mismatch 4, and a match scores 1\n"
         "  -pf  specify the name of a file to contain the run speed\n"
+        "  -metrics Write live progress to this file while aligning: reads and bases per second, how busy each aligner\n"
+        "       thread is, how much input and output is queued and how much time goes to decompression and compression.\n"
+        "       It's Prometheus text format (for node_exporter's textfile collector) if the name ends in .prom, and JSON\n"
+        "       otherwise.  -metricsInterval sets how often it's rewritten, in seconds (default 10).\n"
+        "  -trace Record what each thread spends its time on (reading, decompressing, aligning, compressing, writing,\n"
+        "       sorting and merging) and write it to this file at the end, in the Chrome trace event format for\n"
+        "       chrome://tracing or ui.perfetto.dev, to see where the pipeline stalls.\n"
+        "  -discardOutput Format and compress the output as usual, but throw it away rather than writing it to the -o file,\n"
+        "       and say how fast it came out, to tell whether the storage is what limits the speed.  Not with -so.\n"
+        "  -autotune Before aligning, align the first -autotuneReads reads (or pairs, default 20000) of the input with a few\n"
+        "       settings of the seed count, -h, -ms and -D around the ones given, and use the fastest that loses no more than\n"
+        "       this percentage of the reads that twice the seeds and hits align with MAPQ 10 or more.  FASTQ input only.\n"
+        "  -slowReads Time every read (or pair) and write the slowest ones to this FASTQ file, slowest first, with the\n"
+        "       time and the aligner's work on each (seeds looked up, locations scored, edit distance calls and popular\n"
+        "       seeds skipped) in the read's comment.  Pairs are interleaved.  -slowReadsCount says how many (default 100).\n"
+        "       To profile them, align the file again with -t 1 (and -pairedInterleavedFastq for pairs).\n"
+        "  -workBudget Stop looking for a better alignment once this many edit distance computations have been spent on a read\n"
+        "       (or a pair), and settle for the best one found so far.  Its MAPQ is capped at 9 and it's tagged ZT:i:1.  This\n"
+        "       bounds the time a few pathological reads (satellite repeats, say) can hold up a thread.  Default 0, no limit.\n"
+        "  -dupCache Keep the alignments of up to this many reads (or pairs), and give a later read with the same bases and\n"
+        "       qualities (both mates' for pairs) a copy instead of aligning it again.  For libraries with a lot of\n"
+        "       duplication, such as amplicons.  Default 0, no cache.\n"
+        "  -reuse When realigning SAM or BAM input that was aligned to this same reference, keep the input's alignment of\n"
+        "       any read that has at least this MAPQ and matches the reference exactly where the input says it aligned\n"
+        "       (both mates, marked as properly paired, for pairs), instead of aligning it again, and realign only the rest.\n"
+        "       The reads keep the input's MAPQ.  Not used with secondary alignments (-om).  Default 0, align everything.\n"
+        "  -kmerFilter Don't align; instead look up this many of each read's non-overlapping seeds in the index and call\n"
+        "       the read aligned (with MAPQ 0 and no location) if at least -kmerFilterHits of them (default 2) are there.\n"
+        "       Many times faster than aligning, for host depletion or contamination screening with -F u (or -F a).\n"
+        "  -trimAdapter Trim FASTQ reads from where they match the start of this 3' adapter sequence (such as AGATCGGAAGAGC\n"
+        "       for Illumina TruSeq), with up to one mismatch in ten, or from where they end with a partial match of at least\n"
+        "       3 bases.  The trimmed bases are soft clipped.  This saves a separate trimming pass over the input.\n"
+        "  -trimQuality Trim bases from the end of FASTQ reads while the mean quality of the last -trimWindow of them (default\n"
+        "       4) is below this, before looking for the adapter.  Reads left shorter than -mrl stay unaligned.\n"
+        "  -umi Collapse reads (or pairs) with the same UMI and the same first -umiPrefix bases (default 8) into a consensus\n"
+        "       read before aligning, and write one record per family, tagged with its size in cD:i.  The UMI is this field\n"
+        "       of the read name, counting ':' separated fields from the end (so 1 for bcl2fastq's names).  Reads all of the\n"
+        "       input into memory first.\n"
+        "  -split Write a separate output file for each read group (-split rg) or for each value of a field of the read\n"
+        "       name (-split N, counting ':' separated fields from the end, for a barcode), named after the -o file with\n"
+        "       the read group or field before its extension (out.bam becomes out.RG1.bam).  With -so, each file gets its\n"
+        "       own sort, with -sm memory apiece.\n"
+        "  -otherIndex <index dir> <output file> Also align each read (or pair) against this index, and write it to this\n"
+        "       output (in -o's format) rather than -o if it aligns better there: found rather than not, then with fewer\n"
+        "       edits, then with a higher MAPQ.  Ties, and reads that align nowhere, go to -o.  This separates, say, graft\n"
+        "       from host or pathogen from host reads in one pass over the input.  Up to %d of them, each taking as much\n"
+        "       memory as its index.\n"
+        "  -inputPart i/N Align only the i'th (from 0) of N equal byte ranges of each input, so that N runs (say, on different\n"
+        "       machines) align it between them, each read once.  The input has to be files that SNAP reads in ranges:\n"
+        "       uncompressed or BGZF FASTQ (paired files the same size or with -fqidx indices), or single-end SAM.  See\n"
+        "       snap-aligner distribute.\n"
+        "  -region chr:begin-end Align only the records of BAM input that overlap this range (1-based and inclusive, like\n"
+        "       samtools; chr or chr:begin for the rest of the contig), reading just the parts of the file that its .bai index\n"
+        "       says they're in.  With paired input, a read whose mate is outside it is discarded as unpaired.\n"
+        "  -unmappedOnly Align only the unmapped records of BAM input (and, with paired input, their mapped mates), reading\n"
+        "       just the unplaced reads at the end of the file and the contigs that its .bai index says have unmapped reads.\n"
+        "       With -region, the unmapped records in the range.\n"
+        "  -ckpt N Align the input as N -inputPart pieces, one after another, and keep each finished piece's sorted output\n"
+        "       (out.ckpt0.bam and so on) and statistics (out.ckpt0.done), so that if the run is killed (say, a preemptible\n"
+        "       machine is reclaimed) running it again with the same arguments only aligns the pieces that weren't finished.\n"
+        "       At the end it merges the pieces into the -o file and deletes them.  Needs sorted (-so) BAM output to a file\n"
+        "       and input that -inputPart can split.\n"
+        "  -fqidx For paired uncompressed FASTQ files that aren't the same size (because the reads aren't all the same length),\n"
+        "       scan them for where their reads start and save that next to them (reads_1.fq.fqidx), unless it's already\n"
+        "       there.  With these record indices, SNAP can read the files in ranges the way it does files the same size,\n"
+        "       which is faster than reading them in order with a thread apiece, and works with -inputPart and -ckpt.\n"
+        "       Later runs use the indices without -fqidx.\n"
         "  --hp Indicates not to use huge pages (this may speed up index load and slow down alignment)  This is the default\n"
-        "  -hp  Indicates to use huge pages (this may speed up alignment and slow down index load).\n"
+        "  -hp  Indicates to use huge pages (this may speed up alignment and slow down index load).  On Linux this uses\n"
+        "       hugetlbfs pages if enough are set aside and transparent huge pages if not, says which it got, and faults\n"
+        "       in large allocations with several threads at once.  With -map or -shm,\n"
+        "       asks for transparent huge pages for the mapped index, which Linux provides for files on tmpfs mounted with\n"
+        "       huge= (such as /dev/shm) and sometimes for read-only files.  Index files on a hugetlbfs mount always\n"
+        "       map with huge pages.\n"
         "  -D   Specifies the extra search depth (the edit distance beyond the best hit that SNAP uses to compute MAPQ).  Default 2\n"
         "  -rg  Specify the default read group if it is not specified in the input file\n"
         "  -R   Specify the entire read group line for the SAM/BAM output.  This must include an ID tag.  If it doesn't start with\n"
@@ -161,40 +352,109 @@ AlignerOptions::usageMessage()
         "  -mpc Limit the number of alignments generated by -om to this many per contig (chromosome/FASTA entry);\n"
         "       'mpc' means 'max per contig; default unlimited.  This filter is applied prior to -omax.  The primary alignment\n"
         "       is counted.\n"
-		"  -pc  Preserve the soft clipping for reads coming from SAM or BAM files\n"
+		"  -pc  Preserve the soft clipping for reads coming from SAM or BAM files (for CRAM, keep all their optional fields too)\n"
+        "  -qbin Bin the output's base qualities into Illumina's 8 levels (2-9 -> 6, 10-19 -> 15, 20-24 -> 22, 25-29 -> 27,\n"
+        "       30-34 -> 33, 35-39 -> 37, 40+ -> 40), which makes BAM and CRAM output compress much better\n"
+        "  -noQual Don't write base qualities at all ('*' in SAM), for outputs that are only used to filter or count reads\n"
+        "  -dropAux Don't copy the optional fields of SAM, BAM or CRAM input to the output (except RG, if it's the read group)\n"
 		"  -xf  Increase expansion factor for BAM and GZ files (default %.1f)\n"
 		"  -hdp Use Hadoop-style prefixes (reporter:status:...) on error messages, and emit hadoop-style progress messages\n"
 		"  -mrl Specify the minimum read length to align, reads shorter than this (after clipping) stay unaligned.  This should be\n"
 		"       a good bit bigger than the seed length or you might get some questionable alignments.  Default %d\n"
+        "  -lsr With an index built with -longSeedSize, use its long seeds for reads (or pairs, for paired-end) at least this\n"
+        "       long, and the regular seeds for shorter ones.  Default %d\n"
 		"  -map Use file mapping to load the index rather than reading it.  This might speed up index loading in cases\n"
 		"       where SNAP is run repatedly on the same index, and the index is larger than half of the memory size\n"
 		"       of the machine.  On some operating systems, loading an index with -map is much slower than without if the\n"
 		"       index is not in memory.  You might consider adding -pre to prefetch the index into system cache when loading\n"
-		"       with -map when you don't expect the index to be in cache.\n"
+		"       with -map when you don't expect the index to be in cache.  With -map (or -shm), SNAP drops its input and output\n"
+		"       from the system cache once it's done with them, so that they don't push the index out.\n"
 		"  -pre Prefetch the index into system cache.  This is only meaningful with -map, and only helps if the index is not\n"
 		"       already in memory and your operating system is slow at reading mapped files (i.e., some versions of Linux,\n"
 		"       but not Windows).\n"
+		"  -ooc Out of core, for an index bigger than memory on fast (NVMe) storage.  The hash and overflow tables are mapped\n"
+		"       but not read in, the genome is loaded into memory, and each read's first seed lookups are paged in ahead of\n"
+		"       time without waiting as it enters the -la window, so many reads' page faults are in flight at once.  Turns\n"
+		"       on -la (at %d) if it isn't already.  Linux only.\n"
+		"  -noVerifyIndex Don't check the index's genome, hash table and overflow table against the checksums that index saved\n"
+		"       with them.  The check is done on the loading threads as the files are read, so it costs little; indices built\n"
+		"       before there were checksums, and ones loaded with -map, -shm or -ooc, aren't checked anyway.\n"
+        "  -ira Read this many megabytes from the start of the input files (split evenly among them) into the system cache\n"
+        "       while the index loads, so the aligners don't start out waiting on the input.  0 turns it off.  Default %d\n"
+        "  -numa Spread the index's hash tables evenly over the memory of all of the NUMA nodes (sockets) instead of\n"
+        "       wherever the loading thread happens to be, so no one node's memory is a bottleneck.  Linux only.\n"
+        "  -numaReplicate Load a separate copy of the index on each NUMA node and have each aligner thread use the copy\n"
+        "       on its own node, so seed lookups are always to local memory.  This needs one copy of the index worth of\n"
+        "       memory per node; if there isn't that much, it falls back to -numa.  Each thread picks the copy on the\n"
+        "       node it starts on, so it works best with threads bound to processors (-b, the default).  Neither NUMA\n"
+        "       option has any effect with -map.\n"
+        "  -shm Use a copy of the index in shared memory (/dev/shm), making it first if there isn't one already.  Every\n"
+        "       SNAP process on the machine that's using the same index with -shm maps the same copy, so there's only one\n"
+        "       in memory however many are running, and after the first one the index loads without reading the disk.\n"
+        "       The copy stays in memory after SNAP exits; delete its /dev/shm/snap-index-* directory to free it.\n"
+        "       It implies -map.  Linux only.\n"
+        "  -packGenome Also keep a copy of the genome at 2 bits per base, and score candidate alignments against it 32 bases\n"
+        "       at a time rather than 8.  It takes a quarter of the genome's size in extra memory and some time at startup to\n"
+        "       build.  An N in a read never matches an N in the reference with this option.\n"
+        "  -contigs Load only the contigs in the given comma separated list (for instance -contigs chr1,chr2), and only\n"
+        "       align to them.  Seeds that hit anywhere else are dropped from the index as it loads, and what's left is copied\n"
+        "       into tables just big enough for it, so once it's loaded it takes much less memory than the whole index, which\n"
+        "       is useful for running one aligner per region.  The output header still lists every contig.  It doesn't work\n"
+        "       with -map, -shm, -ooc, -packGenome, -numa, -numaReplicate or indices built with -compressOverflow.\n"
         "  -lp  Run SNAP at low scheduling priority (Only implemented on Windows)\n"
 #ifdef LONG_READS
-        "  -dp  Edit distance as a percentage of read length (single only, overrides -d)\n"
+        "  -dp  Edit distance as a percentage of read length (overrides -d for single; for pairs, -d still limits the pair\n"
+        "       and -dp limits each mate, which saves work on mates that trimming or clipping has made short)\n"
 #endif
+        "  -long Align long, noisy reads (such as PacBio or ONT) by chaining seed hits and aligning the gaps between them,\n"
+        "       rather than with one edit distance search of at most -d edits for the whole read (single only).  Only the\n"
+        "       primary alignment is found, so -om is ignored.\n"
+#ifndef LONG_READS
+        "       Reads longer than 400 bases need the snapxl build.\n"
+#endif
+        "  -longHelpers With -long, split the seed lookups, chaining and gap alignment of each read of 20,000 bases or\n"
+        "       more with this many more threads, so one very long read doesn't hold up the end of the run.  Default 3, 0\n"
+        "       to align each read on one thread.\n"
 		"  -nu  No Ukkonen: don't reduce edit distance search based on prior candidates. This option is purely for\n"
 		"       evaluating the performance effect of using Ukkonen's algorithm rather than Smith-Waterman, and specifying\n"
 		"       it will slow down execution without improving the alignments.\n"
 		"  -no  No Ordering: don't order the evalutation of reads so as to select more likely candidates first.  This option\n"
 		"       is purely for evaluating the performance effect of the read evaluation order, and specifying it will slow\n"
 		"       down execution without improving alignments.\n"
+        "  -nfp No fast path: don't first check whether a few seeds agree on one place that the read matches exactly, and\n"
+        "       take that as the alignment without a full search.  The fast path only takes reads for which the full search\n"
+        "       would find the same alignment, so this is purely for evaluating its performance effect (single only).\n"
 		"  -nt  Don't truncate searches based on missed seed hits.  This option is purely for evaluating the performance effect\n"
 		"       of candidate truncation, and specifying it will slow down execution without improving alignments.\n"
+        "  -la  Keep this many reads in flight per thread ahead of the one being aligned, and prefetch the index lookups for\n"
+        "       their first seeds as they come in, so the aligner doesn't wait for them.  Default 0 (off); try 4 to 8.\n"
+        "  -mem Print how much memory each thread's aligners reserve and how much of it they use, by component.\n"
+        "  -wp  At the end, print how many times threads had to block on locks and events, and for how long (Linux only).\n"
+        "  -hwc Count cycles, instructions, cache and TLB misses and branch mispredicts in each stage of the alignment with\n"
+        "       the hardware performance counters, and print them per read at the end.  Linux only, and SNAP has to be\n"
+        "       built with STAGE_TIMING (make STAGE_TIMING=1), which also prints the time in each stage.\n"
+        "  -iou Read the input files with io_uring, keeping up to this many reads outstanding per file, rather than mapping\n"
+        "       them, and write the output (and the temporary file for sorting) with io_uring too, so all of the write\n"
+        "       buffers are being written at once.  This helps most on fast storage.  Default 0 (off).  Linux only.\n"
+        "  -pmm Memory in megabytes for the reads that the paired read matcher is waiting on the mates of, for SAM and BAM\n"
+        "       input that isn't sorted by read name.  Past that it writes them to temporary files (split up by read name,\n"
+        "       next to the output file) and pairs them up at the end of the input, one file at a time.  Default 0 (no limit).\n"
         " -wbs  Write buffer size in megabytes.  Don't specify this unless you've gotten an error message saying to make it bigger.  Default 16.\n"
+        "  -memLimit Plan threads and buffers to fit in this many Gb (may be fractional), as if SNAP were in a container with\n"
+        "       that memory limit.  Inside a container, its own CPU and memory limits are planned for anyway; this only\n"
+        "       lowers the memory limit.  Options given explicitly (-t, -wbs, -sm) are kept.\n"
 		,
             commandLine,
             maxDist,
             maxHits,
 			minWeightToCheck,
             MAPQ_LIMIT_FOR_SINGLE_HIT, MAPQ_LIMIT_FOR_SINGLE_HIT, MAPQ_LIMIT_FOR_SINGLE_HIT,
+            MAX_OTHER_INDICES,
             expansionFactor,
-			DEFAULT_MIN_READ_LENGTH);
+			DEFAULT_MIN_READ_LENGTH,
+            DEFAULT_LONG_SEED_MIN_READ_LENGTH,
+            DEFAULT_OUT_OF_CORE_LOOKAHEAD,
+            DEFAULT_INPUT_READAHEAD_MB);
 
     if (extra != NULL) {
         extra->usageMessage();
@@ -213,13 +473,16 @@ AlignerOptions::usageMessage()
                 "you think each run will have completed).\n\n");
 
     WriteErrorMessage("When specifying an input or output file, you can simply list the filename, in which case\n"
-                      "SNAP will infer the type of the file from the file extension (.sam or .bam for example),\n"
+                      "SNAP will infer the type of the file from the file extension (.sam or .bam for example, or\n"
+                      ".sam.zst for zstd compressed SAM in builds with zstd, or .snappack for input made by\n"
+                      "'snap-aligner pack'),\n"
                       "or you can explicitly specify the file type by preceding the filename with one of the\n"
                       " following type specifiers (which are case sensitive):\n"
                       "    -fastq\n"
-                      "    -compressedFastq\n"
+                      "    -compressedFastq (gzip, or zstd in builds with it)\n"
                       "    -sam\n"
                       "    -bam\n"
+                      "    -cram (encoded against the index's genome, and read against it)\n"
                       "    -pairedFastq\n"
                       "    -pairedInterleavedFastq\n"
                       "    -pairedCompressedInterleavedFastq\n"
@@ -303,6 +566,7 @@ AlignerOptions::parse(
     } else if (strcmp(argv[n], "-t") == 0) {
         if (n + 1 < argc) {
             numThreads = atoi(argv[n+1]);
+            numThreadsGiven = true;
             n++;
             return true;
         }
@@ -329,12 +593,45 @@ AlignerOptions::parse(
 	} else if (strcmp(argv[n], "-so") == 0) {
 		sortOutput = true;
 		return true;
+	} else if (strcmp(argv[n], "-son") == 0) {
+		sortOutput = true;
+		sortByName = true;
+		return true;
+	} else if (strcmp(argv[n], "-inputOrder") == 0) {
+		inputOrder = true;
+		return true;
 	} else if (strcmp(argv[n], "-map") == 0) {
 		mapIndex = true;
 		return true;
 	} else if (strcmp(argv[n], "-pre") == 0) {
 		prefetchIndex = true;
 		return true;
+	} else if (strcmp(argv[n], "-ooc") == 0) {
+		outOfCoreIndex = true;
+		return true;
+	} else if (strcmp(argv[n], "-noVerifyIndex") == 0) {
+		noVerifyIndex = true;
+		return true;
+	} else if (strcmp(argv[n], "-numa") == 0) {
+		numaInterleaveIndex = true;
+		return true;
+	} else if (strcmp(argv[n], "-numaReplicate") == 0) {
+		numaReplicateIndex = true;
+		return true;
+	} else if (strcmp(argv[n], "-shm") == 0) {
+		sharedMemoryIndex = true;
+		return true;
+	} else if (strcmp(argv[n], "-packGenome") == 0) {
+		packGenome = true;
+		return true;
+	} else if (strcmp(argv[n], "-contigs") == 0) {
+        if (n + 1 < argc) {
+            restrictToContigs = argv[n+1];
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a comma separated list of contig names after -contigs\n");
+        }
 	}
 	else if (strcmp(argv[n], "-S") == 0) {
         if (n + 1 < argc) {
@@ -356,9 +653,79 @@ AlignerOptions::parse(
             }
             return true;
         }
+    } else if (strcmp(argv[n], "-memLimit") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            memoryLimit = atof(argv[n+1]);
+            n++;
+            return true;
+        }
     } else if (strcmp(argv[n], "-sm") == 0) {
         if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
-            sortMemory = atoi(argv[n+1]);
+            sortMemory = atof(argv[n+1]);
+            n++;
+            return true;
+        }
+    } else if (strcmp(argv[n], "-smi") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            sortInMemory = atoi(argv[n+1]);
+            n++;
+            return true;
+        }
+    } else if (strcmp(argv[n], "-smt") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            sortMergeThreads = __max(1, atoi(argv[n+1]));
+            n++;
+            return true;
+        }
+    } else if (strcmp(argv[n], "-stz") == 0) {
+        sortTempZstd = true;
+        return true;
+    } else if (strcmp(argv[n], "-evenShards") == 0) {
+        evenShards = true;
+        return true;
+    } else if (strcmp(argv[n], "-shards") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 1) {
+            sortShards = atoi(argv[n+1]);
+            n++;
+            return true;
+        }
+        WriteErrorMessage("-shards needs a number of shards, more than 1\n");
+    } else if (strcmp(argv[n], "-csi") == 0) {
+        csiIndex = true;
+        return true;
+    } else if (strcmp(argv[n], "-nameIndex") == 0) {
+        nameIndex = true;
+        return true;
+    } else if (strcmp(argv[n], "-cl") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9' && atoi(argv[n+1]) <= 9) {
+            compressionLevel = atoi(argv[n+1]);
+            n++;
+            return true;
+        }
+        WriteErrorMessage("-cl requires a compression level from 0 to 9\n");
+        return false;
+    } else if (strcmp(argv[n], "-dmm") == 0) {
+        if (n + 1 < argc) {
+            duplicateMetricsFile = argv[n+1];
+            n++;
+            return true;
+        }
+    } else if (strcmp(argv[n], "-alnMetrics") == 0) {
+        if (n + 1 < argc) {
+            alignmentMetricsFile = argv[n+1];
+            n++;
+            return true;
+        }
+    } else if (strcmp(argv[n], "-mbin") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            coverageBinSize = atoi(argv[n+1]);
+            n++;
+            return true;
+        }
+        WriteErrorMessage("-mbin needs a number of bases per bin\n");
+    } else if (strcmp(argv[n], "-std") == 0) {
+        if (n + 1 < argc) {
+            sortTempDirectories = argv[n+1];
             n++;
             return true;
         }
@@ -422,6 +789,21 @@ AlignerOptions::parse(
     } else if (strcmp(argv[n], "-f") == 0) {
         stopOnFirstHit = true;
         return true;
+    } else if (strcmp(argv[n], "-as") == 0) {
+        adaptiveSeeding = true;
+        return true;
+    } else if (strcmp(argv[n], "-sq") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            minSeedQuality = atoi(argv[n]);
+            return minSeedQuality <= 93;    // The highest quality that FASTQ can represent
+        }
+    } else if (strcmp(argv[n], "-giveUp") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            maxSeedsWithoutHits = atoi(argv[n]);
+            return true;
+        }
 #if     USE_DEVTEAM_OPTIONS
     } else if (strcmp(argv[n], "-I") == 0) {
         ignoreMismatchedIDs = true;
@@ -490,6 +872,58 @@ AlignerOptions::parse(
         n++;
 
         return true;
+    } else if (strcmp(argv[n], "-la") == 0) {
+        if (n + 1 < argc && argv[n + 1][0] >= '0' && argv[n + 1][0] <= '9') {
+            readLookahead = atoi(argv[n + 1]);
+            if (readLookahead > LookaheadReadSupplier::MaxDepth) {
+                WriteErrorMessage("-la can't be more than %d\n", LookaheadReadSupplier::MaxDepth);
+                return false;
+            }
+            n++;
+            return true;
+        }
+        WriteErrorMessage("-la requires a numerical parameter.\n");
+        return false;
+    } else if (strcmp(argv[n], "-ioc") == 0) {
+        if (n + 1 < argc && argv[n + 1][0] >= '0' && argv[n + 1][0] <= '9') {
+            helperProcessors = atoi(argv[n + 1]);
+            if (helperProcessors >= GetNumberOfProcessors()) {
+                WriteErrorMessage("-ioc must leave at least one of the %d processors for the aligner threads\n", GetNumberOfProcessors());
+                return false;
+            }
+            n++;
+            return true;
+        }
+        WriteErrorMessage("-ioc requires a numerical parameter.\n");
+        return false;
+    } else if (strcmp(argv[n], "-iou") == 0) {
+        if (n + 1 < argc && argv[n + 1][0] >= '0' && argv[n + 1][0] <= '9') {
+            ioUringQueueDepth = atoi(argv[n + 1]);
+            if (ioUringQueueDepth > 4096) {
+                WriteErrorMessage("-iou can't be more than 4096\n");
+                return false;
+            }
+            n++;
+            return true;
+        }
+        WriteErrorMessage("-iou requires a numerical parameter.\n");
+        return false;
+    } else if (strcmp(argv[n], "-ira") == 0) {
+        if (n + 1 < argc && argv[n + 1][0] >= '0' && argv[n + 1][0] <= '9') {
+            inputReadaheadMB = atoi(argv[n + 1]);
+            n++;
+            return true;
+        }
+        WriteErrorMessage("-ira requires a numerical parameter.\n");
+        return false;
+    } else if (strcmp(argv[n], "-pmm") == 0) {
+        if (n + 1 < argc && argv[n + 1][0] >= '0' && argv[n + 1][0] <= '9') {
+            matcherMemory = atoi(argv[n + 1]);
+            n++;
+            return true;
+        }
+        WriteErrorMessage("-pmm requires a numerical parameter.\n");
+        return false;
     } else if (strcmp(argv[n], "-wbs") == 0) {
         if (n + 1 >= argc) {
             WriteErrorMessage("-wbs requires an additional value\n");
@@ -504,6 +938,7 @@ AlignerOptions::parse(
             return false;
         }
         writeBufferSize = atoi(argv[n + 1]) * 1024 * 1024;
+        writeBufferSizeGiven = true;
 
         if (writeBufferSize <= 0) {
             WriteErrorMessage("-wbs must be bigger than zero");
@@ -522,6 +957,15 @@ AlignerOptions::parse(
 	} else if (strcmp(argv[n], "-pc") == 0) {
 		preserveClipping = true;
 		return true;
+    } else if (strcmp(argv[n], "-qbin") == 0) {
+        binQualities = true;
+        return true;
+    } else if (strcmp(argv[n], "-noQual") == 0) {
+        omitQualities = true;
+        return true;
+    } else if (strcmp(argv[n], "-dropAux") == 0) {
+        dropAuxData = true;
+        return true;
 	} else if (strcmp(argv[n], "-G") == 0) {
         if (n + 1 < argc) {
             gapPenalty = atoi(argv[n+1]);
@@ -540,11 +984,17 @@ AlignerOptions::parse(
             minReadLength = atoi(argv[n]);
             return minReadLength > 0;
         }
+    } else if (strcmp(argv[n], "-lsr") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            longSeedMinReadLength = atoi(argv[n]);
+            return longSeedMinReadLength > 0;
+        }
     } else if (strcmp(argv[n], "-dp") == 0) {
         if (n + 1 < argc) {
             n++;
             maxDistFraction = (float) (0.01 * atof(argv[n]));
-            return (! isPaired()) && maxDistFraction > 0.0 && maxDistFraction < 1.0;
+            return maxDistFraction > 0.0 && maxDistFraction < 1.0;
         }
 	} else if (strcmp(argv[n], "-R") == 0) {
         if (n + 1 < argc) {
@@ -684,6 +1134,179 @@ AlignerOptions::parse(
         } else {
             WriteErrorMessage("Must specify the name of the perf file after -pf\n");
         }
+	} else if (strcmp(argv[n], "-metrics") == 0) {
+        if (n + 1 < argc) {
+            metricsFileName = argv[n+1];
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify the name of the metrics file after -metrics\n");
+        }
+	} else if (strcmp(argv[n], "-metricsInterval") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            metricsInterval = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a number of seconds greater than 0 after -metricsInterval\n");
+        }
+	} else if (strcmp(argv[n], "-trace") == 0) {
+        if (n + 1 < argc) {
+            traceFileName = argv[n+1];
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify the name of the trace file after -trace\n");
+        }
+	} else if (strcmp(argv[n], "-slowReads") == 0) {
+        if (n + 1 < argc) {
+            slowReadsFileName = argv[n+1];
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify the name of the slow reads file after -slowReads\n");
+        }
+	} else if (strcmp(argv[n], "-slowReadsCount") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            nSlowReads = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a number greater than 0 after -slowReadsCount\n");
+        }
+	} else if (strcmp(argv[n], "-workBudget") == 0) {
+        if (n + 1 < argc) {
+            workBudget = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify the number of edit distance computations after -workBudget\n");
+        }
+	} else if (strcmp(argv[n], "-dupCache") == 0) {
+        if (n + 1 < argc && atoll(argv[n+1]) > 0) {
+            dupCacheSize = (size_t)atoll(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a number of reads greater than 0 after -dupCache\n");
+        }
+	} else if (strcmp(argv[n], "-reuse") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            reuseMinMAPQ = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a MAPQ greater than 0 after -reuse\n");
+        }
+	} else if (strcmp(argv[n], "-kmerFilter") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            kmerFilterSeeds = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a number of seeds greater than 0 after -kmerFilter\n");
+        }
+	} else if (strcmp(argv[n], "-kmerFilterHits") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            kmerFilterHits = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a number of seeds greater than 0 after -kmerFilterHits\n");
+        }
+	} else if (strcmp(argv[n], "-trimAdapter") == 0) {
+        if (n + 1 < argc && strspn(argv[n+1], "ACGTacgt") == strlen(argv[n+1]) && strlen(argv[n+1]) > 0) {
+            trimAdapter = argv[n+1];
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify an adapter sequence (of ACGT) after -trimAdapter\n");
+        }
+	} else if (strcmp(argv[n], "-trimQuality") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            trimQuality = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a quality greater than 0 after -trimQuality\n");
+        }
+	} else if (strcmp(argv[n], "-trimWindow") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            trimWindow = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a window size greater than 0 after -trimWindow\n");
+        }
+	} else if (strcmp(argv[n], "-umi") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            umiField = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify which field of the read name (from the end, starting at 1) has the UMI after -umi\n");
+        }
+	} else if (strcmp(argv[n], "-split") == 0) {
+        if (n + 1 < argc && (strcmp(argv[n+1], "rg") == 0 || atoi(argv[n+1]) > 0)) {
+            splitOutput = true;
+            splitNameField = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify rg or a read name field (from the end, starting at 1) after -split\n");
+        }
+	} else if (strcmp(argv[n], "-otherIndex") == 0) {
+        if (n + 2 < argc && nOtherIndices < MAX_OTHER_INDICES) {
+            otherIndexDirs[nOtherIndices] = argv[n+1];
+            otherOutputFileNames[nOtherIndices] = argv[n+2];
+            nOtherIndices++;
+            n += 2;
+            return true;
+        } else if (nOtherIndices == MAX_OTHER_INDICES) {
+            WriteErrorMessage("At most %d -otherIndex options are allowed\n", MAX_OTHER_INDICES);
+        } else {
+            WriteErrorMessage("Must specify an index directory and an output file after -otherIndex\n");
+        }
+	} else if (strcmp(argv[n], "-inputPart") == 0) {
+        int part, nParts;
+        if (n + 1 < argc && 2 == sscanf(argv[n+1], "%d/%d", &part, &nParts) && nParts > 0 && part >= 0 && part < nParts) {
+            inputPart = part;
+            nInputParts = nParts;
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify i/N, with i from 0 to N-1, after -inputPart\n");
+        }
+	} else if (strcmp(argv[n], "-region") == 0) {
+        if (n + 1 < argc) {
+            inputRegion = argv[n+1];
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify chr:begin-end after -region\n");
+        }
+	} else if (strcmp(argv[n], "-unmappedOnly") == 0) {
+        unmappedOnly = true;
+        return true;
+	} else if (strcmp(argv[n], "-fqidx") == 0) {
+        FASTQRecordIndex::BuildMissing = true;
+        return true;
+	} else if (strcmp(argv[n], "-ckpt") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            checkpointPieces = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a number of pieces after -ckpt\n");
+        }
+	} else if (strcmp(argv[n], "-umiPrefix") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) >= 0) {
+            umiPrefix = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            WriteErrorMessage("Must specify a number of bases after -umiPrefix\n");
+        }
 	} else if (strcmp(argv[n], "-rg") == 0) {
         if (n + 1 < argc) {
             char *newReadGroup = new char[strlen(argv[n+1]) + 1];
@@ -719,6 +1342,54 @@ AlignerOptions::parse(
 	} else if (strcmp(argv[n], "-nt") == 0) {
 		noTruncation = true;
 		return true;
+	} else if (strcmp(argv[n], "-nfp") == 0) {
+		noExactMatchFastPath = true;
+		return true;
+    } else if (strcmp(argv[n], "-mem") == 0) {
+        memoryReport = true;
+        return true;
+    } else if (strcmp(argv[n], "-wp") == 0) {
+        waitProfile = true;
+        return true;
+    } else if (strcmp(argv[n], "-hwc") == 0) {
+        hardwareCounters = true;
+        return true;
+    } else if (strcmp(argv[n], "-discardOutput") == 0) {
+        discardOutput = true;
+        return true;
+    } else if (strcmp(argv[n], "-autotune") == 0) {
+        if (n + 1 < argc) {
+            autotuneLoss = atof(argv[n + 1]);
+            if (autotuneLoss < 0 || autotuneLoss > 100) {
+                WriteErrorMessage("-autotune must be a percentage, from 0 to 100\n");
+                return false;
+            }
+            n++;
+            return true;
+        }
+    } else if (strcmp(argv[n], "-autotuneReads") == 0) {
+        if (n + 1 < argc) {
+            autotuneReads = atoi(argv[n + 1]);
+            if (autotuneReads < 1) {
+                WriteErrorMessage("-autotuneReads must be at least 1\n");
+                return false;
+            }
+            n++;
+            return true;
+        }
+    } else if (strcmp(argv[n], "-long") == 0) {
+        longReads = true;
+        return !isPaired();
+    } else if (strcmp(argv[n], "-longHelpers") == 0) {
+        if (n + 1 < argc) {
+            longReadHelpers = atoi(argv[n + 1]);
+            if (longReadHelpers < 0 || longReadHelpers > 64) {
+                WriteErrorMessage("-longHelpers must be between 0 and 64\n");
+                return false;
+            }
+            n++;
+            return !isPaired();
+        }
 	} else if (strcmp(argv[n], "-D") == 0) {
         if (n + 1 < argc) {
             extraSearchDepth = atoi(argv[n+1]);
@@ -792,10 +1463,39 @@ AlignerOptions::passFilter(
     }
 }
 
+    bool
+SNAPFile::canReadInParts(bool paired) const
+{
+    if (isStdio) {
+        return false;
+    }
+
+    switch (fileType) {
+    case SAMFile:
+        return ! paired && ! isCompressed;
+
+    case FASTQFile:
+        if (NULL != secondFileName) {
+            return ! isCompressed && (DataSupplier::InputFileSize(fileName) == DataSupplier::InputFileSize(secondFileName) ||
+                FASTQRecordIndex::CanSplitPair(fileName, secondFileName));
+        }
+        return ! isCompressed || DataSupplier::IsBgzfFile(fileName) || DataSupplier::IsSeekableZstdFile(fileName);
+
+    case InterleavedFASTQFile:
+        return ! isCompressed || DataSupplier::IsBgzfFile(fileName) || DataSupplier::IsSeekableZstdFile(fileName);
+
+    case ReadPackFile:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
     PairedReadSupplierGenerator *
 SNAPFile::createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpairedReads, const ReaderContext& context)
 {
-    _ASSERT(fileType == SAMFile || fileType == BAMFile || fileType == InterleavedFASTQFile || secondFileName != NULL); // Caller's responsibility to check this
+    _ASSERT(fileType == SAMFile || fileType == BAMFile || fileType == CRAMFile || fileType == InterleavedFASTQFile || fileType == ReadPackFile || secondFileName != NULL); // Caller's responsibility to check this
 
     switch (fileType) {
     case SAMFile:
@@ -804,11 +1504,17 @@ SNAPFile::createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpa
     case BAMFile:
         return BAMReader::createPairedReadSupplierGenerator(fileName,numThreads, quicklyDropUnpairedReads, context);
 
+    case CRAMFile:
+        return CramReader::createPairedReadSupplierGenerator(fileName, numThreads, quicklyDropUnpairedReads, context);
+
     case FASTQFile:
         return PairedFASTQReader::createPairedReadSupplierGenerator(fileName, secondFileName, numThreads, context, isCompressed);
 
     case InterleavedFASTQFile:
         return PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(fileName, numThreads, context, isCompressed);
+
+    case ReadPackFile:
+        return ReadPackReader::createPairedReadSupplierGenerator(fileName, numThreads, context);
         
     default:
         _ASSERT(false);
@@ -829,9 +1535,15 @@ SNAPFile::createReadSupplierGenerator(int numThreads, const ReaderContext& conte
     case BAMFile:
         return BAMReader::createReadSupplierGenerator(fileName,numThreads, context);
 
+    case CRAMFile:
+        return CramReader::createReadSupplierGenerator(fileName, numThreads, context);
+
     case FASTQFile:
         return FASTQReader::createReadSupplierGenerator(fileName, numThreads, context, isCompressed);
 
+    case ReadPackFile:
+        return ReadPackReader::createReadSupplierGenerator(fileName, numThreads, context);
+
     default:
         _ASSERT(false);
         WriteErrorMessage("SNAPFile::createReadSupplierGenerator: invalid file type (%d)\n", fileType);
@@ -909,6 +1621,10 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
             snapFile->fileType = BAMFile;
             snapFile->isCompressed = true;
             *argsConsumed = 2;
+        } else if (!strcmp(args[0], "-cram")) {
+            snapFile->fileType = CRAMFile;
+            snapFile->isCompressed = true;
+            *argsConsumed = 2;
         } else if (!strcmp(args[0], "-pairedInterleavedFastq") || !strcmp(args[0], "-pairedCompressedInterleavedFastq")) {
             if (!paired) {
                 WriteErrorMessage("Specified %s for a single-end alignment.  To treat it as single-end, just use ordinary fastq (or compressed fastq, as appropriate)\n", args[0]);
@@ -939,26 +1655,36 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
     if (util::stringEndsWith(args[0], ".sam")) {
         snapFile->fileType = SAMFile;
         snapFile->isCompressed = false;
+    } else if (util::stringEndsWith(args[0], ".sam.zst")) {
+        snapFile->fileType = SAMFile;
+        snapFile->isCompressed = true;
     } else if (util::stringEndsWith(args[0], ".bam")) {
         snapFile->fileType = BAMFile;
         snapFile->isCompressed = true;
+    } else if (util::stringEndsWith(args[0], ".cram")) {
+        snapFile->fileType = CRAMFile;
+        snapFile->isCompressed = true;
+    } else if (isInput && util::stringEndsWith(args[0], ".snappack")) {
+        snapFile->fileType = ReadPackFile;
+        snapFile->isCompressed = false;
     } else if (!isInput) {
         //
         // No default output file type.
         //
-        WriteErrorMessage("You specified an output file with name '%s', which doesn't end in .sam or .bam, and doesn't have an explicit type\n"
+        WriteErrorMessage("You specified an output file with name '%s', which doesn't end in .sam, .sam.zst, .bam or .cram, and doesn't have an explicit type\n"
                           "specifier.  There is no default output file type.  Consider doing something like '-o -bam %s'\n", args[0], args[0]);
 		return false;
     } else if (util::stringEndsWith(args[0], ".fq") || util::stringEndsWith(args[0], ".fastq") ||
         util::stringEndsWith(args[0], ".fq.gz") || util::stringEndsWith(args[0], ".fastq.gz") ||
-        util::stringEndsWith(args[0], ".fq.gzip") || util::stringEndsWith(args[0], ".fastq.gzip")) {
+        util::stringEndsWith(args[0], ".fq.gzip") || util::stringEndsWith(args[0], ".fastq.gzip") ||
+        util::stringEndsWith(args[0], ".fq.zst") || util::stringEndsWith(args[0], ".fastq.zst")) {
 
         // 
         // It's a fastq input file (either by default or because it's got a .fq or .fastq extension, we don't
         // need to check).  See if it's also compressed.
         //
         snapFile->fileType= FASTQFile;
-        if (util::stringEndsWith(args[0], ".gz") || util::stringEndsWith(args[0], ".gzip")) {
+        if (util::stringEndsWith(args[0], ".gz") || util::stringEndsWith(args[0], ".gzip") || util::stringEndsWith(args[0], ".zst")) {
             snapFile->isCompressed = true;
         } else {
             snapFile->isCompressed = false;
@@ -977,10 +1703,6 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
                     WriteErrorMessage("Can't have both halves of paired FASTQ files be stdin ('-').  Did you mean to use the interleaved FASTQ type?\n");
 					return false;
                 }
-				if (CommandPipe != NULL) {
-					WriteErrorMessage("You may not write to stdout in daemon mode\n");
-					return false;
-				}
                 snapFile->isStdio = true;
             }
 
@@ -30,6 +30,11 @@ Revision History:
 #include "Read.h"
 
 #define MAPQ_LIMIT_FOR_SINGLE_HIT 10
+#define MAX_MAPQ_FOR_TRUNCATED_SEARCH 9     // -workBudget, so it's never a SingleHit
+#define DEFAULT_LONG_SEED_MIN_READ_LENGTH 100
+#define DEFAULT_INPUT_READAHEAD_MB 256
+#define DEFAULT_OUT_OF_CORE_LOOKAHEAD 32    // -la for -ooc, which needs many more reads in flight to cover a page fault than a cache miss
+#define MAX_OTHER_INDICES 4
 
 struct AbstractOptions
 {
@@ -38,7 +43,7 @@ struct AbstractOptions
     virtual bool parse(const char** argv, int argc, int& n, bool *done) = 0;
 };
 
-enum FileType {UnknownFileType, SAMFile, FASTQFile, BAMFile, InterleavedFASTQFile, CRAMFile};  // Add more as needed
+enum FileType {UnknownFileType, SAMFile, FASTQFile, BAMFile, InterleavedFASTQFile, CRAMFile, ReadPackFile};  // Add more as needed
 
 struct SNAPFile {
 	SNAPFile() : fileName(NULL), secondFileName(NULL), fileType(UnknownFileType), isStdio(false), omitSQLines(false) {}
@@ -52,6 +57,9 @@ struct SNAPFile {
     PairedReadSupplierGenerator *createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpairedReads, const ReaderContext& context);
     ReadSupplierGenerator *createReadSupplierGenerator(int numThreads, const ReaderContext& context);
     static bool generateFromCommandLine(const char **args, int nArgs, int *argsConsumed, SNAPFile *snapFile, bool paired, bool isInput);
+
+    // Whether the generators read it in byte ranges (see RangeSplitter), which -inputPart needs
+    bool canReadInParts(bool paired) const;
 };
 
 struct AlignerOptions : public AbstractOptions
@@ -62,6 +70,7 @@ struct AlignerOptions : public AbstractOptions
     const char         *indexDir;
     const char         *similarityMapFile;
     int                 numThreads;
+    bool                numThreadsGiven;    // -t, rather than planned (see ResourcePlan.h)
     unsigned            maxDist;
     float               maxDistFraction;
     unsigned            numSeedsFromCommandLine;
@@ -70,24 +79,77 @@ struct AlignerOptions : public AbstractOptions
     unsigned            maxHits;
     int                 minWeightToCheck;
     bool                bindToProcessors;
+    unsigned            helperProcessors;   // -ioc, processors set aside for reading, decompression and compression
     bool                ignoreMismatchedIDs;
     SNAPFile            outputFile;
     int                 nInputs;
     SNAPFile           *inputs;
     ReadClippingType    clipping;
     bool                sortOutput;
+    bool                sortByName;         // -son, sort by read name rather than location (sortOutput is set too)
+    bool                inputOrder;         // -inputOrder, unsorted output in the order of the input (see AsyncDataWriterSupplier::place)
     bool                noIndex;
     bool                noDuplicateMarking;
     bool                noQualityCalibration;
-    unsigned            sortMemory; // total output sorting buffer size in Gb
+    double              sortMemory; // total output sorting buffer size in Gb, 0 for the default (planned, see ResourcePlan.h)
+    unsigned            sortInMemory; // -smi, Gb of sorted output to keep in memory rather than in the temp file
+    const char         *sortTempDirectories; // -std, comma separated, NULL for next to the output file
+    int                 sortMergeThreads; // -smt, threads to merge sorted output with
+    int                 sortShards; // -shards, files to split sorted output into by genome range, 0 for one
+    bool                evenShards; // -evenShards, make the shards equal ranges of the genome rather than of the reads
+    bool                sortTempZstd; // -stz, compress the temp files with zstd
+    const char         *duplicateMetricsFile; // -dmm, NULL for none
+    const char         *alignmentMetricsFile; // -alnMetrics, NULL for none
+    unsigned            coverageBinSize; // -mbin, 0 for no coverage bins in the metrics
+    bool                csiIndex; // -csi, index sorted BAM with CSI instead of BAI
+    bool                nameIndex; // -nameIndex, index sorted BAM by read name too, into .rni (see ReadNameIndex.h)
+    int                 compressionLevel; // -cl, zlib level (0-9) for BAM output, -1 for the default
     unsigned            filterFlags;
     bool                explorePopularSeeds;
     bool                stopOnFirstHit;
+    bool                adaptiveSeeding;    // -as, see BaseAligner
+    unsigned            minSeedQuality;     // -sq, 0 for off
+    unsigned            maxSeedsWithoutHits;    // -giveUp, 0 for off
+    bool                noExactMatchFastPath;   // -nfp
+    bool                longReads;              // -long, see LongReadAligner
+    int                 longReadHelpers;        // -longHelpers, threads that help with each very long read
+    unsigned            readLookahead;          // -la, see LookaheadReadSupplier
+    bool                memoryReport;           // -mem, see ReportBigAllocatorUse
+    bool                waitProfile;            // -wp, see PrintWaitProfile
+    bool                hardwareCounters;       // -hwc, see StageTiming.h
+    bool                discardOutput;          // -discardOutput, see AsyncFile::DiscardWritesTo
+    double              autotuneLoss;           // -autotune, the percentage of confident alignments it may lose; -1 for off.  See Autotune.h
+    int                 autotuneReads;          // -autotuneReads, the size of its sample
 	bool				useM;	// Should we generate CIGAR strings using = and X, or using the old-style M?
-    unsigned            gapPenalty; // if non-zero use gap penalty aligner
+    unsigned            gapPenalty; // -G, if non-zero the gap open penalty for affine gap CIGAR strings (see AffineGap.h)
     AbstractOptions    *extra; // extra options
     const char         *rgLineContents;
     const char         *perfFileName;
+    const char         *metricsFileName;    // -metrics, see ProgressReport.h
+    unsigned            metricsInterval;    // -metricsInterval, seconds between reports
+    const char         *slowReadsFileName;  // -slowReads, see SlowReads.h
+    const char         *traceFileName;      // -trace, see PipelineTrace.h
+    int                 nSlowReads;         // -slowReadsCount, how many to keep
+    unsigned            workBudget;         // -workBudget, most edit distance calls for one read or pair, 0 for no limit
+    size_t              dupCacheSize;       // -dupCache, most reads (or pairs) to keep alignments of, 0 for none (see AlignmentCache.h)
+    int                 reuseMinMAPQ;       // -reuse, keep input alignments that verify with at least this MAPQ, 0 for never (see OriginalAlignment.h)
+    int                 kmerFilterSeeds;    // -kmerFilter, seeds to look up instead of aligning, 0 to align (see KmerFilter.h)
+    int                 kmerFilterHits;     // -kmerFilterHits, how many of them have to be in the index for a match
+    const char         *trimAdapter;        // -trimAdapter, 3' adapter to trim from FASTQ reads, or NULL (see ReadTrimmer.h)
+    int                 trimQuality;        // -trimQuality, trim FASTQ read ends whose windowed mean quality is below this, 0 for none
+    int                 trimWindow;         // -trimWindow, the window's size
+    int                 umiField;           // -umi, which ':' field of the read name (from the end) has the UMI, 0 for no consensus (see UmiConsensus.h)
+    int                 umiPrefix;          // -umiPrefix, bases of each mate that also have to match to be in a family
+    bool                splitOutput;        // -split, an output file per read group or read name field
+    int                 splitNameField;     // which ':' field of the read name (from the end) to split by, 0 for the read group
+    int                 nOtherIndices;      // -otherIndex, more indices to align against, each with its own output file
+    const char         *otherIndexDirs[MAX_OTHER_INDICES];
+    const char         *otherOutputFileNames[MAX_OTHER_INDICES];
+    int                 inputPart;          // -inputPart, which of nInputParts byte ranges of the input to align
+    int                 nInputParts;        // 0 to align all of it
+    const char         *inputRegion;        // -region, only align the records of BAM input that overlap chr:begin-end, or NULL
+    bool                unmappedOnly;       // -unmappedOnly, only align the unmapped records of BAM input
+    int                 checkpointPieces;   // -ckpt, align the input as this many -inputPart pieces in turn, keeping the finished ones; 0 not to
     bool                useTimingBarrier;
     unsigned            extraSearchDepth;
     const char         *defaultReadGroup; // if not specified in input
@@ -96,14 +158,30 @@ struct AlignerOptions : public AbstractOptions
 	int					maxSecondaryAlignments;
     int                 maxSecondaryAlignmentsPerContig;
     bool                preserveClipping;
+    bool                binQualities;       // -qbin
+    bool                omitQualities;      // -noQual
+    bool                dropAuxData;        // -dropAux
     float               expansionFactor;
+    unsigned            ioUringQueueDepth;  // 0 means don't use io_uring for input and output files
+    unsigned            matcherMemory;      // -pmm, megabytes of unpaired reads before the paired read matcher spills them; 0 means no limit
     bool                noUkkonen;
     bool                noOrderedEvaluation;
 	bool				noTruncation;
 	unsigned			minReadLength;
+    unsigned            longSeedMinReadLength;  // -lsr, reads at least this long use the index's long seeds if it has them
 	bool				mapIndex;
 	bool				prefetchIndex;
+	bool				outOfCoreIndex;		// -ooc
+	bool				noVerifyIndex;		// -noVerifyIndex, don't check the index's files against their checksums as they load
+    unsigned            inputReadaheadMB;   // -ira, megabytes of the start of the input files to read into the page cache while the index loads
+    bool                numaInterleaveIndex;
+    bool                numaReplicateIndex;
+    bool                sharedMemoryIndex;
+    bool                packGenome;
+    const char         *restrictToContigs;  // Comma separated contig names from -contigs, or NULL for the whole genome
     size_t              writeBufferSize;
+    bool                writeBufferSizeGiven;   // -wbs, rather than planned
+    double              memoryLimit;        // -memLimit, Gb to plan for if it's less than the container's limit; 0 for just that
     
     static bool         useHadoopErrorMessages; // This is static because it's global (and I didn't want to push the options object to every place in the code)
     static bool         outputToStdout;         // Likewise
@@ -40,12 +40,24 @@ AlignerStats::AlignerStats(AbstractStats* i_extra)
     extra(i_extra),
     lvCalls(0),
     filtered(0),
-    extraAlignments(0)
+    extraAlignments(0),
+    exactMatchFastPathHits(0),
+    truncatedAlignments(0),
+    cachedAlignments(0),
+    reusedAlignments(0),
+    alignerMemoryTouched(0),
+    maxAlignerMemoryTouched(0),
+    lowQualitySeedsSkipped(0),
+    readsGivenUp(0)
 {
     for (int i = 0; i <= AlignerStats::maxMapq; i++) {
         mapqHistogram[i] = 0;
      }
 
+    for (int i = 0; i < MAX_OTHER_INDICES; i++) {
+        readsToOtherIndices[i] = 0;
+    }
+
     for (int i = 0; i < maxMaxHits; i++) {
         countOfBestHitsByWeightDepth[i] = 0;
         countOfAllHitsByWeightDepth[i] = 0;
@@ -91,6 +103,14 @@ AlignerStats::add(
     lvCalls += other->lvCalls;
     filtered += other->filtered;
     extraAlignments += other->extraAlignments;
+    exactMatchFastPathHits += other->exactMatchFastPathHits;
+    truncatedAlignments += other->truncatedAlignments;
+    cachedAlignments += other->cachedAlignments;
+    reusedAlignments += other->reusedAlignments;
+    lowQualitySeedsSkipped += other->lowQualitySeedsSkipped;
+    readsGivenUp += other->readsGivenUp;
+    alignerMemoryTouched += other->alignerMemoryTouched;
+    maxAlignerMemoryTouched = __max(maxAlignerMemoryTouched, other->maxAlignerMemoryTouched);
 
     if (extra != NULL && other->extra != NULL) {
         extra->add(other->extra);
@@ -100,6 +120,10 @@ AlignerStats::add(
         mapqHistogram[i] += other->mapqHistogram[i];
     }
 
+    for (int i = 0; i < MAX_OTHER_INDICES; i++) {
+        readsToOtherIndices[i] += other->readsToOtherIndices[i];
+    }
+
     for (int i = 0; i < maxMaxHits; i++) {
         countOfBestHitsByWeightDepth[i] += other->countOfBestHitsByWeightDepth[i];
         countOfAllHitsByWeightDepth[i] += other->countOfAllHitsByWeightDepth[i];
@@ -112,4 +136,47 @@ AlignerStats::add(
         nanosByTimeBucket[i] += other->nanosByTimeBucket[i];
     }
 #endif // TIME_HISTOGRAM
+}
+
+    bool
+AlignerStats::SaveOrLoad(
+    FILE* file,
+    bool saving,
+    void* data,
+    size_t size)
+{
+    return 1 == (saving ? fwrite(data, size, 1, file) : fread(data, size, 1, file));
+}
+
+    bool
+AlignerStats::save(
+    FILE* file)
+{
+    _int64 counts[] = {totalReads, uselessReads, singleHits, multiHits, notFound, alignedAsPairs, lvCalls, filtered, extraAlignments,
+        exactMatchFastPathHits, truncatedAlignments, cachedAlignments, lowQualitySeedsSkipped, reusedAlignments, readsGivenUp};
+
+    return SaveOrLoad(file, true, counts, sizeof(counts)) &&
+        SaveOrLoad(file, true, mapqHistogram, sizeof(mapqHistogram)) &&
+        SaveOrLoad(file, true, countOfBestHitsByWeightDepth, sizeof(countOfBestHitsByWeightDepth)) &&
+        SaveOrLoad(file, true, countOfAllHitsByWeightDepth, sizeof(countOfAllHitsByWeightDepth)) &&
+        SaveOrLoad(file, true, probabilityMassByWeightDepth, sizeof(probabilityMassByWeightDepth));
+}
+
+    bool
+AlignerStats::load(
+    FILE* file)
+{
+    _int64* counts[] = {&totalReads, &uselessReads, &singleHits, &multiHits, &notFound, &alignedAsPairs, &lvCalls, &filtered, &extraAlignments,
+        &exactMatchFastPathHits, &truncatedAlignments, &cachedAlignments, &lowQualitySeedsSkipped, &reusedAlignments, &readsGivenUp};
+
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        if (!SaveOrLoad(file, false, counts[i], sizeof(_int64))) {
+            return false;
+        }
+    }
+
+    return SaveOrLoad(file, false, mapqHistogram, sizeof(mapqHistogram)) &&
+        SaveOrLoad(file, false, countOfBestHitsByWeightDepth, sizeof(countOfBestHitsByWeightDepth)) &&
+        SaveOrLoad(file, false, countOfAllHitsByWeightDepth, sizeof(countOfAllHitsByWeightDepth)) &&
+        SaveOrLoad(file, false, probabilityMassByWeightDepth, sizeof(probabilityMassByWeightDepth));
 }
@@ -27,6 +27,7 @@ Revision History:
 #pragma once
 #include "stdafx.h"
 #include "Compat.h"
+#include "AlignerOptions.h"
 
 struct AbstractStats
 {
@@ -53,6 +54,15 @@ struct AlignerStats : public AbstractStats
     _int64 lvCalls;
     _int64 filtered;
     _int64 extraAlignments;
+    _int64 exactMatchFastPathHits;  // Reads that BaseAligner aligned by its exact match fast path
+    _int64 truncatedAlignments;     // Reads whose search ran out of -workBudget
+    _int64 cachedAlignments;        // Reads that got the alignment of an identical earlier one from -dupCache
+    _int64 reusedAlignments;        // Reads that kept their verified input alignment, from -reuse
+    _int64 lowQualitySeedsSkipped;  // Seeds the first pass over a read moved off low quality bases (-sq)
+    _int64 readsGivenUp;            // Reads reported unaligned because their first seeds had no usable hits (-giveUp)
+    _int64 alignerMemoryTouched;    // For -mem: how much of the aligner threads' BigAllocators was paged in, in all of them
+    _int64 maxAlignerMemoryTouched; // and in the one that touched the most
+    _int64 readsToOtherIndices[MAX_OTHER_INDICES];  // Reads that aligned better to each -otherIndex and went to its output
     static const unsigned maxMapq = 70;
     unsigned mapqHistogram[maxMapq+1];
 
@@ -78,5 +88,14 @@ struct AlignerStats : public AbstractStats
     virtual void add(const AbstractStats* other);
 
     virtual void printHistograms(FILE* out);
+
+    //
+    // Write the counts to a file, or read them back over these, for -ckpt.  extra isn't included.
+    //
+    virtual bool save(FILE* file);
+    virtual bool load(FILE* file);
+
+protected:
+    static bool SaveOrLoad(FILE* file, bool saving, void* data, size_t size);
 };
 
@@ -0,0 +1,207 @@
+/*++
+
+Module Name:
+
+    AlignmentCache.cpp
+
+Abstract:
+
+    Reusing alignments of duplicate reads.  See AlignmentCache.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "AlignmentCache.h"
+#include "Read.h"
+#include "Util.h"
+
+AlignmentCache::AlignmentCache(size_t i_maxEntries)
+{
+    maxEntriesPerShard = __max((size_t)1, i_maxEntries / nShards);
+    for (int i = 0; i < nShards; i++) {
+        InitializeExclusiveLock(&shards[i].lock);
+    }
+}
+
+AlignmentCache::~AlignmentCache()
+{
+    for (int i = 0; i < nShards; i++) {
+        DestroyExclusiveLock(&shards[i].lock);
+    }
+}
+
+    _uint64
+AlignmentCache::hashBytes(const char *bytes, size_t length, _uint64 seed)
+{
+    _uint64 h = seed ^ util::fmix64(length + 1);
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        _uint64 chunk;
+        memcpy(&chunk, bytes + i, 8);
+        h = util::fmix64(h ^ chunk) + i;
+    }
+    _uint64 tail = 0;
+    memcpy(&tail, bytes + i, length - i);
+    return util::fmix64(h ^ tail);
+}
+
+    _uint64
+AlignmentCache::getKey(Read **reads, int nReads)
+{
+    _uint64 key = 0;
+    for (int i = 0; i < nReads; i++) {
+        key = hashBytes(reads[i]->getData(), reads[i]->getDataLength(), key);
+    }
+    return key;
+}
+
+    _uint64
+AlignmentCache::getQualityHash(Read **reads, int nReads)
+{
+    _uint64 hash = 1;
+    for (int i = 0; i < nReads; i++) {
+        hash = hashBytes(reads[i]->getQuality(), reads[i]->getDataLength(), hash);
+    }
+    return hash;
+}
+
+    const AlignmentCache::Entry *
+AlignmentCache::find(Shard *shard, _uint64 key, Read **reads, int nReads)
+{
+    std::unordered_map<_uint64, Entry>::const_iterator it = shard->entries.find(key);
+    if (it == shard->entries.end()) {
+        return NULL;
+    }
+
+    //
+    // The key's only a hash, so check that it's really the same read.
+    //
+    const Entry &entry = it->second;
+    size_t length0 = reads[0]->getDataLength();
+    size_t length1 = nReads > 1 ? reads[1]->getDataLength() : 0;
+    if (entry.length0 != (int)length0 || entry.bases.size() != length0 + length1 ||
+        memcmp(entry.bases.data(), reads[0]->getData(), length0) ||
+        (nReads > 1 && memcmp(entry.bases.data() + length0, reads[1]->getData(), length1))) {
+        return NULL;
+    }
+
+    if (entry.qualityHash != getQualityHash(reads, nReads)) {
+        return NULL;
+    }
+
+    return &entry;
+}
+
+    AlignmentCache::Entry *
+AlignmentCache::insert(Shard *shard, _uint64 key, Read **reads, int nReads)
+{
+    if (shard->entries.count(key) != 0) {
+        //
+        // Another thread got there first, or a different read (or qualities) with the same hash is there.  Either way
+        // keep what's there.
+        //
+        return NULL;
+    }
+
+    if (shard->entries.size() >= maxEntriesPerShard) {
+        shard->entries.erase(shard->entries.begin());
+    }
+
+    Entry &entry = shard->entries[key];
+    entry.length0 = reads[0]->getDataLength();
+    entry.bases.assign(reads[0]->getData(), reads[0]->getDataLength());
+    entry.truncated[0] = reads[0]->wasAlignmentTruncated();
+    entry.truncated[1] = false;
+    if (nReads > 1) {
+        entry.bases.append(reads[1]->getData(), reads[1]->getDataLength());
+        entry.truncated[1] = reads[1]->wasAlignmentTruncated();
+    }
+    entry.qualityHash = getQualityHash(reads, nReads);
+    entry.nSingleSecondaryResults[0] = entry.nSingleSecondaryResults[1] = 0;
+
+    return &entry;
+}
+
+    bool
+AlignmentCache::lookup(Read *read, SingleAlignmentResult *results, int maxSecondaryResults, int *o_nSecondaryResults)
+{
+    _uint64 key = getKey(&read, 1);
+    Shard *shard = getShard(key);
+
+    AcquireExclusiveLock(&shard->lock);
+    const Entry *entry = find(shard, key, &read, 1);
+    bool found = NULL != entry && (int)entry->singleResults.size() - 1 <= maxSecondaryResults;
+    if (found) {
+        std::copy(entry->singleResults.begin(), entry->singleResults.end(), results);
+        *o_nSecondaryResults = (int)entry->singleResults.size() - 1;
+        if (entry->truncated[0]) {
+            read->setAlignmentTruncated();
+        }
+    }
+    ReleaseExclusiveLock(&shard->lock);
+
+    return found;
+}
+
+    void
+AlignmentCache::add(Read *read, const SingleAlignmentResult *results, int nSecondaryResults)
+{
+    _uint64 key = getKey(&read, 1);
+    Shard *shard = getShard(key);
+
+    AcquireExclusiveLock(&shard->lock);
+    Entry *entry = insert(shard, key, &read, 1);
+    if (NULL != entry) {
+        entry->singleResults.assign(results, results + nSecondaryResults + 1);
+    }
+    ReleaseExclusiveLock(&shard->lock);
+}
+
+    bool
+AlignmentCache::lookupPair(Read **reads, PairedAlignmentResult *results, int maxSecondaryResults, int *o_nSecondaryResults,
+    SingleAlignmentResult *singleResults, int maxSingleSecondaryResults, int *o_nSingleSecondaryResults)
+{
+    _uint64 key = getKey(reads, NUM_READS_PER_PAIR);
+    Shard *shard = getShard(key);
+
+    AcquireExclusiveLock(&shard->lock);
+    const Entry *entry = find(shard, key, reads, NUM_READS_PER_PAIR);
+    bool found = NULL != entry && (int)entry->pairedResults.size() - 1 <= maxSecondaryResults &&
+        (int)entry->singleResults.size() <= maxSingleSecondaryResults;
+    if (found) {
+        std::copy(entry->pairedResults.begin(), entry->pairedResults.end(), results);
+        *o_nSecondaryResults = (int)entry->pairedResults.size() - 1;
+        std::copy(entry->singleResults.begin(), entry->singleResults.end(), singleResults);
+        for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+            o_nSingleSecondaryResults[whichRead] = entry->nSingleSecondaryResults[whichRead];
+            if (entry->truncated[whichRead]) {
+                reads[whichRead]->setAlignmentTruncated();
+            }
+        }
+    }
+    ReleaseExclusiveLock(&shard->lock);
+
+    return found;
+}
+
+    void
+AlignmentCache::addPair(Read **reads, const PairedAlignmentResult *results, int nSecondaryResults, const SingleAlignmentResult *singleResults,
+    const int *nSingleSecondaryResults)
+{
+    _uint64 key = getKey(reads, NUM_READS_PER_PAIR);
+    Shard *shard = getShard(key);
+
+    AcquireExclusiveLock(&shard->lock);
+    Entry *entry = insert(shard, key, reads, NUM_READS_PER_PAIR);
+    if (NULL != entry) {
+        entry->pairedResults.assign(results, results + nSecondaryResults + 1);
+        entry->singleResults.assign(singleResults, singleResults + nSingleSecondaryResults[0] + nSingleSecondaryResults[1]);
+        entry->nSingleSecondaryResults[0] = nSingleSecondaryResults[0];
+        entry->nSingleSecondaryResults[1] = nSingleSecondaryResults[1];
+    }
+    ReleaseExclusiveLock(&shard->lock);
+}
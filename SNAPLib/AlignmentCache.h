@@ -0,0 +1,101 @@
+/*++
+
+Module Name:
+
+    AlignmentCache.h
+
+Abstract:
+
+    Reusing the alignment of a read (or pair) for later copies of it (-dupCache).  Amplicon and low input libraries can
+    have thousands of reads with the same bases, and the aligner would do the same work on each of them.  Instead, after
+    a read is aligned its results are kept, keyed by a hash of its bases (both mates' for a pair, in order), and an
+    identical read that comes along later gets a copy of them without being aligned.  Only the name differs, and the
+    writer takes that from the read.
+
+    MAPQ depends on the qualities as well as the bases (mismatches cost according to their base quality), so a cached
+    result is only reused for a read whose qualities are the same too.  With binned qualities that's most duplicates;
+    a duplicate with different qualities is aligned in full, so the output is the same as without the cache.  Which
+    copy ends up in the cache depends on thread timing, but since they're all identical that doesn't matter, except
+    that the paired aligner's spacing can change as it learns the insert size distribution.
+
+    The cache is shared by all of the aligner threads and split into shards, each with its own lock, so they seldom
+    wait for one another.  When a shard is full an arbitrary entry makes room for the new one.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "AlignmentResult.h"
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+class Read;
+
+class AlignmentCache {
+public:
+    AlignmentCache(size_t i_maxEntries);
+    ~AlignmentCache();
+
+    //
+    // Single end.  results[0] is the primary alignment and results[1..] the secondaries, as BaseAligner::AlignRead
+    // fills them in.  lookup copies them out and returns true if read is in the cache with room for its secondaries, and
+    // otherwise returns false without touching results.
+    //
+    bool lookup(Read *read, SingleAlignmentResult *results, int maxSecondaryResults, int *o_nSecondaryResults);
+    void add(Read *read, const SingleAlignmentResult *results, int nSecondaryResults);
+
+    //
+    // Paired, with the results laid out as PairedEndAligner::align does: the pair results (primary first), and the
+    // single end secondaries of read 0 followed by those of read 1.
+    //
+    bool lookupPair(Read **reads, PairedAlignmentResult *results, int maxSecondaryResults, int *o_nSecondaryResults,
+        SingleAlignmentResult *singleResults, int maxSingleSecondaryResults, int *o_nSingleSecondaryResults);
+    void addPair(Read **reads, const PairedAlignmentResult *results, int nSecondaryResults, const SingleAlignmentResult *singleResults,
+        const int *nSingleSecondaryResults);
+
+private:
+    struct Entry {
+        std::string                         bases;          // All of the bases of the read, or of both mates
+        int                                 length0;        // How many of them are read 0's
+        _uint64                             qualityHash;
+        bool                                truncated[NUM_READS_PER_PAIR];  // -workBudget
+        std::vector<SingleAlignmentResult>  singleResults;
+        std::vector<PairedAlignmentResult>  pairedResults;
+        int                                 nSingleSecondaryResults[NUM_READS_PER_PAIR];
+    };
+
+    struct Shard {
+        ExclusiveLock                       lock;
+        std::unordered_map<_uint64, Entry>  entries;
+    };
+
+    static const int nShards = 64;
+
+    static _uint64 hashBytes(const char *bytes, size_t length, _uint64 seed);
+
+    //
+    // Finds the entry for these reads (nReads of them) if it's there and was made from the same qualities.  Call with
+    // the shard's lock held.
+    //
+    const Entry *find(Shard *shard, _uint64 key, Read **reads, int nReads);
+
+    //
+    // Makes room for and fills in all but the results of the entry for these reads, or returns NULL if it's already
+    // there.  Call with the shard's lock held.
+    //
+    Entry *insert(Shard *shard, _uint64 key, Read **reads, int nReads);
+
+    Shard *getShard(_uint64 key) {return &shards[key >> 58];}
+
+    static _uint64 getKey(Read **reads, int nReads);
+    static _uint64 getQualityHash(Read **reads, int nReads);
+
+    size_t      maxEntriesPerShard;
+    Shard       shards[nShards];
+};
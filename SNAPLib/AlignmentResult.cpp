@@ -23,18 +23,20 @@ Revision History:
 #include "AlignmentResult.h"
 #include "GenomeIndex.h"
 
-
-
-    int 
-SingleAlignmentResult::compareByContigAndScore(const void *first_, const void *second_)
+//
+// The genome that the contig compare routines look locations up in.  qsort() gives them no way to take it as a
+// parameter, and the daemon can have threads aligning against different indices at once, so it's per thread.
+//
+static thread_local const Genome *SortGenome = NULL;
+
+    static int
+CompareSingleByContigAndScore(const void *first_, const void *second_)
 {
-    extern GenomeIndex *g_index;    // Sorry, but no easy way to get this into here
-
     const SingleAlignmentResult *first = (SingleAlignmentResult *)first_;
     const SingleAlignmentResult *second = (SingleAlignmentResult *)second_;
 
-    int firstContig = g_index->getGenome()->getContigNumAtLocation(first->location);
-    int secondContig = g_index->getGenome()->getContigNumAtLocation(second->location);
+    int firstContig = SortGenome->getContigNumAtLocation(first->location);
+    int secondContig = SortGenome->getContigNumAtLocation(second->location);
 
     if (firstContig < secondContig) {
         return -1;
@@ -49,6 +51,13 @@ SingleAlignmentResult::compareByContigAndScore(const void *first_, const void *s
     }
  }
 
+    void
+SingleAlignmentResult::sortByContigAndScore(SingleAlignmentResult *results, int nResults, const Genome *genome)
+{
+    SortGenome = genome;
+    qsort(results, nResults, sizeof(*results), CompareSingleByContigAndScore);
+}
+
 int
     SingleAlignmentResult::compareByScore(const void *first_, const void *second_)
 {
@@ -64,16 +73,14 @@ int
     }
 }
 
-    int
-PairedAlignmentResult::compareByContigAndScore(const void *first_, const void *second_)
+    static int
+ComparePairedByContigAndScore(const void *first_, const void *second_)
 {
-    extern GenomeIndex *g_index;    // Sorry, but no easy way to get this into here
-
     const PairedAlignmentResult *first = (PairedAlignmentResult *)first_;
     const PairedAlignmentResult *second = (PairedAlignmentResult *)second_;
 
-    int firstContig = g_index->getGenome()->getContigNumAtLocation(first->location[0]);
-    int secondContig = g_index->getGenome()->getContigNumAtLocation(second->location[0]);
+    int firstContig = SortGenome->getContigNumAtLocation(first->location[0]);
+    int secondContig = SortGenome->getContigNumAtLocation(second->location[0]);
 
     if (firstContig < secondContig) {
         return -1;
@@ -88,6 +95,13 @@ PairedAlignmentResult::compareByContigAndScore(const void *first_, const void *s
     }
 }
 
+    void
+PairedAlignmentResult::sortByContigAndScore(PairedAlignmentResult *results, int nResults, const Genome *genome)
+{
+    SortGenome = genome;
+    qsort(results, nResults, sizeof(*results), ComparePairedByContigAndScore);
+}
+
 int
 PairedAlignmentResult::compareByScore(const void *first_, const void *second_)
 {
@@ -104,4 +118,40 @@ PairedAlignmentResult::compareByScore(const void *first_, const void *second_)
     } else {
         return 0;
     }
-}
\ No newline at end of file
+}
+    bool
+SingleAlignmentResult::isBetterThan(const SingleAlignmentResult &other) const
+{
+    if ((NotFound != status) != (NotFound != other.status)) {
+        return NotFound != status;
+    }
+    if (NotFound == status) {
+        return false;
+    }
+    return score < other.score || (score == other.score && mapq > other.mapq);
+}
+
+    bool
+PairedAlignmentResult::isBetterThan(const PairedAlignmentResult &other) const
+{
+    int nFound = 0, otherNFound = 0;
+    int totalScore = 0, otherTotalScore = 0;
+    int totalMapq = 0, otherTotalMapq = 0;
+    for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+        if (NotFound != status[whichRead]) {
+            nFound++;
+            totalScore += score[whichRead];
+            totalMapq += mapq[whichRead];
+        }
+        if (NotFound != other.status[whichRead]) {
+            otherNFound++;
+            otherTotalScore += other.score[whichRead];
+            otherTotalMapq += other.mapq[whichRead];
+        }
+    }
+
+    if (nFound != otherNFound) {
+        return nFound > otherNFound;
+    }
+    return 0 != nFound && (totalScore < otherTotalScore || (totalScore == otherTotalScore && totalMapq > otherTotalMapq));
+}
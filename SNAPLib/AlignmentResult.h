@@ -31,7 +31,7 @@ Revision History:
 
 class Read;
 
-enum AlignmentResult {NotFound, SingleHit, MultipleHits, UnknownAlignment}; // BB: Changed Unknown to UnknownAlignment because of a conflict w/Windows headers
+enum AlignmentResult : unsigned char {NotFound, SingleHit, MultipleHits, UnknownAlignment}; // BB: Changed Unknown to UnknownAlignment because of a conflict w/Windows headers
 
 bool isAValidAlignmentResult(AlignmentResult result);
 
@@ -46,19 +46,28 @@ inline const char *AlignmentResultToString(AlignmentResult result) {
     }
 }
 
+//
+// The results are copied around a lot (hundreds of secondary results per read with -om on RNA), so they're packed: the
+// location first, then the score, then the small fields in a byte each.  A SingleAlignmentResult is 16 bytes and a
+// PairedAlignmentResult 32, so four or two of them fit in a cache line.  Parts of the result that are only wanted for
+// the primary alignment, and then only for statistics, are kept apart in PairedAlignmentDetails.
+//
 struct SingleAlignmentResult {
-	AlignmentResult status;
-
     GenomeLocation  location;	// Aligned genome location.
-    Direction       direction;	// Did we match the reverse complement? 
     int             score;		// score of each end if matched
+    _uint8          mapq;		// mapping quality, encoded like a Phred score (but as an integer, not ASCII Phred + 33).
+    AlignmentResult status;
+    _uint8          direction;	// Did we match the reverse complement? (A Direction)
 
-    int             mapq;		// mapping quality, encoded like a Phred score (but as an integer, not ASCII Phred + 33).
-
-    static int compareByContigAndScore(const void *first, const void *second);      // qsort()-style compare routine
+    static void sortByContigAndScore(SingleAlignmentResult *results, int nResults, const Genome *genome);
     static int compareByScore(const void *first, const void *second);               // qsort()-style compare routine
+
+    // For -otherIndex, where the alignments are against different indices: found beats not found, then fewer edits, then higher MAPQ
+    bool isBetterThan(const SingleAlignmentResult &other) const;
 };
 
+static_assert(sizeof(SingleAlignmentResult) == 16, "SingleAlignmentResult should pack into 16 bytes");
+
 // Does an AlignmentResult represent a single location?
 inline bool isOneLocation(AlignmentResult result) {
     return result == SingleHit;
@@ -67,27 +76,138 @@ inline bool isOneLocation(AlignmentResult result) {
 const int NUM_READS_PER_PAIR = 2;    // This is just to make it clear what the array subscripts are, it doesn't ever make sense to change
 
 struct PairedAlignmentResult {
+	GenomeLocation location[NUM_READS_PER_PAIR];// Genome location of each read.
+
+	int score[NUM_READS_PER_PAIR];              // score of each end if matched
+
+	_uint8 mapq[NUM_READS_PER_PAIR];            // mapping quality of each end, encoded like a Phred score (but as an integer, not ASCII Phred + 33).
+
 	AlignmentResult status[NUM_READS_PER_PAIR]; // SingleHit or CertainHit if aligned, MultipleHit if matches DB
 	// but not confidently aligned, or NotFound.
 
-	GenomeLocation location[NUM_READS_PER_PAIR];// Genome location of each read.
-
-	Direction direction[NUM_READS_PER_PAIR];    // Did we match the reverse complement? In general the two reads should have
+	_uint8 direction[NUM_READS_PER_PAIR];       // Did we match the reverse complement? (A Direction)  In general the two reads should have
 	// opposite orientations because they're part of the same original fragment,
 	// but it seems possible for a piece of the genome to get cut cleanly and flip
 	// in a translocation event, which would cause both ends of a fragment aligning
 	// there to be in the same orientation w.r.t. the reference genome.
 
-	int score[NUM_READS_PER_PAIR];              // score of each end if matched
-
-	int mapq[NUM_READS_PER_PAIR];               // mapping quality of each end, encoded like a Phred score (but as an integer, not ASCII Phred + 33).
-
 	bool fromAlignTogether;                     // Was this alignment created by aligning both reads together, rather than from some combination of single-end aligners?
 	bool alignedAsPair;                         // Were the reads aligned as a pair, or separately?
+
+    static void sortByContigAndScore(PairedAlignmentResult *results, int nResults, const Genome *genome);
+    static int compareByScore(const void *first, const void *second);               // qsort()-style compare routine
+
+    // As for SingleAlignmentResult, with more mates found beating fewer, and the found mates' edits and MAPQs added up
+    bool isBetterThan(const PairedAlignmentResult &other) const;
+};
+
+static_assert(sizeof(PairedAlignmentResult) == 32, "PairedAlignmentResult should pack into 32 bytes");
+
+//
+// The rest of a primary paired result, which PairedEndAligner::getAlignmentDetails returns.
+//
+struct PairedAlignmentDetails {
 	_int64 nanosInAlignTogether;
 	unsigned nLVCalls;
 	unsigned nSmallHits;
 
-    static int compareByContigAndScore(const void *first, const void *second);      // qsort()-style compare routine
-    static int compareByScore(const void *first, const void *second);               // qsort()-style compare routine
-};
\ No newline at end of file
+    PairedAlignmentDetails() : nanosInAlignTogether(0), nLVCalls(0), nSmallHits(0) {}
+};
+
+//
+// Collecting secondary alignments when only the best few will be returned (-omax without -mpc).  Results go into the
+// buffer in the order they're found until maxToKeep of them are there.  After that it's made into a heap with the worst
+// result on top, and each new result either replaces the top or, if it's no better, is dropped without being copied.
+// That keeps the buffer at maxToKeep and avoids sorting all of the candidates at the end; *heapified tells the caller
+// that the results need sorting before they're truncated, since the final filter can leave fewer than maxToKeep.
+//
+// maxToKeep is MAXINT32 when nothing may be dropped (-mpc is applied before -omax, so it has to see everything).  Returns
+// false if the buffer is full, which the callers treat as a bug.
+//
+inline int SecondaryResultScore(const SingleAlignmentResult &result) {
+    return result.score;
+}
+
+inline int SecondaryResultScore(const PairedAlignmentResult &result) {
+    return result.score[0] + result.score[1];
+}
+
+template<class RESULT> void SiftDownSecondaryResult(RESULT *results, int nResults, int i)
+{
+    RESULT moving = results[i];
+    int movingScore = SecondaryResultScore(moving);
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= nResults) {
+            break;
+        }
+        if (child + 1 < nResults && SecondaryResultScore(results[child + 1]) > SecondaryResultScore(results[child])) {
+            child++;
+        }
+        if (SecondaryResultScore(results[child]) <= movingScore) {
+            break;
+        }
+        results[i] = results[child];
+        i = child;
+    }
+    results[i] = moving;
+}
+
+template<class RESULT> bool AddSecondaryResult(
+    RESULT         *results,
+    int            *nResults,       // in/out
+    int             bufferSize,
+    int             maxToKeep,
+    bool           *heapified,      // in/out, false before the first one for a read
+    const RESULT   &result)
+{
+    if (*nResults < maxToKeep) {
+        if (*nResults >= bufferSize) {
+            return false;
+        }
+        results[(*nResults)++] = result;
+        return true;
+    }
+
+    if (!*heapified) {
+        for (int i = *nResults / 2 - 1; i >= 0; i--) {
+            SiftDownSecondaryResult(results, *nResults, i);
+        }
+        *heapified = true;
+    }
+
+    if (0 == *nResults || SecondaryResultScore(result) >= SecondaryResultScore(results[0])) {
+        return true;    // Can't make the cut
+    }
+
+    results[0] = result;
+    SiftDownSecondaryResult(results, *nResults, 0);
+    return true;
+}
+
+//
+// How much work an aligner has done, counted since it was created.  Take the difference across a call to align to
+// get what one read (or pair) cost.
+//
+struct AlignerWorkCounters {
+    _int64  hashTableLookups;       // Seeds looked up in the index
+    _int64  locationsScored;        // Candidate locations scored
+    _int64  lvCalls;                // Calls to the edit distance (Landau-Vishkin) code
+    _int64  popularSeedsSkipped;    // Seeds with too many hits to use
+
+    AlignerWorkCounters() : hashTableLookups(0), locationsScored(0), lvCalls(0), popularSeedsSkipped(0) {}
+
+    void add(const AlignerWorkCounters &other) {
+        hashTableLookups += other.hashTableLookups;
+        locationsScored += other.locationsScored;
+        lvCalls += other.lvCalls;
+        popularSeedsSkipped += other.popularSeedsSkipped;
+    }
+
+    void subtract(const AlignerWorkCounters &other) {
+        hashTableLookups -= other.hashTableLookups;
+        locationsScored -= other.locationsScored;
+        lvCalls -= other.lvCalls;
+        popularSeedsSkipped -= other.popularSeedsSkipped;
+    }
+};
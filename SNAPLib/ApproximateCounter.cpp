@@ -25,6 +25,13 @@ void ApproximateCounter::add(_uint64 value)
     buckets[bucket] |= (1LL << firstZero);
 }
 
+void ApproximateCounter::merge(const ApproximateCounter &other)
+{
+    for (int i = 0; i < BUCKETS; i++) {
+        buckets[i] |= other.buckets[i];
+    }
+}
+
 
 unsigned ApproximateCounter::getCount()
 {
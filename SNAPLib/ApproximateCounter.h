@@ -10,12 +10,20 @@ public:
 
     void add(_uint64 value);
 
+    // Add in the items that another counter has seen, as if they'd all been added to this one.
+    void merge(const ApproximateCounter &other);
+
     unsigned getCount();
 
 private:
     static const int SHIFT = 9;
     static const int BUCKETS = 1 << SHIFT;
 
+public:
+    static const size_t SizeInBytes = BUCKETS * sizeof(_uint64);
+
+private:
+
     std::vector<_uint64> buckets;
 
     // MurmurHash3 finalization step from http://sites.google.com/site/murmurhash
@@ -0,0 +1,388 @@
+/*++
+
+Module Name:
+
+    Autotune.cpp
+
+Abstract:
+
+    Choosing the seed count, -h, -ms and -D by aligning a sample of the input with each of a few settings.  See
+    Autotune.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "options.h"
+#include "Autotune.h"
+#include "AlignerOptions.h"
+#include "PairedAligner.h"
+#include "EmbeddedAligner.h"
+#include "GenomeIndex.h"
+#include "FASTQ.h"
+#include "DataReader.h"
+#include "Error.h"
+#include "exit.h"
+#include <vector>
+
+struct AutotuneSetting {
+    unsigned        numSeeds;           // numSeedsFromCommandLine, or 0 for seedCoverage
+    double          seedCoverage;
+    unsigned        maxHits;
+    int             minWeightToCheck;
+    unsigned        extraSearchDepth;
+
+    volatile _int64 nanos;              // aligning the sample, summed over the threads
+    _int64          nLost;              // of the reference's confident alignments
+    GenomeLocation *locations;          // per read (or end), InvalidGenomeLocation if not aligned
+    _uint8         *directions;
+    _uint8         *mapqs;
+};
+
+struct AutotuneSample {
+    AlignerOptions     *options;
+    GenomeIndex        *index;
+    bool                paired;
+    int                 nReads;             // reads, or ends of pairs
+    const char        **ids;
+    unsigned           *idLengths;
+    const char        **data;
+    const char        **qualities;
+    unsigned           *lengths;
+    std::vector<char *> arenas;             // what ids, data and qualities point into
+
+    AutotuneSetting    *settings;
+    int                 nSettings;
+    int                 nThreads;
+    volatile int        nextThread;
+    volatile int        nRunning;
+    SingleWaiterObject  done;
+};
+
+    static char *
+CopyToArena(AutotuneSample *sample, const char *from, unsigned length, char **arena, size_t *arenaLeft)
+{
+    if (*arenaLeft < length + 1) {
+        size_t size = __max((size_t)length + 1, (size_t)1024 * 1024);
+        *arena = new char[size];
+        *arenaLeft = size;
+        sample->arenas.push_back(*arena);
+    }
+    char *copy = *arena;
+    memcpy(copy, from, length);
+    copy[length] = '\0';
+    *arena += length + 1;
+    *arenaLeft -= length + 1;
+    return copy;
+}
+
+    static void
+AddToSample(AutotuneSample *sample, int which, Read *read, char **arena, size_t *arenaLeft)
+{
+    sample->ids[which] = CopyToArena(sample, read->getId(), read->getIdLength(), arena, arenaLeft);
+    sample->idLengths[which] = read->getIdLength();
+    sample->data[which] = CopyToArena(sample, read->getUnclippedData(), read->getUnclippedLength(), arena, arenaLeft);
+    sample->qualities[which] = CopyToArena(sample, read->getUnclippedQuality(), read->getUnclippedLength(), arena, arenaLeft);
+    sample->lengths[which] = read->getUnclippedLength();
+}
+
+//
+// The first options->autotuneReads reads or pairs of the first input, copied out of the reader's buffers.
+//
+    static bool
+ReadAutotuneSample(AutotuneSample *sample)
+{
+    AlignerOptions *options = sample->options;
+    SNAPFile *input = &options->inputs[0];
+    if (input->isStdio || (input->fileType != FASTQFile && input->fileType != InterleavedFASTQFile)) {
+        WriteErrorMessage("-autotune can only sample FASTQ files; leaving the seed and hit settings as they are\n");
+        return false;
+    }
+
+    ReaderContext context;
+    memset(&context, 0, sizeof(context));
+    context.genome = sample->index->getGenome();
+    context.clipping = options->clipping;
+    context.defaultReadGroup = options->defaultReadGroup;
+    context.paired = sample->paired;
+
+    const int bufferCount = 4;
+    DataSupplier *supplier0 = input->isCompressed ? DataSupplier::CompressedDefaultForFile(input->fileName) : DataSupplier::Default;
+    int maxReads = options->autotuneReads * (sample->paired ? 2 : 1);
+    sample->ids = new const char *[maxReads];
+    sample->idLengths = new unsigned[maxReads];
+    sample->data = new const char *[maxReads];
+    sample->qualities = new const char *[maxReads];
+    sample->lengths = new unsigned[maxReads];
+    sample->nReads = 0;
+
+    char *arena = NULL;
+    size_t arenaLeft = 0;
+    Read read[2];
+    if (! sample->paired) {
+        FASTQReader *reader = FASTQReader::create(supplier0, input->fileName, bufferCount, 0, DataSupplier::InputFileSize(input->fileName), context);
+        while (sample->nReads < maxReads && reader->getNextRead(&read[0])) {
+            AddToSample(sample, sample->nReads++, &read[0], &arena, &arenaLeft);
+        }
+        delete reader;
+    } else if (input->fileType == InterleavedFASTQFile) {
+        PairedInterleavedFASTQReader *reader = PairedInterleavedFASTQReader::create(supplier0, input->fileName, bufferCount, 0,
+            DataSupplier::InputFileSize(input->fileName), context);
+        while (sample->nReads < maxReads && reader->getNextReadPair(&read[0], &read[1])) {
+            AddToSample(sample, sample->nReads++, &read[0], &arena, &arenaLeft);
+            AddToSample(sample, sample->nReads++, &read[1], &arena, &arenaLeft);
+        }
+        delete reader;
+    } else {
+        DataSupplier *supplier1 = input->isCompressed ? DataSupplier::CompressedDefaultForFile(input->secondFileName) : DataSupplier::Default;
+        FASTQReader *reader0 = FASTQReader::create(supplier0, input->fileName, bufferCount, 0, DataSupplier::InputFileSize(input->fileName), context);
+        FASTQReader *reader1 = FASTQReader::create(supplier1, input->secondFileName, bufferCount, 0,
+            DataSupplier::InputFileSize(input->secondFileName), context);
+        while (sample->nReads < maxReads && reader0->getNextRead(&read[0]) && reader1->getNextRead(&read[1])) {
+            AddToSample(sample, sample->nReads++, &read[0], &arena, &arenaLeft);
+            AddToSample(sample, sample->nReads++, &read[1], &arena, &arenaLeft);
+        }
+        delete reader0;
+        delete reader1;
+    }
+
+    if (0 == sample->nReads) {
+        WriteErrorMessage("-autotune found no reads to sample; leaving the seed and hit settings as they are\n");
+        return false;
+    }
+    return true;
+}
+
+//
+// Align this thread's share of the sample, reads [first, end), with a setting.
+//
+    static void
+RunAutotuneSetting(AutotuneSample *sample, AutotuneSetting *setting, int first, int end)
+{
+    AlignerOptions *options = sample->paired ? new PairedAlignerOptions(*(PairedAlignerOptions *)sample->options) : new AlignerOptions(*sample->options);
+    options->numSeedsFromCommandLine = setting->numSeeds;
+    options->seedCoverage = setting->seedCoverage;
+    options->maxHits = setting->maxHits;
+    options->minWeightToCheck = setting->minWeightToCheck;
+    options->extraSearchDepth = setting->extraSearchDepth;
+
+    //
+    // The aligners clip their reads, so each read is made afresh from the sample.
+    //
+    Read read[2];
+    Read *reads[2] = {&read[0], &read[1]};
+    _int64 start;
+    if (sample->paired) {
+        EmbeddedPairedAligner *aligner = new EmbeddedPairedAligner(sample->index, (PairedAlignerOptions *)options);
+        start = timeInNanos();
+        for (int i = first; i < end; i += 2) {
+            for (int r = 0; r < 2; r++) {
+                read[r].init(sample->ids[i + r], sample->idLengths[i + r], sample->data[i + r], sample->qualities[i + r], sample->lengths[i + r]);
+            }
+            PairedAlignmentResult result;
+            aligner->alignBatch(reads, 1, &result);
+            for (int r = 0; r < 2; r++) {
+                setting->locations[i + r] = result.status[r] == NotFound ? InvalidGenomeLocation : result.location[r];
+                setting->directions[i + r] = result.direction[r];
+                setting->mapqs[i + r] = result.mapq[r];
+            }
+        }
+        InterlockedAdd64AndReturnNewValue(&setting->nanos, timeInNanos() - start);
+        delete aligner;
+    } else {
+        EmbeddedSingleAligner *aligner = new EmbeddedSingleAligner(sample->index, options);
+        start = timeInNanos();
+        for (int i = first; i < end; i++) {
+            read[0].init(sample->ids[i], sample->idLengths[i], sample->data[i], sample->qualities[i], sample->lengths[i]);
+            SingleAlignmentResult result;
+            aligner->alignBatch(reads, 1, &result);
+            setting->locations[i] = result.status == NotFound ? InvalidGenomeLocation : result.location;
+            setting->directions[i] = result.direction;
+            setting->mapqs[i] = result.mapq;
+        }
+        InterlockedAdd64AndReturnNewValue(&setting->nanos, timeInNanos() - start);
+        delete aligner;
+    }
+
+    delete options;
+}
+
+//
+// Every thread runs every setting on its share of the sample, in the same order, so that each setting is timed with
+// the others' threads doing the same work it is (rather than, say, the last setting having the machine to itself).
+//
+    static void
+AutotuneThreadMain(void *param)
+{
+    AutotuneSample *sample = (AutotuneSample *)param;
+    int thread = InterlockedIncrementAndReturnNewValue(&sample->nextThread) - 1;
+    int readsPerAlignment = sample->paired ? 2 : 1;
+    int nAlignments = sample->nReads / readsPerAlignment;
+    int first = (int)((_int64)nAlignments * thread / sample->nThreads) * readsPerAlignment;
+    int end = (int)((_int64)nAlignments * (thread + 1) / sample->nThreads) * readsPerAlignment;
+    for (int s = 0; s < sample->nSettings; s++) {
+        RunAutotuneSetting(sample, &sample->settings[s], first, end);
+    }
+    if (0 == InterlockedDecrementAndReturnNewValue(&sample->nRunning)) {
+        SignalSingleWaiterObject(&sample->done);
+    }
+}
+
+    static const char *
+DescribeAutotuneSetting(const AutotuneSetting *setting, char *buffer, size_t bufferSize)
+{
+    int used = 0 != setting->numSeeds ? snprintf(buffer, bufferSize, "-n %u", setting->numSeeds) :
+        snprintf(buffer, bufferSize, "-sc %g", setting->seedCoverage);
+    snprintf(buffer + used, bufferSize - used, " -h %u -ms %d -D %u", setting->maxHits, setting->minWeightToCheck, setting->extraSearchDepth);
+    return buffer;
+}
+
+    static void
+FreeAutotuneSample(AutotuneSample *sample)
+{
+    for (size_t i = 0; i < sample->arenas.size(); i++) {
+        delete[] sample->arenas[i];
+    }
+    delete[] sample->ids;
+    delete[] sample->idLengths;
+    delete[] sample->data;
+    delete[] sample->qualities;
+    delete[] sample->lengths;
+    delete sample;
+}
+
+    bool
+AutotuneAlignerOptions(GenomeIndex *index, AlignerOptions *options, bool paired)
+{
+    AutotuneSample *sample = new AutotuneSample;
+    sample->options = options;
+    sample->index = index;
+    sample->paired = paired;
+    if (! ReadAutotuneSample(sample)) {
+        FreeAutotuneSample(sample);
+        return false;
+    }
+
+    //
+    // The reference (settings[0]) is the most sensitive; the rest are the settings given and cheaper ones around them.
+    //
+    const int maxSettings = 9;
+    AutotuneSetting base;
+    memset(&base, 0, sizeof(base));
+    base.numSeeds = options->numSeedsFromCommandLine;
+    base.seedCoverage = options->seedCoverage;
+    base.maxHits = options->maxHits;
+    base.minWeightToCheck = options->minWeightToCheck;
+    base.extraSearchDepth = options->extraSearchDepth;
+
+    //                             seeds   hits    ms  D
+    static const double scales[maxSettings][4] = {
+                                {2,     2,      0,  0},     // the reference, with -ms 1
+                                {1,     1,      0,  0},     // as given
+                                {1,     1,      0,  -1},
+                                {0.75,  1,      0,  0},
+                                {0.5,   1,      0,  0},
+                                {1,     0.5,    0,  0},
+                                {0.5,   0.5,    0,  0},
+                                {0.75,  0.5,    0,  -1},
+                                {1,     1,      1,  0}};
+
+    sample->settings = new AutotuneSetting[maxSettings];
+    sample->nSettings = 0;
+    for (int i = 0; i < maxSettings; i++) {
+        AutotuneSetting setting = base;
+        if (0 != base.numSeeds) {
+            setting.numSeeds = __max(1, (unsigned)(base.numSeeds * scales[i][0]));
+        } else {
+            setting.seedCoverage = base.seedCoverage * scales[i][0];
+        }
+        setting.maxHits = __max(1, (unsigned)(base.maxHits * scales[i][1]));
+        setting.minWeightToCheck = 0 == i ? 1 : base.minWeightToCheck + (int)scales[i][2];
+        if (scales[i][3] < 0 && 0 == base.extraSearchDepth) {
+            continue;   // no shallower -D to try
+        }
+        setting.extraSearchDepth = base.extraSearchDepth + (int)scales[i][3];
+        sample->settings[sample->nSettings++] = setting;
+    }
+
+    for (int s = 0; s < sample->nSettings; s++) {
+        sample->settings[s].locations = new GenomeLocation[sample->nReads];
+        sample->settings[s].directions = new _uint8[sample->nReads];
+        sample->settings[s].mapqs = new _uint8[sample->nReads];
+    }
+
+    int nAlignments = sample->nReads / (paired ? 2 : 1);
+    int nThreads = __max(1, __min(options->numThreads, nAlignments));
+    WriteStatusMessage("Autotuning on %d %s with %d settings in %d threads...", nAlignments, paired ? "pairs" : "reads", sample->nSettings, nThreads);
+    _int64 start = timeInMillis();
+    sample->nThreads = nThreads;
+    sample->nextThread = 0;
+    sample->nRunning = nThreads;
+    CreateSingleWaiterObject(&sample->done);
+    for (int i = 0; i < nThreads; i++) {
+        if (! StartNewThread(AutotuneThreadMain, sample)) {
+            WriteErrorMessage("Unable to start an autotune thread\n");
+            soft_exit(1);
+        }
+    }
+    WaitForSingleWaiterObject(&sample->done);
+    DestroySingleWaiterObject(&sample->done);
+    WriteStatusMessage(" %llds\n", (timeInMillis() - start + 500) / 1000);
+
+    //
+    // A setting loses a read that the reference aligned confidently if it doesn't put it in the same place (within -d,
+    // the same direction) too.
+    //
+    AutotuneSetting *reference = &sample->settings[0];
+    _int64 nConfident = 0;
+    for (int i = 0; i < sample->nReads; i++) {
+        if (reference->locations[i] == InvalidGenomeLocation || reference->mapqs[i] < MAPQ_LIMIT_FOR_SINGLE_HIT) {
+            continue;
+        }
+        nConfident++;
+        for (int s = 1; s < sample->nSettings; s++) {
+            AutotuneSetting *setting = &sample->settings[s];
+            if (setting->locations[i] == InvalidGenomeLocation || setting->directions[i] != reference->directions[i] ||
+                    DistanceBetweenGenomeLocations(setting->locations[i], reference->locations[i]) > options->maxDist) {
+                setting->nLost++;
+            }
+        }
+    }
+
+    int chosen = 0;
+    for (int s = 1; s < sample->nSettings; s++) {
+        AutotuneSetting *setting = &sample->settings[s];
+        if (setting->nLost * 100.0 <= options->autotuneLoss * __max(1, nConfident) && setting->nanos < sample->settings[chosen].nanos) {
+            chosen = s;
+        }
+    }
+
+    char description[100];
+    WriteStatusMessage("  %-30s %14s %10s\n", "Setting", "Reads/s", "Loss");
+    for (int s = 0; s < sample->nSettings; s++) {
+        AutotuneSetting *setting = &sample->settings[s];
+        WriteStatusMessage("%s %-30s %14.0f %9.3f%%%s\n", s == chosen ? "*" : " ", DescribeAutotuneSetting(setting, description, sizeof(description)),
+            (double)sample->nReads * nThreads * 1000000000 / __max(1, setting->nanos), setting->nLost * 100.0 / __max(1, nConfident),
+            0 == s ? " (reference)" : "");
+    }
+    WriteStatusMessage("Autotune chose %s\n", DescribeAutotuneSetting(&sample->settings[chosen], description, sizeof(description)));
+
+    AutotuneSetting *best = &sample->settings[chosen];
+    options->numSeedsFromCommandLine = best->numSeeds;
+    options->seedCoverage = best->seedCoverage;
+    options->maxHits = best->maxHits;
+    options->minWeightToCheck = best->minWeightToCheck;
+    options->extraSearchDepth = best->extraSearchDepth;
+
+    for (int s = 0; s < sample->nSettings; s++) {
+        delete[] sample->settings[s].locations;
+        delete[] sample->settings[s].directions;
+        delete[] sample->settings[s].mapqs;
+    }
+    delete[] sample->settings;
+    FreeAutotuneSample(sample);
+    return true;
+}
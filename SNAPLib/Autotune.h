@@ -0,0 +1,37 @@
+/*++
+
+Module Name:
+
+    Autotune.h
+
+Abstract:
+
+    -autotune: choosing the seed count, -h, -ms and -D for the input at hand, rather than by hand for each read length
+    and library.  Once the index is loaded, the first -autotuneReads reads (or pairs) of the input are aligned with a
+    handful of settings around the ones given, each spread over the aligner threads.  The most sensitive of
+    them (twice the seeds and twice -h, with -ms 1) is taken as the truth, and each setting's loss is the percentage of
+    the reads that it aligned confidently (MAPQ 10 or more) that another setting aligns somewhere else or not at all.
+    The fastest setting that loses no more than -autotune percent is then used for the whole input.
+
+    Only FASTQ input (one file, a pair of files or interleaved) can be sampled, since the sample is read straight from
+    the start of the first input file.  For anything else the settings are left as given.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class GenomeIndex;
+struct AlignerOptions;
+
+//
+// Change options' seed count (or coverage), maxHits, minWeightToCheck and extraSearchDepth to the fastest that's
+// within options->autotuneLoss, saying what was measured.  options is a PairedAlignerOptions if paired.  Returns false,
+// having changed nothing, if the input can't be sampled.
+//
+bool AutotuneAlignerOptions(GenomeIndex *index, AlignerOptions *options, bool paired);
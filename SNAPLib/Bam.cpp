@@ -33,18 +33,33 @@ Environment:
 #include "VariableSizeMap.h"
 #include "PairedAligner.h"
 #include "GzipDataWriter.h"
+#include "GzipBlockCodec.h"
 #include "Error.h"
+#include "Simd.h"
+#include "SpliceJunctions.h"
+#include "ReadNameIndex.h"
 
 using std::max;
 using std::min;
 using util::strnchr;
 
-BAMReader::BAMReader(const ReaderContext& i_context) : ReadReader(i_context)
+BAMReader::BAMReader(const ReaderContext& i_context)
+    : ReadReader(i_context), data(NULL), extraOffset(0), deferDecoding(false), fileName(NULL), bufferCount(0), chunks(NULL), currentChunk(0),
+    chunkReaders(NULL), chunkHolds(NULL), regionRefID(-1), regionBegin(0), regionEnd(0)
 {
 }
 
 BAMReader::~BAMReader()
 {
+    if (NULL != chunks) {
+        for (int i = 0; i < (int) chunks->size(); i++) {
+            delete chunkReaders[i];
+        }
+        delete [] chunkReaders;
+        delete [] chunkHolds;
+        delete chunks;
+        DestroyExclusiveLock(&chunkLock);
+    }
 }
 
     bool
@@ -60,11 +75,13 @@ BAMReader::getNextReadPair(
 
     void
 BAMReader::init(
-    const char *fileName,
-    int bufferCount,
+    const char *i_fileName,
+    int i_bufferCount,
     _int64 startingOffset,
     _int64 amountOfFileToProcess)
 {
+    fileName = i_fileName;
+    bufferCount = i_bufferCount;
     // todo: integrate supplier models
     // might need up to 3x extra for expanded sequence + quality + cigar data
     if (!strcmp("-", fileName)) {
@@ -82,6 +99,13 @@ BAMReader::init(
         readHeader(fileName);
     }
 
+    if (NULL != context.region || context.unmappedOnly) {
+        loadChunks(fileName);
+        currentChunk = -1;
+        startNextChunk(); // (with the reader that read the header, if there's a chunk at all)
+        return;
+    }
+
     _ASSERT(context.headerBytes > 0);
     reinit(startingOffset, amountOfFileToProcess);
     if ((size_t) startingOffset < context.headerBytes) {
@@ -163,9 +187,52 @@ BAMReader::readHeader(
 
 	int n_ref = header->n_ref();
 	BAMHeaderRefSeq* refSeq = header->firstRefSeq();
+    const char* regionName = context.region;
+    size_t regionNameLength = NULL == regionName ? 0 : strlen(regionName);
+    if (NULL != regionName) {
+        //
+        // chr, chr:begin or chr:begin-end, where begin and end can have commas in them; a name can have ':' in it too,
+        // so only what's after the last one is a range, and only if it looks like one.
+        //
+        const char* colon = strrchr(regionName, ':');
+        regionBegin = 0;
+        regionEnd = BAMAlignment::BAI_MAX_LENGTH;
+        if (NULL != colon && colon[1] != 0 && strspn(colon + 1, "0123456789,-") == strlen(colon + 1)) {
+            _int64 values[2] = {0, BAMAlignment::BAI_MAX_LENGTH};
+            int which = 0;
+            bool digits = false;
+            for (const char* c = colon + 1; *c != 0; c++) {
+                if (*c == '-') {
+                    if (which == 1 || ! digits) {
+                        break;
+                    }
+                    which = 1;
+                    values[1] = 0;
+                    digits = false;
+                } else if (*c != ',') {
+                    values[which] = values[which] * 10 + (*c - '0');
+                    digits = true;
+                }
+            }
+            if (values[0] < 1 || ! digits || values[1] < values[0]) {
+                WriteErrorMessage("-region %s: the range has to be begin-end, from 1, with end no less than begin\n", regionName);
+                soft_exit(1);
+            }
+            regionBegin = values[0] - 1;
+            regionEnd = values[1];
+            regionNameLength = colon - regionName;
+        }
+    }
 	for (int i = 0; i < n_ref; i++, refSeq = refSeq->next()) {
-		// just advance
+        if (NULL != regionName && (size_t) refSeq->l_name == regionNameLength + 1 && 0 == memcmp(refSeq->name(), regionName, regionNameLength)) {
+            regionRefID = i;
+            regionEnd = min(regionEnd, (_int64) refSeq->l_ref());
+        }
 	}
+    if (NULL != regionName && -1 == regionRefID) {
+        WriteErrorMessage("-region %s: there's no contig %.*s in %s\n", regionName, (int) regionNameLength, regionName, fileName);
+        soft_exit(1);
+    }
 	
 	char* p = new char[textHeaderSize + 1];
     memcpy(p, header->text(), textHeaderSize);
@@ -197,6 +264,250 @@ BAMReader::reinit(
     extraOffset = 0;
 }
 
+    void
+BAMReader::loadChunks(
+    const char* fileName)
+/*++
+
+Routine Description:
+
+    Read the file's BAI (which SNAP writes next to sorted BAM output, as samtools index does) for the chunks that the
+    records -region or -unmappedOnly want can be in:
+
+    -region: the chunks of the bins that overlap the range, less the ones that end before the first record that does,
+    by the linear index.
+
+    -unmappedOnly: the file range of each contig that its metadata pseudo-bin says has unmapped reads (placed with
+    their mates), and the unplaced ones at the end of the file, after every contig's records.
+
+    Then sort them, and merge the ones that share a BGZF block, so that no block is read twice.
+
+--*/
+{
+    size_t indexFileNameSize = strlen(fileName) + 5;
+    char* indexFileName = new char[indexFileNameSize];
+    snprintf(indexFileName, indexFileNameSize, "%s.bai", fileName);
+    FILE* index = fopen(indexFileName, "rb");
+    if (NULL == index) {
+        WriteErrorMessage("%s needs a BAI index for %s, %s (samtools index makes one)\n",
+            NULL != context.region ? "-region" : "-unmappedOnly", fileName, indexFileName);
+        soft_exit(1);
+    }
+    char magic[4];
+    _int32 n_ref;
+    if (1 != fread(magic, sizeof(magic), 1, index) || 0 != memcmp(magic, "BAI\1", 4) || 1 != fread(&n_ref, sizeof(n_ref), 1, index)) {
+        WriteErrorMessage("%s isn't a BAI index\n", indexFileName);
+        soft_exit(1);
+    }
+
+    bool* regionBins = NULL;
+    _uint64 regionMinOffset = 0;
+    if (NULL != context.region) {
+        regionBins = new bool[BAMAlignment::BAM_EXTRA_BIN + 1];
+        memset(regionBins, 0, BAMAlignment::BAM_EXTRA_BIN + 1);
+        _uint16 list[BAMAlignment::MAX_BIN];
+        int n = BAMAlignment::reg2bins((int) regionBegin, (int) max(regionBegin + 1, regionEnd), list);
+        for (int i = 0; i < n; i++) {
+            regionBins[list[i]] = true;
+        }
+    }
+
+    chunks = new VariableSizeVector<Chunk>();
+    _uint64 placedEnd = 0; // just past the last record on a contig
+    bool truncated = false;
+    for (int ref = 0; ref < n_ref && ! truncated; ref++) {
+        _int32 n_bin;
+        truncated = 1 != fread(&n_bin, sizeof(n_bin), 1, index);
+        VariableSizeVector<Chunk> refChunks;
+        bool unmappedOnRef = true; // unless the metadata says otherwise
+        Chunk refRange = {UINT64_MAX, 0};
+        for (int b = 0; b < n_bin && ! truncated; b++) {
+            _uint32 bin;
+            _int32 n_chunk;
+            truncated = 1 != fread(&bin, sizeof(bin), 1, index) || 1 != fread(&n_chunk, sizeof(n_chunk), 1, index);
+            for (int c = 0; c < n_chunk && ! truncated; c++) {
+                Chunk chunk;
+                truncated = 1 != fread(&chunk.begin, sizeof(chunk.begin), 1, index) || 1 != fread(&chunk.end, sizeof(chunk.end), 1, index);
+                if (BAMAlignment::BAM_EXTRA_BIN == bin) {
+                    if (1 == c) {
+                        unmappedOnRef = chunk.end > 0; // (n_mapped, n_unmapped)
+                    }
+                    continue;
+                }
+                placedEnd = max(placedEnd, chunk.end);
+                refRange.begin = min(refRange.begin, chunk.begin);
+                refRange.end = max(refRange.end, chunk.end);
+                if (ref == regionRefID && regionBins[bin]) {
+                    refChunks.push_back(chunk);
+                }
+            }
+        }
+        _int32 n_intv;
+        truncated = truncated || 1 != fread(&n_intv, sizeof(n_intv), 1, index);
+        for (_int32 i = 0; i < n_intv && ! truncated; i++) {
+            _uint64 ioffset;
+            truncated = 1 != fread(&ioffset, sizeof(ioffset), 1, index);
+            if (ref == regionRefID && i == (regionBegin >> 14)) {
+                regionMinOffset = ioffset;
+            }
+        }
+        if (NULL != context.region) {
+            for (Chunk* c = refChunks.begin(); c != refChunks.end(); c++) {
+                if (c->end > regionMinOffset) {
+                    chunks->push_back(*c);
+                }
+            }
+        } else if (unmappedOnRef && refRange.begin < refRange.end) {
+            chunks->push_back(refRange);
+        }
+    }
+    _uint64 n_no_coor = 1; // if it isn't there, there might be some
+    if (! truncated && 1 != fread(&n_no_coor, sizeof(n_no_coor), 1, index)) {
+        n_no_coor = 1;
+    }
+    fclose(index);
+    if (truncated) {
+        WriteErrorMessage("%s is truncated\n", indexFileName);
+        soft_exit(1);
+    }
+    if (NULL == context.region && n_no_coor > 0) {
+        Chunk tail = {placedEnd, UINT64_MAX};
+        chunks->push_back(tail);
+    }
+    delete [] regionBins;
+    delete [] indexFileName;
+
+    //
+    // A chunk is read in whole blocks, up to one past the block it ends in (see readEnd), and the records that aren't
+    // wanted are skipped, so merge it with the next one if that starts in one of them.
+    //
+    std::sort(chunks->begin(), chunks->end(), Chunk::comparator);
+    int merged = 0;
+    for (int i = 0; i < (int) chunks->size(); i++) {
+        Chunk* last = merged > 0 ? &(*chunks)[merged - 1] : NULL;
+        if (NULL != last && ((*chunks)[i].begin >> 16) < last->readEnd()) {
+            last->end = max(last->end, (*chunks)[i].end);
+        } else {
+            (*chunks)[merged++] = (*chunks)[i];
+        }
+    }
+    chunks->truncate(merged);
+
+    chunkReaders = new DataReader*[max(1, merged)];
+    chunkHolds = new int[max(1, merged)];
+    for (int i = 0; i < merged; i++) {
+        chunkReaders[i] = NULL;
+        chunkHolds[i] = 0;
+    }
+    InitializeExclusiveLock(&chunkLock);
+}
+
+    bool
+BAMReader::startNextChunk()
+/*++
+
+Routine Description:
+
+    Let go of the chunk being read, and start reading the next one with a reader of its own, from the start of its
+    first block, skipping the part of the block before the chunk starts.  The first chunk uses the reader that read the
+    header.
+
+Return Value:
+
+    false if there are no more.
+
+--*/
+{
+    AcquireExclusiveLock(&chunkLock);
+    int done = currentChunk++;
+    if (done >= 0 && 0 == chunkHolds[done]) {
+        delete chunkReaders[done];
+        chunkReaders[done] = NULL;
+    }
+    ReleaseExclusiveLock(&chunkLock);
+    if (currentChunk >= (int) chunks->size()) {
+        return false;
+    }
+
+    Chunk* chunk = &(*chunks)[currentChunk];
+    if (currentChunk > 0) {
+        data = DataSupplier::GzipBamDefault->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor, 0);
+        if (! data->init(fileName)) {
+            WriteErrorMessage("Unable to read file %s\n", fileName);
+            soft_exit(1);
+        }
+    }
+    AcquireExclusiveLock(&chunkLock);
+    chunkReaders[currentChunk] = data;
+    ReleaseExclusiveLock(&chunkLock);
+    _uint64 start = chunk->begin >> 16;
+    data->reinit(start, chunk->end == UINT64_MAX ? 0 : chunk->readEnd() - start);
+    extraOffset = 0;
+
+    for (_int64 left = chunk->begin & 0xffff; left > 0; ) {
+        char* p;
+        _int64 valid;
+        if (! data->getData(&p, &valid)) {
+            data->nextBatch();
+            if (! data->getData(&p, &valid)) {
+                WriteErrorMessage("%s ends before its BAI index says it does\n", fileName);
+                soft_exit(1);
+            }
+        }
+        _int64 skip = min(left, valid);
+        data->advance(skip);
+        left -= skip;
+    }
+    return true;
+}
+
+    bool
+BAMReader::wanted(
+    BAMAlignment* bam)
+{
+    if (context.unmappedOnly && ! (bam->FLAG & SAM_UNMAPPED) && ! (context.paired && (bam->FLAG & SAM_NEXT_UNMAPPED))) {
+        return false;
+    }
+    if (NULL != context.region) {
+        // (an unmapped read placed with its mate takes up one base there)
+        _int64 end = bam->pos + ((bam->FLAG & SAM_UNMAPPED) ? 1 : max(1, bam->l_ref()));
+        return bam->refID == regionRefID && bam->pos < regionEnd && end > regionBegin;
+    }
+    return true;
+}
+
+    void
+BAMReader::holdChunkBatch(
+    DataBatch batch)
+{
+    AcquireExclusiveLock(&chunkLock);
+    int chunk = (int) batch.fileID - 1;
+    if (chunk >= 0 && chunk < (int) chunks->size() && NULL != chunkReaders[chunk]) {
+        chunkHolds[chunk]++;
+        chunkReaders[chunk]->holdBatch(DataBatch(batch.batchID));
+    }
+    ReleaseExclusiveLock(&chunkLock);
+}
+
+    bool
+BAMReader::releaseChunkBatch(
+    DataBatch batch)
+{
+    bool released = false;
+    AcquireExclusiveLock(&chunkLock);
+    // (a batch that was never handed out, like the one PairedReadMatcher starts with, isn't in a chunk)
+    int chunk = (int) batch.fileID - 1;
+    if (chunk >= 0 && chunk < (int) chunks->size() && NULL != chunkReaders[chunk]) {
+        released = chunkReaders[chunk]->releaseBatch(DataBatch(batch.batchID));
+        if (chunkHolds[chunk] > 0 && 0 == --chunkHolds[chunk] && chunk < currentChunk) {
+            delete chunkReaders[chunk];
+            chunkReaders[chunk] = NULL;
+        }
+    }
+    ReleaseExclusiveLock(&chunkLock);
+    return released;
+}
+
     ReadSupplierGenerator *
 BAMReader::createReadSupplierGenerator(
     const char *fileName,
@@ -204,6 +515,7 @@ BAMReader::createReadSupplierGenerator(
     const ReaderContext& context)
 {
     BAMReader* reader = create(fileName, ReadSupplierQueue::BufferCount(numThreads), 0, 0, context);
+    reader->deferDecoding = true;
     ReadSupplierQueue* queue = new ReadSupplierQueue((ReadReader*)reader);
     queue->startReaders();
     return queue;
@@ -217,8 +529,11 @@ BAMReader::createPairedReadSupplierGenerator(
     const ReaderContext& context,
     int matchBufferSize)
 {
+    ReaderContext pairedContext = context;
+    pairedContext.paired = true; // so that -unmappedOnly keeps the mates of unmapped reads
     BAMReader* reader = create(fileName, 
-        ReadSupplierQueue::BufferCount(numThreads) + PairedReadReader::MatchBuffers, 0, 0, context);
+        ReadSupplierQueue::BufferCount(numThreads) + PairedReadReader::MatchBuffers, 0, 0, pairedContext);
+    reader->deferDecoding = true;   // The matcher unpacks the ones it has to copy
     PairedReadReader* matcher = PairedReadReader::PairMatcher(reader, quicklyDropUnmatchedReads);
     ReadSupplierQueue* queue = new ReadSupplierQueue(matcher);
     queue->startReaders();
@@ -246,23 +561,32 @@ const _uint8 BAM_CIGAR_X = 8;
 
 BAMAlignment::_init BAMAlignment::_init_;
 
+//
+// The vector versions of the decoders are compiled for their instruction set function by function, so the rest of SNAP
+// still runs on processors without it.  MSVC doesn't need to be told.
+//
+#ifdef _MSC_VER
+#define BAM_VECTOR_TARGET(instructionSets)
+#else
+#define BAM_VECTOR_TARGET(instructionSets) __attribute__((target(instructionSets)))
+#endif
+
+BAMAlignment::DecodeSeqFunction BAMAlignment::decodeSeqImplementation = KernelChooser<BAMAlignment::DecodeSeqFunction>("BAM decoding")
+    .avx2(X86_ONLY(BAMAlignment::decodeSeqAVX2)).vector16Lookup(BAMAlignment::decodeSeqVector16).scalar(BAMAlignment::decodeSeqScalar);
+BAMAlignment::DecodeSeqFunction BAMAlignment::decodeSeqRCImplementation = KernelChooser<BAMAlignment::DecodeSeqFunction>("BAM decoding")
+    .avx2(X86_ONLY(BAMAlignment::decodeSeqRCAVX2)).vector16Lookup(BAMAlignment::decodeSeqRCVector16).scalar(BAMAlignment::decodeSeqRCScalar);
+BAMAlignment::DecodeQualFunction BAMAlignment::decodeQualImplementation = KernelChooser<BAMAlignment::DecodeQualFunction>("BAM decoding")
+    .avx2(X86_ONLY(BAMAlignment::decodeQualAVX2)).vector16(BAMAlignment::decodeQualVector16).scalar(BAMAlignment::decodeQualScalar);
+BAMAlignment::DecodeQualFunction BAMAlignment::decodeQualRCImplementation = KernelChooser<BAMAlignment::DecodeQualFunction>("BAM decoding")
+    .avx2(X86_ONLY(BAMAlignment::decodeQualRCAVX2)).vector16Lookup(BAMAlignment::decodeQualRCVector16).scalar(BAMAlignment::decodeQualRCScalar);
+
     void
 BAMAlignment::decodeSeq(
     char* o_sequence,
     const _uint8* nibbles,
     int bases)
 {
-
-
-    _uint16 *o_sequence_pairs = (_uint16 *)o_sequence;
-    int pairs = bases / 2;
-    for (int i = 0; i < pairs; i++) {
-        o_sequence_pairs[i] = CodeToSeqPair[nibbles[i]];
-    }
-
-    if (bases % 2 == 1) {
-        o_sequence[bases - 1] = CodeToSeq[nibbles[bases / 2] >> 4];
-    }
+    (*decodeSeqImplementation)(o_sequence, nibbles, bases);
 
 #ifdef _DEBUG   // Make sure the new one does the same thing as the old.
     for (int i = 0; i < bases; i++) {
@@ -273,14 +597,62 @@ BAMAlignment::decodeSeq(
     }
 #endif // _DEBUG
 }
+
     void
 BAMAlignment::decodeSeqRC(
-char* o_sequence,
-const _uint8* nibbles,
-int bases)
+    char* o_sequence,
+    const _uint8* nibbles,
+    int bases)
+{
+    (*decodeSeqRCImplementation)(o_sequence, nibbles, bases);
+}
+
+    void
+BAMAlignment::decodeQual(
+    char* o_qual,
+    char* quality,
+    int bases)
+{
+    (*decodeQualImplementation)(o_qual, quality, bases);
+}
+
+    void
+BAMAlignment::decodeQualRC(
+    char* o_qual,
+    char* quality,
+    int bases)
+{
+    (*decodeQualRCImplementation)(o_qual, quality, bases);
+}
+
+    void
+BAMAlignment::decodeSeqScalar(
+    char* o_sequence,
+    const _uint8* nibbles,
+    int bases)
 {
     _uint16 *o_sequence_pairs = (_uint16 *)o_sequence;
     int pairs = bases / 2;
+    for (int i = 0; i < pairs; i++) {
+        o_sequence_pairs[i] = CodeToSeqPair[nibbles[i]];
+    }
+
+    if (bases % 2 == 1) {
+        o_sequence[bases - 1] = CodeToSeq[nibbles[bases / 2] >> 4];
+    }
+}
+
+    void
+BAMAlignment::decodeSeqRCScalar(
+    char* o_sequence,
+    const _uint8* nibbles,
+    int bases)
+{
+    //
+    // With an odd number of bases the last one goes first, and the pairs come after it.
+    //
+    int pairs = bases / 2;
+    _uint16 *o_sequence_pairs = (_uint16 *)(o_sequence + bases % 2);
     for (int i = 0; i < pairs; i++) {
         o_sequence_pairs[pairs-i-1] = CodeToSeqPairRC[nibbles[i]];
     }
@@ -289,8 +661,9 @@ int bases)
         o_sequence[0] = CodeToSeqRC[nibbles[bases / 2] >> 4];
     }
 }
+
     void
-BAMAlignment::decodeQual(
+BAMAlignment::decodeQualScalar(
     char* o_qual,
     char* quality,
     int bases)
@@ -301,7 +674,7 @@ BAMAlignment::decodeQual(
 }
 
     void
-BAMAlignment::decodeQualRC(
+BAMAlignment::decodeQualRCScalar(
     char* o_qual,
     char* quality,
     int bases)
@@ -311,90 +684,407 @@ BAMAlignment::decodeQualRC(
     }
 }
 
-    bool
-BAMAlignment::decodeCigar(
-    char* o_cigar,
-    int cigarSize,
-    _uint32* cigar,
-    int ops)
+#ifdef SNAP_SIMD_X86
+    static inline __m256i BAM_VECTOR_TARGET("avx2")
+NibblesToCodes(const _uint8 *nibbles)
+/*++
+
+Routine Description:
+
+    Spread 16 bytes of packed bases out to one code per byte, high nibble first, ready to be looked up with pshufb.
+
+--*/
 {
-    int i = 0;
-    _uint32 lastOp = 99999;
-    while (ops > 0 && i < cigarSize - 11) { // 9 decimal digits (28 bits) + 1 cigar char + null terminator
-        i += sprintf(o_cigar + i, "%u", *cigar >> 4);
-        _ASSERT((*cigar & 0xf) <= 8);
-        _uint32 op = *cigar & 0xf;
-        o_cigar[i++] = BAMAlignment::CodeToCigar[op];
-        _ASSERT(op != lastOp);
-        lastOp = op;
-        ops--;
-        cigar++;
-    }
-    o_cigar[i++] = 0;
-    return ops == 0;
+    __m256i wide = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)nibbles));
+    __m256i high = _mm256_srli_epi16(wide, 4);
+    __m256i low = _mm256_slli_epi16(_mm256_and_si256(wide, _mm256_set1_epi16(0xf)), 8);
+
+    return _mm256_or_si256(high, low);
 }
 
-    void 
-BAMAlignment::getClippingFromCigar(
-    _uint32 *cigar, 
-    int ops, 
-    unsigned *o_frontClipping, 
-    unsigned *o_backClipping, 
-    unsigned *o_frontHardClipping, 
-    unsigned *o_backHardClipping)
+    static inline __m256i BAM_VECTOR_TARGET("avx2")
+ReverseBytes(__m256i bytes)
 {
-    *o_frontHardClipping = 0;   // Gets overwritten if we have any
-    *o_frontClipping = 0;
-    *o_backHardClipping = 0;
-    *o_backClipping = 0;
+    const __m256i reverseInLane = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                                   15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
 
-    if (0 == ops) return;
+    return _mm256_permute4x64_epi64(_mm256_shuffle_epi8(bytes, reverseInLane), 0x4e);
+}
 
-    if ((*cigar & 0xf) == BAM_CIGAR_H) {
-        *o_frontHardClipping = *cigar >> 4;
-        cigar++;
-        ops--;
-        if (0 == ops) {
-            return;   // What a strange cigar string, all hard clip!
-        }
-    }
+    void BAM_VECTOR_TARGET("avx2")
+BAMAlignment::decodeSeqAVX2(
+    char* o_sequence,
+    const _uint8* nibbles,
+    int bases)
+/*++
 
-    if ((*cigar & 0xf) == BAM_CIGAR_S) {
-        *o_frontClipping = *cigar >> 4;
-        cigar++;
-        ops--;
-        if (0 == ops) {
-            return;
-        }
-    }
+Routine Description:
 
-    if ((cigar[ops - 1] & 0xf) == BAM_CIGAR_H) {
-        *o_backHardClipping = cigar[ops - 1] >> 4;
-        ops--;
-        if (0 == ops) {
-            return;
-        }
-    }
+    decodeSeq 32 bases at a time: the nibbles are spread out to a byte each, and pshufb looks each one up in CodeToSeq.
+    Whatever is left over at the end goes through the table a pair at a time.
 
-    if ((cigar[ops - 1] & 0xf) == BAM_CIGAR_S) {
-        *o_backClipping = cigar[ops - 1] >> 4;
+--*/
+{
+    const __m256i codeToSeq = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)CodeToSeq));
+
+    int i;
+    for (i = 0; i + 32 <= bases; i += 32) {
+        _mm256_storeu_si256((__m256i *)(o_sequence + i), _mm256_shuffle_epi8(codeToSeq, NibblesToCodes(nibbles + i / 2)));
     }
+
+    decodeSeqScalar(o_sequence + i, nibbles + i / 2, bases - i);
 }
 
+    void BAM_VECTOR_TARGET("avx2")
+BAMAlignment::decodeSeqRCAVX2(
+    char* o_sequence,
+    const _uint8* nibbles,
+    int bases)
+/*++
+
+Routine Description:
 
-    void
-BAMAlignment::encodeSeq(
-    _uint8* encoded,
-    char* ascii,
-    int length)
+    decodeSeqRC 32 bases at a time, the same way as decodeSeqAVX2 but looking up in CodeToSeqRC and reversing each
+    block into place from the end of the output.  The bases left over at the end of the input go at the front.
+
+--*/
 {
-    _uint8* p = encoded;
-    for (int i = 0; i + 1 < length; i += 2) {
-        *p++ = (BAMAlignment::SeqToCode[ascii[i]] << 4) | BAMAlignment::SeqToCode[ascii[i+1]];
-    }
-    if (length % 2) {
-        *p = BAMAlignment::SeqToCode[ascii[length - 1]] << 4;
+    const __m256i codeToSeqRC = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)CodeToSeqRC));
+
+    int i;
+    for (i = 0; i + 32 <= bases; i += 32) {
+        __m256i complemented = _mm256_shuffle_epi8(codeToSeqRC, NibblesToCodes(nibbles + i / 2));
+        _mm256_storeu_si256((__m256i *)(o_sequence + bases - i - 32), ReverseBytes(complemented));
     }
+
+    decodeSeqRCScalar(o_sequence, nibbles + i / 2, bases - i);
+}
+
+    static inline __m256i BAM_VECTOR_TARGET("avx2")
+QualitiesToSAM(const char *quality)
+/*++
+
+Routine Description:
+
+    CIGAR_QUAL_TO_SAM for 32 bytes: add '!', except that anything that would go past '~' (including 0xff, which is
+    BAM for no quality) becomes '!'.
+
+--*/
+{
+    const __m256i maxQuality = _mm256_set1_epi8('~' - '!');
+    const __m256i bang = _mm256_set1_epi8('!');
+
+    __m256i raw = _mm256_loadu_si256((const __m256i *)quality);
+    __m256i inRange = _mm256_cmpeq_epi8(_mm256_min_epu8(raw, maxQuality), raw);
+
+    return _mm256_add_epi8(_mm256_and_si256(raw, inRange), bang);
+}
+
+    void BAM_VECTOR_TARGET("avx2")
+BAMAlignment::decodeQualAVX2(
+    char* o_qual,
+    char* quality,
+    int bases)
+{
+    int i;
+    for (i = 0; i + 32 <= bases; i += 32) {
+        _mm256_storeu_si256((__m256i *)(o_qual + i), QualitiesToSAM(quality + i));
+    }
+
+    decodeQualScalar(o_qual + i, quality + i, bases - i);
+}
+
+    void BAM_VECTOR_TARGET("avx2")
+BAMAlignment::decodeQualRCAVX2(
+    char* o_qual,
+    char* quality,
+    int bases)
+{
+    int i;
+    for (i = 0; i + 32 <= bases; i += 32) {
+        _mm256_storeu_si256((__m256i *)(o_qual + bases - i - 32), ReverseBytes(QualitiesToSAM(quality + i)));
+    }
+
+    decodeQualRCScalar(o_qual, quality + i, bases - i);
+}
+#endif // SNAP_SIMD_X86
+
+    void SIMD_TARGET("ssse3")
+BAMAlignment::decodeSeqVector16(
+    char* o_sequence,
+    const _uint8* nibbles,
+    int bases)
+/*++
+
+Routine Description:
+
+    decodeSeqAVX2 16 bases at a time, for processors without AVX2 (including ARM).  The nibbles are spread out by
+    interleaving the high ones with the low ones.  Each load is 16 bytes of nibbles for the 8 that get used, so it
+    stops 32 bases from the end rather than 16.
+
+--*/
+{
+    const Vector16 codeToSeq = Vector16Load(CodeToSeq);
+
+    int i;
+    for (i = 0; i + 32 <= bases; i += 16) {
+        Vector16 packed = Vector16Load(nibbles + i / 2);
+        Vector16 codes = Vector16InterleaveLow(Vector16HighNibbles(packed), Vector16LowNibbles(packed));
+        Vector16Store(o_sequence + i, Vector16Lookup(codeToSeq, codes));
+    }
+
+    decodeSeqScalar(o_sequence + i, nibbles + i / 2, bases - i);
+}
+
+    void SIMD_TARGET("ssse3")
+BAMAlignment::decodeSeqRCVector16(
+    char* o_sequence,
+    const _uint8* nibbles,
+    int bases)
+{
+    const Vector16 codeToSeqRC = Vector16Load(CodeToSeqRC);
+
+    int i;
+    for (i = 0; i + 32 <= bases; i += 16) {
+        Vector16 packed = Vector16Load(nibbles + i / 2);
+        Vector16 codes = Vector16InterleaveLow(Vector16HighNibbles(packed), Vector16LowNibbles(packed));
+        Vector16Store(o_sequence + bases - i - 16, Vector16Reverse(Vector16Lookup(codeToSeqRC, codes)));
+    }
+
+    decodeSeqRCScalar(o_sequence, nibbles + i / 2, bases - i);
+}
+
+    static inline Vector16
+QualitiesToSAM16(const char *quality)
+{
+    //
+    // The compares are signed, so 0x80 and up (including 0xff, no quality) are below zero.
+    //
+    Vector16 raw = Vector16Load(quality);
+    Vector16 inRange = Vector16And(Vector16Greater(raw, Vector16Set1(-1)), Vector16Greater(Vector16Set1('~' - '!' + 1), raw));
+
+    return Vector16Add(Vector16And(raw, inRange), Vector16Set1('!'));
+}
+
+    void
+BAMAlignment::decodeQualVector16(
+    char* o_qual,
+    char* quality,
+    int bases)
+{
+    int i;
+    for (i = 0; i + 16 <= bases; i += 16) {
+        Vector16Store(o_qual + i, QualitiesToSAM16(quality + i));
+    }
+
+    decodeQualScalar(o_qual + i, quality + i, bases - i);
+}
+
+    void SIMD_TARGET("ssse3")
+BAMAlignment::decodeQualRCVector16(
+    char* o_qual,
+    char* quality,
+    int bases)
+{
+    int i;
+    for (i = 0; i + 16 <= bases; i += 16) {
+        Vector16Store(o_qual + bases - i - 16, Vector16Reverse(QualitiesToSAM16(quality + i)));
+    }
+
+    decodeQualRCScalar(o_qual, quality + i, bases - i);
+}
+
+    bool
+BAMAlignment::decodeCigar(
+    char* o_cigar,
+    int cigarSize,
+    _uint32* cigar,
+    int ops)
+{
+    int i = 0;
+    _uint32 lastOp = 99999;
+    while (ops > 0 && i < cigarSize - 11) { // 9 decimal digits (28 bits) + 1 cigar char + null terminator
+        i += FormatUInt(*cigar >> 4, o_cigar + i);
+        _ASSERT((*cigar & 0xf) <= 8);
+        _uint32 op = *cigar & 0xf;
+        o_cigar[i++] = BAMAlignment::CodeToCigar[op];
+        _ASSERT(op != lastOp);
+        lastOp = op;
+        ops--;
+        cigar++;
+    }
+    o_cigar[i++] = 0;
+    return ops == 0;
+}
+
+    void 
+BAMAlignment::getClippingFromCigar(
+    _uint32 *cigar, 
+    int ops, 
+    unsigned *o_frontClipping, 
+    unsigned *o_backClipping, 
+    unsigned *o_frontHardClipping, 
+    unsigned *o_backHardClipping)
+{
+    *o_frontHardClipping = 0;   // Gets overwritten if we have any
+    *o_frontClipping = 0;
+    *o_backHardClipping = 0;
+    *o_backClipping = 0;
+
+    if (0 == ops) return;
+
+    if ((*cigar & 0xf) == BAM_CIGAR_H) {
+        *o_frontHardClipping = *cigar >> 4;
+        cigar++;
+        ops--;
+        if (0 == ops) {
+            return;   // What a strange cigar string, all hard clip!
+        }
+    }
+
+    if ((*cigar & 0xf) == BAM_CIGAR_S) {
+        *o_frontClipping = *cigar >> 4;
+        cigar++;
+        ops--;
+        if (0 == ops) {
+            return;
+        }
+    }
+
+    if ((cigar[ops - 1] & 0xf) == BAM_CIGAR_H) {
+        *o_backHardClipping = cigar[ops - 1] >> 4;
+        ops--;
+        if (0 == ops) {
+            return;
+        }
+    }
+
+    if ((cigar[ops - 1] & 0xf) == BAM_CIGAR_S) {
+        *o_backClipping = cigar[ops - 1] >> 4;
+    }
+}
+
+
+BAMAlignment::EncodeSeqFunction BAMAlignment::encodeSeqImplementation = KernelChooser<BAMAlignment::EncodeSeqFunction>("BAM encoding")
+    .avx2(X86_ONLY(BAMAlignment::encodeSeqAVX2)).scalar(BAMAlignment::encodeSeqScalar);
+BAMAlignment::EncodeQualFunction BAMAlignment::encodeQualImplementation = KernelChooser<BAMAlignment::EncodeQualFunction>("BAM encoding")
+    .avx2(X86_ONLY(BAMAlignment::encodeQualAVX2)).vector16(BAMAlignment::encodeQualVector16).scalar(BAMAlignment::encodeQualScalar);
+
+    void
+BAMAlignment::encodeSeq(
+    _uint8* encoded,
+    char* ascii,
+    int length)
+{
+    (*encodeSeqImplementation)(encoded, ascii, length);
+}
+
+    void
+BAMAlignment::encodeQual(
+    char* o_quality,
+    const char* quality,
+    int length)
+{
+    (*encodeQualImplementation)(o_quality, quality, length);
+}
+
+    void
+BAMAlignment::encodeSeqScalar(
+    _uint8* encoded,
+    char* ascii,
+    int length)
+{
+    _uint8* p = encoded;
+    for (int i = 0; i + 1 < length; i += 2) {
+        *p++ = (BAMAlignment::SeqToCode[ascii[i]] << 4) | BAMAlignment::SeqToCode[ascii[i+1]];
+    }
+    if (length % 2) {
+        *p = BAMAlignment::SeqToCode[ascii[length - 1]] << 4;
+    }
+}
+
+    void
+BAMAlignment::encodeQualScalar(
+    char* o_quality,
+    const char* quality,
+    int length)
+{
+    for (int i = 0; i < length; i++) {
+        o_quality[i] = quality[i] - '!';
+    }
+}
+
+#ifdef SNAP_SIMD_X86
+    void BAM_VECTOR_TARGET("avx2")
+BAMAlignment::encodeSeqAVX2(
+    _uint8* encoded,
+    char* ascii,
+    int length)
+/*++
+
+Routine Description:
+
+    encodeSeq 32 bases at a time.  SeqToCode is zero outside of the rows 0x40 and 0x50 (every base letter is upper
+    case, and '=' is code 0), so each base is looked up in both rows with pshufb on its low nibble and the one that
+    matches its high nibble is kept.  Then pmaddubsw makes each pair of codes into high * 16 + low, and those get
+    packed back down to bytes.
+
+--*/
+{
+    const __m256i row4 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(SeqToCode + 0x40)));
+    const __m256i row5 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(SeqToCode + 0x50)));
+    const __m256i lowNibble = _mm256_set1_epi8(0xf);
+    const __m256i pairWeights = _mm256_set1_epi16(0x0110);    // 16 for the first of each pair, 1 for the second
+
+    int i;
+    for (i = 0; i + 32 <= length; i += 32) {
+        __m256i bases = _mm256_loadu_si256((const __m256i *)(ascii + i));
+        __m256i low = _mm256_and_si256(bases, lowNibble);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(bases, 4), lowNibble);
+
+        __m256i codes = _mm256_or_si256(
+            _mm256_and_si256(_mm256_shuffle_epi8(row4, low), _mm256_cmpeq_epi8(high, _mm256_set1_epi8(4))),
+            _mm256_and_si256(_mm256_shuffle_epi8(row5, low), _mm256_cmpeq_epi8(high, _mm256_set1_epi8(5))));
+        __m256i pairs = _mm256_maddubs_epi16(codes, pairWeights);
+
+        _mm_storeu_si128((__m128i *)(encoded + i / 2),
+            _mm_packus_epi16(_mm256_castsi256_si128(pairs), _mm256_extracti128_si256(pairs, 1)));
+    }
+
+    encodeSeqScalar(encoded + i / 2, ascii + i, length - i);
+}
+
+    void BAM_VECTOR_TARGET("avx2")
+BAMAlignment::encodeQualAVX2(
+    char* o_quality,
+    const char* quality,
+    int length)
+{
+    const __m256i bang = _mm256_set1_epi8('!');
+
+    int i;
+    for (i = 0; i + 32 <= length; i += 32) {
+        _mm256_storeu_si256((__m256i *)(o_quality + i), _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(quality + i)), bang));
+    }
+
+    encodeQualScalar(o_quality + i, quality + i, length - i);
+}
+#endif // SNAP_SIMD_X86
+
+    void
+BAMAlignment::encodeQualVector16(
+    char* o_quality,
+    const char* quality,
+    int length)
+{
+    const Vector16 bang = Vector16Set1('!');
+
+    int i;
+    for (i = 0; i + 16 <= length; i += 16) {
+        Vector16Store(o_quality + i, Vector16Sub(Vector16Load(quality + i), bang));
+    }
+
+    encodeQualScalar(o_quality + i, quality + i, length - i);
 }
 
     int
@@ -466,6 +1156,46 @@ BAMAlignment::reg2bins(
     return i;
 }
 
+    int
+BAMAlignment::csiDepth(
+    _int64 maxLength)
+{
+    int depth = 5;
+    // leave a little room at the end, as samtools does
+    while (maxLength + 256 > (1LL << (CSI_MIN_SHIFT + 3 * depth))) {
+        depth++;
+    }
+    return depth;
+}
+
+    _uint32
+BAMAlignment::csiReg2bin(
+    _int64 beg,
+    _int64 end,
+    int depth)
+{
+    int shift = CSI_MIN_SHIFT;
+    _uint32 first = ((1 << (3 * depth)) - 1) / 7;
+    --end;
+    for (int level = depth; level > 0; level--, shift += 3, first -= 1 << (3 * level)) {
+        if (beg >> shift == end >> shift) return first + (_uint32) (beg >> shift);
+    }
+    return 0;
+}
+
+    _int64
+BAMAlignment::csiBinFirstInterval(
+    _uint32 bin,
+    int depth)
+{
+    int level = 0;
+    for (_uint32 b = bin; b != 0; b = (b - 1) >> 3) {
+        level++;
+    }
+    _uint32 first = ((1 << (3 * level)) - 1) / 7;
+    return ((_int64) (bin - first)) << (3 * (depth - level));
+}
+
 #ifdef VALIDATE_BAM
     void
 BAMAlignment::validate()
@@ -511,22 +1241,45 @@ BAMReader::getNextRead(
         flag = &local_flag;
     }
 
+    if (NULL != chunks && currentChunk >= (int) chunks->size()) {
+        return false;
+    }
+    bool skipped;
     do {
         char* buffer;
         _int64 bytes;
         if (! data->getData(&buffer, &bytes)) {
             data->nextBatch();
-            if (! data->getData(&buffer, &bytes)) {
-                return false;
+            while (! data->getData(&buffer, &bytes)) {
+                if (NULL == chunks || ! startNextChunk()) {
+                    return false;
+                }
             }
             extraOffset = 0;
         }
         BAMAlignment* bam = (BAMAlignment*) buffer;
         if ((_uint64)bytes < sizeof(bam->block_size) || (_uint64)bytes < bam->size()) {
+            if (NULL != chunks) {
+                // the end of a chunk's blocks, in a record that runs on into one it didn't read, and so starts after the chunk
+                if (! startNextChunk()) {
+                    return false;
+                }
+                skipped = true;
+                continue;
+            }
 			WriteErrorMessage("Insufficient buffer space for BAM file, increase -xf parameter\n");
             soft_exit(1);
         }
         data->advance(bam->size());
+        //
+        // Check the flags before decoding anything, so the records that are thrown away cost next to nothing.
+        //
+        skipped = (NULL != chunks && ! wanted(bam)) ||
+            (context.ignoreSecondaryAlignments && (bam->FLAG & SAM_SECONDARY)) ||
+            (context.ignoreSupplementaryAlignments && (bam->FLAG & SAM_SUPPLEMENTARY));
+        if (skipped) {
+            continue;
+        }
         size_t lineLength;
         getReadFromLine(context.genome, buffer, buffer + bytes, read, alignmentResult, genomeLocation,
             isRC, mapQ, &lineLength, flag, cigar, context.clipping);
@@ -541,9 +1294,8 @@ BAMReader::getNextRead(
                 }
             }
         }
-    } while ((context.ignoreSecondaryAlignments && (*flag & SAM_SECONDARY)) || 
-             (context.ignoreSupplementaryAlignments && (*flag & SAM_SUPPLEMENTARY)));
-    _ASSERT(read->getData()[0]);
+    } while (skipped);
+    _ASSERT(read->hasDeferredData() || read->getData()[0]);
     return true;
 }
 
@@ -595,7 +1347,16 @@ BAMReader::getReadFromLine(
 
         unsigned originalFrontClipping, originalBackClipping, originalFrontHardClipping, originalBackHardClipping;
 
-        if (bam->FLAG & SAM_REVERSE_COMPLEMENT) {
+        if (deferDecoding) {
+            //
+            // Just the clipping now; the bases and qualities wait for DecodeDeferredRead.
+            //
+            if (bam->FLAG & SAM_REVERSE_COMPLEMENT) {
+                BAMAlignment::getClippingFromCigar(bam->cigar(), bam->n_cigar_op, &originalBackClipping, &originalFrontClipping, &originalBackHardClipping, &originalFrontHardClipping);
+            } else {
+                BAMAlignment::getClippingFromCigar(bam->cigar(), bam->n_cigar_op, &originalFrontClipping, &originalBackClipping, &originalFrontHardClipping, &originalBackHardClipping);
+            }
+        } else if (bam->FLAG & SAM_REVERSE_COMPLEMENT) {
             BAMAlignment::decodeSeqRC(seqBuffer, bam->seq(), bam->l_seq);
             BAMAlignment::decodeQualRC(qualBuffer, bam->qual(), bam->l_seq);
 
@@ -612,7 +1373,7 @@ BAMReader::getReadFromLine(
 
         const char *rnext;
         unsigned rnextLen;
-        if (bam->next_refID < 0 || (genome != NULL && bam->next_refID >= genome->getNumContigs())) {
+        if (bam->next_refID < 0 || genome == NULL || bam->next_refID >= genome->getNumContigs()) {
             rnext = "*";
             rnextLen = 1;
         } else {
@@ -621,8 +1382,12 @@ BAMReader::getReadFromLine(
         }
         read->init(bam->read_name(), bam->l_read_name - 1, seqBuffer, qualBuffer, bam->l_seq, genomeLocation, bam->MAPQ, bam->FLAG,
             originalFrontClipping, originalBackClipping, originalFrontHardClipping, originalBackHardClipping, rnext, rnextLen, bam->next_pos + 1, true);
-        read->setBatch(data->getBatch());
-        read->clip(clipping);
+        read->setBatch(currentBatch());
+        if (deferDecoding) {
+            read->deferDecoding(DecodeDeferredRead, bam, clipping);
+        } else {
+            read->clip(clipping);
+        }
     }
 
     if (NULL != alignmentResult) {
@@ -643,6 +1408,24 @@ BAMReader::getReadFromLine(
     }
 
 
+}
+
+    void
+BAMReader::DecodeDeferredRead(
+    const void *record,
+    char *data,
+    char *quality,
+    unsigned length)
+{
+    BAMAlignment *bam = (BAMAlignment *)record;
+    _ASSERT(length == bam->l_seq);
+    if (bam->FLAG & SAM_REVERSE_COMPLEMENT) {
+        BAMAlignment::decodeSeqRC(data, bam->seq(), length);
+        BAMAlignment::decodeQualRC(quality, bam->qual(), length);
+    } else {
+        BAMAlignment::decodeSeq(data, bam->seq(), length);
+        BAMAlignment::decodeQual(quality, bam->qual(), length);
+    }
 }
 
     char*
@@ -670,6 +1453,8 @@ public:
 
     virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, GenomeDistance* o_readBytes, int* o_refID, int* o_pos) const;
 
+    virtual void getReadName(char* buffer, _int64 bytes, const char** o_name, size_t* o_nameLength) const;
+
     virtual void setupReaderContext(AlignerOptions* options, ReaderContext* readerContext) const
     { FileFormat::setupReaderContext(options, readerContext, true); }
 
@@ -677,7 +1462,7 @@ public:
 
     virtual bool writeHeader(
         const ReaderContext& context, char *header, size_t headerBufferSize, size_t *headerActualSize,
-        bool sorted, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) const;
+        SortOrder sortOrder, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) const;
 
     virtual bool writeRead(
         const ReaderContext& context, LandauVishkinWithCigar * lv, char * buffer, size_t bufferSpace,
@@ -734,40 +1519,211 @@ BAMFormat::getSortInfo(
 	}
 }
 
-    ReadWriterSupplier*
-BAMFormat::getWriterSupplier(
+    void
+BAMFormat::getReadName(
+    char* buffer,
+    _int64 bytes,
+    const char** o_name,
+    size_t* o_nameLength) const
+{
+    BAMAlignment* bam = (BAMAlignment*) buffer;
+    *o_name = bam->read_name();
+    *o_nameLength = (size_t) bytes >= sizeof(BAMAlignment) && bam->l_read_name > 0 ? bam->l_read_name - 1 : 0; // (without the null)
+}
+
+//
+// The filters for sorted output: duplicate marking and the index, then compression.  Sets *o_indexFileName (or NULL
+// with -ni) and whether it's CSI.
+//
+    static DataWriter::FilterSupplier*
+SortedBAMFilters(
     AlignerOptions* options,
-    const Genome* genome) const
+    const Genome* genome,
+    GzipWriterFilterSupplier* gzipSupplier,
+    char** o_indexFileName,
+    bool* o_csiIndex)
 {
-    DataWriterSupplier* dataSupplier;
+    size_t len = strlen(options->outputFile.fileName);
+    // todo: make markDuplicates optional?
+    DataWriter::FilterSupplier* filters = gzipSupplier;
+    if (NULL != options->alignmentMetricsFile) {
+        filters = DataWriterSupplier::bamMetrics(genome, options->alignmentMetricsFile, options->coverageBinSize)->compose(filters);
+    }
+    if (! options->noDuplicateMarking) {
+        filters = DataWriterSupplier::markDuplicates(genome, options->duplicateMetricsFile)->compose(filters);
+    }
+    char* indexFileName = NULL;
+    bool csiIndex = options->csiIndex;
+    if (! options->noIndex) {
+        for (int i = 0; i < genome->getNumContigs() && ! csiIndex; i++) {
+            if (genome->getContigs()[i].length > BAMAlignment::BAI_MAX_LENGTH) {
+                WriteStatusMessage("Contig %s is too long for a BAI index, writing a CSI index instead\n", genome->getContigs()[i].name);
+                csiIndex = true;
+            }
+        }
+        indexFileName = (char*) malloc(5 + len);
+        strcpy(indexFileName, options->outputFile.fileName);
+        strcpy(indexFileName + len, csiIndex ? ".csi" : ".bai");
+        filters = DataWriterSupplier::bamIndex(indexFileName, genome, gzipSupplier, csiIndex)->compose(filters);
+    }
+    *o_indexFileName = indexFileName;
+    *o_csiIndex = csiIndex;
+    return filters;
+}
+
+//
+// With -nameIndex, the read name index filter in front of filters, for sorted output by location or name.  Sets
+// *o_nameIndexFileName, or to NULL without -nameIndex.
+//
+    static DataWriter::FilterSupplier*
+AddNameIndex(
+    AlignerOptions* options,
+    GzipWriterFilterSupplier* gzipSupplier,
+    DataWriter::FilterSupplier* filters,
+    char** o_nameIndexFileName)
+{
+    *o_nameIndexFileName = NULL;
+    if (! options->nameIndex) {
+        return filters;
+    }
+    size_t len = strlen(options->outputFile.fileName);
+    *o_nameIndexFileName = (char*) malloc(len + strlen(ReadNameIndexSuffix) + 1);
+    strcpy(*o_nameIndexFileName, options->outputFile.fileName);
+    strcpy(*o_nameIndexFileName + len, ReadNameIndexSuffix);
+    return DataWriterSupplier::bamNameIndex(*o_nameIndexFileName, gzipSupplier)->compose(filters);
+}
+
+    ReadWriterSupplier*
+BAMFormat::getWriterSupplier(
+    AlignerOptions* options,
+    const Genome* genome) const
+{
+    DataWriterSupplier* dataSupplier;
+    int compressionLevel = options->compressionLevel >= 0 ? options->compressionLevel : GzipBlockCompressor::DefaultLevel;
     GzipWriterFilterSupplier* gzipSupplier =
-        DataWriterSupplier::gzip(true, BAM_BLOCK, max(1, options->numThreads - 1), false, options->sortOutput);
+        DataWriterSupplier::gzip(true, BAM_BLOCK, max(1, options->numThreads - 1), false, true, compressionLevel);
         // (leave a thread free for main, and let OS map threads to cores to allow system IO etc.)
+        // (compressed by an encoder either way, so the aligner threads don't wait for it)
     if (options->sortOutput) {
         size_t len = strlen(options->outputFile.fileName);
         // todo: this is going to leak, but there's no easy way to free it, and it's small...
         char* tempFileName = (char*) malloc(5 + len);
         strcpy(tempFileName, options->outputFile.fileName);
         strcpy(tempFileName + len, ".tmp");
-        // todo: make markDuplicates optional?
+        char* indexFileName = NULL;
+        bool csiIndex = false;
+        bool markDuplicates = false;
         DataWriter::FilterSupplier* filters = gzipSupplier;
-        if (! options->noDuplicateMarking) {
-            filters = DataWriterSupplier::markDuplicates(genome)->compose(filters);
-        }
-        if (! options->noIndex) {
-            char* indexFileName = (char*) malloc(5 + len);
-            strcpy(indexFileName, options->outputFile.fileName);
-            strcpy(indexFileName + len, ".bai");
-            filters = DataWriterSupplier::bamIndex(indexFileName, genome, gzipSupplier)->compose(filters);
+        if (! options->sortByName) {
+            // (an index and duplicate marking both need reads in order by location)
+            filters = SortedBAMFilters(options, genome, gzipSupplier, &indexFileName, &csiIndex);
+            markDuplicates = ! options->noDuplicateMarking;
+        } else if (NULL != options->alignmentMetricsFile) {
+            filters = DataWriterSupplier::bamMetrics(genome, options->alignmentMetricsFile, options->coverageBinSize)->compose(filters);
         }
+        char* nameIndexFileName;
+        filters = AddNameIndex(options, gzipSupplier, filters, &nameIndexFileName);
+        SortedPartSupplier* parts = options->sortMergeThreads > 1 || options->sortShards > 1
+            ? DataWriterSupplier::bamSortedParts(genome, indexFileName, csiIndex, markDuplicates,
+                options->duplicateMetricsFile, options->numThreads, compressionLevel, options->alignmentMetricsFile,
+                options->coverageBinSize, nameIndexFileName) : NULL;
         dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName,
             options->sortMemory * (1ULL << 30),
             options->numThreads, options->outputFile.fileName, filters, options->writeBufferSize,
-            FileEncoder::gzip(gzipSupplier, options->numThreads, options->bindToProcessors));
+            FileEncoder::gzip(gzipSupplier, options->numThreads, options->bindToProcessors),
+            options->sortInMemory * (1ULL << 30), options->sortTempDirectories, options->sortMergeThreads, parts, options->sortShards,
+            options->evenShards, options->sortTempZstd, options->sortByName);
     } else {
-        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, gzipSupplier);
+        // each aligner thread's batches are compressed on a shared pool, and written in the order they were finished (or,
+        // for -inputOrder, once the input before them has been)
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, gzipSupplier, NULL, 4,
+            FileEncoderPool::gzip(gzipSupplier, max(1, options->numThreads - 1)), options->inputOrder);
+    }
+    return ReadWriterSupplier::create(this, dataSupplier, genome, options->gapPenalty);
+}
+
+    bool
+MergeSortedBAMFiles(
+    AlignerOptions* options,
+    const Genome* genome,
+    int nFiles,
+    const char** fileNames)
+{
+    //
+    // The merge skips each file's header (the text and the reference sequences) to get to its reads, and they'd better
+    // all have the genome's reference sequences, since that's what sorted them.
+    //
+    size_t* headerSizes = new size_t[nFiles];
+    bool ok = true;
+    for (int i = 0; i < nFiles && ok; i++) {
+        ok = false;
+        DataReader* data = DataSupplier::GzipBamDefault->getDataReader(1, BAMReader::MAX_RECORD_LENGTH, 0.0, 0);
+        if (! data->init(fileNames[i])) {
+            WriteErrorMessage("Unable to read file %s\n", fileNames[i]);
+            delete data;
+            break;
+        }
+        for (_int64 wanted = 1024 * 1024; ! ok; wanted *= 2) {
+            _int64 headerSize = wanted;
+            char* buffer = data->readHeader(&headerSize);
+            BAMHeader* header = (BAMHeader*)buffer;
+            if (headerSize < (_int64)sizeof(BAMHeader) || header->magic != BAMHeader::BAM_MAGIC) {
+                WriteErrorMessage("%s is not a BAM file\n", fileNames[i]);
+                break;
+            }
+            if ((_int64)header->size() > headerSize) {
+                if (headerSize < wanted) {
+                    WriteErrorMessage("%s ends in its header\n", fileNames[i]);
+                    break;
+                }
+                continue;
+            }
+            if (header->n_ref() != genome->getNumContigs()) {
+                WriteErrorMessage("%s has %d reference sequences, but the index has %d\n", fileNames[i], header->n_ref(), genome->getNumContigs());
+                break;
+            }
+            BAMHeaderRefSeq* refSeq = header->firstRefSeq();
+            int n = 0;
+            for (; n < header->n_ref() && (char*)refSeq + sizeof(_int32) <= buffer + headerSize &&
+                    (char*)refSeq->next() <= buffer + headerSize; n++) {
+                refSeq = refSeq->next();
+            }
+            if (n < header->n_ref()) {
+                if (headerSize < wanted) {
+                    WriteErrorMessage("%s ends in its header\n", fileNames[i]);
+                    break;
+                }
+                continue;
+            }
+            headerSizes[i] = (char*)refSeq - buffer;
+            ok = true;
+        }
+        delete data;
+    }
+
+    if (ok) {
+        int compressionLevel = options->compressionLevel >= 0 ? options->compressionLevel : GzipBlockCompressor::DefaultLevel;
+        GzipWriterFilterSupplier* gzipSupplier =
+            DataWriterSupplier::gzip(true, BAM_BLOCK, max(1, options->numThreads - 1), false, true, compressionLevel);
+        char* indexFileName;
+        bool csiIndex;
+        DataWriter::FilterSupplier* filters = SortedBAMFilters(options, genome, gzipSupplier, &indexFileName, &csiIndex);
+        char* nameIndexFileName;
+        filters = AddNameIndex(options, gzipSupplier, filters, &nameIndexFileName);
+        _int64 start = timeInMillis();
+        _int64 total;
+        ok = DataWriterSupplier::mergeSorted(FileFormat::BAM[0], genome, nFiles, fileNames, headerSizes, DataSupplier::GzipBamDefault,
+            options->outputFile.fileName, filters, options->writeBufferSize,
+            FileEncoder::gzip(gzipSupplier, options->numThreads, options->bindToProcessors), &total);
+        if (ok) {
+            WriteStatusMessage("Merged %lld reads from %d files into %s in %llds\n", total, nFiles, options->outputFile.fileName,
+                (timeInMillis() + 500 - start) / 1000);
+        }
+        free(indexFileName);
+        free(nameIndexFileName);
     }
-    return ReadWriterSupplier::create(this, dataSupplier, genome);
+    delete [] headerSizes;
+    return ok;
 }
 
     bool
@@ -776,7 +1732,7 @@ BAMFormat::writeHeader(
     char *header,
     size_t headerBufferSize,
     size_t *headerActualSize,
-    bool sorted,
+    SortOrder sortOrder,
     int argc,
     const char **argv,
     const char *version,
@@ -793,7 +1749,7 @@ BAMFormat::writeHeader(
     bamHeader->magic = BAMHeader::BAM_MAGIC;
     size_t samHeaderSize;
     bool ok = FileFormat::SAM[0]->writeHeader(context, bamHeader->text(), headerBufferSize - BAMHeader::size(0), &samHeaderSize,
-        sorted, argc, argv, version, rgLine, omitSQLines);
+        sortOrder, argc, argv, version, rgLine, omitSQLines);
     if (! ok) {
         return false;
     }
@@ -865,8 +1821,10 @@ BAMFormat::writeRead(
     GenomeDistance matePositionInContig = 0;
     _int64 templateLength = 0;
 
-    char data[MAX_READ];
-    char quality[MAX_READ];
+    char dataBuffer[MAX_READ];
+    char qualityBuffer[MAX_READ];
+    const char* data = dataBuffer;
+    const char* quality = qualityBuffer;
 
     const char* clippedData;
     unsigned fullLength;
@@ -874,22 +1832,37 @@ BAMFormat::writeRead(
     unsigned basesClippedBefore;
     GenomeDistance extraBasesClippedBefore;
     unsigned basesClippedAfter;
-    int editDistance;
+    int editDistance = -1;  // NM:i:-1 for unmapped reads, as in SAM
     int newAddFrontClipping = 0;
 
-    if (!SAMFormat::createSAMLine(context.genome, lv, 
-        // outputs:
-        data, quality, MAX_READ, contigName, contigIndex,
-        flags, positionInContig, mapQuality, mateContigName, mateContigIndex, matePositionInContig, templateLength,
-        fullLength, clippedData, clippedLength, basesClippedBefore, basesClippedAfter,
-        // inputs:
-        qnameLen, read, result, genomeLocation, direction, secondaryAlignment, useM,
-        hasMate, firstInPair, alignedAsPair, mate, mateResult, mateLocation, mateDirection,
-        &extraBasesClippedBefore))
-    {
-        return false;
-    }
-    if (genomeLocation != InvalidGenomeLocation) {
+    if (NotFound == result || InvalidGenomeLocation == genomeLocation) {
+        //
+        // Unmapped reads skip the CIGAR, and their bases go straight from the Read into the record.
+        //
+        genomeLocation = InvalidGenomeLocation;
+        SAMFormat::createUnmappedSAMLine(context.genome, contigName, contigIndex, flags, positionInContig, mateContigName, mateContigIndex,
+            matePositionInContig, qnameLen, read, secondaryAlignment, hasMate, firstInPair, mate, mateLocation, mateDirection);
+        mapQuality = 0;
+        fullLength = read->getUnclippedLength();
+        if (fullLength > MAX_READ) {
+            return false;
+        }
+        data = read->getUnclippedData();
+        quality = read->getUnclippedQuality();
+    } else {
+        if (!SAMFormat::createSAMLine(context.genome, lv, 
+            // outputs:
+            dataBuffer, qualityBuffer, MAX_READ, contigName, contigIndex,
+            flags, positionInContig, mapQuality, mateContigName, mateContigIndex, matePositionInContig, templateLength,
+            fullLength, clippedData, clippedLength, basesClippedBefore, basesClippedAfter,
+            // inputs:
+            qnameLen, read, result, genomeLocation, direction, secondaryAlignment, useM,
+            hasMate, firstInPair, alignedAsPair, mate, mateResult, mateLocation, mateDirection,
+            &extraBasesClippedBefore))
+        {
+            return false;
+        }
+
         cigarOps = computeCigarOps(context.genome, lv, (char*)cigarBuf, cigarBufSize * sizeof(_uint32),
                                    clippedData, clippedLength, basesClippedBefore, (unsigned)extraBasesClippedBefore, basesClippedAfter,
                                    read->getOriginalFrontHardClipping(), read->getOriginalBackHardClipping(),
@@ -899,6 +1872,14 @@ BAMFormat::writeRead(
         }
     }
 
+    //
+    // index -gtf: an alignment to a splice junction contig (ours or our mate's) goes in the genome, with its intron as N.
+    //
+    if (NULL != context.junctions && context.junctions->needsLift(contigIndex, mateContigIndex) && cigarOps + 2 <= cigarBufSize) {
+        context.junctions->liftRecord(contigIndex, positionInContig, read->getDataLength(), cigarBuf, cigarOps, mateContigIndex,
+            matePositionInContig, hasMate ? mate->getDataLength() : 0, hasMate && 0 == (flags & (SAM_UNMAPPED | SAM_NEXT_UNMAPPED)), templateLength);
+    }
+
     // Write the BAM entry
     unsigned auxLen;
     bool auxSAM;
@@ -926,6 +1907,21 @@ BAMFormat::writeRead(
             aux = NULL;
             auxLen = 0;
         }
+    } else if (aux != NULL && context.dropAuxData) {
+        //
+        // -dropAux keeps just the RG field, when that's where the read group is.
+        //
+        BAMAlignAux* readGroupField = NULL;
+        if (read->getReadGroup() == READ_GROUP_FROM_AUX) {
+            for (BAMAlignAux* bamAux = (BAMAlignAux*) aux; (char*) bamAux < aux + auxLen; bamAux = bamAux->next()) {
+                if (bamAux->tag[0] == 'R' && bamAux->tag[1] == 'G' && bamAux->val_type == 'Z') {
+                    readGroupField = bamAux;
+                    break;
+                }
+            }
+        }
+        aux = (char*) readGroupField;
+        auxLen = readGroupField != NULL ? (unsigned) readGroupField->size() : 0;
     }
     size_t bamSize = BAMAlignment::size((unsigned)qnameLen + 1, cigarOps, fullLength, auxLen);
     if (read->getReadGroup() != NULL && read->getReadGroup() != READ_GROUP_FROM_AUX) {
@@ -936,6 +1932,15 @@ BAMFormat::writeRead(
         }
     }
     bamSize += 12; // NM:C PG:Z:SNAP fields
+    if (read->wasAlignmentTruncated()) {
+        bamSize += 4;   // ZT:C, -workBudget ran out
+    }
+    if (read->getConsensusFamilySize() != 0) {
+        bamSize += 7;   // cD:I, -umi family size
+    }
+    if (read->getSATag() != NULL) {
+        bamSize += 4 + strlen(read->getSATag());   // SA:Z, -splitReads
+    }
     if (bamSize > bufferSpace) {
         return false;
     }
@@ -972,11 +1977,16 @@ BAMFormat::writeRead(
     memcpy(bam->read_name(), read->getId(), qnameLen);
     bam->read_name()[qnameLen] = 0;
     memcpy(bam->cigar(), cigarBuf, cigarOps * 4);
-    BAMAlignment::encodeSeq(bam->seq(), data, fullLength);
-    for (unsigned i = 0; i < fullLength; i++) {
-        quality[i] -= '!';
+    BAMAlignment::encodeSeq(bam->seq(), (char*)data, fullLength);
+    if (context.omitQualities) {
+        memset(bam->qual(), 0xff, fullLength);   // -noQual, BAM's missing quality
+    } else {
+        if (context.binQualities) {
+            SAMFormat::binQualities(qualityBuffer, quality, fullLength);
+            quality = qualityBuffer;
+        }
+        BAMAlignment::encodeQual(bam->qual(), quality, fullLength);
     }
-    memcpy(bam->qual(), quality, fullLength);
     if (aux != NULL && auxLen > 0) {
         if (((char*)bam->firstAux()) + auxLen > buffer + bufferSpace) {
             return false;
@@ -1019,9 +2029,30 @@ BAMFormat::writeRead(
     auxLen += (unsigned) pg->size();
     // NM
     BAMAlignAux* nm = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
-    nm->tag[0] = 'N'; nm->tag[1] = 'M'; nm->val_type = 'C';
+    nm->tag[0] = 'N'; nm->tag[1] = 'M'; nm->val_type = editDistance >= 0 ? 'C' : 'c';
     *(_uint8*)nm->value() = (_uint8)editDistance;
     auxLen += (unsigned) nm->size();
+    // ZT
+    if (read->wasAlignmentTruncated()) {
+        BAMAlignAux* zt = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
+        zt->tag[0] = 'Z'; zt->tag[1] = 'T'; zt->val_type = 'C';
+        *(_uint8*)zt->value() = 1;
+        auxLen += (unsigned) zt->size();
+    }
+    // cD
+    if (read->getConsensusFamilySize() != 0) {
+        BAMAlignAux* cd = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
+        cd->tag[0] = 'c'; cd->tag[1] = 'D'; cd->val_type = 'I';
+        *(_uint32*)cd->value() = read->getConsensusFamilySize();
+        auxLen += (unsigned) cd->size();
+    }
+    // SA
+    if (read->getSATag() != NULL) {
+        BAMAlignAux* sa = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
+        sa->tag[0] = 'S'; sa->tag[1] = 'A'; sa->val_type = 'Z';
+        strcpy((char*) sa->value(), read->getSATag());
+        auxLen += (unsigned) sa->size();
+    }
 
     if (NULL != spaceUsed) {
         *spaceUsed = bamSize;
@@ -1247,8 +2278,9 @@ struct DuplicateReadKey
     DuplicateReadKey()
     { memset(this, 0, sizeof(DuplicateReadKey)); }
 
-    DuplicateReadKey(const BAMAlignment* bam, const Genome* genome)
+    DuplicateReadKey(const BAMAlignment* bam, const Genome* genome, _uint32 i_library = 0)
     {
+        library = i_library;
         if (bam == NULL) {
             locations[0] = locations[1] = UINT32_MAX;
             isRC[0] = isRC[1] = false;
@@ -1271,7 +2303,7 @@ struct DuplicateReadKey
     bool operator==(const DuplicateReadKey& b) const
     {
         return locations[0] == b.locations[0] && locations[1] == b.locations[1] &&
-            isRC[0] == b.isRC[0] && isRC[1] == b.isRC[1];
+            isRC[0] == b.isRC[0] && isRC[1] == b.isRC[1] && library == b.library;
     }
 
     bool operator!=(const DuplicateReadKey& b) const
@@ -1285,22 +2317,25 @@ struct DuplicateReadKey
             (locations[0] == b.locations[0] &&
                 (locations[1] < b.locations[1] ||
                     (locations[1] == b.locations[1] &&
-                        isRC[0] * 2 + isRC[1] <  b.isRC[0] *2 + b.isRC[1])));
+                        (isRC[0] * 2 + isRC[1] <  b.isRC[0] *2 + b.isRC[1] ||
+                            (isRC[0] * 2 + isRC[1] == b.isRC[0] *2 + b.isRC[1] && library < b.library)))));
     }
 
 
     // required for use as a key in VariableSizeMap template
     DuplicateReadKey(int x)
-    { locations[0] = locations[1] = x; isRC[0] = isRC[1] = false; }
+    { locations[0] = locations[1] = x; isRC[0] = isRC[1] = false; library = 0; }
     bool operator==(int x) const
     { return locations[0] == (_uint32) x && locations[1] == (_uint32) x; }
     bool operator!=(int x) const
     { return locations[0] != (_uint32) x || locations[1] != (_uint32) x; }
     operator _uint64()
-    { return ((_uint64) (GenomeLocationAsInt64(locations[1]) ^ (isRC[1] ? 1 : 0))) << 32 | (_uint64) (GenomeLocationAsInt64(locations[0]) ^ (isRC[0] ? 1 : 0)); }
+    { return (((_uint64) (GenomeLocationAsInt64(locations[1]) ^ (isRC[1] ? 1 : 0))) << 32 | (_uint64) (GenomeLocationAsInt64(locations[0]) ^ (isRC[0] ? 1 : 0)))
+        ^ ((_uint64) library << 20); }
 
     GenomeLocation locations[2];
     bool isRC[2];
+    _uint32 library; // index of the read group in the filter's metrics, since only reads from the same library are duplicates
 };
 
 struct DuplicateMateInfo
@@ -1317,12 +2352,89 @@ struct DuplicateMateInfo
     const char* getBestReadId() { return bestReadId; }
 };
 
+//
+// Counts for one library in Picard's DuplicationMetrics format.  SNAP doesn't keep the LB of each read group, so
+// each read group is taken to be a library of its own.
+//
+struct DuplicateMetrics
+{
+    DuplicateMetrics() { memset(this, 0, sizeof(DuplicateMetrics)); }
+
+    void add(const DuplicateMetrics& other)
+    {
+        unpairedReads += other.unpairedReads;
+        pairedReads += other.pairedReads;
+        secondaryReads += other.secondaryReads;
+        unmappedReads += other.unmappedReads;
+        unpairedDuplicates += other.unpairedDuplicates;
+        pairedDuplicates += other.pairedDuplicates;
+    }
+
+    char library[120];
+    _int64 unpairedReads; // mapped, with no mapped mate
+    _int64 pairedReads; // reads, not pairs
+    _int64 secondaryReads; // secondary or supplementary
+    _int64 unmappedReads;
+    _int64 unpairedDuplicates;
+    _int64 pairedDuplicates; // reads
+};
+
+typedef VariableSizeVector<DuplicateMetrics> DuplicateMetricsVector;
+
+    static double
+LibrarySizeFunction(double x, double c, double n)
+{
+    return c / x - 1 + exp(-n / x);
+}
+
+    static _int64
+EstimateLibrarySize(
+    _int64 readPairs,
+    _int64 uniqueReadPairs)
+/*++
+
+Routine Description:
+
+    Picard's estimate of the number of distinct molecules in a library, from the Lander-Waterman equation
+    c/x = 1 - exp(-n/x), where n is the number of pairs and c the number that aren't duplicates.
+
+Return Value:
+
+    The estimate, or -1 if there aren't any duplicates to estimate it from
+
+--*/
+{
+    if (readPairs <= 0 || readPairs <= uniqueReadPairs) {
+        return -1;
+    }
+    double n = (double)readPairs, c = (double)uniqueReadPairs;
+    double m = 1.0, M = 100.0;
+    if (LibrarySizeFunction(m * c, c, n) < 0) {
+        return -1;
+    }
+    while (LibrarySizeFunction(M * c, c, n) > 0) {
+        M *= 10.0;
+    }
+    for (int i = 0; i < 40; i++) {
+        double r = (m + M) / 2.0;
+        double u = LibrarySizeFunction(r * c, c, n);
+        if (u == 0) {
+            break;
+        } else if (u > 0) {
+            m = r;
+        } else {
+            M = r;
+        }
+    }
+    return (_int64)(c * (m + M) / 2.0);
+}
+
 class BAMDupMarkFilter : public BAMFilter
 {
 public:
     BAMDupMarkFilter(const Genome* i_genome) :
         BAMFilter(DataWriter::ModifyFilter),
-        genome(i_genome), runOffset(0), runLocation(UINT32_MAX), runCount(0), mates()
+        genome(i_genome), runOffset(0), runLocation(UINT32_MAX), runCount(0), mates(), lastLibrary(-1)
     {}
 
     ~BAMDupMarkFilter()
@@ -1341,17 +2453,29 @@ public:
     { return a->pos == b->pos && a->refID == b->refID &&
         ((a->FLAG ^ b->FLAG) & (SAM_REVERSE_COMPLEMENT | SAM_NEXT_REVERSED)) == 0; }
 
+    const DuplicateMetricsVector* getMetrics() const
+    { return &metrics; }
+
 protected:
     virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
 
 private:
     static int getTotalQuality(BAMAlignment* bam);
 
+    static bool isMappedPair(const BAMAlignment* bam)
+    { return (bam->FLAG & (SAM_MULTI_SEGMENT | SAM_UNMAPPED | SAM_NEXT_UNMAPPED)) == SAM_MULTI_SEGMENT; }
+
+    // index of the read's library (read group) in metrics, adding it if it's new
+    int getLibrary(BAMAlignment* bam);
+
+    // set or clear the duplicate flag, keeping count
+    void setDuplicate(BAMAlignment* bam, bool duplicate);
+
     const Genome* genome;
     size_t runOffset; // offset in file of first read in run
     GenomeLocation runLocation; // location in genome
     int runCount; // number of aligned reads
-    typedef VariableSizeMap<DuplicateReadKey,DuplicateMateInfo,150,MapNumericHash<DuplicateReadKey>,70,0,-2> MateMap;
+    typedef VariableSizeGroupMap<DuplicateReadKey,DuplicateMateInfo,150,MapNumericHash<DuplicateReadKey>,70> MateMap;
     static const _uint64 RunKey = 0xffffffffc0000000UL;
     static const _uint64 RunRC = 0x80000000;
     static const _uint64 RunNextRC = 0x40000000;
@@ -1359,11 +2483,62 @@ private:
     typedef VariableSizeVector<_uint64> RunVector;
     RunVector run;
     MateMap mates;
+    DuplicateMetricsVector metrics;
+    int lastLibrary;
 };
 
+    int
+BAMDupMarkFilter::getLibrary(
+    BAMAlignment* bam)
+{
+    const char* name = "Unknown Library";
+    for (BAMAlignAux* aux = bam->firstAux(); aux < bam->endAux(); aux = aux->next()) {
+        if (aux->val_type == 'Z' && aux->tag[0] == 'R' && aux->tag[1] == 'G') {
+            name = (const char*) aux->value();
+            break;
+        }
+    }
+    // almost always the same as the last one
+    if (lastLibrary >= 0 && 0 == strncmp(metrics[lastLibrary].library, name, sizeof(metrics[lastLibrary].library) - 1)) {
+        return lastLibrary;
+    }
+    for (lastLibrary = 0; lastLibrary < metrics.size(); lastLibrary++) {
+        if (0 == strncmp(metrics[lastLibrary].library, name, sizeof(metrics[lastLibrary].library) - 1)) {
+            return lastLibrary;
+        }
+    }
+    DuplicateMetrics library;
+    strncpy(library.library, name, sizeof(library.library) - 1);
+    metrics.push_back(library);
+    return lastLibrary;
+}
+
+    void
+BAMDupMarkFilter::setDuplicate(
+    BAMAlignment* bam,
+    bool duplicate)
+{
+    if (((bam->FLAG & SAM_DUPLICATE) != 0) == duplicate) {
+        return;
+    }
+    bam->FLAG ^= SAM_DUPLICATE;
+    DuplicateMetrics* counts = &metrics[getLibrary(bam)];
+    (isMappedPair(bam) ? counts->pairedDuplicates : counts->unpairedDuplicates) += duplicate ? 1 : -1;
+}
+
     void
 BAMDupMarkFilter::onRead(BAMAlignment* lastBam, size_t lastOffset, int)
 {
+    DuplicateMetrics* counts = &metrics[getLibrary(lastBam)];
+    if ((lastBam->FLAG & (SAM_SECONDARY | SAM_SUPPLEMENTARY)) != 0) {
+        counts->secondaryReads++;
+    } else if ((lastBam->FLAG & SAM_UNMAPPED) != 0) {
+        counts->unmappedReads++;
+    } else if (isMappedPair(lastBam)) {
+        counts->pairedReads++;
+    } else {
+        counts->unpairedReads++;
+    }
     if ((lastBam->FLAG & SAM_SECONDARY) != 0) {
         return; // ignore secondary aliignments; todo: mark them as dups too?
     }
@@ -1416,7 +2591,7 @@ BAMDupMarkFilter::onRead(BAMAlignment* lastBam, size_t lastOffset, int)
                     continue;
                 }
                 foundRun = true;
-                DuplicateReadKey key(record, genome);
+                DuplicateReadKey key(record, genome, getLibrary(record));
                 MateMap::iterator f = mates.find(key);
                 DuplicateMateInfo* info;
                 if (f == mates.end()) {
@@ -1472,7 +2647,7 @@ BAMDupMarkFilter::onRead(BAMAlignment* lastBam, size_t lastOffset, int)
                     i++;
                     continue;
                 }
-                DuplicateReadKey key(record, genome);
+                DuplicateReadKey key(record, genome, getLibrary(record));
                 MateMap::iterator m = mates.find(key);
                 if (m == mates.end()) {
                     continue; // one end in a run, other not
@@ -1484,15 +2659,15 @@ BAMDupMarkFilter::onRead(BAMAlignment* lastBam, size_t lastOffset, int)
                 if (offset != minfo->bestReadOffset[index[pass][isSecond]]) {
                     // Picard markDuplicates will not mark unmapped reads
                     if ((record->FLAG & SAM_UNMAPPED) == 0) {
-                        record->FLAG |= SAM_DUPLICATE;
+                        setDuplicate(record, true);
                     }
                 } else if (pass == 1 && minfo->bestReadOffset[2] != 0 && minfo->bestReadOffset[0] != 0 && minfo->bestReadOffset[2] != minfo->bestReadOffset[0]) {
                     // backpatch reads in first matelist if they're still in memory
                     BAMAlignment* oldBest = getRead(minfo->bestReadOffset[0]);
                     BAMAlignment* newBest = getRead(minfo->bestReadOffset[2]);
                     if (oldBest != NULL && newBest != NULL) {
-                        oldBest->FLAG &= ~SAM_DUPLICATE;
-                        newBest->FLAG |= SAM_DUPLICATE;
+                        setDuplicate(oldBest, true);
+                        setDuplicate(newBest, false);
                     } else {
                         if (failedBackpatch == NULL) {
                             failedBackpatch = new VariableSizeVector<DuplicateMateInfo*>();
@@ -1511,8 +2686,8 @@ BAMDupMarkFilter::onRead(BAMAlignment* lastBam, size_t lastOffset, int)
                     BAMAlignment* firstBestSecond = getRead((*i)->bestReadOffset[3]);
                     _ASSERT(trueBestSecond != NULL && firstBestSecond != NULL);
                     if (trueBestSecond != NULL && firstBestSecond != NULL) {
-                        trueBestSecond->FLAG &= ~SAM_DUPLICATE;
-                        firstBestSecond->FLAG |= ~SAM_DUPLICATE;
+                        setDuplicate(trueBestSecond, true);
+                        setDuplicate(firstBestSecond, false);
                     }
                 }
             }
@@ -1530,7 +2705,7 @@ BAMDupMarkFilter::onRead(BAMAlignment* lastBam, size_t lastOffset, int)
                     i++;
                     continue;
                 }
-                DuplicateReadKey key(record, genome);
+                DuplicateReadKey key(record, genome, getLibrary(record));
                 MateMap::iterator m = mates.find(key);
                 if (m != mates.end() && m->value.firstRunOffset != runOffset) {
                     mates.erase(key);
@@ -1562,23 +2737,107 @@ BAMDupMarkFilter::getTotalQuality(
 class BAMDupMarkSupplier : public DataWriter::FilterSupplier
 {
 public:
-    BAMDupMarkSupplier(const Genome* i_genome) :
-        FilterSupplier(DataWriter::ReadFilter), genome(i_genome) {}
+    BAMDupMarkSupplier(const Genome* i_genome, const char* i_metricsFileName) :
+        FilterSupplier(DataWriter::ReadFilter), genome(i_genome), metricsFileName(i_metricsFileName)
+    {
+        InitializeExclusiveLock(&lock);
+    }
 
-    virtual DataWriter::Filter* getFilter()
-    { return new BAMDupMarkFilter(genome); }
+    virtual ~BAMDupMarkSupplier()
+    {
+        DestroyExclusiveLock(&lock);
+    }
+
+    virtual DataWriter::Filter* getFilter();
 
     virtual void onClosing(DataWriterSupplier* supplier) {}
-    virtual void onClosed(DataWriterSupplier* supplier) {}
+
+    // writes the metrics file, if there is one (there isn't for a part of a file, see BAMSortedPartSupplier)
+    virtual void onClosed(DataWriterSupplier* supplier);
+
+    // write the metrics for all the suppliers' filters together, a line for each library
+    static void WriteMetrics(const char* metricsFileName, int nSuppliers, BAMDupMarkSupplier** suppliers);
 
 private:
     const Genome* genome;
+    const char* metricsFileName;
+    ExclusiveLock lock;
+    VariableSizeVector<BAMDupMarkFilter*> filters; // they outlive the file, so their counts can be gathered at the end
 };
 
+    DataWriter::Filter*
+BAMDupMarkSupplier::getFilter()
+{
+    BAMDupMarkFilter* filter = new BAMDupMarkFilter(genome);
+    AcquireExclusiveLock(&lock);
+    filters.push_back(filter);
+    ReleaseExclusiveLock(&lock);
+    return filter;
+}
+
+    void
+BAMDupMarkSupplier::onClosed(
+    DataWriterSupplier* supplier)
+{
+    if (metricsFileName != NULL) {
+        BAMDupMarkSupplier* self = this;
+        WriteMetrics(metricsFileName, 1, &self);
+    }
+}
+
+    void
+BAMDupMarkSupplier::WriteMetrics(
+    const char* metricsFileName,
+    int nSuppliers,
+    BAMDupMarkSupplier** suppliers)
+{
+    DuplicateMetricsVector libraries;
+    for (int i = 0; i < nSuppliers; i++) {
+        for (BAMDupMarkFilter** filter = suppliers[i]->filters.begin(); filter != suppliers[i]->filters.end(); filter++) {
+            const DuplicateMetricsVector* metrics = (*filter)->getMetrics();
+            for (int j = 0; j < metrics->size(); j++) {
+                int k;
+                for (k = 0; k < libraries.size() && 0 != strcmp(libraries[k].library, (*metrics)[j].library); k++) {
+                    // just looking
+                }
+                if (k == libraries.size()) {
+                    DuplicateMetrics library;
+                    strcpy(library.library, (*metrics)[j].library);
+                    libraries.push_back(library);
+                }
+                libraries[k].add((*metrics)[j]);
+            }
+        }
+    }
+
+    FILE* file = fopen(metricsFileName, "w");
+    if (file == NULL) {
+        WriteErrorMessage("unable to open duplicate metrics file %s\n", metricsFileName);
+        return;
+    }
+    fprintf(file, "## METRICS CLASS\tpicard.sam.DuplicationMetrics\n"
+        "LIBRARY\tUNPAIRED_READS_EXAMINED\tREAD_PAIRS_EXAMINED\tSECONDARY_OR_SUPPLEMENTARY_RDS\tUNMAPPED_READS\t"
+        "UNPAIRED_READ_DUPLICATES\tREAD_PAIR_DUPLICATES\tREAD_PAIR_OPTICAL_DUPLICATES\tPERCENT_DUPLICATION\tESTIMATED_LIBRARY_SIZE\n");
+    for (DuplicateMetrics* m = libraries.begin(); m != libraries.end(); m++) {
+        _int64 pairs = m->pairedReads / 2, pairDuplicates = m->pairedDuplicates / 2;
+        _int64 examined = m->unpairedReads + pairs * 2;
+        double percent = examined > 0 ? (double)(m->unpairedDuplicates + pairDuplicates * 2) / examined : 0.0;
+        fprintf(file, "%s\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t0\t%.6f\t", m->library, m->unpairedReads, pairs, m->secondaryReads,
+            m->unmappedReads, m->unpairedDuplicates, pairDuplicates, percent);
+        _int64 librarySize = EstimateLibrarySize(pairs, pairs - pairDuplicates);
+        if (librarySize >= 0) {
+            fprintf(file, "%lld", librarySize);
+        }
+        fprintf(file, "\n");
+    }
+    fprintf(file, "\n");
+    fclose(file);
+}
+
     DataWriter::FilterSupplier*
-DataWriterSupplier::markDuplicates(const Genome* genome)
+DataWriterSupplier::markDuplicates(const Genome* genome, const char* metricsFileName)
 {
-    return new BAMDupMarkSupplier(genome);
+    return new BAMDupMarkSupplier(genome, metricsFileName);
 }
 
 class BAMIndexSupplier;
@@ -1599,24 +2858,44 @@ private:
 class BAMIndexSupplier : public DataWriter::FilterSupplier
 {
 public:
-    BAMIndexSupplier(const char* i_indexFileName, const Genome* i_genome, GzipWriterFilterSupplier* i_gzipSupplier) :
+    BAMIndexSupplier(const char* i_indexFileName, const Genome* i_genome, GzipWriterFilterSupplier* i_gzipSupplier, bool i_csi) :
         FilterSupplier(DataWriter::ReadFilter),
         indexFileName(i_indexFileName),
         genome(i_genome),
         gzipSupplier(i_gzipSupplier),
+        csi(i_csi),
         lastRefId(-1),
         lastBin(0), binStart(0), lastBamEnd(0)
     {
         refs = genome ? new RefInfo[genome->getNumContigs()] : NULL;
         readCounts[0] = readCounts[1] = 0;
+        csiDepth = 5;
+        if (csi && genome != NULL) {
+            _int64 maxLength = 0;
+            for (int i = 0; i < genome->getNumContigs(); i++) {
+                maxLength = max(maxLength, (_int64) genome->getContigs()[i].length);
+            }
+            csiDepth = BAMAlignment::csiDepth(maxLength);
+        }
+        metaBin = BAMAlignment::csiMetaBin(csiDepth);
     }
 
+    virtual ~BAMIndexSupplier()
+    { delete [] refs; }
+
     virtual DataWriter::Filter* getFilter()
     { return new BAMIndexFilter(this); }
 
     virtual void onClosing(DataWriterSupplier* supplier) {}
+
+    // writes the index file, unless there's no file name because it's for a part of the file (see BAMSortedPartSupplier)
     virtual void onClosed(DataWriterSupplier* supplier);
 
+    // write the index for a file made of parts with an index supplier each, appended at partOffsets
+    // (BAI or CSI, as the parts were built)
+    static void WriteIndex(const char* indexFileName, const Genome* genome, int nParts, BAMIndexSupplier** parts,
+        const size_t* partOffsets);
+
 private:
 
     friend class BAMIndexFilter;
@@ -1643,6 +2922,17 @@ private:
 
     void addInterval(int refId, int begin, int end, _uint64 fileOffset);
 
+    // give linear index intervals that no read overlaps the offset of the one before, so readers don't start from 0
+    void fillIntervals();
+
+    // the part that has the reads for a contig (each contig is all in one part)
+    static BAMIndexSupplier* FindPart(int refId, int nParts, BAMIndexSupplier** parts, const size_t* partOffsets,
+        _uint64* o_partOffset);
+
+    // BAM virtual offset in the whole file, given where this part of it starts
+    _uint64 toVirtualOffset(_uint64 logical, _uint64 partOffset)
+    { return logical != UINT64_MAX ? gzipSupplier->toVirtualOffset(logical) + (partOffset << 16) : 0; }
+
     const char* indexFileName;
     const Genome* genome;
     int lastRefId;
@@ -1653,6 +2943,9 @@ private:
     _uint64 readCounts[2]; // mapped, unmapped
     RefInfo* refs;
     GzipWriterFilterSupplier* gzipSupplier;
+    bool csi; // write CSI rather than BAI
+    int csiDepth; // levels of bins, 5 for BAI
+    _uint32 metaBin; // pseudo-bin for the file range & read counts of each contig
 };
 
     void
@@ -1668,9 +2961,10 @@ BAMIndexFilter::onRead(
 DataWriterSupplier::bamIndex(
     const char* indexFileName,
     const Genome* genome,
-    GzipWriterFilterSupplier* gzipSupplier)
+    GzipWriterFilterSupplier* gzipSupplier,
+    bool csi)
 {
-    return new BAMIndexSupplier(indexFileName, genome, gzipSupplier);
+    return new BAMIndexSupplier(indexFileName, genome, gzipSupplier, csi);
 }
 
     void
@@ -1682,16 +2976,22 @@ BAMIndexSupplier::onRead(
     //fprintf(stderr, "index onRead %d:%d+%d @ %lld %d\n", bam->refID, bam->pos, bam->l_ref(), fileOffset, batchIndex);
     if (bam->refID != lastRefId) {
         if (lastRefId != -1) {
-            addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, firstBamStart, lastBamEnd);
-            addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, readCounts[0], readCounts[1]);
+            addChunk(lastRefId, metaBin, firstBamStart, lastBamEnd);
+            addChunk(lastRefId, metaBin, readCounts[0], readCounts[1]);
             readCounts[0] = readCounts[1] = 0;
         }
         firstBamStart = fileOffset;
     }
     readCounts[(bam->FLAG & SAM_UNMAPPED) ? 1 : 0]++;
-    if (bam->refID != lastRefId || bam->bin != lastBin || lastRefId == -1) {
+    // the bin in the record is only good for BAI
+    _uint32 bin = bam->bin;
+    if (csi) {
+        _int64 end = bam->pos + ((bam->FLAG & SAM_UNMAPPED) ? 0 : bam->l_ref());
+        bin = BAMAlignment::csiReg2bin(bam->pos, max(end, (_int64) bam->pos + 1), csiDepth);
+    }
+    if (bam->refID != lastRefId || bin != lastBin || lastRefId == -1) {
         addChunk(lastRefId, lastBin, binStart, fileOffset);
-        lastBin = bam->bin;
+        lastBin = bin;
         lastRefId = bam->refID;
         binStart = fileOffset;
     }
@@ -1709,25 +3009,87 @@ BAMIndexSupplier::onClosed(
     // add final chunk
     if (lastRefId != -1) {
         addChunk(lastRefId, lastBin, binStart, lastBamEnd);
-        addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, firstBamStart, lastBamEnd);
-        addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, readCounts[0], readCounts[1]);
+        addChunk(lastRefId, metaBin, firstBamStart, lastBamEnd);
+        addChunk(lastRefId, metaBin, readCounts[0], readCounts[1]);
     }
+    fillIntervals();
 
+    if (indexFileName != NULL) {
+        BAMIndexSupplier* self = this;
+        size_t offset = 0;
+        WriteIndex(indexFileName, genome, 1, &self, &offset);
+    }
+}
+
+    BAMIndexSupplier*
+BAMIndexSupplier::FindPart(
+    int refId,
+    int nParts,
+    BAMIndexSupplier** parts,
+    const size_t* partOffsets,
+    _uint64* o_partOffset)
+{
+    int part = 0;
+    for (int p = 0; p < nParts; p++) {
+        RefInfo* info = parts[p]->getRefInfo(refId);
+        if (info != NULL && (info->bins.size() > 0 || info->intervals.size() > 0)) {
+            part = p;
+            break;
+        }
+    }
+    *o_partOffset = partOffsets[part];
+    return parts[part];
+}
+
+    void
+BAMIndexSupplier::WriteIndex(
+    const char* indexFileName,
+    const Genome* genome,
+    int nParts,
+    BAMIndexSupplier** parts,
+    const size_t* partOffsets)
+/*++
+
+Routine Description:
+
+    Write a BAI, or a CSI if the parts were built for one.  CSI has no linear index; instead each bin gets
+    the offset from the linear index interval where it starts, so the intervals are just as useful.
+
+--*/
+{
     // write out index file
     FILE* index = fopen(indexFileName, "wb");
-    char magic[4] = {'B', 'A', 'I', 1};
-    fwrite(magic, sizeof(magic), 1, index);
+    if (index == NULL) {
+        WriteErrorMessage("Unable to open index file %s\n", indexFileName);
+        return;
+    }
+    bool csi = parts[0]->csi;
+    int depth = parts[0]->csiDepth;
+    _uint32 metaBin = parts[0]->metaBin;
+    if (csi) {
+        char magic[4] = {'C', 'S', 'I', 1};
+        fwrite(magic, sizeof(magic), 1, index);
+        _int32 header[3] = {BAMAlignment::CSI_MIN_SHIFT, depth, 0}; // min_shift, depth, l_aux
+        fwrite(header, sizeof(header), 1, index);
+    } else {
+        char magic[4] = {'B', 'A', 'I', 1};
+        fwrite(magic, sizeof(magic), 1, index);
+    }
     _int32 n_ref = genome->getNumContigs();
     fwrite(&n_ref, sizeof(n_ref), 1, index);
 
     for (int i = 0; i < n_ref; i++) {
-        RefInfo* info = getRefInfo(i);
+        _uint64 partOffset;
+        BAMIndexSupplier* supplier = FindPart(i, nParts, parts, partOffsets, &partOffset);
+        RefInfo* info = supplier->getRefInfo(i);
         _int32 n_bin, n_intv;
         if (info == NULL) {
             n_bin = 0;
             fwrite(&n_bin, sizeof(n_bin), 1, index);
-            n_intv = 0;
-            fwrite(&n_intv, sizeof(n_intv), 1, index);
+            if (! csi) {
+                n_intv = 0;
+                fwrite(&n_intv, sizeof(n_intv), 1, index);
+            }
             continue;
         }
         n_bin = info->bins.size();
@@ -1735,26 +3097,39 @@ BAMIndexSupplier::onClosed(
         for (BinMap::iterator j = info->bins.begin(); j != info->bins.end(); j = info->bins.next(j)) {
             _uint32 bin = j->key;
             fwrite(&bin, sizeof(bin), 1, index);
+            if (csi) {
+                _uint64 loffset = 0;
+                if (bin != metaBin) {
+                    _int64 interval = BAMAlignment::csiBinFirstInterval(bin, depth);
+                    if (interval < info->intervals.size()) {
+                        loffset = supplier->toVirtualOffset(info->intervals[interval], partOffset);
+                    }
+                }
+                fwrite(&loffset, sizeof(loffset), 1, index);
+            }
             _int32 n_chunk = (_int32) j->value.size();
             fwrite(&n_chunk, sizeof(n_chunk), 1, index);
-            if (bin != BAMAlignment::BAM_EXTRA_BIN) {
+            if (bin != metaBin) {
                 for (ChunkVec::iterator k = j->value.begin(); k != j->value.end(); k++) {
-                    _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(k->start), gzipSupplier->toVirtualOffset(k->end)};
+                    _uint64 chunk[2] = {supplier->toVirtualOffset(k->start, partOffset), supplier->toVirtualOffset(k->end, partOffset)};
                     fwrite(&chunk, sizeof(chunk), 1, index);
                 }
             } else {
-                _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(j->value[0].start), gzipSupplier->toVirtualOffset(j->value[0].end)};
+                _uint64 chunk[2] = {supplier->toVirtualOffset(j->value[0].start, partOffset),
+                    supplier->toVirtualOffset(j->value[0].end, partOffset)};
                 fwrite(&chunk, sizeof(chunk), 1, index);
                 chunk[0] = j->value[1].start;
                 chunk[1] = j->value[1].end;
                 fwrite(&chunk, sizeof(chunk), 1, index);
             }
         }
-        n_intv = (_int32) info->intervals.size();
-        fwrite(&n_intv, sizeof(n_intv), 1, index);
-        for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
-            _uint64 ioffset = gzipSupplier->toVirtualOffset(*m);
-            fwrite(&ioffset, sizeof(ioffset), 1, index);
+        if (! csi) {
+            n_intv = (_int32) info->intervals.size();
+            fwrite(&n_intv, sizeof(n_intv), 1, index);
+            for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
+                _uint64 ioffset = supplier->toVirtualOffset(*m, partOffset);
+                fwrite(&ioffset, sizeof(ioffset), 1, index);
+            }
         }
     }
     fclose(index);
@@ -1800,13 +3175,615 @@ BAMIndexSupplier::addInterval(
     if (info == NULL) {
         return;
     }
-    int slot = end <= 0 ? 0 : ((end - 1) / 16384);
-    if (slot >= info->intervals.size()) {
-        for (_int64 i = info->intervals.size(); i < slot; i++) {
-            info->intervals.push_back(UINT64_MAX);
+    // reads come in order of begin, so the first one to touch an interval has the smallest offset
+    int first = begin >> BAMAlignment::CSI_MIN_SHIFT;
+    int last = max(begin, end) >> BAMAlignment::CSI_MIN_SHIFT;
+    while (info->intervals.size() <= last) {
+        info->intervals.push_back(UINT64_MAX);
+    }
+    for (int slot = first; slot <= last; slot++) {
+        if (info->intervals[slot] == UINT64_MAX) {
+            info->intervals[slot] = fileOffset;
+        }
+    }
+}
+
+    void
+BAMIndexSupplier::fillIntervals()
+{
+    if (refs == NULL) {
+        return;
+    }
+    for (int i = 0; i < genome->getNumContigs(); i++) {
+        LinearMap* intervals = &refs[i].intervals;
+        for (_int64 j = 1; j < intervals->size(); j++) {
+            if ((*intervals)[j] == UINT64_MAX) {
+                (*intervals)[j] = (*intervals)[j - 1];
+            }
+        }
+    }
+}
+
+//
+// -nameIndex: the read name index (see ReadNameIndex.h) of sorted BAM output, from the records as they're written.  As
+// with the BAI, their offsets are translated to virtual offsets once the file's compressed.
+//
+//
+// Read name index (-nameIndex): the name and offset of each record as it's written, like the BAI's, made into an index
+// by ReadNameIndexBuilder when the file's closed.
+//
+class BAMNameIndexSupplier;
+
+class BAMNameIndexFilter : public BAMFilter
+{
+public:
+    BAMNameIndexFilter(BAMNameIndexSupplier* i_supplier)
+        : BAMFilter(DataWriter::ReadFilter), supplier(i_supplier) {}
+
+protected:
+    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+
+private:
+    BAMNameIndexSupplier* supplier;
+};
+
+class BAMNameIndexSupplier : public DataWriter::FilterSupplier
+{
+public:
+    // indexFileName is NULL for a part of a file, whose index is written with the others' (see BAMSortedPartSupplier);
+    // the temp files are named after tempFilePrefix
+    BAMNameIndexSupplier(const char* i_indexFileName, const char* tempFilePrefix, GzipWriterFilterSupplier* gzipSupplier) :
+        FilterSupplier(DataWriter::ReadFilter), indexFileName(i_indexFileName), builder(tempFilePrefix, gzipSupplier) {}
+
+    virtual DataWriter::Filter* getFilter()
+    { return new BAMNameIndexFilter(this); }
+
+    virtual void onClosing(DataWriterSupplier* supplier) {}
+
+    virtual void onClosed(DataWriterSupplier* supplier)
+    {
+        ReadNameIndexBuilder* self = &builder;
+        if (indexFileName != NULL && ! ReadNameIndexBuilder::WriteIndex(indexFileName, 1, &self, NULL)) {
+            soft_exit(1);
+        }
+    }
+
+    static void WriteIndex(const char* indexFileName, int nParts, BAMNameIndexSupplier** parts, const size_t* partOffsets)
+    {
+        ReadNameIndexBuilder** builders = new ReadNameIndexBuilder*[nParts];
+        for (int i = 0; i < nParts; i++) {
+            builders[i] = &parts[i]->builder;
+        }
+        if (! ReadNameIndexBuilder::WriteIndex(indexFileName, nParts, builders, partOffsets)) {
+            soft_exit(1);
+        }
+        delete [] builders;
+    }
+
+private:
+    friend class BAMNameIndexFilter;
+
+    const char* indexFileName;
+    ReadNameIndexBuilder builder;
+};
+
+    void
+BAMNameIndexFilter::onRead(
+    BAMAlignment* bam,
+    size_t fileOffset,
+    int batchIndex)
+{
+    supplier->builder.add(bam->read_name(), bam->l_read_name > 0 ? bam->l_read_name - 1 : 0, fileOffset);
+}
+
+    DataWriter::FilterSupplier*
+DataWriterSupplier::bamNameIndex(
+    const char* indexFileName,
+    GzipWriterFilterSupplier* gzipSupplier)
+{
+    return new BAMNameIndexSupplier(indexFileName, indexFileName, gzipSupplier);
+}
+
+//
+// Filters for each part of a sorted BAM file merged on several threads: each part is compressed with its own
+// encoder and has duplicates marked on its own, and the parts' indexes are put together once they've been appended.
+// A shard is indexed on its own, into an index file named after it.
+//
+//
+// Alignment metrics (-alnMetrics): what samtools flagstat, idxstats & stats (MAPQs and insert sizes) and mosdepth would
+// otherwise need passes over the finished file for, gathered from the records as the sorted merge writes them.  Each
+// part of a parallel merge has its own counts, added up at the end, except for the coverage bins, which are shared
+// (a read near the end of one part's range can cover bins of the next) and added to with interlocked adds.
+//
+// Depth counts the aligned (M, = and X) bases of mapped reads that aren't secondary or QC failures.  Duplicates are
+// counted like anything else (and not counted as duplicates), since they're still being marked when the reads go by;
+// -dmm has their numbers.
+//
+class BAMCoverageBins
+{
+public:
+    BAMCoverageBins(const Genome* i_genome, unsigned i_binSize);
+
+    ~BAMCoverageBins()
+    { delete [] firstBin; delete [] bases; }
+
+    // the aligned bases from begin to end (exclusive) of a contig
+    void add(int refID, _int64 begin, _int64 end);
+
+    void write(const char* fileName);
+
+private:
+    const Genome*       genome;
+    _int64              binSize;
+    _int64*             firstBin; // for each contig
+    volatile _int64*    bases;
+};
+
+BAMCoverageBins::BAMCoverageBins(
+    const Genome* i_genome,
+    unsigned i_binSize)
+    : genome(i_genome), binSize(i_binSize)
+{
+    int nContigs = genome->getNumContigs();
+    firstBin = new _int64[nContigs + 1];
+    firstBin[0] = 0;
+    for (int i = 0; i < nContigs; i++) {
+        firstBin[i + 1] = firstBin[i] + (genome->getContigs()[i].length + binSize - 1) / binSize;
+    }
+    bases = new _int64[firstBin[nContigs]];
+    memset((void*)bases, 0, firstBin[nContigs] * sizeof(_int64));
+}
+
+    void
+BAMCoverageBins::add(
+    int refID,
+    _int64 begin,
+    _int64 end)
+{
+    end = min(end, (_int64)genome->getContigs()[refID].length);
+    while (begin < end) {
+        _int64 binEnd = (begin / binSize + 1) * binSize;
+        _int64 overlap = min(end, binEnd) - begin;
+        InterlockedAdd64AndReturnNewValue(&bases[firstBin[refID] + begin / binSize], overlap);
+        begin += overlap;
+    }
+}
+
+    void
+BAMCoverageBins::write(
+    const char* fileName)
+{
+    FILE* file = fopen(fileName, "w");
+    if (file == NULL) {
+        WriteErrorMessage("unable to open coverage file %s\n", fileName);
+        return;
+    }
+    for (int i = 0; i < genome->getNumContigs(); i++) {
+        const Genome::Contig* contig = &genome->getContigs()[i];
+        for (_int64 bin = firstBin[i]; bin < firstBin[i + 1]; bin++) {
+            _int64 start = (bin - firstBin[i]) * binSize;
+            _int64 end = min(start + binSize, (_int64)contig->length);
+            fprintf(file, "%s\t%lld\t%lld\t%.2f\n", contig->name, start, end, (double)bases[bin] / (end - start));
         }
-        info->intervals.push_back(fileOffset);
     }
+    fclose(file);
+}
+
+class BAMMetricsFilter : public BAMFilter
+{
+public:
+    BAMMetricsFilter(int i_nContigs, BAMCoverageBins* i_bins);
+
+    ~BAMMetricsFilter()
+    { delete [] contigReads; delete [] contigBases; }
+
+    enum Count {Total, Primary, Secondary, Supplementary, Mapped, PrimaryMapped, Paired, Read1, Read2,
+        ProperlyPaired, BothMapped, Singletons, MateOnOtherContig, MateOnOtherContigMapq5, NCounts};
+
+    static const int MaxInsertSize = 10000; // bigger ones are counted, but not in the distribution
+
+protected:
+    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+
+private:
+    friend class BAMMetricsSupplier;
+
+    int                 nContigs;
+    BAMCoverageBins*    bins; // NULL for none
+    _int64              counts[NCounts];
+    _int64              mapqCounts[256]; // primary mapped reads
+    _int64              insertCounts[MaxInsertSize + 2]; // pairs on the same contig, with the last for bigger ones
+    _int64*             contigReads; // primary mapped reads on each contig
+    _int64*             contigBases; // aligned bases on each contig, for the depth
+};
+
+BAMMetricsFilter::BAMMetricsFilter(
+    int i_nContigs,
+    BAMCoverageBins* i_bins)
+    : BAMFilter(DataWriter::ReadFilter), nContigs(i_nContigs), bins(i_bins),
+    contigReads(new _int64[i_nContigs]), contigBases(new _int64[i_nContigs])
+{
+    memset(counts, 0, sizeof(counts));
+    memset(mapqCounts, 0, sizeof(mapqCounts));
+    memset(insertCounts, 0, sizeof(insertCounts));
+    memset(contigReads, 0, nContigs * sizeof(_int64));
+    memset(contigBases, 0, nContigs * sizeof(_int64));
+}
+
+    void
+BAMMetricsFilter::onRead(
+    BAMAlignment* bam,
+    size_t fileOffset,
+    int batchIndex)
+{
+    int flag = bam->FLAG;
+    bool mapped = (flag & SAM_UNMAPPED) == 0 && bam->refID >= 0 && bam->refID < nContigs;
+    bool primary = (flag & (SAM_SECONDARY | SAM_SUPPLEMENTARY)) == 0;
+    counts[Total]++;
+    counts[Primary] += primary;
+    counts[Secondary] += (flag & SAM_SECONDARY) != 0;
+    counts[Supplementary] += (flag & SAM_SUPPLEMENTARY) != 0;
+    counts[Mapped] += mapped;
+    if (primary && mapped) {
+        counts[PrimaryMapped]++;
+        mapqCounts[bam->MAPQ]++;
+        contigReads[bam->refID]++;
+    }
+    if (primary && (flag & SAM_MULTI_SEGMENT)) {
+        counts[Paired]++;
+        counts[Read1] += (flag & SAM_FIRST_SEGMENT) != 0;
+        counts[Read2] += (flag & SAM_LAST_SEGMENT) != 0;
+        if (mapped) {
+            counts[ProperlyPaired] += (flag & SAM_ALL_ALIGNED) != 0;
+            if (flag & SAM_NEXT_UNMAPPED) {
+                counts[Singletons]++;
+            } else {
+                counts[BothMapped]++;
+                if (bam->next_refID != bam->refID) {
+                    counts[MateOnOtherContig]++;
+                    counts[MateOnOtherContigMapq5] += bam->MAPQ >= 5;
+                } else if ((flag & SAM_FIRST_SEGMENT) && bam->tlen != 0) {
+                    // once per pair
+                    insertCounts[min(abs(bam->tlen), MaxInsertSize + 1)]++;
+                }
+            }
+        }
+    }
+
+    if (! mapped || (flag & (SAM_SECONDARY | SAM_FAILED_QC)) != 0) {
+        return;
+    }
+    _uint32* cigar = bam->cigar();
+    _int64 pos = bam->pos;
+    for (int i = 0; i < bam->n_cigar_op; i++) {
+        int op = cigar[i] & 0xf;
+        _int64 length = cigar[i] >> 4;
+        if (op == 0 || op == 7 || op == 8) { // M, = and X
+            contigBases[bam->refID] += length;
+            if (bins != NULL) {
+                bins->add(bam->refID, pos, pos + length);
+            }
+        }
+        pos += op < 9 ? BAMAlignment::CigarCodeToRefBase[op] * length : 0;
+    }
+}
+
+class BAMMetricsSupplier : public DataWriter::FilterSupplier
+{
+public:
+    BAMMetricsSupplier(const Genome* i_genome, const char* i_fileName, BAMCoverageBins* i_bins) :
+        FilterSupplier(DataWriter::ReadFilter), genome(i_genome), fileName(i_fileName), bins(i_bins)
+    {
+        InitializeExclusiveLock(&lock);
+    }
+
+    virtual ~BAMMetricsSupplier()
+    {
+        DestroyExclusiveLock(&lock);
+    }
+
+    virtual DataWriter::Filter* getFilter();
+
+    virtual void onClosing(DataWriterSupplier* supplier) {}
+
+    // writes the metrics, unless there's no file name because it's for a part of the file (see BAMSortedPartSupplier)
+    virtual void onClosed(DataWriterSupplier* supplier);
+
+    // write the metrics for all the suppliers' filters together, and the coverage bins (which they share) if any
+    static void WriteMetrics(const char* fileName, const Genome* genome, BAMCoverageBins* bins, int nSuppliers,
+        BAMMetricsSupplier** suppliers);
+
+private:
+    const Genome* genome;
+    const char* fileName;
+    BAMCoverageBins* bins;
+    ExclusiveLock lock;
+    VariableSizeVector<BAMMetricsFilter*> filters; // they outlive the file, so their counts can be gathered at the end
+};
+
+    DataWriter::Filter*
+BAMMetricsSupplier::getFilter()
+{
+    BAMMetricsFilter* filter = new BAMMetricsFilter(genome->getNumContigs(), bins);
+    AcquireExclusiveLock(&lock);
+    filters.push_back(filter);
+    ReleaseExclusiveLock(&lock);
+    return filter;
+}
+
+    void
+BAMMetricsSupplier::onClosed(
+    DataWriterSupplier* supplier)
+{
+    if (fileName != NULL) {
+        BAMMetricsSupplier* self = this;
+        WriteMetrics(fileName, genome, bins, 1, &self);
+    }
+}
+
+    void
+BAMMetricsSupplier::WriteMetrics(
+    const char* fileName,
+    const Genome* genome,
+    BAMCoverageBins* bins,
+    int nSuppliers,
+    BAMMetricsSupplier** suppliers)
+{
+    int nContigs = genome->getNumContigs();
+    _int64 counts[BAMMetricsFilter::NCounts];
+    _int64 mapqCounts[256];
+    _int64* insertCounts = new _int64[BAMMetricsFilter::MaxInsertSize + 2];
+    _int64* contigReads = new _int64[nContigs];
+    _int64* contigBases = new _int64[nContigs];
+    memset(counts, 0, sizeof(counts));
+    memset(mapqCounts, 0, sizeof(mapqCounts));
+    memset(insertCounts, 0, (BAMMetricsFilter::MaxInsertSize + 2) * sizeof(_int64));
+    memset(contigReads, 0, nContigs * sizeof(_int64));
+    memset(contigBases, 0, nContigs * sizeof(_int64));
+    for (int i = 0; i < nSuppliers; i++) {
+        for (BAMMetricsFilter** filter = suppliers[i]->filters.begin(); filter != suppliers[i]->filters.end(); filter++) {
+            for (int j = 0; j < BAMMetricsFilter::NCounts; j++) {
+                counts[j] += (*filter)->counts[j];
+            }
+            for (int j = 0; j < 256; j++) {
+                mapqCounts[j] += (*filter)->mapqCounts[j];
+            }
+            for (int j = 0; j <= BAMMetricsFilter::MaxInsertSize + 1; j++) {
+                insertCounts[j] += (*filter)->insertCounts[j];
+            }
+            for (int j = 0; j < nContigs; j++) {
+                contigReads[j] += (*filter)->contigReads[j];
+                contigBases[j] += (*filter)->contigBases[j];
+            }
+        }
+    }
+
+    FILE* file = fopen(fileName, "w");
+    if (file == NULL) {
+        WriteErrorMessage("unable to open alignment metrics file %s\n", fileName);
+    } else {
+        static const char* countNames[BAMMetricsFilter::NCounts] = {"total", "primary", "secondary", "supplementary", "mapped", "primary mapped", "paired in sequencing", "read1", "read2", "properly paired",
+            "with itself and mate mapped", "singletons", "with mate mapped to a different chr",
+            "with mate mapped to a different chr (mapQ>=5)"};
+        fprintf(file, "## FLAGS\n");
+        for (int i = 0; i < BAMMetricsFilter::NCounts; i++) {
+            fprintf(file, "%s\t%lld\n", countNames[i], counts[i]);
+        }
+
+        fprintf(file, "\n## MAPQ (primary mapped reads)\nMAPQ\tREADS\n");
+        for (int i = 0; i < 256; i++) {
+            if (mapqCounts[i] > 0) {
+                fprintf(file, "%d\t%lld\n", i, mapqCounts[i]);
+            }
+        }
+
+        _int64 pairs = 0;
+        double sum = 0, sumSquares = 0;
+        for (int i = 0; i <= BAMMetricsFilter::MaxInsertSize; i++) {
+            pairs += insertCounts[i];
+            sum += (double)i * insertCounts[i];
+            sumSquares += (double)i * i * insertCounts[i];
+        }
+        int median = 0;
+        for (_int64 seen = 0; median <= BAMMetricsFilter::MaxInsertSize && (seen += insertCounts[median]) * 2 < pairs; median++) {
+            // just looking
+        }
+        double mean = pairs > 0 ? sum / pairs : 0;
+        double sd = pairs > 1 ? sqrt(max(0.0, (sumSquares - sum * mean) / (pairs - 1))) : 0;
+        fprintf(file, "\n## INSERT SIZE (pairs on the same contig)\nPAIRS\tMEDIAN\tMEAN\tSTANDARD_DEVIATION\tOVER_%d\n"
+            "%lld\t%d\t%.2f\t%.2f\t%lld\nINSERT_SIZE\tPAIRS\n", BAMMetricsFilter::MaxInsertSize,
+            pairs, pairs > 0 ? median : 0, mean, sd, insertCounts[BAMMetricsFilter::MaxInsertSize + 1]);
+        for (int i = 0; i <= BAMMetricsFilter::MaxInsertSize; i++) {
+            if (insertCounts[i] > 0) {
+                fprintf(file, "%d\t%lld\n", i, insertCounts[i]);
+            }
+        }
+
+        fprintf(file, "\n## CONTIGS\nCONTIG\tLENGTH\tMAPPED_READS\tMEAN_DEPTH\n");
+        _int64 totalLength = 0, totalBases = 0;
+        for (int i = 0; i < nContigs; i++) {
+            const Genome::Contig* contig = &genome->getContigs()[i];
+            fprintf(file, "%s\t%lld\t%lld\t%.2f\n", contig->name, (_int64)contig->length, contigReads[i],
+                contig->length > 0 ? (double)contigBases[i] / contig->length : 0.0);
+            totalLength += contig->length;
+            totalBases += contigBases[i];
+        }
+        fprintf(file, "total\t%lld\t%lld\t%.2f\n", totalLength, counts[BAMMetricsFilter::PrimaryMapped],
+            totalLength > 0 ? (double)totalBases / totalLength : 0.0);
+        fclose(file);
+    }
+
+    if (bins != NULL) {
+        size_t nameSize = strlen(fileName) + 10;
+        char* binsFileName = new char[nameSize];
+        snprintf(binsFileName, nameSize, "%s.bedgraph", fileName);
+        bins->write(binsFileName);
+        delete [] binsFileName;
+    }
+    delete [] insertCounts;
+    delete [] contigReads;
+    delete [] contigBases;
+}
+
+    DataWriter::FilterSupplier*
+DataWriterSupplier::bamMetrics(
+    const Genome* genome,
+    const char* alignmentMetricsFileName,
+    unsigned coverageBinSize)
+{
+    return new BAMMetricsSupplier(genome, alignmentMetricsFileName,
+        coverageBinSize > 0 ? new BAMCoverageBins(genome, coverageBinSize) : NULL);
+}
+
+class BAMSortedPartSupplier : public SortedPartSupplier
+{
+public:
+    BAMSortedPartSupplier(const Genome* i_genome, const char* i_indexFileName, bool i_csiIndex, bool i_markDuplicates,
+            const char* i_metricsFileName, int i_numThreads, int i_compressionLevel, const char* i_alignmentMetricsFileName,
+            unsigned i_coverageBinSize, const char* i_nameIndexFileName)
+        : genome(i_genome), indexFileName(i_indexFileName), csiIndex(i_csiIndex), markDuplicates(i_markDuplicates),
+        nameIndexFileName(i_nameIndexFileName), nameIndexes(NULL),
+        metricsFileName(i_metricsFileName),
+        numThreads(i_numThreads), compressionLevel(i_compressionLevel), nParts(0), partFilters(NULL), indexes(NULL), dupMarkers(NULL),
+        alignmentMetricsFileName(i_alignmentMetricsFileName), metrics(NULL),
+        coverageBins(i_alignmentMetricsFileName != NULL && i_coverageBinSize > 0 ? new BAMCoverageBins(i_genome, i_coverageBinSize) : NULL)
+    {}
+
+    virtual ~BAMSortedPartSupplier();
+
+    virtual void getPart(int part, int nParts, const char* shardFileName, DataWriter::FilterSupplier** o_filters,
+        FileEncoder** o_encoder);
+
+    virtual size_t getTrailerSize()
+    { return GzipWriterFilterSupplier::BamEofSize; }
+
+    virtual void onAppended(int nParts, const size_t* partOffsets);
+
+private:
+    const Genome*       genome;
+    const char*         indexFileName; // NULL for no index
+    bool                csiIndex;
+    bool                markDuplicates;
+    const char*         metricsFileName; // NULL for none
+    int                 numThreads;
+    int                 compressionLevel;
+    int                 nParts;
+    DataWriter::FilterSupplier** partFilters; // one per part, each owning its part's gzip, index, etc. suppliers
+    BAMIndexSupplier**  indexes; // one per part
+    BAMDupMarkSupplier** dupMarkers; // one per part
+    const char*         alignmentMetricsFileName; // NULL for none
+    BAMMetricsSupplier** metrics; // one per part
+    BAMCoverageBins*    coverageBins; // shared by the parts, NULL for none
+    const char*         nameIndexFileName; // NULL for no read name index
+    BAMNameIndexSupplier** nameIndexes; // one per part
+};
+
+    void
+BAMSortedPartSupplier::getPart(
+    int part,
+    int nParts,
+    const char* shardFileName,
+    DataWriter::FilterSupplier** o_filters,
+    FileEncoder** o_encoder)
+{
+    if (indexes == NULL) {
+        this->nParts = nParts;
+        partFilters = new DataWriter::FilterSupplier*[nParts];
+        for (int i = 0; i < nParts; i++) {
+            partFilters[i] = NULL;
+        }
+        indexes = new BAMIndexSupplier*[nParts];
+        dupMarkers = new BAMDupMarkSupplier*[nParts];
+        metrics = new BAMMetricsSupplier*[nParts];
+        nameIndexes = new BAMNameIndexSupplier*[nParts];
+    }
+    // share the threads out between the parts' encoders
+    int partThreads = max(1, numThreads / nParts);
+    GzipWriterFilterSupplier* gzipSupplier = DataWriterSupplier::gzip(true, BAM_BLOCK, partThreads, false, true, compressionLevel);
+    DataWriter::FilterSupplier* filters = gzipSupplier;
+    if (alignmentMetricsFileName != NULL) {
+        metrics[part] = new BAMMetricsSupplier(genome, NULL, coverageBins);
+        filters = metrics[part]->compose(filters);
+    }
+    if (markDuplicates) {
+        dupMarkers[part] = new BAMDupMarkSupplier(genome, NULL);
+        filters = dupMarkers[part]->compose(filters);
+    }
+    if (indexFileName != NULL) {
+        char* shardIndexFileName = NULL; // like indexFileName, this lasts as long as the run
+        if (shardFileName != NULL) {
+            size_t len = strlen(shardFileName);
+            shardIndexFileName = (char*) malloc(5 + len);
+            strcpy(shardIndexFileName, shardFileName);
+            strcpy(shardIndexFileName + len, csiIndex ? ".csi" : ".bai");
+        }
+        indexes[part] = new BAMIndexSupplier(shardIndexFileName, genome, gzipSupplier, csiIndex);
+        filters = indexes[part]->compose(filters);
+    }
+    if (nameIndexFileName != NULL) {
+        char* shardNameIndexFileName = NULL; // lasts as long as the run, too
+        if (shardFileName != NULL) {
+            size_t len = strlen(shardFileName);
+            shardNameIndexFileName = (char*) malloc(len + strlen(ReadNameIndexSuffix) + 1);
+            strcpy(shardNameIndexFileName, shardFileName);
+            strcpy(shardNameIndexFileName + len, ReadNameIndexSuffix);
+        }
+        nameIndexes[part] = new BAMNameIndexSupplier(shardNameIndexFileName, shardNameIndexFileName != NULL ? shardNameIndexFileName : nameIndexFileName,
+            gzipSupplier);
+        filters = nameIndexes[part]->compose(filters);
+    }
+    partFilters[part] = filters;
+    *o_filters = filters;
+    *o_encoder = FileEncoder::gzip(gzipSupplier, partThreads, false);
+}
+
+BAMSortedPartSupplier::~BAMSortedPartSupplier()
+{
+    for (int i = 0; i < nParts; i++) {
+        delete partFilters[i];
+    }
+    delete [] partFilters;
+    delete [] indexes;
+    delete [] dupMarkers;
+    delete [] metrics;
+    delete coverageBins;
+    delete [] nameIndexes;
+}
+
+    void
+BAMSortedPartSupplier::onAppended(
+    int nParts,
+    const size_t* partOffsets)
+{
+    if (indexFileName != NULL && partOffsets != NULL) {
+        BAMIndexSupplier::WriteIndex(indexFileName, genome, nParts, indexes, partOffsets);
+    }
+    if (nameIndexFileName != NULL && partOffsets != NULL) {
+        BAMNameIndexSupplier::WriteIndex(nameIndexFileName, nParts, nameIndexes, partOffsets);
+    }
+    if (markDuplicates && metricsFileName != NULL) {
+        BAMDupMarkSupplier::WriteMetrics(metricsFileName, nParts, dupMarkers);
+    }
+    if (alignmentMetricsFileName != NULL) {
+        BAMMetricsSupplier::WriteMetrics(alignmentMetricsFileName, genome, coverageBins, nParts, metrics);
+    }
+}
+
+    SortedPartSupplier*
+DataWriterSupplier::bamSortedParts(
+    const Genome* genome,
+    const char* indexFileName,
+    bool csiIndex,
+    bool markDuplicates,
+    const char* metricsFileName,
+    int numThreads,
+    int compressionLevel,
+    const char* alignmentMetricsFileName,
+    unsigned coverageBinSize,
+    const char* nameIndexFileName)
+{
+    return new BAMSortedPartSupplier(genome, indexFileName, csiIndex, markDuplicates, metricsFileName, numThreads, compressionLevel,
+        alignmentMetricsFileName, coverageBinSize, nameIndexFileName);
 }
 
     bool
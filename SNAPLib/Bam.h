@@ -147,10 +147,52 @@ struct BAMAlignment
     static void decodeQual(char* o_qual, char* quality, int bases);
     static void decodeSeqRC(char* o_sequence, const _uint8* nibbles, int bases);
     static void decodeQualRC(char* o_qual, char* quality, int bases);
+
+    //
+    // The decoders go to one of these, picked at startup for the processor.  They get the same answers; the AVX2 ones
+    // do 32 bases at a time, looking the sequence codes up with pshufb, and the Vector16 ones (SSSE3 or NEON; see
+    // Simd.h) do 16.
+    //
+    typedef void (*DecodeSeqFunction)(char* o_sequence, const _uint8* nibbles, int bases);
+    typedef void (*DecodeQualFunction)(char* o_qual, char* quality, int bases);
+    static DecodeSeqFunction decodeSeqImplementation;
+    static DecodeSeqFunction decodeSeqRCImplementation;
+    static DecodeQualFunction decodeQualImplementation;
+    static DecodeQualFunction decodeQualRCImplementation;
+
+    static void decodeSeqScalar(char* o_sequence, const _uint8* nibbles, int bases);
+    static void decodeSeqRCScalar(char* o_sequence, const _uint8* nibbles, int bases);
+    static void decodeQualScalar(char* o_qual, char* quality, int bases);
+    static void decodeQualRCScalar(char* o_qual, char* quality, int bases);
+    static void decodeSeqAVX2(char* o_sequence, const _uint8* nibbles, int bases);
+    static void decodeSeqRCAVX2(char* o_sequence, const _uint8* nibbles, int bases);
+    static void decodeQualAVX2(char* o_qual, char* quality, int bases);
+    static void decodeQualRCAVX2(char* o_qual, char* quality, int bases);
+    static void decodeSeqVector16(char* o_sequence, const _uint8* nibbles, int bases);
+    static void decodeSeqRCVector16(char* o_sequence, const _uint8* nibbles, int bases);
+    static void decodeQualVector16(char* o_qual, char* quality, int bases);
+    static void decodeQualRCVector16(char* o_qual, char* quality, int bases);
+
     static bool decodeCigar(char* o_cigar, int cigarSize, _uint32* cigar, int ops);
     static void getClippingFromCigar(_uint32 *cigar, int ops, unsigned *o_frontClipping, unsigned *o_backClipping, unsigned *o_frontHardClipping, unsigned *o_backHardClipping);
 
     static void encodeSeq(_uint8* nibbles, char* ascii, int length);
+    static void encodeQual(char* o_quality, const char* quality, int length); // from SAM, less '!'
+
+    //
+    // As with the decoders, the encoders go to one of these.  The AVX2 encodeSeq looks the bases up in SeqToCode with
+    // pshufb and packs the codes into nibbles 32 bases at a time.
+    //
+    typedef void (*EncodeSeqFunction)(_uint8* nibbles, char* ascii, int length);
+    typedef void (*EncodeQualFunction)(char* o_quality, const char* quality, int length);
+    static EncodeSeqFunction encodeSeqImplementation;
+    static EncodeQualFunction encodeQualImplementation;
+
+    static void encodeSeqScalar(_uint8* nibbles, char* ascii, int length);
+    static void encodeQualScalar(char* o_quality, const char* quality, int length);
+    static void encodeSeqAVX2(_uint8* nibbles, char* ascii, int length);
+    static void encodeQualAVX2(char* o_quality, const char* quality, int length);
+    static void encodeQualVector16(char* o_quality, const char* quality, int length);
 
     int l_ref(); // length of reference aligned to read
 
@@ -167,6 +209,19 @@ struct BAMAlignment
     static const int MAX_BIN = (((1<<18)-1)/7);
     static int reg2bins(int beg, int end, _uint16* list/*[MAX_BIN]*/);
 
+    // CSI binning, for contigs that are too long for BAI's 5 levels of bins
+    static const int CSI_MIN_SHIFT = 14; // smallest bins and linear index intervals are 16Kb, the same as BAI
+    static const _int64 BAI_MAX_LENGTH = 1LL << 29; // longest contig BAI can index
+    /* the number of levels of bins needed to cover contigs up to maxLength */
+    static int csiDepth(_int64 maxLength);
+    /* calculate CSI bin given an alignment covering [beg,end) */
+    static _uint32 csiReg2bin(_int64 beg, _int64 end, int depth);
+    /* the first bin at the lowest level covered by a bin, i.e. the linear index interval where the bin starts */
+    static _int64 csiBinFirstInterval(_uint32 bin, int depth);
+    /* the pseudo-bin for metadata (BAM_EXTRA_BIN when depth is 5) */
+    static _uint32 csiMetaBin(int depth)
+    { return ((1 << (3 * depth + 3)) - 1) / 7 + 1; }
+
     // absoluate genome locations
 
     GenomeLocation getLocation(const Genome* genome) const
@@ -174,7 +229,7 @@ struct BAMAlignment
         ? UINT32_MAX : (genome->getContigs()[refID].beginningLocation + pos); }
 
     GenomeLocation getNextLocation(const Genome* genome) const
-    { return next_pos < 0 || next_refID < 0 || (FLAG & SAM_NEXT_UNMAPPED) ? UINT32_MAX : (genome->getContigs()[next_refID].beginningLocation + next_pos); }
+    { return genome == NULL || next_pos < 0 || next_refID < 0 || (FLAG & SAM_NEXT_UNMAPPED) ? UINT32_MAX : (genome->getContigs()[next_refID].beginningLocation + next_pos); }
 
 #ifdef VALIDATE_BAM
     void validate();
@@ -395,10 +450,16 @@ public:
         }
         
         void holdBatch(DataBatch batch)
-        { data->holdBatch(batch); }
+        {
+            if (NULL == chunks) {
+                data->holdBatch(batch);
+            } else {
+                holdChunkBatch(batch);
+            }
+        }
 
         bool releaseBatch(DataBatch batch)
-        { return data->releaseBatch(batch); }
+        { return NULL == chunks ? data->releaseBatch(batch) : releaseChunkBatch(batch); }
 
         virtual ReaderContext* getContext()
         { return ((ReadReader*)this)->getContext(); }
@@ -432,8 +493,66 @@ private:
 
         char* getExtra(_int64 bytes);
 
+        //
+        // When the reads go through a ReadSupplierQueue (which is how the supplier generators use this), their bases and
+        // qualities are left packed for the aligner threads to unpack; see Read::deferDecoding.  The record stays in
+        // the batch's buffer until the read is done with, so it's what the read points to.
+        //
+        static void DecodeDeferredRead(const void *record, char *data, char *quality, unsigned length);
+
+        bool                deferDecoding;
+
+        //
+        // With -region or -unmappedOnly, the file is read in chunks, the ranges of it (from its BAI) that can have
+        // the records wanted, each with a reader of its own.  A chunk's batches have its index + 1 as their fileID,
+        // so they sort after the ones before it and holds and releases go to its reader, which is deleted once it's
+        // done and nothing holds its batches.  The records in a chunk that aren't wanted are skipped as they're read.
+        //
+        struct Chunk
+        {
+            _uint64         begin; // virtual offsets, the compressed block offset << 16 | the offset in the block
+            _uint64         end; // UINT64_MAX for the end of the file
+
+            // the compressed offset to read to: the blocks that start before it are read, which takes in the one after
+            // the block the chunk ends in, for the rest of a record that runs into it
+            _uint64 readEnd() const
+            { return end == UINT64_MAX ? UINT64_MAX : (end >> 16) + BAM_BLOCK + 1; }
+
+            static bool comparator(const Chunk& a, const Chunk& b)
+            { return a.begin < b.begin; }
+        };
+
+        void loadChunks(const char* fileName);
+
+        bool startNextChunk();
+
+        bool wanted(BAMAlignment* bam);
+
+        DataBatch currentBatch()
+        { return NULL == chunks ? data->getBatch() : DataBatch(data->getBatch().batchID, currentChunk + 1); }
+
+        void holdChunkBatch(DataBatch batch);
+
+        bool releaseChunkBatch(DataBatch batch);
+
         DataReader*         data;
         //unsigned            n_ref; // number of reference sequences
         //unsigned*           refOffset; // array mapping ref sequence ID to contig location
         _int64              extraOffset; // offset into extra data
+
+        const char*         fileName;
+        int                 bufferCount;
+        VariableSizeVector<Chunk>* chunks; // NULL to read the whole file
+        int                 currentChunk;
+        DataReader**        chunkReaders; // NULL once deleted
+        int*                chunkHolds;
+        ExclusiveLock       chunkLock;
+        int                 regionRefID; // the BAM's reference number for context.region
+        _int64              regionBegin, regionEnd; // 0-based, half open
 };
+
+//
+// Merge BAM files that are each sorted against genome (like the pieces of a distributed run) into
+// options->outputFile, with the first one's header and the duplicate marking and index that sorted output gets.
+//
+bool MergeSortedBAMFiles(AlignerOptions* options, const Genome* genome, int nFiles, const char** fileNames);
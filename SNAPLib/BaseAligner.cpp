@@ -32,9 +32,11 @@ Revision History:
 #include "BigAlloc.h"
 #include "mapq.h"
 #include "SeedSequencer.h"
+#include "Minimizer.h"
 #include "exit.h"
 #include "AlignerOptions.h"
 #include "Error.h"
+#include "StageTiming.h"
 
 using std::min;
 
@@ -64,9 +66,10 @@ BaseAligner::BaseAligner(
         genomeIndex(i_genomeIndex), maxHitsToConsider(i_maxHitsToConsider), maxK(i_maxK),
         maxReadSize(i_maxReadSize), maxSeedsToUseFromCommandLine(i_maxSeedsToUseFromCommandLine),
         maxSeedCoverage(i_maxSeedCoverage), readId(-1), extraSearchDepth(i_extraSearchDepth),
-        explorePopularSeeds(false), stopOnFirstHit(false), stats(i_stats), 
+        explorePopularSeeds(false), stopOnFirstHit(false), adaptiveSeeding(false), minSeedQuality(0), maxSeedsWithoutHits(0), deferLowQualitySeeds(false), exactMatchFastPath(true), stats(i_stats), 
         noUkkonen(i_noUkkonen), noOrderedEvaluation(i_noOrderedEvaluation), noTruncation(i_noTruncation),
-		minWeightToCheck(max(1u, i_minWeightToCheck)), maxSecondaryAlignmentsPerContig(i_maxSecondaryAlignmentsPerContig)
+		minWeightToCheck(max(1u, i_minWeightToCheck)), maxSecondaryAlignmentsPerContig(i_maxSecondaryAlignmentsPerContig),
+        secondaryResultsToKeep(MAXINT32), secondaryResultsHeapified(false)
 /*++
 
 Routine Description:
@@ -103,6 +106,17 @@ Arguments:
     nHitsIgnoredBecauseOfTooHighPopularity = 0;
     nReadsIgnoredBecauseOfTooManyNs = 0;
     nIndelsMerged = 0;
+    nSeedLookupsReused = 0;
+    nLowQualitySeedsSkipped = 0;
+    nReadsGivenUp = 0;
+    nLVCalls = 0;
+    nPopularSeedsSkipped = 0;
+    workBudget = 0;
+    seedLookups = NULL;
+
+#ifdef LONG_READS
+    maxMergeDist = hashTableElementSize = longReadMaxMergeDist;
+#endif
 
     genome = genomeIndex->getGenome();
     seedLen = genomeIndex->getSeedLength();
@@ -158,23 +172,8 @@ Arguments:
 
     rcReadData = (char *)BigAlloc(sizeof(char) * maxReadSize);
 
-    // treat everything but ACTG like N
-    for (unsigned i = 0; i < 256; i++) {
-        nTable[i] = 1;
-        rcTranslationTable[i] = 'N';
-    }
     reversedRead[RC] = reversedRead[FORWARD] + maxReadSize;
 
-    rcTranslationTable['A'] = 'T';
-    rcTranslationTable['G'] = 'C';
-    rcTranslationTable['C'] = 'G';
-    rcTranslationTable['T'] = 'A';
-    rcTranslationTable['N'] = 'N';
-
-    memset(nTable, 0, sizeof(nTable));
-
-    nTable['N'] = 1;
-
     if (allocator) {
         seedUsed = (BYTE *)allocator->allocate((sizeof(BYTE) * (maxReadSize + 7 + 128) / 8));    // +128 to make sure it extends at both
     } else {
@@ -184,13 +183,66 @@ Arguments:
     seedUsedAsAllocated = seedUsed; // Save the pointer for the delete.
     seedUsed += 8;  // This moves the pointer up an _int64, so we now have the appropriate before buffer.
 
+    //
+    // These are small, so we allocate them whether or not we're asked for adaptive seeding.
+    //
+    if (allocator) {
+        adaptiveSeedOrder = (AdaptiveSeed *)allocator->allocate(sizeof(AdaptiveSeed) * maxReadSize);
+        probeHitsByBase = (unsigned *)allocator->allocate(sizeof(unsigned) * maxReadSize);
+        seedsContainingBase[FORWARD] = (BYTE *)allocator->allocate(sizeof(BYTE) * maxReadSize * NUM_DIRECTIONS);
+    } else {
+        adaptiveSeedOrder = (AdaptiveSeed *)BigAlloc(sizeof(AdaptiveSeed) * maxReadSize);
+        probeHitsByBase = (unsigned *)BigAlloc(sizeof(unsigned) * maxReadSize);
+        seedsContainingBase[FORWARD] = (BYTE *)BigAlloc(sizeof(BYTE) * maxReadSize * NUM_DIRECTIONS);
+    }
+    seedsContainingBase[RC] = seedsContainingBase[FORWARD] + maxReadSize;
+    nAdaptiveSeeds = nextAdaptiveSeed = 0;
+
+    minimizerWindow = genomeIndex->getMinimizerWindow();
+    if (0 != minimizerWindow) {
+        if (allocator) {
+            minimizerHashes = (_uint64 *)allocator->allocate(sizeof(_uint64) * maxReadSize);
+            isMinimizerSeed = (bool *)allocator->allocate(sizeof(bool) * maxReadSize);
+        } else {
+            minimizerHashes = (_uint64 *)BigAlloc(sizeof(_uint64) * maxReadSize);
+            isMinimizerSeed = (bool *)BigAlloc(sizeof(bool) * maxReadSize);
+        }
+    } else {
+        minimizerHashes = NULL;
+        isMinimizerSeed = NULL;
+    }
+
+    if (allocator) {
+        readSeedStorage = allocator->allocate(PackedReadSeeds::GetStorageSize(maxReadSize));
+    } else {
+        readSeedStorage = BigAlloc(PackedReadSeeds::GetStorageSize(maxReadSize));
+    }
+    readSeeds.init(readSeedStorage, maxReadSize);
+
+    packedGenome = genome->getPackedBases();
+    if (NULL != packedGenome) {
+        size_t packedReadSize = PackedBases::GetStorageSize(maxReadSize);
+        if (allocator) {
+            packedReadStorage = allocator->allocate(packedReadSize * NUM_DIRECTIONS * 2);
+        } else {
+            packedReadStorage = BigAlloc(packedReadSize * NUM_DIRECTIONS * 2);
+        }
+
+        for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
+            packedRead[dir].init((char *)packedReadStorage + packedReadSize * dir, 0, maxReadSize);
+            packedReversedRead[dir].init((char *)packedReadStorage + packedReadSize * (NUM_DIRECTIONS + dir), 0, maxReadSize);
+        }
+    } else {
+        packedReadStorage = NULL;
+    }
+
     nUsedHashTableElements = 0;
 
     if (allocator) {
         candidateHashTable[FORWARD] = (HashTableAnchor *)allocator->allocate(sizeof(HashTableAnchor) * candidateHashTablesSize);
         candidateHashTable[RC] = (HashTableAnchor *)allocator->allocate(sizeof(HashTableAnchor) * candidateHashTablesSize);
         weightLists = (HashTableElement *)allocator->allocate(sizeof(HashTableElement) * numWeightLists);
-        hashTableElementPool = (HashTableElement *)allocator->allocate(sizeof(HashTableElement) * hashTableElementPoolSize); // Allocte last, because it's biggest and usually unused.  This puts all of the commonly used stuff into one large page.
+        hashTableElementPool = (HashTableElement *)allocator->allocate(sizeof(HashTableElement) * hashTableElementPoolSize);
         hitCountByExtraSearchDepth = (unsigned *)allocator->allocate(sizeof(*hitCountByExtraSearchDepth) * extraSearchDepth);
         if (maxSecondaryAlignmentsPerContig > 0) {
             hitsPerContigCounts = (HitsPerContigCounts *)allocator->allocate(sizeof(*hitsPerContigCounts) * genome->getNumContigs());
@@ -198,6 +250,7 @@ Arguments:
         } else {
             hitsPerContigCounts = NULL;
         }
+        candidatePool = (Candidate *)allocator->allocate(sizeof(Candidate) * hashTableElementStride * hashTableElementPoolSize); // Allocte last, because it's biggest and usually unused.  This puts all of the commonly used stuff into one large page.
     } else {
         candidateHashTable[FORWARD] = (HashTableAnchor *)BigAlloc(sizeof(HashTableAnchor) * candidateHashTablesSize);
         candidateHashTable[RC] = (HashTableAnchor *)BigAlloc(sizeof(HashTableAnchor) * candidateHashTablesSize);
@@ -211,20 +264,36 @@ Arguments:
         else {
             hitsPerContigCounts = NULL;
         }
+        candidatePool = (Candidate *)BigAlloc(sizeof(Candidate) * hashTableElementStride * hashTableElementPoolSize);
     }
 
-    for (unsigned i = 0; i < hashTableElementPoolSize; i++) {
-        hashTableElementPool[i].init();
+    //
+    // Indices with compressed overflow tables decode hit lists into memory that we supply, enough for one batch of lookups.
+    // We never look at more than maxHitsToConsider hits of a seed, so there's no need to decode more.
+    //
+    if (genomeIndex->hasCompressedOverflowTable()) {
+        _int64 decodeBufferSize = OverflowDecodeBuffer::getBufferSize(GenomeIndex::MaxSeedLookupBatchSize * NUM_DIRECTIONS, maxHitsToConsider);
+        if (allocator) {
+            overflowDecodeBufferStorage = (GenomeLocation *)allocator->allocate(sizeof(GenomeLocation) * decodeBufferSize);
+        } else {
+            overflowDecodeBufferStorage = (GenomeLocation *)BigAlloc(sizeof(GenomeLocation) * decodeBufferSize);
+        }
+        overflowDecodeBuffer.init(overflowDecodeBufferStorage, decodeBufferSize, maxHitsToConsider);
+    } else {
+        overflowDecodeBufferStorage = NULL;
     }
 
     for (unsigned i = 0; i < maxSeedsToUse + 1; i++) {
         weightLists[i].init();
     }
 
-    for (Direction rc = 0; rc < NUM_DIRECTIONS; rc++) {
-        memset(candidateHashTable[rc],0,sizeof(HashTableAnchor) * candidateHashTablesSize);
-    }
-    hashTableEpoch = 0;
+    //
+    // The hash tables and the element and candidate pools are sized for the worst case, and most reads use a small
+    // part of them.  Memory from BigAlloc (and so from a BigAllocator) is already zero, and pages that are never written
+    // are never committed, so they're left alone: the zeroed slots are empty, and elements are filled in as they're
+    // taken from the pool (see allocateNewCandidate).
+    //
+    hashTableEpoch = 1;     // So the zeroed slots are empty
 
  
 }
@@ -242,7 +311,8 @@ BaseAligner::AlignRead(
         int                      secondaryResultBufferSize,
         int                     *nSecondaryResults,
         int                      maxSecondaryResults,
-        SingleAlignmentResult   *secondaryResults             // The caller passes in a buffer of secondaryResultBufferSize and it's filled in by AlignRead()
+        SingleAlignmentResult   *secondaryResults,            // The caller passes in a buffer of secondaryResultBufferSize and it's filled in by AlignRead()
+        const SeedLookupResults *i_seedLookups
     )
 /*++
 
@@ -259,6 +329,7 @@ Arguments:
     nRescondaryResults                  - returns the number of secondary results found
     maxSecondaryResults                 - limit the number of secondary results to this
     secondaryResults                    - returns the secondary results
+    i_seedLookups                       - seeds of this read that have already been looked up, or NULL
 
 
 Return Value:
@@ -267,15 +338,23 @@ Return Value:
 
 --*/
 {   
+    TIME_STAGE(CandidateStage);
     memset(hitCountByExtraSearchDepth, 0, sizeof(*hitCountByExtraSearchDepth) * extraSearchDepth);
 
     if (NULL != nSecondaryResults) {
         *nSecondaryResults = 0;
     }
 
+    //
+    // Without -mpc only the best maxSecondaryResults can be returned, so there's no need to keep more than that.
+    //
+    secondaryResultsToKeep = maxSecondaryAlignmentsPerContig > 0 ? MAXINT32 : maxSecondaryResults;
+    secondaryResultsHeapified = false;
+
     firstPassSeedsNotSkipped[FORWARD] = firstPassSeedsNotSkipped[RC] = 0;
     smallestSkippedSeed[FORWARD] = smallestSkippedSeed[RC] = 0x8fffffffffffffff;
     highestWeightListChecked = 0;
+    seedLookups = i_seedLookups;
 
     unsigned maxSeedsToUse;
     if (0 != maxSeedsToUseFromCommandLine) {
@@ -292,6 +371,7 @@ Return Value:
     unsigned lookupsThisRun = 0;
 
     popularSeedsSkipped = 0;
+    lvCallsAtReadStart = nLVCalls;
 
     //
     // A bitvector for used seeds, indexed on the starting location of the seed within the read.
@@ -302,6 +382,13 @@ Return Value:
         soft_exit(1);
     }
 
+#ifdef LONG_READS
+    //
+    // clearCandidates() empties the hash tables for each read below, so the element size can change here.
+    //
+    maxMergeDist = hashTableElementSize = inputRead->getDataLength() > SHORT_READ_MAX_LENGTH ? longReadMaxMergeDist : shortReadMaxMergeDist;
+#endif
+
     if ((int)inputRead->getDataLength() < seedLen) {
         //
         // Too short to have any seeds, it's hopeless.
@@ -329,16 +416,7 @@ Return Value:
     unsigned readLen = inputRead->getDataLength();
     const char *readData = inputRead->getData();
     const char *readQuality = inputRead->getQuality();
-    unsigned countOfNs = 0;
-    for (unsigned i = 0; i < readLen; i++) {
-        char baseByte = readData[i];
-        char complement = rcTranslationTable[baseByte];
-        rcReadData[readLen - i - 1] = complement;
-        rcReadQuality[readLen - i - 1] = readQuality[i];
-        reversedRead[FORWARD][readLen - i - 1] = baseByte;
-        reversedRead[RC][i] = complement;
-        countOfNs += nTable[baseByte];
-    }
+    unsigned countOfNs = ReverseComplementRead(readData, readQuality, readLen, rcReadData, rcReadQuality, reversedRead[FORWARD], reversedRead[RC]);
 
     if (countOfNs > maxK) {
         nReadsIgnoredBecauseOfTooManyNs++;
@@ -364,12 +442,38 @@ Return Value:
         }
     }
 
+    //
+    // Minimizer indices only have the minimizers, so don't bother looking up anything else.
+    //
+    if (0 != minimizerWindow) {
+        FindReadMinimizers(readData, readLen, seedLen, minimizerWindow, minimizerHashes, isMinimizerSeed);
+        for (unsigned i = 0; i <= readLen - seedLen; i++) {
+            if (!isMinimizerSeed[i]) {
+                SetSeedUsed(i);
+            }
+        }
+    }
+
     Read reverseComplimentRead;
     Read *read[NUM_DIRECTIONS];
     read[FORWARD] = inputRead;
     read[RC] = &reverseComplimentRead;
     read[RC]->init(NULL, 0, rcReadData, rcReadQuality, readLen);
 
+    readSeeds.set(readData, readLen);
+    deferLowQualitySeeds = 0 != minSeedQuality;
+    if (deferLowQualitySeeds) {
+        readSeeds.setQuality(readQuality, readLen, minSeedQuality);
+    }
+
+    if (NULL != packedGenome) {
+        packedRead[FORWARD].set(readData, readLen);
+        packedRead[RC].set(rcReadData, readLen);
+        for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
+            packedReversedRead[dir].set(reversedRead[dir], readLen);
+        }
+    }
+
     clearCandidates();
 
     //
@@ -381,11 +485,14 @@ Return Value:
 
     unsigned nextSeedToTest = 0;
     unsigned wrapCount = 0;
+    unsigned seedsWithoutHits = 0;     // In the first pass, until one has hits; for -giveUp
+    bool anySeedHasHits = false;
     lowestPossibleScoreOfAnyUnseenLocation[FORWARD] = lowestPossibleScoreOfAnyUnseenLocation[RC] = 0;
-    mostSeedsContainingAnyParticularBase[FORWARD] = mostSeedsContainingAnyParticularBase[RC] = 1;  // Instead of tracking this for real, we're just conservative and use wrapCount+1.  It's faster.
+    mostSeedsContainingAnyParticularBase[FORWARD] = mostSeedsContainingAnyParticularBase[RC] = 1;  // Instead of tracking this for real, we're just conservative and use wrapCount+1.  It's faster.  With -as we do track it (see seedsContainingBase).
     bestScore = UnusedScoreValue;
     secondBestScore = UnusedScoreValue;
     nSeedsApplied[FORWARD] = nSeedsApplied[RC] = 0;
+    nSeedsInLookupBatch = nextSeedInLookupBatch = 0;
     lvScores = 0;
     lvScoresAfterBestFound = 0;
     probabilityOfAllCandidates = 0.0;
@@ -393,17 +500,54 @@ Return Value:
 
     scoreLimit = maxK + extraSearchDepth; // For MAPQ computation
 
+    if (adaptiveSeeding) {
+        for (unsigned i = 0; i < readLen; i++) {
+            probeHitsByBase[i] = UnprobedHits;
+        }
+        memset(seedsContainingBase[FORWARD], 0, readLen);
+        memset(seedsContainingBase[RC], 0, readLen);
+        nAdaptiveSeeds = nextAdaptiveSeed = 0;
+    }
+
+    if (exactMatchFastPath && 0 == countOfNs && tryExactMatch(read, primaryResult, nSecondaryResults != NULL ? maxEditDistanceForSecondaryResults : -1,
+            nPossibleSeeds, maxSeedsToUse)) {
+#ifdef  _DEBUG
+        if (_DumpAlignments) printf("\tExact match fast path at %u\n", primaryResult->location);
+#endif  // _DEBUG
+        bestScore = 0;
+        finalizeSecondaryResults(*primaryResult, nSecondaryResults, secondaryResults, maxSecondaryResults, maxEditDistanceForSecondaryResults, bestScore);
+        return;
+    }
+
     while (nSeedsApplied[FORWARD] + nSeedsApplied[RC] < maxSeedsToUse) {
         //
         // Choose the next seed to use.  Choose the first one that isn't used
         //
-        if (nextSeedToTest >= nPossibleSeeds) {
+        if (adaptiveSeeding && 0 != wrapCount) {
+            //
+            // We're past the probe, so just take the next seed in adaptiveSeedOrder.  They're all unused and valid.
+            //
+            if (nextAdaptiveSeed >= nAdaptiveSeeds) {
+                break;  // Out of seeds.  Do the best we can with what we have.
+            }
+            nextSeedToTest = adaptiveSeedOrder[nextAdaptiveSeed].offset;
+            nextAdaptiveSeed++;
+        } else if (adaptiveSeeding && nextSeedToTest >= nPossibleSeeds) {
+            //
+            // That was the end of the probe.  Order the rest of the seeds by what it found.
+            //
+            wrapCount = 1;
+            deferLowQualitySeeds = false;
+            buildAdaptiveSeedOrder(nPossibleSeeds);
+            continue;
+        } else if (nextSeedToTest >= nPossibleSeeds) {
             //
             // We're wrapping.  We want to space the seeds out as much as possible, so if we had
             // a seed length of 20 we'd want to take 0, 10, 5, 15, 2, 7, 12, 17.  To make the computation
             // fast, we use use a table lookup.
             //
             wrapCount++;
+            deferLowQualitySeeds = false;
             if (wrapCount >= seedLen) {
                 //
                 // We tried all possible seeds without matching or even getting enough seeds to
@@ -441,6 +585,17 @@ Return Value:
             nextSeedToTest++;
         }
 
+        if (deferLowQualitySeeds && nextSeedToTest < nPossibleSeeds && !readSeeds.isHighQuality(nextSeedToTest, seedLen)) {
+            //
+            // A seed over a low quality base is likely to miss.  Take the next high quality one instead, and leave this
+            // one unused for the later passes.
+            //
+            nLowQualitySeedsSkipped++;
+            while (nextSeedToTest < nPossibleSeeds && (IsSeedUsed(nextSeedToTest) || !readSeeds.isHighQuality(nextSeedToTest, seedLen))) {
+                nextSeedToTest++;
+            }
+        }
+
         if (nextSeedToTest >= nPossibleSeeds) {
             //
             // Unusable seeds have pushed us past the end of the read.  Go back around the outer loop so we wrap properly.
@@ -451,23 +606,29 @@ Return Value:
 
         SetSeedUsed(nextSeedToTest);
 
-        if (!Seed::DoesTextRepresentASeed(read[FORWARD]->getData() + nextSeedToTest, seedLen)) {
+        if (!readSeeds.isSeed(nextSeedToTest, seedLen)) {
             continue;
         }
 
-        Seed seed(read[FORWARD]->getData() + nextSeedToTest, seedLen);
+        if (nextSeedInLookupBatch >= nSeedsInLookupBatch || lookupBatchSeedOffsets[nextSeedInLookupBatch] != nextSeedToTest) {
+            //
+            // Each lookup applies at most two seeds (forward and RC), so don't look further ahead than we could use.
+            //
+            unsigned seedsLeftToApply = maxSeedsToUse - (nSeedsApplied[FORWARD] + nSeedsApplied[RC]);
+            lookupSeedBatch(nextSeedToTest, nPossibleSeeds, (seedsLeftToApply + 1) / 2, adaptiveSeeding && 0 != wrapCount);
+        }
+        _ASSERT(lookupBatchSeedOffsets[nextSeedInLookupBatch] == nextSeedToTest);
 
         _int64        nHits[NUM_DIRECTIONS];                // Number of times this seed hits in the genome
         const GenomeLocation  *hits[NUM_DIRECTIONS];        // The actual hits (of size nHits)
-        GenomeLocation singletonHits[NUM_DIRECTIONS];       // Storage for single hits (this is required for 64 bit genome indices, since they might use fewer than 8 bytes internally)
-
         const unsigned *hits32[NUM_DIRECTIONS];
 
-        if (doesGenomeIndexHave64BitLocations) {
-            genomeIndex->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC], &singletonHits[FORWARD], &singletonHits[RC]);
-        } else {
-            genomeIndex->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
+        for (Direction direction = 0; direction < NUM_DIRECTIONS; direction++) {
+            nHits[direction] = lookupBatchNHits[direction][nextSeedInLookupBatch];
+            hits[direction] = lookupBatchHits[direction][nextSeedInLookupBatch];
+            hits32[direction] = lookupBatchHits32[direction][nextSeedInLookupBatch];
         }
+        nextSeedInLookupBatch++;
 
         nHashTableLookups++;
         lookupsThisRun++;
@@ -477,7 +638,7 @@ Return Value:
         if (_DumpAlignments) {
             printf("\tSeed offset %2d, %4d hits, %4d rcHits.", nextSeedToTest, nHits[0], nHits[1]);
             for (int rc = 0; rc < 2; rc++) {
-                for (unsigned i = 0; i < __min(nHits[rc], 5); i++) {
+                for (unsigned i = 0; nHits[rc] <= maxHitsToConsider && i < __min(nHits[rc], 5); i++) {   // Popular seeds may not have hit lists
                     printf(" %sHit at %9llu.", rc == 1 ? "RC " : "", doesGenomeIndexHave64BitLocations ? hits[rc][i] : (_int64)hits32[rc][i]);
                 }
             }
@@ -500,6 +661,23 @@ Return Value:
 
         bool appliedEitherSeed = false;
 
+        if (0 != maxSeedsWithoutHits && 0 == wrapCount && !anySeedHasHits) {
+            for (Direction direction = 0; direction < NUM_DIRECTIONS; direction++) {
+                anySeedHasHits = anySeedHasHits || (0 != nHits[direction] && (nHits[direction] <= maxHitsToConsider || explorePopularSeeds));
+            }
+
+            if (!anySeedHasHits && ++seedsWithoutHits >= maxSeedsWithoutHits) {
+                //
+                // Nothing from this read is in the index, or only sequence that's everywhere, so it's probably adapter,
+                // contamination or low complexity.  Don't spend the rest of the seeds finding that out.
+                //
+                nReadsGivenUp++;
+                primaryResult->mapq = 0;
+                finalizeSecondaryResults(*primaryResult, nSecondaryResults, secondaryResults, maxSecondaryResults, maxEditDistanceForSecondaryResults, bestScore);
+                return;
+            }
+        }
+
         for (Direction direction = 0; direction < NUM_DIRECTIONS; direction++) {
             if (nHits[direction] > maxHitsToConsider && !explorePopularSeeds) {
                 //
@@ -507,6 +685,7 @@ Return Value:
                 //
                 nHitsIgnoredBecauseOfTooHighPopularity++;
                 popularSeedsSkipped++;
+                nPopularSeedsSkipped++;
                 smallestSkippedSeed[direction] = __min(nHits[direction], smallestSkippedSeed[direction]);
             } else {
                 if (0 == wrapCount) {
@@ -586,9 +765,31 @@ Return Value:
                 }
                 nSeedsApplied[direction]++;
                 appliedEitherSeed = true;
+
+                if (adaptiveSeeding) {
+                    //
+                    // The RC seed covers the same bases of the read as the forward one, so counting both in forward
+                    // read coordinates is fine.
+                    //
+                    for (unsigned i = nextSeedToTest; i < nextSeedToTest + seedLen; i++) {
+                        seedsContainingBase[direction][i]++;
+                        mostSeedsContainingAnyParticularBase[direction] =
+                            __max(mostSeedsContainingAnyParticularBase[direction], (unsigned)seedsContainingBase[direction][i]);
+                    }
+                }
             } // not too popular
         }   // directions
 
+        if (adaptiveSeeding && 0 == wrapCount) {
+            //
+            // This is a probe seed.  Record how many hits it got, whether or not we used them.
+            //
+            unsigned probeHits = (unsigned)__min(nHits[FORWARD] + nHits[RC], (_int64)UnprobedHits - 1);
+            for (unsigned i = nextSeedToTest; i < nextSeedToTest + seedLen; i++) {
+                probeHitsByBase[i] = probeHits;
+            }
+        }
+
 #if 1
         nextSeedToTest += seedLen;
 #else   // 0
@@ -745,6 +946,14 @@ Return Value:
 
     unsigned weightListToCheck = highestUsedWeightList;
 
+    //
+    // The elements from the one being scored up to (but not including) prefetchEnd on prefetchWeightList have had their
+    // genome data prefetched.  Scoring only ever takes elements off the front of the list, so prefetchEnd stays on it.
+    //
+    unsigned prefetchWeightList = 0;
+    HashTableElement *prefetchEnd = NULL;
+    unsigned nPrefetched = 0;
+
     do {
         //
         // Grab the next element to score, and score it.
@@ -795,10 +1004,22 @@ Return Value:
 
         if (doAlignerPrefetch) {
             //
-            // Our prefetch pipeline is one loop out we get the genome data for the next loop, and two loops out we get the element to score.
+            // Keep a batch of the elements we're about to score prefetched: the element after the batch, and the genome
+            // data for everything in it.  Scoring an element takes long enough that its memory latency is hidden behind the
+            // ones in front of it.
             //
-            _mm_prefetch((const char *)(elementToScore->weightNext->weightNext), _MM_HINT_T2);   // prefetch the next element, it's likely to be the next thing we score.
-            genome->prefetchData(elementToScore->weightNext->baseGenomeLocation);
+            if (prefetchWeightList != weightListToCheck) {
+                prefetchWeightList = weightListToCheck;
+                prefetchEnd = elementToScore;
+                nPrefetched = 0;
+            }
+
+            while (nPrefetched < scoringPrefetchDepth && prefetchEnd != &weightLists[weightListToCheck]) {
+                prefetchCandidateGenomeData(prefetchEnd, read);
+                _mm_prefetch((const char *)prefetchEnd->weightNext, _MM_HINT_T2);
+                prefetchEnd = prefetchEnd->weightNext;
+                nPrefetched++;
+            }
         }
 
         if (elementToScore->lowestPossibleScore <= scoreLimit) {
@@ -817,19 +1038,11 @@ Return Value:
 
                 elementToScore->candidatesScored |= candidateBit;
                 _ASSERT(candidateIndexToScore < hashTableElementSize);
-                Candidate *candidateToScore = &elementToScore->candidates[candidateIndexToScore];
+                Candidate *candidateToScore = &getCandidates(elementToScore)[candidateIndexToScore];
 
                 GenomeLocation genomeLocation = elementToScore->baseGenomeLocation + candidateIndexToScore;
                 GenomeLocation elementGenomeLocation = genomeLocation;    // This is the genome location prior to any adjustments for indels
 
-                //
-                // We're about to run edit distance computation on the genome.  Launch a prefetch for it
-                // so that it's in cache when we do (or at least on the way).
-                //
-                if (doAlignerPrefetch) {
-                    genomeIndex->prefetchGenomeData(genomeLocation);
-                }
-
                 unsigned score = -1;
                 double matchProbability = 0;
                 unsigned readDataLength = read[elementToScore->direction]->getDataLength();
@@ -865,6 +1078,7 @@ Return Value:
 
 #endif // 0
                 if (data != NULL) {
+                    TIME_STAGE(LVStage);
                     Read *readToScore = read[elementToScore->direction];
 
                     _ASSERT(candidateToScore->seedOffset + seedLen <= readToScore->getDataLength());
@@ -883,9 +1097,27 @@ Return Value:
 
                     _ASSERT(!memcmp(data+seedOffset, readToScore->getData() + seedOffset, seedLen));
 
+                    //
+                    // The head costs at least one edit unless it matches the reference exactly where it sits, which is
+                    // quick to check.  That much of the limit is kept back from the tail, so a tail that would leave too
+                    // little for the head stops a row sooner, and the head is never run just to fail.  It doesn't change
+                    // any score: all it drops are candidates that would have been over the limit anyway.
+                    //
+                    int headLowerBound = (0 != seedOffset && 0 != memcmp(data, readToScore->getData(), seedOffset)) ? 1 : 0;
+
                     int textLen = (int)__min(genomeDataLength - tailStart, 0x7ffffff0);
-                    score1 = landauVishkin->computeEditDistance(data + tailStart, textLen, readToScore->getData() + tailStart, readToScore->getQuality() + tailStart, readLen - tailStart,
-                        scoreLimit, &matchProb1);
+                    if (scoreLimit < headLowerBound) {
+                        score1 = -1;
+                    } else if (NULL != packedGenome) {
+                        nLVCalls++;
+                        score1 = landauVishkin->computeEditDistance(packedGenome, GenomeLocationAsInt64(genomeLocation) + tailStart, textLen,
+                            &packedRead[elementToScore->direction], tailStart, readToScore->getQuality() + tailStart, readLen - tailStart,
+                            scoreLimit - headLowerBound, &matchProb1);
+                    } else {
+                        nLVCalls++;
+                        score1 = landauVishkin->computeEditDistance(data + tailStart, textLen, readToScore->getData() + tailStart, readToScore->getQuality() + tailStart, readLen - tailStart,
+                            scoreLimit - headLowerBound, &matchProb1);
+                    }
 
                     if (score1 == -1) {
                         score = -1;
@@ -893,9 +1125,17 @@ Return Value:
                         // The tail of the read matched; now let's reverse match the reference genome and the head
                         int limitLeft = scoreLimit - score1;
                         int genomeLocationOffset;
-                        score2 = reverseLandauVishkin->computeEditDistance(data + seedOffset, seedOffset + MAX_K, reversedRead[elementToScore->direction] + readLen - seedOffset,
+                        nLVCalls++;
+                        if (NULL != packedGenome) {
+                            score2 = reverseLandauVishkin->computeEditDistance(packedGenome, GenomeLocationAsInt64(genomeLocation) + seedOffset, seedOffset + MAX_K,
+                                                                                    &packedReversedRead[elementToScore->direction], readLen - seedOffset,
+                                                                                    read[OppositeDirection(elementToScore->direction)]->getQuality() + readLen - seedOffset, seedOffset, limitLeft, &matchProb2,
+                                                                                    &genomeLocationOffset);
+                        } else {
+                            score2 = reverseLandauVishkin->computeEditDistance(data + seedOffset, seedOffset + MAX_K, reversedRead[elementToScore->direction] + readLen - seedOffset,
                                                                                     read[OppositeDirection(elementToScore->direction)]->getQuality() + readLen - seedOffset, seedOffset, limitLeft, &matchProb2,
                                                                                     &genomeLocationOffset);
+                        }
 
                         if (score2 == -1) {
                             score = -1;
@@ -1024,21 +1264,19 @@ Return Value:
                     // If we're tracking secondary alignments, put the old best score in as a new secondary alignment
                     //
                     if (NULL != secondaryResults && (int)(bestScore - score) <= maxEditDistanceForSecondaryResults) { // bestScore is initialized to UnusedScoreValue, which is large, so this won't fire if this is the first candidate
-                        if (secondaryResultBufferSize <= *nSecondaryResults) {
+                        SingleAlignmentResult result;
+                        result.direction = primaryResult->direction;
+                        result.location = bestScoreGenomeLocation;
+                        result.mapq = 0;
+                        result.score = bestScore;
+                        result.status = MultipleHits;
+
+                        _ASSERT(result.score != -1);
+
+                        if (!AddSecondaryResult(secondaryResults, nSecondaryResults, secondaryResultBufferSize, secondaryResultsToKeep, &secondaryResultsHeapified, result)) {
                             WriteErrorMessage("Out of secondary result buffer in BaseAliner::score(), which shouldn't be possible");
                             soft_exit(1);
                         }
-
-                        SingleAlignmentResult *result = &secondaryResults[*nSecondaryResults];
-                        result->direction = primaryResult->direction;
-                        result->location = bestScoreGenomeLocation;
-                        result->mapq = 0;
-                        result->score = bestScore;
-                        result->status = MultipleHits;
-
-                        _ASSERT(result->score != -1);
-
-                        (*nSecondaryResults)++;
                     }
 
                     bestScore = score;
@@ -1064,22 +1302,36 @@ Return Value:
                     // If this is close enough, record it as a secondary alignment.
                     //
                     if (-1 != maxEditDistanceForSecondaryResults && NULL != secondaryResults && (int)(bestScore - score) <= maxEditDistanceForSecondaryResults && score != -1) {
-                         if (secondaryResultBufferSize <= *nSecondaryResults) {
+                        SingleAlignmentResult result;
+                        result.direction = elementToScore->direction;
+                        result.location = genomeLocation;
+                        result.mapq = 0;
+                        result.score = score;
+                        result.status = MultipleHits;
+
+                        if (!AddSecondaryResult(secondaryResults, nSecondaryResults, secondaryResultBufferSize, secondaryResultsToKeep, &secondaryResultsHeapified, result)) {
                             WriteErrorMessage("Out of secondary result buffer in BaseAliner::score(), which shouldn't be possible");
                             soft_exit(1);
                         }
+                    }
+                }
 
-                        SingleAlignmentResult *result = &secondaryResults[*nSecondaryResults];
-                        result->direction = elementToScore->direction;
-                        result->location = genomeLocation;
-                        result->mapq = 0;
-                        result->score = score;
-                        result->status = MultipleHits;
-
-                        _ASSERT(result->score != -1);
-
-                        (*nSecondaryResults)++;
+                if (0 != workBudget && nLVCalls - lvCallsAtReadStart >= workBudget) {
+                    //
+                    // Out of budget.  Settle for the best we've got, but don't claim to be sure of it.
+                    //
+                    read[FORWARD]->setAlignmentTruncated();
+                    primaryResult->score = bestScore;
+                    if (bestScore <= maxK) {
+                        primaryResult->location = bestScoreGenomeLocation;
+                        primaryResult->mapq = __min(MAX_MAPQ_FOR_TRUNCATED_SEARCH,
+                            computeMAPQ(probabilityOfAllCandidates, probabilityOfBestCandidate, bestScore, popularSeedsSkipped));
+                        primaryResult->status = MultipleHits;
+                    } else {
+                        primaryResult->status = NotFound;
+                        primaryResult->mapq = 0;
                     }
+                    return true;
                 }
 
                 if (stopOnFirstHit && bestScore <= maxK) {
@@ -1108,6 +1360,9 @@ Return Value:
         elementToScore->weightNext->weightPrev = elementToScore->weightPrev;
         elementToScore->weightPrev->weightNext = elementToScore->weightNext;
         elementToScore->weightNext = elementToScore->weightPrev = elementToScore;
+        if (nPrefetched > 0) {
+            nPrefetched--;
+        }
 
     } while (forceResult);
 
@@ -1115,6 +1370,303 @@ Return Value:
 }
 
 
+    void
+BaseAligner::lookupSeedBatch(unsigned firstSeedOffset, unsigned nPossibleSeeds, unsigned maxSeedsInBatch, bool followAdaptiveSeedOrder)
+/*++
+
+Routine Description:
+
+    Look up the seed at firstSeedOffset along with the seeds that AlignRead will try after it if it keeps going in this
+    pass over the read (i.e., stepping by seedLen, skipping used seeds, ones that contain Ns and, in the first pass with
+    -sq, low quality ones, and stopping when it would wrap), or after the probe with -as, the ones that come after it in
+    adaptiveSeedOrder.  The caller has already checked that the first seed is valid.
+
+Arguments:
+
+    firstSeedOffset         - the offset of the seed that the caller wants now
+    nPossibleSeeds          - the number of seed offsets in the read
+    maxSeedsInBatch         - don't look up more than this many seeds
+    followAdaptiveSeedOrder - take the seeds after the first from adaptiveSeedOrder, starting at nextAdaptiveSeed
+
+--*/
+{
+    Seed seeds[GenomeIndex::MaxSeedLookupBatchSize];
+    int nSeeds = 0;
+    unsigned maxSeeds = __min(__max(maxSeedsInBatch, 1), (unsigned)GenomeIndex::MaxSeedLookupBatchSize);
+
+    if (followAdaptiveSeedOrder) {
+        lookupBatchSeedOffsets[nSeeds] = firstSeedOffset;
+        seeds[nSeeds] = readSeeds.getSeed(firstSeedOffset, seedLen);
+        nSeeds++;
+
+        for (unsigned i = nextAdaptiveSeed; i < nAdaptiveSeeds && nSeeds < (int)maxSeeds; i++) {
+            lookupBatchSeedOffsets[nSeeds] = adaptiveSeedOrder[i].offset;
+            seeds[nSeeds] = readSeeds.getSeed(adaptiveSeedOrder[i].offset, seedLen);
+            nSeeds++;
+        }
+    }
+
+    unsigned seedOffset = firstSeedOffset;
+    while (!followAdaptiveSeedOrder && nSeeds < (int)maxSeeds && seedOffset < nPossibleSeeds) {
+        if (nSeeds != 0 && (IsSeedUsed(seedOffset) || !readSeeds.isSeed(seedOffset, seedLen) ||
+                (deferLowQualitySeeds && !readSeeds.isHighQuality(seedOffset, seedLen)))) {
+            seedOffset++;
+            continue;
+        }
+
+        lookupBatchSeedOffsets[nSeeds] = seedOffset;
+        seeds[nSeeds] = readSeeds.getSeed(seedOffset, seedLen);
+        nSeeds++;
+        seedOffset += seedLen;
+    }
+
+    //
+    // Seeds that were looked up before AlignRead was called don't need to be looked up again.  Move the rest to the front,
+    // look them up there, and then spread them back out to their places in the batch.  Compacting only moves seeds toward
+    // the front, so spreading them back out from the end doesn't overwrite any that haven't moved yet.
+    //
+    int seedIndex[GenomeIndex::MaxSeedLookupBatchSize];
+    int nSeedsToLookUp = 0;
+    for (int i = 0; i < nSeeds; i++) {
+        if (NULL == seedLookups || -1 == seedLookups->find(lookupBatchSeedOffsets[i])) {
+            seeds[nSeedsToLookUp] = seeds[i];
+            seedIndex[nSeedsToLookUp] = i;
+            nSeedsToLookUp++;
+        }
+    }
+
+    if (nSeedsToLookUp > 0) {
+        TIME_STAGE(SeedLookupStage);
+        _int64 maxHitsWanted = explorePopularSeeds ? INT64_MAX : maxHitsToConsider;  // We skip seeds with more, so we only need their counts
+        if (doesGenomeIndexHave64BitLocations) {
+            overflowDecodeBuffer.reset();   // The previous batch is all used up
+            genomeIndex->lookupSeeds(seeds, nSeedsToLookUp, lookupBatchNHits[FORWARD], lookupBatchHits[FORWARD], lookupBatchNHits[RC], lookupBatchHits[RC],
+                lookupBatchSingletonHits[FORWARD], lookupBatchSingletonHits[RC], &overflowDecodeBuffer, maxHitsWanted);
+        } else {
+            genomeIndex->lookupSeeds32(seeds, nSeedsToLookUp, lookupBatchNHits[FORWARD], lookupBatchHits32[FORWARD], lookupBatchNHits[RC], lookupBatchHits32[RC],
+                maxHitsWanted);
+        }
+    }
+
+    if (nSeedsToLookUp < nSeeds) {
+        for (int j = nSeedsToLookUp - 1; j >= 0; j--) {
+            int i = seedIndex[j];
+            if (i == j) {
+                break;  // Everything before here was looked up in place
+            }
+            for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+                lookupBatchNHits[dir][i] = lookupBatchNHits[dir][j];
+                lookupBatchHits32[dir][i] = lookupBatchHits32[dir][j];
+                if (doesGenomeIndexHave64BitLocations && lookupBatchHits[dir][j] == &lookupBatchSingletonHits[dir][j]) {
+                    lookupBatchSingletonHits[dir][i] = lookupBatchSingletonHits[dir][j];
+                    lookupBatchHits[dir][i] = &lookupBatchSingletonHits[dir][i];
+                } else {
+                    lookupBatchHits[dir][i] = lookupBatchHits[dir][j];
+                }
+            }
+        }
+
+        for (int i = 0; i < nSeeds; i++) {
+            int lookup = seedLookups->find(lookupBatchSeedOffsets[i]);
+            if (-1 != lookup) {
+                for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+                    lookupBatchNHits[dir][i] = seedLookups->nHits[dir][lookup];
+                    lookupBatchHits[dir][i] = seedLookups->hits[dir][lookup];
+                    lookupBatchHits32[dir][i] = seedLookups->hits32[dir][lookup];
+                }
+                nSeedLookupsReused++;
+            }
+        }
+    }
+
+    nSeedsInLookupBatch = nSeeds;
+    nextSeedInLookupBatch = 0;
+}
+
+    bool
+BaseAligner::tryExactMatch(
+    Read                    *read[NUM_DIRECTIONS],
+    SingleAlignmentResult   *primaryResult,
+    int                      maxEditDistanceForSecondaryResults,
+    unsigned                 nPossibleSeeds,
+    unsigned                 maxSeedsToUse)
+/*++
+
+Routine Description:
+
+    The fast path for reads that match the genome exactly, which is most of them.  Look up the first batch of seeds, and
+    if the first few (which don't overlap) each hit exactly one place, all at the same location, and the read matches the
+    genome there base for base, that's the answer.
+
+    It's not just a guess.  Any other alignment within d edits of the read has to match at least one of d + 1 disjoint
+    seeds exactly, so it would have shown up as another hit of that seed, unless it's within a few bases of this one, in
+    which case score() would merge it in anyway.  So if d is at least as big as both extraSearchDepth and the limit for
+    secondary results, the full search would find only this location that counts for MAPQ or -om.
+
+    Either way the batch is left for AlignRead, which starts with the same seeds, so it costs nothing if it fails.
+
+Arguments:
+
+    read                                - the read we're aligning in both directions
+    primaryResult                       - filled in if we found the exact match
+    maxEditDistanceForSecondaryResults  - how far from the best alignment secondary results can be, or -1 if we aren't making them
+    nPossibleSeeds                      - the number of seed offsets in the read
+    maxSeedsToUse                       - the seed budget for this read
+
+Return Value:
+
+    true if we found the exact match and filled in primaryResult
+
+--*/
+{
+    unsigned nSeedsNeeded = __max(extraSearchDepth, (unsigned)__max(maxEditDistanceForSecondaryResults, 0)) + 1;
+    unsigned readLen = read[FORWARD]->getDataLength();
+
+    if (0 != minimizerWindow || noTruncation || nSeedsNeeded * seedLen > readLen || nSeedsNeeded > (unsigned)GenomeIndex::MaxSeedLookupBatchSize ||
+        nSeedsNeeded > (maxSeedsToUse + 1) / 2) {
+        return false;
+    }
+
+    if (!readSeeds.isSeed(0, seedLen)) {
+        return false;
+    }
+
+    lookupSeedBatch(0, nPossibleSeeds, (maxSeedsToUse + 1) / 2, false);
+    if ((unsigned)nSeedsInLookupBatch < nSeedsNeeded) {
+        return false;
+    }
+
+    GenomeLocation location = InvalidGenomeLocation;
+    Direction direction = FORWARD;
+    for (unsigned i = 0; i < nSeedsNeeded; i++) {
+        if (lookupBatchNHits[FORWARD][i] + lookupBatchNHits[RC][i] != 1) {
+            return false;
+        }
+
+        Direction hitDirection = 0 != lookupBatchNHits[FORWARD][i] ? FORWARD : RC;
+        unsigned offset = FORWARD == hitDirection ? lookupBatchSeedOffsets[i] : readLen - seedLen - lookupBatchSeedOffsets[i];
+
+        GenomeLocation hitLocation;
+        if (doesGenomeIndexHave64BitLocations) {
+            hitLocation = lookupBatchHits[hitDirection][i][0] - offset;
+        } else {
+            hitLocation = lookupBatchHits32[hitDirection][i][0] - offset;
+        }
+
+        if (0 == i) {
+            location = hitLocation;
+            direction = hitDirection;
+        } else if (hitLocation != location || hitDirection != direction) {
+            return false;
+        }
+    }
+
+    const char *data = genome->getSubstring(location, readLen);
+    if (NULL == data || 0 != memcmp(data, read[direction]->getData(), readLen)) {
+        return false;
+    }
+
+    nHashTableLookups += nSeedsNeeded;
+    nLocationsScored++;
+    if (NULL != stats) {
+        stats->exactMatchFastPathHits++;
+    }
+
+    primaryResult->location = location;
+    primaryResult->direction = direction;
+    primaryResult->score = 0;
+    primaryResult->mapq = computeMAPQ(1.0, 1.0, 0, 0);
+    primaryResult->status = primaryResult->mapq >= MAPQ_LIMIT_FOR_SINGLE_HIT ? SingleHit : MultipleHits;
+
+    return true;
+}
+
+    void
+BaseAligner::buildAdaptiveSeedOrder(unsigned nPossibleSeeds)
+/*++
+
+Routine Description:
+
+    Once the probe (the first pass over the read) is done, fill in adaptiveSeedOrder with the seeds that are still unused
+    and valid, least repetitive region first.  Within a region, they stay in the order that the wrapped passes would
+    have taken them, so they're still spread out over it.
+
+Arguments:
+
+    nPossibleSeeds  - the number of seed offsets in the read
+
+--*/
+{
+    nAdaptiveSeeds = 0;
+    nextAdaptiveSeed = 0;
+
+    for (unsigned wrap = 1; wrap < seedLen; wrap++) {
+        for (unsigned offset = GetWrappedNextSeedToTest(seedLen, wrap); offset < nPossibleSeeds; offset += seedLen) {
+            if (IsSeedUsed(offset) || !readSeeds.isSeed(offset, seedLen)) {
+                continue;
+            }
+
+            AdaptiveSeed *seed = &adaptiveSeedOrder[nAdaptiveSeeds];
+            seed->offset = offset;
+            seed->wrappedOrder = nAdaptiveSeeds;
+            seed->regionHits = __min(probeHitsByBase[offset], probeHitsByBase[offset + seedLen - 1]);
+            if (UnprobedHits == seed->regionHits) {
+                seed->regionHits = 0;   // Nothing's known about it, so it's as good a bet as any
+            }
+            nAdaptiveSeeds++;
+        }
+    }
+
+    qsort(adaptiveSeedOrder, nAdaptiveSeeds, sizeof(*adaptiveSeedOrder), AdaptiveSeed::compare);
+}
+
+    int
+BaseAligner::AdaptiveSeed::compare(const void *first, const void *second)
+{
+    const AdaptiveSeed *a = (const AdaptiveSeed *)first;
+    const AdaptiveSeed *b = (const AdaptiveSeed *)second;
+
+    if (a->regionHits != b->regionHits) {
+        return a->regionHits < b->regionHits ? -1 : 1;
+    }
+
+    return (int)a->wrappedOrder - (int)b->wrappedOrder;
+}
+
+    void
+BaseAligner::prefetchCandidateGenomeData(HashTableElement *element, Read *read[NUM_DIRECTIONS])
+/*++
+
+Routine Description:
+
+    Prefetch the genome data that score() will look at for the unscored candidates in a hash table element: from MAX_K
+    before the first of them (for the reverse edit distance) to MAX_K past the end of the read at the end of the element.
+
+Arguments:
+
+    element - the element
+    read    - the read we're aligning in both directions
+
+--*/
+{
+    _uint64 unscored = element->candidatesUsed & ~element->candidatesScored;
+    if (0 == unscored) {
+        return;
+    }
+
+    unsigned long first;
+    _BitScanForward64(&first, unscored);
+
+    GenomeLocation start = element->baseGenomeLocation + first - MAX_K;
+    GenomeDistance length = (hashTableElementSize - first) + read[element->direction]->getDataLength() + 2 * MAX_K;
+
+    if (NULL != packedGenome) {
+        packedGenome->prefetch(GenomeLocationAsInt64(start), length);
+    } else {
+        genomeIndex->prefetchGenomeData(start, length);
+    }
+}
+
     void
 BaseAligner::prefetchHashTableBucket(GenomeLocation genomeLocation, Direction direction)
 {
@@ -1144,21 +1696,25 @@ BaseAligner::findElement(
     decomposeGenomeLocation(genomeLocation, &highOrderGenomeLocation, &lowOrderGenomeLocation);
 
     _uint64 hashTableIndex = hash(highOrderGenomeLocation) % candidateHashTablesSize;
-    HashTableAnchor *anchor = &hashTable[hashTableIndex];
-    if (anchor->epoch != hashTableEpoch) {
-        //
-        // It's empty.
-        //
-        *hashTableElement = NULL;
-        return false;
-    }
+    unsigned epoch = (unsigned)hashTableEpoch;
 
-    HashTableElement *lookedUpElement = anchor->element;
-    while (NULL != lookedUpElement && lookedUpElement->baseGenomeLocation != highOrderGenomeLocation) {
-        lookedUpElement = lookedUpElement->next;
+    for (;;) {
+        HashTableAnchor *anchor = &hashTable[hashTableIndex];
+        if (anchor->epoch != epoch) {
+            //
+            // It's empty.
+            //
+            *hashTableElement = NULL;
+            return false;
+        }
+
+        if (anchor->baseGenomeLocation == (GenomeLocation)highOrderGenomeLocation) {
+            *hashTableElement = &hashTableElementPool[anchor->elementIndex];
+            return true;
+        }
+
+        hashTableIndex = (hashTableIndex + 1 == candidateHashTablesSize) ? 0 : hashTableIndex + 1;
     }
-    *hashTableElement = lookedUpElement;
-    return lookedUpElement != NULL;
 }
 
 
@@ -1194,7 +1750,7 @@ Arguments:
 
     _uint64 bitForThisCandidate = (_uint64)1 << lowOrderGenomeLocation;
 
-    *candidate = &(*hashTableElement)->candidates[lowOrderGenomeLocation];
+    *candidate = &getCandidates(*hashTableElement)[lowOrderGenomeLocation];
 
     (*hashTableElement)->allExtantCandidatesScored = (*hashTableElement)->allExtantCandidatesScored && ((*hashTableElement)->candidatesUsed & bitForThisCandidate);
     (*hashTableElement)->candidatesUsed |= bitForThisCandidate;
@@ -1228,22 +1784,20 @@ Return Value:
 
     decomposeGenomeLocation(genomeLocation, &highOrderGenomeLocation, &lowOrderGenomeLocation);
 
-    unsigned hashTableIndex = hash(highOrderGenomeLocation) % candidateHashTablesSize;
+    _uint64 hashTableIndex = hash(highOrderGenomeLocation) % candidateHashTablesSize;
+    unsigned epoch = (unsigned)hashTableEpoch;
 
+    //
+    // Find the empty slot at the end of the probe sequence.  The caller already knows that the element isn't there.
+    //
     HashTableAnchor *anchor = &hashTable[hashTableIndex];
-    if (doAlignerPrefetch) {
-        _mm_prefetch((const char *)anchor, _MM_HINT_T2);    // Prefetch our anchor.  We don't have enough computation to completely hide the prefetch, but at least we get some for free here.
+    while (anchor->epoch == epoch) {
+        _ASSERT(anchor->baseGenomeLocation != highOrderGenomeLocation);
+        hashTableIndex = (hashTableIndex + 1 == candidateHashTablesSize) ? 0 : hashTableIndex + 1;
+        anchor = &hashTable[hashTableIndex];
     }
-    HashTableElement *element;
-
-#if     DBG
-    element = hashTable[hashTableIndex].element;
 
-    while (anchor->epoch == hashTableEpoch && NULL != element && element->genomeLocation != highOrderGenomeLocation) {
-        element = element->next;
-    }
-    _ASSERT(NULL == element || anchor->epoch != hashTableEpoch);
-#endif  // DBG
+    HashTableElement *element;
 
     _ASSERT(nUsedHashTableElements < hashTableElementPoolSize);
     element = &hashTableElementPool[nUsedHashTableElements];
@@ -1274,19 +1828,15 @@ Return Value:
     element->weightNext->weightPrev = element;
     element->weightPrev->weightNext = element;
 
-    *candidate = &element->candidates[lowOrderGenomeLocation];
+    *candidate = &getCandidates(element)[lowOrderGenomeLocation];
     (*candidate)->seedOffset = seedOffset;
     *hashTableElement = element;
 
     highestUsedWeightList = __max(highestUsedWeightList,(unsigned)1);
 
-    if (anchor->epoch == hashTableEpoch) {
-        element->next = anchor->element;
-    } else {
-        anchor->epoch = hashTableEpoch;
-        element->next = NULL;
-    }
-    anchor->element = element;
+    anchor->baseGenomeLocation = highOrderGenomeLocation;
+    anchor->elementIndex = (unsigned)(element - hashTableElementPool);
+    anchor->epoch = epoch;
 
 }
 
@@ -1339,6 +1889,30 @@ Return Value:
         BigDealloc(seedUsedAsAllocated);
         seedUsed = NULL;
 
+        BigDealloc(adaptiveSeedOrder);
+        adaptiveSeedOrder = NULL;
+
+        BigDealloc(probeHitsByBase);
+        probeHitsByBase = NULL;
+
+        BigDealloc(seedsContainingBase[FORWARD]);
+        seedsContainingBase[FORWARD] = seedsContainingBase[RC] = NULL;
+
+        if (NULL != minimizerHashes) {
+            BigDealloc(minimizerHashes);
+            minimizerHashes = NULL;
+            BigDealloc(isMinimizerSeed);
+            isMinimizerSeed = NULL;
+        }
+
+        BigDealloc(readSeedStorage);
+        readSeedStorage = NULL;
+
+        if (NULL != packedReadStorage) {
+            BigDealloc(packedReadStorage);
+            packedReadStorage = NULL;
+        }
+
         BigDealloc(candidateHashTable[FORWARD]);
         candidateHashTable[FORWARD] = NULL;
 
@@ -1351,10 +1925,18 @@ Return Value:
         BigDealloc(hashTableElementPool);
         hashTableElementPool = NULL;
 
+        BigDealloc(candidatePool);
+        candidatePool = NULL;
+
         if (NULL != hitsPerContigCounts) {
             BigDealloc(hitsPerContigCounts);
             hitsPerContigCounts = NULL;
         }
+
+        if (NULL != overflowDecodeBufferStorage) {
+            BigDealloc(overflowDecodeBufferStorage);
+            overflowDecodeBufferStorage = NULL;
+        }
     }
 }
 
@@ -1368,7 +1950,6 @@ BaseAligner::HashTableElement::init()
 {
     weightNext = NULL;
     weightPrev = NULL;
-    next = NULL;
     candidatesUsed = 0;
     baseGenomeLocation = 0;
     weight = 0;
@@ -1388,6 +1969,15 @@ BaseAligner::Candidate::init()
     void
 BaseAligner::clearCandidates() {
     hashTableEpoch++;
+    if (0 == (unsigned)hashTableEpoch) {
+        //
+        // The epochs in the slots have wrapped, so some of them could look current.  Really clear them.
+        //
+        for (Direction rc = 0; rc < NUM_DIRECTIONS; rc++) {
+            memset(candidateHashTable[rc], 0, sizeof(HashTableAnchor) * candidateHashTablesSize);
+        }
+        hashTableEpoch++;
+    }
     nUsedHashTableElements = 0;
     highestUsedWeightList = 0;
     for (unsigned i = 1; i < numWeightLists; i++) {
@@ -1453,9 +2043,32 @@ BaseAligner::getBigAllocatorReservation(GenomeIndex *index, bool ownLandauVishki
     } else {
         contigCounters = 0;
     }
+    size_t minimizerBuffers;
+    if (0 != index->getMinimizerWindow()) {
+        minimizerBuffers = (sizeof(_uint64) + sizeof(bool)) * maxReadSize;
+    } else {
+        minimizerBuffers = 0;
+    }
+    size_t packedReads;
+    if (NULL != index->getGenome()->getPackedBases()) {
+        packedReads = PackedBases::GetStorageSize(maxReadSize) * NUM_DIRECTIONS * 2;
+    } else {
+        packedReads = 0;
+    }
+    size_t readSeeds = PackedReadSeeds::GetStorageSize(maxReadSize);
+    size_t overflowDecodeBufferSize;
+    if (index->hasCompressedOverflowTable()) {
+        overflowDecodeBufferSize = sizeof(GenomeLocation) * OverflowDecodeBuffer::getBufferSize(GenomeIndex::MaxSeedLookupBatchSize * NUM_DIRECTIONS, maxHitsToConsider);
+    } else {
+        overflowDecodeBufferSize = 0;
+    }
 
     return
         contigCounters                                                  +
+        overflowDecodeBufferSize                                        + // decoded hits from a compressed overflow table
+        minimizerBuffers                                                + // minimizerHashes and isMinimizerSeed
+        packedReads                                                     + // packedRead and packedReversedRead
+        readSeeds                                                       + // readSeeds
         sizeof(_uint64) * 14                                            + // allow for alignment
         sizeof(BaseAligner)                                             + // our own member variables
         (ownLandauVishkin ?
@@ -1464,7 +2077,10 @@ BaseAligner::getBigAllocatorReservation(GenomeIndex *index, bool ownLandauVishki
         sizeof(char) * maxReadSize * 2                                  + // rcReadData
         sizeof(char) * maxReadSize * 4 + 2 * MAX_K                      + // reversed read (both)
         sizeof(BYTE) * (maxReadSize + 7 + 128) / 8                      + // seed used
+        (sizeof(AdaptiveSeed) + sizeof(unsigned) +
+            sizeof(BYTE) * NUM_DIRECTIONS) * maxReadSize                + // adaptiveSeedOrder, probeHitsByBase and seedsContainingBase
         sizeof(HashTableElement) * hashTableElementPoolSize             + // hash table element pool
+        sizeof(Candidate) * hashTableElementStride * hashTableElementPoolSize + // candidate pool
         sizeof(HashTableAnchor) * candidateHashTablesSize * 2           + // candidate hash table (both)
         sizeof(HashTableElement) * (maxSeedsToUse + 1);                   // weight lists
 }
@@ -1532,7 +2148,7 @@ BaseAligner::finalizeSecondaryResults(
             //
             // Just sort them all, in order of contig then hit depth.
             //
-            qsort(secondaryResults, *nSecondaryResults, sizeof(*secondaryResults), SingleAlignmentResult::compareByContigAndScore);
+            SingleAlignmentResult::sortByContigAndScore(secondaryResults, *nSecondaryResults, genome);
 
             //
             // Now run through and eliminate any contigs with too many hits.  We can't use the same trick at the first loop above, because the
@@ -1565,9 +2181,13 @@ BaseAligner::finalizeSecondaryResults(
         }
     } // if maxSecondaryAlignmentsPerContig > 0
 
-    if (*nSecondaryResults > maxSecondaryResults) {
+    if (*nSecondaryResults > maxSecondaryResults || secondaryResultsHeapified) {
+        //
+        // If score() dropped some, what's left is the best of them but in heap order, so it gets sorted just as it would have been had
+        // they all been kept.
+        //
         qsort(secondaryResults, *nSecondaryResults, sizeof(*secondaryResults), SingleAlignmentResult::compareByScore);
-        *nSecondaryResults = maxSecondaryResults;   // Just truncate it
+        *nSecondaryResults = __min(*nSecondaryResults, maxSecondaryResults);   // Just truncate it
     }
 }
 
@@ -37,6 +37,61 @@ Revision History:
 
 extern bool doAlignerPrefetch;
 
+//
+// Seed lookups that another aligner has already done for a read (see IntersectingPairedEndAligner), so that AlignRead can
+// use them rather than looking the same seeds up again.  The hit lists have to stay valid while AlignRead runs; the single
+// hits of 64 bit indices, which GenomeIndex::lookupSeeds returns in caller storage, are copied here.
+//
+struct SeedLookupResults {
+    static const int MaxSeeds = 64;
+
+    void clear() {nSeeds = 0;}
+
+    //
+    // Returns the index of the lookup of the seed at this offset in the (forward) read, or -1 if there isn't one.
+    //
+    int find(unsigned seedOffset) const {
+        for (int i = 0; i < nSeeds; i++) {
+            if (offset[i] == seedOffset) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    //
+    // Record a lookup, unless there's no room.  Exactly one of i_hits and i_hits32 is supplied (per direction), to
+    // match the index's location size.
+    //
+    void add(unsigned seedOffset, const _int64 *i_nHits, const GenomeLocation * const *i_hits, const unsigned * const *i_hits32) {
+        if (nSeeds >= MaxSeeds) {
+            return;
+        }
+        offset[nSeeds] = seedOffset;
+        for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+            nHits[dir][nSeeds] = i_nHits[dir];
+            hits[dir][nSeeds] = NULL;
+            hits32[dir][nSeeds] = NULL;
+            if (NULL != i_hits32) {
+                hits32[dir][nSeeds] = i_hits32[dir];
+            } else if (1 == i_nHits[dir]) {
+                singletonHits[dir][nSeeds] = *i_hits[dir];
+                hits[dir][nSeeds] = &singletonHits[dir][nSeeds];
+            } else {
+                hits[dir][nSeeds] = i_hits[dir];
+            }
+        }
+        nSeeds++;
+    }
+
+    int                     nSeeds;
+    unsigned                offset[MaxSeeds];
+    _int64                  nHits[NUM_DIRECTIONS][MaxSeeds];
+    const GenomeLocation *  hits[NUM_DIRECTIONS][MaxSeeds];
+    const unsigned *        hits32[NUM_DIRECTIONS][MaxSeeds];
+    GenomeLocation          singletonHits[NUM_DIRECTIONS][MaxSeeds];
+};
+
 class BaseAligner {
 public:
 
@@ -70,7 +125,8 @@ public:
         int                      secondaryResultBufferSize,
         int                     *nSecondaryResults,
         int                      maxSecondaryResults,         // The most secondary results to return; always return the best ones
-        SingleAlignmentResult   *secondaryResults             // The caller passes in a buffer of secondaryResultBufferSize and it's filled in by AlignRead()
+        SingleAlignmentResult   *secondaryResults,            // The caller passes in a buffer of secondaryResultBufferSize and it's filled in by AlignRead()
+        const SeedLookupResults *i_seedLookups = NULL         // Lookups already done for this read, if any
     );      // Retun value is true if there was enough room in the secondary alignment buffer for everything that was found.
 
         
@@ -83,10 +139,18 @@ public:
     _int64 getNHitsIgnoredBecauseOfTooHighPopularity() const {return nHitsIgnoredBecauseOfTooHighPopularity;}
     _int64 getNReadsIgnoredBecauseOfTooManyNs() const {return nReadsIgnoredBecauseOfTooManyNs;}
     _int64 getNIndelsMerged() const {return nIndelsMerged;}
+    _int64 getNSeedLookupsReused() const {return nSeedLookupsReused;}
+    _int64 getNLowQualitySeedsSkipped() const {return nLowQualitySeedsSkipped;}
+    _int64 getNReadsGivenUp() const {return nReadsGivenUp;}
+
+    void getWorkCounters(AlignerWorkCounters *counters) const {
+        counters->hashTableLookups = nHashTableLookups;
+        counters->locationsScored = nLocationsScored;
+        counters->lvCalls = nLVCalls;
+        counters->popularSeedsSkipped = nPopularSeedsSkipped;
+    }
     void addIgnoredReads(_int64 newlyIgnoredReads) {nReadsIgnoredBecauseOfTooManyNs += newlyIgnoredReads;}
 
-    const char *getRCTranslationTable() const {return rcTranslationTable;}
-
     inline int getMaxK() const {return maxK;}
 
     inline void setMaxK(int maxK_) {maxK = maxK_;}
@@ -109,6 +173,27 @@ public:
     inline bool getStopOnFirstHit() {return stopOnFirstHit;}
     inline void setStopOnFirstHit(bool newValue) {stopOnFirstHit = newValue;}
 
+    inline bool getAdaptiveSeeding() {return adaptiveSeeding;}
+    inline void setAdaptiveSeeding(bool newValue) {adaptiveSeeding = newValue;}
+
+    inline bool getExactMatchFastPath() {return exactMatchFastPath;}
+    inline void setExactMatchFastPath(bool newValue) {exactMatchFastPath = newValue;}
+
+    //
+    // In the first pass of seeds over a read, move seeds off windows with a base below this quality (-sq), 0 for off.
+    //
+    inline void setMinSeedQuality(unsigned newValue) {minSeedQuality = newValue;}
+
+    //
+    // Report a read unaligned once this many seeds of the first pass over it have found no usable hits (-giveUp), 0 for off.
+    //
+    inline void setMaxSeedsWithoutHits(unsigned newValue) {maxSeedsWithoutHits = newValue;}
+
+    //
+    // Give up looking for a better alignment after this many edit distance computations on one read (-workBudget), 0 for no limit.
+    //
+    inline void setWorkBudget(unsigned newValue) {workBudget = newValue;}
+
     static size_t getBigAllocatorReservation(GenomeIndex *index, bool ownLandauVishkin, unsigned maxHitsToConsider, unsigned maxReadSize, unsigned seedLen, 
         unsigned numSeedsFromCommandLine, double seedCoverage, int maxSecondaryAlignmentsPerContig);
 
@@ -122,19 +207,36 @@ private:
 
     ProbabilityDistance *probDistance;
 
-    // Maximum distance to merge candidates that differ in indels over.
+    //
+    // Maximum distance to merge candidates that differ in indels over.  It's also the size of a hash table element (see
+    // decomposeGenomeLocation), which the code depends on.  The snapxl build picks it for each read in AlignRead, so that
+    // reads no longer than the regular build allows get the same merging as they would there; the candidate pool is laid
+    // out for the larger size either way.
+    //
+    static const unsigned shortReadMaxMergeDist = 48; // Must be even and <= 64
 #ifdef LONG_READS
-    static const unsigned maxMergeDist = 64; // Must be even and <= 64
+    static const unsigned longReadMaxMergeDist = 64; // Must be even and <= 64
+    unsigned maxMergeDist;
+    unsigned hashTableElementSize;
+    static const unsigned hashTableElementStride = longReadMaxMergeDist;
 #else
-    static const unsigned maxMergeDist = 48; // Must be even and <= 64
+    static const unsigned maxMergeDist = shortReadMaxMergeDist;
+    static const unsigned hashTableElementSize = maxMergeDist;
+    static const unsigned hashTableElementStride = hashTableElementSize;
 #endif
-    char rcTranslationTable[256];
-
     _int64 nHashTableLookups;
     _int64 nLocationsScored;
     _int64 nHitsIgnoredBecauseOfTooHighPopularity;
     _int64 nReadsIgnoredBecauseOfTooManyNs;
     _int64 nIndelsMerged;
+    _int64 nSeedLookupsReused;
+    _int64 nLowQualitySeedsSkipped;
+    _int64 nReadsGivenUp;                  // -giveUp
+    _int64 nLVCalls;
+    _int64 nPopularSeedsSkipped;           // Over the aligner's life, unlike popularSeedsSkipped
+
+    unsigned workBudget;
+    _int64 lvCallsAtReadStart;
 
     //
     // A bitvector indexed by offset in the read indicating whether this seed is used.
@@ -143,6 +245,29 @@ private:
     BYTE *seedUsed;
     BYTE *seedUsedAsAllocated;  // Use this for deleting seedUsed.
 
+    //
+    // For minimizer indices (see Minimizer.h), we mark all of the seeds that aren't minimizers of the read as used
+    // before we start, so the seed selection just steps over them.
+    //
+    unsigned minimizerWindow;
+    _uint64 *minimizerHashes;   // NULL unless minimizerWindow != 0
+    bool    *isMinimizerSeed;
+
+    //
+    // When the genome has a packed copy (-packGenome), we score against it, so we need the read, its reverse complement
+    // and their reversals packed as well.
+    //
+    const PackedBases  *packedGenome;
+    PackedBases         packedRead[NUM_DIRECTIONS];
+    PackedBases         packedReversedRead[NUM_DIRECTIONS];
+    void               *packedReadStorage;
+
+    //
+    // The forward read packed once for pulling out its seeds.
+    //
+    PackedReadSeeds     readSeeds;
+    void               *readSeedStorage;
+
     inline bool IsSeedUsed(unsigned indexInRead) const {
         return (seedUsed[indexInRead / 8] & (1 << (indexInRead % 8))) != 0;
     }
@@ -151,6 +276,57 @@ private:
         seedUsed[indexInRead / 8] |= (1 << (indexInRead % 8));
     }
 
+    //
+    // Seeds are looked up in batches (see GenomeIndex::lookupSeeds).  When AlignRead wants a seed that isn't the next one
+    // in the current batch, lookupSeedBatch looks it up along with the seeds we expect to want after it in this pass over
+    // the read, or the ones after it in adaptiveSeedOrder if followAdaptiveSeedOrder is set.  A bad guess just costs a
+    // wasted lookup; it can't change the results, because AlignRead still chooses its seeds itself and only uses the batch
+    // if the offset matches.
+    //
+    void lookupSeedBatch(unsigned firstSeedOffset, unsigned nPossibleSeeds, unsigned maxSeedsInBatch, bool followAdaptiveSeedOrder);
+
+    //
+    // Adaptive seeding (-as).  The first pass over the read, whose seeds don't overlap, is a cheap probe of how repetitive
+    // each part of the read is.  After it, rather than taking the rest of the seeds in the fixed order that
+    // GetWrappedNextSeedToTest gives, we take them in order of the fewest hits of the probe seeds at their two ends, so the
+    // remaining seed budget goes to the least repetitive parts of the read first.  Seeds chosen that way pile up over some
+    // bases, so wrapCount + 1 no longer bounds how many seeds contain any particular base; instead we count them, which
+    // also gives a tighter lowestPossibleScoreOfAnyUnseenLocation, so score() stops as soon as nothing we haven't seen can
+    // come within extraSearchDepth of the best candidate.
+    //
+    struct AdaptiveSeed {
+        unsigned    offset;
+        unsigned    regionHits;     // Fewest hits of the probe seeds containing its first and last bases
+        unsigned    wrappedOrder;   // Where it would have come without -as, which breaks ties
+
+        static int compare(const void *first, const void *second);
+    };
+
+    static const unsigned UnprobedHits = 0xffffffff;
+
+    void buildAdaptiveSeedOrder(unsigned nPossibleSeeds);
+
+    bool                    adaptiveSeeding;
+    unsigned                minSeedQuality;
+    unsigned                maxSeedsWithoutHits;
+    bool                    deferLowQualitySeeds;   // Only for the first pass over the read, so lookupSeedBatch skips the same seeds
+    AdaptiveSeed           *adaptiveSeedOrder;
+    unsigned                nAdaptiveSeeds;
+    unsigned                nextAdaptiveSeed;
+    unsigned               *probeHitsByBase;        // Hits of the probe seed containing each base of the read, or UnprobedHits
+    BYTE                   *seedsContainingBase[NUM_DIRECTIONS];   // How many applied seeds contain each base, with -as
+
+    int                     nSeedsInLookupBatch;
+    int                     nextSeedInLookupBatch;
+    unsigned                lookupBatchSeedOffsets[GenomeIndex::MaxSeedLookupBatchSize];
+    _int64                  lookupBatchNHits[NUM_DIRECTIONS][GenomeIndex::MaxSeedLookupBatchSize];
+    const GenomeLocation *  lookupBatchHits[NUM_DIRECTIONS][GenomeIndex::MaxSeedLookupBatchSize];
+    const unsigned *        lookupBatchHits32[NUM_DIRECTIONS][GenomeIndex::MaxSeedLookupBatchSize];
+    GenomeLocation          lookupBatchSingletonHits[NUM_DIRECTIONS][GenomeIndex::MaxSeedLookupBatchSize];     // Single hits for 64 bit indices point here
+    OverflowDecodeBuffer    overflowDecodeBuffer;           // Multiple hits from a compressed overflow table point here
+    const SeedLookupResults *seedLookups;                   // What AlignRead was given, or NULL
+    GenomeLocation *        overflowDecodeBufferStorage;    // NULL unless the index has a compressed overflow table
+
     struct Candidate {
         Candidate() {init();}
         void init();
@@ -159,8 +335,6 @@ private:
         int             seedOffset;
     };
 
-    static const unsigned hashTableElementSize = maxMergeDist;   // The code depends on this, don't change it
-
     void decomposeGenomeLocation(GenomeLocation genomeLocation, _uint64 *highOrder, _uint64 *lowOrder)
     {
         *lowOrder = (_uint64)GenomeLocationAsInt64(genomeLocation) % hashTableElementSize;
@@ -179,11 +353,6 @@ private:
         HashTableElement    *weightNext;
         HashTableElement    *weightPrev;
 
-        //
-        // Singly linked list for the hash table buckets.
-        //
-        HashTableElement    *next;
-
         _uint64              candidatesUsed;    // Really candidates we still need to score
         _uint64              candidatesScored;
 
@@ -195,22 +364,37 @@ private:
         Direction            direction;
         bool                 allExtantCandidatesScored;
         double               matchProbabilityForBestScore;
- 
-        Candidate            candidates[hashTableElementSize];
     };
 
     //
-    // Clearing out all of the pointers in the hash tables is expensive relative to running
-    // an alignment, because usually the table is much bigger than the number of entries in it.
-    // So, we avoid that expense by simply not clearing out the table at all.  Instead, along with
-    // the pointers we keep an epoch number.  There's a corresponding epoch number in the
-    // BaseAligner object, and if the two differ then the hash table bucket is empty.  We increment
-    // the epoch number in the BaseAligner at the beginning of each alignment, thus effectively
-    // clearing the hash table from the last run.
+    // The candidates for the elements in hashTableElementPool, hashTableElementStride of them for each in the same order.
+    // They're kept apart from the elements so that the parts of an element that get looked at for every seed hit and
+    // while choosing what to score are small and close together; the candidates themselves are only needed when a
+    // new one is hit and when it's scored.
+    //
+    Candidate *candidatePool;
+
+    inline Candidate *getCandidates(HashTableElement *element) {
+        return &candidatePool[(element - hashTableElementPool) * hashTableElementStride];
+    }
+
+    //
+    // The candidate hash tables are open addressed with linear probing, one slot per element, holding the element's
+    // base genome location so that looking up a location that has no element (which is most of them) only touches the
+    // slots, and never the elements.  There are at least half again as many slots as elements in a direction can be
+    // used for one read, so there's always an empty slot to stop a probe.
+    //
+    // Clearing out all of the slots in the hash tables is expensive relative to running an alignment, because usually
+    // the table is much bigger than the number of entries in it.  So, we avoid that expense by simply not clearing out
+    // the table at all.  Instead, along with each slot we keep an epoch number.  There's a corresponding epoch number in
+    // the BaseAligner object, and if the two differ then the slot is empty.  We increment the epoch number in the
+    // BaseAligner at the beginning of each alignment, thus effectively clearing the hash table from the last run.  Slots
+    // keep only the low 32 bits of it, and clearCandidates really clears the tables when those wrap.
     //
     struct HashTableAnchor {
-        HashTableElement *element;
-        _int64            epoch;
+        GenomeLocation  baseGenomeLocation;
+        unsigned        epoch;
+        unsigned        elementIndex;       // In hashTableElementPool
     };
 
     _int64 hashTableEpoch;
@@ -264,6 +448,12 @@ private:
     double totalProbabilityByDepth[AlignerStats::maxMaxHits];
     void updateProbabilityMass();
 
+    //
+    // Candidates are scored one at a time, best weight first, because each score tightens scoreLimit for the ones after
+    // it (and lets score() stop early), so most of them are cut off within a few rows.  Handing them off in batches to
+    // be scored somewhere else (like a GPU) would mean scoring them all at the looser limit, and would change which
+    // ones get scored at all.  The memory latency is what batching there would hide, and scoringPrefetchDepth does that.
+    //
         bool
     score(
         bool                     forceResult,
@@ -281,6 +471,13 @@ private:
     void allocateNewCandidate(GenomeLocation genomeLoation, Direction direction, unsigned lowestPossibleScore, int seedOffset, Candidate **candidate, HashTableElement **hashTableElement);
     void incrementWeight(HashTableElement *element);
     void prefetchHashTableBucket(GenomeLocation genomeLocation, Direction direction);
+    void prefetchCandidateGenomeData(HashTableElement *element, Read *read[NUM_DIRECTIONS]);
+
+    //
+    // The number of elements at the front of the weight list being scored that score() keeps the genome data coming into
+    // the cache for, so it's there by the time their turn comes.
+    //
+    static const unsigned scoringPrefetchDepth = 4;
 
     const Genome *genome;
     GenomeIndex *genomeIndex;
@@ -299,6 +496,9 @@ private:
     bool     doesGenomeIndexHave64BitLocations;
     int      maxSecondaryAlignmentsPerContig;
 
+    int      secondaryResultsToKeep;        // Bound for AddSecondaryResult() for this read, MAXINT32 if it mustn't drop any
+    bool     secondaryResultsHeapified;
+
     struct HitsPerContigCounts {
         _int64  epoch;          // Used hashTableEpoch, for the same reason
         int     hits;
@@ -310,8 +510,6 @@ private:
     char *rcReadQuality;
     char *reversedRead[NUM_DIRECTIONS];
 
-    unsigned nTable[256];
-
     int readId;
     
     // How many overly popular (> maxHits) seeds we skipped this run
@@ -324,6 +522,11 @@ private:
     bool stopOnFirstHit;      // Whether to stop the first time a location matches with less than
                               // maxK edit distance (useful when using SNAP for filtering only).
 
+    bool exactMatchFastPath;  // Whether to try tryExactMatch before the full search (everything but -nfp).
+
+    bool tryExactMatch(Read *read[NUM_DIRECTIONS], SingleAlignmentResult *primaryResult, int maxEditDistanceForSecondaryResults,
+        unsigned nPossibleSeeds, unsigned maxSeedsToUse);
+
     AlignerStats *stats;
 
     unsigned *hitCountByExtraSearchDepth;   // How many hits at each depth bigger than the current best edit distance.
@@ -364,6 +364,83 @@ bool BigCommit(
 
 #else /* no _MSC_VER */
 
+//
+// With -hp, BigAlloc first asks for hugetlbfs pages, which have to have been set aside (in /proc/sys/vm/nr_hugepages),
+// and if there aren't enough it falls back to ordinary pages with madvise(MADV_HUGEPAGE) for transparent huge pages.
+// Whichever it got the first time gets reported.  Building with USE_HUGETLB always uses hugetlbfs pages, and fails
+// rather than falling back.
+//
+const size_t HugePageSize = 2 * 1024 * 1024;
+
+//
+// The kernel zeros each page as it's first touched, which for a region of several GB (and especially with huge pages,
+// which are zeroed 2MB at a time) takes a while if it all happens in one thread.  So with -hp, regions at least this
+// big are touched by several threads at once before BigAlloc returns them.
+//
+const size_t MinPrefaultSize = 256 * 1024 * 1024;
+const size_t MinPrefaultChunk = 64 * 1024 * 1024;
+const unsigned MaxPrefaultThreads = 32;
+
+struct PrefaultContext {
+    char                *start;
+    size_t              size;
+    SingleWaiterObject  *doneObject;
+    volatile int        *runningThreadCount;
+};
+
+    void
+PrefaultThreadMain(void *param)
+{
+    PrefaultContext *context = (PrefaultContext *)param;
+    const size_t pageSize = 4096;
+    for (size_t offset = 0; offset < context->size; offset += pageSize) {
+        context->start[offset] = 0;     // Anonymous memory starts out zero, so this doesn't change anything
+    }
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
+
+    void
+PrefaultInParallel(char *start, size_t size)
+{
+    unsigned nThreads = (unsigned)__min((size_t)__min(MaxPrefaultThreads, GetNumberOfProcessors()), size / MinPrefaultChunk);
+    if (nThreads < 2) {
+        return;
+    }
+
+    PrefaultContext *contexts = new PrefaultContext[nThreads];
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    volatile int runningThreadCount = nThreads;
+
+    size_t chunkSize = (size + nThreads - 1) / nThreads;
+    for (unsigned i = 0; i < nThreads; i++) {
+        contexts[i].start = start + i * chunkSize;
+        contexts[i].size = __min(chunkSize, size - i * chunkSize);
+        contexts[i].doneObject = &doneObject;
+        contexts[i].runningThreadCount = &runningThreadCount;
+        if (!StartNewThread(PrefaultThreadMain, &contexts[i])) {
+            WriteErrorMessage("Unable to start page fault thread\n");
+            soft_exit(1);
+        }
+    }
+
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+    delete[] contexts;
+}
+
+    void
+ReportPageSize(const char *pageSizeDescription)
+{
+    static volatile int reported = 0;
+    if (1 == InterlockedIncrementAndReturnNewValue(&reported)) {
+        WriteStatusMessage("BigAlloc: using %s\n", pageSizeDescription);
+    }
+}
+
 #ifdef PROFILE_BIGALLOC
 void *BigAllocInternal(
 #else
@@ -380,28 +457,58 @@ void *BigAlloc(
     if (sizeToAllocate % ALIGN_SIZE != 0) {
         sizeToAllocate += ALIGN_SIZE - (sizeToAllocate % ALIGN_SIZE);
     }
+
+    char *mem = (char *)MAP_FAILED;
+    bool hugetlb = false;
+#ifdef USE_HUGETLB
+    bool tryHugetlb = true;
+#else
+    bool tryHugetlb = BigAllocUseHugePages && sizeToAllocate >= HugePageSize;
+#endif
+    if (tryHugetlb) {
+        size_t hugeSizeToAllocate = ((sizeToAllocate + HugePageSize - 1) / HugePageSize) * HugePageSize;
+        mem = (char *) mmap(NULL, hugeSizeToAllocate, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            sizeToAllocate = hugeSizeToAllocate;
+            hugetlb = true;
+            ReportPageSize("2MB hugetlbfs pages");
+        }
+#ifdef USE_HUGETLB
+        else {
+            perror("mmap with MAP_HUGETLB");
+            soft_exit(1);
+        }
+#endif
+    }
+
     if (sizeAllocated != NULL) {
       *sizeAllocated = sizeToAllocate - sizeof(size_t);
     }
 
-    int flags = MAP_PRIVATE|MAP_ANONYMOUS;
-#ifdef USE_HUGETLB
-    flags |= MAP_HUGETLB;
+    if (!hugetlb) {
+        mem = (char *) mmap(NULL, sizeToAllocate, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("mmap");
+            soft_exit(1);
+        }
+
+        if (BigAllocUseHugePages) {
+#ifdef MADV_HUGEPAGE
+            // Tell Linux to use huge pages for this range
+            if (madvise(mem, sizeToAllocate, MADV_HUGEPAGE) == -1) {
+                ReportPageSize("4KB pages: there weren't enough hugetlbfs pages, and madvise(MADV_HUGEPAGE) failed (your kernel may not support transparent huge pages)");
+            } else if (sizeToAllocate >= HugePageSize) {
+                ReportPageSize("transparent huge pages, since there weren't enough hugetlbfs pages");
+            }
+#else
+            ReportPageSize("4KB pages: there weren't enough hugetlbfs pages, and this build has no transparent huge page support");
 #endif
-    char *mem = (char *) mmap(NULL, sizeToAllocate, PROT_READ|PROT_WRITE, flags, -1, 0);
-    if (mem == MAP_FAILED) {
-        perror("mmap");
-        soft_exit(1);
+        }
     }
 
-#if (defined(MADV_HUGEPAGE) && !defined(USE_HUGETLB))
-    // Tell Linux to use huge pages for this range
-    if (BigAllocUseHugePages) {
-        if (madvise(mem, sizeToAllocate, MADV_HUGEPAGE) == -1) {
-            WriteErrorMessage("WARNING: failed to enable huge pages -- your kernel may not support it\n"); 
-        }
+    if (BigAllocUseHugePages && sizeToAllocate >= MinPrefaultSize) {
+        PrefaultInParallel(mem, sizeToAllocate);
     }
-#endif
 
     // Remember the size allocated in the first sizeof(size_t) bytes
     *((size_t *) mem) = sizeToAllocate;
@@ -426,15 +533,33 @@ void *BigReserve(
         size_t      *sizeReserved,
         size_t      *pageSize)
 {
-    // TODO: use actual reserve/commit API; this is a temporary hack
+    //
+    // Pages only get memory when they're touched, so committing is a no-op.  What reserving has to do is keep the
+    // whole range from counting against the overcommit limit, since readers reserve far more than they ever commit
+    // (a BAM reader's buffers can reserve more than the machine's memory).  Otherwise it's the same as BigAlloc,
+    // so BigDealloc frees it.
+    //
     if (pageSize != NULL) {
         *pageSize = 4096;
     }
-#ifdef PROFILE_BIGALLOC
-    return BigAllocInternal(sizeToReserve, sizeReserved);
-#else
-    return BigAlloc(sizeToReserve, sizeReserved);
-#endif
+
+    size_t sizeToAllocate = sizeToReserve + sizeof(size_t);
+    const size_t ALIGN_SIZE = 4096;
+    if (sizeToAllocate % ALIGN_SIZE != 0) {
+        sizeToAllocate += ALIGN_SIZE - (sizeToAllocate % ALIGN_SIZE);
+    }
+    if (sizeReserved != NULL) {
+        *sizeReserved = sizeToAllocate - sizeof(size_t);
+    }
+
+    char *mem = (char *) mmap(NULL, sizeToAllocate, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        soft_exit(1);
+    }
+
+    *((size_t *) mem) = sizeToAllocate;
+    return (void *) (mem + sizeof(size_t));
 }
 
 bool BigCommit(
@@ -449,12 +574,39 @@ bool BigCommit(
 
 #endif /* _MSC_VER */
 
+struct CachedBigAllocatorMemory
+{
+    char    *memory;
+    size_t  size;
+    size_t  used;       // what the BigAllocator allocated, so all that can be nonzero
+
+    CachedBigAllocatorMemory() : memory(NULL), size(0), used(0) {}
+    ~CachedBigAllocatorMemory() {
+        BigDealloc(memory);
+    }
+};
+
+static thread_local CachedBigAllocatorMemory cachedBigAllocatorMemory;
+
 BigAllocator::BigAllocator(size_t i_maxMemory, size_t i_allocationGranularity) : maxMemory(i_maxMemory), allocationGranularity(i_allocationGranularity)
 {
 #if     _DEBUG
     maxMemory += maxCanaries * sizeof(unsigned);
 #endif  // DEBUG
-    basePointer = (char *)BigAlloc(__max(maxMemory, 2 * 1024 * 1024)); // The 2MB minimum is to assure this lands in a big page
+    baseSize = __max(maxMemory, 2 * 1024 * 1024); // The 2MB minimum is to assure this lands in a big page
+
+    //
+    // Take the cached memory if it's big enough, but not if it's so much bigger that it would be a waste to hold it.
+    //
+    CachedBigAllocatorMemory *cached = &cachedBigAllocatorMemory;
+    if (NULL != cached->memory && cached->size >= baseSize && cached->size / 2 <= baseSize) {
+        basePointer = cached->memory;
+        baseSize = cached->size;
+        cached->memory = NULL;
+        memset(basePointer, 0, cached->used);
+    } else {
+        basePointer = (char *)BigAlloc(baseSize);
+    }
     allocPointer = basePointer;
 
 #if     _DEBUG
@@ -470,7 +622,46 @@ BigAllocator::BigAllocator(size_t i_maxMemory, size_t i_allocationGranularity) :
 
 BigAllocator::~BigAllocator()
 {
-    BigDealloc(basePointer);
+    CachedBigAllocatorMemory *cached = &cachedBigAllocatorMemory;
+    if (baseSize > MaxCachedSize) {
+        BigDealloc(basePointer);
+        return;
+    }
+    BigDealloc(cached->memory);
+    cached->memory = basePointer;
+    cached->size = baseSize;
+    cached->used = allocPointer - basePointer;
+}
+
+    size_t
+BigAllocator::getMemoryTouched()
+{
+#ifdef _MSC_VER
+    return getMemoryUsed();
+#else   // _MSC_VER
+    //
+    // mincore wants a page aligned start, and says for each page whether it's resident.
+    //
+    const size_t pageSize = 4096;
+    char *start = (char *)((size_t)basePointer - (size_t)basePointer % pageSize);
+    size_t nPages = (allocPointer - start + pageSize - 1) / pageSize;
+    if (0 == nPages) {
+        return 0;
+    }
+    unsigned char *resident = new unsigned char[nPages];
+    if (mincore(start, allocPointer - start, resident) != 0) {
+        delete[] resident;
+        return getMemoryUsed();
+    }
+    size_t touched = 0;
+    for (size_t i = 0; i < nPages; i++) {
+        if (resident[i] & 1) {
+            touched += pageSize;
+        }
+    }
+    delete[] resident;
+    return __min(touched, getMemoryUsed());
+#endif  // _MSC_VER
 }
 
 void *
@@ -553,6 +744,37 @@ void PrintBigAllocProfile()
 #endif
 }
 
+extern char *FormatUIntWithCommas(_uint64 val, char *outputBuffer, size_t outputBufferSize);   // As in AlignerContext.cpp, not the one in Util.h
+
+volatile int BigAllocatorUseReported = 0;
+
+    void
+ReportBigAllocatorUse(
+    int             nComponents,
+    const char    **componentNames,
+    const size_t   *reserved,
+    const size_t   *used,
+    int             numThreads)
+{
+    if (InterlockedIncrementAndReturnNewValue(&BigAllocatorUseReported) != 1) {
+        return;
+    }
+
+    char reservedBuffer[30], usedBuffer[30], allReservedBuffer[30], allUsedBuffer[30];
+    size_t totalReserved = 0, totalUsed = 0;
+    WriteStatusMessage("Aligner memory        Reserved per thread    Used per thread    Reserved, %d threads    Used, %d threads\n", numThreads, numThreads);
+    for (int i = 0; i <= nComponents; i++) {
+        const char *name = i < nComponents ? componentNames[i] : "Total";
+        size_t r = i < nComponents ? reserved[i] : totalReserved;
+        size_t u = i < nComponents ? used[i] : totalUsed;
+        WriteStatusMessage("%-20s %20s %18s %22s %18s\n", name,
+            FormatUIntWithCommas(r, reservedBuffer, sizeof(reservedBuffer)), FormatUIntWithCommas(u, usedBuffer, sizeof(usedBuffer)),
+            FormatUIntWithCommas(r * numThreads, allReservedBuffer, sizeof(allReservedBuffer)), FormatUIntWithCommas(u * numThreads, allUsedBuffer, sizeof(allUsedBuffer)));
+        totalReserved += r;
+        totalUsed += u;
+    }
+}
+
 void* zalloc(void* opaque, unsigned items, unsigned size)
 {
     size_t bytes = items * (size_t) size;
@@ -570,3 +792,103 @@ void zfree(void* opaque, void* p)
         free(p);
     }
 }
+
+BufferPool::BufferPool() : chunks(NULL)
+{
+    for (int i = 0; i < NSizeClasses; i++) {
+        freeLists[i] = NULL;
+    }
+}
+
+BufferPool::~BufferPool()
+{
+    void* chunk = chunks;
+    while (chunk != NULL) {
+        void* next = *(void**)chunk;
+        BigDealloc(chunk);
+        chunk = next;
+    }
+}
+
+    int
+BufferPool::sizeClass(
+    size_t bytes)
+{
+    if (bytes > MaxPooledSize) {
+        return -1;
+    }
+    int result = 0;
+    while ((MinPooledSize << result) < bytes) {
+        result++;
+    }
+    return result;
+}
+
+    void
+BufferPool::addChunk(
+    int sizeClass)
+{
+    char* chunk = (char*) BigAlloc(ChunkSize);
+    while (true) {
+        void* head = chunks;
+        *(void**)chunk = head;
+        if (InterlockedCompareExchangePointerAndReturnOldValue(&chunks, chunk, head) == head) {
+            break;
+        }
+    }
+
+    //
+    // String the chunk's buffers together and put them on the front of the free list all at once.
+    //
+    size_t bufferSize = MinPooledSize << sizeClass;
+    size_t nBuffers = (ChunkSize - MinPooledSize) / bufferSize;
+    char* first = chunk + MinPooledSize;
+    char* last = first + (nBuffers - 1) * bufferSize;
+    for (char* buffer = first; buffer < last; buffer += bufferSize) {
+        *(void**)buffer = buffer + bufferSize;
+    }
+    while (true) {
+        void* head = freeLists[sizeClass];
+        *(void**)last = head;
+        if (InterlockedCompareExchangePointerAndReturnOldValue(&freeLists[sizeClass], first, head) == head) {
+            return;
+        }
+    }
+}
+
+    char*
+BufferPool::alloc(
+    size_t bytes)
+{
+    int c = sizeClass(bytes);
+    if (c < 0) {
+        return new char[bytes];
+    }
+    while (true) {
+        void* head = freeLists[c];
+        if (head == NULL) {
+            addChunk(c);
+        } else if (InterlockedCompareExchangePointerAndReturnOldValue(&freeLists[c], *(void**)head, head) == head) {
+            return (char*) head;
+        }
+    }
+}
+
+    void
+BufferPool::free(
+    char* buffer,
+    size_t bytes)
+{
+    int c = sizeClass(bytes);
+    if (c < 0) {
+        delete [] buffer;
+        return;
+    }
+    while (true) {
+        void* head = freeLists[c];
+        *(void**)buffer = head;
+        if (InterlockedCompareExchangePointerAndReturnOldValue(&freeLists[c], buffer, head) == head) {
+            return;
+        }
+    }
+}
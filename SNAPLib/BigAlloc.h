@@ -22,6 +22,8 @@ Revision History:
 
 #pragma once
 
+#include "Compat.h"
+
 inline unsigned RoundUpToPageSize(unsigned size)
 {
     const unsigned pageSize = 4096;
@@ -87,6 +89,15 @@ public:
 
     virtual void *allocate(size_t amountToAllocate);
 
+    size_t getMemoryReserved() {return maxMemory;}
+    size_t getMemoryUsed() {return allocPointer - basePointer;}
+
+    //
+    // How much of what's been allocated has actually been paged in.  The aligners reserve for their worst case, but
+    // the memory isn't committed until it's touched, so this is what they really cost.
+    //
+    size_t getMemoryTouched();
+
 #if     _DEBUG
     void checkCanaries();
 #else  // DEBUG
@@ -98,6 +109,15 @@ private:
     char    *allocPointer;
     size_t  maxMemory;
     size_t  allocationGranularity;
+    size_t  baseSize;           // of the memory at basePointer, which can be more than maxMemory if it was cached
+
+    //
+    // Each thread keeps the memory of the last BigAllocator it deleted, up to MaxCachedSize, for the next one it
+    // creates if that fits, since the aligners' threads each make one for every run (see StartPooledThread).  It's
+    // zeroed before reuse, so it's just like new memory from BigAlloc, only without the page faults.  Only the part
+    // that was allocated can have been written, so only that is zeroed; the rest of the reservation is never touched.
+    //
+    static const size_t MaxCachedSize = 256 * 1024 * 1024;
 
 #if     _DEBUG
     //
@@ -137,6 +157,12 @@ private:
 
 extern bool BigAllocUseHugePages;
 
+//
+// For -mem: the first time it's called, print how much of each thread's BigAllocator each component reserved and how
+// much of that it actually allocated, and the same for all of the threads together.  Later calls don't print anything.
+//
+void ReportBigAllocatorUse(int nComponents, const char **componentNames, const size_t *reserved, const size_t *used, int numThreads);
+
 
 // trivial per-thread heap for use in zalloc
 struct ThreadHeap
@@ -172,6 +198,35 @@ struct ThreadHeap
     }
 };
 
+//
+// Buffers in power of two size classes, for small allocations that are made and freed all the time, from several
+// threads, such as the read ids and auxiliary data that PairedReadMatcher copies for reads whose mates are in a later
+// batch.  A freed buffer goes on a lock free list for its size class and gets handed out again; the memory comes from
+// BigAlloc a chunk at a time and only goes back when the pool is deleted.  Any thread may free, but only one at a time
+// may allocate, which is what keeps popping the lists safe.  Buffers bigger than MaxPooledSize just use new and delete.
+//
+class BufferPool
+{
+public:
+    BufferPool();
+    ~BufferPool();
+
+    char* alloc(size_t bytes);
+    void free(char* buffer, size_t bytes);   // bytes as passed to alloc
+
+    static const size_t MinPooledSize = 64;
+    static const int NSizeClasses = 11;     // MinPooledSize through 64KB
+    static const size_t MaxPooledSize = MinPooledSize << (NSizeClasses - 1);
+    static const size_t ChunkSize = 1024 * 1024;
+
+private:
+    static int sizeClass(size_t bytes);
+    void addChunk(int sizeClass);
+
+    void* volatile freeLists[NSizeClasses];
+    void* volatile chunks; // each chunk's first MinPooledSize bytes point at the next
+};
+
 void* zalloc(void* opaque, unsigned items, unsigned size);
 
 void zfree(void* opaque, void* p);
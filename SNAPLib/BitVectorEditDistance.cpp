@@ -0,0 +1,276 @@
+/*++
+
+Module Name:
+
+    BitVectorEditDistance.cpp
+
+Abstract:
+
+    Banded bit-vector edit distance.  See BitVectorEditDistance.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "BitVectorEditDistance.h"
+#include "Tables.h"
+
+    static inline int
+AdvanceBlock(
+    _uint64    &plusVertical,
+    _uint64    &minusVertical,
+    _uint64     match,
+    int         horizontalIn)
+/*++
+
+Routine Description:
+
+    Move a block one column along the text: Hyyro's version of Myers' step, taking the change in value along the row
+    just above the block and returning the change along its last row.
+
+Arguments:
+
+    plusVertical    - the rows where the value is one more than the row above, updated to the new column
+    minusVertical   - the same for one less
+    match           - the rows of the block where the pattern matches this column's text character
+    horizontalIn    - -1, 0 or 1: how the value in the row above the block changed from the last column
+
+--*/
+{
+    //
+    // Written without branches, since which way horizontalIn goes is about as predictable as the text.
+    //
+    _uint64 inIsMinus = (_uint64)(horizontalIn < 0);
+    _uint64 inIsPlus = (_uint64)(horizontalIn > 0);
+    _uint64 xVertical = match | minusVertical;
+
+    match |= inIsMinus;
+
+    _uint64 xHorizontal = (((match & plusVertical) + plusVertical) ^ plusVertical) | match;
+    _uint64 plusHorizontal = minusVertical | ~(xHorizontal | plusVertical);
+    _uint64 minusHorizontal = plusVertical & xHorizontal;
+
+    int horizontalOut = (int)(plusHorizontal >> 63) - (int)(minusHorizontal >> 63);   // They're never both set
+
+    plusHorizontal = (plusHorizontal << 1) | inIsPlus;
+    minusHorizontal = (minusHorizontal << 1) | inIsMinus;
+
+    plusVertical = minusHorizontal | ~(xVertical | plusHorizontal);
+    minusVertical = plusHorizontal & xVertical;
+
+    return horizontalOut;
+}
+
+    void
+BitVectorEditDistance::buildMatchVectors(const char *pattern, int patternLen, int block)
+{
+    for (int c = 0; c < NCharClasses; c++) {
+        matchVectors[block][c] = 0;
+    }
+
+    int end = __min(patternLen, (block + 1) * BlockSize);
+    for (int i = block * BlockSize; i < end; i++) {
+        matchVectors[block][BASE_VALUE[(unsigned char)pattern[i]]] |= (_uint64)1 << (i - block * BlockSize);
+    }
+    //
+    // Rows past the end of the pattern match nothing, so they don't change anything above them.
+    //
+}
+
+    int
+BitVectorEditDistance::computeEditDistance(
+    const char *text,
+    int         textDirection,
+    int         textLen,
+    const char *pattern,
+    int         patternLen,
+    int         k)
+/*++
+
+Routine Description:
+
+    Run the columns of the dynamic programming array, one per text character, keeping only the blocks of rows from
+    firstBlock to lastBlock.  A value that's no more than k comes from a path through values no more than k, so a block
+    whose values are all more than k can be dropped without changing anything that's within k: below it the row above
+    is then taken to go up by one in each column, which can only overestimate.  Blocks are added at the bottom once
+    the row above them gets within k.
+
+Arguments:
+
+    text            - the text, running in textDirection
+    textDirection   - 1 or -1
+    textLen         - the number of text characters
+    pattern         - the pattern
+    patternLen      - its length
+    k               - the most edits that are interesting
+
+Return Value:
+
+    The edit distance, with the pattern allowed to run off the end of the text for free, or -1 if it's more than k.
+
+--*/
+{
+    _ASSERT(patternLen <= MaxBlocks * BlockSize);
+    if (k < 0) {
+        return -1;
+    }
+
+    if (patternLen <= 0 || textLen <= 0) {
+        return 0;
+    }
+
+    int nBlocks = (patternLen + BlockSize - 1) / BlockSize;
+    int lastRowInBlock = (patternLen - 1) % BlockSize;
+    _uint64 pastEndOfPattern = (BlockSize - 1 == lastRowInBlock) ? 0 : ~(_uint64)0 << (lastRowInBlock + 1);
+
+    //
+    // The first column is the distance to the empty prefix of the text, which is just the row number.
+    //
+    int firstBlock = 0;
+    int lastBlock = __min(nBlocks - 1, k / BlockSize);
+    for (int block = 0; block <= lastBlock; block++) {
+        buildMatchVectors(pattern, patternLen, block);
+        plusVertical[block] = ~(_uint64)0;
+        minusVertical[block] = 0;
+        blockScore[block] = (block + 1) * BlockSize;
+    }
+    int blocksBuilt = lastBlock + 1;
+
+    int best = patternLen;
+
+    for (int i = 0; i < textLen; i++) {
+        int charClass = BASE_VALUE[(unsigned char)text[i * textDirection]];
+
+        int horizontal = 1;     // The first row is the distance to the empty pattern, which goes up by one per column
+        for (int block = firstBlock; block <= lastBlock; block++) {
+            horizontal = AdvanceBlock(plusVertical[block], minusVertical[block], matchVectors[block][charClass], horizontal);
+            blockScore[block] += horizontal;
+        }
+
+        if (lastBlock < nBlocks - 1 && blockScore[lastBlock] <= k) {
+            //
+            // The block below might get within k in the next column.  Until now its values have all been more than
+            // k, so taking them to go up by one per row from the last row of this block is good enough.
+            //
+            lastBlock++;
+            if (lastBlock >= blocksBuilt) {
+                buildMatchVectors(pattern, patternLen, lastBlock);
+                blocksBuilt = lastBlock + 1;
+            }
+            plusVertical[lastBlock] = ~(_uint64)0;
+            minusVertical[lastBlock] = 0;
+            blockScore[lastBlock] = blockScore[lastBlock - 1] + BlockSize;
+        }
+
+        //
+        // The smallest value in a block is at least its last row minus the number of rows that go up.
+        //
+        while (lastBlock >= firstBlock && blockScore[lastBlock] - CountOneBits(plusVertical[lastBlock]) > k) {
+            lastBlock--;
+        }
+
+        while (firstBlock <= lastBlock && blockScore[firstBlock] - CountOneBits(plusVertical[firstBlock]) > k) {
+            firstBlock++;
+        }
+
+        if (firstBlock > lastBlock) {
+            //
+            // Nothing's within k any more, so nothing later can be either.
+            //
+            return best <= k ? best : -1;
+        }
+
+        if (lastBlock == nBlocks - 1) {
+            int endOfPattern = blockScore[lastBlock] - CountOneBits(plusVertical[lastBlock] & pastEndOfPattern) +
+                CountOneBits(minusVertical[lastBlock] & pastEndOfPattern);
+            best = __min(best, endOfPattern);
+        }
+    }
+
+    //
+    // Running off the end of the text is free, so whatever's left of the pattern after any row of the last column
+    // costs nothing.  The rows past the end of the pattern can't be smaller than the best so far, so they don't hurt.
+    //
+    best = __min(best, textLen);
+    for (int block = firstBlock; block <= lastBlock; block++) {
+        int value = blockScore[block];
+        best = __min(best, value);
+        for (int row = BlockSize - 1; row > 0; row--) {
+            value -= (int)((plusVertical[block] >> row) & 1) - (int)((minusVertical[block] >> row) & 1);
+            best = __min(best, value);
+        }
+    }
+
+    return best <= k ? best : -1;
+}
+
+    int
+BitVectorEditDistance::findBestMatch(
+    const char *text,
+    int         textLen,
+    const char *pattern,
+    int         patternLen,
+    int         k,
+    int        *o_end)
+/*++
+
+Routine Description:
+
+    Myers' original search: the same columns as computeEditDistance, except that the row above the pattern is all
+    zeroes (a match can start after any text character for free), so nothing comes in at the top of the first block.
+    The texts it's used on are a few insert lengths long, so it keeps all of the blocks rather than banding them.
+
+Arguments:
+
+    text            - the text, running forward
+    textLen         - the number of text characters
+    pattern         - the pattern
+    patternLen      - its length
+    k               - the most edits that are interesting
+    o_end           - the text index the best match ends at
+
+Return Value:
+
+    The edit distance of the best match, or -1 if it's more than k.
+
+--*/
+{
+    _ASSERT(patternLen <= MaxBlocks * BlockSize);
+    if (k < 0 || patternLen <= 0 || textLen <= 0) {
+        return -1;
+    }
+
+    int nBlocks = (patternLen + BlockSize - 1) / BlockSize;
+    int lastRowInBlock = (patternLen - 1) % BlockSize;
+    _uint64 pastEndOfPattern = (BlockSize - 1 == lastRowInBlock) ? 0 : ~(_uint64)0 << (lastRowInBlock + 1);
+
+    for (int block = 0; block < nBlocks; block++) {
+        buildMatchVectors(pattern, patternLen, block);
+        plusVertical[block] = ~(_uint64)0;
+        minusVertical[block] = 0;
+        blockScore[block] = (block + 1) * BlockSize;
+    }
+
+    int best = k + 1;
+    for (int i = 0; i < textLen; i++) {
+        int charClass = BASE_VALUE[(unsigned char)text[i]];
+
+        int horizontal = 0;
+        for (int block = 0; block < nBlocks; block++) {
+            horizontal = AdvanceBlock(plusVertical[block], minusVertical[block], matchVectors[block][charClass], horizontal);
+            blockScore[block] += horizontal;
+        }
+
+        int endOfPattern = blockScore[nBlocks - 1] - CountOneBits(plusVertical[nBlocks - 1] & pastEndOfPattern) +
+            CountOneBits(minusVertical[nBlocks - 1] & pastEndOfPattern);
+        if (endOfPattern < best) {
+            best = endOfPattern;
+            *o_end = i;
+        }
+    }
+
+    return best <= k ? best : -1;
+}
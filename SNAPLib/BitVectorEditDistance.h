@@ -0,0 +1,64 @@
+/*++
+
+Module Name:
+
+    BitVectorEditDistance.h
+
+Abstract:
+
+    Myers' bit-vector edit distance (in Hyyro's formulation, a 64 row block of the pattern at a time), banded to
+    the blocks that can hold values no more than k, as in Ukkonen's cutoff.
+
+    It answers the same question as LandauVishkin (the edit distance between the whole pattern and a prefix of the
+    text, both starting at the beginning), except that running off the end of the text is free.  That makes what it
+    computes a lower bound on what LandauVishkin finds, which lets LandauVishkin use it to throw out candidates that
+    are more than k away: that's most of the locations it's asked about, and the bit vectors get to an answer for them
+    in work proportional to the text length times the width of the band, rather than LandauVishkin's k squared
+    extensions.  It doesn't produce an alignment, so LandauVishkin still does the ones within the limit.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Read.h"
+
+class BitVectorEditDistance {
+public:
+
+    //
+    // The edit distance between pattern and text as described above, or -1 if it's more than k.  The text runs in
+    // textDirection starting at text (so text[-1] is the second character going backward).  The pattern may be no
+    // longer than MaxReadLength.
+    //
+    int computeEditDistance(const char *text, int textDirection, int textLen, const char *pattern, int patternLen, int k);
+
+    //
+    // Where in the text the whole pattern matches best, with the match allowed to start anywhere: the smallest edit
+    // distance between the pattern and any substring of the text, or -1 if that's more than k.  o_end is set to the
+    // index of the last text character of the first substring that's that close.  The text runs forward.
+    //
+    int findBestMatch(const char *text, int textLen, const char *pattern, int patternLen, int k, int *o_end);
+
+private:
+
+    static const int BlockSize = 64;
+    static const int MaxBlocks = (MaxReadLength + BlockSize - 1) / BlockSize;
+
+    //
+    // Characters are looked up by BASE_VALUE, so A, C, G, T and everything else.  Two characters that are both in the
+    // last class count as matching even if they're different, which can only make the distance smaller.
+    //
+    static const int NCharClasses = 5;
+
+    void buildMatchVectors(const char *pattern, int patternLen, int block);
+
+    _uint64     matchVectors[MaxBlocks][NCharClasses];  // Per block and text class, the pattern rows that match
+    _uint64     plusVertical[MaxBlocks];                // The rows where the value goes up by one from the row above
+    _uint64     minusVertical[MaxBlocks];               // ...and down by one
+    int         blockScore[MaxBlocks];                  // The value in the last row of the block
+};
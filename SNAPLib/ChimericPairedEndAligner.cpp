@@ -8,7 +8,8 @@ Abstract:
 
     A paired-end aligner calls into a different paired-end aligner, and if
     it fails to find an alignment, aligns each of the reads singly.  This handles
-    chimeric reads that would otherwise be unalignable.
+    chimeric reads that would otherwise be unalignable.  See ChimericPairedEndAligner.h
+    for mate rescue.
 
 Authors:
 
@@ -47,6 +48,8 @@ ChimericPairedEndAligner::ChimericPairedEndAligner(
         double              seedCoverage,
 		unsigned            minWeightToCheck,
         bool                forceSpacing_,
+        unsigned            minSpacing_,
+        unsigned            maxSpacing_,
         unsigned            extraSearchDepth,
         bool                noUkkonen,
         bool                noOrderedEvaluation,
@@ -55,7 +58,8 @@ ChimericPairedEndAligner::ChimericPairedEndAligner(
 	   unsigned				minReadLength_,
        int                  maxSecondaryAlignmentsPerContig,
         BigAllocator        *allocator)
-		: underlyingPairedEndAligner(underlyingPairedEndAligner_), forceSpacing(forceSpacing_), index(index_), minReadLength(minReadLength_)
+		: underlyingPairedEndAligner(underlyingPairedEndAligner_), forceSpacing(forceSpacing_), minSpacing(minSpacing_), maxSpacing(maxSpacing_),
+          maxK(maxK), maxDistFraction(0), index(index_), minReadLength(minReadLength_)
 {
     // Create single-end aligners.
     singleAligner = new (allocator) BaseAligner(index, maxHits, maxK, maxReadSize,
@@ -64,6 +68,15 @@ ChimericPairedEndAligner::ChimericPairedEndAligner(
     underlyingPairedEndAligner->setLandauVishkin(&lv, &reverseLV);
 
     singleSecondary[0] = singleSecondary[1] = NULL;
+
+    nSingleEndFallbacks = 0;
+    nanosInSingleEndFallbacks = 0;
+
+    splitReadAligner = NULL;
+    nReadsSplit = 0;
+
+    rcMateData = (char *)allocator->allocate(maxReadSize);
+    rcMateQuality = (char *)allocator->allocate(maxReadSize);
 }
 
     size_t 
@@ -79,7 +92,8 @@ ChimericPairedEndAligner::getBigAllocatorReservation(
         unsigned        maxCandidatePoolSize,
         int             maxSecondaryAlignmentsPerContig)
 {
-    return BaseAligner::getBigAllocatorReservation(index, false, maxHits, maxReadSize, seedLen, maxSeedsFromCommandLine, seedCoverage, maxSecondaryAlignmentsPerContig) + sizeof(ChimericPairedEndAligner)+sizeof(_uint64);
+    return BaseAligner::getBigAllocatorReservation(index, false, maxHits, maxReadSize, seedLen, maxSeedsFromCommandLine, seedCoverage, maxSecondaryAlignmentsPerContig) + sizeof(ChimericPairedEndAligner)+sizeof(_uint64) +
+        2 * (maxReadSize + sizeof(_uint64));   // rcMateData and rcMateQuality, with room for the allocator's alignment
 }
 
 
@@ -109,6 +123,7 @@ void ChimericPairedEndAligner::align(
         )
 {
 	result->status[0] = result->status[1] = NotFound;
+    details = PairedAlignmentDetails();
     *nSecondaryResults = 0;
     *nSingleEndSecondaryResultsForFirstRead = 0;
     *nSingleEndSecondaryResultsForSecondRead = 0;
@@ -123,13 +138,11 @@ void ChimericPairedEndAligner::align(
 		}
 		result->alignedAsPair = false;
 		result->fromAlignTogether = false;
-		result->nanosInAlignTogether = 0;
-		result->nLVCalls = 0;
-		result->nSmallHits = 0;
 		return;
     }
 
     _int64 start = timeInNanos();
+    bool underlyingAlignerRan = false;
 	if (read0->getDataLength() >= minReadLength && read1->getDataLength() >= minReadLength) {
 		//
 		// Let the LVs use the cache that we built up.
@@ -137,10 +150,11 @@ void ChimericPairedEndAligner::align(
 		underlyingPairedEndAligner->align(read0, read1, result, maxEditDistanceForSecondaryResults, secondaryResultBufferSize, nSecondaryResults, secondaryResults,
             singleSecondaryBufferSize, maxSecondaryAlignmentsToReturn, nSingleEndSecondaryResultsForFirstRead, nSingleEndSecondaryResultsForSecondRead, 
             singleEndSecondaryResults);
+        underlyingAlignerRan = true;
 
 		_int64 end = timeInNanos();
 
-		result->nanosInAlignTogether = end - start;
+		details.nanosInAlignTogether = end - start;
 		result->fromAlignTogether = true;
 		result->alignedAsPair = true;
 
@@ -165,9 +179,16 @@ void ChimericPairedEndAligner::align(
     //
     // If the intersecting aligner didn't find an alignment for these reads, then they may be
     // chimeric and so we should just align them with the single end aligner and apply a MAPQ penalty.
+    // Or it may have been unable to pair them because one end had too many hits or no usable seeds,
+    // in which case looking for that end next to the other one will find the pair.
     //
+    _int64 fallbackStart = timeInNanos();
+    nSingleEndFallbacks++;
+
     Read *read[NUM_READS_PER_PAIR] = {read0, read1};
     int *resultCount[2] = {nSingleEndSecondaryResultsForFirstRead, nSingleEndSecondaryResultsForSecondRead};
+    int singleMapq[NUM_READS_PER_PAIR] = {0, 0};
+    bool rescued = false;
 
     for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
         SingleAlignmentResult singleResult;
@@ -179,11 +200,15 @@ void ChimericPairedEndAligner::align(
 			result->direction[r] = FORWARD;
 			result->location[r] = 0;
 			result->score[r] = 0;
+			singleMapq[r] = 0;
 		} else {
 			// We're using *nSingleEndSecondaryResultsForFirstRead because it's either 0 or what all we've seen (i.e., we know NUM_READS_PER_PAIR is 2)
+            singleAligner->setMaxK(MateMaxK(maxK, maxDistFraction, read[r]->getDataLength()));
 			singleAligner->AlignRead(read[r], &singleResult, maxEditDistanceForSecondaryResults,
 				singleSecondaryBufferSize - *nSingleEndSecondaryResultsForFirstRead, &singleEndSecondaryResultsThisTime,
-                maxSecondaryAlignmentsToReturn, singleEndSecondaryResults + *nSingleEndSecondaryResultsForFirstRead);
+                maxSecondaryAlignmentsToReturn, singleEndSecondaryResults + *nSingleEndSecondaryResultsForFirstRead,
+                underlyingAlignerRan ? underlyingPairedEndAligner->getSeedLookups(r) : NULL);
+            singleAligner->setMaxK(maxK);
 
 			*(resultCount[r]) = singleEndSecondaryResultsThisTime;
 
@@ -192,11 +217,71 @@ void ChimericPairedEndAligner::align(
 			result->direction[r] = singleResult.direction;
 			result->location[r] = singleResult.location;
 			result->score[r] = singleResult.score;
+			singleMapq[r] = singleResult.mapq;
 		}
+
+        //
+        // Once an end has aligned confidently, look for its mate near it.  For the first end that saves aligning the
+        // second one on its own; for the second, it only replaces an alignment of the first that wasn't confident, and
+        // then only with one that's at least as good.
+        //
+        int mate = 1 - r;
+        if (isOneLocation(result->status[r]) && singleMapq[r] >= MinMapqToRescueFrom && read[mate]->getDataLength() >= minReadLength &&
+            (0 == r || singleMapq[mate] < MinMapqToRescueFrom)) {
+
+            int mateMaxK = (int)MateMaxK(maxK, maxDistFraction, read[mate]->getDataLength());
+            int scoreLimit = NotFound == result->status[mate] ? mateMaxK : __min(mateMaxK, result->score[mate]);
+            GenomeLocation mateLocation;
+            Direction mateDirection;
+            int mateScore, mateMapq;
+
+            if (rescueMate(read[mate], result->location[r], result->direction[r], singleMapq[r], scoreLimit,
+                    &mateLocation, &mateDirection, &mateScore, &mateMapq)) {
+                if (1 == r) {
+                    //
+                    // The first end's secondary results went with the alignment that's being replaced.
+                    //
+                    memmove(singleEndSecondaryResults, singleEndSecondaryResults + *nSingleEndSecondaryResultsForFirstRead,
+                        *nSingleEndSecondaryResultsForSecondRead * sizeof(*singleEndSecondaryResults));
+                    *nSingleEndSecondaryResultsForFirstRead = 0;
+                }
+
+                result->status[mate] = SingleHit;
+                result->mapq[mate] = mateMapq;
+                result->direction[mate] = mateDirection;
+                result->location[mate] = mateLocation;
+                result->score[mate] = mateScore;
+                result->mapq[r] = singleMapq[r];    // It's not chimeric after all
+                rescued = true;
+
+                TRACE("Rescued read %d at %lld from its mate\n", mate, GenomeLocationAsInt64(mateLocation));
+                break;
+            }
+        }
+    }
+
+    //
+    // -splitReads: an end that still didn't align may align in pieces.
+    //
+    for (int r = 0; NULL != splitReadAligner && r < NUM_READS_PER_PAIR; r++) {
+        if (NotFound == result->status[r] && read[r]->getDataLength() >= minReadLength &&
+            splitReadAligner->align(read[r], underlyingAlignerRan ? underlyingPairedEndAligner->getSeedLookups(r) : NULL, &splits[r])) {
+
+            const SplitSegment *primary = &splits[r].segments[0];
+            result->status[r] = SingleHit;
+            result->location[r] = primary->location;
+            result->direction[r] = primary->direction;
+            result->score[r] = primary->score;
+            result->mapq[r] = primary->mapq;
+            read[r]->setSplitAlignment(&splits[r]);
+            nReadsSplit++;
+        }
     }
 
     result->fromAlignTogether = false;
-    result->alignedAsPair = false;
+    result->alignedAsPair = rescued;
+
+    nanosInSingleEndFallbacks += timeInNanos() - fallbackStart;
 
 #ifdef _DEBUG
     if (_DumpAlignments) {
@@ -205,4 +290,153 @@ void ChimericPairedEndAligner::align(
     }
 #endif // _DEBUG
                     
+}
+
+    bool
+ChimericPairedEndAligner::rescueMate(
+    Read            *mate,
+    GenomeLocation   anchorLocation,
+    Direction        anchorDirection,
+    int              anchorMapq,
+    int              scoreLimit,
+    GenomeLocation  *o_location,
+    Direction       *o_direction,
+    int             *o_score,
+    int             *o_mapq)
+/*++
+
+Routine Description:
+
+    Search the reference from maxSpacing before the anchor to maxSpacing after it (staying in its contig) for the
+    mate with the bit-vector edit distance, which does the whole window at once rather than a location at a time,
+    and then find where the best match starts with LV.  The best match elsewhere in the window, if there is one,
+    counts against the MAPQ the way other candidates do in the aligners.
+
+Arguments:
+
+    mate            - the end to look for
+    anchorLocation  - where the other end aligned
+    anchorDirection - and in which direction
+    anchorMapq      - with what MAPQ
+    scoreLimit      - the most edits to allow
+    o_location      - where the mate is
+    o_direction     - its direction, which is opposite the anchor's
+    o_score         - its edit distance
+    o_mapq          - its MAPQ
+
+Return Value:
+
+    true if the mate was found.
+
+--*/
+{
+    const Genome *genome = index->getGenome();
+    const Genome::Contig *contig = genome->getContigAtLocation(anchorLocation);
+    if (NULL == contig || scoreLimit < 0) {
+        return false;
+    }
+
+    Direction mateDirection = OppositeDirection(anchorDirection);
+    int mateLen = mate->getDataLength();
+    const char *mateData;
+    const char *mateQuality;
+    if (FORWARD == mateDirection) {
+        mateData = mate->getData();
+        mateQuality = mate->getQuality();
+    } else {
+        mate->computeReverseCompliment(rcMateData);
+        for (int i = 0; i < mateLen; i++) {
+            rcMateQuality[i] = mate->getQuality()[mateLen - i - 1];
+        }
+        mateData = rcMateData;
+        mateQuality = rcMateQuality;
+    }
+
+    _int64 anchor = GenomeLocationAsInt64(anchorLocation);
+    _int64 contigStart = GenomeLocationAsInt64(contig->beginningLocation);
+    _int64 contigEnd = contigStart + contig->length;    // getSubstring won't return the last base of a contig
+    _int64 windowStart = __max(contigStart, anchor - (_int64)maxSpacing);
+    _int64 windowEnd = __min(contigEnd - 1, anchor + (_int64)maxSpacing + mateLen + scoreLimit);
+    if (windowEnd - windowStart < mateLen) {
+        return false;
+    }
+
+    int windowLen = (int)(windowEnd - windowStart);
+    const char *window = genome->getSubstring(GenomeLocation(windowStart), windowLen);
+    if (NULL == window) {
+        return false;
+    }
+
+    int end;
+    int score = bitVectorEditDistance.findBestMatch(window, windowLen, mateData, mateLen, scoreLimit, &end);
+    int start;
+    double matchProbability;
+    if (-1 == score || !findMatchStart(window, windowLen, mateData, mateQuality, mateLen, end, score, &start, &score, &matchProbability)) {
+        return false;
+    }
+
+    _int64 location = windowStart + start;
+    _int64 spacing = location > anchor ? location - anchor : anchor - location;
+    if (spacing <= (_int64)minSpacing || spacing > (_int64)maxSpacing) {
+        return false;
+    }
+
+    //
+    // Look for a second place on each side of it, not overlapping it by more than half.
+    //
+    double probabilityOfAllMatches = matchProbability;
+    int leftLen = end - mateLen / 2 + 1;
+    int rightStart = start + mateLen / 2;
+    int otherEnd, otherStart, otherScore;
+    double otherProbability;
+    if (leftLen > 0 &&
+        -1 != (otherScore = bitVectorEditDistance.findBestMatch(window, leftLen, mateData, mateLen, scoreLimit, &otherEnd)) &&
+        findMatchStart(window, windowLen, mateData, mateQuality, mateLen, otherEnd, otherScore, &otherStart, &otherScore, &otherProbability)) {
+        probabilityOfAllMatches += otherProbability;
+    }
+    if (rightStart < windowLen &&
+        -1 != (otherScore = bitVectorEditDistance.findBestMatch(window + rightStart, windowLen - rightStart, mateData, mateLen, scoreLimit, &otherEnd)) &&
+        findMatchStart(window, windowLen, mateData, mateQuality, mateLen, rightStart + otherEnd, otherScore, &otherStart, &otherScore, &otherProbability)) {
+        probabilityOfAllMatches += otherProbability;
+    }
+
+    *o_location = GenomeLocation(location);
+    *o_direction = mateDirection;
+    *o_score = score;
+    *o_mapq = __min(anchorMapq, computeMAPQ(probabilityOfAllMatches, matchProbability, score, 0));
+
+    return true;
+}
+
+    bool
+ChimericPairedEndAligner::findMatchStart(
+    const char  *text,
+    int          textLen,
+    const char  *data,
+    const char  *quality,
+    int          dataLen,
+    int          end,
+    int          score,
+    int         *o_start,
+    int         *o_score,
+    double      *o_matchProbability)
+{
+    //
+    // A match with score edits has no more than score indels, so it starts within score of where it would without them.
+    //
+    int bestScore = -1;
+    double bestProbability = 0;
+    for (int start = __max(0, end + 1 - dataLen - score); start <= end + 1 - dataLen + score && start < textLen; start++) {
+        double matchProbability;
+        int thisScore = lv.computeEditDistance(text + start, __min(textLen - start, dataLen + score), data, quality, dataLen, score, &matchProbability);
+        if (-1 != thisScore && (-1 == bestScore || thisScore < bestScore || (thisScore == bestScore && matchProbability > bestProbability))) {
+            bestScore = thisScore;
+            bestProbability = matchProbability;
+            *o_start = start;
+        }
+    }
+
+    *o_score = bestScore;
+    *o_matchProbability = bestProbability;
+    return -1 != bestScore;
 }
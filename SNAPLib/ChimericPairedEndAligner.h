@@ -10,6 +10,11 @@ Abstract:
     it fails to find an alignment, aligns each of the reads singly.  This handles
     chimeric reads that would otherwise be unalignable.
 
+    Before giving up on the pair, it tries to rescue it: when one end aligns
+    confidently on its own, it looks for the other end in the insert window
+    around it, which finds pairs that the underlying aligner missed because one
+    end had too many hits or no usable seeds.
+
 Authors:
 
     Bill Bolosky, June, 2013
@@ -27,6 +32,7 @@ Revision History:
 #include "PairedEndAligner.h"
 #include "BaseAligner.h"
 #include "BigAlloc.h"
+#include "SplitReadAligner.h"
 
 class ChimericPairedEndAligner : public PairedEndAligner {
 public:
@@ -39,6 +45,8 @@ public:
         double              seedCoverage,
 	    unsigned            minWeightToCheck,
         bool                forceSpacing_,
+        unsigned            minSpacing_,
+        unsigned            maxSpacing_,
         unsigned            extraSearchDepth,
         bool                noUkkonen,
         bool                noOrderedEvaluation,
@@ -80,15 +88,96 @@ public:
     void *operator new(size_t size) {return BigAlloc(size);}
     void operator delete(void *ptr) {BigDealloc(ptr);}
 
+    //
+    // Use a narrower window for rescuing mates, once the insert sizes have been fitted.
+    //
+    void setSpacing(unsigned minSpacing_, unsigned maxSpacing_) {minSpacing = minSpacing_; maxSpacing = maxSpacing_;}
+
+    //
+    // -workBudget, which applies to each attempt separately: the pair, and then each read if it falls back to aligning them singly.
+    //
+    virtual void setWorkBudget(unsigned workBudget) {
+        underlyingPairedEndAligner->setWorkBudget(workBudget);
+        singleAligner->setWorkBudget(workBudget);
+    }
+
+    virtual void setMinSeedQuality(unsigned minSeedQuality) {
+        underlyingPairedEndAligner->setMinSeedQuality(minSeedQuality);
+        singleAligner->setMinSeedQuality(minSeedQuality);
+    }
+
+    virtual void setMaxDistFraction(float maxDistFraction_) {
+        maxDistFraction = maxDistFraction_;
+        underlyingPairedEndAligner->setMaxDistFraction(maxDistFraction);
+    }
+
+    virtual void setMaxSeedsWithoutHits(unsigned maxSeedsWithoutHits) {
+        underlyingPairedEndAligner->setMaxSeedsWithoutHits(maxSeedsWithoutHits);
+        singleAligner->setMaxSeedsWithoutHits(maxSeedsWithoutHits);
+    }
+
     virtual _int64 getLocationsScored() const {
         return underlyingPairedEndAligner->getLocationsScored() + singleAligner->getLocationsScored();
     }
 
+    virtual void getWorkCounters(AlignerWorkCounters *counters) const {
+        AlignerWorkCounters single;
+        underlyingPairedEndAligner->getWorkCounters(counters);
+        singleAligner->getWorkCounters(&single);
+        counters->add(single);
+    }
+
+    //
+    // How many pairs the underlying aligner didn't pair, so that we went on to rescue or align them singly, the time
+    // that took, and how many of the single-end aligner's seed lookups came from the underlying aligner's.
+    //
+    _int64 getNSingleEndFallbacks() const {return nSingleEndFallbacks;}
+    _int64 getNanosInSingleEndFallbacks() const {return nanosInSingleEndFallbacks;}
+    _int64 getNSeedLookupsReused() const {return singleAligner->getNSeedLookupsReused();}
+    _int64 getNLowQualitySeedsSkipped() const {return singleAligner->getNLowQualitySeedsSkipped();}   // Just the single-end fallback's
+    _int64 getNReadsGivenUp() const {return singleAligner->getNReadsGivenUp();}
+
+    virtual const PairedAlignmentDetails *getAlignmentDetails() const {return &details;}
+
+    BaseAligner *getSingleAligner() {return singleAligner;}   // For aligning merged mates (-mergeMates)
+
+    //
+    // -splitReads: reads that don't align whole, even singly, are looked for in pieces with splitReadAligner, and
+    // attached to the Read for the writer if found.  The SplitAlignment stays good until the next align().
+    //
+    void setSplitReadAligner(SplitReadAligner *splitReadAligner_) {splitReadAligner = splitReadAligner_;}
+    _int64 getNReadsSplit() const {return nReadsSplit;}
+
 private:
-   
+
+    //
+    // The MAPQ that a single-end alignment needs for its mate to be looked for near it.
+    //
+    static const int MinMapqToRescueFrom = 30;
+
+    //
+    // Look for mate in the opposite direction within maxSpacing of the anchor's location (and further than minSpacing
+    // from it), the way the underlying aligner pairs ends, with no more than scoreLimit edits.  Returns false if it
+    // isn't there.  The MAPQ is no more than the anchor's, and lower if the window has a second place for the mate.
+    //
+    bool rescueMate(Read *mate, GenomeLocation anchorLocation, Direction anchorDirection, int anchorMapq, int scoreLimit,
+                    GenomeLocation *o_location, Direction *o_direction, int *o_score, int *o_mapq);
+
+    //
+    // Given where in text a match of data with score edits ends, find where it starts: the start with the best LV
+    // score and then the highest probability.  Returns false if LV doesn't find it within score.
+    //
+    bool findMatchStart(const char *text, int textLen, const char *data, const char *quality, int dataLen, int end,
+                        int score, int *o_start, int *o_score, double *o_matchProbability);
+
     bool        forceSpacing;
+    unsigned    minSpacing;
+    unsigned    maxSpacing;
+    unsigned    maxK;
+    float       maxDistFraction;    // -dp, 0 for off
     BaseAligner *singleAligner;
     PairedEndAligner *underlyingPairedEndAligner;
+    PairedAlignmentDetails details;
 
     // avoid allocation in aligner calls
     IdPairVector* singleSecondary[2];
@@ -96,6 +185,17 @@ private:
     LandauVishkin<1> lv;
     LandauVishkin<-1> reverseLV;
 
+    BitVectorEditDistance   bitVectorEditDistance;  // For finding the mate in its window
+    char                    *rcMateData;
+    char                    *rcMateQuality;
+
 	GenomeIndex *index;
 	unsigned	minReadLength;
+
+    _int64      nSingleEndFallbacks;
+    _int64      nanosInSingleEndFallbacks;
+
+    SplitReadAligner   *splitReadAligner;   // -splitReads, or NULL
+    SplitAlignment      splits[NUM_READS_PER_PAIR];
+    _int64              nReadsSplit;
 };
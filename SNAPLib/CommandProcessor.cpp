@@ -34,6 +34,12 @@ Pulled from the main program and expanded to handle daemon mode
 #include "CommandProcessor.h"
 #include "Error.h"
 #include "Compat.h"
+#include "AlignerContext.h"
+#include "Util.h"
+#include "DistributedAligner.h"
+#include "IOBench.h"
+#include "ReadPack.h"
+#include <vector>
 
 const char *SNAP_VERSION = "1.0beta.23";
 
@@ -46,6 +52,11 @@ static void usage()
 		"   single   align single-end reads\n"
 		"   paired   align paired-end reads\n"
 		"   daemon   run in daemon mode--accept commands remotely\n"
+		"   batch    run the single and paired commands in a manifest, sharing loaded indices\n"
+		"   distribute  split an alignment over daemons on other machines\n"
+		"   merge    merge sorted BAM files\n"
+		"   iobench  time reading the input, aligning or writing the output by itself\n"
+		"   pack     copy reads into a SNAP read pack file, which alignments read without parsing\n"
 		"Type a command without arguments to see its help.\n");
 }
 
@@ -76,6 +87,12 @@ void ProcessNonDaemonCommands(int argc, const char **argv) {
 			_ASSERT(nArgsConsumed > 0);
 			i += nArgsConsumed;
 		}
+	} else if (strcmp(argv[1], "merge") == 0) {
+		RunMerge(argc, argv);
+	} else if (strcmp(argv[1], "iobench") == 0) {
+		RunIOBench(argc - 2, argv + 2);
+	} else if (strcmp(argv[1], "pack") == 0) {
+		RunPack(argc - 2, argv + 2);
 	} else {
 		WriteErrorMessage("Invalid command: %s\n\n", argv[1]);
 		usage();
@@ -84,19 +101,226 @@ void ProcessNonDaemonCommands(int argc, const char **argv) {
 
 static void daemonUsage()
 {
-	fprintf(stderr, "Usage: snap-aligner daemon [Named pipe name]\n");
+	fprintf(stderr,
+		"Usage: snap-aligner daemon [Named pipe name] [-indexes N] [-indexMemory GB] [-preload configFile]\n"
+		"       snap-aligner daemon -s socket [-allowRemote] [-j N] [-indexes N] [-indexMemory GB] [-preload configFile]\n"
+		"  -s        Take commands on a socket instead of a named pipe, from any number of clients at once.  The socket\n"
+		"            is [host:]port for TCP (just a port listens only on localhost) or the path of a Unix domain socket\n"
+		"            (which replaces a leftover socket there, but not any other kind of file).\n"
+		"  -allowRemote  Let -s listen on a TCP host that isn't a loopback address.  WARNING: there's no authentication,\n"
+		"            and commands read and write any file the daemon can (-o, the inputs, -preload), so anyone who can\n"
+		"            reach the port can do the same.  Only use it on a network you trust, or behind a firewall.\n"
+		"  -j        With -s, run up to this many commands at once (default 1).  Their threads share one pool, and\n"
+		"            aren't bound to processors when there's more than one.  Commands beyond this wait their turn.\n"
+		"  -indexes  Keep up to this many loaded indices for later commands to use (default %d, or no limit with\n"
+		"            -indexMemory).\n"
+		"  -indexMemory  Keep the loaded indices under this many gigabytes of memory, dropping the least recently used\n"
+		"            ones that no command is using to make room.  Mapped (-map or -shm) indices count at their mapped size.\n"
+		"  -preload  Load the indices listed in this file before taking commands.  Each line is an index directory and\n"
+		"            any of -map, -pre, -numa, -numaReplicate, -shm, -packGenome and -contigs to load it with; # starts\n"
+		"            a comment.\n",
+		IndexCacheSize);
 	soft_exit_no_print(1);    // Don't use soft_exit, it's confusing people to get an "error" message after the usage
 }
 
+//
+// Read a command from a daemon client.  The format is argc (in ascii) followed by argc arguments, each in its own
+// message.  Returns false if the connection went away, setting *o_partial if it was in the middle of a command.  A
+// malformed command comes back with *o_argc == 0.
+//
+static bool ReadDaemonCommand(NamedPipe *pipe, char *commandBuffer, size_t commandBufferSize, int *o_argc, char ***o_argv, bool *o_partial)
+{
+	*o_argc = 0;
+	*o_argv = NULL;
+	*o_partial = false;
+
+	if (!ReadFromNamedPipe(pipe, commandBuffer, commandBufferSize)) {
+		return false;
+	}
+
+	int argc = atoi(commandBuffer);
+	if (argc <= 0) {
+		WriteErrorMessage("Expected argument count on named pipe, got '%s'; ignoring.\n", commandBuffer);
+		return true;
+	}
+
+	char **argv = new char*[argc];
+	for (int i = 0; i < argc; i++) {
+		argv[i] = new char[commandBufferSize];
+		if (!ReadFromNamedPipe(pipe, argv[i], commandBufferSize)) {
+			fprintf(stderr, "Error reading argument #%d from named pipe.\n", i);	// Not WriteErrorMessage, the pipe is gone
+			for (int j = 0; j <= i; j++) {
+				delete[] argv[j];
+			}
+			delete[] argv;
+			*o_partial = true;
+			return false;
+		}
+	} // for each arg
+
+	*o_argc = argc;
+	*o_argv = argv;
+	return true;
+}
+
+static void FreeDaemonCommand(int argc, char **argv)
+{
+	for (int i = 0; i < argc; i++) {
+		delete[] argv[i];
+		argv[i] = NULL;
+	}
+	delete[] argv;
+}
+
+//
+// Run a command from a daemon client, whose pipe is CommandPipe.  "exit" stops the whole daemon.
+//
+static void RunDaemonCommand(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "exit") == 0) {
+		WriteStatusMessage("SNAP server exiting by request\n");
+		WriteToNamedPipe(CommandPipe, CommandExecutedString);
+		soft_exit_no_print(1);
+	}
+
+	printf("Executing command: ");
+	for (int i = 1; i < argc; i++) {
+		printf("%s ", argv[i]);
+	}
+	printf("\n");
+
+	ProcessNonDaemonCommands(argc, (const char **) argv);
+
+	printf("\n");
+}
+
+//
+// With -s, each client gets a thread of its own, and the commands take turns for the -j slots.
+//
+static ExclusiveLock DaemonJobLock;
+static EventObject DaemonJobSlotFree;
+static int DaemonRunningJobs = 0;
+static int DaemonMaxJobs = 1;
+
+static void DaemonConnectionThread(void *param)
+{
+	NamedPipe *connection = (NamedPipe *)param;
+	CommandPipe = connection;	// So that this client, rather than some other, gets our messages
+
+	const size_t commandBufferSize = 10000;
+	char *commandBuffer = new char[commandBufferSize];
+	int argc;
+	char **argv;
+	bool partial;
+	while (ReadDaemonCommand(connection, commandBuffer, commandBufferSize, &argc, &argv, &partial)) {
+		if (argc > 0) {
+			AcquireExclusiveLock(&DaemonJobLock);
+			while (DaemonRunningJobs >= DaemonMaxJobs) {
+				PreventEventWaitersFromProceeding(&DaemonJobSlotFree);
+				ReleaseExclusiveLock(&DaemonJobLock);
+				WaitForEvent(&DaemonJobSlotFree);
+				AcquireExclusiveLock(&DaemonJobLock);
+			}
+			DaemonRunningJobs++;
+			ReleaseExclusiveLock(&DaemonJobLock);
+
+			RunDaemonCommand(argc, argv);
+			FreeDaemonCommand(argc, argv);
+
+			AcquireExclusiveLock(&DaemonJobLock);
+			DaemonRunningJobs--;
+			AllowEventWaitersToProceed(&DaemonJobSlotFree);
+			ReleaseExclusiveLock(&DaemonJobLock);
+		}
+		WriteToNamedPipe(connection, CommandExecutedString);
+	}
+
+	CommandPipe = NULL;
+	CloseNamedPipe(connection);
+	delete[] commandBuffer;
+}
+
+static void RunSocketDaemon(const char *address, bool allowRemote)
+{
+	CommandSocket *commandSocket = OpenCommandSocket(address, allowRemote);
+	if (NULL == commandSocket) {
+		WriteErrorMessage("Unable to open socket '%s' for commands.\n", address);
+		soft_exit(1);
+	}
+
+	InitializeExclusiveLock(&DaemonJobLock);
+	SetExclusiveLockWholeProgramScope(&DaemonJobLock);
+	CreateEventObject(&DaemonJobSlotFree);
+
+	printf("SNAP in daemon mode, waiting for commands on '%s' (running up to %d at once)\n", address, DaemonMaxJobs);
+
+	for (;;) {
+		NamedPipe *connection = AcceptCommandConnection(commandSocket);
+		if (NULL == connection) {
+			CloseCommandSocket(commandSocket);
+			WriteErrorMessage("Unable to accept connections on socket '%s'.  Exiting\n", address);
+			soft_exit(1);
+		}
+
+		if (!StartNewThread(DaemonConnectionThread, connection)) {
+			WriteErrorMessage("Unable to start a thread for a new connection; dropping it.\n");
+			CloseNamedPipe(connection);
+		}
+	}
+}
+
 void RunDaemonMode(int argc, const char **argv)
 {
-	if (argc < 2 || argc > 3) {
-		daemonUsage();
+	const char *pipeName = DEFAULT_NAMED_PIPE_NAME;
+	const char *socketAddress = NULL;
+	const char *preloadFileName = NULL;
+	bool sawPipeName = false;
+	bool sawIndexes = false;
+	bool allowRemote = false;
+
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			socketAddress = argv[++i];
+		} else if (strcmp(argv[i], "-allowRemote") == 0) {
+			allowRemote = true;
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			DaemonMaxJobs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-indexes") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			IndexCacheSize = atoi(argv[++i]);
+			sawIndexes = true;
+		} else if (strcmp(argv[i], "-indexMemory") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+			IndexCacheMemoryBudget = (_int64)(atof(argv[++i]) * 1024 * 1024 * 1024);
+		} else if (strcmp(argv[i], "-preload") == 0 && i + 1 < argc) {
+			preloadFileName = argv[++i];
+		} else if ('-' != argv[i][0] && !sawPipeName) {
+			pipeName = argv[i];
+			sawPipeName = true;
+		} else {
+			daemonUsage();
+		}
+	}
+
+	if (NULL != socketAddress ? sawPipeName : (DaemonMaxJobs != 1 || allowRemote)) {
+		daemonUsage();	// Not both a socket and a pipe, and a named pipe has only one client at a time
+	}
+
+	if (0 != IndexCacheMemoryBudget && !sawIndexes) {
+		IndexCacheSize = 0xffffffff;	// The memory budget is the limit
+	}
+
+	if (NULL != preloadFileName && !PreloadIndices(preloadFileName)) {
+		WriteErrorMessage("Unable to preload the indices in '%s'.  Exiting\n", preloadFileName);
+		soft_exit(1);
+	}
+
+	if (NULL != socketAddress) {
+		AlignerContextsRunConcurrently = DaemonMaxJobs > 1;
+		RunSocketDaemon(socketAddress, allowRemote);
+		return;
 	}
 
 	printf("SNAP in daemon mode, waiting for commands to execute\n");
 
-	const char *pipeName = argc == 3 ? argv[2] : DEFAULT_NAMED_PIPE_NAME;
 	CommandPipe = OpenNamedPipe(pipeName, true);
 
 	if (NULL == CommandPipe) {
@@ -107,57 +331,182 @@ void RunDaemonMode(int argc, const char **argv)
 	const size_t commandBufferSize = 10000;	// Yes, this is fixed size, no it's not a buffer overflow.  The named pipe reader just quits if it's too long.
 	char commandBuffer[commandBufferSize];
 
-	//
-	// Format of commands is argc (in ascii) followed by argc arguments, each in one line.
-	//
 	for (;;) {
-		if (!ReadFromNamedPipe(CommandPipe, commandBuffer, commandBufferSize)) {
+		int commandArgc;
+		char **commandArgv;
+		bool partial;
+		if (!ReadDaemonCommand(CommandPipe, commandBuffer, commandBufferSize, &commandArgc, &commandArgv, &partial)) {
 			CloseNamedPipe(CommandPipe);
 			CommandPipe = NULL;
+			if (partial) {
+				soft_exit(1);
+			}
 			WriteStatusMessage("Named pipe closed.  Exiting\n");
 			soft_exit_no_print(0);
 		}
 
-		int argc = atoi(commandBuffer);
-		if (0 == argc) {
-			WriteErrorMessage("Expected argument count on named pipe, got '%s'; ignoring.\n", commandBuffer);
+		if (commandArgc > 0) {
+			RunDaemonCommand(commandArgc, commandArgv);
+			FreeDaemonCommand(commandArgc, commandArgv);
+		}
+		WriteToNamedPipe(CommandPipe, CommandExecutedString);
+	}
+}
+
+static void batchUsage()
+{
+	fprintf(stderr,
+		"Usage: snap-aligner batch manifestFile [-j N] [-indexes N] [-indexMemory GB]\n"
+		"  Runs each line of manifestFile as a single or paired command (such as 'paired index s1_1.fq s1_2.fq -o s1.bam'),\n"
+		"  one per sample, each with its own output and stats.  Blank lines and anything after a # are ignored.  They\n"
+		"  share the loaded indices, so each index is loaded once for the whole batch.\n"
+		"  -j        Run up to this many commands at once (default 2), so that each one's start overlaps the tail of the\n"
+		"            one before (its last reads, closing and sorting its output), when its threads would otherwise be idle.\n"
+		"            Their threads aren't bound to processors when there's more than one.\n"
+		"  -indexes  Keep up to this many loaded indices (default %d, or no limit with -indexMemory).\n"
+		"  -indexMemory  Keep the loaded indices under this many gigabytes of memory, dropping the least recently used\n"
+		"            ones that no command is using to make room.\n",
+		IndexCacheSize);
+	soft_exit_no_print(1);
+}
+
+struct BatchCommand {
+	int			argc;
+	char	  **argv;
+	int			lineNumber;
+};
+
+static std::vector<BatchCommand> BatchCommands;
+static volatile _int64 BatchNextCommand = 0;
+static volatile int BatchRunningWorkers;
+static SingleWaiterObject BatchDone;
+
+//
+// Parse the manifest into BatchCommands, with the program name in front of each so that they look like a command line.
+//
+static bool ReadBatchManifest(const char *manifestFileName)
+{
+	FILE *manifest = fopen(manifestFileName, "r");
+	if (NULL == manifest) {
+		WriteErrorMessage("Unable to open batch manifest '%s'\n", manifestFileName);
+		return false;
+	}
+
+	char *lineBuffer = NULL;
+	int lineBufferSize = 0;
+	int lineNumber = 0;
+	bool worked = true;
+	while (worked && NULL != reallocatingFgets(&lineBuffer, &lineBufferSize, manifest)) {
+		lineNumber++;
+		char *comment = strchr(lineBuffer, '#');
+		if (NULL != comment) {
+			*comment = '\0';
+		}
+
+		std::vector<char *> words;
+		words.push_back(const_cast<char *>("snap-aligner"));
+		for (char *word = strtok(lineBuffer, " \t\r\n"); NULL != word; word = strtok(NULL, " \t\r\n")) {
+			char *copy = new char[strlen(word) + 1];
+			strcpy(copy, word);
+			words.push_back(copy);
+		}
+
+		if (1 == words.size()) {
+			continue;
+		}
+
+		if (strcmp(words[1], "single") != 0 && strcmp(words[1], "paired") != 0) {
+			WriteErrorMessage("Line %d of batch manifest '%s' is '%s', not a single or paired command\n", lineNumber, manifestFileName, words[1]);
+			worked = false;
+		}
+
+		BatchCommand command;
+		command.argc = (int)words.size();
+		command.argv = new char *[words.size()];
+		std::copy(words.begin(), words.end(), command.argv);
+		command.lineNumber = lineNumber;
+		BatchCommands.push_back(command);
+	}
+
+	delete[] lineBuffer;
+	fclose(manifest);
+	return worked;
+}
+
+static void BatchWorkerThread(void *param)
+{
+	for (;;) {
+		_int64 whichCommand = InterlockedAdd64AndReturnNewValue(&BatchNextCommand, 1) - 1;
+		if (whichCommand >= (_int64)BatchCommands.size()) {
+			break;
+		}
+
+		const BatchCommand &command = BatchCommands[whichCommand];
+		WriteStatusMessage("Starting batch command %lld of %lld (manifest line %d)\n", whichCommand + 1, (_int64)BatchCommands.size(), command.lineNumber);
+		ProcessNonDaemonCommands(command.argc, (const char **)command.argv);
+		WriteStatusMessage("Finished batch command %lld of %lld (manifest line %d)\n", whichCommand + 1, (_int64)BatchCommands.size(), command.lineNumber);
+	}
+
+	if (0 == InterlockedDecrementAndReturnNewValue(&BatchRunningWorkers)) {
+		SignalSingleWaiterObject(&BatchDone);
+	}
+}
+
+static void RunBatchMode(int argc, const char **argv)
+{
+	const char *manifestFileName = NULL;
+	int maxJobs = 2;
+	bool sawIndexes = false;
+
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			maxJobs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-indexes") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			IndexCacheSize = atoi(argv[++i]);
+			sawIndexes = true;
+		} else if (strcmp(argv[i], "-indexMemory") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+			IndexCacheMemoryBudget = (_int64)(atof(argv[++i]) * 1024 * 1024 * 1024);
+		} else if ('-' != argv[i][0] && NULL == manifestFileName) {
+			manifestFileName = argv[i];
 		} else {
-			char **argv = new char*[argc];
-			for (int i = 0; i < argc; i++) {
-				argv[i] = new char[commandBufferSize];
-				if (!ReadFromNamedPipe(CommandPipe, argv[i], commandBufferSize)) {
-					CloseNamedPipe(CommandPipe);
-					CommandPipe = NULL;
-					WriteStatusMessage("Error reading argument #%d from named pipe.\n", i);
-					soft_exit(1);
-				}
-			} // for each arg
-
-			if (argc > 1 && strcmp(argv[1], "exit") == 0) {
-				WriteStatusMessage("SNAP server exiting by request\n");
-				WriteToNamedPipe(CommandPipe, CommandExecutedString);
-				soft_exit_no_print(1);
-			}
+			batchUsage();
+		}
+	}
 
-			printf("Executing command: ");
-			for (int i = 1; i < argc; i++) {
-				printf("%s ", argv[i]);
-			}
-			printf("\n");
+	if (NULL == manifestFileName) {
+		batchUsage();
+	}
+
+	if (0 != IndexCacheMemoryBudget && !sawIndexes) {
+		IndexCacheSize = 0xffffffff;	// The memory budget is the limit
+	}
+
+	if (!ReadBatchManifest(manifestFileName)) {
+		soft_exit(1);
+	}
 
-			ProcessNonDaemonCommands(argc, (const char **) argv);
+	if (0 == BatchCommands.size()) {
+		WriteErrorMessage("Batch manifest '%s' has no commands\n", manifestFileName);
+		soft_exit(1);
+	}
 
-			printf("\n");
+	int nWorkers = (int)__min((size_t)maxJobs, BatchCommands.size());
+	AlignerContextsRunConcurrently = nWorkers > 1;
+	BatchRunningWorkers = nWorkers;
+	CreateSingleWaiterObject(&BatchDone);
 
-			for (int i = 0; i < argc; i++) {
-				delete[] argv[i];
-				argv[i] = NULL;
-			}
-			delete[] argv;
-			argv = NULL;
+	_int64 startTime = timeInMillis();
+	for (int i = 0; i < nWorkers; i++) {
+		if (!StartNewThread(BatchWorkerThread, NULL)) {
+			WriteErrorMessage("Unable to start a thread for batch commands\n");
+			soft_exit(1);
 		}
-		WriteToNamedPipe(CommandPipe, CommandExecutedString);
 	}
+
+	WaitForSingleWaiterObject(&BatchDone);
+	DestroySingleWaiterObject(&BatchDone);
+
+	WriteStatusMessage("Ran %lld batch commands in %llds\n", (_int64)BatchCommands.size(), (timeInMillis() + 500 - startTime) / 1000);
 }
 
 void ProcessTopLevelCommands(int argc, const char **argv)
@@ -173,10 +522,57 @@ void ProcessTopLevelCommands(int argc, const char **argv)
 
 	if (strcmp(argv[1], "daemon") == 0) {
 		RunDaemonMode(argc, argv);
+	} else if (strcmp(argv[1], "batch") == 0) {
+		RunBatchMode(argc, argv);
+	} else if (strcmp(argv[1], "distribute") == 0) {
+		RunDistributedAlignment(argc, argv);
 	} else {
 		ProcessNonDaemonCommands(argc, argv);
 	}
 }
 
-NamedPipe *CommandPipe = NULL;
+thread_local NamedPipe *CommandPipe = NULL;
 const char *CommandExecutedString = "***SNAP Command completed execution***";
+
+    bool
+ReadInputFromDaemonClient(NamedPipe *pipe, char *buffer, size_t bytesWanted, size_t *o_bytesRead)
+{
+	char request[DaemonStreamTagSize + 20];
+	request[0] = '\0';
+	request[1] = 'R';
+	size_t requested = __min(bytesWanted, DaemonStreamChunkSize);
+	int requestLength = sprintf(request + DaemonStreamTagSize, "%lld", (_int64)requested);
+	if (!WriteBytesToNamedPipe(pipe, request, DaemonStreamTagSize + requestLength)) {
+		return false;
+	}
+
+	//
+	// The data comes with its tag on the front, so it can't go straight into the caller's buffer.
+	//
+	char *reply = new char[DaemonStreamTagSize + requested];
+	size_t replyLength;
+	bool worked = ReadBytesFromNamedPipe(pipe, reply, DaemonStreamTagSize + requested, &replyLength) &&
+		replyLength >= DaemonStreamTagSize && '\0' == reply[0] && 'D' == reply[1];
+	if (worked) {
+		*o_bytesRead = replyLength - DaemonStreamTagSize;
+		memcpy(buffer, reply + DaemonStreamTagSize, *o_bytesRead);
+	}
+	delete[] reply;
+	return worked;
+}
+
+    bool
+WriteOutputToDaemonClient(NamedPipe *pipe, const char *buffer, size_t length)
+{
+	char *message = new char[DaemonStreamTagSize + __min(length, DaemonStreamChunkSize)];
+	message[0] = '\0';
+	message[1] = 'D';
+	bool worked = true;
+	for (size_t offset = 0; offset < length && worked; offset += DaemonStreamChunkSize) {
+		size_t chunkLength = __min(length - offset, DaemonStreamChunkSize);
+		memcpy(message + DaemonStreamTagSize, buffer + offset, chunkLength);
+		worked = WriteBytesToNamedPipe(pipe, message, DaemonStreamTagSize + chunkLength);
+	}
+	delete[] message;
+	return worked;
+}
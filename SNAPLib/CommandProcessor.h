@@ -25,5 +25,21 @@ Revision History:
 
 extern void ProcessTopLevelCommands(int argc, const char **argv);
 
-extern NamedPipe *CommandPipe;
+extern thread_local NamedPipe *CommandPipe;  // The daemon client that the thread's command came from, if any; it gets the command's messages
 extern const char *CommandExecutedString;	// Sent back along the command pipe to indicate that the whole thing is done and SNAPCommand should exit
+
+//
+// A daemon command's stdin and stdout ('-' as an input or -o file) are streamed over its connection, so that a client
+// can send reads to a daemon with a loaded index and get the alignments back without any files.  Alongside the text
+// messages (which never start with a nul) go:
+//
+//     "\0R<n>"      server to client: send up to n (in ascii) more bytes of input
+//     "\0D<bytes>"  client to server, the input asked for (none at all at EOF); server to client, output
+//
+// The server only asks for input when a reader needs it, so the client can answer each message as it comes.
+//
+const size_t DaemonStreamChunkSize = 1024 * 1024;    // The most data in one message, not counting its tag
+const size_t DaemonStreamTagSize = 2;
+
+extern bool ReadInputFromDaemonClient(NamedPipe *pipe, char *buffer, size_t bytesWanted, size_t *o_bytesRead);   // 0 bytes is EOF
+extern bool WriteOutputToDaemonClient(NamedPipe *pipe, const char *buffer, size_t length);
@@ -25,12 +25,29 @@ Revision History:
 #include "stdafx.h"
 #include "Compat.h"
 #include "BigAlloc.h"
-#ifndef _MSC_VER
+#ifdef _MSC_VER
+#include <psapi.h>
+#include <intrin.h>  // For __cpuid and _xgetbv
+#else
 #include <fcntl.h>
 #include <aio.h>
 #include <err.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <netdb.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <sys/vfs.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 #endif
 #include "exit.h"
 #ifdef PROFILE_WAIT
@@ -90,7 +107,17 @@ void WaitForEventProfile(EventObject *eventObject, const char* fn, int line)
 
 #endif
 
-void PrintWaitProfile()
+#ifdef __linux__
+//
+// What the futex primitives count when they block.  They're only touched on the slow path.
+//
+static volatile _int64 blockedLockAcquisitions = 0;
+static volatile _int64 blockedLockNanos = 0;
+static volatile _int64 blockedWaits = 0;
+static volatile _int64 blockedWaitNanos = 0;
+#endif  // __linux__
+
+void PrintWaitProfile(bool printTotals)
 {
 #ifdef PROFILE_WAIT
     printf("function:line    wait_time (s)\n");
@@ -98,6 +125,12 @@ void PrintWaitProfile()
         printf("%s %.3f\n", lt->first.data(), lt->second * 0.0001);
     }
 #endif
+#ifdef __linux__
+    if (printTotals) {
+        WriteStatusMessage("Blocked %lld times acquiring locks for %.3fs in all, and %lld times waiting for events for %.3fs in all\n",
+            blockedLockAcquisitions, blockedLockNanos / 1e9, blockedWaits, blockedWaitNanos / 1e9);
+    }
+#endif  // __linux__
 }
 
 #ifdef  _MSC_VER
@@ -224,6 +257,28 @@ void BindThreadToProcessor(unsigned processorNumber) // This hard binds a thread
     }
 }
 
+void UnbindThreadFromProcessor()
+{
+    DWORD_PTR processAffinityMask, systemAffinityMask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processAffinityMask, &systemAffinityMask) ||
+        !SetThreadAffinityMask(GetCurrentThread(), processAffinityMask)) {
+        WriteErrorMessage("Unbinding thread from its processor failed, %d\n", GetLastError());
+    }
+}
+
+static void BindThreadToProcessorSet(const unsigned *processors, unsigned nProcessors)
+{
+    DWORD_PTR mask = 0;
+    for (unsigned i = 0; i < nProcessors; i++) {
+        if (processors[i] < sizeof(mask) * 8) {
+            mask |= ((DWORD_PTR)1) << processors[i];
+        }
+    }
+    if (0 != mask && !SetThreadAffinityMask(GetCurrentThread(), mask)) {
+        WriteErrorMessage("Binding thread to its processors failed, %d\n", GetLastError());
+    }
+}
+
 int InterlockedIncrementAndReturnNewValue(volatile int *valueToIncrement)
 {
     return InterlockedIncrement((volatile long *)valueToIncrement);
@@ -303,6 +358,168 @@ unsigned GetNumberOfProcessors()
     return systemInfo->dwNumberOfProcessors;
 }
 
+//
+// Checks CPUID leaf 7 for the extended feature bits, and that the OS saves the vector registers (XCR0) for the ones we need.
+//
+static bool ProcessorHasExtendedFeatures(int ebxBits, unsigned __int64 xcr0Bits)
+{
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+
+    __cpuid(info, 1);
+    if (0 == (info[2] & (1 << 27)) || (_xgetbv(0) & xcr0Bits) != xcr0Bits) { // OSXSAVE
+        return false;
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & ebxBits) == ebxBits;
+}
+
+bool ProcessorSupportsSSSE3()
+{
+    int info[4];
+    __cpuid(info, 1);
+    return 0 != (info[2] & (1 << 9));
+}
+
+bool ProcessorSupportsAVX2()
+{
+    return ProcessorHasExtendedFeatures(1 << 5, 0x6);    // AVX2; SSE and AVX state
+}
+
+bool ProcessorSupportsAVX512F()
+{
+    return ProcessorHasExtendedFeatures(1 << 16, 0xe6);    // AVX512F; SSE, AVX, opmask and ZMM state
+}
+
+unsigned GetNumberOfNumaNodes()
+{
+    ULONG highestNodeNumber;
+    if (!GetNumaHighestNodeNumber(&highestNodeNumber)) {
+        return 1;
+    }
+    return highestNodeNumber + 1;
+}
+
+unsigned GetNumaNodeOfProcessor(unsigned processorNumber)
+{
+    UCHAR node;
+    if (processorNumber > 0xff || !GetNumaProcessorNode((UCHAR)processorNumber, &node) || 0xff == node) {
+        return 0;
+    }
+    return node;
+}
+
+unsigned GetNumaNodeOfCurrentThread()
+{
+    PROCESSOR_NUMBER processorNumber;
+    GetCurrentProcessorNumberEx(&processorNumber);
+    USHORT node;
+    if (!GetNumaProcessorNodeEx(&processorNumber, &node) || 0xffff == node) {
+        return 0;
+    }
+    return node;
+}
+
+bool InterleaveMemoryAcrossNumaNodes(void *memory, size_t size)
+{
+    //
+    // Windows only lets you pick the node when you allocate, not change the policy for memory you've already got.
+    //
+    return false;
+}
+
+_int64 GetPhysicalMemorySize()
+{
+    MEMORYSTATUSEX memoryStatus;
+    memoryStatus.dwLength = sizeof(memoryStatus);
+    if (!GlobalMemoryStatusEx(&memoryStatus)) {
+        return 0;
+    }
+    return memoryStatus.ullTotalPhys;
+}
+
+unsigned GetContainerProcessorLimit()
+{
+    return 0;   // (a job object's limits aren't checked)
+}
+
+_int64 GetContainerMemoryLimit()
+{
+    return 0;
+}
+
+_int64 GetPeakMemoryUsage()
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+}
+
+_int64 GetProcessCPUTimeInMillis()
+{
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime)) {
+        return 0;
+    }
+    ULARGE_INTEGER kernel, user;
+    kernel.LowPart = kernelTime.dwLowDateTime;
+    kernel.HighPart = kernelTime.dwHighDateTime;
+    user.LowPart = userTime.dwLowDateTime;
+    user.HighPart = userTime.dwHighDateTime;
+    return (kernel.QuadPart + user.QuadPart) / 10000;  // FILETIMEs are in 100ns units
+}
+
+const char *GetSharedMemoryDirectory()
+{
+    //
+    // Windows shares memory through named section objects rather than a file system, so there's nothing to return here.
+    //
+    return NULL;
+}
+
+struct InterprocessFileLock {
+    HANDLE hFile;
+};
+
+InterprocessFileLock *AcquireInterprocessFileLock(const char *lockFileName)
+{
+    HANDLE hFile = CreateFile(lockFileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == hFile) {
+        WriteErrorMessage("Unable to open lock file '%s', %d\n", lockFileName, GetLastError());
+        return NULL;
+    }
+
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    if (!LockFileEx(hFile, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped)) {
+        WriteErrorMessage("Unable to lock '%s', %d\n", lockFileName, GetLastError());
+        CloseHandle(hFile);
+        return NULL;
+    }
+
+    InterprocessFileLock *lock = new InterprocessFileLock;
+    lock->hFile = hFile;
+    return lock;
+}
+
+void ReleaseInterprocessFileLock(InterprocessFileLock *lock)
+{
+    CloseHandle(lock->hFile);   // Which releases the lock
+    delete lock;
+}
+
+bool GetCanonicalPathName(const char *path, char *buffer, size_t bufferSize)
+{
+    return NULL != _fullpath(buffer, path, bufferSize);
+}
+
 _int64 QueryFileSize(const char *fileName) {
     HANDLE hFile = CreateFile(fileName,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
     if (INVALID_HANDLE_VALUE == hFile) {
@@ -334,6 +551,35 @@ MoveSingleFile(
     return MoveFile(oldFileName, newFileName) ? true : false;
 }
 
+    bool
+CopyFileRange(
+    const char* fromFileName,
+    const char* toFileName,
+    _int64 toOffset,
+    _int64 bytes)
+{
+    FILE* from = fopen(fromFileName, "rb");
+    FILE* to = fopen(toFileName, "r+b");
+    bool worked = NULL != from && NULL != to && 0 == _fseek64bit(to, toOffset, SEEK_SET);
+    const size_t bufferSize = 16 * 1024 * 1024;
+    char* buffer = worked ? (char*)BigAlloc(bufferSize) : NULL;
+    while (worked && bytes > 0) {
+        size_t amountRead = fread(buffer, 1, (size_t)__min((_int64)bufferSize, bytes), from);
+        worked = amountRead > 0 && fwrite(buffer, 1, amountRead, to) == amountRead;
+        bytes -= amountRead;
+    }
+    if (NULL != buffer) {
+        BigDealloc(buffer);
+    }
+    if (NULL != from) {
+        fclose(from);
+    }
+    if (NULL != to) {
+        worked = 0 == fclose(to) && worked;
+    }
+    return worked;
+}
+
 class LargeFileHandle
 {
 public:
@@ -428,8 +674,12 @@ OpenMemoryMappedFile(
     size_t length,
     void** o_contents,
     bool write,
-    bool sequential)
+    bool sequential,
+    bool largePages)
 {
+    //
+    // largePages is ignored: Windows only backs pagefile sections with large pages, not mapped files.
+    //
     MemoryMappedFile* result = new MemoryMappedFile();
     result->fileHandle = CreateFile(filename, (write ? GENERIC_WRITE : 0) | GENERIC_READ, 0, NULL, OPEN_EXISTING,
         FILE_ATTRIBUTE_NORMAL | (sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS), NULL);
@@ -476,6 +726,16 @@ void AdviseMemoryMappedFilePrefetch(const MemoryMappedFile *mappedFile)
   // No-op on WIndows.
 }
 
+bool PopulateMappedMemory(const void *address, size_t length)
+{
+    return false;
+}
+
+void StartPagingIn(const void *address, size_t length)
+{
+    // No-op on Windows.
+}
+
 
 class WindowsAsyncFile : public AsyncFile
 {
@@ -677,6 +937,11 @@ int _fseek64bit(FILE *stream, _int64 offset, int origin)
     return _fseeki64(stream,offset,origin);
 }
 
+_int64 _ftell64bit(FILE *stream)
+{
+    return _ftelli64(stream);
+}
+
 int getpagesize()
 {
     SYSTEM_INFO systemInfo;
@@ -810,6 +1075,12 @@ FileMapper::unmap(void* mappedBase)
     }
 }
 
+void
+FileMapper::dropPages(const char* address, size_t fileOffset, size_t length)
+{
+    // Windows keeps FILE_FLAG_SEQUENTIAL_SCAN files' pages at the end of the standby list anyway
+}
+
 FileMapper::~FileMapper()
 {
     _ASSERT(mapCount == 0);
@@ -993,7 +1264,49 @@ void CloseNamedPipe(NamedPipe *pipe)
 	delete pipe;
 }
 
+bool ReadBytesFromNamedPipe(NamedPipe *pipe, char *outputBuffer, size_t outputBufferSize, size_t *o_bytesRead)
+{
+	DWORD bytesRead;
+	if (!ReadFile(pipe->hPipe, outputBuffer, (DWORD)outputBufferSize, &bytesRead, NULL)) {
+		fprintf(stderr, "Read named pipe failed, %d\n", GetLastError());	// Don't use WriteErrorMessage, it will try to send on the pipe
+		return false;
+	}
+	*o_bytesRead = bytesRead;
+	return true;
+}
+
+bool WriteBytesToNamedPipe(NamedPipe *pipe, const char *bytes, size_t length)
+{
+	DWORD bytesWritten;
+	if (!WriteFile(pipe->hPipe, bytes, (DWORD)length, &bytesWritten, NULL) || bytesWritten != length) {
+		fprintf(stderr, "WriteBytesToNamedPipe: write failed, %d\n", GetLastError());
+		return false;
+	}
+	return true;
+}
+
 const char *DEFAULT_NAMED_PIPE_NAME = "SNAP";
+
+CommandSocket *OpenCommandSocket(const char *address, bool allowRemote)
+{
+	WriteErrorMessage("Daemon sockets aren't implemented on Windows; use a named pipe instead.\n");
+	return NULL;
+}
+
+NamedPipe *AcceptCommandConnection(CommandSocket *commandSocket)
+{
+	return NULL;
+}
+
+NamedPipe *ConnectToCommandSocket(const char *address)
+{
+	WriteErrorMessage("Daemon sockets aren't implemented on Windows; use a named pipe instead.\n");
+	return NULL;
+}
+
+void CloseCommandSocket(CommandSocket *commandSocket)
+{
+}
 #else   // _MSC_VER
 
 #if defined(__MACH__)
@@ -1031,6 +1344,141 @@ _int64 timeInNanos()
     return ((_int64) ts.tv_sec) * 1000000000 + (_int64) ts.tv_nsec;
 }
 
+#ifdef __linux__
+
+//
+// Locks and waiter objects are futexes on Linux: an uncontended acquire or release is one atomic instruction, and a
+// signal with nobody waiting doesn't make a system call at all.  The lock is the usual three state futex mutex
+// (0 free, 1 held, 2 held and contended), which spins for a while before it sleeps, since the locks here mostly
+// guard queues of batches that are only held for a few instructions at a time.
+//
+
+static inline long futexWait(volatile int *address, int expectedValue, const struct timespec *timeout = NULL)
+{
+    return syscall(SYS_futex, (int *)address, FUTEX_WAIT_PRIVATE, expectedValue, timeout, NULL, 0);
+}
+
+static inline long futexWake(volatile int *address, int nToWake)
+{
+    return syscall(SYS_futex, (int *)address, FUTEX_WAKE_PRIVATE, nToWake, NULL, NULL, 0);
+}
+
+const int LockSpinCount = 100;
+
+void AcquireUnderlyingExclusiveLock(UnderlyingExclusiveLock *lock)
+{
+    int state = __sync_val_compare_and_swap(&lock->state, 0, 1);
+    if (0 == state) {
+        return;
+    }
+
+    for (int i = 0; i < LockSpinCount; i++) {
+        _mm_pause();
+        if (0 == lock->state && 0 == __sync_val_compare_and_swap(&lock->state, 0, 1)) {
+            return;
+        }
+    }
+
+    _int64 start = timeInNanos();
+    if (2 != state) {
+        state = __sync_lock_test_and_set(&lock->state, 2);
+    }
+    while (0 != state) {
+        futexWait(&lock->state, 2);
+        state = __sync_lock_test_and_set(&lock->state, 2);
+    }
+    __sync_fetch_and_add(&blockedLockAcquisitions, 1);
+    __sync_fetch_and_add(&blockedLockNanos, timeInNanos() - start);
+}
+
+void ReleaseUnderlyingExclusiveLock(UnderlyingExclusiveLock *lock)
+{
+    if (1 != __sync_fetch_and_sub(&lock->state, 1)) {
+        lock->state = 0;
+        futexWake(&lock->state, 1);
+    }
+}
+
+bool InitializeUnderlyingExclusiveLock(UnderlyingExclusiveLock *lock)
+{
+    lock->state = 0;
+    return true;
+}
+
+bool DestroyUnderlyingExclusiveLock(UnderlyingExclusiveLock *lock)
+{
+    _ASSERT(0 == lock->state);
+    return true;
+}
+
+class SingleWaiterObjectImpl {
+protected:
+    volatile int set;
+    volatile int nWaiters;
+
+    void wake(int nToWake) {
+        __sync_lock_test_and_set(&set, 1);
+        __sync_synchronize();   // So a waiter either sees set or is already counted in nWaiters
+        if (0 != nWaiters) {
+            futexWake(&set, nToWake);
+        }
+    }
+
+public:
+    bool init() {
+        set = 0;
+        nWaiters = 0;
+        return true;
+    }
+
+    void signal() {
+        wake(1);
+    }
+
+    void wait() {
+        if (set) {
+            return;
+        }
+        _int64 start = timeInNanos();
+        __sync_fetch_and_add(&nWaiters, 1);
+        while (!set) {
+            futexWait(&set, 0);
+        }
+        __sync_fetch_and_sub(&nWaiters, 1);
+        __sync_fetch_and_add(&blockedWaits, 1);
+        __sync_fetch_and_add(&blockedWaitNanos, timeInNanos() - start);
+    }
+
+    bool waitWithTimeout(_int64 timeoutInMillis) {
+        if (set) {
+            return true;
+        }
+        _int64 start = timeInNanos();
+        _int64 deadline = start + timeoutInMillis * 1000000;
+        __sync_fetch_and_add(&nWaiters, 1);
+        for (;;) {
+            _int64 now = timeInNanos();
+            if (set || now >= deadline) {
+                break;
+            }
+            struct timespec timeout;
+            timeout.tv_sec = (deadline - now) / 1000000000;
+            timeout.tv_nsec = (deadline - now) % 1000000000;
+            futexWait(&set, 0, &timeout);
+        }
+        __sync_fetch_and_sub(&nWaiters, 1);
+        __sync_fetch_and_add(&blockedWaits, 1);
+        __sync_fetch_and_add(&blockedWaitNanos, timeInNanos() - start);
+        return 0 != set;
+    }
+
+    bool destroy() {
+        return true;
+    }
+};
+
+#else   // __linux__
+
 void AcquireUnderlyingExclusiveLock(UnderlyingExclusiveLock *lock)
 {
     pthread_mutex_lock(lock);
@@ -1122,6 +1570,8 @@ public:
     }
 };
 
+#endif  // __linux__
+
 bool CreateSingleWaiterObject(SingleWaiterObject *waiter)
 {
     SingleWaiterObjectImpl *obj = new SingleWaiterObjectImpl;
@@ -1161,6 +1611,16 @@ void ResetSingleWaiterObject(SingleWaiterObject *waiter)
 class EventObjectImpl : public SingleWaiterObjectImpl
 {
 public:
+#ifdef __linux__
+    void signalAll()
+    {
+        wake(INT_MAX);
+    }
+    void blockAll()
+    {
+        __sync_lock_test_and_set(&set, 0);
+    }
+#else   // __linux__
     void signalAll()
     {
         pthread_mutex_lock(&lock);
@@ -1174,6 +1634,7 @@ public:
 	    set = false;
         pthread_mutex_unlock(&lock);
     }
+#endif  // __linux__
 };
 
 void CreateEventObject(EventObject *newEvent)
@@ -1283,14 +1744,309 @@ void BindThreadToProcessor(unsigned processorNumber)
 #endif
 }
 
+void UnbindThreadFromProcessor()
+{
+#ifdef __linux__
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (unsigned i = 0; i < GetNumberOfProcessors() && i < CPU_SETSIZE; i++) {
+        CPU_SET(i, &cpuset);
+    }
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) != 0) {
+        perror("sched_setaffinity");
+    }
+#endif
+}
+
+static void BindThreadToProcessorSet(const unsigned *processors, unsigned nProcessors)
+{
+#ifdef __linux__
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (unsigned i = 0; i < nProcessors; i++) {
+        if (processors[i] < CPU_SETSIZE) {
+            CPU_SET(processors[i], &cpuset);
+        }
+    }
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) != 0) {
+        perror("sched_setaffinity");
+    }
+#endif
+}
+
 unsigned GetNumberOfProcessors()
 {
     return (unsigned) sysconf(_SC_NPROCESSORS_ONLN);
 }
 
-void SleepForMillis(unsigned millis)
+bool ProcessorSupportsSSSE3()
 {
-  usleep(millis*1000);
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("ssse3");
+#else
+    return false;
+#endif
+}
+
+bool ProcessorSupportsAVX2()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+bool ProcessorSupportsAVX512F()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx512f");
+#else
+    return false;
+#endif
+}
+
+unsigned GetNumberOfNumaNodes()
+{
+#ifdef __linux__
+    unsigned nNodes = 0;
+    char path[100];
+    for (;;) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", nNodes);
+        if (0 != access(path, F_OK)) {
+            break;
+        }
+        nNodes++;
+    }
+    return (0 == nNodes) ? 1 : nNodes;
+#else   // __linux__
+    return 1;
+#endif  // __linux__
+}
+
+unsigned GetNumaNodeOfProcessor(unsigned processorNumber)
+{
+#ifdef __linux__
+    unsigned nNodes = GetNumberOfNumaNodes();
+    char path[100];
+    for (unsigned node = 0; node < nNodes; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpu%d", node, processorNumber);
+        if (0 == access(path, F_OK)) {
+            return node;
+        }
+    }
+#endif  // __linux__
+    return 0;
+}
+
+unsigned GetNumaNodeOfCurrentThread()
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned processor, node;
+    if (0 == syscall(SYS_getcpu, &processor, &node, NULL)) {
+        return node;
+    }
+#endif  // __linux__ && SYS_getcpu
+    return 0;
+}
+
+bool InterleaveMemoryAcrossNumaNodes(void *memory, size_t size)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned nNodes = __min(GetNumberOfNumaNodes(), (unsigned)(sizeof(unsigned long) * 8));
+    if (nNodes < 2) {
+        return false;
+    }
+
+    //
+    // Call mbind directly rather than through libnuma so as not to need it to build.  This is MPOL_INTERLEAVE from <numaif.h>.
+    //
+    const int interleavePolicy = 3;
+    unsigned long nodeMask = (nNodes == sizeof(unsigned long) * 8) ? ~0ul : (1ul << nNodes) - 1;
+
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    char *start = (char *)(((size_t)memory + pageSize - 1) & ~(pageSize - 1));    // mbind needs a page aligned address
+    char *end = (char *)memory + size;
+    if (end <= start) {
+        return false;
+    }
+
+    return 0 == syscall(SYS_mbind, start, end - start, interleavePolicy, &nodeMask, sizeof(nodeMask) * 8, 0);
+#else   // __linux__ && SYS_mbind
+    return false;
+#endif  // __linux__ && SYS_mbind
+}
+
+_int64 GetPhysicalMemorySize()
+{
+    long nPages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (nPages <= 0 || pageSize <= 0) {
+        return 0;
+    }
+    return (_int64)nPages * pageSize;
+}
+
+#ifdef __linux__
+//
+// The first line of a cgroup control file, without its newline, or false if it isn't there.  A container sees its own
+// cgroup at the root of /sys/fs/cgroup, which is all that's looked at.
+//
+static bool ReadCgroupFile(const char *fileName, char *buffer, int bufferSize)
+{
+    FILE *file = fopen(fileName, "r");
+    if (NULL == file) {
+        return false;
+    }
+    bool worked = NULL != fgets(buffer, bufferSize, file);
+    fclose(file);
+    if (worked) {
+        buffer[strcspn(buffer, "\n")] = '\0';
+    }
+    return worked;
+}
+#endif  // __linux__
+
+unsigned GetContainerProcessorLimit()
+{
+#ifdef __linux__
+    unsigned limit = 0;
+    char buffer[100];
+    _int64 quota = -1, period = 0;
+    if (ReadCgroupFile("/sys/fs/cgroup/cpu.max", buffer, sizeof(buffer))) {
+        // v2: "<quota> <period>", with a quota of "max" for none
+        if (strncmp(buffer, "max", 3) != 0) {
+            sscanf(buffer, "%lld %lld", &quota, &period);
+        }
+    } else if (ReadCgroupFile("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", buffer, sizeof(buffer))) {
+        // v1: a quota of -1 for none
+        quota = atoll(buffer);
+        if (ReadCgroupFile("/sys/fs/cgroup/cpu/cpu.cfs_period_us", buffer, sizeof(buffer))) {
+            period = atoll(buffer);
+        }
+    }
+    if (quota > 0 && period > 0) {
+        limit = (unsigned)((quota + period - 1) / period);
+    }
+
+    cpu_set_t cpuset;
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+        unsigned allowed = (unsigned)CPU_COUNT(&cpuset);
+        if (allowed > 0 && allowed < GetNumberOfProcessors() && (0 == limit || allowed < limit)) {
+            limit = allowed;
+        }
+    }
+    return limit;
+#else   // __linux__
+    return 0;
+#endif  // __linux__
+}
+
+_int64 GetContainerMemoryLimit()
+{
+#ifdef __linux__
+    char buffer[100];
+    _int64 limit = 0;
+    if (ReadCgroupFile("/sys/fs/cgroup/memory.max", buffer, sizeof(buffer))) {
+        // v2: "max" for none
+        limit = strncmp(buffer, "max", 3) == 0 ? 0 : atoll(buffer);
+    } else if (ReadCgroupFile("/sys/fs/cgroup/memory/memory.limit_in_bytes", buffer, sizeof(buffer))) {
+        // v1: a number close to 2^63 for none
+        limit = atoll(buffer);
+        if (limit >= ((_int64)1 << 62)) {
+            limit = 0;
+        }
+    }
+    _int64 physical = GetPhysicalMemorySize();
+    return limit > 0 && (0 == physical || limit < physical) ? limit : 0;
+#else   // __linux__
+    return 0;
+#endif  // __linux__
+}
+
+_int64 GetPeakMemoryUsage()
+{
+    struct rusage usage;
+    if (0 != getrusage(RUSAGE_SELF, &usage)) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss;         // Already in bytes
+#else
+    return (_int64)usage.ru_maxrss * 1024;
+#endif
+}
+
+_int64 GetProcessCPUTimeInMillis()
+{
+    struct rusage usage;
+    if (0 != getrusage(RUSAGE_SELF, &usage)) {
+        return 0;
+    }
+    return ((_int64)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 + ((_int64)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+}
+
+const char *GetSharedMemoryDirectory()
+{
+    const char *sharedMemoryDirectory = "/dev/shm";
+    struct stat sb;
+    if (stat(sharedMemoryDirectory, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+        return NULL;
+    }
+    return sharedMemoryDirectory;
+}
+
+struct InterprocessFileLock {
+    int fd;
+};
+
+InterprocessFileLock *AcquireInterprocessFileLock(const char *lockFileName)
+{
+    int fd = open(lockFileName, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        WriteErrorMessage("Unable to open lock file '%s': %s (%d)\n", lockFileName, strerror(errno), errno);
+        return NULL;
+    }
+
+    int result;
+    while ((result = flock(fd, LOCK_EX)) < 0 && EINTR == errno) {
+        // This space intentionally left blank.
+    }
+    if (result < 0) {
+        WriteErrorMessage("Unable to lock '%s': %s (%d)\n", lockFileName, strerror(errno), errno);
+        close(fd);
+        return NULL;
+    }
+
+    InterprocessFileLock *lock = new InterprocessFileLock;
+    lock->fd = fd;
+    return lock;
+}
+
+void ReleaseInterprocessFileLock(InterprocessFileLock *lock)
+{
+    close(lock->fd);    // Which releases the lock
+    delete lock;
+}
+
+bool GetCanonicalPathName(const char *path, char *buffer, size_t bufferSize)
+{
+    char *canonicalPath = realpath(path, NULL);
+    if (NULL == canonicalPath) {
+        return false;
+    }
+
+    bool fits = strlen(canonicalPath) < bufferSize;
+    if (fits) {
+        strcpy(buffer, canonicalPath);
+    }
+    free(canonicalPath);
+    return fits;
+}
+
+void SleepForMillis(unsigned millis)
+{
+  usleep(millis*1000);
 }
 
 _int64 QueryFileSize(const char *fileName)
@@ -1320,6 +2076,64 @@ MoveSingleFile(
     return rename(from, to) == 0;
 }
 
+    bool
+CopyFileRange(
+    const char* fromFileName,
+    const char* toFileName,
+    _int64 toOffset,
+    _int64 bytes)
+{
+    int from = open(fromFileName, O_RDONLY);
+    int to = open(toFileName, O_WRONLY);
+    bool worked = from >= 0 && to >= 0;
+    off_t fromOffset = 0;
+    off_t offset = toOffset;
+
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    while (worked && bytes > 0) {
+        loff_t fromOffsetForKernel = fromOffset, offsetForKernel = offset;
+        ssize_t copied = syscall(SYS_copy_file_range, from, &fromOffsetForKernel, to, &offsetForKernel, (size_t)__min(bytes, (_int64)1 << 30), 0);
+        if (copied < 0 && (ENOSYS == errno || EXDEV == errno || EINVAL == errno || EOPNOTSUPP == errno)) {
+            break;  // Old kernels can't do it between file systems, or at all; copy the rest through a buffer
+        }
+        worked = copied > 0;
+        if (worked) {
+            fromOffset += copied;
+            offset += copied;
+            bytes -= copied;
+        }
+    }
+#endif  // __linux__ && SYS_copy_file_range
+
+    if (worked && bytes > 0) {
+        const size_t bufferSize = 16 * 1024 * 1024;
+        char* buffer = (char*)BigAlloc(bufferSize);
+        while (worked && bytes > 0) {
+            ssize_t amountRead = pread(from, buffer, (size_t)__min((_int64)bufferSize, bytes), fromOffset);
+            worked = amountRead > 0;
+            for (ssize_t written = 0; worked && written < amountRead; ) {
+                ssize_t amountWritten = pwrite(to, buffer + written, amountRead - written, offset + written);
+                worked = amountWritten > 0;
+                written += amountWritten;
+            }
+            if (worked) {
+                fromOffset += amountRead;
+                offset += amountRead;
+                bytes -= amountRead;
+            }
+        }
+        BigDealloc(buffer);
+    }
+
+    if (from >= 0) {
+        close(from);
+    }
+    if (to >= 0) {
+        worked = 0 == close(to) && worked;
+    }
+    return worked;
+}
+
 class LargeFileHandle
 {
 public:
@@ -1386,30 +2200,61 @@ OpenMemoryMappedFile(
     size_t length,
     void** o_contents,
     bool write,
-    bool sequential)
+    bool sequential,
+    bool largePages)
 {
   int fd = open(filename, write ? O_CREAT | O_RDWR : O_RDONLY, S_IRUSR | S_IWUSR);
     if (fd < 0) {
         warn("OpenMemoryMappedFile %s failed", filename);
         return NULL;
     }
-    // todo: large page support
     size_t page = getpagesize();
+
+    //
+    // Files on a hugetlbfs mount are always backed by huge pages, but have to be mapped in whole huge pages (which
+    // is the file system's block size).  We map them shared when reading, because a private mapping reserves a
+    // second set of huge pages in case somebody writes to it.
+    //
+    bool hugetlbfs = false;
+#ifdef __linux__
+    const long HugetlbfsMagic = 0x958458f6;    // HUGETLBFS_MAGIC from linux/magic.h
+    struct statfs fileSystemInfo;
+    if (fstatfs(fd, &fileSystemInfo) == 0 && HugetlbfsMagic == fileSystemInfo.f_type) {
+        hugetlbfs = true;
+        page = fileSystemInfo.f_bsize;
+    }
+#endif  // __linux__
+
     size_t extra = offset % page;
-    void* map = mmap(NULL, length + extra, (write ? PROT_WRITE : 0) | PROT_READ, MAP_PRIVATE, fd, offset - extra);
+    size_t mapLength = length + extra;
+    if (hugetlbfs) {
+        mapLength = (mapLength + page - 1) / page * page;
+    }
+    void* map = mmap(NULL, mapLength, (write ? PROT_WRITE : 0) | PROT_READ, (hugetlbfs && !write) ? MAP_SHARED : MAP_PRIVATE, fd, offset - extra);
     if (map == NULL || map == MAP_FAILED) {
         warn("OpenMemoryMappedFile %s mmap failed", filename);
         close(fd);
         return NULL;
     }
-    int e = madvise(map, length + extra, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
-    if (e < 0) {
-        warn("OpenMemoryMappedFile %s madvise failed", filename);
+    if (!hugetlbfs) {
+        int e = madvise(map, mapLength, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        if (e < 0) {
+            warn("OpenMemoryMappedFile %s madvise failed", filename);
+        }
+#ifdef MADV_HUGEPAGE
+        //
+        // Ask for transparent huge pages.  The kernel can only do this for some file systems (tmpfs mounted with huge=,
+        // or read-only files when it's built with CONFIG_READ_ONLY_THP_FOR_FS), so it's fine if it doesn't work.
+        //
+        if (largePages) {
+            madvise(map, mapLength, MADV_HUGEPAGE);
+        }
+#endif  // MADV_HUGEPAGE
     }
     MemoryMappedFile* result = new MemoryMappedFile();
     result->fd = fd;
     result->map = map;
-    result->length = length + extra;
+    result->length = mapLength;
     *o_contents = (char*)map + extra;
     return result;
 }
@@ -1436,7 +2281,59 @@ void AdviseMemoryMappedFilePrefetch(const MemoryMappedFile *mappedFile)
   }
 }
 
+bool PopulateMappedMemory(const void *address, size_t length)
+{
 #ifdef __linux__
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22   // Older headers don't have it; older kernels fail it with EINVAL
+#endif  // MADV_POPULATE_READ
+    size_t page = getpagesize();
+    char *start = (char *)((size_t)address / page * page);
+    return 0 == madvise(start, (char *)address + length - start, MADV_POPULATE_READ);
+#else   // __linux__
+    return false;
+#endif  // __linux__
+}
+
+void StartPagingIn(const void *address, size_t length)
+{
+    //
+    // For a file mapping, MADV_WILLNEED queues reads for the pages that aren't in the page cache and returns.
+    //
+    size_t page = getpagesize();
+    char *start = (char *)((size_t)address / page * page);
+    madvise(start, (char *)address + length - start, MADV_WILLNEED);
+}
+
+#ifdef __linux__
+
+//
+// Drop-behind for a writer's writes, for AsyncFile::DropBehind.  Asking the kernel to drop a write that's just finished
+// only starts it being written back, since dirty pages can't be dropped, so each write is asked about again after the
+// writer's next one, by when it's usually clean.
+//
+class WriteDropBehind
+{
+public:
+    WriteDropBehind() : lastOffset(0), lastLength(0) {}
+
+    void written(int fd, size_t offset, size_t length)
+    {
+        if (! AsyncFile::DropBehind || 0 == length) {
+            return;
+        }
+        posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+        if (0 != lastLength) {
+            posix_fadvise(fd, lastOffset, lastLength, POSIX_FADV_DONTNEED);
+        }
+        lastOffset = offset;
+        lastLength = length;
+    }
+
+private:
+    size_t      lastOffset;
+    size_t      lastLength;
+};
 
 class PosixAsyncFile : public AsyncFile
 {
@@ -1464,6 +2361,7 @@ public:
         SingleWaiterObject  ready;
         struct aiocb        aiocb;
         size_t*             result;
+        WriteDropBehind     dropBehind;
     };
 
     virtual AsyncFile::Writer* getWriter();
@@ -1500,7 +2398,7 @@ PosixAsyncFile::open(
 {
     int fd = ::open(filename, write ? O_CREAT | O_RDWR | O_TRUNC : O_RDONLY, write ? S_IRWXU | S_IRGRP : 0);
     if (fd < 0) {
-        WriteErrorMessage("Unable to create SAM file '%s', %d\n",filename,errno);
+        WriteErrorMessage("Unable to %s '%s': %s (%d)\n", write ? "create" : "open", filename, strerror(errno), errno);
         return NULL;
     }
     return new PosixAsyncFile(fd);
@@ -1584,90 +2482,524 @@ PosixAsyncFile::Writer::beginWrite(
         warn("PosixAsyncFile aio_write failed");
         return false;
     }
-    writing = true;
-    return true;
+    writing = true;
+    return true;
+}
+
+    bool
+PosixAsyncFile::Writer::waitForCompletion()
+{
+    if (writing) {
+        WaitForSingleWaiterObject(&ready);
+	ResetSingleWaiterObject(&ready);
+        writing = false;
+        ssize_t ret = aio_return(&aiocb);
+        if (ret < 0 && errno != 0) {
+            warn("PosixAsyncFile Writer aio_return failed");
+            return false;
+        }
+        if (result != NULL) {
+            *result = max((ssize_t)0, ret);
+        }
+        dropBehind.written(file->fd, aiocb.aio_offset, max((ssize_t)0, ret));
+    }
+    return true;
+}
+
+    AsyncFile::Reader*
+PosixAsyncFile::getReader()
+{
+    return new Reader(this);
+}
+
+PosixAsyncFile::Reader::Reader(
+    PosixAsyncFile* i_file)
+    : file(i_file), reading(false)
+{
+    memset(&aiocb, 0, sizeof(aiocb));
+    if (! CreateSingleWaiterObject(&ready)) {
+        WriteErrorMessage("PosixAsyncFile cannot create waiter\n");
+        soft_exit(1);
+    }
+}
+
+    bool
+PosixAsyncFile::Reader::close()
+{
+    DestroySingleWaiterObject(&ready);
+    return true;
+}
+
+    bool
+PosixAsyncFile::Reader::beginRead(
+    void* buffer,
+    size_t length,
+    size_t offset,
+    size_t* bytesRead)
+{
+    if (! waitForCompletion()) {
+        return false;
+    }
+    aio_setup(&aiocb, &ready, file->fd, buffer, length, offset);
+    result = bytesRead;
+    if (aio_read(&aiocb) < 0) {
+        warn("PosixAsyncFile Reader aio_read failed");
+        return false;
+    }
+    reading = true;
+    return true;
+}
+
+    bool
+PosixAsyncFile::Reader::waitForCompletion()
+{
+    if (reading) {
+        WaitForSingleWaiterObject(&ready);
+	ResetSingleWaiterObject(&ready);
+        reading = false;
+        ssize_t ret = aio_return(&aiocb);
+        if (ret < 0 && errno != 0) {
+            warn("PosixAsyncFile Reader aio_return");
+            return false;
+        }
+        if (result != NULL) {
+            *result = max((ssize_t)0, ret);
+        }
+    }
+    return true;
+}
+
+IoUring::~IoUring()
+{
+    if (sqes != NULL) {
+        munmap(sqes, sqesSize);
+    }
+    if (cqRing != NULL && cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != NULL) {
+        munmap(sqRing, sqRingSize);
+    }
+    if (ringFd >= 0) {
+        close(ringFd);
+    }
+}
+
+    bool
+IoUring::init(
+    unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0) {
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+    }
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        sqRing = NULL;
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            cqRing = NULL;
+            return false;
+        }
+    }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*) mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqes = NULL;
+        return false;
+    }
+
+    sqTail = (unsigned*) ((char*) sqRing + params.sq_off.tail);
+    sqMask = *(unsigned*) ((char*) sqRing + params.sq_off.ring_mask);
+    sqArray = (unsigned*) ((char*) sqRing + params.sq_off.array);
+    cqHead = (unsigned*) ((char*) cqRing + params.cq_off.head);
+    cqTail = (unsigned*) ((char*) cqRing + params.cq_off.tail);
+    cqMask = *(unsigned*) ((char*) cqRing + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*) ((char*) cqRing + params.cq_off.cqes);
+    toSubmit = 0;
+    return true;
+}
+
+    bool
+IoUring::registerBuffers(
+    iovec* buffers,
+    unsigned count)
+{
+    return 0 == syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, buffers, count);
+}
+
+    void
+IoUring::queueRead(
+    int fd,
+    void* buffer,
+    unsigned bytes,
+    _int64 offset,
+    _uint64 userData,
+    int fixedIndex)
+{
+    queue(fixedIndex >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ, fd, buffer, bytes, offset, userData, fixedIndex);
+}
+
+    void
+IoUring::queueWrite(
+    int fd,
+    const void* buffer,
+    unsigned bytes,
+    _int64 offset,
+    _uint64 userData)
+{
+    queue(IORING_OP_WRITE, fd, buffer, bytes, offset, userData, -1);
+}
+
+    void
+IoUring::queue(
+    unsigned char opcode,
+    int fd,
+    const void* buffer,
+    unsigned bytes,
+    _int64 offset,
+    _uint64 userData,
+    int fixedIndex)
+{
+    unsigned tail = *sqTail;
+    unsigned index = tail & sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (_uint64) buffer;
+    sqe->len = bytes;
+    sqe->off = offset;
+    sqe->user_data = userData;
+    sqe->buf_index = fixedIndex >= 0 ? fixedIndex : 0;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    toSubmit++;
+}
+
+    void
+IoUring::submit()
+{
+    while (toSubmit > 0) {
+        int submitted = (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, 0, 0, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            WriteErrorMessage("IoUring: io_uring_enter failed to submit, %d\n", errno);
+            soft_exit(1);
+        }
+        toSubmit -= submitted;
+    }
+}
+
+    void
+IoUring::waitForCompletion(
+    _uint64* o_userData,
+    int* o_result)
+{
+    submit();
+    while (true) {
+        unsigned head = *cqHead;
+        if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe* cqe = &cqes[head & cqMask];
+            *o_userData = cqe->user_data;
+            *o_result = cqe->res;
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            return;
+        }
+        if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            WriteErrorMessage("IoUring: io_uring_enter failed to wait, %d\n", errno);
+            soft_exit(1);
+        }
+    }
+}
+
+//
+// io_uring
+//
+// glibc runs the aio requests for a file one at a time, so however many writers there are, only one write is
+// going to the disk.  These give each writer (and reader) a small ring of its own, so every batch that's been
+// handed off is actually being written, and nothing is shared between threads.
+//
+
+class IoUringTransfer
+{
+public:
+    IoUringTransfer() : busy(false) {}
+
+    bool init()
+    { return ring.init(1); }
+
+    bool begin(int fd, bool write, void* buffer, size_t length, size_t offset, size_t* result);
+
+    bool waitForCompletion();
+
+private:
+    // send the part that's left to the kernel
+    void issue();
+
+    static const size_t MaxTransfer = 1 << 30; // the kernel caps a single read or write a bit under 2GB
+
+    IoUring     ring;
+    bool        busy;
+    int         fd;
+    bool        write;
+    char*       buffer;
+    size_t      length;
+    size_t      offset;
+    size_t      done;
+    size_t*     result;
+};
+
+    bool
+IoUringTransfer::begin(
+    int i_fd,
+    bool i_write,
+    void* i_buffer,
+    size_t i_length,
+    size_t i_offset,
+    size_t* i_result)
+{
+    if (! waitForCompletion()) {
+        return false;
+    }
+    fd = i_fd;
+    write = i_write;
+    buffer = (char*) i_buffer;
+    length = i_length;
+    offset = i_offset;
+    done = 0;
+    result = i_result;
+    if (0 == length) {
+        if (result != NULL) {
+            *result = 0;
+        }
+        return true;
+    }
+    busy = true;
+    issue();
+    return true;
+}
+
+    void
+IoUringTransfer::issue()
+{
+    unsigned bytes = (unsigned) min(length - done, (size_t) MaxTransfer);
+    if (write) {
+        ring.queueWrite(fd, buffer + done, bytes, offset + done, 0);
+    } else {
+        ring.queueRead(fd, buffer + done, bytes, offset + done, 0);
+    }
+    ring.submit();
+}
+
+    bool
+IoUringTransfer::waitForCompletion()
+{
+    while (busy) {
+        _uint64 userData;
+        int ret;
+        ring.waitForCompletion(&userData, &ret);
+        if (ret < 0) {
+            busy = false;
+            errno = -ret;
+            warn(write ? "IoUringAsyncFile write failed" : "IoUringAsyncFile read failed");
+            return false;
+        }
+        done += ret;
+        if (ret == 0 || done >= length) {
+            //
+            // A read that returns nothing is at the end of the file.  A write that does has run out of space.
+            //
+            busy = false;
+            if (ret == 0 && write) {
+                WriteErrorMessage("IoUringAsyncFile: wrote %lld of %lld bytes at offset %lld\n", done, length, offset);
+                return false;
+            }
+            if (result != NULL) {
+                *result = done;
+            }
+        } else {
+            issue();
+        }
+    }
+    return true;
+}
+
+class IoUringAsyncFile : public AsyncFile
+{
+public:
+    static IoUringAsyncFile* open(const char* filename, bool write);
+
+    IoUringAsyncFile(int i_fd);
+
+    virtual bool close();
+
+    class Writer : public AsyncFile::Writer
+    {
+    public:
+        Writer(IoUringAsyncFile* i_file);
+
+        virtual bool close();
+
+        virtual bool beginWrite(void* buffer, size_t length, size_t offset, size_t *bytesWritten);
+
+        virtual bool waitForCompletion();
+
+    private:
+        IoUringAsyncFile*   file;
+        IoUringTransfer     transfer;
+        size_t              writeOffset;    // of the write in progress, for dropBehind
+        size_t              writeLength;    // 0 if none
+        WriteDropBehind     dropBehind;
+    };
+
+    virtual AsyncFile::Writer* getWriter();
+
+    class Reader : public AsyncFile::Reader
+    {
+    public:
+        Reader(IoUringAsyncFile* i_file);
+
+        virtual bool close();
+
+        virtual bool beginRead(void* buffer, size_t length, size_t offset, size_t *bytesRead);
+
+        virtual bool waitForCompletion();
+
+    private:
+        IoUringAsyncFile*   file;
+        IoUringTransfer     transfer;
+    };
+
+    virtual AsyncFile::Reader* getReader();
+
+private:
+    int         fd;
+};
+
+    IoUringAsyncFile*
+IoUringAsyncFile::open(
+    const char* filename,
+    bool write)
+{
+    int fd = ::open(filename, write ? O_CREAT | O_RDWR | O_TRUNC : O_RDONLY, write ? S_IRWXU | S_IRGRP : 0);
+    if (fd < 0) {
+        WriteErrorMessage("Unable to %s '%s': %s (%d)\n", write ? "create" : "open", filename, strerror(errno), errno);
+        return NULL;
+    }
+    return new IoUringAsyncFile(fd);
+}
+
+IoUringAsyncFile::IoUringAsyncFile(
+    int i_fd)
+    : fd(i_fd)
+{
+}
+
+    bool
+IoUringAsyncFile::close()
+{
+    return ::close(fd) == 0;
+}
+
+    AsyncFile::Writer*
+IoUringAsyncFile::getWriter()
+{
+    return new Writer(this);
+}
+
+IoUringAsyncFile::Writer::Writer(IoUringAsyncFile* i_file)
+    : file(i_file), writeOffset(0), writeLength(0)
+{
+    if (! transfer.init()) {
+        WriteErrorMessage("IoUringAsyncFile: cannot set up io_uring, %d\n", errno);
+        soft_exit(1);
+    }
+}
+
+    bool
+IoUringAsyncFile::Writer::close()
+{
+    return waitForCompletion();
+}
+
+    bool
+IoUringAsyncFile::Writer::beginWrite(
+    void* buffer,
+    size_t length,
+    size_t offset,
+    size_t *bytesWritten)
+{
+    if (! waitForCompletion()) {
+        return false;
+    }
+    writeOffset = offset;
+    writeLength = length;
+    return transfer.begin(file->fd, true, buffer, length, offset, bytesWritten);
 }
 
     bool
-PosixAsyncFile::Writer::waitForCompletion()
+IoUringAsyncFile::Writer::waitForCompletion()
 {
-    if (writing) {
-        WaitForSingleWaiterObject(&ready);
-	ResetSingleWaiterObject(&ready);
-        writing = false;
-        ssize_t ret = aio_return(&aiocb);
-        if (ret < 0 && errno != 0) {
-            warn("PosixAsyncFile Writer aio_return failed");
-            return false;
-        }
-        if (result != NULL) {
-            *result = max((ssize_t)0, ret);
-        }
+    if (! transfer.waitForCompletion()) {
+        writeLength = 0;
+        return false;
     }
+    dropBehind.written(file->fd, writeOffset, writeLength);
+    writeLength = 0;
     return true;
 }
 
     AsyncFile::Reader*
-PosixAsyncFile::getReader()
+IoUringAsyncFile::getReader()
 {
     return new Reader(this);
 }
 
-PosixAsyncFile::Reader::Reader(
-    PosixAsyncFile* i_file)
-    : file(i_file), reading(false)
+IoUringAsyncFile::Reader::Reader(IoUringAsyncFile* i_file)
+    : file(i_file)
 {
-    memset(&aiocb, 0, sizeof(aiocb));
-    if (! CreateSingleWaiterObject(&ready)) {
-        WriteErrorMessage("PosixAsyncFile cannot create waiter\n");
+    if (! transfer.init()) {
+        WriteErrorMessage("IoUringAsyncFile: cannot set up io_uring, %d\n", errno);
         soft_exit(1);
     }
 }
 
     bool
-PosixAsyncFile::Reader::close()
+IoUringAsyncFile::Reader::close()
 {
-    DestroySingleWaiterObject(&ready);
-    return true;
+    return waitForCompletion();
 }
 
     bool
-PosixAsyncFile::Reader::beginRead(
+IoUringAsyncFile::Reader::beginRead(
     void* buffer,
     size_t length,
     size_t offset,
     size_t* bytesRead)
 {
-    if (! waitForCompletion()) {
-        return false;
-    }
-    aio_setup(&aiocb, &ready, file->fd, buffer, length, offset);
-    result = bytesRead;
-    if (aio_read(&aiocb) < 0) {
-        warn("PosixAsyncFile Reader aio_read failed");
-        return false;
-    }
-    reading = true;
-    return true;
+    return transfer.begin(file->fd, false, buffer, length, offset, bytesRead);
 }
 
     bool
-PosixAsyncFile::Reader::waitForCompletion()
+IoUringAsyncFile::Reader::waitForCompletion()
 {
-    if (reading) {
-        WaitForSingleWaiterObject(&ready);
-	ResetSingleWaiterObject(&ready);
-        reading = false;
-        ssize_t ret = aio_return(&aiocb);
-        if (ret < 0 && errno != 0) {
-            warn("PosixAsyncFile Reader aio_return");
-            return false;
-        }
-        if (result != NULL) {
-            *result = max((ssize_t)0, ret);
-        }
-    }
-    return true;
+    return transfer.waitForCompletion();
 }
 
 #else
@@ -1734,7 +3066,7 @@ OsxAsyncFile::open(
 {
     int fd = ::open(filename, write ? O_CREAT | O_RDWR | O_TRUNC : O_RDONLY, write ? S_IRWXU | S_IRGRP : 0);
     if (fd < 0) {
-        WriteErrorMessage("Unable to create SAM file '%s', %d\n",filename,errno);
+        WriteErrorMessage("Unable to %s '%s': %s (%d)\n", write ? "create" : "open", filename, strerror(errno), errno);
         return NULL;
     }
     return new OsxAsyncFile(fd);
@@ -1847,6 +3179,15 @@ int _fseek64bit(FILE *stream, _int64 offset, int origin)
 #endif
 }
 
+_int64 _ftell64bit(FILE *stream)
+{
+#ifdef __APPLE__
+    return ftello(stream);
+#else
+    return ftello64(stream);
+#endif
+}
+
 FileMapper::FileMapper()
 {
     fd = -1;
@@ -1880,6 +3221,10 @@ FileMapper::init(const char *i_fileName)
     }
     fileSize = sb.st_size;
 
+#ifdef __linux__
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);    // Bigger readahead; it's only a hint, so ignore failure
+#endif  // __linux__
+
     initialized = true;
 
     return true;
@@ -1902,8 +3247,11 @@ FileMapper::createMapping(size_t offset, size_t amountToMap, void** o_token)
 	    return NULL;
     }
 
-    int r = madvise(mappedBase, min((size_t) madviseSize, amountToMap + beginRounding), MADV_WILLNEED | MADV_SEQUENTIAL);
-    _ASSERT(r == 0);
+    //
+    // These are advice values, not flags, so they're separate calls.  Both are only hints, so ignore failure.
+    //
+    madvise(mappedBase, amountToMap + beginRounding, MADV_SEQUENTIAL);
+    madvise(mappedBase, min((size_t) madviseSize, amountToMap + beginRounding), MADV_WILLNEED);
     lastPosMadvised = 0;
 
     InterlockedIncrementAndReturnNewValue(&mapCount);
@@ -1924,6 +3272,29 @@ FileMapper::unmap(void* i_token)
     }
 }
 
+void
+FileMapper::dropPages(const char* address, size_t fileOffset, size_t length)
+{
+    //
+    // Round in to whole pages, so as not to drop part of something that isn't done with.  The mapping may not start on
+    // a page boundary in the file, but createMapping maps from the page boundary below it, so the address and file
+    // offset line up.
+    //
+    size_t skip = (pagesize - fileOffset % pagesize) % pagesize;
+    if (length <= skip) {
+        return;
+    }
+    length = (length - skip) / pagesize * pagesize;
+    if (0 == length) {
+        return;
+    }
+
+    madvise((void *)(address + skip), length, MADV_DONTNEED);   // It's a read only shared mapping, so this just unmaps the pages
+#ifdef __linux__
+    posix_fadvise(fd, fileOffset + skip, length, POSIX_FADV_DONTNEED);
+#endif  // __linux__
+}
+
 FileMapper::~FileMapper()
 {
     _ASSERT(mapCount == 0);
@@ -2174,19 +3545,42 @@ bool ReadFromNamedPipe(NamedPipe *pipe, char *outputBuffer, size_t outputBufferS
 
 bool WriteToNamedPipe(NamedPipe *pipe, const char *stringToWrite)
 {
-    unsigned int size = (unsigned int)strlen(stringToWrite);
+    return WriteBytesToNamedPipe(pipe, stringToWrite, strlen(stringToWrite));
+}
+
+bool ReadBytesFromNamedPipe(NamedPipe *pipe, char *outputBuffer, size_t outputBufferSize, size_t *o_bytesRead)
+{
+    unsigned int size;
+    if (1 != fread(&size, sizeof(size), 1, pipe->input)) {
+        return false;
+    }
 
-    if (1 != fwrite(&size, sizeof(size), 1, pipe->output)) {
+    if (size > outputBufferSize) {
+        WriteErrorMessage("Trying to read too big a chunk from named pipe, %d > %lld\n", size, outputBufferSize);
         return false;
     }
 
-    if (1 != fwrite(stringToWrite, size, 1, pipe->output)) {
+    if (0 != size && 1 != fread(outputBuffer, size, 1, pipe->input)) {
         return false;
     }
 
+    *o_bytesRead = size;
+    return true;
+}
+
+bool WriteBytesToNamedPipe(NamedPipe *pipe, const char *bytes, size_t length)
+{
+    unsigned int size = (unsigned int)length;
+
+    //
+    // Several threads of a command can write messages at once, so keep each count together with its message.
+    //
+    flockfile(pipe->output);
+    bool worked = 1 == fwrite(&size, sizeof(size), 1, pipe->output) && (0 == size || 1 == fwrite(bytes, size, 1, pipe->output));
     fflush(pipe->output);
+    funlockfile(pipe->output);
 
-    return true;
+    return worked;
 }
 
 void CloseNamedPipe(NamedPipe *pipe)
@@ -2198,20 +3592,441 @@ void CloseNamedPipe(NamedPipe *pipe)
 
 const char *DEFAULT_NAMED_PIPE_NAME = "SNAP";
 
+struct CommandSocket {
+    int     fd;
+    char *  unixPath;   // To unlink when we close, or NULL for TCP
+};
+
+//
+// Whether an address is [host:]port (TCP) rather than a Unix domain socket path, and if so its pieces.  The host
+// comes back in hostBuffer, or empty for just a port.
+//
+static bool ParseTcpAddress(const char *address, char *hostBuffer, size_t hostBufferSize, const char **port)
+{
+    const char *colon = strrchr(address, ':');
+    const char *portPart = (NULL == colon) ? address : colon + 1;
+    if ('\0' == *portPart || NULL != strchr(address, '/')) {
+        return false;
+    }
+
+    for (const char *p = portPart; *p != '\0'; p++) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+    }
+
+    size_t hostLength = (NULL == colon) ? 0 : colon - address;
+    if (hostLength >= hostBufferSize) {
+        return false;
+    }
+    memcpy(hostBuffer, address, hostLength);
+    hostBuffer[hostLength] = '\0';
+    *port = portPart;
+    return true;
+}
+
+//
+// Whether a socket address is on this machine only (127.0.0.0/8 or ::1, or ::ffff:127.x.x.x).
+//
+static bool IsLoopbackAddress(const struct sockaddr *address)
+{
+    if (AF_INET == address->sa_family) {
+        return 127 == (ntohl(((const struct sockaddr_in *)address)->sin_addr.s_addr) >> 24);
+    }
+    if (AF_INET6 == address->sa_family) {
+        const struct in6_addr *address6 = &((const struct sockaddr_in6 *)address)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(address6) || (IN6_IS_ADDR_V4MAPPED(address6) && 127 == address6->s6_addr[12]);
+    }
+    return false;
+}
+
+//
+// A socket connected to (or, for a server, bound to) address, or -1.  A server only binds TCP addresses other than
+// loopback ones if allowRemote is set, since anyone who can connect can run commands.
+//
+static int OpenSocketForAddress(const char *address, bool serverSide, bool allowRemote)
+{
+    char host[256];
+    const char *port;
+    if (ParseTcpAddress(address, host, sizeof(host), &port)) {
+        struct addrinfo hints, *addresses;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int error = getaddrinfo('\0' == host[0] ? "localhost" : host, port, &hints, &addresses);
+        if (0 != error) {
+            WriteErrorMessage("Unable to look up socket address '%s': %s\n", address, gai_strerror(error));
+            return -1;
+        }
+
+        int fd = -1;
+        bool skippedRemote = false;
+        for (struct addrinfo *a = addresses; NULL != a && -1 == fd; a = a->ai_next) {
+            if (serverSide && !allowRemote && !IsLoopbackAddress(a->ai_addr)) {
+                skippedRemote = true;
+                continue;
+            }
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (-1 == fd) {
+                continue;
+            }
+
+            int yes = 1;
+            bool worked = serverSide ?
+                0 == setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) && 0 == bind(fd, a->ai_addr, a->ai_addrlen) :
+                0 == connect(fd, a->ai_addr, a->ai_addrlen);
+            if (!worked) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+
+        if (-1 == fd && skippedRemote) {
+            WriteErrorMessage("'%s' isn't a loopback address.  The daemon runs whatever commands it's sent, which read and write files,\n"
+                "with no authentication, so it only listens on other interfaces with -allowRemote.\n", address);
+        } else if (-1 == fd) {
+            WriteErrorMessage("Unable to %s TCP socket '%s', errno %d\n", serverSide ? "listen on" : "connect to", address, errno);
+        }
+        return fd;
+    }
+
+    struct sockaddr_un unixAddress;
+    memset(&unixAddress, 0, sizeof(unixAddress));
+    unixAddress.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof(unixAddress.sun_path)) {
+        WriteErrorMessage("Socket path '%s' is too long\n", address);
+        return -1;
+    }
+    strcpy(unixAddress.sun_path, address);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (-1 == fd) {
+        WriteErrorMessage("Unable to create socket, errno %d\n", errno);
+        return -1;
+    }
+
+    if (serverSide) {
+        //
+        // Remove a leftover socket from a daemon that didn't exit cleanly, but nothing else that's in the way.
+        //
+        struct stat status;
+        if (0 == lstat(address, &status)) {
+            if (!S_ISSOCK(status.st_mode)) {
+                WriteErrorMessage("'%s' is already there and isn't a socket; not replacing it\n", address);
+                close(fd);
+                return -1;
+            }
+            unlink(address);
+        }
+        if (0 != bind(fd, (struct sockaddr *)&unixAddress, sizeof(unixAddress))) {
+            WriteErrorMessage("Unable to create socket '%s', errno %d\n", address, errno);
+            close(fd);
+            return -1;
+        }
+    } else if (0 != connect(fd, (struct sockaddr *)&unixAddress, sizeof(unixAddress))) {
+        WriteErrorMessage("Unable to connect to socket '%s', errno %d\n", address, errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+//
+// Wrap a connected socket up as a named pipe, with a FILE for each direction.
+//
+static NamedPipe *NamedPipeForSocket(int fd)
+{
+    int outputFd = dup(fd);
+    FILE *input = fdopen(fd, "r");
+    FILE *output = (-1 == outputFd) ? NULL : fdopen(outputFd, "w");
+    if (NULL == input || NULL == output) {
+        WriteErrorMessage("Unable to open socket connection, errno %d\n", errno);
+        if (NULL != input) fclose(input); else close(fd);
+        if (NULL != output) fclose(output); else if (-1 != outputFd) close(outputFd);
+        return NULL;
+    }
+
+    NamedPipe *pipe = new NamedPipe;
+    pipe->serverSide = false;   // So that reading EOF is the end of the connection, rather than a reason to reconnect
+    pipe->pipeName = NULL;
+    pipe->input = input;
+    pipe->output = output;
+    return pipe;
+}
+
+CommandSocket *OpenCommandSocket(const char *address, bool allowRemote)
+{
+    signal(SIGPIPE, SIG_IGN);   // A client that goes away just makes our writes to it fail
+
+    int fd = OpenSocketForAddress(address, true, allowRemote);
+    if (-1 == fd) {
+        return NULL;
+    }
+
+    if (0 != listen(fd, SOMAXCONN)) {
+        WriteErrorMessage("Unable to listen on socket '%s', errno %d\n", address, errno);
+        close(fd);
+        return NULL;
+    }
+
+    CommandSocket *commandSocket = new CommandSocket;
+    commandSocket->fd = fd;
+    char host[256];
+    const char *port;
+    if (ParseTcpAddress(address, host, sizeof(host), &port)) {
+        commandSocket->unixPath = NULL;
+    } else {
+        commandSocket->unixPath = new char[strlen(address) + 1];
+        strcpy(commandSocket->unixPath, address);
+    }
+    return commandSocket;
+}
+
+NamedPipe *AcceptCommandConnection(CommandSocket *commandSocket)
+{
+    for (;;) {
+        int fd = accept(commandSocket->fd, NULL, NULL);
+        if (-1 != fd) {
+            return NamedPipeForSocket(fd);
+        }
+
+        if (EINTR != errno && ECONNABORTED != errno) {
+            WriteErrorMessage("AcceptCommandConnection: accept failed, errno %d\n", errno);
+            return NULL;
+        }
+    }
+}
+
+NamedPipe *ConnectToCommandSocket(const char *address)
+{
+    int fd = OpenSocketForAddress(address, false, true);
+    if (-1 == fd) {
+        return NULL;
+    }
+    return NamedPipeForSocket(fd);
+}
+
+void CloseCommandSocket(CommandSocket *commandSocket)
+{
+    close(commandSocket->fd);
+    if (NULL != commandSocket->unixPath) {
+        unlink(commandSocket->unixPath);
+        delete[] commandSocket->unixPath;
+    }
+    delete commandSocket;
+}
+
 #endif  // _MSC_VER
 
+#ifdef __linux__
+//
+// The first number in one of /sys's lists (like "0-7,16-23") or a plain number, or -1 if the file isn't there.
+//
+static int ReadFirstNumberFromSysFile(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (NULL == file) {
+        return -1;
+    }
+    int value;
+    if (1 != fscanf(file, "%d", &value)) {
+        value = -1;
+    }
+    fclose(file);
+    return value;
+}
+#endif  // __linux__
+
+//
+// The processors in the order GetProcessorForThread hands them out, worked out the first time anyone asks.
+//
+struct ProcessorPlacement {
+    unsigned     nProcessors;
+    unsigned    *order;
+    unsigned     nHelperProcessors;     // The last ones in order
+
+    ProcessorPlacement() : nHelperProcessors(0) {
+        nProcessors = __max(GetNumberOfProcessors(), 1u);
+        order = new unsigned[nProcessors];
+        for (unsigned i = 0; i < nProcessors; i++) {
+            order[i] = i;
+        }
+#ifdef __linux__
+        //
+        // For each processor: which of its core's SMT threads it is, which L3 cache it's under (by the lowest
+        // numbered processor that shares it, or its socket if there's no L3) and how many of the cores under that
+        // cache come before it among the processors with the same rank.  Sorting on those deals out the cores round
+        // robin over the caches, one SMT thread per core at a time.
+        //
+        struct Placement {
+            int         package;
+            int         core;
+            int         l3;
+            unsigned    smtRank;
+            unsigned    rankInL3;
+            unsigned    processor;
+
+            bool operator<(const Placement &peer) const {
+                if (smtRank != peer.smtRank) return smtRank < peer.smtRank;
+                if (rankInL3 != peer.rankInL3) return rankInL3 < peer.rankInL3;
+                if (l3 != peer.l3) return l3 < peer.l3;
+                return processor < peer.processor;
+            }
+        };
+
+        Placement *placements = new Placement[nProcessors];
+        char path[200];
+        for (unsigned i = 0; i < nProcessors; i++) {
+            Placement *placement = &placements[i];
+            placement->processor = i;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", i);
+            placement->package = ReadFirstNumberFromSysFile(path);
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", i);
+            placement->core = ReadFirstNumberFromSysFile(path);
+            if (placement->package < 0 || placement->core < 0) {
+                delete[] placements;
+                return;     // Leave it in processor order
+            }
+
+            placement->l3 = -1;
+            for (int cache = 0; cache < 10 && placement->l3 < 0; cache++) {
+                snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", i, cache);
+                int level = ReadFirstNumberFromSysFile(path);
+                if (level < 0) {
+                    break;
+                }
+                if (3 == level) {
+                    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", i, cache);
+                    placement->l3 = ReadFirstNumberFromSysFile(path);
+                }
+            }
+            if (placement->l3 < 0) {
+                placement->l3 = (int)nProcessors + placement->package;    // Can't collide with a processor number
+            }
+
+            placement->smtRank = 0;
+            for (unsigned j = 0; j < i; j++) {
+                if (placements[j].package == placement->package && placements[j].core == placement->core) {
+                    placement->smtRank++;
+                }
+            }
+            placement->rankInL3 = 0;
+            for (unsigned j = 0; j < i; j++) {
+                if (placements[j].l3 == placement->l3 && placements[j].smtRank == placement->smtRank) {
+                    placement->rankInL3++;
+                }
+            }
+        }
+
+        std::sort(placements, placements + nProcessors);
+        for (unsigned i = 0; i < nProcessors; i++) {
+            order[i] = placements[i].processor;
+        }
+        delete[] placements;
+#endif  // __linux__
+    }
+};
+
+static ProcessorPlacement *GetProcessorPlacement()
+{
+    static ProcessorPlacement placement;
+    return &placement;
+}
+
+void ReserveHelperProcessors(unsigned nProcessors)
+{
+    ProcessorPlacement *placement = GetProcessorPlacement();
+    placement->nHelperProcessors = __min(nProcessors, placement->nProcessors - 1);  // Leave at least one for everything else
+}
+
+unsigned GetNumberOfHelperProcessors()
+{
+    return GetProcessorPlacement()->nHelperProcessors;
+}
+
+unsigned GetProcessorForThread(unsigned threadNum)
+{
+    ProcessorPlacement *placement = GetProcessorPlacement();
+    return placement->order[threadNum % (placement->nProcessors - placement->nHelperProcessors)];
+}
+
+void BindThreadToHelperProcessors()
+{
+    ProcessorPlacement *placement = GetProcessorPlacement();
+    if (0 != placement->nHelperProcessors) {
+        BindThreadToProcessorSet(placement->order + placement->nProcessors - placement->nHelperProcessors, placement->nHelperProcessors);
+    }
+}
+
+static bool AsyncFileUseIoUring = false;
+
+bool AsyncFile::DropBehind = false;
+const char *AsyncFile::DiscardWritesTo = NULL;
+volatile _int64 AsyncFile::DiscardedBytes = 0;
+
+//
+// Where AsyncFile::DiscardWritesTo goes.  Every write completes as soon as it's begun.
+//
+class NullAsyncFile : public AsyncFile
+{
+public:
+    bool close() { return true; }
+
+    class Writer : public AsyncFile::Writer
+    {
+    public:
+        bool close() { return true; }
+
+        bool beginWrite(void* buffer, size_t length, size_t offset, size_t *bytesWritten) {
+            InterlockedAdd64AndReturnNewValue(&DiscardedBytes, length);
+            if (NULL != bytesWritten) {
+                *bytesWritten = length;
+            }
+            return true;
+        }
+
+        bool waitForCompletion() { return true; }
+    };
+
+    AsyncFile::Writer* getWriter() { return new Writer(); }
+
+    AsyncFile::Reader* getReader() { return NULL; }
+};
+
 AsyncFile* AsyncFile::open(const char* filename, bool write)
 {
     if (!strcmp("-", filename) && write) {
         return StdoutAsyncFile::open("-", true);
     }
+    if (write && NULL != DiscardWritesTo && !strcmp(DiscardWritesTo, filename)) {
+        return new NullAsyncFile();
+    }
 #ifdef _MSC_VER
     return WindowsAsyncFile::open(filename, write);
 #else
 #ifdef __linux__
+    if (AsyncFileUseIoUring) {
+        return IoUringAsyncFile::open(filename, write);
+    }
     return PosixAsyncFile::open(filename, write);
 #else
     return OsxAsyncFile::open(filename, write);
 #endif
 #endif
 }
+
+bool AsyncFile::UseIoUring()
+{
+#ifdef __linux__
+    IoUring probe;
+    if (! probe.init(1)) {
+        return false;
+    }
+    AsyncFileUseIoUring = true;
+    return true;
+#else
+    return false;
+#endif
+}
@@ -56,6 +56,7 @@ typedef HANDLE EventObject;
 #define PATH_SEP '\\'
 #define snprintf _snprintf
 #define mkdir(path, mode) _mkdir(path)
+#define rmdir(path) _rmdir(path)
 #define strdup(s) _strdup(s)
 
 // <http://stackoverflow.com/questions/9021502/whats-the-difference-between-strtok-r-and-strtok-s-in-c>
@@ -82,10 +83,25 @@ int getpagesize();
 #include <sched.h>  // For sched_setaffinity
 #endif
 
-#ifndef __APPLE__
+#if (defined(__x86_64__) || defined(__i386__)) && ! defined(__APPLE__)
 #include <xmmintrin.h>  // This is currently (in Dec 2013) broken on Mac OS X 10.9 (Apple clang-500.2.79)
 #else
-#define _mm_prefetch(...) {}
+//
+// Everywhere else (ARM, and the Mac), prefetching is a compiler builtin.  The hints keep their x86 meaning, from T0
+// (into every level of cache) to NTA.  See Simd.h for vector code.
+//
+#ifndef _MM_HINT_T0
+#define _MM_HINT_T0 3
+#define _MM_HINT_T1 2
+#define _MM_HINT_T2 1
+#define _MM_HINT_NTA 0
+#define _mm_prefetch(p, hint) __builtin_prefetch((const void *)(p), 0, (hint))
+#endif
+#if defined(__aarch64__)
+#define _mm_pause() __asm__ __volatile__("yield")
+#elif ! defined(__x86_64__) && ! defined(__i386__)
+#define _mm_pause() do {} while (0)
+#endif
 #endif
 
 typedef int64_t _int64;
@@ -135,10 +151,18 @@ inline bool _BitScanForward64(unsigned long *result, _uint64 x) {
     return x != 0;
 }
 
-// We implement SingleWaiterObject using a mutex because POSIX unnamed semaphores don't work on OS X
+// We implement SingleWaiterObject using a mutex because POSIX unnamed semaphores don't work on OS X.  On Linux, locks
+// and waiter objects are futexes instead (see Compat.cpp).
 class SingleWaiterObjectImpl;
 
+#ifdef __linux__
+struct FutexLock {
+    volatile int state;     // 0 free, 1 held, 2 held and maybe waited for
+};
+typedef FutexLock UnderlyingExclusiveLock;
+#else   // __linux__
 typedef pthread_mutex_t UnderlyingExclusiveLock;
+#endif  // __linux__
 typedef SingleWaiterObjectImpl *SingleWaiterObject; // "Single" means only one thread can wait on it at a time.
 
 class EventObjectImpl;
@@ -177,8 +201,28 @@ extern bool ReadFromNamedPipe(NamedPipe *pipe, char *outputBuffer, size_t output
 extern bool WriteToNamedPipe(NamedPipe *pipe, const char *stringToWrite);	// Null-terminated string
 extern void CloseNamedPipe(NamedPipe *pipe);
 
+//
+// The same, but for messages that can have nuls in them.  A message too big for the buffer is an error.
+//
+extern bool ReadBytesFromNamedPipe(NamedPipe *pipe, char *outputBuffer, size_t outputBufferSize, size_t *o_bytesRead);
+extern bool WriteBytesToNamedPipe(NamedPipe *pipe, const char *bytes, size_t length);
+
 extern const char *DEFAULT_NAMED_PIPE_NAME;
 
+//
+// A listening socket for daemon mode, so that several clients can talk to the daemon at once.  The address is
+// either [host:]port for TCP (just a port listens only on localhost) or the path of a Unix domain socket, which
+// replaces a socket but nothing else that's there.  There's no authentication, so a TCP host that isn't a loopback
+// address (like 0.0.0.0) needs allowRemote.  Each connection is a NamedPipe, and is read, written and closed with
+// the named pipe functions above.  Not implemented on Windows.
+//
+struct CommandSocket;
+
+extern CommandSocket *OpenCommandSocket(const char *address, bool allowRemote);
+extern NamedPipe *AcceptCommandConnection(CommandSocket *commandSocket);    // Blocks until a client connects
+extern NamedPipe *ConnectToCommandSocket(const char *address);              // The client side
+extern void CloseCommandSocket(CommandSocket *commandSocket);
+
 //
 // Get the time since some predefined time.  The predefined time must not change during any particular program run.
 //
@@ -187,7 +231,12 @@ _int64 timeInNanos();
 
 //#define PROFILE_WAIT
 
-void PrintWaitProfile();
+//
+// With PROFILE_WAIT, prints the time spent waiting at each call site.  On Linux, if printTotals is set, also prints
+// how often lock acquisitions and waits on waiter objects and events had to block, and for how long in all, which
+// the futex primitives always count, since they only have to when they block anyway.
+//
+void PrintWaitProfile(bool printTotals = false);
 
 
 //
@@ -343,6 +392,20 @@ void* InterlockedCompareExchangePointerAndReturnOldValue(void * volatile *valueT
 typedef void (*ThreadMainFunction) (void *threadMainFunctionParameter);
 bool StartNewThread(ThreadMainFunction threadMainFunction, void *threadMainFunctionParameter);
 void BindThreadToProcessor(unsigned processorNumber); // This hard binds a thread to a processor.  You can no-op it at some perf hit.
+void UnbindThreadFromProcessor(); // Lets the thread run on any of the process's processors again.
+
+//
+// Thread placement.  Bound threads don't go to processor threadNum, but to GetProcessorForThread(threadNum): the
+// processors in an order that gives the first threads a physical core each, round robin over the L3 caches (and so
+// over the sockets and NUMA nodes), and only puts threads on the cores' other SMT threads once every core has one.
+// ReserveHelperProcessors sets aside the last nProcessors in that order for the reader, decompression and compression
+// threads, which BindThreadToHelperProcessors lets run on any of those (and it does nothing if there aren't any); the
+// bound threads then only get the rest.  Where we can't read the topology, the order is just processor number.
+//
+void ReserveHelperProcessors(unsigned nProcessors);
+unsigned GetNumberOfHelperProcessors();
+unsigned GetProcessorForThread(unsigned threadNum);
+void BindThreadToHelperProcessors();
 #ifdef  _MSC_VER
 #define GetThreadId() GetCurrentThreadId()
 #else   // _MSC_VER
@@ -353,6 +416,61 @@ void SleepForMillis(unsigned millis);
 
 unsigned GetNumberOfProcessors();
 
+//
+// Whether the processor (and the operating system) support the SSSE3 instructions, the AVX2 instructions, and the AVX-512
+// foundation instructions, for code that picks a vector version at run time.
+//
+bool ProcessorSupportsSSSE3();
+bool ProcessorSupportsAVX2();
+bool ProcessorSupportsAVX512F();
+
+//
+// NUMA support.  Nodes are numbered 0 .. GetNumberOfNumaNodes() - 1.  Systems without NUMA (or where we can't tell)
+// have one node with all of the processors on it.  InterleaveMemoryAcrossNumaNodes sets the policy for memory that
+// hasn't been touched yet to spread its pages round robin over all of the nodes.  It returns false if it can't (which
+// includes there only being one node), in which case pages will wind up wherever they're first touched.
+// GetNumaNodeOfCurrentThread is the node of the processor the calling thread is running on right now, which for a thread
+// that isn't bound to a processor can change at any time.
+//
+unsigned GetNumberOfNumaNodes();
+unsigned GetNumaNodeOfProcessor(unsigned processorNumber);
+unsigned GetNumaNodeOfCurrentThread();
+bool InterleaveMemoryAcrossNumaNodes(void *memory, size_t size);
+
+_int64 GetPhysicalMemorySize(); // In bytes, or 0 if we can't tell
+
+//
+// The limits of the container (Linux cgroup, v2 or v1) this process runs in: the processors its CPU quota and affinity
+// allow (the quota rounded up), and its memory limit in bytes.  Each is 0 if there isn't a limit, or we can't tell.
+//
+unsigned GetContainerProcessorLimit();
+_int64 GetContainerMemoryLimit();
+
+//
+// The most memory this process has had resident at once, in bytes, and the processor time (user plus system) used by all
+// of its threads so far.  Both return 0 if we can't tell.
+//
+_int64 GetPeakMemoryUsage();
+_int64 GetProcessCPUTimeInMillis();
+
+//
+// A directory whose files are kept in memory (/dev/shm on Linux) rather than on disk, so that any number of processes
+// can map a file there and share one copy of its pages.  Returns NULL if there isn't one on this system.
+//
+const char *GetSharedMemoryDirectory();
+
+//
+// An exclusive lock between processes on the named file, which is created if it isn't there.  Acquiring it waits until no
+// other process holds it, and it's dropped if the holder exits without releasing it.  Returns NULL if the file can't be
+// opened or locked.
+//
+struct InterprocessFileLock;
+InterprocessFileLock *AcquireInterprocessFileLock(const char *lockFileName);
+void ReleaseInterprocessFileLock(InterprocessFileLock *lock);
+
+// Fills in buffer with the absolute form of path.  Returns false if it can't, including if the buffer is too small.
+bool GetCanonicalPathName(const char *path, char *buffer, size_t bufferSize);
+
 _int64 QueryFileSize(const char *fileName);
 
 // returns true on success
@@ -361,6 +479,13 @@ bool DeleteSingleFile(const char* filename); // DeleteFile is a Windows macro...
 // returns true on success
 bool MoveSingleFile(const char* oldFileName, const char* newFileName);
 
+//
+// Copy the first bytes bytes of fromFileName over toFileName (which must already exist) starting at toOffset.  On Linux
+// the kernel does it (copy_file_range), so the data doesn't come through our memory, and some file systems just share
+// the blocks.  Returns true on success.
+//
+bool CopyFileRange(const char* fromFileName, const char* toFileName, _int64 toOffset, _int64 bytes);
+
 class LargeFileHandle;
 
 // open binary file, supports "r" for read, "w" for rewrite/create, "a" for append
@@ -375,10 +500,12 @@ void CloseLargeFile(LargeFileHandle* file);
 
 // open and close memory mapped files
 // currently just readonly, could add flags for r/w if necessary
+// largePages asks for the mapping to be backed by huge pages where the OS can do that for mapped files.  Files on a
+// Linux hugetlbfs mount always are, regardless of largePages.
 
 class MemoryMappedFile;
 
-MemoryMappedFile* OpenMemoryMappedFile(const char* filename, size_t offset, size_t length, void** o_contents, bool write = false, bool sequential = false);
+MemoryMappedFile* OpenMemoryMappedFile(const char* filename, size_t offset, size_t length, void** o_contents, bool write = false, bool sequential = false, bool largePages = false);
 
 // closes and deallocates the file structure
 void CloseMemoryMappedFile(MemoryMappedFile* mappedFile);
@@ -386,6 +513,14 @@ void CloseMemoryMappedFile(MemoryMappedFile* mappedFile);
 //
 void AdviseMemoryMappedFilePrefetch(const MemoryMappedFile *mappedFile);
 
+// Fault in the pages of (part of) a mapping without touching each of them, where the OS can (MADV_POPULATE_READ
+// on Linux 5.14 and later).  Returns false if it can't, in which case the caller should touch them.
+bool PopulateMappedMemory(const void *address, size_t length);
+
+// Ask the OS to start reading in the pages of (part of) a file mapping that aren't in memory, without waiting for them,
+// so that touching them later doesn't take a synchronous fault.  A hint; it does nothing where the OS can't do that.
+void StartPagingIn(const void *address, size_t length);
+
 class AsyncFile
 {
 public:
@@ -429,8 +564,77 @@ public:
 
     // get a new reader, e.g. for another thread to use
     virtual Reader* getReader() = 0;
+
+    // Open files with io_uring from now on (on Linux), so each writer's writes run concurrently with the others'.
+    // Returns false if it isn't available.
+    static bool UseIoUring();
+
+    // Have writers drop what they've written from the page cache once it's on disk (on Linux), so writing a big
+    // output doesn't push out something more valuable, like a -map index
+    static bool DropBehind;
+
+    // Opening this file to write gives one that throws away what's written, counting it in DiscardedBytes, so the
+    // output can be produced without storage in the way (-discardOutput).  NULL for none.
+    static const char *DiscardWritesTo;
+    static volatile _int64 DiscardedBytes;
+};
+
+#ifdef __linux__
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct iovec;
+
+//
+// A bare io_uring, talking to the kernel with the system calls rather than through liburing, since all we need is to
+// submit reads and writes and collect their completions.  It's not thread safe; each user either has its own or
+// keeps it under a lock.
+//
+class IoUring
+{
+public:
+    IoUring() : ringFd(-1), sqRing(NULL), cqRing(NULL), sqes(NULL) {}
+
+    ~IoUring();
+
+    bool init(unsigned entries);
+
+    // Register buffers, so that reads into buffer i can use IORING_OP_READ_FIXED with fixedIndex i
+    bool registerBuffers(iovec* buffers, unsigned count);
+
+    // Queue a read or write; it doesn't go to the kernel until submit.  fixedIndex is -1 for an unregistered buffer.
+    // The caller mustn't have more outstanding than the ring has entries.
+    void queueRead(int fd, void* buffer, unsigned bytes, _int64 offset, _uint64 userData, int fixedIndex = -1);
+    void queueWrite(int fd, const void* buffer, unsigned bytes, _int64 offset, _uint64 userData);
+
+    void submit();
+
+    // Wait for the next completion
+    void waitForCompletion(_uint64* o_userData, int* o_result);
+
+private:
+    void queue(unsigned char opcode, int fd, const void* buffer, unsigned bytes, _int64 offset, _uint64 userData, int fixedIndex);
+
+    int                 ringFd;
+    unsigned            toSubmit;
+
+    void*               sqRing;
+    size_t              sqRingSize;
+    void*               cqRing;
+    size_t              cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t              sqesSize;
+
+    unsigned*           sqTail;
+    unsigned            sqMask;
+    unsigned*           sqArray;
+    unsigned*           cqHead;
+    unsigned*           cqTail;
+    unsigned            cqMask;
+    struct io_uring_cqe* cqes;
 };
 
+#endif // __linux__
+
 
 //
 // Macro for counting trailing zeros of a 64-bit value
@@ -439,10 +643,12 @@ public:
 #define CountLeadingZeroes(x, ans) {_BitScanReverse64(&ans, x);}
 #define CountTrailingZeroes(x, ans) {_BitScanForward64(&ans, x);}
 #define ByteSwapUI64(x) (_byteswap_uint64(x))
+#define CountOneBits(x) ((int)__popcnt64(x))
 #else
 #define CountLeadingZeroes(x, ans) {ans = __builtin_clzll(x);}
 #define CountTrailingZeroes(x, ans) {ans = __builtin_ctzll(x);}
 #define ByteSwapUI64(x) (__builtin_bswap64(x))
+#define CountOneBits(x) (__builtin_popcountll(x))
 #endif
 
 //
@@ -450,6 +656,7 @@ public:
 //
 
 int _fseek64bit(FILE *stream, _int64 offset, int origin);
+_int64 _ftell64bit(FILE *stream);
 
 #ifndef _MSC_VER
 
@@ -480,6 +687,11 @@ public:
     // MUST call unmap on each token out of createMapping, the destructor WILL NOT cleanup
     void unmap(void* token);
 
+    // done with length bytes of a mapping at address (which is fileOffset in the file), so drop them from memory
+    // and from the page cache rather than let them push out something that's still wanted; only whole pages within
+    // the range go, and touching them again just reads them back in
+    void dropPages(const char* address, size_t fileOffset, size_t length);
+
 private:
     bool        initialized;
     const char* fileName;
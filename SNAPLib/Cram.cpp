@@ -0,0 +1,3752 @@
+/*++
+
+Module Name:
+
+    Cram.cpp
+
+Abstract:
+
+    CRAM 3.0 file writer, and CRAM 2.1 and 3.0 reader.  See Cram.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "Cram.h"
+#include "Bam.h"
+#include "FileFormat.h"
+#include "ParallelTask.h"
+#include "zlib.h"
+#include "exit.h"
+#include "Error.h"
+#include "SAM.h"
+#include "Tables.h"
+#include "ReadSupplierQueue.h"
+#include "ProgressReport.h"
+#include "StageTiming.h"
+#include "PipelineTrace.h"
+
+using std::min;
+using std::max;
+
+    void
+CramBuffer::putItf8(
+    _int32 signedValue)
+/*++
+
+Routine Description:
+
+    Append a 32 bit integer in ITF8: the number of leading one bits in the first byte says how many more follow,
+    and negative numbers always take all five.
+
+--*/
+{
+    _uint32 value = (_uint32) signedValue;
+    _uint8* p = (_uint8*) reserve(5);
+    if (value < (1 << 7)) {
+        p[0] = (_uint8) value;
+        used += 1;
+    } else if (value < (1 << 14)) {
+        p[0] = (_uint8) (0x80 | (value >> 8)); p[1] = (_uint8) value;
+        used += 2;
+    } else if (value < (1 << 21)) {
+        p[0] = (_uint8) (0xc0 | (value >> 16)); p[1] = (_uint8) (value >> 8); p[2] = (_uint8) value;
+        used += 3;
+    } else if (value < (1 << 28)) {
+        p[0] = (_uint8) (0xe0 | (value >> 24)); p[1] = (_uint8) (value >> 16); p[2] = (_uint8) (value >> 8); p[3] = (_uint8) value;
+        used += 4;
+    } else {
+        // only the low four bits of the last byte count
+        p[0] = (_uint8) (0xf0 | (value >> 28)); p[1] = (_uint8) (value >> 20); p[2] = (_uint8) (value >> 12); p[3] = (_uint8) (value >> 4);
+        p[4] = (_uint8) (value & 0xf);
+        used += 5;
+    }
+}
+
+    void
+CramBuffer::putLtf8(
+    _int64 signedValue)
+/*++
+
+Routine Description:
+
+    Append a 64 bit integer in LTF8, which is ITF8 carried on to nine bytes.
+
+--*/
+{
+    _uint64 value = (_uint64) signedValue;
+    int extra = 0;
+    while (extra < 8 && value >= (1ULL << (7 - extra + 8 * extra))) {
+        extra++;
+    }
+    _uint8* p = (_uint8*) reserve(9);
+    if (extra == 8) {
+        p[0] = 0xff;
+    } else {
+        p[0] = (_uint8) ((0xff00 >> extra) | (value >> (8 * extra)));
+    }
+    for (int i = 1; i <= extra; i++) {
+        p[i] = (_uint8) (value >> (8 * (extra - i)));
+    }
+    used += 1 + extra;
+}
+
+//
+// MD5 (RFC 1321), for the M5 of each reference and the reference span of each slice.
+//
+class CramMd5
+{
+public:
+    CramMd5();
+
+    void update(const void* data, size_t bytes);
+
+    // update with bases from the genome, in upper case as the spec asks
+    void updateBases(const char* bases, size_t count);
+
+    void finish(_uint8* o_digest/*[16]*/);
+
+    static void toHex(const _uint8* digest, char* o_hex/*[33]*/);
+
+private:
+    void transform(const _uint8* block);
+
+    _uint32 state[4];
+    _uint64 length;
+    _uint8 buffer[64];
+
+    static _uint32 K[64];
+    static bool initialized;
+};
+
+_uint32 CramMd5::K[64];
+bool CramMd5::initialized = false;
+
+CramMd5::CramMd5()
+    : length(0)
+{
+    if (! initialized) {
+        // floor(abs(sin(i + 1)) * 2^32), which doubles get exactly right
+        for (int i = 0; i < 64; i++) {
+            K[i] = (_uint32) (_uint64) (fabs(sin((double) (i + 1))) * 4294967296.0);
+        }
+        initialized = true;
+    }
+    state[0] = 0x67452301;
+    state[1] = 0xefcdab89;
+    state[2] = 0x98badcfe;
+    state[3] = 0x10325476;
+}
+
+    void
+CramMd5::transform(
+    const _uint8* block)
+{
+    static const int R[64] = {
+        7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+        5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+        6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+    };
+    _uint32 m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = block[4 * i] | (block[4 * i + 1] << 8) | (block[4 * i + 2] << 16) | ((_uint32) block[4 * i + 3] << 24);
+    }
+    _uint32 a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; i++) {
+        _uint32 f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        _uint32 t = d;
+        d = c;
+        c = b;
+        _uint32 x = a + f + K[i] + m[g];
+        b = b + ((x << R[i]) | (x >> (32 - R[i])));
+        a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+    void
+CramMd5::update(
+    const void* data,
+    size_t bytes)
+{
+    const _uint8* p = (const _uint8*) data;
+    while (bytes > 0) {
+        size_t offset = (size_t) (length % 64);
+        size_t n = min(bytes, 64 - offset);
+        memcpy(buffer + offset, p, n);
+        length += n;
+        p += n;
+        bytes -= n;
+        if (offset + n == 64) {
+            transform(buffer);
+        }
+    }
+}
+
+    void
+CramMd5::updateBases(
+    const char* bases,
+    size_t count)
+{
+    char upper[4096];
+    while (count > 0) {
+        size_t n = min(count, sizeof(upper));
+        for (size_t i = 0; i < n; i++) {
+            upper[i] = (char) toupper(bases[i]);
+        }
+        update(upper, n);
+        bases += n;
+        count -= n;
+    }
+}
+
+    void
+CramMd5::finish(
+    _uint8* o_digest)
+{
+    _uint64 bits = length * 8;
+    static const _uint8 pad[64] = {0x80};
+    update(pad, 1 + (55 - length % 64 + 64) % 64);
+    _uint8 size[8];
+    for (int i = 0; i < 8; i++) {
+        size[i] = (_uint8) (bits >> (8 * i));
+    }
+    update(size, 8);
+    _ASSERT(length % 64 == 0);
+    for (int i = 0; i < 16; i++) {
+        o_digest[i] = (_uint8) (state[i / 4] >> (8 * (i % 4)));
+    }
+}
+
+    void
+CramMd5::toHex(
+    const _uint8* digest,
+    char* o_hex)
+{
+    for (int i = 0; i < 16; i++) {
+        sprintf(o_hex + 2 * i, "%02x", digest[i]);
+    }
+}
+
+//
+// CRAM block compression methods & content types
+//
+static const int CramRaw = 0;
+static const int CramGzip = 1;
+static const int CramRans = 4;
+
+static const int CramFileHeaderBlock = 0;
+static const int CramCompressionHeaderBlock = 1;
+static const int CramSliceHeaderBlock = 2;
+static const int CramExternalBlock = 4;
+static const int CramCoreBlock = 5;
+
+    bool
+RansEncode0(
+    const _uint8* in,
+    size_t inSize,
+    CramBuffer* out)
+/*++
+
+Routine Description:
+
+    Compress with order 0 rANS, four way interleaved, in the layout htslib and the spec use: the order, compressed & raw
+    sizes, the run length coded frequency table and the four states followed by the renormalization bytes.
+
+Return Value:
+
+    false if the data can't be coded (too short, or a frequency table that won't normalize)
+
+--*/
+{
+    const int TF_SHIFT = 12;
+    const _uint32 TOTFREQ = 1 << TF_SHIFT;
+    const _uint32 RANS_BYTE_L = 1 << 23;
+
+    if (inSize < 4 || inSize > 0x7fffffff) {
+        return false;
+    }
+    _uint32 F[256], C[256];
+    memset(F, 0, sizeof(F));
+    for (size_t i = 0; i < inSize; i++) {
+        F[in[i]]++;
+    }
+
+    // normalize to TOTFREQ, exactly as htslib does (including that the total comes out one short)
+    _uint64 tr = ((_uint64) TOTFREQ << 31) / inSize + (1 << 30) / inSize;
+    _uint32 maxCount = 0, fsum = 0;
+    int M = 0;
+    for (int j = 0; j < 256; j++) {
+        if (F[j] == 0) {
+            continue;
+        }
+        if (maxCount < F[j]) {
+            maxCount = F[j];
+            M = j;
+        }
+        F[j] = (_uint32) ((F[j] * tr) >> 31);
+        if (F[j] == 0) {
+            F[j] = 1;
+        }
+        fsum += F[j];
+    }
+    fsum++;
+    if (fsum < TOTFREQ) {
+        F[M] += TOTFREQ - fsum;
+    } else if (fsum - TOTFREQ < F[M]) {
+        F[M] -= fsum - TOTFREQ;
+    } else {
+        return false;
+    }
+
+    size_t start = out->getUsed();
+    out->putByte(0);    // order
+    out->putUint32(0);  // compressed size, filled in below
+    out->putUint32((_uint32) inSize);
+
+    // frequency table: a symbol, then (when the one before was also there) how many more in a row follow, which are
+    // listed without their symbols, and a zero at the end
+    int rle = 0;
+    for (int j = 0, x = 0; j < 256; j++) {
+        C[j] = x;
+        if (F[j] == 0) {
+            continue;
+        }
+        x += F[j];
+        if (rle > 0) {
+            rle--;
+        } else {
+            out->putByte((_uint8) j);
+            if (j > 0 && F[j - 1] != 0) {
+                for (rle = j + 1; rle < 256 && F[rle] != 0; rle++) {
+                }
+                rle -= j + 1;
+                out->putByte((_uint8) rle);
+            }
+        }
+        if (F[j] < 128) {
+            out->putByte((_uint8) F[j]);
+        } else {
+            out->putByte((_uint8) (0x80 | (F[j] >> 8)));
+            out->putByte((_uint8) F[j]);
+        }
+    }
+    out->putByte(0);
+
+    // encode backwards from the end of a scratch area big enough for the worst case (12 bits a symbol)
+    size_t bound = inSize + inSize / 2 + 64;
+    _uint8* end = (_uint8*) out->reserve(bound) + bound;
+    _uint8* ptr = end;
+    _uint32 R[4] = {RANS_BYTE_L, RANS_BYTE_L, RANS_BYTE_L, RANS_BYTE_L};
+    for (size_t i = inSize; i-- > 0; ) {
+        _uint32 f = F[in[i]];
+        _uint32 x = R[i & 3];
+        _uint64 xMax = (_uint64) ((RANS_BYTE_L >> TF_SHIFT) << 8) * f;
+        while (x >= xMax) {
+            *--ptr = (_uint8) x;
+            x >>= 8;
+        }
+        R[i & 3] = ((x / f) << TF_SHIFT) + (x % f) + C[in[i]];
+    }
+    for (int j = 3; j >= 0; j--) {
+        ptr -= 4;
+        ptr[0] = (_uint8) R[j]; ptr[1] = (_uint8) (R[j] >> 8); ptr[2] = (_uint8) (R[j] >> 16); ptr[3] = (_uint8) (R[j] >> 24);
+    }
+    size_t encoded = end - ptr;
+    char* dest = out->getData() + out->getUsed();
+    memmove(dest, ptr, encoded);
+    out->advance(encoded);
+
+    _uint32 compressed = (_uint32) (out->getUsed() - start - 9);
+    _uint8* sizeField = (_uint8*) out->getData() + start + 1;
+    sizeField[0] = (_uint8) compressed; sizeField[1] = (_uint8) (compressed >> 8);
+    sizeField[2] = (_uint8) (compressed >> 16); sizeField[3] = (_uint8) (compressed >> 24);
+    return true;
+}
+
+    static void
+WriteBlock(
+    CramBuffer* out,
+    int method,
+    int contentType,
+    int contentId,
+    const char* data,
+    size_t bytes,
+    size_t rawBytes)
+{
+    size_t start = out->getUsed();
+    out->putByte((_uint8) method);
+    out->putByte((_uint8) contentType);
+    out->putItf8(contentId);
+    out->putItf8((_int32) bytes);
+    out->putItf8((_int32) rawBytes);
+    out->putBytes(data, bytes);
+    out->putUint32(crc32(0, (const Bytef*) out->getData() + start, (uInt) (out->getUsed() - start)));
+}
+
+    static void
+WriteContainerHeader(
+    CramBuffer* out,
+    size_t length,
+    int refId,
+    _int64 start,
+    _int64 span,
+    int nRecords,
+    _int64 recordCounter,
+    _int64 bases,
+    int nBlocks,
+    int nLandmarks,
+    const _int32* landmarks)
+{
+    size_t begin = out->getUsed();
+    out->putUint32((_uint32) length);
+    out->putItf8(refId);
+    out->putItf8((_int32) start);
+    out->putItf8((_int32) span);
+    out->putItf8(nRecords);
+    out->putLtf8(recordCounter);
+    out->putLtf8(bases);
+    out->putItf8(nBlocks);
+    out->putItf8(nLandmarks);
+    for (int i = 0; i < nLandmarks; i++) {
+        out->putItf8(landmarks[i]);
+    }
+    out->putUint32(crc32(0, (const Bytef*) out->getData() + begin, (uInt) (out->getUsed() - begin)));
+}
+
+//
+// Data series, each in the external block with content id one more than its index here.
+//
+enum CramSeries {
+    CramBF, CramCF, CramRI, CramRL, CramAP, CramRG, CramRN, CramMF, CramNS, CramNP, CramTS, CramTL,
+    CramFN, CramFC, CramFP, CramDL, CramBA, CramQS, CramBS, CramIN, CramSC, CramRS, CramPD, CramHC, CramMQ,
+    CramNumSeries
+};
+
+static const char CramSeriesNames[] = "BFCFRIRLAPRGRNMFNSNPTSTLFNFCFPDLBAQSBSINSCRSPDHCMQ";
+
+static const _uint8 CramByteArrayStop = '\t'; // ends read names, insertions & soft clips, none of which can contain it
+
+//
+// Encodes a run of BAM records into a container.  One per worker, so its buffers are reused.
+//
+class CramSliceEncoder
+{
+public:
+    CramSliceEncoder();
+
+    ~CramSliceEncoder();
+
+    void encode(CramWriterFilterSupplier* supplier, char* records, size_t bytes, int nRecords, _int64 recordCounter,
+        CramBuffer* o_output, int* o_refId, _int64* o_start, _int64* o_span, size_t* o_sliceOffset, size_t* o_sliceSize);
+
+private:
+    void encodeRecord(BAMAlignment* bam, bool multiRef);
+
+    void encodeFeatures(BAMAlignment* bam);
+
+    int tagLine(BAMAlignment* bam);
+
+    CramBuffer* tagBuffer(_uint32 key);
+
+    // external block, compressed whichever way is smallest
+    void writeExternal(CramBuffer* out, int contentId, CramBuffer* raw);
+
+    void writeCompressionHeader(CramBuffer* out);
+
+    const Genome* genome;
+    const CramWriterFilterSupplier::ContigInfo* contigs;
+    int nContigs;
+
+    CramBuffer series[CramNumSeries];
+    CramBuffer bases; // of the current read, in ASCII
+
+    // tag lines: keys (tag << 8 | type), lines[i] start at lineStarts[i] for lineStarts[i+1]-lineStarts[i] of them
+    VariableSizeVector<_uint32> lineKeys;
+    VariableSizeVector<int> lineStarts;
+    VariableSizeVector<_uint32> recordKeys;
+
+    struct TagBuffer {
+        _uint32 key;
+        CramBuffer* buffer;
+    };
+    VariableSizeVector<TagBuffer> tags; // one buffer per tag key & type used in this slice; buffers are kept around
+    int nTags;
+
+    CramBuffer blocks, compressed;
+    z_stream zstream;
+};
+
+CramSliceEncoder::CramSliceEncoder()
+    : nTags(0)
+{
+    zstream.zalloc = Z_NULL;
+    zstream.zfree = Z_NULL;
+    zstream.opaque = Z_NULL;
+    if (deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        WriteErrorMessage("CRAM: unable to initialize zlib\n");
+        soft_exit(1);
+    }
+}
+
+CramSliceEncoder::~CramSliceEncoder()
+{
+    deflateEnd(&zstream);
+    for (int i = 0; i < tags.size(); i++) {
+        delete tags[i].buffer;
+    }
+}
+
+    CramBuffer*
+CramSliceEncoder::tagBuffer(
+    _uint32 key)
+{
+    for (int i = 0; i < nTags; i++) {
+        if (tags[i].key == key) {
+            return tags[i].buffer;
+        }
+    }
+    if (nTags == tags.size()) {
+        TagBuffer t;
+        t.buffer = new CramBuffer();
+        tags.push_back(t);
+    }
+    tags[nTags].key = key;
+    tags[nTags].buffer->clear();
+    return tags[nTags++].buffer;
+}
+
+    int
+CramSliceEncoder::tagLine(
+    BAMAlignment* bam)
+/*++
+
+Routine Description:
+
+    Find (or add) the tag line for the tags this record has, in order, and put their values in their blocks.
+
+--*/
+{
+    recordKeys.clear();
+    for (BAMAlignAux* aux = bam->firstAux(); aux < bam->endAux(); aux = aux->next()) {
+        _uint32 key = ((_uint8) aux->tag[0] << 16) | ((_uint8) aux->tag[1] << 8) | (_uint8) aux->val_type;
+        recordKeys.push_back(key);
+        size_t valueBytes = aux->size() - 3;
+        CramBuffer* buffer = tagBuffer(key);
+        buffer->putItf8((_int32) valueBytes);
+        buffer->putBytes(aux->value(), valueBytes);
+    }
+    int nLines = (int) lineStarts.size() - 1;
+    for (int i = 0; i < nLines; i++) {
+        int n = lineStarts[i + 1] - lineStarts[i];
+        if (n == recordKeys.size() && (n == 0 || memcmp(&lineKeys[lineStarts[i]], &recordKeys[0], n * sizeof(_uint32)) == 0)) {
+            return i;
+        }
+    }
+    for (int i = 0; i < recordKeys.size(); i++) {
+        lineKeys.push_back(recordKeys[i]);
+    }
+    lineStarts.push_back((int) lineKeys.size());
+    return nLines;
+}
+
+    void
+CramSliceEncoder::encodeFeatures(
+    BAMAlignment* bam)
+/*++
+
+Routine Description:
+
+    Write the read features of a mapped read: where it differs from the reference, and the cigar operations that
+    aren't matches.  Positions are 1-based in the read, each a delta from the one before.
+
+--*/
+{
+    int length = bam->l_seq;
+    _uint8* qual = (_uint8*) bam->qual();
+    char* readBases = bases.getData();
+    const Genome::Contig* contig = &genome->getContigs()[bam->refID];
+    GenomeDistance refLength = bam->n_cigar_op > 0 ? bam->l_ref() : length;
+    const char* ref = (bam->pos + refLength <= contigs[bam->refID].length)
+        ? genome->getSubstring(contig->beginningLocation + bam->pos, refLength) : NULL;
+
+    _uint32 wholeRead = (length << 4); // a read with no cigar is all M
+    _uint32* cigar = bam->n_cigar_op > 0 ? bam->cigar() : &wholeRead;
+    int nOps = bam->n_cigar_op > 0 ? bam->n_cigar_op : (length > 0 ? 1 : 0);
+
+    int readPos = 0, lastPosition = 0, nFeatures = 0;
+    GenomeDistance refPos = 0;
+#define CRAM_FEATURE(code, position) \
+    { series[CramFC].putByte(code); series[CramFP].putItf8((position) - lastPosition); lastPosition = (position); nFeatures++; }
+
+    for (int i = 0; i < nOps; i++) {
+        int op = BAMAlignment::GetCigarOpCode(cigar[i]);
+        int count = BAMAlignment::GetCigarOpCount(cigar[i]);
+        switch (BAMAlignment::CodeToCigar[op]) {
+        case 'M':
+        case '=':
+        case 'X':
+            for (int k = 0; k < count && readPos + k < length; k++) {
+                char b = readBases[readPos + k];
+                char r = ref != NULL ? (char) toupper(ref[refPos + k]) : 0;
+                if (b == r) {
+                    continue;
+                }
+                const char* ACGTN = "ACGTN";
+                if (r != 0 && strchr(ACGTN, r) != NULL && strchr(ACGTN, b) != NULL) {
+                    // base substitution: the index of the read base among the other four, in ACGTN order
+                    int code = 0;
+                    for (const char* s = ACGTN; *s != b; s++) {
+                        if (*s != r) {
+                            code++;
+                        }
+                    }
+                    CRAM_FEATURE('X', readPos + k + 1);
+                    series[CramBS].putByte((_uint8) code);
+                } else {
+                    CRAM_FEATURE('B', readPos + k + 1);
+                    series[CramBA].putByte(b);
+                    series[CramQS].putByte(qual[readPos + k]);
+                }
+            }
+            readPos += count;
+            refPos += count;
+            break;
+
+        case 'I':
+            CRAM_FEATURE('I', readPos + 1);
+            series[CramIN].putBytes(readBases + readPos, count);
+            series[CramIN].putByte(CramByteArrayStop);
+            readPos += count;
+            break;
+
+        case 'S':
+            CRAM_FEATURE('S', readPos + 1);
+            series[CramSC].putBytes(readBases + readPos, count);
+            series[CramSC].putByte(CramByteArrayStop);
+            readPos += count;
+            break;
+
+        case 'D':
+            CRAM_FEATURE('D', readPos + 1);
+            series[CramDL].putItf8(count);
+            refPos += count;
+            break;
+
+        case 'N':
+            CRAM_FEATURE('N', readPos + 1);
+            series[CramRS].putItf8(count);
+            refPos += count;
+            break;
+
+        case 'H':
+            CRAM_FEATURE('H', readPos + 1);
+            series[CramHC].putItf8(count);
+            break;
+
+        case 'P':
+            CRAM_FEATURE('P', readPos + 1);
+            series[CramPD].putItf8(count);
+            break;
+        }
+    }
+#undef CRAM_FEATURE
+    series[CramFN].putItf8(nFeatures);
+}
+
+    void
+CramSliceEncoder::encodeRecord(
+    BAMAlignment* bam,
+    bool multiRef)
+{
+    int length = bam->l_seq;
+    series[CramBF].putItf8(bam->FLAG);
+    series[CramCF].putItf8(0x3); // quality scores stored as an array, mate detached
+    if (multiRef) {
+        series[CramRI].putItf8(bam->refID);
+    }
+    series[CramRL].putItf8(length);
+    series[CramAP].putItf8(bam->pos + 1);
+    series[CramRG].putItf8(-1); // read groups are left in the RG tag
+    series[CramRN].putBytes(bam->read_name(), bam->l_read_name - 1);
+    series[CramRN].putByte(CramByteArrayStop);
+    series[CramMF].putItf8(((bam->FLAG & SAM_NEXT_REVERSED) ? 0x1 : 0) | ((bam->FLAG & SAM_NEXT_UNMAPPED) ? 0x2 : 0));
+    series[CramNS].putItf8(bam->next_refID);
+    series[CramNP].putItf8(bam->next_pos + 1);
+    series[CramTS].putItf8(bam->tlen);
+    series[CramTL].putItf8(tagLine(bam));
+
+    BAMAlignment::decodeSeq(bases.reserve(length + 1), bam->seq(), length);
+    if (! (bam->FLAG & SAM_UNMAPPED) && bam->refID >= 0 && bam->refID < nContigs) {
+        encodeFeatures(bam);
+        series[CramMQ].putItf8(bam->MAPQ);
+    } else {
+        series[CramBA].putBytes(bases.getData(), length);
+    }
+    series[CramQS].putBytes(bam->qual(), length);
+}
+
+    void
+CramSliceEncoder::writeExternal(
+    CramBuffer* out,
+    int contentId,
+    CramBuffer* raw)
+{
+    size_t rawBytes = raw->getUsed();
+    int method = CramRaw;
+    const char* data = raw->getData();
+    size_t bytes = rawBytes;
+
+    compressed.clear();
+    if (RansEncode0((const _uint8*) raw->getData(), rawBytes, &compressed) && compressed.getUsed() < bytes) {
+        method = CramRans;
+        data = compressed.getData();
+        bytes = compressed.getUsed();
+    }
+
+    // gzip after rANS, into the same buffer
+    size_t bound = deflateBound(&zstream, (uLong) rawBytes);
+    char* dest = compressed.reserve(bound);
+    data = method == CramRans ? compressed.getData() : data; // reserve may have moved it
+    deflateReset(&zstream);
+    zstream.next_in = (Bytef*) raw->getData();
+    zstream.avail_in = (uInt) rawBytes;
+    zstream.next_out = (Bytef*) dest;
+    zstream.avail_out = (uInt) bound;
+    if (deflate(&zstream, Z_FINISH) == Z_STREAM_END && zstream.total_out < bytes) {
+        method = CramGzip;
+        data = dest;
+        bytes = zstream.total_out;
+    }
+
+    WriteBlock(out, method, CramExternalBlock, contentId, data, bytes, rawBytes);
+}
+
+    void
+CramSliceEncoder::writeCompressionHeader(
+    CramBuffer* out)
+/*++
+
+Routine Description:
+
+    The preservation map (names kept, absolute positions, the reference required, the substitution matrix, the tag
+    lines), and the encodings: every data series and tag goes to an external block of its own.
+
+--*/
+{
+    CramBuffer header, map;
+
+    // preservation map
+    map.putItf8(5);
+    map.putBytes("RN", 2); map.putByte(1);
+    map.putBytes("AP", 2); map.putByte(0);
+    map.putBytes("RR", 2); map.putByte(1);
+    // substitutions in ACGTN order for each reference base, coded 0 to 3
+    map.putBytes("SM", 2);
+    for (int i = 0; i < 5; i++) {
+        map.putByte(0x1b);
+    }
+    CramBuffer td;
+    for (int i = 0; i + 1 < lineStarts.size(); i++) {
+        for (int k = lineStarts[i]; k < lineStarts[i + 1]; k++) {
+            td.putByte((_uint8) (lineKeys[k] >> 16));
+            td.putByte((_uint8) (lineKeys[k] >> 8));
+            td.putByte((_uint8) lineKeys[k]);
+        }
+        td.putByte(0);
+    }
+    map.putBytes("TD", 2);
+    map.putItf8((_int32) td.getUsed());
+    map.putBytes(td.getData(), td.getUsed());
+    header.putItf8((_int32) map.getUsed());
+    header.putBytes(map.getData(), map.getUsed());
+
+    // data series encodings
+    map.clear();
+    map.putItf8(CramNumSeries);
+    for (int i = 0; i < CramNumSeries; i++) {
+        map.putBytes(CramSeriesNames + 2 * i, 2);
+        if (i == CramRN || i == CramIN || i == CramSC) {
+            CramBuffer params;
+            params.putByte(CramByteArrayStop);
+            params.putItf8(i + 1);
+            map.putItf8(5); // BYTE_ARRAY_STOP
+            map.putItf8((_int32) params.getUsed());
+            map.putBytes(params.getData(), params.getUsed());
+        } else {
+            CramBuffer params;
+            params.putItf8(i + 1);
+            map.putItf8(1); // EXTERNAL
+            map.putItf8((_int32) params.getUsed());
+            map.putBytes(params.getData(), params.getUsed());
+        }
+    }
+    header.putItf8((_int32) map.getUsed());
+    header.putBytes(map.getData(), map.getUsed());
+
+    // tag encodings: the length and then the bytes as they are in BAM, both in the tag's block
+    map.clear();
+    map.putItf8(nTags);
+    for (int i = 0; i < nTags; i++) {
+        _uint32 key = tags[i].key;
+        CramBuffer external, params;
+        external.putItf8(key);
+        for (int j = 0; j < 2; j++) {
+            params.putItf8(1); // EXTERNAL
+            params.putItf8((_int32) external.getUsed());
+            params.putBytes(external.getData(), external.getUsed());
+        }
+        map.putItf8(key);
+        map.putItf8(4); // BYTE_ARRAY_LEN
+        map.putItf8((_int32) params.getUsed());
+        map.putBytes(params.getData(), params.getUsed());
+    }
+    header.putItf8((_int32) map.getUsed());
+    header.putBytes(map.getData(), map.getUsed());
+
+    WriteBlock(out, CramRaw, CramCompressionHeaderBlock, 0, header.getData(), header.getUsed(), header.getUsed());
+}
+
+    void
+CramSliceEncoder::encode(
+    CramWriterFilterSupplier* supplier,
+    char* records,
+    size_t bytes,
+    int nRecords,
+    _int64 recordCounter,
+    CramBuffer* o_output,
+    int* o_refId,
+    _int64* o_start,
+    _int64* o_span,
+    size_t* o_sliceOffset,
+    size_t* o_sliceSize)
+/*++
+
+Routine Description:
+
+    Append a container with one slice of the given records to the output, and return what goes in its index entry.
+
+--*/
+{
+    genome = supplier->genome;
+    contigs = supplier->contigs;
+    nContigs = supplier->nContigs;
+
+    // where the slice is on the reference, if it's all on one
+    int refId = -3;
+    _int64 start = 0, end = 0, totalBases = 0;
+    for (char* p = records; p < records + bytes; p += ((BAMAlignment*) p)->size()) {
+        BAMAlignment* bam = (BAMAlignment*) p;
+        int readRef = (bam->refID >= 0 && bam->refID < nContigs && bam->pos >= 0) ? bam->refID : -1;
+        if (refId == -3) {
+            refId = readRef;
+        } else if (refId != readRef) {
+            refId = -2;
+        }
+        if (readRef >= 0) {
+            _int64 readStart = bam->pos + 1;
+            _int64 readEnd = (bam->FLAG & SAM_UNMAPPED) || bam->n_cigar_op == 0 ? readStart : bam->pos + bam->l_ref();
+            start = start == 0 ? readStart : min(start, readStart);
+            end = max(end, readEnd);
+        }
+        totalBases += bam->l_seq;
+    }
+    if (refId < 0) {
+        start = end = 0;
+    } else {
+        end = min(end, contigs[refId].length);
+    }
+    _int64 span = refId >= 0 ? end - start + 1 : 0;
+    bool multiRef = refId == -2;
+    if (multiRef) {
+        start = span = 0;
+    }
+
+    for (int i = 0; i < CramNumSeries; i++) {
+        series[i].clear();
+    }
+    nTags = 0;
+    lineKeys.clear();
+    lineStarts.clear();
+    lineStarts.push_back(0);
+    for (char* p = records; p < records + bytes; p += ((BAMAlignment*) p)->size()) {
+        encodeRecord((BAMAlignment*) p, multiRef);
+    }
+
+    // external blocks first, so the slice header can list them
+    compressed.clear();
+    CramBuffer externals;
+    VariableSizeVector<int> ids;
+    for (int i = 0; i < CramNumSeries; i++) {
+        if (series[i].getUsed() > 0) {
+            writeExternal(&externals, i + 1, &series[i]);
+            ids.push_back(i + 1);
+        }
+    }
+    for (int i = 0; i < nTags; i++) {
+        writeExternal(&externals, tags[i].key, tags[i].buffer);
+        ids.push_back(tags[i].key);
+    }
+
+    blocks.clear();
+    writeCompressionHeader(&blocks);
+    size_t sliceOffset = blocks.getUsed();
+
+    CramBuffer sliceHeader;
+    sliceHeader.putItf8(refId);
+    sliceHeader.putItf8((_int32) start);
+    sliceHeader.putItf8((_int32) span);
+    sliceHeader.putItf8(nRecords);
+    sliceHeader.putLtf8(recordCounter);
+    sliceHeader.putItf8((_int32) (1 + ids.size())); // the core block and the externals
+    sliceHeader.putItf8((_int32) ids.size());
+    for (int i = 0; i < ids.size(); i++) {
+        sliceHeader.putItf8(ids[i]);
+    }
+    sliceHeader.putItf8(-1); // no embedded reference
+    _uint8 digest[16];
+    memset(digest, 0, sizeof(digest));
+    if (refId >= 0 && span > 0) {
+        CramMd5 md5;
+        md5.updateBases(genome->getSubstring(genome->getContigs()[refId].beginningLocation + start - 1, span), span);
+        md5.finish(digest);
+    }
+    sliceHeader.putBytes(digest, sizeof(digest));
+    WriteBlock(&blocks, CramRaw, CramSliceHeaderBlock, 0, sliceHeader.getData(), sliceHeader.getUsed(), sliceHeader.getUsed());
+    WriteBlock(&blocks, CramRaw, CramCoreBlock, 0, NULL, 0, 0);
+    blocks.putBytes(externals.getData(), externals.getUsed());
+
+    _int32 landmark = (_int32) sliceOffset;
+    WriteContainerHeader(o_output, blocks.getUsed(), refId, start, span, nRecords, recordCounter, totalBases,
+        (int) (3 + ids.size()), 1, &landmark);
+    o_output->putBytes(blocks.getData(), blocks.getUsed());
+
+    *o_refId = refId;
+    *o_start = start;
+    *o_span = span;
+    *o_sliceOffset = sliceOffset;
+    *o_sliceSize = blocks.getUsed() - sliceOffset;
+}
+
+//
+// Encodes batches, one slice to each worker at a time.
+//
+class CramEncodeWorkerManager : public ParallelWorkerManager
+{
+public:
+    CramEncodeWorkerManager(CramWriterFilterSupplier* i_supplier) : supplier(i_supplier), nSlices(0), encoder(NULL) {}
+
+    virtual ~CramEncodeWorkerManager();
+
+    virtual void initialize(void* i_encoder);
+
+    virtual ParallelWorker* createWorker();
+
+    virtual void beginStep();
+
+    virtual void finishStep();
+
+private:
+    struct Slice {
+        char* records;
+        size_t bytes;
+        int nRecords;
+        _int64 recordCounter;
+        CramBuffer output;
+        int refId;
+        _int64 start, span;
+        size_t sliceOffset, sliceSize;
+    };
+
+    CramWriterFilterSupplier* supplier;
+    VariableSizeVector<Slice*> slices; // kept between batches, so their buffers are reused
+    volatile int nSlices;
+    CramBuffer headerOutput;
+    FileEncoder* encoder;
+    char* input;
+    size_t inputSize;
+    size_t inputUsed;
+
+    friend class CramEncodeWorker;
+};
+
+class CramEncodeWorker : public ParallelWorker
+{
+public:
+    virtual void step();
+
+private:
+    CramSliceEncoder sliceEncoder;
+};
+
+CramEncodeWorkerManager::~CramEncodeWorkerManager()
+{
+    for (int i = 0; i < slices.size(); i++) {
+        delete slices[i];
+    }
+}
+
+    void
+CramEncodeWorkerManager::initialize(
+    void* i_encoder)
+{
+    encoder = (FileEncoder*) i_encoder;
+}
+
+    ParallelWorker*
+CramEncodeWorkerManager::createWorker()
+{
+    return new CramEncodeWorker();
+}
+
+    void
+CramEncodeWorkerManager::beginStep()
+/*++
+
+Routine Description:
+
+    Take off any header at the start of the batch, and split the reads into slices.
+
+--*/
+{
+    nSlices = 0;
+    if (supplier->closing) {
+        return;
+    }
+    encoder->getEncodeBatch(&input, &inputSize, &inputUsed);
+    headerOutput.clear();
+    size_t offset = 0;
+    if (! supplier->headerDone) {
+        offset = supplier->addHeader(input, inputUsed);
+        if (supplier->headerDone) {
+            supplier->encodeHeader(&headerOutput);
+        }
+    }
+    int n = 0;
+    for (char* p = input + offset; p < input + inputUsed; n++) {
+        if (n == slices.size()) {
+            slices.push_back(new Slice());
+        }
+        Slice* slice = slices[n];
+        slice->records = p;
+        slice->nRecords = 0;
+        int refId = ((BAMAlignment*) p)->refID;
+        while (p < input + inputUsed && slice->nRecords < CramWriterFilterSupplier::MaxSliceRecords &&
+            ! (supplier->sorted && ((BAMAlignment*) p)->refID != refId))
+        {
+            p += ((BAMAlignment*) p)->size();
+            slice->nRecords++;
+        }
+        _ASSERT(p <= input + inputUsed);
+        slice->bytes = p - slice->records;
+        slice->recordCounter = InterlockedAdd64AndReturnNewValue(&supplier->recordCounter, slice->nRecords) - slice->nRecords;
+    }
+    nSlices = n;
+}
+
+    void
+CramEncodeWorkerManager::finishStep()
+/*++
+
+Routine Description:
+
+    Copy the containers back over the batch, which they can't outgrow in practice: they're much smaller than the
+    BAM records they came from.
+
+--*/
+{
+    if (supplier->closing) {
+        return;
+    }
+    size_t total = headerOutput.getUsed();
+    for (int i = 0; i < nSlices; i++) {
+        total += slices[i]->output.getUsed();
+    }
+    if (total > inputSize) {
+        WriteErrorMessage("CRAM output for a batch doesn't fit in its write buffer; try a bigger -wbs\n");
+        soft_exit(1);
+    }
+    size_t logicalOffset, physicalOffset;
+    if (supplier->indexFileName != NULL) {
+        encoder->getOffsets(total, &logicalOffset, &physicalOffset);
+    }
+    memcpy(input, headerOutput.getData(), headerOutput.getUsed());
+    size_t used = headerOutput.getUsed();
+    for (int i = 0; i < nSlices; i++) {
+        Slice* slice = slices[i];
+        if (supplier->indexFileName != NULL) {
+            CramWriterFilterSupplier::IndexEntry entry;
+            entry.refId = slice->refId;
+            entry.start = slice->start;
+            entry.span = slice->span;
+            entry.containerOffset = physicalOffset + used;
+            entry.sliceOffset = slice->sliceOffset;
+            entry.sliceSize = slice->sliceSize;
+            AcquireExclusiveLock(&supplier->lock);
+            supplier->index.push_back(entry);
+            ReleaseExclusiveLock(&supplier->lock);
+        }
+        memcpy(input + used, slice->output.getData(), slice->output.getUsed());
+        used += slice->output.getUsed();
+    }
+    encoder->setEncodedBatchSize(used);
+}
+
+    void
+CramEncodeWorker::step()
+{
+    TIME_STAGE(CompressStage);
+    _int64 stepStart = timeInNanos();  // Encoding a slice counts as compressing it
+    CramEncodeWorkerManager* manager = (CramEncodeWorkerManager*) getManager();
+    int begin = (getThreadNum() * manager->nSlices) / getNumThreads();
+    int end = ((1 + getThreadNum()) * manager->nSlices) / getNumThreads();
+    for (int i = begin; i < end; i++) {
+        CramEncodeWorkerManager::Slice* slice = manager->slices[i];
+        slice->output.clear();
+        sliceEncoder.encode(manager->supplier, slice->records, slice->bytes, slice->nRecords, slice->recordCounter, &slice->output,
+            &slice->refId, &slice->start, &slice->span, &slice->sliceOffset, &slice->sliceSize);
+    }
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::CompressNanos, EndPipelineTraceSpan(CompressTraceEvent, stepStart));
+}
+
+//
+// used for case where each thread encodes by itself, as GzipWriterFilter does
+//
+class CramWriterFilter : public DataWriter::Filter
+{
+public:
+    CramWriterFilter(CramWriterFilterSupplier* i_supplier)
+        : DataWriter::Filter(DataWriter::ResizeFilter), supplier(i_supplier), manager(NULL), worker(NULL), encoder(NULL)
+    {}
+
+    virtual ~CramWriterFilter();
+
+    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, GenomeDistance bytes, GenomeLocation location) {}
+
+    virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes);
+
+private:
+    CramWriterFilterSupplier* supplier;
+    CramEncodeWorkerManager* manager;
+    ParallelWorker* worker;
+    FileEncoder* encoder;
+};
+
+CramWriterFilter::~CramWriterFilter()
+{
+    delete worker;
+    delete manager;
+    delete encoder;
+}
+
+    size_t
+CramWriterFilter::onNextBatch(
+    DataWriter* writer,
+    size_t offset,
+    size_t bytes)
+{
+    char* fromBuffer;
+    size_t fromSize, fromUsed, physicalOffset, logicalOffset;
+    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, &physicalOffset, NULL, &logicalOffset);
+    if (fromUsed == 0 || supplier->multiThreaded || supplier->closing) {
+        return fromUsed;
+    }
+    if (manager == NULL) {
+        manager = new CramEncodeWorkerManager(supplier);
+        worker = manager->createWorker();
+        encoder = new FileEncoder(0, false, manager);
+        encoder->initialize((AsyncDataWriter*) writer);
+        manager->initialize(encoder);
+        manager->configure(worker, 0, 1);
+    }
+    encoder->setupEncode(-1);
+    manager->beginStep();
+    worker->step();
+    manager->finishStep();
+    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, &physicalOffset, NULL, &logicalOffset);
+    return fromUsed;
+}
+
+CramWriterFilterSupplier::CramWriterFilterSupplier(
+    const Genome* i_genome,
+    const char* i_fileName,
+    const char* i_indexFileName,
+    bool i_multiThreaded,
+    bool i_sorted)
+    : DataWriter::FilterSupplier(DataWriter::ResizeFilter), multiThreaded(i_multiThreaded), genome(i_genome), fileName(i_fileName),
+    indexFileName(i_indexFileName), sorted(i_sorted), headerDone(false), contigs(NULL), nContigs(0), recordCounter(0), closing(false)
+{
+    InitializeExclusiveLock(&lock);
+}
+
+CramWriterFilterSupplier::~CramWriterFilterSupplier()
+{
+    DestroyExclusiveLock(&lock);
+    delete [] contigs;
+}
+
+    DataWriter::Filter*
+CramWriterFilterSupplier::getFilter()
+{
+    return new CramWriterFilter(this);
+}
+
+    size_t
+CramWriterFilterSupplier::addHeader(
+    const char* data,
+    size_t bytes)
+/*++
+
+Routine Description:
+
+    Collect the BAM header, which may come over more than one batch.  Once it's all here, note the contigs from it.
+
+--*/
+{
+    size_t had = header.size();
+    header.extend((int) (had + bytes));
+    memcpy(&header[had], data, bytes);
+
+    size_t needed = BAMHeader::size(0);
+    if ((size_t) header.size() < needed) {
+        return bytes;
+    }
+    BAMHeader* bam = (BAMHeader*) &header[0];
+    needed = BAMHeader::size(bam->l_text);
+    if ((size_t) header.size() < needed) {
+        return bytes;
+    }
+    int nRef = bam->n_ref();
+    for (int i = 0; i < nRef; i++) {
+        if ((size_t) header.size() < needed + sizeof(_int32) ||
+            (size_t) header.size() < needed + BAMHeaderRefSeq::size(((BAMHeaderRefSeq*) (&header[0] + needed))->l_name))
+        {
+            return bytes;
+        }
+        needed += BAMHeaderRefSeq::size(((BAMHeaderRefSeq*) (&header[0] + needed))->l_name);
+    }
+
+    headerDone = true;
+    size_t used = needed - had;
+    header.truncate((int) needed);
+    bam = (BAMHeader*) &header[0];
+    nContigs = nRef;
+    contigs = new ContigInfo[max(1, nRef)];
+    BAMHeaderRefSeq* ref = bam->firstRefSeq();
+    for (int i = 0; i < nRef; i++, ref = ref->next()) {
+        contigs[i].name = ref->name();
+        contigs[i].length = ref->l_ref();
+    }
+    return used;
+}
+
+    void
+CramWriterFilterSupplier::encodeHeader(
+    CramBuffer* o_output)
+/*++
+
+Routine Description:
+
+    Write the file definition and the header container, whose SAM header has the MD5 of each reference added to
+    its @SQ line, as readers need to check they have the right reference.
+
+--*/
+{
+    o_output->putBytes("CRAM", 4);
+    o_output->putByte(3);
+    o_output->putByte(0);
+    char fileId[20];
+    memset(fileId, 0, sizeof(fileId));
+    const char* base = fileName;
+    for (const char* p = fileName; *p != '\0'; p++) {
+        if (*p == '/' || *p == '\\') {
+            base = p + 1;
+        }
+    }
+    strncpy(fileId, base, sizeof(fileId));
+    o_output->putBytes(fileId, sizeof(fileId));
+
+    char (*md5s)[33] = new char[max(1, nContigs)][33];
+    for (int i = 0; i < nContigs; i++) {
+        CramMd5 md5;
+        md5.updateBases(genome->getSubstring(genome->getContigs()[i].beginningLocation, contigs[i].length), contigs[i].length);
+        _uint8 digest[16];
+        md5.finish(digest);
+        CramMd5::toHex(digest, md5s[i]);
+    }
+
+    BAMHeader* bam = (BAMHeader*) &header[0];
+    const char* text = bam->text();
+    const char* textEnd = text + bam->l_text;
+    while (textEnd > text && textEnd[-1] == '\0') {
+        textEnd--;
+    }
+    CramBuffer samHeader;
+    int nextContig = 0;
+    bool anySQ = false;
+    for (const char* line = text; line < textEnd; ) {
+        const char* eol = (const char*) memchr(line, '\n', textEnd - line);
+        const char* lineEnd = eol != NULL ? eol : textEnd;
+        samHeader.putBytes(line, lineEnd - line);
+        if (lineEnd - line > 4 && memcmp(line, "@SQ\t", 4) == 0) {
+            anySQ = true;
+            int contig = -1;
+            for (const char* field = line; field != NULL && field < lineEnd; ) {
+                field = (const char*) memchr(field, '\t', lineEnd - field);
+                if (field == NULL) {
+                    break;
+                }
+                field++;
+                if (lineEnd - field > 3 && memcmp(field, "M5:", 3) == 0) {
+                    contig = -2; // already there
+                    break;
+                } else if (lineEnd - field > 3 && memcmp(field, "SN:", 3) == 0 && contig == -1) {
+                    const char* nameEnd = (const char*) memchr(field, '\t', lineEnd - field);
+                    size_t nameLength = (nameEnd != NULL ? nameEnd : lineEnd) - (field + 3);
+                    // they're normally in order, so try the next one first
+                    for (int k = 0; k < nContigs; k++) {
+                        int c = (nextContig + k) % nContigs;
+                        if (strlen(contigs[c].name) == nameLength && memcmp(contigs[c].name, field + 3, nameLength) == 0) {
+                            contig = c;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (contig >= 0) {
+                samHeader.putBytes("\tM5:", 4);
+                samHeader.putBytes(md5s[contig], 32);
+                nextContig = contig + 1;
+            }
+        }
+        samHeader.putByte('\n');
+        line = lineEnd + 1;
+    }
+    if (! anySQ) {
+        for (int i = 0; i < nContigs; i++) {
+            char line[128];
+            samHeader.putBytes("@SQ\tSN:", 7);
+            samHeader.putBytes(contigs[i].name, strlen(contigs[i].name));
+            sprintf(line, "\tLN:%lld\tM5:%s\n", (_int64) contigs[i].length, md5s[i]);
+            samHeader.putBytes(line, strlen(line));
+        }
+    }
+    delete [] md5s;
+
+    CramBuffer headerBlock, block;
+    headerBlock.putUint32((_uint32) samHeader.getUsed());
+    headerBlock.putBytes(samHeader.getData(), samHeader.getUsed());
+    WriteBlock(&block, CramRaw, CramFileHeaderBlock, 0, headerBlock.getData(), headerBlock.getUsed(), headerBlock.getUsed());
+    _int32 landmark = 0;
+    WriteContainerHeader(o_output, block.getUsed(), 0, 0, 0, 0, 0, 0, 1, 1, &landmark);
+    o_output->putBytes(block.getData(), block.getUsed());
+}
+
+    void
+CramWriterFilterSupplier::onClosing(
+    DataWriterSupplier* supplier)
+{
+    closing = true;
+    DataWriter* writer = supplier->getWriter();
+    // the end of file container, which has an empty compression header and no slices
+    static const _uint8 eof[] = {
+        0x0f, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0f, 0xe0, 0x45, 0x4f, 0x46, 0x00, 0x00, 0x00,
+        0x00, 0x01, 0x00, 0x05, 0xbd, 0xd9, 0x4f, 0x00, 0x01, 0x00, 0x06, 0x06, 0x01, 0x00, 0x01, 0x00,
+        0x01, 0x00, 0xee, 0x63, 0x01, 0x4b
+    };
+    char* buffer;
+    size_t bytes;
+    if (! (writer->getBuffer(&buffer, &bytes) && bytes >= sizeof(eof))) {
+        WriteErrorMessage("no space to write eof marker\n");
+        soft_exit(1);
+    }
+    memcpy(buffer, eof, sizeof(eof));
+    writer->advance(sizeof(eof));
+    writer->close();
+    delete writer;
+}
+
+    void
+CramWriterFilterSupplier::onClosed(
+    DataWriterSupplier* supplier)
+/*++
+
+Routine Description:
+
+    Write the .crai: a gzipped line for each slice with its reference, start, span, container offset in the file,
+    and its offset (from the end of the container header) & size.
+
+--*/
+{
+    if (indexFileName == NULL) {
+        return;
+    }
+    gzFile file = gzopen(indexFileName, "wb");
+    if (file == NULL) {
+        WriteErrorMessage("Unable to open index file %s\n", indexFileName);
+        return;
+    }
+    for (int i = 0; i < index.size(); i++) {
+        IndexEntry* e = &index[i];
+        gzprintf(file, "%d\t%lld\t%lld\t%llu\t%lld\t%lld\n", e->refId, e->start, e->span, e->containerOffset, e->sliceOffset, e->sliceSize);
+    }
+    gzclose(file);
+}
+
+class CRAMFormat : public FileFormat
+{
+public:
+    CRAMFormat(bool i_useM) : useM(i_useM) {}
+
+    // everything but getWriterSupplier works on BAM records, so it's all BAM's
+
+    virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, GenomeDistance* o_readBytes,
+        int* o_refID, int* o_pos) const
+    { FileFormat::BAM[useM]->getSortInfo(genome, buffer, bytes, o_location, o_readBytes, o_refID, o_pos); }
+
+    virtual void getReadName(char* buffer, _int64 bytes, const char** o_name, size_t* o_nameLength) const
+    { FileFormat::BAM[useM]->getReadName(buffer, bytes, o_name, o_nameLength); }
+
+    virtual void setupReaderContext(AlignerOptions* options, ReaderContext* readerContext) const
+    { FileFormat::setupReaderContext(options, readerContext, true); }
+
+    virtual ReadWriterSupplier* getWriterSupplier(AlignerOptions* options, const Genome* genome) const;
+
+    virtual bool writeHeader(
+        const ReaderContext& context, char *header, size_t headerBufferSize, size_t *headerActualSize,
+        SortOrder sortOrder, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) const
+    {
+        return FileFormat::BAM[useM]->writeHeader(context, header, headerBufferSize, headerActualSize, sortOrder, argc, argv, version,
+            rgLine, omitSQLines);
+    }
+
+    virtual bool writeRead(
+        const ReaderContext& context, LandauVishkinWithCigar * lv, char * buffer, size_t bufferSpace,
+        size_t * spaceUsed, size_t qnameLen, Read * read, AlignmentResult result,
+        int mapQuality, GenomeLocation genomeLocation, Direction direction, bool secondaryAlignment, int * o_addFrontClipping,
+        bool hasMate = false, bool firstInPair = false, Read * mate = NULL,
+        AlignmentResult mateResult = NotFound, GenomeLocation mateLocation = 0, Direction mateDirection = FORWARD,
+        bool alignedAsPair = false) const
+    {
+        return FileFormat::BAM[useM]->writeRead(context, lv, buffer, bufferSpace, spaceUsed, qnameLen, read, result, mapQuality,
+            genomeLocation, direction, secondaryAlignment, o_addFrontClipping, hasMate, firstInPair, mate, mateResult, mateLocation,
+            mateDirection, alignedAsPair);
+    }
+
+private:
+    const bool useM;
+};
+
+const FileFormat* FileFormat::CRAM[] = { new CRAMFormat(false), new CRAMFormat(true) };
+
+    ReadWriterSupplier*
+CRAMFormat::getWriterSupplier(
+    AlignerOptions* options,
+    const Genome* genome) const
+{
+    DataWriterSupplier* dataSupplier;
+    if (options->sortOutput) {
+        size_t len = strlen(options->outputFile.fileName);
+        // todo: these leak, as with BAM
+        char* tempFileName = (char*) malloc(5 + len);
+        strcpy(tempFileName, options->outputFile.fileName);
+        strcpy(tempFileName + len, ".tmp");
+        char* indexFileName = NULL;
+        if (! options->noIndex) {
+            indexFileName = (char*) malloc(6 + len);
+            strcpy(indexFileName, options->outputFile.fileName);
+            strcpy(indexFileName + len, ".crai");
+        }
+        CramWriterFilterSupplier* cramSupplier = DataWriterSupplier::cram(genome, options->outputFile.fileName, indexFileName, true, true);
+        DataWriter::FilterSupplier* filters = cramSupplier;
+        if (! options->noDuplicateMarking) {
+            filters = DataWriterSupplier::markDuplicates(genome, options->duplicateMetricsFile)->compose(filters);
+        }
+        if (options->sortMergeThreads > 1) {
+            WriteStatusMessage("CRAM output is merged on one thread (-smt is ignored)\n");
+        }
+        dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName,
+            options->sortMemory * (1ULL << 30),
+            options->numThreads, options->outputFile.fileName, filters, options->writeBufferSize,
+            FileEncoder::cram(cramSupplier, options->numThreads, options->bindToProcessors),
+            options->sortInMemory * (1ULL << 30), options->sortTempDirectories, 1, NULL, 0, false, options->sortTempZstd);
+    } else {
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize,
+            DataWriterSupplier::cram(genome, options->outputFile.fileName, NULL, false, false), NULL, 4, NULL, options->inputOrder);
+    }
+    return ReadWriterSupplier::create(this, dataSupplier, genome, options->gapPenalty);
+}
+
+    CramWriterFilterSupplier*
+DataWriterSupplier::cram(
+    const Genome* genome,
+    const char* fileName,
+    const char* indexFileName,
+    bool multiThreaded,
+    bool sorted)
+{
+    return new CramWriterFilterSupplier(genome, fileName, indexFileName, multiThreaded, sorted);
+}
+
+    FileEncoder*
+FileEncoder::cram(
+    CramWriterFilterSupplier* filterSupplier,
+    int numThreads,
+    bool bindToProcessor)
+{
+    return new FileEncoder(numThreads, bindToProcessor, new CramEncodeWorkerManager(filterSupplier));
+}
+
+//
+// Reader
+//
+
+//
+// Reads the CRAM integer encodings from a buffer.  Running off the end leaves it failed and returns zeroes, so callers
+// can check once they're done with a structure.
+//
+class CramCursor
+{
+public:
+    CramCursor(const char* data, size_t bytes) : p((const _uint8*) data), end((const _uint8*) data + bytes), failed(false) {}
+
+    bool isFailed() { return failed; }
+
+    const char* getPosition() { return (const char*) p; }
+
+    size_t getRemaining() { return end - p; }
+
+    _uint8 getByte()
+    {
+        if (p >= end) {
+            failed = true;
+            return 0;
+        }
+        return *p++;
+    }
+
+    const char* getBytes(size_t bytes)
+    {
+        if ((size_t) (end - p) < bytes) {
+            failed = true;
+            p = end;
+            return NULL;
+        }
+        const char* result = (const char*) p;
+        p += bytes;
+        return result;
+    }
+
+    _uint32 getUint32()
+    {
+        const _uint8* q = (const _uint8*) getBytes(4);
+        return q == NULL ? 0 : (q[0] | (q[1] << 8) | (q[2] << 16) | ((_uint32) q[3] << 24));
+    }
+
+    _int32 getItf8();
+
+    _int64 getLtf8();
+
+private:
+    const _uint8* p;
+    const _uint8* end;
+    bool failed;
+};
+
+    _int32
+CramCursor::getItf8()
+{
+    if (p >= end) {
+        failed = true;
+        return 0;
+    }
+    _uint32 b = p[0];
+    int extra = b < 0x80 ? 0 : b < 0xc0 ? 1 : b < 0xe0 ? 2 : b < 0xf0 ? 3 : 4;
+    if ((size_t) (end - p) <= (size_t) extra) {
+        failed = true;
+        p = end;
+        return 0;
+    }
+    _uint32 value;
+    switch (extra) {
+    case 0: value = b; break;
+    case 1: value = ((b & 0x3f) << 8) | p[1]; break;
+    case 2: value = ((b & 0x1f) << 16) | (p[1] << 8) | p[2]; break;
+    case 3: value = ((b & 0x0f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; break;
+    default: value = ((b & 0x0f) << 28) | (p[1] << 20) | (p[2] << 12) | (p[3] << 4) | (p[4] & 0x0f); break;
+    }
+    p += 1 + extra;
+    return (_int32) value;
+}
+
+    _int64
+CramCursor::getLtf8()
+{
+    if (p >= end) {
+        failed = true;
+        return 0;
+    }
+    _uint8 b = p[0];
+    int extra = 0;
+    while (extra < 8 && (b & (0x80 >> extra))) {
+        extra++;
+    }
+    if ((size_t) (end - p) <= (size_t) extra) {
+        failed = true;
+        p = end;
+        return 0;
+    }
+    _uint64 value = extra == 8 ? 0 : (b & (0x7f >> extra));
+    for (int i = 1; i <= extra; i++) {
+        value = (value << 8) | p[i];
+    }
+    p += 1 + extra;
+    return (_int64) value;
+}
+
+static const int CramBzip2 = 2;
+static const int CramLzma = 3;
+
+    static bool
+ReadRansFrequencies(
+    const _uint8** io_p,
+    const _uint8* end,
+    _uint16* freq,
+    _uint16* start,
+    _uint8* symbol)
+/*++
+
+Routine Description:
+
+    Read the frequencies of one context: symbols in order, each with its frequency (in one byte, or two if it's
+    128 or more), with runs of consecutive symbols given as a count after the first two, ending with a zero symbol.
+
+--*/
+{
+    const _uint8* p = *io_p;
+    memset(freq, 0, 256 * sizeof(_uint16));
+    if (p >= end) {
+        return false;
+    }
+    int j = *p++;
+    int rle = 0;
+    unsigned total = 0;
+    do {
+        if (p >= end) {
+            return false;
+        }
+        unsigned f = *p++;
+        if (f >= 128) {
+            if (p >= end) {
+                return false;
+            }
+            f = ((f & 0x7f) << 8) | *p++;
+        }
+        if (total + f > 4096) {
+            return false;
+        }
+        freq[j] = (_uint16) f;
+        start[j] = (_uint16) total;
+        memset(symbol + total, j, f);
+        total += f;
+        if (rle > 0) {
+            rle--;
+            j++;
+            if (j > 255) {
+                return false;
+            }
+        } else {
+            if (p >= end) {
+                return false;
+            }
+            if (j + 1 == *p) {
+                j = *p++;
+                if (p >= end) {
+                    return false;
+                }
+                rle = *p++;
+            } else {
+                j = *p++;
+            }
+        }
+    } while (j != 0);
+    *io_p = p;
+    return true;
+}
+
+    bool
+RansDecode(
+    const _uint8* in,
+    size_t inSize,
+    _uint8* out,
+    size_t outSize,
+    CramRansTables* tables)
+/*++
+
+Routine Description:
+
+    Undo rANS order 0 or order 1, in the layout htslib uses for CRAM 3.0: the order, the compressed and raw sizes,
+    the frequency tables (all 256 contexts for order 1), and four interleaved 32 bit states.  Order 0 takes turns
+    with the states byte by byte; order 1 gives each state a quarter of the output, the remainder going to the last.
+
+--*/
+{
+    if (inSize < 9) {
+        return false;
+    }
+    int order = in[0];
+    _uint32 compressedSize = in[1] | (in[2] << 8) | (in[3] << 16) | ((_uint32) in[4] << 24);
+    _uint32 rawSize = in[5] | (in[6] << 8) | (in[7] << 16) | ((_uint32) in[8] << 24);
+    if (order > 1 || compressedSize != inSize - 9 || rawSize != outSize) {
+        return false;
+    }
+    const _uint8* p = in + 9;
+    const _uint8* end = in + inSize;
+    const _uint32 low = 1 << 23;
+    const _uint32 mask = 4095;
+    _uint32 R[4];
+
+    if (order == 0) {
+        if (! ReadRansFrequencies(&p, end, tables->freq[0], tables->start[0], tables->symbol[0]) || end - p < 16) {
+            return false;
+        }
+        for (int k = 0; k < 4; k++, p += 4) {
+            R[k] = p[0] | (p[1] << 8) | (p[2] << 16) | ((_uint32) p[3] << 24);
+        }
+        const _uint16* freq = tables->freq[0];
+        const _uint16* start = tables->start[0];
+        const _uint8* symbol = tables->symbol[0];
+        for (size_t i = 0; i < outSize; i++) {
+            _uint32* r = &R[i & 3];
+            _uint8 s = symbol[*r & mask];
+            out[i] = s;
+            *r = freq[s] * (*r >> 12) + (*r & mask) - start[s];
+            while (*r < low) {
+                if (p >= end) {
+                    return false;
+                }
+                *r = (*r << 8) | *p++;
+            }
+        }
+        return true;
+    }
+
+    // order 1: the contexts are run-length coded the same way as the symbols in each
+    if (p >= end) {
+        return false;
+    }
+    int i = *p++;
+    int rle = 0;
+    do {
+        if (! ReadRansFrequencies(&p, end, tables->freq[i], tables->start[i], tables->symbol[i]) || p >= end) {
+            return false;
+        }
+        if (rle > 0) {
+            rle--;
+            i++;
+            if (i > 255) {
+                return false;
+            }
+        } else if (i + 1 == *p) {
+            i = *p++;
+            if (p >= end) {
+                return false;
+            }
+            rle = *p++;
+        } else {
+            i = *p++;
+        }
+    } while (i != 0);
+    if (end - p < 16) {
+        return false;
+    }
+    for (int k = 0; k < 4; k++, p += 4) {
+        R[k] = p[0] | (p[1] << 8) | (p[2] << 16) | ((_uint32) p[3] << 24);
+    }
+    size_t quarter = outSize / 4;
+    _uint8 context[4] = {0, 0, 0, 0};
+    for (size_t n = 0; n < outSize; n++) {
+        // one symbol from each state in turn, each filling a quarter of the output; the last one finishes the remainder
+        int k = n < 4 * quarter ? (int) (n & 3) : 3;
+        size_t position = n < 4 * quarter ? k * quarter + (n >> 2) : n;
+        _uint32* r = &R[k];
+        _uint8 s = tables->symbol[context[k]][*r & mask];
+        out[position] = s;
+        *r = tables->freq[context[k]][s] * (*r >> 12) + (*r & mask) - tables->start[context[k]][s];
+        context[k] = s;
+        while (*r < low) {
+            if (p >= end) {
+                return false;
+            }
+            *r = (*r << 8) | *p++;
+        }
+    }
+    return true;
+}
+
+    static bool
+ReadCramBlock(
+    CramCursor* cursor,
+    int majorVersion,
+    int* o_contentType,
+    int* o_contentId,
+    const char** o_data,
+    size_t* o_size,
+    CramBuffer* buffer,
+    z_stream* zstream,
+    CramRansTables* rans,
+    const char** o_error)
+/*++
+
+Routine Description:
+
+    Read a block, and decompress it into buffer if it needs it.
+
+Arguments:
+
+    cursor          - at the start of the block, left after it
+    majorVersion    - of the file; 3.0 blocks end with a CRC
+    o_data, o_size  - the uncompressed contents, in the input or buffer
+    buffer          - for the decompressed data, if it's compressed
+    zstream         - initialized for inflating gzip
+    rans            - tables for undoing rANS
+    o_error         - what was wrong, if it returns false
+
+--*/
+{
+    const char* start = cursor->getPosition();
+    int method = cursor->getByte();
+    *o_contentType = cursor->getByte();
+    *o_contentId = cursor->getItf8();
+    _int32 size = cursor->getItf8();
+    _int32 rawSize = cursor->getItf8();
+    const char* data = size >= 0 ? cursor->getBytes(size) : NULL;
+    if (cursor->isFailed() || data == NULL || rawSize < 0) {
+        *o_error = "truncated block";
+        return false;
+    }
+    if (majorVersion >= 3) {
+        size_t checked = cursor->getPosition() - start;
+        _uint32 crc = cursor->getUint32();
+        if (cursor->isFailed() || crc != crc32(0, (const Bytef*) start, (uInt) checked)) {
+            *o_error = "block CRC doesn't match";
+            return false;
+        }
+    }
+    switch (method) {
+    case CramRaw:
+        *o_data = data;
+        *o_size = size;
+        return true;
+
+    case CramGzip:
+        buffer->clear();
+        inflateReset(zstream);
+        zstream->next_in = (Bytef*) data;
+        zstream->avail_in = (uInt) size;
+        zstream->next_out = (Bytef*) buffer->reserve(rawSize + 1);
+        zstream->avail_out = (uInt) rawSize + 1;
+        if (inflate(zstream, Z_FINISH) != Z_STREAM_END || zstream->total_out != (uLong) rawSize) {
+            *o_error = "gzip block doesn't decompress";
+            return false;
+        }
+        break;
+
+    case CramRans:
+        buffer->clear();
+        if (! RansDecode((const _uint8*) data, size, (_uint8*) buffer->reserve(rawSize), rawSize, rans)) {
+            *o_error = "rANS block doesn't decompress";
+            return false;
+        }
+        break;
+
+    case CramBzip2:
+        *o_error = "bzip2 blocks aren't supported";
+        return false;
+
+    case CramLzma:
+        *o_error = "lzma blocks aren't supported";
+        return false;
+
+    default:
+        *o_error = "unknown block compression method (CRAM 3.1 codecs aren't supported)";
+        return false;
+    }
+    buffer->advance(rawSize);
+    *o_data = buffer->getData();
+    *o_size = rawSize;
+    return true;
+}
+
+//
+// Codecs, as in the compression header.
+//
+static const int CramExternalCodec = 1;
+static const int CramHuffmanCodec = 3;
+static const int CramByteArrayLenCodec = 4;
+static const int CramByteArrayStopCodec = 5;
+static const int CramBetaCodec = 6;
+static const int CramSubexpCodec = 7;
+static const int CramGammaCodec = 9;
+
+struct CramCodec
+{
+    CramCodec() : symbols(NULL), lengths(NULL), values(NULL) {}
+
+    ~CramCodec() { delete [] symbols; }
+
+    int type;
+    int contentId; // EXTERNAL and BYTE_ARRAY_STOP
+    _uint8 stop; // BYTE_ARRAY_STOP
+    _int32 offset; // BETA, SUBEXP and GAMMA
+    int bits; // BETA's bits per value, SUBEXP's k
+
+    // HUFFMAN: the symbols in canonical code order, with the first code & index & the number of codes of each length
+    int nSymbols;
+    _int32* symbols;
+    int maxLength;
+    _uint32 firstCode[33];
+    int firstIndex[33];
+    int lengthCount[33];
+
+    CramCodec* lengths; // BYTE_ARRAY_LEN
+    CramCodec* values;
+};
+
+//
+// Data series the reader knows about: all the ones the writer uses, then the ones only other writers do.
+//
+enum CramReadSeries {
+    CramNF = CramNumSeries, CramBB, CramQQ,
+    CramNumReadSeries
+};
+
+static const char CramReadSeriesNames[] = "BFCFRIRLAPRGRNMFNSNPTSTLFNFCFPDLBAQSBSINSCRSPDHCMQNFBBQQ";
+
+//
+// What's in a container's compression header: the preservation map and the codec for each data series and tag.
+//
+class CramCompressionHeader
+{
+public:
+    CramCompressionHeader() {}
+
+    ~CramCompressionHeader() { reset(); }
+
+    // false if it's malformed or uses something that isn't supported, with the reason in o_error
+    bool parse(const char* data, size_t bytes, const char** o_error);
+
+    bool readNamesIncluded;
+    bool positionsAreDeltas;
+    bool referenceRequired;
+    char substitutions[5][4]; // the base for each reference base (in ACGTN order) and substitution code
+
+    // tag lines: keys (tag << 8 | type), lines[i] are lineKeys[lineStarts[i]] up to lineKeys[lineStarts[i+1]]
+    VariableSizeVector<_uint32> lineKeys;
+    VariableSizeVector<int> lineStarts;
+
+    CramCodec* series[CramNumReadSeries]; // NULL for series that aren't there
+
+    CramCodec* tagCodec(_uint32 key)
+    {
+        for (int i = 0; i < tagKeys.size(); i++) {
+            if (tagKeys[i] == key) {
+                return tagCodecs[i];
+            }
+        }
+        return NULL;
+    }
+
+private:
+    void reset();
+
+    CramCodec* parseCodec(CramCursor* cursor, const char** o_error);
+
+    VariableSizeVector<_uint32> tagKeys;
+    VariableSizeVector<CramCodec*> tagCodecs;
+    VariableSizeVector<CramCodec*> codecs; // all of them, for deleting
+};
+
+    void
+CramCompressionHeader::reset()
+{
+    for (int i = 0; i < codecs.size(); i++) {
+        delete codecs[i];
+    }
+    codecs.clear();
+    tagKeys.clear();
+    tagCodecs.clear();
+    lineKeys.clear();
+    lineStarts.clear();
+}
+
+    CramCodec*
+CramCompressionHeader::parseCodec(
+    CramCursor* cursor,
+    const char** o_error)
+{
+    int type = cursor->getItf8();
+    _int32 paramBytes = cursor->getItf8();
+    const char* params = paramBytes >= 0 ? cursor->getBytes(paramBytes) : NULL;
+    if (cursor->isFailed() || params == NULL) {
+        *o_error = "truncated encoding";
+        return NULL;
+    }
+    CramCursor p(params, paramBytes);
+    CramCodec* codec = new CramCodec();
+    codecs.push_back(codec);
+    codec->type = type;
+    switch (type) {
+    case CramExternalCodec:
+        codec->contentId = p.getItf8();
+        break;
+
+    case CramHuffmanCodec:
+    {
+        codec->nSymbols = p.getItf8();
+        if (p.isFailed() || codec->nSymbols <= 0 || (size_t) codec->nSymbols > p.getRemaining()) {
+            *o_error = "malformed Huffman encoding";
+            return NULL;
+        }
+        int n = codec->nSymbols;
+        _int32* symbols = new _int32[2 * n];
+        _int32* lengths = symbols + n;
+        for (int i = 0; i < n; i++) {
+            symbols[i] = p.getItf8();
+        }
+        if (p.getItf8() != n) {
+            delete [] symbols;
+            *o_error = "malformed Huffman encoding";
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            lengths[i] = p.getItf8();
+            if (lengths[i] < 0 || lengths[i] > 32 || (n > 1 && lengths[i] == 0)) {
+                p.getBytes(p.getRemaining() + 1); // fail
+            }
+        }
+        if (p.isFailed()) {
+            delete [] symbols;
+            *o_error = "malformed Huffman encoding";
+            return NULL;
+        }
+        // canonical codes go by length and then symbol; sort the few there are
+        for (int i = 1; i < n; i++) {
+            _int32 s = symbols[i], l = lengths[i];
+            int j = i;
+            for (; j > 0 && (lengths[j - 1] > l || (lengths[j - 1] == l && symbols[j - 1] > s)); j--) {
+                symbols[j] = symbols[j - 1];
+                lengths[j] = lengths[j - 1];
+            }
+            symbols[j] = s;
+            lengths[j] = l;
+        }
+        memset(codec->lengthCount, 0, sizeof(codec->lengthCount));
+        _uint32 code = 0;
+        int length = n > 1 ? lengths[0] : 0;
+        for (int i = 0; i < n; i++) {
+            if (i > 0) {
+                code = (code + 1) << (lengths[i] - length);
+                length = lengths[i];
+            }
+            if (codec->lengthCount[length]++ == 0) {
+                codec->firstCode[length] = code;
+                codec->firstIndex[length] = i;
+            }
+        }
+        codec->maxLength = length;
+        codec->symbols = symbols;
+        break;
+    }
+
+    case CramByteArrayLenCodec:
+        codec->lengths = parseCodec(&p, o_error);
+        if (codec->lengths == NULL) {
+            return NULL;
+        }
+        codec->values = parseCodec(&p, o_error);
+        if (codec->values == NULL) {
+            return NULL;
+        }
+        break;
+
+    case CramByteArrayStopCodec:
+        codec->stop = p.getByte();
+        codec->contentId = p.getItf8();
+        break;
+
+    case CramBetaCodec:
+    case CramSubexpCodec:
+        codec->offset = p.getItf8();
+        codec->bits = p.getItf8();
+        if (codec->bits < 0 || codec->bits > 32) {
+            *o_error = "malformed BETA or SUBEXP encoding";
+            return NULL;
+        }
+        break;
+
+    case CramGammaCodec:
+        codec->offset = p.getItf8();
+        break;
+
+    default:
+        *o_error = "unsupported encoding (GOLOMB or GOLOMB_RICE)";
+        return NULL;
+    }
+    if (p.isFailed()) {
+        *o_error = "malformed encoding";
+        return NULL;
+    }
+    return codec;
+}
+
+    bool
+CramCompressionHeader::parse(
+    const char* data,
+    size_t bytes,
+    const char** o_error)
+{
+    reset();
+    readNamesIncluded = positionsAreDeltas = referenceRequired = true;
+    const char* ACGTN = "ACGTN";
+    for (int r = 0; r < 5; r++) {
+        // the default substitution matrix: the other bases in order
+        for (int k = 0, c = 0; k < 5; k++) {
+            if (k != r) {
+                substitutions[r][c++] = ACGTN[k];
+            }
+        }
+    }
+    for (int i = 0; i < CramNumReadSeries; i++) {
+        series[i] = NULL;
+    }
+
+    CramCursor cursor(data, bytes);
+
+    // preservation map
+    _int32 mapBytes = cursor.getItf8();
+    const char* mapData = mapBytes >= 0 ? cursor.getBytes(mapBytes) : NULL;
+    if (mapData == NULL) {
+        *o_error = "truncated compression header";
+        return false;
+    }
+    CramCursor map(mapData, mapBytes);
+    int n = map.getItf8();
+    for (int i = 0; i < n && ! map.isFailed(); i++) {
+        const char* key = map.getBytes(2);
+        if (key == NULL) {
+            break;
+        }
+        if (key[0] == 'R' && key[1] == 'N') {
+            readNamesIncluded = map.getByte() != 0;
+        } else if (key[0] == 'A' && key[1] == 'P') {
+            positionsAreDeltas = map.getByte() != 0;
+        } else if (key[0] == 'R' && key[1] == 'R') {
+            referenceRequired = map.getByte() != 0;
+        } else if (key[0] == 'S' && key[1] == 'M') {
+            const _uint8* sm = (const _uint8*) map.getBytes(5);
+            for (int r = 0; sm != NULL && r < 5; r++) {
+                // each 2 bit code, highest first, goes with the other bases in order
+                for (int k = 0, c = 0; k < 5; k++) {
+                    if (k != r) {
+                        substitutions[r][(sm[r] >> (6 - 2 * c)) & 3] = ACGTN[k];
+                        c++;
+                    }
+                }
+            }
+        } else if (key[0] == 'T' && key[1] == 'D') {
+            _int32 tdBytes = map.getItf8();
+            const _uint8* td = tdBytes >= 0 ? (const _uint8*) map.getBytes(tdBytes) : NULL;
+            if (td == NULL) {
+                break;
+            }
+            lineStarts.push_back(0);
+            for (int k = 0; k < tdBytes; ) {
+                if (td[k] == 0) {
+                    lineStarts.push_back((int) lineKeys.size());
+                    k++;
+                } else if (k + 3 <= tdBytes) {
+                    lineKeys.push_back((td[k] << 16) | (td[k + 1] << 8) | td[k + 2]);
+                    k += 3;
+                } else {
+                    break;
+                }
+            }
+        } else {
+            *o_error = "unknown preservation map key";
+            return false;
+        }
+    }
+    if (map.isFailed()) {
+        *o_error = "malformed preservation map";
+        return false;
+    }
+
+    // data series encodings
+    _int32 seriesBytes = cursor.getItf8();
+    const char* seriesData = seriesBytes >= 0 ? cursor.getBytes(seriesBytes) : NULL;
+    if (seriesData == NULL) {
+        *o_error = "truncated compression header";
+        return false;
+    }
+    CramCursor seriesMap(seriesData, seriesBytes);
+    n = seriesMap.getItf8();
+    for (int i = 0; i < n && ! seriesMap.isFailed(); i++) {
+        const char* key = seriesMap.getBytes(2);
+        if (key == NULL) {
+            break;
+        }
+        CramCodec* codec = parseCodec(&seriesMap, o_error);
+        if (codec == NULL) {
+            return false;
+        }
+        for (int k = 0; k < CramNumReadSeries; k++) {
+            if (key[0] == CramReadSeriesNames[2 * k] && key[1] == CramReadSeriesNames[2 * k + 1]) {
+                series[k] = codec;
+                break;
+            }
+        }
+    }
+    if (seriesMap.isFailed()) {
+        *o_error = "malformed data series encodings";
+        return false;
+    }
+
+    // tag encodings
+    _int32 tagBytes = cursor.getItf8();
+    const char* tagData = tagBytes >= 0 ? cursor.getBytes(tagBytes) : NULL;
+    if (tagData == NULL) {
+        *o_error = "truncated compression header";
+        return false;
+    }
+    CramCursor tagMap(tagData, tagBytes);
+    n = tagMap.getItf8();
+    for (int i = 0; i < n && ! tagMap.isFailed(); i++) {
+        _uint32 key = (_uint32) tagMap.getItf8();
+        CramCodec* codec = parseCodec(&tagMap, o_error);
+        if (codec == NULL) {
+            return false;
+        }
+        tagKeys.push_back(key);
+        tagCodecs.push_back(codec);
+    }
+    if (tagMap.isFailed()) {
+        *o_error = "malformed tag encodings";
+        return false;
+    }
+    return true;
+}
+
+//
+// What the reader gets for each read: the fields of Read::init, with the bases and qualities already turned to the
+// read's own direction, followed by the name, bases, qualities and optional fields in BAM form.
+//
+struct CramInputRecord
+{
+    _int32 size; // of the whole record, a multiple of 8
+    _uint16 flag;
+    _uint8 mapq;
+    GenomeLocation location;
+    int nextContig; // contig number in the index, -1 for none
+    unsigned nextPos; // 1-based, 0 for none
+    unsigned frontClipping, backClipping, frontHardClipping, backHardClipping;
+    int nameLength, length, auxLength;
+
+    char* name() { return (char*) (this + 1); }
+    char* seq() { return name() + nameLength; }
+    char* qual() { return seq() + length; }
+    char* aux() { return qual() + length; }
+};
+
+//
+// Decodes slices into CramInputRecords.  One per worker, so its buffers are reused.
+//
+class CramSliceDecoder
+{
+public:
+    CramSliceDecoder();
+
+    ~CramSliceDecoder();
+
+    void decode(CramReader* reader, CramCompressionHeader* header, const char* slice, size_t bytes, CramBuffer* o_output);
+
+private:
+    struct Block {
+        int contentId;
+        const _uint8* data;
+        size_t size;
+        size_t offset;
+    };
+
+    // a decoded read, before mates in the slice are matched up; the strings are in the strings buffer
+    struct Record {
+        int flag, cf, refId, length, mapq, readGroup;
+        _int64 pos; // 1-based, 0 if none
+        int mateLine; // the mate further on in the slice, -1 if none
+        int nextRefId;
+        _int64 nextPos;
+        size_t name;
+        int nameLength;
+        size_t bases; // then the qualities, length each
+        size_t aux;
+        int auxLength;
+        int frontClipping, backClipping, frontHardClipping, backHardClipping;
+        bool hasReadGroupTag;
+    };
+
+    void fail(const char* message);
+
+    Block* findBlock(int contentId);
+
+    _uint32 getBits(int n);
+
+    _int32 decodeInt(CramCodec* codec);
+
+    _uint8 decodeByte(CramCodec* codec);
+
+    void decodeBytes(CramCodec* codec, int count, char* o_bytes);
+
+    const char* decodeByteArray(CramCodec* codec, int* o_length);
+
+    CramCodec* seriesCodec(int series)
+    {
+        CramCodec* codec = header->series[series];
+        if (codec == NULL) {
+            char message[100];
+            snprintf(message, sizeof(message), "a read needs data series %.2s, which isn't in the compression header", CramReadSeriesNames + 2 * series);
+            fail(message);
+        }
+        return codec;
+    }
+
+    _int32 decodeSeries(int series) { return decodeInt(seriesCodec(series)); }
+
+    char referenceBase(_int64 position); // 0-based on the read's reference
+
+    void decodeRecord(Record* record, int index, int sliceRefId, _int64* io_lastPos);
+
+    void decodeFeatures(Record* record, char* bases, char* qual);
+
+    CramReader* reader;
+    CramCompressionHeader* header;
+    VariableSizeVector<CramBuffer*> buffers; // decompressed blocks
+    VariableSizeVector<Block> blocks;
+    int blockIndex[256]; // blocks index for content ids that fit, -1 if none
+    Block* core;
+    size_t coreBit;
+    VariableSizeVector<Record> records;
+    CramBuffer strings;
+    CramBuffer scratch; // byte arrays that don't come straight from a block
+    CramBuffer names; // generated read names
+    z_stream zstream;
+    CramRansTables* rans;
+
+    // the reference for the read being decoded
+    const char* ref;
+    _int64 refStart, refLength; // 0-based on its contig, and how much of it there is at ref
+    const Block* embeddedRef;
+    _int64 embeddedRefStart;
+    int embeddedRefId;
+};
+
+CramSliceDecoder::CramSliceDecoder()
+    : rans(new CramRansTables())
+{
+    zstream.zalloc = Z_NULL;
+    zstream.zfree = Z_NULL;
+    zstream.opaque = Z_NULL;
+    zstream.next_in = Z_NULL;
+    zstream.avail_in = 0;
+    if (inflateInit2(&zstream, 15 + 32) != Z_OK) {
+        WriteErrorMessage("CRAM: unable to initialize zlib\n");
+        soft_exit(1);
+    }
+}
+
+CramSliceDecoder::~CramSliceDecoder()
+{
+    inflateEnd(&zstream);
+    for (int i = 0; i < buffers.size(); i++) {
+        delete buffers[i];
+    }
+    delete rans;
+}
+
+    void
+CramSliceDecoder::fail(
+    const char* message)
+{
+    WriteErrorMessage("CRAM file '%s' can't be read: %s\n", reader->fileName, message);
+    soft_exit(1);
+}
+
+    CramSliceDecoder::Block*
+CramSliceDecoder::findBlock(
+    int contentId)
+{
+    if (contentId >= 0 && contentId < 256) {
+        int i = blockIndex[contentId];
+        if (i >= 0) {
+            return &blocks[i];
+        }
+    } else {
+        for (int i = 0; i < blocks.size(); i++) {
+            if (blocks[i].contentId == contentId) {
+                return &blocks[i];
+            }
+        }
+    }
+    char message[100];
+    snprintf(message, sizeof(message), "external block %d is missing from a slice", contentId);
+    fail(message);
+    return NULL;
+}
+
+    _uint32
+CramSliceDecoder::getBits(
+    int n)
+{
+    if (n == 0) {
+        return 0;
+    }
+    if (core == NULL || coreBit + n > 8 * core->size) {
+        fail("ran off the end of the core data block");
+    }
+    _uint32 value = 0;
+    for (int i = 0; i < n; i++, coreBit++) {
+        value = (value << 1) | ((core->data[coreBit >> 3] >> (7 - (coreBit & 7))) & 1);
+    }
+    return value;
+}
+
+    _int32
+CramSliceDecoder::decodeInt(
+    CramCodec* codec)
+{
+    switch (codec->type) {
+    case CramExternalCodec:
+    {
+        Block* block = findBlock(codec->contentId);
+        CramCursor cursor((const char*) block->data + block->offset, block->size - block->offset);
+        _int32 value = cursor.getItf8();
+        if (cursor.isFailed()) {
+            fail("ran off the end of an external block");
+        }
+        block->offset = (const _uint8*) cursor.getPosition() - block->data;
+        return value;
+    }
+
+    case CramHuffmanCodec:
+    {
+        if (codec->nSymbols == 1) {
+            return codec->symbols[0];
+        }
+        _uint32 code = 0;
+        for (int length = 1; length <= codec->maxLength; length++) {
+            code = (code << 1) | getBits(1);
+            if (codec->lengthCount[length] > 0 && code >= codec->firstCode[length] &&
+                code - codec->firstCode[length] < (_uint32) codec->lengthCount[length]) {
+                return codec->symbols[codec->firstIndex[length] + (code - codec->firstCode[length])];
+            }
+        }
+        fail("bad Huffman code");
+        return 0;
+    }
+
+    case CramBetaCodec:
+        return (_int32) getBits(codec->bits) - codec->offset;
+
+    case CramGammaCodec:
+    {
+        int zeros = 0;
+        while (getBits(1) == 0) {
+            if (++zeros > 31) {
+                fail("bad GAMMA code");
+            }
+        }
+        return (_int32) ((1u << zeros) | getBits(zeros)) - codec->offset;
+    }
+
+    case CramSubexpCodec:
+    {
+        int ones = 0;
+        while (getBits(1) == 1) {
+            if (++ones > 31) {
+                fail("bad SUBEXP code");
+            }
+        }
+        int n = ones == 0 ? codec->bits : ones + codec->bits - 1;
+        if (n > 31) {
+            fail("bad SUBEXP code");
+        }
+        _uint32 value = getBits(n);
+        if (ones > 0) {
+            value += 1u << n;
+        }
+        return (_int32) value - codec->offset;
+    }
+
+    default:
+        fail("a byte array encoding is used for an integer data series");
+        return 0;
+    }
+}
+
+    _uint8
+CramSliceDecoder::decodeByte(
+    CramCodec* codec)
+{
+    if (codec->type == CramExternalCodec) {
+        Block* block = findBlock(codec->contentId);
+        if (block->offset >= block->size) {
+            fail("ran off the end of an external block");
+        }
+        return block->data[block->offset++];
+    }
+    return (_uint8) decodeInt(codec);
+}
+
+    void
+CramSliceDecoder::decodeBytes(
+    CramCodec* codec,
+    int count,
+    char* o_bytes)
+{
+    if (codec->type == CramExternalCodec) {
+        Block* block = findBlock(codec->contentId);
+        if (block->size - block->offset < (size_t) count) {
+            fail("ran off the end of an external block");
+        }
+        memcpy(o_bytes, block->data + block->offset, count);
+        block->offset += count;
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        o_bytes[i] = (char) decodeByte(codec);
+    }
+}
+
+    const char*
+CramSliceDecoder::decodeByteArray(
+    CramCodec* codec,
+    int* o_length)
+/*++
+
+Routine Description:
+
+    Decode a byte array, returning where it is (in its block, if it can, otherwise in scratch, so it's good until
+    the next call).
+
+--*/
+{
+    if (codec->type == CramByteArrayStopCodec) {
+        Block* block = findBlock(codec->contentId);
+        const _uint8* start = block->data + block->offset;
+        const _uint8* stop = (const _uint8*) memchr(start, codec->stop, block->size - block->offset);
+        if (stop == NULL) {
+            fail("ran off the end of an external block");
+        }
+        *o_length = (int) (stop - start);
+        block->offset += *o_length + 1;
+        return (const char*) start;
+    }
+    if (codec->type != CramByteArrayLenCodec) {
+        fail("an integer encoding is used for a byte array data series");
+    }
+    int length = decodeInt(codec->lengths);
+    if (length < 0) {
+        fail("negative byte array length");
+    }
+    *o_length = length;
+    if (codec->values->type == CramExternalCodec) {
+        Block* block = findBlock(codec->values->contentId);
+        if (block->size - block->offset < (size_t) length) {
+            fail("ran off the end of an external block");
+        }
+        const char* result = (const char*) block->data + block->offset;
+        block->offset += length;
+        return result;
+    }
+    scratch.clear();
+    char* result = scratch.reserve(length + 1);
+    decodeBytes(codec->values, length, result);
+    return result;
+}
+
+    char
+CramSliceDecoder::referenceBase(
+    _int64 position)
+{
+    if (embeddedRef != NULL) {
+        _int64 i = position - embeddedRefStart;
+        return i >= 0 && i < (_int64) embeddedRef->size ? (char) toupper(embeddedRef->data[i]) : 'N';
+    }
+    return ref != NULL && position >= 0 && position < refLength ? (char) toupper(ref[position]) : 'N';
+}
+
+    void
+CramSliceDecoder::decodeFeatures(
+    Record* record,
+    char* bases,
+    char* qual)
+/*++
+
+Routine Description:
+
+    Rebuild a mapped read from the reference and its read features, keeping count of the clipping.
+
+--*/
+{
+    int nFeatures = decodeSeries(CramFN);
+    int length = record->length;
+    int readPos = 0; // 0-based in the read
+    _int64 refPos = record->pos - 1;
+    int position = 0; // of the last feature, 1-based in the read
+    for (int f = 0; f < nFeatures; f++) {
+        _uint8 code = decodeByte(seriesCodec(CramFC));
+        position += decodeSeries(CramFP);
+        if (position < 1 || position - 1 < readPos || position > length + 1) {
+            fail("read feature out of order or past the end of the read");
+        }
+        // the bases up to the feature match the reference
+        for (; readPos < position - 1; readPos++, refPos++) {
+            bases[readPos] = referenceBase(refPos);
+        }
+        int n;
+        const char* p;
+        switch (code) {
+        case 'X':
+        {
+            _uint8 sub = decodeByte(seriesCodec(CramBS));
+            if (readPos >= length) {
+                fail("read feature past the end of the read");
+            }
+            char r = referenceBase(refPos);
+            const char* s = strchr("ACGT", r);
+            bases[readPos] = header->substitutions[s != NULL && r != 0 ? s - "ACGT" : 4][sub & 3];
+            readPos++;
+            refPos++;
+            break;
+        }
+
+        case 'B':
+            if (readPos >= length) {
+                fail("read feature past the end of the read");
+            }
+            bases[readPos] = (char) decodeByte(seriesCodec(CramBA));
+            qual[readPos] = (char) decodeByte(seriesCodec(CramQS));
+            readPos++;
+            refPos++;
+            break;
+
+        case 'b':
+            p = decodeByteArray(seriesCodec(CramBB), &n);
+            if (readPos + n > length) {
+                fail("read feature past the end of the read");
+            }
+            memcpy(bases + readPos, p, n);
+            readPos += n;
+            refPos += n;
+            break;
+
+        case 'q':
+            p = decodeByteArray(seriesCodec(CramQQ), &n);
+            if (readPos + n > length) {
+                fail("read feature past the end of the read");
+            }
+            memcpy(qual + readPos, p, n);
+            break;
+
+        case 'Q':
+            if (readPos >= length) {
+                fail("read feature past the end of the read");
+            }
+            qual[readPos] = (char) decodeByte(seriesCodec(CramQS));
+            break;
+
+        case 'I':
+        case 'S':
+            p = decodeByteArray(seriesCodec(code == 'I' ? CramIN : CramSC), &n);
+            if (readPos + n > length) {
+                fail("read feature past the end of the read");
+            }
+            memcpy(bases + readPos, p, n);
+            if (code == 'S') {
+                if (readPos == 0) {
+                    record->frontClipping = n;
+                } else {
+                    record->backClipping = n;
+                }
+            }
+            readPos += n;
+            break;
+
+        case 'i':
+            if (readPos >= length) {
+                fail("read feature past the end of the read");
+            }
+            bases[readPos++] = (char) decodeByte(seriesCodec(CramBA));
+            break;
+
+        case 'D':
+            refPos += decodeSeries(CramDL);
+            break;
+
+        case 'N':
+            refPos += decodeSeries(CramRS);
+            break;
+
+        case 'P':
+            decodeSeries(CramPD);
+            break;
+
+        case 'H':
+            n = decodeSeries(CramHC);
+            if (readPos == 0) {
+                record->frontHardClipping = n;
+            } else {
+                record->backHardClipping = n;
+            }
+            break;
+
+        default:
+            fail("unknown read feature");
+        }
+    }
+    for (; readPos < length; readPos++, refPos++) {
+        bases[readPos] = referenceBase(refPos);
+    }
+}
+
+    void
+CramSliceDecoder::decodeRecord(
+    Record* record,
+    int index,
+    int sliceRefId,
+    _int64* io_lastPos)
+/*++
+
+Routine Description:
+
+    Decode a read's data series, in the order the CRAM specification puts them.
+
+--*/
+{
+    record->flag = decodeSeries(CramBF);
+    record->cf = decodeSeries(CramCF);
+    record->refId = sliceRefId == -2 ? decodeSeries(CramRI) : sliceRefId;
+    record->length = decodeSeries(CramRL);
+    _int32 ap = decodeSeries(CramAP);
+    record->pos = header->positionsAreDeltas ? *io_lastPos + ap : ap;
+    *io_lastPos = record->pos;
+    record->readGroup = decodeSeries(CramRG);
+    if (record->length < 0 || record->length >= MAX_READ_LENGTH) {
+        fail("read length out of range");
+    }
+
+    record->name = strings.getUsed();
+    record->nameLength = 0;
+    int n;
+    const char* p;
+    if (header->readNamesIncluded) {
+        p = decodeByteArray(seriesCodec(CramRN), &n);
+        strings.putBytes(p, n);
+        record->nameLength = n;
+    }
+    record->mateLine = -1;
+    record->nextRefId = -1;
+    record->nextPos = 0;
+    if (record->cf & 0x2) {
+        // detached: the mate's details are all here
+        int mf = decodeSeries(CramMF);
+        if (mf & 0x1) {
+            record->flag |= SAM_NEXT_REVERSED;
+        }
+        if (mf & 0x2) {
+            record->flag |= SAM_NEXT_UNMAPPED;
+        }
+        if (! header->readNamesIncluded) {
+            p = decodeByteArray(seriesCodec(CramRN), &n);
+            strings.putBytes(p, n);
+            record->nameLength = n;
+        }
+        record->nextRefId = decodeSeries(CramNS);
+        record->nextPos = decodeSeries(CramNP);
+        decodeSeries(CramTS);
+    } else if (record->cf & 0x4) {
+        record->mateLine = index + decodeSeries(CramNF) + 1;
+    }
+
+    // the tags: all decoded to keep the blocks in step, but only RG kept without -pc
+    int line = decodeSeries(CramTL);
+    if (line < 0 || line + 1 >= header->lineStarts.size()) {
+        fail("tag line out of range");
+    }
+    record->aux = strings.getUsed();
+    record->hasReadGroupTag = false;
+    bool keepAll = reader->context.preserveClipping;
+    for (int k = header->lineStarts[line]; k < header->lineStarts[line + 1]; k++) {
+        _uint32 key = header->lineKeys[k];
+        CramCodec* codec = header->tagCodec(key);
+        if (codec == NULL) {
+            fail("a tag has no encoding");
+        }
+        char type = (char) key;
+        if (codec->type == CramByteArrayLenCodec || codec->type == CramByteArrayStopCodec) {
+            p = decodeByteArray(codec, &n);
+        } else {
+            n = strchr("cCA", type) != NULL ? 1 : strchr("sS", type) != NULL ? 2 : strchr("iIf", type) != NULL ? 4 : -1;
+            if (n < 0) {
+                fail("a variable length tag has a fixed length encoding");
+            }
+            scratch.clear();
+            char* value = scratch.reserve(n);
+            decodeBytes(codec, n, value);
+            p = value;
+        }
+        bool isReadGroup = key == (('R' << 16) | ('G' << 8) | 'Z');
+        if (keepAll || isReadGroup) {
+            strings.putByte((_uint8) (key >> 16));
+            strings.putByte((_uint8) (key >> 8));
+            strings.putByte((_uint8) key);
+            strings.putBytes(p, n);
+            record->hasReadGroupTag |= isReadGroup;
+        }
+    }
+
+    // the bases, which start out as N, and the qualities, which start out missing (as 0xff in BAM)
+    record->frontClipping = record->backClipping = record->frontHardClipping = record->backHardClipping = 0;
+    int length = record->length;
+    record->bases = strings.getUsed();
+    char* bases = strings.reserve(2 * length);
+    char* qual = bases + length;
+    memset(bases, 'N', length);
+    memset(qual, 0xff, length);
+    if (! (record->flag & SAM_UNMAPPED)) {
+        // point at the read's reference
+        embeddedRef = NULL;
+        ref = NULL;
+        refLength = 0;
+        if (embeddedRefId >= 0 && record->refId == sliceRefId) {
+            embeddedRef = findBlock(embeddedRefId);
+        } else if (record->refId >= 0 && record->refId < reader->nRefs && reader->contigForRef[record->refId] >= 0) {
+            const Genome* genome = reader->context.genome;
+            const Genome::Contig* contig = &genome->getContigs()[reader->contigForRef[record->refId]];
+            ref = genome->getSubstring(contig->beginningLocation, 1);
+            refLength = contig->length;
+        } else if (header->referenceRequired) {
+            char message[200];
+            snprintf(message, sizeof(message), "reads on reference %d of the header need its bases, and it isn't in the index", record->refId);
+            fail(message);
+        }
+        decodeFeatures(record, bases, qual);
+        record->mapq = decodeSeries(CramMQ);
+    } else {
+        record->mapq = 0;
+        if (! (record->cf & 0x8)) {
+            decodeBytes(seriesCodec(CramBA), length, bases);
+        }
+    }
+    if (record->cf & 0x1) {
+        decodeBytes(seriesCodec(CramQS), length, qual);
+    }
+    if (record->cf & 0x8) {
+        // no sequence stored
+        length = record->length = 0;
+    }
+    strings.advance(2 * length);
+    record->auxLength = (int) (record->bases - record->aux);
+}
+
+    void
+CramSliceDecoder::decode(
+    CramReader* i_reader,
+    CramCompressionHeader* i_header,
+    const char* slice,
+    size_t bytes,
+    CramBuffer* o_output)
+/*++
+
+Routine Description:
+
+    Decode a slice: its header, its blocks, and then each read, before filling in what mates in the slice say about
+    each other, and writing out a CramInputRecord for each.
+
+--*/
+{
+    reader = i_reader;
+    header = i_header;
+    const char* error = NULL;
+    CramCursor cursor(slice, bytes);
+
+    int contentType, contentId;
+    const char* data;
+    size_t size;
+    if (buffers.size() == 0) {
+        buffers.push_back(new CramBuffer());
+    }
+    if (! ReadCramBlock(&cursor, reader->majorVersion, &contentType, &contentId, &data, &size, buffers[0], &zstream, rans, &error)) {
+        fail(error);
+    }
+    if (contentType != CramSliceHeaderBlock) {
+        fail("slice doesn't start with a slice header");
+    }
+    // copy the header, since its buffer is about to be reused
+    CramBuffer sliceHeader;
+    sliceHeader.putBytes(data, size);
+    CramCursor h(sliceHeader.getData(), sliceHeader.getUsed());
+    int refId = h.getItf8();
+    _int64 start = h.getItf8();
+    h.getItf8(); // span
+    int nRecords = h.getItf8();
+    _int64 recordCounter = reader->majorVersion >= 3 ? h.getLtf8() : h.getItf8();
+    int nBlocks = h.getItf8();
+    int nContentIds = h.getItf8();
+    for (int i = 0; i < nContentIds; i++) {
+        h.getItf8();
+    }
+    embeddedRefId = h.getItf8();
+    embeddedRefStart = start - 1;
+    if (h.isFailed() || nRecords < 0 || nBlocks < 0) {
+        fail("malformed slice header");
+    }
+
+    blocks.clear();
+    core = NULL;
+    coreBit = 0;
+    for (int i = 0; i < 256; i++) {
+        blockIndex[i] = -1;
+    }
+    for (int i = 0; i < nBlocks; i++) {
+        while (buffers.size() <= i) {
+            buffers.push_back(new CramBuffer());
+        }
+        Block block;
+        if (! ReadCramBlock(&cursor, reader->majorVersion, &contentType, &block.contentId, (const char**) &block.data, &block.size,
+                buffers[i], &zstream, rans, &error)) {
+            fail(error);
+        }
+        block.offset = 0;
+        if (contentType == CramCoreBlock) {
+            block.contentId = -1;
+        } else if (contentType != CramExternalBlock) {
+            fail("unexpected block type in a slice");
+        } else if (block.contentId >= 0 && block.contentId < 256) {
+            blockIndex[block.contentId] = (int) blocks.size();
+        }
+        blocks.push_back(block);
+    }
+    for (int i = 0; i < blocks.size(); i++) {
+        if (blocks[i].contentId == -1) {
+            core = &blocks[i];
+        }
+    }
+
+    records.clear();
+    strings.clear();
+    _int64 lastPos = start;
+    for (int i = 0; i < nRecords; i++) {
+        Record record;
+        decodeRecord(&record, i, refId, &lastPos);
+        records.push_back(record);
+    }
+
+    // mates in the slice: each says where the other is, and whether it's reversed or unmapped, and names are shared
+    names.clear();
+    VariableSizeVector<size_t> nameOffsets(nRecords > 0 ? nRecords : 1);
+    for (int i = 0; i < nRecords; i++) {
+        nameOffsets.push_back(0);
+    }
+    for (int i = 0; i < nRecords; i++) {
+        Record* r = &records[i];
+        if (r->nameLength == 0) {
+            // generated from the record counter, like samtools does
+            nameOffsets[i] = names.getUsed();
+            char name[32];
+            r->nameLength = snprintf(name, sizeof(name), "%lld", (long long) (recordCounter + i + 1));
+            names.putBytes(name, r->nameLength);
+            r->name = (size_t) -1;
+        }
+        if (r->mateLine >= 0) {
+            if (r->mateLine >= nRecords) {
+                fail("mate is past the end of the slice");
+            }
+            Record* m = &records[r->mateLine];
+            r->nextRefId = m->refId;
+            r->nextPos = m->pos;
+            m->nextRefId = r->refId;
+            m->nextPos = r->pos;
+            r->flag |= ((m->flag & SAM_REVERSE_COMPLEMENT) ? SAM_NEXT_REVERSED : 0) | ((m->flag & SAM_UNMAPPED) ? SAM_NEXT_UNMAPPED : 0);
+            m->flag |= ((r->flag & SAM_REVERSE_COMPLEMENT) ? SAM_NEXT_REVERSED : 0) | ((r->flag & SAM_UNMAPPED) ? SAM_NEXT_UNMAPPED : 0);
+            if (m->nameLength == 0) {
+                m->name = r->name;
+                m->nameLength = r->nameLength;
+                nameOffsets[r->mateLine] = nameOffsets[i];
+            }
+        }
+    }
+
+    o_output->clear();
+    const Genome* genome = reader->context.genome;
+    for (int i = 0; i < nRecords; i++) {
+        Record* r = &records[i];
+        const char* readGroupAux = NULL;
+        int readGroupAuxLength = 0;
+        if (! r->hasReadGroupTag && r->readGroup >= 0 && r->readGroup < reader->nReadGroups) {
+            // the read group from the RG data series goes after the other tags, as if it were an RG tag
+            readGroupAux = reader->readGroups[r->readGroup];
+            readGroupAuxLength = (int) (strlen(readGroupAux + 3) + 4);
+        }
+        int auxLength = r->auxLength + readGroupAuxLength;
+        size_t recordSize = sizeof(CramInputRecord) + r->nameLength + 2 * r->length + auxLength;
+        recordSize = (recordSize + 7) & ~(size_t) 7;
+        CramInputRecord* out = (CramInputRecord*) o_output->reserve(recordSize);
+        out->size = (_int32) recordSize;
+        out->flag = (_uint16) r->flag;
+        out->mapq = (_uint8) r->mapq;
+        int contig = r->refId >= 0 && r->refId < reader->nRefs ? reader->contigForRef[r->refId] : -1;
+        out->location = contig < 0 || r->pos <= 0 || (r->flag & SAM_UNMAPPED) ? InvalidGenomeLocation
+            : genome->getContigs()[contig].beginningLocation + (r->pos - 1);
+        out->nextContig = r->nextRefId >= 0 && r->nextRefId < reader->nRefs ? reader->contigForRef[r->nextRefId] : -1;
+        out->nextPos = out->nextContig >= 0 ? (unsigned) r->nextPos : 0;
+        out->nameLength = r->nameLength;
+        out->length = r->length;
+        out->auxLength = auxLength;
+        memcpy(out->name(), r->name == (size_t) -1 ? names.getData() + nameOffsets[i] : strings.getData() + r->name, r->nameLength);
+        const char* bases = strings.getData() + r->bases;
+        const _uint8* qual = (const _uint8*) bases + r->length;
+        char* seq = out->seq();
+        char* q = out->qual();
+        int length = r->length;
+        if (r->flag & SAM_REVERSE_COMPLEMENT) {
+            for (int k = 0; k < length; k++) {
+                seq[length - 1 - k] = COMPLEMENT[(_uint8) toupper(bases[k])];
+                q[length - 1 - k] = CIGAR_QUAL_TO_SAM[qual[k]];
+            }
+            out->frontClipping = r->backClipping;
+            out->backClipping = r->frontClipping;
+            out->frontHardClipping = r->backHardClipping;
+            out->backHardClipping = r->frontHardClipping;
+        } else {
+            for (int k = 0; k < length; k++) {
+                seq[k] = (char) toupper(bases[k]);
+                q[k] = CIGAR_QUAL_TO_SAM[qual[k]];
+            }
+            out->frontClipping = r->frontClipping;
+            out->backClipping = r->backClipping;
+            out->frontHardClipping = r->frontHardClipping;
+            out->backHardClipping = r->backHardClipping;
+        }
+        memcpy(out->aux(), strings.getData() + r->aux, r->auxLength);
+        if (readGroupAux != NULL) {
+            memcpy(out->aux() + r->auxLength, readGroupAux, readGroupAuxLength);
+        }
+        o_output->advance(recordSize);
+    }
+}
+
+struct CramReader::Entry
+{
+    Entry* next; // next entry on first/available list
+    EntryState state;
+    DataBatch batch;
+    int holds; // the reader's own, until it's done with the entry, and its clients'
+    bool eof; // no more containers
+    CramBuffer data; // the container, after its header
+    VariableSizeVector<_int32> landmarks; // where its slices start
+    CramCompressionHeader compression;
+    VariableSizeVector<CramBuffer*> outputs; // CramInputRecords, one buffer per slice; kept around for reuse
+    int nSlices;
+};
+
+//
+// Decodes the slices of the containers read on one pass of the decode thread.
+//
+class CramDecodeWorkerManager : public ParallelWorkerManager
+{
+public:
+    CramDecodeWorkerManager(CramReader* i_reader) : reader(i_reader), nEntries(0) {}
+
+    virtual ParallelWorker* createWorker();
+
+    struct Task {
+        CramReader::Entry* entry;
+        int slice;
+    };
+
+    CramReader* reader;
+    CramReader::Entry** entries;
+    int nEntries;
+    VariableSizeVector<Task> tasks;
+};
+
+class CramDecodeWorker : public ParallelWorker
+{
+public:
+    virtual void step();
+
+private:
+    CramSliceDecoder sliceDecoder;
+};
+
+    ParallelWorker*
+CramDecodeWorkerManager::createWorker()
+{
+    return new CramDecodeWorker();
+}
+
+    void
+CramDecodeWorker::step()
+{
+    _int64 stepStart = timeInNanos();  // Decoding a slice counts as decompressing it
+    CramDecodeWorkerManager* manager = (CramDecodeWorkerManager*) getManager();
+    for (int i = getThreadNum(); i < manager->tasks.size(); i += getNumThreads()) {
+        CramDecodeWorkerManager::Task* task = &manager->tasks[i];
+        CramReader::Entry* entry = task->entry;
+        size_t start = entry->landmarks[task->slice];
+        size_t end = task->slice + 1 < entry->nSlices ? entry->landmarks[task->slice + 1] : entry->data.getUsed();
+        sliceDecoder.decode(manager->reader, &entry->compression, entry->data.getData() + start, end - start, entry->outputs[task->slice]);
+    }
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::DecompressNanos, EndPipelineTraceSpan(DecompressTraceEvent, stepStart));
+}
+
+CramReader::CramReader(const ReaderContext& i_context)
+    : ReadReader(i_context), fileName(NULL), file(NULL), majorVersion(0), fileOffset(0), nRefs(0), contigForRef(NULL),
+    nReadGroups(0), readGroups(NULL), entries(NULL), count(0), first(NULL), last(NULL), available(NULL),
+    threadStarted(false), stopping(false), nextBatchID(1), readSlice(0), readOffset(0)
+{
+    CreateEventObject(&readyEvent);
+    PreventEventWaitersFromProceeding(&readyEvent);
+    CreateEventObject(&availableEvent);
+    AllowEventWaitersToProceed(&availableEvent);
+    CreateEventObject(&decodeThreadDone);
+    PreventEventWaitersFromProceeding(&decodeThreadDone);
+    InitializeExclusiveLock(&lock);
+}
+
+CramReader::~CramReader()
+{
+    if (threadStarted) {
+        stopping = true;
+        AllowEventWaitersToProceed(&availableEvent);
+        WaitForEvent(&decodeThreadDone);
+    }
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < entries[i].outputs.size(); j++) {
+            delete entries[i].outputs[j];
+        }
+    }
+    delete [] entries;
+    if (file != NULL) {
+        file->close();
+        delete file;
+    }
+    delete [] contigForRef;
+    for (int i = 0; i < nReadGroups; i++) {
+        delete [] readGroups[i];
+    }
+    delete [] readGroups;
+    DestroyExclusiveLock(&lock);
+}
+
+    void
+CramReader::init(
+    const char* i_fileName,
+    int bufferCount)
+{
+    fileName = i_fileName;
+    if (! strcmp("-", fileName)) {
+        WriteErrorMessage("CRAM input can't come from stdin\n");
+        soft_exit(1);
+    }
+    file = GenericFile::open(fileName, GenericFile::ReadOnly);
+    if (file == NULL) {
+        WriteErrorMessage("Unable to read file %s\n", fileName);
+        soft_exit(1);
+    }
+    readHeader();
+
+    count = bufferCount;
+    entries = new Entry[count];
+    for (int i = 0; i < count; i++) {
+        Entry* entry = &entries[i];
+        entry->state = EntryAvailable;
+        entry->next = i < count - 1 ? &entries[i + 1] : NULL;
+        entry->batch = DataBatch(0, 0);
+        entry->holds = 0;
+        entry->eof = false;
+        entry->nSlices = 0;
+    }
+    available = entries;
+
+    threadStarted = true;
+    if (! StartNewThread(decodeThread, this)) {
+        WriteErrorMessage("failed to start CRAM decodeThread\n");
+        soft_exit(1);
+    }
+}
+
+    bool
+CramReader::readFully(
+    void* buffer,
+    size_t bytes)
+{
+    size_t done = 0;
+    while (done < bytes) {
+        size_t n = file->read((char*) buffer + done, bytes - done);
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    fileOffset += done;
+    return done == bytes;
+}
+
+    void
+CramReader::readHeader()
+/*++
+
+Routine Description:
+
+    Read the file definition and the header container, take the SAM header from it, and work out which contig in
+    the index each reference in the header is.
+
+--*/
+{
+    char definition[26];
+    if (! readFully(definition, sizeof(definition)) || memcmp(definition, "CRAM", 4) != 0) {
+        WriteErrorMessage("CramReader: '%s' is not a valid CRAM file\n", fileName);
+        soft_exit(1);
+    }
+    majorVersion = definition[4];
+    if (majorVersion != 2 && majorVersion != 3) {
+        WriteErrorMessage("CramReader: '%s' is CRAM %d.%d; only 2.1 and 3.0 are supported\n", fileName, definition[4], definition[5]);
+        soft_exit(1);
+    }
+
+    Entry* container = new Entry();
+    if (! readContainer(container) && container->data.getUsed() == 0) {
+        WriteErrorMessage("CramReader: '%s' has no header\n", fileName);
+        soft_exit(1);
+    }
+    CramCursor cursor(container->data.getData(), container->data.getUsed());
+    CramBuffer buffer;
+    z_stream zstream;
+    zstream.zalloc = Z_NULL;
+    zstream.zfree = Z_NULL;
+    zstream.opaque = Z_NULL;
+    zstream.next_in = Z_NULL;
+    zstream.avail_in = 0;
+    inflateInit2(&zstream, 15 + 32);
+    CramRansTables* rans = new CramRansTables();
+    int contentType, contentId;
+    const char* data;
+    size_t size;
+    const char* error;
+    bool ok = ReadCramBlock(&cursor, majorVersion, &contentType, &contentId, &data, &size, &buffer, &zstream, rans, &error);
+    inflateEnd(&zstream);
+    delete rans;
+    if (! ok || contentType != CramFileHeaderBlock || size < 4) {
+        WriteErrorMessage("CramReader: '%s' has a malformed header%s%s\n", fileName, ok ? "" : ": ", ok ? "" : error);
+        soft_exit(1);
+    }
+    _int64 textLength = min((_int64) (size - 4), (_int64) (((_uint8) data[0]) | (((_uint8) data[1]) << 8) | (((_uint8) data[2]) << 16) | (((_uint32) (_uint8) data[3]) << 24)));
+    char* text = new char[textLength + 1];
+    memcpy(text, data + 4, textLength);
+    text[textLength] = 0;
+    delete container;
+
+    _int64 textHeaderSize;
+    bool sawWholeHeader;
+    if (! SAMReader::parseHeader(fileName, text, text + textLength + 1, context.genome, &textHeaderSize, &context.headerMatchesIndex, &sawWholeHeader) ||
+        ! sawWholeHeader) {
+        WriteErrorMessage("CramReader: failed to parse header on '%s'\n", fileName);
+        soft_exit(1);
+    }
+    text[textHeaderSize] = 0;
+    context.header = text;
+    context.headerLength = textHeaderSize;
+    context.headerBytes = fileOffset;
+
+    // @SQ lines are the references, in order, and @RG lines the read groups
+    for (int pass = 0; pass < 2; pass++) {
+        int nSQ = 0, nRG = 0;
+        for (char* line = text; line < text + textHeaderSize; ) {
+            char* end = strchr(line, '\n');
+            if (end == NULL) {
+                end = text + textHeaderSize;
+            }
+            bool sq = ! strncmp(line, "@SQ\t", 4);
+            bool rg = ! strncmp(line, "@RG\t", 4);
+            for (char* field = line + 3; (sq || rg) && field < end; field = strchr(field + 1, '\t')) {
+                if (field == NULL || field >= end) {
+                    break;
+                }
+                if (sq && ! strncmp(field, "\tSN:", 4)) {
+                    if (pass == 1) {
+                        size_t nameLength = strcspn(field + 4, "\t\n");
+                        char* name = new char[nameLength + 1];
+                        memcpy(name, field + 4, nameLength);
+                        name[nameLength] = 0;
+                        GenomeLocation ignored;
+                        int index;
+                        contigForRef[nSQ] = -1;
+                        if (context.genome != NULL && context.genome->getLocationOfContig(name, &ignored, &index)) {
+                            contigForRef[nSQ] = index;
+                        }
+                        delete [] name;
+                    }
+                    nSQ++;
+                    break;
+                }
+                if (rg && ! strncmp(field, "\tID:", 4)) {
+                    if (pass == 1) {
+                        size_t idLength = strcspn(field + 4, "\t\n");
+                        char* aux = new char[idLength + 4];
+                        memcpy(aux, "RGZ", 3);
+                        memcpy(aux + 3, field + 4, idLength);
+                        aux[3 + idLength] = 0;
+                        readGroups[nRG] = aux;
+                    }
+                    nRG++;
+                    break;
+                }
+            }
+            line = end + 1;
+        }
+        if (pass == 0) {
+            nRefs = nSQ;
+            contigForRef = new int[max(nSQ, 1)];
+            nReadGroups = nRG;
+            readGroups = new char*[max(nRG, 1)];
+        }
+    }
+}
+
+    bool
+CramReader::readContainer(
+    Entry* entry)
+/*++
+
+Routine Description:
+
+    Read the next container into entry, skipping any without records (like the one at the end of the file) except
+    for the header container, which is the first.
+
+--*/
+{
+    while (true) {
+        CramBuffer raw;
+        _uint8* p = (_uint8*) raw.reserve(4);
+        if (! readFully(p, 4)) {
+            // files needn't have the end of file container
+            return false;
+        }
+        raw.advance(4);
+        _int32 length = p[0] | (p[1] << 8) | (p[2] << 16) | ((_uint32) p[3] << 24);
+
+        // the rest of the header, an integer at a time: reference, start, span, records, record counter, bases,
+        // blocks, landmarks
+        _int64 values[8];
+        for (int i = 0; i < 8; i++) {
+            readInteger(&raw, (i == 4 && majorVersion >= 3) || i == 5, &values[i]);
+        }
+        if (values[7] < 0 || values[7] > 100000) {
+            WriteErrorMessage("CramReader: '%s' has a malformed container header at offset %lld\n", fileName, fileOffset);
+            soft_exit(1);
+        }
+        entry->landmarks.clear();
+        for (int i = 0; i < values[7]; i++) {
+            _int64 landmark;
+            readInteger(&raw, false, &landmark);
+            entry->landmarks.push_back((_int32) landmark);
+        }
+        if (majorVersion >= 3) {
+            _uint32 crc;
+            if (! readFully(&crc, 4)) {
+                WriteErrorMessage("CramReader: '%s' is truncated\n", fileName);
+                soft_exit(1);
+            }
+            if (crc != crc32(0, (const Bytef*) raw.getData(), (uInt) raw.getUsed())) {
+                WriteErrorMessage("CramReader: container header CRC doesn't match in '%s' at offset %lld\n", fileName, fileOffset);
+                soft_exit(1);
+            }
+        }
+        int nRecords = (int) values[3];
+        entry->data.clear();
+        if (length < 0 || ! readFully(entry->data.reserve(length), length)) {
+            WriteErrorMessage("CramReader: '%s' is truncated\n", fileName);
+            soft_exit(1);
+        }
+        entry->data.advance(length);
+        if (nRecords > 0 || context.header == NULL) {
+            return nRecords > 0;
+        }
+    }
+}
+
+    void
+CramReader::readInteger(
+    CramBuffer* raw,
+    bool ltf8,
+    _int64* o_value)
+/*++
+
+Routine Description:
+
+    Read an ITF8 or LTF8 integer from the file, adding its bytes to raw (for the CRC).  The first byte says how many
+    more there are.
+
+--*/
+{
+    _uint8* b = (_uint8*) raw->reserve(9);
+    if (! readFully(b, 1)) {
+        WriteErrorMessage("CramReader: '%s' is truncated\n", fileName);
+        soft_exit(1);
+    }
+    int extra = 0;
+    while (extra < (ltf8 ? 8 : 4) && (b[0] & (0x80 >> extra))) {
+        extra++;
+    }
+    if (extra > 0 && ! readFully(b + 1, extra)) {
+        WriteErrorMessage("CramReader: '%s' is truncated\n", fileName);
+        soft_exit(1);
+    }
+    CramCursor cursor((const char*) b, 1 + extra);
+    *o_value = ltf8 ? cursor.getLtf8() : cursor.getItf8();
+    raw->advance(1 + extra);
+}
+
+    void
+CramReader::decodeThread(
+    void* context)
+/*++
+
+Routine Description:
+
+    Read containers into available entries, and decode them, as many at a time as there are entries available and
+    threads to decode them, so each gets its own.
+
+--*/
+{
+    CramReader* reader = (CramReader*) context;
+    CramDecodeWorkerManager manager(reader);
+    int nThreads = max(1, min(8, DataSupplier::ThreadCount));
+    ParallelCoworker coworker(nThreads, false, &manager);
+    coworker.start();
+    manager.entries = new Entry*[nThreads];
+    z_stream zstream;
+    zstream.zalloc = Z_NULL;
+    zstream.zfree = Z_NULL;
+    zstream.opaque = Z_NULL;
+    zstream.next_in = Z_NULL;
+    zstream.avail_in = 0;
+    inflateInit2(&zstream, 15 + 32);
+    CramRansTables* rans = new CramRansTables();
+    bool eof = false;
+    while (! eof) {
+        manager.nEntries = 0;
+        manager.tasks.clear();
+        Entry* entry = reader->dequeueAvailable(true);
+        while (entry != NULL) {
+            manager.entries[manager.nEntries++] = entry;
+            entry->nSlices = 0;
+            if (eof || ! reader->readContainer(entry)) {
+                eof = entry->eof = true;
+                break;
+            }
+            entry->eof = false;
+            const char* error;
+            CramCursor cursor(entry->data.getData(), entry->data.getUsed());
+            int contentType, contentId;
+            const char* data;
+            size_t size;
+            CramBuffer* buffer = entry->outputs.size() > 0 ? entry->outputs[0] : NULL;
+            if (buffer == NULL) {
+                buffer = new CramBuffer();
+                entry->outputs.push_back(buffer);
+            }
+            // the compression header is small and usually raw; decompress it into the first output buffer, if need be
+            if (! ReadCramBlock(&cursor, reader->majorVersion, &contentType, &contentId, &data, &size, buffer, &zstream, rans, &error) ||
+                contentType != CramCompressionHeaderBlock || ! entry->compression.parse(data, size, &error)) {
+                WriteErrorMessage("CRAM file '%s' can't be read: %s\n", reader->fileName,
+                    contentType != CramCompressionHeaderBlock ? "container doesn't start with a compression header" : error);
+                soft_exit(1);
+            }
+            entry->nSlices = (int) entry->landmarks.size();
+            while (entry->outputs.size() < entry->nSlices) {
+                entry->outputs.push_back(new CramBuffer());
+            }
+            for (int i = 0; i < entry->nSlices; i++) {
+                if (entry->landmarks[i] < 0 || (size_t) entry->landmarks[i] > entry->data.getUsed() ||
+                    (i > 0 && entry->landmarks[i] < entry->landmarks[i - 1])) {
+                    WriteErrorMessage("CRAM file '%s' can't be read: bad slice offset\n", reader->fileName);
+                    soft_exit(1);
+                }
+                CramDecodeWorkerManager::Task task;
+                task.entry = entry;
+                task.slice = i;
+                manager.tasks.push_back(task);
+            }
+            entry = manager.nEntries < nThreads ? reader->dequeueAvailable(false) : NULL;
+        }
+        if (manager.nEntries == 0) {
+            break; // stopping
+        }
+        if (manager.tasks.size() > 0) {
+            coworker.step();
+        }
+        for (int i = 0; i < manager.nEntries; i++) {
+            Entry* e = manager.entries[i];
+            e->batch = DataBatch(reader->nextBatchID++);
+            e->holds = 1;
+            reader->enqueueReady(e);
+        }
+    }
+    coworker.stop();
+    delete [] manager.entries;
+    inflateEnd(&zstream);
+    delete rans;
+    AllowEventWaitersToProceed(&reader->decodeThreadDone);
+}
+
+    bool
+CramReader::getNextRead(
+    Read* read)
+{
+    CramInputRecord* record;
+    Entry* entry;
+    do {
+        while (true) {
+            entry = peekReady();
+            if (entry->eof) {
+                return false;
+            }
+            if (readSlice < entry->nSlices && readOffset < entry->outputs[readSlice]->getUsed()) {
+                record = (CramInputRecord*) (entry->outputs[readSlice]->getData() + readOffset);
+                readOffset += record->size;
+                break;
+            }
+            if (readSlice < entry->nSlices) {
+                readSlice++;
+                readOffset = 0;
+                continue;
+            }
+            // done with this container
+            popReady();
+            releaseBatch(entry->batch);
+            readSlice = 0;
+            readOffset = 0;
+        }
+    } while ((context.ignoreSecondaryAlignments && (record->flag & SAM_SECONDARY)) ||
+             (context.ignoreSupplementaryAlignments && (record->flag & SAM_SUPPLEMENTARY)));
+
+    const char* rnext = "*";
+    unsigned rnextLen = 1;
+    if (record->nextContig >= 0) {
+        rnext = context.genome->getContigs()[record->nextContig].name;
+        rnextLen = context.genome->getContigs()[record->nextContig].nameLength;
+    }
+    read->init(record->name(), record->nameLength, record->seq(), record->qual(), record->length, record->location, record->mapq,
+        record->flag, record->frontClipping, record->backClipping, record->frontHardClipping, record->backHardClipping,
+        rnext, rnextLen, record->nextPos, true);
+    read->setBatch(entry->batch);
+    read->clip(context.clipping);
+    read->setReadGroup(context.defaultReadGroup);
+    read->setAuxiliaryData(record->auxLength > 0 ? record->aux() : NULL, record->auxLength);
+    for (char* aux = record->aux(); aux < record->aux() + record->auxLength; aux = (char*) ((BAMAlignAux*) aux)->next()) {
+        if (aux[0] == 'R' && aux[1] == 'G' && aux[2] == 'Z') {
+            read->setReadGroup(READ_GROUP_FROM_AUX);
+            break;
+        }
+    }
+    return true;
+}
+
+    void
+CramReader::reinit(
+    _int64 startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    if (startingOffset != 0 || amountOfFileToProcess != 0) {
+        WriteErrorMessage("CramReader: reading part of a CRAM file isn't supported\n");
+        soft_exit(1);
+    }
+}
+
+    void
+CramReader::holdBatch(
+    DataBatch batch)
+{
+    AcquireExclusiveLock(&lock);
+    for (int i = 0; i < count; i++) {
+        if (entries[i].batch == batch) {
+            entries[i].holds++;
+            break;
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    bool
+CramReader::releaseBatch(
+    DataBatch batch)
+{
+    bool released = true;
+    AcquireExclusiveLock(&lock);
+    for (int i = 0; i < count; i++) {
+        Entry* entry = &entries[i];
+        if (entry->batch == batch) {
+            _ASSERT(entry->holds > 0);
+            released = --entry->holds == 0;
+            if (released && entry->state == EntryHeld) {
+                enqueueAvailable(entry);
+            }
+            break;
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+    return released;
+}
+
+    CramReader::Entry*
+CramReader::peekReady()
+{
+    // not thread-safe relative to popReady!
+    if (first == NULL) {
+        WaitForEvent(&readyEvent);
+    }
+    _ASSERT(first->state == EntryReady);
+    return first;
+}
+
+    void
+CramReader::popReady()
+{
+    AcquireExclusiveLock(&lock);
+    _ASSERT(first != NULL && first->state == EntryReady);
+    first->state = EntryHeld;
+    if (first->next == NULL) {
+        _ASSERT(last == first);
+        last = NULL;
+        PreventEventWaitersFromProceeding(&readyEvent);
+    }
+    first = first->next;
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+CramReader::enqueueReady(
+    Entry* entry)
+{
+    AcquireExclusiveLock(&lock);
+    _ASSERT(entry->state == EntryReading);
+    entry->next = NULL;
+    entry->state = EntryReady;
+    if (last == NULL) {
+        first = last = entry;
+        AllowEventWaitersToProceed(&readyEvent);
+    } else {
+        last->next = entry;
+        last = entry;
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    CramReader::Entry*
+CramReader::dequeueAvailable(
+    bool wait)
+{
+    while (true) {
+        AcquireExclusiveLock(&lock);
+        if (available != NULL && ! stopping) {
+            _ASSERT(available->state == EntryAvailable);
+            available->state = EntryReading;
+            Entry* result = available;
+            available = available->next;
+            if (available == NULL) {
+                PreventEventWaitersFromProceeding(&availableEvent);
+            }
+            ReleaseExclusiveLock(&lock);
+            return result;
+        }
+        ReleaseExclusiveLock(&lock);
+        if (! wait || stopping) {
+            return NULL;
+        }
+        WaitForEvent(&availableEvent);
+    }
+}
+
+    void
+CramReader::enqueueAvailable(
+    Entry* entry)
+{
+    AssertExclusiveLockHeld(&lock);
+    _ASSERT(entry->state == EntryHeld);
+    entry->state = EntryAvailable;
+    entry->next = available;
+    available = entry;
+    if (entry->next == NULL) {
+        AllowEventWaitersToProceed(&availableEvent);
+    }
+}
+
+    CramReader*
+CramReader::create(
+    const char* fileName,
+    int bufferCount,
+    const ReaderContext& context)
+{
+    CramReader* reader = new CramReader(context);
+    reader->init(fileName, bufferCount);
+    return reader;
+}
+
+    ReadSupplierGenerator*
+CramReader::createReadSupplierGenerator(
+    const char* fileName,
+    int numThreads,
+    const ReaderContext& context)
+{
+    CramReader* reader = create(fileName, ReadSupplierQueue::BufferCount(numThreads), context);
+    ReadSupplierQueue* queue = new ReadSupplierQueue((ReadReader*) reader);
+    queue->startReaders();
+    return queue;
+}
+
+    PairedReadSupplierGenerator*
+CramReader::createPairedReadSupplierGenerator(
+    const char* fileName,
+    int numThreads,
+    bool quicklyDropUnmatchedReads,
+    const ReaderContext& context)
+{
+    CramReader* reader = create(fileName, ReadSupplierQueue::BufferCount(numThreads) + PairedReadReader::MatchBuffers, context);
+    PairedReadReader* matcher = PairedReadReader::PairMatcher(reader, quicklyDropUnmatchedReads);
+    ReadSupplierQueue* queue = new ReadSupplierQueue(matcher);
+    queue->startReaders();
+    return queue;
+}
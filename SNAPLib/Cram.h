@@ -0,0 +1,260 @@
+/*++
+
+Module Name:
+
+    Cram.h
+
+Abstract:
+
+    CRAM 3.0 file writer, and a reader for CRAM 2.1 and 3.0.
+
+    Reads are formatted as BAM records (see BAMFormat), so sorting, duplicate marking and everything else that
+    works on BAM output works the same way, and then each batch is turned into CRAM containers by a filter at
+    the end of the chain, the way GzipWriterFilter turns it into BGZF blocks.  Bases are encoded against the
+    Genome that's already loaded, so there's no reference to fetch.
+
+    Each container has one slice, with every data series in an external block of its own, compressed with
+    rANS (order 0) or gzip, whichever is smaller.  Mates are always stored detached and read names are kept.
+
+    The reader decodes a container at a time on a background thread, its slices in parallel, into records that
+    have just what SNAP takes from an input read.  No CIGAR string is built, and the optional fields are dropped
+    unless -pc is set (except RG, which is needed to keep the read group).
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "DataWriter.h"
+#include "VariableSizeVector.h"
+#include "Genome.h"
+#include "Read.h"
+#include "GenericFile.h"
+
+class CramEncodeWorkerManager;
+
+//
+// Growable byte buffer, with the CRAM integer encodings.
+//
+class CramBuffer
+{
+public:
+    CramBuffer() : data(NULL), used(0), capacity(0) {}
+
+    ~CramBuffer() { delete [] data; }
+
+    void clear() { used = 0; }
+
+    char* getData() { return data; }
+
+    size_t getUsed() { return used; }
+
+    // make room for bytes more, and return where they go; call advance once they're written
+    char* reserve(size_t bytes)
+    {
+        if (used + bytes > capacity) {
+            size_t newCapacity = __max(used + bytes, __max((size_t) 4096, 2 * capacity));
+            char* newData = new char[newCapacity];
+            if (used > 0) {
+                memcpy(newData, data, used);
+            }
+            delete [] data;
+            data = newData;
+            capacity = newCapacity;
+        }
+        return data + used;
+    }
+
+    void advance(size_t bytes) { _ASSERT(used + bytes <= capacity); used += bytes; }
+
+    void putByte(_uint8 value) { *(_uint8*) reserve(1) = value; used++; }
+
+    void putBytes(const void* p, size_t bytes) { if (bytes > 0) { memcpy(reserve(bytes), p, bytes); used += bytes; } }
+
+    void putUint32(_uint32 value)
+    {
+        _uint8* p = (_uint8*) reserve(4);
+        p[0] = (_uint8) value; p[1] = (_uint8) (value >> 8); p[2] = (_uint8) (value >> 16); p[3] = (_uint8) (value >> 24);
+        used += 4;
+    }
+
+    void putItf8(_int32 signedValue);
+
+    void putLtf8(_int64 signedValue);
+
+private:
+    char* data;
+    size_t used;
+    size_t capacity;
+};
+
+//
+// Frequency tables for undoing rANS, one per context (just the first for order 0).
+//
+struct CramRansTables
+{
+    _uint16 freq[256][256];
+    _uint16 start[256][256];
+    _uint8 symbol[256][4096];
+};
+
+//
+// The rANS codec of CRAM 3.0 blocks (see Cram.cpp): the writer's order 0 encoder, which appends to out and fails for data
+// it can't code, and the reader's order 0 and order 1 decoder, which needs outSize to be the raw size of the block.
+//
+bool RansEncode0(const _uint8* in, size_t inSize, CramBuffer* out);
+
+bool RansDecode(const _uint8* in, size_t inSize, _uint8* out, size_t outSize, CramRansTables* tables);
+
+class CramWriterFilterSupplier : public DataWriter::FilterSupplier
+{
+public:
+    CramWriterFilterSupplier(const Genome* i_genome, const char* i_fileName, const char* i_indexFileName, bool i_multiThreaded,
+        bool i_sorted);
+
+    virtual ~CramWriterFilterSupplier();
+
+    // compress on the FileEncoder's threads rather than the writer's
+    const bool multiThreaded;
+
+    static const int MaxSliceRecords = 10000;
+
+    virtual DataWriter::Filter* getFilter();
+
+    virtual void onClosing(DataWriterSupplier* supplier);
+
+    // writes the .crai, if there is one
+    virtual void onClosed(DataWriterSupplier* supplier);
+
+private:
+    friend class CramWriterFilter;
+    friend class CramEncodeWorkerManager;
+    friend class CramEncodeWorker;
+    friend class CramSliceEncoder;
+
+    // add the BAM header bytes at the start of a batch, returning the number that were header (the rest are reads)
+    size_t addHeader(const char* data, size_t bytes);
+
+    // turn the BAM header into the CRAM file definition and header container
+    void encodeHeader(CramBuffer* o_output);
+
+    struct IndexEntry {
+        int refId;
+        _int64 start, span;
+        _uint64 containerOffset;
+        _int64 sliceOffset, sliceSize;
+    };
+
+    struct ContigInfo {
+        const char* name; // points into header
+        _int64 length;
+    };
+
+    const Genome* genome;
+    const char* fileName;
+    const char* indexFileName; // NULL for no .crai
+    const bool sorted; // break slices where the contig changes
+    bool headerDone;
+    VariableSizeVector<char> header; // BAM header
+    ContigInfo* contigs; // from the header
+    int nContigs;
+    volatile _int64 recordCounter;
+    bool closing;
+    ExclusiveLock lock;
+    VariableSizeVector<IndexEntry> index;
+};
+
+class CramReader : public PairedReadReader, public ReadReader {
+public:
+
+        CramReader(const ReaderContext& i_context);
+
+        virtual ~CramReader();
+
+        void init(const char* fileName, int bufferCount);
+
+        virtual bool getNextRead(Read* readToUpdate);
+
+        //
+        // Pairs are put together by PairedReadReader::PairMatcher, as they are for BAM.
+        //
+        virtual bool getNextReadPair(Read* read1, Read* read2)
+        { return false; }
+
+        virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+        virtual void holdBatch(DataBatch batch);
+
+        virtual bool releaseBatch(DataBatch batch);
+
+        virtual ReaderContext* getContext()
+        { return ((ReadReader*)this)->getContext(); }
+
+        static CramReader* create(const char* fileName, int bufferCount, const ReaderContext& context);
+
+        static ReadSupplierGenerator* createReadSupplierGenerator(const char* fileName, int numThreads, const ReaderContext& context);
+
+        static PairedReadSupplierGenerator* createPairedReadSupplierGenerator(const char* fileName, int numThreads, bool quicklyDropUnmatchedReads,
+            const ReaderContext& context);
+
+private:
+        friend class CramDecodeWorkerManager;
+        friend class CramDecodeWorker;
+        friend class CramSliceDecoder;
+
+        enum EntryState
+        {
+            EntryReady, // decoded, for reading by client, on first list
+            EntryHeld, // finished reading but not released, not on a list
+            EntryAvailable, // released by client, on available list
+            EntryReading // reading or decoding, not on a list
+        };
+
+        struct Entry; // a container, and the records decoded from it
+
+        void readHeader();
+
+        // read the next container that has records into the entry, false at the end of the file
+        bool readContainer(Entry* entry);
+
+        bool readFully(void* buffer, size_t bytes);
+
+        void readInteger(CramBuffer* raw, bool ltf8, _int64* o_value);
+
+        static void decodeThread(void* context);
+
+        // use only these routines to manipulate the linked lists
+        Entry* peekReady(); // from first, block if none
+        void popReady(); // from first
+        void enqueueReady(Entry* entry); // as last
+        Entry* dequeueAvailable(bool wait); // as available, NULL if none and not waiting, or stopping
+        void enqueueAvailable(Entry* entry); // from available
+
+        const char* fileName;
+        GenericFile* file;
+        int majorVersion;
+        _int64 fileOffset;
+        int nRefs;
+        int* contigForRef; // CRAM reference id to contig number in the index, -1 if it isn't there
+        int nReadGroups;
+        char** readGroups; // RG:Z fields (in BAM form) for the @RG lines, in order
+
+        Entry* entries;
+        int count;
+        Entry* first; // first ready entry, NULL if none, currently being read by client
+        Entry* last; // last ready entry, NULL if none
+        EventObject readyEvent; // signalled by bg thread when first goes NULL->non-NULL
+        Entry* available; // first non-ready entry (head of freelist), NULL if none
+        EventObject availableEvent; // signalled by main thread when available goes NULL->non-NULL
+        ExclusiveLock lock; // lock on linked list pointers and holds
+        bool threadStarted;
+        volatile bool stopping;
+        EventObject decodeThreadDone; // signalled by background thread on exit
+        _uint32 nextBatchID;
+        int readSlice; // where getNextRead is in the first ready entry
+        size_t readOffset;
+};
@@ -25,8 +25,28 @@ Environment:
 #include "DataReader.h"
 #include "Bam.h"
 #include "zlib.h"
+#include "GzipBlockCodec.h"
+#include "ParallelInflate.h"
+#ifdef SNAP_ZSTD
+#include <zstd.h>
+#endif // SNAP_ZSTD
 #include "exit.h"
 #include "Error.h"
+#include "ObjectStore.h"
+#include "CommandProcessor.h"
+#include "ProgressReport.h"
+#include "StageTiming.h"
+#include "PipelineTrace.h"
+#ifdef SNAP_HDFS
+#include "GenericFile_HDFS.h"
+#endif // SNAP_HDFS
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif // __linux__
 
 using std::max;
 using std::min;
@@ -45,7 +65,7 @@ class ReadBasedDataReader : public DataReader
 {
 public:
 
-    ReadBasedDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace = 0);
+    ReadBasedDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace = 0, _int64 minExtraBytes = 0);
 
     virtual ~ReadBasedDataReader();
     
@@ -163,7 +183,8 @@ ReadBasedDataReader::ReadBasedDataReader(
     unsigned i_nBuffers,
     _int64 i_overflowBytes,
     double extraFactor,
-    size_t i_bufferSpace)
+    size_t i_bufferSpace,
+    _int64 minExtraBytes)
     : DataReader(), nBuffers(i_nBuffers), overflowBytes(i_overflowBytes),
     maxBuffers(i_nBuffers * (i_nBuffers == 1 ? 2 : 4)),
     bufferSize(i_bufferSpace > 0 ? i_bufferSpace / (i_nBuffers * 2) : BUFFER_SIZE),
@@ -179,7 +200,7 @@ ReadBasedDataReader::ReadBasedDataReader(
     // NOTE: buffers are not null-terminated (since memmap version can't do it)
     _ASSERT(extraFactor >= 0 && i_nBuffers > 0);
     bufferInfo = new BufferInfo[maxBuffers];
-    extraBytes = max((_int64) 0, (_int64) ((bufferSize + overflowBytes) * extraFactor));
+    extraBytes = max(minExtraBytes, (_int64) ((bufferSize + overflowBytes) * extraFactor));
     char* allocated = (char*) BigReserve(maxBuffers * (bufferSize + extraBytes + overflowBytes));
     BigCommit(allocated, nBuffers * (bufferSize + extraBytes + overflowBytes));
     if (NULL == allocated) {
@@ -635,6 +656,13 @@ ReadBasedDataReader::releaseBatch(
                 if (info->holds > 0) {
                     info->holds--;
                 }
+                if (info->holds == 0 && info->state == Full && (int)i == nextBufferForConsumer) {
+                    //
+                    // The consumer is still reading this one (a supplier can hold and let go of the batch it's in the
+                    // middle of).  nextBatch will release it when it moves on.
+                    //
+                    break;
+                }
                 if (info->holds == 0) {
                     //fprintf(stderr,"%x releaseBatch batch %d, releasing %s buffer %d\n", (unsigned) this, batch.batchID, info->state == InUse ? "InUse" : "Full", i);
                     info->state = Empty;
@@ -751,251 +779,6 @@ ReadBasedDataReader::addBuffer()
     }
 }
 
-class StdioDataReader : public ReadBasedDataReader 
-{
-public:
-    StdioDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor);
-    ~StdioDataReader();
-
-    virtual bool init(const char* i_fileName);
-
-    virtual const char* getFilename()
-    { return "-"; }
-
- protected:
-    
-    // must hold the lock to call
-    virtual void startIo();
-
-    // must hold the lock to call
-    virtual void waitForBuffer(unsigned bufferNumber);
-
-private:
-    //
-    // Because reads don't necessarily divide evenly into buffers, we have to assure that
-    // the buffers that we read can overlap.  In file-IO based readers, we do this by reading
-    // a buffer's worth of data each time, but advancing the file pointer only by
-    // bufferSize - overflowBytes, so each buffer ovelaps with its predecessor by a little.
-    // That doesn't work for stdio, since it can't rewind.  So, instead, we allocate
-    // storage on the side to hold a copy of the last overflowBytes
-    // and then just copy those bytes into the beginning of the next buffer to read.
-    // We also use this buffer to hold the header (the first read), and to allow
-    // reading the header plus some extra data, parsing the header, and then seeking
-    // backward to the actual end of the header.
-    //
-
-    char    *overflowBuffer;
-    bool     overflowBufferFilled;   // For the very first read, there may be no overlap buffer data.
-
-    bool    started;
-    bool    hitEOF;
-
-    _int64 readOffset;
-};
-
-StdioDataReader::StdioDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor) :
-    ReadBasedDataReader(i_nBuffers, i_overflowBytes, extraFactor), started(false), hitEOF(false), overflowBufferFilled(false),
-    readOffset(0), overflowBuffer(NULL)
-{
-}
-
-StdioDataReader::~StdioDataReader()
-{
-    BigDealloc(overflowBuffer);
-    overflowBuffer = NULL;
-}
-
-bool
-StdioDataReader::init(const char * i_fileName)
-{
-    if (strcmp(i_fileName, "-")) {
-        WriteErrorMessage("StdioDataReader: must have filename of '-', got '%s'\n", i_fileName);
-        soft_exit(1);
-    }
-
-#ifdef _MSC_VER
-    int result = _setmode( _fileno( stdin ), _O_BINARY );  // puts stdin in to non-translated mode, so if we're reading compressed data windows' CRLF processing doesn't destroy it.
-    if (-1 == result) {
-        WriteErrorMessage("StdioDataReader::freopen to change to untranslated mode failed\n");
-        soft_exit(1);
-    }
-#endif // _MSC_VER
-
-    return true;
-}
-
-void
-StdioDataReader::startIo()
-{
-	AssertExclusiveLockHeld(&lock);
-	
-	started = true;
-
-    //
-    // Synchronously read data into whatever buffers are ready.
-    //
-    while (nextBufferForReader != -1) {
-        // remove from free list
-        BufferInfo* info = &bufferInfo[nextBufferForReader];
-        _ASSERT(info->state == Empty);
-        int index = nextBufferForReader;
-        nextBufferForReader = info->next;
-        info->batchID = nextBatchID++;
-        // add to end of consumer list
-        if (lastBufferForConsumer != -1) {
-            _ASSERT(bufferInfo[lastBufferForConsumer].next == -1);
-            bufferInfo[lastBufferForConsumer].next = index;
-        }
-        info->next = -1;
-        info->previous = lastBufferForConsumer;
-        lastBufferForConsumer = index;
-		if (nextBufferForConsumer == -1) {
-            //fprintf(stderr, "StdioDataReader::startIo set nextBufferForConsumder -1 -> %d\n", index);
-			nextBufferForConsumer = index;
-		}
-       
-        if (hitEOF) {
-            info->validBytes = 0;
-            info->buffer[0] = '\0';
-            info->nBytesThatMayBeginARead = 0;
-            info->isEOF = true;
-            info->state = Full;
-            return;
-        }
-
-        size_t amountToRead;
-        size_t bufferOffset;
-        if (overflowBufferFilled) {
-            //
-            // Copy the bytes from the overflow buffer into our buffer.
-            //
-			memcpy(info->buffer, overflowBuffer, overflowBytes);
-			bufferOffset = overflowBytes;
-			amountToRead = bufferSize - overflowBytes;
-			info->fileOffset = readOffset - overflowBytes;
-        } else {
-            amountToRead = bufferSize;
-            bufferOffset = 0;
-            info->fileOffset = readOffset;
-        }
-
-        //
-        // We have to run this holding the lock, because otherwise there's no way to make the overflow buffer work properly.  
-        //
-        size_t bytesRead = fread(info->buffer + bufferOffset, 1, amountToRead, stdin);
-        //fprintf(stderr,"StdioDataReader:startIO(): Read offset 0x%llx into buffer at 0x%llx, size %d, copied 0x%x overflow bytes, start at 0x%llx, tid %d\n", readOffset, info->buffer, bytesRead, bufferOffset, readOffset - bufferOffset, GetCurrentThreadId());
-
-        readOffset += bytesRead;
-
-        if (bytesRead != amountToRead) {
-            if (feof(stdin)) {
-                info->isEOF = true;
-                hitEOF = true;
-            } else {
-                WriteErrorMessage("StdinDataReader: Error reading stdin (but not EOF).\n");
-                soft_exit(1);
-            }
-        } else {
-            info->isEOF = false;
-        }
-
-        info->validBytes = (unsigned)(bytesRead + bufferOffset);
-
-        if (hitEOF) {
-            info->nBytesThatMayBeginARead = (unsigned)(bytesRead + bufferOffset);
-            overflowBufferFilled = false;
-        } else {
-            info->nBytesThatMayBeginARead = (unsigned)(bytesRead + bufferOffset - overflowBytes);
-            //
-            // Fill the overflow buffer with the last bytes from this buffer.
-            //
-            if (NULL == overflowBuffer) {
-                //
-                // We can get here if we never called readHeader().  If so, we know we never will and so
-                // we can just allocate the overflow buffer to be the size of the header.
-                //
-                overflowBuffer = (char *)BigAlloc(overflowBytes);
-            }
-            memcpy(overflowBuffer, info->buffer + bufferOffset + bytesRead - overflowBytes, overflowBytes);
-            overflowBufferFilled = true;
-        }
-        info->state = Full;
-    }
-
-    if (nextBufferForConsumer == -1) {
-        //fprintf(stderr, "startIo thread %x reset releaseEvent\n", GetCurrentThreadId());
-        PreventEventWaitersFromProceeding(&releaseEvent);
-    }
-}
- 
-    void
-StdioDataReader::waitForBuffer(
-    unsigned bufferNumber)
-{
-    _ASSERT(bufferNumber >= 0 && (bufferNumber < nBuffers || bufferNumber >= maxBuffers && 0 != headerBuffersOutstanding));
-    BufferInfo *info = &bufferInfo[bufferNumber];
-
-    while (info->state == InUse) {
-        //fprintf(stderr, "StdioDataReader::waitForBuffer %d InUse...\n", bufferNumber);
-        // must already have lock to call, release & wait & reacquire
-        ReleaseExclusiveLock(&lock);
-	// TODO: implement timed wait on Linux
-#ifdef _MSC_VER
-        _int64 start = timeInNanos();
-        _uint32 waitTime;
-        if (releaseWaitInMillis > 0xffffffff) {
-            waitTime = INFINITE;
-        } else {
-            waitTime = (_uint32)releaseWaitInMillis;
-        }
-        _uint32 result = WaitForSingleObject(releaseEvent, waitTime);
-        InterlockedAdd64AndReturnNewValue(&ReleaseWaitTime, timeInNanos() - start);
-#else
-		WaitForEvent(&releaseEvent);
-#endif
-        AcquireExclusiveLock(&lock);
-#ifdef _MSC_VER
-        if (result == WAIT_TIMEOUT) {
-            // this isn't going to directly make this buffer available, but will reduce pressure
-            addBuffer();
-        }
-#endif
-    }
-
-    if (info->state == Full) {
-        return;
-    }
-
-    _ASSERT(info->state != Reading);    // We're synchronous, we don't use Reading
-    startIo();
-    
-    info->state = Full;
-    info->buffer[info->validBytes] = 0;
-}
-
-class StdioDataSupplier : public DataSupplier
-{
-public:
-    StdioDataSupplier() : DataSupplier() {}
-    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor = 0.0, size_t bufferSpace = 0)
-    {
-        if (supplied) {
-            WriteErrorMessage("You can only use stdin input for one run per execution of SNAP (i.e., if you use ',' to run SNAP more than once without reloading the index, you can only use stdin once)\n");
-            soft_exit_no_print(1);
-        }
-
-        supplied = true;
-
-        return new StdioDataReader(bufferCount, overflowBytes, extraFactor);
-    }
-private:
-
-    static bool supplied;
-};
-
-bool StdioDataSupplier::supplied = false;
-
-
 #ifdef _MSC_VER
 class WindowsOverlappedDataReader : public ReadBasedDataReader
 {
@@ -1239,7 +1022,9 @@ WindowsOverlappedDataReader::waitForBuffer(
         WriteErrorMessage("Error reading FASTQ file, %d\n",GetLastError());
         soft_exit(1);
     }
-    InterlockedAdd64AndReturnNewValue(&ReadWaitTime, timeInNanos() - start);
+    _int64 waitNanos = timeInNanos() - start;
+    InterlockedAdd64AndReturnNewValue(&ReadWaitTime, waitNanos);
+    ADD_STAGE_TIME(ReadWaitStage, waitNanos);
 
     info->state = Full;
     info->buffer[info->validBytes] = 0;
@@ -1279,745 +1064,3272 @@ DataSupplier* DataSupplier::WindowsOverlapped = new WindowsOverlappedDataSupplie
 
 #endif // _MSC_VER
 
+#ifdef __linux__
+
 //
-// Decompress
+// io_uring
+//
+// The Linux counterpart of the overlapped reader: reads go to the kernel through an io_uring (see IoUring in
+// Compat.h), so several buffers are being filled at once without a thread for each, and without the page faults
+// that the memory mapped reader takes one at a time on cold files.  The ring is only used under the reader's lock.
 //
 
-static const int windowBits = 15;
-static const int ENABLE_ZLIB_GZIP = 32;
-
-static const double MIN_FACTOR = 1.2;
-static const double MAX_FACTOR = 10.0;
-
-class DecompressDataReader : public DataReader
+class IoUringDataReader : public ReadBasedDataReader
 {
 public:
 
-    DecompressDataReader(DataReader* i_inner, int i_count, _int64 totalExtra, _int64 i_extraBytes, _int64 i_overflowBytes, int i_chunkSize = BAM_BLOCK);
-
-    virtual ~DecompressDataReader();
+    IoUringDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace, unsigned i_queueDepth);
 
-    virtual bool init(const char* fileName);
+    virtual ~IoUringDataReader();
 
-    virtual char* readHeader(_int64* io_headerSize);
+    virtual bool init(const char* i_fileName);
 
     virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
 
-    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL);
-
-    virtual void advance(_int64 bytes);
-
-    virtual void nextBatch();
-
-    virtual bool isEOF();
-
-    virtual DataBatch getBatch();
-
-    virtual void holdBatch(DataBatch batch);
-
-    virtual bool releaseBatch(DataBatch batch);
-
-    virtual _int64 getFileOffset();
-
-    virtual void getExtra(char** o_extra, _int64* o_length);
-
     virtual const char* getFilename()
-    { return inner->getFilename(); }
+    { return fileName; }
 
-    enum DecompressMode { SingleBlock, ContinueMultiBlock, StartMultiBlock };
+ protected:
 
-    static bool decompress(z_stream* zstream, ThreadHeap* heap, char* input, _int64 inputSize, _int64* o_inputUsed,
-        char* output, _int64 outputSize, _int64* o_outputUsed, DecompressMode mode);
+    // must hold the lock to call
+    virtual void startIo();
 
-    // debugging
-    char* findPointer(void* p);
+    // must hold the lock to call
+    virtual void waitForBuffer(unsigned bufferNumber);
 
 private:
 
+    // must hold the lock to call; takes the next completion and finishes off its buffer
+    void completeOne();
 
-    static void decompressThread(void *context);
+    IoUring             ring;
+    const unsigned      queueDepth;
+    unsigned            nReading;           // reads in the ring
+    unsigned            nRegistered;        // buffers below this are registered with the ring
+    unsigned*           bytesRead;          // by buffer, so far; sized for maxBuffers so added buffers fit
 
-    static void decompressThreadContinuous(void *context);
+    const char*         fileName;
+    int                 fd;
+    _int64              fileSize;
+    _int64              readOffset;
+    _int64              endingOffset;
+};
 
-    friend class DecompressManager;
-    friend class DecompressWorker;
+IoUringDataReader::IoUringDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace, unsigned i_queueDepth) :
+    ReadBasedDataReader(i_nBuffers, i_overflowBytes, extraFactor, bufferSpace), queueDepth(__max(i_queueDepth, 1)), nReading(0),
+    nRegistered(0), fileName(NULL), fd(-1), fileSize(0), readOffset(0), endingOffset(0)
+{
+    bytesRead = new unsigned[maxBuffers];
+    if (! ring.init(queueDepth)) {
+        WriteErrorMessage("IoUringDataReader: unable to set up io_uring, %d\n", errno);
+        soft_exit(1);
+    }
 
-    enum EntryState
+    //
+    // Registering the buffers we start with saves the kernel mapping them on every read.  It pins them, which counts
+    // against the locked memory limit, so if it can't be done the reads just aren't fixed.  Only the part that gets
+    // read into is registered, not the extra space that goes with each buffer (which can be much bigger).
+    //
+    iovec* buffers = new iovec[nBuffers];
+    for (unsigned i = 0; i < nBuffers; i++) {
+        buffers[i].iov_base = bufferInfo[i].buffer;
+        buffers[i].iov_len = bufferSize + overflowBytes;
+    }
+    if (ring.registerBuffers(buffers, nBuffers)) {
+        nRegistered = nBuffers;
+    }
+    delete [] buffers;
+}
+
+IoUringDataReader::~IoUringDataReader()
+{
+    AcquireExclusiveLock(&lock);
+    while (nReading > 0) {
+        completeOne();
+    }
+    ReleaseExclusiveLock(&lock);
+    delete [] bytesRead;
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+    bool
+IoUringDataReader::init(
+    const char* i_fileName)
+{
+    fileName = i_fileName;
+    fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        WriteErrorMessage("IoUringDataReader: unable to get file size of '%s', %d\n", fileName, errno);
+        return false;
+    }
+    fileSize = sb.st_size;
+    return true;
+}
+
+    void
+IoUringDataReader::reinit(
+    _int64 i_startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    _ASSERT(fd >= 0);  // Must call init() before reinit()
+
+    AcquireExclusiveLock(&lock);
+
+    //
+    // First let any pending IO complete.
+    //
+    while (nReading > 0) {
+        completeOne();
+    }
+    for (unsigned i = 0; i < nBuffers; i++) {
+        bufferInfo[i].state = Empty;
+        bufferInfo[i].isEOF= false;
+        bufferInfo[i].offset = 0;
+        bufferInfo[i].next = i < nBuffers - 1 ? i + 1 : -1;
+        bufferInfo[i].previous = i > 0 ? i - 1 : -1;
+    }
+
+    nextBufferForConsumer = -1;
+    lastBufferForConsumer = -1;
+    nextBufferForReader = 0;
+
+    readOffset = i_startingOffset;
+    if (amountOfFileToProcess == 0) {
+        //
+        // This means just read the whole file.
+        //
+        endingOffset = fileSize;
+    } else {
+        endingOffset = min(fileSize, i_startingOffset + amountOfFileToProcess);
+    }
+
+    //
+    // Kick off IO, wait for the first buffer to be read
+    //
+    startIo();
+    waitForBuffer(nextBufferForConsumer);
+
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+IoUringDataReader::startIo()
+{
+    //
+    // Launch reads on whatever buffers are ready, as many as the queue depth allows.
+    //
+    AssertExclusiveLockHeld(&lock);
+
+    while (nextBufferForReader != -1 && nReading < queueDepth) {
+        // remove from free list
+        BufferInfo* info = &bufferInfo[nextBufferForReader];
+        _ASSERT(info->state == Empty);
+        int index = nextBufferForReader;
+        nextBufferForReader = info->next;
+        info->batchID = nextBatchID++;
+        // add to end of consumer list
+        if (lastBufferForConsumer != -1) {
+            _ASSERT(bufferInfo[lastBufferForConsumer].next == -1);
+            bufferInfo[lastBufferForConsumer].next = index;
+        }
+        info->next = -1;
+        info->previous = lastBufferForConsumer;
+        lastBufferForConsumer = index;
+
+		if (nextBufferForConsumer == -1) {
+				nextBufferForConsumer = index;
+		}
+
+        if (readOffset >= fileSize || readOffset >= endingOffset) {
+            info->validBytes = 0;
+            info->nBytesThatMayBeginARead = 0;
+            info->isEOF = true;
+            info->state = Full;
+            break;
+        }
+
+        _int64 finalOffset = min(fileSize, endingOffset + overflowBytes);
+        _int64 finalStartOffset = min(fileSize, endingOffset);
+        unsigned amountToRead = (unsigned)min(finalOffset - readOffset, (_int64) bufferSize);   // Cast OK because can't be longer than unsigned bufferSize
+        info->isEOF = readOffset + amountToRead == finalOffset;
+        info->nBytesThatMayBeginARead = (unsigned)min((_int64)bufferSize - overflowBytes, finalStartOffset - readOffset);
+
+        _ASSERT(amountToRead >= info->nBytesThatMayBeginARead && (!info->isEOF || finalOffset == readOffset + amountToRead));
+        info->fileOffset = readOffset;
+        info->validBytes = amountToRead;   // getData looks at this to see if we're at EOF, even before the read is done
+        bytesRead[index] = 0;
+
+        readOffset += info->nBytesThatMayBeginARead;
+        info->state = Reading;
+        info->offset = 0;
+
+        ring.queueRead(fd, info->buffer, amountToRead, info->fileOffset, index, (unsigned) index < nRegistered ? index : -1);
+        nReading++;
+    }
+    ring.submit();
+
+    if (nextBufferForConsumer == -1) {
+        PreventEventWaitersFromProceeding(&releaseEvent);
+    }
+}
+
+    void
+IoUringDataReader::completeOne()
+{
+    _uint64 index;
+    int result;
+    ring.waitForCompletion(&index, &result);
+    _ASSERT(index < nBuffers && nReading > 0);
+    nReading--;
+
+    BufferInfo* info = &bufferInfo[index];
+    if (result < 0) {
+        WriteErrorMessage("Error reading file '%s' at offset %lld, %d\n", fileName, info->fileOffset + bytesRead[index], -result);
+        soft_exit(1);
+    }
+    bytesRead[index] += result;
+    if (result > 0 && bytesRead[index] < info->validBytes) {
+        //
+        // A short read (which a regular file only gives us if it's interrupted).  Go back for the rest.
+        //
+        ring.queueRead(fd, info->buffer + bytesRead[index], info->validBytes - bytesRead[index],
+            info->fileOffset + bytesRead[index], index, index < nRegistered ? (int) index : -1);
+        ring.submit();
+        nReading++;
+        return;
+    }
+    if (bytesRead[index] < info->validBytes) {
+        WriteErrorMessage("Unexpected end of file '%s' at offset %lld\n", fileName, info->fileOffset + bytesRead[index]);
+        soft_exit(1);
+    }
+    info->state = Full;
+    info->buffer[info->validBytes] = 0;
+}
+
+    void
+IoUringDataReader::waitForBuffer(
+    unsigned bufferNumber)
+{
+    _ASSERT(bufferNumber >= 0 && (bufferNumber < nBuffers || bufferNumber >= maxBuffers && 0 != headerBuffersOutstanding));
+    BufferInfo *info = &bufferInfo[bufferNumber];
+
+    while (info->state == InUse) {
+        // must already have lock to call, release & wait & reacquire
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&releaseEvent);
+        AcquireExclusiveLock(&lock);
+    }
+
+    if (info->state == Full) {
+        return;
+    }
+
+    if (info->state != Reading) {
+        startIo();
+    }
+
+    _int64 start = timeInNanos();
+    while (info->state == Reading) {
+        completeOne();
+    }
+    _int64 waitNanos = timeInNanos() - start;
+    InterlockedAdd64AndReturnNewValue(&ReadWaitTime, waitNanos);
+    ADD_STAGE_TIME(ReadWaitStage, waitNanos);
+
+    //
+    // Now that some buffers are done, start reading into the ones that the queue depth held back.
+    //
+    startIo();
+}
+
+class IoUringDataSupplier : public DataSupplier
+{
+public:
+    IoUringDataSupplier(unsigned i_queueDepth) : DataSupplier(), queueDepth(i_queueDepth) {}
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor, size_t bufferSpace)
     {
-        EntryReady, // for reading by client, on first list
-        EntryHeld, // finished reading but not released, not on a list
-        EntryAvailable, // released by client, on available list
-        EntryReading // reading or decompressing, not on a list
-    };
+        // add some buffers for read-ahead
+        return new IoUringDataReader(bufferCount + (bufferCount > 1 ? 4 : 0), overflowBytes, extraFactor, bufferSpace, queueDepth);
+    }
+
+private:
+    const unsigned queueDepth;
+};
+
+#endif // __linux__
+
+    bool
+DataSupplier::UseIoUring(
+    unsigned queueDepth)
+/*++
+
+Routine Description:
+
+    Make io_uring the default way to read input files (and the compressed ones under the gzip suppliers), with up to
+    queueDepth reads outstanding per reader.  Call it before any readers are made.
+
+Return Value:
+
+    false if io_uring isn't available here, in which case nothing changes.
+
+--*/
+{
+#ifdef __linux__
+    IoUring probe;
+    if (! probe.init(queueDepth)) {
+        return false;
+    }
+    Default = RemoteFiles(new IoUringDataSupplier(queueDepth));
+    GzipDefault = ParallelGzip(Default);
+    GzipBamDefault = GzipBam(Default);
+    return true;
+#else
+    return false;
+#endif // __linux__
+}
+
+//
+// Readahead
+//
+// A reader for storage that only has blocking reads (libhdfs, HTTP), which has a thread of its own that reads ahead
+// into the free buffers in file order, a whole buffer at a time, while the consumer works through the ones that are
+// already full.  Subclasses open the file in init(), set fileSize and call startReadahead(); their readaheadThread()
+// loops taking buffers with takePending() and handing them back filled with bufferFilled(), and their destructors
+// call stopReadahead() before tearing down anything the thread uses.
+//
+
+class ReadaheadDataReader : public ReadBasedDataReader
+{
+public:
+
+    ReadaheadDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace, _int64 minExtraBytes);
+
+    virtual ~ReadaheadDataReader();
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+protected:
+
+    // must hold the lock to call
+    virtual void startIo();
+
+    // must hold the lock to call
+    virtual void waitForBuffer(unsigned bufferNumber);
+
+    void startReadahead();
+
+    void stopReadahead();
+
+    // runs on the readahead thread, and returns once stopping is set
+    virtual void readaheadThread() = 0;
+
+    // called with the lock held whenever there are new buffers to fill, so a thread that waits on something other
+    // than workReady can be woken
+    virtual void pendingAdded() {}
+
+    // must hold the lock to call; the next buffer to fill, or -1 if there isn't one (and if wait, only when stopping)
+    int takePending(bool wait);
+
+    // must hold the lock to call
+    void bufferFilled(int bufferNumber);
+
+    // must hold the lock to call; give a buffer that's Reading to the readahead thread, after the ones it already has
+    void addPending(int bufferNumber);
+
+    _int64              fileSize;
+    _int64              readOffset;
+    _int64              endingOffset;
+    bool                stopping;
+
+private:
+
+    static void readaheadThreadMain(void* context);
+
+    int*                pending;            // ring of buffers to fill, in file order; sized for maxBuffers
+    unsigned            firstPending;
+    unsigned            nPending;
+    bool                threadStarted;
+    EventObject         workReady;          // there's something pending, or we're stopping
+    EventObject         readDone;           // a buffer has filled
+    SingleWaiterObject  threadExited;
+};
+
+ReadaheadDataReader::ReadaheadDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace, _int64 minExtraBytes) :
+    ReadBasedDataReader(i_nBuffers, i_overflowBytes, extraFactor, bufferSpace, minExtraBytes), fileSize(0), readOffset(0), endingOffset(0),
+    stopping(false), firstPending(0), nPending(0), threadStarted(false)
+{
+    pending = new int[maxBuffers];
+    CreateEventObject(&workReady);
+    PreventEventWaitersFromProceeding(&workReady);
+    CreateEventObject(&readDone);
+    CreateSingleWaiterObject(&threadExited);
+}
+
+ReadaheadDataReader::~ReadaheadDataReader()
+{
+    _ASSERT(!threadStarted);    // The subclass has to stop it, while the thread still has what it needs
+    DestroyEventObject(&workReady);
+    DestroyEventObject(&readDone);
+    DestroySingleWaiterObject(&threadExited);
+    delete [] pending;
+}
+
+    void
+ReadaheadDataReader::startReadahead()
+{
+    if (! StartNewThread(readaheadThreadMain, this)) {
+        WriteErrorMessage("ReadaheadDataReader: unable to start readahead thread\n");
+        soft_exit(1);
+    }
+    threadStarted = true;
+}
+
+    void
+ReadaheadDataReader::stopReadahead()
+{
+    if (!threadStarted) {
+        return;
+    }
+
+    AcquireExclusiveLock(&lock);
+    stopping = true;
+    AllowEventWaitersToProceed(&workReady);
+    pendingAdded();
+    ReleaseExclusiveLock(&lock);
+
+    WaitForSingleWaiterObject(&threadExited);
+    threadStarted = false;
+}
+
+    void
+ReadaheadDataReader::readaheadThreadMain(
+    void* context)
+{
+    BindThreadToHelperProcessors();
+    ReadaheadDataReader* reader = (ReadaheadDataReader*) context;
+    reader->readaheadThread();
+    SignalSingleWaiterObject(&reader->threadExited);
+}
+
+    int
+ReadaheadDataReader::takePending(
+    bool wait)
+{
+    AssertExclusiveLockHeld(&lock);
+    while (wait && 0 == nPending && !stopping) {
+        PreventEventWaitersFromProceeding(&workReady);
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&workReady);
+        AcquireExclusiveLock(&lock);
+    }
+
+    if (stopping || 0 == nPending) {
+        return -1;
+    }
+
+    int bufferNumber = pending[firstPending];
+    firstPending = (firstPending + 1) % maxBuffers;
+    nPending--;
+    _ASSERT(bufferInfo[bufferNumber].state == Reading);
+    return bufferNumber;
+}
+
+    void
+ReadaheadDataReader::bufferFilled(
+    int bufferNumber)
+{
+    AssertExclusiveLockHeld(&lock);
+    BufferInfo* info = &bufferInfo[bufferNumber];
+    _ASSERT(info->state == Reading);
+    info->buffer[info->validBytes] = 0;
+    info->state = Full;
+    AllowEventWaitersToProceed(&readDone);
+}
+
+    void
+ReadaheadDataReader::reinit(
+    _int64 i_startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    _ASSERT(threadStarted);  // Must call init() before reinit()
+
+    AcquireExclusiveLock(&lock);
+
+    //
+    // First let any pending IO complete.  A buffer stays Reading until it's filled, whether or not the readahead
+    // thread has taken it yet.
+    //
+    for (unsigned i = 0; i < nBuffers; i++) {
+        if (bufferInfo[i].state == Reading) {
+            waitForBuffer(i);
+        }
+    }
+    _ASSERT(0 == nPending);
+    for (unsigned i = 0; i < nBuffers; i++) {
+        bufferInfo[i].state = Empty;
+        bufferInfo[i].isEOF= false;
+        bufferInfo[i].offset = 0;
+        bufferInfo[i].next = i < nBuffers - 1 ? i + 1 : -1;
+        bufferInfo[i].previous = i > 0 ? i - 1 : -1;
+    }
+
+    nextBufferForConsumer = -1;
+    lastBufferForConsumer = -1;
+    nextBufferForReader = 0;
+
+    readOffset = i_startingOffset;
+    if (amountOfFileToProcess == 0) {
+        //
+        // This means just read the whole file.
+        //
+        endingOffset = fileSize;
+    } else {
+        endingOffset = min(fileSize, i_startingOffset + amountOfFileToProcess);
+    }
+
+    //
+    // Kick off IO, wait for the first buffer to be read
+    //
+    startIo();
+    waitForBuffer(nextBufferForConsumer);
+
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+ReadaheadDataReader::startIo()
+{
+    //
+    // Hand every free buffer to the readahead thread.
+    //
+    AssertExclusiveLockHeld(&lock);
+
+    while (nextBufferForReader != -1) {
+        // remove from free list
+        BufferInfo* info = &bufferInfo[nextBufferForReader];
+        _ASSERT(info->state == Empty);
+        int index = nextBufferForReader;
+        nextBufferForReader = info->next;
+        info->batchID = nextBatchID++;
+        // add to end of consumer list
+        if (lastBufferForConsumer != -1) {
+            _ASSERT(bufferInfo[lastBufferForConsumer].next == -1);
+            bufferInfo[lastBufferForConsumer].next = index;
+        }
+        info->next = -1;
+        info->previous = lastBufferForConsumer;
+        lastBufferForConsumer = index;
+
+        if (nextBufferForConsumer == -1) {
+            nextBufferForConsumer = index;
+        }
+
+        if (readOffset >= fileSize || readOffset >= endingOffset) {
+            info->validBytes = 0;
+            info->nBytesThatMayBeginARead = 0;
+            info->isEOF = true;
+            info->state = Full;
+            break;
+        }
+
+        _int64 finalOffset = min(fileSize, endingOffset + overflowBytes);
+        _int64 finalStartOffset = min(fileSize, endingOffset);
+        unsigned amountToRead = (unsigned)min(finalOffset - readOffset, (_int64) bufferSize);   // Cast OK because can't be longer than unsigned bufferSize
+        info->isEOF = readOffset + amountToRead == finalOffset;
+        info->nBytesThatMayBeginARead = (unsigned)min((_int64)bufferSize - overflowBytes, finalStartOffset - readOffset);
+
+        _ASSERT(amountToRead >= info->nBytesThatMayBeginARead && (!info->isEOF || finalOffset == readOffset + amountToRead));
+        info->fileOffset = readOffset;
+        info->validBytes = amountToRead;   // getData looks at this to see if we're at EOF, even before the read is done
+
+        readOffset += info->nBytesThatMayBeginARead;
+        info->state = Reading;
+        info->offset = 0;
+
+        addPending(index);
+    }
+
+    if (nextBufferForConsumer == -1) {
+        PreventEventWaitersFromProceeding(&releaseEvent);
+    }
+}
+
+    void
+ReadaheadDataReader::addPending(
+    int bufferNumber)
+{
+    AssertExclusiveLockHeld(&lock);
+    _ASSERT(nPending < maxBuffers && bufferInfo[bufferNumber].state == Reading);
+    pending[(firstPending + nPending) % maxBuffers] = bufferNumber;
+    nPending++;
+    AllowEventWaitersToProceed(&workReady);
+    pendingAdded();
+}
+
+    void
+ReadaheadDataReader::waitForBuffer(
+    unsigned bufferNumber)
+{
+    _ASSERT(bufferNumber >= 0 && (bufferNumber < nBuffers || bufferNumber >= maxBuffers && 0 != headerBuffersOutstanding));
+    BufferInfo *info = &bufferInfo[bufferNumber];
+
+    while (info->state == InUse) {
+        // must already have lock to call, release & wait & reacquire
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&releaseEvent);
+        AcquireExclusiveLock(&lock);
+    }
+
+    if (info->state == Full) {
+        return;
+    }
+
+    if (info->state != Reading) {
+        startIo();
+    }
+
+    _int64 start = timeInNanos();
+    while (info->state == Reading) {
+        //
+        // bufferFilled only sets the event under the lock, so resetting it here can't lose a wakeup.
+        //
+        PreventEventWaitersFromProceeding(&readDone);
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&readDone);
+        AcquireExclusiveLock(&lock);
+    }
+    _int64 waitNanos = timeInNanos() - start;
+    InterlockedAdd64AndReturnNewValue(&ReadWaitTime, waitNanos);
+    ADD_STAGE_TIME(ReadWaitStage, waitNanos);
+}
+
+//
+// Reads stdin, or for a daemon command, the input its client streams over the connection.  The reads happen on a
+// readahead thread of their own, straight into the buffers, so that whatever is writing into the pipe (a decompressor,
+// say, or a trimmer) keeps going while the consumer parses what's already been read, rather than waiting until the
+// consumer gets around to reading the next buffer.  On Linux, a stdin that's a pipe also gets as big a pipe buffer as
+// the system allows, so that the writer doesn't have to stop and wait for us every 64KB.
+//
+class StdioDataReader : public ReadaheadDataReader
+{
+public:
+    StdioDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, NamedPipe *i_client);
+    ~StdioDataReader();
+
+    virtual bool init(const char* i_fileName);
+
+    //
+    // The generic reinit, which can only start at the beginning (after the header), since we can't seek.
+    //
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
+    { ReadBasedDataReader::reinit(startingOffset, amountOfFileToProcess); }
+
+    virtual const char* getFilename()
+    { return "-"; }
+
+ protected:
+    
+    // must hold the lock to call
+    virtual void startIo();
+
+    virtual void readaheadThread();
+
+private:
+    //
+    // Like fread, but from the client if there is one.  Sets *o_error if it came up short for any reason but EOF.
+    //
+    size_t readInput(char *buffer, size_t amountToRead, bool *o_error);
+
+    //
+    // Grow stdin's pipe buffer, if it's a pipe.
+    //
+    static void EnlargePipe();
+
+    NamedPipe *client;
+
+    //
+    // Because reads don't necessarily divide evenly into buffers, we have to assure that
+    // the buffers that we read can overlap.  In file-IO based readers, we do this by reading
+    // a buffer's worth of data each time, but advancing the file pointer only by
+    // bufferSize - overflowBytes, so each buffer ovelaps with its predecessor by a little.
+    // That doesn't work for stdio, since it can't rewind.  So, instead, we allocate
+    // storage on the side to hold a copy of the last overflowBytes
+    // and then just copy those bytes into the beginning of the next buffer to read.
+    // The readahead thread fills the buffers in order, so it's the only one that touches it.
+    //
+
+    char    *overflowBuffer;
+    bool     overflowBufferFilled;   // For the very first read, there may be no overlap buffer data.
+
+    bool    hitEOF;                  // Set by the readahead thread, with the lock held
+};
+
+StdioDataReader::StdioDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, NamedPipe *i_client) :
+    ReadaheadDataReader(i_nBuffers, i_overflowBytes, extraFactor, 0, 0), client(i_client), hitEOF(false), overflowBufferFilled(false),
+    overflowBuffer(NULL)
+{
+}
+
+    size_t
+StdioDataReader::readInput(char *buffer, size_t amountToRead, bool *o_error)
+{
+    if (NULL == client) {
+        size_t bytesRead = fread(buffer, 1, amountToRead, stdin);
+        *o_error = bytesRead != amountToRead && !feof(stdin);
+        return bytesRead;
+    }
+
+    size_t totalBytesRead = 0;
+    *o_error = false;
+    while (totalBytesRead < amountToRead) {
+        size_t bytesRead;
+        if (!ReadInputFromDaemonClient(client, buffer + totalBytesRead, amountToRead - totalBytesRead, &bytesRead)) {
+            //
+            // The client went away.  Treat it as EOF, so that the command finishes rather than taking the daemon with it.
+            //
+            fprintf(stderr, "StdioDataReader: lost the daemon client's input; treating it as EOF\n");
+            break;
+        }
+        if (0 == bytesRead) {
+            break;  // EOF
+        }
+        totalBytesRead += bytesRead;
+    }
+    return totalBytesRead;
+}
+
+StdioDataReader::~StdioDataReader()
+{
+    stopReadahead();
+    BigDealloc(overflowBuffer);
+    overflowBuffer = NULL;
+}
+
+    void
+StdioDataReader::EnlargePipe()
+{
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+    int fd = fileno(stdin);
+    struct stat statBuffer;
+    if (0 != fstat(fd, &statBuffer) || !S_ISFIFO(statBuffer.st_mode)) {
+        return;
+    }
+
+    //
+    // An unprivileged process can go up to pipe-max-size (usually 1MB).  It's only a hint, so failing doesn't matter.
+    //
+    int pipeSize = 1024 * 1024;
+    FILE *maxSizeFile = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (NULL != maxSizeFile) {
+        if (1 != fscanf(maxSizeFile, "%d", &pipeSize)) {
+            pipeSize = 1024 * 1024;
+        }
+        fclose(maxSizeFile);
+    }
+
+    if (fcntl(fd, F_GETPIPE_SZ) < pipeSize) {
+        fcntl(fd, F_SETPIPE_SZ, pipeSize);
+    }
+#endif // __linux__ && F_SETPIPE_SZ
+}
+
+bool
+StdioDataReader::init(const char * i_fileName)
+{
+    if (strcmp(i_fileName, "-")) {
+        WriteErrorMessage("StdioDataReader: must have filename of '-', got '%s'\n", i_fileName);
+        soft_exit(1);
+    }
+
+#ifdef _MSC_VER
+    int result = _setmode( _fileno( stdin ), _O_BINARY );  // puts stdin in to non-translated mode, so if we're reading compressed data windows' CRLF processing doesn't destroy it.
+    if (-1 == result) {
+        WriteErrorMessage("StdioDataReader::freopen to change to untranslated mode failed\n");
+        soft_exit(1);
+    }
+#endif // _MSC_VER
+
+    if (NULL == client) {
+        EnlargePipe();
+    }
+
+    //
+    // overflowBytes doesn't change after this, so the readahead thread can have the overflow buffer from the start.
+    //
+    overflowBuffer = (char *)BigAlloc(overflowBytes);
+
+    startReadahead();
+    return true;
+}
+
+void
+StdioDataReader::startIo()
+{
+	AssertExclusiveLockHeld(&lock);
+
+    //
+    // Hand every free buffer to the readahead thread.  We don't know how much each one will get until it's read, so
+    // until then it looks like a whole buffer that isn't the end.
+    //
+    while (nextBufferForReader != -1) {
+        // remove from free list
+        BufferInfo* info = &bufferInfo[nextBufferForReader];
+        _ASSERT(info->state == Empty);
+        int index = nextBufferForReader;
+        nextBufferForReader = info->next;
+        info->batchID = nextBatchID++;
+        // add to end of consumer list
+        if (lastBufferForConsumer != -1) {
+            _ASSERT(bufferInfo[lastBufferForConsumer].next == -1);
+            bufferInfo[lastBufferForConsumer].next = index;
+        }
+        info->next = -1;
+        info->previous = lastBufferForConsumer;
+        lastBufferForConsumer = index;
+		if (nextBufferForConsumer == -1) {
+			nextBufferForConsumer = index;
+		}
+       
+        if (hitEOF) {
+            info->validBytes = 0;
+            info->buffer[0] = '\0';
+            info->nBytesThatMayBeginARead = 0;
+            info->isEOF = true;
+            info->state = Full;
+            return;
+        }
+
+        info->isEOF = false;
+        info->validBytes = (unsigned)bufferSize;
+        info->nBytesThatMayBeginARead = (unsigned)bufferSize;
+        info->offset = 0;
+        info->state = Reading;
+        addPending(index);
+    }
+
+    if (nextBufferForConsumer == -1) {
+        PreventEventWaitersFromProceeding(&releaseEvent);
+    }
+}
+
+    void
+StdioDataReader::readaheadThread()
+/*++
+
+Routine Description:
+
+    Fill the buffers that startIo hands us in order, reading without the lock so that the consumer can go on with the
+    ones that are already full.  Buffers that we get after EOF are empty EOF buffers.
+
+--*/
+{
+    _int64 streamOffset = 0;      // How much we've read
+
+    AcquireExclusiveLock(&lock);
+    for (;;) {
+        int bufferNumber = takePending(true);
+        if (-1 == bufferNumber) {
+            break;
+        }
+
+        BufferInfo* info = &bufferInfo[bufferNumber];
+        if (hitEOF) {
+            info->validBytes = 0;
+            info->nBytesThatMayBeginARead = 0;
+            info->isEOF = true;
+            info->fileOffset = streamOffset;
+            bufferFilled(bufferNumber);
+            continue;
+        }
+
+        char *buffer = info->buffer;
+        ReleaseExclusiveLock(&lock);
+
+        size_t amountToRead;
+        size_t bufferOffset;
+        _int64 fileOffset;
+        if (overflowBufferFilled) {
+            //
+            // Copy the bytes from the overflow buffer into our buffer.
+            //
+			memcpy(buffer, overflowBuffer, overflowBytes);
+			bufferOffset = overflowBytes;
+			amountToRead = bufferSize - overflowBytes;
+			fileOffset = streamOffset - overflowBytes;
+        } else {
+            amountToRead = bufferSize;
+            bufferOffset = 0;
+            fileOffset = streamOffset;
+        }
+
+        bool error;
+        size_t bytesRead = readInput(buffer + bufferOffset, amountToRead, &error);
+        streamOffset += bytesRead;
+
+        if (error) {
+            WriteErrorMessage("StdinDataReader: Error reading %s (but not EOF).\n", NULL == client ? "stdin" : "input from the daemon client");
+            soft_exit(1);
+        }
+
+        bool reachedEOF = bytesRead != amountToRead;
+        unsigned nBytesThatMayBeginARead;
+        if (reachedEOF) {
+            nBytesThatMayBeginARead = (unsigned)(bytesRead + bufferOffset);
+            overflowBufferFilled = false;
+        } else {
+            nBytesThatMayBeginARead = (unsigned)(bytesRead + bufferOffset - overflowBytes);
+            //
+            // Fill the overflow buffer with the last bytes from this buffer.
+            //
+            memcpy(overflowBuffer, buffer + bufferOffset + bytesRead - overflowBytes, overflowBytes);
+            overflowBufferFilled = true;
+        }
+
+        AcquireExclusiveLock(&lock);
+        info->fileOffset = fileOffset;
+        info->validBytes = (unsigned)(bytesRead + bufferOffset);
+        info->nBytesThatMayBeginARead = nBytesThatMayBeginARead;
+        info->isEOF = reachedEOF;
+        hitEOF = reachedEOF;
+        bufferFilled(bufferNumber);
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+class StdioDataSupplier : public DataSupplier
+{
+public:
+    StdioDataSupplier() : DataSupplier() {}
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor = 0.0, size_t bufferSpace = 0)
+    {
+        //
+        // A daemon command reads what its client sends, which is new every time.
+        //
+        if (NULL != CommandPipe) {
+            return new StdioDataReader(bufferCount, overflowBytes, extraFactor, CommandPipe);
+        }
+
+        if (supplied) {
+            WriteErrorMessage("You can only use stdin input for one run per execution of SNAP (i.e., if you use ',' to run SNAP more than once without reloading the index, you can only use stdin once)\n");
+            soft_exit_no_print(1);
+        }
+
+        supplied = true;
+
+        return new StdioDataReader(bufferCount, overflowBytes, extraFactor, NULL);
+    }
+private:
+
+    static bool supplied;
+};
+
+bool StdioDataSupplier::supplied = false;
+
+#ifdef SNAP_HDFS
+
+//
+// HDFS
+//
+// The readahead thread reads each buffer with hdfsPread.  Where libhdfs has zero copy reads (build with
+// SNAP_HDFS_ZERO_COPY, which needs Hadoop 2.3 or later) and the block is on this machine with short circuit reads
+// configured, the data comes out of the datanode's own mapping of the block rather than over a socket and through
+// the JVM.  It still gets copied into our buffer, because a buffer has to hold overflowBytes past its end
+// contiguously, which a block boundary would split.
+//
+
+class HdfsDataReader : public ReadaheadDataReader
+{
+public:
+
+    HdfsDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace, _int64 minExtraBytes);
+
+    virtual ~HdfsDataReader();
+
+    virtual bool init(const char* i_fileName);
+
+    virtual const char* getFilename()
+    { return fileName; }
+
+protected:
+
+    virtual void readaheadThread();
+
+private:
+
+    // called without the lock, only from the readahead thread
+    bool readRange(char* buffer, _int64 offset, unsigned length);
+
+    const char*         fileName;
+    hdfsFS              fs;
+    hdfsFile            file;
+#ifdef SNAP_HDFS_ZERO_COPY
+    struct hadoopRzOptions* zeroCopyOptions;
+#endif
+};
+
+HdfsDataReader::HdfsDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace, _int64 minExtraBytes) :
+    ReadaheadDataReader(i_nBuffers, i_overflowBytes, extraFactor, bufferSpace, minExtraBytes), fileName(NULL), fs(NULL), file(NULL)
+{
+#ifdef SNAP_HDFS_ZERO_COPY
+    //
+    // With a buffer pool, libhdfs falls back to an ordinary read into a buffer from the pool for blocks it can't
+    // map, rather than failing the read.
+    //
+    zeroCopyOptions = hadoopRzOptionsAlloc();
+    if (NULL != zeroCopyOptions && 0 != hadoopRzOptionsSetByteBufferPool(zeroCopyOptions, ELASTIC_BYTE_BUFFER_POOL_CLASS)) {
+        hadoopRzOptionsFree(zeroCopyOptions);
+        zeroCopyOptions = NULL;
+    }
+#endif
+}
+
+HdfsDataReader::~HdfsDataReader()
+{
+    stopReadahead();
+
+    if (NULL != file) {
+        hdfsCloseFile(fs, file);
+    }
+#ifdef SNAP_HDFS_ZERO_COPY
+    if (NULL != zeroCopyOptions) {
+        hadoopRzOptionsFree(zeroCopyOptions);
+    }
+#endif
+}
+
+    bool
+HdfsDataReader::init(
+    const char* i_fileName)
+{
+    fileName = i_fileName;
+    fs = GenericFile_HDFS::getFileSystem();
+    if (NULL == fs) {
+        return false;
+    }
+
+    fileSize = GenericFile_HDFS::getFileSize(fileName);
+    if (fileSize < 0) {
+        return false;
+    }
+
+    file = hdfsOpenFile(fs, fileName, O_RDONLY, 0, 0, 0);
+    if (NULL == file) {
+        return false;
+    }
+
+    startReadahead();
+    return true;
+}
+
+    void
+HdfsDataReader::readaheadThread()
+{
+    AcquireExclusiveLock(&lock);
+    for (;;) {
+        int index = takePending(true);
+        if (-1 == index) {
+            break;  // stopping
+        }
+
+        BufferInfo* info = &bufferInfo[index];
+        char* buffer = info->buffer;
+        _int64 offset = info->fileOffset;
+        unsigned length = info->validBytes;
+        ReleaseExclusiveLock(&lock);
+
+        if (! readRange(buffer, offset, length)) {
+            WriteErrorMessage("Error reading HDFS file '%s' at offset %lld\n", fileName, offset);
+            soft_exit(1);
+        }
+
+        AcquireExclusiveLock(&lock);
+        bufferFilled(index);
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    bool
+HdfsDataReader::readRange(
+    char* buffer,
+    _int64 offset,
+    unsigned length)
+{
+#ifdef SNAP_HDFS_ZERO_COPY
+    if (NULL != zeroCopyOptions && 0 == hdfsSeek(fs, file, offset)) {
+        while (length > 0) {
+            struct hadoopRzBuffer* zeroCopyBuffer = hadoopReadZero(file, zeroCopyOptions, length);
+            if (NULL == zeroCopyBuffer) {
+                break;  // Finish with ordinary reads
+            }
+            int32_t lengthRead = hadoopRzBufferLength(zeroCopyBuffer);
+            if (lengthRead > 0) {
+                memcpy(buffer, hadoopRzBufferGet(zeroCopyBuffer), lengthRead);
+            }
+            hadoopRzBufferFree(file, zeroCopyBuffer);
+            if (lengthRead <= 0) {
+                break;
+            }
+            buffer += lengthRead;
+            offset += lengthRead;
+            length -= lengthRead;
+        }
+    }
+#endif // SNAP_HDFS_ZERO_COPY
+
+    while (length > 0) {
+        tSize lengthRead = hdfsPread(fs, file, offset, buffer, (tSize)length);  // Buffers are well under 2GB
+        if (lengthRead <= 0) {
+            return false;
+        }
+        buffer += lengthRead;
+        offset += lengthRead;
+        length -= lengthRead;
+    }
+    return true;
+}
+
+#endif // SNAP_HDFS
+
+#ifdef SNAP_OBJECT_STORE
+
+//
+// Object stores
+//
+// The readahead thread for an s3:// or gs:// object runs a curl multi handle with a ranged GET for each buffer
+// being filled, up to MaxTransfers at once, which is what it takes to get an object store's bandwidth: any one
+// connection to it is slow, but they add up.  The data goes straight into the buffer as it arrives.
+//
+
+class ObjectStoreDataReader : public ReadaheadDataReader
+{
+public:
+
+    ObjectStoreDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace, _int64 minExtraBytes);
+
+    virtual ~ObjectStoreDataReader();
+
+    virtual bool init(const char* i_fileName);
+
+    virtual const char* getFilename()
+    { return fileName; }
+
+    static const int MaxTransfers = 16;     // GETs in flight per reader
+    static const int MaxAttempts = 4;       // for any one GET, since a request to an object store occasionally just fails
+
+protected:
+
+    virtual void readaheadThread();
+
+    virtual void pendingAdded();
+
+private:
+
+    struct Transfer {
+        CURL*               curl;
+        struct curl_slist*  headers;
+        int                 bufferNumber;   // -1 if this one's free
+        char*               buffer;
+        _int64              offset;
+        unsigned            length;
+        unsigned            received;
+        int                 attempts;
+    };
+
+    // called without the lock, only from the readahead thread
+    void startTransfer(Transfer* transfer);
+
+    static size_t receiveData(char* data, size_t size, size_t count, void* context);
+
+    const char*         fileName;
+    CURLM*              multi;
+    Transfer            transfers[MaxTransfers];
+};
+
+ObjectStoreDataReader::ObjectStoreDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, size_t bufferSpace, _int64 minExtraBytes) :
+    ReadaheadDataReader(i_nBuffers, i_overflowBytes, extraFactor, bufferSpace, minExtraBytes), fileName(NULL), multi(NULL)
+{
+    for (int i = 0; i < MaxTransfers; i++) {
+        transfers[i].curl = NULL;
+        transfers[i].headers = NULL;
+        transfers[i].bufferNumber = -1;
+    }
+}
+
+ObjectStoreDataReader::~ObjectStoreDataReader()
+{
+    stopReadahead();
+
+    for (int i = 0; i < MaxTransfers; i++) {
+        if (NULL != transfers[i].curl) {
+            if (-1 != transfers[i].bufferNumber) {
+                curl_multi_remove_handle(multi, transfers[i].curl);
+            }
+            curl_easy_cleanup(transfers[i].curl);
+        }
+        curl_slist_free_all(transfers[i].headers);
+    }
+    if (NULL != multi) {
+        curl_multi_cleanup(multi);
+    }
+}
+
+    bool
+ObjectStoreDataReader::init(
+    const char* i_fileName)
+{
+    fileName = i_fileName;
+    fileSize = GetObjectStoreObjectSize(fileName);
+    if (fileSize < 0) {
+        return false;
+    }
+
+    multi = curl_multi_init();
+    if (NULL == multi) {
+        WriteErrorMessage("ObjectStoreDataReader: unable to create curl multi handle\n");
+        return false;
+    }
+
+    startReadahead();
+    return true;
+}
+
+    void
+ObjectStoreDataReader::pendingAdded()
+{
+    //
+    // The readahead thread may be waiting in curl_multi_poll for the transfers it has going.
+    //
+    if (NULL != multi) {
+        curl_multi_wakeup(multi);
+    }
+}
+
+    size_t
+ObjectStoreDataReader::receiveData(
+    char* data,
+    size_t size,
+    size_t count,
+    void* context)
+{
+    Transfer* transfer = (Transfer*) context;
+    size_t bytes = size * count;
+    if (bytes > transfer->length - transfer->received) {
+        return 0;   // More than we asked for, so the range wasn't honored (or it's an error body); fail the transfer
+    }
+    memcpy(transfer->buffer + transfer->received, data, bytes);
+    transfer->received += (unsigned) bytes;
+    return bytes;
+}
+
+    void
+ObjectStoreDataReader::startTransfer(
+    Transfer* transfer)
+{
+    if (NULL == transfer->curl) {
+        transfer->curl = curl_easy_init();
+        if (NULL == transfer->curl) {
+            WriteErrorMessage("ObjectStoreDataReader: unable to create curl handle\n");
+            soft_exit(1);
+        }
+    } else {
+        curl_easy_reset(transfer->curl);
+    }
+    curl_slist_free_all(transfer->headers);
+    transfer->headers = NULL;
+    transfer->received = 0;
+
+    if (! PrepareObjectStoreRequest(transfer->curl, fileName, &transfer->headers)) {
+        soft_exit(1);   // It's already said why
+    }
+
+    char range[100];
+    snprintf(range, sizeof(range), "Range: bytes=%lld-%lld", transfer->offset, transfer->offset + transfer->length - 1);
+    transfer->headers = curl_slist_append(transfer->headers, range);
+    curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, transfer->headers);
+    curl_easy_setopt(transfer->curl, CURLOPT_WRITEFUNCTION, receiveData);
+    curl_easy_setopt(transfer->curl, CURLOPT_WRITEDATA, transfer);
+    curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer);
+    curl_multi_add_handle(multi, transfer->curl);
+}
+
+    void
+ObjectStoreDataReader::readaheadThread()
+{
+    int nActive = 0;
+
+    AcquireExclusiveLock(&lock);
+    for (;;) {
+        //
+        // Start GETs for as many of the pending buffers as we can.  With none going, wait for one.
+        //
+        while (nActive < MaxTransfers) {
+            int index = takePending(0 == nActive);
+            if (-1 == index) {
+                break;
+            }
+
+            Transfer* transfer = transfers;
+            while (-1 != transfer->bufferNumber) {
+                transfer++;
+            }
+            BufferInfo* info = &bufferInfo[index];
+            transfer->bufferNumber = index;
+            transfer->buffer = info->buffer;
+            transfer->offset = info->fileOffset;
+            transfer->length = info->validBytes;
+            transfer->attempts = 1;
+            startTransfer(transfer);
+            nActive++;
+        }
+
+        if (stopping) {
+            break;
+        }
+        ReleaseExclusiveLock(&lock);
+
+        int nRunning;
+        curl_multi_perform(multi, &nRunning);
+
+        CURLMsg* message;
+        int nMessagesLeft;
+        while (NULL != (message = curl_multi_info_read(multi, &nMessagesLeft))) {
+            if (CURLMSG_DONE != message->msg) {
+                continue;
+            }
+
+            Transfer* transfer;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+            CURLcode result = message->data.result;
+            long status = 0;
+            curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+            curl_multi_remove_handle(multi, transfer->curl);
+
+            if (CURLE_OK != result || (206 != status && 200 != status) || transfer->received != transfer->length) {
+                if (transfer->attempts < MaxAttempts) {
+                    SleepForMillis(100 * transfer->attempts);
+                    transfer->attempts++;
+                    startTransfer(transfer);
+                    continue;
+                }
+                WriteErrorMessage("Error reading '%s' at offset %lld: %s, HTTP status %ld\n", fileName, transfer->offset,
+                    curl_easy_strerror(result), status);
+                soft_exit(1);
+            }
+
+            AcquireExclusiveLock(&lock);
+            bufferFilled(transfer->bufferNumber);
+            ReleaseExclusiveLock(&lock);
+            transfer->bufferNumber = -1;
+            nActive--;
+        }
+
+        if (nActive > 0) {
+            curl_multi_poll(multi, NULL, 0, 1000, NULL);    // pendingAdded wakes this up
+        }
+
+        AcquireExclusiveLock(&lock);
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+#endif // SNAP_OBJECT_STORE
+
+#if defined(SNAP_HDFS) || defined(SNAP_OBJECT_STORE)
+
+//
+// Readers for the remote stores that we know how to read, by the prefix of the file name, or NULL for anything else.
+// Each batch gets at least minExtraBytes of extra space.
+//
+    static DataReader*
+RemoteDataReaderForFile(
+    const char* fileName,
+    int bufferCount,
+    _int64 overflowBytes,
+    double extraFactor,
+    size_t bufferSpace,
+    _int64 minExtraBytes)
+{
+    unsigned nBuffers = bufferCount + (bufferCount > 1 ? 4 : 0);   // add some buffers for read-ahead
+#ifdef SNAP_HDFS
+    if (0 == strncmp(fileName, GenericFile::HDFS_PREFIX, strlen(GenericFile::HDFS_PREFIX))) {
+        return new HdfsDataReader(nBuffers, overflowBytes, extraFactor, bufferSpace, minExtraBytes);
+    }
+#endif // SNAP_HDFS
+#ifdef SNAP_OBJECT_STORE
+    if (IsObjectStoreUrl(fileName)) {
+        return new ObjectStoreDataReader(nBuffers, overflowBytes, extraFactor, bufferSpace, minExtraBytes);
+    }
+#endif // SNAP_OBJECT_STORE
+    return NULL;
+}
+
+//
+// Reads remote files with the reader RemoteDataReaderForFile gives, and anything else with a reader from the inner
+// supplier.  The reader can't be chosen until init() says what file it's for, but the layers above can ask how much
+// extra space there is before then (the decompressors do), so this starts out with a reader from the inner supplier
+// and swaps in a remote reader with at least as much extra space if the file turns out to be remote.  Everything
+// else just passes through.
+//
+
+class RemoteRoutingDataReader : public DataReader
+{
+public:
+
+    RemoteRoutingDataReader(DataSupplier* inner, int i_bufferCount, _int64 i_overflowBytes, double i_extraFactor, size_t i_bufferSpace) :
+        bufferCount(i_bufferCount), overflowBytes(i_overflowBytes), extraFactor(i_extraFactor), bufferSpace(i_bufferSpace)
+    {
+        reader = inner->getDataReader(bufferCount, overflowBytes, extraFactor, bufferSpace);
+    }
+
+    virtual ~RemoteRoutingDataReader()
+    { delete reader; }
+
+    virtual bool init(const char* fileName)
+    {
+        char* extra;
+        _int64 extraLength;
+        reader->getExtra(&extra, &extraLength);
+        DataReader* remoteReader = RemoteDataReaderForFile(fileName, bufferCount, overflowBytes, extraFactor, bufferSpace, extraLength);
+        if (NULL != remoteReader) {
+            delete reader;
+            reader = remoteReader;
+        }
+        return reader->init(fileName);
+    }
+
+    virtual char* readHeader(_int64* io_headerSize)
+    { return reader->readHeader(io_headerSize); }
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
+    { reader->reinit(startingOffset, amountOfFileToProcess); }
+
+    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL)
+    { return reader->getData(o_buffer, o_validBytes, o_startBytes); }
+
+    virtual void advance(_int64 bytes)
+    { reader->advance(bytes); }
+
+    virtual void nextBatch()
+    { reader->nextBatch(); }
+
+    virtual bool isEOF()
+    { return reader->isEOF(); }
+
+    virtual DataBatch getBatch()
+    { return reader->getBatch(); }
+
+    virtual void holdBatch(DataBatch batch)
+    { reader->holdBatch(batch); }
+
+    virtual bool releaseBatch(DataBatch batch)
+    { return reader->releaseBatch(batch); }
+
+    virtual _int64 getFileOffset()
+    { return reader->getFileOffset(); }
+
+    virtual void getExtra(char** o_extra, _int64* o_length)
+    { reader->getExtra(o_extra, o_length); }
+
+    virtual const char* getFilename()
+    { return reader->getFilename(); }
+
+private:
+
+    const int           bufferCount;
+    const _int64        overflowBytes;
+    const double        extraFactor;
+    const size_t        bufferSpace;
+    DataReader*         reader;
+};
+
+class RemoteRoutingDataSupplier : public DataSupplier
+{
+public:
+    RemoteRoutingDataSupplier(DataSupplier* i_inner) : DataSupplier(), inner(i_inner) {}
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor, size_t bufferSpace)
+    {
+        return new RemoteRoutingDataReader(inner, bufferCount, overflowBytes, extraFactor, bufferSpace);
+    }
+
+private:
+    DataSupplier* inner;
+};
+
+#endif // SNAP_HDFS || SNAP_OBJECT_STORE
+
+    DataSupplier*
+DataSupplier::RemoteFiles(
+    DataSupplier* inner)
+{
+#if defined(SNAP_HDFS) || defined(SNAP_OBJECT_STORE)
+    return new RemoteRoutingDataSupplier(inner);
+#else
+    return inner;
+#endif // SNAP_HDFS || SNAP_OBJECT_STORE
+}
+
+    _int64
+DataSupplier::InputFileSize(
+    const char* fileName)
+{
+#ifdef SNAP_HDFS
+    if (0 == strncmp(fileName, GenericFile::HDFS_PREFIX, strlen(GenericFile::HDFS_PREFIX))) {
+        _int64 fileSize = GenericFile_HDFS::getFileSize(fileName);
+        if (fileSize < 0) {
+            WriteErrorMessage("Unable to get the size of HDFS file '%s'\n", fileName);
+            soft_exit(1);
+        }
+        return fileSize;
+    }
+#endif // SNAP_HDFS
+    if (IsObjectStoreUrl(fileName)) {
+#ifdef SNAP_OBJECT_STORE
+        _int64 fileSize = GetObjectStoreObjectSize(fileName);
+        if (fileSize >= 0) {
+            return fileSize;
+        }
+#else   // SNAP_OBJECT_STORE
+        WriteErrorMessage("SNAP wasn't built to read from object stores; set LIBCURL_HOME in the Makefile and rebuild.\n");
+#endif  // SNAP_OBJECT_STORE
+        soft_exit(1);
+    }
+    return QueryFileSize(fileName);
+}
+
+    _int64
+DataSupplier::InputSplitSize(
+    const char* fileName)
+{
+#ifdef SNAP_HDFS
+    if (0 == strncmp(fileName, GenericFile::HDFS_PREFIX, strlen(GenericFile::HDFS_PREFIX))) {
+        return __max(GenericFile_HDFS::getBlockSize(fileName), (_int64)0);
+    }
+#endif // SNAP_HDFS
+    if (IsObjectStoreUrl(fileName)) {
+        return ObjectStoreSplitSize;
+    }
+    return 0;
+}
+
+//
+// Decompress
+//
+
+static const int windowBits = 15;
+static const int ENABLE_ZLIB_GZIP = 32;
+
+static const double MIN_FACTOR = 1.2;
+static const double MAX_FACTOR = 10.0;
+
+class DecompressDataReader : public DataReader
+{
+public:
+
+    DecompressDataReader(DataReader* i_inner, int i_count, _int64 totalExtra, _int64 i_extraBytes, _int64 i_overflowBytes, int i_chunkSize = BAM_BLOCK,
+        bool i_zstd = false, bool i_parallelGzip = false);
+
+    virtual ~DecompressDataReader();
+
+    virtual bool init(const char* fileName);
+
+    virtual char* readHeader(_int64* io_headerSize);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL);
+
+    virtual void advance(_int64 bytes);
+
+    virtual void nextBatch();
+
+    virtual bool isEOF();
+
+    virtual DataBatch getBatch();
+
+    virtual void holdBatch(DataBatch batch);
+
+    virtual bool releaseBatch(DataBatch batch);
+
+    virtual _int64 getFileOffset();
+
+    virtual void getExtra(char** o_extra, _int64* o_length);
+
+    virtual const char* getFilename()
+    { return inner->getFilename(); }
+
+    enum DecompressMode { SingleBlock, ContinueMultiBlock, StartMultiBlock };
+
+    // true if it used all of the input; if the output fills up first, ContinueMultiBlock picks up where it stopped
+    static bool decompress(z_stream* zstream, ThreadHeap* heap, char* input, _int64 inputSize, _int64* o_inputUsed,
+        char* output, _int64 outputSize, _int64* o_outputUsed, DecompressMode mode);
+
+    // debugging
+    char* findPointer(void* p);
+
+private:
+
+
+    static void decompressThread(void *context);
+
+    static void decompressThreadContinuous(void *context);
+
+    static void decompressThreadParallelGzip(void *context);
+
+#ifdef SNAP_ZSTD
+    static void decompressThreadZstd(void *context);
+
+    // decompress a zstd header into output, returning how much it wrote
+    _int64 readZstdHeader(char* input, _int64 inputBytes, char* output, _int64 outputBytes);
+
+    friend class ZstdFrameManager;
+#endif // SNAP_ZSTD
+
+    friend class DecompressManager;
+    friend class DecompressDataReaderSupplier;
+    friend class DecompressWorker;
+
+    enum EntryState
+    {
+        EntryReady, // for reading by client, on first list
+        EntryHeld, // finished reading but not released, not on a list
+        EntryAvailable, // released by client, on available list
+        EntryReading // reading or decompressing, not on a list
+    };
+
+    struct Entry
+    {
+        Entry* next; // next entry on first/available list
+        EntryState state;
+        DataBatch batch;
+        char* compressed;
+        _int64 compressedStart; // limit to start a new zip block
+        _int64 compressedValid; // total available data
+        char* decompressed;
+        _int64 decompressedSize; // space for decompressed data, followed by the extra data for the layer above
+        _int64 extraSize; // extra data for the layer above, which grows in proportion when decompressedSize does
+        _int64 decompressedStart;
+        _int64 decompressedValid;
+        bool allocated; // if decompressed has been allocated specially, not from inner extra data
+    };
+
+    // point an entry at the space it decompresses into for the next batch
+    void setupEntry(Entry* entry);
+
+    // give an entry its own space for at least needed bytes, keeping the first keep bytes of what it has
+    void growEntry(Entry* entry, _int64 needed, _int64 keep);
+
+    // note how much a batch expanded, for sizing later readers
+    static void observeExpansion(_int64 compressedBytes, _int64 decompressedBytes);
+
+    static volatile double ObservedExpansion; // largest decompressed/compressed ratio of a batch so far
+
+    // use only these routines to manipulate the linked  lists
+    Entry* peekReady(); // from first, block if none
+    void popReady(); // from first
+    void enqueueReady(Entry* entry); // as last
+    Entry* dequeueAvailable(); // as available, block if none
+    void enqueueAvailable(Entry* entry); // from available
+
+    DataReader* inner; // inner reader for compressed data
+    const _int64 extraBytes; // number of bytes of extra that I get to use
+    const _int64 overflowBytes; // overflow between batches
+    const _int64 totalExtra; // total extra data
+    const int chunkSize; // max size of decompressed data
+    const bool zstd; // zstd rather than gzip, always with chunkSize 0
+    const bool parallelGzip; // ordinary gzip with a ParallelInflater, always with chunkSize 0
+    _int64 offset; // into current entry
+    bool threadStarted; // whether thread has been started
+    bool eof; // true when we've read to eof of previous
+    volatile bool stopping; // set to stop everything
+    EventObject decompressThreadDone; // signalled by background thread on exit
+
+    // entry lists
+    Entry* entries; // ring buffer of batches from inner reader
+    int count; // # of entries
+    _int64 grownSize; // decompressedSize of the largest entry that's had to grow, 0 if none
+    Entry* first; // first ready buffer, NULL if none, currently being read by client
+    Entry* last; // last ready buffer, NULL if none
+    EventObject readyEvent; // signalled by bg thread when first goes NULL->non-NULL
+    Entry* available; // first non-ready buffer (head of freelist), NULL if none
+    EventObject availableEvent; // signalled by main thread when available goes NULL->non-NULL
+    ExclusiveLock lock; // lock on linked list pointers in this object and in Entry
+};
+
+
+DecompressDataReader::DecompressDataReader(
+    DataReader* i_inner,
+    int i_count,
+    _int64 i_totalExtra,
+    _int64 i_extraBytes,
+    _int64 i_overflowBytes,
+    int i_chunkSize,
+    bool i_zstd,
+    bool i_parallelGzip)
+    : DataReader(), inner(i_inner), count(i_count), offset(i_overflowBytes),
+    totalExtra(i_totalExtra), extraBytes(i_extraBytes), overflowBytes(i_overflowBytes),
+    chunkSize(i_chunkSize), zstd(i_zstd), parallelGzip(i_parallelGzip), grownSize(0), threadStarted(false), eof(false), stopping(false)
+{
+    entries = new Entry[count];
+    for (int i = 0; i < count; i++) {
+        Entry* entry = &entries[i];
+        entry->state = EntryAvailable;
+        entry->next = i < count - 1 ? &entries[i + 1] : NULL;
+        entry->decompressed = NULL;
+        entry->decompressedSize = i_extraBytes;
+        entry->extraSize = i_totalExtra - i_extraBytes;
+        entry->allocated = false;
+        entry->batch = DataBatch(0, 0);
+    }
+    available = entries;
+    first = last = NULL;
+    CreateEventObject(&readyEvent);
+    PreventEventWaitersFromProceeding(&readyEvent);
+    CreateEventObject(&availableEvent);
+    AllowEventWaitersToProceed(&availableEvent);
+    CreateEventObject(&decompressThreadDone);
+    PreventEventWaitersFromProceeding(&decompressThreadDone);
+    InitializeExclusiveLock(&lock);
+}
+
+DecompressDataReader::~DecompressDataReader()
+{
+    if (threadStarted) {
+        stopping = true;
+        AllowEventWaitersToProceed(&availableEvent);
+        WaitForEvent(&decompressThreadDone);
+    }
+    for (int i = 0;  i < count; i++) {
+        if (entries[i].allocated) {
+            BigDealloc(entries[i].decompressed);
+        }
+    }
+    DestroyExclusiveLock(&lock);
+    delete inner;
+}
+
+    bool
+DecompressDataReader::init(
+    const char* fileName)
+{
+    return inner->init(fileName);
+}
+
+    char*
+DecompressDataReader::readHeader(
+    _int64* io_headerSize)
+{
+    z_stream zstream;
+    ThreadHeap heap(max(chunkSize,1000));
+    _int64 compressedBytes = (_int64)(*io_headerSize / MIN_FACTOR);
+    char* compressed = inner->readHeader(&compressedBytes);
+    char* header;
+    _int64 total;
+    inner->getExtra(&header, &total);
+    _ASSERT(total >= totalExtra);
+#ifdef SNAP_ZSTD
+    if (zstd) {
+        *io_headerSize = readZstdHeader(compressed, compressedBytes, header, min(*io_headerSize, totalExtra));
+        return header;
+    }
+#endif // SNAP_ZSTD
+    _int64 headerSize = 0;
+    while (headerSize < *io_headerSize && compressedBytes > 0) {
+        _int64 compressedBlockSize, decompressedBlockSize;
+        //fprintf(stderr,"decompress chunkSize %d compressedBytes %d headerSize %d totalExtra %d\n", chunkSize, compressedBytes, headerSize, totalExtra);
+        bool done = decompress(&zstream, chunkSize != 0 ? &heap : NULL,
+            compressed, compressedBytes, &compressedBlockSize,
+            header + headerSize, totalExtra - headerSize, &decompressedBlockSize,
+            StartMultiBlock);
+        if (! done && headerSize + decompressedBlockSize == totalExtra) {
+            WriteErrorMessage("insufficient decompression buffer space for the file header - increase expansion factor, currently -xf %.1f\n", DataSupplier::ExpansionFactor);
+            soft_exit(1);
+        }
+        // This just gets reinit()'ed later, and in the interim confuses the non-rewind stdio data reader.  inner->advance(compressedBlockSize);
+        compressed += compressedBlockSize;
+        compressedBytes -= compressedBlockSize;
+        headerSize += decompressedBlockSize;
+    }
+    *io_headerSize = headerSize;
+    return header;
+}
+
+    void
+DecompressDataReader::reinit(
+    _int64 startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    if (threadStarted) {
+        WriteErrorMessage("DecompressDataReader reinit called twice\n");
+        soft_exit(1);
+    }
+    // todo: transform start/amount to add for compression? I don't think so...
+    inner->reinit(startingOffset, amountOfFileToProcess);
+    threadStarted = true;
+    ThreadMainFunction threadMain = chunkSize > 0 ? decompressThread : parallelGzip ? decompressThreadParallelGzip : decompressThreadContinuous;
+#ifdef SNAP_ZSTD
+    if (zstd) {
+        threadMain = decompressThreadZstd;
+    }
+#endif // SNAP_ZSTD
+    if (! StartNewThread(threadMain, this)) {
+        WriteErrorMessage("failed to start decompressThread\n");
+        soft_exit(1);
+    }
+}
+
+    bool
+DecompressDataReader::getData(
+    char** o_buffer,
+    _int64* o_validBytes,
+    _int64* o_startBytes)
+{
+    if (eof) {
+        return false;
+    }
+    Entry* entry = peekReady();
+    if (offset >= entry->decompressedStart) {
+        return false;
+    }
+    *o_buffer = entry->decompressed + offset;
+    *o_validBytes = entry->decompressedValid - offset;
+    if (o_startBytes != NULL) {
+        *o_startBytes = entry->decompressedStart- offset;
+    }
+    return true;
+}
+
+    void
+DecompressDataReader::advance(
+    _int64 bytes)
+
+{
+    offset = min(offset + max(bytes, (_int64) 0), peekReady()->decompressedValid);
+}
+
+    void
+DecompressDataReader::nextBatch()
+{
+    if (eof) {
+        return;
+    }
+    Entry* old = peekReady();
+    popReady();
+    if (old->decompressedValid == overflowBytes) {
+        eof = true;
+        return;
+    }
+    Entry* next = peekReady();
+    _ASSERT(next->state == EntryReady && next->decompressed != NULL);
+    _int64 copy = old->decompressedValid - max(offset, old->decompressedStart);
+    memcpy(next->decompressed + overflowBytes - copy, old->decompressed + old->decompressedValid - copy, copy);
+    offset = overflowBytes - copy;
+    //fprintf(stderr,"DecompressDataReader nextBatch %d:%d #%d -> %d:%d #%d copy %lld + %lld/%lld\n", old->batch.fileID, old->batch.batchID, old-entries, next->batch.fileID, next->batch.batchID, next-entries, copy, next->decompressedStart, next->decompressedValid);
+    releaseBatch(old->batch); // holdBatch was called in decompress thread, release now if no customers added holds
+    if (offset == next->decompressedValid) {
+        eof = true;
+        _ASSERT(inner->isEOF());
+    }
+}
+
+    bool
+DecompressDataReader::isEOF()
+{
+    return eof;
+}
+
+    DataBatch
+DecompressDataReader::getBatch()
+{
+    return peekReady()->batch;
+}
+
+    void
+DecompressDataReader::holdBatch(DataBatch batch)
+{
+    inner->holdBatch(batch);
+}
+
+    bool
+DecompressDataReader::releaseBatch(DataBatch batch)
+{
+    if (! inner->releaseBatch(batch)) {
+        return false;
+    }
+    // truly released, find matching entry & put back on available list
+    AcquireExclusiveLock(&lock);
+    for (int i = 0; i < count; i++) {
+        Entry* entry = &entries[i];
+        if (entry->batch == batch) {
+			//fprintf(stderr,"DecompressDataReader releaseBatch %d:0x%x #%d\n", batch.fileID, batch.batchID, i);
+            if (entry->state == EntryHeld) {
+                enqueueAvailable(entry);
+            } else {
+                _ASSERT(entry->state == EntryAvailable);
+            }
+            break;
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+    return true;
+}
+
+    _int64
+DecompressDataReader::getFileOffset()
+{
+    return inner->getFileOffset();
+}
+
+    void
+DecompressDataReader::getExtra(
+    char** o_extra,
+    _int64* o_length)
+{
+    Entry* entry = peekReady();
+    *o_extra = entry->decompressed + entry->decompressedSize;
+    *o_length = entry->extraSize;
+}
+
+    void
+DecompressDataReader::setupEntry(
+    Entry* entry)
+{
+    if (! entry->allocated) {
+        _int64 extraSize;
+        inner->getExtra(&entry->decompressed, &extraSize);
+        _ASSERT(extraSize >= extraBytes && extraSize >= overflowBytes);
+        entry->decompressedSize = extraBytes;
+        entry->extraSize = totalExtra - extraBytes;
+    }
+    if (entry->decompressedSize < grownSize) {
+        //
+        // Another entry has already found out that batches need more than this, so don't wait to find it again.
+        //
+        growEntry(entry, grownSize, 0);
+    }
+}
+
+    void
+DecompressDataReader::growEntry(
+    Entry* entry,
+    _int64 needed,
+    _int64 keep)
+/*++
+
+Routine Description:
+
+    Make room for a batch that decompressed to more than its entry had space for, rather than failing.  The entry gets a
+    buffer of its own (at least double what it had, as BgzfRangeDataReader grows), followed by proportionally more room
+    for the extra data of the layer above, and keeps it for the batches after this one.  The new size is remembered so that the other
+    entries grow before they need to.
+
+Arguments:
+
+    entry   - the entry to grow
+    needed  - how much decompressed data (overflow included) it needs room for
+    keep    - how much of what's already been decompressed into it to copy over
+
+--*/
+{
+    _int64 newSize = max(2 * entry->decompressedSize, needed);
+    _int64 newExtraSize = (_int64) ((double) (totalExtra - extraBytes) * newSize / extraBytes);
+    char* newBuffer = (char*) BigAlloc(newSize + newExtraSize);
+    if (keep > 0) {
+        memcpy(newBuffer, entry->decompressed, keep);
+    }
+    if (entry->allocated) {
+        BigDealloc(entry->decompressed);
+    }
+    entry->decompressed = newBuffer;
+    entry->decompressedSize = newSize;
+    entry->extraSize = newExtraSize;
+    entry->allocated = true;
+    grownSize = max(grownSize, newSize);
+}
+
+volatile double DecompressDataReader::ObservedExpansion = 0.0;
+
+    void
+DecompressDataReader::observeExpansion(
+    _int64 compressedBytes,
+    _int64 decompressedBytes)
+{
+    if (compressedBytes > 0 && (double) decompressedBytes / compressedBytes > ObservedExpansion) {
+        ObservedExpansion = (double) decompressedBytes / compressedBytes; // a lost race just means a slightly smaller guess
+    }
+}
+    
+    bool
+DecompressDataReader::decompress(
+    z_stream* zstream,
+    ThreadHeap* heap,
+    char* input,
+    _int64 inputBytes,
+    _int64* o_inputRead,
+    char* output,
+    _int64 outputBytes,
+    _int64* o_outputWritten,
+    DecompressMode mode)
+{
+    if (inputBytes > 0xffffffff || outputBytes > 0xffffffff) {
+        WriteErrorMessage("GzipDataReader: inputBytes or outputBytes > max unsigned int\n");
+        soft_exit(1);
+    }
+    zstream->next_in = (Bytef*) input;
+    zstream->avail_in = (uInt)inputBytes;
+    zstream->next_out = (Bytef*) output;
+    zstream->avail_out = (uInt)outputBytes;
+    uInt oldAvailOut, oldAvailIn;
+    int block = 0;
+    bool startStream = mode != ContinueMultiBlock;
+    bool progress;
+    int status;
+    do {
+        if (startStream) {
+            //
+            // inflateInit2 fills in its own allocator for NULL, and a stream being continued needs to keep it.
+            //
+            if (heap != NULL) {
+                heap->reset();
+                zstream->zalloc = zalloc;
+                zstream->zfree = zfree;
+                zstream->opaque = heap;
+            } else {
+                zstream->zalloc = NULL;
+                zstream->zfree = NULL;
+            }
+            status = inflateInit2(zstream, windowBits | ENABLE_ZLIB_GZIP);
+            if (status < 0) {
+                WriteErrorMessage("GzipDataReader: inflateInit2 failed with %d\n", status);
+                return false;
+            }
+        }
+        oldAvailOut = zstream->avail_out;
+        oldAvailIn = zstream->avail_in;
+        status = inflate(zstream, mode == SingleBlock ? Z_NO_FLUSH : Z_FINISH);
+        // fprintf(stderr, "decompress block #%d %lld -> %lld = %d\n", block, zstream.next_in - lastIn, zstream.next_out - lastOut, status);
+        block++;
+        if (status < 0 && status != Z_BUF_ERROR) {
+            WriteErrorMessage("GzipDataReader: inflate failed with %d\n", status);
+            soft_exit(1);
+        }
+        progress = zstream->avail_out != oldAvailOut || zstream->avail_in != oldAvailIn;
+        if (status == Z_STREAM_END && ! progress && ! startStream) {
+            //
+            // The stream we were continuing had already ended where the last call stopped, so the input starts a new one.
+            //
+            progress = true;
+        }
+        startStream = status == Z_STREAM_END;
+        //
+        // Stop when the output is full, rather than starting a new stream that has nowhere to go, so that the caller can
+        // make more room and continue this one.
+        //
+    } while (zstream->avail_in != 0 && zstream->avail_out != 0 && progress && mode != SingleBlock);
+    // fprintf(stderr, "end decompress status=%d, avail_in=%lld, last block=%lld->%lld, avail_out=%lld\n", status, zstream.avail_in, zstream.next_in - lastIn, zstream.next_out - lastOut, zstream.avail_out);
+    if (o_inputRead) {
+        *o_inputRead = inputBytes - zstream->avail_in;
+    }
+    if (o_outputWritten) {
+        *o_outputWritten = outputBytes - zstream->avail_out;
+    }
+    return zstream->avail_in == 0;
+}
+  
+    char*
+DecompressDataReader::findPointer(
+    void* p)
+{
+    static char result[100];
+    sprintf(result, "not found");
+    for (int i = 0; i < count; i++) {
+        Entry* e = &entries[i];
+        if (e->compressed <= p && p < e->compressed + e->compressedValid) {
+            sprintf(result, "compressed #%d @ %lld", i, (char*)p - e->compressed);
+            break;
+        }
+        if (e->decompressed <= p && p < e->decompressed + e->decompressedSize) {
+            sprintf(result, "decompressed #%d %lld", i, (char*) p - e->decompressed);
+            break;
+        }
+        if (e->decompressed + e->decompressedSize <= p && p < e->decompressed + e->decompressedSize + e->extraSize) {
+            sprintf(result, "extra #%d %lld", i, (char*) p - e->decompressed - e->decompressedSize);
+            break;
+        }
+    }
+    return result;
+}
+
+typedef VariableSizeVector<_int64> OffsetVector;
+
+class DecompressWorker : public ParallelWorker
+{
+public:
+    DecompressWorker();
+
+    virtual ~DecompressWorker() { delete blockDecompressor; }
+
+    virtual void step();
+
+private:
+    z_stream zstream;
+    ThreadHeap heap;
+    GzipBlockDecompressor* blockDecompressor; // NULL to just use zlib
+};
+    
+class DecompressManager: public ParallelWorkerManager
+{
+public:
+    DecompressManager(OffsetVector* i_inputs, OffsetVector* i_outputs)
+        : inputs(i_inputs), outputs(i_outputs)
+    {}
+
+    virtual ParallelWorker* createWorker()
+    { return new DecompressWorker(); }
+
+    OffsetVector* inputs;
+    OffsetVector* outputs;
+    DecompressDataReader::Entry* entry;
+
+    friend class DecompressWorker;
+};
+
+DecompressWorker::DecompressWorker()
+    : heap(BAM_BLOCK), blockDecompressor(GzipBlockDecompressor::Create())
+{
+    zstream.zalloc = zalloc;
+    zstream.zfree = zfree;
+    zstream.opaque = &heap;
+}
+
+    void
+DecompressWorker::step()
+{
+    _int64 start = timeInNanos();
+    DecompressManager* manager = (DecompressManager*) getManager();
+    for (int i = getThreadNum(); i < manager->inputs->size() - 1; i += getNumThreads()) {
+        _int64 inputUsed, outputUsed;
+        size_t blockOutputUsed;
+        if (blockDecompressor != NULL &&
+            blockDecompressor->decompressBlock(manager->entry->compressed + (*manager->inputs)[i],
+                (*manager->inputs)[i + 1] - (*manager->inputs)[i],
+                manager->entry->decompressed + (*manager->outputs)[i],
+                (*manager->outputs)[i + 1] - (*manager->outputs)[i],
+                &blockOutputUsed)) {
+            //
+            // Each BGZF block is a whole gzip member, so it all gets used.
+            //
+            inputUsed = (*manager->inputs)[i + 1] - (*manager->inputs)[i];
+            outputUsed = blockOutputUsed;
+        } else {
+            DecompressDataReader::decompress(&zstream,
+                &heap,
+                manager->entry->compressed + (*manager->inputs)[i],
+                (*manager->inputs)[i + 1] - (*manager->inputs)[i],
+                &inputUsed,
+                manager->entry->decompressed + (*manager->outputs)[i],
+                (*manager->outputs)[i + 1] - (*manager->outputs)[i],
+                &outputUsed,
+                DecompressDataReader::SingleBlock);
+        }
+        _ASSERT(inputUsed == (*manager->inputs)[i + 1] - (*manager->inputs)[i] &&
+            outputUsed == (*manager->outputs)[i + 1] - (*manager->outputs)[i]);
+    }
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::DecompressNanos, EndPipelineTraceSpan(DecompressTraceEvent, start));
+}
+
+    void
+DecompressDataReader::decompressThread(
+    void* context)
+{
+    BindThreadToHelperProcessors();
+    DecompressDataReader* reader = (DecompressDataReader*) context;
+    OffsetVector inputs, outputs;
+    DecompressManager manager(&inputs, &outputs);
+    ParallelCoworker coworker(min(8, DataSupplier::ThreadCount), false, &manager);
+    coworker.start();
+    // keep reading & decompressing entries until stopped
+    bool stop = false;
+    while (! stop) {
+        Entry* entry = reader->dequeueAvailable();
+        if (reader->stopping) {
+            break;
+        }
+        // always starts with a fresh batch - advances after reading it all
+        bool ok = reader->inner->getData(&entry->compressed, &entry->compressedValid, &entry->compressedStart);
+        int index = (int) (entry - reader->entries);
+        if (! ok) {
+            //fprintf(stderr, "decompressThread #%d %d:%d eof\n", index, reader->inner->getBatch().fileID, reader->inner->getBatch().batchID);
+            if (! reader->inner->isEOF()) {
+                WriteErrorMessage("error reading file at offset %lld\n", reader->getFileOffset());
+                soft_exit(1);
+            }
+            // mark as eof - no data
+            entry->decompressedValid = entry->decompressedStart = reader->overflowBytes;
+            DataBatch b = reader->inner->getBatch();
+            entry->batch = DataBatch(b.batchID + 1, b.fileID);
+            // decompressed buffer is same as next-to-last batch, need to allocate own buffer
+            if (! entry->allocated) {
+                entry->decompressed = (char*) BigAlloc(reader->totalExtra);
+                entry->decompressedSize = reader->extraBytes;
+                entry->extraSize = reader->totalExtra - reader->extraBytes;
+                entry->allocated = true;
+            }
+            stop = true;
+        } else {
+            reader->setupEntry(entry);
+            // figure out offsets and advance inner data
+            inputs.clear();
+            outputs.clear();
+            _int64 input = 0;
+            _int64 output = reader->overflowBytes;
+            do {
+                inputs.push_back(input);
+                outputs.push_back(output);
+                BgzfHeader* zip = (BgzfHeader*) (entry->compressed + input);
+                input += zip->BSIZE() + 1;
+                output += zip->ISIZE();
+                if (input > entry->compressedValid || zip->BSIZE() >= BAM_BLOCK || zip->ISIZE() > BAM_BLOCK) {
+                    fprintf(stderr, "error reading BAM file at offset %lld\n", reader->getFileOffset());
+                    soft_exit(1);
+                }
+            } while (input < entry->compressedStart);
+            // append final offsets
+            inputs.push_back(input);
+            outputs.push_back(output);
+            if (output > entry->decompressedSize) {
+                reader->growEntry(entry, output, 0);
+            }
+            observeExpansion(input, output - reader->overflowBytes);
+            //fprintf(stderr, "decompressThread read #%d %lld->%lld\n", index, input, output);
+            reader->inner->advance(input);
+            entry->decompressedValid = output;
+            entry->decompressedStart = output - reader->overflowBytes;
+            entry->batch = reader->inner->getBatch();
+			reader->holdBatch(entry->batch); // hold batch while decompressing
+            reader->inner->nextBatch(); // start reading next batch
+            // decompress all chunks synchronously on multiple threads
+            manager.entry = entry;
+            coworker.step();
+        }
+        // make buffer available for clients & go on to next
+        //fprintf(stderr, "decompressThread #%d %d:%d ready\n", index, entry->batch.fileID, entry->batch.batchID);
+        reader->enqueueReady(entry);
+    }
+    coworker.stop();
+    AllowEventWaitersToProceed(&reader->decompressThreadDone);
+}
 
-    struct Entry
-    {
-        Entry* next; // next entry on first/available list
-        EntryState state;
-        DataBatch batch;
-        char* compressed;
-        _int64 compressedStart; // limit to start a new zip block
-        _int64 compressedValid; // total available data
-        char* decompressed;
-        _int64 decompressedStart;
-        _int64 decompressedValid;
-        bool allocated; // if decompressed has been allocated specially, not from inner extra data
-    };
+    void
+DecompressDataReader::decompressThreadContinuous(
+    void* context)
+{
+    BindThreadToHelperProcessors();
+    DecompressDataReader* reader = (DecompressDataReader*) context;
+    z_stream zstream;
+    bool first = true;
+    bool stop = false;
+    while (! stop) {
+        Entry* entry = reader->dequeueAvailable();
+        if (reader->stopping) {
+            break;
+        }
+        // always starts with a fresh batch - advances after reading it all
+        bool ok = reader->inner->getData(&entry->compressed, &entry->compressedValid, &entry->compressedStart);
+        int index = (int) (entry - reader->entries);
+        if (! ok) {
+            //fprintf(stderr, "decompressThreadContinuous#%d %d:%d eof\n", index, reader->inner->getBatch().fileID, reader->inner->getBatch().batchID);
+            if (! reader->inner->isEOF()) {
+                WriteErrorMessage("error reading file at offset %lld\n", reader->getFileOffset());
+                soft_exit(1);
+            }
+            // mark as eof - no data
+            entry->decompressedValid = entry->decompressedStart = reader->overflowBytes;
+            DataBatch b = reader->inner->getBatch();
+            entry->batch = DataBatch(b.batchID + 1, b.fileID);
+            if (! entry->allocated) {
+                entry->decompressed = (char*) BigAlloc(reader->totalExtra);
+                entry->decompressedSize = reader->extraBytes;
+                entry->extraSize = reader->totalExtra - reader->extraBytes;
+                entry->allocated = true;
+            }
+            stop = true;
+        } else {
+            // figure out offsets and advance inner data
+            reader->setupEntry(entry);
+            entry->batch = reader->inner->getBatch();
+            reader->holdBatch(entry->batch); // hold batch while decompressing
+            reader->inner->advance(entry->compressedValid);
+            reader->inner->nextBatch(); // start reading next batch
+            _int64 start = timeInNanos();
+            _int64 compressedRead = 0, decompressedWritten = 0;
+            DecompressMode mode = first ? StartMultiBlock : ContinueMultiBlock;
+            while (true) {
+                _int64 inputUsed, outputUsed;
+                bool done = decompress(&zstream, NULL,
+                    entry->compressed + compressedRead, entry->compressedValid - compressedRead, &inputUsed,
+                    entry->decompressed + reader->overflowBytes + decompressedWritten,
+                    entry->decompressedSize - reader->overflowBytes - decompressedWritten, &outputUsed, mode);
+                compressedRead += inputUsed;
+                decompressedWritten += outputUsed;
+                if (done) {
+                    break;
+                }
+                //
+                // Out of room with input left over.  Grow the entry, keeping what's been decompressed, and carry on with the
+                // same stream.
+                //
+                if (reader->overflowBytes + decompressedWritten < entry->decompressedSize) {
+                    WriteErrorMessage("error decompressing file at offset %lld\n", reader->getFileOffset());
+                    soft_exit(1);
+                }
+                reader->growEntry(entry, 0, reader->overflowBytes + decompressedWritten);
+                mode = ContinueMultiBlock;
+            }
+            InterlockedAdd64AndReturnNewValue(&ProgressReporter::DecompressNanos, EndPipelineTraceSpan(DecompressTraceEvent, start));
+            _ASSERT(compressedRead == entry->compressedValid);
+            observeExpansion(compressedRead, decompressedWritten);
+            entry->decompressedValid = reader->overflowBytes + decompressedWritten;
+            entry->decompressedStart = decompressedWritten;
+            first = false;
+        }
+        // make buffer available for clients & go on to next
+        //fprintf(stderr, "decompressThreadContinuous#%d %d:%d ready\n", index, entry->batch.fileID, entry->batch.batchID);
+        reader->enqueueReady(entry);
+    }
+    AllowEventWaitersToProceed(&reader->decompressThreadDone);
+}
 
-    // use only these routines to manipulate the linked  lists
-    Entry* peekReady(); // from first, block if none
-    void popReady(); // from first
-    void enqueueReady(Entry* entry); // as last
-    Entry* dequeueAvailable(); // as available, block if none
-    void enqueueAvailable(Entry* entry); // from available
+    void
+DecompressDataReader::decompressThreadParallelGzip(
+    void* context)
+/*++
 
-    DataReader* inner; // inner reader for compressed data
-    const _int64 extraBytes; // number of bytes of extra that I get to use
-    const _int64 overflowBytes; // overflow between batches
-    const _int64 totalExtra; // total extra data
-    const int chunkSize; // max size of decompressed data
-    _int64 offset; // into current entry
-    bool threadStarted; // whether thread has been started
-    bool eof; // true when we've read to eof of previous
-    volatile bool stopping; // set to stop everything
-    EventObject decompressThreadDone; // signalled by background thread on exit
+Routine Description:
 
-    // entry lists
-    Entry* entries; // ring buffer of batches from inner reader
-    int count; // # of entries
-    Entry* first; // first ready buffer, NULL if none, currently being read by client
-    Entry* last; // last ready buffer, NULL if none
-    EventObject readyEvent; // signalled by bg thread when first goes NULL->non-NULL
-    Entry* available; // first non-ready buffer (head of freelist), NULL if none
-    EventObject availableEvent; // signalled by main thread when available goes NULL->non-NULL
-    ExclusiveLock lock; // lock on linked list pointers in this object and in Entry
-};
+    decompressThreadContinuous for ordinary gzip files, with each batch inflated on several threads by a ParallelInflater.
+    A batch reads on into the overflow as far as the end of a deflate block, and the next one starts there.
+
+--*/
+{
+    BindThreadToHelperProcessors();
+    DecompressDataReader* reader = (DecompressDataReader*) context;
+    ParallelInflater inflater(min(8, DataSupplier::ThreadCount));
+    bool stop = false;
+    while (! stop) {
+        Entry* entry = reader->dequeueAvailable();
+        if (reader->stopping) {
+            break;
+        }
+        // always starts with a fresh batch - advances after reading it all
+        bool ok = reader->inner->getData(&entry->compressed, &entry->compressedValid, &entry->compressedStart);
+        if (! ok) {
+            if (! reader->inner->isEOF()) {
+                WriteErrorMessage("error reading file at offset %lld\n", reader->getFileOffset());
+                soft_exit(1);
+            }
+            if (! inflater.atMemberEnd()) {
+                WriteErrorMessage("gzip file %s is truncated\n", reader->getFilename());
+                soft_exit(1);
+            }
+            // mark as eof - no data
+            entry->decompressedValid = entry->decompressedStart = reader->overflowBytes;
+            DataBatch b = reader->inner->getBatch();
+            entry->batch = DataBatch(b.batchID + 1, b.fileID);
+            if (! entry->allocated) {
+                entry->decompressed = (char*) BigAlloc(reader->totalExtra);
+                entry->decompressedSize = reader->extraBytes;
+                entry->extraSize = reader->totalExtra - reader->extraBytes;
+                entry->allocated = true;
+            }
+            stop = true;
+        } else {
+            reader->setupEntry(entry);
+            entry->batch = reader->inner->getBatch();
+            reader->holdBatch(entry->batch); // hold batch while decompressing
+            _int64 inputUsed, outputBytes;
+            if (! inflater.inflate(entry->compressed, entry->compressedStart, entry->compressedValid, &inputUsed, &outputBytes)) {
+                WriteErrorMessage("error decompressing gzip file %s at offset %lld\n", reader->getFilename(), reader->getFileOffset());
+                soft_exit(1);
+            }
+            reader->inner->advance(inputUsed);
+            reader->inner->nextBatch(); // start reading next batch
+            if (reader->overflowBytes + outputBytes > entry->decompressedSize) {
+                reader->growEntry(entry, reader->overflowBytes + outputBytes, 0);
+            }
+            if (! inflater.getOutput(entry->decompressed + reader->overflowBytes)) {
+                WriteErrorMessage("error decompressing gzip file %s\n", reader->getFilename());
+                soft_exit(1);
+            }
+            observeExpansion(inputUsed, outputBytes);
+            entry->decompressedValid = reader->overflowBytes + outputBytes;
+            entry->decompressedStart = outputBytes;
+        }
+        // make buffer available for clients & go on to next
+        reader->enqueueReady(entry);
+    }
+    AllowEventWaitersToProceed(&reader->decompressThreadDone);
+}
 
+#ifdef SNAP_ZSTD
 
-DecompressDataReader::DecompressDataReader(
-    DataReader* i_inner,
-    int i_count,
-    _int64 i_totalExtra,
-    _int64 i_extraBytes,
-    _int64 i_overflowBytes,
-    int i_chunkSize)
-    : DataReader(), inner(i_inner), count(i_count), offset(i_overflowBytes),
-    totalExtra(i_totalExtra), extraBytes(i_extraBytes), overflowBytes(i_overflowBytes),
-    chunkSize(i_chunkSize), threadStarted(false), eof(false), stopping(false)
+    _int64
+DecompressDataReader::readZstdHeader(
+    char* input,
+    _int64 inputBytes,
+    char* output,
+    _int64 outputBytes)
 {
-    entries = new Entry[count];
-    for (int i = 0; i < count; i++) {
-        Entry* entry = &entries[i];
-        entry->state = EntryAvailable;
-        entry->next = i < count - 1 ? &entries[i + 1] : NULL;
-        entry->decompressed = NULL;
-        entry->allocated = false;
-        entry->batch = DataBatch(0, 0);
+    ZSTD_DStream* dstream = ZSTD_createDStream();
+    ZSTD_inBuffer in = { input, (size_t) inputBytes, 0 };
+    ZSTD_outBuffer out = { output, (size_t) outputBytes, 0 };
+    while (in.pos < in.size && out.pos < out.size) {
+        size_t status = ZSTD_decompressStream(dstream, &out, &in);
+        if (ZSTD_isError(status)) {
+            WriteErrorMessage("error decompressing zstd file %s: %s\n", getFilename(), ZSTD_getErrorName(status));
+            soft_exit(1);
+        }
     }
-    available = entries;
-    first = last = NULL;
-    CreateEventObject(&readyEvent);
-    PreventEventWaitersFromProceeding(&readyEvent);
-    CreateEventObject(&availableEvent);
-    AllowEventWaitersToProceed(&availableEvent);
-    CreateEventObject(&decompressThreadDone);
-    PreventEventWaitersFromProceeding(&decompressThreadDone);
-    InitializeExclusiveLock(&lock);
+    ZSTD_freeDStream(dstream);
+    if (in.pos < in.size && (_int64) out.pos == totalExtra) {
+        WriteErrorMessage("insufficient decompression buffer space for the file header - increase expansion factor, currently -xf %.1f\n", DataSupplier::ExpansionFactor);
+        soft_exit(1);
+    }
+    return out.pos;
 }
 
-DecompressDataReader::~DecompressDataReader()
+//
+// Decompresses whole zstd frames on several threads at once, each straight into its place in the entry, the way
+// DecompressWorker does BGZF blocks.
+//
+class ZstdFrameWorker : public ParallelWorker
 {
-    if (threadStarted) {
-        stopping = true;
-        AllowEventWaitersToProceed(&availableEvent);
-        WaitForEvent(&decompressThreadDone);
+public:
+    ZstdFrameWorker() : dctx(ZSTD_createDCtx()) {}
+
+    virtual ~ZstdFrameWorker() { ZSTD_freeDCtx(dctx); }
+
+    virtual void step();
+
+private:
+    ZSTD_DCtx* dctx;
+};
+
+class ZstdFrameManager : public ParallelWorkerManager
+{
+public:
+    ZstdFrameManager(OffsetVector* i_inputs, OffsetVector* i_outputs)
+        : inputs(i_inputs), outputs(i_outputs), entry(NULL)
+    {}
+
+    virtual ParallelWorker* createWorker()
+    { return new ZstdFrameWorker(); }
+
+    OffsetVector* inputs;
+    OffsetVector* outputs;
+    DecompressDataReader::Entry* entry;
+};
+
+    void
+ZstdFrameWorker::step()
+{
+    _int64 start = timeInNanos();
+    ZstdFrameManager* manager = (ZstdFrameManager*) getManager();
+    for (int i = getThreadNum(); i < manager->inputs->size() - 1; i += getNumThreads()) {
+        size_t outputBytes = (*manager->outputs)[i + 1] - (*manager->outputs)[i];
+        size_t written = ZSTD_decompressDCtx(dctx,
+            manager->entry->decompressed + (*manager->outputs)[i], outputBytes,
+            manager->entry->compressed + (*manager->inputs)[i], (*manager->inputs)[i + 1] - (*manager->inputs)[i]);
+        if (ZSTD_isError(written) || written != outputBytes) {
+            WriteErrorMessage("error decompressing zstd frame: %s\n", ZSTD_isError(written) ? ZSTD_getErrorName(written) : "wrong size");
+            soft_exit(1);
+        }
     }
-    for (int i = 0;  i < count; i++) {
-        if (entries[i].allocated) {
-            BigDealloc(entries[i].decompressed);
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::DecompressNanos, EndPipelineTraceSpan(DecompressTraceEvent, start));
+}
+
+    void
+DecompressDataReader::decompressThreadZstd(
+    void* context)
+/*++
+
+Routine Description:
+
+    decompressThreadContinuous for zstd.  A run of whole frames in a batch that have their decompressed sizes in their
+    headers (zstd writes them when it knows the input size, and pzstd and seekable zstd files are many small frames) is
+    decompressed on several threads at once.  Everything else, including a frame that's split between batches, is
+    streamed on this thread.
+
+--*/
+{
+    BindThreadToHelperProcessors();
+    DecompressDataReader* reader = (DecompressDataReader*) context;
+    ZSTD_DStream* dstream = ZSTD_createDStream();
+    bool inFrame = false; // the stream stopped partway through a frame, so the next input continues it
+    OffsetVector inputs, outputs;
+    ZstdFrameManager manager(&inputs, &outputs);
+    ParallelCoworker coworker(min(8, DataSupplier::ThreadCount), false, &manager);
+    coworker.start();
+    bool stop = false;
+    while (! stop) {
+        Entry* entry = reader->dequeueAvailable();
+        if (reader->stopping) {
+            break;
+        }
+        // always starts with a fresh batch - advances after reading it all
+        bool ok = reader->inner->getData(&entry->compressed, &entry->compressedValid, &entry->compressedStart);
+        if (! ok) {
+            if (! reader->inner->isEOF()) {
+                WriteErrorMessage("error reading file at offset %lld\n", reader->getFileOffset());
+                soft_exit(1);
+            }
+            if (inFrame) {
+                WriteErrorMessage("zstd file %s is truncated\n", reader->getFilename());
+                soft_exit(1);
+            }
+            // mark as eof - no data
+            entry->decompressedValid = entry->decompressedStart = reader->overflowBytes;
+            DataBatch b = reader->inner->getBatch();
+            entry->batch = DataBatch(b.batchID + 1, b.fileID);
+            if (! entry->allocated) {
+                entry->decompressed = (char*) BigAlloc(reader->totalExtra);
+                entry->decompressedSize = reader->extraBytes;
+                entry->extraSize = reader->totalExtra - reader->extraBytes;
+                entry->allocated = true;
+            }
+            stop = true;
+        } else {
+            reader->setupEntry(entry);
+            entry->batch = reader->inner->getBatch();
+            reader->holdBatch(entry->batch); // hold batch while decompressing
+            reader->inner->advance(entry->compressedValid);
+            reader->inner->nextBatch(); // start reading next batch
+            _int64 compressedRead = 0, decompressedWritten = 0;
+            bool flushPending = false; // the stream filled the output, and may have more of it even without more input
+            while (compressedRead < entry->compressedValid || flushPending) {
+                if (! inFrame) {
+                    //
+                    // Find the run of whole frames with known sizes that starts here.
+                    //
+                    inputs.clear();
+                    outputs.clear();
+                    _int64 input = compressedRead;
+                    _int64 output = reader->overflowBytes + decompressedWritten;
+                    while (input < entry->compressedValid) {
+                        size_t frameSize = ZSTD_findFrameCompressedSize(entry->compressed + input, entry->compressedValid - input);
+                        unsigned long long frameContentSize = ZSTD_getFrameContentSize(entry->compressed + input, entry->compressedValid - input);
+                        if (ZSTD_isError(frameSize) || frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN || frameContentSize == ZSTD_CONTENTSIZE_ERROR) {
+                            break;
+                        }
+                        inputs.push_back(input);
+                        outputs.push_back(output);
+                        input += frameSize;
+                        output += frameContentSize;
+                    }
+                    if (inputs.size() > 1) {
+                        inputs.push_back(input);
+                        outputs.push_back(output);
+                        if (output > entry->decompressedSize) {
+                            reader->growEntry(entry, output, reader->overflowBytes + decompressedWritten);
+                        }
+                        manager.entry = entry;
+                        coworker.step();
+                        compressedRead = input;
+                        decompressedWritten = output - reader->overflowBytes;
+                        continue;
+                    }
+                }
+                if (reader->overflowBytes + decompressedWritten == entry->decompressedSize) {
+                    reader->growEntry(entry, 0, reader->overflowBytes + decompressedWritten);
+                }
+                _int64 start = timeInNanos();
+                ZSTD_inBuffer in = { entry->compressed + compressedRead, (size_t) (entry->compressedValid - compressedRead), 0 };
+                ZSTD_outBuffer out = { entry->decompressed + reader->overflowBytes + decompressedWritten,
+                    (size_t) (entry->decompressedSize - reader->overflowBytes - decompressedWritten), 0 };
+                size_t status = ZSTD_decompressStream(dstream, &out, &in);
+                InterlockedAdd64AndReturnNewValue(&ProgressReporter::DecompressNanos, EndPipelineTraceSpan(DecompressTraceEvent, start));
+                if (ZSTD_isError(status)) {
+                    WriteErrorMessage("error decompressing zstd file %s at offset %lld: %s\n", reader->getFilename(), reader->getFileOffset(),
+                        ZSTD_getErrorName(status));
+                    soft_exit(1);
+                }
+                compressedRead += in.pos;
+                decompressedWritten += out.pos;
+                inFrame = status != 0;
+                flushPending = inFrame && out.pos == out.size;
+            }
+            observeExpansion(compressedRead, decompressedWritten);
+            entry->decompressedValid = reader->overflowBytes + decompressedWritten;
+            entry->decompressedStart = decompressedWritten;
         }
+        // make buffer available for clients & go on to next
+        reader->enqueueReady(entry);
     }
-    DestroyExclusiveLock(&lock);
-    delete inner;
-}
-
-    bool
-DecompressDataReader::init(
-    const char* fileName)
-{
-    return inner->init(fileName);
+    coworker.stop();
+    ZSTD_freeDStream(dstream);
+    AllowEventWaitersToProceed(&reader->decompressThreadDone);
 }
+#endif // SNAP_ZSTD
 
-    char*
-DecompressDataReader::readHeader(
-    _int64* io_headerSize)
+    DecompressDataReader::Entry*
+DecompressDataReader::peekReady()
 {
-    z_stream zstream;
-    ThreadHeap heap(max(chunkSize,1000));
-    _int64 compressedBytes = (_int64)(*io_headerSize / MIN_FACTOR);
-    char* compressed = inner->readHeader(&compressedBytes);
-    char* header;
-    _int64 total;
-    inner->getExtra(&header, &total);
-    _ASSERT(total >= totalExtra);
-    _int64 headerSize = 0;
-    while (headerSize < *io_headerSize && compressedBytes > 0) {
-        _int64 compressedBlockSize, decompressedBlockSize;
-        //fprintf(stderr,"decompress chunkSize %d compressedBytes %d headerSize %d totalExtra %d\n", chunkSize, compressedBytes, headerSize, totalExtra);
-        decompress(&zstream, chunkSize != 0 ? &heap : NULL,
-            compressed, compressedBytes, &compressedBlockSize,
-            header + headerSize, totalExtra - headerSize, &decompressedBlockSize,
-            StartMultiBlock);
-        // This just gets reinit()'ed later, and in the interim confuses the non-rewind stdio data reader.  inner->advance(compressedBlockSize);
-        compressed += compressedBlockSize;
-        compressedBytes -= compressedBlockSize;
-        headerSize += decompressedBlockSize;
+    // not thread-safe relative to popReady!
+    if (first == NULL) {
+        WaitForEvent(&readyEvent);
     }
-    *io_headerSize = headerSize;
-    return header;
+    _ASSERT(first->state == EntryReady);
+    return first;
 }
 
     void
-DecompressDataReader::reinit(
-    _int64 startingOffset,
-    _int64 amountOfFileToProcess)
+DecompressDataReader::popReady()
 {
-    if (threadStarted) {
-        WriteErrorMessage("DecompressDataReader reinit called twice\n");
-        soft_exit(1);
-    }
-    // todo: transform start/amount to add for compression? I don't think so...
-    inner->reinit(startingOffset, amountOfFileToProcess);
-    threadStarted = true;
-    if (! StartNewThread(chunkSize > 0 ? decompressThread : decompressThreadContinuous, this)) {
-        WriteErrorMessage("failed to start decompressThread\n");
-        soft_exit(1);
+    while (true) {
+        AcquireExclusiveLock(&lock);
+        if (first != NULL) {
+            _ASSERT(first->state == EntryReady);
+            //fprintf(stderr, "popReady %d:%d #%d -> held\n", first->batch.fileID, first->batch.batchID, first - entries);
+            first->state = EntryHeld;
+            if (first->next == NULL) {
+                _ASSERT(last == first);
+                last = NULL;
+                PreventEventWaitersFromProceeding(&readyEvent);
+            }
+            first = first->next;
+            _ASSERT(first == NULL || first->state == EntryReady);
+            ReleaseExclusiveLock(&lock);
+            return;
+        }
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&readyEvent);
     }
 }
 
-    bool
-DecompressDataReader::getData(
-    char** o_buffer,
-    _int64* o_validBytes,
-    _int64* o_startBytes)
+    void
+DecompressDataReader::enqueueReady(Entry* entry)
 {
-    if (eof) {
-        return false;
-    }
-    Entry* entry = peekReady();
-    if (offset >= entry->decompressedStart) {
-        return false;
-    }
-    *o_buffer = entry->decompressed + offset;
-    *o_validBytes = entry->decompressedValid - offset;
-    if (o_startBytes != NULL) {
-        *o_startBytes = entry->decompressedStart- offset;
+    AcquireExclusiveLock(&lock);
+    _ASSERT(entry->state == EntryReading);
+    entry->next = NULL;
+    entry->state = EntryReady;
+    if (last == NULL) {
+        first = last = entry;
+        AllowEventWaitersToProceed(&readyEvent);
+    } else {
+        last->next = entry;
+        last = entry;
     }
-    return true;
+    ReleaseExclusiveLock(&lock);
 }
 
-    void
-DecompressDataReader::advance(
-    _int64 bytes)
-
+    DecompressDataReader::Entry*
+DecompressDataReader::dequeueAvailable()
 {
-    offset = min(offset + max(bytes, (_int64) 0), peekReady()->decompressedValid);
+    while (true) {
+        AcquireExclusiveLock(&lock);
+        //fprintf(stderr, "dequeueAvailable #%d\n", available == NULL ? -1 : available - entries);
+        if (available!= NULL) {
+            _ASSERT(available->state == EntryAvailable);
+            available->state = EntryReading;
+            Entry* result = available;
+            available = available->next;
+            if (available == NULL) {
+                PreventEventWaitersFromProceeding(&availableEvent);
+            }
+            ReleaseExclusiveLock(&lock);
+            return result;
+        }
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&availableEvent);
+        if (stopping) {
+            return NULL;
+        }
+    }
 }
 
     void
-DecompressDataReader::nextBatch()
+DecompressDataReader::enqueueAvailable(Entry* entry)
 {
-    if (eof) {
-        return;
-    }
-    Entry* old = peekReady();
-    popReady();
-    if (old->decompressedValid == overflowBytes) {
-        eof = true;
-        return;
-    }
-    Entry* next = peekReady();
-    _ASSERT(next->state == EntryReady && next->decompressed != NULL);
-    _int64 copy = old->decompressedValid - max(offset, old->decompressedStart);
-    memcpy(next->decompressed + overflowBytes - copy, old->decompressed + old->decompressedValid - copy, copy);
-    offset = overflowBytes - copy;
-    //fprintf(stderr,"DecompressDataReader nextBatch %d:%d #%d -> %d:%d #%d copy %lld + %lld/%lld\n", old->batch.fileID, old->batch.batchID, old-entries, next->batch.fileID, next->batch.batchID, next-entries, copy, next->decompressedStart, next->decompressedValid);
-    releaseBatch(old->batch); // holdBatch was called in decompress thread, release now if no customers added holds
-    if (offset == next->decompressedValid) {
-        eof = true;
-        _ASSERT(inner->isEOF());
+    AssertExclusiveLockHeld(&lock);
+    _ASSERT(entry->state == EntryHeld);
+    entry->state = EntryAvailable;
+    entry->next = available;
+    available = entry;
+    if (entry->next == NULL) {
+        AllowEventWaitersToProceed(&availableEvent);
     }
 }
 
-    bool
-DecompressDataReader::isEOF()
+class DecompressDataReaderSupplier : public DataSupplier
 {
-    return eof;
-}
+public:
+    DecompressDataReaderSupplier(DataSupplier* i_inner, int i_blockSize = BAM_BLOCK, bool i_zstd = false, bool i_parallelGzip = false)
+        : DataSupplier(), inner(i_inner), blockSize(i_blockSize), zstd(i_zstd), parallelGzip(i_parallelGzip)
+    {}
 
-    DataBatch
-DecompressDataReader::getBatch()
-{
-    return peekReady()->batch;
-}
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor, size_t bufferSpace);
 
-    void
-DecompressDataReader::holdBatch(DataBatch batch)
+private:
+    DataSupplier* inner;
+    const int blockSize;
+    const bool zstd;
+    const bool parallelGzip;
+};
+
+    DataReader*
+DecompressDataReaderSupplier::getDataReader(
+    int bufferCount,
+    _int64 overflowBytes,
+    double extraFactor,
+    size_t bufferSpace)
 {
-    inner->holdBatch(batch);
+    // adjust extra factor for compression ratio, allowing for what earlier readers have seen
+    double expand = max(MAX_FACTOR * DataSupplier::ExpansionFactor, 1.25 * DecompressDataReader::ObservedExpansion);
+    double totalFactor = expand * (1.0 + extraFactor);
+    // get inner reader with no overflow since zlib can't deal with it, except that a ParallelInflater reads on to the end of a block
+    // add 2 buffers for compression thread
+    DataReader* data = inner->getDataReader(bufferCount + 2, parallelGzip ? ParallelInflater::OverflowBytes : blockSize, totalFactor, bufferSpace);
+    // compute how many extra bytes are owned by this layer
+    char* p;
+    _int64 totalExtra;
+    data->getExtra(&p, &totalExtra);
+    _int64 mine = (_int64)(totalExtra * expand / totalFactor);
+    // create new reader, telling it how many bytes it owns
+    // it will subtract overflow off the end of each batch
+    return new DecompressDataReader(data, bufferCount, totalExtra, mine, overflowBytes, blockSize, zstd, parallelGzip);
 }
+    
+    static bool
+ParseBgzfBlockHeader(
+    const char* p,
+    _int64 bytes,
+    _int64* o_blockSize)
+/*++
 
-    bool
-DecompressDataReader::releaseBatch(DataBatch batch)
+Routine Description:
+
+    See whether there's a BGZF block header at p, and if so how big the whole compressed block is.
+
+Arguments:
+
+    p           - where the block might start
+    bytes       - how much data there is at p
+    o_blockSize - the size of the block, header and trailer included
+
+--*/
 {
-    if (! inner->releaseBatch(batch)) {
+    BgzfHeader* header = (BgzfHeader*) p;
+    if (bytes < (_int64) sizeof(BgzfHeader) || header->ID1 != 0x1f || header->ID2 != 0x8b || header->CM != 8 || ! (header->FLG & 4) ||
+        (_int64) sizeof(BgzfHeader) + header->XLEN > bytes) {
         return false;
     }
-    // truly released, find matching entry & put back on available list
-    AcquireExclusiveLock(&lock);
-    for (int i = 0; i < count; i++) {
-        Entry* entry = &entries[i];
-        if (entry->batch == batch) {
-			//fprintf(stderr,"DecompressDataReader releaseBatch %d:0x%x #%d\n", batch.fileID, batch.batchID, i);
-            if (entry->state == EntryHeld) {
-                enqueueAvailable(entry);
-            } else {
-                _ASSERT(entry->state == EntryAvailable);
-            }
-            break;
+    char* end = (char*) header->firstExtra() + header->XLEN;
+    for (BgzfExtra* x = header->firstExtra(); (char*) x + sizeof(BgzfExtra) <= end; x = x->nextExtra()) {
+        if (x->SI1 == 66 && x->SI2 == 67 && x->SLEN == 2) {
+            *o_blockSize = (_int64) *(_uint16*) x->data() + 1;
+            return true;
         }
     }
-    ReleaseExclusiveLock(&lock);
-    return true;
+    return false;
+}
+
+//
+// Reads a range of a BGZF file on the calling thread, so each range splitting aligner thread inflates its own piece
+// of the file.  The range is in compressed bytes, and belongs to the blocks that start in it: reads may start anywhere
+// in the decompressed data of those blocks, and the blocks after them are decompressed too, as far as the overflow goes,
+// to finish the last read.  Like a memory mapped reader with no extra data, each range is one batch.
+//
+class BgzfRangeDataReader : public DataReader
+{
+public:
+    BgzfRangeDataReader(DataReader* i_inner, _int64 i_overflowBytes);
+
+    virtual ~BgzfRangeDataReader();
+
+    virtual bool init(const char* fileName);
+
+    virtual char* readHeader(_int64* io_headerSize);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL);
+
+    virtual void advance(_int64 bytes);
+
+    virtual void nextBatch() {}
+
+    virtual bool isEOF() { return true; }
+
+    virtual DataBatch getBatch() { return DataBatch((_uint32) 1); }
+
+    virtual void holdBatch(DataBatch batch) {}
+
+    virtual bool releaseBatch(DataBatch batch) { return true; }
+
+    virtual _int64 getFileOffset() { return firstBlockOffset; }
+
+    virtual void getExtra(char** o_extra, _int64* o_length) { *o_extra = NULL; *o_length = 0; }
+
+    virtual const char* getFilename() { return inner->getFilename(); }
+
+private:
+
+    void decompressBlock(char* block, _int64 blockSize, _int64 fileOffset);
+
+    DataReader* inner; // maps the compressed file
+    const _int64 overflowBytes;
+    char* buffer; // decompressed data for the current range
+    _int64 bufferSize;
+    _int64 startBytes; // decompressed bytes from the blocks that start in the range
+    _int64 validBytes; // including the overflow
+    _int64 offset;
+    _int64 firstBlockOffset; // in the compressed file
+    z_stream zstream;
+    ThreadHeap heap;
+    GzipBlockDecompressor* blockDecompressor; // NULL to just use zlib
+};
+
+BgzfRangeDataReader::BgzfRangeDataReader(
+    DataReader* i_inner,
+    _int64 i_overflowBytes)
+    : inner(i_inner), overflowBytes(i_overflowBytes), buffer(NULL), bufferSize(0), startBytes(0), validBytes(0), offset(0),
+    firstBlockOffset(0), heap(BAM_BLOCK), blockDecompressor(GzipBlockDecompressor::Create())
+{
+    zstream.zalloc = zalloc;
+    zstream.zfree = zfree;
+    zstream.opaque = &heap;
+}
+
+BgzfRangeDataReader::~BgzfRangeDataReader()
+{
+    if (buffer != NULL) {
+        BigDealloc(buffer);
+    }
+    delete blockDecompressor;
+    delete inner;
 }
 
-    _int64
-DecompressDataReader::getFileOffset()
+    bool
+BgzfRangeDataReader::init(
+    const char* fileName)
 {
-    return inner->getFileOffset();
+    return inner->init(fileName);
 }
 
-    void
-DecompressDataReader::getExtra(
-    char** o_extra,
-    _int64* o_length)
+    char*
+BgzfRangeDataReader::readHeader(
+    _int64* io_headerSize)
 {
-    *o_extra = peekReady()->decompressed + extraBytes;
-    *o_length = totalExtra - extraBytes;
+    reinit(0, 0);
+    *io_headerSize = min(*io_headerSize, validBytes);
+    return buffer;
 }
-    
-    bool
-DecompressDataReader::decompress(
-    z_stream* zstream,
-    ThreadHeap* heap,
-    char* input,
-    _int64 inputBytes,
-    _int64* o_inputRead,
-    char* output,
-    _int64 outputBytes,
-    _int64* o_outputWritten,
-    DecompressMode mode)
+
+    void
+BgzfRangeDataReader::decompressBlock(
+    char* block,
+    _int64 blockSize,
+    _int64 fileOffset)
 {
-    if (inputBytes > 0xffffffff || outputBytes > 0xffffffff) {
-        WriteErrorMessage("GzipDataReader: inputBytes or outputBytes > max unsigned int\n");
+    _int64 decompressedSize = *(_uint32*) (block + blockSize - 4);
+    if (decompressedSize > BAM_BLOCK) {
+        WriteErrorMessage("error reading BGZF file %s at offset %lld\n", getFilename(), fileOffset);
         soft_exit(1);
     }
-    zstream->next_in = (Bytef*) input;
-    zstream->avail_in = (uInt)inputBytes;
-    zstream->next_out = (Bytef*) output;
-    zstream->avail_out = (uInt)outputBytes;
-    if (heap != NULL) {
-        zstream->zalloc = zalloc;
-        zstream->zfree = zfree;
-        zstream->opaque = heap;
-    } else {
-        zstream->zalloc = NULL;
-        zstream->zfree = NULL;
+    if (validBytes + decompressedSize > bufferSize) {
+        _int64 newSize = max(2 * bufferSize, validBytes + decompressedSize + overflowBytes + BAM_BLOCK);
+        char* newBuffer = (char*) BigAlloc(newSize);
+        if (buffer != NULL) {
+            memcpy(newBuffer, buffer, validBytes);
+            BigDealloc(buffer);
+        }
+        buffer = newBuffer;
+        bufferSize = newSize;
     }
-    uInt oldAvailOut, oldAvailIn;
-    int block = 0;
-    bool multiBlock = true;
-    int status;
-    do {
-        if (mode != ContinueMultiBlock || block != 0) {
-            if (heap != NULL) {
-                heap->reset();
-            }
-            status = inflateInit2(zstream, windowBits | ENABLE_ZLIB_GZIP);
-            if (status < 0) {
-                WriteErrorMessage("GzipDataReader: inflateInit2 failed with %d\n", status);
-                return false;
+
+    size_t written;
+    _int64 start = timeInNanos();
+    if (blockDecompressor == NULL || ! blockDecompressor->decompressBlock(block, blockSize, buffer + validBytes, decompressedSize, &written)) {
+        _int64 inputUsed, outputUsed;
+        DecompressDataReader::decompress(&zstream, &heap, block, blockSize, &inputUsed, buffer + validBytes, decompressedSize, &outputUsed,
+            DecompressDataReader::SingleBlock);
+        written = outputUsed;
+    }
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::DecompressNanos, EndPipelineTraceSpan(DecompressTraceEvent, start));
+    if ((_int64) written != decompressedSize) {
+        WriteErrorMessage("error reading BGZF file %s at offset %lld\n", getFilename(), fileOffset);
+        soft_exit(1);
+    }
+    validBytes += decompressedSize;
+}
+
+    void
+BgzfRangeDataReader::reinit(
+    _int64 startingOffset,
+    _int64 amountOfFileToProcess)
+/*++
+
+Routine Description:
+
+    Find the first block that starts in the range, and decompress the blocks that start in the range, and then the
+    ones after them until there's enough overflow.
+
+    A block boundary in the middle of the file is found by looking for a BGZF header whose block is followed by another
+    one (or the end of the file), which isn't going to happen by chance in compressed data.
+
+--*/
+{
+    inner->reinit(startingOffset, 0); // to the end of the file, for the overflow
+    char* compressed;
+    _int64 available;
+    startBytes = validBytes = offset = 0;
+    firstBlockOffset = startingOffset;
+    if (! inner->getData(&compressed, &available)) {
+        return;
+    }
+    _int64 rangeEnd = amountOfFileToProcess == 0 ? available : min(available, amountOfFileToProcess);
+
+    _int64 position = 0;
+    _int64 blockSize;
+    if (startingOffset != 0) {
+        for (; position < rangeEnd; position++) {
+            _int64 nextBlockSize;
+            if (compressed[position] == 0x1f && ParseBgzfBlockHeader(compressed + position, available - position, &blockSize) &&
+                (position + blockSize == available ||
+                 ParseBgzfBlockHeader(compressed + position + blockSize, available - position - blockSize, &nextBlockSize))) {
+                break;
             }
         }
-        oldAvailOut = zstream->avail_out;
-        oldAvailIn = zstream->avail_in;
-        status = inflate(zstream, mode == SingleBlock ? Z_NO_FLUSH : Z_FINISH);
-        // fprintf(stderr, "decompress block #%d %lld -> %lld = %d\n", block, zstream.next_in - lastIn, zstream.next_out - lastOut, status);
-        block++;
-        if (status < 0 && status != Z_BUF_ERROR) {
-            WriteErrorMessage("GzipDataReader: inflate failed with %d\n", status);
+    }
+    firstBlockOffset = startingOffset + position;
+
+    while (position < available && (position < rangeEnd || validBytes - startBytes < overflowBytes)) {
+        if (! ParseBgzfBlockHeader(compressed + position, available - position, &blockSize) || position + blockSize > available) {
+            WriteErrorMessage("error reading BGZF file %s at offset %lld\n", getFilename(), startingOffset + position);
             soft_exit(1);
         }
-        if (status < 0 && zstream->avail_out == 0 && zstream->avail_in > 0) {
-            WriteErrorMessage("insufficient decompression buffer space - increase expansion factor, currently -xf %.1f\n", DataSupplier::ExpansionFactor);
-            soft_exit(1);
+        bool startsInRange = position < rangeEnd;
+        decompressBlock(compressed + position, blockSize, startingOffset + position);
+        position += blockSize;
+        if (startsInRange) {
+            startBytes = validBytes;
         }
-    } while (zstream->avail_in != 0 && (zstream->avail_out != oldAvailOut || zstream->avail_in != oldAvailIn) && mode != SingleBlock);
-    // fprintf(stderr, "end decompress status=%d, avail_in=%lld, last block=%lld->%lld, avail_out=%lld\n", status, zstream.avail_in, zstream.next_in - lastIn, zstream.next_out - lastOut, zstream.avail_out);
-    if (o_inputRead) {
-        *o_inputRead = inputBytes - zstream->avail_in;
-    }
-    if (o_outputWritten) {
-        *o_outputWritten = outputBytes - zstream->avail_out;
     }
-    return zstream->avail_in == 0;
 }
-  
-    char*
-DecompressDataReader::findPointer(
-    void* p)
+
+    bool
+BgzfRangeDataReader::getData(
+    char** o_buffer,
+    _int64* o_validBytes,
+    _int64* o_startBytes)
 {
-    static char result[100];
-    sprintf(result, "not found");
-    for (int i = 0; i < count; i++) {
-        Entry* e = &entries[i];
-        if (e->compressed <= p && p < e->compressed + e->compressedValid) {
-            sprintf(result, "compressed #%d @ %lld", i, (char*)p - e->compressed);
-            break;
-        }
-        if (e->decompressed <= p && p < e->decompressed + extraBytes) {
-            sprintf(result, "decompressed #%d %lld", i, (char*) p - e->decompressed);
-            break;
-        }
-        if (e->decompressed + extraBytes <= p && p < e->decompressed + totalExtra) {
-            sprintf(result, "extra #%d %lld", i, (char*) p - e->decompressed - extraBytes);
-            break;
-        }
+    if (offset >= startBytes) {
+        return false;
     }
-    return result;
+    *o_buffer = buffer + offset;
+    *o_validBytes = validBytes - offset;
+    if (o_startBytes != NULL) {
+        *o_startBytes = startBytes - offset;
+    }
+    return true;
 }
 
-typedef VariableSizeVector<_int64> OffsetVector;
+    void
+BgzfRangeDataReader::advance(
+    _int64 bytes)
+{
+    offset = min(offset + max(bytes, (_int64) 0), validBytes);
+}
 
-class DecompressWorker : public ParallelWorker
+class BgzfRangeDataSupplier : public DataSupplier
 {
 public:
-    DecompressWorker();
+    BgzfRangeDataSupplier(DataSupplier* i_inner) : DataSupplier(), inner(i_inner) {}
 
-    virtual void step();
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor, size_t bufferSpace)
+    {
+        //
+        // The whole rest of the file as one batch, with no overflow or extra data of its own.
+        //
+        return new BgzfRangeDataReader(inner->getDataReader(1, 0, 0.0, 0), overflowBytes);
+    }
 
 private:
-    z_stream zstream;
-    ThreadHeap heap;
+    DataSupplier* inner;
 };
-    
-class DecompressManager: public ParallelWorkerManager
+
+    DataSupplier*
+DataSupplier::BgzfRange(
+    DataSupplier* inner)
 {
-public:
-    DecompressManager(OffsetVector* i_inputs, OffsetVector* i_outputs)
-        : inputs(i_inputs), outputs(i_outputs)
-    {}
+    return new BgzfRangeDataSupplier(inner);
+}
 
-    virtual ParallelWorker* createWorker()
-    { return new DecompressWorker(); }
+#ifdef SNAP_ZSTD
 
-    OffsetVector* inputs;
-    OffsetVector* outputs;
-    DecompressDataReader::Entry* entry;
+    static bool
+ParseZstdFrame(
+    const char* p,
+    _int64 bytes,
+    _int64* o_frameSize)
+/*++
 
-    friend class DecompressWorker;
-};
+Routine Description:
 
-DecompressWorker::DecompressWorker()
-    : heap(BAM_BLOCK)
-{
-    zstream.zalloc = zalloc;
-    zstream.zfree = zfree;
-    zstream.opaque = &heap;
-}
+    See whether there's a whole zstd frame (or skippable frame, like the seek table) at p, and if so how big it is.
 
-    void
-DecompressWorker::step()
+--*/
 {
-    DecompressManager* manager = (DecompressManager*) getManager();
-    for (int i = getThreadNum(); i < manager->inputs->size() - 1; i += getNumThreads()) {
-        _int64 inputUsed, outputUsed;
-        DecompressDataReader::decompress(&zstream,
-            &heap,
-            manager->entry->compressed + (*manager->inputs)[i],
-            (*manager->inputs)[i + 1] - (*manager->inputs)[i],
-            &inputUsed,
-            manager->entry->decompressed + (*manager->outputs)[i],
-            (*manager->outputs)[i + 1] - (*manager->outputs)[i],
-            &outputUsed,
-            DecompressDataReader::SingleBlock);
-        _ASSERT(inputUsed == (*manager->inputs)[i + 1] - (*manager->inputs)[i] &&
-            outputUsed == (*manager->outputs)[i + 1] - (*manager->outputs)[i]);
+    if (bytes < 4 || (*(_uint32*) p != ZSTD_MAGICNUMBER && (*(_uint32*) p & ZSTD_MAGIC_SKIPPABLE_MASK) != ZSTD_MAGIC_SKIPPABLE_START)) {
+        return false;
+    }
+    size_t frameSize = ZSTD_findFrameCompressedSize(p, bytes);
+    if (ZSTD_isError(frameSize)) {
+        return false;
     }
+    *o_frameSize = frameSize;
+    return true;
 }
 
-    void
-DecompressDataReader::decompressThread(
-    void* context)
+//
+// Reads a range of a seekable zstd file on the calling thread, the way BgzfRangeDataReader does a BGZF one: the range
+// is in compressed bytes, and belongs to the frames that start in it.  The seek table itself isn't used, other than by
+// IsSeekableZstdFile to say that the file is made of frames small enough for this.
+//
+class ZstdRangeDataReader : public DataReader
 {
-    DecompressDataReader* reader = (DecompressDataReader*) context;
-    OffsetVector inputs, outputs;
-    DecompressManager manager(&inputs, &outputs);
-    ParallelCoworker coworker(min(8, DataSupplier::ThreadCount), false, &manager);
-    coworker.start();
-    // keep reading & decompressing entries until stopped
-    bool stop = false;
-    while (! stop) {
-        Entry* entry = reader->dequeueAvailable();
-        if (reader->stopping) {
-            break;
-        }
-        // always starts with a fresh batch - advances after reading it all
-        bool ok = reader->inner->getData(&entry->compressed, &entry->compressedValid, &entry->compressedStart);
-        int index = (int) (entry - reader->entries);
-        if (! ok) {
-            //fprintf(stderr, "decompressThread #%d %d:%d eof\n", index, reader->inner->getBatch().fileID, reader->inner->getBatch().batchID);
-            if (! reader->inner->isEOF()) {
-                WriteErrorMessage("error reading file at offset %lld\n", reader->getFileOffset());
-                soft_exit(1);
-            }
-            // mark as eof - no data
-            entry->decompressedValid = entry->decompressedStart = reader->overflowBytes;
-            DataBatch b = reader->inner->getBatch();
-            entry->batch = DataBatch(b.batchID + 1, b.fileID);
-            // decompressed buffer is same as next-to-last batch, need to allocate own buffer
-            entry->decompressed = (char*) BigAlloc(reader->totalExtra);
-            entry->allocated = true;
-            stop = true;
-        } else {
-            _int64 extraSize;
-            reader->inner->getExtra(&entry->decompressed, &extraSize);
-			_ASSERT(extraSize >= reader->extraBytes && extraSize >= reader->overflowBytes);
-            // figure out offsets and advance inner data
-            inputs.clear();
-            outputs.clear();
-            _int64 input = 0;
-            _int64 output = reader->overflowBytes;
-            do {
-                inputs.push_back(input);
-                outputs.push_back(output);
-                BgzfHeader* zip = (BgzfHeader*) (entry->compressed + input);
-                input += zip->BSIZE() + 1;
-                output += zip->ISIZE();
+public:
+    ZstdRangeDataReader(DataReader* i_inner, _int64 i_overflowBytes);
 
-                if (output > reader->extraBytes) {
-                    fprintf(stderr, "insufficient decompression space, increase -xf parameter\n");
-                    soft_exit(1);
-                }
-                if (input > entry->compressedValid || zip->BSIZE() >= BAM_BLOCK || zip->ISIZE() > BAM_BLOCK) {
-                    fprintf(stderr, "error reading BAM file at offset %lld\n", reader->getFileOffset());
-                    soft_exit(1);
-                }
-            } while (input < entry->compressedStart);
-            // append final offsets
-            inputs.push_back(input);
-            outputs.push_back(output);
-            //fprintf(stderr, "decompressThread read #%d %lld->%lld\n", index, input, output);
-            reader->inner->advance(input);
-            entry->decompressedValid = output;
-            entry->decompressedStart = output - reader->overflowBytes;
-            entry->batch = reader->inner->getBatch();
-			reader->holdBatch(entry->batch); // hold batch while decompressing
-            reader->inner->nextBatch(); // start reading next batch
-            // decompress all chunks synchronously on multiple threads
-            manager.entry = entry;
-            coworker.step();
-        }
-        // make buffer available for clients & go on to next
-        //fprintf(stderr, "decompressThread #%d %d:%d ready\n", index, entry->batch.fileID, entry->batch.batchID);
-        reader->enqueueReady(entry);
-    }
-    coworker.stop();
-    AllowEventWaitersToProceed(&reader->decompressThreadDone);
+    virtual ~ZstdRangeDataReader();
+
+    virtual bool init(const char* fileName);
+
+    virtual char* readHeader(_int64* io_headerSize);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL);
+
+    virtual void advance(_int64 bytes);
+
+    virtual void nextBatch() {}
+
+    virtual bool isEOF() { return true; }
+
+    virtual DataBatch getBatch() { return DataBatch((_uint32) 1); }
+
+    virtual void holdBatch(DataBatch batch) {}
+
+    virtual bool releaseBatch(DataBatch batch) { return true; }
+
+    virtual _int64 getFileOffset() { return firstFrameOffset; }
+
+    virtual void getExtra(char** o_extra, _int64* o_length) { *o_extra = NULL; *o_length = 0; }
+
+    virtual const char* getFilename() { return inner->getFilename(); }
+
+private:
+
+    void decompressFrame(char* frame, _int64 frameSize, _int64 fileOffset);
+
+    DataReader* inner; // maps the compressed file
+    const _int64 overflowBytes;
+    char* buffer; // decompressed data for the current range
+    _int64 bufferSize;
+    _int64 startBytes; // decompressed bytes from the frames that start in the range
+    _int64 validBytes; // including the overflow
+    _int64 offset;
+    _int64 firstFrameOffset; // in the compressed file
+    ZSTD_DCtx* dctx;
+};
+
+ZstdRangeDataReader::ZstdRangeDataReader(
+    DataReader* i_inner,
+    _int64 i_overflowBytes)
+    : inner(i_inner), overflowBytes(i_overflowBytes), buffer(NULL), bufferSize(0), startBytes(0), validBytes(0), offset(0),
+    firstFrameOffset(0), dctx(ZSTD_createDCtx())
+{
 }
 
-    void
-DecompressDataReader::decompressThreadContinuous(
-    void* context)
+ZstdRangeDataReader::~ZstdRangeDataReader()
 {
-    DecompressDataReader* reader = (DecompressDataReader*) context;
-    z_stream zstream;
-    bool first = true;
-    bool stop = false;
-    while (! stop) {
-        Entry* entry = reader->dequeueAvailable();
-        if (reader->stopping) {
-            break;
-        }
-        // always starts with a fresh batch - advances after reading it all
-        bool ok = reader->inner->getData(&entry->compressed, &entry->compressedValid, &entry->compressedStart);
-        int index = (int) (entry - reader->entries);
-        if (! ok) {
-            //fprintf(stderr, "decompressThreadContinuous#%d %d:%d eof\n", index, reader->inner->getBatch().fileID, reader->inner->getBatch().batchID);
-            if (! reader->inner->isEOF()) {
-                WriteErrorMessage("error reading file at offset %lld\n", reader->getFileOffset());
-                soft_exit(1);
-            }
-            // mark as eof - no data
-            entry->decompressedValid = entry->decompressedStart = reader->overflowBytes;
-            DataBatch b = reader->inner->getBatch();
-            entry->batch = DataBatch(b.batchID + 1, b.fileID);
-            entry->decompressed = (char*) BigAlloc(reader->totalExtra);
-            entry->allocated = true;
-            stop = true;
-        } else {
-            // figure out offsets and advance inner data
-            _int64 ignore;
-            reader->inner->getExtra(&entry->decompressed, &ignore);
-            _ASSERT(ignore >= reader->extraBytes && ignore >= reader->overflowBytes);
-            _int64 compressedRead, decompressedWritten;
-            entry->batch = reader->inner->getBatch();
-            reader->holdBatch(entry->batch); // hold batch while decompressing
-            reader->inner->advance(entry->compressedValid);
-            reader->inner->nextBatch(); // start reading next batch
-            decompress(&zstream, NULL,
-                entry->compressed, entry->compressedValid, &compressedRead,
-                entry->decompressed + reader->overflowBytes, reader->extraBytes - reader->overflowBytes, &decompressedWritten,
-                first ? StartMultiBlock : ContinueMultiBlock);
-            _ASSERT(compressedRead == entry->compressedValid && decompressedWritten <= reader->extraBytes - reader->overflowBytes);
-            entry->decompressedValid = reader->overflowBytes + decompressedWritten;
-            entry->decompressedStart = decompressedWritten;
-            first = false;
-        }
-        // make buffer available for clients & go on to next
-        //fprintf(stderr, "decompressThreadContinuous#%d %d:%d ready\n", index, entry->batch.fileID, entry->batch.batchID);
-        reader->enqueueReady(entry);
+    if (buffer != NULL) {
+        BigDealloc(buffer);
     }
-    AllowEventWaitersToProceed(&reader->decompressThreadDone);
+    ZSTD_freeDCtx(dctx);
+    delete inner;
 }
 
-    DecompressDataReader::Entry*
-DecompressDataReader::peekReady()
+    bool
+ZstdRangeDataReader::init(
+    const char* fileName)
 {
-    // not thread-safe relative to popReady!
-    if (first == NULL) {
-        WaitForEvent(&readyEvent);
-    }
-    _ASSERT(first->state == EntryReady);
-    return first;
+    return inner->init(fileName);
+}
+
+    char*
+ZstdRangeDataReader::readHeader(
+    _int64* io_headerSize)
+{
+    reinit(0, 0);
+    *io_headerSize = min(*io_headerSize, validBytes);
+    return buffer;
 }
 
     void
-DecompressDataReader::popReady()
+ZstdRangeDataReader::decompressFrame(
+    char* frame,
+    _int64 frameSize,
+    _int64 fileOffset)
 {
-    while (true) {
-        AcquireExclusiveLock(&lock);
-        if (first != NULL) {
-            _ASSERT(first->state == EntryReady);
-            //fprintf(stderr, "popReady %d:%d #%d -> held\n", first->batch.fileID, first->batch.batchID, first - entries);
-            first->state = EntryHeld;
-            if (first->next == NULL) {
-                _ASSERT(last == first);
-                last = NULL;
-                PreventEventWaitersFromProceeding(&readyEvent);
+    unsigned long long frameContentSize = ZSTD_getFrameContentSize(frame, frameSize);
+    _int64 needed = frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN || frameContentSize == ZSTD_CONTENTSIZE_ERROR ? ZSTD_DStreamOutSize() : frameContentSize;
+    _int64 start = timeInNanos();
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    ZSTD_inBuffer in = { frame, (size_t) frameSize, 0 };
+    size_t status;
+    do {
+        if (validBytes + needed > bufferSize) {
+            _int64 newSize = max(2 * bufferSize, validBytes + needed + overflowBytes + (_int64) ZSTD_DStreamOutSize());
+            char* newBuffer = (char*) BigAlloc(newSize);
+            if (buffer != NULL) {
+                memcpy(newBuffer, buffer, validBytes);
+                BigDealloc(buffer);
             }
-            first = first->next;
-            _ASSERT(first == NULL || first->state == EntryReady);
-            ReleaseExclusiveLock(&lock);
-            return;
+            buffer = newBuffer;
+            bufferSize = newSize;
         }
-        ReleaseExclusiveLock(&lock);
-        WaitForEvent(&readyEvent);
-    }
+        ZSTD_outBuffer out = { buffer + validBytes, (size_t) (bufferSize - validBytes), 0 };
+        status = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(status) || (status != 0 && in.pos == in.size && out.pos < out.size)) {
+            WriteErrorMessage("error reading zstd file %s at offset %lld\n", getFilename(), fileOffset);
+            soft_exit(1);
+        }
+        validBytes += out.pos;
+        needed = ZSTD_DStreamOutSize();
+    } while (status != 0);
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::DecompressNanos, EndPipelineTraceSpan(DecompressTraceEvent, start));
 }
 
     void
-DecompressDataReader::enqueueReady(Entry* entry)
-{
-    AcquireExclusiveLock(&lock);
-    _ASSERT(entry->state == EntryReading);
-    entry->next = NULL;
-    entry->state = EntryReady;
-    if (last == NULL) {
-        first = last = entry;
-        AllowEventWaitersToProceed(&readyEvent);
-    } else {
-        last->next = entry;
-        last = entry;
-    }
-    ReleaseExclusiveLock(&lock);
-}
+ZstdRangeDataReader::reinit(
+    _int64 startingOffset,
+    _int64 amountOfFileToProcess)
+/*++
 
-    DecompressDataReader::Entry*
-DecompressDataReader::dequeueAvailable()
+Routine Description:
+
+    Find the first frame that starts in the range, and decompress the frames that start in the range, and then the
+    ones after them until there's enough overflow.
+
+    A frame boundary in the middle of the file is found by looking for the zstd magic number at the start of a frame
+    that's followed by another one (or the end of the file), as BgzfRangeDataReader looks for BGZF headers.
+
+--*/
 {
-    while (true) {
-        AcquireExclusiveLock(&lock);
-        //fprintf(stderr, "dequeueAvailable #%d\n", available == NULL ? -1 : available - entries);
-        if (available!= NULL) {
-            _ASSERT(available->state == EntryAvailable);
-            available->state = EntryReading;
-            Entry* result = available;
-            available = available->next;
-            if (available == NULL) {
-                PreventEventWaitersFromProceeding(&availableEvent);
+    inner->reinit(startingOffset, 0); // to the end of the file, for the overflow
+    char* compressed;
+    _int64 available;
+    startBytes = validBytes = offset = 0;
+    firstFrameOffset = startingOffset;
+    if (! inner->getData(&compressed, &available)) {
+        return;
+    }
+    _int64 rangeEnd = amountOfFileToProcess == 0 ? available : min(available, amountOfFileToProcess);
+
+    _int64 position = 0;
+    _int64 frameSize;
+    if (startingOffset != 0) {
+        for (; position < rangeEnd; position++) {
+            _int64 nextFrameSize;
+            if (position + 4 <= available && *(_uint32*) (compressed + position) == ZSTD_MAGICNUMBER &&
+                ParseZstdFrame(compressed + position, available - position, &frameSize) &&
+                (position + frameSize == available ||
+                 ParseZstdFrame(compressed + position + frameSize, available - position - frameSize, &nextFrameSize))) {
+                break;
             }
-            ReleaseExclusiveLock(&lock);
-            return result;
         }
-        ReleaseExclusiveLock(&lock);
-        WaitForEvent(&availableEvent);
-        if (stopping) {
-            return NULL;
+    }
+    firstFrameOffset = startingOffset + position;
+    if (position >= rangeEnd) {
+        return; // no frame starts in the range, which happens when the range is smaller than a frame
+    }
+
+    while (position < available && (position < rangeEnd || validBytes - startBytes < overflowBytes)) {
+        if (! ParseZstdFrame(compressed + position, available - position, &frameSize)) {
+            WriteErrorMessage("error reading zstd file %s at offset %lld\n", getFilename(), startingOffset + position);
+            soft_exit(1);
+        }
+        bool startsInRange = position < rangeEnd;
+        decompressFrame(compressed + position, frameSize, startingOffset + position);
+        position += frameSize;
+        if (startsInRange) {
+            startBytes = validBytes;
         }
     }
 }
 
-    void
-DecompressDataReader::enqueueAvailable(Entry* entry)
+    bool
+ZstdRangeDataReader::getData(
+    char** o_buffer,
+    _int64* o_validBytes,
+    _int64* o_startBytes)
 {
-    AssertExclusiveLockHeld(&lock);
-    _ASSERT(entry->state == EntryHeld);
-    entry->state = EntryAvailable;
-    entry->next = available;
-    available = entry;
-    if (entry->next == NULL) {
-        AllowEventWaitersToProceed(&availableEvent);
+    if (offset >= startBytes) {
+        return false;
     }
+    *o_buffer = buffer + offset;
+    *o_validBytes = validBytes - offset;
+    if (o_startBytes != NULL) {
+        *o_startBytes = startBytes - offset;
+    }
+    return true;
 }
 
-class DecompressDataReaderSupplier : public DataSupplier
+    void
+ZstdRangeDataReader::advance(
+    _int64 bytes)
+{
+    offset = min(offset + max(bytes, (_int64) 0), validBytes);
+}
+
+class ZstdRangeDataSupplier : public DataSupplier
 {
 public:
-    DecompressDataReaderSupplier(DataSupplier* i_inner, int i_blockSize = BAM_BLOCK)
-        : DataSupplier(), inner(i_inner), blockSize(i_blockSize)
-    {}
+    ZstdRangeDataSupplier(DataSupplier* i_inner) : DataSupplier(), inner(i_inner) {}
 
-    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor, size_t bufferSpace);
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor, size_t bufferSpace)
+    {
+        return new ZstdRangeDataReader(inner->getDataReader(1, 0, 0.0, 0), overflowBytes);
+    }
 
 private:
     DataSupplier* inner;
-    const int blockSize;
 };
 
-    DataReader*
-DecompressDataReaderSupplier::getDataReader(
-    int bufferCount,
-    _int64 overflowBytes,
-    double extraFactor,
-    size_t bufferSpace)
+    DataSupplier*
+DataSupplier::Zstd(
+    DataSupplier* inner)
 {
-    // adjust extra factor for compression ratio
-    double expand = MAX_FACTOR * DataSupplier::ExpansionFactor;
-    double totalFactor = expand * (1.0 + extraFactor);
-    // get inner reader with no overflow since zlib can't deal with it
-    // add 2 buffers for compression thread
-    DataReader* data = inner->getDataReader(bufferCount + 2, blockSize, totalFactor, bufferSpace);
-    // compute how many extra bytes are owned by this layer
-    char* p;
-    _int64 totalExtra;
-    data->getExtra(&p, &totalExtra);
-    _int64 mine = (_int64)(totalExtra * expand / totalFactor);
-    // create new reader, telling it how many bytes it owns
-    // it will subtract overflow off the end of each batch
-    return new DecompressDataReader(data, bufferCount, totalExtra, mine, overflowBytes, blockSize);
+    return new DecompressDataReaderSupplier(inner, 0, true);
 }
-    
+
+    DataSupplier*
+DataSupplier::ZstdRange(
+    DataSupplier* inner)
+{
+    return new ZstdRangeDataSupplier(inner);
+}
+#endif // SNAP_ZSTD
+
     DataSupplier*
 DataSupplier::GzipBam(
     DataSupplier* inner)
@@ -2031,6 +4343,13 @@ DataSupplier::Gzip(
 {
     return new DecompressDataReaderSupplier(inner, 0);
 }
+
+    DataSupplier*
+DataSupplier::ParallelGzip(
+    DataSupplier* inner)
+{
+    return new DecompressDataReaderSupplier(inner, 0, false, true);
+}
     DataSupplier* 
 DataSupplier::StdioSupplier()
 {
@@ -2130,10 +4449,15 @@ private:
     _uint32         currentBatch; // current batch number starting at 1
     _int64          startBytes; // in current batch
     _int64          validBytes; // in current batch
+    _int64          droppedThrough; // offset into mapped region before which DropBehind has dropped the pages
     MemMapDataSupplier* supplier;
     FileMapper*     mapper;
     SingleWaiterObject waiter; // flow control
     ExclusiveLock   lock; // lock around flow control members (currentBatch, extraUsed, etc.)
+
+    // how far behind the read point DropBehind stays, so that reads still being aligned (which point into the mapping)
+    // don't have to be read back in
+    static const _int64 DropBehindLag = 64 * 1024 * 1024;
 };
  
 
@@ -2149,6 +4473,7 @@ MemMapDataReader::MemMapDataReader(MemMapDataSupplier* i_supplier, int i_batchCo
         currentMapOffset(0),
         currentMapSize(0),
         currentExtraIndex(0),
+        droppedThrough(0),
         supplier(i_supplier),
         mapper(NULL)
 {
@@ -2237,6 +4562,7 @@ MemMapDataReader::reinit(
     currentMapStartSize = startSize;
     currentMapSize = amountOfFileToProcess;
     offset = 0;
+    droppedThrough = 0;
     startBytes = min(batchSize, currentMapStartSize - (currentBatch - 1) * batchSize);
     validBytes = min(batchSize + overflowBytes, currentMapSize - (currentBatch - 1) * batchSize);
     currentBatch = 1;
@@ -2276,6 +4602,14 @@ MemMapDataReader::advance(
 {
     _ASSERT(bytes >= 0);
     offset = min(offset + max((_int64)0, bytes), validBytes);
+
+    if (DataSupplier::DropBehind) {
+        _int64 readThrough = (currentBatch - 1) * batchSize + offset;
+        if (readThrough >= droppedThrough + 2 * DropBehindLag) {
+            mapper->dropPages(currentMap + droppedThrough, currentMapOffset + droppedThrough, readThrough - DropBehindLag - droppedThrough);
+            droppedThrough = readThrough - DropBehindLag;
+        }
+    }
 }
 
     void
@@ -2511,25 +4845,122 @@ BatchTracker::releaseBatch(
 DataSupplier* DataSupplier::MemMap = new MemMapDataSupplier();
 
 #ifdef _MSC_VER
-DataSupplier* DataSupplier::Default = DataSupplier::WindowsOverlapped;
+DataSupplier* DataSupplier::Default = DataSupplier::RemoteFiles(DataSupplier::WindowsOverlapped);
 #else
-DataSupplier* DataSupplier::Default = DataSupplier::MemMap;
+DataSupplier* DataSupplier::Default = DataSupplier::RemoteFiles(DataSupplier::MemMap);
 #endif
 
-DataSupplier* DataSupplier::GzipDefault = DataSupplier::Gzip(DataSupplier::Default);
+DataSupplier* DataSupplier::GzipDefault = DataSupplier::ParallelGzip(DataSupplier::Default);
 
 DataSupplier* DataSupplier::GzipBamDefault = DataSupplier::GzipBam(DataSupplier::Default);
 
 DataSupplier* DataSupplier::Stdio = DataSupplier::StdioSupplier();
 
+    bool
+DataSupplier::IsBgzfFile(
+    const char* fileName)
+/*++
+
+Routine Description:
+
+    See whether a gzip file is BGZF (bgzip output, or BAM), by looking for the BC extra field in the first block's header.
+
+--*/
+{
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    const int MaxHeader = 256;
+    char buffer[MaxHeader];
+    size_t bytes = fread(buffer, 1, MaxHeader, file);
+    fclose(file);
+
+    _int64 blockSize;
+    return ParseBgzfBlockHeader(buffer, bytes, &blockSize);
+}
+
+    bool
+DataSupplier::IsZstdFile(
+    const char* fileName)
+{
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    _uint32 magic;
+    bool isZstd = fread(&magic, sizeof(magic), 1, file) == 1 && magic == 0xfd2fb528;
+    fclose(file);
+    return isZstd;
+}
+
+    bool
+DataSupplier::IsSeekableZstdFile(
+    const char* fileName)
+/*++
+
+Routine Description:
+
+    See whether a zstd file is in the seekable format, by looking for the seek table footer's magic number at the very end
+    of the file.  The footer is the frame count (4 bytes), a descriptor byte and then the magic number.
+
+--*/
+{
+#ifdef SNAP_ZSTD
+    if (! IsZstdFile(fileName)) {
+        return false;
+    }
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    const _uint32 SeekableMagic = 0x8f92eab1;
+    _uint32 magic;
+    bool isSeekable = _fseek64bit(file, -(_int64) sizeof(magic), SEEK_END) == 0 && fread(&magic, sizeof(magic), 1, file) == 1 &&
+        magic == SeekableMagic;
+    fclose(file);
+    return isSeekable;
+#else // SNAP_ZSTD
+    return false;
+#endif // SNAP_ZSTD
+}
+
+    DataSupplier*
+DataSupplier::CompressedDefaultForFile(
+    const char* fileName)
+{
+    if (IsZstdFile(fileName)) {
+        if (ZstdDefault == NULL) {
+            WriteErrorMessage("%s is zstd compressed, but this SNAP was built without zstd support (see LIBZSTD_HOME in the Makefile)\n", fileName);
+            soft_exit(1);
+        }
+        return ZstdDefault;
+    }
+    return IsBgzfFile(fileName) ? GzipBamDefault : GzipDefault;
+}
+
 DataSupplier* DataSupplier::GzipStdio = DataSupplier::Gzip(DataSupplier::Stdio);
 
 DataSupplier* DataSupplier::GzipBamStdio = DataSupplier::GzipBam(DataSupplier::Stdio);
 
+DataSupplier* DataSupplier::BgzfRangeDefault = DataSupplier::BgzfRange(DataSupplier::MemMap);
+
+#ifdef SNAP_ZSTD
+DataSupplier* DataSupplier::ZstdDefault = DataSupplier::Zstd(DataSupplier::Default);
+
+DataSupplier* DataSupplier::ZstdRangeDefault = DataSupplier::ZstdRange(DataSupplier::MemMap);
+#else // SNAP_ZSTD
+DataSupplier* DataSupplier::ZstdDefault = NULL;
+
+DataSupplier* DataSupplier::ZstdRangeDefault = NULL;
+#endif // SNAP_ZSTD
+
 
 int DataSupplier::ThreadCount = 1;
 
 double DataSupplier::ExpansionFactor = 1.0;
 
+bool DataSupplier::DropBehind = false;
+
 volatile _int64 DataReader::ReadWaitTime = 0;
 volatile _int64 DataReader::ReleaseWaitTime = 0;
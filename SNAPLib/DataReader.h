@@ -163,7 +163,13 @@ public:
     // 
     static DataSupplier* GzipBam(DataSupplier* inner);
     static DataSupplier* Gzip(DataSupplier* inner);
+    static DataSupplier* ParallelGzip(DataSupplier* inner); // inflates ordinary gzip on several threads, see ParallelInflate.h
+    static DataSupplier* BgzfRange(DataSupplier* inner); // reads a range of a BGZF file on the calling thread, see IsBgzfFile
     static DataSupplier* StdioSupplier();
+#ifdef SNAP_ZSTD
+    static DataSupplier* Zstd(DataSupplier* inner);
+    static DataSupplier* ZstdRange(DataSupplier* inner); // reads a range of a seekable zstd file on the calling thread, see IsSeekableZstdFile
+#endif // SNAP_ZSTD
 
     // memmap works on both platforms (but better on Linux)
     static DataSupplier* MemMap;
@@ -182,11 +188,48 @@ public:
     static DataSupplier* Stdio;
     static DataSupplier* GzipBamStdio;
 
+    // BGZF files are a series of independent blocks, so they can be decompressed in parallel like BAM,
+    // even when they hold something else
+    static bool IsBgzfFile(const char* fileName);
+    static DataSupplier* BgzfRangeDefault;
+
+    // zstd files (SNAP_ZSTD builds only; these are NULL otherwise) are decompressed on a thread of their own, with runs
+    // of whole frames done in parallel.  Seekable ones are made of many small frames and end with a table of them, so
+    // they can be range split like BGZF.  IsZstdFile just looks at the magic number, so it works in any build.
+    static bool IsZstdFile(const char* fileName);
+    static bool IsSeekableZstdFile(const char* fileName); // always false without SNAP_ZSTD
+    static DataSupplier* ZstdDefault;
+    static DataSupplier* ZstdRangeDefault;
+
+    // ZstdDefault for zstd (exiting if it's not built in), GzipBamDefault for BGZF, otherwise GzipDefault
+    static DataSupplier* CompressedDefaultForFile(const char* fileName);
+
+    // read with io_uring rather than memory mapping on Linux; see DataReader.cpp
+    static bool UseIoUring(unsigned queueDepth);
+
+    // reads files named hdfs:/... from HDFS and s3://... or gs://... from object storage (see ObjectStore.h), with
+    // readahead, and hands anything else to inner; it's just inner when SNAP is built with neither.  Default is
+    // wrapped in one of these, so anything that reads through it (or through the gzip suppliers over it) can take
+    // a remote file name.
+    static DataSupplier* RemoteFiles(DataSupplier* inner);
+
+    // QueryFileSize, but remote files work too
+    static _int64 InputFileSize(const char* fileName);
+
+    // how much of a remote file range splitting should hand out at a time: the blocks an HDFS file is stored in, or
+    // ObjectStoreSplitSize for an object, so that ranged reads are big enough to be efficient; 0 for local files
+    static _int64 InputSplitSize(const char* fileName);
+    static const _int64 ObjectStoreSplitSize = 64 * 1024 * 1024;
+
     // hack: must be set to communicate thread count into suppliers
     static int ThreadCount;
 
     // hack: global for additional expansion factor
     static double ExpansionFactor;
+
+    // drop input from the page cache once it's well behind where it's being read, so that streaming through a big
+    // input doesn't push out something more valuable, like a -map index.  Only the memory mapped reader does it.
+    static bool DropBehind;
 };
 
 // manages lifetime tracking for batches of reads
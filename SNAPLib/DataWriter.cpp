@@ -24,15 +24,30 @@ Environment:
 #include "exit.h"
 #include "Bam.h"
 #include "Error.h"
+#include "CommandProcessor.h"
+#include "ProgressReport.h"
+#include "StageTiming.h"
+#include "PipelineTrace.h"
+#ifndef _MSC_VER
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif // !_MSC_VER
 
 using std::min;
 using std::max;
 
+class AsyncDataWriter;
+
 class AsyncDataWriterSupplier : public DataWriterSupplier
 {
 public:
     AsyncDataWriterSupplier(const char* i_filename, DataWriter::FilterSupplier* i_filterSupplier,
-        FileEncoder* i_encoder, int i_bufferCount, size_t i_bufferSize);
+        FileEncoder* i_encoder, int i_bufferCount, size_t i_bufferSize, FileEncoderPool* i_pool, bool i_inputOrder);
+
+    virtual ~AsyncDataWriterSupplier()
+    { DestroyExclusiveLock(&orderLock); }
 
     virtual DataWriter* getWriter();
 
@@ -41,18 +56,42 @@ public:
 private:
     friend class AsyncDataWriter;
     friend class FileEncoder;
+    // reserve space in the file (and in the logical, unencoded stream) for a batch; threadsafe, without a lock, so each
+    // writer flushes on its own.  Batches aren't in the same order physically and logically if two writers reserve at
+    // once, but nothing needs them to be: the filters' translations are per batch, and a file that has to be in order
+    // (sorted output, or one ending with an EOF marker) is written by one writer at a time
     void advance(size_t physical, size_t logical, size_t* o_physical, size_t* o_logical);
 
+    // for inputOrder, write a batch that's ready to go (encoded, if there's an encoder) once its turn comes: after the
+    // batches before it of its input unit, and all those of the units before.  Until then it waits in parked, still in
+    // its writer's buffer, which the writer doesn't get back until it's been written; so the reorder buffer is bounded
+    // by the writers' own buffers, and a writer that gets that far ahead waits as it would for a slow disk.  A batch
+    // that isn't from an input unit (a header or an end of file marker) is written right away.  Threadsafe
+    void place(AsyncDataWriter* writer, int index);
+
     const char* filename;
     AsyncFile* file;
     DataWriter::FilterSupplier* filterSupplier;
     FileEncoder* encoder;
     const int bufferCount;
     const size_t bufferSize;
-    ExclusiveLock lock;
-    size_t sharedOffset;
-    size_t sharedLogical;
+    size_t bufferReserve; // kept free at the end of each buffer for the filters
+    volatile _int64 sharedOffset;
+    volatile _int64 sharedLogical;
     bool closing;
+
+    FileEncoderPool* pool;
+
+    const bool inputOrder;
+    struct ParkedBatch
+    {
+        AsyncDataWriter* writer;
+        int index;
+    };
+    ExclusiveLock orderLock;
+    VariableSizeVector<ParkedBatch> parked;
+    _int64 nextUnit; // the unit, and the batch within it, that's to be written next
+    int nextPart;
 };
 
 class AsyncDataWriter : public DataWriter
@@ -82,6 +121,8 @@ public:
     virtual bool getBatch(int relative, char** o_buffer, size_t* o_size, size_t* o_used, size_t* o_offset, size_t* o_logicalUsed = 0, size_t* o_logicalOffset = NULL);
 
     virtual bool nextBatch();
+
+    virtual void beginInputUnit(_int64 unit);
     
     virtual void close();
 
@@ -93,6 +134,13 @@ private:
     void releaseLock()
     { if (encoder != NULL) { ReleaseExclusiveLock(&lock); } }
 
+    // whether a batch may still be in use after nextBatch moves on, and has to be waited for (see Batch::encoded)
+    bool waitsForBatches()
+    { return encoder != NULL || supplier->inputOrder; }
+
+    // start writing a batch whose turn has come (see AsyncDataWriterSupplier::place), and let the writer reuse it
+    void writePlaced(int index);
+
     struct Batch
     {
         char* buffer;
@@ -101,17 +149,25 @@ private:
         size_t fileOffset;
         size_t logicalUsed;
         size_t logicalOffset;
-        EventObject encoded;
+        EventObject encoded; // set once the batch has been encoded and its write begun (and, in input order, placed)
+        _int64 unit; // for inputOrder, the input unit it's from (-1 for none), which of its batches it is, and if it's the last
+        int part;
+        bool lastPart;
     };
     Batch* batches;
     const int count;
     const size_t bufferSize;
     AsyncDataWriterSupplier* supplier;
     int current;
+    int encodeLimit; // the encoder may take batches up to (not including) this one
     FileEncoder* encoder;
     ExclusiveLock lock;
+    _int64 unit; // for inputOrder, the input unit being written, and the number of batches of it so far
+    int part;
+    bool endingUnit; // the batch nextBatch is about to write is the last of unit
 
     friend class FileEncoder;
+    friend class AsyncDataWriterSupplier;
 };
 
 FileEncoder::FileEncoder(
@@ -120,8 +176,24 @@ FileEncoder::FileEncoder(
     ParallelWorkerManager* i_manager)
     :
     encoderRunning(false),
+    offsetReserved(false),
     coworker(numThreads == 0 ? NULL
-        : new ParallelCoworker(numThreads, bindToProcessors, i_manager, FileEncoder::outputReadyCallback, this))
+        : new ParallelCoworker(numThreads, bindToProcessors, i_manager, FileEncoder::outputReadyCallback, this)),
+    pool(NULL),
+    manager(NULL),
+    worker(NULL)
+{}
+
+FileEncoder::FileEncoder(
+    FileEncoderPool* i_pool,
+    ParallelWorkerManager* i_manager)
+    :
+    encoderRunning(false),
+    offsetReserved(false),
+    coworker(NULL),
+    pool(i_pool),
+    manager(i_manager),
+    worker(NULL)
 {}
 
     void
@@ -135,6 +207,11 @@ FileEncoder::initialize(
         coworker->getManager()->initialize(this);
         coworker->start();
     }
+    if (pool != NULL) {
+        worker = manager->createWorker();
+        manager->configure(worker, 0, 1);
+        manager->initialize(this);
+    }
 }
 
     void
@@ -158,7 +235,13 @@ FileEncoder::close()
     for (int i = 0; i < pending; i++) {
         WaitForEvent(&writer->batches[(start + i) % writer->count].encoded);
     }
-    coworker->stop();
+    if (coworker != NULL) {
+        coworker->stop();
+    } else if (pool != NULL) {
+        // the last batch was let go while its pool thread still held the lock, so wait for that to be released
+        AcquireExclusiveLock(lock);
+        ReleaseExclusiveLock(lock);
+    }
 }
 
     void
@@ -175,19 +258,51 @@ FileEncoder::outputReady()
 
     encoderRunning = false;
 
+    writeBatch();
+
+    // check for more work
+    checkForInput();
+
+    ReleaseExclusiveLock(lock);
+}
+
+    void
+FileEncoder::writeBatch()
+{
     // begin writing the buffer to disk
+    TRACE_SPAN(WriteTraceEvent);
     AsyncDataWriter::Batch* write = &writer->batches[encoderBatch];
-    writer->supplier->advance(write->used, 0, &write->fileOffset, &write->logicalOffset);
+    if (writer->supplier->inputOrder) {
+        InterlockedAdd64AndReturnNewValue(&ProgressReporter::WriteBatchesPending, -1);
+        writer->supplier->place(writer, encoderBatch);
+        return;
+    }
+    if (! offsetReserved) {
+        size_t ignore;
+        writer->supplier->advance(write->used, 0, &write->fileOffset, &ignore);
+    }
+    offsetReserved = false;
     //fprintf(stderr, "outputReady write batch %d @%lld:%lld\n", encoderBatch, write->fileOffset, write->used);
     if (! write->file->beginWrite(write->buffer, write->used, write->fileOffset, NULL)) {
         WriteErrorMessage("error: file write %lld bytes at offset %lld failed\n", write->used, write->fileOffset);
         soft_exit(1);
     }
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::WriteBatchesPending, -1);
     AllowEventWaitersToProceed(&write->encoded);
+}
 
-    // check for more work
-    checkForInput();
+    void
+FileEncoder::encodeOnPool()
+{
+    // nothing else touches the batch until it's been written, so no need for the lock
+    manager->beginStep();
+    worker->step();
+    manager->finishStep();
 
+    AcquireExclusiveLock(lock);
+    encoderRunning = false;
+    writeBatch();
+    checkForInput();
     ReleaseExclusiveLock(lock);
 }
 
@@ -197,14 +312,18 @@ FileEncoder::checkForInput()
     // look for another block ready to encode
     while (true) {
         int nextBatch = (encoderBatch + 1) % writer->count;
-        if (nextBatch == writer->current) {
+        if (nextBatch == writer->encodeLimit) {
             break;
         }
         encoderBatch = nextBatch;
         AsyncDataWriter::Batch* encode = &writer->batches[encoderBatch];
         if (encode->used > 0) {
             encoderRunning = true;
-            coworker->step();
+            if (pool != NULL) {
+                pool->submit(this);
+            } else {
+                coworker->step();
+            }
             break;
         }
     }
@@ -232,13 +351,24 @@ FileEncoder::getEncodeBatch(
 
     void
 FileEncoder::getOffsets(
+    size_t encodedBytes,
     size_t* o_logicalOffset,
     size_t* o_physicalOffset)
 {
     // logical has already been set correctly in batch
-    *o_logicalOffset = writer->batches[encoderBatch].logicalOffset;
-    // physical is not yet updated, use shared
-    *o_physicalOffset = writer->supplier->sharedOffset;
+    AsyncDataWriter::Batch* batch = &writer->batches[encoderBatch];
+    *o_logicalOffset = batch->logicalOffset;
+    if ((coworker == NULL && pool == NULL) || writer->supplier->inputOrder) {
+        // encoding inline in a filter, and the writer places the batch once the filters are done; or in input order,
+        // where it's placed when its turn comes.  Either way this is only a guess, which is fine for unsorted output,
+        // since only an index needs to know where things are
+        *o_physicalOffset = writer->supplier->sharedOffset;
+        return;
+    }
+    size_t ignore;
+    writer->supplier->advance(encodedBytes, 0, &batch->fileOffset, &ignore);
+    *o_physicalOffset = batch->fileOffset;
+    offsetReserved = true;
 }
 
     void
@@ -269,7 +399,11 @@ AsyncDataWriter::AsyncDataWriter(
     supplier(i_supplier),
     count(i_count),
     bufferSize(i_bufferSize),
-    current(0)
+    current(0),
+    encodeLimit(0),
+    unit(-1),
+    part(0),
+    endingUnit(false)
 {
     _ASSERT(count >= 2);
     char* block = (char*) BigAlloc(count * bufferSize);
@@ -285,7 +419,10 @@ AsyncDataWriter::AsyncDataWriter(
         batches[i].fileOffset = 0;
         batches[i].logicalUsed = 0;
         batches[i].logicalOffset = 0;
-        if (encoder != NULL) {
+        batches[i].unit = -1;
+        batches[i].part = 0;
+        batches[i].lastPart = false;
+        if (waitsForBatches()) {
             CreateEventObject(&batches[i].encoded);
             AllowEventWaitersToProceed(&batches[i].encoded); // initialize so empty bufs are available
         }
@@ -302,8 +439,9 @@ AsyncDataWriter::getBuffer(
     char** o_buffer,
     size_t* o_size)
 {
+    size_t available = bufferSize - min(bufferSize, supplier->bufferReserve);
     *o_buffer = batches[current].buffer + batches[current].used;
-    *o_size = bufferSize - batches[current].used;
+    *o_size = available - min(available, batches[current].used);
     return true;
 }
 
@@ -358,7 +496,7 @@ AsyncDataWriter::getBatch(
         *o_logicalOffset = relative <=0 ? batch->logicalOffset : 0;
     }
     if (relative >= 0) {
-        if (encoder != NULL) {
+        if (waitsForBatches()) {
             WaitForEvent(&batch->encoded);
         }
         batch->file->waitForCompletion();
@@ -370,8 +508,14 @@ AsyncDataWriter::getBatch(
 AsyncDataWriter::nextBatch()
 {
     _int64 start = timeInNanos();
-    if (encoder != NULL) {
+    bool newBuffer = filter != NULL && (filter->filterType == CopyFilter || filter->filterType == TransformFilter);
+    bool inOrder = supplier->inputOrder;
+    if (waitsForBatches()) {
         WaitForEvent(&batches[(current + 1) % count].encoded);
+        if (newBuffer) {
+            // a copy moves on two batches, into the one after the copy
+            WaitForEvent(&batches[(current + 2) % count].encoded);
+        }
     }
     acquireLock();
     int written = current;
@@ -380,24 +524,23 @@ AsyncDataWriter::nextBatch()
     current = (current + 1) % count;
     //fprintf(stderr, "nextBatch reset %d used=0\n", current);
     batches[current].used = 0;
-    bool newBuffer = filter != NULL && (filter->filterType == CopyFilter || filter->filterType == TransformFilter);
     bool newSize = filter != NULL && (filter->filterType == TransformFilter || filter->filterType == ResizeFilter);
     if (newSize) {
         // advisory only
         write->fileOffset = supplier->sharedOffset;
         write->logicalOffset = supplier->sharedLogical;
     } else {
-        supplier->advance(encoder == NULL ? write->used : 0, write->logicalUsed, &write->fileOffset, &write->logicalOffset);
+        supplier->advance(encoder == NULL && ! inOrder ? write->used : 0, write->logicalUsed, &write->fileOffset, &write->logicalOffset);
     }
     if (filter != NULL) {
         size_t n = filter->onNextBatch(this, write->fileOffset, write->used);
 	    if (newSize) {
 	        write->used = n;
-            supplier->advance(encoder == NULL ? write->used : 0, write->logicalUsed, &write->fileOffset, &write->logicalOffset);
+            supplier->advance(encoder == NULL && ! inOrder ? write->used : 0, write->logicalUsed, &write->fileOffset, &write->logicalOffset);
 	    }
         if (newBuffer) {
             // current has used>0, written has logicalUsed>0, for compressed & uncompressed data respectively
-            batches[current].used = write->used;
+            batches[current].used = newSize || n > 0 ? write->used : 0;
             batches[current].fileOffset = write->fileOffset;
             batches[current].logicalUsed = 0;
             batches[current].logicalOffset = write->logicalOffset;
@@ -409,11 +552,26 @@ AsyncDataWriter::nextBatch()
             batches[current].logicalUsed = 0;
         }
     }
+    // (not current, which a copy moves past the batch it's copying before it's done)
+    encodeLimit = current;
+    if (inOrder) {
+        // (physical space is reserved when it's placed)
+        write->unit = unit;
+        write->part = part++;
+        write->lastPart = endingUnit;
+    }
     _int64 start2 = timeInNanos();
     releaseLock();
 
     InterlockedAdd64AndReturnNewValue(&FilterTime, start2 - start);
-    if (encoder == NULL) {
+    if (inOrder && (encoder == NULL || write->used == 0)) {
+        // (an empty batch still has its turn, to say whether it ends its unit; the encoder skips it)
+        PreventEventWaitersFromProceeding(&write->encoded);
+        supplier->place(this, written);
+        if (encoder != NULL) {
+            encoder->inputReady();
+        }
+    } else if (encoder == NULL) {
         //fprintf(stderr, "nextBatch beginWrite #%d @%lld: %lld bytes\n", write-batches, write->fileOffset, write->used);
         //_ASSERT(BgzfHeader::validate(write->buffer, write->used)); //!! remove before checkin
         if (! write->file->beginWrite(write->buffer, write->used, write->fileOffset, NULL)) {
@@ -421,24 +579,69 @@ AsyncDataWriter::nextBatch()
             soft_exit(1);
         }
     } else {
-        PreventEventWaitersFromProceeding(&write->encoded);
+        // (the encoder skips an empty batch, but it still has to be told to so that it keeps up with current)
+        if (write->used > 0 || encoder->pool == NULL) {
+            PreventEventWaitersFromProceeding(&write->encoded);
+            if (write->used > 0) {
+                InterlockedAdd64AndReturnNewValue(&ProgressReporter::WriteBatchesPending, 1);  // The encoder skips empty ones
+            }
+        }
         encoder->inputReady();
     }
     if (! batches[current].file->waitForCompletion()) {
         WriteErrorMessage("error: file write failed\n");
         soft_exit(1);
     }
-    InterlockedAdd64AndReturnNewValue(&WaitTime, timeInNanos() - start2);
+    _int64 waitNanos = EndPipelineTraceSpan(WriteTraceEvent, start2);
+    InterlockedAdd64AndReturnNewValue(&WaitTime, waitNanos);
+    ADD_STAGE_TIME(WriteWaitStage, waitNanos);
     return true;
 }
 
+    void
+AsyncDataWriter::beginInputUnit(
+    _int64 i_unit)
+{
+    if (! supplier->inputOrder) {
+        return;
+    }
+    if (unit != -1) {
+        endingUnit = true;
+        nextBatch();
+        endingUnit = false;
+    }
+    unit = i_unit;
+    part = 0;
+}
+
+    void
+AsyncDataWriter::writePlaced(
+    int index)
+{
+    Batch* write = &batches[index];
+    size_t ignore;
+    supplier->advance(write->used, 0, &write->fileOffset, &ignore);
+    if (write->used > 0 && ! write->file->beginWrite(write->buffer, write->used, write->fileOffset, NULL)) {
+        WriteErrorMessage("error: file write %lld bytes at offset %lld failed\n", write->used, write->fileOffset);
+        soft_exit(1);
+    }
+    AllowEventWaitersToProceed(&write->encoded);
+}
+
     void
 AsyncDataWriter::close()
 {
+    endingUnit = true;
     nextBatch(); // ensure last buffer gets written
     if (encoder != NULL) {
         encoder->close();
+    }
+    if (waitsForBatches()) {
         for (int i = 0; i < count; i++) {
+            if (supplier->inputOrder) {
+                // batches the encoder is done with (or that never had one) may still be waiting their turn
+                WaitForEvent(&batches[i].encoded);
+            }
             DestroyEventObject(&batches[i].encoded);
         }
     }
@@ -452,23 +655,30 @@ AsyncDataWriterSupplier::AsyncDataWriterSupplier(
     DataWriter::FilterSupplier* i_filterSupplier,
     FileEncoder* i_encoder,
     int i_bufferCount,
-    size_t i_bufferSize)
+    size_t i_bufferSize,
+    FileEncoderPool* i_pool,
+    bool i_inputOrder)
     :
     filename(i_filename),
     filterSupplier(i_filterSupplier),
     encoder(i_encoder),
     bufferCount(i_bufferCount),
     bufferSize(i_bufferSize),
+    bufferReserve(i_filterSupplier != NULL ? i_filterSupplier->getBufferReserve(i_bufferSize) : 0),
     sharedOffset(0),
     sharedLogical(0),
-    closing(false)
+    closing(false),
+    pool(i_pool),
+    inputOrder(i_inputOrder),
+    nextUnit(0),
+    nextPart(0)
 {
+    InitializeExclusiveLock(&orderLock);
     file = AsyncFile::open(filename, true);
     if (file == NULL) {
         WriteErrorMessage("failed to open %s for write\n", filename);
         soft_exit(1);
     }
-    InitializeExclusiveLock(&lock);
 }
 
     DataWriter*
@@ -476,13 +686,18 @@ AsyncDataWriterSupplier::getWriter()
 {
     return new AsyncDataWriter(file, this, bufferCount, bufferSize,
         filterSupplier && ! closing ? filterSupplier->getFilter() : NULL,
-        closing ? NULL : encoder);
+        closing ? NULL : pool != NULL ? pool->getEncoder() : encoder);
 }
 
     void
 AsyncDataWriterSupplier::close()
 {
     closing = true;
+    if (pool != NULL) {
+        // all the writers have closed, so everything has been encoded and written
+        delete pool;
+        pool = NULL;
+    }
     if (filterSupplier != NULL) {
         filterSupplier->onClosing(this);
     }
@@ -490,7 +705,6 @@ AsyncDataWriterSupplier::close()
     if (filterSupplier != NULL) {
         filterSupplier->onClosed(this);
     }
-    DestroyExclusiveLock(&lock);
 }
     void
 AsyncDataWriterSupplier::advance(
@@ -499,13 +713,43 @@ AsyncDataWriterSupplier::advance(
     size_t* o_physical,
     size_t* o_logical)
 {
-    AcquireExclusiveLock(&lock);
-    *o_physical = sharedOffset;
-    sharedOffset += physical;
-    *o_logical = sharedLogical;
-    sharedLogical += logical;
-    //fprintf(stderr, "advance %lld + %lld = %lld, logical %lld + %lld = %lld\n", *o_physical, physical, sharedOffset, *o_logical, logical, sharedLogical);
-    ReleaseExclusiveLock(&lock);
+    *o_physical = InterlockedAdd64AndReturnNewValue(&sharedOffset, physical) - physical;
+    *o_logical = InterlockedAdd64AndReturnNewValue(&sharedLogical, logical) - logical;
+}
+
+    void
+AsyncDataWriterSupplier::place(
+    AsyncDataWriter* writer,
+    int index)
+{
+    AcquireExclusiveLock(&orderLock);
+    if (writer->batches[index].unit == -1) {
+        writer->writePlaced(index);
+        ReleaseExclusiveLock(&orderLock);
+        return;
+    }
+    ParkedBatch batch = {writer, index};
+    parked.push_back(batch);
+    // there are only a few writers' worth, so look through them all for the next one until it isn't there
+    for (bool found = true; found; ) {
+        found = false;
+        for (int i = 0; i < parked.size(); i++) {
+            AsyncDataWriter::Batch* next = &parked[i].writer->batches[parked[i].index];
+            if (next->unit == nextUnit && next->part == nextPart) {
+                if (next->lastPart) {
+                    nextUnit++;
+                    nextPart = 0;
+                } else {
+                    nextPart++;
+                }
+                parked[i].writer->writePlaced(parked[i].index);
+                parked.erase(i);
+                found = true;
+                break;
+            }
+        }
+    }
+    ReleaseExclusiveLock(&orderLock);
 }
 
     DataWriterSupplier*
@@ -514,9 +758,81 @@ DataWriterSupplier::create(
     size_t bufferSize,
     DataWriter::FilterSupplier* filterSupplier,
     FileEncoder* encoder,
-    int count)
+    int count,
+    FileEncoderPool* pool,
+    bool inputOrder)
+{
+    return new AsyncDataWriterSupplier(filename, filterSupplier, encoder, count, bufferSize, pool, inputOrder);
+}
+
+FileEncoderPool::FileEncoderPool(
+    int i_numThreads)
+    :
+    numThreads(max(1, i_numThreads)),
+    stopping(false),
+    threadsDone(max(1, i_numThreads))
+{
+    InitializeExclusiveLock(&lock);
+    CreateEventObject(&workReady);
+    for (int i = 0; i < numThreads; i++) {
+        if (! StartNewThread(FileEncoderPool::threadMain, this)) {
+            WriteErrorMessage("Unable to start encoder thread\n");
+            soft_exit(1);
+        }
+    }
+}
+
+FileEncoderPool::~FileEncoderPool()
+{
+    AcquireExclusiveLock(&lock);
+    stopping = true;
+    AllowEventWaitersToProceed(&workReady);
+    ReleaseExclusiveLock(&lock);
+    threadsDone.wait();
+    DestroyEventObject(&workReady);
+    DestroyExclusiveLock(&lock);
+}
+
+    void
+FileEncoderPool::submit(
+    FileEncoder* encoder)
+{
+    AcquireExclusiveLock(&lock);
+    queue.push_back(encoder);
+    AllowEventWaitersToProceed(&workReady);
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+FileEncoderPool::threadMain(
+    void* context)
 {
-    return new AsyncDataWriterSupplier(filename, filterSupplier, encoder, count, bufferSize);
+    BindThreadToHelperProcessors();
+    ((FileEncoderPool*) context)->run();
+}
+
+    void
+FileEncoderPool::run()
+{
+    while (true) {
+        AcquireExclusiveLock(&lock);
+        while (queue.size() == 0 && ! stopping) {
+            PreventEventWaitersFromProceeding(&workReady);
+            ReleaseExclusiveLock(&lock);
+            WaitForEvent(&workReady);
+            AcquireExclusiveLock(&lock);
+        }
+        if (queue.size() == 0) {
+            ReleaseExclusiveLock(&lock);
+            break;
+        }
+        FileEncoder* encoder = queue[0];
+        queue.erase(0);
+        ReleaseExclusiveLock(&lock);
+
+        encoder->encodeOnPool();
+    }
+    threadsDone.signal();
 }
 
 class ComposeFilter : public DataWriter::Filter
@@ -564,6 +880,9 @@ public:
     virtual DataWriter::Filter* getFilter()
     { return new ComposeFilter(a->getFilter(), b->getFilter()); }
 
+    virtual size_t getBufferReserve(size_t bufferSize)
+    { return a->getBufferReserve(bufferSize) + b->getBufferReserve(bufferSize); }
+
     virtual void onClosing(DataWriterSupplier* supplier)
     {
         a->onClosing(supplier);
@@ -592,13 +911,15 @@ volatile _int64 DataWriter::WaitTime = 0;
 volatile _int64 DataWriter::FilterTime = 0;
 
 
-StdoutAsyncFile::StdoutAsyncFile()
+StdoutAsyncFile::StdoutAsyncFile() : client(CommandPipe), clientFailed(false), maxWriteSize(1024 * 1024)
 {
-    if (anyCreated) {
-        WriteErrorMessage("You can only ever write to stdout once per SNAP run (even if you're doing multiple runs with the comma syntax\n");
-        soft_exit(1);
+    if (NULL == client) {
+        if (anyCreated) {
+            WriteErrorMessage("You can only ever write to stdout once per SNAP run (even if you're doing multiple runs with the comma syntax\n");
+            soft_exit(1);
+        }
+        anyCreated = true;
     }
-    anyCreated = true;
 
 #ifdef _MSC_VER
     int result = _setmode( _fileno( stdout ), _O_BINARY );  // puts stdout in to non-translated mode, so if we're writing compressed data windows' CRLF processing doesn't destroy it.
@@ -788,42 +1109,66 @@ StdoutAsyncFile::waitForCompletion(size_t offset)
 }
 
     void
-StdoutAsyncFile::runConsumer()
+StdoutAsyncFile::EnlargePipe()
 {
-    size_t maxWriteSize = 1024 * 1024;
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+    int fd = fileno(stdout);
+    struct stat statBuffer;
+    if (0 != fstat(fd, &statBuffer) || !S_ISFIFO(statBuffer.st_mode)) {
+        return;
+    }
 
-    AcquireExclusiveLock(&lock);
-    for (;;) {
-        if (isQueueEmpty() && closing) {
-            ReleaseExclusiveLock(&lock);
-            //
-            // Done.  The caller is responsible for signalling the consumerThreadDone object.
-            //
-            return;
+    //
+    // An unprivileged process can go up to pipe-max-size (usually 1MB).  It's only a hint, so failing doesn't matter.
+    //
+    int pipeSize = 1024 * 1024;
+    FILE *maxSizeFile = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (NULL != maxSizeFile) {
+        if (1 != fscanf(maxSizeFile, "%d", &pipeSize)) {
+            pipeSize = 1024 * 1024;
         }
+        fclose(maxSizeFile);
+    }
 
-        if (isQueueEmpty() || writeElementQueue->next->offset != highestOffsetCompleted) {
+    if (fcntl(fd, F_GETPIPE_SZ) < pipeSize) {
+        fcntl(fd, F_SETPIPE_SZ, pipeSize);
+    }
+#endif // __linux__ && F_SETPIPE_SZ
+}
+
+    void
+StdoutAsyncFile::writeElements(WriteElement **elements, int nElements)
+/*++
+
+Routine Description:
+
+    Write some elements that are next to each other in the output.  On Linux and the like they go out with writev, as
+    many at once as the pipe (or file) will take, so that when the writers get ahead of whatever's reading stdout, the
+    backlog goes in a few big system calls rather than one (or more) for each buffer.  Elsewhere, and for a daemon
+    client, it's one element at a time.
+
+--*/
+{
+    if (NULL != client) {
+        for (int i = 0; i < nElements; i++) {
             //
-            // Wait for work.
+            // A client that's gone away just doesn't get the rest of its output; the daemon carries on.
             //
-            ReleaseExclusiveLock(&lock);
-            WaitForEvent(&unexaminedElementsOnQueue);
-            AcquireExclusiveLock(&lock);
-            PreventEventWaitersFromProceeding(&unexaminedElementsOnQueue);
-            continue;
+            if (!clientFailed && !WriteOutputToDaemonClient(client, (char *)elements[i]->buffer, elements[i]->length)) {
+                fprintf(stderr, "StdoutAsyncFile::runConsumer(): unable to send output to the daemon client, dropping the rest of it\n");
+                clientFailed = true;
+            }
         }
+        return;
+    }
 
-        //
-        // We have the next write queued.  Write it.  Use a loop in case fwrite doesn't take the whole thing at once.
-        //
-        WriteElement *element = writeElementQueue->next;
-        //fprintf(stderr,"StdoutAsyncFile::runConsumer(): writing buffer at 0x%llx, size %lld\n", element->buffer, element->length);
-        ReleaseExclusiveLock(&lock);
-        size_t bytesLeftToWrite = element->length;
+#ifdef _MSC_VER
+    for (int i = 0; i < nElements; i++) {
+        size_t bytesLeftToWrite = elements[i]->length;
         size_t totalBytesWritten = 0;
         while (bytesLeftToWrite > 0) {
             size_t bytesToWrite = __min(bytesLeftToWrite, maxWriteSize);
-            size_t bytesWritten = fwrite((char *)element->buffer + totalBytesWritten, 1, bytesToWrite, stdout);
+            size_t bytesWritten = fwrite((char *)elements[i]->buffer + totalBytesWritten, 1, bytesToWrite, stdout);
             _ASSERT(bytesWritten <= bytesToWrite);
             if (0 == bytesWritten) {
                 if (ENOMEM == errno && maxWriteSize > 1024) {
@@ -840,18 +1185,108 @@ StdoutAsyncFile::runConsumer()
             bytesLeftToWrite -= bytesWritten;
             totalBytesWritten += bytesWritten;
         }
+    }
+#else // _MSC_VER
+    struct iovec iov[MaxElementsPerWrite];
+    _ASSERT(nElements <= MaxElementsPerWrite);
+    for (int i = 0; i < nElements; i++) {
+        iov[i].iov_base = elements[i]->buffer;
+        iov[i].iov_len = elements[i]->length;
+    }
+
+    struct iovec *nextIov = iov;
+    int nIovsLeft = nElements;
+    while (nIovsLeft > 0) {
+        ssize_t bytesWritten = writev(fileno(stdout), nextIov, nIovsLeft);
+        if (bytesWritten < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            WriteErrorMessage("StdoutAsyncFile::runConsumer(): write failed %d\n", errno);
+            soft_exit(1);
+        }
+
+        //
+        // Skip what it took, which may end in the middle of an element.
+        //
+        while (nIovsLeft > 0 && (size_t)bytesWritten >= nextIov->iov_len) {
+            bytesWritten -= nextIov->iov_len;
+            nextIov++;
+            nIovsLeft--;
+        }
+        if (nIovsLeft > 0) {
+            nextIov->iov_base = (char *)nextIov->iov_base + bytesWritten;
+            nextIov->iov_len -= bytesWritten;
+        }
+    }
+#endif // _MSC_VER
+}
+
+    void
+StdoutAsyncFile::runConsumer()
+{
+    if (NULL == client) {
+        //
+        // We write around stdio, so anything that's been printed to stdout has to go first.
+        //
+        fflush(stdout);
+        EnlargePipe();
+    }
+
+    WriteElement *elements[MaxElementsPerWrite];
+
+    AcquireExclusiveLock(&lock);
+    for (;;) {
+        if (isQueueEmpty() && closing) {
+            ReleaseExclusiveLock(&lock);
+            //
+            // Done.  The caller is responsible for signalling the consumerThreadDone object.
+            //
+            return;
+        }
+
+        if (isQueueEmpty() || writeElementQueue->next->offset != highestOffsetCompleted) {
+            //
+            // Wait for work.
+            //
+            ReleaseExclusiveLock(&lock);
+            WaitForEvent(&unexaminedElementsOnQueue);
+            AcquireExclusiveLock(&lock);
+            PreventEventWaitersFromProceeding(&unexaminedElementsOnQueue);
+            continue;
+        }
+
+        //
+        // We have the next write queued.  Take it and whatever follows it without a gap.  Nothing can get put between
+        // them (they're in offset order, and there's no room), so they stay in order on the queue while we write
+        // without the lock.
+        //
+        int nElements = 0;
+        size_t nextOffset = highestOffsetCompleted;
+        for (WriteElement *element = writeElementQueue->next; element != writeElementQueue && element->offset == nextOffset && nElements < MaxElementsPerWrite;
+                element = element->next) {
+            elements[nElements++] = element;
+            nextOffset = element->offset + element->length;
+        }
+        ReleaseExclusiveLock(&lock);
 
-        if (NULL != element->o_bytesWritten) {
-            *element->o_bytesWritten = totalBytesWritten;
+        writeElements(elements, nElements);
+
+        for (int i = 0; i < nElements; i++) {
+            if (NULL != elements[i]->o_bytesWritten) {
+                *elements[i]->o_bytesWritten = elements[i]->length;
+            }
         }
         
         AcquireExclusiveLock(&lock);
-        _ASSERT(writeElementQueue->next == element);
-        element->dequeue();
-        highestOffsetCompleted = element->offset + element->length;
+        for (int i = 0; i < nElements; i++) {
+            _ASSERT(writeElementQueue->next == elements[i]);
+            elements[i]->dequeue();
+            delete elements[i];
+        }
+        highestOffsetCompleted = nextOffset;
 
         AllowEventWaitersToProceed(&elementsCompleted);
-        delete element;
     }
     /*NOTREACHED*/
 }
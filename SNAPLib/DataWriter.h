@@ -26,6 +26,8 @@ Revision History:
 #include "Read.h"
 #include "ParallelTask.h"
 #include "Genome.h"
+#include "VariableSizeVector.h"
+#include "Util.h"
 
 class DataWriterSupplier;
 
@@ -63,6 +65,8 @@ public:
         // e.g. so use getBatch(-1, ...) to get the one that was just completed
         // TransformFilters return #byte of transformed data in current buffer, so we need to advance again
         // TransformFilters should call getBatch(0) to ensure current buffer has been written before they write into it
+        // CopyFilters return the same size, or 0 if they've kept the data themselves and there's nothing to write
+        // (its space in the file is still taken, so offsets don't change)
         virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes) = 0;
     };
     
@@ -80,6 +84,9 @@ public:
 
         virtual Filter* getFilter() = 0;
 
+        // bytes to leave free at the end of each buffer, for a ResizeFilter whose output can be bigger than its input
+        virtual size_t getBufferReserve(size_t bufferSize) { return 0; }
+
         // called when entire file is done; onClosing before file is closed, onClosed after
         virtual void onClosing(DataWriterSupplier* supplier) = 0;
         virtual void onClosed(DataWriterSupplier* supplier) = 0;
@@ -107,6 +114,10 @@ public:
     // advance to next buffer
     virtual bool nextBatch() = 0;
 
+    // for a file written in input order (see DataWriterSupplier::create): what's written from here on is from this input
+    // unit, until the next call or close; the unit before it is done
+    virtual void beginInputUnit(_int64 unit) {}
+
     // this thread is complete
     virtual void close() = 0;
 
@@ -121,7 +132,30 @@ protected:
 class FileFormat;
 class Genome;
 class GzipWriterFilterSupplier;
+class ZstdWriterFilterSupplier;
+class CramWriterFilterSupplier;
 class FileEncoder;
+class FileEncoderPool;
+
+// for merging a sorted file on several threads: each thread merges a range of the genome into a file of its own,
+// and they're appended to the first one's at the end (unless they're shards, which stay separate files), so each needs
+// its own filters
+class SortedPartSupplier
+{
+public:
+    virtual ~SortedPartSupplier() {}
+
+    // filters & encoder (either may be NULL) for writing one part; shardFileName is the part's own output if it's a shard,
+    // or NULL if it's going to be appended
+    virtual void getPart(int part, int nParts, const char* shardFileName, DataWriter::FilterSupplier** o_filters,
+        FileEncoder** o_encoder) = 0;
+
+    // bytes written at the end of each part to drop when another is appended after it (e.g. an end of file marker)
+    virtual size_t getTrailerSize() = 0;
+
+    // all the parts have been closed and appended, starting at these file offsets (NULL if they were shards)
+    virtual void onAppended(int nParts, const size_t* partOffsets) = 0;
+};
 
 // creates writers for multiple threads
 class DataWriterSupplier
@@ -139,8 +173,10 @@ public:
         size_t bufferSize,
         DataWriter::FilterSupplier* filterSupplier = NULL,
         FileEncoder* encoder = NULL,
-        int count = 4);
-    
+        int count = 4,
+        FileEncoderPool* pool = NULL,           // encoders for each writer come from the pool, rather than encoder
+        bool inputOrder = false);               // write the writers' input units in order (see AsyncDataWriterSupplier::place)
+
     static DataWriterSupplier* sorted(
         const FileFormat* format,
         const Genome* genome,
@@ -150,14 +186,68 @@ public:
         const char* sortedFileName,
         DataWriter::FilterSupplier* sortedFilterSupplier,
         size_t maxBufferSize,
-        FileEncoder* encoder = NULL);
+        FileEncoder* encoder = NULL,
+        size_t inMemoryLimit = 0,               // bytes of sorted batches to keep in memory rather than the temp file
+        const char* tempDirectories = NULL,     // comma separated, to spread temp files over rather than tempFileName
+        int mergeThreads = 1,                   // to merge ranges of the genome in parallel, each with filters from parts
+        SortedPartSupplier* parts = NULL,       // (NULL if there are no filters or encoder)
+        int shards = 0,                         // > 1 to write this many files, each a range of the genome (see shardFileName)
+        bool evenShards = false,                // equal ranges, rather than ones with about as many reads
+        bool zstdTemp = false,                  // compress the temp files with zstd (SNAP_ZSTD builds only)
+        bool byName = false);                   // sort by read name (grouping each read's records) rather than location
+
+    // merge files that are each sorted already into sortedFileName, with the first one's header; each is read through
+    // inputSupplier and starts with headerSizes[i] bytes (after inflating) that are skipped.  false if it failed
+    static bool mergeSorted(
+        const FileFormat* format,
+        const Genome* genome,
+        int nFiles,
+        const char** fileNames,
+        const size_t* headerSizes,
+        DataSupplier* inputSupplier,
+        const char* sortedFileName,
+        DataWriter::FilterSupplier* sortedFilterSupplier,
+        size_t bufferSize,
+        FileEncoder* encoder,
+        _int64* o_total);
+
+    // the name of one shard of a sorted file, with the shard number before the extension: out.bam -> out.shard03.bam
+    static char* shardFileName(const char* sortedFileName, int shard, int nShards);
+
+    // defaults follow BAM output spec; compressionLevel is zlib's, 0 to 9 (see GzipBlockCompressor::DefaultLevel)
+    static GzipWriterFilterSupplier* gzip(bool bamFormat, size_t chunkSize, int numThreads, bool bindToProcessors, bool multiThreaded,
+        int compressionLevel);
+
+    // zstd frames of chunkSize bytes each, at zstd's compressionLevel (0 for its default); NULL without SNAP_ZSTD
+    static ZstdWriterFilterSupplier* zstd(bool multiThreaded, int compressionLevel, size_t chunkSize = 1024 * 1024);
+
+    // for each part of a sorted zstd file that's merged in parallel
+    static SortedPartSupplier* zstdSortedParts(int numThreads, int compressionLevel);
 
-    // defaults follow BAM output spec
-    static GzipWriterFilterSupplier* gzip(bool bamFormat, size_t chunkSize, int numThreads, bool bindToProcessors, bool multiThreaded);
+    // metricsFileName gets Picard style duplication metrics, if it's not NULL
+    static DataWriter::FilterSupplier* markDuplicates(const Genome* genome, const char* metricsFileName = NULL);
 
-    static DataWriter::FilterSupplier* markDuplicates(const Genome* genome);
+    // coverage, flag counts, MAPQs and insert sizes of BAM records, written to alignmentMetricsFileName, with the mean
+    // depth in bins of coverageBinSize bases to alignmentMetricsFileName.bedgraph if that's not 0
+    static DataWriter::FilterSupplier* bamMetrics(const Genome* genome, const char* alignmentMetricsFileName, unsigned coverageBinSize);
 
-    static DataWriter::FilterSupplier* bamIndex(const char* indexFileName, const Genome* genome, GzipWriterFilterSupplier* gzipSupplier);
+    // csi writes a CSI index, needed for contigs longer than 512Mb, instead of a BAI
+    static DataWriter::FilterSupplier* bamIndex(const char* indexFileName, const Genome* genome, GzipWriterFilterSupplier* gzipSupplier,
+        bool csi = false);
+
+    // read name index (see ReadNameIndex.h) of sorted BAM output, as its BAI is built
+    static DataWriter::FilterSupplier* bamNameIndex(const char* indexFileName, GzipWriterFilterSupplier* gzipSupplier);
+
+    // CRAM encoded against genome; multiThreaded if it's done by a FileEncoder (see FileEncoder::cram), sorted to break slices
+    // at each new contig, and indexFileName is NULL for no .crai
+    static CramWriterFilterSupplier* cram(const Genome* genome, const char* fileName, const char* indexFileName, bool multiThreaded,
+        bool sorted);
+
+    // filters for each part of a sorted BAM file that's merged in parallel; indexFileName is NULL for no index, and
+    // alignmentMetricsFileName NULL for no bamMetrics
+    static SortedPartSupplier* bamSortedParts(const Genome* genome, const char* indexFileName, bool csiIndex, bool markDuplicates,
+        const char* metricsFileName, int numThreads, int compressionLevel, const char* alignmentMetricsFileName = NULL,
+        unsigned coverageBinSize = 0, const char* nameIndexFileName = NULL);
 };
 
 class AsyncDataWriter;
@@ -167,15 +257,25 @@ class FileEncoder
 public:
     FileEncoder(int numThreads, bool bindToProcessors, ParallelWorkerManager* i_supplier);
 
+    // encodes each batch as one job on the pool's threads, see FileEncoderPool
+    FileEncoder(FileEncoderPool* i_pool, ParallelWorkerManager* i_manager);
+
     ~FileEncoder()
     {
         if (coworker != NULL) {
             _ASSERT(! encoderRunning); coworker->stop(); delete coworker;
         }
+        if (pool != NULL) {
+            _ASSERT(! encoderRunning); delete worker; delete manager;
+        }
     }
 
     static FileEncoder* gzip(GzipWriterFilterSupplier* filterSupplier, int numThreads, bool bindToProcessor, size_t chunkSize = 65536, bool bam = true);
 
+    static FileEncoder* zstd(ZstdWriterFilterSupplier* filterSupplier, int numThreads, bool bindToProcessor);
+
+    static FileEncoder* cram(CramWriterFilterSupplier* filterSupplier, int numThreads, bool bindToProcessor);
+
     // post-construction initialization
     void initialize(AsyncDataWriter* i_writer);
 
@@ -190,7 +290,10 @@ public:
     
     void getEncodeBatch(char** o_batch, size_t* o_batchSize, size_t* o_batchUsed);
 
-    void getOffsets(size_t* o_logicalOffset, size_t* o_physicalOffset);
+    // reserves encodedBytes in the file for the batch (so it can be written as soon as it's encoded, whatever other
+    // writers are doing) and returns where it goes, with the logical offset it was given when it was filled.  Inline
+    // in a filter, where the writer places the batch itself afterwards, it's just where the file has got to
+    void getOffsets(size_t encodedBytes, size_t* o_logicalOffset, size_t* o_physicalOffset);
 
     void setEncodedBatchSize(size_t newSize);
 
@@ -204,15 +307,77 @@ private:
     // scans writer and kicks off encoder if there is something ready; must hold lock
     void checkForInput();
 
+    // begin writing the encoded batch to the file, and let the writer reuse it; must hold lock
+    void writeBatch();
+
+    // called on a pool thread to encode the current batch and write it
+    void encodeOnPool();
+
     AsyncDataWriter* writer;
     ParallelCoworker* coworker;
     ExclusiveLock* lock;
     bool encoderRunning;
     int encoderBatch;
+    bool offsetReserved; // getOffsets has placed the batch being encoded in the file
+
+    // if encoding on a pool, instead of coworker
+    FileEncoderPool* pool;
+    ParallelWorkerManager* manager;
+    ParallelWorker* worker;
 
     friend class AsyncDataWriter;
+    friend class AsyncDataWriterSupplier;
+    friend class FileEncoderPool;
 };
 
+//
+// Threads shared by the writers of a file to encode their batches, so each aligner thread just hands its batch
+// over and keeps going rather than compressing it itself.  Batches are encoded in whatever order the threads get
+// to them, and each is written as soon as it's encoded, at a file offset reserved without a lock; one writer's batches
+// still go in order, since its encoder does them one at a time, but different writers' batches are interleaved however
+// they finish (which is fine for unsorted output, the only kind that uses a pool).
+//
+class FileEncoderPool
+{
+public:
+    FileEncoderPool(int i_numThreads);
+
+    // waits for the threads to exit; all the encoders must be closed
+    virtual ~FileEncoderPool();
+
+    // a new encoder for one writer
+    FileEncoder* getEncoder()
+    { return new FileEncoder(this, createManager()); }
+
+    static FileEncoderPool* gzip(GzipWriterFilterSupplier* filterSupplier, int numThreads);
+
+    static FileEncoderPool* zstd(ZstdWriterFilterSupplier* filterSupplier, int numThreads);
+
+protected:
+    // state for encoding one writer's batches, one at a time
+    virtual ParallelWorkerManager* createManager() = 0;
+
+private:
+    friend class FileEncoder;
+
+    // queue an encoder that has a batch ready to encode; threadsafe
+    void submit(FileEncoder* encoder);
+
+    static void threadMain(void* context);
+
+    void run();
+
+    const int numThreads;
+    VariableSizeVector<FileEncoder*> queue; // in the order they were submitted
+    ExclusiveLock lock;
+    EventObject workReady; // set when there's something on the queue, or stopping
+    volatile bool stopping;
+    NWaiter threadsDone;
+};
+
+//
+// Writes stdout, or for a daemon command, the output that goes back over the connection to its client.
+//
 class StdoutAsyncFile : public AsyncFile
 {
 public:
@@ -264,8 +429,22 @@ private:
 
     bool                closing;
 
+    NamedPipe          *client;
+    bool                clientFailed;
+
     static void ConsumerThreadMain(void *param);
     void runConsumer();
 
+    static const int MaxElementsPerWrite = 64;
+
+    void writeElements(WriteElement **elements, int nElements);
+
+    //
+    // Grow stdout's pipe buffer, if it's a pipe, so that a reader that falls behind for a moment doesn't stall us.
+    //
+    static void EnlargePipe();
+
+    size_t              maxWriteSize;   // For fwrite, which sometimes fails with ENOMEM if it's asked to write too much at once
+
     static bool anyCreated;              // Because there's no way to multiplex stdout, you only get one per run of SNAP
 };
@@ -0,0 +1,513 @@
+/*++
+
+Module Name:
+
+    DistributedAligner.cpp
+
+Abstract:
+
+    The distribute and merge commands, for aligning over several machines.  See DistributedAligner.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "DistributedAligner.h"
+#include "AlignerOptions.h"
+#include "Bam.h"
+#include "CommandProcessor.h"
+#include "DataWriter.h"
+#include "Error.h"
+#include "exit.h"
+#include "Genome.h"
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+static void mergeUsage()
+{
+    WriteErrorMessage(
+        "Usage: snap-aligner merge <index-dir> -o output.bam [<options>] input.bam ...\n"
+        "  Merges BAM files that SNAP sorted (-so) against the index into one sorted BAM file, with duplicates marked and\n"
+        "  an index, as sorted output gets.  The header is the first input's.  The options are the align options about\n"
+        "  sorted BAM output: -t, -b, -cl, -csi, -S (i and d), -dmm and -wbs.\n");
+}
+
+    void
+RunMerge(
+    int argc,
+    const char **argv)
+/*++
+
+Routine Description:
+
+    The merge command.  Since it's also run on daemons (by distribute), it reports failures and returns rather than
+    exiting, and it doesn't leave a partial output behind.
+
+--*/
+{
+    if (argc < 4) {
+        mergeUsage();
+        return;
+    }
+
+    AlignerOptions options("snap-aligner merge");
+    vector<const char *> inputs;
+    for (int n = 3; n < argc; n++) {
+        if ('-' == argv[n][0] && '\0' != argv[n][1]) {
+            bool done;
+            if (!options.parse(argv, argc, n, &done)) {
+                WriteErrorMessage("Invalid merge option: %s\n\n", argv[n]);
+                mergeUsage();
+                return;
+            }
+        } else {
+            inputs.push_back(argv[n]);
+        }
+    }
+
+    if (NULL == options.outputFile.fileName || BAMFile != options.outputFile.fileType || options.outputFile.isStdio || 0 == inputs.size()) {
+        WriteErrorMessage("merge needs -o with a BAM file, and at least one input\n\n");
+        mergeUsage();
+        return;
+    }
+
+    //
+    // Only the contig layout matters, so a one base slice of the genome will do.
+    //
+    size_t nameSize = strlen(argv[2]) + 20;
+    char *genomeFileName = new char[nameSize];
+    snprintf(genomeFileName, nameSize, "%s%cGenome", argv[2], PATH_SEP);
+    const Genome *genome = Genome::loadFromFile(genomeFileName, 0, 0, 1);
+    delete[] genomeFileName;
+    if (NULL == genome) {
+        WriteErrorMessage("Unable to load the genome of index %s\n", argv[2]);
+        return;
+    }
+
+    if (!MergeSortedBAMFiles(&options, genome, (int)inputs.size(), &inputs[0])) {
+        WriteErrorMessage("Merging into %s failed\n", options.outputFile.fileName);
+        DeleteSingleFile(options.outputFile.fileName);
+    }
+    delete genome;
+}
+
+static void distributeUsage()
+{
+    WriteErrorMessage(
+        "Usage: snap-aligner distribute -w workers [<options>] {single|paired} <align arguments, with -o output.bam>\n"
+        "  Splits an alignment over SNAP daemons (snap-aligner daemon -s [host:]port) on machines that see the inputs,\n"
+        "  the index and the output directory at the same paths as here, and merges what they write into sorted BAM\n"
+        "  output with duplicates marked and an index.  The inputs need to be ones -inputPart can split.\n"
+        "  -w        The workers, as a comma separated list of their sockets.  List one more than once to have it run\n"
+        "            that many commands at a time (its -j needs to be at least that).\n"
+        "  -pieces   Split the input into this many pieces (default 4 per worker), which the workers take in turn.\n"
+        "  -shards   Write the output as this many files by genome range, out.shard0.bam and so on (default one per\n"
+        "            worker), which the workers merge in parallel.  -shards 1 writes out.bam.\n"
+        "  -attempts Run each command up to this many times before giving up on it (default 3).\n");
+    soft_exit_no_print(1);
+}
+
+struct DistributedJob {
+    vector<string>  args;       // With the program name in front, like a command line
+    vector<string>  outputs;    // What it writes, which says that it worked
+    string          description;
+    int             attempts;
+};
+
+//
+// The jobs of one step (aligning the pieces or merging them), which the workers take from pending until it's empty
+// and nothing that's running might come back to it.
+//
+struct DistributedPhase {
+    vector<DistributedJob>  jobs;
+    vector<int>             pending;
+    int                     nRunning;
+    int                     nFailed;
+    int                     maxAttempts;
+    ExclusiveLock           lock;
+    EventObject             jobFinished;
+    volatile int            nRunningWorkers;
+    SingleWaiterObject      allWorkersDone;
+};
+
+struct DistributedWorker {
+    string              address;
+    bool                alive;
+    DistributedPhase   *phase;
+};
+
+static string PieceFileName(const char *outputFileName, int piece, int nPieces)
+{
+    int digits = 1;
+    for (int n = nPieces - 1; n >= 10; n /= 10) {
+        digits++;
+    }
+    const char *baseName = strrchr(outputFileName, PATH_SEP);
+    const char *extension = strrchr(NULL == baseName ? outputFileName : baseName, '.');
+    size_t prefixLength = NULL == extension ? strlen(outputFileName) : extension - outputFileName;
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".part%0*d", digits, piece);
+    return string(outputFileName, prefixLength) + suffix + (NULL == extension ? "" : extension);
+}
+
+static string ShardFileName(const string &fileName, int shard, int nShards)
+{
+    char *name = DataWriterSupplier::shardFileName(fileName.c_str(), shard, nShards);
+    string result = name;
+    delete[] name;
+    return result;
+}
+
+static bool FileExists(const string &fileName)
+{
+    FILE *file = fopen(fileName.c_str(), "rb");
+    if (NULL == file) {
+        return false;
+    }
+    fclose(file);
+    return true;
+}
+
+static bool TakeJob(DistributedPhase *phase, int *o_whichJob)
+{
+    AcquireExclusiveLock(&phase->lock);
+    for (;;) {
+        if (phase->pending.size() > 0) {
+            *o_whichJob = phase->pending[0];
+            phase->pending.erase(phase->pending.begin());
+            phase->nRunning++;
+            ReleaseExclusiveLock(&phase->lock);
+            return true;
+        }
+        if (0 == phase->nRunning) {
+            ReleaseExclusiveLock(&phase->lock);
+            return false;
+        }
+        PreventEventWaitersFromProceeding(&phase->jobFinished);
+        ReleaseExclusiveLock(&phase->lock);
+        WaitForEvent(&phase->jobFinished);
+        AcquireExclusiveLock(&phase->lock);
+    }
+}
+
+//
+// Send a job down a worker's connection and collect what it prints until it's done.  False if the connection went away.
+//
+static bool RunJob(NamedPipe *connection, const DistributedJob &job, string *o_output)
+{
+    char argcBuffer[32];
+    snprintf(argcBuffer, sizeof(argcBuffer), "%d", (int)job.args.size());
+    if (!WriteToNamedPipe(connection, argcBuffer)) {
+        return false;
+    }
+    for (size_t i = 0; i < job.args.size(); i++) {
+        if (!WriteToNamedPipe(connection, job.args[i].c_str())) {
+            return false;
+        }
+    }
+
+    const size_t bufferSize = DaemonStreamTagSize + DaemonStreamChunkSize + 1;
+    char *buffer = new char[bufferSize];
+    size_t messageLength;
+    bool finished = false;
+    while (ReadBytesFromNamedPipe(connection, buffer, bufferSize - 1, &messageLength)) {
+        if (messageLength >= DaemonStreamTagSize && '\0' == buffer[0]) {
+            continue;   // Streamed input and output, which nothing here uses
+        }
+        buffer[messageLength] = '\0';
+        if (0 == strcmp(buffer, CommandExecutedString)) {
+            finished = true;
+            break;
+        }
+        o_output->append(buffer, messageLength);
+    }
+    delete[] buffer;
+    return finished;
+}
+
+static void DistributedWorkerThread(void *param)
+{
+    DistributedWorker *worker = (DistributedWorker *)param;
+    DistributedPhase *phase = worker->phase;
+
+    NamedPipe *connection = ConnectToCommandSocket(worker->address.c_str());
+    if (NULL == connection) {
+        WriteErrorMessage("Unable to connect to worker %s; going on without it\n", worker->address.c_str());
+        worker->alive = false;
+    }
+
+    int whichJob;
+    while (worker->alive && TakeJob(phase, &whichJob)) {
+        DistributedJob &job = phase->jobs[whichJob];
+        for (size_t i = 0; i < job.outputs.size(); i++) {
+            DeleteSingleFile(job.outputs[i].c_str());   // So that finding them means this run wrote them
+        }
+
+        _int64 startTime = timeInMillis();
+        string output;
+        bool connected = RunJob(connection, job, &output);
+        bool wroteOutputs = connected;
+        for (size_t i = 0; i < job.outputs.size() && wroteOutputs; i++) {
+            wroteOutputs = FileExists(job.outputs[i]);
+        }
+
+        AcquireExclusiveLock(&phase->lock);
+        phase->nRunning--;
+        if (wroteOutputs) {
+            WriteStatusMessage("%s done on %s in %llds\n", job.description.c_str(), worker->address.c_str(), (timeInMillis() + 500 - startTime) / 1000);
+        } else {
+            job.attempts++;
+            const size_t maxOutputShown = 4096;
+            WriteErrorMessage("%s %s on %s (attempt %d of %d)%s%s\n", job.description.c_str(),
+                connected ? "didn't write its output" : "lost its connection", worker->address.c_str(), job.attempts, phase->maxAttempts,
+                output.size() > 0 ? ", after:\n" : "", output.substr(output.size() - __min(output.size(), maxOutputShown)).c_str());
+            if (job.attempts < phase->maxAttempts) {
+                phase->pending.push_back(whichJob);
+            } else {
+                phase->nFailed++;
+            }
+        }
+        AllowEventWaitersToProceed(&phase->jobFinished);
+        ReleaseExclusiveLock(&phase->lock);
+
+        if (!connected) {
+            worker->alive = false;
+        }
+    }
+
+    if (NULL != connection) {
+        CloseNamedPipe(connection);
+    }
+    if (0 == InterlockedDecrementAndReturnNewValue(&phase->nRunningWorkers)) {
+        SignalSingleWaiterObject(&phase->allWorkersDone);
+    }
+}
+
+//
+// Run all of the phase's jobs on the workers that are still alive, returning whether every one of them worked.
+//
+static bool RunDistributedPhase(DistributedPhase *phase, vector<DistributedWorker> &workers)
+{
+    for (int i = 0; i < (int)phase->jobs.size(); i++) {
+        phase->pending.push_back(i);
+    }
+    phase->nRunning = 0;
+    phase->nFailed = 0;
+    InitializeExclusiveLock(&phase->lock);
+    CreateEventObject(&phase->jobFinished);
+    CreateSingleWaiterObject(&phase->allWorkersDone);
+
+    int nAlive = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        nAlive += workers[i].alive;
+    }
+    phase->nRunningWorkers = nAlive;
+    for (size_t i = 0; i < workers.size(); i++) {
+        if (workers[i].alive) {
+            workers[i].phase = phase;
+            if (!StartNewThread(DistributedWorkerThread, &workers[i])) {
+                WriteErrorMessage("Unable to start a thread for worker %s\n", workers[i].address.c_str());
+                soft_exit(1);
+            }
+        }
+    }
+    if (nAlive > 0) {
+        WaitForSingleWaiterObject(&phase->allWorkersDone);
+    }
+
+    DestroySingleWaiterObject(&phase->allWorkersDone);
+    DestroyEventObject(&phase->jobFinished);
+    DestroyExclusiveLock(&phase->lock);
+
+    if (phase->pending.size() > 0) {
+        WriteErrorMessage("No workers are left, with %lld commands still to run\n", (_int64)phase->pending.size());
+        return false;
+    }
+    return 0 == phase->nFailed;
+}
+
+    void
+RunDistributedAlignment(
+    int argc,
+    const char **argv)
+{
+    const char *workerList = NULL;
+    int nPieces = 0;
+    int nShards = 0;
+    int maxAttempts = 3;
+    int n;
+    for (n = 2; n < argc && strcmp(argv[n], "single") != 0 && strcmp(argv[n], "paired") != 0; n++) {
+        if (strcmp(argv[n], "-w") == 0 && n + 1 < argc) {
+            workerList = argv[++n];
+        } else if (strcmp(argv[n], "-pieces") == 0 && n + 1 < argc && atoi(argv[n + 1]) > 0) {
+            nPieces = atoi(argv[++n]);
+        } else if (strcmp(argv[n], "-shards") == 0 && n + 1 < argc && atoi(argv[n + 1]) > 0) {
+            nShards = atoi(argv[++n]);
+        } else if (strcmp(argv[n], "-attempts") == 0 && n + 1 < argc && atoi(argv[n + 1]) > 0) {
+            maxAttempts = atoi(argv[++n]);
+        } else {
+            distributeUsage();
+        }
+    }
+    if (NULL == workerList || n + 2 >= argc) {
+        distributeUsage();
+    }
+
+    vector<DistributedWorker> workers;
+    for (const char *address = workerList; '\0' != *address; ) {
+        const char *comma = strchr(address, ',');
+        size_t length = NULL == comma ? strlen(address) : comma - address;
+        if (length > 0) {
+            DistributedWorker worker;
+            worker.address.assign(address, length);
+            worker.alive = true;
+            worker.phase = NULL;
+            workers.push_back(worker);
+        }
+        address += length + (NULL == comma ? 0 : 1);
+    }
+    if (0 == workers.size()) {
+        distributeUsage();
+    }
+    if (0 == nPieces) {
+        nPieces = 4 * (int)workers.size();
+    }
+    if (0 == nShards) {
+        nShards = (int)workers.size();
+    }
+
+    //
+    // The align arguments go to the pieces as they are, except for the output, and the ones about sorted BAM output
+    // go to the merges, too.
+    //
+    const char *indexDir = argv[n + 1];
+    SNAPFile outputFile;
+    int outputArg = -1, nOutputArgs = 0;
+    vector<string> mergeOptions;
+    const char *metricsFileName = NULL;
+    for (int i = n + 2; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            if (!SNAPFile::generateFromCommandLine(argv + i + 1, argc - i - 1, &nOutputArgs, &outputFile, false, false)) {
+                WriteErrorMessage("Must have a file specifier after -o\n");
+                soft_exit(1);
+            }
+            outputArg = i;
+            i += nOutputArgs;
+        } else if (strcmp(argv[i], "-inputPart") == 0 || strcmp(argv[i], "-shards") == 0 || strcmp(argv[i], "-evenShards") == 0) {
+            WriteErrorMessage("distribute splits the input and shards the output itself; leave out %s\n", argv[i]);
+            soft_exit(1);
+        } else if (strcmp(argv[i], "-dmm") == 0 && i + 1 < argc) {
+            metricsFileName = argv[++i];
+        } else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-cl") == 0 || strcmp(argv[i], "-S") == 0 || strcmp(argv[i], "-wbs") == 0) &&
+                i + 1 < argc) {
+            mergeOptions.push_back(argv[i]);
+            mergeOptions.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "-csi") == 0 || strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--b") == 0) {
+            mergeOptions.push_back(argv[i]);
+        }
+    }
+    if (-1 == outputArg || BAMFile != outputFile.fileType || outputFile.isStdio) {
+        WriteErrorMessage("distribute writes BAM output to a file, so it needs -o something.bam\n");
+        soft_exit(1);
+    }
+    const char *outputFileName = outputFile.fileName;
+
+    //
+    // Each piece is sorted (and sharded at the same places as the others), but doesn't need duplicate marking or an
+    // index, since the merge does those.
+    //
+    DistributedPhase align;
+    align.maxAttempts = maxAttempts;
+    vector<string> pieceFileNames;
+    for (int piece = 0; piece < nPieces; piece++) {
+        DistributedJob job;
+        string pieceFileName = PieceFileName(outputFileName, piece, nPieces);
+        pieceFileNames.push_back(pieceFileName);
+        char part[64];
+        snprintf(part, sizeof(part), "%d/%d", piece, nPieces);
+        job.args.push_back(argv[0]);
+        for (int i = n; i < argc; i++) {
+            if (i == outputArg) {
+                job.args.push_back("-o");
+                job.args.push_back(pieceFileName);
+                i += nOutputArgs;
+            } else {
+                job.args.push_back(argv[i]);
+            }
+        }
+        job.args.push_back("-inputPart");
+        job.args.push_back(part);
+        job.args.push_back("-so");
+        job.args.push_back("-S");
+        job.args.push_back("id");
+        if (nShards > 1) {
+            char shards[32];
+            snprintf(shards, sizeof(shards), "%d", nShards);
+            job.args.push_back("-shards");
+            job.args.push_back(shards);
+            job.args.push_back("-evenShards");
+            for (int shard = 0; shard < nShards; shard++) {
+                job.outputs.push_back(ShardFileName(pieceFileName, shard, nShards));
+            }
+        } else {
+            job.outputs.push_back(pieceFileName);
+        }
+        job.description = string("Piece ") + part;
+        job.attempts = 0;
+        align.jobs.push_back(job);
+    }
+
+    DistributedPhase merge;
+    merge.maxAttempts = maxAttempts;
+    for (int shard = 0; shard < nShards; shard++) {
+        DistributedJob job;
+        job.args.push_back(argv[0]);
+        job.args.push_back("merge");
+        job.args.push_back(indexDir);
+        job.args.push_back("-o");
+        job.args.push_back(nShards > 1 ? ShardFileName(outputFileName, shard, nShards) : string(outputFileName));
+        job.outputs.push_back(job.args.back());
+        job.args.insert(job.args.end(), mergeOptions.begin(), mergeOptions.end());
+        if (NULL != metricsFileName) {
+            job.args.push_back("-dmm");
+            job.args.push_back(nShards > 1 ? ShardFileName(metricsFileName, shard, nShards) : string(metricsFileName));
+        }
+        for (int piece = 0; piece < nPieces; piece++) {
+            job.args.push_back(nShards > 1 ? ShardFileName(pieceFileNames[piece], shard, nShards) : pieceFileNames[piece]);
+        }
+        job.description = "Merge of " + job.outputs[0];
+        job.attempts = 0;
+        merge.jobs.push_back(job);
+    }
+
+    _int64 startTime = timeInMillis();
+    WriteStatusMessage("Aligning %d pieces on %lld workers\n", nPieces, (_int64)workers.size());
+    if (!RunDistributedPhase(&align, workers)) {
+        WriteErrorMessage("Aligning the pieces failed\n");
+        soft_exit(1);
+    }
+    _int64 alignTime = timeInMillis() - startTime;
+
+    WriteStatusMessage("Merging them into %d %s\n", nShards, nShards > 1 ? "shards" : "file");
+    if (!RunDistributedPhase(&merge, workers)) {
+        WriteErrorMessage("Merging the pieces failed; they're left in %s and so on\n", align.jobs[0].outputs[0].c_str());
+        soft_exit(1);
+    }
+
+    for (size_t i = 0; i < align.jobs.size(); i++) {
+        for (size_t j = 0; j < align.jobs[i].outputs.size(); j++) {
+            if (!DeleteSingleFile(align.jobs[i].outputs[j].c_str())) {
+                WriteErrorMessage("warning: failure deleting piece %s\n", align.jobs[i].outputs[j].c_str());
+            }
+        }
+    }
+
+    WriteStatusMessage("Aligned in %llds and merged in %llds, into %s%s\n", (alignTime + 500) / 1000,
+        (timeInMillis() - startTime - alignTime + 500) / 1000, nShards > 1 ? "shards of " : "", outputFileName);
+}
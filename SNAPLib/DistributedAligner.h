@@ -0,0 +1,37 @@
+/*++
+
+Module Name:
+
+    DistributedAligner.h
+
+Abstract:
+
+    Splitting one alignment over several machines (snap-aligner distribute).  The workers are SNAP daemons started
+    with -s, and they share storage with the coordinator: the inputs, the index and the output directory have the same
+    paths everywhere.  The coordinator doesn't load anything itself.  It cuts the input into pieces with -inputPart,
+    hands each worker a piece at a time to align into a sorted BAM of its own, and then has the workers merge the
+    pieces into the output.
+
+    With more than one shard (-shards, one per worker by default), each piece is written as shards at equal divisions
+    of the genome (-evenShards), so shard s of every piece covers the same range.  Merging shard s of all of the
+    pieces gives out.shardS.bam, and the shards are merged at once on different workers.  With one shard, one worker
+    merges all of the pieces into out.bam.  The pieces are deleted once they've been merged.
+
+    A worker whose connection drops is done for, and whatever it was running goes to another worker.  Since a command
+    that fails takes its daemon down with it, that covers failures, too.  A command that finishes without writing its
+    output is tried again, up to -attempts times in all.
+
+    merge (snap-aligner merge index -o out.bam in1.bam in2.bam ...) is the second step by itself, and it's also what
+    the workers run for it.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+void RunDistributedAlignment(int argc, const char **argv);
+
+void RunMerge(int argc, const char **argv);
@@ -0,0 +1,391 @@
+/*++
+
+Module Name:
+
+    EmbeddedAligner.cpp
+
+Abstract:
+
+    Aligning reads in memory for a program that uses SNAP as a library.  See EmbeddedAligner.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "options.h"
+#include "EmbeddedAligner.h"
+#include "BigAlloc.h"
+#include "GenomeIndex.h"
+#include "BaseAligner.h"
+#include "IntersectingPairedEndAligner.h"
+#include "ChimericPairedEndAligner.h"
+#include "AlignerOptions.h"
+#include "PairedAligner.h"
+#include "FileFormat.h"
+#include "DataWriter.h"
+#include "SeedSequencer.h"
+#include "Error.h"
+#include "exit.h"
+
+extern const char *SNAP_VERSION;    // CommandProcessor.cpp
+
+    void
+InitializeEmbeddedAligners()
+{
+    InitializeSeedSequencers();
+}
+
+    static void
+SetNotFound(SingleAlignmentResult *result)
+{
+    result->status = NotFound;
+    result->location = InvalidGenomeLocation;
+    result->direction = FORWARD;
+    result->mapq = 0;
+    result->score = 0;
+}
+
+EmbeddedSingleAligner::EmbeddedSingleAligner(GenomeIndex *i_index, const AlignerOptions *i_options)
+    : options(i_options), index(i_index), longSeedAligner(NULL)
+{
+    //
+    // Sized just as SingleAlignerContext::runIterationThread does.
+    //
+    unsigned maxReadSize = MAX_READ_LENGTH;
+    maxResults = 1;
+    if (options->maxSecondaryAlignmentAdditionalEditDistance >= 0) {
+        unsigned maxSecondary = BaseAligner::getMaxSecondaryResults(options->numSeedsFromCommandLine, options->seedCoverage, maxReadSize,
+            options->maxHits, index->getSeedLength());
+        if (options->maxSecondaryAlignmentsPerContig <= 0) {
+            maxSecondary = __min(maxSecondary, (unsigned)options->maxSecondaryAlignments);
+        }
+        maxResults += maxSecondary;
+    }
+
+    GenomeIndex *longSeedIndex = index->getLongSeedIndex();
+    size_t reservation = BaseAligner::getBigAllocatorReservation(index, true, options->maxHits, maxReadSize, index->getSeedLength(),
+        options->numSeedsFromCommandLine, options->seedCoverage, options->maxSecondaryAlignmentsPerContig);
+    if (NULL != longSeedIndex) {
+        reservation += BaseAligner::getBigAllocatorReservation(longSeedIndex, true, options->maxHits, maxReadSize, longSeedIndex->getSeedLength(),
+            options->numSeedsFromCommandLine, options->seedCoverage, options->maxSecondaryAlignmentsPerContig);
+    }
+    allocator = new BigAllocator(reservation + sizeof(SingleAlignmentResult) * maxResults);
+
+    GenomeIndex *indexes[] = {index, longSeedIndex};
+    BaseAligner **aligners[] = {&aligner, &longSeedAligner};
+    for (int i = 0; i < 2 && NULL != indexes[i]; i++) {
+        *aligners[i] = new (allocator) BaseAligner(indexes[i], options->maxHits, options->maxDist, maxReadSize, options->numSeedsFromCommandLine,
+            options->seedCoverage, options->minWeightToCheck, options->extraSearchDepth, options->noUkkonen, options->noOrderedEvaluation,
+            options->noTruncation, options->maxSecondaryAlignmentsPerContig, NULL, NULL, NULL, allocator);
+        (*aligners[i])->setExplorePopularSeeds(options->explorePopularSeeds);
+        (*aligners[i])->setStopOnFirstHit(options->stopOnFirstHit);
+        (*aligners[i])->setAdaptiveSeeding(options->adaptiveSeeding);
+        (*aligners[i])->setExactMatchFastPath(!options->noExactMatchFastPath);
+        (*aligners[i])->setWorkBudget(options->workBudget);
+        (*aligners[i])->setMinSeedQuality(options->minSeedQuality);
+        (*aligners[i])->setMaxSeedsWithoutHits(options->maxSeedsWithoutHits);
+    }
+
+    results = (SingleAlignmentResult *)allocator->allocate(sizeof(SingleAlignmentResult) * maxResults);
+}
+
+EmbeddedSingleAligner::~EmbeddedSingleAligner()
+{
+    aligner->~BaseAligner();    // The allocator owns the memory
+    if (NULL != longSeedAligner) {
+        longSeedAligner->~BaseAligner();
+    }
+    delete allocator;
+}
+
+    bool
+EmbeddedSingleAligner::alignable(Read *read)
+{
+    read->clip(options->clipping);
+    return read->getDataLength() >= options->minReadLength && read->countOfNs() <= options->maxDist;
+}
+
+    void
+EmbeddedSingleAligner::alignBatch(Read **reads, int nReads, SingleAlignmentResult *results)
+{
+    for (int i = 0; i < nReads; i++) {
+        align(reads[i], &results[i], 1);
+    }
+}
+
+    int
+EmbeddedSingleAligner::align(Read *read, SingleAlignmentResult *o_results, int resultsSize)
+{
+    _ASSERT(resultsSize > 0);
+    if (! alignable(read)) {
+        SetNotFound(o_results);
+        return 1;
+    }
+
+    BaseAligner *readAligner = (NULL != longSeedAligner && read->getDataLength() >= options->longSeedMinReadLength) ? longSeedAligner : aligner;
+    SingleAlignmentResult *alignmentResults = resultsSize >= maxResults ? o_results : results;
+    int nSecondaryResults = 0;
+    readAligner->AlignRead(read, alignmentResults, options->maxSecondaryAlignmentAdditionalEditDistance, maxResults - 1, &nSecondaryResults,
+        options->maxSecondaryAlignments, alignmentResults + 1);
+
+    int nResults = 1 + nSecondaryResults;
+    if (alignmentResults != o_results) {
+        nResults = __min(nResults, resultsSize);
+        memcpy(o_results, alignmentResults, sizeof(*o_results) * nResults);
+    }
+    return nResults;
+}
+
+EmbeddedPairedAligner::EmbeddedPairedAligner(GenomeIndex *i_index, const PairedAlignerOptions *i_options)
+    : options(i_options), index(i_index), longSeedIntersectingAligner(NULL), longSeedAligner(NULL)
+{
+    //
+    // Sized just as PairedAlignerContext::runIterationThread does.
+    //
+    unsigned maxReadSize = MAX_READ_LENGTH;
+    maxPairedResults = 1;
+    maxSingleResults = 0;
+    if (options->maxSecondaryAlignmentAdditionalEditDistance >= 0) {
+        unsigned maxPairedSecondary = IntersectingPairedEndAligner::getMaxSecondaryResults(options->numSeedsFromCommandLine, options->seedCoverage,
+            maxReadSize, options->maxHits, index->getSeedLength(), options->minSpacing, options->maxSpacing);
+        unsigned maxSingleSecondary = ChimericPairedEndAligner::getMaxSingleEndSecondaryResults(options->numSeedsFromCommandLine, options->seedCoverage,
+            maxReadSize, options->maxHits, index->getSeedLength());
+        if (options->maxSecondaryAlignmentsPerContig <= 0) {
+            maxPairedSecondary = __min(maxPairedSecondary, (unsigned)options->maxSecondaryAlignments);
+            maxSingleSecondary = __min(maxSingleSecondary, (unsigned)options->maxSecondaryAlignments * NUM_READS_PER_PAIR);
+        }
+        maxPairedResults += maxPairedSecondary;
+        maxSingleResults = maxSingleSecondary;
+    }
+
+    GenomeIndex *longSeedIndex = index->getLongSeedIndex();
+    GenomeIndex *indexes[] = {index, longSeedIndex};
+    size_t reservation = sizeof(PairedAlignmentResult) * maxPairedResults + sizeof(SingleAlignmentResult) * maxSingleResults;
+    for (int i = 0; i < 2 && NULL != indexes[i]; i++) {
+        reservation +=
+            IntersectingPairedEndAligner::getBigAllocatorReservation(indexes[i], options->intersectingAlignerMaxHits, maxReadSize, indexes[i]->getSeedLength(),
+                options->numSeedsFromCommandLine, options->seedCoverage, options->maxDist, options->extraSearchDepth, options->maxCandidatePoolSize,
+                options->maxSecondaryAlignmentsPerContig) +
+            ChimericPairedEndAligner::getBigAllocatorReservation(indexes[i], maxReadSize, options->maxHits, indexes[i]->getSeedLength(),
+                options->numSeedsFromCommandLine, options->seedCoverage, options->maxDist, options->extraSearchDepth, options->maxCandidatePoolSize,
+                options->maxSecondaryAlignmentsPerContig);
+    }
+    allocator = new BigAllocator(reservation);
+
+    IntersectingPairedEndAligner **intersectingAligners[] = {&intersectingAligner, &longSeedIntersectingAligner};
+    ChimericPairedEndAligner **aligners[] = {&aligner, &longSeedAligner};
+    for (int i = 0; i < 2 && NULL != indexes[i]; i++) {
+        *intersectingAligners[i] = new (allocator) IntersectingPairedEndAligner(indexes[i], maxReadSize, options->maxHits, options->maxDist,
+            options->numSeedsFromCommandLine, options->seedCoverage, options->minSpacing, options->maxSpacing, options->intersectingAlignerMaxHits,
+            options->extraSearchDepth, options->maxCandidatePoolSize, options->maxSecondaryAlignmentsPerContig, allocator, options->noUkkonen,
+            options->noOrderedEvaluation, options->noTruncation);
+        (*intersectingAligners[i])->setShareMateSeeds(options->shareMateSeeds);
+        *aligners[i] = new (allocator) ChimericPairedEndAligner(indexes[i], maxReadSize, options->maxHits, options->maxDist,
+            options->numSeedsFromCommandLine, options->seedCoverage, options->minWeightToCheck, options->forceSpacing, options->minSpacing,
+            options->maxSpacing, options->extraSearchDepth, options->noUkkonen, options->noOrderedEvaluation, options->noTruncation,
+            *intersectingAligners[i], options->minReadLength, options->maxSecondaryAlignmentsPerContig, allocator);
+        (*aligners[i])->setWorkBudget(options->workBudget);
+        (*aligners[i])->setMinSeedQuality(options->minSeedQuality);
+        (*aligners[i])->setMaxSeedsWithoutHits(options->maxSeedsWithoutHits);
+        (*aligners[i])->setMaxDistFraction(options->maxDistFraction);
+    }
+
+    results = (PairedAlignmentResult *)allocator->allocate(sizeof(PairedAlignmentResult) * maxPairedResults);
+    singleResults = (SingleAlignmentResult *)allocator->allocate(sizeof(SingleAlignmentResult) * maxSingleResults);
+}
+
+EmbeddedPairedAligner::~EmbeddedPairedAligner()
+{
+    aligner->~ChimericPairedEndAligner();
+    intersectingAligner->~IntersectingPairedEndAligner();
+    if (NULL != longSeedAligner) {
+        longSeedAligner->~ChimericPairedEndAligner();
+        longSeedIntersectingAligner->~IntersectingPairedEndAligner();
+    }
+    delete allocator;
+}
+
+    ChimericPairedEndAligner *
+EmbeddedPairedAligner::chooseAligner(Read *read0, Read *read1)
+{
+    if (NULL != longSeedAligner && __min(read0->getDataLength(), read1->getDataLength()) >= options->longSeedMinReadLength) {
+        return longSeedAligner;
+    }
+    return aligner;
+}
+
+    void
+EmbeddedPairedAligner::alignBatch(Read **reads, int nPairs, PairedAlignmentResult *results)
+{
+    for (int i = 0; i < nPairs; i++) {
+        align(reads[2 * i], reads[2 * i + 1], &results[i], 1);
+    }
+}
+
+    int
+EmbeddedPairedAligner::align(Read *read0, Read *read1, PairedAlignmentResult *o_results, int resultsSize, int *o_nSingleResults)
+{
+    _ASSERT(resultsSize > 0);
+    int nSingleResults[NUM_READS_PER_PAIR] = {0, 0};
+    if (NULL != o_nSingleResults) {
+        o_nSingleResults[0] = o_nSingleResults[1] = 0;
+    }
+
+    Read *reads[NUM_READS_PER_PAIR] = {read0, read1};
+    bool useful[NUM_READS_PER_PAIR];
+    for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+        reads[whichRead]->clip(options->clipping);
+        useful[whichRead] = reads[whichRead]->getDataLength() >= options->minReadLength && reads[whichRead]->countOfNs() <= options->maxDist;
+    }
+    if (! useful[0] && ! useful[1]) {
+        memset(o_results, 0, sizeof(*o_results));
+        for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+            o_results->status[whichRead] = NotFound;
+            o_results->location[whichRead] = InvalidGenomeLocation;
+        }
+        return 1;
+    }
+
+    PairedAlignmentResult *alignmentResults = resultsSize >= maxPairedResults ? o_results : results;
+    int nSecondaryResults = 0;
+    chooseAligner(read0, read1)->align(read0, read1, alignmentResults, options->maxSecondaryAlignmentAdditionalEditDistance, maxPairedResults - 1,
+        &nSecondaryResults, alignmentResults + 1, maxSingleResults, options->maxSecondaryAlignments, &nSingleResults[0], &nSingleResults[1], singleResults);
+
+    if (options->forceSpacing && isOneLocation(alignmentResults->status[0]) != isOneLocation(alignmentResults->status[1])) {
+        // either both align or neither do, as in PairedAlignerContext
+        alignmentResults->status[0] = alignmentResults->status[1] = NotFound;
+        alignmentResults->location[0] = alignmentResults->location[1] = InvalidGenomeLocation;
+    }
+
+    int nResults = 1 + nSecondaryResults;
+    if (alignmentResults != o_results) {
+        nResults = __min(nResults, resultsSize);
+        memcpy(o_results, alignmentResults, sizeof(*o_results) * nResults);
+    }
+    if (NULL != o_nSingleResults) {
+        o_nSingleResults[0] = nSingleResults[0];
+        o_nSingleResults[1] = nSingleResults[1];
+    }
+    return nResults;
+}
+
+//
+// A DataWriter over the caller's buffer, so that the records come from the same ReadWriter that writes files.  There's
+// never another batch, so a ReadWriter that runs out of room gives up rather than moving on.
+//
+class BufferDataWriter : public DataWriter
+{
+public:
+    BufferDataWriter() : DataWriter(NULL), buffer(NULL), size(0), used(0) {}
+
+    void setBuffer(char *i_buffer, size_t i_size)
+    {
+        buffer = i_buffer;
+        size = i_size;
+        used = 0;
+    }
+
+    size_t getUsed() {return used;}
+
+    virtual bool getBuffer(char** o_buffer, size_t* o_size)
+    {
+        *o_buffer = buffer + used;
+        *o_size = size - used;
+        return NULL != buffer;
+    }
+
+    virtual void advance(GenomeDistance bytes, GenomeLocation location = 0)
+    {
+        _ASSERT(used + bytes <= size);
+        used += bytes;
+    }
+
+    virtual bool getBatch(int relative, char** o_buffer, size_t* o_size = NULL, size_t* o_used = NULL, size_t* o_offset = NULL,
+        size_t* o_logicalUsed = 0, size_t* o_logicalOffset = NULL)
+    {
+        return false;
+    }
+
+    virtual bool nextBatch() {return false;}
+
+    virtual void close() {}
+
+private:
+    char   *buffer;
+    size_t  size;
+    size_t  used;
+};
+
+class BufferDataWriterSupplier : public DataWriterSupplier
+{
+public:
+    BufferDataWriterSupplier() : writer(NULL) {}
+
+    virtual DataWriter* getWriter()
+    {
+        _ASSERT(NULL == writer);
+        writer = new BufferDataWriter();
+        return writer;
+    }
+
+    virtual void close() {}
+
+    BufferDataWriter   *writer;
+};
+
+EmbeddedRecordWriter::EmbeddedRecordWriter(const Genome *i_genome, AlignerOptions *i_options, bool bam)
+    : options(i_options)
+{
+    format = bam ? FileFormat::BAM[options->useM] : FileFormat::SAM[options->useM];
+
+    memset(&context, 0, sizeof(context));
+    context.genome = i_genome;
+    context.clipping = options->clipping;
+    context.defaultReadGroup = options->defaultReadGroup;
+    context.compressionLevel = -1;
+    format->setupReaderContext(options, &context);
+
+    BufferDataWriterSupplier *dataSupplier = new BufferDataWriterSupplier();
+    writerSupplier = ReadWriterSupplier::create(format, dataSupplier, i_genome, options->gapPenalty);   // which owns dataSupplier
+    writer = writerSupplier->getWriter();
+    dataWriter = dataSupplier->writer;
+}
+
+EmbeddedRecordWriter::~EmbeddedRecordWriter()
+{
+    delete writer;
+    delete writerSupplier;
+}
+
+    bool
+EmbeddedRecordWriter::writeHeader(char *buffer, size_t bufferSize, size_t *o_used, int argc, const char **argv)
+{
+    return format->writeHeader(context, buffer, bufferSize, o_used, Unsorted, argc, argv, SNAP_VERSION, options->rgLineContents, false);
+}
+
+    bool
+EmbeddedRecordWriter::writeReads(Read *read, SingleAlignmentResult *results, int nResults, bool firstIsPrimary, char *buffer, size_t bufferSize,
+    size_t *o_used)
+{
+    dataWriter->setBuffer(buffer, bufferSize);
+    bool worked = writer->writeReads(context, read, results, nResults, firstIsPrimary);
+    *o_used = worked ? dataWriter->getUsed() : 0;
+    dataWriter->setBuffer(NULL, 0);
+    return worked;
+}
+
+    bool
+EmbeddedRecordWriter::writePairs(Read **reads, PairedAlignmentResult *results, int nResults, bool firstIsPrimary, char *buffer, size_t bufferSize,
+    size_t *o_used, SingleAlignmentResult **singleResults, int *nSingleResults)
+{
+    int noSingleResults[NUM_READS_PER_PAIR] = {0, 0};
+    dataWriter->setBuffer(buffer, bufferSize);
+    bool worked = writer->writePairs(context, reads, results, nResults, singleResults, NULL == nSingleResults ? noSingleResults : nSingleResults,
+        firstIsPrimary);
+    *o_used = worked ? dataWriter->getUsed() : 0;
+    dataWriter->setBuffer(NULL, 0);
+    return worked;
+}
@@ -0,0 +1,149 @@
+/*++
+
+Module Name:
+
+    EmbeddedAligner.h
+
+Abstract:
+
+    Using SNAP as a library, from a program that has reads in memory and wants alignments back, without input or output
+    files, formatting or a daemon to talk to.  After InitializeEmbeddedAligners(), the index is loaded once
+    (GenomeIndex::loadFromDirectory) and shared by all threads; each thread makes its own EmbeddedSingleAligner or
+    EmbeddedPairedAligner, which are what the aligner threads of snap-aligner single and paired use (BaseAligner, or
+    IntersectingPairedEndAligner under ChimericPairedEndAligner), with all of their memory in one BigAllocator.  The settings come from an AlignerOptions
+    (or PairedAlignerOptions), either left at their defaults and filled in by hand or parsed from a command line.
+
+    Reads are the caller's: Read::init points them at the caller's id, bases and qualities without copying, and they
+    have to stay put until the alignment is done.  Results are written straight into the caller's arrays.  What the
+    command line does around the aligners is left to the caller: there's no -reuse, -dupCache, -f filtering, -ins or
+    -lr, and no statistics.
+
+    EmbeddedRecordWriter turns results into SAM or BAM records in the caller's buffer, exactly as they'd be written to
+    a file (with the soft clipping and CIGARs of FileFormat::writeRead), for a caller that wants to send them on itself.
+    BAM records aren't compressed; that's for whoever writes the file.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "AlignmentResult.h"
+#include "Read.h"
+
+//
+// Call once, before loading the index, to set up what snap-aligner's main sets up (the seed orders).
+//
+void InitializeEmbeddedAligners();
+
+class GenomeIndex;
+class AlignerOptions;
+class PairedAlignerOptions;
+class BigAllocator;
+class BaseAligner;
+class IntersectingPairedEndAligner;
+class ChimericPairedEndAligner;
+class DataWriter;
+class BufferDataWriter;
+class FileFormat;
+class Genome;
+
+//
+// Each of these is for one thread at a time.
+//
+class EmbeddedSingleAligner {
+public:
+    EmbeddedSingleAligner(GenomeIndex *i_index, const AlignerOptions *i_options);
+    ~EmbeddedSingleAligner();
+
+    //
+    // The primary alignment of each of nReads reads into results[0..nReads-1].  A read that's too short or has too many
+    // Ns to align comes back NotFound, like every other unaligned one.
+    //
+    void alignBatch(Read **reads, int nReads, SingleAlignmentResult *results);
+
+    //
+    // A read's primary alignment followed by its secondary alignments (-om, -omax), returning how many there are.  With
+    // room for getMaxResults() none are lost; otherwise the best that fit are kept.
+    //
+    int align(Read *read, SingleAlignmentResult *results, int resultsSize);
+
+    int getMaxResults() const {return maxResults;}
+
+private:
+    bool alignable(Read *read);
+
+    const AlignerOptions   *options;
+    GenomeIndex            *index;
+    BigAllocator           *allocator;
+    BaseAligner            *aligner;
+    BaseAligner            *longSeedAligner;     // for reads of at least -lsr bases, with an index that has long seed tables
+    SingleAlignmentResult  *results;             // when the caller's array is too small for the secondary alignments
+    int                     maxResults;
+};
+
+class EmbeddedPairedAligner {
+public:
+    EmbeddedPairedAligner(GenomeIndex *i_index, const PairedAlignerOptions *i_options);
+    ~EmbeddedPairedAligner();
+
+    //
+    // The primary alignment of each of nPairs pairs, whose reads are reads[2 * i] and reads[2 * i + 1], into results[i].
+    //
+    void alignBatch(Read **reads, int nPairs, PairedAlignmentResult *results);
+
+    //
+    // A pair's primary alignment followed by its secondary pair alignments, returning how many there are.  The secondary
+    // alignments of the ends by themselves (when they didn't align well as a pair) are left in getSingleResults(), which
+    // holds o_nSingleResults[0] of the first read's and then o_nSingleResults[1] of the second's, until the next call.
+    //
+    int align(Read *read0, Read *read1, PairedAlignmentResult *results, int resultsSize, int *o_nSingleResults = NULL);
+
+    int getMaxResults() const {return maxPairedResults;}
+    const SingleAlignmentResult *getSingleResults() const {return singleResults;}
+
+private:
+    ChimericPairedEndAligner *chooseAligner(Read *read0, Read *read1);
+
+    const PairedAlignerOptions     *options;
+    GenomeIndex                    *index;
+    BigAllocator                   *allocator;
+    IntersectingPairedEndAligner   *intersectingAligner;
+    ChimericPairedEndAligner       *aligner;
+    IntersectingPairedEndAligner   *longSeedIntersectingAligner;
+    ChimericPairedEndAligner       *longSeedAligner;
+    PairedAlignmentResult          *results;
+    SingleAlignmentResult          *singleResults;
+    int                             maxPairedResults;
+    int                             maxSingleResults;
+};
+
+//
+// SAM or BAM records (options->useM, -G and -R apply) for the results of a read or pair, the first of which is primary
+// if firstIsPrimary, written into the caller's buffer.  Returns false, having written nothing, if they don't fit.  One
+// per thread, like the aligners.
+//
+class EmbeddedRecordWriter {
+public:
+    EmbeddedRecordWriter(const Genome *i_genome, AlignerOptions *i_options, bool bam = true);
+    ~EmbeddedRecordWriter();
+
+    bool writeHeader(char *buffer, size_t bufferSize, size_t *o_used, int argc = 0, const char **argv = NULL);
+
+    bool writeReads(Read *read, SingleAlignmentResult *results, int nResults, bool firstIsPrimary, char *buffer, size_t bufferSize,
+        size_t *o_used);
+
+    bool writePairs(Read **reads, PairedAlignmentResult *results, int nResults, bool firstIsPrimary, char *buffer, size_t bufferSize,
+        size_t *o_used, SingleAlignmentResult **singleResults = NULL, int *nSingleResults = NULL);
+
+private:
+    AlignerOptions     *options;
+    const FileFormat   *format;
+    ReaderContext       context;
+    ReadWriterSupplier *writerSupplier;
+    ReadWriter         *writer;
+    BufferDataWriter   *dataWriter;       // owned by writer
+};
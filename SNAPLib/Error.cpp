@@ -46,6 +46,28 @@ WriteMessageToFile(FILE *file, const char *message)
 }
 
 
+//
+// Format the message into buffer, or into a new buffer (which the caller deletes) if it doesn't fit, which the usage
+// messages don't.
+//
+    static char *
+FormatMessageText(char *buffer, size_t bufferSize, const char *message, va_list args)
+{
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    int length = vsnprintf(buffer, bufferSize - 1, message, args);
+    buffer[bufferSize - 1] = '\0';  // vsnprintf spec is vague on whether it null terminates a full buffer, so better safe than sorry
+
+    char *text = buffer;
+    if (length >= (int)bufferSize - 1) {
+        text = new char[length + 1];
+        vsnprintf(text, length + 1, message, argsCopy);
+    }
+    va_end(argsCopy);
+
+    return text;
+}
+
     void
 WriteErrorMessage(const char *message, ...)
 {
@@ -53,12 +75,15 @@ WriteErrorMessage(const char *message, ...)
     va_start(args, message);
     const size_t bufferSize = 10240;
     char buffer[bufferSize];
-    vsnprintf(buffer, bufferSize - 1, message, args);
-    buffer[bufferSize - 1] = '\0';  // vsnprintf spec is vague on whether it null terminates a full buffer, so better safe than sorry
-    WriteMessageToFile(stderr, buffer);
+    char *text = FormatMessageText(buffer, bufferSize, message, args);
+    va_end(args);
+    WriteMessageToFile(stderr, text);
 	if (NULL != CommandPipe) {
-	  WriteToNamedPipe(CommandPipe, buffer);
+	  WriteToNamedPipe(CommandPipe, text);
 	}
+    if (text != buffer) {
+        delete[] text;
+    }
 }
 
     void
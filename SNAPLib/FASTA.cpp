@@ -28,53 +28,97 @@ Revision History:
 #include "Error.h"
 #include "exit.h"
 #include "Util.h"
+#include "zlib.h"
 
 using namespace std;
 
+class GzipFGetsObject : public FgetsObject
+{
+public:
+    GzipFGetsObject(gzFile _file) : file(_file) {}
+    virtual char *fgets(char *s, int size) {
+        return gzgets(file, s, size);
+    }
+private:
+    gzFile file;
+};
+
     const Genome *
 ReadFASTAGenome(
     const char *fileName,
     const char *pieceNameTerminatorCharacters,
     bool spaceIsAPieceNameTerminator,
     unsigned chromosomePaddingSize)
+/*++
+
+Routine Description:
+
+    Read a FASTA file into a new genome.  The file may be gzip compressed (zlib reads uncompressed files as they are).
+
+    We make two passes over the file.  The first just counts the contigs and bases, so that the genome is allocated
+    at exactly the size it needs to be.  The file size isn't a usable bound for a compressed file, and even for an
+    uncompressed one it's more than needed.  Neither pass holds more than a line of the file in memory.
+
+--*/
 {
     //
-    // We need to know a bound on the size of the genome before we create the Genome object.
-    // A bound is the number of bytes in the FASTA file, because we store at most one base per
-    // byte.  Get the file size to use for this bound.
+    // What each character in a base line turns into: bases are converted to upper case, except that every
+    // N is lower case n, so we don't match the N from the genome with N in reads (where we just do a straight
+    // text comparison).  Anything else is invalid, and becomes N.
     //
-    _int64 fileSize = QueryFileSize(fileName);
+    char genomeCharacter[256];
     bool isValidGenomeCharacter[256];
 
     for (int i = 0; i < 256; i++) {
+        genomeCharacter[i] = 'N';
         isValidGenomeCharacter[i] = false;
     }
 
-    isValidGenomeCharacter['A'] = isValidGenomeCharacter['T'] = isValidGenomeCharacter['C'] = isValidGenomeCharacter['G'] = isValidGenomeCharacter['N'] = true;
-    isValidGenomeCharacter['a'] = isValidGenomeCharacter['t'] = isValidGenomeCharacter['c'] = isValidGenomeCharacter['g'] = isValidGenomeCharacter['n'] = true;
+    const char *bases = "ACGT";
+    for (int i = 0; i < 4; i++) {
+        genomeCharacter[(unsigned char)bases[i]] = genomeCharacter[(unsigned char)tolower(bases[i])] = bases[i];
+        isValidGenomeCharacter[(unsigned char)bases[i]] = isValidGenomeCharacter[(unsigned char)tolower(bases[i])] = true;
+    }
+    genomeCharacter['N'] = genomeCharacter['n'] = 'n';
+    isValidGenomeCharacter['N'] = isValidGenomeCharacter['n'] = true;
 
-    FILE *fastaFile = fopen(fileName, "r");
+    gzFile fastaFile = gzopen(fileName, "rb");
     if (fastaFile == NULL) {
-        WriteErrorMessage("Unable to open FASTA file '%s' (even though we already got its size)\n",fileName);
+        WriteErrorMessage("Unable to open FASTA file '%s'\n",fileName);
         return NULL;
     }
+    gzbuffer(fastaFile, 1024 * 1024);
+    GzipFGetsObject fgetsObject(fastaFile);
 
     int lineBufferSize = 0;
     char *lineBuffer;
  
     //
-    // Count the chromosomes
+    // Count the chromosomes and bases.
     //
     unsigned nChromosomes = 0;
+    GenomeDistance nBases = 0;
 
-    while (NULL != reallocatingFgets(&lineBuffer,&lineBufferSize,fastaFile)) {
+    while (NULL != genericReallocatingFgets(&lineBuffer, &lineBufferSize, &fgetsObject)) {
         if (lineBuffer[0] == '>') {
             nChromosomes++;
+        } else {
+            size_t lineLen = strlen(lineBuffer);
+            if (lineLen > 0 && lineBuffer[lineLen - 1] == '\n') {
+                lineLen--;
+            }
+            nBases += lineLen;
         }
     }
-    rewind(fastaFile);
 
-    Genome *genome = new Genome(fileSize + (nChromosomes+1) * (size_t)chromosomePaddingSize, fileSize + (nChromosomes+1) * (size_t)chromosomePaddingSize, chromosomePaddingSize, nChromosomes + 1);
+    if (0 != gzrewind(fastaFile)) {
+        WriteErrorMessage("Unable to rewind FASTA file '%s'\n", fileName);
+        gzclose(fastaFile);
+        return NULL;
+    }
+
+    GenomeDistance genomeSize = nBases + (nChromosomes+1) * (size_t)chromosomePaddingSize;
+    Genome *genome = new Genome(genomeSize, genomeSize, chromosomePaddingSize, nChromosomes + 1);
 
     char *paddingBuffer = new char[chromosomePaddingSize+1];
     for (unsigned i = 0; i < chromosomePaddingSize; i++) {
@@ -85,7 +129,7 @@ ReadFASTAGenome(
     bool warningIssued = false;
     bool inAContig = false;
 
-    while (NULL != reallocatingFgets(&lineBuffer, &lineBufferSize, fastaFile)) {
+    while (NULL != genericReallocatingFgets(&lineBuffer, &lineBufferSize, &fgetsObject)) {
         if (lineBuffer[0] == '>') {
             inAContig = true;
             //
@@ -130,7 +174,7 @@ ReadFASTAGenome(
             }
 
             //
-            // Convert it to upper case and truncate the newline before adding it to the genome.
+            // Convert it to what goes in the genome and truncate the newline before adding it.
             //
 
             char *newline = strchr(lineBuffer, '\n');
@@ -138,28 +182,15 @@ ReadFASTAGenome(
                 *newline = 0;
             }
 
-            //
-            // But convert any 'N' to 'n'.  This is so we don't match the N from the genome with N
-            // in reads (where we just do a straight text comparison.
-            //
             size_t lineLen = strlen(lineBuffer);
 
 			for (unsigned i = 0; i < lineLen; i++) {
-              lineBuffer[i] = toupper(lineBuffer[i]);
-            }
-
-			for (unsigned i = 0; i < lineLen; i++) {
-                if ('N' == lineBuffer[i]) {
-                    lineBuffer[i] = 'n';
-                }
-
-                if (!isValidGenomeCharacter[(unsigned char)lineBuffer[i]]) {
-                    if (!warningIssued) {
-                        WriteErrorMessage("\nFASTA file contained a character that's not a valid base (or N): '%c', full line '%s'; \nconverting to 'N'.  This may happen again, but there will be no more warnings.\n", lineBuffer[i], lineBuffer);
-                        warningIssued = true;
-                    }
-                    lineBuffer[i] = 'N';
+                unsigned char c = (unsigned char)lineBuffer[i];
+                if (!isValidGenomeCharacter[c] && !warningIssued) {
+                    WriteErrorMessage("\nFASTA file contained a character that's not a valid base (or N): '%c', full line '%s'; \nconverting to 'N'.  This may happen again, but there will be no more warnings.\n", c, lineBuffer);
+                    warningIssued = true;
                 }
+                lineBuffer[i] = genomeCharacter[c];
             }
             genome->addData(lineBuffer);
         }
@@ -170,9 +201,9 @@ ReadFASTAGenome(
     //
     genome->addData(paddingBuffer);
     genome->fillInContigLengths();
-    genome->sortContigsByName();
+    genome->buildContigNameTable();
 
-    fclose(fastaFile);
+    gzclose(fastaFile);
     delete [] paddingBuffer;
     delete [] lineBuffer;
     return genome;
@@ -33,10 +33,141 @@ Revision History:
 #include "Util.h"
 #include "exit.h"
 #include "Error.h"
+#include "ReadTrimmer.h"
+
+#include "Simd.h"
 
 using std::min;
 using util::strnchr;
 
+//
+// Finding the ends of the lines is most of the work of parsing FASTQ, so it's done with vector compares when the processor
+// has AVX2: compare 32 bytes at a time against newline (and NUL, since the buffers are NUL terminated and the scalar
+// version stops there too), and pull the positions out of the bit mask.  The AVX2 version is compiled for its instruction
+// set function by function, so the rest of SNAP still runs on processors without it.  MSVC doesn't need to be told.
+//
+#ifdef _MSC_VER
+#define FASTQ_VECTOR_TARGET(instructionSets)
+#else
+#define FASTQ_VECTOR_TARGET(instructionSets) __attribute__((target(instructionSets)))
+#endif
+
+    static int
+FindNewlinesFrom(const char *buffer, _int64 start, _int64 length, _int64 *newlineOffsets, int maxNewlines)
+{
+    int nFound = 0;
+    for (_int64 i = start; i < length && nFound < maxNewlines; i++) {
+        if ('\n' == buffer[i]) {
+            newlineOffsets[nFound++] = i;
+        } else if (0 == buffer[i]) {
+            break;
+        }
+    }
+    return nFound;
+}
+
+    int
+FASTQReader::FindNewlinesScalar(const char *buffer, _int64 length, _int64 *newlineOffsets, int maxNewlines)
+{
+    return FindNewlinesFrom(buffer, 0, length, newlineOffsets, maxNewlines);
+}
+
+#ifdef SNAP_SIMD_X86
+    int FASTQ_VECTOR_TARGET("avx2")
+FASTQReader::FindNewlinesAVX2(const char *buffer, _int64 length, _int64 *newlineOffsets, int maxNewlines)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+
+    int nFound = 0;
+    _int64 offset = 0;
+    for (; offset + 32 <= length; offset += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(buffer + offset));
+        _uint32 newlines = (_uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        _uint32 nuls = (_uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, zero));
+        if (0 != nuls) {
+            newlines &= (nuls & (0 - nuls)) - 1;    // Just the ones before the first NUL
+        }
+
+        while (0 != newlines) {
+            unsigned long bit;
+            CountTrailingZeroes(newlines, bit);
+            newlineOffsets[nFound++] = offset + bit;
+            if (nFound == maxNewlines) {
+                return nFound;
+            }
+            newlines &= newlines - 1;
+        }
+
+        if (0 != nuls) {
+            return nFound;
+        }
+    }
+
+    //
+    // Don't read past the end for the last partial vector.
+    //
+    return nFound + FindNewlinesFrom(buffer, offset, length, newlineOffsets + nFound, maxNewlines - nFound);
+}
+#endif // SNAP_SIMD_X86
+
+    int
+FASTQReader::FindNewlinesVector16(const char *buffer, _int64 length, _int64 *newlineOffsets, int maxNewlines)
+/*++
+
+Routine Description:
+
+    FindNewlinesAVX2 16 bytes at a time, for processors without AVX2 (including ARM).
+
+--*/
+{
+    const Vector16 newline = Vector16Set1('\n');
+    const Vector16 zero = Vector16Zero();
+
+    int nFound = 0;
+    _int64 offset = 0;
+    for (; offset + 16 <= length; offset += 16) {
+        Vector16 chunk = Vector16Load(buffer + offset);
+        _uint32 newlines = Vector16MoveMask(Vector16Equal(chunk, newline));
+        _uint32 nuls = Vector16MoveMask(Vector16Equal(chunk, zero));
+        if (0 != nuls) {
+            newlines &= (nuls & (0 - nuls)) - 1;
+        }
+
+        while (0 != newlines) {
+            unsigned long bit;
+            CountTrailingZeroes(newlines, bit);
+            newlineOffsets[nFound++] = offset + bit;
+            if (nFound == maxNewlines) {
+                return nFound;
+            }
+            newlines &= newlines - 1;
+        }
+
+        if (0 != nuls) {
+            return nFound;
+        }
+    }
+
+    return nFound + FindNewlinesFrom(buffer, offset, length, newlineOffsets + nFound, maxNewlines - nFound);
+}
+
+    static FASTQReader::FindNewlinesFunction
+ChooseFindNewlines()
+{
+    return KernelChooser<FASTQReader::FindNewlinesFunction>("FASTQ parsing").avx2(X86_ONLY(FASTQReader::FindNewlinesAVX2))
+        .vector16(FASTQReader::FindNewlinesVector16).scalar(FASTQReader::FindNewlinesScalar);
+}
+
+static FASTQReader::FindNewlinesFunction FindNewlines = ChooseFindNewlines();
+
+    static char *
+FindNewline(char *buffer, _int64 length)
+{
+    _int64 offset;
+    return 1 == (*FindNewlines)(buffer, length, &offset, 1) ? buffer + offset : NULL;
+}
+
 FASTQReader::FASTQReader(
     DataReader* i_data,
     const ReaderContext& i_context)
@@ -132,7 +263,7 @@ FASTQReader::skipPartialRecord(DataReader *data)
 
     char *firstLineCandidate = buffer;
     if (*firstLineCandidate != '@') {
-        firstLineCandidate = strnchr(buffer, '\n', validBytes) + 1;
+        firstLineCandidate = FindNewline(buffer, validBytes) + 1;
     }
 
     for (;;) {
@@ -141,7 +272,7 @@ FASTQReader::skipPartialRecord(DataReader *data)
             return false;
         }
 
-        char *secondLineCandidate = strnchr(firstLineCandidate, '\n', validBytes - (firstLineCandidate - buffer)) + 1;
+        char *secondLineCandidate = FindNewline(firstLineCandidate, validBytes - (firstLineCandidate - buffer)) + 1;
         if (NULL == (secondLineCandidate-1)) {
 			WriteErrorMessage("Unable to find a read in FASTQ buffer (2) at %d\n", data->getFileOffset());
             return false;
@@ -229,16 +360,18 @@ FASTQReader::getNextRead(Read *readToUpdate)
 FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpdate, const char *fileName, DataReader *data, const ReaderContext &context)
 {
     //
-    // Get the next four lines.
+    // Get the next four lines, finding all of their ends at once.
     //
     char* lines[nLinesPerFastqQuery];
     unsigned lineLengths[nLinesPerFastqQuery];
     char* scan = buffer;
 
+    _int64 newlineOffsets[nLinesPerFastqQuery];
+    int nNewlines = (*FindNewlines)(buffer, validBytes, newlineOffsets, nLinesPerFastqQuery);
+
     for (unsigned i = 0; i < nLinesPerFastqQuery; i++) {
 
-        char *newLine = strnchr(scan, '\n', validBytes - (scan - buffer));
-        if (NULL == newLine) {
+        if ((int)i >= nNewlines) {
             if (validBytes - (scan - buffer) == 1 && *scan == 0x1a && data->isEOF()) {
                 // sometimes DOS files will have extra ^Z at end
                 return false;
@@ -255,6 +388,8 @@ FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpda
             soft_exit(1);
         }
 
+        char *newLine = buffer + newlineOffsets[i];
+
         const size_t lineLen = newLine - scan;
         if (0 == lineLen) {
             WriteErrorMessage("Syntax error in FASTQ file: blank line.\n");
@@ -275,6 +410,9 @@ FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpda
     const char* space = strnchr(id, ' ', lineLengths[0] - 1);
     readToUpdate->init(id, space != NULL ? (unsigned) (space - id) : (unsigned) lineLengths[0] - 1, lines[1], lines[3], lineLengths[1]);
     readToUpdate->clip(context.clipping);
+    if (NULL != context.trimmer) {
+        context.trimmer->trim(readToUpdate);
+    }
     readToUpdate->setBatch(data->getBatch());
     readToUpdate->setReadGroup(context.defaultReadGroup);
 
@@ -510,11 +648,28 @@ PairedFASTQReader::create(
     int bufferCount,
     _int64 startingOffset,
     _int64 amountOfFileToProcess,
-    const ReaderContext& context)
+    const ReaderContext& context,
+    FASTQRecordIndex * const *recordIndices)
 {
     PairedFASTQReader *reader = new PairedFASTQReader;
-    reader->readers[0] = FASTQReader::create(supplier, fileName0, bufferCount, startingOffset, amountOfFileToProcess, context);
-    reader->readers[1] = FASTQReader::create(supplier, fileName1, bufferCount, startingOffset, amountOfFileToProcess, context);
+    if (NULL != recordIndices) {
+        reader->recordIndices[0] = recordIndices[0];
+        reader->recordIndices[1] = recordIndices[1];
+    }
+
+    _int64 fileStartingOffset[2], fileAmountToProcess[2];
+    if (!reader->fileRanges(startingOffset, amountOfFileToProcess, fileStartingOffset, fileAmountToProcess)) {
+        //
+        // The readers still need a range, even though they won't get to read it.
+        //
+        for (int i = 0; i < 2; i++) {
+            fileAmountToProcess[i] = 1;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        reader->readers[i] = FASTQReader::create(supplier, i == 0 ? fileName0 : fileName1, bufferCount, fileStartingOffset[i], fileAmountToProcess[i], context);
+    }
 
     for (int i = 0; i < 2; i++) {
         if (NULL == reader->readers[i]) {
@@ -527,9 +682,39 @@ PairedFASTQReader::create(
     return reader;
 }
 
+    bool
+PairedFASTQReader::fileRanges(_int64 startingOffset, _int64 amountOfFileToProcess, _int64 *fileStartingOffset, _int64 *fileAmountToProcess)
+{
+    emptyRange = false;
+    if (NULL == recordIndices[0]) {
+        for (int i = 0; i < 2; i++) {
+            fileStartingOffset[i] = startingOffset;
+            fileAmountToProcess[i] = amountOfFileToProcess;
+        }
+        return true;
+    }
+
+    _int64 firstCheckpoint, endCheckpoint;
+    recordIndices[0]->checkpointRange(startingOffset, amountOfFileToProcess, &firstCheckpoint, &endCheckpoint);
+    if (firstCheckpoint == endCheckpoint) {
+        emptyRange = true;
+        return false;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        fileStartingOffset[i] = recordIndices[i]->getCheckpointOffset(firstCheckpoint);
+        fileAmountToProcess[i] = recordIndices[i]->getCheckpointOffset(endCheckpoint) - fileStartingOffset[i];
+    }
+    return true;
+}
+
     bool
 PairedFASTQReader::getNextReadPair(Read *read0, Read *read1)
 {
+    if (emptyRange) {
+        return false;
+    }
+
     bool worked = readers[0]->getNextRead(read0);
  
     if (readers[1]->getNextRead(read1) != worked) {
@@ -550,9 +735,12 @@ PairedFASTQReader::createPairedReadSupplierGenerator(
 {
     const char *fileNames[2] = {fileName0, fileName1};
     //
-    // Decide whether to use the range splitter or a queue based on whether the files are the same size.
+    // Decide whether to use the range splitter or a queue based on whether the files are the same size, or failing that,
+    // have record indices.
     //
-    if (!strcmp("-", fileNames[0]) || !strcmp("-", fileNames[1]) || QueryFileSize(fileNames[0]) != QueryFileSize(fileNames[1]) || gzip) {
+    FASTQRecordIndex *recordIndices[2] = {NULL, NULL};
+    if (!strcmp("-", fileNames[0]) || !strcmp("-", fileNames[1]) || gzip ||
+        (DataSupplier::InputFileSize(fileNames[0]) != DataSupplier::InputFileSize(fileNames[1]) && !FASTQRecordIndex::LoadPair(fileName0, fileName1, recordIndices))) {
         //WriteStatusMessage("FASTQ using supplier queue\n");
         DataSupplier* dataSupplier[2];
         size_t fileSize[2];
@@ -566,9 +754,9 @@ PairedFASTQReader::createPairedReadSupplierGenerator(
                     dataSupplier[i] = DataSupplier::Stdio;
                 }
             } else {
-                fileSize[i] = QueryFileSize(fileNames[i]);
+                fileSize[i] = DataSupplier::InputFileSize(fileNames[i]);
                 if (gzip) {
-                    dataSupplier[i] = DataSupplier::GzipDefault;
+                    dataSupplier[i] = DataSupplier::CompressedDefaultForFile(fileNames[i]);
                 } else {
                     dataSupplier[i] = DataSupplier::Default;
                 }
@@ -589,8 +777,264 @@ PairedFASTQReader::createPairedReadSupplierGenerator(
         return queue;
     } else {
         //WriteStatusMessage("FASTQ using range splitter\n");
-        return new RangeSplittingPairedReadSupplierGenerator(fileName0, fileName1, FASTQFile, numThreads, false, context);
+        return new RangeSplittingPairedReadSupplierGenerator(fileName0, fileName1, FASTQFile, numThreads, false, context, DataSupplier::Default,
+            NULL == recordIndices[0] ? NULL : recordIndices);
+    }
+}
+
+static const _uint64 FASTQRecordIndexMagic = 0x5844495150414e53;    // "SNAPQIDX" as little endian bytes
+static const _uint64 FASTQRecordIndexVersion = 1;
+
+bool FASTQRecordIndex::BuildMissing = false;
+
+FASTQRecordIndex::~FASTQRecordIndex()
+{
+    delete[] offsets;
+}
+
+    char *
+FASTQRecordIndex::SidecarFileName(const char *fastqFileName)
+{
+    size_t size = strlen(fastqFileName) + 7;
+    char *sidecarFileName = new char[size];
+    snprintf(sidecarFileName, size, "%s.fqidx", fastqFileName);
+    return sidecarFileName;
+}
+
+    FASTQRecordIndex *
+FASTQRecordIndex::load(const char *fastqFileName)
+{
+    char *sidecarFileName = SidecarFileName(fastqFileName);
+    FILE *file = fopen(sidecarFileName, "rb");
+    if (NULL == file) {
+        delete[] sidecarFileName;
+        return NULL;
+    }
+
+    FASTQRecordIndex *index = NULL;
+    _uint64 header[6];
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != FASTQRecordIndexMagic || header[1] != FASTQRecordIndexVersion) {
+        WriteErrorMessage("'%s' isn't a FASTQ record index, ignoring it\n", sidecarFileName);
+    } else if ((_int64)header[2] != QueryFileSize(fastqFileName)) {
+        WriteErrorMessage("The FASTQ record index '%s' is for a different version of '%s', ignoring it\n", sidecarFileName, fastqFileName);
+    } else {
+        index = new FASTQRecordIndex();
+        index->fileSize = (_int64)header[2];
+        index->recordsPerCheckpoint = (_int64)header[3];
+        index->nRecords = (_int64)header[4];
+        index->nCheckpoints = (_int64)header[5];
+        index->offsets = new _int64[index->nCheckpoints + 1];
+        if (fread(index->offsets, sizeof(_int64), index->nCheckpoints + 1, file) != (size_t)index->nCheckpoints + 1 || index->offsets[index->nCheckpoints] != index->fileSize) {
+            WriteErrorMessage("FASTQ record index '%s' is truncated, ignoring it\n", sidecarFileName);
+            delete index;
+            index = NULL;
+        }
+    }
+
+    fclose(file);
+    delete[] sidecarFileName;
+    return index;
+}
+
+    FASTQRecordIndex *
+FASTQRecordIndex::build(const char *fastqFileName, _int64 recordsPerCheckpoint)
+/*++
+
+Routine Description:
+
+    Read through the file finding the newlines with the same vector kernel that the FASTQ reader uses, and note where every
+    recordsPerCheckpoint'th record starts.  It's bound by how fast the file reads, so it doesn't bother with more than one
+    thread (LoadPair does the two files of a pair at once, though).
+
+--*/
+{
+    FILE *file = fopen(fastqFileName, "rb");
+    if (NULL == file) {
+        WriteErrorMessage("FASTQRecordIndex: unable to open '%s'\n", fastqFileName);
+        return NULL;
+    }
+
+    FASTQRecordIndex *index = new FASTQRecordIndex();
+    index->fileSize = QueryFileSize(fastqFileName);
+    index->recordsPerCheckpoint = recordsPerCheckpoint;
+
+    _int64 maxCheckpoints = index->fileSize / (4 * recordsPerCheckpoint) + 1;     // Every record is at least four bytes (four newlines)
+    index->offsets = new _int64[maxCheckpoints + 1];
+    index->offsets[0] = 0;
+
+    const size_t bufferSize = 16 * 1024 * 1024;
+    char *buffer = (char *)BigAlloc(bufferSize);
+    const int maxNewlines = 256;
+    _int64 newlineOffsets[maxNewlines];
+    _int64 nLines = 0;
+    _int64 bufferFileOffset = 0;
+    _int64 nRecordStarts = 1;   // Including where the one after the last would be
+    size_t bytesRead;
+
+    while ((bytesRead = fread(buffer, 1, bufferSize, file)) > 0) {
+        _int64 scanned = 0;
+        for (;;) {
+            int nNewlines = (*FindNewlines)(buffer + scanned, bytesRead - scanned, newlineOffsets, maxNewlines);
+            if (0 == nNewlines) {
+                break;
+            }
+
+            for (int i = 0; i < nNewlines; i++) {
+                nLines++;
+                if (0 == nLines % FASTQReader::nLinesPerFastqQuery) {
+                    if (0 == nRecordStarts % recordsPerCheckpoint) {
+                        index->offsets[nRecordStarts / recordsPerCheckpoint] = bufferFileOffset + scanned + newlineOffsets[i] + 1;
+                    }
+                    nRecordStarts++;
+                }
+            }
+            scanned += newlineOffsets[nNewlines - 1] + 1;
+        }
+        bufferFileOffset += bytesRead;
+    }
+
+    bool worked = !ferror(file) && bufferFileOffset == index->fileSize;
+    fclose(file);
+    BigDealloc(buffer);
+
+    if (!worked) {
+        WriteErrorMessage("FASTQRecordIndex: error reading '%s'\n", fastqFileName);
+        delete index;
+        return NULL;
+    }
+
+    //
+    // The last record normally ends in a newline, in which case the last record start is the end of the file.  If it doesn't,
+    // it still counts.
+    //
+    index->nRecords = nRecordStarts - ((nLines % FASTQReader::nLinesPerFastqQuery == 0) ? 1 : 0);
+    index->nCheckpoints = (index->nRecords + recordsPerCheckpoint - 1) / recordsPerCheckpoint;
+    index->offsets[index->nCheckpoints] = index->fileSize;
+    return index;
+}
+
+    bool
+FASTQRecordIndex::save(const char *fastqFileName) const
+{
+    char *sidecarFileName = SidecarFileName(fastqFileName);
+    FILE *file = fopen(sidecarFileName, "wb");
+    if (NULL == file) {
+        WriteErrorMessage("FASTQRecordIndex: unable to open '%s' for write\n", sidecarFileName);
+        delete[] sidecarFileName;
+        return false;
+    }
+
+    _uint64 header[] = {FASTQRecordIndexMagic, FASTQRecordIndexVersion, (_uint64)fileSize, (_uint64)recordsPerCheckpoint, (_uint64)nRecords, (_uint64)nCheckpoints};
+    bool worked = fwrite(header, sizeof(header), 1, file) == 1 && fwrite(offsets, sizeof(_int64), nCheckpoints + 1, file) == (size_t)nCheckpoints + 1;
+    worked = (0 == fclose(file)) && worked;
+
+    if (!worked) {
+        WriteErrorMessage("FASTQRecordIndex: unable to write '%s'\n", sidecarFileName);
+        DeleteSingleFile(sidecarFileName);
     }
+
+    delete[] sidecarFileName;
+    return worked;
+}
+
+    void
+FASTQRecordIndex::BuildThreadMain(void *param)
+{
+    BuildContext *context = (BuildContext *)param;
+    context->index = build(context->fileName);
+    SignalSingleWaiterObject(context->doneObject);
+}
+
+    bool
+FASTQRecordIndex::LoadPair(const char *fileName0, const char *fileName1, FASTQRecordIndex **indices)
+{
+    const char *fileNames[2] = {fileName0, fileName1};
+    for (int i = 0; i < 2; i++) {
+        indices[i] = load(fileNames[i]);
+    }
+
+    if ((NULL == indices[0] || NULL == indices[1]) && BuildMissing) {
+        //
+        // Scan the second file on another thread while this one does the first.
+        //
+        WriteStatusMessage("Building FASTQ record indices for '%s' and '%s'\n", fileName0, fileName1);
+        _int64 start = timeInMillis();
+
+        SingleWaiterObject doneObject;
+        CreateSingleWaiterObject(&doneObject);
+        BuildContext context;
+        context.fileName = fileName1;
+        context.index = indices[1];
+        context.doneObject = &doneObject;
+
+        bool threadStarted = NULL == indices[1] && StartNewThread(BuildThreadMain, &context);
+        if (NULL == indices[0]) {
+            indices[0] = build(fileName0);
+        }
+
+        if (threadStarted) {
+            WaitForSingleWaiterObject(&doneObject);
+            indices[1] = context.index;
+        } else if (NULL == indices[1]) {
+            indices[1] = build(fileName1);
+        }
+        DestroySingleWaiterObject(&doneObject);
+
+        //
+        // Not being able to save them (say, because the input is in a read-only directory) just means building them again next time.
+        //
+        for (int i = 0; i < 2; i++) {
+            if (NULL != indices[i]) {
+                indices[i]->save(fileNames[i]);
+            }
+        }
+
+        WriteStatusMessage("Built FASTQ record indices in %llds\n", (timeInMillis() + 500 - start) / 1000);
+    }
+
+    if (NULL != indices[0] && NULL != indices[1] && !indices[0]->matches(indices[1])) {
+        WriteErrorMessage("The FASTQ record indices of '%s' and '%s' have different numbers of reads (%lld and %lld), not using them\n", fileName0, fileName1,
+            indices[0]->nRecords, indices[1]->nRecords);
+        delete indices[0];
+        indices[0] = NULL;
+    }
+
+    if (NULL == indices[0] || NULL == indices[1]) {
+        for (int i = 0; i < 2; i++) {
+            delete indices[i];
+            indices[i] = NULL;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+    bool
+FASTQRecordIndex::CanSplitPair(const char *fileName0, const char *fileName1)
+{
+    if (BuildMissing) {
+        return true;
+    }
+
+    FASTQRecordIndex *indices[2];
+    bool canSplit = LoadPair(fileName0, fileName1, indices);
+    for (int i = 0; i < 2; i++) {
+        delete indices[i];
+    }
+    return canSplit;
+}
+
+    void
+FASTQRecordIndex::checkpointRange(_int64 startingOffset, _int64 amountOfFileToProcess, _int64 *firstCheckpoint, _int64 *endCheckpoint) const
+{
+    _int64 endOffset = 0 == amountOfFileToProcess ? fileSize : __min(fileSize, startingOffset + amountOfFileToProcess);
+
+    //
+    // The first checkpoint at or after each end, with offsets[nCheckpoints] being the end of the file.
+    //
+    *firstCheckpoint = std::lower_bound(offsets, offsets + nCheckpoints, startingOffset) - offsets;
+    *endCheckpoint = std::lower_bound(offsets, offsets + nCheckpoints, endOffset) - offsets;
 }
 
     ReadSupplierGenerator *
@@ -606,6 +1050,16 @@ FASTQReader::createReadSupplierGenerator(
         // Single ended uncompressed FASTQ files can be handled by a range splitter.
         //
         return new RangeSplittingReadSupplierGenerator(fileName, false, numThreads, context);
+    } else if (! isStdin && DataSupplier::IsBgzfFile(fileName)) {
+        //
+        // So can BGZF files, with each thread inflating the blocks in its own ranges.
+        //
+        return new RangeSplittingReadSupplierGenerator(fileName, false, numThreads, context, DataSupplier::BgzfRangeDefault);
+    } else if (! isStdin && DataSupplier::IsSeekableZstdFile(fileName)) {
+        //
+        // And seekable zstd files, a frame at a time.
+        //
+        return new RangeSplittingReadSupplierGenerator(fileName, false, numThreads, context, DataSupplier::ZstdRangeDefault);
     } else {
         ReadReader* fastq;
         //
@@ -618,7 +1072,7 @@ FASTQReader::createReadSupplierGenerator(
                 fastq = FASTQReader::create(DataSupplier::Stdio, fileName, ReadSupplierQueue::BufferCount(numThreads), 0, 0, context);
             }
         } else {
-            fastq = FASTQReader::create(DataSupplier::GzipDefault, fileName, ReadSupplierQueue::BufferCount(numThreads), 0, QueryFileSize(fileName), context);
+            fastq = FASTQReader::create(DataSupplier::CompressedDefaultForFile(fileName), fileName, ReadSupplierQueue::BufferCount(numThreads), 0, DataSupplier::InputFileSize(fileName), context);
         }
         if (fastq == NULL) {
             delete fastq;
@@ -639,7 +1093,16 @@ PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(
 {
      bool isStdin = !strcmp(fileName,"-");
  
-     if (gzip || isStdin) {
+     if (gzip && ! isStdin && DataSupplier::IsBgzfFile(fileName)) {
+        //
+        // Interleaved pairs come from one file, so a BGZF one can be range split.
+        //
+        return new RangeSplittingPairedReadSupplierGenerator(fileName, NULL, InterleavedFASTQFile, numThreads, false, context,
+            DataSupplier::BgzfRangeDefault);
+     } else if (gzip && ! isStdin && DataSupplier::IsSeekableZstdFile(fileName)) {
+        return new RangeSplittingPairedReadSupplierGenerator(fileName, NULL, InterleavedFASTQFile, numThreads, false, context,
+            DataSupplier::ZstdRangeDefault);
+     } else if (gzip || isStdin) {
         //WriteStatusMessage("PairedInterleavedFASTQ using supplier queue\n");
         DataSupplier *dataSupplier;
         if (isStdin) {
@@ -649,11 +1112,11 @@ PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(
                 dataSupplier = DataSupplier::Stdio;
             }
         } else {
-            dataSupplier = DataSupplier::GzipDefault;
+            dataSupplier = DataSupplier::CompressedDefaultForFile(fileName);
         }
         
         PairedReadReader *reader = PairedInterleavedFASTQReader::create(dataSupplier, fileName,
-            ReadSupplierQueue::BufferCount(numThreads), 0,(stdin ? 0 : QueryFileSize(fileName)),context);
+            ReadSupplierQueue::BufferCount(numThreads), 0, (isStdin ? 0 : DataSupplier::InputFileSize(fileName)), context);
  
         if (NULL == reader ) {
             delete reader;
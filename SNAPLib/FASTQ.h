@@ -68,7 +68,19 @@ public:
 
         static bool skipPartialRecord(DataReader *data);
 
+        //
+        // Fill in newlineOffsets with the offsets of up to maxNewlines newlines in the first length bytes of buffer, stopping
+        // at a NUL, and return how many there were.  One of these is picked at startup for the processor; they're public so
+        // the tests can check them against each other.
+        //
+        typedef int (*FindNewlinesFunction)(const char *buffer, _int64 length, _int64 *newlineOffsets, int maxNewlines);
+
+        static int FindNewlinesScalar(const char *buffer, _int64 length, _int64 *newlineOffsets, int maxNewlines);
+        static int FindNewlinesVector16(const char *buffer, _int64 length, _int64 *newlineOffsets, int maxNewlines);
+        static int FindNewlinesAVX2(const char *buffer, _int64 length, _int64 *newlineOffsets, int maxNewlines);   // x86 only
+
 private:
+        friend class FASTQRecordIndex;
 
         static const int maxReadSizeInBytes = MAX_READ_LENGTH * 2 + 1000;    // Read as in sequencer read, not read-from-the-filesystem.  +1000 is for ID string, + line, newlines, etc.
 
@@ -130,19 +142,105 @@ private:
         ReaderContext           context;
 };
 
+//
+// The record index sidecar (file.fastq.fqidx, made by -fqidx) of a FASTQ file: the byte offset of every RecordsPerCheckpoint'th
+// record.  The two files of a pair that aren't the same size (because their reads aren't all the same length, say after
+// trimming) can't be split into matching byte ranges the way that files that are the same size can, so they'd have to go
+// through a ReadSupplierQueue with one reader thread per file.  With their record indices, a byte range of the first file
+// becomes the checkpoints that start in it, and those are the same records in both files, so they can be range split too.
+//
+// The file is a header of _uint64s (magic, version, fileSize, recordsPerCheckpoint, nRecords, nCheckpoints), then
+// nCheckpoints + 1 _int64 offsets, the last of which is the file size.
+//
+class FASTQRecordIndex {
+public:
+        ~FASTQRecordIndex();
+
+        //
+        // NULL if there's no sidecar for the file, or it's for a different version of it.
+        //
+        static FASTQRecordIndex *load(const char *fastqFileName);
+
+        //
+        // Scan the file for its records.  FASTQ records are four lines, so that's finding every fourth newline.
+        //
+        static FASTQRecordIndex *build(const char *fastqFileName, _int64 recordsPerCheckpoint = DefaultRecordsPerCheckpoint);
+
+        bool save(const char *fastqFileName) const;
+
+        //
+        // Fill in indices with the record indices of both files of a pair, from their sidecars or, with BuildMissing, by
+        // scanning the files (both at once) and saving what that finds for next time.  False if they're missing or don't
+        // match, in which case the pair can't be range split.
+        //
+        static bool LoadPair(const char *fileName0, const char *fileName1, FASTQRecordIndex **indices);
+
+        //
+        // Whether LoadPair would work, without scanning anything.
+        //
+        static bool CanSplitPair(const char *fileName0, const char *fileName1);
+
+        //
+        // The checkpoints that start in a byte range of the file (amountOfFileToProcess 0 meaning the rest of it), as a
+        // half open range of checkpoint numbers.  Like a reader's range, each record belongs to the range it starts in.
+        //
+        void checkpointRange(_int64 startingOffset, _int64 amountOfFileToProcess, _int64 *firstCheckpoint, _int64 *endCheckpoint) const;
+
+        _int64 getCheckpointOffset(_int64 whichCheckpoint) const {
+            _ASSERT(whichCheckpoint >= 0 && whichCheckpoint <= nCheckpoints);
+            return offsets[whichCheckpoint];
+        }
+
+        static bool BuildMissing;   // -fqidx
+
+        static const _int64 DefaultRecordsPerCheckpoint = 64;
+
+private:
+        FASTQRecordIndex() : fileSize(0), recordsPerCheckpoint(0), nRecords(0), nCheckpoints(0), offsets(NULL) {}
+
+        static char *SidecarFileName(const char *fastqFileName);  // new[]ed
+
+        bool matches(const FASTQRecordIndex *peer) const {
+            return recordsPerCheckpoint == peer->recordsPerCheckpoint && nRecords == peer->nRecords;
+        }
+
+        struct BuildContext {
+            const char          *fileName;
+            FASTQRecordIndex    *index;
+            SingleWaiterObject  *doneObject;
+        };
+
+        static void BuildThreadMain(void *param);
+
+        _int64      fileSize;
+        _int64      recordsPerCheckpoint;
+        _int64      nRecords;
+        _int64      nCheckpoints;
+        _int64     *offsets;        // nCheckpoints + 1 of them
+};
+
 class PairedFASTQReader: public PairedReadReader {
 public:
         virtual ~PairedFASTQReader();
 
 
+        //
+        // With recordIndices (which the caller owns), the ranges are of the first file, and get moved to the records that
+        // start in them in each file.
+        //
         static PairedFASTQReader* create(DataSupplier* supplier, const char *fileName0, const char *fileName1,
-                                         int bufferCount, _int64 startingOffset, _int64 amountOfFileToProcess, const ReaderContext& context);
+                                         int bufferCount, _int64 startingOffset, _int64 amountOfFileToProcess, const ReaderContext& context,
+                                         FASTQRecordIndex * const *recordIndices = NULL);
 
         virtual bool getNextReadPair(Read *read0, Read *read1);
 
         virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess) {
+            _int64 fileStartingOffset[2], fileAmountToProcess[2];
+            if (!fileRanges(startingOffset, amountOfFileToProcess, fileStartingOffset, fileAmountToProcess)) {
+                return;
+            }
             for (int i = 0; i < 2; i++) {
-                readers[i]->reinit(startingOffset,amountOfFileToProcess);
+                readers[i]->reinit(fileStartingOffset[i], fileAmountToProcess[i]);
             }
         }
 
@@ -165,14 +263,23 @@ public:
 
 private:
 
-        PairedFASTQReader()
+        PairedFASTQReader() : emptyRange(false)
         {
             for (int i =0; i < 2; i++) {
                 readers[i] = NULL;
+                recordIndices[i] = NULL;
             }
         }
 
+        //
+        // Each file's part of a range, which is the range itself without record indices.  Sets emptyRange, and returns false
+        // if it is, since a reader takes an amount of 0 to mean the rest of the file.
+        //
+        bool fileRanges(_int64 startingOffset, _int64 amountOfFileToProcess, _int64 *fileStartingOffset, _int64 *fileAmountToProcess);
+
         FASTQReader *readers[2];
+        const FASTQRecordIndex *recordIndices[2];
+        bool emptyRange;            // The range has no checkpoints in it, and so no records
 };
 
 
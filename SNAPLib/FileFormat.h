@@ -47,6 +47,9 @@ public:
 
     virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, GenomeDistance* o_readBytes, int* o_refID = NULL, int* o_pos = NULL) const = 0;
 
+    // the read name (QNAME) of the record in buffer, for sorting by name; not null terminated
+    virtual void getReadName(char* buffer, _int64 bytes, const char** o_name, size_t* o_nameLength) const = 0;
+
     /*
 
     virtual ReadReader* createReader(const DataSupplier* supplier, const char *fileName,
@@ -87,7 +90,7 @@ public:
 
     virtual bool writeHeader(
         const ReaderContext& context, char *header, size_t headerBufferSize, size_t *headerActualSize,
-        bool sorted, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) const = 0;
+        SortOrder sortOrder, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) const = 0;
 
     virtual bool writeRead(
         const ReaderContext& context, LandauVishkinWithCigar * lv, char * buffer, size_t bufferSpace,
@@ -103,6 +106,7 @@ public:
 
     static const FileFormat* SAM[2]; // 0 for =, 1 for M (useM flag)
     static const FileFormat* BAM[2];
+    static const FileFormat* CRAM[2];
     static const FileFormat* FASTQ;
     static const FileFormat* FASTQZ;
 };
@@ -27,6 +27,10 @@ Revision History:
 #include "Compat.h"
 #include "GenericFile.h"
 #include "GenericFile_stdio.h"
+#include "GenericFile_packed.h"
+#include <zlib.h>
+#include "Error.h"
+#include "exit.h"
 
 #ifdef SNAP_HDFS
 # include "GenericFile_HDFS.h"
@@ -59,6 +63,8 @@ GenericFile *GenericFile::open(const char *filename, Mode mode)
 		fprintf(stderr, "SNAP not compiled with HDFS support. Set HADOOP_HOME and recompile.\n");
 		retval = NULL;
 #endif
+	} else if (ReadOnly == mode && GenericFile_packed::IsPackedFile(filename)) {
+		retval = GenericFile_packed::open(filename);
 	} else {
         retval = GenericFile_stdio::open(filename, mode);
 	}
@@ -96,6 +102,20 @@ char *GenericFile::_gets_impl(char *buf, size_t count)
 	_int64
 GenericFile::prefetch()
 {
+	//
+	// Files that know their offset are read the way readInParallel does it, but into a scratch buffer per thread,
+	// since all this is for is getting them into the page cache.
+	//
+	_int64 startOffset = tell();
+	if (startOffset >= 0 && NULL != _filename && ReadOnly == _mode) {
+		size_t count = (size_t)__max(QueryFileSize(_filename) - startOffset, (_int64)0);
+		unsigned nThreads = (unsigned)__min((size_t)MaxParallelReadThreads, count / MinParallelReadChunk);
+		if (nThreads >= 2) {
+			advance(ParallelRead(startOffset, NULL, count, nThreads));
+			return 0;
+		}
+	}
+
 	const size_t ioSize = 128 * 1024 * 1024;
 
 	char *buffer = new char[ioSize];
@@ -106,4 +126,172 @@ GenericFile::prefetch()
 			return 0;
 		}
 	}
-}
\ No newline at end of file
+}
+
+	_int64
+GenericFile::tell()
+{
+	return -1;
+}
+
+	size_t
+GenericFile::readInParallel(void *ptr, size_t count, _uint32 *o_checksum)
+{
+	_int64 startOffset = tell();
+	unsigned nThreads = (unsigned)__min((size_t)MaxParallelReadThreads, count / MinParallelReadChunk);
+	if (startOffset < 0 || nThreads < 2 || NULL == _filename || ReadOnly != _mode) {
+		return readAndChecksum(ptr, count, o_checksum);
+	}
+
+	size_t totalRead = ParallelRead(startOffset, (char *)ptr, count, nThreads, o_checksum);
+	advance(totalRead);
+	return totalRead;
+}
+
+	size_t
+GenericFile::readAndChecksum(void *ptr, size_t count, _uint32 *o_checksum)
+{
+	if (NULL != ptr) {
+		size_t amountRead = read(ptr, count);
+		if (NULL != o_checksum) {
+			*o_checksum = (size_t)-1 == amountRead ? 0 : Checksum(ptr, amountRead);
+		}
+		return amountRead;
+	}
+
+	//
+	// Nowhere to put it, so read it a piece at a time.
+	//
+	const size_t ioSize = 32 * 1024 * 1024;
+	char *scratch = new char[__max((size_t)1, __min(ioSize, count))];
+	size_t totalRead = 0;
+	_uint32 checksum = 0;
+	while (totalRead < count) {
+		size_t amountRead = read(scratch, __min(ioSize, count - totalRead));
+		if (0 == amountRead || (size_t)-1 == amountRead) {
+			break;
+		}
+		checksum = Checksum(scratch, amountRead, checksum);
+		totalRead += amountRead;
+	}
+	delete[] scratch;
+	if (NULL != o_checksum) {
+		*o_checksum = checksum;
+	}
+	return totalRead;
+}
+
+	_uint32
+GenericFile::Checksum(const void *ptr, size_t count, _uint32 crc)
+{
+	//
+	// zlib takes a uInt length, so big buffers go in pieces.
+	//
+	const size_t maxPiece = 1024 * 1024 * 1024;
+	const Bytef *next = (const Bytef *)ptr;
+	while (count > 0) {
+		size_t piece = __min(count, maxPiece);
+		crc = (_uint32)crc32(crc, next, (uInt)piece);
+		next += piece;
+		count -= piece;
+	}
+	return crc;
+}
+
+	_uint32
+GenericFile::CombineChecksums(_uint32 crc1, _uint32 crc2, size_t count2)
+{
+	//
+	// The combination is crc1 advanced over count2 zeros, xored with crc2.  z_off_t may be 32 bits, so big counts
+	// advance in pieces.
+	//
+	const size_t maxPiece = 1024 * 1024 * 1024;
+	while (count2 > maxPiece) {
+		crc1 = (_uint32)crc32_combine(crc1, 0, (z_off_t)maxPiece);
+		count2 -= maxPiece;
+	}
+	return (_uint32)crc32_combine(crc1, crc2, (z_off_t)count2);
+}
+
+	size_t
+GenericFile::ParallelRead(_int64 startOffset, char *buffer, size_t count, unsigned nThreads, _uint32 *o_checksum)
+{
+	ParallelReadContext *contexts = new ParallelReadContext[nThreads];
+	SingleWaiterObject doneObject;
+	CreateSingleWaiterObject(&doneObject);
+	volatile int runningThreadCount = nThreads;
+
+	size_t chunkSize = (count + nThreads - 1) / nThreads;
+	for (unsigned i = 0; i < nThreads; i++) {
+		contexts[i].fileName = _filename;
+		contexts[i].fileOffset = startOffset + (_int64)(i * chunkSize);
+		contexts[i].buffer = NULL == buffer ? NULL : buffer + i * chunkSize;
+		contexts[i].count = __min(chunkSize, count - i * chunkSize);
+		contexts[i].amountRead = 0;
+		contexts[i].computeChecksum = NULL != o_checksum;
+		contexts[i].checksum = 0;
+		contexts[i].doneObject = &doneObject;
+		contexts[i].runningThreadCount = &runningThreadCount;
+		if (!StartNewThread(ParallelReadThreadMain, &contexts[i])) {
+			WriteErrorMessage("Unable to start file read thread\n");
+			soft_exit(1);
+		}
+	}
+
+	WaitForSingleWaiterObject(&doneObject);
+	DestroySingleWaiterObject(&doneObject);
+
+	//
+	// Like read, return only what we got before the first short read.
+	//
+	size_t totalRead = 0;
+	_uint32 checksum = 0;
+	for (unsigned i = 0; i < nThreads; i++) {
+		totalRead += contexts[i].amountRead;
+		checksum = CombineChecksums(checksum, contexts[i].checksum, contexts[i].amountRead);
+		if (contexts[i].amountRead != contexts[i].count) {
+			break;
+		}
+	}
+	delete[] contexts;
+
+	if (NULL != o_checksum) {
+		*o_checksum = checksum;
+	}
+
+	return totalRead;
+}
+
+	void
+GenericFile::ParallelReadThreadMain(void *param)
+{
+	ParallelReadContext *context = (ParallelReadContext *)param;
+
+	GenericFile *file = GenericFile::open(context->fileName, ReadOnly);
+	if (NULL != file && 0 == file->advance(context->fileOffset)) {
+		const size_t ioSize = 32 * 1024 * 1024;
+		char *scratch = NULL == context->buffer ? new char[ioSize] : NULL;	// For prefetch, which doesn't keep the data
+		while (context->amountRead < context->count) {
+			size_t amountToRead = __min(ioSize, context->count - context->amountRead);
+			char *readInto = NULL == scratch ? context->buffer + context->amountRead : scratch;
+			size_t amountRead = file->read(readInto, amountToRead);
+			if (0 == amountRead || (size_t)-1 == amountRead) {
+				break;
+			}
+			if (context->computeChecksum) {
+				context->checksum = Checksum(readInto, amountRead, context->checksum);
+			}
+			context->amountRead += amountRead;
+		}
+		delete[] scratch;
+	}
+
+	if (NULL != file) {
+		file->close();
+		delete file;
+	}
+
+	if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+		SignalSingleWaiterObject(context->doneObject);
+	}
+}
@@ -37,6 +37,7 @@ public:
 
 	// Factory that returns either:
     //   * a GenericFile_HDFS object if the filename starts with "hdfs://"
+    //   * a GenericFile_packed object for reading a file written by GenericFile_packed::PackFile (index -pack)
     //   * a GenericFile_stdio object otherwise
     static GenericFile *open(const char *fileName, Mode mode);
 
@@ -57,6 +58,22 @@ public:
 	// Advance forward or back by byteOffset bytes in the file.
 	virtual int advance(long long byteOffset) = 0;
 
+	// Return the current offset in the file, or -1 if this kind of file doesn't know it.
+	virtual _int64 tell();
+
+	// Like read, but for big reads of files that know their offset, splits the read among several threads
+	// each with its own handle on the file, so that storage that needs several requests in flight to reach
+	// its bandwidth (NVMe, network file systems) gets them.  The data goes straight into 'ptr', or is discarded if
+	// 'ptr' is NULL.  If 'o_checksum' isn't NULL, it gets the CRC-32 (zlib's) of what was read, each thread taking
+	// its own part as it reads it.
+	virtual size_t readInParallel(void *ptr, size_t count, _uint32 *o_checksum = NULL);
+
+	// The CRC-32 of count bytes at ptr, continuing from crc.
+	static _uint32 Checksum(const void *ptr, size_t count, _uint32 crc = 0);
+
+	// The CRC-32 of two pieces, from each one's CRC-32 and the length of the second.
+	static _uint32 CombineChecksums(_uint32 crc1, _uint32 crc2, size_t count2);
+
     // Close the file.
 	virtual void close() = 0;
 
@@ -69,6 +86,33 @@ public:
 
 protected:
 	char *_gets_impl(char *buf, size_t count);
+
+	// readInParallel for reads that aren't worth the threads: just read, into a scratch buffer if ptr is NULL.
+	size_t readAndChecksum(void *ptr, size_t count, _uint32 *o_checksum);
+
+	static const unsigned MaxParallelReadThreads = 8;
+	static const size_t MinParallelReadChunk = 64 * 1024 * 1024;	// Don't bother with a thread for less than this
+
+	//
+	// Read count bytes from startOffset on nThreads threads into buffer, or just into the page cache if buffer is NULL.
+	// Returns the amount read before the first short read, and the checksum of it if o_checksum isn't NULL.
+	//
+	size_t ParallelRead(_int64 startOffset, char *buffer, size_t count, unsigned nThreads, _uint32 *o_checksum = NULL);
+
+	struct ParallelReadContext {
+		const char			*fileName;
+		_int64				 fileOffset;
+		char				*buffer;			// NULL to discard the data
+		size_t				 count;
+		size_t				 amountRead;
+		bool				 computeChecksum;
+		_uint32				 checksum;			// Of this thread's amountRead
+		SingleWaiterObject	*doneObject;
+		volatile int		*runningThreadCount;
+	};
+
+	static void ParallelReadThreadMain(void *param);
+
 	GenericFile();
 	Mode _mode;
 	char *_filename;
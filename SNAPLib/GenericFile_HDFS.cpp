@@ -58,11 +58,8 @@ GenericFile_HDFS::~GenericFile_HDFS()
 {
 }
 
-GenericFile_HDFS *GenericFile_HDFS::open(const char *filename, Mode mode)
+hdfsFS GenericFile_HDFS::getFileSystem()
 {
-	GenericFile_HDFS *retval = new GenericFile_HDFS();
-	bool noFs = false;
-
 	AcquireExclusiveLock(&_staticLock);
 
 	if (NULL == _fs) {
@@ -73,13 +70,51 @@ GenericFile_HDFS *GenericFile_HDFS::open(const char *filename, Mode mode)
 
 		if (NULL == _fs) {
 			fprintf(stderr, "can't open HDFS");
-			noFs = true;
 		}
 	}
 
+	hdfsFS fs = _fs;
 	ReleaseExclusiveLock(&_staticLock);
+	return fs;
+}
+
+_int64 GenericFile_HDFS::getFileSize(const char *filename)
+{
+	hdfsFS fs = getFileSystem();
+	if (NULL == fs) {
+		return -1;
+	}
+
+	hdfsFileInfo *info = hdfsGetPathInfo(fs, filename);
+	if (NULL == info) {
+		return -1;
+	}
+	_int64 size = info->mSize;
+	hdfsFreeFileInfo(info, 1);
+	return size;
+}
+
+_int64 GenericFile_HDFS::getBlockSize(const char *filename)
+{
+	hdfsFS fs = getFileSystem();
+	if (NULL == fs) {
+		return -1;
+	}
+
+	hdfsFileInfo *info = hdfsGetPathInfo(fs, filename);
+	if (NULL == info) {
+		return -1;
+	}
+	_int64 blockSize = info->mBlockSize;
+	hdfsFreeFileInfo(info, 1);
+	return blockSize;
+}
+
+GenericFile_HDFS *GenericFile_HDFS::open(const char *filename, Mode mode)
+{
+	GenericFile_HDFS *retval = new GenericFile_HDFS();
 
-	if (noFs) {
+	if (NULL == getFileSystem()) {
 		goto fail;
 	}
 
@@ -43,6 +43,14 @@ public:
 	virtual void close();
 	virtual ~GenericFile_HDFS();
 
+	// The process's one connection to HDFS (see _fs), made the first time it's needed, or NULL if it can't be.
+	// For code that talks to libhdfs itself, like the HDFS DataReader.
+	static hdfsFS getFileSystem();
+
+	// The size of a file, and the size of the blocks it's stored in, or -1 if it can't be found.
+	static _int64 getFileSize(const char *filename);
+	static _int64 getBlockSize(const char *filename);
+
 private:
 	// private constructor -- must use factory
 	GenericFile_HDFS();
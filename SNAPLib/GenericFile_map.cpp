@@ -23,6 +23,7 @@ Revision History:
 
 #include "stdafx.h"
 #include "GenericFile_map.h"
+#include "BigAlloc.h"
 #include "Error.h"
 #include "exit.h"
 
@@ -30,7 +31,8 @@ GenericFile_map *GenericFile_map::open(const char *filename)
 {
 	size_t fileSize = QueryFileSize(filename);
 	void *contents;
-	MemoryMappedFile *mappedFile = OpenMemoryMappedFile(filename, 0, fileSize, &contents);
+	// -hp applies to mapped files too, where the OS can do it for them.
+	MemoryMappedFile *mappedFile = OpenMemoryMappedFile(filename, 0, fileSize, &contents, false, false, BigAllocUseHugePages);
 
 	return new GenericFile_map(mappedFile, contents, fileSize);
 }
@@ -57,15 +59,65 @@ GenericFile_map::~GenericFile_map()
 
 	_int64
 GenericFile_map::prefetch()
+/*++
+
+Routine Description:
+
+    Get all of the mapping into memory before returning, so that the threads that use it don't fault on it.  It's split
+    into ranges for several threads, since a cold file system serves several streams of faults (or a few big
+    populate requests) much faster than one thread walking the whole thing.
+
+--*/
 {
     AdviseMemoryMappedFilePrefetch(mappedFile);
-	int pageSize = getpagesize();
 
-	_int64 total = 0;
+	unsigned nThreads = (unsigned)__max((size_t)1, __min((size_t)__min(GetNumberOfProcessors(), MaxPrefetchThreads), fileSize / MinPrefetchRange));
+	PrefetchContext *contexts = new PrefetchContext[nThreads];
+	SingleWaiterObject doneObject;
+	CreateSingleWaiterObject(&doneObject);
+	volatile int runningThreadCount = nThreads;
+
+	size_t rangeSize = (fileSize + nThreads - 1) / nThreads;
+	for (unsigned i = 0; i < nThreads; i++) {
+		contexts[i].start = contents + i * rangeSize;
+		contexts[i].length = __min(rangeSize, fileSize - i * rangeSize);
+		contexts[i].total = 0;
+		contexts[i].doneObject = &doneObject;
+		contexts[i].runningThreadCount = &runningThreadCount;
+		if (!StartNewThread(PrefetchThreadMain, &contexts[i])) {
+			WriteErrorMessage("Unable to start prefetch thread\n");
+			soft_exit(1);
+		}
+	}
+
+	WaitForSingleWaiterObject(&doneObject);
+	DestroySingleWaiterObject(&doneObject);
 
-	for (size_t offset = 0; offset < fileSize / sizeof (_int64); offset += 4 ) {
-		total += ((_int64 *)contents)[offset];
+	_int64 total = 0;
+	for (unsigned i = 0; i < nThreads; i++) {
+		total += contexts[i].total;
 	}
+	delete[] contexts;
 
 	return total;		// We're returning this just to keep the compiler from optimizing away the whole thing.
 }
+
+	void
+GenericFile_map::PrefetchThreadMain(void *param)
+{
+	PrefetchContext *context = (PrefetchContext *)param;
+
+	//
+	// Without populate, a read of each page faults it in.
+	//
+	if (!PopulateMappedMemory(context->start, context->length)) {
+		size_t pageSize = getpagesize();
+		for (size_t offset = 0; offset < context->length; offset += pageSize) {
+			context->total += context->start[offset];
+		}
+	}
+
+	if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+		SignalSingleWaiterObject(context->doneObject);
+	}
+}
@@ -40,4 +40,17 @@ private:
 	MemoryMappedFile *mappedFile;
 	const char *contents;
 	size_t fileSize;
+
+	static const unsigned MaxPrefetchThreads = 16;
+	static const size_t MinPrefetchRange = 64 * 1024 * 1024;	// Don't bother with a thread for less than this
+
+	struct PrefetchContext {
+		const char			*start;
+		size_t				 length;
+		_int64				 total;
+		SingleWaiterObject	*doneObject;
+		volatile int		*runningThreadCount;
+	};
+
+	static void PrefetchThreadMain(void *param);
 };
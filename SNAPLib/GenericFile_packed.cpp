@@ -0,0 +1,498 @@
+/*++
+
+Module Name:
+
+    GenericFile_packed.cpp
+
+Abstract:
+
+    Reading (and writing) the compressed index files that index -pack makes.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "Compat.h"
+#include "GenericFile_packed.h"
+#include "GzipBlockCodec.h"
+#include "BigAlloc.h"
+#include "Error.h"
+#include "exit.h"
+#include "zlib.h"
+
+static const _uint64 PackedFileMagic = 0x4b43415050414e53;		// "SNAPPACK" as little endian bytes
+static const _uint64 PackedFileVersion = 1;
+static const unsigned PackedFileHeaderSize = 5;					// _uint64s, before the chunk offsets
+static const _uint64 MaxChunkSize = 1024 * 1024 * 1024;		// zlib's sizes are 32 bits
+
+	static bool
+DecompressChunk(GzipBlockDecompressor *decompressor, const char *input, size_t inputBytes, char *output, size_t outputBytes)
+{
+	size_t outputWritten;
+	if (NULL != decompressor && decompressor->decompressBlock(input, inputBytes, output, outputBytes, &outputWritten)) {
+		return outputWritten == outputBytes;
+	}
+
+	z_stream zstream;
+	memset(&zstream, 0, sizeof(zstream));
+	if (inflateInit2(&zstream, 15 + 16) != Z_OK) {
+		return false;
+	}
+	zstream.next_in = (Bytef *)input;
+	zstream.avail_in = (uInt)inputBytes;
+	zstream.next_out = (Bytef *)output;
+	zstream.avail_out = (uInt)outputBytes;
+	bool worked = inflate(&zstream, Z_FINISH) == Z_STREAM_END && zstream.total_out == outputBytes;
+	inflateEnd(&zstream);
+
+	return worked;
+}
+
+	static bool
+CompressChunk(GzipBlockCompressor *compressor, const char *input, size_t inputBytes, char *output, size_t outputBytes, size_t *o_outputWritten)
+{
+	if (NULL != compressor && compressor->compressBlock(false, input, inputBytes, output, outputBytes, o_outputWritten)) {
+		return true;
+	}
+
+	z_stream zstream;
+	memset(&zstream, 0, sizeof(zstream));
+	if (deflateInit2(&zstream, GzipBlockCompressor::DefaultLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return false;
+	}
+	zstream.next_in = (Bytef *)input;
+	zstream.avail_in = (uInt)inputBytes;
+	zstream.next_out = (Bytef *)output;
+	zstream.avail_out = (uInt)outputBytes;
+	bool worked = deflate(&zstream, Z_FINISH) == Z_STREAM_END;
+	*o_outputWritten = zstream.total_out;
+	deflateEnd(&zstream);
+
+	return worked;
+}
+
+	static size_t
+CompressedChunkBound(size_t inputBytes)
+{
+	return compressBound((uLong)inputBytes) + 64;	// compressBound is for a zlib header; gzip's is a little bigger
+}
+
+GenericFile_packed::GenericFile_packed() : _file(NULL), uncompressedSize(0), chunkSize(0), nChunks(0), chunkOffsets(NULL), maxCompressedChunkSize(0),
+	position(0), chunk(NULL), compressedChunk(NULL), whichChunkLoaded(0), decompressor(NULL)
+{
+}
+
+GenericFile_packed::~GenericFile_packed()
+{
+	delete[] chunkOffsets;
+	delete[] chunk;
+	delete[] compressedChunk;
+	delete decompressor;
+}
+
+	GenericFile_packed *
+GenericFile_packed::open(const char *filename)
+{
+	FILE *file = fopen(filename, "rb");
+	if (NULL == file) {
+		return NULL;
+	}
+
+	_uint64 header[PackedFileHeaderSize];
+	if (fread(header, sizeof(header), 1, file) != 1 || header[0] != PackedFileMagic || header[1] != PackedFileVersion ||
+		0 == header[3] || header[3] > MaxChunkSize || header[4] != (header[2] + header[3] - 1) / header[3]) {
+		fclose(file);
+		return NULL;
+	}
+
+	GenericFile_packed *retval = new GenericFile_packed();
+	retval->_file = file;
+	retval->_mode = ReadOnly;
+	retval->uncompressedSize = header[2];
+	retval->chunkSize = header[3];
+	retval->nChunks = header[4];
+	retval->whichChunkLoaded = retval->nChunks;
+
+	retval->chunkOffsets = new _uint64[retval->nChunks + 1];
+	if (fread(retval->chunkOffsets, sizeof(_uint64), retval->nChunks + 1, file) != retval->nChunks + 1) {
+		WriteErrorMessage("Packed file '%s' is truncated\n", filename);
+		delete retval;
+		fclose(file);
+		return NULL;
+	}
+
+	for (_uint64 i = 0; i < retval->nChunks; i++) {
+		if (retval->chunkOffsets[i + 1] < retval->chunkOffsets[i]) {
+			WriteErrorMessage("Packed file '%s' is corrupt\n", filename);
+			delete retval;
+			fclose(file);
+			return NULL;
+		}
+		retval->maxCompressedChunkSize = __max(retval->maxCompressedChunkSize, (size_t)(retval->chunkOffsets[i + 1] - retval->chunkOffsets[i]));
+	}
+
+	return retval;
+}
+
+	bool
+GenericFile_packed::IsPackedFile(const char *filename)
+{
+	FILE *file = fopen(filename, "rb");
+	if (NULL == file) {
+		return false;
+	}
+
+	_uint64 magic;
+	bool isPacked = fread(&magic, sizeof(magic), 1, file) == 1 && PackedFileMagic == magic;
+	fclose(file);
+
+	return isPacked;
+}
+
+	bool
+GenericFile_packed::readChunk(FILE *file, _uint64 whichChunk, char *compressedBuffer, char *output, GzipBlockDecompressor *chunkDecompressor)
+{
+	size_t compressedBytes = (size_t)(chunkOffsets[whichChunk + 1] - chunkOffsets[whichChunk]);
+	if (0 != _fseek64bit(file, (_int64)chunkOffsets[whichChunk], SEEK_SET) || fread(compressedBuffer, 1, compressedBytes, file) != compressedBytes) {
+		WriteErrorMessage("Unable to read chunk %lld of packed file '%s'\n", whichChunk, _filename);
+		return false;
+	}
+
+	if (!DecompressChunk(chunkDecompressor, compressedBuffer, compressedBytes, output, (size_t)chunkBytes(whichChunk))) {
+		WriteErrorMessage("Chunk %lld of packed file '%s' is corrupt\n", whichChunk, _filename);
+		return false;
+	}
+
+	return true;
+}
+
+	bool
+GenericFile_packed::loadChunk(_uint64 whichChunk)
+{
+	if (whichChunk == whichChunkLoaded) {
+		return true;
+	}
+
+	if (NULL == chunk) {
+		chunk = new char[chunkSize];
+		compressedChunk = new char[maxCompressedChunkSize];
+		decompressor = GzipBlockDecompressor::Create();
+	}
+
+	whichChunkLoaded = nChunks;		// In case the read fails
+	if (!readChunk(_file, whichChunk, compressedChunk, chunk, decompressor)) {
+		return false;
+	}
+	whichChunkLoaded = whichChunk;
+
+	return true;
+}
+
+	size_t
+GenericFile_packed::read(void *ptr, size_t count)
+{
+	size_t amountRead = 0;
+	while (amountRead < count && position < uncompressedSize) {
+		_uint64 whichChunk = position / chunkSize;
+		if (!loadChunk(whichChunk)) {
+			return 0 == amountRead ? (size_t)-1 : amountRead;
+		}
+
+		size_t offsetInChunk = (size_t)(position - whichChunk * chunkSize);
+		size_t amountToCopy = __min(count - amountRead, (size_t)chunkBytes(whichChunk) - offsetInChunk);
+		memcpy((char *)ptr + amountRead, chunk + offsetInChunk, amountToCopy);
+		amountRead += amountToCopy;
+		position += amountToCopy;
+	}
+
+	return amountRead;
+}
+
+	int
+GenericFile_packed::getchar()
+{
+	if (position >= uncompressedSize || !loadChunk(position / chunkSize)) {
+		return EOF;
+	}
+
+	return (unsigned char)chunk[position++ % chunkSize];
+}
+
+	char *
+GenericFile_packed::gets(char *buf, size_t count)
+{
+	return _gets_impl(buf, count);
+}
+
+	int
+GenericFile_packed::advance(long long offset)
+{
+	if (offset < 0 ? (_uint64)-offset > position : position + offset > uncompressedSize) {
+		return -1;
+	}
+
+	position += offset;
+	return 0;
+}
+
+	_int64
+GenericFile_packed::tell()
+{
+	return (_int64)position;
+}
+
+	void
+GenericFile_packed::close()
+{
+	fclose(_file);
+	_file = NULL;
+}
+
+	size_t
+GenericFile_packed::readInParallel(void *ptr, size_t count, _uint32 *o_checksum)
+/*++
+
+Routine Description:
+
+    Decompress count bytes from the current position into ptr, with a thread per processor taking the chunks in turn.
+    The chunks that are entirely in the range go straight into ptr; only the (at most two) that stick out of it take a
+    copy, as do all of them if ptr is NULL.  Each chunk's checksum is computed by the thread that decompressed it, and
+    they're combined in order at the end.  Small reads just use read.
+
+--*/
+{
+	count = (size_t)__min((_uint64)count, uncompressedSize - position);
+	_uint64 firstChunk = position / chunkSize;
+	_uint64 endChunk = (position + count + chunkSize - 1) / chunkSize;
+	unsigned nThreads = (unsigned)__min((_uint64)GetNumberOfProcessors(), endChunk - firstChunk);
+	if (nThreads < 2) {
+		return readAndChecksum(ptr, count, o_checksum);
+	}
+
+	SingleWaiterObject doneObject;
+	CreateSingleWaiterObject(&doneObject);
+	volatile int runningThreadCount = nThreads;
+	volatile _int64 nextChunk = (_int64)firstChunk;
+	volatile int failed = 0;
+
+	ParallelUnpackContext context;
+	context.file = this;
+	context.buffer = (char *)ptr;
+	context.startOffset = position;
+	context.count = count;
+	context.nextChunk = &nextChunk;
+	context.endChunk = endChunk;
+	context.checksums = NULL == o_checksum ? NULL : new _uint32[endChunk - firstChunk];
+	context.failed = &failed;
+	context.doneObject = &doneObject;
+	context.runningThreadCount = &runningThreadCount;
+
+	for (unsigned i = 0; i < nThreads; i++) {
+		if (!StartNewThread(ParallelUnpackThreadMain, &context)) {
+			WriteErrorMessage("Unable to start file unpack thread\n");
+			soft_exit(1);
+		}
+	}
+
+	WaitForSingleWaiterObject(&doneObject);
+	DestroySingleWaiterObject(&doneObject);
+
+	if (NULL != o_checksum && !failed) {
+		*o_checksum = 0;
+		for (_uint64 whichChunk = firstChunk; whichChunk < endChunk; whichChunk++) {
+			_uint64 chunkStart = __max(whichChunk * chunkSize, position);
+			_uint64 chunkEnd = __min(whichChunk * chunkSize + chunkBytes(whichChunk), position + count);
+			*o_checksum = CombineChecksums(*o_checksum, context.checksums[whichChunk - firstChunk], (size_t)(chunkEnd - chunkStart));
+		}
+	}
+	delete[] context.checksums;
+
+	if (failed) {
+		return 0;
+	}
+
+	position += count;
+	return count;
+}
+
+	void
+GenericFile_packed::ParallelUnpackThreadMain(void *param)
+{
+	ParallelUnpackContext *context = (ParallelUnpackContext *)param;
+	GenericFile_packed *packedFile = context->file;
+
+	FILE *file = fopen(packedFile->_filename, "rb");
+	char *compressedBuffer = new char[packedFile->maxCompressedChunkSize];
+	char *chunkBuffer = NULL;	// Only for the chunks at the ends, which aren't all in the caller's buffer
+	GzipBlockDecompressor *threadDecompressor = GzipBlockDecompressor::Create();
+
+	if (NULL == file) {
+		WriteErrorMessage("Unable to open packed file '%s'\n", packedFile->_filename);
+		*context->failed = 1;
+	}
+
+	_uint64 endOffset = context->startOffset + context->count;
+	while (!*context->failed) {
+		_uint64 whichChunk = (_uint64)(InterlockedAdd64AndReturnNewValue(context->nextChunk, 1) - 1);
+		if (whichChunk >= context->endChunk) {
+			break;
+		}
+
+		_uint64 chunkStart = whichChunk * packedFile->chunkSize;
+		_uint64 chunkEnd = chunkStart + packedFile->chunkBytes(whichChunk);
+		_uint64 firstChunk = context->startOffset / packedFile->chunkSize;
+		if (NULL != context->buffer && chunkStart >= context->startOffset && chunkEnd <= endOffset) {
+			char *output = context->buffer + (chunkStart - context->startOffset);
+			if (!packedFile->readChunk(file, whichChunk, compressedBuffer, output, threadDecompressor)) {
+				*context->failed = 1;
+			} else if (NULL != context->checksums) {
+				context->checksums[whichChunk - firstChunk] = Checksum(output, (size_t)(chunkEnd - chunkStart));
+			}
+		} else {
+			if (NULL == chunkBuffer) {
+				chunkBuffer = new char[packedFile->chunkSize];
+			}
+			if (!packedFile->readChunk(file, whichChunk, compressedBuffer, chunkBuffer, threadDecompressor)) {
+				*context->failed = 1;
+			} else {
+				_uint64 copyStart = __max(chunkStart, context->startOffset);
+				_uint64 copyEnd = __min(chunkEnd, endOffset);
+				if (NULL != context->buffer) {
+					memcpy(context->buffer + (copyStart - context->startOffset), chunkBuffer + (copyStart - chunkStart), (size_t)(copyEnd - copyStart));
+				}
+				if (NULL != context->checksums) {
+					context->checksums[whichChunk - firstChunk] = Checksum(chunkBuffer + (copyStart - chunkStart), (size_t)(copyEnd - copyStart));
+				}
+			}
+		}
+	}
+
+	if (NULL != file) {
+		fclose(file);
+	}
+	delete[] compressedBuffer;
+	delete[] chunkBuffer;
+	delete threadDecompressor;
+
+	if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+		SignalSingleWaiterObject(context->doneObject);
+	}
+}
+
+	void
+GenericFile_packed::PackThreadMain(void *param)
+{
+	PackContext *context = (PackContext *)param;
+
+	GzipBlockCompressor *compressor = GzipBlockCompressor::Create();
+	context->worked = CompressChunk(compressor, context->inputBuffer, context->inputBytes, context->outputBuffer, context->outputBufferSize, &context->outputBytes);
+	delete compressor;
+
+	if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+		SignalSingleWaiterObject(context->doneObject);
+	}
+}
+
+	bool
+GenericFile_packed::PackFile(const char *inputFileName, const char *outputFileName, unsigned maxThreads, _int64 *o_packedSize, size_t i_chunkSize)
+/*++
+
+Routine Description:
+
+    Read the input a batch of chunks at a time (one per thread), compress the batch in parallel and write the results
+    in order.  The chunk offsets go at the front of the file, so they're written last.
+
+--*/
+{
+	FILE *inputFile = fopen(inputFileName, "rb");
+	if (NULL == inputFile) {
+		WriteErrorMessage("Unable to open '%s' for read\n", inputFileName);
+		return false;
+	}
+
+	FILE *outputFile = fopen(outputFileName, "wb");
+	if (NULL == outputFile) {
+		WriteErrorMessage("Unable to open '%s' for write\n", outputFileName);
+		fclose(inputFile);
+		return false;
+	}
+
+	_uint64 inputSize = (_uint64)QueryFileSize(inputFileName);
+	_uint64 chunkSize = __max((_uint64)1, __min((_uint64)i_chunkSize, MaxChunkSize));
+	_uint64 nChunks = (inputSize + chunkSize - 1) / chunkSize;
+	_uint64 header[PackedFileHeaderSize] = {PackedFileMagic, PackedFileVersion, inputSize, chunkSize, nChunks};
+	_uint64 *chunkOffsets = new _uint64[nChunks + 1];
+	memset(chunkOffsets, 0, (nChunks + 1) * sizeof(_uint64));
+
+	bool worked = fwrite(header, sizeof(header), 1, outputFile) == 1 && fwrite(chunkOffsets, sizeof(_uint64), nChunks + 1, outputFile) == nChunks + 1;
+	chunkOffsets[0] = sizeof(header) + (nChunks + 1) * sizeof(_uint64);
+
+	unsigned nThreads = (unsigned)__max((_uint64)1, __min((_uint64)__min(maxThreads, GetNumberOfProcessors()), nChunks));
+	size_t outputBufferSize = CompressedChunkBound(chunkSize);
+	PackContext *contexts = new PackContext[nThreads];
+	for (unsigned i = 0; i < nThreads; i++) {
+		contexts[i].inputBuffer = (char *)BigAlloc(chunkSize);
+		contexts[i].outputBuffer = (char *)BigAlloc(outputBufferSize);
+		contexts[i].outputBufferSize = outputBufferSize;
+	}
+
+	for (_uint64 batchStart = 0; worked && batchStart < nChunks; batchStart += nThreads) {
+		unsigned nInBatch = (unsigned)__min((_uint64)nThreads, nChunks - batchStart);
+
+		for (unsigned i = 0; worked && i < nInBatch; i++) {
+			contexts[i].inputBytes = (size_t)__min(chunkSize, inputSize - (batchStart + i) * chunkSize);
+			worked = fread(contexts[i].inputBuffer, 1, contexts[i].inputBytes, inputFile) == contexts[i].inputBytes;
+		}
+
+		if (!worked) {
+			WriteErrorMessage("Error reading '%s'\n", inputFileName);
+			break;
+		}
+
+		SingleWaiterObject doneObject;
+		CreateSingleWaiterObject(&doneObject);
+		volatile int runningThreadCount = nInBatch;
+		for (unsigned i = 0; i < nInBatch; i++) {
+			contexts[i].doneObject = &doneObject;
+			contexts[i].runningThreadCount = &runningThreadCount;
+			if (!StartNewThread(PackThreadMain, &contexts[i])) {
+				WriteErrorMessage("Unable to start file pack thread\n");
+				soft_exit(1);
+			}
+		}
+		WaitForSingleWaiterObject(&doneObject);
+		DestroySingleWaiterObject(&doneObject);
+
+		for (unsigned i = 0; worked && i < nInBatch; i++) {
+			if (!contexts[i].worked) {
+				WriteErrorMessage("Unable to compress chunk %lld of '%s'\n", batchStart + i, inputFileName);
+				worked = false;
+				break;
+			}
+			worked = fwrite(contexts[i].outputBuffer, 1, contexts[i].outputBytes, outputFile) == contexts[i].outputBytes;
+			chunkOffsets[batchStart + i + 1] = chunkOffsets[batchStart + i] + contexts[i].outputBytes;
+		}
+	}
+
+	worked = worked && 0 == _fseek64bit(outputFile, sizeof(header), SEEK_SET) && fwrite(chunkOffsets, sizeof(_uint64), nChunks + 1, outputFile) == nChunks + 1;
+	worked = (0 == fclose(outputFile)) && worked;
+	fclose(inputFile);
+
+	if (!worked) {
+		WriteErrorMessage("Unable to write packed file '%s'\n", outputFileName);
+	} else if (NULL != o_packedSize) {
+		*o_packedSize = (_int64)chunkOffsets[nChunks];
+	}
+
+	for (unsigned i = 0; i < nThreads; i++) {
+		BigDealloc(contexts[i].inputBuffer);
+		BigDealloc(contexts[i].outputBuffer);
+	}
+	delete[] contexts;
+	delete[] chunkOffsets;
+
+	return worked;
+}
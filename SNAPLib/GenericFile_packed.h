@@ -0,0 +1,111 @@
+/*++
+
+Module Name:
+
+    GenericFile_packed.h
+
+Abstract:
+
+    Reading (and writing) the compressed index files that index -pack makes.
+
+    A packed file is the original file cut into fixed size chunks, each compressed on its own into a gzip member, after
+    a header that says where each chunk starts.  That makes it seekable and lets readInParallel decompress the chunks
+    on as many threads as there are processors, each straight into its part of the caller's buffer, which is what it
+    takes for loading a compressed index to be faster than loading an uncompressed one from anything slower than a
+    local NVMe drive.  It's zlib (or libdeflate, when SNAP is built with it) rather than something like zstd, because
+    that's what SNAP already links with.
+
+    The format is a header of _uint64s (magic, version, uncompressedSize, chunkSize, nChunks), then nChunks + 1
+    _uint64 file offsets, of the start of each chunk and of the end of the last, then the chunks.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "GenericFile.h"
+
+class GzipBlockDecompressor;
+
+class GenericFile_packed : public GenericFile
+{
+public:
+	static GenericFile_packed *open(const char *filename);	// ReadOnly.  NULL if it can't be opened or isn't a packed file.  Use GenericFile::open, which sets the file name.
+	virtual size_t read(void *ptr, size_t count);
+	virtual int getchar();
+	virtual char *gets(char *buf, size_t count);
+	virtual int advance(long long offset);
+	virtual _int64 tell();
+	virtual size_t readInParallel(void *ptr, size_t count, _uint32 *o_checksum = NULL);
+	virtual ~GenericFile_packed();
+	virtual void close();
+
+	_int64 getUncompressedSize() const { return (_int64)uncompressedSize; }
+
+	static bool IsPackedFile(const char *filename);
+
+	//
+	// Write a packed copy of inputFileName to outputFileName, compressing on up to maxThreads threads.
+	//
+	static bool PackFile(const char *inputFileName, const char *outputFileName, unsigned maxThreads, _int64 *o_packedSize = NULL,
+						 size_t chunkSize = DefaultChunkSize);
+
+	static const size_t DefaultChunkSize = 16 * 1024 * 1024;
+
+private:
+	GenericFile_packed();
+
+	bool loadChunk(_uint64 whichChunk);
+
+	//
+	// Read and decompress one chunk with file (which may not be this object's _file, since readInParallel's threads
+	// each have their own) into output, which has room for the whole chunk.
+	//
+	bool readChunk(FILE *file, _uint64 whichChunk, char *compressedBuffer, char *output, GzipBlockDecompressor *decompressor);
+
+	_uint64 chunkBytes(_uint64 whichChunk) const { return __min(chunkSize, uncompressedSize - whichChunk * chunkSize); }
+
+	FILE		*_file;
+	_uint64		 uncompressedSize;
+	_uint64		 chunkSize;
+	_uint64		 nChunks;
+	_uint64		*chunkOffsets;				// nChunks + 1 of them
+	size_t		 maxCompressedChunkSize;
+
+	_uint64		 position;					// In the uncompressed data
+	char		*chunk;						// The one that position is in, for read and getchar
+	char		*compressedChunk;
+	_uint64		 whichChunkLoaded;			// nChunks if none
+	GzipBlockDecompressor *decompressor;	// NULL means zlib
+
+	struct ParallelUnpackContext {
+		GenericFile_packed	*file;
+		char				*buffer;
+		_uint64				 startOffset;	// Of buffer in the uncompressed data
+		size_t				 count;
+		volatile _int64		*nextChunk;
+		_uint64				 endChunk;
+		_uint32				*checksums;		// Of each chunk's part of the range, from the first; NULL if not wanted
+		volatile int		*failed;
+		SingleWaiterObject	*doneObject;
+		volatile int		*runningThreadCount;
+	};
+
+	static void ParallelUnpackThreadMain(void *param);
+
+	struct PackContext {
+		char				*inputBuffer;
+		size_t				 inputBytes;
+		char				*outputBuffer;
+		size_t				 outputBufferSize;
+		size_t				 outputBytes;
+		bool				 worked;
+		SingleWaiterObject	*doneObject;
+		volatile int		*runningThreadCount;
+	};
+
+	static void PackThreadMain(void *param);
+};
@@ -87,6 +87,11 @@ int GenericFile_stdio::advance(long long offset)
 {
 	return _fseek64bit(_file, offset, SEEK_CUR);
 }
+
+_int64 GenericFile_stdio::tell()
+{
+	return _ftell64bit(_file);
+}
  
 void GenericFile_stdio::close()
 {
@@ -34,6 +34,7 @@ public:
 	virtual int getchar();
 	virtual char *gets(char *buf, size_t count);
 	virtual int advance(long long offset);
+	virtual _int64 tell();
 	virtual ~GenericFile_stdio();
 	virtual void close();
 
@@ -31,10 +31,11 @@ Revision History:
 #include "exit.h"
 #include "Error.h"
 #include "Util.h"
+#include "PackedBases.h"
 
 Genome::Genome(GenomeDistance i_maxBases, GenomeDistance nBasesStored, unsigned i_chromosomePadding, unsigned i_maxContigs)
 : maxBases(i_maxBases), minLocation(0), maxLocation(i_maxBases), chromosomePadding(i_chromosomePadding), maxContigs(i_maxContigs),
-  mappedFile(NULL)
+  mappedFile(NULL), packedBases(NULL), packedBasesStorage(NULL)
 {
     bases = ((char *) BigAlloc(nBasesStored + 2 * N_PADDING)) + N_PADDING;
     if (NULL == bases) {
@@ -50,7 +51,11 @@ Genome::Genome(GenomeDistance i_maxBases, GenomeDistance nBasesStored, unsigned
 
     nContigs = 0;
     contigs = new Contig[maxContigs];
-    contigsByName = NULL;
+    contigNumByName = NULL;
+    contigNameTableMask = 0;
+    contigNumByBucket = NULL;
+    nContigBuckets = 0;
+    contigBucketShift = 0;
 }
 
     void
@@ -108,22 +113,70 @@ Genome::startContig(const char *contigName)
 
 Genome::~Genome()
 {
-    BigDealloc(bases - N_PADDING);
+    if (NULL == mappedFile) {
+        BigDealloc(bases - N_PADDING);
+    }
     for (int i = 0; i < nContigs; i++) {
         delete [] contigs[i].name;
         contigs[i].name = NULL;
     }
 
     delete [] contigs;
-    if (contigsByName) {
-        delete [] contigsByName;
-    }
     contigs = NULL;
 
+    delete [] contigNumByName;
+    contigNumByName = NULL;
+
+    delete [] contigNumByBucket;
+    contigNumByBucket = NULL;
+
 	if (NULL != mappedFile) {
 		mappedFile->close();
 		delete mappedFile;
 	}
+
+    if (NULL != packedBases) {
+        delete packedBases;
+        BigDealloc(packedBasesStorage);
+    }
+}
+
+    bool
+Genome::createPackedBases()
+/*++
+
+Routine Description:
+
+    Build the 2 bit per base copy of the genome.  The padding on either end is left as not-ACGT, which is the
+    same as the 'n's there, and it doesn't need to be read (which matters for mapped genomes, where it isn't really there).
+
+--*/
+{
+    if (NULL != packedBases) {
+        return true;
+    }
+
+    if (minLocation != 0) {
+        WriteErrorMessage("Genome::createPackedBases: only whole genomes can be packed\n");
+        return false;
+    }
+
+    packedBasesStorage = BigAlloc(PackedBases::GetStorageSize(nBases + 2 * N_PADDING));
+    packedBases = new PackedBases;
+    packedBases->init(packedBasesStorage, -N_PADDING, nBases + 2 * N_PADDING);
+    packedBases->pack(0, bases, nBases);
+
+    return true;
+}
+
+    _int64
+Genome::getMemoryFootprint() const
+{
+    _int64 footprint = (maxLocation - minLocation) + 2 * N_PADDING;
+    if (NULL != packedBases) {
+        footprint += PackedBases::GetStorageSize(nBases + 2 * N_PADDING);
+    }
+    return footprint;
 }
 
 
@@ -178,7 +231,8 @@ Genome::saveToFile(const char *fileName) const
 }
 
     const Genome *
-Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLocation minLocation, GenomeDistance length, bool map)
+Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLocation minLocation, GenomeDistance length, bool map,
+                     _uint32 *o_basesChecksum)
 {    
     GenericFile *loadFile;
     GenomeDistance nBases;
@@ -262,11 +316,12 @@ Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLoc
     size_t readSize;
 	if (map) {
 		GenericFile_map *mappedFile = (GenericFile_map *)loadFile;
+		BigDealloc(genome->bases - N_PADDING);    // The bases are in the mapping instead
 		genome->bases = (char *)mappedFile->mapAndAdvance(length, &readSize);
 		genome->mappedFile = mappedFile;
 		mappedFile->prefetch();
 	} else {
-		readSize = loadFile->read(genome->bases, length);
+		readSize = loadFile->readInParallel(genome->bases, length, o_basesChecksum);
 
 		loadFile->close();
 		delete loadFile;
@@ -281,28 +336,90 @@ Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLoc
 	}
 	
 	genome->fillInContigLengths();
-    genome->sortContigsByName();
+    genome->buildContigNameTable();
     delete[] contigNameBuffer;
     return genome;
 }
 
-    bool
-contigComparator(
-    const Genome::Contig& a,
-    const Genome::Contig& b)
+    _uint64
+Genome::hashContigName(const char *name, size_t nameLength)
 {
-    return strcmp(a.name, b.name) < 0;
+    _uint64 hash = 0xcbf29ce484222325;  // FNV-1a
+    for (size_t i = 0; i < nameLength; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3;
+    }
+    return util::fmix64(hash);
 }
 
     void
-Genome::sortContigsByName()
+Genome::buildContigNameTable()
 {
-    if (contigsByName) {
-        delete [] contigsByName;
+    delete [] contigNumByName;
+
+    unsigned tableSize = 16;
+    while (tableSize < 2 * (unsigned)nContigs) {
+        tableSize *= 2;
+    }
+    contigNameTableMask = tableSize - 1;
+    contigNumByName = new int[tableSize];
+    for (unsigned i = 0; i < tableSize; i++) {
+        contigNumByName[i] = -1;
+    }
+
+    for (int i = 0; i < nContigs; i++) {
+        unsigned slot = (unsigned)hashContigName(contigs[i].name, contigs[i].nameLength) & contigNameTableMask;
+        while (contigNumByName[slot] != -1) {
+            slot = (slot + 1) & contigNameTableMask;
+        }
+        contigNumByName[slot] = i;
     }
-    contigsByName = new Contig[nContigs];
-    memcpy(contigsByName, contigs, nContigs * sizeof(Contig));
-    std::sort(contigsByName, contigsByName + nContigs, contigComparator);
+}
+
+    Genome *
+Genome::appendGenome(const Genome *additionalGenome) const
+{
+    if (additionalGenome->chromosomePadding != chromosomePadding) {
+        WriteErrorMessage("Genome::appendGenome: the genomes have different chromosome padding (%d and %d)\n", chromosomePadding, additionalGenome->chromosomePadding);
+        return NULL;
+    }
+
+    _ASSERT(0 == minLocation && 0 == additionalGenome->minLocation);    // It only makes sense for whole genomes
+
+    for (int i = 0; i < additionalGenome->nContigs; i++) {
+        GenomeLocation existingLocation;
+        if (getLocationOfContig(additionalGenome->contigs[i].name, &existingLocation)) {
+            WriteErrorMessage("Genome::appendGenome: contig '%s' is already in the genome\n", additionalGenome->contigs[i].name);
+            return NULL;
+        }
+    }
+
+    //
+    // Both genomes start with padding ahead of their first contig, and (coming from FASTA) end with padding after their last
+    // one.  Since we already have trailing padding, drop the additional genome's leading padding.
+    //
+    GenomeDistance additionalStart = (0 == additionalGenome->nContigs) ? additionalGenome->nBases : GenomeLocationAsInt64(additionalGenome->contigs[0].beginningLocation);
+    GenomeDistance newNBases = nBases + additionalGenome->nBases - additionalStart;
+
+    Genome *newGenome = new Genome(newNBases, newNBases, chromosomePadding, nContigs + additionalGenome->nContigs + 1);
+
+    GenomeDistance firstContigStart = (0 == nContigs) ? nBases : GenomeLocationAsInt64(contigs[0].beginningLocation);
+    newGenome->addData(bases, firstContigStart);
+    for (int i = 0; i < nContigs; i++) {
+        newGenome->startContig(contigs[i].name);
+        newGenome->addData(bases + GenomeLocationAsInt64(contigs[i].beginningLocation), contigs[i].length);
+    }
+
+    for (int i = 0; i < additionalGenome->nContigs; i++) {
+        newGenome->startContig(additionalGenome->contigs[i].name);
+        newGenome->addData(additionalGenome->bases + GenomeLocationAsInt64(additionalGenome->contigs[i].beginningLocation), additionalGenome->contigs[i].length);
+    }
+
+    _ASSERT(newGenome->nBases == newNBases);
+
+    newGenome->fillInContigLengths();
+    newGenome->buildContigNameTable();
+
+    return newGenome;
 }
 
     bool
@@ -351,32 +468,26 @@ Genome::getSizeFromFile(const char *fileName, GenomeDistance *nBases, unsigned *
 
 
     bool
-Genome::getLocationOfContig(const char *contigName, GenomeLocation *location, int * index) const
+Genome::lookupContig(const char *contigName, size_t nameLength, GenomeLocation *location, int *index) const
 {
-    if (contigsByName) {
-        int low = 0;
-        int high = nContigs - 1;
-        while (low <= high) {
-            int mid = (low + high) / 2;
-            int c = strcmp(contigsByName[mid].name, contigName);
-            if (c == 0) {
+    if (NULL != contigNumByName) {
+        unsigned slot = (unsigned)hashContigName(contigName, nameLength) & contigNameTableMask;
+        for (; contigNumByName[slot] != -1; slot = (slot + 1) & contigNameTableMask) {
+            const Contig *contig = &contigs[contigNumByName[slot]];
+            if (contig->nameLength == nameLength && !memcmp(contig->name, contigName, nameLength)) {
                 if (location != NULL) {
-                    *location = contigsByName[mid].beginningLocation;
+                    *location = contig->beginningLocation;
                 }
                 if (index != NULL) {
-                    *index = mid;
+                    *index = contigNumByName[slot];
                 }
                 return true;
-            } else if (c < 0) {
-                low = mid + 1;
-            } else {
-                high = mid - 1;
             }
         }
         return false;
     }
     for (int i = 0; i < nContigs; i++) {
-        if (!strcmp(contigName,contigs[i].name)) {
+        if (contigs[i].nameLength == nameLength && !memcmp(contigName, contigs[i].name, nameLength)) {
             if (NULL != location) {
                 *location = contigs[i].beginningLocation;
             }
@@ -394,20 +505,35 @@ Genome::getLocationOfContig(const char *contigName, GenomeLocation *location, in
 Genome::getContigAtLocation(GenomeLocation location) const
 {
     _ASSERT(location < nBases);
-    int low = 0;
-    int high = nContigs - 1;
-    while (low <= high) {
-        int mid = (low + high) / 2;
-        if (contigs[mid].beginningLocation <= location &&
-                (mid == nContigs-1 || contigs[mid+1].beginningLocation > location)) {
-            return &contigs[mid];
-        } else if (contigs[mid].beginningLocation <= location) {
-            low = mid + 1;
-        } else {
-            high = mid - 1;
+    if (0 == nContigs || location < contigs[0].beginningLocation) {
+        return NULL;
+    }
+
+    int contigNum;
+    if (NULL != contigNumByBucket) {
+        contigNum = contigNumByBucket[__min(GenomeLocationAsInt64(location) >> contigBucketShift, nContigBuckets - 1)];
+    } else {
+        //
+        // We're in the middle of building the genome, so there's no lookup table yet.  Binary search.
+        //
+        int low = 0;
+        int high = nContigs - 1;
+        while (low < high) {
+            int mid = (low + high + 1) / 2;
+            if (contigs[mid].beginningLocation <= location) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
         }
+        contigNum = low;
     }
-    return NULL; // Should not be reached
+
+    while (contigNum < nContigs - 1 && contigs[contigNum + 1].beginningLocation <= location) {
+        contigNum++;
+    }
+
+    return &contigs[contigNum];
 }
 
     int
@@ -421,31 +547,23 @@ Genome::getContigNumAtLocation(GenomeLocation location) const
 Genome::getNextContigAfterLocation(GenomeLocation location) const
 {
     _ASSERT(location < nBases);
-    if (nContigs > 0 && location < contigs[0].beginningLocation) {
-            return &contigs[0];
-    }
-
-    int low = 0;
-    int high = nContigs - 1;
-    while (low <= high) {
-        int mid = (low + high) / 2;
-        if (contigs[mid].beginningLocation <= location &&
-                (mid == nContigs-1 || contigs[mid+1].beginningLocation > location)) {
-            if (mid >= nContigs - 1) {
-                //
-                // This location landed in the last contig, so return NULL for the next one.
-                //
-                return NULL;
-            } else {
-                return &contigs[mid+1];
-            }
-        } else if (contigs[mid].beginningLocation <= location) {
-            low = mid + 1;
-        } else {
-            high = mid - 1;
-        }
+    if (0 == nContigs) {
+        return NULL;
     }
-    return NULL; // Should not be reached
+
+    const Contig *contig = getContigAtLocation(location);
+    if (NULL == contig) {
+        return &contigs[0]; // The location is before the first contig
+    }
+
+    if (contig == &contigs[nContigs - 1]) {
+        //
+        // This location landed in the last contig, so return NULL for the next one.
+        //
+        return NULL;
+    }
+
+    return contig + 1;
 }
 
 GenomeDistance DistanceBetweenGenomeLocations(GenomeLocation locationA, GenomeLocation locationB) 
@@ -463,6 +581,39 @@ void Genome::fillInContigLengths()
     }
 
     contigs[nContigs-1].length = nBases - GenomeLocationAsInt64(contigs[nContigs-1].beginningLocation);
+
+    buildContigLookupTable();
+}
+
+    void
+Genome::buildContigLookupTable()
+/*++
+
+Routine Description:
+
+    Build the table that getContigAtLocation uses.  The bucket size is the smallest power of two that gives fewer than
+    four buckets per contig, so the table's about the same size as the contig array itself.
+
+--*/
+{
+    delete [] contigNumByBucket;
+
+    contigBucketShift = 0;
+    while ((nBases >> contigBucketShift) >= 4 * (_int64)nContigs) {
+        contigBucketShift++;
+    }
+
+    nContigBuckets = (nBases >> contigBucketShift) + 1;
+    contigNumByBucket = new int[nContigBuckets];
+
+    int contigNum = 0;
+    for (_int64 bucket = 0; bucket < nContigBuckets; bucket++) {
+        GenomeLocation bucketStart = bucket << contigBucketShift;
+        while (contigNum < nContigs - 1 && contigs[contigNum + 1].beginningLocation <= bucketStart) {
+            contigNum++;
+        }
+        contigNumByBucket[bucket] = contigNum;
+    }
 }
 
 const Genome::Contig *Genome::getContigForRead(GenomeLocation location, unsigned readLength, GenomeDistance *extraBasesClippedBefore) const 
@@ -27,6 +27,8 @@ Revision History:
 #include "GenericFile.h"
 #include "GenericFile_map.h"
 
+class PackedBases;
+
 //
 // We have two different classes to represent a place in a genome and a distance between places in a genome.
 // In reality, they're both just 64 bit ints, but the classes are set up to encourage the user to keep
@@ -191,13 +193,22 @@ public:
         // first created to the amount actually used (rounded up to a page size).  However, saved
         // and loaded genomes can't be added to, they're read only.
         //
-        // minOffset and length are used to read in only a part of a whole genome.
+        // minOffset and length are used to read in only a part of a whole genome.  If o_basesChecksum isn't NULL
+        // and the genome isn't mapped, it gets the CRC-32 of the bases that were read (see GenericFile::readInParallel).
         //
-        static const Genome *loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLocation i_minLocation = 0, GenomeDistance length = 0, bool map = false);
+        static const Genome *loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLocation i_minLocation = 0, GenomeDistance length = 0, bool map = false,
+                                          _uint32 *o_basesChecksum = NULL);
                                                                   // This loads from a genome save
                                                                   // file, not a FASTA file.  Use
                                                                   // FASTA.h for FASTA loads.
 
+        //
+        // Make a new genome that's this one with the contigs of another (built with the same padding) added to the
+        // end.  The existing bases keep their locations, which is what lets an index be extended without rebuilding
+        // it.  Fails if the genomes' padding differs or they have a contig name in common.
+        //
+        Genome *appendGenome(const Genome *additionalGenome) const;
+
         static bool getSizeFromFile(const char *fileName, GenomeDistance *nBases, unsigned *nContigs);
 
         bool saveToFile(const char *fileName) const;
@@ -206,18 +217,16 @@ public:
         // Methods to read the genome.
         //
 		inline const char *getSubstring(GenomeLocation location, GenomeDistance lengthNeeded) const {
-			if (location > nBases || location + lengthNeeded > nBases + N_PADDING) {
-				// The first part of the test is for the unsigned version of a negative offset.
+			if (location > nBases || location + N_PADDING < minLocation || location + lengthNeeded > maxLocation + N_PADDING) {
+				// The first part of the test is for the unsigned version of a negative offset, and the rest is for reads past the padding on either end of a genome slice (or the whole genome).
 				return NULL;
 			}
 
 			// If we're in the padding, then the base will be an n, and we can't short circuit.  Recall that we use lower case n in the reference so it won't match with N in the read.
-			if (lengthNeeded <= chromosomePadding && bases[GenomeLocationAsInt64(location)] != 'n') {
+			if (lengthNeeded <= chromosomePadding && bases[location - minLocation] != 'n') {
 				return bases + (location - minLocation);
 			}
 
-			_ASSERT(location >= minLocation && location + lengthNeeded <= maxLocation + N_PADDING); // If the caller asks for a genome slice, it's only legal to look within it.
-
 			if (lengthNeeded == 0) {
 				return bases + (location - minLocation);
 			}
@@ -237,11 +246,43 @@ public:
 
         inline GenomeDistance getCountOfBases() const {return nBases;}
 
-        bool getLocationOfContig(const char *contigName, GenomeLocation *location, int* index = NULL) const;
+        //
+        // An optional 2 bit per base copy of the genome (see PackedBases.h), which the aligners use for scoring when it's
+        // there.  It's in addition to the bases, not instead of them, and its positions are genome locations.  It's only
+        // for whole genomes, not slices.
+        //
+        bool createPackedBases();
+        inline const PackedBases *getPackedBases() const {return packedBases;}
+
+        //
+        // The memory the bases take (the part of the file that's mapped, for a mapped genome), plus the packed copy if
+        // there is one.
+        //
+        _int64 getMemoryFootprint() const;
+
+        bool getLocationOfContig(const char *contigName, GenomeLocation *location, int* index = NULL) const
+            { return lookupContig(contigName, strlen(contigName), location, index); }
+
+        //
+        // The same for a name that needn't be null terminated, such as a SAM field.  index is the contig number, as in
+        // getContigs().
+        //
+        bool lookupContig(const char *contigName, size_t nameLength, GenomeLocation *location, int *index) const;
 
         inline void prefetchData(GenomeLocation genomeLocation) const {
-            _mm_prefetch(bases + GenomeLocationAsInt64(genomeLocation), _MM_HINT_T2);
-            _mm_prefetch(bases + GenomeLocationAsInt64(genomeLocation) + 64, _MM_HINT_T2);
+            _mm_prefetch(bases + (genomeLocation - minLocation), _MM_HINT_T2);
+            _mm_prefetch(bases + (genomeLocation - minLocation) + 64, _MM_HINT_T2);
+        }
+
+        //
+        // The same, but for every cache line of the length bases starting at genomeLocation.
+        //
+        inline void prefetchData(GenomeLocation genomeLocation, GenomeDistance length) const {
+            const char *data = bases + (genomeLocation - minLocation);
+            for (GenomeDistance offset = 0; offset < length; offset += 64) {
+                _mm_prefetch(data + offset, _MM_HINT_T2);
+            }
+            _mm_prefetch(data + length - 1, _MM_HINT_T2);  // The loop can stop short of the last line if data isn't aligned
         }
 
         struct Contig {
@@ -268,7 +309,7 @@ public:
         // These are only public so creators of new genomes (i.e., FASTA) can use them.
         //
         void    fillInContigLengths();
-        void    sortContigsByName();
+        void    buildContigNameTable();
 
 private:
 
@@ -292,7 +333,23 @@ private:
 
         Contig      *contigs;    // This is always in order (it's not possible to express it otherwise in FASTA).
 
-        Contig      *contigsByName;
+        //
+        // An open addressed hash table of contig numbers by name (-1 for an empty slot), twice as big as it needs to be
+        // so that probes stay short.  Built by buildContigNameTable.
+        //
+        int         *contigNumByName;
+        unsigned     contigNameTableMask;
+        static _uint64 hashContigName(const char *name, size_t nameLength);
+
+        //
+        // A coarse lookup table for finding the contig at a location: entry i is the number of the contig containing
+        // location i << contigBucketShift (or 0 if that's before the first contig).  There are a few buckets per contig,
+        // so getContigAtLocation only has to scan forward past a handful of contigs at most.  Built by fillInContigLengths.
+        //
+        int         *contigNumByBucket;
+        _int64       nContigBuckets;
+        unsigned     contigBucketShift;
+        void         buildContigLookupTable();
         Genome *copy(bool copyX, bool copyY, bool copyM) const;
 
         static bool openFileAndGetSizes(const char *filename, GenericFile **file, GenomeDistance *nBases, unsigned *nContigs, bool map);
@@ -300,6 +357,9 @@ private:
         const unsigned chromosomePadding;
 
 		GenericFile_map *mappedFile;
+
+        PackedBases         *packedBases;
+        void                *packedBasesStorage;
 };
 
 GenomeDistance DistanceBetweenGenomeLocations(GenomeLocation locationA, GenomeLocation locationB);
@@ -31,10 +31,16 @@ Revision History:
 #include "FixedSizeVector.h"
 #include "GenericFile.h"
 #include "GenericFile_stdio.h"
+#include "GenericFile_packed.h"
 #include "Genome.h"
 #include "GenomeIndex.h"
 #include "HashTable.h"
+#include "IndexBuildReport.h"
+#include "Minimizer.h"
 #include "Seed.h"
+#include "SeedSketch.h"
+#include "SpliceJunctions.h"
+#include "Simd.h"
 #include "exit.h"
 #include "Error.h"
 #include "directions.h"
@@ -51,11 +57,71 @@ const char *GenomeIndexFileName = "GenomeIndex";
 const char *OverflowTableFileName = "OverflowTable";
 const char *GenomeIndexHashFileName = "GenomeIndexHash";
 const char *GenomeFileName = "Genome";
+const char *SeedSketchFileName = "SeedSketch";     // Optional, so not in IndexFileNames
+const char *SpliceJunctionsFileName = "SpliceJunctions";   // Also optional
+const char *OptionalIndexFileNames[] = {SeedSketchFileName, SpliceJunctionsFileName};
+const int nOptionalIndexFileNames = sizeof(OptionalIndexFileNames) / sizeof(OptionalIndexFileNames[0]);
+const char *LongSeedIndexDirectoryName = "LongSeeds";   // Likewise; the tables for -longSeedSize, without a Genome
+const char *IndexChecksumsTag = "checksums";        // Starts the GenomeIndex file's line of file checksums
+
+bool GenomeIndex::VerifyChecksums = true;
+
+const char *GenomeIndex::IndexFileNames[] = {GenomeFileName, GenomeIndexHashFileName, OverflowTableFileName, GenomeIndexFileName};
+const int GenomeIndex::nIndexFileNames = sizeof(GenomeIndex::IndexFileNames) / sizeof(*GenomeIndex::IndexFileNames);
+
+//
+// The long seed directory inside an index directory.  The caller owns the returned string.
+//
+static char *
+LongSeedIndexDirectoryFor(const char *directoryName)
+{
+    size_t longSeedDirectoryNameSize = strlen(directoryName) + 1 + strlen(LongSeedIndexDirectoryName) + 1;
+    char *longSeedDirectoryName = new char[longSeedDirectoryNameSize];
+    snprintf(longSeedDirectoryName, longSeedDirectoryNameSize, "%s%c%s", directoryName, PATH_SEP, LongSeedIndexDirectoryName);
+    return longSeedDirectoryName;
+}
+
+//
+// GenomeIndex is written last, so its being there means the long seed tables are complete.
+//
+static bool
+HasLongSeedIndex(const char *directoryName)
+{
+    char *longSeedDirectoryName = LongSeedIndexDirectoryFor(directoryName);
+    size_t filenameBufferSize = strlen(longSeedDirectoryName) + 1 + strlen(GenomeIndexFileName) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", longSeedDirectoryName, PATH_SEP, GenomeIndexFileName);
+    FILE *file = fopen(filenameBuffer, "rb");
+    if (NULL != file) {
+        fclose(file);
+    }
+    delete[] filenameBuffer;
+    delete[] longSeedDirectoryName;
+    return NULL != file;
+}
+
+//
+// The size of a file once it's loaded, which for a packed one (index -pack) is its size before it was packed.
+//
+static _int64
+LoadedFileSize(const char *fileName)
+{
+    GenericFile_packed *packedFile = GenericFile_packed::open(fileName);
+    if (NULL == packedFile) {
+        return QueryFileSize(fileName);
+    }
+
+    _int64 size = packedFile->getUncompressedSize();
+    packedFile->close();
+    delete packedFile;
+    return size;
+}
 
 static void usage()
 {
 	WriteErrorMessage(
 		"Usage: snap-aligner index <input.fa> <output-dir> [<options>]\n"
+		"   or: snap-aligner index -append <index-dir> <additional.fa> [<options>]\n"
 		"Options:\n"
 		"  -s               Seed size (default: %d)\n"
 		"  -h               Hash table slack (default: %.1f)\n"
@@ -85,16 +151,91 @@ static void usage()
 		"                   In particular, this will generally use less memory than the index will use once it's built, so if this doesn't work you\n"
 		"                   won't be able to use the index anyway. However, if you've got sufficient memory to begin with, this option will just\n"
 		"                   slow down the index build by doing extra, useless IO.\n"
+		" -sortbuild        Build the hash tables by radix sorting (seed, location) pairs for each table and then filling the tables and the\n"
+		"                   overflow table sequentially, rather than inserting seeds one at a time.  This is usually faster and uses less memory\n"
+		"                   for large or highly repetitive references.  The index it builds is equivalent.  -sm has no effect with -sortbuild.\n"
+		" -minimizer <w>    Only index the seeds that are the minimizer of some window of w consecutive seeds, rather than every seed in\n"
+		"                   the genome.  The index is roughly (w + 1) / 2 times smaller and faster to build, and the aligners only look up the\n"
+		"                   minimizers of each read, at the cost of some sensitivity for reads with many differences from the reference.\n"
+		"                   w can be from 2 to %d; 5-10 is a reasonable range.  Older versions of SNAP can't use these indices.\n"
+		" -spacedSeed <p>   Build a spaced seed index: p is a pattern of -s 0s and 1s, and only the bases of each seed where it has a 1\n"
+		"                   are indexed, so a read's seed still hits its location when its differences from the reference fall on the\n"
+		"                   0s.  That makes each lookup more likely to find the right place in reads with a high error rate, so fewer\n"
+		"                   seeds (-n, -sc) can get the same sensitivity.  p must start and end with 1 and read the same backward, for\n"
+		"                   example 110110110111111011011011 for -s 24.  Use a longer -s than usual, since the seeds are only as\n"
+		"                   specific as their number of 1s.  It doesn't work with -minimizer, -hg19 or -biasFile, the long seed tables\n"
+		"                   are contiguous, and older versions of SNAP can't use these indices.\n"
+		" -compressOverflow After building the index, rewrite its overflow table (the lists of locations for seeds that occur more than\n"
+		"                   once) with the locations stored as variable length differences, which makes it several times smaller.  This\n"
+		"                   needs -locationSize 5 or more, and the index it builds can't be used by older versions of SNAP or with -append.\n"
+		" -biasFile <file>  Keep the bias tables (which size the hash tables, see -hg19) in file, so that building another index of the\n"
+		"                   same genome with the same seed size, key size and -large doesn't have to compute them again.  The\n"
+		"                   file is created if it doesn't exist, and holds the tables for any number of genomes and parameters.\n"
+		" -perfectHash      After building the index, rewrite its hash tables as minimal perfect hashes, which have no empty slots, so\n"
+		"                   they're smaller, and look up any seed with a read of a small table of pilots and then of one entry.  The\n"
+		"                   index it builds can't be used by older versions of SNAP or with -append.\n"
+		" -seedSketch       Also build a seed sketch: a Bloom filter of the seeds in the index and the hit counts of the most popular\n"
+		"                   ones, which the aligners check before the hash tables, so that looking up a seed that isn't in the genome or\n"
+		"                   that they'd ignore anyway usually doesn't touch them.  It takes about %d bits per distinct seed, which for\n"
+		"                   large genomes is more than fits in cache, but it's still one cache line per lookup rather than several.\n"
+		" -longSeedSize <n> Also build hash tables for seeds of n bases (more than -s) that share the index's genome, for the aligners to\n"
+		"                   use with long reads (see the aligners' -lsr), where longer seeds hit fewer places and so cost less to\n"
+		"                   check.  Their key size is bigger than -keysize by enough that they have no more hash tables than the\n"
+		"                   main ones, and they get the same location size, -large, -minimizer, -compressOverflow, -perfectHash and\n"
+		"                   -seedSketch.  n can be up to 32.  The index it builds can't be used with -append.\n"
+		" -pack             After building the index, compress its genome, hash table and overflow table files (and those of its long\n"
+		"                   seed tables) in independently compressed chunks, so that copying it around takes less IO and loading it\n"
+		"                   decompresses them on all of the processors straight into memory.  A packed index can't be loaded with\n"
+		"                   -map or -shm, or by older versions of SNAP.  With -append, it packs the appended index.\n"
+		" -gtf <file>       Add a contig for each splice junction of the transcripts in a GTF file (which may be gzip compressed), so\n"
+		"                   that RNA reads that span an intron align across it in the same pass that aligns the rest to the genome.\n"
+		"                   Each distinct intron's contig is the end of the exon before it and the start of the one after, and the\n"
+		"                   aligners write alignments to it at their place in the genome, with an N in the CIGAR for the intron.\n"
+		"                   It doesn't work with -append.\n"
+		" -junctionFlank <n> How much of each exon goes in a -gtf junction contig, at most.  Make it one less than the read length,\n"
+		"                   so that spliced reads fit in the contig and reads from within an exon don't.  Default: %d\n"
+		" -report <file>    Write a JSON report of the build to file: the wall and processor time, thread utilization and peak memory of\n"
+		"                   each phase, the size of each index file, and counts like the overflow table size and the number of repeated seeds.\n"
+		"\n"
+		"The FASTA file may be gzip compressed.\n"
+		"\n"
+		"-append adds the contigs in additional.fa to the existing index in index-dir without rebuilding it from scratch.  The index keeps\n"
+		"its seed size, key size, location size and padding, so only -t, -B, -bSpace, -H, -seedSketch and -report apply.  It needs enough memory\n"
+		"for two copies of the index.  If the index had a seed sketch, it's rebuilt.\n"
 			,
             DEFAULT_SEED_SIZE,
             DEFAULT_SLACK,
             DEFAULT_PADDING,
             DEFAULT_KEY_BYTES,
-            DEFAULT_LOCATION_SIZE);
+            DEFAULT_LOCATION_SIZE,
+            MaxMinimizerWindow,
+            SeedSketch::DefaultBitsPerKey,
+            SpliceJunctions::DefaultFlank);
     soft_exit_no_print(1);    // Don't use soft-exit, it's confusing people to get an error message after the usage
 }
 
 
+    _uint64
+GenomeIndex::SeedMaskForPattern(const char *pattern, int seedLen)
+{
+    if ((int)strlen(pattern) != seedLen || '1' != pattern[0] || '1' != pattern[seedLen - 1]) {
+        return 0;
+    }
+
+    _uint64 mask = 0;
+    for (int i = 0; i < seedLen; i++) {
+        if (('0' != pattern[i] && '1' != pattern[i]) || pattern[i] != pattern[seedLen - i - 1]) {
+            return 0;
+        }
+
+        if ('1' == pattern[i]) {
+            mask |= (_uint64)3 << ((seedLen - i - 1) * 2);  // As Seed lays out its bases
+        }
+    }
+
+    return mask;
+}
+
     void
 GenomeIndex::runIndexer(
     int argc,
@@ -104,7 +245,15 @@ GenomeIndex::runIndexer(
         usage();
     }
 
-    const char *fastaFile = argv[0];
+    //
+    // index -append <index-dir> <input.fa> adds contigs to an existing index rather than building a new one.
+    //
+    bool append = !strcmp(argv[0], "-append");
+    if (append && argc < 3) {
+        usage();
+    }
+
+    const char *fastaFile = append ? argv[2] : argv[0];
     const char *outputDir = argv[1];
 
     unsigned maxThreads = GetNumberOfProcessors();
@@ -121,8 +270,20 @@ GenomeIndex::runIndexer(
 	bool large = false;
     unsigned locationSize = DEFAULT_LOCATION_SIZE;
 	bool smallMemory = false;
-
-    for (int n = 2; n < argc; n++) {
+    bool sortBuild = false;
+    bool compressOverflow = false;
+    bool perfectHash = false;
+    bool seedSketch = false;
+    bool pack = false;
+    unsigned minimizerWindow = 0;
+    const char *spacedSeedPattern = NULL;
+    int longSeedLen = 0;
+    const char *reportFileName = NULL;
+    const char *biasFileName = NULL;
+    const char *gtfFileName = NULL;
+    unsigned junctionFlank = SpliceJunctions::DefaultFlank;
+
+    for (int n = append ? 3 : 2; n < argc; n++) {
         if (strcmp(argv[n], "-s") == 0) {
             if (n + 1 < argc) {
                 seedLen = atoi(argv[n+1]);
@@ -154,6 +315,69 @@ GenomeIndex::runIndexer(
             }
         } else if (strcmp(argv[n], "-large") == 0) {
             large = true;
+        } else if (strcmp(argv[n], "-sortbuild") == 0) {
+            sortBuild = true;
+        } else if (strcmp(argv[n], "-minimizer") == 0) {
+            if (n + 1 < argc) {
+                minimizerWindow = atoi(argv[n+1]);
+                if (minimizerWindow < 2 || minimizerWindow > MaxMinimizerWindow) {
+                    WriteErrorMessage("Minimizer window must be between 2 and %d inclusive\n", MaxMinimizerWindow);
+                    soft_exit(1);
+                }
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-spacedSeed") == 0) {
+            if (n + 1 < argc) {
+                spacedSeedPattern = argv[n+1];
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-compressOverflow") == 0) {
+            compressOverflow = true;
+        } else if (strcmp(argv[n], "-perfectHash") == 0) {
+            perfectHash = true;
+        } else if (strcmp(argv[n], "-seedSketch") == 0) {
+            seedSketch = true;
+        } else if (strcmp(argv[n], "-pack") == 0) {
+            pack = true;
+        } else if (strcmp(argv[n], "-longSeedSize") == 0) {
+            if (n + 1 < argc) {
+                longSeedLen = atoi(argv[n+1]);
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-biasFile") == 0) {
+            if (n + 1 < argc) {
+                biasFileName = argv[n+1];
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-gtf") == 0) {
+            if (n + 1 < argc) {
+                gtfFileName = argv[n+1];
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-junctionFlank") == 0) {
+            if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+                junctionFlank = atoi(argv[n+1]);
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-report") == 0) {
+            if (n + 1 < argc) {
+                reportFileName = argv[n+1];
+                n++;
+            } else {
+                usage();
+            }
         } else if (argv[n][0] == '-' && argv[n][1] == 'H') {
             histogramFileName = argv[n] + 2;
         } else if (argv[n][0] == '-' && argv[n][1] == 'O') {
@@ -218,30 +442,443 @@ GenomeIndex::runIndexer(
 	}
 
 
+    _uint64 seedMask = ~(_uint64)0;
+    if (NULL != spacedSeedPattern) {
+        seedMask = SeedMaskForPattern(spacedSeedPattern, seedLen);
+        if (0 == seedMask) {
+            WriteErrorMessage("The -spacedSeed pattern must be %d (the seed size) 0s and 1s, start and end with 1, and read the same backward\n", seedLen);
+            soft_exit(1);
+        }
+
+        if (append || 0 != minimizerWindow || !computeBias || NULL != biasFileName) {
+            WriteErrorMessage("-spacedSeed doesn't work with -append, -minimizer, -hg19 or -biasFile\n");
+            soft_exit(1);
+        }
+    }
+
+    if (compressOverflow && (append || locationSize < 5)) {
+        WriteErrorMessage("-compressOverflow needs -locationSize 5 or more, and doesn't work with -append\n");
+        soft_exit(1);
+    }
+
+    if (perfectHash && append) {
+        WriteErrorMessage("-perfectHash doesn't work with -append\n");
+        soft_exit(1);
+    }
+
+    //
+    // Each extra base of seed multiplies the number of hash tables by four unless the key gets bigger, and the tables
+    // have a fixed overhead, so the long seed tables get a key size that keeps them to no more tables than the main
+    // ones (as long as the seed still fills the key).
+    //
+    unsigned longSeedKeySizeInBytes = __min(keySizeInBytes + (unsigned)(longSeedLen - seedLen + 3) / 4, __min((unsigned)longSeedLen / 4, 8u));
+    if (0 != longSeedLen && (append || longSeedLen <= seedLen || longSeedLen > 32 || (unsigned)longSeedLen * 2 - longSeedKeySizeInBytes * 8 > 16)) {
+        WriteErrorMessage("-longSeedSize must be more than the seed size and at most 32, and doesn't work with -append\n");
+        soft_exit(1);
+    }
+
+    if (NULL != gtfFileName && append) {
+        WriteErrorMessage("-gtf doesn't work with -append\n");
+        soft_exit(1);
+    }
+
+    IndexBuildReport report;
+
+    if (append) {
+        _int64 start = timeInMillis();
+        if (!seedSketch) {
+            size_t sketchFileNameSize = strlen(outputDir) + 1 + strlen(SeedSketchFileName) + 1;
+            char *sketchFileName = new char[sketchFileNameSize];
+            snprintf(sketchFileName, sketchFileNameSize, "%s%c%s", outputDir, PATH_SEP, SeedSketchFileName);
+            FILE *sketchFile = fopen(sketchFileName, "rb");
+            if (NULL != sketchFile) {
+                seedSketch = true;
+                fclose(sketchFile);
+            }
+            delete[] sketchFileName;
+        }
+
+        if (!GenomeIndex::AppendToIndex(outputDir, fastaFile, pieceNameTerminatorCharacters, spaceIsAPieceNameTerminator, maxThreads, histogramFileName, &report)) {
+            WriteErrorMessage("Appending to the index failed\n");
+            soft_exit(1);
+        }
+
+        if (seedSketch && !GenomeIndex::BuildSeedSketch(outputDir, &report)) {
+            WriteErrorMessage("Building the seed sketch failed\n");
+            soft_exit(1);
+        }
+
+        if (!GenomeIndex::WriteIndexChecksums(outputDir, &report)) {
+            WriteErrorMessage("Checksumming the index failed\n");
+            soft_exit(1);
+        }
+
+        if (pack && !GenomeIndex::PackIndex(outputDir, maxThreads, &report)) {
+            WriteErrorMessage("Packing the index failed\n");
+            soft_exit(1);
+        }
+        WriteStatusMessage("Index append took %llds\n", (timeInMillis() + 500 - start) / 1000);
+        WriteBuildReport(&report, outputDir, reportFileName);
+        return;
+    }
+
     WriteStatusMessage("Hash table slack %lf\nLoading FASTA file '%s' into memory...", slack, fastaFile);
 
     BigAllocUseHugePages = false;
 
     _int64 start = timeInMillis();
+    report.startPhase("loadFASTA");
     const Genome *genome = ReadFASTAGenome(fastaFile, pieceNameTerminatorCharacters, spaceIsAPieceNameTerminator, chromosomePadding);
     if (NULL == genome) {
         WriteErrorMessage("Unable to read FASTA file\n");
         soft_exit(1);
     }
+    report.endPhase();
     WriteStatusMessage("%llds\n", (timeInMillis() + 500 - start) / 1000);
 
+    if (NULL != gtfFileName) {
+        report.startPhase("spliceJunctions");
+        WriteStatusMessage("Adding splice junctions from '%s'\n", gtfFileName);
+        SpliceJunctions *junctions = SpliceJunctions::readGTF(gtfFileName, genome, junctionFlank);
+        if (NULL == junctions) {
+            soft_exit(1);
+        }
+
+        //
+        // The junctions' file names their contigs, so it's written while we still have the genome they came from.
+        //
+        size_t junctionsFileNameSize = strlen(outputDir) + 1 + strlen(SpliceJunctionsFileName) + 1;
+        char *junctionsFileName = new char[junctionsFileNameSize];
+        snprintf(junctionsFileName, junctionsFileNameSize, "%s%c%s", outputDir, PATH_SEP, SpliceJunctionsFileName);
+        if ((mkdir(outputDir, 0777) != 0 && errno != EEXIST) || !junctions->saveToFile(junctionsFileName)) {
+            WriteErrorMessage("Unable to write the splice junctions to '%s'\n", junctionsFileName);
+            soft_exit(1);
+        }
+        delete[] junctionsFileName;
+
+        Genome *junctionGenome = junctions->buildJunctionGenome();
+        const Genome *genomeWithJunctions = genome->appendGenome(junctionGenome);
+        report.endPhase();
+        report.setValue("spliceJunctions", junctions->getNumJunctions());
+        delete junctionGenome;
+        delete junctions;
+        delete genome;
+        genome = genomeWithJunctions;
+        if (NULL == genome) {
+            soft_exit(1);
+        }
+    }
+
     GenomeDistance nBases = genome->getCountOfBases();
 
     if (!GenomeIndex::BuildIndexToDirectory(genome, seedLen, slack, computeBias, outputDir, maxThreads, chromosomePadding, forceExact, keySizeInBytes, 
-		large, histogramFileName, locationSize, smallMemory)) {
+		large, histogramFileName, locationSize, smallMemory, sortBuild, minimizerWindow, biasFileName, &report, seedMask)) {
         WriteErrorMessage("Genome index build failed\n");
         soft_exit(1);
     }
     genome = NULL;  // It's deleted by BuildIndexToDirectory.
 
+    if (compressOverflow && !GenomeIndex::CompressOverflowTable(outputDir, &report)) {
+        WriteErrorMessage("Compressing the overflow table failed\n");
+        soft_exit(1);
+    }
+
+    if (perfectHash && !GenomeIndex::BuildPerfectHashTables(outputDir, &report)) {
+        WriteErrorMessage("Building the perfect hash tables failed\n");
+        soft_exit(1);
+    }
+
+    if (seedSketch && !GenomeIndex::BuildSeedSketch(outputDir, &report)) {
+        WriteErrorMessage("Building the seed sketch failed\n");
+        soft_exit(1);
+    }
+
+    if (0 != longSeedLen) {
+        report.startPhase("longSeedIndex", __min(GetNumberOfProcessors(), maxThreads));
+        WriteStatusMessage("Building the tables for %d base seeds\n", longSeedLen);
+        if (!GenomeIndex::BuildLongSeedIndex(outputDir, longSeedLen, slack, computeBias, maxThreads, chromosomePadding, forceExact, longSeedKeySizeInBytes,
+                large, locationSize, smallMemory, sortBuild, minimizerWindow, biasFileName, compressOverflow, perfectHash, seedSketch)) {
+            WriteErrorMessage("Building the long seed tables failed\n");
+            soft_exit(1);
+        }
+        report.endPhase();
+        report.setValue("longSeedSize", longSeedLen);
+    }
+
+    if (!GenomeIndex::WriteIndexChecksums(outputDir, &report)) {
+        WriteErrorMessage("Checksumming the index failed\n");
+        soft_exit(1);
+    }
+
+    if (pack && !GenomeIndex::PackIndex(outputDir, maxThreads, &report)) {
+        WriteErrorMessage("Packing the index failed\n");
+        soft_exit(1);
+    }
+
     _int64 end = timeInMillis();
     WriteStatusMessage("Index build and save took %llds (%lld bases/s)\n",
            (end - start) / 1000, nBases / max((end - start) / 1000, (_int64) 1)); 
+
+    WriteBuildReport(&report, outputDir, reportFileName);
+}
+
+    bool
+GenomeIndex::BuildLongSeedIndex(const char *directoryName, int longSeedLen, double slack, bool computeBias, unsigned maxThreads,
+                                unsigned chromosomePaddingSize, bool forceExact, unsigned hashTableKeySize, bool large, unsigned locationSize,
+                                bool smallMemory, bool sortBuild, unsigned minimizerWindow, const char *biasFileName,
+                                bool compressOverflow, bool perfectHash, bool seedSketch)
+/*++
+
+Routine Description:
+
+    The long seed tables are a whole index of their own, built the usual way from the genome that's already saved in
+    directoryName, except that their copy of the genome is deleted once they're done, since loadFromDirectory gives
+    them the main index's.  Their report counters would collide with the main build's, so they go in a report of their
+    own that isn't written; the caller times the whole thing as one phase.
+
+--*/
+{
+    size_t filenameBufferSize = strlen(directoryName) + 1 + strlen(GenomeFileName) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeFileName);
+    const Genome *genome = Genome::loadFromFile(filenameBuffer, chromosomePaddingSize);
+    delete[] filenameBuffer;
+    if (NULL == genome) {
+        WriteErrorMessage("BuildLongSeedIndex: unable to load the genome from '%s'\n", directoryName);
+        return false;
+    }
+
+    char *longSeedDirectoryName = LongSeedIndexDirectoryFor(directoryName);
+    IndexBuildReport longSeedReport;
+    bool worked = BuildIndexToDirectory(genome, longSeedLen, slack, computeBias, longSeedDirectoryName, maxThreads, chromosomePaddingSize, forceExact,
+                    hashTableKeySize, large, NULL, locationSize, smallMemory, sortBuild, minimizerWindow, biasFileName, &longSeedReport) &&
+                  (!compressOverflow || CompressOverflowTable(longSeedDirectoryName, &longSeedReport)) &&
+                  (!perfectHash || BuildPerfectHashTables(longSeedDirectoryName, &longSeedReport)) &&
+                  (!seedSketch || BuildSeedSketch(longSeedDirectoryName, &longSeedReport));
+
+    if (worked) {
+        filenameBufferSize = strlen(longSeedDirectoryName) + 1 + strlen(GenomeFileName) + 1;
+        filenameBuffer = new char[filenameBufferSize];
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", longSeedDirectoryName, PATH_SEP, GenomeFileName);
+        worked = DeleteSingleFile(filenameBuffer);
+        delete[] filenameBuffer;
+    }
+
+    delete[] longSeedDirectoryName;
+    return worked;
+}
+
+    bool
+GenomeIndex::PackIndex(const char *directoryName, unsigned maxThreads, IndexBuildReport *report)
+/*++
+
+Routine Description:
+
+    Pack each of the big files of the index to a temporary name and then move it over the original.  The GenomeIndex
+    file is tiny and stays as it is (so does the seed sketch, which is small and has its own loader).  The long seed
+    directory has no genome, and files that are already packed are left alone.
+
+--*/
+{
+    WriteStatusMessage("Packing the index in '%s'...", directoryName);
+    _int64 start = timeInMillis();
+    report->startPhase("pack", __min(GetNumberOfProcessors(), maxThreads));
+
+    const char *packingSuffix = ".packing";
+    const char *fileNames[] = {GenomeFileName, GenomeIndexHashFileName, OverflowTableFileName};
+    size_t filenameBufferSize = strlen(directoryName) + 1 + __max(strlen(GenomeIndexHashFileName), strlen(OverflowTableFileName)) + strlen(packingSuffix) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
+    char *packedFilenameBuffer = new char[filenameBufferSize];
+    _int64 unpackedBytes = 0, packedBytes = 0;
+    bool worked = true;
+
+    for (size_t i = 0; worked && i < sizeof(fileNames) / sizeof(*fileNames); i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, fileNames[i]);
+        snprintf(packedFilenameBuffer, filenameBufferSize, "%s%s", filenameBuffer, packingSuffix);
+
+        FILE *file = fopen(filenameBuffer, "rb");
+        if (NULL == file) {
+            continue;
+        }
+        fclose(file);
+
+        if (GenericFile_packed::IsPackedFile(filenameBuffer)) {
+            continue;
+        }
+
+        _int64 fileBytes = QueryFileSize(filenameBuffer), filePackedBytes = 0;
+        worked = GenericFile_packed::PackFile(filenameBuffer, packedFilenameBuffer, maxThreads, &filePackedBytes) &&
+                 DeleteSingleFile(filenameBuffer) && MoveSingleFile(packedFilenameBuffer, filenameBuffer);
+        if (!worked) {
+            WriteErrorMessage("Unable to pack '%s'\n", filenameBuffer);
+            DeleteSingleFile(packedFilenameBuffer);
+        }
+        unpackedBytes += fileBytes;
+        packedBytes += filePackedBytes;
+    }
+
+    delete[] filenameBuffer;
+    delete[] packedFilenameBuffer;
+
+    report->endPhase();
+    if (worked) {
+        WriteStatusMessage("%llds, %lld bytes packed into %lld\n", (timeInMillis() + 500 - start) / 1000, unpackedBytes, packedBytes);
+        report->setValue("packedBytes", packedBytes);
+    }
+
+    if (worked && HasLongSeedIndex(directoryName)) {
+        char *longSeedDirectoryName = LongSeedIndexDirectoryFor(directoryName);
+        IndexBuildReport longSeedReport;
+        worked = PackIndex(longSeedDirectoryName, maxThreads, &longSeedReport);
+        delete[] longSeedDirectoryName;
+    }
+
+    return worked;
+}
+
+//
+// The CRC-32 of the part of a (maybe packed) index file from offset on, read the way loadFromDirectory reads it.
+//
+static bool
+ChecksumIndexFile(const char *fileName, _int64 offset, _uint32 *o_checksum)
+{
+    GenericFile *file = GenericFile::open(fileName, GenericFile::ReadOnly);
+    if (NULL == file) {
+        WriteErrorMessage("Unable to open '%s' to checksum it\n", fileName);
+        return false;
+    }
+
+    size_t count = (size_t)(LoadedFileSize(fileName) - offset);
+    bool worked = 0 == file->advance(offset) && file->readInParallel(NULL, count, o_checksum) == count;
+    if (!worked) {
+        WriteErrorMessage("Unable to read '%s' to checksum it\n", fileName);
+    }
+
+    file->close();
+    delete file;
+    return worked;
+}
+
+    bool
+GenomeIndex::WriteIndexChecksums(const char *directoryName, IndexBuildReport *report)
+/*++
+
+Routine Description:
+
+    Read the parameters line of the GenomeIndex file, checksum the files that are there, and write the file back with
+    a line like "checksums Genome:1c291ca3 GenomeIndexHash:... OverflowTable:..." after the parameters.  Versions of
+    SNAP from before the checksums stop parsing at the word "checksums", so they can still load the index.
+
+    The genome's checksum is of just its bases, which are what Genome::loadFromFile reads in parallel; the contig
+    table before them is parsed as it's read, so damage there shows up anyway.
+
+--*/
+{
+    WriteStatusMessage("Checksumming the index in '%s'...", directoryName);
+    _int64 start = timeInMillis();
+    report->startPhase("checksums");
+
+    size_t filenameBufferSize = strlen(directoryName) + 1 + __max(strlen(GenomeIndexFileName), __max(strlen(OverflowTableFileName), __max(strlen(GenomeIndexHashFileName), strlen(GenomeFileName)))) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
+
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeIndexFileName);
+    char parameters[1000];
+    FILE *indexFile = fopen(filenameBuffer, "r");
+    if (NULL == indexFile || NULL == fgets(parameters, sizeof(parameters), indexFile)) {
+        WriteErrorMessage("Unable to read '%s'\n", filenameBuffer);
+        if (NULL != indexFile) {
+            fclose(indexFile);
+        }
+        delete[] filenameBuffer;
+        return false;
+    }
+    fclose(indexFile);
+    parameters[strcspn(parameters, "\r\n")] = '\0';     // Drop any checksums that were there already
+
+    const char *fileNames[] = {GenomeFileName, GenomeIndexHashFileName, OverflowTableFileName};
+    const int nFileNames = sizeof(fileNames) / sizeof(*fileNames);
+    _uint32 checksums[nFileNames];
+    bool present[nFileNames];
+    bool worked = true;
+
+    for (int i = 0; worked && i < nFileNames; i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, fileNames[i]);
+        FILE *file = fopen(filenameBuffer, "rb");
+        present[i] = NULL != file;
+        if (!present[i]) {
+            continue;   // The long seed tables have no genome
+        }
+        fclose(file);
+
+        _int64 offset = 0;
+        if (GenomeFileName == fileNames[i]) {
+            GenomeDistance nBases;
+            unsigned nContigs;
+            if (!Genome::getSizeFromFile(filenameBuffer, &nBases, &nContigs)) {
+                worked = false;
+                break;
+            }
+            offset = LoadedFileSize(filenameBuffer) - nBases;
+        }
+        worked = ChecksumIndexFile(filenameBuffer, offset, &checksums[i]);
+    }
+
+    if (worked) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeIndexFileName);
+        indexFile = fopen(filenameBuffer, "w");
+        if (NULL == indexFile) {
+            WriteErrorMessage("Unable to open file '%s' for write.\n", filenameBuffer);
+            worked = false;
+        } else {
+            fprintf(indexFile, "%s\n%s", parameters, IndexChecksumsTag);
+            for (int i = 0; i < nFileNames; i++) {
+                if (present[i]) {
+                    fprintf(indexFile, " %s:%08x", fileNames[i], checksums[i]);
+                }
+            }
+            fprintf(indexFile, "\n");
+            worked = 0 == fclose(indexFile);
+        }
+    }
+    delete[] filenameBuffer;
+
+    report->endPhase();
+    if (worked) {
+        WriteStatusMessage("%llds\n", (timeInMillis() + 500 - start) / 1000);
+    }
+
+    if (worked && HasLongSeedIndex(directoryName)) {
+        char *longSeedDirectoryName = LongSeedIndexDirectoryFor(directoryName);
+        IndexBuildReport longSeedReport;
+        worked = WriteIndexChecksums(longSeedDirectoryName, &longSeedReport);
+        delete[] longSeedDirectoryName;
+    }
+
+    return worked;
+}
+
+    void
+GenomeIndex::WriteBuildReport(IndexBuildReport *report, const char *directoryName, const char *reportFileName)
+{
+    if (NULL == reportFileName) {
+        return;
+    }
+
+    size_t filenameBufferSize = 0;
+    for (int i = 0; i < nIndexFileNames; i++) {
+        filenameBufferSize = __max(filenameBufferSize, strlen(directoryName) + 1 + strlen(IndexFileNames[i]) + 1);
+    }
+    char *filenameBuffer = new char[filenameBufferSize];
+
+    for (int i = 0; i < nIndexFileNames; i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, IndexFileNames[i]);
+        report->recordFile(IndexFileNames[i], QueryFileSize(filenameBuffer));
+    }
+    delete[] filenameBuffer;
+
+    if (!report->writeToFile(reportFileName)) {
+        soft_exit(1);
+    }
 }
 
 //
@@ -261,7 +898,8 @@ SetInvalidGenomeLocation(unsigned locationSize)
     bool
 GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double slack, bool computeBias, const char *directoryName,
                                     unsigned maxThreads, unsigned chromosomePaddingSize, bool forceExact, unsigned hashTableKeySize, 
-									bool large, const char *histogramFileName, unsigned locationSize, bool smallMemory)
+									bool large, const char *histogramFileName, unsigned locationSize, bool smallMemory, bool sortBuild,
+                                    unsigned minimizerWindow, const char *biasFileName, IndexBuildReport *report, _uint64 seedMask)
 {
 	PreventMachineHibernationWhileThisThreadIsAlive();
 
@@ -287,15 +925,27 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     
 	fprintf(stderr,"Saving genome...");
 	_int64 start = timeInMillis();
+    report->startPhase("saveGenome");
     snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeFileName);
     if (!genome->saveToFile(filenameBuffer)) {
         WriteErrorMessage("GenomeIndex::saveToDirectory: Failed to save the genome itself\n");
         delete[] filenameBuffer;
         return false;
     }
+    report->endPhase();
 	fprintf(stderr,"%llds\n", (timeInMillis() + 500 - start) / 1000);
 
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, SeedSketchFileName);
+    DeleteSingleFile(filenameBuffer);   // Any sketch here is for some other index; runIndexer builds a new one if it's wanted
+
+    if (HasLongSeedIndex(directoryName)) {    // Likewise any long seed tables
+        char *longSeedDirectoryName = LongSeedIndexDirectoryFor(directoryName);
+        DeleteIndexDirectory(longSeedDirectoryName);
+        delete[] longSeedDirectoryName;
+    }
+
 	GenomeIndex *index = new GenomeIndex();
+    index->seedMask = seedMask;
     index->genome = NULL;   // We always delete the index when we're done, but we delete the genome first to save space during the overflow table build.
 
     GenomeDistance countOfBases = genome->getCountOfBases();
@@ -322,15 +972,91 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     if (computeBias) {
         unsigned nHashTables = 1 << ((max((unsigned)seedLen, hashTableKeySize * 4) - hashTableKeySize * 4) * 2);
         biasTable = new double[nHashTables];
-        ComputeBiasTable(genome, seedLen, biasTable, maxThreads, forceExact, hashTableKeySize, large);
-    }
+        report->startPhase("biasTable", __min(GetNumberOfProcessors(), maxThreads));
 
-    WriteStatusMessage("Allocating memory for hash tables...");
+        //
+        // With -biasFile, reuse the table from an earlier build of this genome with the same parameters if there was one,
+        // and otherwise save the one we compute for next time.
+        //
+        _uint64 genomeChecksum = 0;
+        bool loadedBiasTable = false;
+        if (NULL != biasFileName) {
+            genomeChecksum = ComputeGenomeChecksum(genome);
+            loadedBiasTable = LoadBiasTable(biasFileName, genomeChecksum, countOfBases, seedLen, hashTableKeySize, large, forceExact, biasTable, nHashTables);
+            if (loadedBiasTable) {
+                WriteStatusMessage("Using the bias table from '%s'\n", biasFileName);
+            }
+        }
+
+        if (!loadedBiasTable) {
+            bool exact = ComputeBiasTable(genome, seedLen, biasTable, maxThreads, forceExact, hashTableKeySize, large, seedMask);
+            if (NULL != biasFileName) {
+                SaveBiasTable(biasFileName, genomeChecksum, countOfBases, seedLen, hashTableKeySize, large, exact, biasTable, nHashTables);
+            }
+        }
+        report->endPhase();
+        report->setValue("biasTableFromFile", loadedBiasTable ? 1 : 0);
+    }
+
+    //
+    // For minimizer indices, find the locations we're going to index.  The bias table sizes the hash tables for all of
+    // the seeds, so scale that down by the fraction we're keeping.  We pad the fraction a bit, because seeds that occur
+    // many times (which take one hash table entry for all of their locations) are less likely to be minimizers.
+    //
+    _uint64 *minimizerLocations = NULL;
+    GenomeDistance basesToSizeHashTablesFor = countOfBases;
+    if (0 != minimizerWindow) {
+        _int64 nMinimizerLocations, nSeedLocations;
+        report->startPhase("minimizers", __min(GetNumberOfProcessors(), maxThreads));
+        minimizerLocations = ComputeMinimizerLocations(genome, seedLen, minimizerWindow, maxThreads, &nMinimizerLocations, &nSeedLocations);
+        report->endPhase();
+        report->setValue("minimizerLocations", nMinimizerLocations);
+        report->setValue("seedLocations", nSeedLocations);
+        double fractionIndexed = __min(1.0, 1.2 * (double)nMinimizerLocations / (double)__max(nSeedLocations, (_int64)1));
+        basesToSizeHashTablesFor = (GenomeDistance)(countOfBases * fractionIndexed);
+    }
+
+    WriteStatusMessage("Allocating memory for hash tables...");
     start = timeInMillis();
+    report->startPhase("allocateHashTables");
     unsigned nHashTables;
     SNAPHashTable** hashTables = index->hashTables =
-        allocateHashTables(&nHashTables, countOfBases, slack, seedLen, hashTableKeySize, large, locationSize, biasTable);
+        allocateHashTables(&nHashTables, basesToSizeHashTablesFor, slack, seedLen, hashTableKeySize, large, locationSize, biasTable);
     index->nHashTables = nHashTables;
+    report->endPhase();
+    report->setValue("countOfBases", countOfBases);
+    report->setValue("seedLen", seedLen);
+    report->setValue("locationSize", locationSize);
+    report->setValue("nHashTables", nHashTables);
+
+    if (sortBuild) {
+        size_t totalBytesWritten;
+        bool worked = BuildHashTablesBySorting(index, genome, seedLen, hashTableKeySize, large, locationSize, maxThreads, directoryName,
+                                               buildHistogram ? histogramFile : NULL, &totalBytesWritten, minimizerLocations, report);
+        delete genome;
+        genome = NULL;
+        if (NULL != minimizerLocations) {
+            BigDealloc(minimizerLocations);
+            minimizerLocations = NULL;
+        }
+
+        if (buildHistogram) {
+            fclose(histogramFile);
+        }
+
+        report->startPhase("saveIndexParameters");
+        worked = worked && SaveIndexParameters(directoryName, index->nHashTables, index->overflowTableSize, seedLen, chromosomePaddingSize,
+                                               hashTableKeySize, totalBytesWritten, large, locationSize, false, minimizerWindow, seedMask);
+        report->endPhase();
+
+        delete index;
+        if (computeBias && biasTable != NULL) {
+            delete[] biasTable;
+        }
+        delete[] filenameBuffer;
+
+        return worked;
+    }
 
     //
     // Set up the hash tables.  Each table has a key value of the lower 32 bits of the seed, and data
@@ -368,6 +1094,7 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     }
 
     runningThreadCount = nThreads;
+    report->startPhase("hashTableBuild", nThreads);
 
     GenomeDistance nextChunkToProcess = 0;
 	_int64 * lastBackpointerIndexUsedByThread = NULL;
@@ -418,9 +1145,12 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         threadContexts[i].hashTableKeySize = hashTableKeySize;
 		threadContexts[i].large = large;
         threadContexts[i].locationSize = locationSize;
+        threadContexts[i].minimizerLocations = minimizerLocations;
 		threadContexts[i].backpointerSpillLock = &backpointerSpillLock;
 		threadContexts[i].lastBackpointerIndexUsedByThread = lastBackpointerIndexUsedByThread;
 		threadContexts[i].backpointerSpillFile = backpointerSpillFile;
+        threadContexts[i].nextBackpointerInChunk = 0;
+        threadContexts[i].backpointerChunkEnd = 0;
 
         StartNewThread(BuildHashTablesWorkerThreadMain, &threadContexts[i]);
     }
@@ -435,6 +1165,13 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         exit(1);
     }
 
+    report->endPhase();
+    report->setValue("nonSeeds", nonSeeds);
+    report->setValue("seedsWithMultipleOccurrences", seedsWithMultipleOccurrences);
+    report->setValue("genomeLocationsInOverflowTable", genomeLocationsInOverflowTable);
+    report->setValue("bothComplementsUsed", bothComplementsUsed);
+    report->setValue("noBaseAvailable", noBaseAvailable);
+
     size_t totalUsedHashTableElements = 0;
     for (unsigned j = 0; j < index->nHashTables; j++) {
         totalUsedHashTableElements += hashTables[j]->GetUsedElementCount();
@@ -461,6 +1198,11 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     delete genome;
     genome = NULL;
 
+    if (NULL != minimizerLocations) {
+        BigDealloc(minimizerLocations);
+        minimizerLocations = NULL;
+    }
+
 	char *halfBuiltHashTableSpillFileName = NULL;
 
 	if (smallMemory) {
@@ -471,6 +1213,7 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
 		//
 		_int64 startSpill = timeInMillis();
 		WriteStatusMessage("Spilling half-built hash tables to disk..");
+        report->startPhase("spillHashTables");
 #define	HALF_BUILT_HASH_TABLE_SPILL_FILE_NAME "HalfBuiltHashTables"
 		halfBuiltHashTableSpillFileName = new char[strlen(directoryName) + 1 + strlen(HALF_BUILT_HASH_TABLE_SPILL_FILE_NAME) + 20];	// +20 is for the number and trailing null
 
@@ -489,6 +1232,7 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
 		fclose(backpointerSpillFile);
 		DeleteSingleFile(backpointerSpillFileName);
 		delete[] backpointerSpillFileName;
+        report->endPhase();
 
 		WriteStatusMessage("%llds\n", (timeInMillis() - spillDone + 500) / 1000);
 	}
@@ -496,6 +1240,7 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     WriteStatusMessage("Building overflow table.\n");
     start = timeInMillis();
     fflush(stdout);
+    report->startPhase("overflowTableBuildAndHashTableSave");
 
     //
     // Now build the real overflow table and simultaneously fixup the hash table entries.
@@ -523,7 +1268,6 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     _uint64 nBackpointersProcessed = 0;
     _int64 lastPrintTime = timeInMillis();
 
-    const unsigned maxHistogramEntry = 500000;
     _uint64 countOfTooBigForHistogram = 0;
     _uint64  sumOfTooBigForHistogram = 0;
     _uint64 largestSeed = 0;
@@ -677,12 +1421,7 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
 
     if (buildHistogram) {
         histogram[1] = (unsigned)(totalUsedHashTableElements - seedsWithMultipleOccurrences);
-        for (unsigned i = 0; i <= maxHistogramEntry; i++) {
-            if (histogram[i] != 0) {
-                fprintf(histogramFile,"%d\t%d\n", i, histogram[i]);
-            }
-        }
-        fprintf(histogramFile, "%d larger than %d with %d total genome locations, largest seed %d\n", countOfTooBigForHistogram, maxHistogramEntry, sumOfTooBigForHistogram, largestSeed);
+        WriteSeedHistogram(histogramFile, histogram, maxHistogramEntry, countOfTooBigForHistogram, sumOfTooBigForHistogram, largestSeed);
         fclose(histogramFile);
         delete [] histogram;
     }
@@ -690,8 +1429,13 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     //
     // Now save out the part of the index that's independent of the genome itself.
     //
+    report->endPhase();
+    report->setValue("overflowTableSize", index->overflowTableSize);
+    report->setValue("usedHashTableElements", totalUsedHashTableElements);
+
     WriteStatusMessage("Overflow table build and hash table save took %llds\nSaving overflow table...", (timeInMillis() + 500 - start)/1000);
     start = timeInMillis();
+    report->startPhase("saveOverflowTable");
 
 
     snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, OverflowTableFileName);
@@ -720,6 +1464,227 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     fclose(fOverflowTable);
     fOverflowTable = NULL;
 
+    if (!SaveIndexParameters(directoryName, index->nHashTables, index->overflowTableSize, seedLen, chromosomePaddingSize, hashTableKeySize,
+                             totalBytesWritten, large, locationSize, false, minimizerWindow, seedMask)) {
+        delete[] filenameBuffer;
+        return false;
+    }
+    report->endPhase();
+ 
+    delete index;
+    if (computeBias && biasTable != NULL) {
+        delete[] biasTable;
+    }
+ 
+    WriteStatusMessage("%llds\n", (timeInMillis() + 500 - start) / 1000);
+
+    delete[] filenameBuffer;
+    
+    return true;
+}
+
+
+
+    bool
+GenomeIndex::AppendToIndex(const char *directoryName, const char *fastaFile, const char *pieceNameTerminatorCharacters,
+                           bool spaceIsAPieceNameTerminator, unsigned maxThreads, const char *histogramFileName, IndexBuildReport *report)
+/*++
+
+Routine Description:
+
+    Add the contigs in a FASTA file to an existing index (index -append).  The existing genome is kept as is with
+    the new contigs after it, so none of the existing genome locations change.  Only the new part of the genome gets
+    scanned for seeds, and they're merged into the existing hash tables by the -sortbuild code, which also rewrites the
+    overflow table (whose offsets all move because the genome got bigger).  The result is the same index you'd get by
+    building from the combined FASTA, apart from hash table sizes.
+
+    The new files are built in a subdirectory and moved over the old ones at the end, so a failure while building
+    leaves the existing index alone.  The moves aren't atomic as a group: if they fail part way, the index is left
+    without its GenomeIndex file (so it won't load) and the rest of the new files are still in the subdirectory (see
+    MoveStagedIndexFiles).  It needs enough memory for both the old and new indices.
+
+Arguments:
+
+    directoryName                   - the index directory
+    fastaFile                       - the FASTA file with the contigs to add
+    pieceNameTerminatorCharacters   - as for the regular build (-B)
+    spaceIsAPieceNameTerminator     - as for the regular build (-bSpace)
+    maxThreads                      - the most threads to use
+    histogramFileName               - if non-NULL, write a seed popularity histogram for the whole index here
+    report                          - gets the time for each phase and the build statistics
+
+--*/
+{
+	PreventMachineHibernationWhileThisThreadIsAlive();
+
+    WriteStatusMessage("Loading existing index from '%s'...", directoryName);
+    _int64 start = timeInMillis();
+    report->startPhase("loadExistingIndex");
+    GenomeIndex *existingIndex = loadFromDirectory((char *)directoryName, false, false);
+    if (NULL == existingIndex) {
+        WriteErrorMessage("Unable to load the index in '%s'\n", directoryName);
+        return false;
+    }
+    report->endPhase();
+    WriteStatusMessage("%llds\n", (timeInMillis() + 500 - start) / 1000);
+
+    if (existingIndex->hasCompressedOverflowTable()) {
+        WriteErrorMessage("Can't append to an index with a compressed overflow table.  Rebuild it, and compress it afterward.\n");
+        delete existingIndex;
+        return false;
+    }
+
+    for (unsigned whichHashTable = 0; whichHashTable < existingIndex->nHashTables; whichHashTable++) {
+        if (existingIndex->hashTables[whichHashTable]->UsesPerfectHash()) {
+            WriteErrorMessage("Can't append to an index with perfect hash tables.  Rebuild it with the added contigs.\n");
+            delete existingIndex;
+            return false;
+        }
+    }
+
+    if (NULL != existingIndex->longSeedIndex) {
+        WriteErrorMessage("Can't append to an index with long seed tables.  Rebuild it with the added contigs.\n");
+        delete existingIndex;
+        return false;
+    }
+
+    const Genome *existingGenome = existingIndex->genome;
+    unsigned chromosomePadding = existingGenome->getChromosomePadding();
+
+    WriteStatusMessage("Loading FASTA file '%s' into memory...", fastaFile);
+    start = timeInMillis();
+    report->startPhase("loadFASTA");
+    const Genome *additionalGenome = ReadFASTAGenome(fastaFile, pieceNameTerminatorCharacters, spaceIsAPieceNameTerminator, chromosomePadding);
+    if (NULL == additionalGenome) {
+        WriteErrorMessage("Unable to read FASTA file\n");
+        delete existingIndex;
+        return false;
+    }
+    report->endPhase();
+    WriteStatusMessage("%llds\n", (timeInMillis() + 500 - start) / 1000);
+
+    const Genome *genome = existingGenome->appendGenome(additionalGenome);
+    int nAddedContigs = additionalGenome->getNumContigs();
+    delete additionalGenome;
+    additionalGenome = NULL;
+    if (NULL == genome) {
+        delete existingIndex;
+        return false;
+    }
+
+    unsigned locationSize = existingIndex->locationSize;
+    if (locationSize != 8 && genome->getCountOfBases() > ((_int64) 1 << (locationSize*8)) - 16) {
+        WriteErrorMessage("The genome would be too big for the index's %d byte genome locations.  Rebuild it from scratch with a larger -locationSize\n", locationSize);
+        delete genome;
+        delete existingIndex;
+        return false;
+    }
+
+    WriteStatusMessage("Adding %d contigs (%lld bases) to the index\n", nAddedContigs, genome->getCountOfBases() - existingGenome->getCountOfBases());
+
+    const char *stagingDirectoryName = "AppendInProgress";
+    size_t stagingDirectoryBufferSize = strlen(directoryName) + 1 + strlen(stagingDirectoryName) + 1;
+    char *stagingDirectory = new char[stagingDirectoryBufferSize];
+    snprintf(stagingDirectory, stagingDirectoryBufferSize, "%s%c%s", directoryName, PATH_SEP, stagingDirectoryName);
+    if (mkdir(stagingDirectory, 0777) != 0 && errno != EEXIST) {
+        WriteErrorMessage("AppendToIndex: failed to create directory %s\n", stagingDirectory);
+        delete[] stagingDirectory;
+        delete genome;
+        delete existingIndex;
+        return false;
+    }
+
+    size_t filenameBufferSize = 0;
+    for (int i = 0; i < nIndexFileNames; i++) {
+        filenameBufferSize = __max(filenameBufferSize, stagingDirectoryBufferSize + 1 + strlen(IndexFileNames[i]) + 1);
+    }
+    char *filenameBuffer = new char[filenameBufferSize];
+    char *destinationFilenameBuffer = new char[filenameBufferSize];
+
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", stagingDirectory, PATH_SEP, GenomeFileName);
+    report->startPhase("saveGenome");
+    if (!genome->saveToFile(filenameBuffer)) {
+        WriteErrorMessage("AppendToIndex: Failed to save the genome\n");
+        soft_exit(1);
+    }
+    report->endPhase();
+    report->setValue("countOfBases", genome->getCountOfBases());
+    report->setValue("seedLen", existingIndex->seedLen);
+    report->setValue("locationSize", locationSize);
+    report->setValue("nHashTables", existingIndex->nHashTables);
+
+    FILE *histogramFile = NULL;
+    if (NULL != histogramFileName) {
+        histogramFile = fopen(histogramFileName, "w");
+        if (NULL == histogramFile) {
+            WriteErrorMessage("Unable to open histogram file '%s', skipping it.\n", histogramFileName);
+        }
+    }
+
+    GenomeIndex *index = new GenomeIndex();
+    index->seedMask = existingIndex->seedMask;
+    index->nHashTables = existingIndex->nHashTables;
+    index->hashTables = new SNAPHashTable *[index->nHashTables];
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        index->hashTables[i] = NULL;    // BuildHashTablesBySorting allocates them
+    }
+
+    //
+    // A minimizer index stays one, with the same window.
+    //
+    _uint64 *minimizerLocations = NULL;
+    if (0 != existingIndex->minimizerWindow) {
+        _int64 nMinimizerLocations, nSeedLocations;
+        report->startPhase("minimizers", __min(GetNumberOfProcessors(), maxThreads));
+        minimizerLocations = ComputeMinimizerLocations(genome, existingIndex->seedLen, existingIndex->minimizerWindow, maxThreads, &nMinimizerLocations, &nSeedLocations);
+        report->endPhase();
+        report->setValue("minimizerLocations", nMinimizerLocations);
+        report->setValue("seedLocations", nSeedLocations);
+    }
+
+    size_t totalBytesWritten;
+    bool worked = BuildHashTablesBySorting(index, genome, existingIndex->seedLen, existingIndex->hashTableKeySize, existingIndex->largeHashTable, locationSize,
+                                           maxThreads, stagingDirectory, histogramFile, &totalBytesWritten, minimizerLocations, report, existingIndex);
+
+    if (NULL != minimizerLocations) {
+        BigDealloc(minimizerLocations);
+        minimizerLocations = NULL;
+    }
+
+    if (NULL != histogramFile) {
+        fclose(histogramFile);
+    }
+
+    report->startPhase("saveIndexParameters");
+    worked = worked && SaveIndexParameters(stagingDirectory, index->nHashTables, index->overflowTableSize, existingIndex->seedLen, chromosomePadding,
+                                           existingIndex->hashTableKeySize, totalBytesWritten, existingIndex->largeHashTable, locationSize, false,
+                                           existingIndex->minimizerWindow, existingIndex->seedMask);
+    report->endPhase();
+
+    delete index;
+    delete genome;
+    delete existingIndex;
+
+    worked = worked && MoveStagedIndexFiles(stagingDirectory, directoryName, IndexFileNames, nIndexFileNames, "AppendToIndex");
+
+    if (worked) {
+        rmdir(stagingDirectory);
+        snprintf(destinationFilenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, SeedSketchFileName);
+        DeleteSingleFile(destinationFilenameBuffer);   // It's for the old hash tables; runIndexer builds a new one
+    }
+
+    delete[] filenameBuffer;
+    delete[] destinationFilenameBuffer;
+    delete[] stagingDirectory;
+
+    return worked;
+}
+
+    bool
+GenomeIndex::SaveIndexParameters(const char *directoryName, unsigned nHashTables, _uint64 overflowTableSize, int seedLen, unsigned chromosomePaddingSize,
+                                 unsigned hashTableKeySize, size_t hashTablesFileSize, bool large, unsigned locationSize, bool compressedOverflow,
+                                 unsigned minimizerWindow, _uint64 seedMask)
+{
     //
     // The save format is:
     //  file 'GenomeIndex' contains in order major version, minor version, nHashTables, overflowTableSize, seedLen, chromosomePaddingSize.
@@ -728,6 +1693,8 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     //  table number.
     //  And the genome itself is already saved in the same directory in its own format.
     //
+    size_t filenameBufferSize = strlen(directoryName) + 1 + strlen(GenomeIndexFileName) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
     snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeIndexFileName);
 
     FILE *indexFile = fopen(filenameBuffer,"w");
@@ -737,25 +1704,25 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         return false;
     }
 
-    fprintf(indexFile,"%d %d %d %lld %d %d %d %lld %d %d", GenomeIndexFormatMajorVersion, GenomeIndexFormatMinorVersion, index->nHashTables, 
-        index->overflowTableSize, seedLen, chromosomePaddingSize, hashTableKeySize, totalBytesWritten, large ? 0 : 1, locationSize); 
-
-    fclose(indexFile);
- 
-    delete index;
-    if (computeBias && biasTable != NULL) {
-        delete[] biasTable;
+    bool spaced = ~(_uint64)0 != seedMask;
+    bool extended = compressedOverflow || 0 != minimizerWindow || spaced;
+    fprintf(indexFile,"%d %d %d %lld %d %d %d %lld %d %d",
+        spaced ? SpacedSeedGenomeIndexFormatMajorVersion : extended ? ExtendedGenomeIndexFormatMajorVersion : GenomeIndexFormatMajorVersion,
+        GenomeIndexFormatMinorVersion, nHashTables, 
+        overflowTableSize, seedLen, chromosomePaddingSize, hashTableKeySize, hashTablesFileSize, large ? 0 : 1, locationSize); 
+    if (extended) {
+        fprintf(indexFile, " %d %d", compressedOverflow ? 1 : 0, minimizerWindow);
+    }
+    if (spaced) {
+        fprintf(indexFile, " %llu", seedMask);
     }
- 
-    WriteStatusMessage("%llds\n", (timeInMillis() + 500 - start) / 1000);
 
+    fclose(indexFile);
     delete[] filenameBuffer;
-    
+
     return true;
 }
 
-
-
 SNAPHashTable** GenomeIndex::allocateHashTables(
     unsigned*       o_nTables,
     GenomeDistance  countOfBases,
@@ -830,7 +1797,7 @@ SNAPHashTable** GenomeIndex::allocateHashTables(
             biasedSize = 100;
         }
         
-        hashTables[i] = new SNAPHashTable(biasedSize, hashTableKeySize, locationSize, large ? 2 : 1, GenomeLocationAsInt64(InvalidGenomeLocation));
+        hashTables[i] = new SNAPHashTable(biasedSize, hashTableKeySize, locationSize, large ? 2 : 1, GenomeLocationAsInt64(InvalidGenomeLocation), true);
  
         if (NULL == hashTables[i]) {
             WriteErrorMessage("IndexBuilder: unable to allocate HashTable %d of %d\n", i+1, nHashTablesToBuild);
@@ -845,7 +1812,7 @@ SNAPHashTable** GenomeIndex::allocateHashTables(
 
 
 
-GenomeIndex::GenomeIndex() : nHashTables(0), hashTables(NULL), overflowTable32(NULL), overflowTable64(NULL), genome(NULL), tablesBlob(NULL), mappedOverflowTable(NULL), mappedTables(NULL)
+GenomeIndex::GenomeIndex() : nHashTables(0), hashTables(NULL), overflowTable32(NULL), overflowTable64(NULL), compressedOverflowTable(NULL), seedSketch(NULL), spliceJunctions(NULL), minimizerWindow(0), seedMask(~(_uint64)0), restrictedToContigs(false), outOfCore(false), genome(NULL), longSeedIndex(NULL), overflowTableSizeInBytes(0), tablesBlob(NULL), tablesBlobSize(0), mappedOverflowTable(NULL), mappedTables(NULL)
 {
 }
 
@@ -876,19 +1843,36 @@ GenomeIndex::~GenomeIndex()
 			overflowTable64 = NULL;
 		}
 
+		if (NULL != compressedOverflowTable) {
+			BigDealloc((void *)compressedOverflowTable);
+			compressedOverflowTable = NULL;
+		}
+
 		if (NULL != tablesBlob) {
 			BigDealloc(tablesBlob);
 			tablesBlob = NULL;
 		}
 	}
 
+    if (NULL != longSeedIndex) {
+        longSeedIndex->genome = NULL;
+        delete longSeedIndex;
+        longSeedIndex = NULL;
+    }
+
 	delete genome;
 	genome = NULL;
 
+    delete seedSketch;
+    seedSketch = NULL;
+
+    delete spliceJunctions;
+    spliceJunctions = NULL;
 }
 
-    void
-GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table, unsigned maxThreads, bool forceExact, unsigned hashTableKeySize, bool large)
+    bool
+GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table, unsigned maxThreads, bool forceExact, unsigned hashTableKeySize, bool large,
+                              _uint64 seedMask)
 /**
  * Fill in table with the table size biases for a given genome and seed size.
  * We assume that table is already of the correct size for our seed size
@@ -896,6 +1880,7 @@ GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table,
  *
  * If the genome is less than 2^20 bases, we count the seeds in each table exactly;
  * otherwise, we estimate them using Flajolet-Martin approximate counters.
+ * Returns whether the counts were exact.
  */
 {
     _int64 start = timeInMillis();
@@ -949,7 +1934,7 @@ GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table,
                 continue;
             }
 
-            Seed seed(bases, seedLen);
+            Seed seed = Seed(bases, seedLen).masked(seedMask);
             validSeeds++;
 
 			if (large && seed.isBiggerThanItsReverseComplement()) {
@@ -974,25 +1959,26 @@ GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table,
 		seedsSeen = NULL;
     } else {
         //
-        // Run through the table in parallel.
+        // Run through the table in parallel.  Each thread counts into its own set of counters, so there's no locking,
+        // and we merge them at the end.  A set of counters takes ApproximateCounter::SizeInBytes per hash table, which
+        // adds up with lots of hash tables, so use fewer threads rather than more than an eighth of memory (or 1GB,
+        // if that's more).
         //
         unsigned nThreads = __min(GetNumberOfProcessors(), maxThreads);
+        _int64 counterSetSize = (_int64)nHashTables * ApproximateCounter::SizeInBytes;
+        _int64 memoryForCounters = __max(GetPhysicalMemorySize() / 8, (_int64)1 << 30);
+        nThreads = (unsigned)__max(__min((_int64)nThreads, memoryForCounters / counterSetSize), (_int64)1);
+
         volatile int runningThreadCount = nThreads;
         volatile _int64 nBasesProcessed = 0;
         SingleWaiterObject doneObject;
 
-        ExclusiveLock *locks;
-        locks = new ExclusiveLock[nHashTables];
-        for (unsigned i = 0; i < nHashTables; i++) {
-            InitializeExclusiveLock(&locks[i]);
-        }
-
         CreateSingleWaiterObject(&doneObject);
 
         ComputeBiasTableThreadContext *contexts = new ComputeBiasTableThreadContext[nThreads];
         GenomeDistance nextChunkToProcess = 0;
         for (unsigned i = 0; i < nThreads; i++) {
-            contexts[i].approxCounters = &approxCounters;
+            contexts[i].approxCounters = (0 == i) ? &approxCounters : new vector<ApproximateCounter>(nHashTables);
             contexts[i].doneObject = &doneObject;
             contexts[i].genomeChunkStart = nextChunkToProcess;
             if (i == nThreads - 1) {
@@ -1008,8 +1994,8 @@ GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table,
             contexts[i].nBasesProcessed = &nBasesProcessed;
             contexts[i].seedLen = seedLen;
             contexts[i].validSeeds = &validSeeds;
-            contexts[i].approximateCounterLocks = locks;
 			contexts[i].large = large;
+            contexts[i].seedMask = seedMask;
 
             StartNewThread(ComputeBiasTableWorkerThreadMain, &contexts[i]);
         }
@@ -1017,10 +2003,13 @@ GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table,
         WaitForSingleWaiterObject(&doneObject);
         DestroySingleWaiterObject(&doneObject);
 
-        for (unsigned i = 0; i < nHashTables; i++) {
-            DestroyExclusiveLock(&locks[i]);
+        for (unsigned i = 1; i < nThreads; i++) {
+            for (unsigned j = 0; j < nHashTables; j++) {
+                approxCounters[j].merge((*contexts[i].approxCounters)[j]);
+            }
+            delete contexts[i].approxCounters;
         }
-        delete [] locks;
+        delete [] contexts;
     }
 
 
@@ -1038,30 +2027,144 @@ GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table,
 	numExactSeeds = NULL;
 
     WriteStatusMessage("Computed bias table in %llds\n", (timeInMillis() + 500 - start) / 1000);
+
+    return computeExactly;
 }
 
-struct PerCounterBatch {
-    PerCounterBatch() : nUsed(0) {}
-    static const unsigned nSeedsPerBatch = 1000;
+    _uint64
+GenomeIndex::ComputeGenomeChecksum(const Genome *genome)
+/*++
+
+Routine Description:
+
+    Hash the genome's bases (including the padding between the contigs, which is where seeds can't go), so that a bias
+    table file can tell whether it's got a table for this genome.
+
+--*/
+{
+    const char *bases = genome->getSubstring(0, 0);
+    GenomeDistance countOfBases = genome->getCountOfBases();
+    const GenomeDistance chunkSize = 64 * 1024 * 1024;   // util::hash64 takes an int length
+
+    _uint64 checksum = util::hash64((_uint64)countOfBases);
+    for (GenomeDistance offset = 0; offset < countOfBases; offset += chunkSize) {
+        checksum = util::hash64(checksum ^ util::hash64(bases + offset, (int)__min(chunkSize, countOfBases - offset)));
+    }
+
+    return checksum;
+}
+
+//
+// The bias table file (index -biasFile) is text, a header line followed by any number of tables.  Each table has a line
+// with the parameters it's for (seed length, key size, large, exact, count of bases, genome checksum and number of hash
+// tables), followed by its values one per line.
+//
+static const char *BiasFileHeader = "SNAP bias tables 1";
+
+    bool
+GenomeIndex::LoadBiasTable(const char *biasFileName, _uint64 genomeChecksum, GenomeDistance countOfBases, int seedLen, unsigned hashTableKeySize,
+                           bool large, bool forceExact, double *table, unsigned nHashTables)
+/*++
+
+Routine Description:
+
+    Look for a table for this genome and these index parameters in a bias table file.  An exact table will do when
+    we'd compute an approximate one, but not the other way around.
+
+Arguments:
 
-    unsigned nUsed;
-    _uint64 lowBases[nSeedsPerBatch];
+    biasFileName    - the bias table file, which needn't exist
+    genomeChecksum  - ComputeGenomeChecksum of the genome
+    countOfBases    - the size of the genome
+    seedLen         - the seed length
+    hashTableKeySize- the hash table key size in bytes
+    large           - whether it's for a large index
+    forceExact      - whether we need an exact table (-exact)
+    table           - gets the table, if we find it
+    nHashTables     - the number of entries in the table
+
+Return Value:
+
+    true if it found the table.
+
+--*/
+{
+    FILE *biasFile = fopen(biasFileName, "r");
+    if (NULL == biasFile) {
+        return false;
+    }
 
-    bool addSeed(_uint64 seedLowBases) {
-        _ASSERT(nUsed < nSeedsPerBatch);
-        lowBases[nUsed] = seedLowBases;
-        nUsed++;
-        return nUsed >= nSeedsPerBatch;
+    char header[100];
+    if (NULL == fgets(header, sizeof(header), biasFile) || strncmp(header, BiasFileHeader, strlen(BiasFileHeader))) {
+        WriteErrorMessage("'%s' isn't a bias table file, ignoring it\n", biasFileName);
+        fclose(biasFile);
+        return false;
     }
 
-    void apply(ApproximateCounter *counter) {
-        for (unsigned i = 0; i < nUsed; i++) {
-            counter->add(lowBases[i]);
+    int fileSeedLen, fileLarge, fileExact;
+    unsigned fileKeySize, fileNHashTables;
+    _int64 fileCountOfBases;
+    _uint64 fileChecksum;
+    while (7 == fscanf(biasFile, "%d %u %d %d %lld %llx %u", &fileSeedLen, &fileKeySize, &fileLarge, &fileExact, &fileCountOfBases, &fileChecksum,
+                       &fileNHashTables)) {
+        bool matches = fileSeedLen == seedLen && fileKeySize == hashTableKeySize && (0 != fileLarge) == large && (fileExact || !forceExact) &&
+            fileCountOfBases == countOfBases && fileChecksum == genomeChecksum && fileNHashTables == nHashTables;
+
+        for (unsigned i = 0; i < fileNHashTables; i++) {
+            double value;
+            if (1 != fscanf(biasFile, "%lf", &value)) {
+                WriteErrorMessage("Bias table file '%s' is truncated, ignoring the rest of it\n", biasFileName);
+                fclose(biasFile);
+                return false;
+            }
+            if (matches) {
+                table[i] = value;
+            }
+        }
+
+        if (matches) {
+            fclose(biasFile);
+            return true;
         }
-        nUsed = 0;
     }
-};
 
+    fclose(biasFile);
+    return false;
+}
+
+    void
+GenomeIndex::SaveBiasTable(const char *biasFileName, _uint64 genomeChecksum, GenomeDistance countOfBases, int seedLen, unsigned hashTableKeySize,
+                           bool large, bool exact, const double *table, unsigned nHashTables)
+/*++
+
+Routine Description:
+
+    Add a table to a bias table file, creating it if need be.  Failing to isn't fatal, it just means we'll have to
+    compute the table again next time.
+
+--*/
+{
+    FILE *biasFile = fopen(biasFileName, "a");
+    if (NULL == biasFile) {
+        WriteErrorMessage("Unable to open bias table file '%s' to save the bias table in it\n", biasFileName);
+        return;
+    }
+
+    fseek(biasFile, 0, SEEK_END);
+    if (0 == ftell(biasFile)) {
+        fprintf(biasFile, "%s\n", BiasFileHeader);
+    }
+
+    fprintf(biasFile, "%d %u %d %d %lld %llx %u\n", seedLen, hashTableKeySize, large ? 1 : 0, exact ? 1 : 0, (_int64)countOfBases, genomeChecksum,
+            nHashTables);
+    for (unsigned i = 0; i < nHashTables; i++) {
+        fprintf(biasFile, "%.17g\n", table[i]);
+    }
+
+    if (0 != fclose(biasFile)) {
+        WriteErrorMessage("Error writing bias table file '%s'\n", biasFileName);
+    }
+}
 
     void
 GenomeIndex::ComputeBiasTableWorkerThreadMain(void *param)
@@ -1070,19 +2173,24 @@ GenomeIndex::ComputeBiasTableWorkerThreadMain(void *param)
 	bool large = context->large;
 
     GenomeDistance countOfBases = context->genome->getCountOfBases();
+    std::vector<ApproximateCounter> &approxCounters = *context->approxCounters;    // This thread's own
     _int64 validSeeds = 0;
 
     //
-    // Batch the insertions into the approximate counters, because otherwise we spend all of
-    // our time acquiring and releasing locks.
+    // Only add to the shared progress count every so often, so the threads don't fight over it.
     //
- 
-    PerCounterBatch *batches = new PerCounterBatch[context->nHashTables];
-
-    _uint64 unrecordedSkippedSeeds = 0;
-
+    const _int64 progressBatchSize = 1000000;
     const _uint64 printBatchSize = 100000000;
+    _int64 unrecordedBases = 0;
+
     for (GenomeDistance i = context->genomeChunkStart; i < context->genomeChunkEnd; i++) {
+            if (++unrecordedBases == progressBatchSize) {
+                _int64 basesProcessed = InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, unrecordedBases);
+                if ((_uint64)basesProcessed / printBatchSize > ((_uint64)basesProcessed - unrecordedBases) / printBatchSize) {
+                    WriteStatusMessage("Bias computation: %lld / %lld\n",(basesProcessed/printBatchSize)*printBatchSize, (_int64)countOfBases);
+                }
+                unrecordedBases = 0;
+            }
 
             const char *bases = context->genome->getSubstring(i, context->seedLen);
             //
@@ -1096,11 +2204,10 @@ GenomeIndex::ComputeBiasTableWorkerThreadMain(void *param)
             // We don't build seeds out of sections of the genome that contain 'N.'  If this is one, skip it.
             //
             if (!Seed::DoesTextRepresentASeed(bases, context->seedLen)) {
-                unrecordedSkippedSeeds++;
                 continue;
             }
 
-            Seed seed(bases, context->seedLen);
+            Seed seed = Seed(bases, context->seedLen).masked(context->seedMask);
             validSeeds++;
 
 			if (large && seed.isBiggerThanItsReverseComplement()) {
@@ -1114,66 +2221,164 @@ GenomeIndex::ComputeBiasTableWorkerThreadMain(void *param)
 
 			_ASSERT(whichHashTable < context->nHashTables);
 
-			if (batches[whichHashTable].addSeed(seed.getLowBases(context->hashTableKeySize))) {
-				PerCounterBatch *batch = &batches[whichHashTable];
-				AcquireExclusiveLock(&context->approximateCounterLocks[whichHashTable]);
-				batch->apply(&(*context->approxCounters)[whichHashTable]);    
-				ReleaseExclusiveLock(&context->approximateCounterLocks[whichHashTable]);
+            approxCounters[whichHashTable].add(seed.getLowBases(context->hashTableKeySize));
+    }
 
-				_int64 basesProcessed = InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, PerCounterBatch::nSeedsPerBatch + unrecordedSkippedSeeds);
+    InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, unrecordedBases);
+    InterlockedAdd64AndReturnNewValue(context->validSeeds, validSeeds);
 
-				if ((_uint64)basesProcessed / printBatchSize > ((_uint64)basesProcessed - PerCounterBatch::nSeedsPerBatch - unrecordedSkippedSeeds)/printBatchSize) {
-					WriteStatusMessage("Bias computation: %lld / %lld\n",(basesProcessed/printBatchSize)*printBatchSize, (_int64)countOfBases);
-				}
-				unrecordedSkippedSeeds= 0;  // We've now recorded them.
-			}
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
     }
+}
 
-    for (unsigned i = 0; i < context->nHashTables; i++) {
-        _int64 basesProcessed = InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, batches[i].nUsed + unrecordedSkippedSeeds);
 
-        if ((_uint64)basesProcessed / printBatchSize > ((_uint64)basesProcessed - batches[i].nUsed - unrecordedSkippedSeeds)/printBatchSize) {
-            WriteStatusMessage("Bias computation: %lld / %lld\n",(basesProcessed/printBatchSize)*printBatchSize, (_int64)countOfBases);
-        }
 
-        unrecordedSkippedSeeds = 0; // All except the first time through the loop this will be 0.
+    _uint64 *
+GenomeIndex::ComputeMinimizerLocations(const Genome *genome, unsigned seedLen, unsigned windowSize, unsigned maxThreads,
+                                       _int64 *nMinimizerLocations, _int64 *nSeedLocations)
+/*++
 
-        AcquireExclusiveLock(&context->approximateCounterLocks[i]);
-        batches[i].apply(&(*context->approxCounters)[i]);
-        ReleaseExclusiveLock(&context->approximateCounterLocks[i]);
+Routine Description:
 
+    Find the genome locations whose seeds are minimizers (see Minimizer.h) for a -minimizer index build.  This looks
+    at the same locations as the hash table build, so anything past them isn't a minimizer.
 
-    }
+Arguments:
 
-    delete [] batches;
+    genome              - the genome being indexed
+    seedLen             - the seed length
+    windowSize          - the number of consecutive seeds in a window
+    maxThreads          - the most threads to use
+    nMinimizerLocations - returns the number of locations that are minimizers
+    nSeedLocations      - returns the number of locations that have seeds
 
-    InterlockedAdd64AndReturnNewValue(context->validSeeds, validSeeds);
+--*/
+{
+    _int64 start = timeInMillis();
+    WriteStatusMessage("Finding minimizers...");
 
-    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
-        SignalSingleWaiterObject(context->doneObject);
+    GenomeDistance countOfBases = genome->getCountOfBases();
+    GenomeDistance limit = __max(countOfBases - seedLen - 1, (GenomeDistance)0);
+    size_t bitmapWords = (size_t)(countOfBases + 63) / 64;
+    _uint64 *minimizerLocations = (_uint64 *)BigAlloc(__max(bitmapWords, (size_t)1) * sizeof(_uint64));
+    memset(minimizerLocations, 0, bitmapWords * sizeof(_uint64));
+
+    volatile _int64 minimizers = 0;
+    volatile _int64 seedLocations = 0;
+
+    unsigned nThreads = (unsigned)__max(__min((_int64)__min(GetNumberOfProcessors(), maxThreads), (limit + 63) / 64), (_int64)1);
+    volatile int runningThreadCount = nThreads;
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+
+    ComputeMinimizerLocationsThreadContext *contexts = new ComputeMinimizerLocationsThreadContext[nThreads];
+    GenomeDistance wordsPerThread = (limit + 63) / 64 / nThreads;
+    for (unsigned i = 0; i < nThreads; i++) {
+        contexts[i].doneObject = &doneObject;
+        contexts[i].runningThreadCount = &runningThreadCount;
+        contexts[i].genome = genome;
+        contexts[i].genomeChunkStart = i * wordsPerThread * 64;
+        contexts[i].genomeChunkEnd = (i == nThreads - 1) ? limit : __min((i + 1) * wordsPerThread * 64, limit);
+        contexts[i].seedLen = seedLen;
+        contexts[i].windowSize = windowSize;
+        contexts[i].minimizerLocations = minimizerLocations;
+        contexts[i].nMinimizerLocations = &minimizers;
+        contexts[i].nSeedLocations = &seedLocations;
+
+        StartNewThread(ComputeMinimizerLocationsWorkerThreadMain, &contexts[i]);
     }
-}
 
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+    delete[] contexts;
 
+    *nMinimizerLocations = minimizers;
+    *nSeedLocations = seedLocations;
 
-    void 
-GenomeIndex::BuildHashTablesWorkerThreadMain(void *param)
-{
-    BuildHashTablesThreadContext *context = (BuildHashTablesThreadContext *)param;
+    WriteStatusMessage("%llds, %lld of %lld seeds (%lld%%) are minimizers\n", (timeInMillis() + 500 - start) / 1000, (_int64)minimizers, (_int64)seedLocations,
+        (_int64)minimizers * 100 / __max((_int64)seedLocations, (_int64)1));
 
-    context->index->BuildHashTablesWorkerThread(context);
+    return minimizerLocations;
 }
-    
+
     void
-GenomeIndex::BuildHashTablesWorkerThread(BuildHashTablesThreadContext *context)
+GenomeIndex::ComputeMinimizerLocationsWorkerThreadMain(void *param)
 {
-    GenomeDistance countOfBases = context->genome->getCountOfBases();
+    ComputeMinimizerLocationsThreadContext *context = (ComputeMinimizerLocationsThreadContext *)param;
     const Genome *genome = context->genome;
     unsigned seedLen = context->seedLen;
-	bool large = context->large;
- 
+    unsigned windowSize = context->windowSize;
+    GenomeDistance limit = __max(genome->getCountOfBases() - seedLen - 1, (GenomeDistance)0);
+
     //
-    // Batch the insertions into the hash tables, because otherwise we spend all of
+    // Work through the chunk in blocks.  A location can be the minimizer of windows that start up to windowSize - 1
+    // before it, so each block looks at the hashes that far on either side of it, and only marks the ones in the block.
+    // Blocks are a multiple of 64 locations so that every bitmap word is written by just one thread.
+    //
+    const GenomeDistance blockSize = 1024 * 1024;
+    _uint64 *hashes = new _uint64[blockSize + 2 * windowSize];
+    bool *isMinimizer = new bool[blockSize + 2 * windowSize];
+    _int64 minimizers = 0;
+    _int64 seedLocations = 0;
+
+    for (GenomeDistance blockStart = context->genomeChunkStart; blockStart < context->genomeChunkEnd; blockStart += blockSize) {
+        GenomeDistance blockEnd = __min(blockStart + blockSize, context->genomeChunkEnd);
+        GenomeDistance hashesStart = __max(blockStart - (GenomeDistance)windowSize + 1, (GenomeDistance)0);
+        GenomeDistance hashesEnd = __min(blockEnd + windowSize - 1, limit);
+
+        for (GenomeDistance location = hashesStart; location < hashesEnd; location++) {
+            const char *bases = genome->getSubstring(location, seedLen);
+            if (NULL == bases || !Seed::DoesTextRepresentASeed(bases, seedLen)) {
+                hashes[location - hashesStart] = NotAMinimizerCandidate;
+            } else {
+                hashes[location - hashesStart] = MinimizerHash(Seed(bases, seedLen));
+            }
+            isMinimizer[location - hashesStart] = false;
+        }
+
+        MarkMinimizers(hashes, hashesEnd - hashesStart, windowSize, isMinimizer);
+
+        for (GenomeDistance location = blockStart; location < blockEnd; location++) {
+            if (NotAMinimizerCandidate != hashes[location - hashesStart]) {
+                seedLocations++;
+            }
+            if (isMinimizer[location - hashesStart]) {
+                context->minimizerLocations[location / 64] |= (_uint64)1 << (location % 64);
+                minimizers++;
+            }
+        }
+    }
+
+    delete[] hashes;
+    delete[] isMinimizer;
+
+    InterlockedAdd64AndReturnNewValue(context->nMinimizerLocations, minimizers);
+    InterlockedAdd64AndReturnNewValue(context->nSeedLocations, seedLocations);
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
+
+    void 
+GenomeIndex::BuildHashTablesWorkerThreadMain(void *param)
+{
+    BuildHashTablesThreadContext *context = (BuildHashTablesThreadContext *)param;
+
+    context->index->BuildHashTablesWorkerThread(context);
+}
+    
+    void
+GenomeIndex::BuildHashTablesWorkerThread(BuildHashTablesThreadContext *context)
+{
+    GenomeDistance countOfBases = context->genome->getCountOfBases();
+    const Genome *genome = context->genome;
+    unsigned seedLen = context->seedLen;
+	bool large = context->large;
+ 
+    //
+    // Batch the insertions into the hash tables, because otherwise we spend all of
     // our time acquiring and releasing locks.
     //
  
@@ -1200,7 +2405,12 @@ GenomeIndex::BuildHashTablesWorkerThread(BuildHashTablesThreadContext *context)
             continue;
         }
 
-		Seed seed(bases, seedLen);
+        if (!IsMinimizerLocation(context->minimizerLocations, genomeLocation)) {
+            stats.unrecordedSkippedSeeds++;
+            continue;
+        }
+
+		Seed seed = Seed(bases, seedLen).masked(seedMask);
 
         indexSeed(genomeLocation, seed, batches, context, &stats, large);
     } // For each genome base in our area
@@ -1219,6 +2429,15 @@ GenomeIndex::BuildHashTablesWorkerThread(BuildHashTablesThreadContext *context)
 
     delete [] batches;
 
+    if (NULL != context->lastBackpointerIndexUsedByThread) {
+        //
+        // We won't add any more backpointers, so don't hold up spilling the ones that the other threads are done with.
+        //
+        AcquireExclusiveLock(context->backpointerSpillLock);
+        context->lastBackpointerIndexUsedByThread[context->whichThread] = 0x7fffffffffffffff;
+        ReleaseExclusiveLock(context->backpointerSpillLock);
+    }
+
     if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
         SignalSingleWaiterObject(context->doneObject);
     }
@@ -1370,23 +2589,36 @@ GenomeIndex::AddOverflowBackpointer(
 	BuildHashTablesThreadContext*context,
 	GenomeLocation               genomeLocation)
 {
-    _int64 overflowBackpointerIndex = InterlockedAdd64AndReturnNewValue(context->nextOverflowBackpointer, 1) - 1;
+    if (context->nextBackpointerInChunk >= context->backpointerChunkEnd) {
+        //
+        // Our chunk is used up (or we never had one).  Grab the next one.
+        //
+        context->nextBackpointerInChunk = InterlockedAdd64AndReturnNewValue(context->nextOverflowBackpointer, OverflowBackpointerChunkSize) - OverflowBackpointerChunkSize;
+        context->backpointerChunkEnd = context->nextBackpointerInChunk + OverflowBackpointerChunkSize;
+
+        if (NULL != context->lastBackpointerIndexUsedByThread) {
+            //
+            // We'll never again write a backpointer below the start of our new chunk, so let the spiller know.
+            //
+            AcquireExclusiveLock(context->backpointerSpillLock);
+            context->lastBackpointerIndexUsedByThread[context->whichThread] = context->nextBackpointerInChunk - 1;
+            _int64 trimToIndex = context->lastBackpointerIndexUsedByThread[0];
+            for (unsigned i = 1; i < context->nThreads; i++) {
+                trimToIndex = __min(trimToIndex, context->lastBackpointerIndexUsedByThread[i]);
+            }
+            context->overflowAnchor->trimTo(trimToIndex, context->backpointerSpillFile);
+            ReleaseExclusiveLock(context->backpointerSpillLock);
+        }
+    }
+
+    _int64 overflowBackpointerIndex = context->nextBackpointerInChunk;
+    context->nextBackpointerInChunk++;
+
     OverflowBackpointer *newBackpointer = context->overflowAnchor->getBackpointer(overflowBackpointerIndex);
  
     newBackpointer->nextIndex = previousOverflowBackpointer;
     newBackpointer->genomeLocation = genomeLocation;
 
-	if (overflowBackpointerIndex % 100000 == 1 && NULL != context->lastBackpointerIndexUsedByThread) {
-		AcquireExclusiveLock(context->backpointerSpillLock);
-		context->lastBackpointerIndexUsedByThread[context->whichThread] = overflowBackpointerIndex - 1;
-		_int64 trimToIndex = context->lastBackpointerIndexUsedByThread[0];
-		for (unsigned i = 1; i < context->nThreads; i++) {
-			trimToIndex = __min(trimToIndex, context->lastBackpointerIndexUsedByThread[i]);
-		}
-		context->overflowAnchor->trimTo(trimToIndex, context->backpointerSpillFile);
-		ReleaseExclusiveLock(context->backpointerSpillLock);
-	}
-
     return overflowBackpointerIndex;
 }
 
@@ -1441,647 +2673,3212 @@ GenomeIndex::completeIndexing(PerHashTableBatch *batches, BuildHashTablesThreadC
     }
 }
 
-GenomeIndex::OverflowBackpointerAnchor::OverflowBackpointerAnchor(_int64 maxOverflowEntries_) : maxOverflowEntries(maxOverflowEntries_)
+    void
+GenomeIndex::WriteSeedHistogram(FILE *histogramFile, const unsigned *histogram, unsigned maxHistogramEntry, _uint64 countOfTooBigForHistogram,
+                                _uint64 sumOfTooBigForHistogram, _uint64 largestSeed)
 {
-    _ASSERT(maxOverflowEntries > 0);
-	_int64 roundedUpMaxOverflowEntries = (maxOverflowEntries + batchSize - 1) / batchSize * batchSize;	// Round up to the next batch size
-
-	table = new OverflowBackpointer *[roundedUpMaxOverflowEntries / batchSize];
+    for (unsigned i = 0; i <= maxHistogramEntry; i++) {
+        if (histogram[i] != 0) {
+            fprintf(histogramFile,"%d\t%d\n", i, histogram[i]);
+        }
+    }
+    fprintf(histogramFile, "%d larger than %d with %d total genome locations, largest seed %d\n", countOfTooBigForHistogram, maxHistogramEntry, sumOfTooBigForHistogram, largestSeed);
+}
 
-	for (unsigned i = 0; i < roundedUpMaxOverflowEntries / batchSize; i++) {
-		table[i] = NULL;
-	}
+    bool
+GenomeIndex::BuildHashTablesBySorting(
+    GenomeIndex    *index,
+    const Genome   *genome,
+    unsigned        seedLen,
+    unsigned        hashTableKeySize,
+    bool            large,
+    unsigned        locationSize,
+    unsigned        maxThreads,
+    const char     *directoryName,
+    FILE           *histogramFile,
+    size_t         *totalBytesWritten,
+    const _uint64  *minimizerLocations,
+    IndexBuildReport *report,
+    const GenomeIndex *existingIndex)
+/*++
 
-    InitializeExclusiveLock(&lock);
-}
+Routine Description:
+
+    Build the hash tables and overflow table for an index by sorting rather than by incremental insertion (the -sortbuild
+    option).  The hash tables must already be allocated in index->hashTables, unless we're appending to an existing
+    index, in which case they're allocated here once we know how many new seeds each one gets.  It writes them and the
+    overflow table into the index directory, freeing each hash table once it's written.
+
+Arguments:
+
+    index               - the index being built
+    genome              - the genome to index
+    seedLen             - the seed length
+    hashTableKeySize    - the size of the hash table keys in bytes
+    large               - whether we're building a large index (one entry for a seed and its complement)
+    locationSize        - the size of the genome locations in the index
+    maxThreads          - the most threads to use
+    directoryName       - the index directory
+    histogramFile       - if non-NULL, write a seed popularity histogram here
+    totalBytesWritten   - returns the size of the hash table file
+    minimizerLocations  - for minimizer indices, the locations to index (see ComputeMinimizerLocations), otherwise NULL
+    report              - gets the time for each phase and the build statistics
+    existingIndex       - for -append, the index being added to.  genome must start with its genome.
 
-GenomeIndex::OverflowBackpointerAnchor::~OverflowBackpointerAnchor()
+--*/
 {
-	for (unsigned i = 0; i < maxOverflowEntries / batchSize; i++) {
-		if (table[i] != NULL) {
-			BigDealloc(table[i]);
-			table[i] = NULL;
-		}
-	}
+    _int64 start = timeInMillis();
+    unsigned nHashTables = index->nHashTables;
+    GenomeDistance countOfBases = genome->getCountOfBases();
+    unsigned nThreads = __min(GetNumberOfProcessors(), maxThreads);
 
-	delete [] table;
-	table = NULL;
+    WriteStatusMessage("Counting seeds for each hash table.\n");
 
-    DestroyExclusiveLock(&lock);
-}
+    SortBuildThreadContext *threadContexts = new SortBuildThreadContext[nThreads];
+    volatile _int64 nextHashTableToProcess;
+    _int64 *seedsPerHashTable = new _int64[nThreads * nHashTables];
+    _int64 *nextRecordForHashTable = new _int64[nThreads * nHashTables];
+    _int64 *hashTableRecordStart = new _int64[nHashTables];
+    _int64 *overflowSizeOfHashTable = new _int64[nHashTables];
+    _int64 *overflowOffsetOfHashTable = new _int64[nHashTables];
 
-	GenomeIndex::OverflowBackpointer *
-GenomeIndex::OverflowBackpointerAnchor::getBackpointer(_int64 index)
-{
-    if (index >= maxOverflowEntries) {
-        WriteErrorMessage("Trying to use too many overflow entries.  To index this genome, you either need a larger seed size or a larger location size.\n");
-        soft_exit(1);
+    //
+    // When appending, the existing index already has every seed up to where the regular build stops at the end of
+    // the existing genome (seedLen + 1 bases from its end), so we pick up from there.
+    //
+    GenomeDistance existingCountOfBases = 0;
+    GenomeDistance firstLocationToIndex = 0;
+    if (NULL != existingIndex) {
+        existingCountOfBases = existingIndex->genome->getCountOfBases();
+        firstLocationToIndex = existingCountOfBases - seedLen - 1;
     }
-	_int64 tableSlot = index / batchSize;
-	if (table[tableSlot] == NULL) {
-        AcquireExclusiveLock(&lock);
-        if (table[tableSlot] == NULL) {
-			OverflowBackpointer *newTableEntry = (OverflowBackpointer *)BigAlloc(batchSize * sizeof(OverflowBackpointer));
-		    for (unsigned i = 0; i < batchSize; i++) {
-				newTableEntry[i].genomeLocation = 0xffffffffffffffff;
-				newTableEntry[i].nextIndex = 0xffffffffffffffff;
-		    }
 
-			//
-			// Don't fill in the table[] pointer until initialization is complete in order to avoid racing with someone writing while we're
-			// initializing.
-			//
-			table[tableSlot] = newTableEntry;
-		}
-        ReleaseExclusiveLock(&lock);
-	} else {
-		if (&spilledTableSlot == table[tableSlot]) {
-			WriteErrorMessage("Looking up spilled table slot.  Something is very wrong.  Try not using -sm and contact the developers.\n");
-			soft_exit(1);
-		}
-	}
-	return &table[tableSlot][index % batchSize];
-}
+    GenomeDistance nextChunkToProcess = firstLocationToIndex;
+    for (unsigned i = 0; i < nThreads; i++) {
+        SortBuildThreadContext *context = &threadContexts[i];
+        context->whichThread = i;
+        context->nThreads = nThreads;
+        context->index = index;
+        context->genome = genome;
+        //
+        // Split up the genome the same way as the regular build, so we index exactly the same seeds.
+        //
+        context->genomeChunkStart = nextChunkToProcess;
+        if (i == nThreads - 1) {
+            nextChunkToProcess = countOfBases - seedLen - 1;
+        } else {
+            nextChunkToProcess += (countOfBases - seedLen - firstLocationToIndex) / nThreads;
+        }
+        context->genomeChunkEnd = nextChunkToProcess;
+        context->seedLen = seedLen;
+        context->hashTableKeySize = hashTableKeySize;
+        context->large = large;
+        context->locationSize = locationSize;
+        context->minimizerLocations = minimizerLocations;
+        context->existingIndex = existingIndex;
+        context->existingCountOfBases = existingCountOfBases;
+        context->seedsPerHashTable = seedsPerHashTable + i * nHashTables;
+        context->nextRecordForHashTable = nextRecordForHashTable + i * nHashTables;
+        context->hashTableRecordStart = hashTableRecordStart;
+        context->nextHashTableToProcess = &nextHashTableToProcess;
+        context->overflowSizeOfHashTable = overflowSizeOfHashTable;
+        context->overflowOffsetOfHashTable = overflowOffsetOfHashTable;
+        context->records = NULL;
+        context->sortBuffer = NULL;
+        context->groupOverflowTable = NULL;
+        context->countOfTooBigForHistogram = 0;
+        context->sumOfTooBigForHistogram = 0;
+        context->largestSeed = 0;
+        if (NULL != histogramFile) {
+            context->histogram = new unsigned[maxHistogramEntry + 1];
+            memset(context->histogram, 0, sizeof(unsigned) * (maxHistogramEntry + 1));
+        } else {
+            context->histogram = NULL;
+        }
 
-	void
-GenomeIndex::OverflowBackpointerAnchor::trimTo(_int64 trimToIndex, FILE *trimFile)
-{
-	//
-	// Run through the anchor table, and spill out any table slots whose indices are all less than trimToIndex and that aren't
-	// yet spilled out.
-	//
-	for (_int64 tableSlot = 0; (tableSlot + 1) * batchSize < trimToIndex; tableSlot++) {
-		if (&spilledTableSlot != table[tableSlot] && NULL != table[tableSlot]) {
-			if (batchSize != fwrite(table[tableSlot], sizeof(*table[tableSlot]), batchSize, trimFile)) {
-				WriteErrorMessage("Failure writing to trim file.  Maybe you're out of disk space or encountered some other error.  Perhaps try without -sm.\n");
-				soft_exit(1);
-			}
-			BigDealloc((void *)table[tableSlot]);
-			table[tableSlot] = &spilledTableSlot;
-		}
-	}
-}
-	void
-GenomeIndex::OverflowBackpointerAnchor::loadFromFile(FILE *file)
-{
-	rewind(file);
-	for (int i = 0; i < maxOverflowEntries / batchSize; i++) {
-		if (table[i] == &spilledTableSlot) {
-			table[i] = (OverflowBackpointer *)BigAlloc(batchSize * sizeof(OverflowBackpointer));
-			if (batchSize != fread(table[i], sizeof(OverflowBackpointer), batchSize, file)) {
-				WriteErrorMessage("Failed to read overflow table batch i from spill file\n", i);
-				soft_exit(1);
-			}
-		}
-	}
-}
+        for (unsigned whichHashTable = 0; whichHashTable < nHashTables; whichHashTable++) {
+            context->seedsPerHashTable[whichHashTable] = 0;
+        }
+    }
 
-const unsigned GenomeIndex::OverflowBackpointerAnchor::batchSize = 1024 * 1024;
-GenomeIndex::OverflowBackpointer GenomeIndex::OverflowBackpointerAnchor::spilledTableSlot;
+    report->startPhase("countSeeds", nThreads);
+    RunSortBuildPhase(threadContexts, nThreads, SortBuildThreadContext::CountSeeds);
+    report->endPhase();
 
-    void
-GenomeIndex::printBiasTables()
-{
-    for (int keySize = 0; keySize <= largestKeySize; keySize++) {
-        for (int seedSize = 0; seedSize <= largestBiasTable; seedSize++) {
-            if (NULL != hg19_biasTables_large[keySize][seedSize]) {
-                printf("static double hg19_biasTable%d_%d_large[] = {\n", seedSize, keySize);
-                unsigned bitsOfSeed = seedSize * 2;
-                unsigned bitsOfKey = keySize * 8;   // 8 == nBits / byte
-                unsigned numHashTables = 1 << (bitsOfSeed - bitsOfKey);
-                for (unsigned hashTable = 0; hashTable < numHashTables; hashTable++) {
-                    if (hg19_biasTables_large[keySize][seedSize][hashTable] == 0) {
-                        printf("0");
-                    } else if (hg19_biasTables_large[keySize][seedSize][hashTable] > 1000 || hg19_biasTables_large[keySize][seedSize][hashTable] < .01) {
-                        printf("%1.2e", hg19_biasTables_large[keySize][seedSize][hashTable]);
-                    } else if (hg19_biasTables_large[keySize][seedSize][hashTable] > 10) {
-                        printf("%1.1f", hg19_biasTables_large[keySize][seedSize][hashTable]);
-                    } else {
-                        printf("%1.3f", hg19_biasTables_large[keySize][seedSize][hashTable]);
-                    }
+    _int64 *seedsInHashTable = new _int64[nHashTables];
+    _int64 totalSeeds = 0;
+    for (unsigned whichHashTable = 0; whichHashTable < nHashTables; whichHashTable++) {
+        seedsInHashTable[whichHashTable] = 0;
+        for (unsigned i = 0; i < nThreads; i++) {
+            seedsInHashTable[whichHashTable] += threadContexts[i].seedsPerHashTable[whichHashTable];
+        }
+        totalSeeds += seedsInHashTable[whichHashTable];
+    }
 
-                    if (hashTable != numHashTables-1) {
-                        printf(",");
-                    }
+    for (unsigned i = 0; i < nThreads; i++) {
+        threadContexts[i].seedsInHashTable = seedsInHashTable;
+    }
 
-                    if (hashTable % 10 == 9) {
-                        printf("\n");
-                    }
-                } // for each hash table
-                printf("\n};\n\n");
-            } // if there is a bias entry for this key * seed size
-        } // for each seed size
-    } // for each key size
+    WriteStatusMessage("%lld seeds counted in %llds\n", totalSeeds, (timeInMillis() + 500 - start) / 1000);
 
-    for (int keySize = 0; keySize <= largestKeySize; keySize++) {
-        for (int seedSize = 0; seedSize <= largestBiasTable; seedSize++) {
-            if (NULL != hg19_biasTables[keySize][seedSize]) {
-                printf("static double hg19_biasTable%d_%d[] = {\n", seedSize, keySize);
-                unsigned bitsOfSeed = seedSize * 2;
-                unsigned bitsOfKey = keySize * 8;   // 8 == nBits / byte
-                unsigned numHashTables = 1 << (bitsOfSeed - bitsOfKey);
-                for (unsigned hashTable = 0; hashTable < numHashTables; hashTable++) {
-                    if (hg19_biasTables[keySize][seedSize][hashTable] == 0) {
-                        printf("0");
-                    } else if (hg19_biasTables[keySize][seedSize][hashTable] > 1000 || hg19_biasTables[keySize][seedSize][hashTable] < .01) {
-                        printf("%1.2e", hg19_biasTables[keySize][seedSize][hashTable]);
-                    } else if (hg19_biasTables[keySize][seedSize][hashTable] > 10) {
-                        printf("%1.1f", hg19_biasTables[keySize][seedSize][hashTable]);
-                    } else {
-                        printf("%1.3f", hg19_biasTables[keySize][seedSize][hashTable]);
-                    }
+    char *filenameBuffer = new char[strlen(directoryName) + 1 + __max(strlen(GenomeIndexHashFileName), strlen(OverflowTableFileName)) + 1];
+    sprintf(filenameBuffer, "%s%c%s", directoryName, PATH_SEP, GenomeIndexHashFileName);
+    FILE *tablesFile = fopen(filenameBuffer, "wb");
+    if (NULL == tablesFile) {
+        WriteErrorMessage("Unable to open hash table file '%s'\n", filenameBuffer);
+        soft_exit(1);
+    }
 
-                    if (hashTable != numHashTables-1) {
-                        printf(",");
-                    }
+    sprintf(filenameBuffer, "%s%c%s", directoryName, PATH_SEP, OverflowTableFileName);
+    FILE *overflowTableFile = fopen(filenameBuffer, "wb");
+    if (NULL == overflowTableFile) {
+        WriteErrorMessage("Unable to open overflow table file, '%s', %d\n", filenameBuffer, errno);
+        soft_exit(1);
+    }
 
-                    if (hashTable % 10 == 9) {
-                        printf("\n");
-                    }
-                } // for each hash table
-                printf("\n};\n\n");
-            } // if there is a bias entry for this key * seed size
-        } // for each seed size
-    } // for each key size
-}
+    unsigned overflowElementSize = (locationSize > 4) ? sizeof(_int64) : sizeof(unsigned);
+    _int64 overflowTableSize = 0;
+    size_t totalUsedHashTableElements = 0;
+    *totalBytesWritten = 0;
 
-        GenomeIndex *
-GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch)
-{
-    int filenameBufferSize = (int)(strlen(directoryName) + 1 + __max(strlen(GenomeIndexFileName), __max(strlen(OverflowTableFileName), __max(strlen(GenomeIndexHashFileName), strlen(GenomeFileName)))) + 1);
-    char *filenameBuffer = new char[filenameBufferSize];
-    
-    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeIndexFileName);
+    //
+    // Now do the hash tables in groups that fit in our record budget.  A group is always at least one table.
+    //
+    for (unsigned firstHashTableInGroup = 0; firstHashTableInGroup < nHashTables; ) {
+        unsigned hashTableLimitInGroup = firstHashTableInGroup;
+        _int64 recordsInGroup = 0;
+        while (hashTableLimitInGroup < nHashTables && 
+               (hashTableLimitInGroup == firstHashTableInGroup || recordsInGroup + seedsInHashTable[hashTableLimitInGroup] <= sortBuildMaxRecordsPerGroup)) {
+            hashTableRecordStart[hashTableLimitInGroup] = recordsInGroup;
+            recordsInGroup += seedsInHashTable[hashTableLimitInGroup];
+            hashTableLimitInGroup++;
+        }
 
-    GenericFile *indexFile = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+        WriteStatusMessage("Sorting and filling hash tables %d-%d of %d (%lld seeds)\n", firstHashTableInGroup, hashTableLimitInGroup - 1, nHashTables, recordsInGroup);
 
-    if (NULL == indexFile) {
-        WriteErrorMessage("Unable to open file '%s' for read.\n",filenameBuffer);
-        delete[] filenameBuffer;
-        filenameBuffer = NULL;
+        SortBuildRecord *records = (SortBuildRecord *)BigAlloc(__max(recordsInGroup, (_int64)1) * sizeof(SortBuildRecord));
+        SortBuildRecord *sortBuffer = (SortBuildRecord *)BigAlloc(__max(recordsInGroup, (_int64)1) * sizeof(SortBuildRecord));
+
+        //
+        // Each thread writes its records for a hash table after those of the threads with earlier parts of the genome,
+        // so each table's records come out in genome order, which the (stable) radix sort preserves within a seed.
+        //
+        for (unsigned whichHashTable = firstHashTableInGroup; whichHashTable < hashTableLimitInGroup; whichHashTable++) {
+            _int64 nextRecord = hashTableRecordStart[whichHashTable];
+            for (unsigned i = 0; i < nThreads; i++) {
+                threadContexts[i].nextRecordForHashTable[whichHashTable] = nextRecord;
+                nextRecord += threadContexts[i].seedsPerHashTable[whichHashTable];
+            }
+        }
+
+        for (unsigned i = 0; i < nThreads; i++) {
+            threadContexts[i].firstHashTableInGroup = firstHashTableInGroup;
+            threadContexts[i].hashTableLimitInGroup = hashTableLimitInGroup;
+            threadContexts[i].records = records;
+            threadContexts[i].sortBuffer = sortBuffer;
+        }
+
+        report->startPhase("scatterSeeds", nThreads);
+        RunSortBuildPhase(threadContexts, nThreads, SortBuildThreadContext::ScatterSeeds);
+
+        nextHashTableToProcess = firstHashTableInGroup;
+        report->startPhase("sortAndSizeHashTables", nThreads);
+        RunSortBuildPhase(threadContexts, nThreads, SortBuildThreadContext::SortAndSizeHashTables);
+        report->endPhase();
+
+        BigDealloc(sortBuffer);
+        sortBuffer = NULL;
+
+        _int64 groupOverflowTableSize = 0;
+        for (unsigned whichHashTable = firstHashTableInGroup; whichHashTable < hashTableLimitInGroup; whichHashTable++) {
+            overflowOffsetOfHashTable[whichHashTable] = groupOverflowTableSize;
+            groupOverflowTableSize += overflowSizeOfHashTable[whichHashTable];
+        }
+
+        if (locationSize != 8 && overflowTableSize + groupOverflowTableSize + (_int64)countOfBases > ((_int64)1 << (8 * locationSize)) - 15) {
+            WriteErrorMessage("Ran out of overflow table namespace. This genome cannot be indexed with this seed and location size.  Increase at least one.\n");
+            soft_exit(1);
+        }
+
+        void *groupOverflowTable = BigAlloc(__max(groupOverflowTableSize, (_int64)1) * overflowElementSize);
+        for (unsigned i = 0; i < nThreads; i++) {
+            threadContexts[i].groupOverflowTable = groupOverflowTable;
+            threadContexts[i].groupOverflowTableBase = overflowTableSize;
+        }
+
+        nextHashTableToProcess = firstHashTableInGroup;
+        report->startPhase("fillHashTables", nThreads);
+        RunSortBuildPhase(threadContexts, nThreads, SortBuildThreadContext::FillHashTables);
+        report->endPhase();
+
+        BigDealloc(records);
+        records = NULL;
+
+        report->startPhase("saveHashAndOverflowTables");
+
+        //
+        // Write out this group's part of the overflow table and its hash tables, and free them.
+        //
+        if (groupOverflowTableSize > 0 &&
+            (size_t)groupOverflowTableSize != fwrite(groupOverflowTable, overflowElementSize, groupOverflowTableSize, overflowTableFile)) {
+            WriteErrorMessage("GenomeIndex::BuildHashTablesBySorting: fwrite failed on the overflow table, %d\n", errno);
+            soft_exit(1);
+        }
+        BigDealloc(groupOverflowTable);
+        groupOverflowTable = NULL;
+        overflowTableSize += groupOverflowTableSize;
+
+        for (unsigned whichHashTable = firstHashTableInGroup; whichHashTable < hashTableLimitInGroup; whichHashTable++) {
+            size_t bytesWrittenThisHashTable;
+            if (!index->hashTables[whichHashTable]->saveToFile(tablesFile, &bytesWrittenThisHashTable)) {
+                WriteErrorMessage("GenomeIndex::BuildHashTablesBySorting: Failed to save hash table %d\n", whichHashTable);
+                soft_exit(1);
+            }
+            *totalBytesWritten += bytesWrittenThisHashTable;
+            totalUsedHashTableElements += index->hashTables[whichHashTable]->GetUsedElementCount();
+
+            delete index->hashTables[whichHashTable];
+            index->hashTables[whichHashTable] = NULL;
+        }
+
+        report->endPhase();
+        firstHashTableInGroup = hashTableLimitInGroup;
+    } // for each group of hash tables
+
+    fclose(tablesFile);
+    fclose(overflowTableFile);
+
+    index->overflowTableSize = overflowTableSize;
+    report->setValue("overflowTableSize", overflowTableSize);
+    report->setValue("usedHashTableElements", totalUsedHashTableElements);
+    report->setValue("totalSeeds", totalSeeds);
+
+    IndexBuildStats stats;
+    for (unsigned i = 0; i < nThreads; i++) {
+        stats.noBaseAvailable += threadContexts[i].stats.noBaseAvailable;
+        stats.nonSeeds += threadContexts[i].stats.nonSeeds;
+        stats.bothComplementsUsed += threadContexts[i].stats.bothComplementsUsed;
+        stats.genomeLocationsInOverflowTable += threadContexts[i].stats.genomeLocationsInOverflowTable;
+        stats.seedsWithMultipleOccurrences += threadContexts[i].stats.seedsWithMultipleOccurrences;
+    }
+
+    report->setValue("nonSeeds", stats.nonSeeds);
+    report->setValue("seedsWithMultipleOccurrences", stats.seedsWithMultipleOccurrences);
+    report->setValue("genomeLocationsInOverflowTable", stats.genomeLocationsInOverflowTable);
+    report->setValue("bothComplementsUsed", stats.bothComplementsUsed);
+    report->setValue("noBaseAvailable", stats.noBaseAvailable);
+
+    WriteStatusMessage("%lld(%lld%%) seeds occur more than once, total of %lld(%lld%%) genome locations are not unique, %lld(%lld%%) bad seeds, %lld both complements used %lld no string\n",
+        stats.seedsWithMultipleOccurrences,
+        (stats.seedsWithMultipleOccurrences * 100) / countOfBases,
+        stats.genomeLocationsInOverflowTable,
+        stats.genomeLocationsInOverflowTable * 100 / countOfBases,
+        stats.nonSeeds,
+        (stats.nonSeeds * 100) / countOfBases,
+        stats.bothComplementsUsed,
+        stats.noBaseAvailable);
+
+    if (NULL != histogramFile) {
+        unsigned *histogram = threadContexts[0].histogram;
+        _uint64 countOfTooBigForHistogram = threadContexts[0].countOfTooBigForHistogram;
+        _uint64 sumOfTooBigForHistogram = threadContexts[0].sumOfTooBigForHistogram;
+        _uint64 largestSeed = threadContexts[0].largestSeed;
+        for (unsigned i = 1; i < nThreads; i++) {
+            for (unsigned j = 0; j <= maxHistogramEntry; j++) {
+                histogram[j] += threadContexts[i].histogram[j];
+            }
+            countOfTooBigForHistogram += threadContexts[i].countOfTooBigForHistogram;
+            sumOfTooBigForHistogram += threadContexts[i].sumOfTooBigForHistogram;
+            largestSeed = __max(largestSeed, threadContexts[i].largestSeed);
+        }
+        histogram[1] = (unsigned)(totalUsedHashTableElements - stats.seedsWithMultipleOccurrences);
+        WriteSeedHistogram(histogramFile, histogram, maxHistogramEntry, countOfTooBigForHistogram, sumOfTooBigForHistogram, largestSeed);
+    }
+
+    for (unsigned i = 0; i < nThreads; i++) {
+        delete [] threadContexts[i].histogram;
+    }
+    delete [] threadContexts;
+    delete [] seedsPerHashTable;
+    delete [] nextRecordForHashTable;
+    delete [] hashTableRecordStart;
+    delete [] overflowSizeOfHashTable;
+    delete [] overflowOffsetOfHashTable;
+    delete [] seedsInHashTable;
+    delete [] filenameBuffer;
+
+    WriteStatusMessage("Sorted hash table and overflow table build took %llds\n", (timeInMillis() + 500 - start) / 1000);
+
+    return true;
+}
+
+    void
+GenomeIndex::RunSortBuildPhase(SortBuildThreadContext *contexts, unsigned nThreads, SortBuildThreadContext::Phase phase)
+{
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    volatile int runningThreadCount = nThreads;
+
+    for (unsigned i = 0; i < nThreads; i++) {
+        contexts[i].phase = phase;
+        contexts[i].doneObject = &doneObject;
+        contexts[i].runningThreadCount = &runningThreadCount;
+        StartNewThread(SortBuildWorkerThreadMain, &contexts[i]);
+    }
+
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+}
+
+    void
+GenomeIndex::SortBuildWorkerThreadMain(void *param)
+{
+    SortBuildThreadContext *context = (SortBuildThreadContext *)param;
+    const Genome *genome = context->genome;
+    GenomeIndex *index = context->index;
+    unsigned seedLen = context->seedLen;
+    unsigned hashTableKeySize = context->hashTableKeySize;
+    unsigned locationSize = context->locationSize;
+
+    if (SortBuildThreadContext::CountSeeds == context->phase || SortBuildThreadContext::ScatterSeeds == context->phase) {
+        bool counting = SortBuildThreadContext::CountSeeds == context->phase;
+
+        for (GenomeLocation genomeLocation = context->genomeChunkStart; genomeLocation < context->genomeChunkEnd; genomeLocation++) {
+            const char *bases = genome->getSubstring(genomeLocation, seedLen);
+            //
+            // Check it for NULL, because Genome won't return strings that cross contig boundaries.
+            //
+            if (NULL == bases) {
+                if (counting) {
+                    context->stats.noBaseAvailable++;
+                }
+                continue;
+            }
+
+            if (!Seed::DoesTextRepresentASeed(bases, seedLen)) {
+                if (counting) {
+                    context->stats.nonSeeds++;
+                }
+                continue;
+            }
+
+            if (!IsMinimizerLocation(context->minimizerLocations, genomeLocation)) {
+                continue;
+            }
+
+            Seed seed = Seed(bases, seedLen).masked(index->seedMask);
+            bool usingComplement = context->large && seed.isBiggerThanItsReverseComplement();
+            if (usingComplement) {
+                seed = ~seed;
+            }
+
+            unsigned whichHashTable = seed.getHighBases(hashTableKeySize);
+            _ASSERT(whichHashTable < index->nHashTables);
+
+            if (counting) {
+                context->seedsPerHashTable[whichHashTable]++;
+            } else if (whichHashTable >= context->firstHashTableInGroup && whichHashTable < context->hashTableLimitInGroup) {
+                SortBuildRecord *record = &context->records[context->nextRecordForHashTable[whichHashTable]];
+                context->nextRecordForHashTable[whichHashTable]++;
+                record->lowBases = seed.getLowBases(hashTableKeySize);
+                record->locationAndComplement = GenomeLocationAsInt64(genomeLocation) | (usingComplement ? SortBuildComplementFlag : 0);
+            }
+        } // for each genome location in our chunk
+    } else {
+        //
+        // The per hash table phases.  Grab tables one at a time, since their sizes vary a lot.
+        //
+        for (;;) {
+            _int64 whichHashTable = InterlockedAdd64AndReturnNewValue(context->nextHashTableToProcess, 1) - 1;
+            if (whichHashTable >= context->hashTableLimitInGroup) {
+                break;
+            }
+
+            SortBuildRecord *records = context->records + context->hashTableRecordStart[whichHashTable];
+            _int64 nRecords = context->seedsInHashTable[whichHashTable];
+
+            const SNAPHashTable *existingTable = (NULL == context->existingIndex) ? NULL : context->existingIndex->hashTables[whichHashTable];
+            SNAPHashTable::KeyType existingKey;
+            SNAPHashTable::ValueType existingValues[NUM_DIRECTIONS];
+            _int64 nExistingHits[NUM_DIRECTIONS];
+
+            if (SortBuildThreadContext::SortAndSizeHashTables == context->phase) {
+                SortBuildRadixSort(records, context->sortBuffer + context->hashTableRecordStart[whichHashTable], nRecords, hashTableKeySize);
+
+                //
+                // Each seed (or, for large tables, each direction of each seed) with more than one hit needs
+                // a count followed by its hits in the overflow table.  When appending, start with what the existing
+                // entries need and then adjust for the ones that get new hits.
+                //
+                _int64 overflowSize = 0;
+                _int64 nSeedsNotInExistingTable = 0;
+                if (NULL != existingTable) {
+                    for (_uint64 whichSlot = 0; whichSlot < existingTable->GetTableSize(); whichSlot++) {
+                        if (existingTable->GetSlotContents(whichSlot, &existingKey, existingValues)) {
+                            SortBuildCountExistingHits(context, existingValues, nExistingHits);
+                            overflowSize += SortBuildOverflowSizeForHits(nExistingHits);
+                        }
+                    }
+                }
+
+                for (_int64 runStart = 0; runStart < nRecords; ) {
+                    _int64 nHitsInDirection[NUM_DIRECTIONS] = {0, 0};
+                    _int64 runEnd;
+                    for (runEnd = runStart; runEnd < nRecords && records[runEnd].lowBases == records[runStart].lowBases; runEnd++) {
+                        nHitsInDirection[(records[runEnd].locationAndComplement & SortBuildComplementFlag) ? 1 : 0]++;
+                    }
+
+                    if (NULL != existingTable && existingTable->Lookup(records[runStart].lowBases, existingTable->GetValueCount(), existingValues)) {
+                        SortBuildCountExistingHits(context, existingValues, nExistingHits);
+                        overflowSize -= SortBuildOverflowSizeForHits(nExistingHits);
+                        for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+                            nHitsInDirection[dir] += nExistingHits[dir];
+                        }
+                    } else {
+                        nSeedsNotInExistingTable++;
+                    }
+
+                    overflowSize += SortBuildOverflowSizeForHits(nHitsInDirection);
+                    runStart = runEnd;
+                }
+                context->overflowSizeOfHashTable[whichHashTable] = overflowSize;
+
+                if (NULL != existingTable) {
+                    //
+                    // Make the new table big enough for the added seeds at the same load as the existing one (but at least
+                    // the default slack, since a nearly full table is slow and might not take them all).
+                    //
+                    size_t nSeedsInTable = existingTable->GetUsedElementCount() + nSeedsNotInExistingTable;
+                    double load = __min((double)existingTable->GetUsedElementCount() / existingTable->GetTableSize(), 1.0 / (1.0 + DEFAULT_SLACK));
+                    if (0 == existingTable->GetUsedElementCount()) {
+                        load = 1.0 / (1.0 + DEFAULT_SLACK);
+                    }
+                    _int64 newTableSize = __max((_int64)existingTable->GetTableSize(), (_int64)(nSeedsInTable / load) + 1);
+
+                    index->hashTables[whichHashTable] = new SNAPHashTable(newTableSize, hashTableKeySize, locationSize, context->large ? 2 : 1,
+                                                                          GenomeLocationAsInt64(InvalidGenomeLocation), true);
+                }
+            } else {
+                _ASSERT(SortBuildThreadContext::FillHashTables == context->phase);
+
+                SNAPHashTable *hashTable = index->hashTables[whichHashTable];
+                _int64 overflowOffset = context->overflowOffsetOfHashTable[whichHashTable];
+                SNAPHashTable::ValueType newEntry[NUM_DIRECTIONS];
+
+                if (NULL != existingTable) {
+                    //
+                    // Move each existing entry over, along with any new hits for its seed.  Find those by binary search,
+                    // since records is sorted by seed.
+                    //
+                    for (_uint64 whichSlot = 0; whichSlot < existingTable->GetTableSize(); whichSlot++) {
+                        if (!existingTable->GetSlotContents(whichSlot, &existingKey, existingValues)) {
+                            continue;
+                        }
+
+                        _int64 runStart = 0;
+                        _int64 runLimit = nRecords;
+                        while (runStart < runLimit) {
+                            _int64 probe = (runStart + runLimit) / 2;
+                            if (records[probe].lowBases < existingKey) {
+                                runStart = probe + 1;
+                            } else {
+                                runLimit = probe;
+                            }
+                        }
+
+                        _int64 runEnd;
+                        for (runEnd = runStart; runEnd < nRecords && records[runEnd].lowBases == existingKey; runEnd++) {
+                            // This space intentionally left blank.
+                        }
+
+                        SortBuildFillEntry(context, records, runStart, runEnd, existingValues, &overflowOffset, newEntry);
+
+                        if (!hashTable->Insert(existingKey, newEntry)) {
+                            WriteErrorMessage("IndexBuilder: exceeded size of hash table %d while appending.\n", (int)whichHashTable);
+                            soft_exit(1);
+                        }
+                    }
+                }
+
+                for (_int64 runStart = 0; runStart < nRecords; ) {
+                    _int64 runEnd;
+                    for (runEnd = runStart; runEnd < nRecords && records[runEnd].lowBases == records[runStart].lowBases; runEnd++) {
+                        // This space intentionally left blank.
+                    }
+
+                    if (NULL != existingTable && NULL != existingTable->GetFirstValueForKey(records[runStart].lowBases)) {
+                        //
+                        // We did this one along with the existing entries.
+                        //
+                        runStart = runEnd;
+                        continue;
+                    }
+
+                    SortBuildFillEntry(context, records, runStart, runEnd, NULL, &overflowOffset, newEntry);
+
+                    if (!hashTable->Insert(records[runStart].lowBases, newEntry)) {
+                        WriteErrorMessage("IndexBuilder: exceeded size of hash table %d.\n"
+                                "If you're indexing a non-human genome, make sure not to pass the -hg19 option.  Otheriwse, use -exact or increase slack with -h.\n",
+                                (int)whichHashTable);
+                        soft_exit(1);
+                    }
+
+                    runStart = runEnd;
+                } // for each seed
+
+                _ASSERT(overflowOffset == context->overflowOffsetOfHashTable[whichHashTable] + context->overflowSizeOfHashTable[whichHashTable]);
+            } // fill phase
+        } // for each hash table
+    }
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
+
+    void
+GenomeIndex::SortBuildRadixSort(SortBuildRecord *records, SortBuildRecord *buffer, _int64 nRecords, unsigned keySizeInBytes)
+/*++
+
+Routine Description:
+
+    Sort records by lowBases, using an LSD radix sort one byte at a time.  Because it's stable, records with the same
+    lowBases stay in the order they were in coming in.  The result is left in records; buffer is scratch space of the
+    same size.
+
+--*/
+{
+    if (nRecords < 2) {
+        return;
+    }
+
+    SortBuildRecord *from = records;
+    SortBuildRecord *to = buffer;
+
+    for (unsigned whichByte = 0; whichByte < keySizeInBytes; whichByte++) {
+        unsigned shift = whichByte * 8;
+        _int64 bucketStart[256];
+        memset(bucketStart, 0, sizeof(bucketStart));
+
+        for (_int64 i = 0; i < nRecords; i++) {
+            bucketStart[(from[i].lowBases >> shift) & 0xff]++;
+        }
+
+        if (nRecords == bucketStart[(from[0].lowBases >> shift) & 0xff]) {
+            //
+            // Every record has the same value for this byte, so this pass wouldn't change anything.
+            //
+            continue;
+        }
+
+        _int64 nextStart = 0;
+        for (unsigned bucket = 0; bucket < 256; bucket++) {
+            _int64 count = bucketStart[bucket];
+            bucketStart[bucket] = nextStart;
+            nextStart += count;
+        }
+
+        for (_int64 i = 0; i < nRecords; i++) {
+            to[bucketStart[(from[i].lowBases >> shift) & 0xff]++] = from[i];
+        }
+
+        SortBuildRecord *temp = from;
+        from = to;
+        to = temp;
+    }
+
+    if (from != records) {
+        memcpy(records, from, nRecords * sizeof(SortBuildRecord));
+    }
+}
+
+    void
+GenomeIndex::SortBuildCountExistingHits(const SortBuildThreadContext *context, const SNAPHashTable::ValueType *existingValues, _int64 *nHitsInDirection)
+/*++
+
+Routine Description:
+
+    Figure out how many hits in each direction a seed has in the index we're appending to, given its hash table
+    values there (or NULL if it's not there).
+
+--*/
+{
+    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+        nHitsInDirection[dir] = 0;
+    }
+
+    if (NULL == existingValues) {
+        return;
+    }
+
+    const GenomeIndex *existingIndex = context->existingIndex;
+    for (int dir = 0; dir < (context->large ? NUM_DIRECTIONS : 1); dir++) {
+        _uint64 value = existingValues[dir];
+        if (value == (_uint64)(GenomeLocationAsInt64(InvalidGenomeLocation) - 1)) {
+            nHitsInDirection[dir] = 0;  // The unused complement in a large table
+        } else if (value < (_uint64)context->existingCountOfBases) {
+            nHitsInDirection[dir] = 1;
+        } else if (context->locationSize > 4) {
+            nHitsInDirection[dir] = existingIndex->overflowTable64[value - context->existingCountOfBases];
+        } else {
+            nHitsInDirection[dir] = existingIndex->overflowTable32[value - context->existingCountOfBases];
+        }
+    }
+}
+
+    _int64
+GenomeIndex::SortBuildOverflowSizeForHits(const _int64 *nHitsInDirection)
+{
+    //
+    // Each direction with more than one hit needs a count followed by its hits in the overflow table.
+    //
+    _int64 overflowSize = 0;
+    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+        if (nHitsInDirection[dir] > 1) {
+            overflowSize += 1 + nHitsInDirection[dir];
+        }
+    }
+
+    return overflowSize;
+}
+
+    void
+GenomeIndex::SortBuildSetOverflowEntry(SortBuildThreadContext *context, _int64 whichEntry, _int64 value)
+{
+    if (context->locationSize > 4) {
+        ((_int64 *)context->groupOverflowTable)[whichEntry] = value;
+    } else {
+        ((unsigned *)context->groupOverflowTable)[whichEntry] = (unsigned)value;
+    }
+}
+
+    void
+GenomeIndex::SortBuildFillEntry(
+    SortBuildThreadContext         *context,
+    const SortBuildRecord          *records,
+    _int64                          runStart,
+    _int64                          runEnd,
+    const SNAPHashTable::ValueType *existingValues,
+    _int64                         *overflowOffset,
+    SNAPHashTable::ValueType       *newEntry)
+/*++
+
+Routine Description:
+
+    Compute the hash table values for one seed from its sorted records and (when appending) its values in the existing
+    index, writing its overflow table lists into the group's overflow table if it needs any.
+
+Arguments:
+
+    context         - the thread context
+    records         - the sorted records for the seed's hash table
+    runStart        - the seed's first record
+    runEnd          - one past the seed's last record (the same as runStart if the seed has no new hits)
+    existingValues  - the seed's values in the index we're appending to, or NULL if it's not there
+    overflowOffset  - in/out: where in the group's overflow table to put the next overflow list
+    newEntry        - returns the hash table values for the seed
+
+--*/
+{
+    _int64 nNewHits[NUM_DIRECTIONS] = {0, 0};
+    for (_int64 i = runStart; i < runEnd; i++) {
+        nNewHits[(records[i].locationAndComplement & SortBuildComplementFlag) ? 1 : 0]++;
+    }
+
+    _int64 nExistingHits[NUM_DIRECTIONS];
+    SortBuildCountExistingHits(context, existingValues, nExistingHits);
+
+    _int64 countOfBases = context->genome->getCountOfBases();
+
+    for (int dir = 0; dir < (context->large ? NUM_DIRECTIONS : 1); dir++) {
+        _uint64 complementFlag = (1 == dir) ? SortBuildComplementFlag : 0;
+        _int64 nHits = nNewHits[dir] + nExistingHits[dir];
+        if (0 == nHits) {
+            newEntry[dir] = GenomeLocationAsInt64(InvalidGenomeLocation) - 1; // Use 0xfffffffe for unused, because we gave 0xffffffff to the hash table package.
+        } else if (1 == nHits) {
+            if (1 == nExistingHits[dir]) {
+                newEntry[dir] = existingValues[dir];
+            } else {
+                for (_int64 i = runStart; i < runEnd; i++) {
+                    if ((records[i].locationAndComplement & SortBuildComplementFlag) == complementFlag) {
+                        newEntry[dir] = records[i].locationAndComplement & ~SortBuildComplementFlag;
+                        break;
+                    }
+                }
+            }
+        } else {
+            //
+            // Write the count followed by the hits.  They need to be reverse sorted (see the comment in BuildIndexToDirectory),
+            // and the new ones are in genome order now, so just walk them backwards.  Any existing hits are all earlier in the
+            // genome than the new ones, and already reverse sorted, so they go at the end.
+            //
+            newEntry[dir] = countOfBases + context->groupOverflowTableBase + *overflowOffset;
+            _int64 nextOverflowEntry = *overflowOffset + 1;
+            for (_int64 i = runEnd - 1; i >= runStart; i--) {
+                if ((records[i].locationAndComplement & SortBuildComplementFlag) == complementFlag) {
+                    SortBuildSetOverflowEntry(context, nextOverflowEntry, records[i].locationAndComplement & ~SortBuildComplementFlag);
+                    nextOverflowEntry++;
+                }
+            }
+
+            if (1 == nExistingHits[dir]) {
+                SortBuildSetOverflowEntry(context, nextOverflowEntry, existingValues[dir]);
+                nextOverflowEntry++;
+            } else if (nExistingHits[dir] > 1) {
+                _int64 existingOverflowOffset = existingValues[dir] - context->existingCountOfBases;
+                for (_int64 i = 1; i <= nExistingHits[dir]; i++) {
+                    if (context->locationSize > 4) {
+                        SortBuildSetOverflowEntry(context, nextOverflowEntry, context->existingIndex->overflowTable64[existingOverflowOffset + i]);
+                    } else {
+                        SortBuildSetOverflowEntry(context, nextOverflowEntry, context->existingIndex->overflowTable32[existingOverflowOffset + i]);
+                    }
+                    nextOverflowEntry++;
+                }
+            }
+
+            SortBuildSetOverflowEntry(context, *overflowOffset, nHits);
+            *overflowOffset = nextOverflowEntry;
+
+            context->stats.seedsWithMultipleOccurrences++;
+            context->stats.genomeLocationsInOverflowTable += nHits;
+
+            if (NULL != context->histogram) {
+                if (nHits > maxHistogramEntry) {
+                    context->countOfTooBigForHistogram++;
+                    context->sumOfTooBigForHistogram += nHits;
+                } else {
+                    context->histogram[nHits]++;
+                }
+                context->largestSeed = __max(context->largestSeed, (_uint64)nHits);
+            }
+        }
+    } // for each direction
+
+    if (context->large && 0 != nNewHits[0] + nExistingHits[0] && 0 != nNewHits[1] + nExistingHits[1]) {
+        context->stats.bothComplementsUsed++;
+    }
+}
+
+GenomeIndex::OverflowBackpointerAnchor::OverflowBackpointerAnchor(_int64 maxOverflowEntries_) : maxOverflowEntries(maxOverflowEntries_)
+{
+    _ASSERT(maxOverflowEntries > 0);
+	_int64 roundedUpMaxOverflowEntries = (maxOverflowEntries + batchSize - 1) / batchSize * batchSize;	// Round up to the next batch size
+
+	table = new OverflowBackpointer *[roundedUpMaxOverflowEntries / batchSize];
+
+	for (unsigned i = 0; i < roundedUpMaxOverflowEntries / batchSize; i++) {
+		table[i] = NULL;
+	}
+
+    InitializeExclusiveLock(&lock);
+}
+
+GenomeIndex::OverflowBackpointerAnchor::~OverflowBackpointerAnchor()
+{
+	for (unsigned i = 0; i < maxOverflowEntries / batchSize; i++) {
+		if (table[i] != NULL) {
+			BigDealloc(table[i]);
+			table[i] = NULL;
+		}
+	}
+
+	delete [] table;
+	table = NULL;
+
+    DestroyExclusiveLock(&lock);
+}
+
+	GenomeIndex::OverflowBackpointer *
+GenomeIndex::OverflowBackpointerAnchor::getBackpointer(_int64 index)
+{
+    if (index >= maxOverflowEntries) {
+        WriteErrorMessage("Trying to use too many overflow entries.  To index this genome, you either need a larger seed size or a larger location size.\n");
+        soft_exit(1);
+    }
+	_int64 tableSlot = index / batchSize;
+	if (table[tableSlot] == NULL) {
+        AcquireExclusiveLock(&lock);
+        if (table[tableSlot] == NULL) {
+			OverflowBackpointer *newTableEntry = (OverflowBackpointer *)BigAlloc(batchSize * sizeof(OverflowBackpointer));
+		    for (unsigned i = 0; i < batchSize; i++) {
+				newTableEntry[i].genomeLocation = 0xffffffffffffffff;
+				newTableEntry[i].nextIndex = 0xffffffffffffffff;
+		    }
+
+			//
+			// Don't fill in the table[] pointer until initialization is complete in order to avoid racing with someone writing while we're
+			// initializing.
+			//
+			table[tableSlot] = newTableEntry;
+		}
+        ReleaseExclusiveLock(&lock);
+	} else {
+		if (&spilledTableSlot == table[tableSlot]) {
+			WriteErrorMessage("Looking up spilled table slot.  Something is very wrong.  Try not using -sm and contact the developers.\n");
+			soft_exit(1);
+		}
+	}
+	return &table[tableSlot][index % batchSize];
+}
+
+	void
+GenomeIndex::OverflowBackpointerAnchor::trimTo(_int64 trimToIndex, FILE *trimFile)
+{
+	//
+	// Run through the anchor table, and spill out any table slots whose indices are all less than trimToIndex and that aren't
+	// yet spilled out.
+	//
+	for (_int64 tableSlot = 0; (tableSlot + 1) * batchSize < trimToIndex; tableSlot++) {
+		if (&spilledTableSlot != table[tableSlot] && NULL != table[tableSlot]) {
+			if (batchSize != fwrite(table[tableSlot], sizeof(*table[tableSlot]), batchSize, trimFile)) {
+				WriteErrorMessage("Failure writing to trim file.  Maybe you're out of disk space or encountered some other error.  Perhaps try without -sm.\n");
+				soft_exit(1);
+			}
+			BigDealloc((void *)table[tableSlot]);
+			table[tableSlot] = &spilledTableSlot;
+		}
+	}
+}
+	void
+GenomeIndex::OverflowBackpointerAnchor::loadFromFile(FILE *file)
+{
+	rewind(file);
+	for (int i = 0; i < maxOverflowEntries / batchSize; i++) {
+		if (table[i] == &spilledTableSlot) {
+			table[i] = (OverflowBackpointer *)BigAlloc(batchSize * sizeof(OverflowBackpointer));
+			if (batchSize != fread(table[i], sizeof(OverflowBackpointer), batchSize, file)) {
+				WriteErrorMessage("Failed to read overflow table batch i from spill file\n", i);
+				soft_exit(1);
+			}
+		}
+	}
+}
+
+const unsigned GenomeIndex::OverflowBackpointerAnchor::batchSize = 1024 * 1024;
+GenomeIndex::OverflowBackpointer GenomeIndex::OverflowBackpointerAnchor::spilledTableSlot;
+
+    void
+GenomeIndex::printBiasTables()
+{
+    for (int keySize = 0; keySize <= largestKeySize; keySize++) {
+        for (int seedSize = 0; seedSize <= largestBiasTable; seedSize++) {
+            if (NULL != hg19_biasTables_large[keySize][seedSize]) {
+                printf("static double hg19_biasTable%d_%d_large[] = {\n", seedSize, keySize);
+                unsigned bitsOfSeed = seedSize * 2;
+                unsigned bitsOfKey = keySize * 8;   // 8 == nBits / byte
+                unsigned numHashTables = 1 << (bitsOfSeed - bitsOfKey);
+                for (unsigned hashTable = 0; hashTable < numHashTables; hashTable++) {
+                    if (hg19_biasTables_large[keySize][seedSize][hashTable] == 0) {
+                        printf("0");
+                    } else if (hg19_biasTables_large[keySize][seedSize][hashTable] > 1000 || hg19_biasTables_large[keySize][seedSize][hashTable] < .01) {
+                        printf("%1.2e", hg19_biasTables_large[keySize][seedSize][hashTable]);
+                    } else if (hg19_biasTables_large[keySize][seedSize][hashTable] > 10) {
+                        printf("%1.1f", hg19_biasTables_large[keySize][seedSize][hashTable]);
+                    } else {
+                        printf("%1.3f", hg19_biasTables_large[keySize][seedSize][hashTable]);
+                    }
+
+                    if (hashTable != numHashTables-1) {
+                        printf(",");
+                    }
+
+                    if (hashTable % 10 == 9) {
+                        printf("\n");
+                    }
+                } // for each hash table
+                printf("\n};\n\n");
+            } // if there is a bias entry for this key * seed size
+        } // for each seed size
+    } // for each key size
+
+    for (int keySize = 0; keySize <= largestKeySize; keySize++) {
+        for (int seedSize = 0; seedSize <= largestBiasTable; seedSize++) {
+            if (NULL != hg19_biasTables[keySize][seedSize]) {
+                printf("static double hg19_biasTable%d_%d[] = {\n", seedSize, keySize);
+                unsigned bitsOfSeed = seedSize * 2;
+                unsigned bitsOfKey = keySize * 8;   // 8 == nBits / byte
+                unsigned numHashTables = 1 << (bitsOfSeed - bitsOfKey);
+                for (unsigned hashTable = 0; hashTable < numHashTables; hashTable++) {
+                    if (hg19_biasTables[keySize][seedSize][hashTable] == 0) {
+                        printf("0");
+                    } else if (hg19_biasTables[keySize][seedSize][hashTable] > 1000 || hg19_biasTables[keySize][seedSize][hashTable] < .01) {
+                        printf("%1.2e", hg19_biasTables[keySize][seedSize][hashTable]);
+                    } else if (hg19_biasTables[keySize][seedSize][hashTable] > 10) {
+                        printf("%1.1f", hg19_biasTables[keySize][seedSize][hashTable]);
+                    } else {
+                        printf("%1.3f", hg19_biasTables[keySize][seedSize][hashTable]);
+                    }
+
+                    if (hashTable != numHashTables-1) {
+                        printf(",");
+                    }
+
+                    if (hashTable % 10 == 9) {
+                        printf("\n");
+                    }
+                } // for each hash table
+                printf("\n};\n\n");
+            } // if there is a bias entry for this key * seed size
+        } // for each seed size
+    } // for each key size
+}
+
+        GenomeIndex *
+GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch, bool interleaveAcrossNumaNodes, const char *restrictToContigs,
+                               const Genome *genomeToShare, bool outOfCore)
+{
+    int filenameBufferSize = (int)(strlen(directoryName) + 1 + __max(strlen(GenomeIndexFileName), __max(strlen(OverflowTableFileName), __max(strlen(GenomeIndexHashFileName), strlen(GenomeFileName)))) + 1);
+    char *filenameBuffer = new char[filenameBufferSize];
+    
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeIndexFileName);
+
+    GenericFile *indexFile = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+
+    if (NULL == indexFile) {
+        WriteErrorMessage("Unable to open file '%s' for read.\n",filenameBuffer);
+        delete[] filenameBuffer;
+        filenameBuffer = NULL;
+        return NULL;
+    }
+
+    char indexFileBuf[1000];
+    size_t indexFileSize = indexFile->read(indexFileBuf, sizeof(indexFileBuf) - 1);
+    indexFileBuf[indexFileSize] = 0;
+
+    unsigned seedLen;
+    unsigned majorVersion, minorVersion, chromosomePadding;
+    int nRead;
+    size_t hashTablesFileSize;
+    unsigned nHashTables;
+    _int64 overflowTableSize;
+    unsigned hashTableKeySize;
+    unsigned smallHashTable;
+    unsigned locationSize;
+    unsigned compressedOverflowValue = 0;
+    unsigned minimizerWindow = 0;
+    _uint64 seedMask = ~(_uint64)0;
+    if (10 > (nRead = sscanf(indexFileBuf,"%d %d %d %lld %d %d %d %lld %d %d %d %d %llu", &majorVersion, &minorVersion, &nHashTables, &overflowTableSize, &seedLen, &chromosomePadding, 
+											&hashTableKeySize, &hashTablesFileSize, &smallHashTable, &locationSize, &compressedOverflowValue, &minimizerWindow, &seedMask))) {
+        if (3 == nRead || 6 == nRead || 7 == nRead || 9 == nRead) {
+            WriteErrorMessage("Indices built by versions before 1.0dev.21 are no longer supported.  Please rebuild your index.\n");
+        } else {
+            WriteErrorMessage("GenomeIndex::LoadFromDirectory: didn't read initial values\n");
+        }
+        indexFile->close();		
+        delete indexFile;
+        return NULL;
+    }
+    indexFile->close();
+    delete indexFile;
+
+    //
+    // The checksums line, if the index has one (see WriteIndexChecksums).
+    //
+    bool hasGenomeChecksum = false, hasHashTableChecksum = false, hasOverflowTableChecksum = false;
+    _uint32 genomeChecksum = 0, hashTableChecksum = 0, overflowTableChecksum = 0;
+    const char *checksumsLine = strstr(indexFileBuf, IndexChecksumsTag);
+    if (NULL != checksumsLine) {
+        const char *next = checksumsLine + strlen(IndexChecksumsTag);
+        char name[100];
+        unsigned checksum;
+        int nConsumed;
+        while (2 == sscanf(next, " %99[^:]:%x%n", name, &checksum, &nConsumed)) {
+            if (!strcmp(name, GenomeFileName)) {
+                hasGenomeChecksum = true;
+                genomeChecksum = checksum;
+            } else if (!strcmp(name, GenomeIndexHashFileName)) {
+                hasHashTableChecksum = true;
+                hashTableChecksum = checksum;
+            } else if (!strcmp(name, OverflowTableFileName)) {
+                hasOverflowTableChecksum = true;
+                overflowTableChecksum = checksum;
+            }
+            next += nConsumed;
+        }
+    }
+
+    if (majorVersion > SpacedSeedGenomeIndexFormatMajorVersion || majorVersion < OldestSupportedGenomeIndexFormatMajorVersion) {
+        WriteErrorMessage("This genome index appears to be from a different version of SNAP than this, and so we can't read it.  Index version %d, SNAP index format version %d\n",
+            majorVersion, GenomeIndexFormatMajorVersion);
+        soft_exit(1);
+    }
+
+    if (0 == seedLen) {
+        WriteErrorMessage("GenomeIndex::LoadFromDirectory: saw seed size of 0.\n");
+        return NULL;
+    }
+
+    bool badParameters;
+    if (SpacedSeedGenomeIndexFormatMajorVersion == majorVersion) {
+        badParameters = 13 != nRead || minimizerWindow > MaxMinimizerWindow || 0 == seedMask;
+    } else if (ExtendedGenomeIndexFormatMajorVersion == majorVersion) {
+        badParameters = 12 != nRead || minimizerWindow > MaxMinimizerWindow;
+    } else {
+        badParameters = 10 != nRead;
+    }
+
+    if (badParameters) {
+        WriteErrorMessage("GenomeIndex::LoadFromDirectory: the index parameters don't match the index version %d\n", majorVersion);
+        return NULL;
+    }
+
+    SetInvalidGenomeLocation(locationSize);
+
+    GenomeIndex *index;
+    index = new GenomeIndex();
+
+    index->nHashTables = nHashTables;
+    index->overflowTableSize = overflowTableSize;
+    index->hashTableKeySize = hashTableKeySize;
+    index->seedLen = seedLen;
+    index->locationSize = locationSize;
+    index->largeHashTable = !smallHashTable;
+    index->minimizerWindow = minimizerWindow;
+    index->seedMask = seedMask;
+
+    bool compressedOverflow = 0 != compressedOverflowValue;
+    if (compressedOverflow && locationSize <= 4) {
+        WriteErrorMessage("GenomeIndex::LoadFromDirectory: index has a compressed overflow table but %d byte locations\n", locationSize);
+        delete index;
+        return NULL;
+    }
+
+    //
+    // Out of core, the tables are mapped, and left to be paged in as they're used.
+    //
+    bool mapTables = map || outOfCore;
+    bool prefetchTables = prefetch && !outOfCore;
+    index->outOfCore = outOfCore;
+
+    if (NULL != restrictToContigs && mapTables) {
+        WriteErrorMessage("GenomeIndex::loadFromDirectory: an index can only be restricted to some contigs if it's loaded without mapping\n");
+        delete[] filenameBuffer;
+        delete index;
+        return NULL;
+    }
+
+    if (NULL != restrictToContigs && compressedOverflow) {
+        WriteErrorMessage("The index in '%s' has a compressed overflow table (index -compressOverflow), so it can't be restricted to some contigs\n",
+                          directoryName);
+        delete[] filenameBuffer;
+        delete index;
+        return NULL;
+    }
+
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeIndexHashFileName);
+    if (mapTables && GenericFile_packed::IsPackedFile(filenameBuffer)) {
+        WriteErrorMessage("The index in '%s' is packed (index -pack), so it can't be mapped.  Load it without -map, -shm or -ooc.\n", directoryName);
+        delete[] filenameBuffer;
+        delete index;
+        return NULL;
+    }
+
+    unsigned overflowEntrySize = compressedOverflow ? 1 : (locationSize > 4) ? sizeof(*index->overflowTable64) : sizeof(*index->overflowTable32);   // Compressed size is in bytes
+
+    size_t overflowTableSizeInBytes = (size_t)index->overflowTableSize * overflowEntrySize;
+    index->overflowTableSizeInBytes = overflowTableSizeInBytes;
+
+    snprintf(filenameBuffer,filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, OverflowTableFileName);
+
+	if (mapTables) {
+		if (prefetchTables) {
+			GenericFile *overflowTableFile = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+			if (NULL == overflowTableFile) {
+				WriteErrorMessage("Unable to open file '%s'\n", filenameBuffer);
+                soft_exit(1);
+			}
+
+			overflowTableFile->prefetch();
+			overflowTableFile->close();
+			delete overflowTableFile;
+		}
+
+		index->mappedOverflowTable = GenericFile_map::open(filenameBuffer);
+		if (NULL == index->mappedOverflowTable) {
+			WriteErrorMessage("Unable to open file '%s'\n", filenameBuffer);
+            soft_exit(1);
+		}
+
+		size_t bytesMapped;
+		if (compressedOverflow) {
+			index->compressedOverflowTable = (const unsigned char *)index->mappedOverflowTable->mapAndAdvance(overflowTableSizeInBytes, &bytesMapped);
+		} else if (locationSize > 4) {
+			index->overflowTable64 = (_int64 *)index->mappedOverflowTable->mapAndAdvance(overflowTableSizeInBytes, &bytesMapped);
+		} else {
+			index->overflowTable32 = (unsigned *)index->mappedOverflowTable->mapAndAdvance(overflowTableSizeInBytes, &bytesMapped);
+		}
+
+		if (bytesMapped != overflowTableSizeInBytes) {
+			WriteErrorMessage("read (via mapping) only %lld bytes of '%s', expected %lld\n", bytesMapped, filenameBuffer, overflowTableSizeInBytes);
+            soft_exit(1);
+		}
+
+		if (!outOfCore) {
+			index->mappedOverflowTable->prefetch();	// NB: This is different than the -pre prefetch.  This one maps the whole thing (and reads it sequentially in case you didn't use -pre)
+		}
+	} else {
+		char *tableAsCharStar;
+		if (compressedOverflow) {
+			tableAsCharStar = (char *)BigAlloc(overflowTableSizeInBytes);
+			index->compressedOverflowTable = (const unsigned char *)tableAsCharStar;
+		} else if (locationSize > 4) {
+			index->overflowTable64 = (_int64 *)BigAlloc(overflowTableSizeInBytes);
+			tableAsCharStar = (char *)index->overflowTable64;
+			_ASSERT(NULL == index->overflowTable32);
+		} else {
+			index->overflowTable32 = (unsigned *)BigAlloc(overflowTableSizeInBytes);
+			tableAsCharStar = (char *)index->overflowTable32;
+			_ASSERT(NULL == index->overflowTable64);
+		}
+
+        if (interleaveAcrossNumaNodes) {
+            InterleaveMemoryAcrossNumaNodes(tableAsCharStar, overflowTableSizeInBytes);  // Before reading it in, so the pages get spread out as they're touched
+        }
+
+		GenericFile *fOverflowTable = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+
+		if (NULL == fOverflowTable) {
+			WriteErrorMessage("Unable to open overflow table file, '%s', %d\n", filenameBuffer, errno);
+            delete[] filenameBuffer;
+            delete index;
+			return NULL;
+		}
+
+		bool verify = VerifyChecksums && hasOverflowTableChecksum;
+		_uint32 checksum;
+		size_t amountRead = fOverflowTable->readInParallel(tableAsCharStar, overflowTableSizeInBytes, verify ? &checksum : NULL);
+		if (amountRead != overflowTableSizeInBytes) {
+			WriteErrorMessage("Error reading overflow table, %lld != %lld bytes read.\n", amountRead, overflowTableSizeInBytes);
+			soft_exit(1);
+		}
+
+		if (verify && checksum != overflowTableChecksum) {
+			WriteErrorMessage("The checksum of '%s' is %08x, but the index says %08x.  Index corrupt\n", filenameBuffer, checksum, overflowTableChecksum);
+			fOverflowTable->close();
+			delete fOverflowTable;
+			delete[] filenameBuffer;
+			delete index;
+			return NULL;
+		}
+
+		fOverflowTable->close();
+		delete fOverflowTable;
+		fOverflowTable = NULL;
+	}
+
+    index->hashTables = new SNAPHashTable*[index->nHashTables];
+
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        index->hashTables[i] = NULL; // We need to do this so the destructor doesn't crash if loading a hash table fails.
+    }
+    index->tablesBlobSize = hashTablesFileSize;
+
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeIndexHashFileName);
+
+	GenericFile_Blob *blobFile = NULL;
+	GenericFile *tablesFile = NULL;
+
+	if (mapTables) {
+		if (prefetchTables) {
+			GenericFile *hashTableFile = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+			if (NULL == hashTableFile) {
+				WriteErrorMessage("Unable to open genome hash table file '%s'\n", filenameBuffer);
+				soft_exit(1);
+			}
+
+			hashTableFile->prefetch();
+			hashTableFile->close();
+			delete hashTableFile;
+		}
+
+		//
+		// Files on hugetlbfs are padded out to a whole number of huge pages, so allow a mapped file to be bigger than it should be.
+		//
+		if (QueryFileSize(filenameBuffer) < (_int64)hashTablesFileSize) {
+			WriteErrorMessage("File '%s' is too small, %lld < %lld\n", filenameBuffer, QueryFileSize(filenameBuffer), hashTablesFileSize);
+            delete[]filenameBuffer;
+			delete index;
+			return NULL;
+		}
+
+		index->mappedTables = GenericFile_map::open(filenameBuffer);
+		if (!outOfCore) {
+			index->mappedTables->prefetch();
+		}
+		blobFile = index->mappedTables;
+		index->tablesBlob = NULL;
+	} else {
+		tablesFile = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+		if (NULL == tablesFile) {
+			WriteErrorMessage("Unable to open genome hash table file '%s'\n", filenameBuffer);
+			soft_exit(1);
+		}
+
+		index->tablesBlob = BigAlloc(hashTablesFileSize);
+        if (interleaveAcrossNumaNodes) {
+            InterleaveMemoryAcrossNumaNodes(index->tablesBlob, hashTablesFileSize);
+        }
+		bool verify = VerifyChecksums && hasHashTableChecksum;
+		_uint32 checksum;
+		size_t amountRead = tablesFile->readInParallel(index->tablesBlob, hashTablesFileSize, verify ? &checksum : NULL);
+		if (amountRead != hashTablesFileSize) {
+			WriteErrorMessage("Read incorrect amount for GenomeIndexHash file, %lld != %lld\n", hashTablesFileSize, amountRead);
+            delete[] filenameBuffer;
+			delete index;
+			return NULL;
+		}
+
+		if (verify && checksum != hashTableChecksum) {
+			WriteErrorMessage("The checksum of '%s' is %08x, but the index says %08x.  Index corrupt\n", filenameBuffer, checksum, hashTableChecksum);
+			tablesFile->close();
+			delete tablesFile;
+			delete[] filenameBuffer;
+			delete index;
+			return NULL;
+		}
+
+		blobFile = GenericFile_Blob::open(index->tablesBlob, hashTablesFileSize);
+	}
+
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        if (NULL == (index->hashTables[i] = SNAPHashTable::loadFromBlob(blobFile))) {
+            WriteErrorMessage("GenomeIndex::loadFromDirectory: Failed to load hash table %d\n",i);
+            delete[] filenameBuffer;
+            delete index;
+            return NULL;
+        }
+
+		unsigned expectedValueCount;
+		if (smallHashTable) {
+			expectedValueCount = 1;
+		} else {
+			expectedValueCount = 2;
+		}
+
+        if (index->hashTables[i]->GetValueCount() != expectedValueCount) {
+            WriteErrorMessage("Expected loaded hash table to have value count of %d, but it had %d.  Index corrupt\n", expectedValueCount, index->hashTables[i]->GetValueCount());
+            delete[] filenameBuffer;
+            delete index;
+            return NULL;
+        }
+    }
+
+	if (!mapTables) {
+		tablesFile->close();
+		delete tablesFile;
+		tablesFile = NULL;
+
+		blobFile->close();
+		delete blobFile;
+		blobFile = NULL;
+	}
+
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeFileName);
+    if (NULL != genomeToShare) {
+        index->genome = genomeToShare;
+    } else if (NULL != restrictToContigs) {
+        if (!index->loadGenomeSliceForContigs(filenameBuffer, chromosomePadding, restrictToContigs)) {
+            delete[] filenameBuffer;
+            delete index;
+            return NULL;
+        }
+    } else {
+        bool verify = VerifyChecksums && hasGenomeChecksum && !map;
+        _uint32 checksum;
+        if (NULL == (index->genome = Genome::loadFromFile(filenameBuffer, chromosomePadding, 0, 0, map, verify ? &checksum : NULL))) {
+            WriteErrorMessage("GenomeIndex::loadFromDirectory: Failed to load the genome itself\n");
+            delete[] filenameBuffer;
+            delete index;
+            return NULL;
+        }
+
+        if (verify && checksum != genomeChecksum) {
+            WriteErrorMessage("The checksum of the bases in '%s' is %08x, but the index says %08x.  Index corrupt\n", filenameBuffer, checksum, genomeChecksum);
+            delete[] filenameBuffer;
+            delete index;
+            return NULL;
+        }
+    }
+
+    if ((_int64)index->genome->getCountOfBases() + (_int64)index->overflowTableSize > 0xfffffff0 && locationSize == 4) {
+        WriteErrorMessage("\nThis index has too many overflow entries to be valid.  Some early versions of SNAP\n"
+                        "allowed building indices with too small of a seed size, and this appears to be such\n"
+                        "an index.  You can no longer build indices like this, and you also can't use them\n"
+                        "because they are corrupt and would produce incorrect results.  Please use an index\n"
+                        "built with a larger seed size.  For hg19, the seed size must be at least 19.\n"
+                        "For other reference genomes this quantity will vary.\n");
+        soft_exit(1);
+    }
+
+    //
+    // The seed sketch counts hits that restrictToContigs may have dropped, so it's only good for the whole index.
+    //
+    if (NULL == restrictToContigs) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, SeedSketchFileName);
+        index->seedSketch = SeedSketch::loadFromFile(filenameBuffer, index->nHashTables, index->genome->getCountOfBases());
+    }
+
+    if (NULL == genomeToShare) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, SpliceJunctionsFileName);
+        index->spliceJunctions = SpliceJunctions::loadFromFile(filenameBuffer, index->genome);
+    }
+    delete[] filenameBuffer;
+
+    //
+    // Likewise, restricting the long seed tables would need its own pass over them, so a restricted index just uses
+    // its own seed size.
+    //
+    if (NULL == genomeToShare && NULL == restrictToContigs && HasLongSeedIndex(directoryName)) {
+        char *longSeedDirectoryName = LongSeedIndexDirectoryFor(directoryName);
+        index->longSeedIndex = loadFromDirectory(longSeedDirectoryName, map, prefetch, interleaveAcrossNumaNodes, NULL, index->genome, outOfCore);
+        if (NULL == index->longSeedIndex) {
+            WriteErrorMessage("GenomeIndex::loadFromDirectory: failed to load the long seed tables in '%s'\n", longSeedDirectoryName);
+        }
+        delete[] longSeedDirectoryName;
+        if (NULL == index->longSeedIndex) {
+            delete index;
+            return NULL;
+        }
+    }
+
+    return index;
+}
+
+    static bool
+LocationInRanges(_int64 location, const _int64 *rangeBegins, const _int64 *rangeEnds, int nRanges)
+{
+    //
+    // The ranges are sorted and don't overlap, so find the last one that starts at or before location.
+    //
+    int low = 0;
+    int high = nRanges - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (rangeBegins[mid] <= location) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return high >= 0 && location < rangeEnds[high];
+}
+
+template<class LOCATION> static _int64
+KeepHitsInRanges(LOCATION *list, const _int64 *rangeBegins, const _int64 *rangeEnds, int nRanges)
+/*++
+
+Routine Description:
+
+    Squeeze the hits in an overflow table list (a count followed by the hits) down to the ones inside the ranges,
+    keeping them in order, and update the count.
+
+Return Value:
+
+    The number of hits that are left.
+
+--*/
+{
+    _int64 hitCount = (_int64)list[0];
+    _int64 nKept = 0;
+    for (_int64 i = 1; i <= hitCount; i++) {
+        if (LocationInRanges((_int64)list[i], rangeBegins, rangeEnds, nRanges)) {
+            nKept++;
+            list[nKept] = list[i];
+        }
+    }
+
+    list[0] = (LOCATION)nKept;
+    return nKept;
+}
+
+    bool
+GenomeIndex::loadGenomeSliceForContigs(const char *genomeFileName, unsigned chromosomePadding, const char *contigNames)
+/*++
+
+Routine Description:
+
+    Load only the part of the genome that spans a set of contigs, and drop every seed hit outside of those contigs from
+    the (already loaded) hash and overflow tables.  The genome still knows about all of the contigs (so the SAM header
+    is the same as usual), but only has the bases from the first chosen one to the end of the last one, plus the
+    padding before the first.  A direct hit that's dropped becomes the unused value, and overflow lists shrink in
+    place, turning into a direct hit or unused if there are fewer than two left, so that lookups never see a list
+    that's too short.  Then what's left is copied into new hash and overflow tables sized for it, and the whole
+    index's tables are freed, so it briefly takes the whole index's memory and then only the slice's.
+
+Arguments:
+
+    genomeFileName      - the genome file in the index directory
+    chromosomePadding   - the index's padding between contigs
+    contigNames         - a comma separated list of contig names
+
+--*/
+{
+    //
+    // Get the contig layout by loading a one base slice, since loadFromFile reads all of the contigs whatever the slice is.
+    //
+    const Genome *layout = Genome::loadFromFile(genomeFileName, chromosomePadding, 0, 1);
+    if (NULL == layout) {
+        WriteErrorMessage("GenomeIndex::loadFromDirectory: Failed to load the genome itself\n");
+        return false;
+    }
+
+    int maxRanges = layout->getNumContigs();
+    _int64 *rangeBegins = new _int64[maxRanges];
+    _int64 *rangeEnds = new _int64[maxRanges];
+    int nRanges = 0;
+
+    char *namesCopy = new char[strlen(contigNames) + 1];
+    strcpy(namesCopy, contigNames);
+
+    for (char *name = namesCopy; NULL != name; ) {
+        char *comma = strchr(name, ',');
+        if (NULL != comma) {
+            *comma = '\0';
+        }
+
+        GenomeLocation contigStart;
+        if ('\0' != *name && !layout->getLocationOfContig(name, &contigStart)) {
+            WriteErrorMessage("The index doesn't have a contig named '%s'\n", name);
+            delete[] namesCopy;
+            delete[] rangeBegins;
+            delete[] rangeEnds;
+            delete layout;
+            return false;
+        }
+
+        if ('\0' != *name) {
+            const Genome::Contig *contig = layout->getContigAtLocation(contigStart);
+            _int64 begin = GenomeLocationAsInt64(contig->beginningLocation);
+            _int64 end = begin + contig->length;
+
+            //
+            // Keep the ranges sorted, and don't add a contig twice.
+            //
+            int insertAt = 0;
+            while (insertAt < nRanges && rangeBegins[insertAt] < begin) {
+                insertAt++;
+            }
+
+            if (insertAt == nRanges || rangeBegins[insertAt] != begin) {
+                for (int i = nRanges; i > insertAt; i--) {
+                    rangeBegins[i] = rangeBegins[i - 1];
+                    rangeEnds[i] = rangeEnds[i - 1];
+                }
+                rangeBegins[insertAt] = begin;
+                rangeEnds[insertAt] = end;
+                nRanges++;
+            }
+        }
+
+        name = (NULL == comma) ? NULL : comma + 1;
+    }
+
+    _int64 countOfBases = layout->getCountOfBases();
+    delete[] namesCopy;
+    delete layout;
+    layout = NULL;
+
+    if (0 == nRanges) {
+        WriteErrorMessage("No contigs given to restrict the index to\n");
+        delete[] rangeBegins;
+        delete[] rangeEnds;
+        return false;
+    }
+
+    _int64 sliceStart = __max((_int64)0, rangeBegins[0] - (_int64)chromosomePadding);
+    if (NULL == (genome = Genome::loadFromFile(genomeFileName, chromosomePadding, sliceStart, rangeEnds[nRanges - 1] - sliceStart))) {
+        WriteErrorMessage("GenomeIndex::loadFromDirectory: Failed to load the genome itself\n");
+        delete[] rangeBegins;
+        delete[] rangeEnds;
+        return false;
+    }
+
+    _uint64 unused = (_uint64)(GenomeLocationAsInt64(InvalidGenomeLocation) - 1);
+    for (unsigned whichHashTable = 0; whichHashTable < nHashTables; whichHashTable++) {
+        SNAPHashTable *hashTable = hashTables[whichHashTable];
+        for (_uint64 slot = 0; slot < hashTable->GetTableSize(); slot++) {
+            SNAPHashTable::KeyType key;
+            SNAPHashTable::ValueType values[NUM_DIRECTIONS];
+            if (!hashTable->GetSlotContents(slot, &key, values)) {
+                continue;
+            }
+
+            for (unsigned whichValue = 0; whichValue < hashTable->GetValueCount(); whichValue++) {
+                if (values[whichValue] == unused) {
+                    continue;
+                }
+
+                if (values[whichValue] < (_uint64)countOfBases) {
+                    if (!LocationInRanges((_int64)values[whichValue], rangeBegins, rangeEnds, nRanges)) {
+                        hashTable->SetSlotValue(slot, whichValue, unused);
+                    }
+                    continue;
+                }
+
+                _int64 overflowTableOffset = (_int64)values[whichValue] - countOfBases;
+                _int64 nKept;
+                _uint64 firstHit;
+                if (locationSize > 4) {
+                    nKept = KeepHitsInRanges(overflowTable64 + overflowTableOffset, rangeBegins, rangeEnds, nRanges);
+                    firstHit = (_uint64)overflowTable64[overflowTableOffset + 1];
+                } else {
+                    nKept = KeepHitsInRanges(overflowTable32 + overflowTableOffset, rangeBegins, rangeEnds, nRanges);
+                    firstHit = overflowTable32[overflowTableOffset + 1];
+                }
+
+                if (0 == nKept) {
+                    hashTable->SetSlotValue(slot, whichValue, unused);
+                } else if (1 == nKept) {
+                    hashTable->SetSlotValue(slot, whichValue, firstHit);
+                }
+            } // for each value
+        } // for each slot
+    } // for each hash table
+
+    delete[] rangeBegins;
+    delete[] rangeEnds;
+
+    compactTablesAfterDroppingHits(countOfBases);
+
+    restrictedToContigs = true;
+    return true;
+}
+
+    void
+GenomeIndex::compactTablesAfterDroppingHits(_int64 countOfBases)
+/*++
+
+Routine Description:
+
+    Copy the entries that still have a hit into new hash tables with the usual slack for them, and the overflow lists
+    they use into a new overflow table, and free the old tables.  This is for after loadGenomeSliceForContigs has
+    dropped most of the hits, so that the tables only take memory for what's left.
+
+--*/
+{
+    _uint64 unused = (_uint64)(GenomeLocationAsInt64(InvalidGenomeLocation) - 1);
+    size_t overflowEntrySize = (locationSize > 4) ? sizeof(*overflowTable64) : sizeof(*overflowTable32);
+
+    //
+    // First count the entries and overflow table space that are left.
+    //
+    _int64 *nEntriesLeft = new _int64[nHashTables];
+    _int64 newOverflowTableSize = 0;
+    for (unsigned whichHashTable = 0; whichHashTable < nHashTables; whichHashTable++) {
+        SNAPHashTable *hashTable = hashTables[whichHashTable];
+        nEntriesLeft[whichHashTable] = 0;
+        for (_uint64 slot = 0; slot < hashTable->GetTableSize(); slot++) {
+            SNAPHashTable::KeyType key;
+            SNAPHashTable::ValueType values[NUM_DIRECTIONS];
+            if (!hashTable->GetSlotContents(slot, &key, values)) {
+                continue;
+            }
+
+            bool anyLeft = false;
+            for (unsigned whichValue = 0; whichValue < hashTable->GetValueCount(); whichValue++) {
+                if (values[whichValue] == unused) {
+                    continue;
+                }
+                anyLeft = true;
+                if (values[whichValue] >= (_uint64)countOfBases) {
+                    _int64 overflowTableOffset = (_int64)values[whichValue] - countOfBases;
+                    newOverflowTableSize += 1 + ((locationSize > 4) ? overflowTable64[overflowTableOffset] : (_int64)overflowTable32[overflowTableOffset]);
+                }
+            }
+            nEntriesLeft[whichHashTable] += anyLeft;
+        }
+    }
+
+    size_t newOverflowTableSizeInBytes = (size_t)newOverflowTableSize * overflowEntrySize;
+    char *newOverflowTable = (char *)BigAlloc(__max(newOverflowTableSizeInBytes, (size_t)1));
+    const char *oldOverflowTable = (locationSize > 4) ? (const char *)overflowTable64 : (const char *)overflowTable32;
+    _int64 newOverflowTableOffset = 0;
+    size_t newTablesSize = 0;
+
+    for (unsigned whichHashTable = 0; whichHashTable < nHashTables; whichHashTable++) {
+        SNAPHashTable *hashTable = hashTables[whichHashTable];
+        _int64 newTableSize = __max((_int64)100, (_int64)(nEntriesLeft[whichHashTable] * (1.0 + DEFAULT_SLACK)) + 1);
+        SNAPHashTable *newTable = new SNAPHashTable(newTableSize, hashTable->GetKeySizeInBytes(), hashTable->GetValueSizeInBytes(),
+                                                    hashTable->GetValueCount(), GenomeLocationAsInt64(InvalidGenomeLocation), true);
+
+        for (_uint64 slot = 0; slot < hashTable->GetTableSize(); slot++) {
+            SNAPHashTable::KeyType key;
+            SNAPHashTable::ValueType values[NUM_DIRECTIONS];
+            if (!hashTable->GetSlotContents(slot, &key, values)) {
+                continue;
+            }
+
+            bool anyLeft = false;
+            for (unsigned whichValue = 0; whichValue < hashTable->GetValueCount(); whichValue++) {
+                if (values[whichValue] == unused) {
+                    continue;
+                }
+                anyLeft = true;
+                if (values[whichValue] >= (_uint64)countOfBases) {
+                    _int64 overflowTableOffset = (_int64)values[whichValue] - countOfBases;
+                    _int64 listSize = 1 + ((locationSize > 4) ? overflowTable64[overflowTableOffset] : (_int64)overflowTable32[overflowTableOffset]);
+                    memcpy(newOverflowTable + newOverflowTableOffset * overflowEntrySize, oldOverflowTable + overflowTableOffset * overflowEntrySize,
+                           listSize * overflowEntrySize);
+                    values[whichValue] = countOfBases + newOverflowTableOffset;
+                    newOverflowTableOffset += listSize;
+                }
+            }
+
+            if (anyLeft && !newTable->Insert(key, values)) {
+                WriteErrorMessage("GenomeIndex: unable to insert into the hash table for the chosen contigs\n");
+                soft_exit(1);
+            }
+        } // for each slot
+
+        delete hashTable;
+        hashTables[whichHashTable] = newTable;
+        newTablesSize += newTable->GetTableSizeInBytes();
+    } // for each hash table
+
+    _ASSERT(newOverflowTableOffset == newOverflowTableSize);
+    delete[] nEntriesLeft;
+
+    BigDealloc(tablesBlob); // The old hash tables pointed into it
+    tablesBlob = NULL;
+    tablesBlobSize = newTablesSize;
+
+    if (locationSize > 4) {
+        BigDealloc(overflowTable64);
+        overflowTable64 = (_int64 *)newOverflowTable;
+    } else {
+        BigDealloc(overflowTable32);
+        overflowTable32 = (unsigned *)newOverflowTable;
+    }
+    overflowTableSize = newOverflowTableSize;
+    overflowTableSizeInBytes = newOverflowTableSizeInBytes;
+}
+
+    _int64
+GenomeIndex::getSizeOnDisk(const char *directoryName)
+{
+    const char *fileNames[] = {GenomeIndexHashFileName, OverflowTableFileName, GenomeFileName, SeedSketchFileName, SpliceJunctionsFileName};
+    size_t filenameBufferSize = strlen(directoryName) + 1 + __max(strlen(GenomeIndexHashFileName), __max(strlen(OverflowTableFileName), strlen(GenomeFileName))) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
+    _int64 size = 0;
+    for (size_t i = 0; i < sizeof(fileNames) / sizeof(*fileNames); i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, fileNames[i]);
+        FILE *file = fopen(filenameBuffer, "rb");   // QueryFileSize doesn't expect files that aren't there
+        if (NULL != file) {
+            fclose(file);
+            size += LoadedFileSize(filenameBuffer);
+        }
+    }
+    delete[] filenameBuffer;
+
+    if (HasLongSeedIndex(directoryName)) {
+        char *longSeedDirectoryName = LongSeedIndexDirectoryFor(directoryName);
+        size += getSizeOnDisk(longSeedDirectoryName);
+        delete[] longSeedDirectoryName;
+    }
+
+    return size;
+}
+
+    _int64
+GenomeIndex::getMemoryFootprint() const
+{
+    return (_int64)tablesBlobSize + (_int64)overflowTableSizeInBytes + (NULL == genome ? 0 : genome->getMemoryFootprint()) +
+        (NULL == seedSketch ? 0 : seedSketch->getSizeInBytes()) +
+        (NULL == longSeedIndex ? 0 : longSeedIndex->getMemoryFootprint() - genome->getMemoryFootprint());   // The genome is shared
+}
+
+    GenomeIndex **
+GenomeIndex::loadReplicasForNumaNodes(char *directoryName, bool prefetch, unsigned *nReplicas)
+{
+    unsigned nNodes = GetNumberOfNumaNodes();
+    if (nNodes < 2) {
+        return NULL;
+    }
+
+    _int64 indexSize = getSizeOnDisk(directoryName);
+
+    //
+    // Leave a tenth of memory for everything else.
+    //
+    _int64 physicalMemorySize = GetPhysicalMemorySize();
+    if (0 != physicalMemorySize && indexSize * nNodes > physicalMemorySize / 10 * 9) {
+        WriteStatusMessage("Not enough memory for a copy of the index on each of the %d NUMA nodes, using one interleaved copy instead.\n", nNodes);
+        return NULL;
+    }
+
+    NumaReplicaLoadContext *contexts = new NumaReplicaLoadContext[nNodes];
+    unsigned nProcessors = GetNumberOfProcessors();
+    for (unsigned node = 0; node < nNodes; node++) {
+        unsigned processor;
+        for (processor = 0; processor < nProcessors && GetNumaNodeOfProcessor(processor) != node; processor++) {
+            // This space intentionally left blank.
+        }
+
+        if (processor == nProcessors) {
+            WriteStatusMessage("NUMA node %d has no processors, using one interleaved copy of the index instead of one per node.\n", node);
+            delete[] contexts;
+            return NULL;
+        }
+        contexts[node].processor = processor;
+    }
+
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    volatile int runningThreadCount = nNodes;
+
+    for (unsigned node = 0; node < nNodes; node++) {
+        contexts[node].directoryName = directoryName;
+        contexts[node].prefetch = prefetch;
+        contexts[node].index = NULL;
+        contexts[node].doneObject = &doneObject;
+        contexts[node].runningThreadCount = &runningThreadCount;
+        if (!StartNewThread(NumaReplicaLoadThreadMain, &contexts[node])) {
+            WriteErrorMessage("Unable to start index load thread\n");
+            soft_exit(1);
+        }
+    }
+
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+
+    GenomeIndex **replicas = new GenomeIndex *[nNodes];
+    bool allLoaded = true;
+    for (unsigned node = 0; node < nNodes; node++) {
+        replicas[node] = contexts[node].index;
+        allLoaded = allLoaded && NULL != replicas[node];
+    }
+    delete[] contexts;
+
+    if (!allLoaded) {
+        for (unsigned node = 0; node < nNodes; node++) {
+            delete replicas[node];
+        }
+        delete[] replicas;
+        return NULL;
+    }
+
+    *nReplicas = nNodes;
+    return replicas;
+}
+
+    void
+GenomeIndex::NumaReplicaLoadThreadMain(void *param)
+{
+    NumaReplicaLoadContext *context = (NumaReplicaLoadContext *)param;
+
+    //
+    // Memory is allocated on the node where it's first touched, so loading it from a processor on the node puts it there.
+    //
+    BindThreadToProcessor(context->processor);
+    context->index = loadFromDirectory(context->directoryName, false, context->prefetch);
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
+
+    char *
+GenomeIndex::getSharedMemoryCopy(const char *directoryName)
+{
+    const char *sharedMemoryDirectory = GetSharedMemoryDirectory();
+    if (NULL == sharedMemoryDirectory) {
+        WriteErrorMessage("There's no shared memory file system on this system, so the index can't be shared.\n");
+        return NULL;
+    }
+
+    //
+    // Name the copy after a hash of the index directory's absolute path, so that it's the same however the index is named
+    // on the command line, and different indices get different copies.  This is the 64 bit FNV-1a hash.
+    //
+    char canonicalDirectoryName[MAX_PATH];
+    if (!GetCanonicalPathName(directoryName, canonicalDirectoryName, sizeof(canonicalDirectoryName))) {
+        WriteErrorMessage("Unable to find the absolute path of index directory '%s'\n", directoryName);
+        return NULL;
+    }
+
+    _uint64 nameHash = 0xcbf29ce484222325;
+    for (const char *p = canonicalDirectoryName; *p != '\0'; p++) {
+        nameHash = (nameHash ^ (unsigned char)*p) * 0x100000001b3;
+    }
+
+    size_t sharedDirectoryNameBufferSize = strlen(sharedMemoryDirectory) + 50;
+    char *sharedDirectoryName = new char[sharedDirectoryNameBufferSize];
+    snprintf(sharedDirectoryName, sharedDirectoryNameBufferSize, "%s%csnap-index-%016llx", sharedMemoryDirectory, PATH_SEP, nameHash);
+
+    //
+    // Hold a lock on a file next to the copy while checking it and replacing it, so that one process can't delete a copy
+    // that another has just renamed into place.  Anyone else who wants the index waits for the copy rather than making
+    // their own.
+    //
+    size_t lockFileNameBufferSize = sharedDirectoryNameBufferSize + 10;
+    char *lockFileName = new char[lockFileNameBufferSize];
+    snprintf(lockFileName, lockFileNameBufferSize, "%s.lock", sharedDirectoryName);
+    InterprocessFileLock *lock = AcquireInterprocessFileLock(lockFileName);
+    delete[] lockFileName;
+    if (NULL == lock) {
+        delete[] sharedDirectoryName;
+        return NULL;
+    }
+
+    if (SharedMemoryCopyIsCurrent(directoryName, sharedDirectoryName)) {
+        ReleaseInterprocessFileLock(lock);
+        return sharedDirectoryName;
+    }
+
+    //
+    // Either there's no copy or it's of an older version of the index.  Deleting an old copy doesn't bother processes that
+    // already have it mapped; it just goes away once they've all exited.
+    //
+    DeleteIndexDirectory(sharedDirectoryName);
+
+    WriteStatusMessage("(copying index to %s) ", sharedDirectoryName);
+
+    //
+    // Copy into a private staging directory and then rename it into place, so that a copy left by a process that died
+    // part way through never looks like a whole one.
+    //
+    size_t stagingDirectoryNameBufferSize = sharedDirectoryNameBufferSize + 30;
+    char *stagingDirectoryName = new char[stagingDirectoryNameBufferSize];
+    snprintf(stagingDirectoryName, stagingDirectoryNameBufferSize, "%s.%lld", sharedDirectoryName, timeInNanos());
+    if (mkdir(stagingDirectoryName, 0777) != 0) {
+        WriteErrorMessage("Unable to create shared memory directory '%s'\n", stagingDirectoryName);
+        ReleaseInterprocessFileLock(lock);
+        delete[] stagingDirectoryName;
+        delete[] sharedDirectoryName;
+        return NULL;
+    }
+
+    size_t filenameBufferSize = strlen(directoryName) + stagingDirectoryNameBufferSize + 1 + strlen(GenomeIndexHashFileName) + 1;
+    char *fromFileName = new char[filenameBufferSize];
+    char *toFileName = new char[filenameBufferSize];
+    bool worked = true;
+    for (int i = 0; worked && i < nIndexFileNames; i++) {
+        snprintf(fromFileName, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, IndexFileNames[i]);
+        snprintf(toFileName, filenameBufferSize, "%s%c%s", stagingDirectoryName, PATH_SEP, IndexFileNames[i]);
+        worked = CopyFileContents(fromFileName, toFileName);
+    }
+
+    for (int i = 0; worked && i < nOptionalIndexFileNames; i++) {
+        snprintf(fromFileName, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, OptionalIndexFileNames[i]);
+        FILE *optionalFile = fopen(fromFileName, "rb");
+        if (NULL != optionalFile) {
+            fclose(optionalFile);
+            snprintf(toFileName, filenameBufferSize, "%s%c%s", stagingDirectoryName, PATH_SEP, OptionalIndexFileNames[i]);
+            worked = CopyFileContents(fromFileName, toFileName);
+        }
+    }
+    delete[] fromFileName;
+    delete[] toFileName;
+
+    if (!worked) {
+        WriteErrorMessage("Unable to copy the index into shared memory.  Perhaps %s is too small; it's usually limited to half of memory.\n", sharedMemoryDirectory);
+        DeleteIndexDirectory(stagingDirectoryName);
+    } else if (!MoveSingleFile(stagingDirectoryName, sharedDirectoryName)) {
+        WriteErrorMessage("Unable to rename shared memory directory '%s' to '%s'\n", stagingDirectoryName, sharedDirectoryName);
+        worked = false;
+        DeleteIndexDirectory(stagingDirectoryName);
+    }
+
+    ReleaseInterprocessFileLock(lock);
+    delete[] stagingDirectoryName;
+    if (!worked) {
+        delete[] sharedDirectoryName;
+        return NULL;
+    }
+    return sharedDirectoryName;
+}
+
+    bool
+GenomeIndex::SharedMemoryCopyIsCurrent(const char *directoryName, const char *sharedDirectoryName)
+{
+    //
+    // The copy is current if all of its files are the same size as the index's and its GenomeIndex file (which has the
+    // sizes of the tables in it) is identical.
+    //
+    size_t filenameBufferSize = __max(strlen(directoryName), strlen(sharedDirectoryName)) + 1 + strlen(GenomeIndexHashFileName) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
+    char *sharedFilenameBuffer = new char[filenameBufferSize];
+    bool current = true;
+    for (int i = 0; current && i < nIndexFileNames; i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, IndexFileNames[i]);
+        snprintf(sharedFilenameBuffer, filenameBufferSize, "%s%c%s", sharedDirectoryName, PATH_SEP, IndexFileNames[i]);
+
+        FILE *file = fopen(filenameBuffer, "rb");
+        FILE *sharedFile = fopen(sharedFilenameBuffer, "rb");
+        current = NULL != file && NULL != sharedFile && QueryFileSize(filenameBuffer) == QueryFileSize(sharedFilenameBuffer);
+
+        if (current && IndexFileNames[i] == GenomeIndexFileName) {
+            int c;
+            do {
+                c = getc(file);
+                current = c == getc(sharedFile);
+            } while (current && EOF != c);
+        }
+
+        if (NULL != file) {
+            fclose(file);
+        }
+        if (NULL != sharedFile) {
+            fclose(sharedFile);
+        }
+    }
+
+    //
+    // The seed sketch and splice junctions are optional, but the copy needs them if (and only if) the index has them.
+    //
+    for (int i = 0; current && i < nOptionalIndexFileNames; i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, OptionalIndexFileNames[i]);
+        snprintf(sharedFilenameBuffer, filenameBufferSize, "%s%c%s", sharedDirectoryName, PATH_SEP, OptionalIndexFileNames[i]);
+        FILE *file = fopen(filenameBuffer, "rb");
+        FILE *sharedFile = fopen(sharedFilenameBuffer, "rb");
+        current = (NULL == file) == (NULL == sharedFile) && (NULL == file || QueryFileSize(filenameBuffer) == QueryFileSize(sharedFilenameBuffer));
+        if (NULL != file) {
+            fclose(file);
+        }
+        if (NULL != sharedFile) {
+            fclose(sharedFile);
+        }
+    }
+
+    delete[] filenameBuffer;
+    delete[] sharedFilenameBuffer;
+    return current;
+}
+
+    bool
+GenomeIndex::CopyFileContents(const char *fromFileName, const char *toFileName)
+{
+    FILE *fromFile = fopen(fromFileName, "rb");
+    if (NULL == fromFile) {
+        WriteErrorMessage("Unable to open file '%s' for read\n", fromFileName);
+        return false;
+    }
+
+    FILE *toFile = fopen(toFileName, "wb");
+    if (NULL == toFile) {
+        WriteErrorMessage("Unable to open file '%s' for write\n", toFileName);
+        fclose(fromFile);
+        return false;
+    }
+
+    const size_t bufferSize = 16 * 1024 * 1024;
+    char *buffer = (char *)BigAlloc(bufferSize);
+    bool worked = true;
+    size_t amountRead;
+    while (worked && 0 != (amountRead = fread(buffer, 1, bufferSize, fromFile))) {
+        worked = fwrite(buffer, 1, amountRead, toFile) == amountRead;
+    }
+    worked = worked && !ferror(fromFile);
+
+    BigDealloc(buffer);
+    fclose(fromFile);
+    worked = (0 == fclose(toFile)) && worked;
+    return worked;
+}
+
+    bool
+GenomeIndex::MoveStagedIndexFiles(const char *stagingDirectory, const char *directoryName, const char **fileNames, int nFileNames,
+                                  const char *callerName)
+{
+    _ASSERT(nFileNames > 0 && fileNames[nFileNames - 1] == GenomeIndexFileName);
+
+    size_t filenameBufferSize = __max(strlen(stagingDirectory), strlen(directoryName)) + 1 + strlen(GenomeIndexHashFileName) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
+    char *destinationFilenameBuffer = new char[filenameBufferSize];
+
+    snprintf(destinationFilenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeIndexFileName);
+    bool worked = DeleteSingleFile(destinationFilenameBuffer);
+    if (!worked) {
+        WriteErrorMessage("%s: unable to delete '%s'\n", callerName, destinationFilenameBuffer);
+    }
+
+    for (int i = 0; worked && i < nFileNames; i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", stagingDirectory, PATH_SEP, fileNames[i]);
+        snprintf(destinationFilenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, fileNames[i]);
+        if ((i < nFileNames - 1 && !DeleteSingleFile(destinationFilenameBuffer)) || !MoveSingleFile(filenameBuffer, destinationFilenameBuffer)) {
+            WriteErrorMessage("%s: unable to move '%s' to '%s'\n", callerName, filenameBuffer, destinationFilenameBuffer);
+            worked = false;
+        }
+    }
+
+    if (!worked) {
+        WriteErrorMessage("The index in '%s' is incomplete.  Move the files left in '%s' into it to finish, or rebuild it.\n", directoryName, stagingDirectory);
+    }
+
+    delete[] filenameBuffer;
+    delete[] destinationFilenameBuffer;
+    return worked;
+}
+
+    void
+GenomeIndex::DeleteIndexDirectory(const char *directoryName)
+{
+    char *longSeedDirectoryName = LongSeedIndexDirectoryFor(directoryName);
+    if (HasLongSeedIndex(directoryName)) {
+        DeleteIndexDirectory(longSeedDirectoryName);
+    }
+    delete[] longSeedDirectoryName;
+
+    size_t filenameBufferSize = strlen(directoryName) + 1 + strlen(GenomeIndexHashFileName) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
+    for (int i = nIndexFileNames - 1; i >= 0; i--) {    // GenomeIndex first, so a partly deleted copy doesn't look complete
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, IndexFileNames[i]);
+        DeleteSingleFile(filenameBuffer);
+    }
+    for (int i = 0; i < nOptionalIndexFileNames; i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, OptionalIndexFileNames[i]);
+        DeleteSingleFile(filenameBuffer);
+    }
+    delete[] filenameBuffer;
+    rmdir(directoryName);
+}
+
+    void
+GenomeIndex::lookupSeed32(
+    Seed              seed,
+    _int64           *nHits,
+    const unsigned  **hits,
+    _int64           *nRCHits,
+    const unsigned  **rcHits)
+{
+    _ASSERT(locationSize == 4);   // This is the caller's responsibility to check.
+
+    seed = seed.masked(seedMask);
+
+    if (largeHashTable) {
+        bool lookedUpComplement;
+
+        lookedUpComplement = seed.isBiggerThanItsReverseComplement();
+        if (lookedUpComplement) {
+            seed = ~seed;
+        }
+
+        _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
+        _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() == 4);
+        const unsigned *entry = (const unsigned *)findEntry(seed);   // Cast OK because valueSize == 4
+        if (NULL == entry) {
+            *nHits = 0;
+            *nRCHits = 0;
+            return;
+        }
+
+        //
+        // Fill in the caller's answers for the main and complement of the seed looked up.
+        // Because of our hash table design, we may have had to take the complement before the
+        // lookup, in which case we reverse the results so the caller gets the right thing.
+        // Also, if the seed is its own reverse complement, we need to fill the same hits
+        // in both return arrays.
+        //
+        fillInLookedUpResults32((lookedUpComplement ? entry + 1 : entry), nHits, hits);
+        if (seed.isOwnReverseComplement()) {
+          *nRCHits = *nHits;
+          *rcHits = *hits;
+        } else {
+          fillInLookedUpResults32((lookedUpComplement ? entry : entry + 1), nRCHits, rcHits);
+        }
+    } else {
+	    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+		    _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
+		    _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() == 4);
+		    unsigned *entry = (unsigned int *)findEntry(seed);   // Cast OK because valueSize == 4
+		    if (NULL == entry) {
+			    if (FORWARD == dir) {
+				    *nHits = 0;
+			    } else {
+				    *nRCHits = 0;
+			    }
+		    } else if (FORWARD == dir) {
+			    fillInLookedUpResults32(entry,  nHits, hits);
+		    } else {
+			    fillInLookedUpResults32(entry,  nRCHits, rcHits);
+		    }
+		    seed = ~seed;
+        }	// For each direction    
+    }
+}
+
+    void *
+GenomeIndex::findEntry(Seed seed) const
+{
+    unsigned whichTable = (unsigned)seed.getHighBases(hashTableKeySize);
+    _uint64 key = seed.getLowBases(hashTableKeySize);
+    if (NULL != seedSketch && !seedSketch->mightContain(whichTable, key)) {
         return NULL;
     }
 
-    char indexFileBuf[1000];
-    size_t indexFileSize = indexFile->read(indexFileBuf, sizeof(indexFileBuf) - 1);
-    indexFileBuf[indexFileSize] = 0;
+    return hashTables[whichTable]->GetFirstValueForKey(key);
+}
+
+    void
+GenomeIndex::fillInLookedUpResults32(
+    const unsigned  *subEntry,
+    _int64          *nHits, 
+    const unsigned **hits)
+{
+    //
+    // WARNING: the code in the IntersectingPairedEndAligner relies on being able to look at 
+    // hits[-1].  It doesn't care about the value, but it must not be a bogus pointer.  This
+    // is true with the current layout (where it will either be the hit count, the key or
+    // forward pointer in the hash table entry or some intermediate hit in the case where the
+    // search is constrained by minLocation/maxLocation).  If you change this, be sure to look
+    // at the code and fix it.
+    //
+    if (*subEntry < genome->getCountOfBases()) {
+        //
+        // It's a singleton.
+        //
+        *nHits = 1;
+        *hits = subEntry;
+    } else if (*subEntry == 0xfffffffe) {
+        //
+        // It's unused, the other complement must exist (unless the seed's hits were all dropped by restrictToContigs).
+        //
+        _ASSERT(largeHashTable || restrictedToContigs);
+        *nHits = 0;
+    } else {
+        //
+        // Multiple hits.  Recall that the overflow table format is first a count of
+        // the number of hits for that seed, followed by the list of hits.
+        //
+        unsigned overflowTableOffset = *subEntry - (unsigned)genome->getCountOfBases();
+
+        _ASSERT(overflowTableOffset < overflowTableSize);
+
+        int hitCount = overflowTable32[overflowTableOffset];
+
+        _ASSERT(hitCount >= 2);
+        _ASSERT(hitCount + overflowTableOffset < overflowTableSize);
+
+        *nHits = hitCount;
+        *hits = &overflowTable32[overflowTableOffset + 1];
+    }
+}
+
+    void 
+GenomeIndex::lookupSeed(
+    Seed                    seed, 
+    _int64 *                nHits, 
+    const GenomeLocation ** hits, 
+    _int64 *                nRCHits, 
+    const GenomeLocation ** rcHits, 
+    GenomeLocation *        singleHit, 
+    GenomeLocation *        singleRCHit,
+    OverflowDecodeBuffer *  decodeBuffer)
+{
+    _ASSERT(locationSize > 4 && locationSize <= 8);
+
+    seed = seed.masked(seedMask);
+
+    if (largeHashTable) {
+        bool lookedUpComplement;
+
+        lookedUpComplement = seed.isBiggerThanItsReverseComplement();
+        if (lookedUpComplement) {
+            seed = ~seed;
+        }
+
+        _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
+        _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() > 4);
+
+        const char *entry = (char *)findEntry(seed);
+        if (NULL == entry) {
+            *nHits = 0;
+            *nRCHits = 0;
+            return;
+        }
+
+        GenomeLocation entryByValue[NUM_DIRECTIONS];
+        entryByValue[0] = 0;
+        entryByValue[1] = 0;
+
+        memcpy(&entryByValue[0], entry, locationSize);  // Works because we're litte-endian
+        memcpy(&entryByValue[1], entry + locationSize, locationSize);   // Again, required litte-endianness.
+
+        //
+        // Fill in the caller's answers for the main and complement of the seed looked up.
+        // Because of our hash table design, we may have had to take the complement before the
+        // lookup, in which case we reverse the results so the caller gets the right thing.
+        // Also, if the seed is its own reverse complement, we need to fill the same hits
+        // in both return arrays.
+        //
+        fillInLookedUpResults(entryByValue[lookedUpComplement ? 1 : 0], nHits, hits, singleHit, decodeBuffer);
+   
+        if (seed.isOwnReverseComplement()) {
+          *nRCHits = *nHits;
+          *rcHits = *hits;
+        } else {
+          fillInLookedUpResults(entryByValue[lookedUpComplement ? 0 : 1], nRCHits, rcHits, singleRCHit, decodeBuffer);
+        }
+    } else {
+	    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+		    _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
+		    _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() > 4);
+		    const char *entry = (char *)findEntry(seed);   
+
+            if (NULL == entry) {
+			    if (FORWARD == dir) {
+				    *nHits = 0;
+			    } else {
+				    *nRCHits = 0;
+			    }
+		    } else {
+                GenomeLocation entryByValue = 0;
+                memcpy(&entryByValue, entry, locationSize);  // Assumes little endian
+
+                if (FORWARD == dir) {
+			        fillInLookedUpResults(entryByValue,  nHits, hits, singleHit, decodeBuffer);
+		        } else {
+			        fillInLookedUpResults(entryByValue,  nRCHits, rcHits, singleRCHit, decodeBuffer);
+                }
+		    }
+		    seed = ~seed;
+        }	// For each direction    
+    }
+}
+
+
+    void 
+GenomeIndex::fillInLookedUpResults(GenomeLocation lookedUpLocation, _int64 *nHits, const GenomeLocation **hits, GenomeLocation *singleHitLocation,
+                                   OverflowDecodeBuffer *decodeBuffer)
+{
+     //
+    // WARNING: the code in the IntersectingPairedEndAligner relies on being able to look at 
+    // hits[-1].  It doesn't care about the value, but it must not be a bogus pointer.  This
+    // is true with the current layout (where it will either be the hit count, the key or
+    // forward pointer in the hash table entry or some intermediate hit in the case where the
+    // search is constrained by minLocation/maxLocation).  If you change this, be sure to look
+    // at the code and fix it.  You don't need to worry about this in the case of singleHitLocation,
+    // that's the caller's problem.
+    //
+    if (lookedUpLocation < genome->getCountOfBases()) {
+        //
+        // It's a singleton.
+        //
+        *nHits = 1;
+        *hits = singleHitLocation;
+        *singleHitLocation = lookedUpLocation;
+     } else if (lookedUpLocation == InvalidGenomeLocation - 1) {
+        //
+        // It's unused, the other complement must exist (unless the seed's hits were all dropped by restrictToContigs).
+        //
+        _ASSERT(largeHashTable || restrictedToContigs);
+        *nHits = 0;
+    } else {
+        //
+        // Multiple hits.  Recall that the overflow table format is first a count of
+        // the number of hits for that seed, followed by the list of hits.
+        //
+        _int64 overflowTableOffset = GenomeLocationAsInt64(lookedUpLocation) - genome->getCountOfBases();
+
+        _ASSERT(overflowTableOffset < (_int64)overflowTableSize);
+
+        if (NULL != compressedOverflowTable) {
+            decodeHitList(overflowTableOffset, nHits, hits, decodeBuffer);
+            return;
+        }
+
+        _int64 hitCount = overflowTable64[overflowTableOffset];
+
+        _ASSERT(hitCount >= 2);
+        _ASSERT(hitCount + overflowTableOffset < (_int64)overflowTableSize);
+
+        *nHits = hitCount;
+        *hits = (const GenomeLocation *)&overflowTable64[overflowTableOffset + 1];
+    }
+}
+
+    void
+GenomeIndex::decodeHitList(_int64 compressedOverflowTableOffset, _int64 *nHits, const GenomeLocation **hits, OverflowDecodeBuffer *decodeBuffer)
+{
+    if (NULL == decodeBuffer) {
+        WriteErrorMessage("GenomeIndex: lookup in an index with a compressed overflow table without a decode buffer\n");
+        soft_exit(1);
+    }
+
+    const unsigned char *list = compressedOverflowTable + compressedOverflowTableOffset;
+
+    _uint64 header = 0;
+    for (unsigned shift = 0; ; shift += 7) {
+        header |= ((_uint64)(*list & 0x7f)) << shift;
+        if (0 == (*list++ & 0x80)) {
+            break;
+        }
+    }
+
+    _int64 hitCount = (_int64)(header >> 1);
+    bool stored = (header & 1) != 0;
+    _ASSERT(hitCount >= 2);
+
+    _int64 nToDecode = __min(hitCount, decodeBuffer->maxHitsToDecode);
+    if (decodeBuffer->used + nToDecode + 1 > decodeBuffer->bufferSize) {
+        WriteErrorMessage("GenomeIndex: overflowed the overflow table decode buffer (%lld + %lld > %lld)\n", decodeBuffer->used, nToDecode + 1, decodeBuffer->bufferSize);
+        soft_exit(1);
+    }
+
+    GenomeLocation *output = decodeBuffer->buffer + decodeBuffer->used;
+    decodeBuffer->used += nToDecode + 1;
+    output[0] = hitCount;   // Like the uncompressed overflow table, so hits[-1] is valid
+    output++;
+
+    *nHits = hitCount;
+    *hits = output;
+
+    if (0 == nToDecode) {
+        return;
+    }
+
+    if (stored) {
+        (*UnpackLocations)(list, locationSize, nToDecode, output);
+        return;
+    }
+
+    _int64 location = 0;
+    memcpy(&location, list, locationSize);  // Assumes little-endian
+    list += locationSize;
+    output[0] = location;
+
+    const unsigned char *control = list;
+    const unsigned char *data = list + (hitCount - 1 + 3) / 4;
+    for (_int64 i = 1; i < nToDecode; i++) {
+        unsigned deltaSize = ((control[(i - 1) / 4] >> (((i - 1) % 4) * 2)) & 3) + 1;
+        unsigned delta = 0;
+        memcpy(&delta, data, deltaSize);    // Also little-endian
+        data += deltaSize;
+        location -= delta;
+        output[i] = location;
+    }
+}
+
+    void
+GenomeIndex::UnpackLocationsScalar(const unsigned char *packed, unsigned locationSize, _int64 count, GenomeLocation *output)
+/*++
+
+Routine Description:
+
+    UnpackLocations a location at a time.  Each is a whole eight byte load masked down to locationSize bytes, which
+    is much cheaper than a memcpy of a length the compiler doesn't know, except for the last few, where eight bytes
+    would run past the end of the list.
+
+--*/
+{
+    _ASSERT(locationSize > 4 && locationSize <= 8);
+    _uint64 mask = 8 == locationSize ? ~(_uint64)0 : ((_uint64)1 << (8 * locationSize)) - 1;
+    _int64 i = 0;
+    for (; (count - i) * locationSize >= 8; i++) {
+        _uint64 location;
+        memcpy(&location, packed + i * locationSize, 8);    // Assumes little-endian
+        output[i] = (_int64)(location & mask);
+    }
+    for (; i < count; i++) {
+        _int64 location = 0;
+        memcpy(&location, packed + i * locationSize, locationSize);
+        output[i] = location;
+    }
+}
+
+    void SIMD_TARGET("ssse3")
+GenomeIndex::UnpackLocationsVector16(const unsigned char *packed, unsigned locationSize, _int64 count, GenomeLocation *output)
+/*++
+
+Routine Description:
+
+    UnpackLocations two locations at a time: a 16 byte load holds at least two of them, and one lookup (pshufb or tbl)
+    moves each to its own eight bytes, with zeroes (from lookup indices with the top bit set) above it.  The ones at
+    the end of the list, where a 16 byte load would run past it, are left to the scalar version.
+
+--*/
+{
+    _ASSERT(locationSize > 4 && locationSize <= 8);
+    _uint8 shuffle[16];
+    for (unsigned i = 0; i < 16; i++) {
+        unsigned byte = i % 8;
+        shuffle[i] = byte < locationSize ? (_uint8)((i / 8) * locationSize + byte) : 0x80;
+    }
+    const Vector16 shuffleVector = Vector16Load(shuffle);
+
+    _int64 i = 0;
+    for (; i + 2 <= count && (count - i) * locationSize >= 16; i += 2) {
+        Vector16Store(&output[i], Vector16Lookup(Vector16Load(packed + i * locationSize), shuffleVector));
+    }
+    UnpackLocationsScalar(packed + i * locationSize, locationSize, count - i, output + i);
+}
+
+GenomeIndex::UnpackLocationsFunction GenomeIndex::UnpackLocations = KernelChooser<GenomeIndex::UnpackLocationsFunction>("location unpacking")
+    .vector16Lookup(GenomeIndex::UnpackLocationsVector16).scalar(GenomeIndex::UnpackLocationsScalar);
+
+    size_t
+GenomeIndex::EncodeHitList(const _int64 *hits, _int64 nHits, unsigned locationSize, unsigned char *output)
+/*++
+
+Routine Description:
+
+    Write one hit list in the compressed overflow table format and return its size in bytes.  The format is:
+
+        a varint (seven bits per byte, low order first, high bit set on all but the last byte) of nHits * 2 + stored
+        the first (largest) hit, in locationSize bytes
+        then, if stored is 0, the differences between each hit and the one before it (the hits are in descending order)
+        in StreamVByte layout: two bits per difference of control giving its size less one, four to a byte, followed by
+        the differences themselves in that many bytes each,
+        or, if stored is 1 (because some difference doesn't fit in 32 bits), the rest of the hits in locationSize bytes each.
+
+    The result is never more than 9 bytes per entry of the uncompressed list, counting the count.
+
+Arguments:
+
+    hits            - the hit list, in descending order as in the overflow table
+    nHits           - the number of hits
+    locationSize    - the index's location size
+    output          - where to write the encoded list
+
+--*/
+{
+    bool stored = false;
+    for (_int64 i = 1; i < nHits; i++) {
+        _ASSERT(hits[i] < hits[i - 1]);
+        if (hits[i - 1] - hits[i] > 0xffffffff) {
+            stored = true;
+            break;
+        }
+    }
+
+    unsigned char *p = output;
+    _uint64 header = ((_uint64)nHits << 1) | (stored ? 1 : 0);
+    while (header >= 0x80) {
+        *p++ = (unsigned char)(header | 0x80);
+        header >>= 7;
+    }
+    *p++ = (unsigned char)header;
+
+    memcpy(p, &hits[0], locationSize);
+    p += locationSize;
 
-    unsigned seedLen;
-    unsigned majorVersion, minorVersion, chromosomePadding;
-    int nRead;
-    size_t hashTablesFileSize;
-    unsigned nHashTables;
-    _int64 overflowTableSize;
-    unsigned hashTableKeySize;
-    unsigned smallHashTable;
-    unsigned locationSize;
-    if (10 != (nRead = sscanf(indexFileBuf,"%d %d %d %lld %d %d %d %lld %d %d", &majorVersion, &minorVersion, &nHashTables, &overflowTableSize, &seedLen, &chromosomePadding, 
-											&hashTableKeySize, &hashTablesFileSize, &smallHashTable, &locationSize))) {
-        if (3 == nRead || 6 == nRead || 7 == nRead || 9 == nRead) {
-            WriteErrorMessage("Indices built by versions before 1.0dev.21 are no longer supported.  Please rebuild your index.\n");
-        } else {
-            WriteErrorMessage("GenomeIndex::LoadFromDirectory: didn't read initial values\n");
+    if (stored) {
+        for (_int64 i = 1; i < nHits; i++) {
+            memcpy(p, &hits[i], locationSize);
+            p += locationSize;
         }
-        indexFile->close();		
-        delete indexFile;
-        return NULL;
+        return p - output;
     }
-    indexFile->close();
-    delete indexFile;
 
-    if (majorVersion != GenomeIndexFormatMajorVersion) {
-        WriteErrorMessage("This genome index appears to be from a different version of SNAP than this, and so we can't read it.  Index version %d, SNAP index format version %d\n",
-            majorVersion, GenomeIndexFormatMajorVersion);
-        soft_exit(1);
+    unsigned char *control = p;
+    _int64 controlSize = (nHits - 1 + 3) / 4;
+    memset(control, 0, controlSize);
+    p += controlSize;
+    for (_int64 i = 1; i < nHits; i++) {
+        unsigned delta = (unsigned)(hits[i - 1] - hits[i]);
+        unsigned deltaSize = delta < 0x100 ? 1 : delta < 0x10000 ? 2 : delta < 0x1000000 ? 3 : 4;
+        control[(i - 1) / 4] |= (deltaSize - 1) << (((i - 1) % 4) * 2);
+        memcpy(p, &delta, deltaSize);
+        p += deltaSize;
     }
 
-    if (0 == seedLen) {
-        WriteErrorMessage("GenomeIndex::LoadFromDirectory: saw seed size of 0.\n");
-        return NULL;
-    }
+    return p - output;
+}
 
-    SetInvalidGenomeLocation(locationSize);
+    bool
+GenomeIndex::CompressOverflowTable(const char *directoryName, IndexBuildReport *report)
+/*++
 
-    GenomeIndex *index;
-    index = new GenomeIndex();
+Routine Description:
 
-    index->nHashTables = nHashTables;
-    index->overflowTableSize = overflowTableSize;
-    index->hashTableKeySize = hashTableKeySize;
-    index->seedLen = seedLen;
-    index->locationSize = locationSize;
-    index->largeHashTable = !smallHashTable;
+    Rewrite the overflow table of an index in the compressed format (see EncodeHitList), which stores most hits in
+    a byte or two instead of eight.  The hash table entries that point into the overflow table get rewritten to point
+    at the start of their compressed list (plus the count of bases, as before, but now the offset is in bytes).
+    This is only for 64 bit location indices; that's where the overflow table is biggest, and the compressed
+    offsets might not fit in 32 bit locations.
 
-    unsigned overflowEntrySize = (locationSize > 4) ? sizeof(*index->overflowTable64) : sizeof(*index->overflowTable32);
+    Like -append, the new files are built in a subdirectory and moved over the old ones at the end, with the old
+    GenomeIndex file deleted first so that stopping part way through the moves leaves an index that won't load rather
+    than one that mixes compressed and uncompressed files.
 
-    size_t overflowTableSizeInBytes = (size_t)index->overflowTableSize * overflowEntrySize;
+Arguments:
 
-    snprintf(filenameBuffer,filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, OverflowTableFileName);
+    directoryName   - the index directory
+    report          - gets the time it takes and the table sizes
 
-	if (map) {
-		if (prefetch) {
-			GenericFile *overflowTableFile = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
-			if (NULL == overflowTableFile) {
-				WriteErrorMessage("Unable to open file '%s'\n", filenameBuffer);
-                soft_exit(1);
-			}
+--*/
+{
+    WriteStatusMessage("Compressing overflow table...");
+    _int64 start = timeInMillis();
+    report->startPhase("compressOverflowTable");
 
-			overflowTableFile->prefetch();
-			overflowTableFile->close();
-			delete overflowTableFile;
-		}
+    GenomeIndex *index = loadFromDirectory((char *)directoryName, false, false);
+    if (NULL == index) {
+        WriteErrorMessage("Unable to load the index in '%s'\n", directoryName);
+        return false;
+    }
 
-		index->mappedOverflowTable = GenericFile_map::open(filenameBuffer);
-		if (NULL == index->mappedOverflowTable) {
-			WriteErrorMessage("Unable to open file '%s'\n", filenameBuffer);
-            soft_exit(1);
-		}
+    if (index->locationSize <= 4) {
+        WriteErrorMessage("Compressing the overflow table needs an index with -locationSize 5 or more.\n");
+        delete index;
+        return false;
+    }
 
-		size_t bytesMapped;
-		if (locationSize > 4) {
-			index->overflowTable64 = (_int64 *)index->mappedOverflowTable->mapAndAdvance(overflowTableSizeInBytes, &bytesMapped);
-		} else {
-			index->overflowTable32 = (unsigned *)index->mappedOverflowTable->mapAndAdvance(overflowTableSizeInBytes, &bytesMapped);
-		}
+    if (NULL != index->compressedOverflowTable) {
+        WriteStatusMessage("already compressed\n");
+        delete index;
+        return true;
+    }
 
-		if (bytesMapped != overflowTableSizeInBytes) {
-			WriteErrorMessage("read (via mapping) only %lld bytes of '%s', expected %lld\n", bytesMapped, filenameBuffer, overflowTableSizeInBytes);
-            soft_exit(1);
-		}
+    _int64 countOfBases = index->genome->getCountOfBases();
+    size_t uncompressedSize = (size_t)index->overflowTableSize * sizeof(*index->overflowTable64);
+    unsigned char *compressedTable = (unsigned char *)BigAlloc(__max((size_t)index->overflowTableSize * 9, (size_t)1));  // Only the part we use gets touched
+    size_t compressedSize = 0;
+
+    for (unsigned whichHashTable = 0; whichHashTable < index->nHashTables; whichHashTable++) {
+        SNAPHashTable *hashTable = index->hashTables[whichHashTable];
+        for (_uint64 slot = 0; slot < hashTable->GetTableSize(); slot++) {
+            SNAPHashTable::KeyType key;
+            SNAPHashTable::ValueType values[NUM_DIRECTIONS];
+            if (!hashTable->GetSlotContents(slot, &key, values)) {
+                continue;
+            }
 
-		index->mappedOverflowTable->prefetch();	// NB: This is different than the -pre prefetch.  This one maps the whole thing (and reads it sequentially in case you didn't use -pre)
-	} else {
-		char *tableAsCharStar;
-		if (locationSize > 4) {
-			index->overflowTable64 = (_int64 *)BigAlloc(overflowTableSizeInBytes);
-			tableAsCharStar = (char *)index->overflowTable64;
-			_ASSERT(NULL == index->overflowTable32);
-		} else {
-			index->overflowTable32 = (unsigned *)BigAlloc(overflowTableSizeInBytes);
-			tableAsCharStar = (char *)index->overflowTable32;
-			_ASSERT(NULL == index->overflowTable64);
-		}
+            for (unsigned whichValue = 0; whichValue < hashTable->GetValueCount(); whichValue++) {
+                if (values[whichValue] < (_uint64)countOfBases || values[whichValue] == (_uint64)(GenomeLocationAsInt64(InvalidGenomeLocation) - 1)) {
+                    continue;   // A single hit or the unused complement
+                }
 
-		GenericFile *fOverflowTable = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+                const _int64 *list = index->overflowTable64 + (values[whichValue] - countOfBases);
+                _uint64 newValue = countOfBases + compressedSize;
+                if (newValue >= (_uint64)(GenomeLocationAsInt64(InvalidGenomeLocation) - 1)) {
+                    WriteErrorMessage("The compressed overflow table is too big for %d byte locations\n", index->locationSize);
+                    BigDealloc(compressedTable);
+                    delete index;
+                    return false;
+                }
 
-		if (NULL == fOverflowTable) {
-			WriteErrorMessage("Unable to open overflow table file, '%s', %d\n", filenameBuffer, errno);
-            delete[] filenameBuffer;
-            delete index;
-			return NULL;
-		}
+                compressedSize += EncodeHitList(list + 1, list[0], index->locationSize, compressedTable + compressedSize);
+                hashTable->SetSlotValue(slot, whichValue, newValue);
+            } // for each value in the slot
+        } // for each slot
+    } // for each hash table
 
-		size_t amountRead = fOverflowTable->read(tableAsCharStar, overflowTableSizeInBytes);
-		if (amountRead != overflowTableSizeInBytes) {
-			WriteErrorMessage("Error reading overflow table, %lld != %lld bytes read.\n", amountRead, overflowTableSizeInBytes);
-			soft_exit(1);
-		}
+    //
+    // Write everything but the genome (which doesn't change) into the staging directory.
+    //
+    const char *stagingDirectoryName = "CompressInProgress";
+    size_t stagingDirectoryBufferSize = strlen(directoryName) + 1 + strlen(stagingDirectoryName) + 1;
+    char *stagingDirectory = new char[stagingDirectoryBufferSize];
+    snprintf(stagingDirectory, stagingDirectoryBufferSize, "%s%c%s", directoryName, PATH_SEP, stagingDirectoryName);
+    size_t filenameBufferSize = stagingDirectoryBufferSize + 1 + strlen(GenomeIndexHashFileName) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
 
-		fOverflowTable->close();
-		delete fOverflowTable;
-		fOverflowTable = NULL;
-	}
+    bool worked = mkdir(stagingDirectory, 0777) == 0 || errno == EEXIST;
+    if (!worked) {
+        WriteErrorMessage("CompressOverflowTable: failed to create directory %s\n", stagingDirectory);
+    }
 
-    index->hashTables = new SNAPHashTable*[index->nHashTables];
+    size_t hashTablesFileSize = 0;
+    if (worked) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", stagingDirectory, PATH_SEP, GenomeIndexHashFileName);
+        FILE *tablesFile = fopen(filenameBuffer, "wb");
+        worked = NULL != tablesFile;
+        for (unsigned whichHashTable = 0; worked && whichHashTable < index->nHashTables; whichHashTable++) {
+            size_t bytesWrittenThisHashTable;
+            worked = index->hashTables[whichHashTable]->saveToFile(tablesFile, &bytesWrittenThisHashTable);
+            hashTablesFileSize += bytesWrittenThisHashTable;
+        }
+        if (NULL != tablesFile) {
+            worked = (0 == fclose(tablesFile)) && worked;
+        }
+        if (!worked) {
+            WriteErrorMessage("CompressOverflowTable: unable to write '%s'\n", filenameBuffer);
+        }
+    }
 
-    for (unsigned i = 0; i < index->nHashTables; i++) {
-        index->hashTables[i] = NULL; // We need to do this so the destructor doesn't crash if loading a hash table fails.
+    if (worked) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", stagingDirectory, PATH_SEP, OverflowTableFileName);
+        FILE *overflowTableFile = fopen(filenameBuffer, "wb");
+        worked = NULL != overflowTableFile;
+        const size_t writeSize = 32 * 1024 * 1024;
+        for (size_t writeOffset = 0; worked && writeOffset < compressedSize; writeOffset += writeSize) {
+            size_t amountToWrite = __min(writeSize, compressedSize - writeOffset);
+            worked = fwrite(compressedTable + writeOffset, 1, amountToWrite, overflowTableFile) == amountToWrite;
+        }
+        if (NULL != overflowTableFile) {
+            worked = (0 == fclose(overflowTableFile)) && worked;
+        }
+        if (!worked) {
+            WriteErrorMessage("CompressOverflowTable: unable to write '%s'\n", filenameBuffer);
+        }
     }
 
-    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeIndexHashFileName);
+    worked = worked && SaveIndexParameters(stagingDirectory, index->nHashTables, compressedSize, index->seedLen, index->genome->getChromosomePadding(),
+                                           index->hashTableKeySize, hashTablesFileSize, index->largeHashTable, index->locationSize, true, index->minimizerWindow,
+                                           index->seedMask);
 
-	GenericFile_Blob *blobFile = NULL;
-	GenericFile *tablesFile = NULL;
+    BigDealloc(compressedTable);
+    compressedTable = NULL;
+    delete index;
+    index = NULL;
+
+    const char *movedFileNames[] = {GenomeIndexHashFileName, OverflowTableFileName, GenomeIndexFileName};   // GenomeIndex goes last
+    worked = worked && MoveStagedIndexFiles(stagingDirectory, directoryName, movedFileNames, (int)(sizeof(movedFileNames) / sizeof(*movedFileNames)),
+                                            "CompressOverflowTable");
+
+    if (worked) {
+        rmdir(stagingDirectory);
+        report->endPhase();
+        report->setValue("uncompressedOverflowTableBytes", uncompressedSize);
+        report->setValue("compressedOverflowTableBytes", compressedSize);
+        WriteStatusMessage("%llds, %lld bytes to %lld bytes\n", (timeInMillis() + 500 - start) / 1000, (_int64)uncompressedSize, (_int64)compressedSize);
+    }
 
-	if (map) {
-		if (prefetch) {
-			GenericFile *hashTableFile = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
-			if (NULL == hashTableFile) {
-				WriteErrorMessage("Unable to open genome hash table file '%s'\n", filenameBuffer);
-				soft_exit(1);
-			}
+    delete[] filenameBuffer;
+    delete[] stagingDirectory;
 
-			hashTableFile->prefetch();
-			hashTableFile->close();
-			delete hashTableFile;
-		}
+    return worked;
+}
 
-		if (QueryFileSize(filenameBuffer) != hashTablesFileSize) {
-			WriteErrorMessage("File '%s' had unexpected size, %lld != %lld\n", filenameBuffer, QueryFileSize(filenameBuffer), hashTablesFileSize);
-            delete[]filenameBuffer;
-			delete index;
-			return NULL;
-		}
+    bool
+GenomeIndex::BuildPerfectHashTables(const char *directoryName, IndexBuildReport *report)
+/*++
 
-		index->mappedTables = GenericFile_map::open(filenameBuffer);
-		index->mappedTables->prefetch();
-		blobFile = index->mappedTables;
-		index->tablesBlob = NULL;
-	} else {
-		tablesFile = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
-		if (NULL == tablesFile) {
-			WriteErrorMessage("Unable to open genome hash table file '%s'\n", filenameBuffer);
-			soft_exit(1);
-		}
+Routine Description:
 
-		index->tablesBlob = BigAlloc(hashTablesFileSize);
-		size_t amountRead = tablesFile->read(index->tablesBlob, hashTablesFileSize);
-		if (amountRead != hashTablesFileSize) {
-			WriteErrorMessage("Read incorrect amount for GenomeIndexHash file, %lld != %lld\n", hashTablesFileSize, amountRead);
-            delete[] filenameBuffer;
-			delete index;
-			return NULL;
-		}
+    Replace each hash table of an index with a minimal perfect hash copy of it (see SNAPHashTable::BuildPerfectHash).
+    The entries don't change, so the overflow table and any seed sketch stay as they are, but the size of the hash
+    table file is in the index parameters, so GenomeIndex is rewritten too.  An empty table, or one the build can't
+    find pilots for, stays as it was.
 
-		blobFile = GenericFile_Blob::open(index->tablesBlob, hashTablesFileSize);
-	}
+--*/
+{
+    WriteStatusMessage("Building perfect hash tables...");
+    _int64 start = timeInMillis();
+    report->startPhase("buildPerfectHashTables");
 
-    for (unsigned i = 0; i < index->nHashTables; i++) {
-        if (NULL == (index->hashTables[i] = SNAPHashTable::loadFromBlob(blobFile))) {
-            WriteErrorMessage("GenomeIndex::loadFromDirectory: Failed to load hash table %d\n",i);
-            delete[] filenameBuffer;
-            delete index;
-            return NULL;
+    GenomeIndex *index = loadFromDirectory((char *)directoryName, false, false);
+    if (NULL == index) {
+        WriteErrorMessage("Unable to load the index in '%s'\n", directoryName);
+        return false;
+    }
+
+    unsigned nTablesNotConverted = 0;
+    for (unsigned whichHashTable = 0; whichHashTable < index->nHashTables; whichHashTable++) {
+        if (index->hashTables[whichHashTable]->UsesPerfectHash()) {
+            continue;
         }
 
-		unsigned expectedValueCount;
-		if (smallHashTable) {
-			expectedValueCount = 1;
-		} else {
-			expectedValueCount = 2;
-		}
+        SNAPHashTable *perfectTable = SNAPHashTable::BuildPerfectHash(index->hashTables[whichHashTable]);
+        if (NULL == perfectTable) {
+            nTablesNotConverted++;
+            continue;
+        }
 
-        if (index->hashTables[i]->GetValueCount() != expectedValueCount) {
-            WriteErrorMessage("Expected loaded hash table to have value count of %d, but it had %d.  Index corrupt\n", expectedValueCount, index->hashTables[i]->GetValueCount());
-            delete[] filenameBuffer;
-            delete index;
-            return NULL;
+        delete index->hashTables[whichHashTable];
+        index->hashTables[whichHashTable] = perfectTable;
+    }
+
+    const char *stagingDirectoryName = "PerfectHashInProgress";
+    size_t stagingDirectoryBufferSize = strlen(directoryName) + 1 + strlen(stagingDirectoryName) + 1;
+    char *stagingDirectory = new char[stagingDirectoryBufferSize];
+    snprintf(stagingDirectory, stagingDirectoryBufferSize, "%s%c%s", directoryName, PATH_SEP, stagingDirectoryName);
+    size_t filenameBufferSize = stagingDirectoryBufferSize + 1 + strlen(GenomeIndexHashFileName) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
+
+    bool worked = mkdir(stagingDirectory, 0777) == 0 || errno == EEXIST;
+    if (!worked) {
+        WriteErrorMessage("BuildPerfectHashTables: failed to create directory %s\n", stagingDirectory);
+    }
+
+    size_t hashTablesFileSize = 0;
+    if (worked) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", stagingDirectory, PATH_SEP, GenomeIndexHashFileName);
+        FILE *tablesFile = fopen(filenameBuffer, "wb");
+        worked = NULL != tablesFile;
+        for (unsigned whichHashTable = 0; worked && whichHashTable < index->nHashTables; whichHashTable++) {
+            size_t bytesWrittenThisHashTable;
+            worked = index->hashTables[whichHashTable]->saveToFile(tablesFile, &bytesWrittenThisHashTable);
+            hashTablesFileSize += bytesWrittenThisHashTable;
+        }
+        if (NULL != tablesFile) {
+            worked = (0 == fclose(tablesFile)) && worked;
+        }
+        if (!worked) {
+            WriteErrorMessage("BuildPerfectHashTables: unable to write '%s'\n", filenameBuffer);
         }
     }
 
-	if (!map) {
-		tablesFile->close();
-		delete tablesFile;
-		tablesFile = NULL;
+    size_t oldHashTablesFileSize = index->tablesBlobSize;
+    worked = worked && SaveIndexParameters(stagingDirectory, index->nHashTables, index->overflowTableSize, index->seedLen, index->genome->getChromosomePadding(),
+                                           index->hashTableKeySize, hashTablesFileSize, index->largeHashTable, index->locationSize,
+                                           NULL != index->compressedOverflowTable, index->minimizerWindow, index->seedMask);
+    delete index;
+    index = NULL;
+
+    const char *movedFileNames[] = {GenomeIndexHashFileName, GenomeIndexFileName};   // GenomeIndex goes last
+    worked = worked && MoveStagedIndexFiles(stagingDirectory, directoryName, movedFileNames, (int)(sizeof(movedFileNames) / sizeof(*movedFileNames)),
+                                            "BuildPerfectHashTables");
+
+    if (worked) {
+        rmdir(stagingDirectory);
+        report->endPhase();
+        report->setValue("hashTableBytesBeforePerfectHash", oldHashTablesFileSize);
+        report->setValue("perfectHashTableBytes", hashTablesFileSize);
+        report->setValue("hashTablesNotPerfect", nTablesNotConverted);
+        WriteStatusMessage("%llds, %lld bytes to %lld bytes\n", (timeInMillis() + 500 - start) / 1000, (_int64)oldHashTablesFileSize, (_int64)hashTablesFileSize);
+    }
 
-		blobFile->close();
-		delete blobFile;
-		blobFile = NULL;
-	}
+    delete[] filenameBuffer;
+    delete[] stagingDirectory;
 
-    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeFileName);
-    if (NULL == (index->genome = Genome::loadFromFile(filenameBuffer, chromosomePadding, 0, 0, map))) {
-        WriteErrorMessage("GenomeIndex::loadFromDirectory: Failed to load the genome itself\n");
-        delete[] filenameBuffer;
-        delete index;
-        return NULL;
+    return worked;
+}
+
+    _int64
+GenomeIndex::countHitsForValue(_uint64 value) const
+{
+    _uint64 countOfBases = genome->getCountOfBases();
+    if (value < countOfBases) {
+        return 1;
     }
 
-    if ((_int64)index->genome->getCountOfBases() + (_int64)index->overflowTableSize > 0xfffffff0 && locationSize == 4) {
-        WriteErrorMessage("\nThis index has too many overflow entries to be valid.  Some early versions of SNAP\n"
-                        "allowed building indices with too small of a seed size, and this appears to be such\n"
-                        "an index.  You can no longer build indices like this, and you also can't use them\n"
-                        "because they are corrupt and would produce incorrect results.  Please use an index\n"
-                        "built with a larger seed size.  For hg19, the seed size must be at least 19.\n"
-                        "For other reference genomes this quantity will vary.\n");
-        soft_exit(1);
+    if (value == (_uint64)(GenomeLocationAsInt64(InvalidGenomeLocation) - 1)) {
+        return 0;   // The unused complement
+    }
+
+    _uint64 overflowTableOffset = value - countOfBases;
+    if (NULL != compressedOverflowTable) {
+        //
+        // The list's header is the count shifted left one, as a varint (see EncodeHitList).
+        //
+        const unsigned char *list = compressedOverflowTable + overflowTableOffset;
+        _uint64 header = 0;
+        for (unsigned shift = 0; ; shift += 7) {
+            header |= ((_uint64)(*list & 0x7f)) << shift;
+            if (0 == (*list++ & 0x80)) {
+                break;
+            }
+        }
+        return (_int64)(header >> 1);
+    }
+
+    return locationSize > 4 ? overflowTable64[overflowTableOffset] : (_int64)overflowTable32[overflowTableOffset];
+}
+
+    bool
+GenomeIndex::BuildSeedSketch(const char *directoryName, IndexBuildReport *report)
+/*++
+
+Routine Description:
+
+    Build the seed sketch for an index and save it in the index directory.  This walks the hash tables twice: once to
+    count the keys (which sizes the Bloom filter) and find the most popular ones, and once to fill in the filter.
+
+    An entry's popularity is the smallest of its nonzero hit counts, since a lookup can only skip the entry if the
+    caller would ignore every direction that has hits.
+
+Arguments:
+
+    directoryName   - the index directory
+    report          - gets the time it takes and the sketch's size
+
+--*/
+{
+    WriteStatusMessage("Building seed sketch...");
+    _int64 start = timeInMillis();
+    report->startPhase("buildSeedSketch");
+
+    GenomeIndex *index = loadFromDirectory((char *)directoryName, false, false);
+    if (NULL == index) {
+        WriteErrorMessage("Unable to load the index in '%s'\n", directoryName);
+        return false;
+    }
+
+    struct PopularEntry {
+        _int64      popularity;
+        unsigned    whichTable;
+        _uint64     key;
+        _int64      nHits[NUM_DIRECTIONS];
+
+        bool operator<(const PopularEntry &peer) const {return popularity > peer.popularity;}  // Most popular first
+    };
+
+    vector<PopularEntry> popularEntries;
+    _int64 nKeys = 0;
+
+    for (unsigned whichHashTable = 0; whichHashTable < index->nHashTables; whichHashTable++) {
+        SNAPHashTable *hashTable = index->hashTables[whichHashTable];
+        for (_uint64 slot = 0; slot < hashTable->GetTableSize(); slot++) {
+            PopularEntry entry;
+            SNAPHashTable::ValueType values[NUM_DIRECTIONS];
+            if (!hashTable->GetSlotContents(slot, &entry.key, values)) {
+                continue;
+            }
+            nKeys++;
+
+            entry.whichTable = whichHashTable;
+            entry.popularity = 0;
+            for (unsigned whichValue = 0; whichValue < hashTable->GetValueCount(); whichValue++) {
+                entry.nHits[whichValue] = index->countHitsForValue(values[whichValue]);
+                if (entry.nHits[whichValue] > 0 && (0 == entry.popularity || entry.nHits[whichValue] < entry.popularity)) {
+                    entry.popularity = entry.nHits[whichValue];
+                }
+            }
+
+            if (entry.popularity >= SeedSketch::MinPopularKeyHits) {
+                popularEntries.push_back(entry);
+            }
+        } // for each slot
+    } // for each hash table
+
+    if ((_int64)popularEntries.size() > SeedSketch::MaxPopularKeys) {
+        nth_element(popularEntries.begin(), popularEntries.begin() + SeedSketch::MaxPopularKeys, popularEntries.end());
+        popularEntries.resize(SeedSketch::MaxPopularKeys);
+    }
+
+    SeedSketch *sketch = new SeedSketch(nKeys, SeedSketch::DefaultBitsPerKey, popularEntries.size());
+    for (size_t i = 0; i < popularEntries.size(); i++) {
+        sketch->addPopularKey(popularEntries[i].whichTable, popularEntries[i].key, popularEntries[i].nHits, index->hashTables[0]->GetValueCount());
+    }
+
+    for (unsigned whichHashTable = 0; whichHashTable < index->nHashTables; whichHashTable++) {
+        SNAPHashTable *hashTable = index->hashTables[whichHashTable];
+        for (_uint64 slot = 0; slot < hashTable->GetTableSize(); slot++) {
+            SNAPHashTable::KeyType key;
+            SNAPHashTable::ValueType values[NUM_DIRECTIONS];
+            if (hashTable->GetSlotContents(slot, &key, values)) {
+                sketch->addKey(whichHashTable, key);
+            }
+        }
+    }
+
+    size_t filenameBufferSize = strlen(directoryName) + 1 + strlen(SeedSketchFileName) + 1;
+    char *filenameBuffer = new char[filenameBufferSize];
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, SeedSketchFileName);
+    bool worked = sketch->saveToFile(filenameBuffer, index->nHashTables, index->genome->getCountOfBases());
+
+    if (worked) {
+        report->endPhase();
+        report->setValue("seedSketchBytes", sketch->getSizeInBytes());
+        report->setValue("seedSketchPopularSeeds", sketch->getPopularKeyCount());
+        WriteStatusMessage("%llds, %lld bytes for %lld seeds, %lld of them popular\n", (timeInMillis() + 500 - start) / 1000, sketch->getSizeInBytes(),
+            nKeys, sketch->getPopularKeyCount());
     }
 
     delete[] filenameBuffer;
-    return index;
+    delete sketch;
+    delete index;
+
+    return worked;
 }
 
     void
-GenomeIndex::lookupSeed32(
-    Seed              seed,
-    _int64           *nHits,
-    const unsigned  **hits,
-    _int64           *nRCHits,
-    const unsigned  **rcHits)
+GenomeIndex::lookupSeedEntries(
+    const Seed     *seeds,
+    int             nSeeds,
+    bool           *lookedUpComplement,
+    const char     *(*entries)[NUM_DIRECTIONS],
+    _int64          maxHitsWanted,
+    _int64          (*popularNHits)[NUM_DIRECTIONS])
 {
-    _ASSERT(locationSize == 4);   // This is the caller's responsibility to check.
+    _ASSERT(nSeeds <= MaxSeedLookupBatchSize);
 
-    if (largeHashTable) {
-        bool lookedUpComplement;
+    //
+    // First, work out which hash table entries we're going to need: one per seed for large hash tables, otherwise one
+    // for each direction.  Then get the hash table lines for all of them on their way in, or if there's a seed sketch,
+    // the sketch's lines.  Nothing here depends on memory that isn't already in cache.
+    //
+    Seed lookupSeeds[MaxSeedLookupBatchSize][NUM_DIRECTIONS];
+    int nEntriesPerSeed = largeHashTable ? 1 : NUM_DIRECTIONS;
+    for (int i = 0; i < nSeeds; i++) {
+        lookupSeeds[i][FORWARD] = seeds[i];
+        if (largeHashTable) {
+            lookedUpComplement[i] = seeds[i].isBiggerThanItsReverseComplement();
+            if (lookedUpComplement[i]) {
+                lookupSeeds[i][FORWARD] = ~seeds[i];
+            }
+        } else {
+            lookedUpComplement[i] = false;
+            lookupSeeds[i][RC] = ~seeds[i];
+        }
 
-        lookedUpComplement = seed.isBiggerThanItsReverseComplement();
-        if (lookedUpComplement) {
-            seed = ~seed;
+        for (int dir = 0; dir < nEntriesPerSeed; dir++) {
+            Seed seed = lookupSeeds[i][dir];
+            _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
+            if (NULL != seedSketch) {
+                seedSketch->prefetch((unsigned)seed.getHighBases(hashTableKeySize), seed.getLowBases(hashTableKeySize));
+            } else {
+                hashTables[seed.getHighBases(hashTableKeySize)]->PrefetchForKey(seed.getLowBases(hashTableKeySize));
+            }
         }
+    }
 
-        _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
-        _uint64 lowBases = seed.getLowBases(hashTableKeySize);
-        _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() == 4);
-        const unsigned *entry = (const unsigned *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(lowBases);   // Cast OK because valueSize == 4
-        if (NULL == entry) {
-            *nHits = 0;
-            *nRCHits = 0;
-            return;
+    //
+    // With a sketch, drop the entries that it says aren't there, or that have more hits than the caller wants in every
+    // direction that has any, and prefetch the hash table lines for the rest.
+    //
+    bool needLookup[MaxSeedLookupBatchSize][NUM_DIRECTIONS];
+    for (int i = 0; i < nSeeds; i++) {
+        popularNHits[i][FORWARD] = popularNHits[i][RC] = -1;
+        for (int dir = 0; dir < nEntriesPerSeed; dir++) {
+            needLookup[i][dir] = true;
+            if (NULL == seedSketch) {
+                continue;
+            }
+
+            Seed seed = lookupSeeds[i][dir];
+            unsigned whichTable = (unsigned)seed.getHighBases(hashTableKeySize);
+            _uint64 key = seed.getLowBases(hashTableKeySize);
+            _int64 nHits[NUM_DIRECTIONS];
+            if (!seedSketch->mightContain(whichTable, key)) {
+                needLookup[i][dir] = false;
+            } else if (seedSketch->findPopularKey(whichTable, key, nHits) &&
+                       (nHits[0] == 0 || nHits[0] > maxHitsWanted) && (!largeHashTable || nHits[1] == 0 || nHits[1] > maxHitsWanted)) {
+                needLookup[i][dir] = false;
+                if (largeHashTable) {
+                    popularNHits[i][FORWARD] = nHits[0];
+                    popularNHits[i][RC] = nHits[1];
+                } else {
+                    popularNHits[i][dir] = nHits[0];
+                }
+            } else {
+                hashTables[whichTable]->PrefetchForKey(key);
+            }
         }
+    }
 
-        //
-        // Fill in the caller's answers for the main and complement of the seed looked up.
-        // Because of our hash table design, we may have had to take the complement before the
-        // lookup, in which case we reverse the results so the caller gets the right thing.
-        // Also, if the seed is its own reverse complement, we need to fill the same hits
-        // in both return arrays.
-        //
-        fillInLookedUpResults32((lookedUpComplement ? entry + 1 : entry), nHits, hits);
-        if (seed.isOwnReverseComplement()) {
-          *nRCHits = *nHits;
-          *rcHits = *hits;
-        } else {
-          fillInLookedUpResults32((lookedUpComplement ? entry : entry + 1), nRCHits, rcHits);
+    //
+    // Now do the lookups themselves.
+    //
+    for (int i = 0; i < nSeeds; i++) {
+        entries[i][RC] = NULL;
+        for (int dir = 0; dir < nEntriesPerSeed; dir++) {
+            Seed seed = lookupSeeds[i][dir];
+            if (needLookup[i][dir]) {
+                entries[i][dir] = (const char *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(seed.getLowBases(hashTableKeySize));
+            } else {
+                entries[i][dir] = NULL;
+            }
         }
-    } else {
-	    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
-		    _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
-		    _uint64 lowBases = seed.getLowBases(hashTableKeySize);
-		    _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() == 4);
-		    unsigned *entry = (unsigned int *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(lowBases);   // Cast OK because valueSize == 4
-		    if (NULL == entry) {
-			    if (FORWARD == dir) {
-				    *nHits = 0;
-			    } else {
-				    *nRCHits = 0;
-			    }
-		    } else if (FORWARD == dir) {
-			    fillInLookedUpResults32(entry,  nHits, hits);
-		    } else {
-			    fillInLookedUpResults32(entry,  nRCHits, rcHits);
-		    }
-		    seed = ~seed;
-        }	// For each direction    
     }
 }
 
     void
-GenomeIndex::fillInLookedUpResults32(
-    const unsigned  *subEntry,
-    _int64          *nHits, 
-    const unsigned **hits)
+GenomeIndex::prefetchSeedLookups(const char *bases, unsigned length) const
 {
-    //
-    // WARNING: the code in the IntersectingPairedEndAligner relies on being able to look at 
-    // hits[-1].  It doesn't care about the value, but it must not be a bogus pointer.  This
-    // is true with the current layout (where it will either be the hit count, the key or
-    // forward pointer in the hash table entry or some intermediate hit in the case where the
-    // search is constrained by minLocation/maxLocation).  If you change this, be sure to look
-    // at the code and fix it.
-    //
-    if (*subEntry < genome->getCountOfBases()) {
-        //
-        // It's a singleton.
-        //
-        *nHits = 1;
-        *hits = subEntry;
-    } else if (*subEntry == 0xfffffffe) {
-        //
-        // It's unused, the other complement must exist.
-        //
-        _ASSERT(largeHashTable);
-        *nHits = 0;
-    } else {
-        //
-        // Multiple hits.  Recall that the overflow table format is first a count of
-        // the number of hits for that seed, followed by the list of hits.
-        //
-        unsigned overflowTableOffset = *subEntry - (unsigned)genome->getCountOfBases();
-
-        _ASSERT(overflowTableOffset < overflowTableSize);
-
-        int hitCount = overflowTable32[overflowTableOffset];
+    unsigned nPrefetched = 0;
+    unsigned offset = 0;
+    while (offset + seedLen <= length && nPrefetched < MaxSeedLookupBatchSize) {
+        if (!Seed::DoesTextRepresentASeed(bases + offset, seedLen)) {
+            offset++;
+            continue;
+        }
 
-        _ASSERT(hitCount >= 2);
-        _ASSERT(hitCount + overflowTableOffset < overflowTableSize);
+        Seed seed = Seed(bases + offset, seedLen).masked(seedMask);
+        if (largeHashTable) {
+            if (seed.isBiggerThanItsReverseComplement()) {
+                seed = ~seed;
+            }
+        } else {
+            prefetchSeedLookup(~seed);
+        }
+        prefetchSeedLookup(seed);
 
-        *nHits = hitCount;
-        *hits = &overflowTable32[overflowTableOffset + 1];
+        nPrefetched++;
+        offset += seedLen;
     }
 }
 
-    void 
-GenomeIndex::lookupSeed(
-    Seed                    seed, 
-    _int64 *                nHits, 
-    const GenomeLocation ** hits, 
-    _int64 *                nRCHits, 
-    const GenomeLocation ** rcHits, 
-    GenomeLocation *        singleHit, 
-    GenomeLocation *        singleRCHit)
+    void
+GenomeIndex::lookupSeeds(
+    const Seed *            seeds,
+    int                     nSeeds,
+    _int64 *                nHits,
+    const GenomeLocation ** hits,
+    _int64 *                nRCHits,
+    const GenomeLocation ** rcHits,
+    GenomeLocation *        singleHits,
+    GenomeLocation *        singleRCHits,
+    OverflowDecodeBuffer *  decodeBuffer,
+    _int64                  maxHitsWanted)
 {
     _ASSERT(locationSize > 4 && locationSize <= 8);
 
-    if (largeHashTable) {
-        bool lookedUpComplement;
+    GenomeLocation countOfBases = genome->getCountOfBases();
 
-        lookedUpComplement = seed.isBiggerThanItsReverseComplement();
-        if (lookedUpComplement) {
-            seed = ~seed;
+    for (int batchStart = 0; batchStart < nSeeds; batchStart += MaxSeedLookupBatchSize) {
+        int batchSize = __min(MaxSeedLookupBatchSize, nSeeds - batchStart);
+        bool lookedUpComplement[MaxSeedLookupBatchSize];
+        const char *entries[MaxSeedLookupBatchSize][NUM_DIRECTIONS];
+        _int64 popularNHits[MaxSeedLookupBatchSize][NUM_DIRECTIONS];
+
+        Seed batchSeeds[MaxSeedLookupBatchSize];    // Masked for spaced seed indices
+        for (int i = 0; i < batchSize; i++) {
+            batchSeeds[i] = seeds[batchStart + i].masked(seedMask);
         }
 
-        _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
-        _uint64 lowBases = seed.getLowBases(hashTableKeySize);
-        _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() > 4);
+        lookupSeedEntries(batchSeeds, batchSize, lookedUpComplement, entries, maxHitsWanted, popularNHits);
 
-        const char *entry = (char *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(lowBases);
-        if (NULL == entry) {
-            *nHits = 0;
-            *nRCHits = 0;
-            return;
-        }
+        //
+        // Pull the locations out of the entries, and prefetch the overflow table for any that have multiple hits.
+        // For large tables, both directions are in the one entry; otherwise there's one entry per direction.
+        //
+        GenomeLocation entryByValue[MaxSeedLookupBatchSize][NUM_DIRECTIONS];
+        for (int i = 0; i < batchSize; i++) {
+            for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+                const char *entry = largeHashTable ? entries[i][FORWARD] : entries[i][dir];
+                if (NULL == entry) {
+                    entryByValue[i][dir] = InvalidGenomeLocation;
+                    continue;
+                }
 
-        GenomeLocation entryByValue[NUM_DIRECTIONS];
-        entryByValue[0] = 0;
-        entryByValue[1] = 0;
+                entryByValue[i][dir] = 0;
+                memcpy(&entryByValue[i][dir], entry + (largeHashTable ? dir * locationSize : 0), locationSize);  // Assumes little endian
 
-        memcpy(&entryByValue[0], entry, locationSize);  // Works because we're litte-endian
-        memcpy(&entryByValue[1], entry + locationSize, locationSize);   // Again, required litte-endianness.
+                if (entryByValue[i][dir] >= countOfBases && entryByValue[i][dir] != InvalidGenomeLocation - 1) {
+                    _int64 overflowTableOffset = GenomeLocationAsInt64(entryByValue[i][dir]) - GenomeLocationAsInt64(countOfBases);
+                    if (NULL != compressedOverflowTable) {
+                        _mm_prefetch((const char *)&compressedOverflowTable[overflowTableOffset], _MM_HINT_T2);
+                    } else {
+                        _mm_prefetch((const char *)&overflowTable64[overflowTableOffset], _MM_HINT_T2);
+                    }
+                }
+            }
+        }
 
         //
-        // Fill in the caller's answers for the main and complement of the seed looked up.
-        // Because of our hash table design, we may have had to take the complement before the
-        // lookup, in which case we reverse the results so the caller gets the right thing.
-        // Also, if the seed is its own reverse complement, we need to fill the same hits
-        // in both return arrays.
+        // And finally fill in the results, the same way that lookupSeed does.  The seeds that the sketch says are too
+        // popular just get their counts.
         //
-        fillInLookedUpResults(entryByValue[lookedUpComplement ? 1 : 0], nHits, hits, singleHit);
-   
-        if (seed.isOwnReverseComplement()) {
-          *nRCHits = *nHits;
-          *rcHits = *hits;
-        } else {
-          fillInLookedUpResults(entryByValue[lookedUpComplement ? 0 : 1], nRCHits, rcHits, singleRCHit);
-        }
-    } else {
-	    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
-		    _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
-		    _uint64 lowBases = seed.getLowBases(hashTableKeySize);
-		    _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() > 4);
-		    const char *entry = (char *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(lowBases);   
+        for (int i = 0; i < batchSize; i++) {
+            int which = batchStart + i;
+            if (largeHashTable && popularNHits[i][FORWARD] >= 0) {
+                nHits[which] = popularNHits[i][lookedUpComplement[i] ? 1 : 0];
+                hits[which] = NULL;
+                nRCHits[which] = batchSeeds[i].isOwnReverseComplement() ? nHits[which] : popularNHits[i][lookedUpComplement[i] ? 0 : 1];
+                rcHits[which] = NULL;
+                continue;
+            }
 
-            if (NULL == entry) {
-			    if (FORWARD == dir) {
-				    *nHits = 0;
-			    } else {
-				    *nRCHits = 0;
-			    }
-		    } else {
-                GenomeLocation entryByValue = 0;
-                memcpy(&entryByValue, entry, locationSize);  // Assumes little endian
+            if (NULL == entries[i][FORWARD] && (largeHashTable || NULL == entries[i][RC]) && popularNHits[i][FORWARD] < 0 && popularNHits[i][RC] < 0) {
+                nHits[which] = 0;
+                nRCHits[which] = 0;
+                continue;
+            }
 
-                if (FORWARD == dir) {
-			        fillInLookedUpResults(entryByValue,  nHits, hits, singleHit);
-		        } else {
-			        fillInLookedUpResults(entryByValue,  nRCHits, rcHits, singleRCHit);
+            if (largeHashTable) {
+                fillInLookedUpResults(entryByValue[i][lookedUpComplement[i] ? 1 : 0], &nHits[which], &hits[which], &singleHits[which], decodeBuffer);
+                if (batchSeeds[i].isOwnReverseComplement()) {
+                    nRCHits[which] = nHits[which];
+                    rcHits[which] = hits[which];
+                } else {
+                    fillInLookedUpResults(entryByValue[i][lookedUpComplement[i] ? 0 : 1], &nRCHits[which], &rcHits[which], &singleRCHits[which], decodeBuffer);
                 }
-		    }
-		    seed = ~seed;
-        }	// For each direction    
+            } else {
+                if (popularNHits[i][FORWARD] >= 0) {
+                    nHits[which] = popularNHits[i][FORWARD];
+                    hits[which] = NULL;
+                } else if (NULL == entries[i][FORWARD]) {
+                    nHits[which] = 0;
+                } else {
+                    fillInLookedUpResults(entryByValue[i][FORWARD], &nHits[which], &hits[which], &singleHits[which], decodeBuffer);
+                }
+
+                if (popularNHits[i][RC] >= 0) {
+                    nRCHits[which] = popularNHits[i][RC];
+                    rcHits[which] = NULL;
+                } else if (NULL == entries[i][RC]) {
+                    nRCHits[which] = 0;
+                } else {
+                    fillInLookedUpResults(entryByValue[i][RC], &nRCHits[which], &rcHits[which], &singleRCHits[which], decodeBuffer);
+                }
+            }
+        }
     }
 }
 
-
-    void 
-GenomeIndex::fillInLookedUpResults(GenomeLocation lookedUpLocation, _int64 *nHits, const GenomeLocation **hits, GenomeLocation *singleHitLocation)
+    void
+GenomeIndex::lookupSeeds32(
+    const Seed *        seeds,
+    int                 nSeeds,
+    _int64 *            nHits,
+    const unsigned **   hits,
+    _int64 *            nRCHits,
+    const unsigned **   rcHits,
+    _int64              maxHitsWanted)
 {
-     //
-    // WARNING: the code in the IntersectingPairedEndAligner relies on being able to look at 
-    // hits[-1].  It doesn't care about the value, but it must not be a bogus pointer.  This
-    // is true with the current layout (where it will either be the hit count, the key or
-    // forward pointer in the hash table entry or some intermediate hit in the case where the
-    // search is constrained by minLocation/maxLocation).  If you change this, be sure to look
-    // at the code and fix it.  You don't need to worry about this in the case of singleHitLocation,
-    // that's the caller's problem.
-    //
-    if (lookedUpLocation < genome->getCountOfBases()) {
-        //
-        // It's a singleton.
-        //
-        *nHits = 1;
-        *hits = singleHitLocation;
-        *singleHitLocation = lookedUpLocation;
-     } else if (lookedUpLocation == InvalidGenomeLocation - 1) {
-        //
-        // It's unused, the other complement must exist.
-        //
-        _ASSERT(largeHashTable);
-        *nHits = 0;
-    } else {
+    _ASSERT(locationSize == 4);   // This is the caller's responsibility to check.
+
+    unsigned countOfBases = (unsigned)genome->getCountOfBases();
+
+    for (int batchStart = 0; batchStart < nSeeds; batchStart += MaxSeedLookupBatchSize) {
+        int batchSize = __min(MaxSeedLookupBatchSize, nSeeds - batchStart);
+        bool lookedUpComplement[MaxSeedLookupBatchSize];
+        const char *entries[MaxSeedLookupBatchSize][NUM_DIRECTIONS];
+        _int64 popularNHits[MaxSeedLookupBatchSize][NUM_DIRECTIONS];
+
+        Seed batchSeeds[MaxSeedLookupBatchSize];    // Masked for spaced seed indices
+        for (int i = 0; i < batchSize; i++) {
+            batchSeeds[i] = seeds[batchStart + i].masked(seedMask);
+        }
+
+        lookupSeedEntries(batchSeeds, batchSize, lookedUpComplement, entries, maxHitsWanted, popularNHits);
+
         //
-        // Multiple hits.  Recall that the overflow table format is first a count of
-        // the number of hits for that seed, followed by the list of hits.
+        // Find the subentry for each direction (cast OK because valueSize == 4), and prefetch the overflow table for any
+        // with multiple hits.
         //
-        _int64 overflowTableOffset = GenomeLocationAsInt64(lookedUpLocation) - genome->getCountOfBases();
+        const unsigned *subEntries[MaxSeedLookupBatchSize][NUM_DIRECTIONS];
+        for (int i = 0; i < batchSize; i++) {
+            for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+                if (largeHashTable) {
+                    subEntries[i][dir] = NULL == entries[i][FORWARD] ? NULL : (const unsigned *)entries[i][FORWARD] + dir;
+                } else {
+                    subEntries[i][dir] = (const unsigned *)entries[i][dir];
+                }
 
-        _ASSERT(overflowTableOffset < (_int64)overflowTableSize);
+                if (NULL != subEntries[i][dir] && *subEntries[i][dir] >= countOfBases && *subEntries[i][dir] != 0xfffffffe) {
+                    _mm_prefetch((const char *)&overflowTable32[*subEntries[i][dir] - countOfBases], _MM_HINT_T2);
+                }
+            }
+        }
 
-        _int64 hitCount = overflowTable64[overflowTableOffset];
+        for (int i = 0; i < batchSize; i++) {
+            int which = batchStart + i;
+            if (largeHashTable) {
+                if (popularNHits[i][FORWARD] >= 0) {
+                    nHits[which] = popularNHits[i][lookedUpComplement[i] ? 1 : 0];
+                    hits[which] = NULL;
+                    nRCHits[which] = batchSeeds[i].isOwnReverseComplement() ? nHits[which] : popularNHits[i][lookedUpComplement[i] ? 0 : 1];
+                    rcHits[which] = NULL;
+                    continue;
+                }
 
-        _ASSERT(hitCount >= 2);
-        _ASSERT(hitCount + overflowTableOffset < (_int64)overflowTableSize);
+                if (NULL == entries[i][FORWARD]) {
+                    nHits[which] = 0;
+                    nRCHits[which] = 0;
+                    continue;
+                }
 
-        *nHits = hitCount;
-        *hits = (const GenomeLocation *)&overflowTable64[overflowTableOffset + 1];
+                fillInLookedUpResults32(subEntries[i][lookedUpComplement[i] ? 1 : 0], &nHits[which], &hits[which]);
+                if (batchSeeds[i].isOwnReverseComplement()) {
+                    nRCHits[which] = nHits[which];
+                    rcHits[which] = hits[which];
+                } else {
+                    fillInLookedUpResults32(subEntries[i][lookedUpComplement[i] ? 0 : 1], &nRCHits[which], &rcHits[which]);
+                }
+            } else {
+                if (popularNHits[i][FORWARD] >= 0) {
+                    nHits[which] = popularNHits[i][FORWARD];
+                    hits[which] = NULL;
+                } else if (NULL == subEntries[i][FORWARD]) {
+                    nHits[which] = 0;
+                } else {
+                    fillInLookedUpResults32(subEntries[i][FORWARD], &nHits[which], &hits[which]);
+                }
+
+                if (popularNHits[i][RC] >= 0) {
+                    nRCHits[which] = popularNHits[i][RC];
+                    rcHits[which] = NULL;
+                } else if (NULL == subEntries[i][RC]) {
+                    nRCHits[which] = 0;
+                } else {
+                    fillInLookedUpResults32(subEntries[i][RC], &nRCHits[which], &rcHits[which]);
+                }
+            }
+        }
     }
 }
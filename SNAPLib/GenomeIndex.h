@@ -28,12 +28,64 @@ Revision History:
 #include "Seed.h"
 #include "Genome.h"
 #include "ApproximateCounter.h"
+#include "directions.h"
 #include "GenericFile_map.h"
 
+class IndexBuildReport;
+class SeedSketch;
+class SpliceJunctions;
+
+//
+// Indices with a compressed overflow table (index -compressOverflow) don't have their hit lists in memory in a form that
+// lookups can point to, so the lookups decode the lists they return into one of these, which belongs to the caller.  The
+// pointers they return stay good until the next reset().  Only the first maxHitsToDecode hits of each list are filled in,
+// since callers either skip seeds with more hits than that or only look at that many.  As in the overflow table, each list
+// has its count in front of it, so hits[-1] is valid.
+//
+class OverflowDecodeBuffer {
+public:
+    OverflowDecodeBuffer() : buffer(NULL), bufferSize(0), used(0), maxHitsToDecode(0) {}
+
+    void init(GenomeLocation *i_buffer, _int64 i_bufferSize, _int64 i_maxHitsToDecode) {
+        buffer = i_buffer;
+        bufferSize = i_bufferSize;
+        maxHitsToDecode = i_maxHitsToDecode;
+        used = 0;
+    }
+
+    void reset() {used = 0;}
+
+    //
+    // The number of GenomeLocations of buffer needed to return nLists lists between resets.
+    //
+    static _int64 getBufferSize(_int64 nLists, _int64 maxHitsToDecode) {
+        return nLists * (maxHitsToDecode + 1);
+    }
+
+private:
+    friend class GenomeIndex;
+
+    GenomeLocation  *buffer;
+    _int64           bufferSize;
+    _int64           used;
+    _int64           maxHitsToDecode;
+};
+
 class GenomeIndex {
 public:
     const Genome *getGenome() {return genome;}
 
+    //
+    // Build the genome's 2 bit per base copy for the aligners to use (see Genome::createPackedBases).
+    //
+    bool createPackedGenome() {return ((Genome *)genome)->createPackedBases();}
+
+    //
+    // How much memory the index takes: the hash tables, the overflow table and the genome (with its packed copy, if
+    // there is one).  The parts of a mapped index count at their mapped size, whether or not they're resident.
+    //
+    _int64 getMemoryFootprint() const;
+
     //
     // This looks up a seed and its reverse complement, and returns the number and list of hits for each.
     // It guarantees that if the lookup succeeds that hits[-1] and rcHits[-1] are valid memory with 
@@ -47,10 +99,61 @@ public:
     // be pointed to as a return value.  When only a single hit is returned, *hits == singleHit, so there's
     // no need to check on the caller's side.
     //
-    void lookupSeed(Seed seed, _int64 *nHits, const GenomeLocation **hits, _int64 *nRCHits, const GenomeLocation **rcHits, GenomeLocation *singleHit, GenomeLocation *singleRCHit);
+    // For indices with a compressed overflow table (which always have 64 bit locations), the 64 bit versions also need
+    // a decodeBuffer to put hit lists in.  It's ignored for other indices.
+    //
+    void lookupSeed(Seed seed, _int64 *nHits, const GenomeLocation **hits, _int64 *nRCHits, const GenomeLocation **rcHits, GenomeLocation *singleHit, GenomeLocation *singleRCHit,
+                    OverflowDecodeBuffer *decodeBuffer = NULL);
     void lookupSeed32(Seed seed, _int64 *nHits, const unsigned **hits, _int64 *nRCHits, const unsigned **rcHits);
 
+    //
+    // Batched versions of lookupSeed and lookupSeed32.  These look up nSeeds seeds at once, returning the
+    // results for seeds[i] in the i'th element of each of the output arrays, with the same semantics as the
+    // single seed versions (including hits[-1] and the singleHits storage).  Rather than taking the hash table
+    // and overflow table cache misses one seed at a time, they hash all of the seeds and prefetch their hash
+    // table buckets, then find the entries and prefetch any overflow table lists, and only then fill in the
+    // results.  Callers that know which seeds they'll want should prefer these.
+    //
+    // Callers that ignore seeds with more than some number of hits can say so with maxHitsWanted.  Then for a seed that the
+    // index's seed sketch knows has more hits than that, the counts are right but the hit lists may be NULL, which saves
+    // looking it up in the hash and overflow tables.
+    //
+    void lookupSeeds(const Seed *seeds, int nSeeds, _int64 *nHits, const GenomeLocation **hits, _int64 *nRCHits, const GenomeLocation **rcHits,
+                     GenomeLocation *singleHits, GenomeLocation *singleRCHits, OverflowDecodeBuffer *decodeBuffer = NULL, _int64 maxHitsWanted = INT64_MAX);
+    void lookupSeeds32(const Seed *seeds, int nSeeds, _int64 *nHits, const unsigned **hits, _int64 *nRCHits, const unsigned **rcHits,
+                       _int64 maxHitsWanted = INT64_MAX);
+
+    static const int MaxSeedLookupBatchSize = 32;   // lookupSeeds works through larger requests in chunks of this size
+
+    //
+    // Prefetch the hash table buckets for the non-overlapping seeds of a read (at offsets 0, seedLen, 2 * seedLen and so
+    // on, stepping over any with Ns), which are the first ones the aligners look up.  This is for callers that know about
+    // a read a while before they align it (see LookaheadReadSupplier).  For an out of core index, it asks the OS to
+    // start reading the buckets' pages in instead.
+    //
+    void prefetchSeedLookups(const char *bases, unsigned length) const;
+    inline void prefetchSeedLookup(Seed seed) const {
+        const SNAPHashTable *table = hashTables[seed.getHighBases(hashTableKeySize)];
+        if (outOfCore) {
+            StartPagingIn(table->GetLookupAddressForKey(seed.getLowBases(hashTableKeySize)), 64);    // A bucket's worth
+        } else {
+            table->PrefetchForKey(seed.getLowBases(hashTableKeySize));
+        }
+    }
+    bool isOutOfCore() const {return outOfCore;}
+
     bool doesGenomeIndexHave64BitLocations() const {return locationSize > 4;}
+    bool hasCompressedOverflowTable() const {return NULL != compressedOverflowTable;}
+
+    //
+    // Widen count locations of locationSize (5 to 8) bytes each, packed end to end as in the stored hit lists of a
+    // compressed overflow table, into 64 bit ones.  UnpackLocations is the best version for the processor; the others
+    // are public for the tests.
+    //
+    typedef void (*UnpackLocationsFunction)(const unsigned char *packed, unsigned locationSize, _int64 count, GenomeLocation *output);
+    static UnpackLocationsFunction UnpackLocations;
+    static void UnpackLocationsScalar(const unsigned char *packed, unsigned locationSize, _int64 count, GenomeLocation *output);
+    static void UnpackLocationsVector16(const unsigned char *packed, unsigned locationSize, _int64 count, GenomeLocation *output);
 
     //
     // Looks up a seed and its reverse complement, restricting the search to a given range of locations,
@@ -66,8 +169,44 @@ public:
         genome->prefetchData(genomeLocation);
     }
 
+    inline void prefetchGenomeData(GenomeLocation genomeLocation, GenomeDistance length) const {
+        genome->prefetchData(genomeLocation, length);
+    }
+
     inline int getSeedLength() const { return seedLen; }
 
+    //
+    // For indices built with -minimizer, the number of consecutive seeds in a minimizer window (see Minimizer.h).  Only
+    // the read's minimizers are worth looking up in these indices.  0 for indices that have every seed.
+    //
+    inline unsigned getMinimizerWindow() const { return minimizerWindow; }
+
+    //
+    // For indices built with -spacedSeed, which bases of each seed are indexed, two bits per base as in Seed (so all
+    // ones for ordinary indices).  The lookups mask the seeds they're given themselves, so callers don't need to.
+    //
+    inline _uint64 getSeedMask() const { return seedMask; }
+    inline bool isSpacedSeedIndex() const { return ~(_uint64)0 != seedMask; }
+
+    //
+    // Turn a -spacedSeed pattern (seedLen 0s and 1s, the 1s being the bases that count) into a seed mask.  Returns 0
+    // if it isn't one: the pattern has to start and end with 1 and read the same backward, so that a seed and its
+    // reverse complement keep the same bases.
+    //
+    static _uint64 SeedMaskForPattern(const char *pattern, int seedLen);
+
+    //
+    // An index built with -longSeedSize also has hash and overflow tables for a longer seed size (in the LongSeeds
+    // subdirectory), which share this index's genome.  This returns them as an index of their own, or NULL if there
+    // aren't any.  They belong to this index, so don't delete them.
+    //
+    inline GenomeIndex *getLongSeedIndex() const { return longSeedIndex; }
+
+    //
+    // The splice junction contigs of an index built with -gtf (see SpliceJunctions.h), or NULL.  They belong to the index.
+    //
+    inline const SpliceJunctions *getSpliceJunctions() const { return spliceJunctions; }
+
     virtual ~GenomeIndex();
 
     //
@@ -75,7 +214,52 @@ public:
     //
     static void runIndexer(int argc, const char **argv);
 
-    static GenomeIndex *loadFromDirectory(char *directoryName, bool map, bool prefetch);
+    //
+    // interleaveAcrossNumaNodes spreads the pages of the hash tables and overflow table evenly over the NUMA nodes, so that
+    // no one node's memory is the bottleneck for seed lookups from threads on all of them.  It's ignored for mapped indices.
+    //
+    // restrictToContigs is a comma separated list of contig names.  If it's given, only the part of the genome that holds
+    // those contigs is loaded, and the seed hits anywhere else are dropped from the index, so a worker that's aligning
+    // against one region doesn't need memory for the whole genome.  It doesn't work with map or compressed overflow tables.
+    //
+    // genomeToShare is for loading the LongSeeds part of an index, which has no genome of its own.
+    //
+    // outOfCore (-ooc) is for indices bigger than memory: the hash and overflow tables are mapped but not read in (and
+    // map and prefetch don't matter for them), the genome is read into memory, and prefetchSeedLookups starts paging in
+    // the hash table pages that the reads it's given will need, rather than prefetching them into cache.
+    //
+    static GenomeIndex *loadFromDirectory(char *directoryName, bool map, bool prefetch, bool interleaveAcrossNumaNodes = false, const char *restrictToContigs = NULL,
+                                          const Genome *genomeToShare = NULL, bool outOfCore = false);
+
+    //
+    // Load one copy of the index per NUMA node, each into memory local to its node, and return them in an array indexed
+    // by node.  Returns NULL if there's only one node or there isn't enough memory for all of the copies, in which case
+    // the caller should just load one.
+    //
+    static GenomeIndex **loadReplicasForNumaNodes(char *directoryName, bool prefetch, unsigned *nReplicas);
+
+    //
+    // The total size of the files in an index directory, which is about how much memory loading it will take.  Missing files
+    // count as empty, and packed ones (index -pack) as their unpacked size.
+    //
+    static _int64 getSizeOnDisk(const char *directoryName);
+
+    //
+    // Make sure there's a current copy of the index in directoryName in the shared memory file system (/dev/shm on Linux),
+    // copying it there if not, and return the name of the directory holding the copy (which the caller owns and should
+    // load with map).  Every process that does this for the same index maps the same pages, so there's only one copy
+    // in memory however many of them are running, and only the first one has to read the index from disk.  The copy
+    // stays in memory after they all exit, until somebody deletes it.  Returns NULL if there's no shared memory file
+    // system or the copy fails.
+    //
+    static char *getSharedMemoryCopy(const char *directoryName);
+
+    //
+    // Whether loadFromDirectory checks the files it reads against the checksums that index saved with them, and fails
+    // if they don't match.  The check is done as the files are read, but it can be turned off (-noVerifyIndex).  Mapped
+    // files (-map, -shm, -ooc) and restricted genomes aren't checked either way.
+    //
+    static bool VerifyChecksums;
 
     static void printBiasTables();
 
@@ -85,9 +269,17 @@ protected:
     unsigned hashTableKeySize;
     unsigned nHashTables;
     const Genome *genome;
+    GenomeIndex *longSeedIndex;     // Its genome is ours, so we clear it before deleting it
 
     bool largeHashTable;
     unsigned locationSize;
+    unsigned minimizerWindow;
+    _uint64 seedMask;
+    bool restrictedToContigs;   // Loaded with restrictToContigs, so a seed can have no hits in either direction
+    bool outOfCore;             // -ooc; see loadFromDirectory
+
+    bool loadGenomeSliceForContigs(const char *genomeFileName, unsigned chromosomePadding, const char *contigNames);
+    void compactTablesAfterDroppingHits(_int64 countOfBases);
 
     //
     // The overflow table is indexed by numbers > than the number of bases in the genome.
@@ -95,12 +287,26 @@ protected:
     // than one instance in the genome.  For locationSize <= 4, the table is made of 32
     // bit entries (and pointed to by overflowTable32), otherwise it's 64 bit entries.
     //
+    // For compressed indices, overflowTable64 is NULL and the hit lists are in compressedOverflowTable instead, which is
+    // overflowTableSize bytes.  See CompressOverflowTable for the format.
+    //
     _uint64 overflowTableSize;
     unsigned *overflowTable32;
     _int64 *overflowTable64;
+    const unsigned char *compressedOverflowTable;
 	GenericFile_map *mappedOverflowTable;
 
+    //
+    // The Bloom filter and popular seed counts that the lookups check first (see SeedSketch.h), if the index has one.
+    //
+    SeedSketch *seedSketch;
+
+    SpliceJunctions *spliceJunctions;
+
+    size_t overflowTableSizeInBytes;
+
     void *tablesBlob;   // All of the hash tables in one giant blob
+    size_t tablesBlobSize;
 	GenericFile_map *mappedTables;
 
     //
@@ -152,7 +358,41 @@ protected:
                                       bool computeBias, const char *directory,
                                       unsigned maxThreads, unsigned chromosomePaddingSize, bool forceExact, 
                                       unsigned hashTableKeySize, bool large, const char *histogramFileName,
-                                      unsigned locationSize, bool smallMemory);
+                                      unsigned locationSize, bool smallMemory, bool sortBuild, unsigned minimizerWindow,
+                                      const char *biasFileName, IndexBuildReport *report, _uint64 seedMask = ~(_uint64)0);
+
+    //
+    // index -report: record the index file sizes in the report and write it out, if reportFileName isn't NULL.
+    //
+    static void WriteBuildReport(IndexBuildReport *report, const char *directoryName, const char *reportFileName);
+
+    //
+    // For -minimizer builds, find the genome locations that are minimizers, and return a bitmap of them (bit i of word
+    // i / 64 for location i) to be freed with BigDealloc.  Also returns the number of minimizer locations and the
+    // number of locations that have seeds at all.
+    //
+    static _uint64 *ComputeMinimizerLocations(const Genome *genome, unsigned seedLen, unsigned windowSize, unsigned maxThreads,
+                                              _int64 *nMinimizerLocations, _int64 *nSeedLocations);
+
+    static inline bool IsMinimizerLocation(const _uint64 *minimizerLocations, GenomeLocation genomeLocation) {
+        _int64 location = GenomeLocationAsInt64(genomeLocation);
+        return NULL == minimizerLocations || 0 != (minimizerLocations[location / 64] & ((_uint64)1 << (location % 64)));
+    }
+
+    struct ComputeMinimizerLocationsThreadContext {
+        SingleWaiterObject              *doneObject;
+        volatile int                    *runningThreadCount;
+        const Genome                    *genome;
+        GenomeDistance                   genomeChunkStart;  // A multiple of 64, so each thread has its own bitmap words
+        GenomeDistance                   genomeChunkEnd;
+        unsigned                         seedLen;
+        unsigned                         windowSize;
+        _uint64                         *minimizerLocations;
+        volatile _int64                 *nMinimizerLocations;
+        volatile _int64                 *nSeedLocations;
+    };
+
+    static void ComputeMinimizerLocationsWorkerThreadMain(void *param);
 
  
     //
@@ -160,16 +400,89 @@ protected:
     //
     static SNAPHashTable** allocateHashTables(unsigned* o_nTables, GenomeDistance countOfBases, double slack,
         int seedLen, unsigned hashTableKeySize, bool large, unsigned locationSize, double* biasTable = NULL);
+
+    //
+    // Write the 'GenomeIndex' file, which holds the parameters of the index built into a directory.
+    //
+    static bool SaveIndexParameters(const char *directoryName, unsigned nHashTables, _uint64 overflowTableSize, int seedLen, unsigned chromosomePaddingSize,
+                                    unsigned hashTableKeySize, size_t hashTablesFileSize, bool large, unsigned locationSize, bool compressedOverflow = false,
+                                    unsigned minimizerWindow = 0, _uint64 seedMask = ~(_uint64)0);
+
+    //
+    // Rewrite the overflow table of the (64 bit location) index in directoryName in the compressed format, and point the
+    // hash tables at the new lists (index -compressOverflow).
+    //
+    static bool CompressOverflowTable(const char *directoryName, IndexBuildReport *report);
+
+    //
+    // Rewrite the hash tables of the index in directoryName as minimal perfect hashes (index -perfectHash).
+    //
+    static bool BuildPerfectHashTables(const char *directoryName, IndexBuildReport *report);
+
+    //
+    // Build the seed sketch (see SeedSketch.h) for the index in directoryName and save it there (index -seedSketch).
+    //
+    static bool BuildSeedSketch(const char *directoryName, IndexBuildReport *report);
+
+    //
+    // Build the tables for longSeedLen base seeds of the genome of the index in directoryName into its long seed
+    // subdirectory, with the post passes that the main tables got (index -longSeedSize).
+    //
+    static bool BuildLongSeedIndex(const char *directoryName, int longSeedLen, double slack, bool computeBias, unsigned maxThreads,
+                                    unsigned chromosomePaddingSize, bool forceExact, unsigned hashTableKeySize, bool large, unsigned locationSize,
+                                    bool smallMemory, bool sortBuild, unsigned minimizerWindow, const char *biasFileName,
+                                    bool compressOverflow, bool perfectHash, bool seedSketch);
+
+    //
+    // Replace the genome, hash table and overflow table files of the index in directoryName and its long seed tables with
+    // packed copies (index -pack, see GenericFile_packed.h).
+    //
+    static bool PackIndex(const char *directoryName, unsigned maxThreads, IndexBuildReport *report);
+
+    //
+    // Add the CRC-32 of each of the genome's bases, the hash table file and the overflow table file of the finished index
+    // in directoryName (and of its long seed tables) to its GenomeIndex file, on a line after the parameters, for
+    // loadFromDirectory to check.  Each file is read back with readInParallel, so the checksums are computed on as many
+    // threads as the reads.
+    //
+    static bool WriteIndexChecksums(const char *directoryName, IndexBuildReport *report);
+
+    //
+    // The number of hits for a value from a hash table entry.
+    //
+    _int64 countHitsForValue(_uint64 value) const;
     
-    static const unsigned GenomeIndexFormatMajorVersion = 5;
+    //
+    // Version 6 switched the hash tables to the cache-line bucketed layout (see HashTable.h).  We still load
+    // version 5 indices, whose hash tables use the flat layout; each table records its own layout.  Indices
+    // with compressed overflow tables or only minimizer seeds are otherwise the same as version 6, but get their
+    // own version so that older versions of SNAP refuse them rather than misreading the overflow table or quietly
+    // looking up seeds that aren't there.  Their GenomeIndex file has two more values: whether the overflow table
+    // is compressed and the minimizer window.  Spaced seed indices are version 8, with one more still: the seed mask.
+    //
+    static const unsigned GenomeIndexFormatMajorVersion = 6;
+    static const unsigned ExtendedGenomeIndexFormatMajorVersion = 7;
+    static const unsigned SpacedSeedGenomeIndexFormatMajorVersion = 8;
     static const unsigned GenomeIndexFormatMinorVersion = 0;
+    static const unsigned OldestSupportedGenomeIndexFormatMajorVersion = 5;
     
     static const unsigned largestBiasTable = 32;    // Can't be bigger than the biggest seed size, which is set in Seed.h.  Bigger than 32 means a new Seed structure.
     static const unsigned largestKeySize = 8;
     static double *hg19_biasTables[largestKeySize+1][largestBiasTable+1];
     static double *hg19_biasTables_large[largestKeySize+1][largestBiasTable+1];
 
-    static void ComputeBiasTable(const Genome* genome, int seedSize, double* table, unsigned maxThreads, bool forceExact, unsigned hashTableKeySize, bool large);
+    static bool ComputeBiasTable(const Genome* genome, int seedSize, double* table, unsigned maxThreads, bool forceExact, unsigned hashTableKeySize, bool large,
+                                 _uint64 seedMask);
+
+    //
+    // The bias table file for -biasFile.  LoadBiasTable returns false if the file doesn't have a table for this genome and
+    // these parameters.
+    //
+    static _uint64 ComputeGenomeChecksum(const Genome *genome);
+    static bool LoadBiasTable(const char *biasFileName, _uint64 genomeChecksum, GenomeDistance countOfBases, int seedLen, unsigned hashTableKeySize,
+                              bool large, bool forceExact, double *table, unsigned nHashTables);
+    static void SaveBiasTable(const char *biasFileName, _uint64 genomeChecksum, GenomeDistance countOfBases, int seedLen, unsigned hashTableKeySize,
+                              bool large, bool exact, const double *table, unsigned nHashTables);
 
     struct ComputeBiasTableThreadContext {
         SingleWaiterObject              *doneObject;
@@ -178,14 +491,13 @@ protected:
         GenomeDistance                   genomeChunkEnd;
         unsigned                         nHashTables;
         unsigned                         hashTableKeySize;
-        std::vector<ApproximateCounter> *approxCounters;
+        std::vector<ApproximateCounter> *approxCounters;    // Each thread has its own
         const Genome                    *genome;
         volatile _int64                 *nBasesProcessed;
         unsigned                         seedLen;
         volatile _int64                 *validSeeds;
 		bool							 large;
-
-        ExclusiveLock                   *approximateCounterLocks;
+        _uint64                          seedMask;
     };
 
     static void ComputeBiasTableWorkerThreadMain(void *param);
@@ -213,6 +525,7 @@ protected:
         unsigned                         hashTableKeySize;
 		bool							 large;
         unsigned                         locationSize;
+        const _uint64                   *minimizerLocations;        // NULL unless we're only indexing minimizers
 
 		//
 		// The "small memory" option causes SNAP to write out the backpointer table as it's
@@ -227,9 +540,19 @@ protected:
 		FILE							*backpointerSpillFile;
 
         ExclusiveLock                   *hashTableLocks;
-        ExclusiveLock                   *overflowTableLock;
+
+        //
+        // Each thread hands out overflow backpointers from its own chunk of the backpointer index space, so adding
+        // one doesn't touch any shared state.  Only when a chunk runs out does the thread go to nextOverflowBackpointer
+        // for another one.  This leaves unused holes at the ends of chunks, but they're never linked into any chain,
+        // so building the overflow table (which walks the chains) compacts them out.
+        //
+        _int64                           nextBackpointerInChunk;
+        _int64                           backpointerChunkEnd;
     };
 
+    static const _int64 OverflowBackpointerChunkSize = 64 * 1024;
+
     struct PerHashTableBatch {
         PerHashTableBatch() : nUsed(0) {}
 
@@ -281,9 +604,117 @@ protected:
     static void ApplyHashTableUpdate(BuildHashTablesThreadContext *context, _uint64 whichHashTable, GenomeLocation genomeLocation, _uint64 lowBases, bool usingComplement,
                     _int64 *bothComplementsUsed, _int64 *genomeLocationsInOverflowTable, _int64 *seedsWithMultipleOccurrences, bool large);
 
+    //
+    // The -sortbuild index builder.  Rather than inserting seeds into the hash tables as it finds them (which means
+    // random writes all over every table and a backpointer list for each repeated seed), it first counts the seeds that
+    // go in each hash table, then scatters (seed, location) records into a contiguous partition per table, radix sorts each
+    // partition and finally fills in its hash table and overflow table section in one sequential pass.  If all of the
+    // records won't fit in sortBuildMaxRecordsPerGroup, the tables are done in groups, rescanning the genome for each group.
+    // It writes the hash table and overflow table files itself, and sets index->overflowTableSize.
+    //
+    // It's also how -append extends an existing index: given the existing index, it only scans the part of the genome
+    // past the existing genome, and merges the resulting records with the existing hash table entries as it fills in
+    // each (newly allocated, and possibly larger) hash table.
+    //
+    struct SortBuildRecord {
+        _uint64             lowBases;
+        _uint64             locationAndComplement;     // The genome location, with SortBuildComplementFlag set if it's for the seed's complement
+    };
+
+    static const _uint64 SortBuildComplementFlag = (_uint64)1 << 63;
+    static const _int64 sortBuildMaxRecordsPerGroup = (_int64)256 * 1024 * 1024;
+
+    struct SortBuildThreadContext {
+        enum Phase {CountSeeds, ScatterSeeds, SortAndSizeHashTables, FillHashTables};
+
+        Phase                            phase;
+        unsigned                         whichThread;
+        unsigned                         nThreads;
+        SingleWaiterObject              *doneObject;
+        volatile int                    *runningThreadCount;
+        GenomeIndex                     *index;
+        const Genome                    *genome;
+        GenomeLocation                   genomeChunkStart;
+        GenomeLocation                   genomeChunkEnd;
+        unsigned                         seedLen;
+        unsigned                         hashTableKeySize;
+        bool                             large;
+        unsigned                         locationSize;
+        const _uint64                   *minimizerLocations;        // NULL unless we're only indexing minimizers
+        const GenomeIndex               *existingIndex;             // The index we're appending to, or NULL
+        GenomeDistance                   existingCountOfBases;
+
+        _int64                          *seedsPerHashTable;         // This thread's count of seeds for each hash table, filled in by CountSeeds
+        _int64                          *seedsInHashTable;          // The total over all threads, filled in after CountSeeds
+        _int64                          *nextRecordForHashTable;    // This thread's write cursor into records for each hash table in the group
+        unsigned                         firstHashTableInGroup;
+        unsigned                         hashTableLimitInGroup;
+        _int64                          *hashTableRecordStart;      // Where each hash table's records start in records (indexed by hash table)
+        SortBuildRecord                 *records;
+        SortBuildRecord                 *sortBuffer;
+        volatile _int64                 *nextHashTableToProcess;    // Shared work counter for the per hash table phases
+        _int64                          *overflowSizeOfHashTable;   // Overflow table entries needed by each hash table
+        _int64                          *overflowOffsetOfHashTable; // Where each hash table's overflow entries go in groupOverflowTable
+        _int64                           groupOverflowTableBase;    // The offset of groupOverflowTable in the whole overflow table
+        void                            *groupOverflowTable;
+
+        IndexBuildStats                  stats;
+        unsigned                        *histogram;                 // NULL if we're not building a histogram
+        _uint64                          countOfTooBigForHistogram;
+        _uint64                          sumOfTooBigForHistogram;
+        _uint64                          largestSeed;
+    };
+
+    static bool BuildHashTablesBySorting(GenomeIndex *index, const Genome *genome, unsigned seedLen, unsigned hashTableKeySize, bool large, unsigned locationSize,
+                                         unsigned maxThreads, const char *directoryName, FILE *histogramFile, size_t *totalBytesWritten,
+                                         const _uint64 *minimizerLocations, IndexBuildReport *report, const GenomeIndex *existingIndex = NULL);
+    static void RunSortBuildPhase(SortBuildThreadContext *contexts, unsigned nThreads, SortBuildThreadContext::Phase phase);
+    static void SortBuildWorkerThreadMain(void *param);
+    static void SortBuildRadixSort(SortBuildRecord *records, SortBuildRecord *buffer, _int64 nRecords, unsigned keySizeInBytes);
+    static void SortBuildCountExistingHits(const SortBuildThreadContext *context, const SNAPHashTable::ValueType *existingValues, _int64 *nHitsInDirection);
+    static _int64 SortBuildOverflowSizeForHits(const _int64 *nHitsInDirection);
+    static void SortBuildSetOverflowEntry(SortBuildThreadContext *context, _int64 whichEntry, _int64 value);
+    static void SortBuildFillEntry(SortBuildThreadContext *context, const SortBuildRecord *records, _int64 runStart, _int64 runEnd,
+                                   const SNAPHashTable::ValueType *existingValues, _int64 *overflowOffset, SNAPHashTable::ValueType *newEntry);
+
+    //
+    // index -append: add the contigs in a FASTA file to an existing index, reusing its genome and hash tables.
+    //
+    static bool AppendToIndex(const char *directoryName, const char *fastaFile, const char *pieceNameTerminatorCharacters,
+                              bool spaceIsAPieceNameTerminator, unsigned maxThreads, const char *histogramFileName, IndexBuildReport *report);
+    static void WriteSeedHistogram(FILE *histogramFile, const unsigned *histogram, unsigned maxHistogramEntry, _uint64 countOfTooBigForHistogram,
+                                   _uint64 sumOfTooBigForHistogram, _uint64 largestSeed);
+
+    static const unsigned maxHistogramEntry = 500000;
+
     static int BackwardsUnsignedCompare(const void *, const void *);
     static int BackwardsInt64Compare(const void *, const void *);
 
+    struct NumaReplicaLoadContext {
+        char                *directoryName;
+        bool                 prefetch;
+        unsigned             processor;     // A processor on the node we're loading for
+        GenomeIndex         *index;
+        SingleWaiterObject  *doneObject;
+        volatile int        *runningThreadCount;
+    };
+
+    static void NumaReplicaLoadThreadMain(void *param);
+
+    static const char *IndexFileNames[];    // All of the files in an index directory, GenomeIndex last
+    static const int nIndexFileNames;
+    static bool SharedMemoryCopyIsCurrent(const char *directoryName, const char *sharedDirectoryName);
+    static bool CopyFileContents(const char *fromFileName, const char *toFileName);
+    static void DeleteIndexDirectory(const char *directoryName);
+
+    //
+    // Move the named files (the last of which must be GenomeIndex) from the staging directory into the index directory,
+    // replacing the ones there.  The old GenomeIndex goes first, so if we stop part way the index won't load rather than
+    // loading a mix of old and new files.
+    //
+    static bool MoveStagedIndexFiles(const char *stagingDirectory, const char *directoryName, const char **fileNames, int nFileNames,
+                                     const char *callerName);
+
     GenomeIndex();
 
 
@@ -294,6 +725,25 @@ protected:
 						BuildHashTablesThreadContext*context,
                         GenomeLocation               genomeLocation);
 
+    //
+    // The hash table entry for seed (not its reverse complement), or NULL if it's not in the index.  This checks the seed sketch first.
+    //
+    void *findEntry(Seed seed) const;
+
     void fillInLookedUpResults32(const unsigned *subEntry, _int64 *nHits, const unsigned **hits);
-    void fillInLookedUpResults(GenomeLocation lookedUpLocation, _int64 *nHits, const GenomeLocation **hits, GenomeLocation *singleHitLocation);
+    void fillInLookedUpResults(GenomeLocation lookedUpLocation, _int64 *nHits, const GenomeLocation **hits, GenomeLocation *singleHitLocation,
+                               OverflowDecodeBuffer *decodeBuffer);
+    void decodeHitList(_int64 compressedOverflowTableOffset, _int64 *nHits, const GenomeLocation **hits, OverflowDecodeBuffer *decodeBuffer);
+    static size_t EncodeHitList(const _int64 *hits, _int64 nHits, unsigned locationSize, unsigned char *output);
+
+    //
+    // The first two stages of lookupSeeds: prefetch the hash table buckets for each seed, and then find the hash
+    // table entries.  For large hash tables only entries[i][0] is filled in (with the entry for the smaller of the seed
+    // and its reverse complement, lookedUpComplement[i] says which); otherwise entries[i][dir] is the entry for each direction.
+    //
+    // Entries that the seed sketch says aren't there are NULL without looking.  So are the ones it says have more than
+    // maxHitsWanted hits, and for those popularNHits has the count for each value of the entry (and is -1 otherwise).
+    //
+    void lookupSeedEntries(const Seed *seeds, int nSeeds, bool *lookedUpComplement, const char *(*entries)[NUM_DIRECTIONS],
+                           _int64 maxHitsWanted, _int64 (*popularNHits)[NUM_DIRECTIONS]);
 };
@@ -0,0 +1,149 @@
+/*++
+
+Module Name:
+
+    GzipBlockCodec.cpp
+
+Abstract:
+
+    Whole block gzip codecs.  See GzipBlockCodec.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "GzipBlockCodec.h"
+
+#ifdef SNAP_LIBDEFLATE
+
+#include "libdeflate.h"
+
+class LibdeflateBlockDecompressor : public GzipBlockDecompressor {
+public:
+    LibdeflateBlockDecompressor(libdeflate_decompressor *i_decompressor) : decompressor(i_decompressor) {}
+    virtual ~LibdeflateBlockDecompressor() {libdeflate_free_decompressor(decompressor);}
+
+    virtual bool decompressBlock(const char *input, size_t inputBytes, char *output, size_t outputBytes, size_t *o_outputWritten)
+    {
+        //
+        // libdeflate skips over the BGZF extra field like any other, and checks the CRC and length at the end.
+        //
+        return LIBDEFLATE_SUCCESS == libdeflate_gzip_decompress(decompressor, input, inputBytes, output, outputBytes, o_outputWritten);
+    }
+
+private:
+    libdeflate_decompressor *decompressor;
+};
+
+    GzipBlockDecompressor *
+GzipBlockDecompressor::Create()
+{
+    libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+    if (NULL == decompressor) {
+        return NULL;
+    }
+
+    return new LibdeflateBlockDecompressor(decompressor);
+}
+
+class LibdeflateBlockCompressor : public GzipBlockCompressor {
+public:
+    LibdeflateBlockCompressor(libdeflate_compressor *i_compressor) : compressor(i_compressor) {}
+    virtual ~LibdeflateBlockCompressor() {libdeflate_free_compressor(compressor);}
+
+    virtual bool compressBlock(bool bamFormat, const char *input, size_t inputBytes, char *output, size_t outputBytes, size_t *o_outputWritten);
+
+private:
+    libdeflate_compressor *compressor;
+};
+
+    bool
+LibdeflateBlockCompressor::compressBlock(bool bamFormat, const char *input, size_t inputBytes, char *output, size_t outputBytes, size_t *o_outputWritten)
+/*++
+
+Routine Description:
+
+    Without BAM format this is just a gzip member.  libdeflate doesn't write extra header fields, so for BGZF we write
+    the header with its BC field ourselves (the same bytes zlib would for our gz_header), then the raw deflate stream,
+    and then the CRC and length trailer.
+
+--*/
+{
+    if (!bamFormat) {
+        *o_outputWritten = libdeflate_gzip_compress(compressor, input, inputBytes, output, outputBytes);
+        return 0 != *o_outputWritten;
+    }
+
+    const size_t headerBytes = 18;
+    const size_t trailerBytes = 8;
+    if (outputBytes < headerBytes + trailerBytes) {
+        return false;
+    }
+
+    static const _uint8 bgzfHeader[headerBytes] = {
+        0x1f, 0x8b,             // gzip magic
+        8,                      // deflate
+        4,                      // FLG.FEXTRA
+        0, 0, 0, 0,             // MTIME
+        0,                      // XFL
+        0,                      // OS
+        6, 0,                   // XLEN
+        'B', 'C', 2, 0,         // BGZF subfield, 2 bytes long
+        0, 0                    // BSIZE, filled in below
+    };
+    memcpy(output, bgzfHeader, headerBytes);
+
+    size_t deflatedBytes = libdeflate_deflate_compress(compressor, input, inputBytes, output + headerBytes, outputBytes - headerBytes - trailerBytes);
+    if (0 == deflatedBytes) {
+        return false;
+    }
+
+    _uint8 *trailer = (_uint8 *)output + headerBytes + deflatedBytes;
+    _uint32 crc = libdeflate_crc32(0, input, inputBytes);
+    _uint32 isize = (_uint32)inputBytes;
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (_uint8)(crc >> (8 * i));
+        trailer[4 + i] = (_uint8)(isize >> (8 * i));
+    }
+
+    *o_outputWritten = headerBytes + deflatedBytes + trailerBytes;
+    if (*o_outputWritten > 0x10000) {
+        return false;   // BSIZE doesn't fit; let zlib report it
+    }
+    *(_uint16 *)(output + 16) = (_uint16)(*o_outputWritten - 1);
+
+    return true;
+}
+
+    GzipBlockCompressor *
+GzipBlockCompressor::Create(int level)
+{
+    //
+    // Older versions of libdeflate don't have level 0 (just storing the data), so they return NULL and zlib does it.
+    //
+    libdeflate_compressor *compressor = libdeflate_alloc_compressor(level);
+    if (NULL == compressor) {
+        return NULL;
+    }
+
+    return new LibdeflateBlockCompressor(compressor);
+}
+
+#else   // SNAP_LIBDEFLATE
+
+    GzipBlockDecompressor *
+GzipBlockDecompressor::Create()
+{
+    return NULL;
+}
+
+    GzipBlockCompressor *
+GzipBlockCompressor::Create(int level)
+{
+    return NULL;
+}
+
+#endif  // SNAP_LIBDEFLATE
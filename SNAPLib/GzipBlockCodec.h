@@ -0,0 +1,53 @@
+/*++
+
+Module Name:
+
+    GzipBlockCodec.h
+
+Abstract:
+
+    Headers for codecs that compress or decompress a whole gzip member (a BGZF block, say) in one call.
+
+    zlib is a streaming library, and it's slower than it has to be when the whole of the input and room for all of the
+    output are already there, which is always the case for the 64KB blocks of BAM files.  libdeflate does just that
+    job, and is two to three times faster at it.  It's optional: build with LIBDEFLATE_HOME set (see the Makefile) to get
+    it.  Without it, or if it can't be set up, Create returns NULL and the callers carry on with zlib, which is also
+    what they fall back on for a block the codec turns down, so zlib is the one that reports any errors.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class GzipBlockDecompressor {
+public:
+    virtual ~GzipBlockDecompressor() {}
+
+    //
+    // Decompress one whole gzip member into output, which must be big enough for all of it.  Returns false (having
+    // maybe written over output) if it can't, in which case the caller should go back to zlib.
+    //
+    virtual bool decompressBlock(const char *input, size_t inputBytes, char *output, size_t outputBytes, size_t *o_outputWritten) = 0;
+
+    static GzipBlockDecompressor *Create();     // One per thread.  NULL if there's nothing faster than zlib.
+};
+
+class GzipBlockCompressor {
+public:
+    virtual ~GzipBlockCompressor() {}
+
+    //
+    // Compress all of input into one gzip member in output, with a BGZF header (and its block size filled in) if
+    // bamFormat.  Returns false if it can't, in which case the caller should go back to zlib.
+    //
+    virtual bool compressBlock(bool bamFormat, const char *input, size_t inputBytes, char *output, size_t outputBytes, size_t *o_outputWritten) = 0;
+
+    static const int DefaultLevel = 6;          // What zlib's Z_DEFAULT_COMPRESSION means
+
+    static GzipBlockCompressor *Create(int level = DefaultLevel);  // One per thread.  NULL if there's nothing faster than zlib.
+};
@@ -24,8 +24,12 @@ Environment:
 #include "RangeSplitter.h"
 #include "Bam.h"
 #include "zlib.h"
+#include "GzipBlockCodec.h"
 #include "exit.h"
 #include "Error.h"
+#include "ProgressReport.h"
+#include "StageTiming.h"
+#include "PipelineTrace.h"
 
 using std::min;
 using std::max;
@@ -38,7 +42,8 @@ class GzipCompressWorkerManager : public ParallelWorkerManager
 public:
     GzipCompressWorkerManager(GzipWriterFilterSupplier* i_filterSupplier)
         : filterSupplier(i_filterSupplier), buffer(NULL),
-        chunkSize(i_filterSupplier->chunkSize), bam(i_filterSupplier->bamFormat)
+        chunkSize(i_filterSupplier->chunkSize), inputChunkSize(i_filterSupplier->inputChunkSize),
+        level(i_filterSupplier->compressionLevel), bam(i_filterSupplier->bamFormat)
     {}
 
     virtual ~GzipCompressWorkerManager();
@@ -54,7 +59,9 @@ public:
 private:
     VariableSizeVector<size_t> sizes;
     volatile int nChunks;
-    const size_t chunkSize;
+    const size_t chunkSize; // room for each compressed chunk in buffer
+    const size_t inputChunkSize;
+    const int level;
     const bool bam;
     FileEncoder* encoder;
     GzipWriterFilterSupplier* filterSupplier;
@@ -70,17 +77,19 @@ private:
 class GzipCompressWorker : public ParallelWorker
 {
 public:
-    GzipCompressWorker() : heap(NULL) {}
+    GzipCompressWorker(int level) : heap(NULL), blockCompressor(GzipBlockCompressor::Create(level)) {}
 
-    virtual ~GzipCompressWorker() { delete heap; }
+    virtual ~GzipCompressWorker() { delete heap; delete blockCompressor; }
 
     virtual void step();
 
-    static size_t compressChunk(z_stream& zstream, bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed);
+    static size_t compressChunk(z_stream& zstream, bool bamFormat, int level, char* toBuffer, size_t toSize, char* fromBuffer,
+        size_t fromUsed, GzipBlockCompressor* blockCompressor = NULL);
 
 private:
     z_stream zstream;
     ThreadHeap* heap;
+    GzipBlockCompressor* blockCompressor; // NULL to just use zlib
 };
 
 // used for case where each thread compresses by itself
@@ -120,7 +129,7 @@ GzipCompressWorkerManager::initialize(
     ParallelWorker*
 GzipCompressWorkerManager::createWorker()
 {
-    return new GzipCompressWorker();
+    return new GzipCompressWorker(level);
 }
 
     void
@@ -131,12 +140,12 @@ GzipCompressWorkerManager::beginStep()
         return;
     }
     encoder->getEncodeBatch(&input, &inputSize, &inputUsed);
-    nChunks = (int) ((inputUsed + chunkSize - 1) / chunkSize);
+    nChunks = (int) ((inputUsed + inputChunkSize - 1) / inputChunkSize);
     sizes.clear();
     sizes.extend(nChunks);
 
     if (buffer == NULL) {
-        buffer = (char*) BigAlloc(inputSize);
+        buffer = (char*) BigAlloc(((inputSize + inputChunkSize - 1) / inputChunkSize) * chunkSize);
     }
 }
 
@@ -146,18 +155,22 @@ GzipCompressWorkerManager::finishStep()
     if (filterSupplier->closing) {
         return;
     }
-    size_t toUsed = 0, logicalOffset, physicalOffset;
-    encoder->getOffsets(&logicalOffset, &physicalOffset);
+    size_t toUsed = 0, logicalOffset, physicalOffset, encodedBytes = 0;
+    for (int i = 0; i < nChunks; i++) {
+        encodedBytes += sizes[i];
+    }
+    encoder->getOffsets(encodedBytes, &logicalOffset, &physicalOffset);
     for (int i = 0; i < nChunks; i++) {
         translation.push_back(pair<_uint64,_uint64>(logicalOffset, physicalOffset + toUsed));
-        _ASSERT(i * chunkSize < inputUsed);
+        _ASSERT(i * inputChunkSize < inputUsed);
         _ASSERT(sizes[i] <= chunkSize);
-        size_t logicalChunk = min(chunkSize, inputUsed - i * chunkSize);
+        size_t logicalChunk = min(inputChunkSize, inputUsed - i * inputChunkSize);
         logicalOffset += logicalChunk;
         _ASSERT(((BgzfHeader*)(buffer + i * chunkSize))->validate(sizes[i], logicalChunk));
         memcpy(input + toUsed, buffer + i * chunkSize, sizes[i]);
         toUsed += sizes[i];
     }
+    _ASSERT(toUsed <= inputSize); // (see GzipWriterFilterSupplier::getBufferReserve)
     _ASSERT(BgzfHeader::validate(input, toUsed));
     encoder->setEncodedBatchSize(toUsed);
     filterSupplier->addTranslations(&translation);
@@ -175,16 +188,18 @@ GzipCompressWorker::step()
         zstream.opaque = heap;
     }
     //fprintf(stderr, "zip task thread %d begin\n", GetCurrentThreadId());
-    _int64 start = timeInMillis();
+    TIME_STAGE(CompressStage);
+    _int64 start = timeInNanos();
     int begin = (getThreadNum() * supplier->nChunks) / getNumThreads();
     int end = ((1 + getThreadNum()) * supplier->nChunks) / getNumThreads();
     for (int i = begin; i < end; i++) {
-        size_t bytes = min(supplier->chunkSize, supplier->inputUsed - i * supplier->chunkSize);
-        supplier->sizes[i] = compressChunk(zstream, supplier->bam,
+        size_t bytes = min(supplier->inputChunkSize, supplier->inputUsed - i * supplier->inputChunkSize);
+        supplier->sizes[i] = compressChunk(zstream, supplier->bam, supplier->level,
             supplier->buffer + i * supplier->chunkSize, supplier->chunkSize,
-            supplier->input + i * supplier->chunkSize, bytes);
+            supplier->input + i * supplier->inputChunkSize, bytes, blockCompressor);
         _ASSERT(supplier->sizes[i] <= supplier->chunkSize); // can't grow!
     }
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::CompressNanos, EndPipelineTraceSpan(CompressTraceEvent, start));
 }
 
 
@@ -192,15 +207,25 @@ GzipCompressWorker::step()
 GzipCompressWorker::compressChunk(
     z_stream& zstream,
     bool bamFormat,
+    int level,
     char* toBuffer,
     size_t toSize,
     char* fromBuffer,
-    size_t fromUsed)
+    size_t fromUsed,
+    GzipBlockCompressor* blockCompressor)
 {
     if (bamFormat && fromUsed > BAM_BLOCK) {
         WriteErrorMessage("exceeded BAM chunk size\n");
         soft_exit(1);
     }
+    size_t blockUsed;
+    if (blockCompressor != NULL && blockCompressor->compressBlock(bamFormat, fromBuffer, fromUsed, toBuffer, toSize, &blockUsed)) {
+        if (bamFormat && blockUsed >= BAM_BLOCK) {
+            WriteErrorMessage("exceeded BAM chunk size\n");
+            soft_exit(1);
+        }
+        return blockUsed;
+    }
     if (zstream.opaque != NULL) {
         ((ThreadHeap*)zstream.opaque)->reset();
     }
@@ -244,7 +269,7 @@ GzipCompressWorker::compressChunk(
     uInt oldAvail;
     int status;
 
-    status = deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits | GZIP_ENCODING, 8, Z_DEFAULT_STRATEGY);
+    status = deflateInit2(&zstream, level, Z_DEFLATED, windowBits | GZIP_ENCODING, 8, Z_DEFAULT_STRATEGY);
     if (status < 0) {
         WriteErrorMessage("GzipWriterFilter: deflateInit2 failed with %d\n", status);
         soft_exit(1);
@@ -341,9 +366,10 @@ DataWriterSupplier::gzip(
     size_t chunkSize,
     int numThreads,
     bool bindToProcessors,
-    bool multiThreaded)
+    bool multiThreaded,
+    int compressionLevel)
 {
-    return new GzipWriterFilterSupplier(bamFormat, chunkSize, numThreads, bindToProcessors, multiThreaded);
+    return new GzipWriterFilterSupplier(bamFormat, chunkSize, numThreads, bindToProcessors, multiThreaded, compressionLevel);
 }
 
     DataWriter::Filter*
@@ -373,13 +399,14 @@ GzipWriterFilterSupplier::onClosing(
         memcpy(buffer, eof, sizeof(eof));
         writer->advance(sizeof(eof));
 
-        // add final translation for last empty block
+        // add final translation for last empty block, so the end of the data is the start of the eof marker
+        // (which is also where the next part starts when this is a part of a file, see BAMSortedPartSupplier)
         writer->nextBatch();
         char* ignore;
         pair<_uint64,_uint64> last;
         size_t used;
         writer->getBatch(-1, &ignore, NULL, &used, (size_t*) &last.second, NULL, (size_t*) &last.first);
-        last.second += used;
+        last.second += used - sizeof(eof);
         translation.push_back(last);
 
         writer->close();
@@ -437,3 +464,26 @@ FileEncoder::gzip(
 {
     return new FileEncoder(numThreads, bindToProcessor, new GzipCompressWorkerManager(filterSupplier));
 }
+
+class GzipEncoderPool : public FileEncoderPool
+{
+public:
+    GzipEncoderPool(GzipWriterFilterSupplier* i_filterSupplier, int numThreads)
+        : FileEncoderPool(numThreads), filterSupplier(i_filterSupplier)
+    {}
+
+protected:
+    virtual ParallelWorkerManager* createManager()
+    { return new GzipCompressWorkerManager(filterSupplier); }
+
+private:
+    GzipWriterFilterSupplier* filterSupplier;
+};
+
+    FileEncoderPool*
+FileEncoderPool::gzip(
+    GzipWriterFilterSupplier* filterSupplier,
+    int numThreads)
+{
+    return new GzipEncoderPool(filterSupplier, numThreads);
+}
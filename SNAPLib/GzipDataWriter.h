@@ -36,7 +36,8 @@ using std::pair;
 class GzipWriterFilterSupplier : public DataWriter::FilterSupplier
 {
 public:
-    GzipWriterFilterSupplier(bool i_bamFormat, size_t i_chunkSize, int i_numThreads, bool i_bindToProcessors, bool i_multiThreaded)
+    GzipWriterFilterSupplier(bool i_bamFormat, size_t i_chunkSize, int i_numThreads, bool i_bindToProcessors, bool i_multiThreaded,
+        int i_compressionLevel)
     :
         FilterSupplier(DataWriter::ResizeFilter),
         bamFormat(i_bamFormat),
@@ -44,6 +45,8 @@ public:
         numThreads(i_numThreads),
         bindToProcessors(i_bindToProcessors),
         multiThreaded(i_multiThreaded),
+        compressionLevel(i_compressionLevel),
+        inputChunkSize(i_compressionLevel == 0 ? i_chunkSize - StoredChunkSlack : i_chunkSize),
         closing(false)
     {
         InitializeExclusiveLock(&lock);
@@ -56,8 +59,22 @@ public:
 
     const bool multiThreaded;
 
+    // zlib level, 0 (just stored) to 9
+    const int compressionLevel;
+
+    // bytes in the empty block written at the end of a BAM file
+    static const size_t BamEofSize = 28;
+
+    // stored data grows by its gzip header & trailer and the deflate block headers, so at level 0 each chunk
+    // takes this much less input to still fit (like htslib's 0xff00)
+    static const size_t StoredChunkSlack = 256;
+
     virtual DataWriter::Filter* getFilter();
 
+    // room for stored chunks to grow in place
+    virtual size_t getBufferReserve(size_t bufferSize)
+    { return compressionLevel != 0 ? 0 : (bufferSize / inputChunkSize + 1) * StoredChunkSlack; }
+
     virtual void onClosing(DataWriterSupplier* supplier);
     virtual void onClosed(DataWriterSupplier* supplier) {}
 
@@ -92,7 +109,8 @@ private:
     static bool translationComparator(const pair<_uint64,_uint64>& a, const pair<_uint64,_uint64>& b);
 
     const bool bamFormat;
-    const size_t chunkSize;
+    const size_t chunkSize; // compressed
+    const size_t inputChunkSize; // uncompressed
     const int numThreads;
     const bool bindToProcessors;
     ExclusiveLock lock;
@@ -24,12 +24,15 @@ Environment:
 #include "Error.h"
 #include "GenericFile_Blob.h"
 
+using std::vector;
+
 SNAPHashTable::SNAPHashTable(
     _int64      i_tableSize,
     unsigned    i_keySizeInBytes,
     unsigned    i_valueSizeInBytes,
     unsigned    i_valueCount,
-    _uint64     i_invalidValueValue)
+    _uint64     i_invalidValueValue,
+    bool        i_useBuckets)
 /*++
 
 Routine Description:
@@ -37,7 +40,9 @@ Routine Description:
     Constructor for a new, empty closed hash table.
 
 Arguments:
-    tableSize           - How many slots should the table have.
+    tableSize           - How many slots should the table have.  For bucketed tables this is rounded up
+                          to a whole number of buckets.
+    useBuckets          - Use the cache-line bucketed layout (with Robin Hood insertion) rather than the flat one.
 --*/
 {
     keySizeInBytes = i_keySizeInBytes;
@@ -47,6 +52,13 @@ Arguments:
     elementSize = keySizeInBytes + valueSizeInBytes * valueCount;
     tableSize = i_tableSize;
     usedElementCount = 0;
+    useBuckets = i_useBuckets;
+    robinHood = i_useBuckets;
+    perfectHash = false;
+    nPilots = nPositions = 0;
+    perfectHashIndex = NULL;
+    remap = NULL;
+    pilots = NULL;
     Table = NULL;
 
     if (tableSize <= 0) {
@@ -54,29 +66,77 @@ Arguments:
         return;
     }
 
-	Table = BigAlloc(tableSize * elementSize);
+    if (useBuckets) {
+        computeBucketGeometry();
+        nBuckets = (tableSize + entriesPerBucket - 1) / entriesPerBucket;
+        tableSize = nBuckets * entriesPerBucket;
+        chooseLookup();
+    }
+
+	Table = BigAlloc(getTableSizeInBytes());
     ownsMemoryForTable = true;
 
+    if (useBuckets) {
+        memset(Table, 0, getTableSizeInBytes());    // So the padding at the end of each bucket is deterministic in the saved file
+    }
+
     //
     // Run through the table and set all of the first values to invalidValueValue, which means
     // unused.
     //
 
     for (size_t i = 0; i < tableSize; i++) {
-        void *entry = getEntry(i);
-		_ASSERT(entry >= Table && entry <= (char *)Table + tableSize * elementSize);
-        clearKey(entry);
-        memcpy(getEntry(i), &invalidValueValue, valueSizeInBytes);
+        clearSlotKey(i);
+        memcpy(getSlotValues(i), &invalidValueValue, valueSizeInBytes);
     }
 }
 
+    void
+SNAPHashTable::computeBucketGeometry()
+{
+    _ASSERT(elementSize <= BucketSize);
+    entriesPerBucket = BucketSize / elementSize;
+    if (0 != tableSize) {
+        nBuckets = tableSize / entriesPerBucket;
+    }
+}
+
+    void
+SNAPHashTable::chooseLookup()
+/*++
+
+Routine Description:
+
+    Pick the bucketed lookup for this table's geometry.  The index builder only makes tables with 4 or 5 byte
+    locations, 1 or 2 of them, and keys are usually 4 or 5 bytes, so those get GetFirstValueForKeyInBucketsFixed.
+    Anything else takes the general version.
+
+--*/
+{
+#define FIXED_LOOKUP(k, v, c) if (keySizeInBytes == k && valueSizeInBytes == v && valueCount == c) {lookupInBuckets = &SNAPHashTable::GetFirstValueForKeyInBucketsFixed<k, v, c>; return;}
+    FIXED_LOOKUP(4, 4, 1) FIXED_LOOKUP(4, 4, 2) FIXED_LOOKUP(4, 5, 1) FIXED_LOOKUP(4, 5, 2)
+    FIXED_LOOKUP(5, 4, 1) FIXED_LOOKUP(5, 4, 2) FIXED_LOOKUP(5, 5, 1) FIXED_LOOKUP(5, 5, 2)
+#undef FIXED_LOOKUP
+
+    lookupInBuckets = &SNAPHashTable::GetFirstValueForKeyInBuckets;
+}
+
 SNAPHashTable *SNAPHashTable::loadFromBlob(GenericFile_Blob *loadFile)
 {
 	SNAPHashTable *table = loadCommon(loadFile);
 
 	size_t bytesMapped;
-	table->Table = loadFile->mapAndAdvance(table->tableSize * table->elementSize, &bytesMapped);
-	if (bytesMapped != table->tableSize * table->elementSize) {
+    if (table->perfectHash) {
+        char *perfectHashIndex = (char *)loadFile->mapAndAdvance(table->getPerfectHashIndexSizeInBytes(), &bytesMapped);
+        if (bytesMapped != table->getPerfectHashIndexSizeInBytes()) {
+            WriteErrorMessage("SNAPHashTable: unable to map perfect hash pilots\n");
+            soft_exit(1);
+        }
+        table->setPerfectHashIndex(perfectHashIndex);
+    }
+
+	table->Table = loadFile->mapAndAdvance(table->getTableSizeInBytes(), &bytesMapped);
+	if (bytesMapped != table->getTableSizeInBytes()) {
 		WriteErrorMessage("SNAPHashTable: unable to map table\n");
 		soft_exit(1);
 	}
@@ -88,8 +148,12 @@ SNAPHashTable *SNAPHashTable::loadFromBlob(GenericFile_Blob *loadFile)
 SNAPHashTable *SNAPHashTable::loadFromGenericFile(GenericFile *loadFile)
 {
 	SNAPHashTable *table = loadCommon(loadFile);
-	table->Table = BigAlloc(table->tableSize * table->elementSize);
-	loadFile->read(table->Table, table->tableSize * table->elementSize);
+    if (table->perfectHash) {
+        table->setPerfectHashIndex((char *)BigAlloc(__max(table->getPerfectHashIndexSizeInBytes(), (size_t)1)));
+        loadFile->read(table->perfectHashIndex, table->getPerfectHashIndexSizeInBytes());
+    }
+	table->Table = BigAlloc(table->getTableSizeInBytes());
+	loadFile->read(table->Table, table->getTableSizeInBytes());
 	table->ownsMemoryForTable = true;
 
 	return table;
@@ -105,10 +169,14 @@ SNAPHashTable *SNAPHashTable::loadCommon(GenericFile *loadFile)
         soft_exit(1);
     }
 
-    if (fileMagic != magic) {
+    if (fileMagic != magic && fileMagic != bucketedMagic && fileMagic != robinHoodMagic && fileMagic != perfectHashMagic) {
         WriteErrorMessage("SNAPHashTable: magic number mismatch.  Perhaps you have a corruped index.  %d != %d\n", fileMagic, magic);
         soft_exit(1);
     }
+
+    table->useBuckets = (fileMagic == bucketedMagic || fileMagic == robinHoodMagic);
+    table->robinHood = (fileMagic == robinHoodMagic);   // Older bucketed tables weren't built in probe order, so their lookups can't stop early
+    table->perfectHash = (fileMagic == perfectHashMagic);
  
     if (sizeof(table->tableSize) != loadFile->read(&table->tableSize, sizeof(table->tableSize))) {
         WriteErrorMessage("SNAPHashTable::SNAPHashTable fread table size failed\n");
@@ -169,15 +237,57 @@ SNAPHashTable *SNAPHashTable::loadCommon(GenericFile *loadFile)
 
     table->elementSize = table->keySizeInBytes + table->valueSizeInBytes * table->valueCount;
 
+    if (table->perfectHash) {
+        if (sizeof(table->nPilots) != loadFile->read(&table->nPilots, sizeof(table->nPilots)) ||
+            sizeof(table->nPositions) != loadFile->read(&table->nPositions, sizeof(table->nPositions))) {
+            WriteErrorMessage("SNAPHashTable: unable to read perfect hash table header\n");
+            soft_exit(1);
+        }
 
+        if (0 == table->nPilots || table->nPositions < table->tableSize || table->usedElementCount != table->tableSize) {
+            WriteErrorMessage("SNAPHashTable: perfect hash table has %lld pilots, %lld positions, %lld slots and %lld entries.  Index corrupt.\n",
+                (_int64)table->nPilots, (_int64)table->nPositions, (_int64)table->tableSize, (_int64)table->usedElementCount);
+            soft_exit(1);
+        }
+    }
+
+    if (table->useBuckets) {
+        table->computeBucketGeometry();
+        table->chooseLookup();
+        if (table->nBuckets * table->entriesPerBucket != table->tableSize) {
+            WriteErrorMessage("SNAPHashTable: bucketed table size %lld isn't a multiple of the bucket entry count %d.  Index corrupt.\n", (_int64)table->tableSize, table->entriesPerBucket);
+            soft_exit(1);
+        }
+
+        //
+        // Bucketed tables pad their header out to a full bucket so that the buckets in a loaded blob stay cache line aligned.
+        //
+        size_t headerSize = bucketedHeaderSize(table->valueSizeInBytes);
+        if (headerSize < BucketSize) {
+            char padding[BucketSize];
+            if (BucketSize - headerSize != loadFile->read(padding, BucketSize - headerSize)) {
+                WriteErrorMessage("SNAPHashTable: unable to read bucketed table header padding\n");
+                soft_exit(1);
+            }
+        }
+    }
 
     return table;
 }
 
+    size_t
+SNAPHashTable::bucketedHeaderSize(unsigned valueSizeInBytes)
+{
+    return sizeof(magic) + sizeof(tableSize) + sizeof(usedElementCount) + sizeof(keySizeInBytes) + sizeof(valueSizeInBytes) + sizeof(valueCount) + valueSizeInBytes;
+}
+
 SNAPHashTable::~SNAPHashTable()
 {
     if (ownsMemoryForTable) {
         BigDealloc(Table);
+        if (NULL != perfectHashIndex) {
+            BigDealloc(perfectHashIndex);
+        }
     }
 }
 
@@ -200,7 +310,8 @@ bool
 SNAPHashTable::saveToFile(FILE *saveFile, size_t *bytesWritten) 
 {
     *bytesWritten = 0;
-    if (1 != fwrite(&magic,sizeof(magic), 1, saveFile)) {
+    const unsigned *fileMagic = perfectHash ? &perfectHashMagic : robinHood ? &robinHoodMagic : (useBuckets ? &bucketedMagic : &magic);
+    if (1 != fwrite(fileMagic, sizeof(magic), 1, saveFile)) {
         WriteErrorMessage("SNAPHashTable::SNAPHashTable fwrite magic number failed\n");
         return false;
     }    
@@ -242,10 +353,30 @@ SNAPHashTable::saveToFile(FILE *saveFile, size_t *bytesWritten)
     }
     (*bytesWritten) += valueSizeInBytes;
 
+    if (perfectHash) {
+        if (1 != fwrite(&nPilots, sizeof(nPilots), 1, saveFile) || 1 != fwrite(&nPositions, sizeof(nPositions), 1, saveFile) ||
+            getPerfectHashIndexSizeInBytes() != fwrite(perfectHashIndex, 1, getPerfectHashIndexSizeInBytes(), saveFile)) {
+            WriteErrorMessage("SNAPHashTable: fwrite perfect hash pilots failed\n");
+            return false;
+        }
+        (*bytesWritten) += sizeof(nPilots) + sizeof(nPositions) + getPerfectHashIndexSizeInBytes();
+    }
+
+    if (useBuckets) {
+        _ASSERT(*bytesWritten == bucketedHeaderSize(valueSizeInBytes));
+        char padding[BucketSize];
+        memset(padding, 0, sizeof(padding));
+        if (1 != fwrite(padding, BucketSize - *bytesWritten, 1, saveFile)) {
+            WriteErrorMessage("SNAPHashTable: fwrite header padding failed\n");
+            return false;
+        }
+        (*bytesWritten) = BucketSize;
+    }
+
     size_t maxWriteSize = 100 * 1024 * 1024;
     size_t writeOffset = 0;
-    while (writeOffset < tableSize * elementSize) {
-        size_t amountToWrite = __min(maxWriteSize,tableSize * elementSize - writeOffset);
+    while (writeOffset < getTableSizeInBytes()) {
+        size_t amountToWrite = __min(maxWriteSize,getTableSizeInBytes() - writeOffset);
         size_t thisWrite = fwrite((char*)Table + writeOffset, 1, amountToWrite, saveFile);
         if (thisWrite < amountToWrite) {
             WriteErrorMessage("SNAPHashTable::saveToFile: fwrite failed, %d\n"
@@ -262,12 +393,17 @@ SNAPHashTable::saveToFile(FILE *saveFile, size_t *bytesWritten)
 _int64 nCallsToGetEntryForKey = 0;
 _int64 nProbesInGetEntryForKey = 0;
 
-void *
-SNAPHashTable::getEntryForKey(KeyType key) const
+_int64
+SNAPHashTable::getSlotForKey(KeyType key) const
 {
     nCallsToGetEntryForKey++;
 
-    _uint64 tableIndex = hash(key) % tableSize;
+    //
+    // For bucketed tables we probe whole buckets rather than individual slots, and then look through
+    // the bucket in order.
+    //
+    _uint64 nProbeUnits = useBuckets ? nBuckets : tableSize;
+    _uint64 tableIndex = hash(key) % nProbeUnits;
 
     bool wrapped = false;
     _uint64 nProbes = 1;
@@ -275,8 +411,16 @@ SNAPHashTable::getEntryForKey(KeyType key) const
     //
     // Chain through the table until we hit either a match on the key or an unused element
     //
-    void *entry = getEntry(tableIndex);
-    while (!isKeyEqual(entry, key) && !doesEntryHaveInvalidValue(entry)) {
+    for (;;) {
+        unsigned slotsInUnit = useBuckets ? entriesPerBucket : 1;
+        for (unsigned i = 0; i < slotsInUnit; i++) {
+            _uint64 slot = tableIndex * slotsInUnit + i;
+            if (isSlotKeyEqual(slot, key) || doesEntryHaveInvalidValue(getSlotValues(slot))) {
+                nProbesInGetEntryForKey++;
+                return (_int64)slot;
+            }
+        }
+
         nProbesInGetEntryForKey++;
 
         if (nProbes < QUADRATIC_CHAINING_DEPTH) {
@@ -287,20 +431,14 @@ SNAPHashTable::getEntryForKey(KeyType key) const
 
         nProbes++;
 
-        if (tableIndex >= tableSize) {
+        if (tableIndex >= nProbeUnits) {
             if (wrapped) {
-                return NULL;
+                return -1;
             }
             wrapped = true;
-            tableIndex = tableIndex % tableSize;
+            tableIndex = tableIndex % nProbeUnits;
         }
-
-        entry = getEntry(tableIndex);
     }
-
-    nProbesInGetEntryForKey++;
-
-    return entry;
 }
 
 
@@ -308,36 +446,293 @@ SNAPHashTable::getEntryForKey(KeyType key) const
     SNAPHashTable::ValueType * 
 SNAPHashTable::SlowLookup(KeyType key)
 {
-    void *entry = getEntryForKey(key);
+    if (perfectHash) {
+        return GetFirstValueForKey(key);
+    }
+
+    _int64 slot = getSlotForKey(key);
 
-    if (NULL == entry || doesEntryHaveInvalidValue(entry)) {
+    if (-1 == slot || doesEntryHaveInvalidValue(getSlotValues(slot))) {
         return NULL;
     }
 
-    return (ValueType *)entry;
+    return (ValueType *)getSlotValues(slot);
 }
 
     bool 
 SNAPHashTable::Insert(KeyType key, ValueType *data)
 {
-    void *entry = getEntryForKey(key);
+    if (robinHood) {
+        return insertRobinHood(key, data);
+    }
+
+    if (perfectHash) {
+        return false;
+    }
+
+    _int64 slot = getSlotForKey(key);
 
-    if (NULL == entry) {
+    if (-1 == slot) {
         return false;
     }
 
-	if (!isKeyEqual(entry, key)) {
-		setKey(entry, key);
+	if (!isSlotKeyEqual(slot, key)) {
+		setSlotKey(slot, key);
 		usedElementCount++;
 	}
 
+    char *values = (char *)getSlotValues(slot);
     for (unsigned i = 0; i < valueCount; i++) {
-        memcpy((char *)entry + i * valueSizeInBytes, &data[i], valueSizeInBytes);   // Assumes little endian
+        memcpy(values + i * valueSizeInBytes, &data[i], valueSizeInBytes);   // Assumes little endian
     }
 
     return true;
 }
 
 
+    bool
+SNAPHashTable::insertRobinHood(KeyType key, ValueType *data)
+/*++
+
+Routine Description:
+
+    Insert for Robin Hood tables.  Walk the key's probe sequence, and at each full bucket swap it with the entry
+    that has the smallest probe number there if that's smaller than the key's own, then carry on inserting the
+    entry that was swapped out from where it was.  See getBucketProbeNumber() in HashTable.h.
+
+--*/
+{
+    char *existingValues = (char *)GetFirstValueForKey(key);
+    if (NULL == existingValues) {
+        if (usedElementCount >= tableSize) {
+            return false;
+        }
+    } else {
+        for (unsigned i = 0; i < valueCount; i++) {
+            memcpy(existingValues + i * valueSizeInBytes, &data[i], valueSizeInBytes);   // Assumes little endian
+        }
+        return true;
+    }
+
+    const unsigned valuesSize = valueCount * valueSizeInBytes;
+    char carriedValues[2 * sizeof(ValueType)];
+    for (unsigned i = 0; i < valueCount; i++) {
+        memcpy(carriedValues + i * valueSizeInBytes, &data[i], valueSizeInBytes);   // Assumes little endian
+    }
+
+    KeyType carriedKey = key;
+    _uint64 homeBucket = hash(key) % nBuckets;
+    _uint64 bucketIndex = homeBucket;
+    _uint64 nProbes = 0;
+
+    //
+    // There's a free slot somewhere, and each swap puts a larger probe number in a slot, so this ends.
+    //
+    for (;;) {
+        _uint64 poorestSlot = 0;
+        _uint64 poorestProbeNumber = getBucketProbeNumber(homeBucket, bucketIndex);
+        bool foundPoorer = false;
+
+        for (unsigned i = 0; i < entriesPerBucket; i++) {
+            _uint64 slot = bucketIndex * entriesPerBucket + i;
+            char *slotValues = (char *)getSlotValues(slot);
+            if (doesEntryHaveInvalidValue(slotValues)) {
+                setSlotKey(slot, carriedKey);
+                memcpy(slotValues, carriedValues, valuesSize);
+                usedElementCount++;
+                return true;
+            }
+
+            _uint64 slotProbeNumber = getSlotProbeNumber(slot);
+            if (slotProbeNumber < poorestProbeNumber) {
+                poorestSlot = slot;
+                poorestProbeNumber = slotProbeNumber;
+                foundPoorer = true;
+            }
+        }
+
+        if (foundPoorer) {
+            KeyType displacedKey = 0;
+            char displacedValues[2 * sizeof(ValueType)];
+            memcpy(&displacedKey, getSlotKey(poorestSlot), keySizeInBytes);
+            memcpy(displacedValues, getSlotValues(poorestSlot), valuesSize);
+
+            setSlotKey(poorestSlot, carriedKey);
+            memcpy(getSlotValues(poorestSlot), carriedValues, valuesSize);
+
+            carriedKey = displacedKey;
+            memcpy(carriedValues, displacedValues, valuesSize);
+            homeBucket = hash(carriedKey) % nBuckets;
+            nProbes = poorestProbeNumber;
+        }
+
+        nProbes++;
+        if (nProbes < QUADRATIC_CHAINING_DEPTH) {
+            bucketIndex = (bucketIndex + nProbes * nProbes) % nBuckets;
+        } else {
+            bucketIndex = (bucketIndex + 1) % nBuckets;
+        }
+    }
+}
+
+    SNAPHashTable *
+SNAPHashTable::BuildPerfectHash(const SNAPHashTable *source)
+/*++
+
+Routine Description:
+
+    Build a perfect hash copy of a table, the way PTHash does: sort the keys into pilot buckets, and then, biggest
+    bucket first, try pilot values in order until all of the bucket's keys land on distinct unused positions.  The
+    big buckets go first while most positions are free, and by the time the table is nearly full only buckets with
+    a key or two are left, so a pilot turns up quickly (with 1% spare positions, in a hundred or so tries).
+
+--*/
+{
+    _uint64 nKeys = source->GetUsedElementCount();
+    if (0 == nKeys) {
+        return NULL;
+    }
+
+    SNAPHashTable *table = new SNAPHashTable();
+    table->keySizeInBytes = source->keySizeInBytes;
+    table->valueSizeInBytes = source->valueSizeInBytes;
+    table->valueCount = source->valueCount;
+    table->invalidValueValue = source->invalidValueValue;
+    table->elementSize = source->elementSize;
+    table->tableSize = nKeys;
+    table->usedElementCount = nKeys;
+    table->useBuckets = false;
+    table->robinHood = false;
+    table->perfectHash = true;
+    table->nPilots = (nKeys + AverageKeysPerPilot - 1) / AverageKeysPerPilot;
+    table->nPositions = nKeys + nKeys / 100 + 1;
+    table->setPerfectHashIndex((char *)BigAlloc(table->getPerfectHashIndexSizeInBytes()));
+    table->Table = BigAlloc(table->getTableSizeInBytes());
+    table->ownsMemoryForTable = true;
+
+    //
+    // Sort the source slots by pilot with a counting sort, and then the pilots by how many keys they have.
+    //
+    _uint64 *keyHashes = (_uint64 *)BigAlloc(nKeys * sizeof(_uint64));
+    _uint64 *sourceSlots = (_uint64 *)BigAlloc(nKeys * sizeof(_uint64));
+    _uint64 *pilotStarts = (_uint64 *)BigAlloc((table->nPilots + 1) * sizeof(_uint64));
+    memset(pilotStarts, 0, (table->nPilots + 1) * sizeof(_uint64));
+
+    KeyType key;
+    ValueType values[2];
+    for (_uint64 slot = 0; slot < source->GetTableSize(); slot++) {
+        if (source->GetSlotContents(slot, &key, values)) {
+            pilotStarts[(hash(key) >> 32) % table->nPilots + 1]++;
+        }
+    }
+
+    _uint64 maxKeysPerPilot = 0;
+    for (_uint64 whichPilot = 0; whichPilot < table->nPilots; whichPilot++) {
+        maxKeysPerPilot = __max(maxKeysPerPilot, pilotStarts[whichPilot + 1]);
+        pilotStarts[whichPilot + 1] += pilotStarts[whichPilot];
+    }
+
+    vector<_uint64> pilotFill(pilotStarts, pilotStarts + table->nPilots);
+    for (_uint64 slot = 0; slot < source->GetTableSize(); slot++) {
+        if (source->GetSlotContents(slot, &key, values)) {
+            _uint64 keyHash = hash(key);
+            _uint64 where = pilotFill[(keyHash >> 32) % table->nPilots]++;
+            keyHashes[where] = keyHash;
+            sourceSlots[where] = slot;
+        }
+    }
+
+    vector<_uint64> pilotOrder;
+    pilotOrder.reserve(table->nPilots);
+    for (_uint64 nKeysInPilot = maxKeysPerPilot; nKeysInPilot > 0; nKeysInPilot--) {
+        for (_uint64 whichPilot = 0; whichPilot < table->nPilots; whichPilot++) {
+            if (pilotStarts[whichPilot + 1] - pilotStarts[whichPilot] == nKeysInPilot) {
+                pilotOrder.push_back(whichPilot);
+            }
+        }
+    }
+
+    //
+    // Find the pilots.
+    //
+    vector<bool> positionUsed(table->nPositions, false);
+    vector<_uint64> positions(maxKeysPerPilot);
+    memset(table->pilots, 0, table->nPilots * sizeof(*table->pilots));
+    bool worked = true;
+
+    for (size_t i = 0; worked && i < pilotOrder.size(); i++) {
+        _uint64 whichPilot = pilotOrder[i];
+        _uint64 nKeysInPilot = pilotStarts[whichPilot + 1] - pilotStarts[whichPilot];
+        const _uint64 *pilotKeyHashes = keyHashes + pilotStarts[whichPilot];
+
+        unsigned pilot;
+        for (pilot = 0; pilot <= MaxPilot; pilot++) {
+            _uint64 nPlaced;
+            for (nPlaced = 0; nPlaced < nKeysInPilot; nPlaced++) {
+                _uint64 position = (pilotKeyHashes[nPlaced] ^ pilotHash(pilot)) % table->nPositions;
+                if (positionUsed[position]) {
+                    break;
+                }
+                positionUsed[position] = true;     // So that the pilot's other keys don't collide with it
+                positions[nPlaced] = position;
+            }
+
+            if (nPlaced == nKeysInPilot) {
+                break;
+            }
+
+            for (_uint64 j = 0; j < nPlaced; j++) {
+                positionUsed[positions[j]] = false;
+            }
+        }
+
+        if (pilot > MaxPilot) {
+            worked = false;
+        } else {
+            table->pilots[whichPilot] = (_uint16)pilot;
+        }
+    }
+
+    if (worked) {
+        //
+        // Point each spare position that's in use at a slot that isn't, and then copy the entries.
+        //
+        _uint64 nextFreeSlot = 0;
+        for (_uint64 position = table->tableSize; position < table->nPositions; position++) {
+            table->remap[position - table->tableSize] = 0;
+            if (positionUsed[position]) {
+                while (positionUsed[nextFreeSlot]) {
+                    nextFreeSlot++;
+                }
+                table->remap[position - table->tableSize] = nextFreeSlot++;
+            }
+        }
+
+        for (_uint64 whichKey = 0; whichKey < nKeys; whichKey++) {
+            _uint64 keyHash = keyHashes[whichKey];
+            _uint64 position = (keyHash ^ pilotHash(table->pilots[(keyHash >> 32) % table->nPilots])) % table->nPositions;
+            if (position >= table->tableSize) {
+                position = table->remap[position - table->tableSize];
+            }
+
+            memcpy(table->getEntry(position), source->getSlotValues(sourceSlots[whichKey]), table->valueSizeInBytes * table->valueCount);
+            memcpy((char *)table->getEntry(position) + table->valueSizeInBytes * table->valueCount, source->getSlotKey(sourceSlots[whichKey]), table->keySizeInBytes);
+        }
+    }
+
+    BigDealloc(keyHashes);
+    BigDealloc(sourceSlots);
+    BigDealloc(pilotStarts);
+
+    if (!worked) {
+        delete table;
+        return NULL;
+    }
+
+    return table;
+}
 
 const unsigned SNAPHashTable::magic = 0xb111b010;
+const unsigned SNAPHashTable::bucketedMagic = 0xb111b011;
+const unsigned SNAPHashTable::robinHoodMagic = 0xb111b012;
+const unsigned SNAPHashTable::perfectHashMagic = 0xb111b013;
@@ -36,7 +36,8 @@ class SNAPHashTable {
             unsigned    i_keySizeInBytes,
             unsigned    i_valueSizeInBytes,
             unsigned    i_valueCount,
-            _uint64		i_invalidValueValue);
+            _uint64		i_invalidValueValue,
+            bool        i_useBuckets = false);
 
         //
         // Load from file.
@@ -51,24 +52,65 @@ class SNAPHashTable {
         bool saveToFile(FILE *saveFile, size_t *bytesWritten);
 
         //
-        // Fails if either the table is full or key already exists.  Inserts ALL
-        // values for a key.
+        // Fails if the table is full or is a perfect hash.  If the key already exists, overwrites its values.  Inserts ALL
+        // values for a key.  For Robin Hood tables this can move other entries, so it invalidates any
+        // pointers from GetFirstValueForKey or SlowLookup.
         //
         bool Insert(KeyType key, ValueType *data);
 
         size_t GetUsedElementCount() const {return usedElementCount;}
         size_t GetTableSize() const {return tableSize;}
+        size_t GetTableSizeInBytes() const {return getTableSizeInBytes();}
 
         unsigned GetKeySizeInBytes() const {return keySizeInBytes;}
         unsigned GetValueSizeInBytes() const {return valueSizeInBytes;}
         unsigned GetValueCount() const {return valueCount;}
+        bool UsesBuckets() const {return useBuckets;}
+        bool UsesRobinHood() const {return robinHood;}
+        bool UsesPerfectHash() const {return perfectHash;}
+
+        //
+        // Make a copy of a table in the perfect hash layout (see GetFirstValueForKeyInPerfectHash), which has no empty
+        // slots and can't be inserted into.  Returns NULL if source is empty, or in the unlikely case that the build can't
+        // find a place for every key.
+        //
+        static SNAPHashTable *BuildPerfectHash(const SNAPHashTable *source);
 
 		void *getEntryValues(_uint64 whichEntry) 
 		{
 			_ASSERT(whichEntry < GetTableSize());
-			return getEntry(whichEntry);
+			return getSlotValues(whichEntry);
 		}
 
+        //
+        // For walking every entry in the table.  Returns false if the slot is unused, otherwise fills in its key
+        // and all of its values.
+        //
+        bool GetSlotContents(_uint64 whichSlot, KeyType *key, ValueType *values) const
+        {
+            _ASSERT(whichSlot < GetTableSize());
+            void *slotValues = getSlotValues(whichSlot);
+            if (doesEntryHaveInvalidValue(slotValues)) {
+                return false;
+            }
+
+            *key = 0;
+            memcpy(key, getSlotKey(whichSlot), keySizeInBytes);
+            for (unsigned i = 0; i < valueCount; i++) {
+                values[i] = getValueFromEntry(slotValues, i);
+            }
+            return true;
+        }
+
+        //
+        // Overwrite one of the values in a slot that's in use, for rewriting an existing table in place.
+        //
+        void SetSlotValue(_uint64 whichSlot, unsigned whichValue, ValueType value)
+        {
+            _ASSERT(whichSlot < GetTableSize() && whichValue < valueCount);
+            memcpy((char *)getSlotValues(whichSlot) + whichValue * valueSizeInBytes, &value, valueSizeInBytes);   // Assumes little-endian
+        }
+
         static inline _uint64 hash(_uint64 key) {
             //
             // Hash the key.  Use the hash finalizer from the 64 bit MurmurHash3, http://code.google.com/p/smhasher/wiki/MurmurHash3,
@@ -86,6 +128,12 @@ class SNAPHashTable {
 
         inline ValueType *GetFirstValueForKey(KeyType key) const {
             _ASSERT(keySizeInBytes == 8 || (key & ~((((_uint64)1) << (keySizeInBytes * 8)) - 1)) == 0);    // High bits of the key aren't set.
+            if (useBuckets) {
+                return (this->*lookupInBuckets)(key);
+            }
+            if (perfectHash) {
+                return GetFirstValueForKeyInPerfectHash(key);
+            }
             _uint64 tableIndex = hash(key) % tableSize;
             void *entry = getEntry(tableIndex);
             if (isKeyEqual(entry, key) && !doesEntryHaveInvalidValue(entry)) {
@@ -118,6 +166,145 @@ class SNAPHashTable {
         }
 
 
+        //
+        // The bucketed version of GetFirstValueForKey.  All of the keys in a bucket share a
+        // cache line with their values, so the common case (a hit or miss in the home bucket)
+        // touches exactly one line.  We only move on to another bucket if this one is full,
+        // and for Robin Hood tables not even then if the bucket shows that the key would have
+        // displaced one of its entries.
+        //
+        inline ValueType *GetFirstValueForKeyInBuckets(KeyType key) const {
+            _uint64 bucketIndex = hash(key) % nBuckets;
+            unsigned nProbes = 0;
+            for (;;) {
+                char *bucket = getBucket(bucketIndex);
+                for (unsigned i = 0; i < entriesPerBucket; i++) {
+                    char *values = bucket + BucketValueOffset(i);
+                    if (doesEntryHaveInvalidValue(values)) {
+                        //
+                        // Buckets fill from the front, so an empty slot means the key isn't here or anywhere
+                        // later in the probe sequence.
+                        //
+                        return NULL;
+                    }
+                    if (!memcmp(bucket + i * keySizeInBytes, &key, keySizeInBytes)) {
+                        return (ValueType *)values;
+                    }
+                }
+
+                if (robinHood && 0 != nProbes && isKeyPastBucket(key, bucketIndex)) {
+                    return NULL;
+                }
+
+                nProbes++;
+                if (nProbes > nBuckets + QUADRATIC_CHAINING_DEPTH) {
+                    return NULL;
+                }
+                if (nProbes < QUADRATIC_CHAINING_DEPTH) {
+                    bucketIndex = (bucketIndex + nProbes * nProbes) % nBuckets;
+                } else {
+                    bucketIndex = (bucketIndex + 1) % nBuckets;
+                }
+
+                extern _int64 nProbesInGetEntryForKey;
+                nProbesInGetEntryForKey++;
+            }
+        }
+
+        //
+        // GetFirstValueForKeyInBuckets for one particular key size, value size and value count, so that the bucket
+        // geometry is constant and the key and value compares are single fixed-width loads rather than memcmps.
+        // chooseLookup() points lookupInBuckets at the one that matches the table, if there is one.
+        //
+        template<unsigned KeySize, unsigned ValueSize, unsigned ValueCount> ValueType *GetFirstValueForKeyInBucketsFixed(KeyType key) const {
+            static const unsigned EntriesPerBucket = BucketSize / (KeySize + ValueSize * ValueCount);
+            const _uint64 invalidValue = invalidValueValue & FixedWidthMask<ValueSize>();
+            _uint64 bucketIndex = hash(key) % nBuckets;
+            unsigned nProbes = 0;
+            for (;;) {
+                const char *bucket = getBucket(bucketIndex);
+                for (unsigned i = 0; i < EntriesPerBucket; i++) {
+                    const char *values = bucket + EntriesPerBucket * KeySize + i * ValueSize * ValueCount;
+                    if (LoadFixedWidth<ValueSize>(values) == invalidValue) {
+                        return NULL;
+                    }
+                    if (LoadFixedWidth<KeySize>(bucket + i * KeySize) == key) {
+                        return (ValueType *)values;
+                    }
+                }
+
+                if (robinHood && 0 != nProbes && isKeyPastBucket(key, bucketIndex)) {
+                    return NULL;
+                }
+
+                nProbes++;
+                if (nProbes > nBuckets + QUADRATIC_CHAINING_DEPTH) {
+                    return NULL;
+                }
+                if (nProbes < QUADRATIC_CHAINING_DEPTH) {
+                    bucketIndex = (bucketIndex + nProbes * nProbes) % nBuckets;
+                } else {
+                    bucketIndex = (bucketIndex + 1) % nBuckets;
+                }
+
+                extern _int64 nProbesInGetEntryForKey;
+                nProbesInGetEntryForKey++;
+            }
+        }
+
+        //
+        // The perfect hash version of GetFirstValueForKey.  The table is a minimal perfect hash in the style of PTHash:
+        // the key hash picks a pilot, and the key hash mixed with the pilot picks a position.  The build chose each pilot so
+        // that all of the keys that share it land on distinct positions that no other key has.  There are about 1%
+        // more positions than keys, which makes the pilots much easier to find, and the remap table sends each of the
+        // extra positions that's in use to one of the slots that would otherwise be empty.  So a lookup is a read of
+        // the (small) pilot table and then of one entry, which holds the whole key to reject seeds that aren't there.
+        //
+        inline ValueType *GetFirstValueForKeyInPerfectHash(KeyType key) const {
+            _uint64 keyHash = hash(key);
+            _uint64 position = (keyHash ^ pilotHash(pilots[(keyHash >> 32) % nPilots])) % nPositions;
+            if (position >= tableSize) {
+                position = remap[position - tableSize];
+            }
+
+            void *entry = getEntry(position);
+            return isKeyEqual(entry, key) ? (ValueType *)entry : NULL;
+        }
+
+        //
+        // Issue a prefetch for the place where a key's lookup will start (its home bucket, or its first
+        // entry for the flat layout).  This lets batched lookups get the cache misses for several keys
+        // going at once before doing any of the GetFirstValueForKey calls.
+        //
+        inline void PrefetchForKey(KeyType key) const {
+            if (useBuckets) {
+                _mm_prefetch(getBucket(hash(key) % nBuckets), _MM_HINT_T2);
+            } else if (perfectHash) {
+                _mm_prefetch((const char *)&pilots[(hash(key) >> 32) % nPilots], _MM_HINT_T2);
+            } else {
+                _mm_prefetch((const char *)getEntry(hash(key) % tableSize), _MM_HINT_T2);
+            }
+        }
+
+        //
+        // The address where a key's lookup will start, which PrefetchForKey prefetches.  For the perfect hash that's the
+        // key's entry, so this reads its pilot, from a table small enough to stay in memory.
+        //
+        inline const void *GetLookupAddressForKey(KeyType key) const {
+            if (useBuckets) {
+                return getBucket(hash(key) % nBuckets);
+            } else if (perfectHash) {
+                _uint64 keyHash = hash(key);
+                _uint64 position = (keyHash ^ pilotHash(pilots[(keyHash >> 32) % nPilots])) % nPositions;
+                if (position >= tableSize) {
+                    position = remap[position - tableSize];
+                }
+                return getEntry(position);
+            } else {
+                return getEntry(hash(key) % tableSize);
+            }
+        }
+
         inline bool Lookup(KeyType key, unsigned nValuesToFill, ValueType *values) const {
             _ASSERT(nValuesToFill <= valueCount);
             char *entry = (char *)GetFirstValueForKey(key);
@@ -140,7 +327,7 @@ class SNAPHashTable {
 
 private:
 
-        SNAPHashTable() {}
+        SNAPHashTable() : perfectHash(false), perfectHashIndex(NULL) {}
 
         static const unsigned QUADRATIC_CHAINING_DEPTH = 5; // Chain quadratically for this long, then linerarly  Set to 0 for linear chaining
 		static SNAPHashTable *loadCommon(GenericFile *loadFile);
@@ -154,6 +341,12 @@ private:
         //
         // The format is 1 or 2 (valueCount) values of size valueSize, followed by keySize bytes of key.
         //
+        // Bucketed tables (useBuckets) instead pack entriesPerBucket entries into each BucketSize byte bucket.
+        // The keys for all of the entries in the bucket come first, followed by the values for each entry
+        // in the same order, followed by any unused padding.  Each entry's values are still contiguous, so
+        // the pointer returned by GetFirstValueForKey can be used the same way for both layouts.  Slot n
+        // is entry n % entriesPerBucket in bucket n / entriesPerBucket.
+        //
 #if 0
         struct Entry {
             unsigned        value1;
@@ -166,9 +359,128 @@ private:
         // understand the format and try to make it less opaque to use them.
         
         inline void *getEntry(_uint64 whichEntry) const {
+            _ASSERT(!useBuckets);
             return ((char *)Table + elementSize * whichEntry);
         }
 
+        inline char *getBucket(_uint64 whichBucket) const {
+            return (char *)Table + BucketSize * whichBucket;
+        }
+
+        inline unsigned BucketValueOffset(unsigned whichEntryInBucket) const {
+            return entriesPerBucket * keySizeInBytes + whichEntryInBucket * valueCount * valueSizeInBytes;
+        }
+
+        //
+        // Slot accessors that work for either layout.
+        //
+        inline void *getSlotValues(_uint64 whichSlot) const {
+            if (useBuckets) {
+                return getBucket(whichSlot / entriesPerBucket) + BucketValueOffset((unsigned)(whichSlot % entriesPerBucket));
+            }
+            return getEntry(whichSlot);
+        }
+
+        inline void *getSlotKey(_uint64 whichSlot) const {
+            if (useBuckets) {
+                return getBucket(whichSlot / entriesPerBucket) + (whichSlot % entriesPerBucket) * keySizeInBytes;
+            }
+            return (char *)getEntry(whichSlot) + valueSizeInBytes * valueCount;
+        }
+
+        inline bool isSlotKeyEqual(_uint64 whichSlot, KeyType key) const
+        {
+            return !memcmp(getSlotKey(whichSlot), &key, keySizeInBytes);
+        }
+
+        size_t getTableSizeInBytes() const {
+            return useBuckets ? nBuckets * BucketSize : tableSize * elementSize;
+        }
+
+        void computeBucketGeometry();
+        void chooseLookup();
+
+        //
+        // Robin Hood ordering for bucketed tables.  An entry's probe number in a bucket is how far along the
+        // quadratic-then-linear probe sequence from its home bucket the bucket is (the first time the sequence
+        // gets there, if it wraps).  Insert lets a key take the slot of an entry with a smaller probe number
+        // than its own and moves that entry on instead, so the probe numbers in a bucket never go down.  Then
+        // a lookup that reaches a full bucket holding an entry with a smaller probe number than the key's own
+        // there knows that the key isn't any further on, and can stop without probing to an empty slot.
+        //
+        inline _uint64 getBucketProbeNumber(_uint64 homeBucket, _uint64 whichBucket) const {
+            _uint64 distance = (whichBucket + nBuckets - homeBucket) % nBuckets;
+            if (0 == distance) {
+                return 0;
+            }
+
+            _uint64 offset = 0;
+            unsigned nProbes;
+            for (nProbes = 1; nProbes < QUADRATIC_CHAINING_DEPTH; nProbes++) {
+                offset += nProbes * nProbes;
+                if ((offset < nBuckets ? offset : offset % nBuckets) == distance) {
+                    return nProbes;
+                }
+            }
+
+            //
+            // Past the quadratic probes, probe nProbes - 1 + n is at offset + n.
+            //
+            return nProbes - 1 + (distance + 2 * nBuckets - 1 - offset % nBuckets) % nBuckets + 1;
+        }
+
+        inline _uint64 getSlotProbeNumber(_uint64 whichSlot) const {
+            KeyType slotKey = 0;
+            memcpy(&slotKey, getSlotKey(whichSlot), keySizeInBytes);
+            return getBucketProbeNumber(hash(slotKey) % nBuckets, whichSlot / entriesPerBucket);
+        }
+
+        //
+        // For a full bucket that doesn't hold key, whether it has an entry that key would have displaced.
+        //
+        inline bool isKeyPastBucket(KeyType key, _uint64 whichBucket) const {
+            _uint64 keyProbeNumber = getBucketProbeNumber(hash(key) % nBuckets, whichBucket);
+            for (unsigned i = 0; i < entriesPerBucket; i++) {
+                if (getSlotProbeNumber(whichBucket * entriesPerBucket + i) < keyProbeNumber) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool insertRobinHood(KeyType key, ValueType *data);
+
+        static inline _uint64 pilotHash(_uint64 pilot) {
+            return hash(pilot ^ 0x9e3779b97f4a7c15);
+        }
+
+        size_t getPerfectHashIndexSizeInBytes() const {
+            return (nPositions - tableSize) * sizeof(*remap) + nPilots * sizeof(*pilots);
+        }
+
+        void setPerfectHashIndex(char *i_perfectHashIndex) {
+            perfectHashIndex = i_perfectHashIndex;
+            remap = (_uint64 *)perfectHashIndex;
+            pilots = (_uint16 *)(perfectHashIndex + (nPositions - tableSize) * sizeof(*remap));
+        }
+
+        static const _uint64 AverageKeysPerPilot = 4;
+        static const unsigned MaxPilot = 0xffff;
+
+        //
+        // Little-endian loads of Width (<= 8) bytes, which the compiler turns into one or two plain loads.
+        //
+        template<unsigned Width> static inline _uint64 LoadFixedWidth(const char *p) {
+            _uint64 value = 0;
+            memcpy(&value, p, Width);
+            return value;
+        }
+
+        template<unsigned Width> static inline _uint64 FixedWidthMask() {
+            return Width >= 8 ? ~(_uint64)0 : (((_uint64)1) << (Width * 8 % 64)) - 1;
+        }
+        static size_t bucketedHeaderSize(unsigned valueSizeInBytes);
+
         inline bool doesEntryHaveInvalidValue(void *entry) const
         {
             return !memcmp(entry, &invalidValueValue, valueSizeInBytes);
@@ -187,18 +499,18 @@ private:
             return !memcmp((const char *)entry + valueSizeInBytes * valueCount, &key, keySizeInBytes);
         }
 
-        inline void clearKey(void *entry)
+        inline void clearSlotKey(_uint64 whichSlot)
         {
-            memset((char *)entry + valueSizeInBytes * valueCount, 0 , keySizeInBytes);
+            memset(getSlotKey(whichSlot), 0 , keySizeInBytes);
         }
 
-        inline void setKey(void *entry, KeyType key)
+        inline void setSlotKey(_uint64 whichSlot, KeyType key)
         {
-            memcpy((char *)entry + valueSizeInBytes * valueCount, &key, keySizeInBytes);
+            memcpy(getSlotKey(whichSlot), &key, keySizeInBytes);
         }
  
         void *Table;
-        size_t tableSize;
+        size_t tableSize;           // In slots (i.e., entries), regardless of layout
         unsigned keySizeInBytes;
         unsigned elementSize;
         size_t usedElementCount;
@@ -206,14 +518,34 @@ private:
         unsigned valueSizeInBytes;
         unsigned valueCount;
         ValueType invalidValueValue;
+
+        bool useBuckets;
+        bool robinHood;             // Bucketed and built with Robin Hood insertion (every new bucketed table is)
+        unsigned entriesPerBucket;  // Only meaningful if useBuckets
+        size_t nBuckets;            // Likewise
+
+        bool perfectHash;           // Flat layout with exactly usedElementCount slots, all in use
+        _uint64 nPilots;            // The rest are only meaningful if perfectHash
+        _uint64 nPositions;
+        char *perfectHashIndex;     // The remap table followed by the pilots
+        _uint64 *remap;             // nPositions - tableSize entries
+        _uint16 *pilots;
+
+        typedef ValueType *(SNAPHashTable::*BucketLookup)(KeyType key) const;
+        BucketLookup lookupInBuckets;   // Likewise; set by chooseLookup()
+
+        static const unsigned BucketSize = 64;  // One cache line
  
         //
-        // Returns either the entry for this key, or else the entry where the key would be
-        // inserted if it's not in the table.
+        // Returns either the slot for this key, or else the slot where the key would be
+        // inserted if it's not in the table.  Returns -1 if the table is full.
         //
-        void* getEntryForKey(__in KeyType key) const;
+        _int64 getSlotForKey(__in KeyType key) const;
 
         friend class SeedCountIterator;
 
         static const unsigned magic;
+        static const unsigned bucketedMagic;
+        static const unsigned robinHoodMagic;
+        static const unsigned perfectHashMagic;
 };
@@ -0,0 +1,333 @@
+/*++
+
+Module Name:
+
+    IOBench.cpp
+
+Abstract:
+
+    Benchmarks of the parts of the pipeline by themselves.  See IOBench.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "IOBench.h"
+#include "Compat.h"
+#include "AlignerContext.h"
+#include "AlignerOptions.h"
+#include "AlignerStats.h"
+#include "SingleAligner.h"
+#include "PairedAligner.h"
+#include "GenomeIndex.h"
+#include "FileFormat.h"
+#include "DataReader.h"
+#include "ProgressReport.h"
+#include "Read.h"
+#include "Util.h"
+#include "Error.h"
+#include "exit.h"
+#include <vector>
+
+extern const char *SNAP_VERSION;
+extern char *FormatUIntWithCommas(_uint64 val, char *outputBuffer, size_t outputBufferSize);   // As in AlignerContext.cpp, not the one in Util.h
+
+static const _int64 DefaultSyntheticReads = 10 * 1000 * 1000;
+static const unsigned DefaultSyntheticReadLength = 150;
+static const double MB = 1 << 20;
+
+static void usage()
+{
+    WriteErrorMessage(
+        "Usage: snap-aligner iobench -read single|paired <input files> [<options>]\n"
+        "       snap-aligner iobench -align single|paired <index-dir> <input files> -o <output file> [<options>]\n"
+        "       snap-aligner iobench -write <index-dir> -o <output file> [-n reads] [-len bases] [<options>]\n"
+        "Runs one part of the pipeline by itself, and says how many megabytes and reads a second went through it:\n"
+        "  -read  Read and parse the input as an alignment would, and throw the reads away.\n"
+        "  -align Align as usual, formatting and compressing the output, but throw it away (-discardOutput).\n"
+        "  -write Make reads from random places in the index's genome, aligned there, and write them to the output\n"
+        "         file, formatting, compressing and sorting (with -so) them as an alignment would.  -n says how many\n"
+        "         (default %lld) and -len how long (default %u).\n"
+        "The options are those of single and paired alignments, such as -t, -xf, -iou, -so, -sm and -wbs.\n",
+        DefaultSyntheticReads, DefaultSyntheticReadLength);
+    soft_exit_no_print(1);
+}
+
+    static double
+Seconds(_int64 nanos)
+{
+    return (double)nanos / 1000000000;
+}
+
+    static void
+PrintRate(const char *stage, _int64 bytes, _int64 reads, _int64 millis)
+{
+    char bytesString[50], readsString[50], rateString[50];
+    double seconds = (double)__max(millis, (_int64)1) / 1000;
+    WriteStatusMessage("iobench %s: %s bytes, %.1f MB/s; %s reads, %s reads/s\n", stage, FormatUIntWithCommas(bytes, bytesString, sizeof(bytesString)),
+        bytes / MB / seconds, FormatUIntWithCommas(reads, readsString, sizeof(readsString)),
+        FormatUIntWithCommas((_uint64)(reads / seconds), rateString, sizeof(rateString)));
+}
+
+    static _int64
+InputBytes(AlignerOptions *options)
+{
+    _int64 bytes = 0;
+    for (int i = 0; i < options->nInputs; i++) {
+        SNAPFile *input = &options->inputs[i];
+        if (! input->isStdio) {
+            bytes += QueryFileSize(input->fileName);
+        }
+        if (NULL != input->secondFileName) {
+            bytes += QueryFileSize(input->secondFileName);
+        }
+    }
+    return bytes;
+}
+
+//
+// -read and -align: an ordinary alignment, with the arguments changed to take out the stage that isn't wanted.
+//
+    static void
+RunAlignmentStage(bool align, int argc, const char **argv)
+{
+    if (argc < 2 || (strcmp(argv[0], "single") != 0 && strcmp(argv[0], "paired") != 0)) {
+        usage();
+    }
+    bool paired = strcmp(argv[0], "paired") == 0;
+
+    std::vector<const char *> args;
+    args.push_back(argv[0]);
+    if (! align) {
+        args.push_back("-");
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], ",") == 0) {
+            WriteErrorMessage("iobench runs one alignment at a time\n");
+            soft_exit_no_print(1);
+        }
+        if (! align && strcmp(argv[i], "-o") == 0) {
+            WriteErrorMessage("iobench -read doesn't write output; use -align or -write for that\n");
+            soft_exit_no_print(1);
+        }
+        args.push_back(argv[i]);
+    }
+    if (align) {
+        args.push_back("-discardOutput");
+    }
+
+    ProgressReporter::DecompressNanos = 0;
+    ProgressReporter::CompressNanos = 0;
+
+    AlignerContext *context = paired ? (AlignerContext *) new PairedAlignerContext() : (AlignerContext *) new SingleAlignerContext();
+    unsigned nArgsConsumed;
+    context->runAlignment((int)args.size(), &args[0], SNAP_VERSION, &nArgsConsumed);
+    if (NULL == context->options || NULL == context->stats) {
+        soft_exit_no_print(1);  // it's said what went wrong
+    }
+
+    WriteStatusMessage("\n");
+    PrintRate("input", InputBytes(context->options), context->stats->totalReads, context->alignTime);
+    WriteStatusMessage("iobench decompressing: %.2fs, summed over threads\n", Seconds(ProgressReporter::DecompressNanos));
+    if (align) {
+        PrintRate("output", AsyncFile::DiscardedBytes, context->stats->totalReads, context->alignTime);
+        WriteStatusMessage("iobench compressing: %.2fs, summed over threads\n", Seconds(ProgressReporter::CompressNanos));
+    }
+
+    delete context;
+}
+
+//
+// -write: each thread writes its share of the reads through a writer of its own, as aligner threads do.
+//
+struct SyntheticWriteContext {
+    ReadWriterSupplier     *writerSupplier;
+    const ReaderContext    *readerContext;
+    const Genome           *genome;
+    _int64                  firstRead;
+    _int64                  nReads;
+    unsigned                readLength;
+    volatile int           *nRunning;
+    SingleWaiterObject     *doneObject;
+};
+
+    static _uint64
+NextRandom(_uint64 *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+    static void
+SyntheticWriteThreadMain(void *param)
+{
+    SyntheticWriteContext *context = (SyntheticWriteContext *)param;
+    ReadWriter *writer = context->writerSupplier->getWriter();
+    const Genome *genome = context->genome;
+    unsigned readLength = context->readLength;
+    char *quality = new char[readLength];
+    char id[64];
+    _uint64 random = (context->firstRead + 1) * 0x9e3779b97f4a7c15ull;
+
+    for (_int64 i = context->firstRead; i < context->firstRead + context->nReads; i++) {
+        //
+        // Somewhere that's all bases, rather than padding between contigs or Ns.
+        //
+        GenomeLocation location;
+        const char *bases;
+        for (;;) {
+            location = NextRandom(&random) % (genome->getCountOfBases() - readLength);
+            bases = genome->getSubstring(location, readLength);
+            if (NULL != bases && NULL == memchr(bases, 'n', readLength) && NULL == memchr(bases, 'N', readLength)) {
+                break;
+            }
+        }
+        for (unsigned j = 0; j < readLength; j++) {
+            quality[j] = "?@ABCDEFGHI"[NextRandom(&random) % 11];
+        }
+        int idLength = snprintf(id, sizeof(id), "iobench.%lld", i);
+
+        Read read;
+        read.init(id, idLength, bases, quality, readLength);
+        SingleAlignmentResult result;
+        result.location = location;
+        result.score = 0;
+        result.mapq = 60;
+        result.status = SingleHit;
+        result.direction = FORWARD;
+        if (! writer->writeReads(*context->readerContext, &read, &result, 1, true)) {
+            WriteErrorMessage("iobench: writing read %lld failed\n", i);
+            soft_exit(1);
+        }
+    }
+
+    writer->close();
+    delete writer;
+    delete [] quality;
+    if (0 == InterlockedDecrementAndReturnNewValue(context->nRunning)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
+
+    static void
+RunWriteStage(int argc, const char **argv)
+{
+    if (argc < 1) {
+        usage();
+    }
+    AlignerOptions options("snap-aligner iobench -write");
+    options.indexDir = argv[0];
+    _int64 nReads = DefaultSyntheticReads;
+    unsigned readLength = DefaultSyntheticReadLength;
+    for (int n = 1; n < argc; n++) {
+        if (strcmp(argv[n], "-n") == 0 && n + 1 < argc && atoll(argv[n + 1]) > 0) {
+            nReads = atoll(argv[n + 1]);
+            n++;
+        } else if (strcmp(argv[n], "-len") == 0 && n + 1 < argc && atoi(argv[n + 1]) > 0) {
+            readLength = atoi(argv[n + 1]);
+            n++;
+        } else {
+            bool done;
+            if (! options.parse(argv, argc, n, &done)) {
+                WriteErrorMessage("Invalid argument: %s\n\n", argv[n]);
+                usage();
+            }
+        }
+    }
+    if (UnknownFileType == options.outputFile.fileType) {
+        WriteErrorMessage("iobench -write needs an output file (-o)\n\n");
+        usage();
+    }
+
+    const FileFormat *format = SAMFile == options.outputFile.fileType ? FileFormat::SAM[options.useM] :
+        BAMFile == options.outputFile.fileType ? FileFormat::BAM[options.useM] : FileFormat::CRAM[options.useM];
+
+    WriteStatusMessage("Loading the genome from %s...", options.indexDir);
+    _int64 loadStart = timeInMillis();
+    GenomeIndex *index = GenomeIndex::loadFromDirectory((char *)options.indexDir, true, false);
+    if (NULL == index) {
+        WriteErrorMessage("Index load failed, aborting.\n");
+        soft_exit(1);
+    }
+    const Genome *genome = index->getGenome();
+    WriteStatusMessage("%llds\n", (timeInMillis() - loadStart + 500) / 1000);
+
+    ReaderContext readerContext;
+    memset(&readerContext, 0, sizeof(readerContext));
+    readerContext.clipping = options.clipping;
+    readerContext.compressionLevel = BAMFile == options.outputFile.fileType ? options.compressionLevel : -1;
+    readerContext.defaultReadGroup = options.defaultReadGroup;
+    readerContext.genome = genome;
+    format->setupReaderContext(&options, &readerContext);
+    DataSupplier::ThreadCount = options.numThreads;
+
+    ProgressReporter::CompressNanos = 0;
+    _int64 start = timeInMillis();
+
+    ReadWriterSupplier *writerSupplier = format->getWriterSupplier(&options, genome);
+    ReadWriter *headerWriter = writerSupplier->getWriter();
+    headerWriter->writeHeader(readerContext, ! options.sortOutput ? Unsorted : options.sortByName ? SortedByName : SortedByLocation, argc, argv,
+        SNAP_VERSION, options.rgLineContents, false);
+    headerWriter->close();
+    delete headerWriter;
+
+    int nThreads = (int)__max((_int64)1, __min((_int64)options.numThreads, nReads));
+    SyntheticWriteContext *contexts = new SyntheticWriteContext[nThreads];
+    volatile int nRunning = nThreads;
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    for (int i = 0; i < nThreads; i++) {
+        contexts[i].writerSupplier = writerSupplier;
+        contexts[i].readerContext = &readerContext;
+        contexts[i].genome = genome;
+        contexts[i].firstRead = nReads * i / nThreads;
+        contexts[i].nReads = nReads * (i + 1) / nThreads - contexts[i].firstRead;
+        contexts[i].readLength = readLength;
+        contexts[i].nRunning = &nRunning;
+        contexts[i].doneObject = &doneObject;
+        if (! StartNewThread(SyntheticWriteThreadMain, &contexts[i])) {
+            WriteErrorMessage("iobench: unable to start write thread\n");
+            soft_exit(1);
+        }
+    }
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+    _int64 written = timeInMillis();
+
+    writerSupplier->close();    // Which for -so is when the sort's merge happens
+    delete writerSupplier;
+    _int64 end = timeInMillis();
+
+    WriteStatusMessage("\n");
+    PrintRate("write", QueryFileSize(options.outputFile.fileName), nReads, end - start);
+    WriteStatusMessage("iobench compressing: %.2fs, summed over threads\n", Seconds(ProgressReporter::CompressNanos));
+    if (options.sortOutput) {
+        WriteStatusMessage("iobench sorting: %.2fs writing the sort's temporary file, %.2fs merging it into the output\n",
+            (double)(written - start) / 1000, (double)(end - written) / 1000);
+    }
+
+    delete [] contexts;
+    delete index;
+}
+
+    void
+RunIOBench(int argc, const char **argv)
+{
+    if (argc < 2) {
+        usage();
+    }
+    if (strcmp(argv[0], "-read") == 0) {
+        RunAlignmentStage(false, argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "-align") == 0) {
+        RunAlignmentStage(true, argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "-write") == 0) {
+        RunWriteStage(argc - 1, argv + 1);
+    } else {
+        usage();
+    }
+}
@@ -0,0 +1,26 @@
+/*++
+
+Module Name:
+
+    IOBench.h
+
+Abstract:
+
+    snap-aligner iobench, which runs one part of the pipeline by itself to find which part limits a run on this
+    machine: reading and parsing the input (-read), aligning and producing the output without storing it (-align), or
+    formatting, compressing and sorting output without aligning anything (-write).  Each says how many megabytes and
+    reads a second went through, and how much time went to decompression or compression.
+
+    -read and -align are an ordinary single or paired alignment, with the index "-" and no output for -read, and with
+    -discardOutput for -align, so they take all of the usual options.  -write makes its own reads, copied from random
+    places in an index's genome and aligned there exactly, so it needs no input.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+void RunIOBench(int argc, const char **argv);
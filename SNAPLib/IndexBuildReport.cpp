@@ -0,0 +1,157 @@
+/*++
+
+Module Name:
+
+    IndexBuildReport.cpp
+
+Abstract:
+
+    The index build report.  See IndexBuildReport.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "IndexBuildReport.h"
+#include "Error.h"
+
+IndexBuildReport::IndexBuildReport() : nPhases(0), currentPhase(-1), phaseStartTime(0), phaseStartCPUTime(0), nValues(0), nFiles(0)
+{
+    startTime = timeInMillis();
+}
+
+    void
+IndexBuildReport::startPhase(const char *name, unsigned nThreads)
+{
+    endPhase();
+
+    int whichPhase;
+    for (whichPhase = 0; whichPhase < nPhases; whichPhase++) {
+        if (!strcmp(phases[whichPhase].name, name)) {
+            break;
+        }
+    }
+
+    if (whichPhase == nPhases) {
+        if (nPhases == MaxPhases) {
+            return;     // Just leave it out of the report
+        }
+        phases[whichPhase].name = name;
+        phases[whichPhase].nThreads = nThreads;
+        phases[whichPhase].wallMillis = 0;
+        phases[whichPhase].cpuMillis = 0;
+        phases[whichPhase].peakMemory = 0;
+        nPhases++;
+    }
+
+    phases[whichPhase].nThreads = __max(phases[whichPhase].nThreads, nThreads);
+    currentPhase = whichPhase;
+    phaseStartTime = timeInMillis();
+    phaseStartCPUTime = GetProcessCPUTimeInMillis();
+}
+
+    void
+IndexBuildReport::endPhase()
+{
+    if (-1 == currentPhase) {
+        return;
+    }
+
+    phases[currentPhase].wallMillis += timeInMillis() - phaseStartTime;
+    phases[currentPhase].cpuMillis += GetProcessCPUTimeInMillis() - phaseStartCPUTime;
+    phases[currentPhase].peakMemory = GetPeakMemoryUsage();
+    currentPhase = -1;
+}
+
+    IndexBuildReport::NamedValue *
+IndexBuildReport::findOrAddValue(NamedValue *array, int *nEntries, const char *name)
+{
+    for (int i = 0; i < *nEntries; i++) {
+        if (!strcmp(array[i].name, name)) {
+            return &array[i];
+        }
+    }
+
+    if (*nEntries == MaxValues) {
+        return NULL;
+    }
+
+    array[*nEntries].name = name;
+    array[*nEntries].value = 0;
+    (*nEntries)++;
+
+    return &array[*nEntries - 1];
+}
+
+    void
+IndexBuildReport::setValue(const char *name, _int64 value)
+{
+    NamedValue *entry = findOrAddValue(values, &nValues, name);
+    if (NULL != entry) {
+        entry->value = value;
+    }
+}
+
+    void
+IndexBuildReport::recordFile(const char *name, _int64 bytes)
+{
+    NamedValue *entry = findOrAddValue(files, &nFiles, name);
+    if (NULL != entry) {
+        entry->value = bytes;
+    }
+}
+
+    bool
+IndexBuildReport::writeToFile(const char *fileName)
+{
+    endPhase();
+
+    FILE *reportFile = fopen(fileName, "w");
+    if (NULL == reportFile) {
+        WriteErrorMessage("Unable to open index build report file '%s'\n", fileName);
+        return false;
+    }
+
+    fprintf(reportFile, "{\n");
+    fprintf(reportFile, "  \"totalSeconds\": %.3f,\n", (timeInMillis() - startTime) / 1000.0);
+    fprintf(reportFile, "  \"peakMemoryBytes\": %lld,\n", GetPeakMemoryUsage());
+
+    fprintf(reportFile, "  \"phases\": [");
+    for (int i = 0; i < nPhases; i++) {
+        //
+        // Utilization is the fraction of the phase's threads' time that they spent running.  It's for the whole
+        // process, but nothing else runs during the build.
+        //
+        double utilization = 0;
+        if (phases[i].wallMillis > 0) {
+            utilization = (double)phases[i].cpuMillis / ((double)phases[i].wallMillis * phases[i].nThreads);
+        }
+        fprintf(reportFile, "%s\n    {\"name\": \"%s\", \"seconds\": %.3f, \"cpuSeconds\": %.3f, \"threads\": %d, \"threadUtilization\": %.3f, \"peakMemoryBytes\": %lld}",
+            i == 0 ? "" : ",", phases[i].name, phases[i].wallMillis / 1000.0, phases[i].cpuMillis / 1000.0, phases[i].nThreads, utilization, phases[i].peakMemory);
+    }
+    fprintf(reportFile, "%s],\n", nPhases == 0 ? "" : "\n  ");
+
+    fprintf(reportFile, "  \"files\": {");
+    for (int i = 0; i < nFiles; i++) {
+        fprintf(reportFile, "%s\n    \"%s\": %lld", i == 0 ? "" : ",", files[i].name, files[i].value);
+    }
+    fprintf(reportFile, "%s},\n", nFiles == 0 ? "" : "\n  ");
+
+    fprintf(reportFile, "  \"values\": {");
+    for (int i = 0; i < nValues; i++) {
+        fprintf(reportFile, "%s\n    \"%s\": %lld", i == 0 ? "" : ",", values[i].name, values[i].value);
+    }
+    fprintf(reportFile, "%s}\n", nValues == 0 ? "" : "\n  ");
+    fprintf(reportFile, "}\n");
+
+    bool worked = !ferror(reportFile);
+    if (0 != fclose(reportFile) || !worked) {
+        WriteErrorMessage("Error writing index build report file '%s'\n", fileName);
+        return false;
+    }
+
+    return true;
+}
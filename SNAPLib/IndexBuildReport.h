@@ -0,0 +1,83 @@
+/*++
+
+Module Name:
+
+    IndexBuildReport.h
+
+Abstract:
+
+    A machine-readable report of an index build (index -report), written as JSON.  It has the wall and processor time
+    of each phase of the build, how well the phase used the threads it was given, the peak memory use as of the end of
+    the phase, the size of each index file and whatever counters the builder wants to record.
+
+    A phase that's started more than once (like the per-group phases of -sortbuild) accumulates into one entry.
+    Phases don't nest: starting one ends the one that's running.  Phase, value and file names are used as is in the
+    JSON, so they must not need escaping, and they must stay valid until the report is written (string literals, in
+    practice).
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class IndexBuildReport {
+public:
+    IndexBuildReport();
+
+    //
+    // Start timing a phase that runs with nThreads threads, ending any phase that's currently running.
+    //
+    void startPhase(const char *name, unsigned nThreads = 1);
+    void endPhase();
+
+    //
+    // Record a counter.  Setting the same name again replaces the old value.
+    //
+    void setValue(const char *name, _int64 value);
+
+    void recordFile(const char *name, _int64 bytes);
+
+    bool writeToFile(const char *fileName);
+
+private:
+
+    struct Phase {
+        const char  *name;
+        unsigned     nThreads;
+        _int64       wallMillis;
+        _int64       cpuMillis;
+        _int64       peakMemory;
+    };
+
+    struct NamedValue {
+        const char  *name;
+        _int64       value;
+    };
+
+    static const int MaxPhases = 32;
+    static const int MaxValues = 48;
+
+    //
+    // Returns the entry with this name, adding it if it isn't there, or NULL if the array is full.
+    //
+    static NamedValue *findOrAddValue(NamedValue *array, int *nEntries, const char *name);
+
+    Phase       phases[MaxPhases];
+    int         nPhases;
+    int         currentPhase;   // -1 if none is running
+    _int64      phaseStartTime;
+    _int64      phaseStartCPUTime;
+
+    NamedValue  values[MaxValues];
+    int         nValues;
+
+    NamedValue  files[MaxValues];
+    int         nFiles;
+
+    _int64      startTime;
+};
@@ -0,0 +1,87 @@
+/*++
+
+Module Name:
+
+    InsertSizeDistribution.cpp
+
+Abstract:
+
+    Insert size sampling for the paired aligner.  See InsertSizeDistribution.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "InsertSizeDistribution.h"
+#include <algorithm>
+
+InsertSizeDistribution::InsertSizeDistribution(int i_samplesWanted, int i_minSpacing, int i_maxSpacing) :
+    samplesWanted(__max(1, i_samplesWanted)), nSamples(0), minSpacing(i_minSpacing), maxSpacing(i_maxSpacing),
+    ready(false), fittedMinSpacing(i_minSpacing), fittedMaxSpacing(i_maxSpacing), binWidth(1), prior(NULL)
+{
+    samples = new int[samplesWanted];
+}
+
+InsertSizeDistribution::~InsertSizeDistribution()
+{
+    delete[] samples;
+    delete[] prior;
+}
+
+    bool
+InsertSizeDistribution::addSample(int spacing)
+{
+    if (ready || spacing <= minSpacing || spacing > maxSpacing) {
+        return false;
+    }
+
+    samples[nSamples++] = spacing;
+    if (nSamples < samplesWanted) {
+        return false;
+    }
+
+    fit();
+    return true;
+}
+
+    void
+InsertSizeDistribution::fit()
+/*++
+
+Routine Description:
+
+    Trim the top and bottom 0.05% of the samples to get the window, and histogram the rest for the prior.  Every bin
+    gets one extra count, so a spacing in the window that happened not to be sampled is unlikely rather than impossible.
+
+--*/
+{
+    std::sort(samples, samples + nSamples);
+
+    int trimmed = nSamples / 2000;
+    fittedMinSpacing = __max(minSpacing, samples[trimmed] - 1);     // The aligners don't consider pairs at minSpacing
+    fittedMaxSpacing = __min(maxSpacing, samples[nSamples - 1 - trimmed]);
+
+    binWidth = __max(1, (fittedMaxSpacing - fittedMinSpacing + TargetBins - 1) / TargetBins);
+    int nBins = (fittedMaxSpacing - fittedMinSpacing) / binWidth + 1;
+    prior = new double[nBins];
+    for (int bin = 0; bin < nBins; bin++) {
+        prior[bin] = 1;
+    }
+
+    for (int i = trimmed; i < nSamples - trimmed; i++) {
+        prior[(samples[i] - fittedMinSpacing) / binWidth]++;
+    }
+
+    double largest = 1;
+    for (int bin = 0; bin < nBins; bin++) {
+        largest = __max(largest, prior[bin]);
+    }
+    for (int bin = 0; bin < nBins; bin++) {
+        prior[bin] /= largest;
+    }
+
+    ready = true;
+}
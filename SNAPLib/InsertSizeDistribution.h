@@ -0,0 +1,80 @@
+/*++
+
+Module Name:
+
+    InsertSizeDistribution.h
+
+Abstract:
+
+    The spacing between the ends of confidently aligned pairs, sampled as the run goes, so that the paired aligner can
+    search a window that fits the library rather than the -s range, and prefer pairs whose spacing is typical of it.
+
+    Spacing is as the paired aligners measure it: the distance between the locations of the two ends.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class InsertSizeDistribution {
+public:
+    //
+    // Collect samplesWanted spacings, each within the range the aligner was searching, which bounds what's fitted.
+    //
+    InsertSizeDistribution(int i_samplesWanted, int i_minSpacing, int i_maxSpacing);
+
+    ~InsertSizeDistribution();
+
+    //
+    // The MAPQ both ends of a pair need for its spacing to be sampled.
+    //
+    static const int MinMapqToSample = 60;
+
+    //
+    // Add the spacing of a confidently aligned pair.  Returns true when this sample is the one that makes the
+    // distribution ready; after that, samples are ignored.
+    //
+    bool addSample(int spacing);
+
+    bool isReady() const {return ready;}
+
+    //
+    // The window that holds the middle 99.9% of the samples, in the aligners' sense: pairs closer than minSpacing or
+    // further than maxSpacing aren't considered.  Only valid once the distribution is ready.
+    //
+    int getMinSpacing() const {return fittedMinSpacing;}
+    int getMaxSpacing() const {return fittedMaxSpacing;}
+
+    //
+    // How likely a pair with this spacing is, relative to the most common spacing (so no more than 1), for weighting
+    // pair probabilities.  Only valid once the distribution is ready, and for spacings in the window.
+    //
+    double getSpacingPrior(int spacing) const {
+        _ASSERT(ready && spacing >= fittedMinSpacing && spacing <= fittedMaxSpacing);
+        return prior[(spacing - fittedMinSpacing) / binWidth];
+    }
+
+private:
+
+    void fit();
+
+    static const int TargetBins = 50;   // Wide enough bins to get a few samples in most of them, narrow enough to keep the shape
+
+    int         samplesWanted;
+    int         nSamples;
+    int         *samples;
+
+    int         minSpacing;
+    int         maxSpacing;
+
+    bool        ready;
+    int         fittedMinSpacing;
+    int         fittedMaxSpacing;
+    int         binWidth;
+    double      *prior;         // One per bin of binWidth spacings, starting at fittedMinSpacing
+};
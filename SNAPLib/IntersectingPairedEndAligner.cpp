@@ -23,11 +23,13 @@ Revision History:
 #include "stdafx.h"
 #include "IntersectingPairedEndAligner.h"
 #include "SeedSequencer.h"
+#include "Minimizer.h"
 #include "mapq.h"
 #include "exit.h"
 #include "Error.h"
 #include "BigAlloc.h"
 #include "AlignerOptions.h"
+#include "StageTiming.h"
 
 #ifdef  _DEBUG
 extern bool _DumpAlignments;    // From BaseAligner.cpp
@@ -50,9 +52,9 @@ IntersectingPairedEndAligner::IntersectingPairedEndAligner(
         bool          noUkkonen_,
         bool          noOrderedEvaluation_,
 		bool          noTruncation_) :
-    index(index_), maxReadSize(maxReadSize_), maxHits(maxHits_), maxK(maxK_), numSeedsFromCommandLine(__min(MAX_MAX_SEEDS,numSeedsFromCommandLine_)), minSpacing(minSpacing_), maxSpacing(maxSpacing_),
+    index(index_), maxReadSize(maxReadSize_), maxHits(maxHits_), maxK(maxK_), numSeedsFromCommandLine(__min(MAX_MAX_SEEDS,numSeedsFromCommandLine_)), minSpacing(minSpacing_), maxSpacing(maxSpacing_), insertSizeDistribution(NULL),
 	landauVishkin(NULL), reverseLandauVishkin(NULL), maxBigHits(maxBigHits_), seedCoverage(seedCoverage_),
-    extraSearchDepth(extraSearchDepth_), nLocationsScored(0), noUkkonen(noUkkonen_), noOrderedEvaluation(noOrderedEvaluation_), noTruncation(noTruncation_), 
+    extraSearchDepth(extraSearchDepth_), nLocationsScored(0), nHashTableLookups(0), nLVCalls(0), nPopularSeedsSkipped(0), nLowQualitySeedsSkipped(0), nMateSeedLookupsShared(0), shareMateSeeds(false), workBudget(0), minSeedQuality(0), maxSeedsWithoutHits(0), maxDistFraction(0), noUkkonen(noUkkonen_), noOrderedEvaluation(noOrderedEvaluation_), noTruncation(noTruncation_), 
     maxSecondaryAlignmentsPerContig(maxSecondaryAlignmentsPerContig_)
 {
     doesGenomeIndexHave64BitLocations = index->doesGenomeIndexHave64BitLocations();
@@ -65,18 +67,6 @@ IntersectingPairedEndAligner::IntersectingPairedEndAligner(
     }
     allocateDynamicMemory(allocator, maxReadSize, maxBigHits, maxSeedsToUse, maxK, extraSearchDepth, maxCandidatePoolSize, maxSecondaryAlignmentsPerContig);
 
-    rcTranslationTable['A'] = 'T';
-    rcTranslationTable['G'] = 'C';
-    rcTranslationTable['C'] = 'G';
-    rcTranslationTable['T'] = 'A';
-    rcTranslationTable['N'] = 'N';
-
-    for (unsigned i = 0; i < 256; i++) {
-        nTable[i] = 0;
-    }
-
-    nTable['N'] = 1;
-
     seedLen = index->getSeedLength();
 
     genome = index->getGenome();
@@ -117,12 +107,28 @@ IntersectingPairedEndAligner::allocateDynamicMemory(BigAllocator *allocator, uns
 {
     seedUsed = (BYTE *) allocator->allocate(100 + (maxReadSize + 7) / 8);
 
+    packedGenome = index->getGenome()->getPackedBases();
+
+    minimizerWindow = index->getMinimizerWindow();
+    if (0 != minimizerWindow) {
+        minimizerHashes = (_uint64 *)allocator->allocate(sizeof(_uint64) * maxReadSize);
+        isMinimizerSeed = (bool *)allocator->allocate(sizeof(bool) * maxReadSize);
+    } else {
+        minimizerHashes = NULL;
+        isMinimizerSeed = NULL;
+    }
+
     for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
         rcReadData[whichRead] = (char *)allocator->allocate(maxReadSize);
+        readSeeds[whichRead].init(allocator->allocate(PackedReadSeeds::GetStorageSize(maxReadSize)), maxReadSize);
         rcReadQuality[whichRead] = (char *)allocator->allocate(maxReadSize);
 
         for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
             reversedRead[whichRead][dir] = (char *)allocator->allocate(maxReadSize);
+            if (NULL != packedGenome) {
+                packedRead[whichRead][dir].init(allocator->allocate(PackedBases::GetStorageSize(maxReadSize)), 0, maxReadSize);
+                packedReversedRead[whichRead][dir].init(allocator->allocate(PackedBases::GetStorageSize(maxReadSize)), 0, maxReadSize);
+            }
             hashTableHitSets[whichRead][dir] =(HashTableHitSet *)allocator->allocate(sizeof(HashTableHitSet)); /*new HashTableHitSet();*/
             hashTableHitSets[whichRead][dir]->firstInit(maxSeedsToUse, maxMergeDistance, allocator, doesGenomeIndexHave64BitLocations);
         }
@@ -148,6 +154,14 @@ IntersectingPairedEndAligner::allocateDynamicMemory(BigAllocator *allocator, uns
     } else {
         hitsPerContigCounts = NULL;
     }
+
+    if (index->hasCompressedOverflowTable()) {
+        //
+        // We only record lookups with fewer than maxBigHitsToConsider hits, so there's no point in decoding more than that.
+        //
+        _int64 decodeBufferSize = OverflowDecodeBuffer::getBufferSize((_int64)maxSeedsToUse * NUM_READS_PER_PAIR * NUM_DIRECTIONS, maxBigHitsToConsider);
+        overflowDecodeBuffer.init((GenomeLocation *)allocator->allocate(sizeof(GenomeLocation) * decodeBufferSize), decodeBufferSize, maxBigHitsToConsider);
+    }
 }
 
     void
@@ -166,13 +180,18 @@ IntersectingPairedEndAligner::align(
         SingleAlignmentResult *singleEndSecondaryResults     // Single-end secondary alignments for when the paired-end alignment didn't work properly
         )
 {
-    result->nLVCalls = 0;
-    result->nSmallHits = 0;
+    TIME_STAGE(CandidateStage);
 
     *nSecondaryResults = 0;
     *nSingleEndSecondaryResultsForFirstRead = 0;
     *nSingleEndSecondaryResultsForSecondRead = 0;
 
+    //
+    // Without -mpc only the best maxSecondaryResultsToReturn can be returned, so there's no need to keep more than that.
+    //
+    int secondaryResultsToKeep = maxSecondaryAlignmentsPerContig > 0 ? MAXINT32 : maxSecondaryResultsToReturn;
+    bool secondaryResultsHeapified = false;
+
     int maxSeeds;
     if (numSeedsFromCommandLine != 0) {
         maxSeeds = (int)numSeedsFromCommandLine;
@@ -196,6 +215,9 @@ IntersectingPairedEndAligner::align(
     }
     firstFreeMergeAnchor = 0;
 
+    seedLookups[0].clear();
+    seedLookups[1].clear();
+
     Read rcReads[NUM_READS_PER_PAIR];
 
     GenomeLocation bestResultGenomeLocation[NUM_READS_PER_PAIR];
@@ -203,6 +225,9 @@ IntersectingPairedEndAligner::align(
     unsigned bestResultScore[NUM_READS_PER_PAIR];
     unsigned popularSeedsSkipped[NUM_READS_PER_PAIR];
 
+    const _int64 lvCallsAtStart = nLVCalls;
+    bool searchTruncated = false;   // Ran out of workBudget
+
     reads[0][FORWARD] = read0;
     reads[1][FORWARD] = read1;
 
@@ -219,9 +244,12 @@ IntersectingPairedEndAligner::align(
     //
     unsigned countOfNs = 0;
 
+    overflowDecodeBuffer.reset();
+
     for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
         Read *read = reads[whichRead][FORWARD];
         readLen[whichRead] = read->getDataLength();
+        mateScoreLimit[whichRead] = MateMaxK(maxK, maxDistFraction, readLen[whichRead]) + extraSearchDepth;
         popularSeedsSkipped[whichRead] = 0;
         countOfHashTableLookups[whichRead] = 0;
 #if 0
@@ -241,10 +269,15 @@ IntersectingPairedEndAligner::align(
             soft_exit(1);
         }
 
-        for (unsigned i = 0; i < reads[whichRead][FORWARD]->getDataLength(); i++) {
-            rcReadData[whichRead][i] = rcTranslationTable[read->getData()[readLen[whichRead] - i - 1]];
-            rcReadQuality[whichRead][i] = read->getQuality()[readLen[whichRead] - i - 1];
-            countOfNs += nTable[read->getData()[i]];
+        //
+        // The reversed forward read is the data reversed and the reversed RC read is the data complemented, so they come
+        // out of the same pass as the RC read for the backwards LV to use.
+        //
+        countOfNs += ReverseComplementRead(read->getData(), read->getQuality(), readLen[whichRead], rcReadData[whichRead], rcReadQuality[whichRead],
+            reversedRead[whichRead][FORWARD], reversedRead[whichRead][RC]);
+        readSeeds[whichRead].set(read->getData(), readLen[whichRead]);
+        if (0 != minSeedQuality) {
+            readSeeds[whichRead].setQuality(read->getQuality(), readLen[whichRead], minSeedQuality);
         }
         reads[whichRead][RC] = &rcReads[whichRead];
         reads[whichRead][RC]->init(read->getId(), read->getIdLength(), rcReadData[whichRead], rcReadQuality[whichRead], read->getDataLength());
@@ -254,15 +287,12 @@ IntersectingPairedEndAligner::align(
         return;
     }
 
-    //
-    // Build the reverse data for both reads in both directions for the backwards LV to use.
-    //
-    for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
-        for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
-            Read *read = reads[whichRead][dir];
-
-            for (unsigned i = 0; i < read->getDataLength(); i++) {
-                reversedRead[whichRead][dir][i] = read->getData()[read->getDataLength() - i - 1];
+    if (NULL != packedGenome) {
+        for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+            for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
+                Read *read = reads[whichRead][dir];
+                packedRead[whichRead][dir].set(read->getData(), read->getDataLength());
+                packedReversedRead[whichRead][dir].set(reversedRead[whichRead][dir], read->getDataLength());
             }
         }
     }
@@ -282,99 +312,204 @@ IntersectingPairedEndAligner::align(
 
     //
     // Phase 1: do the hash table lookups for each of the seeds for each of the reads and add them to the hit sets.
+    // Which seeds we use doesn't depend on what the lookups return, so we pick them a batch at a time and then
+    // look the whole batch up together, which lets the index overlap the cache misses.
     //
     for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
         int nextSeedToTest = 0;
         unsigned wrapCount = 0;
         int nPossibleSeeds = (int)readLen[whichRead] - seedLen + 1;
         memset(seedUsed, 0, (__max(readLen[0], readLen[1]) + 7) / 8);
+        if (0 != minimizerWindow) {
+            FindReadMinimizers(reads[whichRead][FORWARD]->getData(), readLen[whichRead], seedLen, minimizerWindow, minimizerHashes, isMinimizerSeed);
+            for (int i = 0; i < nPossibleSeeds; i++) {
+                if (!isMinimizerSeed[i]) {
+                    SetSeedUsed(i);
+                }
+            }
+        }
         bool beginsDisjointHitSet[NUM_DIRECTIONS] = {true, true};
+        bool wrappedSinceLastSeed = false;
+        bool pastFirstPass = false;
+        unsigned seedsWithoutHits = 0;     // In the first pass, until one has hits; for -giveUp
+        bool anySeedHasHits = false;
+
+        if (1 == whichRead && shareMateSeeds) {
+            int overlap = findMateOverlap();
+            if (NoMateOverlap != overlap) {
+                shareMateSeedLookups(overlap, maxSeeds, popularSeedsSkipped);
+            }
+        }
+
+        for (;;) {
+            Seed seeds[GenomeIndex::MaxSeedLookupBatchSize];
+            int seedOffsets[GenomeIndex::MaxSeedLookupBatchSize];
+            bool seedFollowsWrap[GenomeIndex::MaxSeedLookupBatchSize];
+            int nSeedsInBatch = 0;
+
+            while (nSeedsInBatch < GenomeIndex::MaxSeedLookupBatchSize &&
+                countOfHashTableLookups[whichRead] < nPossibleSeeds && countOfHashTableLookups[whichRead] < maxSeeds) {
+                if (nextSeedToTest >= nPossibleSeeds) {
+                    wrapCount++;
+                    wrappedSinceLastSeed = true;
+                    if (wrapCount >= seedLen) {
+                        //
+                        // There aren't enough valid seeds in this read to reach our target.
+                        //
+                        break;
+                    }
+                    nextSeedToTest = GetWrappedNextSeedToTest(seedLen, wrapCount);
+                }
+
 
-        while (countOfHashTableLookups[whichRead] < nPossibleSeeds && countOfHashTableLookups[whichRead] < maxSeeds) {
-            if (nextSeedToTest >= nPossibleSeeds) {
-                wrapCount++;
-				beginsDisjointHitSet[FORWARD] = beginsDisjointHitSet[RC] = true;
-                if (wrapCount >= seedLen) {
+                while (nextSeedToTest < nPossibleSeeds && IsSeedUsed(nextSeedToTest)) {
                     //
-                    // There aren't enough valid seeds in this read to reach our target.
+                    // This seed is already used.  Try the next one.
                     //
-                    break;
+                    nextSeedToTest++;
                 }
-                nextSeedToTest = GetWrappedNextSeedToTest(seedLen, wrapCount);
-            }
 
+                if (0 != minSeedQuality && 0 == wrapCount && nextSeedToTest < nPossibleSeeds && !readSeeds[whichRead].isHighQuality(nextSeedToTest, seedLen)) {
+                    //
+                    // In the first pass, move off seeds over low quality bases (-sq), leaving them for the later passes.
+                    //
+                    nLowQualitySeedsSkipped++;
+                    while (nextSeedToTest < nPossibleSeeds && (IsSeedUsed(nextSeedToTest) || !readSeeds[whichRead].isHighQuality(nextSeedToTest, seedLen))) {
+                        nextSeedToTest++;
+                    }
+                }
 
-            while (nextSeedToTest < nPossibleSeeds && IsSeedUsed(nextSeedToTest)) {
-                //
-                // This seed is already used.  Try the next one.
-                //
-                nextSeedToTest++;
-            }
+                if (nextSeedToTest >= nPossibleSeeds) {
+                    //
+                    // Unusable seeds have pushed us past the end of the read.  Go back around the outer loop so we wrap properly.
+                    //
+                    continue;
+                }
 
-            if (nextSeedToTest >= nPossibleSeeds) {
-                //
-                // Unusable seeds have pushed us past the end of the read.  Go back around the outer loop so we wrap properly.
-                //
-                continue;
-            }
+                SetSeedUsed(nextSeedToTest);
 
-            SetSeedUsed(nextSeedToTest);
+                if (!readSeeds[whichRead].isSeed(nextSeedToTest, seedLen)) {
+                    //
+                    // It's got Ns in it, so just skip it.
+                    //
+                    nextSeedToTest++;
+                    continue;
+                }
+
+                seeds[nSeedsInBatch] = readSeeds[whichRead].getSeed(nextSeedToTest, seedLen);
+                seedOffsets[nSeedsInBatch] = nextSeedToTest;
+                seedFollowsWrap[nSeedsInBatch] = wrappedSinceLastSeed;
+                wrappedSinceLastSeed = false;
+                nSeedsInBatch++;
+
+                countOfHashTableLookups[whichRead]++;
+                nHashTableLookups++;
 
-            if (!Seed::DoesTextRepresentASeed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen)) {
                 //
-                // It's got Ns in it, so just skip it.
+                // If we don't have enough seeds left to reach the end of the read, space out the seeds more-or-less evenly.
                 //
-                nextSeedToTest++;
-                continue;
+                if ((maxSeeds - countOfHashTableLookups[whichRead] + 1) * (int)seedLen + nextSeedToTest < nPossibleSeeds) {
+                    _ASSERT((nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1) >= (int)seedLen);
+                    nextSeedToTest += (nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1);
+                    _ASSERT(nextSeedToTest < nPossibleSeeds);   // We haven't run off the end of the read.
+                } else {
+                    nextSeedToTest += seedLen;
+                }
+            } // while we need to pick seeds for this batch
+
+            if (0 == nSeedsInBatch) {
+                break;
             }
 
-            Seed seed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen);
             //
-            // Find all instances of this seed in the genome.
+            // Find all instances of these seeds in the genome.
             //
-            _int64 nHits[NUM_DIRECTIONS];
-            const GenomeLocation *hits[NUM_DIRECTIONS];
-            const unsigned *hits32[NUM_DIRECTIONS];
+            _int64 nHits[NUM_DIRECTIONS][GenomeIndex::MaxSeedLookupBatchSize];
+            const GenomeLocation *hits[NUM_DIRECTIONS][GenomeIndex::MaxSeedLookupBatchSize];
+            const unsigned *hits32[NUM_DIRECTIONS][GenomeIndex::MaxSeedLookupBatchSize];
+            GenomeLocation singleHits[NUM_DIRECTIONS][GenomeIndex::MaxSeedLookupBatchSize];
 
+            TIME_STAGE(SeedLookupStage);
             if (doesGenomeIndexHave64BitLocations) {
-                index->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC], 
-                            hashTableHitSets[whichRead][FORWARD]->getNextSingletonLocation(), hashTableHitSets[whichRead][RC]->getNextSingletonLocation());
+                index->lookupSeeds(seeds, nSeedsInBatch, nHits[FORWARD], hits[FORWARD], nHits[RC], hits[RC], singleHits[FORWARD], singleHits[RC],
+                    &overflowDecodeBuffer, maxBigHits - 1);
             } else {
-                index->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
+                index->lookupSeeds32(seeds, nSeedsInBatch, nHits[FORWARD], hits32[FORWARD], nHits[RC], hits32[RC], maxBigHits - 1);
             }
+            END_STAGE(SeedLookupStage);
 
-            countOfHashTableLookups[whichRead]++;
-            for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
-                int offset;
-                if (dir == FORWARD) {
-                    offset = nextSeedToTest;
-                } else {
-                    offset = readLen[whichRead] - seedLen - nextSeedToTest;
+            for (int i = 0; i < nSeedsInBatch; i++) {
+                //
+                // Keep the lookup for the single-end aligner, unless a compressed overflow table only decoded the
+                // part of a hit list that we'd use, or the seed sketch let us skip a popular seed's hit lists.
+                //
+                bool haveHitLists = true;
+                for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+                    haveHitLists = haveHitLists &&
+                        (0 == nHits[dir][i] || NULL != (doesGenomeIndexHave64BitLocations ? (const void *)hits[dir][i] : (const void *)hits32[dir][i]));
                 }
-                if (nHits[dir] < maxBigHits) {
-                    totalHashTableHits[whichRead][dir] += nHits[dir];
+
+                if (haveHitLists && (!index->hasCompressedOverflowTable() || (nHits[FORWARD][i] <= maxBigHits && nHits[RC][i] <= maxBigHits))) {
+                    _int64 seedNHits[NUM_DIRECTIONS] = {nHits[FORWARD][i], nHits[RC][i]};
                     if (doesGenomeIndexHave64BitLocations) {
-                        hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits[dir], beginsDisjointHitSet[dir]);
+                        const GenomeLocation *seedHits[NUM_DIRECTIONS] = {hits[FORWARD][i], hits[RC][i]};
+                        seedLookups[whichRead].add(seedOffsets[i], seedNHits, seedHits, NULL);
                     } else {
-                        hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits32[dir], beginsDisjointHitSet[dir]);
+                        const unsigned *seedHits32[NUM_DIRECTIONS] = {hits32[FORWARD][i], hits32[RC][i]};
+                        seedLookups[whichRead].add(seedOffsets[i], seedNHits, NULL, seedHits32);
+                    }
+                }
+
+                if (seedFollowsWrap[i]) {
+                    beginsDisjointHitSet[FORWARD] = beginsDisjointHitSet[RC] = true;
+                    pastFirstPass = true;
+                }
+
+                if (!pastFirstPass && !anySeedHasHits) {
+                    anySeedHasHits = (0 != nHits[FORWARD][i] && nHits[FORWARD][i] < maxBigHits) || (0 != nHits[RC][i] && nHits[RC][i] < maxBigHits);
+                    seedsWithoutHits += anySeedHasHits ? 0 : 1;
+                }
+
+                for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+                    int offset;
+                    if (dir == FORWARD) {
+                        offset = seedOffsets[i];
+                    } else {
+                        offset = readLen[whichRead] - seedLen - seedOffsets[i];
+                    }
+                    if (nHits[dir][i] < maxBigHits) {
+                        totalHashTableHits[whichRead][dir] += nHits[dir][i];
+                        if (doesGenomeIndexHave64BitLocations) {
+                            const GenomeLocation *seedHits = hits[dir][i];
+                            if (1 == nHits[dir][i]) {
+                                //
+                                // Single hits came back in our local singleHits, which won't be around when we use the hit sets.
+                                // Move it to the hit set's own singleton storage.
+                                //
+                                GenomeLocation *singletonLocation = hashTableHitSets[whichRead][dir]->getNextSingletonLocation();
+                                *singletonLocation = *seedHits;
+                                seedHits = singletonLocation;
+                            }
+                            hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir][i], seedHits, beginsDisjointHitSet[dir]);
+                        } else {
+                            hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir][i], hits32[dir][i], beginsDisjointHitSet[dir]);
+                        }
+                        beginsDisjointHitSet[dir]= false;
+                    } else {
+                        popularSeedsSkipped[whichRead]++;
+                        nPopularSeedsSkipped++;
                     }
-                    beginsDisjointHitSet[dir]= false;
-                } else {
-                    popularSeedsSkipped[whichRead]++;
                 }
             }
 
-            //
-            // If we don't have enough seeds left to reach the end of the read, space out the seeds more-or-less evenly.
-            //
-            if ((maxSeeds - countOfHashTableLookups[whichRead] + 1) * (int)seedLen + nextSeedToTest < nPossibleSeeds) {
-                _ASSERT((nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1) >= (int)seedLen);
-                nextSeedToTest += (nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1);
-                _ASSERT(nextSeedToTest < nPossibleSeeds);   // We haven't run off the end of the read.
-            } else {
-                nextSeedToTest += seedLen;
+            if (0 != maxSeedsWithoutHits && !anySeedHasHits && seedsWithoutHits >= maxSeedsWithoutHits) {
+                //
+                // -giveUp: this read has nothing usable in the index, so don't look up the rest of its seeds.  The pair
+                // won't be found, and the single-end aligner will give up on the read the same way.
+                //
+                break;
             }
-        } // while we need to lookup seeds for this read
+        } // for each batch of seeds for this read
     } // for each read
 
     readWithMoreHits = totalHashTableHits[0][FORWARD] + totalHashTableHits[0][RC] > totalHashTableHits[1][FORWARD] + totalHashTableHits[1][RC] ? 0 : 1;
@@ -580,6 +715,14 @@ IntersectingPairedEndAligner::align(
     //
     unsigned currentBestPossibleScoreList = 0;
     scoreLimit = maxK + extraSearchDepth;
+
+    //
+    // The candidates from the one being scored up to (but not including) prefetchEnd on prefetchList have had their
+    // genome data prefetched.  Scoring only takes candidates off the front of a list, so prefetchEnd stays on it.
+    //
+    unsigned prefetchList = (unsigned)-1;  // None yet
+    ScoringCandidate *prefetchEnd = NULL;
+    unsigned nPrefetched = 0;
     //
     // Loop until we've scored all of the candidates, or proven that what's left must have too high of a score to be interesting.
     //
@@ -598,6 +741,23 @@ IntersectingPairedEndAligner::align(
         //
         ScoringCandidate *candidate = scoringCandidates[currentBestPossibleScoreList];
 
+        if (doAlignerPrefetch) {
+            //
+            // Keep the next few candidates' reference data (both ends) on its way into the cache while this one is scored.
+            //
+            if (prefetchList != currentBestPossibleScoreList) {
+                prefetchList = currentBestPossibleScoreList;
+                prefetchEnd = candidate;
+                nPrefetched = 0;
+            }
+
+            while (nPrefetched < scoringPrefetchDepth && NULL != prefetchEnd) {
+                prefetchScoringCandidate(prefetchEnd);
+                prefetchEnd = prefetchEnd->scoreListNext;
+                nPrefetched++;
+            }
+        }
+
         unsigned fewerEndScore;
         double fewerEndMatchProbability;
         int fewerEndGenomeLocationOffset;
@@ -653,6 +813,10 @@ IntersectingPairedEndAligner::align(
 
                     if (mate->score != -1) {
                         double pairProbability = mate->matchProbability * fewerEndMatchProbability;
+                        if (NULL != insertSizeDistribution) {
+                            pairProbability *= insertSizeDistribution->getSpacingPrior((int)DistanceBetweenGenomeLocations(
+                                mate->readWithMoreHitsGenomeLocation, candidate->readWithFewerHitsGenomeLocation));
+                        }
                         unsigned pairScore = mate->score + fewerEndScore;
                         //
                         // See if this should be ignored as a merge, or if we need to back out a previously scored location
@@ -737,24 +901,23 @@ IntersectingPairedEndAligner::align(
                                     // because bestPairScore is initialized to be very large.
                                     //
                                     //
-                                    if (*nSecondaryResults >= secondaryResultBufferSize) {
-                                        WriteErrorMessage("IntersectingPairedEndAligner::align(): out of secondary result buffer\n");
-                                        soft_exit(1);
-                                    }
-
-                                    PairedAlignmentResult *result = &secondaryResults[*nSecondaryResults];
-                                    result->alignedAsPair = true;
-                                    result->fromAlignTogether = true;
+                                    PairedAlignmentResult secondaryResult;
+                                    secondaryResult.alignedAsPair = true;
+                                    secondaryResult.fromAlignTogether = true;
 
                                     for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
-                                        result->direction[r] = bestResultDirection[r];
-                                        result->location[r] = bestResultGenomeLocation[r];
-                                        result->mapq[r] = 0;
-                                        result->score[r] = bestResultScore[r];
-                                        result->status[r] = MultipleHits;
+                                        secondaryResult.direction[r] = bestResultDirection[r];
+                                        secondaryResult.location[r] = bestResultGenomeLocation[r];
+                                        secondaryResult.mapq[r] = 0;
+                                        secondaryResult.score[r] = bestResultScore[r];
+                                        secondaryResult.status[r] = MultipleHits;
+                                    }
+
+                                    if (!AddSecondaryResult(secondaryResults, nSecondaryResults, secondaryResultBufferSize, secondaryResultsToKeep,
+                                            &secondaryResultsHeapified, secondaryResult)) {
+                                        WriteErrorMessage("IntersectingPairedEndAligner::align(): out of secondary result buffer\n");
+                                        soft_exit(1);
                                     }
- 
-                                    (*nSecondaryResults)++;
 
                                 }
                                 bestPairScore = pairScore;
@@ -776,24 +939,23 @@ IntersectingPairedEndAligner::align(
                                     //
                                     // A secondary result to save.
                                     //
-                                    if (*nSecondaryResults >= secondaryResultBufferSize) {
+                                    PairedAlignmentResult secondaryResult;
+                                    secondaryResult.alignedAsPair = true;
+                                    secondaryResult.direction[readWithMoreHits] = setPairDirection[candidate->whichSetPair][readWithMoreHits];
+                                    secondaryResult.direction[readWithFewerHits] = setPairDirection[candidate->whichSetPair][readWithFewerHits];
+                                    secondaryResult.fromAlignTogether = true;
+                                    secondaryResult.location[readWithMoreHits] = mate->readWithMoreHitsGenomeLocation + mate->genomeOffset;
+                                    secondaryResult.location[readWithFewerHits] = candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset;
+                                    secondaryResult.mapq[0] = secondaryResult.mapq[1] = 0;
+                                    secondaryResult.score[readWithMoreHits] = mate->score;
+                                    secondaryResult.score[readWithFewerHits] = fewerEndScore;
+                                    secondaryResult.status[readWithFewerHits] = secondaryResult.status[readWithMoreHits] = MultipleHits;
+
+                                    if (!AddSecondaryResult(secondaryResults, nSecondaryResults, secondaryResultBufferSize, secondaryResultsToKeep,
+                                            &secondaryResultsHeapified, secondaryResult)) {
                                         WriteErrorMessage("IntersectingPairedEndAligner::align(): out of secondary result buffer.  Read ID %.*s\n", read0->getIdLength(), read0->getId());
                                         soft_exit(1);
                                     }
-
-                                    PairedAlignmentResult *result = &secondaryResults[*nSecondaryResults];
-                                    result->alignedAsPair = true;
-                                    result->direction[readWithMoreHits] = setPairDirection[candidate->whichSetPair][readWithMoreHits];
-                                    result->direction[readWithFewerHits] = setPairDirection[candidate->whichSetPair][readWithFewerHits];
-                                    result->fromAlignTogether = true;
-                                    result->location[readWithMoreHits] = mate->readWithMoreHitsGenomeLocation + mate->genomeOffset;
-                                    result->location[readWithFewerHits] = candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset;
-                                    result->mapq[0] = result->mapq[1] = 0;
-                                    result->score[readWithMoreHits] = mate->score;
-                                    result->score[readWithFewerHits] = fewerEndScore;
-                                    result->status[readWithFewerHits] = result->status[readWithMoreHits] = MultipleHits;
-
-                                    (*nSecondaryResults)++;
                                 }
                             }
 
@@ -833,6 +995,19 @@ IntersectingPairedEndAligner::align(
         // Remove us from the head of the list and proceed to the next candidate to score.
         //
         scoringCandidates[currentBestPossibleScoreList] = candidate->scoreListNext;
+        if (nPrefetched > 0) {
+            nPrefetched--;
+        }
+
+        if (0 != workBudget && nLVCalls - lvCallsAtStart >= workBudget) {
+            //
+            // Out of budget.  Settle for the best pair we've got, with its MAPQ capped below.
+            //
+            searchTruncated = true;
+            read0->setAlignmentTruncated();
+            read1->setAlignmentTruncated();
+            break;
+        }
      }
 
 doneScoring:
@@ -857,6 +1032,9 @@ doneScoring:
             result->location[whichRead] = bestResultGenomeLocation[whichRead];
             result->direction[whichRead] = bestResultDirection[whichRead];
             result->mapq[whichRead] = computeMAPQ(probabilityOfAllPairs, probabilityOfBestPair, bestResultScore[whichRead], popularSeedsSkipped[0] + popularSeedsSkipped[1]);
+            if (searchTruncated) {
+                result->mapq[whichRead] = __min(MAX_MAPQ_FOR_TRUNCATED_SEARCH, result->mapq[whichRead]);
+            }
             result->status[whichRead] = result->mapq[whichRead] > MAPQ_LIMIT_FOR_SINGLE_HIT ? SingleHit : MultipleHits;
             result->score[whichRead] = bestResultScore[whichRead];
         }
@@ -917,7 +1095,7 @@ doneScoring:
             //
             // Just sort them all, in order of contig then hit depth.
             //
-            qsort(secondaryResults, *nSecondaryResults, sizeof(*secondaryResults), PairedAlignmentResult::compareByContigAndScore);
+            PairedAlignmentResult::sortByContigAndScore(secondaryResults, *nSecondaryResults, genome);
 
             //
             // Now run through and eliminate any contigs with too many hits.  We can't use the same trick at the first loop above, because the
@@ -951,9 +1129,105 @@ doneScoring:
     } // if we're limiting by contig
 
 
-    if (*nSecondaryResults > maxSecondaryResultsToReturn) {
+    if (*nSecondaryResults > maxSecondaryResultsToReturn || secondaryResultsHeapified) {
         qsort(secondaryResults, *nSecondaryResults, sizeof(*secondaryResults), PairedAlignmentResult::compareByScore);
-        *nSecondaryResults = maxSecondaryResultsToReturn;   // Just truncate it
+        *nSecondaryResults = __min(*nSecondaryResults, maxSecondaryResultsToReturn);   // Just truncate it
+    }
+}
+
+    int
+IntersectingPairedEndAligner::findMateOverlap() const
+{
+    //
+    // Look for the first seed's worth of read 1's reverse complement in read 0, and failing that for the first seed's
+    // worth of read 0 in read 1's reverse complement.  A sequencing error in one of them just costs us the sharing.
+    //
+    const char *read0Data = reads[0][FORWARD]->getData();
+    const char *rcRead1Data = rcReadData[1];
+
+    for (int overlap = 0; overlap + seedLen <= readLen[0]; overlap++) {
+        if (0 == memcmp(read0Data + overlap, rcRead1Data, seedLen)) {
+            return overlap;
+        }
+    }
+
+    for (int overlap = 1; overlap + seedLen <= readLen[1]; overlap++) {
+        if (0 == memcmp(rcRead1Data + overlap, read0Data, seedLen)) {
+            return -overlap;
+        }
+    }
+
+    return NoMateOverlap;
+}
+
+    void
+IntersectingPairedEndAligner::shareMateSeedLookups(int overlap, int maxSeeds, unsigned *popularSeedsSkipped)
+{
+    const SeedLookupResults *mateLookups = &seedLookups[0];
+    const char *read0Data = reads[0][FORWARD]->getData();
+    int previousOffset = -1;
+    bool beginsDisjointHitSet[NUM_DIRECTIONS] = {true, true};
+
+    for (int i = 0; i < mateLookups->nSeeds && countOfHashTableLookups[1] < maxSeeds; i++) {
+        int mateOffset = mateLookups->offset[i];
+        int rcOffset = mateOffset - overlap;      // Where the seed is in read 1's reverse complement
+
+        if (rcOffset < 0 || rcOffset + seedLen > readLen[1] || 0 != memcmp(read0Data + mateOffset, rcReadData[1] + rcOffset, seedLen)) {
+            continue;
+        }
+
+        int offset = readLen[1] - seedLen - rcOffset;
+        if (IsSeedUsed(offset)) {
+            continue;
+        }
+        SetSeedUsed(offset);
+
+        //
+        // Read 0's seeds go forward through it a pass at a time, so read 1's go backward.  A seed that doesn't (because
+        // it's from a later pass) overlaps the ones before it, so it starts a new disjoint hit set.
+        //
+        if (-1 != previousOffset && (offset > previousOffset || previousOffset - offset < (int)seedLen)) {
+            beginsDisjointHitSet[FORWARD] = beginsDisjointHitSet[RC] = true;
+        }
+        previousOffset = offset;
+
+        //
+        // The seed is the reverse complement of read 0's, so read 1's forward hits are read 0's RC ones and vice versa.
+        //
+        _int64 nHits[NUM_DIRECTIONS] = {mateLookups->nHits[RC][i], mateLookups->nHits[FORWARD][i]};
+        if (doesGenomeIndexHave64BitLocations) {
+            const GenomeLocation *hits[NUM_DIRECTIONS] = {mateLookups->hits[RC][i], mateLookups->hits[FORWARD][i]};
+            seedLookups[1].add(offset, nHits, hits, NULL);
+        } else {
+            const unsigned *hits32[NUM_DIRECTIONS] = {mateLookups->hits32[RC][i], mateLookups->hits32[FORWARD][i]};
+            seedLookups[1].add(offset, nHits, NULL, hits32);
+        }
+
+        countOfHashTableLookups[1]++;
+        nMateSeedLookupsShared++;
+
+        for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+            Direction mateDir = OppositeDirection(dir);
+            if (nHits[dir] < maxBigHits) {
+                totalHashTableHits[1][dir] += nHits[dir];
+                int offsetForDir = dir == FORWARD ? offset : rcOffset;
+                if (doesGenomeIndexHave64BitLocations) {
+                    const GenomeLocation *hits = mateLookups->hits[mateDir][i];
+                    if (1 == nHits[dir]) {
+                        GenomeLocation *singletonLocation = hashTableHitSets[1][dir]->getNextSingletonLocation();
+                        *singletonLocation = *hits;
+                        hits = singletonLocation;
+                    }
+                    hashTableHitSets[1][dir]->recordLookup(offsetForDir, nHits[dir], hits, beginsDisjointHitSet[dir]);
+                } else {
+                    hashTableHitSets[1][dir]->recordLookup(offsetForDir, nHits[dir], mateLookups->hits32[mateDir][i], beginsDisjointHitSet[dir]);
+                }
+                beginsDisjointHitSet[dir] = false;
+            } else {
+                popularSeedsSkipped[1]++;
+                nPopularSeedsSkipped++;
+            }
+        }
     }
 }
 
@@ -968,8 +1242,11 @@ IntersectingPairedEndAligner::scoreLocation(
     double              *matchProbability,
     int                 *genomeLocationOffset)
 {
+    TIME_STAGE(LVStage);
     nLocationsScored++;
 
+    scoreLimit = __min(scoreLimit, mateScoreLimit[whichRead]);
+
     Read *readToScore = reads[whichRead][direction];
     unsigned readDataLength = readToScore->getDataLength();
     GenomeDistance genomeDataLength = readDataLength + MAX_K; // Leave extra space in case the read has deletions
@@ -1027,15 +1304,28 @@ IntersectingPairedEndAligner::scoreLocation(
     } else {
         textLen = (int)(genomeDataLength - tailStart);
     }
-    score1 = landauVishkin->computeEditDistance(data + tailStart, textLen, readToScore->getData() + tailStart, readToScore->getQuality() + tailStart, readLen - tailStart,
-        scoreLimit, &matchProb1);
+    nLVCalls++;
+    if (NULL != packedGenome) {
+        score1 = landauVishkin->computeEditDistance(packedGenome, GenomeLocationAsInt64(genomeLocation) + tailStart, textLen, &packedRead[whichRead][direction], tailStart,
+            readToScore->getQuality() + tailStart, readLen - tailStart, scoreLimit, &matchProb1);
+    } else {
+        score1 = landauVishkin->computeEditDistance(data + tailStart, textLen, readToScore->getData() + tailStart, readToScore->getQuality() + tailStart, readLen - tailStart,
+            scoreLimit, &matchProb1);
+    }
     if (score1 == -1) {
         *score = -1;
     } else {
         // The tail of the read matched; now let's reverse the reference genome data and match the head
         int limitLeft = scoreLimit - score1;
-        score2 = reverseLandauVishkin->computeEditDistance(data + seedOffset, seedOffset + MAX_K, reversedRead[whichRead][direction] + readLen - seedOffset,
+        nLVCalls++;
+        if (NULL != packedGenome) {
+            score2 = reverseLandauVishkin->computeEditDistance(packedGenome, GenomeLocationAsInt64(genomeLocation) + seedOffset, seedOffset + MAX_K,
+                                                                    &packedReversedRead[whichRead][direction], readLen - seedOffset,
                                                                     reads[whichRead][OppositeDirection(direction)]->getQuality() + readLen - seedOffset, seedOffset, limitLeft, &matchProb2, genomeLocationOffset);
+        } else {
+            score2 = reverseLandauVishkin->computeEditDistance(data + seedOffset, seedOffset + MAX_K, reversedRead[whichRead][direction] + readLen - seedOffset,
+                                                                    reads[whichRead][OppositeDirection(direction)]->getQuality() + readLen - seedOffset, seedOffset, limitLeft, &matchProb2, genomeLocationOffset);
+        }
 
         if (score2 == -1) {
             *score = -1;
@@ -1052,6 +1342,40 @@ IntersectingPairedEndAligner::scoreLocation(
     }
 }
 
+    void
+IntersectingPairedEndAligner::prefetchScoringWindow(unsigned whichRead, GenomeLocation genomeLocation)
+{
+    //
+    // From MAX_K before the location (for the reverse edit distance) to MAX_K past the end of the read.
+    //
+    GenomeLocation start = genomeLocation - MAX_K;
+    GenomeDistance length = reads[whichRead][FORWARD]->getDataLength() + 2 * MAX_K;
+
+    if (NULL != packedGenome) {
+        packedGenome->prefetch(GenomeLocationAsInt64(start), length);
+    } else {
+        genome->prefetchData(start, length);
+    }
+}
+
+    void
+IntersectingPairedEndAligner::prefetchScoringCandidate(ScoringCandidate *candidate)
+{
+    prefetchScoringWindow(readWithFewerHits, candidate->readWithFewerHitsGenomeLocation);
+
+    ScoringMateCandidate *mates = scoringMateCandidates[candidate->whichSetPair];
+    unsigned nMatesPrefetched = 0;
+    for (int mateIndex = (int)candidate->scoringMateCandidateIndex;
+            mateIndex >= 0 && nMatesPrefetched < scoringPrefetchDepth &&
+            genomeLocationIsWithin(mates[mateIndex].readWithMoreHitsGenomeLocation, candidate->readWithFewerHitsGenomeLocation, maxSpacing);
+            mateIndex--) {
+        if ((unsigned)-2 == mates[mateIndex].score) {
+            prefetchScoringWindow(readWithMoreHits, mates[mateIndex].readWithMoreHitsGenomeLocation);
+            nMatesPrefetched++;
+        }
+    }
+}
+
     void
  IntersectingPairedEndAligner::HashTableHitSet::firstInit(unsigned maxSeeds_, unsigned maxMergeDistance_, BigAllocator *allocator, bool doesGenomeIndexHave64BitLocations_)
  {
@@ -1180,6 +1504,76 @@ IntersectingPairedEndAligner::HashTableHitSet::computeBestPossibleScoreForCurren
 	return bestPossibleScoreSoFar;
 }
 
+    template<class GL> bool
+IntersectingPairedEndAligner::HashTableHitSet::advanceToHitAtOrBelow(HashTableLookup<GL> *lookup, GenomeLocation maxGenomeLocationToFindThisSeed)
+/*++
+
+Routine Description:
+
+    Galloping search.  The hits are sorted from largest to smallest, and the location being looked for mostly moves down
+    a little at a time, so the answer is usually a few hits past where the last one was.  Probe 1, 2, 4, ... hits past it until one is
+    at or below the location, then binary search the last gap.  That's a handful of probes close together rather than a
+    binary search of everything that's left, which for a popular seed can be thousands of hits.
+
+    The answer is the same as the binary search this replaced gave, including that a lookup whose current hit is
+    already at or below the location, with the one before it too, counts as exhausted.
+
+--*/
+{
+    _int64 current = lookup->currentHitForIntersection;
+    _int64 nHits = lookup->nHits;
+
+    if (current < nHits && GenomeLocation(lookup->hits[current]) <= maxGenomeLocationToFindThisSeed) {
+        if (0 == current || GenomeLocation(lookup->hits[current - 1]) > maxGenomeLocationToFindThisSeed) {
+            return true;
+        }
+        lookup->currentHitForIntersection = nHits;
+        return false;
+    }
+
+    _int64 above = current;     // The last hit known to be above the location
+    _int64 step = 1;
+    _int64 probe = current + 1;
+    while (probe < nHits && GenomeLocation(lookup->hits[probe]) > maxGenomeLocationToFindThisSeed) {
+        above = probe;
+        step *= 2;
+        probe = above + step;
+        if (doAlignerPrefetch && probe < nHits) {
+            _mm_prefetch((const char *)&lookup->hits[__min(nHits - 1, probe + 2 * step)], _MM_HINT_T2);
+        }
+    }
+
+    if (probe >= nHits) {
+        probe = nHits - 1;
+        if (probe <= above) {
+            lookup->currentHitForIntersection = nHits;
+            return false;
+        }
+    }
+
+    //
+    // hits[above] is above the location and hits[probe] is at or below it, unless probe is the last hit, which could be either.
+    //
+    _int64 low = above + 1;
+    _int64 high = probe;
+    while (low < high) {
+        _int64 middle = (low + high) / 2;
+        if (GenomeLocation(lookup->hits[middle]) <= maxGenomeLocationToFindThisSeed) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    if (GenomeLocation(lookup->hits[low]) > maxGenomeLocationToFindThisSeed) {
+        lookup->currentHitForIntersection = nHits;
+        return false;
+    }
+
+    lookup->currentHitForIntersection = low;
+    return true;
+}
+
 	bool
 IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(GenomeLocation maxGenomeLocationToFind, GenomeLocation *actualGenomeLocationFound, unsigned *seedOffsetFound)
 {
@@ -1187,82 +1581,27 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(Genom
     bool anyFound = false;
     GenomeLocation bestLocationFound = 0;
     for (unsigned i = 0; i < nLookupsUsed; i++) {
-        //
-        // Binary search from the current starting offset to either the right place or the end.
-        //
-        _int64 limit[2];
-        GenomeLocation maxGenomeLocationToFindThisSeed;
+        GenomeLocation hit;
+        unsigned seedOffset;
 
         if (doesGenomeIndexHave64BitLocations) {
-            limit[0] = (_int64)lookups64[i].currentHitForIntersection;
-            limit[1] = (_int64)lookups64[i].nHits - 1;
-            maxGenomeLocationToFindThisSeed = maxGenomeLocationToFind + lookups64[i].seedOffset;
-        } else {
-            limit[0] = (_int64)lookups32[i].currentHitForIntersection;
-            limit[1] = (_int64)lookups32[i].nHits - 1;
-            maxGenomeLocationToFindThisSeed = maxGenomeLocationToFind + lookups32[i].seedOffset;
-        }
- 
-        while (limit[0] <= limit[1]) {
-            _int64 probe = (limit[0] + limit[1]) / 2;
-            if (doAlignerPrefetch) { // not clear this helps.  We're probably not far enough ahead.
-                if (doesGenomeIndexHave64BitLocations) {
-                    _mm_prefetch((const char *)&lookups64[i].hits[(limit[0] + probe) / 2 - 1], _MM_HINT_T2);
-                    _mm_prefetch((const char *)&lookups64[i].hits[(limit[1] + probe) / 2 + 1], _MM_HINT_T2);
-                } else {
-                    _mm_prefetch((const char *)&lookups32[i].hits[(limit[0] + probe) / 2 - 1], _MM_HINT_T2);
-                    _mm_prefetch((const char *)&lookups32[i].hits[(limit[1] + probe) / 2 + 1], _MM_HINT_T2);
-                }
-            }
-            //
-            // Recall that the hit sets are sorted from largest to smallest, so the strange looking logic is actually right.
-            // We're evaluating the expression "lookups[i].hits[probe] <= maxGenomeOffsetToFindThisSeed && (probe == 0 || lookups[i].hits[probe-1] > maxGenomeOffsetToFindThisSeed)"
-            // It's written in this strange way just so the profile tool will show us where the time's going.
-            //
-            GenomeLocation probeHit;
-            GenomeLocation probeMinusOneHit;
-            unsigned seedOffset;
-            if (doesGenomeIndexHave64BitLocations) {
-                probeHit = lookups64[i].hits[probe];
-                probeMinusOneHit = lookups64[i].hits[probe-1];
-                seedOffset = lookups64[i].seedOffset;
-            } else {
-                probeHit = lookups32[i].hits[probe];
-                probeMinusOneHit = lookups32[i].hits[probe-1];
-                seedOffset = lookups32[i].seedOffset;
-            }
-            unsigned clause1 =  probeHit <= maxGenomeLocationToFindThisSeed;
-            unsigned clause2 = probe == 0;
-
-            if (clause1 && (clause2 || probeMinusOneHit > maxGenomeLocationToFindThisSeed)) {
-                if (probeHit - seedOffset > bestLocationFound) {
-					anyFound = true;
-                    mostRecentLocationReturned = *actualGenomeLocationFound = bestLocationFound = probeHit - seedOffset;
-                    *seedOffsetFound = seedOffset;
-                }
-
-                if (doesGenomeIndexHave64BitLocations) {
-                    lookups64[i].currentHitForIntersection = probe;
-                } else {
-                    lookups32[i].currentHitForIntersection = probe;
-                }
-                break;
+            seedOffset = lookups64[i].seedOffset;
+            if (!advanceToHitAtOrBelow(&lookups64[i], maxGenomeLocationToFind + seedOffset)) {
+                continue;
             }
-
-            if (probeHit > maxGenomeLocationToFindThisSeed) {   // Recode this without the if to avoid the hard-to-predict branch.
-                limit[0] = probe + 1;
-            } else {
-                limit[1] = probe - 1;
+            hit = lookups64[i].hits[lookups64[i].currentHitForIntersection];
+        } else {
+            seedOffset = lookups32[i].seedOffset;
+            if (!advanceToHitAtOrBelow(&lookups32[i], maxGenomeLocationToFind + seedOffset)) {
+                continue;
             }
-        } // While we're looking
+            hit = lookups32[i].hits[lookups32[i].currentHitForIntersection];
+        }
 
-        if (limit[0] > limit[1]) {
-            // We're done with this lookup.
-            if (doesGenomeIndexHave64BitLocations) {
-                lookups64[i].currentHitForIntersection = lookups64[i].nHits;    
-            } else {
-                lookups32[i].currentHitForIntersection = lookups32[i].nHits;
-            }
+        if (hit - seedOffset > bestLocationFound) {
+            anyFound = true;
+            mostRecentLocationReturned = *actualGenomeLocationFound = bestLocationFound = hit - seedOffset;
+            *seedOffsetFound = seedOffset;
         }
     } // For each lookup
 
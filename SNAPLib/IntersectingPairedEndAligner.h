@@ -28,6 +28,7 @@ Revision History:
 #include "directions.h"
 #include "LandauVishkin.h"
 #include "FixedSizeMap.h"
+#include "InsertSizeDistribution.h"
 
 const unsigned DEFAULT_INTERSECTING_ALIGNER_MAX_HITS = 2000;
 const unsigned DEFAULT_MAX_CANDIDATE_POOL_SIZE = 1000000;
@@ -76,6 +77,18 @@ public:
         landauVishkin = landauVishkin_;
         reverseLandauVishkin = reverseLandauVishkin_;
     }
+
+    //
+    // Search only the window the distribution was fitted to, and weight each pair's probability by how typical its
+    // spacing is.  The window can only narrow, since the secondary result buffers were sized for the constructor's.
+    //
+    void setInsertSizeDistribution(const InsertSizeDistribution *insertSizeDistribution_)
+    {
+        _ASSERT(insertSizeDistribution_->isReady());
+        insertSizeDistribution = insertSizeDistribution_;
+        minSpacing = __max(minSpacing, (unsigned)insertSizeDistribution->getMinSpacing());
+        maxSpacing = __min(maxSpacing, (unsigned)insertSizeDistribution->getMaxSpacing());
+    }
     
     virtual ~IntersectingPairedEndAligner();
     
@@ -108,6 +121,31 @@ public:
          return nLocationsScored;
      }
 
+    virtual void setWorkBudget(unsigned newValue) {workBudget = newValue;}
+
+    virtual void setMinSeedQuality(unsigned newValue) {minSeedQuality = newValue;}
+
+    virtual void setMaxSeedsWithoutHits(unsigned newValue) {maxSeedsWithoutHits = newValue;}
+
+    virtual void setMaxDistFraction(float newValue) {maxDistFraction = newValue;}
+
+    _int64 getNLowQualitySeedsSkipped() const {return nLowQualitySeedsSkipped;}
+
+    void setShareMateSeeds(bool newValue) {shareMateSeeds = newValue;}
+
+    _int64 getNMateSeedLookupsShared() const {return nMateSeedLookupsShared;}
+
+    virtual void getWorkCounters(AlignerWorkCounters *counters) const {
+        counters->hashTableLookups = nHashTableLookups;
+        counters->locationsScored = nLocationsScored;
+        counters->lvCalls = nLVCalls;
+        counters->popularSeedsSkipped = nPopularSeedsSkipped;
+    }
+
+    virtual const SeedLookupResults *getSeedLookups(int whichRead) const {
+        return &seedLookups[whichRead];
+    }
+
 
 private:
 
@@ -132,9 +170,22 @@ private:
     static const unsigned MAX_MAX_SEEDS = 30;
     unsigned        minSpacing;
     unsigned        maxSpacing;
+    const InsertSizeDistribution *insertSizeDistribution;   // NULL until one's been fitted
+    SeedLookupResults seedLookups[NUM_READS_PER_PAIR];     // For the single-end aligner, if we don't find a pair
     unsigned        seedLen;
     bool            doesGenomeIndexHave64BitLocations;
     _int64          nLocationsScored;
+    _int64          nHashTableLookups;
+    _int64          nLVCalls;
+    _int64          nPopularSeedsSkipped;
+    _int64          nLowQualitySeedsSkipped;
+    _int64          nMateSeedLookupsShared;
+    bool            shareMateSeeds;     // -mateSeeds
+    unsigned        workBudget;
+    unsigned        minSeedQuality;     // -sq, 0 for off
+    unsigned        maxSeedsWithoutHits;    // -giveUp, 0 for off
+    float           maxDistFraction;        // -dp, 0 for off
+    unsigned        mateScoreLimit[NUM_READS_PER_PAIR];     // The most that scoreLocation looks for on each mate of this pair
     bool            noUkkonen;
     bool            noOrderedEvaluation;
 	bool			noTruncation;
@@ -250,6 +301,12 @@ private:
             unsigned missCount;
         };
 
+        //
+        // Move a lookup's currentHitForIntersection down to its first hit at or below maxGenomeLocationToFindThisSeed, or
+        // mark it exhausted and return false if there isn't one.
+        //
+        template<class GL> static bool advanceToHitAtOrBelow(HashTableLookup<GL> *lookup, GenomeLocation maxGenomeLocationToFindThisSeed);
+
         int                                 currentDisjointHitSet;
         DisjointHitSet  *                   disjointHitSets;
         HashTableLookup<unsigned> *         lookups32;
@@ -265,6 +322,12 @@ private:
 
     HashTableHitSet *                       hashTableHitSets[NUM_READS_PER_PAIR][NUM_DIRECTIONS];
 
+    //
+    // For indices with compressed overflow tables, the hit lists that the hit sets point to are decoded into here.  It holds
+    // all of the lookups for both reads, because the hit sets keep using them until we're done with the pair.
+    //
+    OverflowDecodeBuffer                    overflowDecodeBuffer;
+
     int                                     countOfHashTableLookups[NUM_READS_PER_PAIR];
     _int64                                  totalHashTableHits[NUM_READS_PER_PAIR][NUM_DIRECTIONS];
     _int64                                  largestHashTableHit[NUM_READS_PER_PAIR][NUM_DIRECTIONS];
@@ -310,14 +373,23 @@ private:
 
     char *reversedRead[NUM_READS_PER_PAIR][NUM_DIRECTIONS]; // The reversed data for each read for forward and RC.  This is used in the backwards LV
 
+    const PackedBases *packedGenome;                                    // The genome's 2 bit copy, if it has one (-packGenome)
+    PackedBases packedRead[NUM_READS_PER_PAIR][NUM_DIRECTIONS];         // The reads packed to match it, used only if it's there
+    PackedBases packedReversedRead[NUM_READS_PER_PAIR][NUM_DIRECTIONS];
+    PackedReadSeeds readSeeds[NUM_READS_PER_PAIR];                      // The forward reads packed for pulling out their seeds
+
     LandauVishkin<> *landauVishkin;
     LandauVishkin<-1> *reverseLandauVishkin;
 
-    char rcTranslationTable[256];
-    unsigned nTable[256];
-
     BYTE *seedUsed;
 
+    //
+    // As in BaseAligner, for minimizer indices the seeds that aren't read minimizers start out marked as used.
+    //
+    unsigned minimizerWindow;
+    _uint64 *minimizerHashes;
+    bool    *isMinimizerSeed;
+
     inline bool IsSeedUsed(_int64 indexInRead) const {
         return (seedUsed[indexInRead / 8] & (1 << (indexInRead % 8))) != 0;
     }
@@ -326,6 +398,16 @@ private:
         seedUsed[indexInRead / 8] |= (1 << (indexInRead % 8));
     }
 
+    //
+    // -mateSeeds.  When the fragment is shorter than the reads' combined length, read 1's reverse complement repeats
+    // some of read 0.  findMateOverlap finds where (as the offset in read 0 at which read 1's reverse complement
+    // starts, negative if it starts first), and shareMateSeedLookups gives read 1 the lookups of read 0's seeds that
+    // lie in the overlap, with the directions swapped, in place of looking them up again.
+    //
+    static const int NoMateOverlap = 0x7fffffff;
+    int findMateOverlap() const;
+    void shareMateSeedLookups(int overlap, int maxSeeds, unsigned *popularSeedsSkipped);
+
     //
     // "Local probability" means the probability that each end is correct given that the pair itself is correct.
     // Consider the example where there's exactly one decent match for one read, but the other one has several
@@ -442,6 +524,19 @@ private:
     // out.  We rely on their being allocated in descending genome order within a set pair.
     //
     ScoringCandidate *scoringCandidatePool;
+
+    //
+    // The number of candidates at the front of the list being scored that phase 3 keeps the genome data coming into the
+    // cache for, as BaseAligner does with its weight lists.
+    //
+    static const unsigned scoringPrefetchDepth = 4;
+
+    //
+    // Prefetch the genome data that scoreLocation will look at for a read at genomeLocation, and for a scoring candidate
+    // (its fewer hits end and the first of its mates that haven't been scored).
+    //
+    void prefetchScoringWindow(unsigned whichRead, GenomeLocation genomeLocation);
+    void prefetchScoringCandidate(ScoringCandidate *candidate);
     unsigned scoringCandidatePoolSize;
     unsigned lowestFreeScoringCandidatePoolEntry;
 
@@ -0,0 +1,92 @@
+/*++
+
+Module Name:
+
+    KmerFilter.cpp
+
+Abstract:
+
+    Telling whether a read comes from the index's genome by looking up a few of its seeds.  See KmerFilter.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "KmerFilter.h"
+#include "Read.h"
+
+KmerFilter::KmerFilter(GenomeIndex *i_index, int i_nSeeds, int i_minSeedsWithHits) :
+    index(i_index), nSeeds(i_nSeeds), minSeedsWithHits(i_minSeedsWithHits), seedLen(i_index->getSeedLength())
+{
+    seeds = new Seed[nSeeds];
+    nHits = new _int64[nSeeds];
+    nRCHits = new _int64[nSeeds];
+    hits = new const GenomeLocation *[nSeeds];
+    rcHits = new const GenomeLocation *[nSeeds];
+    hits32 = new const unsigned *[nSeeds];
+    rcHits32 = new const unsigned *[nSeeds];
+    singleHits = new GenomeLocation[nSeeds];
+    singleRCHits = new GenomeLocation[nSeeds];
+
+    //
+    // Only the counts matter, so don't decode more than one hit of each list.
+    //
+    _int64 decodeBufferSize = OverflowDecodeBuffer::getBufferSize(nSeeds * NUM_DIRECTIONS, 1);
+    decodeBufferStorage = new GenomeLocation[decodeBufferSize];
+    decodeBuffer.init(decodeBufferStorage, decodeBufferSize, 1);
+}
+
+KmerFilter::~KmerFilter()
+{
+    delete[] seeds;
+    delete[] nHits;
+    delete[] nRCHits;
+    delete[] hits;
+    delete[] rcHits;
+    delete[] hits32;
+    delete[] rcHits32;
+    delete[] singleHits;
+    delete[] singleRCHits;
+    delete[] decodeBufferStorage;
+}
+
+    bool
+KmerFilter::matches(Read *read)
+{
+    const char *bases = read->getData();
+    unsigned length = read->getDataLength();
+
+    int nSeedsFound = 0;
+    unsigned offset = 0;
+    while (offset + seedLen <= length && nSeedsFound < nSeeds) {
+        if (!Seed::DoesTextRepresentASeed(bases + offset, seedLen)) {
+            offset++;
+            continue;
+        }
+        seeds[nSeedsFound++] = Seed(bases + offset, seedLen);
+        offset += seedLen;
+    }
+
+    if (nSeedsFound < minSeedsWithHits) {
+        return false;
+    }
+
+    if (index->doesGenomeIndexHave64BitLocations()) {
+        decodeBuffer.reset();
+        index->lookupSeeds(seeds, nSeedsFound, nHits, hits, nRCHits, rcHits, singleHits, singleRCHits, &decodeBuffer);
+    } else {
+        index->lookupSeeds32(seeds, nSeedsFound, nHits, hits32, nRCHits, rcHits32);
+    }
+
+    int nSeedsWithHits = 0;
+    for (int i = 0; i < nSeedsFound; i++) {
+        if (nHits[i] + nRCHits[i] > 0) {
+            nSeedsWithHits++;
+        }
+    }
+
+    return nSeedsWithHits >= minSeedsWithHits;
+}
@@ -0,0 +1,60 @@
+/*++
+
+Module Name:
+
+    KmerFilter.h
+
+Abstract:
+
+    A quick test of whether a read comes from the index's genome, for host depletion and contamination screening
+    (-kmerFilter).  Rather than aligning the read, it looks up a few of its seeds in the index's hash tables with the
+    batched lookup, and calls the read a match if enough of them are there (forward or reverse complement), without
+    scoring any candidate locations.  The seeds are the non-overlapping ones the aligners start with: at offsets 0,
+    seedLen, 2 * seedLen and so on, stepping over any with Ns.
+
+    That's one round of hash table misses per read instead of a full alignment, but it's only exact matches of the
+    seeds, so a read with an error in each of its probed seeds won't match.  Asking for more than one seed with hits
+    keeps chance matches of a single seed (and low complexity sequence) from counting.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "GenomeIndex.h"
+#include "Seed.h"
+
+class Read;
+
+class KmerFilter {
+public:
+    KmerFilter(GenomeIndex *i_index, int i_nSeeds, int i_minSeedsWithHits);
+    ~KmerFilter();
+
+    //
+    // Do at least minSeedsWithHits of the read's first nSeeds seeds occur in the index?
+    //
+    bool matches(Read *read);
+
+private:
+    GenomeIndex             *index;
+    int                      nSeeds;
+    int                      minSeedsWithHits;
+    unsigned                 seedLen;
+
+    Seed                    *seeds;
+    _int64                  *nHits;
+    _int64                  *nRCHits;
+    const GenomeLocation   **hits;
+    const GenomeLocation   **rcHits;
+    const unsigned         **hits32;
+    const unsigned         **rcHits32;
+    GenomeLocation          *singleHits;
+    GenomeLocation          *singleRCHits;
+    GenomeLocation          *decodeBufferStorage;
+    OverflowDecodeBuffer     decodeBuffer;
+};
@@ -8,11 +8,23 @@
 #include "exit.h"
 #include "Error.h"
 
+#include "Simd.h"
+
 using std::make_pair;
 using std::min;
 
+//
+// The vector versions of computing a row are compiled for their instruction sets function by function, so the rest of
+// SNAP still runs on processors without them.  MSVC doesn't need to be told.
+//
+#ifdef _MSC_VER
+#define LV_VECTOR_TARGET(instructionSets)
+#else
+#define LV_VECTOR_TARGET(instructionSets) __attribute__((target(instructionSets)))
+#endif
+
  
-LandauVishkinWithCigar::LandauVishkinWithCigar()
+LandauVishkinWithCigar::LandauVishkinWithCigar() : affineGapPenalty(0)
 {
     for (int i = 0; i < MAX_K+1; i++) {
         for (int j = 0; j < 2*MAX_K+1; j++) {
@@ -22,6 +34,13 @@ LandauVishkinWithCigar::LandauVishkinWithCigar()
     totalIndels[0][MAX_K] = 0;
 }
 
+    void
+LandauVishkinWithCigar::setAffineGapPenalty(int i_affineGapPenalty)
+{
+    affineGapPenalty = i_affineGapPenalty;
+    affineGap.setGapOpenPenalty(affineGapPenalty);
+}
+
 /*++
     Write cigar to buffer, return true if it fits
     null-terminates buffer if it returns false (i.e. fills up buffer)
@@ -525,6 +544,28 @@ int LandauVishkinWithCigar::computeEditDistanceNormalized(
         return score;
     }
 
+    char firstCode = BAMAlignment::CodeToCigar[BAMAlignment::GetCigarOpCode(*(_uint32*)bamBuf)];
+    if (affineGapPenalty > 0 && score > 0 && firstCode != 'I' && firstCode != 'D') {
+        //
+        // Realign with affine gaps.  An alignment with score edits can't leave the diagonals within score of the main
+        // one, so that's the band; anything the affine aligner prefers to it that goes farther out isn't considered.
+        // A leading indel moves the alignment (see below), and it's run again from there, so it waits for that.
+        //
+        char* affineBuf = (char*)alloca(bamBufLen);
+        int affineBufUsed, affineTextUsed, affineNetIndel;
+        int affineScore = affineGap.computeAlignment(text, (int)textLen, pattern, (int)patternLen, score, affineBuf, bamBufLen,
+            useM, &affineBufUsed, &affineTextUsed, &affineNetIndel);
+        if (affineScore >= 0) {
+            score = affineScore;
+            bamBuf = affineBuf;
+            bamBufUsed = affineBufUsed;
+            textUsed = affineTextUsed;
+            if (NULL != o_netIndel) {
+                *o_netIndel = affineNetIndel;
+            }
+        }
+    }
+
     _uint32* bamOps = (_uint32*)bamBuf;
     int bamOpCount = bamBufUsed / sizeof(_uint32);
 
@@ -764,3 +805,184 @@ initializeLVProbabilitiesToPhredPlus33()
 double *lv_phredToProbability = NULL;
 double *lv_indelProbabilities = NULL;
 double *lv_perfectMatchProbability = NULL;
+
+//
+// The length of the match starting at pattern and text but no more than avail, which is what the one diagonal at a time
+// loop adds for a candidate whose first bases match.
+//
+    static inline int
+ExtendMatch(const char *pattern, const char *text, int textDirection, int patternOffset, int textOffset, int avail)
+{
+    const char *p = pattern + patternOffset;
+    const char *t = text + textOffset * textDirection;
+    if (1 == textDirection) {
+        return LandauVishkin<1>::countPerfectMatch(p, t, avail);
+    } else {
+        return LandauVishkin<-1>::countPerfectMatch(p, t, avail);
+    }
+}
+
+#ifdef SNAP_SIMD_X86
+    LV_VECTOR_TARGET("avx2") static void
+ComputeRowAVX2(const char *pattern, const char *text, int textDirection, const int *previousRow, int e, int textLen, int patternLen, int *rowBest, char *rowAction)
+/*++
+
+Routine Description:
+
+    Compute a row of the L array eight diagonals at a time.  The three candidates for each diagonal (up, left and right)
+    come straight from the previous row, and their first bases are gathered and compared together.  Only the ones that
+    match need extending, which is done one at a time; all of the rest of the work, and all of the branches on which
+    bases match, are done across the diagonals at once.
+
+    The text going backward is gathered from the three bytes before each base as well as the base, so that it never
+    reads anything that the one at a time version wouldn't.
+
+--*/
+{
+    const __m256i laneNumbers = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    const int textByteShift = (1 == textDirection) ? 0 : 24;
+    const int textAdjust = (1 == textDirection) ? 0 : -3;
+
+    for (int firstD = -e; firstD <= e; firstD += 8) {
+        int nLanes = __min(8, e - firstD + 1);
+        __m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(nLanes), laneNumbers);
+        __m256i d = _mm256_add_epi32(_mm256_set1_epi32(firstD), laneNumbers);
+        __m256i end = _mm256_min_epi32(_mm256_set1_epi32(patternLen), _mm256_sub_epi32(_mm256_set1_epi32(textLen), d));
+
+        __m256i candidates[3];
+        candidates[0] = _mm256_add_epi32(_mm256_maskload_epi32(previousRow + firstD, lanes), one);         // up
+        candidates[1] = _mm256_maskload_epi32(previousRow + firstD - 1, lanes);                           // left
+        candidates[2] = _mm256_add_epi32(_mm256_maskload_epi32(previousRow + firstD + 1, lanes), one);    // right
+
+        for (int c = 0; c < 3; c++) {
+            __m256i valid = _mm256_and_si256(lanes, _mm256_cmpgt_epi32(candidates[c], _mm256_set1_epi32(-1)));
+            __m256i textIndex = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(d, candidates[c]), _mm256_set1_epi32(textDirection)), _mm256_set1_epi32(textAdjust));
+            __m256i patternBases = _mm256_and_si256(_mm256_mask_i32gather_epi32(zero, (const int *)pattern, candidates[c], valid, 1), byteMask);
+            __m256i textBases = _mm256_and_si256(_mm256_srli_epi32(_mm256_mask_i32gather_epi32(zero, (const int *)text, textIndex, valid, 1), textByteShift), byteMask);
+            unsigned toExtend = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(valid, _mm256_cmpeq_epi32(patternBases, textBases))));
+
+            if (0 != toExtend) {
+                int laneCandidates[8], laneEnds[8], extensions[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+                _mm256_storeu_si256((__m256i *)laneCandidates, candidates[c]);
+                _mm256_storeu_si256((__m256i *)laneEnds, end);
+                for (; 0 != toExtend; toExtend &= toExtend - 1) {
+                    unsigned long lane;
+                    CountTrailingZeroes(toExtend, lane);
+                    extensions[lane] = ExtendMatch(pattern, text, textDirection, laneCandidates[lane], firstD + (int)lane + laneCandidates[lane], laneEnds[lane] - laneCandidates[lane]);
+                }
+                candidates[c] = _mm256_add_epi32(candidates[c], _mm256_loadu_si256((const __m256i *)extensions));
+            }
+        }
+
+        __m256i best = candidates[0];
+        __m256i action = _mm256_set1_epi32('X');
+        __m256i better = _mm256_cmpgt_epi32(candidates[1], best);
+        best = _mm256_blendv_epi8(best, candidates[1], better);
+        action = _mm256_blendv_epi8(action, _mm256_set1_epi32('D'), better);
+        better = _mm256_cmpgt_epi32(candidates[2], best);
+        best = _mm256_blendv_epi8(best, candidates[2], better);
+        action = _mm256_blendv_epi8(action, _mm256_set1_epi32('I'), better);
+
+        int laneBest[8], laneAction[8];
+        _mm256_storeu_si256((__m256i *)laneBest, best);
+        _mm256_storeu_si256((__m256i *)laneAction, action);
+        for (int lane = 0; lane < nLanes; lane++) {
+            rowBest[firstD + lane] = laneBest[lane];
+            rowAction[firstD + lane] = (char)laneAction[lane];
+        }
+    }
+}
+
+    LV_VECTOR_TARGET("avx512f") static void
+ComputeRowAVX512(const char *pattern, const char *text, int textDirection, const int *previousRow, int e, int textLen, int patternLen, int *rowBest, char *rowAction)
+/*++
+
+Routine Description:
+
+    The same as ComputeRowAVX2, sixteen diagonals at a time.
+
+--*/
+{
+    const __m512i laneNumbers = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i byteMask = _mm512_set1_epi32(0xff);
+    const unsigned textByteShift = (1 == textDirection) ? 0 : 24;
+    const int textAdjust = (1 == textDirection) ? 0 : -3;
+
+    for (int firstD = -e; firstD <= e; firstD += 16) {
+        int nLanes = __min(16, e - firstD + 1);
+        __mmask16 lanes = (__mmask16)((1 << nLanes) - 1);
+        __m512i d = _mm512_add_epi32(_mm512_set1_epi32(firstD), laneNumbers);
+        __m512i end = _mm512_min_epi32(_mm512_set1_epi32(patternLen), _mm512_sub_epi32(_mm512_set1_epi32(textLen), d));
+
+        __m512i candidates[3];
+        candidates[0] = _mm512_add_epi32(_mm512_maskz_loadu_epi32(lanes, previousRow + firstD), one);         // up
+        candidates[1] = _mm512_maskz_loadu_epi32(lanes, previousRow + firstD - 1);                           // left
+        candidates[2] = _mm512_add_epi32(_mm512_maskz_loadu_epi32(lanes, previousRow + firstD + 1), one);    // right
+
+        for (int c = 0; c < 3; c++) {
+            __mmask16 valid = _mm512_mask_cmpge_epi32_mask(lanes, candidates[c], _mm512_setzero_si512());
+            __m512i textIndex = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_add_epi32(d, candidates[c]), _mm512_set1_epi32(textDirection)), _mm512_set1_epi32(textAdjust));
+            __m512i patternBases = _mm512_and_si512(_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), valid, candidates[c], (const int *)pattern, 1), byteMask);
+            __m512i textBases = _mm512_and_si512(_mm512_srli_epi32(_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), valid, textIndex, (const int *)text, 1), textByteShift), byteMask);
+            unsigned toExtend = (unsigned)_mm512_mask_cmpeq_epi32_mask(valid, patternBases, textBases);
+
+            if (0 != toExtend) {
+                int laneCandidates[16], laneEnds[16], extensions[16];
+                _mm512_storeu_si512(laneCandidates, candidates[c]);
+                _mm512_storeu_si512(laneEnds, end);
+                _mm512_storeu_si512(extensions, _mm512_setzero_si512());
+                for (; 0 != toExtend; toExtend &= toExtend - 1) {
+                    unsigned long lane;
+                    CountTrailingZeroes(toExtend, lane);
+                    extensions[lane] = ExtendMatch(pattern, text, textDirection, laneCandidates[lane], firstD + (int)lane + laneCandidates[lane], laneEnds[lane] - laneCandidates[lane]);
+                }
+                candidates[c] = _mm512_add_epi32(candidates[c], _mm512_loadu_si512(extensions));
+            }
+        }
+
+        __m512i best = candidates[0];
+        __m512i action = _mm512_set1_epi32('X');
+        __mmask16 better = _mm512_cmpgt_epi32_mask(candidates[1], best);
+        best = _mm512_mask_blend_epi32(better, best, candidates[1]);
+        action = _mm512_mask_blend_epi32(better, action, _mm512_set1_epi32('D'));
+        better = _mm512_cmpgt_epi32_mask(candidates[2], best);
+        best = _mm512_mask_blend_epi32(better, best, candidates[2]);
+        action = _mm512_mask_blend_epi32(better, action, _mm512_set1_epi32('I'));
+
+        _mm512_mask_storeu_epi32(rowBest + firstD, lanes, best);
+        _mm512_mask_cvtepi32_storeu_epi8(rowAction + firstD, lanes, action);
+    }
+}
+#endif // SNAP_SIMD_X86
+
+    static LVComputeRowFunction
+ChooseComputeRow(int *minErrors)
+{
+    //
+    // The row kernels depend on gathers that NEON doesn't have, so off x86 it's the scalar loop (and the bit vector
+    // check, which is plain 64 bit arithmetic).
+    //
+    LVComputeRowFunction computeRow = KernelChooser<LVComputeRowFunction>("Landau-Vishkin")
+        .avx512(X86_ONLY(ComputeRowAVX512)).avx2(X86_ONLY(ComputeRowAVX2)).scalar(NULL);
+
+    //
+    // The minimum row sizes are from timing on 100-250 base reads.  AVX2 only about breaks even until the rows get wide.
+    //
+    if (NULL != computeRow) {
+        *minErrors = ProcessorSupportsAVX512F() ? 4 : 8;
+    }
+    return computeRow;
+}
+
+int lv_minVectorRowErrors = MAX_K + 1;
+LVComputeRowFunction lv_computeRow = ChooseComputeRow(&lv_minVectorRowErrors);
+
+//
+// From timing on 100-250 base reads, both against random text and against text with half of k errors.
+//
+int lv_bitVectorCheckErrors = 6;
+int lv_minBitVectorK = 16;
@@ -4,6 +4,9 @@
 #include "BigAlloc.h"
 #include "exit.h"
 #include "Genome.h"
+#include "PackedBases.h"
+#include "BitVectorEditDistance.h"
+#include "AffineGap.h"
 
 const int MAX_K = 63;
 
@@ -15,6 +18,28 @@ extern double *lv_indelProbabilities;  // Maps indels by length to probability o
 extern double *lv_phredToProbability;  // Maps ASCII phred character to probability of error, including 
 extern double *lv_perfectMatchProbability; // Probability that a read of this length has no mutations
 
+//
+// Computes a whole row of LandauVishkin's L array at once with vector instructions, for computeEditDistance on chars.
+// previousRow points at L(e-1, 0), and it fills in rowBest[d] and rowAction[d] for -e <= d <= e with what the one
+// diagonal at a time loop would put in L(e, d) and A(e, d); the text runs in textDirection, as in LandauVishkin.
+// lv_computeRow is picked at startup for the processor, and is NULL if it doesn't have AVX2, in which case the
+// diagonals are done one at a time.  It's only used for rows with at least lv_minVectorRowErrors errors, since the
+// narrow rows before that don't have enough diagonals to fill a vector.
+//
+typedef void (*LVComputeRowFunction)(const char *pattern, const char *text, int textDirection, const int *previousRow, int e,
+                                     int textLen, int patternLen, int *rowBest, char *rowAction);
+extern LVComputeRowFunction lv_computeRow;
+extern int lv_minVectorRowErrors;
+
+//
+// When computeEditDistance on chars has run lv_bitVectorCheckErrors rows without finding an answer and k is at least
+// lv_minBitVectorK, it asks the bit-vector edit distance (see BitVectorEditDistance.h) whether there can be one within
+// k at all before running the rest.  Most of the time there isn't, and finding that out with the rows is what gets
+// expensive as k grows; a check before the first few rows would mostly be spent on patterns that are close.
+//
+extern int lv_bitVectorCheckErrors;
+extern int lv_minBitVectorK;
+
 struct LVResult {
     short k;
     short result;
@@ -54,8 +79,11 @@ template<int TEXT_DIRECTION = 1> class LandauVishkin {
 //
 // Macros to make arrays with negative indices seem "natural" in the code.
 //
-#define L(e,d)			L_zero			[(e) * (2 * MAX_K + 1) + (d)]
-#define A(e,d)			A_zero			[(e) * (2 * MAX_K + 1) + (d)]
+// The rows are laid out for at most MAX_EDITS edits, which is a template parameter of the functions that use them.
+//
+#define LV_ROW_STRIDE(maxEdits)	(2 * (maxEdits) + 3)
+#define L(e,d)			L_zero			[(e) * LV_ROW_STRIDE(MAX_EDITS) + (d)]
+#define A(e,d)			A_zero			[(e) * LV_ROW_STRIDE(MAX_EDITS) + (d)]
 
 public:
     LandauVishkin()
@@ -66,9 +94,7 @@ public:
     }
 
     memsetint(L_space, -2, (MAX_K + 1) * (2 * MAX_K + 1));
-
-    L_zero = L_space + MAX_K;   // The address of L(0,0)
-    A_zero = A_space + MAX_K;   // The address of A(0,0)
+    layoutEdits = LayoutEdits[0];   // Everything is -2, so any layout will do
 
     //
     // Initialize dTable, which is used to avoid a branch misprediction in our inner loop.
@@ -101,9 +127,9 @@ public:
 	// by looking at L[e-1][d-1 .. d+1], depending on whether the next change is a deletion, insertion or 
 	// substitution.
 	//
-	// Because d can be negative, the L array doesn't really use L[e][d].  Instead, it uses L[e][MAX_K+d], because MAX_K is
-	// the largest possible edit distance, and hence d can never be less than -MAX_K, so MAX_K + d >= 0.  However, the L and A macros
-    // conceal this internally.
+	// Because d can be negative, the L array doesn't really use L[e][d].  Instead, it uses L[e][MAX_EDITS+1+d], because MAX_EDITS is
+	// the largest edit distance the rows are laid out for, and hence d can never be less than -(MAX_EDITS+1), so MAX_EDITS + 1 + d >= 0.
+	// However, the L and A macros conceal this internally.
 	//
 	// Also, because of the way the alignment algorithms work, sometimes SNAP wants to run the edit distance
 	// backward.  This is built as a template with TEXT_DIRECTION either 1 for forward or -1 for backward, just to make
@@ -119,6 +145,214 @@ public:
                 int k,
                 double *matchProbability,
                 int *o_netIndel = NULL)   // the net of insertions and deletions in the alignment.  Negative for insertions, positive for deleteions (and 0 if there are non in net).  Filled in only if matchProbability is non-NULL
+{
+    if (NULL == text) {
+        // This happens when we're trying to read past the end of the genome.
+        return textNotAvailable(matchProbability, o_netIndel);
+    }
+
+    if (TEXT_DIRECTION == -1) {
+        text--; // so now it points at the "first" character of t, not after it.
+    }
+
+    CharSequences sequences(text, pattern, &bitVectorEditDistance);
+    return computeEditDistanceOfSequences(sequences, textLen, qualityString, patternLen, k, matchProbability, o_netIndel);
+}
+
+    //
+    // The same thing, comparing 2 bit packed bases (see PackedBases.h).  The text starts at textStart in text (or
+    // at the base before it going backward, just like the char version), and the pattern at patternStart in
+    // pattern.  The difference from the char version is that N never matches anything, including another N.
+    // A NULL text means that it's not available, as for the char version.
+    //
+    int computeEditDistance(
+                const PackedBases *text,
+                _int64 textStart,
+                int textLen,
+                const PackedBases *pattern,
+                _int64 patternStart,
+                const char *qualityString,
+                int patternLen,
+                int k,
+                double *matchProbability,
+                int *o_netIndel = NULL)
+{
+    if (NULL == text) {
+        return textNotAvailable(matchProbability, o_netIndel);
+    }
+
+    if (TEXT_DIRECTION == -1) {
+        textStart--;
+    }
+
+    PackedSequences sequences(text, textStart, pattern, patternStart);
+    return computeEditDistanceOfSequences(sequences, textLen, qualityString, patternLen, k, matchProbability, o_netIndel);
+}
+
+    // Version that does not requre match probability and quality string
+    inline int computeEditDistance(
+            const char* text,
+            int textLen,
+            const char* pattern,
+            int patternLen,
+            int k)
+    {
+        return computeEditDistance(text, textLen, pattern, NULL, patternLen, k, NULL);
+    }
+
+    void *operator new(size_t size) {return BigAlloc(size);}
+    void operator delete(void *ptr) {BigDealloc(ptr);}
+
+    void *operator new(size_t size, BigAllocator *allocator) {_ASSERT(size == sizeof(LandauVishkin<TEXT_DIRECTION>)); return allocator->allocate(size);}
+    void operator delete(void *ptr, BigAllocator *allocator) {/*Do nothing.  The memory is freed when the allocator is deleted.*/}
+ 
+private:
+    //
+    // The algorithm only looks at the text and pattern through one of these, so the same code runs over chars or packed bases.
+    // Offsets are from the start of the text or pattern, and text offsets run in TEXT_DIRECTION.
+    //
+    struct CharSequences {
+        CharSequences(const char *i_text, const char *i_pattern, BitVectorEditDistance *i_bitVectorEditDistance) :
+            text(i_text), pattern(i_pattern), bitVectorEditDistance(i_bitVectorEditDistance) {}
+
+        inline bool basesMatch(int patternOffset, int textOffset) {
+            return pattern[patternOffset] == text[textOffset * TEXT_DIRECTION];
+        }
+
+        inline int countPerfectMatch(int patternOffset, int textOffset, int availBytes) {
+            const char *p = pattern + patternOffset;
+            const char *t = text + textOffset * TEXT_DIRECTION;
+            return LandauVishkin<TEXT_DIRECTION>::countPerfectMatch(p, t, availBytes);
+        }
+
+        inline bool canComputeRows() {
+            return NULL != lv_computeRow;
+        }
+
+        inline void computeRow(const int *previousRow, int e, int textLen, int patternLen, int *rowBest, char *rowAction) {
+            (*lv_computeRow)(pattern, text, TEXT_DIRECTION, previousRow, e, textLen, patternLen, rowBest, rowAction);
+        }
+
+        //
+        // True if the pattern certainly isn't within k of the text.  The bit vectors never say more than the rows
+        // would find.
+        //
+        inline bool isTooFar(int textLen, int patternLen, int k) {
+            return -1 == bitVectorEditDistance->computeEditDistance(text, TEXT_DIRECTION, textLen, pattern, patternLen, k);
+        }
+
+        const char              *text;
+        const char              *pattern;
+        BitVectorEditDistance   *bitVectorEditDistance;
+    };
+
+    struct PackedSequences {
+        PackedSequences(const PackedBases *i_text, _int64 i_textStart, const PackedBases *i_pattern, _int64 i_patternStart) :
+            text(i_text), textStart(i_textStart), pattern(i_pattern), patternStart(i_patternStart) {}
+
+        inline bool basesMatch(int patternOffset, int textOffset) {
+            return PackedBases::BasesMatch(*pattern, patternStart + patternOffset, *text, textStart + textOffset * TEXT_DIRECTION);
+        }
+
+        inline int countPerfectMatch(int patternOffset, int textOffset, int availBases) {
+            if (availBases <= 0) {
+                return availBases;  // Which is what the char version does
+            }
+
+            if (TEXT_DIRECTION == 1) {
+                return PackedBases::CountMatchingBases(*pattern, patternStart + patternOffset, *text, textStart + textOffset, availBases);
+            } else {
+                return PackedBases::CountMatchingBasesBackward(*pattern, patternStart + patternOffset, *text, textStart - textOffset, availBases);
+            }
+        }
+
+        //
+        // Packed bases already go 32 at a time, so there's no vector version of a row for them.
+        //
+        inline bool canComputeRows() {
+            return false;
+        }
+
+        inline void computeRow(const int *previousRow, int e, int textLen, int patternLen, int *rowBest, char *rowAction) {
+            _ASSERT(false);
+        }
+
+        //
+        // The bit vectors work on chars, so packed bases just run the rows.
+        //
+        inline bool isTooFar(int textLen, int patternLen, int k) {
+            return false;
+        }
+
+        const PackedBases  *text;
+        _int64              textStart;
+        const PackedBases  *pattern;
+        _int64              patternStart;
+    };
+
+    inline int textNotAvailable(double *matchProbability, int *o_netIndel)
+    {
+        if (NULL != o_netIndel) {
+            *o_netIndel = 0;
+        }
+
+        if (NULL != matchProbability) {
+            *matchProbability = 0.0;
+        }
+        return -1;
+    }
+
+    template<class SEQUENCES> int computeEditDistanceOfSequences(
+                SEQUENCES &sequences,
+                int textLen,
+                const char *qualityString,
+                int patternLen,
+                int k,
+                double *matchProbability,
+                int *o_netIndel)
+/*++
+
+Routine Description:
+
+    Run the rows in the layout for the smallest of LayoutEdits that fits k.  The L and A arrays are as big as MAX_K
+    needs, but laid out for the 16 edits that the default -d and -D ask for, only the first few KB of them are ever touched, rather than rows
+    of 2 * MAX_K + 1 cells of which the middle few are used, and the row stride is a constant in the loops.  A layout
+    depends on the cells beyond the diagonals of each row that never get written staying at -2, so it only ever
+    grows, once per object when it first sees a larger k, and after that does for any smaller k too.
+
+--*/
+{
+    _ASSERT(k < MAX_K);
+
+    k = __min(MAX_K - 1, k); // enforce limit even in non-debug builds
+
+    if (k > layoutEdits) {
+        int i = 0;
+        while (LayoutEdits[i] < k) {
+            i++;
+        }
+        layoutEdits = LayoutEdits[i];
+        memsetint(L_space, -2, (layoutEdits + 1) * LV_ROW_STRIDE(layoutEdits));
+    }
+
+    switch (layoutEdits) {
+        case 8:     return computeEditDistanceOfSequencesInLayout<SEQUENCES, 8>(sequences, textLen, qualityString, patternLen, k, matchProbability, o_netIndel);
+        case 16:    return computeEditDistanceOfSequencesInLayout<SEQUENCES, 16>(sequences, textLen, qualityString, patternLen, k, matchProbability, o_netIndel);
+        case 32:    return computeEditDistanceOfSequencesInLayout<SEQUENCES, 32>(sequences, textLen, qualityString, patternLen, k, matchProbability, o_netIndel);
+        default:
+            _ASSERT(MAX_K - 1 == layoutEdits);
+            return computeEditDistanceOfSequencesInLayout<SEQUENCES, MAX_K - 1>(sequences, textLen, qualityString, patternLen, k, matchProbability, o_netIndel);
+    }
+}
+
+    template<class SEQUENCES, int MAX_EDITS> int computeEditDistanceOfSequencesInLayout(
+                SEQUENCES &sequences,
+                int textLen,
+                const char *qualityString,
+                int patternLen,
+                int k,
+                double *matchProbability,
+                int *o_netIndel)
 {
     int localNetIndel;
 	int d;
@@ -129,18 +363,15 @@ public:
         //
         o_netIndel = &localNetIndel;
     }
-    _ASSERT(k < MAX_K);
+    _ASSERT(k <= MAX_EDITS);
 
     *o_netIndel = 0;
 
-    k = __min(MAX_K - 1, k); // enforce limit even in non-debug builds
-    if (NULL == text) {
-        // This happens when we're trying to read past the end of the genome.
-        if (NULL != matchProbability) {
-            *matchProbability = 0.0;
-        }
-        return -1;
-    }
+    //
+    // Row e - 1 gets read as far out as diagonal e + 1, so each row has MAX_EDITS + 1 cells on either side of d = 0.
+    //
+    int *L_zero = L_space + MAX_EDITS + 1;   // The address of L(0,0)
+    char *A_zero = A_space + MAX_EDITS + 1;  // The address of A(0,0)
  
     if (NULL != matchProbability) {
         //
@@ -149,16 +380,9 @@ public:
         *matchProbability = 1.0;    
     }
 
-    if (TEXT_DIRECTION == -1) {
-        text--; // so now it points at the "first" character of t, not after it.
-    }
-
-    const char* p = pattern;
-    const char* t = text;
     int end = __min(patternLen, textLen);
-    const char* pend = pattern + end;
 
-    L(0, 0) = countPerfectMatch(p, t, end);
+    L(0, 0) = sequences.countPerfectMatch(0, 0, end);
 
     if (L(0, 0) == end) {
         int result = (patternLen > end ? patternLen - end : 0); // Could need some deletions at the end
@@ -176,53 +400,54 @@ public:
 
 	int lastBestD = MAX_K + 1;
 	int e;
+    bool vectorRows = sequences.canComputeRows();
 
     for (e = 1; e <= k; e++) {
+        if (e == lv_bitVectorCheckErrors && k >= lv_minBitVectorK && sequences.isTooFar(textLen, patternLen, k)) {
+            return -1;  // With matchProbability and netIndel as they'd be from running out of rows
+        }
+
+        bool vectorRow = vectorRows && e >= lv_minVectorRowErrors;
+        if (vectorRow) {
+            sequences.computeRow(&L(e-1, 0), e, textLen, patternLen, rowBest + MAX_K, rowAction + MAX_K);
+        }
+
         // Search d's in the order 0, 1, -1, 2, -2, etc to find an alignment with as few indels as possible.
         // dTable is just precomputed d = (d > 0 ? -d : -d+1) to save the branch misprediction from (d > 0)
         int i =0;
         for (d = 0; d != e+1 ; i++, d = dTable[i]) {
-            int best = L(e-1, d) + 1; // up
-            A(e, d) = 'X';
-
-            const char* p = pattern + best;
-            const char* t = (text + d * TEXT_DIRECTION) + best * TEXT_DIRECTION;
-            if (*p == *t && best >= 0) {
-                int end = __min(patternLen, textLen - d);
-                const char* pend = pattern + end;
-
-                best += countPerfectMatch(p, t, (int)(end - (p - pattern)));
-            }
-
-
-            int left = L(e-1, d-1);
-            p = pattern + left;
-            t = (text + d * TEXT_DIRECTION) + left * TEXT_DIRECTION;
-            if (*p == *t && left >= 0) {
-                int end = __min(patternLen, textLen - d);
-                const char* pend = pattern + end;
-
-                left += countPerfectMatch(p, t, (int)(end - (p - pattern)));
-            }
-
-            if (left > best) {
-                best = left;
-                A(e, d) = 'D';
-            }
-
-            int right = L(e-1, d+1) + 1;
-            p = pattern + right;
-            t = (text + d * TEXT_DIRECTION) + right * TEXT_DIRECTION;
-            if (*p == *t && right >= 0) {
-                int end = __min(patternLen, textLen - d);
-                const char* pend = pattern + end;
-
-                right += countPerfectMatch(p, t, (int)(end - (p - pattern)));
-            }
-
-            if (right > best) {
-                best = right;
-                A(e, d) = 'I';
+            int best;
+            if (vectorRow) {
+                best = rowBest[MAX_K + d];
+                A(e, d) = rowAction[MAX_K + d];
+            } else {
+                best = L(e-1, d) + 1; // up
+                A(e, d) = 'X';
+
+                if (best >= 0 && sequences.basesMatch(best, d + best)) {
+                    best += sequences.countPerfectMatch(best, d + best, __min(patternLen, textLen - d) - best);
+                }
+
+
+                int left = L(e-1, d-1);
+                if (left >= 0 && sequences.basesMatch(left, d + left)) {
+                    left += sequences.countPerfectMatch(left, d + left, __min(patternLen, textLen - d) - left);
+                }
+
+                if (left > best) {
+                    best = left;
+                    A(e, d) = 'D';
+                }
+
+                int right = L(e-1, d+1) + 1;
+                if (right >= 0 && sequences.basesMatch(right, d + right)) {
+                    right += sequences.countPerfectMatch(right, d + right, __min(patternLen, textLen - d) - right);
+                }
+
+                if (right > best) {
+                    best = right;
+                    A(e, d) = 'I';
+                }
             }
 
 			if (best == patternLen) {
@@ -266,7 +491,9 @@ got_answer:
 
 		_ASSERT(*matchProbability == 1.0);
 		//
-		// We're done.  Compute the match probability.
+		// We're done.  Compute the match probability.  It's one table lookup and multiply per edit (plus one for
+		// the matching bases), not per base or per cell, so it costs nothing next to the rows above; it's kept as
+		// a plain product of doubles so the aligners can add the probabilities of candidates to get MAPQ.
 		//
 
 		//
@@ -338,30 +565,13 @@ got_answer:
 }
 
 
-    // Version that does not requre match probability and quality string
-    inline int computeEditDistance(
-            const char* text,
-            int textLen,
-            const char* pattern,
-            int patternLen,
-            int k)
-    {
-        return computeEditDistance(text, textLen, pattern, NULL, patternLen, k, NULL);
-    }
-
-    void *operator new(size_t size) {return BigAlloc(size);}
-    void operator delete(void *ptr) {BigDealloc(ptr);}
-
-    void *operator new(size_t size, BigAllocator *allocator) {_ASSERT(size == sizeof(LandauVishkin<TEXT_DIRECTION>)); return allocator->allocate(size);}
-    void operator delete(void *ptr, BigAllocator *allocator) {/*Do nothing.  The memory is freed when the allocator is deleted.*/}
- 
-private:
+public:
     //
     // Count characters of a perfect match until a mismatch or the end of one or the other string, the
     // minimum length of which is represented by the end parameter.  Advances p & t to the first mismatch
     // or first character beyond the end.
     //
-    inline int countPerfectMatch(const char *& p, const char *& t, int availBytes)      // This is essentially duplicated in LandauVishkinWithCigar
+    static inline int countPerfectMatch(const char *& p, const char *& t, int availBytes)      // This is essentially duplicated in LandauVishkinWithCigar
     {
 	    const char *pBase = p;
 	    const char *pend = p + availBytes;
@@ -393,6 +603,7 @@ private:
 	    return 0;
     }
 
+private:
 
     //
     // Table of d values for the inner loop in computeEditDistance.  This allows us to avoid the line d = (d > 0 ? -d : -d+1), which causes
@@ -418,21 +629,37 @@ private:
 
     // TODO: For long reads, we should include a version that only has L be 2 x (2*MAX_K+1) cells
     int L_space[(MAX_K + 1) * (2 * MAX_K + 1)];
-	int *L_zero;
 
     // Action we did to get to each position: 'D' = deletion, 'I' = insertion, 'X' = substitution.  This is needed to compute match probability.
 	char A_space[(MAX_K + 1) * (2 * MAX_K + 1)];
-	char *A_zero;
+
+    //
+    // The most edits L and A are laid out for now, one of LayoutEdits.  The last is the same layout as MAX_K, which
+    // the arrays are sized for.
+    //
+    int layoutEdits;
+    static const int LayoutEdits[4];
 
     // Arrays for backtracing the actions required to match two strings
     char backtraceAction[MAX_K+1];
     int  backtraceMatched[MAX_K+1];
     int  backtraceD[MAX_K+1];
 
+    //
+    // The row that lv_computeRow fills in, indexed like the rows of L and A.
+    //
+    int  rowBest[2 * MAX_K + 1];
+    char rowAction[2 * MAX_K + 1];
+
+    BitVectorEditDistance bitVectorEditDistance;
+
 #undef  L
 #undef  A
+#undef  LV_ROW_STRIDE
 };
 
+template<int TEXT_DIRECTION> const int LandauVishkin<TEXT_DIRECTION>::LayoutEdits[4] = {8, 16, 32, MAX_K - 1};
+
 void setLVProbabilities(double *i_indelProbabilities, double *i_phredToProbability, double mutationProbability);
 void initializeLVProbabilitiesToPhredPlus33();
 
@@ -468,6 +695,12 @@ class LandauVishkinWithCigar {
 public:
     LandauVishkinWithCigar();
 
+    //
+    // Have computeEditDistanceNormalized redo what it finds with AffineGapWithCigar, with this gap open penalty
+    // (see -G).  0 (the default) leaves the CIGAR string as the fewest edits.
+    //
+    void setAffineGapPenalty(int i_affineGapPenalty);
+
     // Compute the edit distance between two strings and write the CIGAR string in cigarBuf.
     // Returns -1 if the edit distance exceeds k or -2 if we run out of space in cigarBuf.
     int computeEditDistance(const char* text, int textLen, const char* pattern, int patternLen, int k,
@@ -509,4 +742,7 @@ private:
     char backtraceAction[MAX_K+1];
     int backtraceMatched[MAX_K+1];
     int backtraceD[MAX_K+1];
+
+    int affineGapPenalty;
+    AffineGapWithCigar affineGap;
 };
@@ -0,0 +1,684 @@
+/*++
+
+Module Name:
+
+    LongReadAligner.cpp
+
+Abstract:
+
+    Seed chaining alignment for long reads.  See LongReadAligner.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "LongReadAligner.h"
+#include "Read.h"
+#include "mapq.h"
+#include "AlignerOptions.h"
+#include "ParallelTask.h"
+#include <algorithm>
+
+//
+// How much likelier each edit fewer makes one chain than another, for MAPQ.  Long reads have enough errors that the
+// per base quality based probabilities that LandauVishkin computes would all underflow.
+//
+static const double RelativeProbabilityPerEdit = 0.1;
+
+LongReadAligner::LongReadAligner(GenomeIndex *i_genomeIndex, unsigned i_maxHitsToConsider, int i_nHelpers) :
+    genomeIndex(i_genomeIndex), genome(i_genomeIndex->getGenome()), seedLen(i_genomeIndex->getSeedLength()),
+    maxHitsToConsider(i_maxHitsToConsider), doesGenomeIndexHave64BitLocations(i_genomeIndex->doesGenomeIndexHave64BitLocations()),
+    nParts(1 + __max(0, i_nHelpers)), helperWork(NULL), parallel(false), chainCapacity(0), nChain(0), chain(NULL),
+    readCapacity(0), rcReadData(NULL), reversedPattern(NULL), reversedText(NULL)
+{
+    parts = new Part[nParts];
+    for (int i = 0; i < nParts; i++) {
+        Part *part = &parts[i];
+        if (genomeIndex->hasCompressedOverflowTable()) {
+            _int64 decodeBufferSize = OverflowDecodeBuffer::getBufferSize(NUM_DIRECTIONS, maxHitsToConsider);
+            part->overflowDecodeBufferStorage = new GenomeLocation[decodeBufferSize];
+            part->overflowDecodeBuffer.init(part->overflowDecodeBufferStorage, decodeBufferSize, maxHitsToConsider);
+        } else {
+            part->overflowDecodeBufferStorage = NULL;
+        }
+        part->cigarBufCapacity = 0;
+        part->cigarBuf = NULL;
+        part->anchorCapacity = 0;
+        part->nAnchors = 0;
+        part->anchors = NULL;
+    }
+
+    if (nParts > 1) {
+        helperWork = new HelperWork[nParts];
+        for (int i = 0; i < nParts; i++) {
+            helperWork[i].aligner = this;
+            helperWork[i].part = i;
+        }
+        CreateSingleWaiterObject(&helpersDone);
+    }
+}
+
+LongReadAligner::~LongReadAligner()
+{
+    for (int i = 0; i < nParts; i++) {
+        delete[] parts[i].overflowDecodeBufferStorage;
+        delete[] parts[i].cigarBuf;
+        delete[] parts[i].anchors;
+    }
+    delete[] parts;
+    if (NULL != helperWork) {
+        delete[] helperWork;
+        DestroySingleWaiterObject(&helpersDone);
+    }
+    delete[] chain;
+    delete[] rcReadData;
+    delete[] reversedPattern;
+    delete[] reversedText;
+}
+
+    void
+LongReadAligner::addAnchor(Part *part, _int64 genomeLocation, int readOffset, Direction direction)
+{
+    if (part->nAnchors >= part->anchorCapacity) {
+        int newCapacity = __max(1024, 2 * part->anchorCapacity);
+        Anchor *newAnchors = new Anchor[newCapacity];
+        memcpy(newAnchors, part->anchors, sizeof(*part->anchors) * part->nAnchors);
+        delete[] part->anchors;
+        part->anchors = newAnchors;
+        part->anchorCapacity = newCapacity;
+    }
+
+    Anchor *anchor = &part->anchors[part->nAnchors++];
+    anchor->genomeLocation = genomeLocation;
+    anchor->readOffset = readOffset;
+    anchor->direction = direction;
+    anchor->score = 0;
+    anchor->predecessor = -1;
+    anchor->used = false;
+}
+
+    int
+LongReadAligner::gapCost(int drift)
+/*++
+
+Routine Description:
+
+    What chaining across an indel of drift bases costs, in bases of anchor.  It goes up slowly, since long read indels
+    are common and a real chain across one should keep most of its score.
+
+--*/
+{
+    return 0 == drift ? 0 : 1 + drift / 4;
+}
+
+    void
+LongReadAligner::chainAnchors(int first, int end)
+/*++
+
+Routine Description:
+
+    The chaining dynamic program, for anchors[first..end-1].  The anchors are sorted by direction and then genome
+    location, so the possible predecessors of an anchor are the ones just before it.  Each chain scores the bases its
+    anchors cover (only the new ones, for anchors that overlap the one before) less the cost of the indels between them.
+    No chain crosses first, so the range can be chained on its own.
+
+--*/
+{
+    Anchor *anchors = parts[0].anchors;
+    for (int i = first; i < end; i++) {
+        Anchor *anchor = &anchors[i];
+        anchor->score = seedLen;
+        anchor->predecessor = -1;
+
+        for (int j = i - 1; j >= first && j >= i - MaxPredecessors; j--) {
+            const Anchor *peer = &anchors[j];
+            if (peer->direction != anchor->direction) {
+                break;
+            }
+
+            _int64 genomeGap = anchor->genomeLocation - peer->genomeLocation;
+            if (genomeGap > MaxChainGap) {
+                break;
+            }
+
+            int readGap = anchor->readOffset - peer->readOffset;
+            if (readGap <= 0 || genomeGap <= 0 || readGap > MaxChainGap) {
+                continue;
+            }
+
+            int drift = (int)__max(genomeGap - readGap, readGap - genomeGap);
+            if (drift > MaxDiagonalDrift) {
+                continue;
+            }
+
+            int score = peer->score + (int)__min((_int64)seedLen, __min((_int64)readGap, genomeGap)) - gapCost(drift);
+            if (score > anchor->score) {
+                anchor->score = score;
+                anchor->predecessor = j;
+            }
+        }
+    }
+}
+
+    int
+LongReadAligner::takeChain(int end)
+/*++
+
+Routine Description:
+
+    Walk back from end through the predecessors to build the chain in chain[], in order along the read, and mark its
+    anchors as used.  A chain stops at an anchor that an earlier chain took, so no anchor is in two of them.  Anchors
+    that overlap the one before them on the read or the genome are left out, so the gaps between the anchors in chain[]
+    are all at least empty.
+
+Return Value:
+
+    The chain's score, less what it would have had from the part that another chain took.
+
+--*/
+{
+    Anchor *anchors = parts[0].anchors;
+    int nBackward = 0;
+    int stop = end;
+    for (int i = end; i != -1 && !anchors[i].used; i = anchors[i].predecessor) {
+        nBackward++;
+        stop = anchors[i].predecessor;
+    }
+
+    if (nBackward > chainCapacity) {
+        delete[] chain;
+        chainCapacity = __max(nBackward, 2 * chainCapacity);
+        chain = new int[chainCapacity];
+    }
+
+    int position = nBackward;
+    for (int i = end; i != stop; i = anchors[i].predecessor) {
+        anchors[i].used = true;
+        chain[--position] = i;
+    }
+
+    nChain = 0;
+    for (int i = 0; i < nBackward; i++) {
+        const Anchor *anchor = &anchors[chain[i]];
+        if (nChain > 0) {
+            const Anchor *previous = &anchors[chain[nChain - 1]];
+            if (anchor->readOffset < previous->readOffset + (int)seedLen || anchor->genomeLocation < previous->genomeLocation + seedLen) {
+                continue;
+            }
+        }
+        chain[nChain++] = chain[i];
+    }
+
+    return anchors[end].score - (-1 == stop ? 0 : anchors[stop].score);
+}
+
+    int
+LongReadAligner::alignSegment(Part *part, const char *text, int textLen, const char *pattern, int patternLen, int w, int *o_textUsed)
+{
+    for (;;) {
+        int cigarBufUsed, netIndel;
+        int editDistance = part->gapAligner.computeAlignment(text, textLen, pattern, patternLen, w, part->cigarBuf, part->cigarBufCapacity,
+            true, &cigarBufUsed, o_textUsed, &netIndel);
+        if (-2 != editDistance) {
+            return editDistance;
+        }
+
+        delete[] part->cigarBuf;
+        part->cigarBufCapacity = __max(2 * part->cigarBufCapacity, (int)sizeof(_uint32) * 2 * (patternLen + 1));
+        part->cigarBuf = new char[part->cigarBufCapacity];
+    }
+}
+
+    int
+LongReadAligner::fillGaps(Part *part, const char *readData, int firstGap, int endGap)
+/*++
+
+Routine Description:
+
+    Align the gaps before chain[firstGap..endGap-1], for fillChain.  Both ends are pinned, so any of the gap in the
+    genome that the alignment doesn't use is deleted.
+
+Return Value:
+
+    Their total edit distance.
+
+--*/
+{
+    const Anchor *anchors = parts[0].anchors;
+    int editDistance = 0;
+    for (int i = firstGap; i < endGap; i++) {
+        const Anchor *previous = &anchors[chain[i - 1]];
+        const Anchor *anchor = &anchors[chain[i]];
+        int readGap = anchor->readOffset - (previous->readOffset + seedLen);
+        int genomeGap = (int)(anchor->genomeLocation - (previous->genomeLocation + seedLen));
+        _ASSERT(readGap >= 0 && genomeGap >= 0);
+
+        if (0 == readGap || 0 == genomeGap || __max(readGap, genomeGap) > MaxFillLength) {
+            editDistance += __max(readGap, genomeGap);
+            continue;
+        }
+
+        const char *text = genome->getSubstring(previous->genomeLocation + seedLen, genomeGap);
+        int gapEditDistance = -1;
+        int textUsed;
+        if (NULL != text) {
+            int w = __min(__max(readGap, genomeGap), abs(genomeGap - readGap) + GapBandSlack);
+            gapEditDistance = alignSegment(part, text, genomeGap, readData + previous->readOffset + seedLen, readGap, w, &textUsed);
+        }
+
+        if (gapEditDistance < 0) {
+            editDistance += __max(readGap, genomeGap);
+        } else {
+            editDistance += gapEditDistance + (genomeGap - textUsed);
+        }
+    }
+    return editDistance;
+}
+
+    bool
+LongReadAligner::fillChain(const char *readData, int readLen, int *o_editDistance, GenomeLocation *o_location, _int64 *o_end)
+/*++
+
+Routine Description:
+
+    Align the read around the anchors in chain[], which match exactly: the part before the first anchor (backward
+    from it), each gap between anchors, and the part after the last.  A piece that's too long to align, or that runs
+    off the contig, counts as all edits.
+
+Arguments:
+
+    readData        - the read, in the chain's direction
+    readLen         - its length
+    o_editDistance  - the total edit distance
+    o_location      - where the read starts
+    o_end           - the genome location just past its end
+
+Return Value:
+
+    false if the chain crosses from one contig to another.
+
+--*/
+{
+    const Anchor *anchors = parts[0].anchors;
+    const Anchor *first = &anchors[chain[0]];
+    const Anchor *last = &anchors[chain[nChain - 1]];
+    int editDistance = 0;
+
+    //
+    // The head, backward from the first anchor, so that the alignment is pinned at the anchor and free at the start of the read.
+    //
+    int headLen = first->readOffset;
+    _int64 start = first->genomeLocation - headLen;
+    if (headLen > 0 && headLen <= MaxFillLength) {
+        int w = __min(headLen, MaxEndBand);
+        int textLen = headLen + w;
+        const char *text = genome->getSubstring(first->genomeLocation - textLen, textLen);
+        if (NULL == text) {
+            textLen = headLen;
+            text = genome->getSubstring(first->genomeLocation - textLen, textLen);
+        }
+
+        int headEditDistance = -1;
+        int textUsed;
+        if (NULL != text) {
+            for (int i = 0; i < headLen; i++) {
+                reversedPattern[i] = readData[headLen - 1 - i];
+            }
+            for (int i = 0; i < textLen; i++) {
+                reversedText[i] = text[textLen - 1 - i];
+            }
+            headEditDistance = alignSegment(&parts[0], reversedText, textLen, reversedPattern, headLen, w, &textUsed);
+        }
+
+        if (headEditDistance < 0) {
+            editDistance += headLen;
+        } else {
+            editDistance += headEditDistance;
+            start = first->genomeLocation - textUsed;
+        }
+    } else {
+        editDistance += headLen;
+    }
+
+    //
+    // The gaps between anchors, split among the parts by count.
+    //
+    if (parallel && nChain > nParts) {
+        phaseReadData = readData;
+        for (int i = 0; i < nParts; i++) {
+            parts[i].first = 1 + (int)((_int64)(nChain - 1) * i / nParts);
+            parts[i].end = 1 + (int)((_int64)(nChain - 1) * (i + 1) / nParts);
+        }
+        runParts(FillGapsPhase);
+        for (int i = 0; i < nParts; i++) {
+            editDistance += parts[i].editDistance;
+        }
+    } else {
+        editDistance += fillGaps(&parts[0], readData, 1, nChain);
+    }
+
+    //
+    // The tail, forward from the last anchor.
+    //
+    int tailStart = last->readOffset + seedLen;
+    int tailLen = readLen - tailStart;
+    _int64 end = last->genomeLocation + seedLen + tailLen;
+    if (tailLen > 0 && tailLen <= MaxFillLength) {
+        int w = __min(tailLen, MaxEndBand);
+        int textLen = tailLen + w;
+        const char *text = genome->getSubstring(last->genomeLocation + seedLen, textLen);
+        if (NULL == text) {
+            textLen = tailLen;
+            text = genome->getSubstring(last->genomeLocation + seedLen, textLen);
+        }
+
+        int tailEditDistance = -1;
+        int textUsed;
+        if (NULL != text) {
+            tailEditDistance = alignSegment(&parts[0], text, textLen, readData + tailStart, tailLen, w, &textUsed);
+        }
+
+        if (tailEditDistance < 0) {
+            editDistance += tailLen;
+        } else {
+            editDistance += tailEditDistance;
+            end = last->genomeLocation + seedLen + textUsed;
+        }
+    } else {
+        editDistance += tailLen;
+    }
+
+    if (start < 0 || genome->getContigNumAtLocation(start) != genome->getContigNumAtLocation(end - 1)) {
+        return false;
+    }
+
+    *o_editDistance = editDistance;
+    *o_location = start;
+    *o_end = end;
+    return true;
+}
+
+    void
+LongReadAligner::lookupSeeds(Part *part, int firstSeed, int endSeed)
+/*++
+
+Routine Description:
+
+    Look up seeds firstSeed..endSeed-1 of phaseReadData, which start every seedStride bases, and make anchors of
+    their hits in part.
+
+--*/
+{
+    part->nAnchors = 0;
+    int seedStride = __max(1, (int)seedLen / SeedStrideDivisor);
+    for (int whichSeed = firstSeed; whichSeed < endSeed; whichSeed++) {
+        int offset = whichSeed * seedStride;
+        if (!Seed::DoesTextRepresentASeed(phaseReadData + offset, seedLen)) {
+            continue;
+        }
+
+        Seed seed(phaseReadData + offset, seedLen);
+        _int64 nHits[NUM_DIRECTIONS];
+        int rcOffset = phaseReadLen - seedLen - offset;  // Where the seed is in the reverse complement of the read
+
+        if (doesGenomeIndexHave64BitLocations) {
+            const GenomeLocation *hits[NUM_DIRECTIONS];
+            GenomeLocation singleHit[NUM_DIRECTIONS];
+            part->overflowDecodeBuffer.reset();
+            genomeIndex->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC], &singleHit[FORWARD], &singleHit[RC], &part->overflowDecodeBuffer);
+            for (Direction direction = FORWARD; direction < NUM_DIRECTIONS; direction++) {
+                if (nHits[direction] > maxHitsToConsider) {
+                    continue;
+                }
+                for (_int64 i = 0; i < nHits[direction]; i++) {
+                    addAnchor(part, GenomeLocationAsInt64(hits[direction][i]), FORWARD == direction ? offset : rcOffset, direction);
+                }
+            }
+        } else {
+            const unsigned *hits[NUM_DIRECTIONS];
+            genomeIndex->lookupSeed32(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC]);
+            for (Direction direction = FORWARD; direction < NUM_DIRECTIONS; direction++) {
+                if (nHits[direction] > maxHitsToConsider) {
+                    continue;
+                }
+                for (_int64 i = 0; i < nHits[direction]; i++) {
+                    addAnchor(part, hits[direction][i], FORWARD == direction ? offset : rcOffset, direction);
+                }
+            }
+        }
+    }
+
+}
+
+    void
+LongReadAligner::runPart(int whichPart)
+{
+    Part *part = &parts[whichPart];
+    switch (phase) {
+        case LookupSeedsPhase:
+            lookupSeeds(part, part->first, part->end);
+            break;
+
+        case ChainPhase:
+            chainAnchors(part->first, part->end);
+            break;
+
+        case FillGapsPhase:
+            part->editDistance = fillGaps(part, phaseReadData, part->first, part->end);
+            break;
+    }
+}
+
+    void
+LongReadAligner::HelperThreadMain(void *param)
+{
+    HelperWork *work = (HelperWork *)param;
+    LongReadAligner *aligner = work->aligner;
+    aligner->runPart(work->part);
+    if (0 == InterlockedDecrementAndReturnNewValue(&aligner->nHelpersRunning)) {
+        SignalSingleWaiterObject(&aligner->helpersDone);
+    }
+}
+
+    void
+LongReadAligner::runParts(Phase i_phase)
+/*++
+
+Routine Description:
+
+    Run each part of a phase, the first on this thread and the rest on pooled threads, and wait for them all.  A part
+    whose thread can't be started is run here too.
+
+--*/
+{
+    phase = i_phase;
+    ResetSingleWaiterObject(&helpersDone);
+    nHelpersRunning = nParts;    // One extra, so that none of them can finish it before they're all started
+    for (int i = 1; i < nParts; i++) {
+        if (!StartPooledThread(HelperThreadMain, &helperWork[i])) {
+            runPart(i);
+            InterlockedDecrementAndReturnNewValue(&nHelpersRunning);
+        }
+    }
+
+    runPart(0);
+    if (0 != InterlockedDecrementAndReturnNewValue(&nHelpersRunning)) {
+        WaitForSingleWaiterObject(&helpersDone);
+    }
+}
+
+    void
+LongReadAligner::AlignRead(Read *read, SingleAlignmentResult *result)
+/*++
+
+Routine Description:
+
+    Look up the seeds, chain their hits, and fill in the best few chains that are at different places.  The one with
+    the fewest edits is the alignment, and the rest are what its MAPQ is computed against.
+
+--*/
+{
+    result->status = NotFound;
+    result->location = InvalidGenomeLocation;
+    result->direction = FORWARD;
+    result->score = -1;
+    result->mapq = 0;
+
+    int readLen = read->getDataLength();
+    if (readLen < (int)seedLen) {
+        return;
+    }
+
+    if (readLen > readCapacity) {
+        delete[] rcReadData;
+        delete[] reversedPattern;
+        delete[] reversedText;
+        readCapacity = readLen;
+        rcReadData = new char[readCapacity];
+        reversedPattern = new char[readCapacity];
+        reversedText = new char[readCapacity + MaxEndBand];
+    }
+
+    const char *readData[NUM_DIRECTIONS];
+    readData[FORWARD] = read->getData();
+    read->computeReverseCompliment(rcReadData);
+    readData[RC] = rcReadData;
+
+    //
+    // Look up the seeds and chain their hits, split among the parts if the read is long enough to be worth it.
+    //
+    parallel = nParts > 1 && readLen >= ParallelMinReadLength;
+    int nSeeds = (readLen - (int)seedLen) / __max(1, (int)seedLen / SeedStrideDivisor) + 1;
+    phaseReadData = readData[FORWARD];
+    phaseReadLen = readLen;
+    Part *all = &parts[0];
+    if (parallel) {
+        for (int i = 0; i < nParts; i++) {
+            parts[i].first = (int)((_int64)nSeeds * i / nParts);
+            parts[i].end = (int)((_int64)nSeeds * (i + 1) / nParts);
+        }
+        runParts(LookupSeedsPhase);
+
+        //
+        // In the order of the seeds, as if one thread had looked them all up.
+        //
+        int nAnchors = 0;
+        for (int i = 0; i < nParts; i++) {
+            nAnchors += parts[i].nAnchors;
+        }
+        if (nAnchors > all->anchorCapacity) {
+            Anchor *newAnchors = new Anchor[nAnchors];
+            memcpy(newAnchors, all->anchors, sizeof(*all->anchors) * all->nAnchors);
+            delete[] all->anchors;
+            all->anchors = newAnchors;
+            all->anchorCapacity = nAnchors;
+        }
+        for (int i = 1; i < nParts; i++) {
+            memcpy(all->anchors + all->nAnchors, parts[i].anchors, sizeof(*all->anchors) * parts[i].nAnchors);
+            all->nAnchors += parts[i].nAnchors;
+        }
+    } else {
+        lookupSeeds(all, 0, nSeeds);
+    }
+
+    int nAnchors = all->nAnchors;
+    Anchor *anchors = all->anchors;
+    if (0 == nAnchors) {
+        return;
+    }
+
+    std::sort(anchors, anchors + nAnchors);
+
+    if (parallel) {
+        //
+        // Split where no chain can cross, near equal shares.
+        //
+        parts[0].first = 0;
+        for (int i = 1; i < nParts; i++) {
+            int split = __max(parts[i - 1].first, (int)((_int64)nAnchors * i / nParts));
+            while (split > 0 && split < nAnchors && anchors[split].direction == anchors[split - 1].direction &&
+                    anchors[split].genomeLocation - anchors[split - 1].genomeLocation <= MaxChainGap) {
+                split++;
+            }
+            parts[i - 1].end = parts[i].first = split;
+        }
+        parts[nParts - 1].end = nAnchors;
+        runParts(ChainPhase);
+    } else {
+        chainAnchors(0, nAnchors);
+    }
+
+    //
+    // Take chains best first, skipping ones at the same place as one we already have, which are usually what's left of
+    // it after a gap the chaining couldn't cross.
+    //
+    struct FilledChain {
+        GenomeLocation  location;
+        _int64          end;
+        Direction       direction;
+        int             editDistance;
+    } filled[MaxChainsToFill];
+    int nFilled = 0;
+
+    for (int attempt = 0; attempt < MaxChainsToTry && nFilled < MaxChainsToFill; attempt++) {
+        int best = -1;
+        for (int i = 0; i < nAnchors; i++) {
+            if (!anchors[i].used && (-1 == best || anchors[i].score > anchors[best].score)) {
+                best = i;
+            }
+        }
+
+        if (-1 == best || anchors[best].score < MinChainSeeds * (int)seedLen) {
+            break;
+        }
+
+        Direction direction = anchors[best].direction;
+        if (takeChain(best) < MinChainSeeds * (int)seedLen) {
+            continue;
+        }
+
+        FilledChain *candidate = &filled[nFilled];
+        if (!fillChain(readData[direction], readLen, &candidate->editDistance, &candidate->location, &candidate->end)) {
+            continue;
+        }
+        candidate->direction = direction;
+
+        bool overlaps = false;
+        for (int i = 0; i < nFilled; i++) {
+            if (filled[i].direction == direction && GenomeLocationAsInt64(filled[i].location) < candidate->end &&
+                GenomeLocationAsInt64(candidate->location) < filled[i].end) {
+                overlaps = true;
+                break;
+            }
+        }
+
+        if (!overlaps) {
+            nFilled++;
+        }
+    }
+
+    if (0 == nFilled) {
+        return;
+    }
+
+    int best = 0;
+    for (int i = 1; i < nFilled; i++) {
+        if (filled[i].editDistance < filled[best].editDistance) {
+            best = i;
+        }
+    }
+
+    double probabilityOfAllCandidates = 0;
+    for (int i = 0; i < nFilled; i++) {
+        probabilityOfAllCandidates += pow(RelativeProbabilityPerEdit, filled[i].editDistance - filled[best].editDistance);
+    }
+
+    result->location = filled[best].location;
+    result->direction = filled[best].direction;
+    result->score = filled[best].editDistance;
+    result->mapq = computeMAPQ(probabilityOfAllCandidates, 1.0, result->score, 0);
+    result->status = result->mapq >= MAPQ_LIMIT_FOR_SINGLE_HIT ? SingleHit : MultipleHits;
+}
@@ -0,0 +1,177 @@
+/*++
+
+Module Name:
+
+    LongReadAligner.h
+
+Abstract:
+
+    Alignment for long, noisy reads (-long).  BaseAligner scores each candidate with one LandauVishkin run that can
+    find at most MAX_K edits, which is a few percent of a few hundred bases and nowhere near enough for a 10 kb
+    read with ten percent error.  This aligner works the way long read aligners generally do instead: look up seeds
+    along the read, chain hits that are co-linear (in increasing order along both the read and the genome, on
+    roughly the same diagonal) with a sparse dynamic program over the hits, and then align only what's between the
+    anchors of the best chains, each gap in a band of its own with AffineGapWithCigar.  The edit distance of the
+    read is the sum of those, so no one alignment ever has to cover more than a gap's worth of edits.
+
+    It only finds the primary alignment, and the read writer still computes the CIGAR string the usual way.
+
+    A read of ParallelMinReadLength or more bases can take long enough that its thread holds up the end of the run
+    while the others wait, so with -longHelpers its work is split with that many helper threads from the thread pool
+    (see StartPooledThread): the seed lookups by where the seeds are in the read, the chaining by stretches of the
+    sorted anchors that no chain can cross (a change of direction, or more than MaxChainGap of genome between two
+    anchors), and the gaps of each chain.  Each part has its own scratch space, and the result is the same as aligning
+    the read on one thread.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "GenomeIndex.h"
+#include "AlignmentResult.h"
+#include "AffineGap.h"
+
+class Read;
+
+class LongReadAligner {
+public:
+    LongReadAligner(GenomeIndex *i_genomeIndex, unsigned i_maxHitsToConsider, int i_nHelpers = 0);
+
+    ~LongReadAligner();
+
+    void AlignRead(Read *read, SingleAlignmentResult *result);
+
+    //
+    // Seeds start every SeedStrideDivisor'th of the seed length along the read, so they overlap.  Overlapping seeds
+    // find a few more hits in noisy reads, and the chaining only credits the bases each anchor adds.
+    //
+    static const int SeedStrideDivisor = 2;
+
+    //
+    // Limits on consecutive anchors in a chain: how far apart they can be along the read or the genome, how far off
+    // each other's diagonal (that is, how large an indel between them), and how many anchors back to look for a
+    // predecessor.  The last is what keeps the chaining close to linear in the number of hits.
+    //
+    static const int MaxChainGap = 5000;
+    static const int MaxDiagonalDrift = 500;
+    static const int MaxPredecessors = 50;
+
+    //
+    // A chain has to cover at least this many seeds' worth of bases to be considered.
+    //
+    static const int MinChainSeeds = 3;
+
+    //
+    // How many chains at different places to fill in for MAPQ, and how many chains to look at to find them.
+    //
+    static const int MaxChainsToFill = 4;
+    static const int MaxChainsToTry = 16;
+
+    //
+    // Gaps between anchors are aligned in a band of their drift plus GapBandSlack; the ends of the read, which aren't
+    // pinned on the outside, get MaxEndBand.  Anything longer than MaxFillLength is counted as all edits rather than
+    // aligned.
+    //
+    static const int GapBandSlack = 16;
+    static const int MaxEndBand = 64;
+    static const int MaxFillLength = 4000;
+
+    //
+    // Reads at least this long are split among the helpers.
+    //
+    static const int ParallelMinReadLength = 20000;
+
+private:
+
+    struct Anchor {
+        _int64      genomeLocation;
+        int         readOffset;             // In the read in direction, so the anchor's diagonal is genomeLocation - readOffset
+        Direction   direction;
+        int         score;                  // The best chain that ends here
+        int         predecessor;            // The anchor before this one in that chain, or -1
+        bool        used;                   // Already part of a chain that's been taken
+
+        bool operator<(const Anchor &peer) const {
+            if (direction != peer.direction) {
+                return direction < peer.direction;
+            }
+            if (genomeLocation != peer.genomeLocation) {
+                return genomeLocation < peer.genomeLocation;
+            }
+            return readOffset < peer.readOffset;
+        }
+    };
+
+    //
+    // What each thread working on a read needs for itself.  parts[0] is the aligner's own thread's, and its anchors are
+    // the read's, once the other parts' have been added to them.
+    //
+    struct Part {
+        OverflowDecodeBuffer overflowDecodeBuffer;
+        GenomeLocation      *overflowDecodeBufferStorage;
+
+        AffineGapWithCigar   gapAligner;
+
+        int                  cigarBufCapacity;
+        char                *cigarBuf;              // AffineGapWithCigar insists on writing one, which we ignore
+
+        int                  anchorCapacity;
+        int                  nAnchors;
+        Anchor              *anchors;
+
+        int                  first;                 // The seeds, anchors or gaps of the current phase
+        int                  end;
+        int                  editDistance;          // Of the gaps filled
+    };
+
+    enum Phase {LookupSeedsPhase, ChainPhase, FillGapsPhase};
+
+    struct HelperWork {
+        LongReadAligner     *aligner;
+        int                  part;
+    };
+
+    void addAnchor(Part *part, _int64 genomeLocation, int readOffset, Direction direction);
+    void lookupSeeds(Part *part, int firstSeed, int endSeed);
+    void chainAnchors(int first, int end);
+    int takeChain(int end);
+    bool fillChain(const char *readData, int readLen, int *o_editDistance, GenomeLocation *o_location, _int64 *o_end);
+    int fillGaps(Part *part, const char *readData, int firstGap, int endGap);
+    int alignSegment(Part *part, const char *text, int textLen, const char *pattern, int patternLen, int w, int *o_textUsed);
+
+    void runParts(Phase phase);
+    void runPart(int whichPart);
+    static void HelperThreadMain(void *param);
+
+    static int gapCost(int drift);
+
+    GenomeIndex         *genomeIndex;
+    const Genome        *genome;
+    unsigned             seedLen;
+    unsigned             maxHitsToConsider;
+    bool                 doesGenomeIndexHave64BitLocations;
+
+    int                  nParts;                // 1 + the number of helpers
+    Part                *parts;
+    HelperWork          *helperWork;
+    Phase                phase;
+    bool                 parallel;              // Splitting the current read among the parts
+    const char          *phaseReadData;         // The read (forward for the lookups, in the chain's direction to fill)
+    int                  phaseReadLen;
+    volatile int         nHelpersRunning;
+    SingleWaiterObject   helpersDone;
+
+    int                  chainCapacity;
+    int                  nChain;
+    int                 *chain;                 // Anchor indices of the chain being filled, in order along the read
+
+    int                  readCapacity;
+    char                *rcReadData;
+    char                *reversedPattern;       // The read before the first anchor, backward
+    char                *reversedText;          // The genome before the first anchor, backward
+};
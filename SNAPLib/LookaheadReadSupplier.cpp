@@ -0,0 +1,151 @@
+/*++
+
+Module Name:
+
+    LookaheadReadSupplier.cpp
+
+Abstract:
+
+    Read suppliers that keep a few reads in flight ahead of the one that's being aligned.  See LookaheadReadSupplier.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "LookaheadReadSupplier.h"
+#include "GenomeIndex.h"
+#include "AlignmentResult.h"
+
+    static void
+CopyRead(Read *slotRead, Read *read, char **buffer, size_t *bufferSize)
+/*++
+
+Routine Description:
+
+    Copy a read from the inner supplier into a slot, along with everything it points at, so it lasts as long as
+    the slot does.
+
+Arguments:
+
+    slotRead    - the slot's read
+    read        - the read from the inner supplier
+    buffer      - the slot's buffer, which is grown if it's not big enough
+    bufferSize  - its size
+
+--*/
+{
+    *slotRead = *read;
+
+    size_t needed = slotRead->getExternalDataSize();
+    if (needed > *bufferSize) {
+        delete [] *buffer;
+        *bufferSize = __max(needed, 2 * *bufferSize);
+        *buffer = new char[*bufferSize];
+    }
+
+    slotRead->moveExternalDataTo(*buffer);
+}
+
+LookaheadReadSupplier::LookaheadReadSupplier(ReadSupplier *i_inner, const GenomeIndex *i_index, unsigned i_depth) :
+    inner(i_inner), index(i_index), depth(__min(__max(i_depth, 1), MaxDepth)), oldest(0), nInFlight(0), innerDone(false)
+{
+    slots = new Slot[depth + 1];
+}
+
+LookaheadReadSupplier::~LookaheadReadSupplier()
+{
+    delete [] slots;
+    delete inner;
+}
+
+    Read *
+LookaheadReadSupplier::getNextRead()
+/*++
+
+Routine Description:
+
+    Top up the reads in flight from the inner supplier (prefetching the seed lookups for each new one), and hand out
+    the oldest.  The slot we handed out last time is free again, since the caller is done with it.
+
+--*/
+{
+    while (!innerDone && nInFlight < depth + 1) {
+        Read *read = inner->getNextRead();
+        if (NULL == read) {
+            innerDone = true;
+            break;
+        }
+
+        Slot *slot = &slots[(oldest + nInFlight) % (depth + 1)];
+        CopyRead(&slot->read, read, &slot->buffer, &slot->bufferSize);
+        index->prefetchSeedLookups(slot->read.getData(), slot->read.getDataLength());
+        nInFlight++;
+    }
+
+    if (0 == nInFlight) {
+        return NULL;
+    }
+
+    Slot *slot = &slots[oldest];
+    oldest = (oldest + 1) % (depth + 1);
+    nInFlight--;
+
+    return &slot->read;
+}
+
+LookaheadPairedReadSupplier::LookaheadPairedReadSupplier(PairedReadSupplier *i_inner, const GenomeIndex *i_index, unsigned i_depth) :
+    inner(i_inner), index(i_index), depth(__min(__max(i_depth, 1), LookaheadReadSupplier::MaxDepth)), oldest(0), nInFlight(0),
+    innerDone(false)
+{
+    slots = new Slot[depth + 1];
+}
+
+LookaheadPairedReadSupplier::~LookaheadPairedReadSupplier()
+{
+    delete [] slots;
+    delete inner;
+}
+
+    bool
+LookaheadPairedReadSupplier::getNextReadPair(Read **read0, Read **read1)
+/*++
+
+Routine Description:
+
+    The same as LookaheadReadSupplier::getNextRead, for pairs.
+
+--*/
+{
+    while (!innerDone && nInFlight < depth + 1) {
+        Read *reads[NUM_READS_PER_PAIR];
+        if (!inner->getNextReadPair(&reads[0], &reads[1])) {
+            innerDone = true;
+            break;
+        }
+
+        Slot *slot = &slots[(oldest + nInFlight) % (depth + 1)];
+        for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+            CopyRead(&slot->reads[whichRead], reads[whichRead], &slot->buffer[whichRead], &slot->bufferSize[whichRead]);
+            index->prefetchSeedLookups(slot->reads[whichRead].getData(), slot->reads[whichRead].getDataLength());
+        }
+
+        nInFlight++;
+    }
+
+    if (0 == nInFlight) {
+        *read0 = *read1 = NULL;
+        return false;
+    }
+
+    Slot *slot = &slots[oldest];
+    oldest = (oldest + 1) % (depth + 1);
+    nInFlight--;
+
+    *read0 = &slot->reads[0];
+    *read1 = &slot->reads[1];
+
+    return true;
+}
@@ -0,0 +1,99 @@
+/*++
+
+Module Name:
+
+    LookaheadReadSupplier.h
+
+Abstract:
+
+    Headers for read suppliers that keep a few reads in flight ahead of the one that's being aligned (-la).
+
+    An aligner thread takes one read at a time and aligns it start to finish, so the first seed lookups for each read
+    stall on hash table lines that aren't in cache.  These suppliers take reads from the real supplier some way ahead of
+    the one they hand out, and prefetch the hash table buckets for the first seeds of each as it comes in, so by the time the
+    aligner gets to a read its lookups are (mostly) in cache.  The reads come out in the same order as they went in, so
+    nothing downstream can tell the difference.
+
+    Reads are only good until the next call to getNextRead, and holding their batches isn't enough to keep them alive
+    with every supplier (a range splitting supplier remaps its file when it moves to the next range), so each read in
+    flight is copied along with everything it points to into memory that belongs to its slot.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+#include "Read.h"
+#include "Compat.h"
+
+class GenomeIndex;
+
+class LookaheadReadSupplier : public ReadSupplier {
+public:
+    LookaheadReadSupplier(ReadSupplier *i_inner, const GenomeIndex *i_index, unsigned i_depth);   // We own inner
+    virtual ~LookaheadReadSupplier();
+
+    virtual Read *getNextRead();
+
+    //
+    // The reads we hand out have their own copies of everything, so there's nothing to hold.
+    //
+    virtual void holdBatch(DataBatch batch) {}
+    virtual bool releaseBatch(DataBatch batch) {return true;}
+
+    static const unsigned MaxDepth = 64;
+
+private:
+
+    struct Slot {
+        Slot() : buffer(NULL), bufferSize(0) {}
+        ~Slot() {delete [] buffer;}
+
+        Read    read;
+        char   *buffer;     // The id, data, quality and so on that read points to
+        size_t  bufferSize;
+    };
+
+    ReadSupplier       *inner;
+    const GenomeIndex  *index;
+    unsigned            depth;          // How many reads to keep in flight, not counting the one the caller has
+    Slot               *slots;          // A ring of depth + 1, so the one the caller has isn't overwritten until it's done with it
+    unsigned            oldest;         // The slot that the next getNextRead will return
+    unsigned            nInFlight;      // How many slots starting at oldest have reads in them
+    bool                innerDone;
+};
+
+class LookaheadPairedReadSupplier : public PairedReadSupplier {
+public:
+    LookaheadPairedReadSupplier(PairedReadSupplier *i_inner, const GenomeIndex *i_index, unsigned i_depth);   // We own inner
+    virtual ~LookaheadPairedReadSupplier();
+
+    virtual bool getNextReadPair(Read **read0, Read **read1);
+
+    //
+    // The reads we hand out have their own copies of everything, so there's nothing to hold.
+    //
+    virtual void holdBatch(DataBatch batch) {}
+    virtual bool releaseBatch(DataBatch batch) {return true;}
+
+private:
+
+    struct Slot {
+        Slot() {for (int i = 0; i < NUM_READS_PER_PAIR; i++) {buffer[i] = NULL; bufferSize[i] = 0;}}
+        ~Slot() {for (int i = 0; i < NUM_READS_PER_PAIR; i++) {delete [] buffer[i];}}
+
+        Read    reads[NUM_READS_PER_PAIR];
+        char   *buffer[NUM_READS_PER_PAIR];
+        size_t  bufferSize[NUM_READS_PER_PAIR];
+    };
+
+    PairedReadSupplier *inner;
+    const GenomeIndex  *index;
+    unsigned            depth;
+    Slot               *slots;
+    unsigned            oldest;
+    unsigned            nInFlight;
+    bool                innerDone;
+};
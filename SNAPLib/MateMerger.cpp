@@ -0,0 +1,195 @@
+/*++
+
+Module Name:
+
+    MateMerger.cpp
+
+Abstract:
+
+    Aligning overlapping mates as one read.  See MateMerger.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "MateMerger.h"
+#include "BaseAligner.h"
+#include "ReverseComplement.h"
+
+MateMerger::MateMerger(const Genome *i_genome, unsigned i_maxReadSize, int i_maxK) : genome(i_genome), maxReadSize(i_maxReadSize), maxK(__min(i_maxK, MAX_K)), mergedLength(0)
+{
+    rcData1 = new char[maxReadSize];
+    rcQuality1 = new char[maxReadSize];
+    mergedData = new char[maxReadSize];
+    mergedQuality = new char[maxReadSize];
+    rcMergedData = new char[maxReadSize];
+    rcMergedQuality = new char[maxReadSize];
+    complementBackData = new char[maxReadSize];
+}
+
+MateMerger::~MateMerger()
+{
+    delete [] rcData1;
+    delete [] rcQuality1;
+    delete [] mergedData;
+    delete [] mergedQuality;
+    delete [] rcMergedData;
+    delete [] rcMergedQuality;
+    delete [] complementBackData;
+}
+
+    int
+MateMerger::findOverlap(const char *data0, unsigned length0, const char *rcData1, unsigned length1) const
+{
+    //
+    // Try each offset at which read 1's reverse complement runs at least to the end of read 0, giving up on one as soon
+    // as it has too many mismatches, which for all but the right one is usually within a few bases.
+    //
+    int found = -1;
+    for (unsigned offset = length0 > length1 ? length0 - length1 : 0; offset + MinOverlap <= length0; offset++) {
+        unsigned overlap = length0 - offset;
+        unsigned maxMismatches = overlap * MaxMismatchPercent / 100;
+        unsigned mismatches = 0;
+        for (unsigned i = 0; i < overlap && mismatches <= maxMismatches; i++) {
+            if (data0[offset + i] != rcData1[i] || 'N' == rcData1[i]) {
+                mismatches++;
+            }
+        }
+
+        if (mismatches <= maxMismatches) {
+            if (-1 != found) {
+                //
+                // A repeat lines them up more than one way, so we can't tell how long the fragment is.
+                //
+                return -1;
+            }
+            found = (int)offset;
+        }
+    }
+
+    return found;
+}
+
+    bool
+MateMerger::merge(Read **reads)
+{
+    const char *data0 = reads[0]->getData();
+    const char *quality0 = reads[0]->getQuality();
+    unsigned length0 = reads[0]->getDataLength();
+    unsigned length1 = reads[1]->getDataLength();
+    if (length0 < MinOverlap || length1 < MinOverlap || length0 > maxReadSize || length1 > maxReadSize) {
+        return false;
+    }
+
+    ReverseComplementRead(reads[1]->getData(), reads[1]->getQuality(), length1, rcData1, rcQuality1, NULL, NULL);
+
+    int offset = findOverlap(data0, length0, rcData1, length1);
+    if (-1 == offset || offset + length1 > maxReadSize) {
+        return false;
+    }
+
+    mergedLength = offset + length1;
+    memcpy(mergedData, data0, offset);
+    memcpy(mergedQuality, quality0, offset);
+    for (unsigned i = offset; i < length0; i++) {
+        char base0 = data0[i], base1 = rcData1[i - offset];
+        int q0 = quality0[i] - '!', q1 = rcQuality1[i - offset] - '!';
+        if (base0 == base1) {
+            mergedData[i] = base0;
+            mergedQuality[i] = (char)('!' + __min(q0 + q1, MaxMergedQuality));
+        } else if ('N' == base0 || 'N' == base1) {
+            mergedData[i] = 'N' == base0 ? base1 : base0;
+            mergedQuality[i] = (char)('!' + ('N' == base0 ? q1 : q0));
+        } else {
+            mergedData[i] = q1 > q0 ? base1 : base0;
+            mergedQuality[i] = (char)('!' + __max(abs(q0 - q1), 2));
+        }
+    }
+    memcpy(mergedData + length0, rcData1 + length0 - offset, mergedLength - length0);
+    memcpy(mergedQuality + length0, rcQuality1 + length0 - offset, mergedLength - length0);
+
+    mergedRead.init(reads[0]->getId(), reads[0]->getIdLength(), mergedData, mergedQuality, mergedLength);
+    return true;
+}
+
+    bool
+MateMerger::alignPair(BaseAligner *aligner, Read **reads, PairedAlignmentResult *result)
+{
+    if (!merge(reads)) {
+        return false;
+    }
+
+    SingleAlignmentResult mergedResult;
+    int nSecondaryResults;
+    aligner->AlignRead(&mergedRead, &mergedResult, -1, 0, &nSecondaryResults, 0, NULL);
+    if (NotFound == mergedResult.status) {
+        return false;
+    }
+
+    //
+    // The mate that reads the fragment forward starts where the merged read does, and the other one (RC) ends where
+    // it ends, which the merged read's own edit distance says.  Find where the second one starts by aligning it
+    // backward from there.  The mates' scores are their own, not the merged read's.
+    //
+    Direction mergedDirection = (Direction)mergedResult.direction;
+    const char *data = mergedData;
+    const char *quality = mergedQuality;
+    if (RC == mergedDirection) {
+        ReverseComplementRead(mergedData, mergedQuality, mergedLength, rcMergedData, rcMergedQuality, NULL, NULL);
+        data = rcMergedData;
+        quality = rcMergedQuality;
+    }
+
+    int front = FORWARD == mergedDirection ? 0 : 1;
+    int back = 1 - front;
+    unsigned frontLength = reads[front]->getDataLength();
+    unsigned backLength = reads[back]->getDataLength();
+
+    //
+    // Backward, the RC mate is its complement, unreversed.
+    //
+    ReverseComplementRead(reads[back]->getData(), reads[back]->getQuality(), backLength, NULL, NULL, NULL, complementBackData);
+
+    const char *text = genome->getSubstring(mergedResult.location, mergedLength + maxK);
+    if (NULL == text) {
+        return false;
+    }
+
+    double matchProbability;
+    int netIndel = 0;
+    if (lv.computeEditDistance(text, mergedLength + maxK, data, quality, mergedLength, maxK, &matchProbability, &netIndel) < 0) {
+        return false;
+    }
+    int frontScore = lv.computeEditDistance(text, frontLength + maxK, reads[front]->getData(), reads[front]->getQuality(), frontLength, maxK,
+        &matchProbability);
+
+    GenomeLocation end = mergedResult.location + mergedLength - netIndel;    // netIndel is negative for deletions
+    const char *backText = genome->getSubstring(end - backLength - maxK, backLength + maxK);
+    if (NULL == backText || frontScore < 0) {
+        return false;
+    }
+
+    int backNetIndel = 0;
+    int backScore = reverseLV.computeEditDistance(backText + backLength + maxK, backLength + maxK, complementBackData, reads[back]->getQuality(), backLength, maxK,
+        &matchProbability, &backNetIndel);
+    if (backScore < 0) {
+        return false;
+    }
+
+    result->location[front] = mergedResult.location;
+    result->direction[front] = FORWARD;
+    result->score[front] = frontScore;
+    result->location[back] = end - backLength + backNetIndel;  // As BaseAligner applies the reverse LV's offset
+    result->direction[back] = RC;
+    result->score[back] = backScore;
+    for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+        result->mapq[whichRead] = mergedResult.mapq;
+        result->status[whichRead] = mergedResult.status;
+    }
+    result->fromAlignTogether = true;
+    result->alignedAsPair = true;
+    return true;
+}
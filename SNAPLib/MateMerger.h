@@ -0,0 +1,77 @@
+/*++
+
+Module Name:
+
+    MateMerger.h
+
+Abstract:
+
+    -mergeMates: aligning a pair whose mates overlap as one read.  When the fragment is shorter than the two reads
+    together, the reverse complement of read 1 picks up where read 0 leaves off, so the pair is really one longer read
+    of the fragment.  The mates are merged into that read (with a consensus of the two where they overlap, taking the
+    better base by quality where they disagree), it's aligned once with the single-end aligner, and the alignment is
+    split back into one for each mate: the mate that reads the fragment forward starts where the merged read does, and
+    the other ends where it ends.
+
+    Only pairs that line up at exactly one offset, with few mismatches over at least MinOverlap bases, are merged, and
+    not those where read 1 ends inside read 0 (a fragment shorter than the reads, so they run into adapter).  Pairs
+    that aren't merged, or whose merged read doesn't align, are aligned as usual.  Since it can't supply secondary
+    alignments, it's not used when they're asked for.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Genome.h"
+#include "Read.h"
+#include "AlignmentResult.h"
+#include "LandauVishkin.h"
+
+class BaseAligner;
+
+class MateMerger {
+public:
+    MateMerger(const Genome *i_genome, unsigned i_maxReadSize, int i_maxK);
+    ~MateMerger();
+
+    //
+    // If the mates overlap, align them as one read with aligner and fill in result (with no secondary alignments) from
+    // where it went.  Returns false, leaving result alone, if they don't or the merged read can't be placed.
+    //
+    bool alignPair(BaseAligner *aligner, Read **reads, PairedAlignmentResult *result);
+
+    static const unsigned MinOverlap = 30;
+    static const unsigned MaxMismatchPercent = 5;   // Of the overlap
+    static const int MaxMergedQuality = 41;         // For bases where the mates agree
+
+private:
+    //
+    // The offset in read 0 at which read 1's reverse complement starts, or -1 if they don't line up at exactly one.
+    //
+    int findOverlap(const char *data0, unsigned length0, const char *rcData1, unsigned length1) const;
+
+    bool merge(Read **reads);
+
+    const Genome   *genome;
+    unsigned        maxReadSize;
+    int             maxK;
+
+    char           *rcData1;
+    char           *rcQuality1;
+    char           *mergedData;
+    char           *mergedQuality;
+    unsigned        mergedLength;
+    Read            mergedRead;
+
+    char           *rcMergedData;           // For a merged read that aligned RC
+    char           *rcMergedQuality;
+    char           *complementBackData;     // The RC mate, for aligning it backward from the merged read's end
+
+    LandauVishkin<1>    lv;
+    LandauVishkin<-1>   reverseLV;
+};
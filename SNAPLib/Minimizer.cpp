@@ -0,0 +1,100 @@
+/*++
+
+Module Name:
+
+    Minimizer.cpp
+
+Abstract:
+
+    Code for finding (w,k) minimizers.  See Minimizer.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "Minimizer.h"
+
+    void
+MarkMinimizers(const _uint64 *hashes, _int64 nHashes, unsigned windowSize, bool *isMinimizer)
+/*++
+
+Routine Description:
+
+    Find the minimizers using a monotone queue of candidate offsets: the queue holds the offsets in the current window
+    whose hashes aren't bigger than any that come after them in the window, so its head is the window's smallest, and any
+    ties for smallest follow it.  This is linear in nHashes except when there are many ties (like a run of a
+    single base), where it can take up to windowSize per window.
+
+Arguments:
+
+    hashes      - the seed hashes, in order
+    nHashes     - the number of hashes
+    windowSize  - the number of consecutive seeds in a window
+    isMinimizer - set for each minimizer
+
+--*/
+{
+    _ASSERT(windowSize >= 1 && windowSize <= MaxMinimizerWindow);
+
+    if (nHashes <= 0) {
+        return;
+    }
+
+    _int64 queue[MaxMinimizerWindow];   // A ring buffer, since it never holds more than one window
+    unsigned queueHead = 0;
+    unsigned queueCount = 0;
+
+    for (_int64 i = 0; i < nHashes; i++) {
+        //
+        // Drop anything that's fallen out of the window ending here, and anything bigger than the new hash.
+        //
+        if (queueCount > 0 && queue[queueHead] <= i - (_int64)windowSize) {
+            queueHead = (queueHead + 1) % windowSize;
+            queueCount--;
+        }
+
+        while (queueCount > 0 && hashes[queue[(queueHead + queueCount - 1) % windowSize]] > hashes[i]) {
+            queueCount--;
+        }
+
+        queue[(queueHead + queueCount) % windowSize] = i;
+        queueCount++;
+
+        _int64 windowStart = i - (_int64)windowSize + 1;
+        if (windowStart < 0 && i != nHashes - 1) {
+            continue;   // We haven't seen a whole window yet
+        }
+
+        _uint64 smallest = hashes[queue[queueHead]];
+        if (NotAMinimizerCandidate == smallest) {
+            continue;
+        }
+
+        for (unsigned j = 0; j < queueCount && hashes[queue[(queueHead + j) % windowSize]] == smallest; j++) {
+            isMinimizer[queue[(queueHead + j) % windowSize]] = true;
+        }
+    }
+}
+
+    void
+FindReadMinimizers(const char *readData, unsigned readLen, unsigned seedLen, unsigned windowSize, _uint64 *hashes, bool *isMinimizer)
+{
+    if (readLen < seedLen) {
+        return;
+    }
+
+    unsigned nSeeds = readLen - seedLen + 1;
+    for (unsigned i = 0; i < nSeeds; i++) {
+        isMinimizer[i] = false;
+        if (Seed::DoesTextRepresentASeed(readData + i, seedLen)) {
+            hashes[i] = MinimizerHash(Seed(readData + i, seedLen));
+        } else {
+            hashes[i] = NotAMinimizerCandidate;
+        }
+    }
+
+    MarkMinimizers(hashes, nSeeds, windowSize, isMinimizer);
+}
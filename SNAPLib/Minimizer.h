@@ -0,0 +1,55 @@
+/*++
+
+Module Name:
+
+    Minimizer.h
+
+Abstract:
+
+    Code for finding (w,k) minimizers, for indices built with index -minimizer.  Such an index only has the seeds
+    that are the minimizer of some window of w consecutive seeds in the genome (k is the seed length), and the
+    aligners only look up the minimizers of the read.  Any part of a read that matches the genome exactly for
+    w + k - 1 bases has at least one minimizer in common with it.
+
+    The ordering is by Seed::hash64(), which is the same for a seed and its reverse complement, and every seed
+    tied for the smallest in a window counts as a minimizer.  So the minimizers of a read's reverse complement are
+    the same seeds as those of the read, and it doesn't matter which strand we index or look up.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Seed.h"
+
+//
+// The hash for a location that doesn't have a seed (it contains an N or crosses a contig boundary).  It's never a minimizer.
+//
+const _uint64 NotAMinimizerCandidate = 0xffffffffffffffff;
+
+const unsigned MaxMinimizerWindow = 255;
+
+    inline _uint64
+MinimizerHash(Seed seed)
+{
+    _uint64 hash = seed.hash64();
+    return hash == NotAMinimizerCandidate ? hash - 1 : hash;
+}
+
+//
+// Given the hashes of consecutive seeds, set isMinimizer for each one that's (one of) the smallest in some
+// window of windowSize consecutive hashes.  It only ever sets isMinimizer, so the caller needs to clear it
+// first.  If there are fewer than windowSize hashes, they're treated as one short window, which happens
+// for reads that are shorter than a window.
+//
+void MarkMinimizers(const _uint64 *hashes, _int64 nHashes, unsigned windowSize, bool *isMinimizer);
+
+//
+// Fill in hashes for each seed offset in a read (NotAMinimizerCandidate for seeds with Ns) and find the minimizers.
+// There are readLen - seedLen + 1 seed offsets, and hashes and isMinimizer need that many entries.
+//
+void FindReadMinimizers(const char *readData, unsigned readLen, unsigned seedLen, unsigned windowSize, _uint64 *hashes, bool *isMinimizer);
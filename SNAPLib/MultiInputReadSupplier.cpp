@@ -27,192 +27,234 @@ Revision History:
 #include "MultiInputReadSupplier.h"
 
 
-MultiInputReadSupplier::MultiInputReadSupplier(int i_nReadSuppliers, ReadSupplier **i_readSuppliers)
+MultiInputScheduler::MultiInputScheduler(int i_nInputs) : nInputs(i_nInputs)
 {
-    readSuppliers = i_readSuppliers;    // We get to own the array
-    nRemainingReadSuppliers = nReadSuppliers = i_nReadSuppliers;
-    nextReadSupplier = 0;
-    activeReadSuppliers = new ActiveRead[nReadSuppliers];
-    for (int i = 0; i < nReadSuppliers; i++) {
-        activeReadSuppliers[i].index = i;
-        activeReadSuppliers[i].lastBatch = DataBatch();
-        activeReadSuppliers[i].firstReadInNextBatch = NULL;
+    InitializeExclusiveLock(&lock);
+    nReaders = new int[nInputs];
+    finished = new bool[nInputs];
+    for (int i = 0; i < nInputs; i++) {
+        nReaders[i] = 0;
+        finished[i] = false;
+    }
+}
+
+MultiInputScheduler::~MultiInputScheduler()
+{
+    DestroyExclusiveLock(&lock);
+    delete [] nReaders;
+    delete [] finished;
+}
+
+    int
+MultiInputScheduler::nextInput(int finishedInput)
+/*++
+
+Routine Description:
+
+    An input runs out of reads for everyone at once: a range splitter when it has no ranges left to hand out or steal, and
+    a queue when it's empty and its readers are at the end of the file.  So one thread finding that it's out is enough to
+    stop sending threads to it.  Ties go to the earlier input, so the inputs get finished more or less in order.
+
+--*/
+{
+    AcquireExclusiveLock(&lock);
+    if (-1 != finishedInput) {
+        _ASSERT(finishedInput >= 0 && finishedInput < nInputs && nReaders[finishedInput] > 0);
+        nReaders[finishedInput]--;
+        finished[finishedInput] = true;
+    }
+
+    int input = -1;
+    for (int i = 0; i < nInputs; i++) {
+        if (!finished[i] && (-1 == input || nReaders[i] < nReaders[input])) {
+            input = i;
+        }
+    }
+
+    if (-1 != input) {
+        nReaders[input]++;
+    }
+    ReleaseExclusiveLock(&lock);
+
+    return input;
+}
+
+MultiInputReadSupplier::MultiInputReadSupplier(MultiInputReadSupplierGenerator *i_generator, int i_nInputs) :
+    generator(i_generator), nInputs(i_nInputs), currentInput(-1)
+{
+    readSuppliers = new ReadSupplier *[nInputs];
+    for (int i = 0; i < nInputs; i++) {
+        readSuppliers[i] = NULL;
     }
 }
 
 MultiInputReadSupplier::~MultiInputReadSupplier()
 {
-    for (int i = 0; i < nReadSuppliers; i++) {
+    for (int i = 0; i < nInputs; i++) {
         delete readSuppliers[i];
         readSuppliers[i] = NULL;
     }
     delete [] readSuppliers;
-    delete [] activeReadSuppliers;
+}
+
+    bool
+MultiInputReadSupplier::moveToNextInput()
+{
+    int finishedInput = currentInput;
+    currentInput = -1;  // So that we don't tell the scheduler we're done with it twice
+
+    int input;
+    ReadSupplier *supplier = generator->generateSupplierForNextInput(finishedInput, &input);
+    if (NULL == supplier) {
+        return false;
+    }
+
+    _ASSERT(NULL == readSuppliers[input]);
+    readSuppliers[input] = supplier;
+    currentInput = input;
+    return true;
 }
 
     Read *
 MultiInputReadSupplier::getNextRead()
 {
-    while (true) {
-        if (0 == nRemainingReadSuppliers) {
-            return NULL;
+    while (-1 != currentInput || moveToNextInput()) {
+        Read *read = readSuppliers[currentInput]->getNextRead();
+        if (NULL != read) {
+            setBatch(read);
+            return read;
         }
-        _ASSERT(nextReadSupplier < nRemainingReadSuppliers);
-
-        ActiveRead* active = &activeReadSuppliers[nextReadSupplier];
-        DataBatch last = active->lastBatch;
-        Read *read;
 
-        if (active->firstReadInNextBatch != NULL) {
-            read = active->firstReadInNextBatch;
-            active->firstReadInNextBatch = NULL;
-            active->lastBatch = read->getBatch();
-            return read;
+        if (!moveToNextInput()) {
+            break;
         }
+    }
+
+    return NULL;
+}
+
+    int
+MultiInputReadSupplier::getNextReadBatch(Read **reads, int maxReads)
+/*++
+
+Routine Description:
+
+    Take a batch from the current input.  Reads from an input stay valid after we move on to the next one, since each
+    supplier only reuses its reads when it's called again.
 
-        read = readSuppliers[active->index]->getNextRead();
-        if (read != NULL) {
-            read->setBatch(DataBatch(read->getBatch().batchID,
-                read->getBatch().fileID * nReadSuppliers + active->index));
-            active->lastBatch = read->getBatch();
-            if (read->getBatch() == last || last == DataBatch()) {
-                return read;
+--*/
+{
+    while (-1 != currentInput || moveToNextInput()) {
+        int nReads = readSuppliers[currentInput]->getNextReadBatch(reads, maxReads);
+        if (0 != nReads) {
+            for (int i = 0; i < nReads; i++) {
+                setBatch(reads[i]);
             }
-            // end of batch from current supplier, round-robin through suppliers
-            active->firstReadInNextBatch = read;
-            nextReadSupplier = (nextReadSupplier + 1) % nRemainingReadSuppliers;
-        } else {
-            //
-            // This supplier is done.  Update our array to pull the
-            // last live read supplier into the slot that we just vacated (this will result
-            // in violating a strict round robin, but we don't promise any such thing
-            // anyway). Can't delete because it might be retaining read data in use downstream.
-            //
-            nRemainingReadSuppliers--;
-            activeReadSuppliers[nextReadSupplier] = activeReadSuppliers[nRemainingReadSuppliers];
-            nextReadSupplier = 0;   // (Bluntly) handles the case where nextReadSupplier is the last one.
+            return nReads;
+        }
+
+        if (!moveToNextInput()) {
+            break;
         }
     }
+
+    return 0;
 }
 
     void
 MultiInputReadSupplier::holdBatch(
     DataBatch batch)
 {
-    int index = batch.fileID % nReadSuppliers;
-    _ASSERT(index >= 0 && index < nReadSuppliers);
-    readSuppliers[index]->holdBatch(DataBatch(batch.batchID, batch.fileID / nReadSuppliers));
+    int index = batch.fileID % nInputs;
+    _ASSERT(index >= 0 && index < nInputs && NULL != readSuppliers[index]);
+    readSuppliers[index]->holdBatch(DataBatch(batch.batchID, batch.fileID / nInputs));
 }
     
     bool
 MultiInputReadSupplier::releaseBatch(
     DataBatch batch)
 {
-    int index = batch.fileID % nReadSuppliers;
-    _ASSERT(index >= 0 && index < nReadSuppliers);
-    return readSuppliers[index]->releaseBatch(DataBatch(batch.batchID, batch.fileID / nReadSuppliers));
+    int index = batch.fileID % nInputs;
+    _ASSERT(index >= 0 && index < nInputs && NULL != readSuppliers[index]);
+    return readSuppliers[index]->releaseBatch(DataBatch(batch.batchID, batch.fileID / nInputs));
 }
 
-MultiInputPairedReadSupplier::MultiInputPairedReadSupplier(int i_nReadSuppliers, PairedReadSupplier **i_pairedReadSuppliers)
+MultiInputPairedReadSupplier::MultiInputPairedReadSupplier(MultiInputPairedReadSupplierGenerator *i_generator, int i_nInputs) :
+    generator(i_generator), nInputs(i_nInputs), currentInput(-1)
 {
-    pairedReadSuppliers = i_pairedReadSuppliers;    // We get to own the array
-    nRemainingReadSuppliers = nReadSuppliers = i_nReadSuppliers;
-    nextReadSupplier = 0;
-    activeReadSuppliers = new ActiveRead[nReadSuppliers];
-    for (int i = 0; i < nReadSuppliers; i++) {
-        activeReadSuppliers[i].index = i;
-        activeReadSuppliers[i].lastBatch[0] = activeReadSuppliers[i].lastBatch[1] = DataBatch();
-        activeReadSuppliers[i].firstReadInNextBatch[0] = activeReadSuppliers[i].firstReadInNextBatch[1] = NULL;
+    pairedReadSuppliers = new PairedReadSupplier *[nInputs];
+    for (int i = 0; i < nInputs; i++) {
+        pairedReadSuppliers[i] = NULL;
     }
 }
  
 MultiInputPairedReadSupplier::~MultiInputPairedReadSupplier()
 {
-    for (int i = 0; i < nReadSuppliers; i++) {
+    for (int i = 0; i < nInputs; i++) {
         delete pairedReadSuppliers[i];
         pairedReadSuppliers[i] = NULL;
     }
 
     delete [] pairedReadSuppliers;
-    delete [] activeReadSuppliers;
 }
 
-    bool 
-MultiInputPairedReadSupplier::getNextReadPair(Read **read0, Read **read1)
+    bool
+MultiInputPairedReadSupplier::moveToNextInput()
 {
-    if (0 == nRemainingReadSuppliers) {
-        return NULL;
+    int finishedInput = currentInput;
+    currentInput = -1;
+
+    int input;
+    PairedReadSupplier *supplier = generator->generateSupplierForNextInput(finishedInput, &input);
+    if (NULL == supplier) {
+        return false;
     }
 
-    _ASSERT(nextReadSupplier < nRemainingReadSuppliers);
+    _ASSERT(NULL == pairedReadSuppliers[input]);
+    pairedReadSuppliers[input] = supplier;
+    currentInput = input;
+    return true;
+}
 
-    ActiveRead* active = &activeReadSuppliers[nextReadSupplier];
-    bool hasReads = pairedReadSuppliers[active->index]->getNextReadPair(read0, read1);
-    bool nextBatch = hasReads && ((*read0)->getBatch() != active->lastBatch[0] || (*read1)->getBatch() != active->lastBatch[1]);
-    if (nextBatch) {
-        active->firstReadInNextBatch[0] = *read0;
-        active->firstReadInNextBatch[1] = *read1;
-    }
-    if (nextBatch || ! hasReads) {
-        while (true) {
-            // end of batch from current supplier, round-robin through suppliers
-            if (nextBatch) {
-                nextReadSupplier = (nextReadSupplier + 1) % nRemainingReadSuppliers;
-                nextBatch = false;
-            }
-            active = &activeReadSuppliers[nextReadSupplier];
-            if (active->firstReadInNextBatch[0] != NULL) {
-                _ASSERT(active->firstReadInNextBatch[1] != NULL);
-                *read0 = active->firstReadInNextBatch[0];
-                *read1 = active->firstReadInNextBatch[1];
-                active->firstReadInNextBatch[0] = active->firstReadInNextBatch[1] = NULL;
-                break;
-            }
-            if (pairedReadSuppliers[active->index]->getNextReadPair(read0, read1)) {
-                break;
-            }
-            nRemainingReadSuppliers--;
-            if (0 == nRemainingReadSuppliers) {
-                return false;
-            }
-            //
-            // This supplier is done.  Update our array to pull the
-            // last live read supplier into the slot that we just vacated (this will result
-            // in violating a strict round robin, but we don't promise any such thing
-            // anyway). Can't delete because it might be retaining read data in use downstream.
-            //
-            activeReadSuppliers[nextReadSupplier] = activeReadSuppliers[nRemainingReadSuppliers];
-            nextReadSupplier = 0;   // (Bluntly) handles the case where nextReadSupplier is the last one.
+    bool 
+MultiInputPairedReadSupplier::getNextReadPair(Read **read0, Read **read1)
+{
+    while (-1 != currentInput || moveToNextInput()) {
+        if (pairedReadSuppliers[currentInput]->getNextReadPair(read0, read1)) {
+            setBatch(*read0);
+            setBatch(*read1);
+            return true;
+        }
+
+        if (!moveToNextInput()) {
+            break;
         }
     }
-    active->lastBatch[0] = (*read0)->getBatch();
-    (*read0)->setBatch(DataBatch(active->lastBatch[0].fileID * nReadSuppliers + active->index, active->lastBatch[0].batchID));
-    active->lastBatch[1] = (*read1)->getBatch();
-    (*read1)->setBatch(DataBatch(active->lastBatch[1].fileID * nReadSuppliers + active->index, active->lastBatch[1].batchID));
 
-    return true;
+    return false;
 }
 
     void
 MultiInputPairedReadSupplier::holdBatch(
     DataBatch batch)
 {
-    int index = batch.fileID % nReadSuppliers;
-    _ASSERT(index >= 0 && index < nReadSuppliers);
-    pairedReadSuppliers[index]->holdBatch(DataBatch(batch.batchID, batch.fileID / nReadSuppliers));
+    int index = batch.fileID % nInputs;
+    _ASSERT(index >= 0 && index < nInputs && NULL != pairedReadSuppliers[index]);
+    pairedReadSuppliers[index]->holdBatch(DataBatch(batch.batchID, batch.fileID / nInputs));
 }
     
     bool
 MultiInputPairedReadSupplier::releaseBatch(
     DataBatch batch)
 {
-    int index = batch.fileID % nReadSuppliers;
-    _ASSERT(index >= 0 && index < nReadSuppliers);
-    return pairedReadSuppliers[index]->releaseBatch(DataBatch(batch.batchID, batch.fileID / nReadSuppliers));
+    int index = batch.fileID % nInputs;
+    _ASSERT(index >= 0 && index < nInputs && NULL != pairedReadSuppliers[index]);
+    return pairedReadSuppliers[index]->releaseBatch(DataBatch(batch.batchID, batch.fileID / nInputs));
 }
 
 
-MultiInputReadSupplierGenerator::MultiInputReadSupplierGenerator(int i_nReadSuppliers, ReadSupplierGenerator **i_readSupplierGenerators)
+MultiInputReadSupplierGenerator::MultiInputReadSupplierGenerator(int i_nReadSuppliers, ReadSupplierGenerator **i_readSupplierGenerators) :
+    scheduler(i_nReadSuppliers)
 {
     nReadSuppliers = i_nReadSuppliers;
     readSupplierGenerators = i_readSupplierGenerators;  // We take ownership of the array
@@ -230,24 +272,32 @@ MultiInputReadSupplierGenerator::~MultiInputReadSupplierGenerator()
     ReadSupplier *
 MultiInputReadSupplierGenerator::generateNewReadSupplier()
 {
-    ReadSupplier **readSuppliers = new ReadSupplier *[nReadSuppliers];
-    for (int i = 0; i < nReadSuppliers; ) {
-        readSuppliers[i] = readSupplierGenerators[i]->generateNewReadSupplier();
-		if (NULL == readSuppliers[i]) {
-			nReadSuppliers--;
-		} else {
-			i++;
-		}
-    }
+    //
+    // It gets its inputs' suppliers from us as it goes.
+    //
+    return new MultiInputReadSupplier(this, nReadSuppliers);
+}
 
-	if (0 == nReadSuppliers) {
-		delete [] readSuppliers;
-		return NULL;
-	}
+    ReadSupplier *
+MultiInputReadSupplierGenerator::generateSupplierForNextInput(int finishedInput, int *input)
+{
+    for (;;) {
+        *input = scheduler.nextInput(finishedInput);
+        if (-1 == *input) {
+            return NULL;
+        }
 
-    return new MultiInputReadSupplier(nReadSuppliers,readSuppliers);    // The Supplier owns the array and suppliers we created
-}
+        ReadSupplier *supplier = readSupplierGenerators[*input]->generateNewReadSupplier();
+        if (NULL != supplier) {
+            return supplier;
+        }
 
+        //
+        // It had nothing left for a new thread.
+        //
+        finishedInput = *input;
+    }
+}
     
     ReaderContext*
 MultiInputReadSupplierGenerator::getContext()
@@ -256,7 +306,8 @@ MultiInputReadSupplierGenerator::getContext()
 }
 
 
-MultiInputPairedReadSupplierGenerator::MultiInputPairedReadSupplierGenerator(int i_nReadSuppliers, PairedReadSupplierGenerator **i_readSupplierGenerators)
+MultiInputPairedReadSupplierGenerator::MultiInputPairedReadSupplierGenerator(int i_nReadSuppliers, PairedReadSupplierGenerator **i_readSupplierGenerators) :
+    scheduler(i_nReadSuppliers)
 {
     nReadSuppliers = i_nReadSuppliers;
     readSupplierGenerators = i_readSupplierGenerators;  // We own the array and the generators.
@@ -275,20 +326,24 @@ MultiInputPairedReadSupplierGenerator::~MultiInputPairedReadSupplierGenerator()
     PairedReadSupplier *
 MultiInputPairedReadSupplierGenerator::generateNewPairedReadSupplier()
 {
-    PairedReadSupplier **readSuppliers = new PairedReadSupplier *[nReadSuppliers];
-    for (int i = 0; i < nReadSuppliers; ) {
-        readSuppliers[i] = readSupplierGenerators[i]->generateNewPairedReadSupplier();
-		if (NULL == readSuppliers[i]) {
-			nReadSuppliers--;
-		} else {
-			i++;
-		}
+    return new MultiInputPairedReadSupplier(this, nReadSuppliers);
+}
+
+    PairedReadSupplier *
+MultiInputPairedReadSupplierGenerator::generateSupplierForNextInput(int finishedInput, int *input)
+{
+    for (;;) {
+        *input = scheduler.nextInput(finishedInput);
+        if (-1 == *input) {
+            return NULL;
+        }
+
+        PairedReadSupplier *supplier = readSupplierGenerators[*input]->generateNewPairedReadSupplier();
+        if (NULL != supplier) {
+            return supplier;
+        }
+        finishedInput = *input;
     }
-	if (0 == nReadSuppliers) {
-		delete [] readSuppliers;
-		return NULL;
-	}
-    return new MultiInputPairedReadSupplier(nReadSuppliers,readSuppliers);
 }
 
     ReaderContext*
@@ -7,6 +7,7 @@ Module Name:
 Abstract:
 
     Headers for a read supplier that combines other read suppliers.  It's used when there are muliple input files to process.
+    The threads share the inputs out among themselves with a MultiInputScheduler.
 
 Authors:
 
@@ -25,36 +26,68 @@ Revision History:
 #include "Read.h"
 #include "Compat.h"
 
+//
+// Hands the inputs out to the aligner threads.  Each thread's supplier reads one input until it's out of reads, and then
+// asks for another, getting the one (of those with reads left) that the fewest threads are reading.  So with more inputs
+// than threads (say, two dozen lane level FASTQ files), the threads start out on different inputs and move on as they
+// finish them, rather than each thread setting up a supplier for every input and taking turns among them; and at the end,
+// the inputs that are left get all of the threads between them, since each input splits its ranges (or its queue) among
+// however many threads are reading it.
+//
+class MultiInputScheduler {
+public:
+    MultiInputScheduler(int i_nInputs);
+    ~MultiInputScheduler();
+
+    //
+    // The input for a thread to read next, given the one that it just found to be out of reads (-1 if none), or -1 if
+    // they're all out.
+    //
+    int nextInput(int finishedInput);
+
+private:
+    ExclusiveLock   lock;
+    int             nInputs;
+    int            *nReaders;      // How many threads are reading each input
+    bool           *finished;
+};
+
+class MultiInputReadSupplierGenerator;
+class MultiInputPairedReadSupplierGenerator;
+
 class MultiInputReadSupplier: public ReadSupplier {
 public:
-    MultiInputReadSupplier(int nReadSuppliers, ReadSupplier **i_readSuppliers);
+    MultiInputReadSupplier(MultiInputReadSupplierGenerator *i_generator, int i_nInputs);
     virtual ~MultiInputReadSupplier();
 
     virtual Read *getNextRead();
 
+    virtual int getNextReadBatch(Read **reads, int maxReads);
+
     virtual void holdBatch(DataBatch batch);
     virtual bool releaseBatch(DataBatch batch);
 
 private:
 
-    // info for a currently active supplier
-    struct ActiveRead
-    {
-        int         index; // index in readSuppliers array
-        DataBatch   lastBatch; // last batch read from this supplier
-        Read*       firstReadInNextBatch;
-    };
-
-    int                 nRemainingReadSuppliers;
-    int                 nReadSuppliers;
-    int                 nextReadSupplier;
-    ReadSupplier        **readSuppliers;
-    ActiveRead          *activeReadSuppliers;
+    bool moveToNextInput();     // False when there aren't any inputs left
+
+    //
+    // The batch IDs of the reads from input i have file IDs of i mod nInputs, so that holdBatch and releaseBatch can
+    // find their supplier.
+    //
+    void setBatch(Read *read) {
+        read->setBatch(DataBatch(read->getBatch().batchID, read->getBatch().fileID * nInputs + currentInput));
+    }
+
+    MultiInputReadSupplierGenerator *generator;
+    int                 nInputs;
+    int                 currentInput;       // -1 before the first one and after the last
+    ReadSupplier        **readSuppliers;    // One per input, NULL for those that this thread hasn't read.  They may hold data that's still in use, so they stay until we're deleted.
 };
 
 class MultiInputPairedReadSupplier: public PairedReadSupplier {
 public:
-    MultiInputPairedReadSupplier(int nReadSuppliers, PairedReadSupplier **i_pairedReadSuppliers);
+    MultiInputPairedReadSupplier(MultiInputPairedReadSupplierGenerator *i_generator, int i_nInputs);
     virtual ~MultiInputPairedReadSupplier();
 
     virtual bool getNextReadPair(Read **read0, Read **read1);
@@ -64,20 +97,17 @@ public:
     virtual bool releaseBatch(DataBatch batch);
 
 private:
-    
-    // info for a currently active supplier
-    struct ActiveRead
-    {
-        int         index; // index in readSuppliers array
-        DataBatch   lastBatch[2]; // last batch read from this supplier
-        Read*       firstReadInNextBatch[2];
-    };
-
-    int                 nRemainingReadSuppliers;
-    int                 nReadSuppliers;
-    int                 nextReadSupplier;
+
+    bool moveToNextInput();
+
+    void setBatch(Read *read) {
+        read->setBatch(DataBatch(read->getBatch().batchID, read->getBatch().fileID * nInputs + currentInput));
+    }
+
+    MultiInputPairedReadSupplierGenerator *generator;
+    int                 nInputs;
+    int                 currentInput;
     PairedReadSupplier  **pairedReadSuppliers;
-    ActiveRead          *activeReadSuppliers;
 };
 
 class MultiInputReadSupplierGenerator: public ReadSupplierGenerator
@@ -89,10 +119,17 @@ public:
     virtual ReadSupplier *generateNewReadSupplier();
     virtual ReaderContext* getContext();
 
+    //
+    // A supplier for the next input that a thread should read (see MultiInputScheduler), with the input's number in
+    // *input.  NULL when they're all out of reads.
+    //
+    ReadSupplier *generateSupplierForNextInput(int finishedInput, int *input);
+
 private:
 
     int nReadSuppliers;
     ReadSupplierGenerator **readSupplierGenerators;
+    MultiInputScheduler scheduler;
 };
 
 class MultiInputPairedReadSupplierGenerator: public PairedReadSupplierGenerator
@@ -104,8 +141,11 @@ public:
     virtual PairedReadSupplier *generateNewPairedReadSupplier();
     virtual ReaderContext* getContext();
 
+    PairedReadSupplier *generateSupplierForNextInput(int finishedInput, int *input);
+
 private:
 
     int nReadSuppliers;
     PairedReadSupplierGenerator **readSupplierGenerators;
+    MultiInputScheduler scheduler;
 };
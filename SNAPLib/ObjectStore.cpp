@@ -0,0 +1,180 @@
+/*++
+
+Module Name:
+
+    ObjectStore.cpp
+
+Abstract:
+
+    Reading objects from S3 and Google Cloud Storage.  See ObjectStore.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ObjectStore.h"
+#include "Error.h"
+
+using std::string;
+
+static const char *S3Prefix = "s3://";
+static const char *GcsPrefix = "gs://";
+
+bool IsObjectStoreUrl(const char *name)
+{
+    return 0 == strncmp(name, S3Prefix, strlen(S3Prefix)) || 0 == strncmp(name, GcsPrefix, strlen(GcsPrefix));
+}
+
+#ifdef SNAP_OBJECT_STORE
+
+//
+// Add an object key to a URL path, percent encoding everything but the characters that are safe in a path.  The
+// slashes in a key are left alone, since both stores treat them as just part of the name.
+//
+static void AppendEscapedKey(string *url, const char *key)
+{
+    static const char *hex = "0123456789ABCDEF";
+    for (const char *p = key; *p != '\0'; p++) {
+        unsigned char c = (unsigned char)*p;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+            url->push_back(c);
+        } else {
+            url->push_back('%');
+            url->push_back(hex[c >> 4]);
+            url->push_back(hex[c & 0xf]);
+        }
+    }
+}
+
+bool PrepareObjectStoreRequest(CURL *curl, const char *url, struct curl_slist **io_headers)
+{
+    static bool curlInitialized = (0 == curl_global_init(CURL_GLOBAL_DEFAULT));  // Once, and before any other thread can use curl
+    if (!curlInitialized) {
+        WriteErrorMessage("Unable to initialize libcurl\n");
+        return false;
+    }
+
+    bool isS3 = 0 == strncmp(url, S3Prefix, strlen(S3Prefix));
+    if (!isS3 && 0 != strncmp(url, GcsPrefix, strlen(GcsPrefix))) {
+        return false;
+    }
+
+    const char *bucket = url + strlen(isS3 ? S3Prefix : GcsPrefix);
+    const char *slash = strchr(bucket, '/');
+    if (NULL == slash || slash == bucket || '\0' == slash[1]) {
+        WriteErrorMessage("'%s' doesn't name an object; it should look like %sbucket/key\n", url, isS3 ? S3Prefix : GcsPrefix);
+        return false;
+    }
+
+    //
+    // Both get path style URLs (the bucket is the first part of the path rather than of the host name), which work
+    // for bucket names that have dots in them and for S3 compatible stores.
+    //
+    string https;
+    if (isS3) {
+        const char *region = getenv("AWS_REGION");
+        if (NULL == region) {
+            region = getenv("AWS_DEFAULT_REGION");
+        }
+        if (NULL == region) {
+            region = "us-east-1";
+        }
+
+        const char *endpoint = getenv("AWS_ENDPOINT_URL");
+        if (NULL != endpoint) {
+            https = endpoint;
+            while (!https.empty() && '/' == https[https.size() - 1]) {
+                https.erase(https.size() - 1);
+            }
+        } else {
+            https = string("https://s3.") + region + ".amazonaws.com";
+        }
+        https += "/";
+        https.append(bucket, slash - bucket);
+        https += "/";
+        AppendEscapedKey(&https, slash + 1);
+
+        const char *accessKeyId = getenv("AWS_ACCESS_KEY_ID");
+        const char *secretAccessKey = getenv("AWS_SECRET_ACCESS_KEY");
+        if (NULL != accessKeyId && NULL != secretAccessKey) {
+#if LIBCURL_VERSION_NUM >= 0x074b00
+            //
+            // libcurl does the SigV4 signing.  S3 wants the hash of the (empty) body as well.  curl copies the strings.
+            //
+            string sigv4 = string("aws:amz:") + region + ":s3";
+            curl_easy_setopt(curl, CURLOPT_AWS_SIGV4, sigv4.c_str());
+            string credentials = string(accessKeyId) + ":" + secretAccessKey;
+            curl_easy_setopt(curl, CURLOPT_USERPWD, credentials.c_str());
+            *io_headers = curl_slist_append(*io_headers, "x-amz-content-sha256: e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+
+            const char *sessionToken = getenv("AWS_SESSION_TOKEN");
+            if (NULL != sessionToken) {
+                *io_headers = curl_slist_append(*io_headers, (string("x-amz-security-token: ") + sessionToken).c_str());
+            }
+#else   // LIBCURL_VERSION_NUM
+            WriteErrorMessage("Signing S3 requests needs libcurl 7.75 or later.  Unset AWS_ACCESS_KEY_ID to read public objects.\n");
+            return false;
+#endif  // LIBCURL_VERSION_NUM
+        }
+    } else {
+        https = "https://storage.googleapis.com/";
+        https.append(bucket, slash - bucket);
+        https += "/";
+        AppendEscapedKey(&https, slash + 1);
+
+        const char *accessToken = getenv("GOOGLE_OAUTH_ACCESS_TOKEN");
+        if (NULL != accessToken) {
+            *io_headers = curl_slist_append(*io_headers, (string("Authorization: Bearer ") + accessToken).c_str());
+        }
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, https.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);     // Signals and threads don't mix
+    return true;
+}
+
+_int64 GetObjectStoreObjectSize(const char *url)
+{
+    CURL *curl = curl_easy_init();
+    if (NULL == curl) {
+        return -1;
+    }
+
+    struct curl_slist *headers = NULL;
+    _int64 size = -1;
+    if (PrepareObjectStoreRequest(curl, url, &headers)) {
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);    // HEAD
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+        CURLcode result = curl_easy_perform(curl);
+        long status = 0;
+        curl_off_t contentLength = -1;
+        if (CURLE_OK == result) {
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+            curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength);
+        }
+
+        if (CURLE_OK != result || 200 != status) {
+            WriteErrorMessage("Unable to get the size of '%s': %s, HTTP status %ld\n", url, curl_easy_strerror(result), status);
+        } else {
+            size = contentLength;
+        }
+    }
+
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+    return size;
+}
+
+#else   // SNAP_OBJECT_STORE
+
+_int64 GetObjectStoreObjectSize(const char *url)
+{
+    return -1;
+}
+
+#endif  // SNAP_OBJECT_STORE
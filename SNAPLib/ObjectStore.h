@@ -0,0 +1,49 @@
+/*++
+
+Module Name:
+
+    ObjectStore.h
+
+Abstract:
+
+    Objects in S3 (s3://bucket/key) and Google Cloud Storage (gs://bucket/key), which SNAP can read input from over
+    HTTPS with libcurl when it's built with SNAP_OBJECT_STORE (set LIBCURL_HOME in the Makefile).
+
+    Credentials come from the environment, the way the providers' own tools take them: AWS_ACCESS_KEY_ID,
+    AWS_SECRET_ACCESS_KEY and (for temporary credentials) AWS_SESSION_TOKEN for S3, with AWS_REGION or
+    AWS_DEFAULT_REGION, and AWS_ENDPOINT_URL for S3 compatible stores that aren't AWS; GOOGLE_OAUTH_ACCESS_TOKEN
+    (from "gcloud auth print-access-token", say) for GCS.  Without them, only public objects can be read.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+#ifdef SNAP_OBJECT_STORE
+#include <curl/curl.h>
+#endif // SNAP_OBJECT_STORE
+
+//
+// Whether a file name is an s3:// or gs:// URL.  This doesn't depend on SNAP_OBJECT_STORE, so that callers can
+// say why they can't read one.
+//
+bool IsObjectStoreUrl(const char *name);
+
+//
+// The size of an object, or -1 if it can't be found or read (or SNAP isn't built to read object stores).
+//
+_int64 GetObjectStoreObjectSize(const char *url);
+
+#ifdef SNAP_OBJECT_STORE
+//
+// Set up an easy handle to request the object: its HTTPS URL and whatever authentication it needs.  The headers the
+// request needs are added to *io_headers, which the caller can add its own to before setting CURLOPT_HTTPHEADER, and
+// frees with curl_slist_free_all once the request is done.  Returns false if url isn't an object store URL.
+//
+bool PrepareObjectStoreRequest(CURL *curl, const char *url, struct curl_slist **io_headers);
+#endif // SNAP_OBJECT_STORE
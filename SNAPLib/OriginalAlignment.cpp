@@ -0,0 +1,117 @@
+/*++
+
+Module Name:
+
+    OriginalAlignment.cpp
+
+Abstract:
+
+    Verifying and keeping the alignments that the input already has.  See OriginalAlignment.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "OriginalAlignment.h"
+#include "Read.h"
+#include "SAM.h"
+#include "Tables.h"
+#include "AlignerStats.h"
+
+    bool
+OriginalAlignmentVerifier::verifyRead(Read *read, GenomeLocation *o_location, Direction *o_direction, _uint8 *o_mapq) const
+{
+    unsigned flags = read->getOriginalSAMFlags();
+    unsigned mapq = read->getOriginalMAPQ();
+    GenomeLocation originalLocation = read->getOriginalAlignedLocation();
+    if ((flags & (SAM_UNMAPPED | SAM_SECONDARY | SAM_SUPPLEMENTARY)) != 0 || originalLocation == InvalidGenomeLocation ||
+        mapq == 255 || (int)mapq < minMAPQ || read->getDataLength() == 0) {
+        return false;
+    }
+
+    //
+    // The original location is of the first base that isn't soft clipped, in the reference's direction; find where
+    // the read's own (clipped) data would start.  The original clipping is kept in the read's direction, like the rest
+    // of it, so for RC it's the back clipping that's in front.
+    //
+    const char *data = read->getData();
+    unsigned length = read->getDataLength();
+    Direction direction = (flags & SAM_REVERSE_COMPLEMENT) ? RC : FORWARD;
+    GenomeLocation location;
+    if (FORWARD == direction) {
+        location = originalLocation - read->getOriginalFrontClipping() + read->getFrontClippedLength();
+    } else {
+        location = originalLocation - read->getOriginalBackClipping() + read->getBackClippedLength();
+    }
+
+    //
+    // Padding between contigs is 'n', so a read that runs off the end of its contig won't match.
+    //
+    const char *reference = genome->getSubstring(location, length);
+    if (NULL == reference) {
+        return false;
+    }
+
+    if (FORWARD == direction) {
+        if (memcmp(data, reference, length) != 0) {
+            return false;
+        }
+    } else {
+        for (unsigned i = 0; i < length; i++) {
+            if (reference[i] != COMPLEMENT[(unsigned char)data[length - 1 - i]]) {
+                return false;
+            }
+        }
+    }
+
+    *o_location = location;
+    *o_direction = direction;
+    *o_mapq = (_uint8)__min(mapq, AlignerStats::maxMapq);
+    return true;
+}
+
+    bool
+OriginalAlignmentVerifier::verify(Read *read, SingleAlignmentResult *result) const
+{
+    GenomeLocation location;
+    Direction direction;
+    _uint8 mapq;
+    if (! verifyRead(read, &location, &direction, &mapq)) {
+        return false;
+    }
+
+    result->location = location;
+    result->direction = direction;
+    result->mapq = mapq;
+    result->score = 0;
+    result->status = SingleHit;
+    return true;
+}
+
+    bool
+OriginalAlignmentVerifier::verifyPair(Read **reads, PairedAlignmentResult *result) const
+{
+    GenomeLocation location[NUM_READS_PER_PAIR];
+    Direction direction[NUM_READS_PER_PAIR];
+    _uint8 mapq[NUM_READS_PER_PAIR];
+    for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+        if ((reads[whichRead]->getOriginalSAMFlags() & SAM_ALL_ALIGNED) == 0 ||
+            ! verifyRead(reads[whichRead], &location[whichRead], &direction[whichRead], &mapq[whichRead])) {
+            return false;
+        }
+    }
+
+    for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+        result->location[whichRead] = location[whichRead];
+        result->direction[whichRead] = direction[whichRead];
+        result->mapq[whichRead] = mapq[whichRead];
+        result->score[whichRead] = 0;
+        result->status[whichRead] = SingleHit;
+    }
+    result->fromAlignTogether = true;
+    result->alignedAsPair = true;
+    return true;
+}
@@ -0,0 +1,49 @@
+/*++
+
+Module Name:
+
+    OriginalAlignment.h
+
+Abstract:
+
+    Keeping the alignments that SAM or BAM input already has (-reuse), when it was aligned to the same reference as the
+    index (ReaderContext::headerMatchesIndex).  Realigning such a file mostly reproduces what's there, so instead the
+    bases of each read are compared with the reference where the input says it aligned, and a read that matches exactly
+    there with at least -reuse's MAPQ keeps that alignment and MAPQ without being looked up in the index.  Everything
+    else (unmapped, secondary or supplementary records, low MAPQ, any mismatch, indel or clipping other than SNAP's own,
+    and pairs that aren't marked as properly paired) is aligned as usual.
+
+    Since the MAPQ comes from whatever made the input, this isn't quite the same as aligning the read, so it's off by
+    default, and it's not used when secondary alignments are asked for, which it can't supply.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Genome.h"
+#include "AlignmentResult.h"
+
+class Read;
+
+class OriginalAlignmentVerifier {
+public:
+    OriginalAlignmentVerifier(const Genome *i_genome, int i_minMAPQ) : genome(i_genome), minMAPQ(i_minMAPQ) {}
+
+    //
+    // Fill in result (with no secondary alignments) and return true if the read's original alignment holds up, or return
+    // false without touching it.  Safe to call from any number of threads.
+    //
+    bool verify(Read *read, SingleAlignmentResult *result) const;
+    bool verifyPair(Read **reads, PairedAlignmentResult *result) const;
+
+private:
+    bool verifyRead(Read *read, GenomeLocation *o_location, Direction *o_direction, _uint8 *o_mapq) const;
+
+    const Genome   *genome;
+    int             minMAPQ;
+};
@@ -0,0 +1,140 @@
+/*++
+
+Module Name:
+
+    PackedBases.cpp
+
+Abstract:
+
+    The 2 bit per base representation of sequences.  See PackedBases.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "PackedBases.h"
+
+static const unsigned char NotACGTCode = 4;
+
+static struct PackedBaseCodes {
+    PackedBaseCodes() {
+        for (int i = 0; i < 256; i++) {
+            codes[i] = NotACGTCode;
+        }
+        codes['A'] = 0;
+        codes['C'] = 1;
+        codes['G'] = 2;
+        codes['T'] = 3;
+    }
+
+    unsigned char codes[256];
+} BaseCodes;
+
+static inline _int64 BasesWords(_int64 nBases)
+{
+    return (nBases + 2 * PackedBases::Slack) / 32 + 2;  // The extra word is for reading 32 unaligned bases at the end
+}
+
+static inline _int64 NotACGTWords(_int64 nBases)
+{
+    return (nBases + 2 * PackedBases::Slack) / 64 + 2;
+}
+
+    size_t
+PackedBases::GetStorageSize(_int64 nBases)
+{
+    return (size_t)(BasesWords(nBases) + NotACGTWords(nBases)) * sizeof(_uint64);
+}
+
+    void
+PackedBases::init(void *storage, _int64 i_firstPosition, _int64 i_nBases)
+{
+    firstPosition = i_firstPosition;
+    nBases = i_nBases;
+    origin = Slack - firstPosition;
+    bases = (_uint64 *)storage;
+    notACGT = bases + BasesWords(nBases);
+
+    memset(bases, 0, BasesWords(nBases) * sizeof(_uint64));
+    memset(notACGT, 0xff, NotACGTWords(nBases) * sizeof(_uint64));
+}
+
+    void
+PackedBases::pack(_int64 position, const char *data, _int64 length)
+/*++
+
+Routine Description:
+
+    Fill in bases from their character representation.  It builds up a word's worth at a time and then merges it into
+    the words that are there, so the start and end don't need to be aligned.
+
+Arguments:
+
+    position    - the position of the first base to fill in
+    data        - the bases
+    length      - the number of bases
+
+--*/
+{
+    _ASSERT(position >= firstPosition - Slack && position + length <= firstPosition + nBases + Slack);
+
+    _int64 index = origin + position;
+
+    for (_int64 i = 0; i < length; ) {
+        unsigned firstField = (unsigned)((index + i) & 31);
+        unsigned nFields = (unsigned)__min((_int64)(32 - firstField), length - i);
+        _uint64 word = 0;
+        _uint64 fieldsMask = (nFields == 32 ? 0xffffffffffffffff : ((_uint64)1 << (2 * nFields)) - 1) << (2 * firstField);
+
+        for (unsigned j = 0; j < nFields; j++) {
+            word |= (_uint64)(BaseCodes.codes[(unsigned char)data[i + j]] & 3) << (2 * (firstField + j));
+        }
+
+        _uint64 *target = bases + ((index + i) >> 5);
+        *target = (*target & ~fieldsMask) | word;
+        i += nFields;
+    }
+
+    for (_int64 i = 0; i < length; ) {
+        unsigned firstBit = (unsigned)((index + i) & 63);
+        unsigned nBits = (unsigned)__min((_int64)(64 - firstBit), length - i);
+        _uint64 word = 0;
+        _uint64 bitsMask = (nBits == 64 ? 0xffffffffffffffff : ((_uint64)1 << nBits) - 1) << firstBit;
+
+        for (unsigned j = 0; j < nBits; j++) {
+            word |= (_uint64)(BaseCodes.codes[(unsigned char)data[i + j]] >> 2) << (firstBit + j);
+        }
+
+        _uint64 *target = notACGT + ((index + i) >> 6);
+        *target = (*target & ~bitsMask) | word;
+        i += nBits;
+    }
+}
+
+    void
+PackedBases::clear(_int64 position, _int64 length)
+{
+    _ASSERT(position >= firstPosition - Slack && position + length <= firstPosition + nBases + Slack);
+
+    for (_int64 index = origin + position; index < origin + position + length; index++) {
+        notACGT[index >> 6] |= (_uint64)1 << (index & 63);
+    }
+}
+
+    void
+PackedBases::unpack(_int64 position, _int64 length, char *buffer) const
+{
+    static const char baseChars[] = "ACGT";
+
+    for (_int64 i = 0; i < length; i++) {
+        _int64 index = origin + position + i;
+        if ((notACGT[index >> 6] >> (index & 63)) & 1) {
+            buffer[i] = 'N';
+        } else {
+            buffer[i] = baseChars[(bases[index >> 5] >> ((index & 31) * 2)) & 3];
+        }
+    }
+}
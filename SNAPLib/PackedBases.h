@@ -0,0 +1,184 @@
+/*++
+
+Module Name:
+
+    PackedBases.h
+
+Abstract:
+
+    A 2 bit per base representation of a sequence of bases, for comparing sequences 32 bases at a time.
+
+    Each base is stored as a 2 bit code (A=0, C=1, G=2, T=3), 32 to a 64 bit word with the first base in the low
+    order bits.  Anything else (N, the lower case n that's used for padding in the genome, or for that matter
+    any other character) is stored as a set bit in a separate one bit per base mask, and never matches anything,
+    including another N.  Positions are signed, so sequences can be read a little way on either side of the
+    part that's been filled in (the genome's padding, for instance), and everything that hasn't been filled in
+    is not-ACGT.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class PackedBases {
+public:
+    PackedBases() : bases(NULL), notACGT(NULL), origin(0), firstPosition(0), nBases(0) {}
+
+    //
+    // The number of bytes of storage needed for a sequence of nBases bases.  It includes Slack bases on either
+    // end, which may be read (but never match) when comparing near the ends.
+    //
+    static size_t GetStorageSize(_int64 nBases);
+
+    //
+    // Set up to hold positions firstPosition .. firstPosition + nBases - 1, using storage of the size from
+    // GetStorageSize (which must be 8 byte aligned, and which belongs to the caller).  Every position starts out not-ACGT.
+    //
+    void init(void *storage, _int64 i_firstPosition, _int64 i_nBases);
+
+    //
+    // Fill in length bases starting at position from the character representation.  Anything other than upper
+    // case A, C, G or T becomes not-ACGT.
+    //
+    void pack(_int64 position, const char *data, _int64 length);
+
+    //
+    // Fill in a sequence of length bases starting at position 0, and make the Slack bases after it not-ACGT, so
+    // whatever was there before (a longer read, say) can't match.
+    //
+    inline void set(const char *data, _int64 length) {
+        pack(0, data, length);
+        clear(length, Slack);
+    }
+
+    //
+    // Make length bases starting at position not-ACGT.  The positions may run Slack bases past the end.
+    //
+    void clear(_int64 position, _int64 length);
+
+    //
+    // The character representation of length bases starting at position.  Not-ACGT comes back as N.
+    //
+    void unpack(_int64 position, _int64 length, char *buffer) const;
+
+    //
+    // The number of bases past either end of a sequence that are allowed to be read.
+    //
+    static const _int64 Slack = 128;
+
+    //
+    // Prefetch the storage for the length bases starting at position.
+    //
+    inline void prefetch(_int64 position, _int64 length) const {
+        _int64 index = origin + position;
+        for (_int64 word = index >> 5; word < (index + length) >> 5; word += 8) {  // 8 words to a cache line
+            _mm_prefetch((const char *)(bases + word), _MM_HINT_T2);
+        }
+        _mm_prefetch((const char *)(bases + ((index + length) >> 5)), _MM_HINT_T2);
+
+        for (_int64 word = index >> 6; word < (index + length) >> 6; word += 8) {
+            _mm_prefetch((const char *)(notACGT + word), _MM_HINT_T2);
+        }
+        _mm_prefetch((const char *)(notACGT + ((index + length) >> 6)), _MM_HINT_T2);
+    }
+
+    //
+    // Are the bases at the given positions in two sequences the same (and ACGT)?
+    //
+    static inline bool BasesMatch(const PackedBases &a, _int64 aPosition, const PackedBases &b, _int64 bPosition) {
+        _int64 aIndex = a.origin + aPosition;
+        _int64 bIndex = b.origin + bPosition;
+
+        return 0 == ((a.notACGT[aIndex >> 6] >> (aIndex & 63)) & 1) && 0 == ((b.notACGT[bIndex >> 6] >> (bIndex & 63)) & 1) &&
+            ((a.bases[aIndex >> 5] >> ((aIndex & 31) * 2)) & 3) == ((b.bases[bIndex >> 5] >> ((bIndex & 31) * 2)) & 3);
+    }
+
+    //
+    // Count the bases that match going forward from aPosition and bPosition, stopping at the first mismatch
+    // or at maxBases.
+    //
+    static inline int CountMatchingBases(const PackedBases &a, _int64 aPosition, const PackedBases &b, _int64 bPosition, int maxBases) {
+        for (int matched = 0; matched < maxBases; matched += 32) {
+            _uint64 x = (a.get32Bases(aPosition + matched) ^ b.get32Bases(bPosition + matched)) |
+                a.get32NotACGT(aPosition + matched) | b.get32NotACGT(bPosition + matched);
+
+            if (x) {
+                unsigned long zeroes;
+                CountTrailingZeroes(x, zeroes);
+                return __min(matched + (int)(zeroes >> 1), maxBases);
+            }
+        }
+
+        return maxBases;
+    }
+
+    //
+    // The same, except that b runs backward from bPosition (the way the reverse Landau-Vishkin reads the genome).
+    //
+    static inline int CountMatchingBasesBackward(const PackedBases &a, _int64 aPosition, const PackedBases &b, _int64 bPosition, int maxBases) {
+        for (int matched = 0; matched < maxBases; matched += 32) {
+            _int64 bLowest = bPosition - matched - 31;
+            _uint64 x = (a.get32Bases(aPosition + matched) ^ ReverseBases(b.get32Bases(bLowest))) |
+                a.get32NotACGT(aPosition + matched) | ReverseBases(b.get32NotACGT(bLowest));
+
+            if (x) {
+                unsigned long zeroes;
+                CountTrailingZeroes(x, zeroes);
+                return __min(matched + (int)(zeroes >> 1), maxBases);
+            }
+        }
+
+        return maxBases;
+    }
+
+private:
+
+    //
+    // The 32 bases starting at position, the first in the low order bits.
+    //
+    inline _uint64 get32Bases(_int64 position) const {
+        _int64 index = origin + position;
+        unsigned shift = (unsigned)(index & 31) * 2;
+        const _uint64 *word = bases + (index >> 5);
+
+        return (word[0] >> shift) | ((word[1] << (63 - shift)) << 1);   // Split in two so a shift of 0 doesn't shift by 64
+    }
+
+    //
+    // The not-ACGT bits for the 32 bases starting at position, spread out to two bits per base to line up with get32Bases.
+    //
+    inline _uint64 get32NotACGT(_int64 position) const {
+        _int64 index = origin + position;
+        unsigned shift = (unsigned)(index & 63);
+        const _uint64 *word = notACGT + (index >> 6);
+
+        _uint64 x = ((word[0] >> shift) | ((word[1] << (63 - shift)) << 1)) & 0xffffffff;
+        x = (x | (x << 16)) & 0x0000ffff0000ffff;
+        x = (x | (x << 8))  & 0x00ff00ff00ff00ff;
+        x = (x | (x << 4))  & 0x0f0f0f0f0f0f0f0f;
+        x = (x | (x << 2))  & 0x3333333333333333;
+        x = (x | (x << 1))  & 0x5555555555555555;
+
+        return x | (x << 1);
+    }
+
+    //
+    // Reverse the order of the 2 bit fields in a word.
+    //
+    static inline _uint64 ReverseBases(_uint64 x) {
+        x = ByteSwapUI64(x);
+        x = ((x >> 4) & 0x0f0f0f0f0f0f0f0f) | ((x & 0x0f0f0f0f0f0f0f0f) << 4);
+        return ((x >> 2) & 0x3333333333333333) | ((x & 0x3333333333333333) << 2);
+    }
+
+    _uint64    *bases;
+    _uint64    *notACGT;
+    _int64      origin;         // The index in bases/notACGT of position 0
+    _int64      firstPosition;
+    _int64      nBases;
+};
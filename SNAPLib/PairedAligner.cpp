@@ -43,8 +43,15 @@ Revision History:
 #include "FASTQ.h"
 #include "PairedAligner.h"
 #include "MultiInputReadSupplier.h"
+#include "LookaheadReadSupplier.h"
 #include "Util.h"
 #include "IntersectingPairedEndAligner.h"
+#include "InsertSizeDistribution.h"
+#include "KmerFilter.h"
+#include "UmiConsensus.h"
+#include "PipelineTrace.h"
+#include "MateMerger.h"
+#include "SplitReadAligner.h"
 #include "exit.h"
 #include "Error.h"
 
@@ -62,6 +69,12 @@ struct PairedAlignerStats : public AlignerStats
     static const int MAX_SCORE = 15;
 
     _int64 sameComplement;
+    _int64 singleEndFallbacks;          // Pairs that ChimericPairedEndAligner had to rescue or align singly
+    _int64 nanosInSingleEndFallbacks;
+    _int64 seedLookupsReused;           // Seed lookups the single-end aligner got from the intersecting aligner
+    _int64 mateSeedLookupsShared;       // Read 1 seed lookups that the intersecting aligner took from read 0 (-mateSeeds)
+    _int64 matesMerged;                 // Pairs aligned as one read (-mergeMates)
+    _int64 readsSplit;                  // Reads aligned in pieces (-splitReads)
     _int64* distanceCounts; // histogram of distances
     // TODO: could save a bit of memory & time since this is a triangular matrix
     _int64* scoreCounts; // 2-d histogram of scores for paired ends
@@ -137,6 +150,13 @@ struct PairedAlignerStats : public AlignerStats
     virtual void add(const AbstractStats * other);
 
     virtual void printHistograms(FILE* output);
+
+    virtual bool save(FILE* file);
+
+    virtual bool load(FILE* file);
+
+private:
+    bool saveOrLoadPaired(FILE* file, bool saving);
 };
 
 const int PairedAlignerStats::MAX_DISTANCE;
@@ -144,7 +164,13 @@ const int PairedAlignerStats::MAX_SCORE;
 
 PairedAlignerStats::PairedAlignerStats(AbstractStats* i_extra)
     : AlignerStats(i_extra),
-    sameComplement(0)
+    sameComplement(0),
+    singleEndFallbacks(0),
+    nanosInSingleEndFallbacks(0),
+    seedLookupsReused(0),
+    mateSeedLookupsShared(0),
+    matesMerged(0),
+    readsSplit(0)
 {
     int dsize = sizeof(_int64) * (MAX_DISTANCE+1);
     distanceCounts = (_int64*)BigAlloc(dsize);
@@ -188,6 +214,12 @@ void PairedAlignerStats::add(const AbstractStats * i_other)
 {
     AlignerStats::add(i_other);
     PairedAlignerStats* other = (PairedAlignerStats*) i_other;
+    singleEndFallbacks += other->singleEndFallbacks;
+    nanosInSingleEndFallbacks += other->nanosInSingleEndFallbacks;
+    seedLookupsReused += other->seedLookupsReused;
+    mateSeedLookupsShared += other->mateSeedLookupsShared;
+    matesMerged += other->matesMerged;
+    readsSplit += other->readsSplit;
     for (int i = 0; i < MAX_DISTANCE + 1; i++) {
         distanceCounts[i] += other->distanceCounts[i];
     }
@@ -219,8 +251,69 @@ void PairedAlignerStats::add(const AbstractStats * i_other)
 
 }
 
+bool PairedAlignerStats::saveOrLoadPaired(FILE* file, bool saving)
+{
+    return SaveOrLoad(file, saving, &sameComplement, sizeof(sameComplement)) &&
+        SaveOrLoad(file, saving, &singleEndFallbacks, sizeof(singleEndFallbacks)) &&
+        SaveOrLoad(file, saving, &nanosInSingleEndFallbacks, sizeof(nanosInSingleEndFallbacks)) &&
+        SaveOrLoad(file, saving, &seedLookupsReused, sizeof(seedLookupsReused)) &&
+        SaveOrLoad(file, saving, &mateSeedLookupsShared, sizeof(mateSeedLookupsShared)) &&
+        SaveOrLoad(file, saving, &matesMerged, sizeof(matesMerged)) &&
+        SaveOrLoad(file, saving, &readsSplit, sizeof(readsSplit)) &&
+        SaveOrLoad(file, saving, distanceCounts, sizeof(_int64) * (MAX_DISTANCE + 1)) &&
+        SaveOrLoad(file, saving, scoreCounts, sizeof(_int64) * (MAX_SCORE + 1) * (MAX_SCORE + 1)) &&
+        SaveOrLoad(file, saving, alignTogetherByMapqHistogram, sizeof(alignTogetherByMapqHistogram)) &&
+        SaveOrLoad(file, saving, totalTimeByMapqHistogram, sizeof(totalTimeByMapqHistogram)) &&
+        SaveOrLoad(file, saving, nSmallHitsByTimeHistogram, sizeof(nSmallHitsByTimeHistogram)) &&
+        SaveOrLoad(file, saving, nLVCallsByTimeHistogram, sizeof(nLVCallsByTimeHistogram)) &&
+        SaveOrLoad(file, saving, mapqByNLVCallsHistogram, sizeof(mapqByNLVCallsHistogram)) &&
+        SaveOrLoad(file, saving, mapqByNSmallHitsHistogram, sizeof(mapqByNSmallHitsHistogram));
+}
+
+bool PairedAlignerStats::save(FILE* file)
+{
+    return AlignerStats::save(file) && saveOrLoadPaired(file, true);
+}
+
+bool PairedAlignerStats::load(FILE* file)
+{
+    return AlignerStats::load(file) && saveOrLoadPaired(file, false);
+}
+
+extern char *FormatUIntWithCommas(_uint64 val, char *outputBuffer, size_t outputBufferSize);   // As in AlignerContext.cpp, not the one in Util.h
+
 void PairedAlignerStats::printHistograms(FILE* output)
 {
+    if (singleEndFallbacks > 0) {
+        const size_t strBufLen = 50;
+        char fallbacks[strBufLen];
+        char reused[strBufLen];
+        WriteStatusMessage("%s pairs (%0.2f%%) weren't paired by the intersecting aligner; rescuing or aligning them singly took %0.2fs and reused %s seed lookups\n",
+            FormatUIntWithCommas(singleEndFallbacks, fallbacks, strBufLen), 100.0 * singleEndFallbacks * NUM_READS_PER_PAIR / max(totalReads, (_int64)1),
+            nanosInSingleEndFallbacks / 1e9, FormatUIntWithCommas(seedLookupsReused, reused, strBufLen));
+    }
+
+    if (mateSeedLookupsShared > 0) {
+        const size_t strBufLen = 50;
+        char shared[strBufLen];
+        WriteStatusMessage("%s seed lookups (%0.2f per pair) were shared between overlapping mates\n",
+            FormatUIntWithCommas(mateSeedLookupsShared, shared, strBufLen), (double)mateSeedLookupsShared * NUM_READS_PER_PAIR / max(totalReads, (_int64)1));
+    }
+
+    if (matesMerged > 0) {
+        const size_t strBufLen = 50;
+        char merged[strBufLen];
+        WriteStatusMessage("%s pairs (%0.2f%%) overlapped and were aligned as one read\n",
+            FormatUIntWithCommas(matesMerged, merged, strBufLen), 100.0 * matesMerged * NUM_READS_PER_PAIR / max(totalReads, (_int64)1));
+    }
+
+    if (readsSplit > 0) {
+        const size_t strBufLen = 50;
+        char split[strBufLen];
+        WriteStatusMessage("%s reads (%0.2f%%) didn't align whole and were aligned in pieces, with supplementary records\n",
+            FormatUIntWithCommas(readsSplit, split, strBufLen), 100.0 * readsSplit / max(totalReads, (_int64)1));
+    }
+
     AlignerStats::printHistograms(output);
 }
 
@@ -231,7 +324,11 @@ PairedAlignerOptions::PairedAlignerOptions(const char* i_commandLine)
     forceSpacing(false),
     intersectingAlignerMaxHits(DEFAULT_INTERSECTING_ALIGNER_MAX_HITS),
     maxCandidatePoolSize(DEFAULT_MAX_CANDIDATE_POOL_SIZE),
-    quicklyDropUnpairedReads(true)
+    quicklyDropUnpairedReads(true),
+    insertSizeSamples(0),
+    shareMateSeeds(false),
+    mergeMates(false),
+    splitReads(false)
 {
 }
 
@@ -243,6 +340,18 @@ void PairedAlignerOptions::usageMessage()
         "  -s   min and max spacing to allow between paired ends (default: %d %d).\n"
         "  -fs  force spacing to lie between min and max.\n"
         "  -H   max hits for intersecting aligner (default: %d).\n"
+        "  -ins fit the insert size distribution to this many confidently aligned pairs (per thread) and then\n"
+        "       search only the part of the -s window that holds 99.9%% of them, preferring typical spacings\n"
+        "       when choosing between pairs.  Default: 0, which always searches the whole -s window\n"
+        "  -mateSeeds  where the two mates overlap (short fragments), reuse the first read's seed lookups for the second\n"
+        "       rather than looking the same sequence up again.  This changes which seeds the second read uses.\n"
+        "  -mergeMates  align pairs whose mates overlap (short fragments) as one read made by merging them, using the\n"
+        "       better base by quality where they disagree, and then split the alignment back into one for each mate.\n"
+        "       Not used with secondary alignments.\n"
+        "  -splitReads  when a read doesn't align whole, even on its own, look for two or three pieces of it that do (as\n"
+        "       at a structural variant's breakpoint, or in a chimeric read).  The best is written as its alignment,\n"
+        "       soft clipped, and the others as supplementary (0x800) records, each with an SA tag listing the rest.\n"
+        "       Not used with -dupCache or -otherIndex.\n"
         "  -mcp specifies the maximum candidate pool size (An internal data structure. \n"
         "       Only increase this if you get an error message saying to do so. If you're running\n"
         "       out of memory, you may want to reduce it.  Default: %d)\n"
@@ -279,6 +388,22 @@ bool PairedAlignerOptions::parse(const char** argv, int argc, int& n, bool *done
             return true;
         } 
         return false;
+    } else if (strcmp(argv[n], "-ins") == 0) {
+        if (n + 1 < argc) {
+            insertSizeSamples = atoi(argv[n+1]);
+            n += 1;
+            return true;
+        }
+        return false;
+    } else if (strcmp(argv[n], "-mateSeeds") == 0) {
+        shareMateSeeds = true;
+        return true;
+    } else if (strcmp(argv[n], "-mergeMates") == 0) {
+        mergeMates = true;
+        return true;
+    } else if (strcmp(argv[n], "-splitReads") == 0) {
+        splitReads = true;
+        return true;
     } else if (strcmp(argv[n], "-fs") == 0) {
         forceSpacing = true;
         return true;    
@@ -316,6 +441,18 @@ bool PairedAlignerContext::initialize()
     intersectingAlignerMaxHits = options2->intersectingAlignerMaxHits;
     ignoreMismatchedIDs = options2->ignoreMismatchedIDs;
     quicklyDropUnpairedReads = options2->quicklyDropUnpairedReads;
+    insertSizeSamples = options2->insertSizeSamples;
+    shareMateSeeds = options2->shareMateSeeds;
+    mergeMates = options2->mergeMates;
+    if (mergeMates && maxSecondaryAlignmentAdditionalEditDistance >= 0) {
+        WriteErrorMessage("Warning: -mergeMates doesn't work with secondary alignments, so no mates will be merged\n");
+        mergeMates = false;
+    }
+    splitReads = options2->splitReads;
+    if (splitReads && (0 != options->dupCacheSize || 0 != options->nOtherIndices)) {
+        WriteErrorMessage("Warning: -splitReads doesn't work with -dupCache or -otherIndex, so no reads will be split\n");
+        splitReads = false;
+    }
     noUkkonen = options->noUkkonen;
     noOrderedEvaluation = options->noOrderedEvaluation;
 
@@ -352,6 +489,18 @@ void PairedAlignerContext::runIterationThread()
 		return;
 	}
 
+    if (options->inputOrder) {
+        supplier->setInputUnitListener(this);
+    }
+
+    //
+    // (not for -inputOrder, since the lookahead would take the reads of the next unit before the writers had finished this one)
+    //
+    unsigned readLookahead = options->inputOrder ? 0 : 0 == options->readLookahead && options->outOfCoreIndex ? DEFAULT_OUT_OF_CORE_LOOKAHEAD : options->readLookahead;
+    if (NULL != index && 0 != readLookahead) {
+        supplier = new LookaheadPairedReadSupplier(supplier, index, readLookahead);
+    }
+
     Read *reads[NUM_READS_PER_PAIR];
     int nSingleResults[2] = { 0, 0 };
 
@@ -392,12 +541,61 @@ void PairedAlignerContext::runIterationThread()
         return;
     }
 
+    if (options->kmerFilterSeeds > 0) {
+        //
+        // Just look up a few seeds of each mate, see KmerFilter.h.  Each mate gets its own result, and -F b decides
+        // whether it takes one or both of them to keep the pair, as usual.
+        //
+        KmerFilter kmerFilter(index, options->kmerFilterSeeds, options->kmerFilterHits);
+        PairedAlignmentResult result;
+        memset(&result, 0, sizeof(result));
+        result.location[0] = result.location[1] = InvalidGenomeLocation;
+
+        while (supplier->getNextReadPair(&reads[0], &reads[1])) {
+            if (!ignoreMismatchedIDs) {
+                Read::checkIdMatch(reads[0], reads[1]);
+            }
+            stats->totalReads += 2;
+
+            bool tooShort[NUM_READS_PER_PAIR];
+            AlignmentResult status[NUM_READS_PER_PAIR];
+            bool passes[NUM_READS_PER_PAIR];
+            for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+                tooShort[whichRead] = reads[whichRead]->getDataLength() < minReadLength || reads[whichRead]->countOfNs() > maxDist;
+                status[whichRead] = !tooShort[whichRead] && kmerFilter.matches(reads[whichRead]) ? MultipleHits : NotFound;
+                passes[whichRead] = options->passFilter(reads[whichRead], status[whichRead], tooShort[whichRead], false);
+            }
+            bool pass = (options->filterFlags & AlignerOptions::FilterBothMatesMatch)
+                ? (passes[0] && passes[1]) : (passes[0] || passes[1]);
+
+            if (pass) {
+                for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+                    if (tooShort[whichRead]) {
+                        stats->uselessReads++;
+                    } else if (MultipleHits == status[whichRead]) {
+                        stats->multiHits++;
+                    } else {
+                        stats->notFound++;
+                    }
+                }
+                if (NULL != readWriter) {
+                    result.status[0] = result.status[1] = NotFound;     // There's no location to write
+                    readWriter->writePairs(readerContext, reads, &result, 1, NULL, nSingleResults, true);
+                }
+            } else {
+                stats->filtered += 2;
+            }
+        }
+        delete supplier;
+        return;
+    }
+
     int maxReadSize = MAX_READ_LENGTH;
-    size_t memoryPoolSize = IntersectingPairedEndAligner::getBigAllocatorReservation(index, intersectingAlignerMaxHits, maxReadSize, index->getSeedLength(), 
+    size_t intersectingReservation = IntersectingPairedEndAligner::getBigAllocatorReservation(index, intersectingAlignerMaxHits, maxReadSize, index->getSeedLength(), 
                                                                 numSeedsFromCommandLine, seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize,
                                                                 maxSecondaryAlignmentsPerContig);
 
-    memoryPoolSize += ChimericPairedEndAligner::getBigAllocatorReservation(index, maxReadSize, maxHits, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxDist,
+    size_t chimericReservation = ChimericPairedEndAligner::getBigAllocatorReservation(index, maxReadSize, maxHits, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxDist,
         extraSearchDepth, maxCandidatePoolSize, maxSecondaryAlignmentsPerContig);
 
     unsigned maxPairedSecondaryHits;
@@ -409,16 +607,60 @@ void PairedAlignerContext::runIterationThread()
     } else {
         maxPairedSecondaryHits = IntersectingPairedEndAligner::getMaxSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength(), minSpacing, maxSpacing);
         maxSingleSecondaryHits = ChimericPairedEndAligner::getMaxSingleEndSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength());
+        for (int i = 0; i < nOtherIndices; i++) {
+            int otherSeedLength = otherIndices[i]->getSeedLength();
+            maxPairedSecondaryHits = __max(maxPairedSecondaryHits, IntersectingPairedEndAligner::getMaxSecondaryResults(numSeedsFromCommandLine, seedCoverage,
+                maxReadSize, maxHits, otherSeedLength, minSpacing, maxSpacing));
+            maxSingleSecondaryHits = __max(maxSingleSecondaryHits, ChimericPairedEndAligner::getMaxSingleEndSecondaryResults(numSeedsFromCommandLine, seedCoverage,
+                maxReadSize, maxHits, otherSeedLength));
+        }
+        if (maxSecondaryAlignmentsPerContig <= 0) {
+            //
+            // The aligners keep only the best -omax of them (for each end, in the single-end case).
+            //
+            maxPairedSecondaryHits = __min(maxPairedSecondaryHits, (unsigned)maxSecondaryAlignments);
+            maxSingleSecondaryHits = __min(maxSingleSecondaryHits, (unsigned)maxSecondaryAlignments * NUM_READS_PER_PAIR);
+        }
     }
 
-    memoryPoolSize += (1 + maxPairedSecondaryHits) * sizeof(PairedAlignmentResult) + maxSingleSecondaryHits * sizeof(SingleAlignmentResult);
+    size_t resultsReservation = (1 + maxPairedSecondaryHits) * sizeof(PairedAlignmentResult) + maxSingleSecondaryHits * sizeof(SingleAlignmentResult);
+
+    //
+    // With an index that has long seed tables (index -longSeedSize), pairs whose reads are both at least -lsr bases get
+    // aligners of their own that use them.  Longer seeds mean fewer of them per read, so the result buffers are big
+    // enough for both.
+    //
+    GenomeIndex *longSeedIndex = index->getLongSeedIndex();
+    size_t longSeedReservation = 0;
+    if (NULL != longSeedIndex) {
+        longSeedReservation =
+            IntersectingPairedEndAligner::getBigAllocatorReservation(longSeedIndex, intersectingAlignerMaxHits, maxReadSize, longSeedIndex->getSeedLength(),
+                numSeedsFromCommandLine, seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize, maxSecondaryAlignmentsPerContig) +
+            ChimericPairedEndAligner::getBigAllocatorReservation(longSeedIndex, maxReadSize, maxHits, longSeedIndex->getSeedLength(), numSeedsFromCommandLine,
+                seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize, maxSecondaryAlignmentsPerContig);
+    }
+
+    //
+    // With -otherIndex, each pair is aligned against the other indices too, each with aligners and results of its own.
+    //
+    size_t otherIndexReservation = 0;
+    for (int i = 0; i < nOtherIndices; i++) {
+        otherIndexReservation += resultsReservation +
+            IntersectingPairedEndAligner::getBigAllocatorReservation(otherIndices[i], intersectingAlignerMaxHits, maxReadSize, otherIndices[i]->getSeedLength(),
+                numSeedsFromCommandLine, seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize, maxSecondaryAlignmentsPerContig) +
+            ChimericPairedEndAligner::getBigAllocatorReservation(otherIndices[i], maxReadSize, maxHits, otherIndices[i]->getSeedLength(), numSeedsFromCommandLine,
+                seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize, maxSecondaryAlignmentsPerContig);
+    }
 
-    BigAllocator *allocator = new BigAllocator(memoryPoolSize);
+    BigAllocator *allocator = new BigAllocator(intersectingReservation + chimericReservation + resultsReservation + longSeedReservation + otherIndexReservation);
+    size_t allocatorUsed[6];
+    allocatorUsed[0] = allocator->getMemoryUsed();
     
     IntersectingPairedEndAligner *intersectingAligner = new (allocator) IntersectingPairedEndAligner(index, maxReadSize, maxHits, maxDist, numSeedsFromCommandLine, 
                                                                 seedCoverage, minSpacing, maxSpacing, intersectingAlignerMaxHits, extraSearchDepth, 
                                                                 maxCandidatePoolSize, maxSecondaryAlignmentsPerContig ,allocator, noUkkonen, noOrderedEvaluation, noTruncation);
-
+    intersectingAligner->setShareMateSeeds(shareMateSeeds);
+    allocatorUsed[1] = allocator->getMemoryUsed();
 
     ChimericPairedEndAligner *aligner = new (allocator) ChimericPairedEndAligner(
         index,
@@ -429,6 +671,8 @@ void PairedAlignerContext::runIterationThread()
         seedCoverage,
 		minWeightToCheck,
         forceSpacing,
+        minSpacing,
+        maxSpacing,
         extraSearchDepth,
         noUkkonen,
         noOrderedEvaluation,
@@ -437,14 +681,86 @@ void PairedAlignerContext::runIterationThread()
 		minReadLength,
         maxSecondaryAlignmentsPerContig,
         allocator);
+    allocatorUsed[2] = allocator->getMemoryUsed();
+    aligner->setWorkBudget(options->workBudget);
+    aligner->setMinSeedQuality(options->minSeedQuality);
+    aligner->setMaxSeedsWithoutHits(options->maxSeedsWithoutHits);
+    aligner->setMaxDistFraction(options->maxDistFraction);
+
+    IntersectingPairedEndAligner *longSeedIntersectingAligner = NULL;
+    ChimericPairedEndAligner *longSeedAligner = NULL;
+    if (NULL != longSeedIndex) {
+        longSeedIntersectingAligner = new (allocator) IntersectingPairedEndAligner(longSeedIndex, maxReadSize, maxHits, maxDist, numSeedsFromCommandLine,
+                                                                seedCoverage, minSpacing, maxSpacing, intersectingAlignerMaxHits, extraSearchDepth,
+                                                                maxCandidatePoolSize, maxSecondaryAlignmentsPerContig, allocator, noUkkonen, noOrderedEvaluation, noTruncation);
+        longSeedIntersectingAligner->setShareMateSeeds(shareMateSeeds);
+        longSeedAligner = new (allocator) ChimericPairedEndAligner(longSeedIndex, maxReadSize, maxHits, maxDist, numSeedsFromCommandLine, seedCoverage,
+                                                                minWeightToCheck, forceSpacing, minSpacing, maxSpacing, extraSearchDepth, noUkkonen,
+                                                                noOrderedEvaluation, noTruncation, longSeedIntersectingAligner, minReadLength,
+                                                                maxSecondaryAlignmentsPerContig, allocator);
+        longSeedAligner->setWorkBudget(options->workBudget);
+        longSeedAligner->setMinSeedQuality(options->minSeedQuality);
+        longSeedAligner->setMaxSeedsWithoutHits(options->maxSeedsWithoutHits);
+        longSeedAligner->setMaxDistFraction(options->maxDistFraction);
+    }
+    allocatorUsed[3] = allocator->getMemoryUsed();
 
     allocator->checkCanaries();
 
     PairedAlignmentResult *results = (PairedAlignmentResult *)allocator->allocate((1 + maxPairedSecondaryHits) * sizeof(*results)); // 1 + is for the primary result
     SingleAlignmentResult *singleSecondaryResults = (SingleAlignmentResult *)allocator->allocate(maxSingleSecondaryHits * sizeof(*singleSecondaryResults));
+    allocatorUsed[4] = allocator->getMemoryUsed();
+
+    IntersectingPairedEndAligner *otherIntersectingAligners[MAX_OTHER_INDICES];
+    ChimericPairedEndAligner *otherAligners[MAX_OTHER_INDICES];
+    PairedAlignmentResult *otherResults[MAX_OTHER_INDICES];
+    SingleAlignmentResult *otherSingleSecondaryResults[MAX_OTHER_INDICES];
+    for (int i = 0; i < nOtherIndices; i++) {
+        otherIntersectingAligners[i] = new (allocator) IntersectingPairedEndAligner(otherIndices[i], maxReadSize, maxHits, maxDist, numSeedsFromCommandLine,
+                                                                seedCoverage, minSpacing, maxSpacing, intersectingAlignerMaxHits, extraSearchDepth,
+                                                                maxCandidatePoolSize, maxSecondaryAlignmentsPerContig, allocator, noUkkonen, noOrderedEvaluation, noTruncation);
+        otherIntersectingAligners[i]->setShareMateSeeds(shareMateSeeds);
+        otherAligners[i] = new (allocator) ChimericPairedEndAligner(otherIndices[i], maxReadSize, maxHits, maxDist, numSeedsFromCommandLine, seedCoverage,
+                                                                minWeightToCheck, forceSpacing, minSpacing, maxSpacing, extraSearchDepth, noUkkonen,
+                                                                noOrderedEvaluation, noTruncation, otherIntersectingAligners[i], minReadLength,
+                                                                maxSecondaryAlignmentsPerContig, allocator);
+        otherAligners[i]->setWorkBudget(options->workBudget);
+        otherAligners[i]->setMinSeedQuality(options->minSeedQuality);
+        otherAligners[i]->setMaxSeedsWithoutHits(options->maxSeedsWithoutHits);
+        otherAligners[i]->setMaxDistFraction(options->maxDistFraction);
+        otherResults[i] = (PairedAlignmentResult *)allocator->allocate((1 + maxPairedSecondaryHits) * sizeof(*results));
+        otherSingleSecondaryResults[i] = (SingleAlignmentResult *)allocator->allocate(maxSingleSecondaryHits * sizeof(*singleSecondaryResults));
+    }
+    allocatorUsed[5] = allocator->getMemoryUsed();
+
+    if (options->memoryReport) {
+        const char *componentNames[] = {"Intersecting", "Chimeric & single", "Results", "Long seed aligners", "Other index aligners"};
+        size_t reserved[] = {intersectingReservation, chimericReservation, resultsReservation, longSeedReservation, otherIndexReservation};
+        size_t used[] = {allocatorUsed[1] - allocatorUsed[0], allocatorUsed[2] - allocatorUsed[1], allocatorUsed[4] - allocatorUsed[3], allocatorUsed[3] - allocatorUsed[2],
+            allocatorUsed[5] - allocatorUsed[4]};
+        ReportBigAllocatorUse(0 != nOtherIndices ? 5 : NULL == longSeedAligner ? 3 : 4, componentNames, reserved, used, options->numThreads);
+    }
 
     ReadWriter *readWriter = this->readWriter;
 
+    InsertSizeDistribution *insertSizeDistribution = NULL;
+    if (insertSizeSamples > 0) {
+        insertSizeDistribution = new InsertSizeDistribution(insertSizeSamples, minSpacing, maxSpacing);
+    }
+
+    MateMerger *mateMerger = mergeMates ? new MateMerger(index->getGenome(), maxReadSize, maxDist) : NULL;
+
+    SplitReadAligner *splitReadAligner = NULL;
+    SplitReadAligner *longSeedSplitReadAligner = NULL;
+    if (splitReads) {
+        splitReadAligner = new SplitReadAligner(index, maxReadSize, maxDist);
+        aligner->setSplitReadAligner(splitReadAligner);
+        if (NULL != longSeedAligner) {
+            longSeedSplitReadAligner = new SplitReadAligner(longSeedIndex, maxReadSize, maxDist);
+            longSeedAligner->setSplitReadAligner(longSeedSplitReadAligner);
+        }
+    }
+
 #ifdef  _MSC_VER
     if (options->useTimingBarrier) {
         if (0 == InterlockedDecrementAndReturnNewValue(nThreadsAllocatingMemory)) {
@@ -459,13 +775,37 @@ void PairedAlignerContext::runIterationThread()
     _uint64 lastReportTime = timeInMillis();
     _uint64 readsWhenLastReported = 0;
 
-    while (supplier->getNextReadPair(&reads[0], &reads[1])) {
+    AlignerThreadProgress *threadProgress = NULL == progress ? NULL : progress->getThreadProgress(threadNum);
+    if (NULL != threadProgress) {
+        threadProgress->begin();
+    }
+    SlowReadTracker *slowReadTracker = NULL == slowReads ? NULL : slowReads->getThreadTracker(threadNum);
+
+    PipelineTraceSpan alignSpan(AlignTraceEvent);
+    for (;;) {
+        alignSpan.end();
+        if (NULL != threadProgress) {
+            threadProgress->waiting();
+        }
+        bool gotPair = supplier->getNextReadPair(&reads[0], &reads[1]);
+        if (NULL != threadProgress) {
+            threadProgress->working();
+        }
+        if (!gotPair) {
+            break;
+        }
+        alignSpan.begin();
+
         // Check that the two IDs form a pair; they will usually be foo/1 and foo/2 for some foo.
         if (!ignoreMismatchedIDs) {
             Read::checkIdMatch(reads[0], reads[1]);
         }
 
         stats->totalReads += 2;
+        if (NULL != threadProgress) {
+            threadProgress->reads += 2;
+            threadProgress->bases += reads[0]->getDataLength() + reads[1]->getDataLength();
+        }
 
         if (AlignerOptions::useHadoopErrorMessages && stats->totalReads % 10000 == 0 && timeInMillis() - lastReportTime > 10000) {
             fprintf(stderr, "reporter:counter:SNAP,readsAligned,%lu\n", stats->totalReads - readsWhenLastReported);
@@ -513,8 +853,104 @@ void PairedAlignerContext::runIterationThread()
         int nSecondaryResults;
         int nSingleSecondaryResults[2];
 
-        aligner->align(reads[0], reads[1], results, maxSecondaryAlignmentAdditionalEditDistance, maxPairedSecondaryHits, &nSecondaryResults, results + 1,
-            maxSingleSecondaryHits, maxSecondaryAlignments, &nSingleSecondaryResults[0], &nSingleSecondaryResults[1], singleSecondaryResults);
+        ChimericPairedEndAligner *pairAligner = aligner;
+        if (NULL != longSeedAligner && __min(reads[0]->getDataLength(), reads[1]->getDataLength()) >= options->longSeedMinReadLength) {
+            pairAligner = longSeedAligner;
+        }
+
+        AlignerWorkCounters workBefore;
+        _int64 slowReadStart = 0;
+        if (NULL != slowReadTracker) {
+            pairAligner->getWorkCounters(&workBefore);
+            slowReadStart = timeInNanos();
+        }
+
+        bool reused = NULL != originalAlignments && originalAlignments->verifyPair(reads, results);
+        bool cached = !reused && NULL != alignmentCache && alignmentCache->lookupPair(reads, results, maxPairedSecondaryHits, &nSecondaryResults,
+            singleSecondaryResults, maxSingleSecondaryHits, nSingleSecondaryResults);
+        bool merged = false;
+        if (reused) {
+            nSecondaryResults = 0;
+            nSingleSecondaryResults[0] = nSingleSecondaryResults[1] = 0;
+            stats->reusedAlignments += 2;
+        } else if (cached) {
+            stats->cachedAlignments += 2;
+        } else {
+            merged = NULL != mateMerger && useful0 && useful1 && mateMerger->alignPair(pairAligner->getSingleAligner(), reads, results);
+            if (merged) {
+                nSecondaryResults = 0;
+                nSingleSecondaryResults[0] = nSingleSecondaryResults[1] = 0;
+                ((PairedAlignerStats*)stats)->matesMerged++;
+            } else {
+                pairAligner->align(reads[0], reads[1], results, maxSecondaryAlignmentAdditionalEditDistance, maxPairedSecondaryHits, &nSecondaryResults, results + 1,
+                    maxSingleSecondaryHits, maxSecondaryAlignments, &nSingleSecondaryResults[0], &nSingleSecondaryResults[1], singleSecondaryResults);
+            }
+            if (NULL != alignmentCache) {
+                alignmentCache->addPair(reads, results, nSecondaryResults, singleSecondaryResults, nSingleSecondaryResults);
+            }
+        }
+
+        //
+        // -otherIndex: align the pair against each of the other indices as well, and write it (with that index's
+        // secondary alignments) to the output of whichever one it aligned best to.  Ties go to the earlier index.
+        //
+        PairedAlignmentResult *bestResults = results;
+        SingleAlignmentResult *bestSingleSecondaryResults = singleSecondaryResults;
+        ReadWriter *writer = readWriter;
+        ReaderContext *context = &readerContext;
+        int bestOtherIndex = -1;
+        for (int i = 0; i < nOtherIndices; i++) {
+            int nOtherSecondaryResults;
+            int nOtherSingleSecondaryResults[2];
+            otherAligners[i]->align(reads[0], reads[1], otherResults[i], maxSecondaryAlignmentAdditionalEditDistance, maxPairedSecondaryHits, &nOtherSecondaryResults,
+                otherResults[i] + 1, maxSingleSecondaryHits, maxSecondaryAlignments, &nOtherSingleSecondaryResults[0], &nOtherSingleSecondaryResults[1],
+                otherSingleSecondaryResults[i]);
+            if (otherResults[i][0].isBetterThan(bestResults[0])) {
+                bestOtherIndex = i;
+                bestResults = otherResults[i];
+                bestSingleSecondaryResults = otherSingleSecondaryResults[i];
+                nSecondaryResults = nOtherSecondaryResults;
+                nSingleSecondaryResults[0] = nOtherSingleSecondaryResults[0];
+                nSingleSecondaryResults[1] = nOtherSingleSecondaryResults[1];
+                writer = otherReadWriters[i];
+                context = &otherReaderContexts[i];
+            }
+        }
+        if (-1 != bestOtherIndex) {
+            stats->readsToOtherIndices[bestOtherIndex] += 2;
+        }
+
+        for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+            if (reads[whichRead]->wasAlignmentTruncated()) {
+                stats->truncatedAlignments++;
+            }
+        }
+
+        if (NULL != slowReadTracker) {
+            _int64 nanos = timeInNanos() - slowReadStart;
+            AlignerWorkCounters work;
+            pairAligner->getWorkCounters(&work);
+            work.subtract(workBefore);
+            slowReadTracker->record(nanos, work, reads[0], reads[1]);
+        }
+
+        if (NULL != insertSizeDistribution && !insertSizeDistribution->isReady() && !cached && results[0].fromAlignTogether && results[0].alignedAsPair &&
+            isOneLocation(results[0].status[0]) && isOneLocation(results[0].status[1]) &&
+            results[0].mapq[0] >= InsertSizeDistribution::MinMapqToSample && results[0].mapq[1] >= InsertSizeDistribution::MinMapqToSample) {
+
+            if (insertSizeDistribution->addSample((int)DistanceBetweenGenomeLocations(results[0].location[0], results[0].location[1]))) {
+                intersectingAligner->setInsertSizeDistribution(insertSizeDistribution);
+                aligner->setSpacing(insertSizeDistribution->getMinSpacing(), insertSizeDistribution->getMaxSpacing());
+                if (NULL != longSeedAligner) {
+                    longSeedIntersectingAligner->setInsertSizeDistribution(insertSizeDistribution);
+                    longSeedAligner->setSpacing(insertSizeDistribution->getMinSpacing(), insertSizeDistribution->getMaxSpacing());
+                }
+                for (int i = 0; i < nOtherIndices; i++) {
+                    otherIntersectingAligners[i]->setInsertSizeDistribution(insertSizeDistribution);
+                    otherAligners[i]->setSpacing(insertSizeDistribution->getMinSpacing(), insertSizeDistribution->getMaxSpacing());
+                }
+            }
+        }
 
 #if     TIME_HISTOGRAM
         _int64 runTime = timeInNanos() - startTime;
@@ -523,16 +959,16 @@ void PairedAlignerContext::runIterationThread()
         stats->nanosByTimeBucket[timeBucket] += runTime;
 #endif // TIME_HISTOGRAM
 
-        if (forceSpacing && isOneLocation(results[0].status[0]) != isOneLocation(results[0].status[1])) {
+        if (forceSpacing && isOneLocation(bestResults[0].status[0]) != isOneLocation(bestResults[0].status[1])) {
             // either both align or neither do
-            results[0].status[0] = results[0].status[1] = NotFound;
-            results[0].location[0] = results[0].location[1] = InvalidGenomeLocation;
+            bestResults[0].status[0] = bestResults[0].status[1] = NotFound;
+            bestResults[0].location[0] = bestResults[0].location[1] = InvalidGenomeLocation;
         }
 
         bool firstIsPrimary = true;
         for (int i = 0; i <= nSecondaryResults; i++) {  // Loop runs to <= nSecondaryResults because there's a primary result, too.
-            bool pass0 = options->passFilter(reads[0], results[i].status[0], !useful0, i != 0 || !firstIsPrimary);
-            bool pass1 = options->passFilter(reads[1], results[i].status[1], !useful1, i != 0 || !firstIsPrimary);
+            bool pass0 = options->passFilter(reads[0], bestResults[i].status[0], !useful0, i != 0 || !firstIsPrimary);
+            bool pass1 = options->passFilter(reads[1], bestResults[i].status[1], !useful1, i != 0 || !firstIsPrimary);
             bool pass = (options->filterFlags & AlignerOptions::FilterBothMatesMatch)
                 ? (pass0 && pass1) : (pass0 || pass1);
 
@@ -540,7 +976,7 @@ void PairedAlignerContext::runIterationThread()
                 //
                 // Remove this one from the list by copying the last one here.
                 //
-                results[i] = results[nSecondaryResults];
+                bestResults[i] = bestResults[nSecondaryResults];
                 nSecondaryResults--;
                 if (0 == i) {
                     firstIsPrimary = false;
@@ -552,7 +988,7 @@ void PairedAlignerContext::runIterationThread()
         //
         // Now check the single secondary alignments
         //
-        SingleAlignmentResult *singleResults[2] = { singleSecondaryResults, singleSecondaryResults + nSingleSecondaryResults[0] };
+        SingleAlignmentResult *singleResults[2] = { bestSingleSecondaryResults, bestSingleSecondaryResults + nSingleSecondaryResults[0] };
         for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
             for (int whichAlignment = 0; whichAlignment < nSingleSecondaryResults[whichRead]; whichAlignment++) {
                 if (!options->passFilter(reads[whichRead], singleResults[whichRead][whichAlignment].status, false, true)) {
@@ -563,31 +999,70 @@ void PairedAlignerContext::runIterationThread()
             }
         }
 
-        if (NULL != readWriter) {
-            readWriter->writePairs(readerContext, reads, results, nSecondaryResults + 1, singleResults, nSingleSecondaryResults, firstIsPrimary);
+        if (NULL != writer) {
+            writer->writePairs(*context, reads, bestResults, nSecondaryResults + 1, singleResults, nSingleSecondaryResults, firstIsPrimary);
         }
 
         stats->extraAlignments += nSecondaryResults + (firstIsPrimary ? 0 : 1); // If first isn't primary, it's secondary.
         if (firstIsPrimary) {
-            updateStats((PairedAlignerStats*)stats, reads[0], reads[1], &results[0], useful0, useful1);
+            updateStats((PairedAlignerStats*)stats, reads[0], reads[1], &bestResults[0],
+                -1 != bestOtherIndex ? otherAligners[bestOtherIndex]->getAlignmentDetails() : cached || merged ? NULL : pairAligner->getAlignmentDetails(), useful0, useful1);
         } else {
             stats->filtered += 2;
         }
     }   // while we have a read pair
 
     stats->lvCalls = aligner->getLocationsScored();
+    ((PairedAlignerStats*)stats)->singleEndFallbacks = aligner->getNSingleEndFallbacks();
+    ((PairedAlignerStats*)stats)->nanosInSingleEndFallbacks = aligner->getNanosInSingleEndFallbacks();
+    ((PairedAlignerStats*)stats)->seedLookupsReused = aligner->getNSeedLookupsReused();
+    ((PairedAlignerStats*)stats)->readsSplit = aligner->getNReadsSplit();
+    ((PairedAlignerStats*)stats)->mateSeedLookupsShared = intersectingAligner->getNMateSeedLookupsShared();
+    stats->lowQualitySeedsSkipped = intersectingAligner->getNLowQualitySeedsSkipped() + aligner->getNLowQualitySeedsSkipped();
+    stats->readsGivenUp = aligner->getNReadsGivenUp();
+    if (NULL != longSeedAligner) {
+        stats->lowQualitySeedsSkipped += longSeedIntersectingAligner->getNLowQualitySeedsSkipped() + longSeedAligner->getNLowQualitySeedsSkipped();
+        stats->readsGivenUp += longSeedAligner->getNReadsGivenUp();
+        stats->lvCalls += longSeedAligner->getLocationsScored();
+        ((PairedAlignerStats*)stats)->singleEndFallbacks += longSeedAligner->getNSingleEndFallbacks();
+        ((PairedAlignerStats*)stats)->nanosInSingleEndFallbacks += longSeedAligner->getNanosInSingleEndFallbacks();
+        ((PairedAlignerStats*)stats)->seedLookupsReused += longSeedAligner->getNSeedLookupsReused();
+        ((PairedAlignerStats*)stats)->readsSplit += longSeedAligner->getNReadsSplit();
+        ((PairedAlignerStats*)stats)->mateSeedLookupsShared += longSeedIntersectingAligner->getNMateSeedLookupsShared();
+    }
+    for (int i = 0; i < nOtherIndices; i++) {
+        stats->lowQualitySeedsSkipped += otherIntersectingAligners[i]->getNLowQualitySeedsSkipped() + otherAligners[i]->getNLowQualitySeedsSkipped();
+        stats->readsGivenUp += otherAligners[i]->getNReadsGivenUp();
+        stats->lvCalls += otherAligners[i]->getLocationsScored();
+    }
 
     allocator->checkCanaries();
+    if (options->memoryReport) {
+        stats->alignerMemoryTouched = stats->maxAlignerMemoryTouched = allocator->getMemoryTouched();
+    }
 
     aligner->~ChimericPairedEndAligner();
+    if (NULL != longSeedAligner) {
+        longSeedAligner->~ChimericPairedEndAligner();
+        longSeedIntersectingAligner->~IntersectingPairedEndAligner();
+    }
+    for (int i = 0; i < nOtherIndices; i++) {
+        otherAligners[i]->~ChimericPairedEndAligner();
+        otherIntersectingAligners[i]->~IntersectingPairedEndAligner();
+    }
     delete supplier;
 
     intersectingAligner->~IntersectingPairedEndAligner();
     delete allocator;
+    delete insertSizeDistribution;
+    delete mateMerger;
+    delete splitReadAligner;
+    delete longSeedSplitReadAligner;
 }
 
 
-void PairedAlignerContext::updateStats(PairedAlignerStats* stats, Read* read0, Read* read1, PairedAlignmentResult* result, bool useful0, bool useful1)
+void PairedAlignerContext::updateStats(PairedAlignerStats* stats, Read* read0, Read* read1, PairedAlignmentResult* result, const PairedAlignmentDetails *details,
+                                       bool useful0, bool useful1)
 {
 	bool useful[2] = { useful0, useful1 };
 
@@ -623,8 +1098,8 @@ void PairedAlignerContext::updateStats(PairedAlignerStats* stats, Read* read0, R
         stats->incrementScore(result->score[0], result->score[1]);
     }
 
-    if (result->fromAlignTogether) {
-        stats->recordAlignTogetherMapqAndTime(__max(result->mapq[0], result->mapq[1]), result->nanosInAlignTogether, result->nSmallHits, result->nLVCalls);
+    if (result->fromAlignTogether && NULL != details) {
+        stats->recordAlignTogetherMapqAndTime(__max(result->mapq[0], result->mapq[1]), details->nanosInAlignTogether, details->nSmallHits, details->nLVCalls);
     }
 
     if (result->alignedAsPair) {
@@ -652,6 +1127,9 @@ PairedAlignerContext::typeSpecificBeginIteration()
         }
         pairedReadSupplierGenerator = new MultiInputPairedReadSupplierGenerator(options->nInputs,generators);
     }
+    if (0 != options->umiField) {
+        pairedReadSupplierGenerator = new UmiConsensusPairedReadSupplierGenerator(pairedReadSupplierGenerator, options->umiField, options->umiPrefix);
+    }
     ReaderContext* context = pairedReadSupplierGenerator->getContext();
     readerContext.header = context->header;
     readerContext.headerBytes = context->headerBytes;
@@ -49,7 +49,8 @@ protected:
 
     // for subclasses
 
-    virtual void updateStats(PairedAlignerStats* stats, Read* read0, Read* read1, PairedAlignmentResult* result, bool useful0, bool useful1);
+    virtual void updateStats(PairedAlignerStats* stats, Read* read0, Read* read1, PairedAlignmentResult* result, const PairedAlignmentDetails *details,
+                             bool useful0, bool useful1);
 
     bool isPaired() {return true;}
 
@@ -65,6 +66,10 @@ protected:
     bool                forceSpacing;
     unsigned            intersectingAlignerMaxHits;
     unsigned            maxCandidatePoolSize;
+    int                 insertSizeSamples;
+    bool                shareMateSeeds;
+    bool                mergeMates;
+    bool                splitReads;
     const char         *fastqFile1;
     bool                ignoreMismatchedIDs;
     bool                quicklyDropUnpairedReads;
@@ -88,4 +93,8 @@ struct PairedAlignerOptions : public AlignerOptions
     unsigned    intersectingAlignerMaxHits;
     unsigned    maxCandidatePoolSize;
     bool        quicklyDropUnpairedReads;
+    int         insertSizeSamples;          // Pairs to fit the insert size distribution to, or 0 to keep searching the -s window
+    bool        shareMateSeeds;             // -mateSeeds: reuse read 0's seed lookups for read 1 where the mates overlap
+    bool        mergeMates;                 // -mergeMates: align overlapping mates as one read (see MateMerger.h)
+    bool        splitReads;                 // -splitReads: align reads that don't align whole in pieces (see SplitReadAligner.h)
 };
@@ -27,7 +27,7 @@ Revision History:
 #include "LandauVishkin.h"
 #include "Read.h"
 
-
+struct SeedLookupResults;
 
 /**
  * Abstract interface for paired-end aligners.
@@ -58,5 +58,65 @@ public:
     {
     }
 
+    //
+    // Stop looking for better alignments after this many edit distance computations on one pair (-workBudget), 0 for no limit.
+    //
+    virtual void setWorkBudget(unsigned workBudget)
+    {
+    }
+
+    //
+    // In the first pass of seeds over each read, move seeds off windows with a base below this quality (-sq), 0 for off.
+    //
+    virtual void setMinSeedQuality(unsigned minSeedQuality)
+    {
+    }
+
+    //
+    // Stop looking up seeds for a read whose first this many disjoint seeds have no usable hits (-giveUp), 0 for off.
+    //
+    virtual void setMaxSeedsWithoutHits(unsigned maxSeedsWithoutHits)
+    {
+    }
+
+    //
+    // Limit each mate's edit distance to this fraction of its length as well as to maxK (-dp), 0 for just maxK.  Shorter
+    // limits also let LandauVishkin use its smaller row layouts.
+    //
+    virtual void setMaxDistFraction(float maxDistFraction)
+    {
+    }
+
+    static unsigned MateMaxK(unsigned maxK, float maxDistFraction, unsigned readLength) {
+        return maxDistFraction > 0 ? __min(maxK, (unsigned)(readLength * maxDistFraction)) : maxK;
+    }
+
     virtual _int64 getLocationsScored() const  = 0;
+
+    //
+    // The work it's done since it was created.  Aligners that don't count the rest only fill in locationsScored.
+    //
+    virtual void getWorkCounters(AlignerWorkCounters *counters) const
+    {
+        *counters = AlignerWorkCounters();
+        counters->locationsScored = getLocationsScored();
+    }
+
+    //
+    // The seed lookups the last call to align did for one of the reads, which stay valid until the next call, or NULL
+    // if the aligner doesn't keep them.
+    //
+    virtual const SeedLookupResults *getSeedLookups(int whichRead) const
+    {
+        return NULL;
+    }
+
+    //
+    // The details of the last call to align's primary result, which stay valid until the next call, or NULL if the aligner
+    // doesn't keep them.
+    //
+    virtual const PairedAlignmentDetails *getAlignmentDetails() const
+    {
+        return NULL;
+    }
 };
@@ -55,8 +55,7 @@ public:
     virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
     { single->reinit(startingOffset, amountOfFileToProcess); }
 
-    virtual void holdBatch(DataBatch batch)
-    { single->holdBatch(batch); }
+    virtual void holdBatch(DataBatch batch);
 
     virtual bool releaseBatch(DataBatch batch);
 
@@ -67,10 +66,19 @@ private:
 
     ReadWithOwnMemory* allocOverflowRead();
     void freeOverflowRead(ReadWithOwnMemory* read);
+
+    // keep the reads left in unmatched[1] where they are, holding batch[1]; false if that's too many batches to hold
+    bool holdOverflow();
+
+    // copy the held overflow reads of the oldest held batch into overflow, and let go of it
+    void evictHeldOverflow();
+
+    // a held overflow read has been matched
+    void matchedHeldOverflowRead(DataBatch readBatch);
     
     ReadReader* single; // reader for single reads
     typedef _uint64 StringHash;
-    typedef VariableSizeMap<StringHash,Read> ReadMap;
+    typedef VariableSizeGroupMap<StringHash,Read> ReadMap;
     DataBatch currentBatch; // for dropped reads
     bool allDroppedInCurrentBatch;
     DataBatch batch[2]; // 0 = current, 1 = previous
@@ -82,8 +90,74 @@ private:
     static const int BlockSize = 10000; // # ReadWithOwnMemory per block
     ExclusiveLock blockLock; // protects adding to blocks list
     ReadWithOwnMemory* freeList; // head of free list, NULL if empty, use interlocked ops to update
+    BufferPool overflowExtraBuffers; // for ids and aux data that don't fit in the reads; only allocated from here, freed from releaseBatch too
     typedef VariableSizeMap<_uint64,OverflowReadVector*> OverflowReadReleaseMap;
     OverflowReadReleaseMap overflowRelease;
+
+    //
+    // Unpaired reads from the batch we're letting go of are first kept in place, in heldOverflow, by holding on to
+    // their batch, so their bases and qualities don't get copied.  The reader only has so many batches, so once
+    // there are MatchHeldOverflowBatches of those the oldest one's reads are copied into overflow after all.  A
+    // matched read keeps its own batch, so the consumer holds it like any other; our hold goes once its last read
+    // is matched, at the start of the next call (after the queue has taken its own hold).
+    //
+    ReadMap heldOverflow; // read id -> Read in a held batch
+    struct HeldBatch
+    {
+        DataBatch batch;
+        int pending; // reads from it still in heldOverflow
+    };
+    HeldBatch heldBatches[PairedReadReader::MatchHeldOverflowBatches]; // oldest first
+    int nHeldBatches;
+    VariableSizeVector<DataBatch> heldToRelease;
+    _int64 heldOverflowTotal;
+
+    // write overflow out to the spill files if it's over the memory limit
+    void spillOverflowIfNeeded();
+
+    // write all of the reads in overflow or a read map out to the spill files, and empty it
+    void spillOverflow();
+    void spillReads(ReadMap* reads);
+
+    void spillRead(StringHash key, Read* read);
+
+    // at eof, pair up the spilled reads one bucket at a time
+    bool getNextSpilledPair(Read* read1, Read* read2);
+    bool loadNextSpillBucket();
+    void releaseSpilledBatch(DataBatch spilledBatch);
+
+    //
+    // With a memory limit (see SpillUnpairedReads), once overflow gets bigger than that it's written out to
+    // SpillBuckets temporary files, split up by read id hash so that both mates of a pair always end up in the same
+    // one, and emptied.  Nothing on disk is looked at again until eof, at which point everything that's still unmatched
+    // goes out as well and the files are read back one at a time, pairing up the reads in each.  The pairs come out in
+    // batches of their own (fileID SpillFileID), one per file, whose memory goes once the consumer has let go of them.
+    //
+    static const int SpillBuckets = 64;
+    static const _uint32 SpillFileID = 0xffffffff;
+    FILE* spillFiles[SpillBuckets];
+    _int64 spillBytes[SpillBuckets];
+    int spillInstance; // to keep this matcher's files apart from any other's
+    _int64 spilledTotal, spillDiscarded;
+    char* spillRecord; // space to build a record in before writing it
+    unsigned spillRecordSize;
+    bool spilling; // handing out pairs from the spill files
+    int nextSpillBucket;
+    char* spillBuffer; // the bucket we're pairing up
+    _int64 spillBufferBytes, spillOffset;
+    DataBatch spillBatch;
+    typedef VariableSizeMap<StringHash,_int64> SpillMap;
+    SpillMap spillUnmatched; // read id -> offset of the read in spillBuffer
+    struct SpilledBatch
+    {
+        char* buffer;
+        int holds;
+    };
+    typedef VariableSizeMap<_int64,SpilledBatch*> SpilledBatchMap;
+    SpilledBatchMap spilledBatches;
+    ExclusiveLock spillLock; // protects spilledBatches, which the consumers release
+    _uint32 nSpilledBatches;
+
 #ifdef VALIDATE_MATCH
     typedef VariableSizeMap<StringHash,char*> StringMap;
     StringMap strings;
@@ -113,18 +187,88 @@ private:
 #endif
 };
 
+static size_t SpillMemoryLimit = 0; // 0 means don't spill
+static const char* SpillFilePrefix = "snap";
+static volatile int SpillInstances = 0;
+
+//
+// A read in a spill file.  It's followed by its id, data, quality, RNEXT and auxiliary data, and then padding to
+// a multiple of 8 bytes.  The read group is a pointer into the reader's context (or the flag for reading it from the
+// auxiliary data), which lasts as long as the run does, so it's written as is.
+//
+struct SpilledRead
+{
+    _uint64     key;
+    _int64      originalAlignedLocation;
+    const char* readGroup;
+    unsigned    size; // all of the record, including what follows this
+    unsigned    idLength;
+    unsigned    unclippedLength;
+    unsigned    clippingState;
+    unsigned    originalMAPQ;
+    unsigned    originalSAMFlags;
+    unsigned    originalFrontClipping;
+    unsigned    originalBackClipping;
+    unsigned    originalFrontHardClipping;
+    unsigned    originalBackHardClipping;
+    unsigned    originalRNEXTLength;
+    unsigned    originalPNEXT;
+    unsigned    auxiliaryDataLength;
+};
+
+    static void
+SpillFileName(
+    char* buffer,
+    size_t bufferSize,
+    int instance,
+    int bucket)
+{
+    snprintf(buffer, bufferSize, "%s.unpaired.%d.%d.tmp", SpillFilePrefix, instance, bucket);
+}
+
+    static void
+UnspillRead(
+    SpilledRead* record,
+    Read* read,
+    DataBatch batch)
+{
+    const char* id = (const char *)(record + 1);
+    const char* data = id + record->idLength;
+    const char* quality = data + record->unclippedLength;
+    const char* rnext = quality + record->unclippedLength;
+    char* aux = (char *)rnext + record->originalRNEXTLength;
+
+    read->init(id, record->idLength, data, quality, record->unclippedLength, GenomeLocation(record->originalAlignedLocation),
+        record->originalMAPQ, record->originalSAMFlags, record->originalFrontClipping, record->originalBackClipping,
+        record->originalFrontHardClipping, record->originalBackHardClipping, 0 == record->originalRNEXTLength ? NULL : rnext,
+        record->originalRNEXTLength, record->originalPNEXT);
+    read->clip((ReadClippingType)record->clippingState);
+    read->setReadGroup(record->readGroup);
+    read->setAuxiliaryData(0 == record->auxiliaryDataLength ? NULL : aux, record->auxiliaryDataLength);
+    read->setBatch(batch);
+}
+
 PairedReadMatcher::PairedReadMatcher(
     ReadReader* i_single,
     bool i_quicklyDropUnpairedReads)
     : single(i_single),
-    overflowTotal(0), overflowPeak(0),
+    overflowTotal(0), overflowPeak(0), nHeldBatches(0), heldOverflowTotal(0),
     quicklyDropUnpairedReads(i_quicklyDropUnpairedReads),
     nReadsQuicklyDropped(0), freeList(NULL),
-    currentBatch(0, 0), allDroppedInCurrentBatch(false)
+    currentBatch(0, 0), allDroppedInCurrentBatch(false),
+    spilledTotal(0), spillDiscarded(0), spillRecord(NULL), spillRecordSize(0), spilling(false), nextSpillBucket(0),
+    spillBuffer(NULL), spillBufferBytes(0), spillOffset(0), nSpilledBatches(0)
 {
-    new (&unmatched[0]) VariableSizeMap<StringHash,Read>(10000);
-    new (&unmatched[1]) VariableSizeMap<StringHash,Read>(10000);
+    new (&unmatched[0]) ReadMap(10000);
+    new (&unmatched[1]) ReadMap(10000);
+    new (&heldOverflow) ReadMap(10000);
     InitializeExclusiveLock(&blockLock);
+    InitializeExclusiveLock(&spillLock);
+    for (int i = 0; i < SpillBuckets; i++) {
+        spillFiles[i] = NULL;
+        spillBytes[i] = 0;
+    }
+    spillInstance = SpillMemoryLimit > 0 ? InterlockedIncrementAndReturnNewValue(&SpillInstances) : 0;
 #ifdef STATISTICS
     currentStats.clear();
     totalStats.clear();
@@ -138,6 +282,21 @@ PairedReadMatcher::~PairedReadMatcher()
     }
     delete single;
 	DestroyExclusiveLock(&blockLock);
+
+    for (int i = 0; i < SpillBuckets; i++) {
+        if (NULL != spillFiles[i]) {
+            char fileName[MAX_PATH];
+            SpillFileName(fileName, sizeof(fileName), spillInstance, i);
+            fclose(spillFiles[i]);
+            remove(fileName);
+        }
+    }
+    for (SpilledBatchMap::iterator i = spilledBatches.begin(); i != spilledBatches.end(); i = spilledBatches.next(i)) {
+        BigDealloc(i->value->buffer);
+        delete i->value;
+    }
+    delete [] spillRecord;
+    DestroyExclusiveLock(&spillLock);
 }
 
     ReadWithOwnMemory*
@@ -183,6 +342,280 @@ PairedReadMatcher::freeOverflowRead(
     }
 }
 
+    bool
+PairedReadMatcher::holdOverflow()
+{
+    if (nHeldBatches == PairedReadReader::MatchHeldOverflowBatches) {
+        evictHeldOverflow();
+        if (nHeldBatches == PairedReadReader::MatchHeldOverflowBatches) {
+            return false;
+        }
+    }
+
+    single->holdBatch(batch[1]);
+    HeldBatch* held = &heldBatches[nHeldBatches++];
+    held->batch = batch[1];
+    held->pending = unmatched[1].size();
+    for (ReadMap::iterator r = unmatched[1].begin(); r != unmatched[1].end(); r = unmatched[1].next(r)) {
+        heldOverflow.put(r->key, r->value);
+    }
+    heldOverflowTotal += unmatched[1].size();
+    return true;
+}
+
+    void
+PairedReadMatcher::evictHeldOverflow()
+{
+    _ASSERT(nHeldBatches > 0);
+    DataBatch oldest = heldBatches[0].batch;
+
+    VariableSizeVector<StringHash> keys;
+    for (ReadMap::iterator r = heldOverflow.begin(); r != heldOverflow.end(); r = heldOverflow.next(r)) {
+        if (r->value.getBatch() == oldest) {
+            keys.push_back(r->key);
+        }
+    }
+    _ASSERT(keys.size() == heldBatches[0].pending);
+
+    for (VariableSizeVector<StringHash>::iterator k = keys.begin(); k != keys.end(); k++) {
+        ReadWithOwnMemory* p = allocOverflowRead();
+        new (p) ReadWithOwnMemory(heldOverflow[*k], &overflowExtraBuffers);
+        overflow.put(*k, p);
+        heldOverflow.erase(*k);
+    }
+    overflowTotal += keys.size();
+    overflowPeak = max(overflow.size(), overflowPeak);
+    spillOverflowIfNeeded();
+
+    single->releaseBatch(oldest);
+    nHeldBatches--;
+    for (int i = 0; i < nHeldBatches; i++) {
+        heldBatches[i] = heldBatches[i + 1];
+    }
+}
+
+    void
+PairedReadMatcher::matchedHeldOverflowRead(
+    DataBatch readBatch)
+{
+    for (int i = 0; i < nHeldBatches; i++) {
+        if (heldBatches[i].batch == readBatch) {
+            heldBatches[i].pending--;
+            if (0 == heldBatches[i].pending) {
+                heldToRelease.push_back(readBatch);
+                nHeldBatches--;
+                for (int j = i; j < nHeldBatches; j++) {
+                    heldBatches[j] = heldBatches[j + 1];
+                }
+            }
+            return;
+        }
+    }
+    _ASSERT(false);
+}
+
+    void
+PairedReadMatcher::spillOverflowIfNeeded()
+{
+    if (SpillMemoryLimit > 0 && (size_t)overflow.size() * sizeof(ReadWithOwnMemory) > SpillMemoryLimit) {
+        spillOverflow();
+    }
+}
+
+    void
+PairedReadMatcher::spillOverflow()
+{
+    for (OverflowMap::iterator i = overflow.begin(); i != overflow.end(); i = overflow.next(i)) {
+        spillRead(i->key, i->value);
+        i->value->dispose();
+        freeOverflowRead(i->value);
+    }
+    spilledTotal += overflow.size();
+    overflow.clear();
+}
+
+    void
+PairedReadMatcher::spillReads(
+    ReadMap* reads)
+{
+    for (ReadMap::iterator i = reads->begin(); i != reads->end(); i = reads->next(i)) {
+        spillRead(i->key, &i->value);
+    }
+    spilledTotal += reads->size();
+    reads->clear();
+}
+
+    void
+PairedReadMatcher::spillRead(
+    StringHash key,
+    Read* read)
+{
+    unsigned auxLength;
+    bool auxIsSAM;
+    char* aux = read->getAuxiliaryData(&auxLength, &auxIsSAM);
+    unsigned size = (unsigned)sizeof(SpilledRead) + read->getIdLength() + 2 * read->getUnclippedLength() +
+        read->getOriginalRNEXTLength() + auxLength;
+    size = (size + 7) & ~7;
+    if (size > spillRecordSize) {
+        delete [] spillRecord;
+        spillRecordSize = __max(size, 2 * spillRecordSize);
+        spillRecord = new char[spillRecordSize];
+    }
+
+    SpilledRead* record = (SpilledRead*)spillRecord;
+    memset(record, 0, size);
+    record->key = key;
+    record->originalAlignedLocation = GenomeLocationAsInt64(read->getOriginalAlignedLocation());
+    record->readGroup = read->getReadGroup();
+    record->size = size;
+    record->idLength = read->getIdLength();
+    record->unclippedLength = read->getUnclippedLength();
+    record->clippingState = read->getClippingState();
+    record->originalMAPQ = read->getOriginalMAPQ();
+    record->originalSAMFlags = read->getOriginalSAMFlags();
+    record->originalFrontClipping = read->getOriginalFrontClipping();
+    record->originalBackClipping = read->getOriginalBackClipping();
+    record->originalFrontHardClipping = read->getOriginalFrontHardClipping();
+    record->originalBackHardClipping = read->getOriginalBackHardClipping();
+    record->originalRNEXTLength = read->getOriginalRNEXTLength();
+    record->originalPNEXT = read->getOriginalPNEXT();
+    record->auxiliaryDataLength = auxLength;
+
+    char* p = (char*)(record + 1);
+    memcpy(p, read->getId(), read->getIdLength());
+    p += read->getIdLength();
+    memcpy(p, read->getUnclippedData(), read->getUnclippedLength());
+    p += read->getUnclippedLength();
+    memcpy(p, read->getUnclippedQuality(), read->getUnclippedLength());
+    p += read->getUnclippedLength();
+    if (0 != read->getOriginalRNEXTLength()) {
+        memcpy(p, read->getOriginalRNEXT(), read->getOriginalRNEXTLength());
+        p += read->getOriginalRNEXTLength();
+    }
+    if (0 != auxLength) {
+        memcpy(p, aux, auxLength);
+    }
+
+    int bucket = (int)(key % SpillBuckets);
+    if (NULL == spillFiles[bucket]) {
+        char fileName[MAX_PATH];
+        SpillFileName(fileName, sizeof(fileName), spillInstance, bucket);
+        spillFiles[bucket] = fopen(fileName, "w+b");
+        if (NULL == spillFiles[bucket]) {
+            WriteErrorMessage("PairedReadMatcher: unable to create temporary file %s for unpaired reads\n", fileName);
+            soft_exit(1);
+        }
+    }
+    if (1 != fwrite(record, size, 1, spillFiles[bucket])) {
+        WriteErrorMessage("PairedReadMatcher: error writing temporary file for unpaired reads, errno %d\n", errno);
+        soft_exit(1);
+    }
+    spillBytes[bucket] += size;
+}
+
+    bool
+PairedReadMatcher::loadNextSpillBucket()
+{
+    if (NULL != spillBuffer) {
+        //
+        // The last of the bucket we were on has been handed out, and the consumer has taken its own holds by now.
+        //
+        spillDiscarded += spillUnmatched.size();
+        spillUnmatched.clear();
+        releaseSpilledBatch(spillBatch);
+        spillBuffer = NULL;
+    }
+
+    while (nextSpillBucket < SpillBuckets && NULL == spillFiles[nextSpillBucket]) {
+        nextSpillBucket++;
+    }
+    if (nextSpillBucket == SpillBuckets) {
+        return false;
+    }
+
+    int bucket = nextSpillBucket++;
+    spillBufferBytes = spillBytes[bucket];
+    spillBuffer = (char*)BigAlloc(spillBufferBytes);
+    rewind(spillFiles[bucket]);
+    if (1 != fread(spillBuffer, spillBufferBytes, 1, spillFiles[bucket])) {
+        WriteErrorMessage("PairedReadMatcher: error reading temporary file for unpaired reads, errno %d\n", errno);
+        soft_exit(1);
+    }
+
+    char fileName[MAX_PATH];
+    SpillFileName(fileName, sizeof(fileName), spillInstance, bucket);
+    fclose(spillFiles[bucket]);
+    remove(fileName);
+    spillFiles[bucket] = NULL;
+    spillBytes[bucket] = 0;
+    spillOffset = 0;
+
+    SpilledBatch* spilled = new SpilledBatch;
+    spilled->buffer = spillBuffer;
+    spilled->holds = 1; // ours, until we've handed out all of its pairs
+    spillBatch = DataBatch(++nSpilledBatches, SpillFileID);
+    AcquireExclusiveLock(&spillLock);
+    spilledBatches.put(spillBatch.asKey(), spilled);
+    ReleaseExclusiveLock(&spillLock);
+    return true;
+}
+
+    bool
+PairedReadMatcher::getNextSpilledPair(
+    Read* read1,
+    Read* read2)
+{
+    while (true) {
+        if (NULL == spillBuffer || spillOffset == spillBufferBytes) {
+            if (! loadNextSpillBucket()) {
+                if (spillDiscarded > 0) {
+                    WriteErrorMessage( " warning: PairedReadMatcher discarding %lld unpaired reads at eof\n", spillDiscarded);
+                }
+                spilling = false;
+                spilledTotal = 0;
+                spillDiscarded = 0;
+                return false;
+            }
+            continue;
+        }
+
+        SpilledRead* record = (SpilledRead*)(spillBuffer + spillOffset);
+        _int64 mateOffset;
+        if (! spillUnmatched.tryGet(record->key, &mateOffset)) {
+            spillUnmatched.put(record->key, spillOffset);
+            spillOffset += record->size;
+            continue;
+        }
+        spillOffset += record->size;
+        spillUnmatched.erase(record->key);
+
+        SpilledRead* mate = (SpilledRead*)(spillBuffer + mateOffset);
+        bool recordIsFirst = 0 != (record->originalSAMFlags & SAM_FIRST_SEGMENT);
+        UnspillRead(recordIsFirst ? record : mate, read1, spillBatch);
+        UnspillRead(recordIsFirst ? mate : record, read2, spillBatch);
+        return true;
+    }
+}
+
+    void
+PairedReadMatcher::releaseSpilledBatch(
+    DataBatch spilledBatch)
+{
+    AcquireExclusiveLock(&spillLock);
+    SpilledBatch* spilled = NULL;
+    if (spilledBatches.tryGet(spilledBatch.asKey(), &spilled) && 0 == --spilled->holds) {
+        spilledBatches.erase(spilledBatch.asKey());
+    } else {
+        spilled = NULL;
+    }
+    ReleaseExclusiveLock(&spillLock);
+
+    if (NULL != spilled) {
+        BigDealloc(spilled->buffer);
+        delete spilled;
+    }
+}
+
     bool
 PairedReadMatcher::getNextReadPair(
     Read *read1,
@@ -194,6 +627,15 @@ PairedReadMatcher::getNextReadPair(
     int readOneToOutputRead;    // This is used to determine which of the output reads corresponds to one (the read that just came from getNextRead())
                                 // That, in turn, is determined by the S/BAM flags in the read saying whether it was first-in-template.
 
+    for (VariableSizeVector<DataBatch>::iterator b = heldToRelease.begin(); b != heldToRelease.end(); b++) {
+        single->releaseBatch(*b);
+    }
+    heldToRelease.clear();
+
+    if (spilling) {
+        return getNextSpilledPair(read1, read2);
+    }
+
     int skipped = 0;
     while (true) {
         if (skipped++ == 10000) {
@@ -202,9 +644,18 @@ PairedReadMatcher::getNextReadPair(
 
         if (! single->getNextRead(&localRead)) {
 #ifdef USE_DEVTEAM_OPTIONS
-            WriteErrorMessage("overflow total %d, peak %d\n", overflowTotal, overflowPeak);
+            WriteErrorMessage("overflow total %d, peak %d, held in place %lld, spilled %lld\n", overflowTotal, overflowPeak, heldOverflowTotal, spilledTotal);
 #endif
-            int n = unmatched[0].size() + unmatched[1].size() + overflow.size();
+            if (spilledTotal > 0) {
+                //
+                // The mates of any of these might be on disk, so they go there too, and get paired up with the rest.
+                //
+                spillReads(&unmatched[0]);
+                spillReads(&unmatched[1]);
+                spillReads(&heldOverflow);
+                spillOverflow();
+            }
+            int n = unmatched[0].size() + unmatched[1].size() + heldOverflow.size() + overflow.size();
             if (n > 0) {
                 WriteErrorMessage( " warning: PairedReadMatcher discarding %d unpaired reads at eof\n", n);
 #ifdef USE_DEVTEAM_OPTIONS
@@ -242,6 +693,15 @@ PairedReadMatcher::getNextReadPair(
             }
             single->releaseBatch(batch[0]);
             single->releaseBatch(batch[1]);
+            for (int i = 0; i < nHeldBatches; i++) {
+                single->releaseBatch(heldBatches[i].batch);
+            }
+            nHeldBatches = 0;
+            heldOverflow.clear();
+            if (spilledTotal > 0) {
+                spilling = true;
+                return getNextSpilledPair(read1, read2);
+            }
             return false;
         }
 
@@ -303,13 +763,13 @@ PairedReadMatcher::getNextReadPair(
             currentBatches.clear();
 #endif
             // roll over batches
-            if (unmatched[1].size() > 0) {
+            if (unmatched[1].size() > 0 && ! holdOverflow()) {
                 // copy remaining reads into overflow map
                 //fprintf(stderr,"warning: PairedReadMatcher overflow %d unpaired reads from %d:%d\n", unmatched[1].size(), batch[1].fileID, batch[1].batchID); //!!
                 //char* buf = (char*) alloca(500);
                 for (ReadMap::iterator r = unmatched[1].begin(); r != unmatched[1].end(); r = unmatched[1].next(r)) {
                     ReadWithOwnMemory* p = allocOverflowRead();
-                    new (p) ReadWithOwnMemory(r->value);
+                    new (p) ReadWithOwnMemory(r->value, &overflowExtraBuffers);
                     _ASSERT(p->getData()[0]);
                     overflow.put(r->key, p);
 #ifdef VALIDATE_MATCH
@@ -325,6 +785,7 @@ PairedReadMatcher::getNextReadPair(
                 }
                 overflowTotal += unmatched[1].size();
                 overflowPeak = max(overflow.size(), overflowPeak);
+                spillOverflowIfNeeded();
             }
             for (ReadMap::iterator i = unmatched[1].begin(); i != unmatched[1].end(); i = unmatched[1].next(i)) {
                 i->value.dispose();
@@ -352,12 +813,20 @@ PairedReadMatcher::getNextReadPair(
             // try previous batch
             found = unmatched[1].find(key);
             if (found == unmatched[1].end()) {
-                // try overflow
+                // try overflow, first the reads we've kept in place
+                ReadMap::iterator found3 = heldOverflow.find(key);
+                if (found3 != heldOverflow.end()) {
+                    *outputReads[1-readOneToOutputRead] = found3->value;
+                    matchedHeldOverflowRead(found3->value.getBatch());
+                    heldOverflow.erase(found3->key);
+                    *outputReads[readOneToOutputRead] = localRead;
+                    return true;
+                }
                 OverflowMap::iterator found2 = overflow.find(key);
                 if (found2 == overflow.end()) {
                     // no match, remember it for later matching
                     unmatched[0].put(key, localRead);
-                    _ASSERT(localRead.getData()[0] && unmatched[0][key].getData()[0]);
+                    _ASSERT(localRead.hasDeferredData() || (localRead.getData()[0] && unmatched[0][key].getData()[0]));
                     //fprintf(stderr, "unmatched add %d:%d %lx\n", batch[0].fileID, batch[0].batchID, key); //!!
                     continue;
                 } else {
@@ -405,12 +874,16 @@ PairedReadMatcher::releaseBatch(
 {
     if (batch.asKey() == 0) {
         return true;
+    } else if (batch.fileID == SpillFileID) {
+        releaseSpilledBatch(batch);
+        return true;
     } else if (single->releaseBatch(batch)) {
         OverflowReadVector* v = NULL;
         if (overflowRelease.tryGet(batch.asKey(), &v)) {
             // free memory for overflow reads
             //fprintf(stderr, "PairedReadMatcher release %d overflow reads for batch %d:%d\n", v->size(), batch.fileID, batch.batchID);
             for (OverflowReadVector::iterator i = v->begin(); i != v->end(); i++) {
+                (*i)->dispose();
                 freeOverflowRead(*i);
             }
             delete v;
@@ -422,6 +895,242 @@ PairedReadMatcher::releaseBatch(
     }
 }
 
+    void
+PairedReadMatcher::holdBatch(
+    DataBatch batch)
+{
+    if (batch.fileID == SpillFileID) {
+        AcquireExclusiveLock(&spillLock);
+        SpilledBatch* spilled = NULL;
+        if (spilledBatches.tryGet(batch.asKey(), &spilled)) {
+            spilled->holds++;
+        }
+        ReleaseExclusiveLock(&spillLock);
+    } else {
+        single->holdBatch(batch);
+    }
+}
+
+//
+// A reader that hands back a read or two it was given before going on to the ones from single, so that a matcher can be
+// started up partway through a file without losing what's already been read.  It owns single.
+//
+class PushbackReadReader: public ReadReader
+{
+public:
+    PushbackReadReader(ReadReader* i_single) : ReadReader(*i_single->getContext()), single(i_single), nPushedBack(0), nextPushedBack(0) {}
+
+    virtual ~PushbackReadReader()
+    { delete single; }
+
+    // reads come back out in the order they were pushed
+    void pushBack(const Read& read)
+    {
+        _ASSERT(nPushedBack < MaxPushedBack);
+        pushedBack[nPushedBack++] = read;
+    }
+
+    virtual bool getNextRead(Read *readToUpdate)
+    {
+        if (nextPushedBack < nPushedBack) {
+            *readToUpdate = pushedBack[nextPushedBack++];
+            return true;
+        }
+        return single->getNextRead(readToUpdate);
+    }
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
+    { single->reinit(startingOffset, amountOfFileToProcess); }
+
+    virtual void holdBatch(DataBatch batch)
+    { single->holdBatch(batch); }
+
+    virtual bool releaseBatch(DataBatch batch)
+    { return single->releaseBatch(batch); }
+
+private:
+    ReadReader* single;
+    static const int MaxPushedBack = NUM_READS_PER_PAIR;
+    Read pushedBack[MaxPushedBack];
+    int nPushedBack;
+    int nextPushedBack;
+};
+
+//
+// For input whose header says it's grouped by read name (queryname sorted or collated), where each read is right next
+// to its mate: pair reads off two at a time, with no hashing and no copying.  As soon as two reads in a row aren't mates
+// (or a read is one the matcher would drop) it gives up, and hands those and everything after them to a
+// PairedReadMatcher instead.
+//
+class AdjacentPairReader: public PairedReadReader
+{
+public:
+    AdjacentPairReader(ReadReader* i_single, bool i_quicklyDropUnpairedReads)
+        : source(new PushbackReadReader(i_single)), matcher(NULL), quicklyDropUnpairedReads(i_quicklyDropUnpairedReads) {}
+
+    virtual ~AdjacentPairReader()
+    {
+        if (NULL != matcher) {
+            delete matcher;     // Which deletes source
+        } else {
+            delete source;
+        }
+    }
+
+    virtual bool getNextReadPair(Read *read1, Read *read2);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
+    { source->reinit(startingOffset, amountOfFileToProcess); }
+
+    virtual void holdBatch(DataBatch batch)
+    { NULL != matcher ? matcher->holdBatch(batch) : source->holdBatch(batch); }
+
+    virtual bool releaseBatch(DataBatch batch)
+    { return NULL != matcher ? matcher->releaseBatch(batch) : source->releaseBatch(batch); }
+
+    virtual ReaderContext* getContext()
+    { return source->getContext(); }
+
+private:
+    // get the next read, holding its batch (and letting go of the one before last) if it's a new one
+    bool getNextRead(Read *read);
+
+    bool wouldBeDropped(Read *read) const;
+
+    PushbackReadReader* source;
+    PairedReadMatcher* matcher; // once we've fallen back to matching
+    bool quicklyDropUnpairedReads;
+    DataBatch batch[2]; // 0 = current, 1 = previous, as in the matcher
+    Read reads[NUM_READS_PER_PAIR];
+};
+
+    bool
+AdjacentPairReader::getNextRead(
+    Read *read)
+{
+    if (! source->getNextRead(read)) {
+        return false;
+    }
+
+    if (read->getBatch() != batch[0]) {
+        if (! batch[1].isZero()) {
+            source->releaseBatch(batch[1]);
+        }
+        batch[1] = batch[0];
+        batch[0] = read->getBatch();
+        source->holdBatch(batch[0]);
+    }
+
+    return true;
+}
+
+    bool
+AdjacentPairReader::wouldBeDropped(
+    Read *read) const
+{
+    return quicklyDropUnpairedReads && ((read->getOriginalSAMFlags() & SAM_NEXT_UNMAPPED) == 0) &&
+        (read->getOriginalPNEXT() == 0 || (read->getOriginalRNEXTLength() == 1 && read->getOriginalRNEXT()[0] == '*'));
+}
+
+    static unsigned
+PairKeyLength(
+    const Read *read)
+{
+    // the id up to a slash or space, as the matcher hashes it
+    const char* id = read->getId();
+    unsigned idLength = read->getIdLength();
+    const char* slash = (const char*) memchr(id, '/', idLength);
+    if (slash != NULL) {
+        idLength = (unsigned)(slash - id);
+    }
+    const char* space = (const char*) memchr(id, ' ', idLength);
+    if (space != NULL) {
+        idLength = (unsigned)(space - id);
+    }
+    return idLength;
+}
+
+    bool
+AdjacentPairReader::getNextReadPair(
+    Read *read1,
+    Read *read2)
+{
+    if (NULL != matcher) {
+        bool result = matcher->getNextReadPair(read1, read2);
+        //
+        // The matcher holds whatever it's kept of the reads we handed it by now, and the queue the pair it's returned.
+        //
+        for (int i = 0; i < 2; i++) {
+            if (! batch[i].isZero()) {
+                source->releaseBatch(batch[i]);
+                batch[i] = DataBatch();
+            }
+        }
+        return result;
+    }
+
+    int nReads = 0;
+    while (nReads < NUM_READS_PER_PAIR && getNextRead(&reads[nReads])) {
+        nReads++;
+        if (wouldBeDropped(&reads[nReads - 1])) {
+            break;
+        }
+    }
+
+    if (NUM_READS_PER_PAIR == nReads && ! wouldBeDropped(&reads[0]) && ! wouldBeDropped(&reads[1])) {
+        unsigned keyLength = PairKeyLength(&reads[0]);
+        if (keyLength == PairKeyLength(&reads[1]) && ! memcmp(reads[0].getId(), reads[1].getId(), keyLength)) {
+            //
+            // Mates, so they go out the way the matcher would put them: the second one by its own flags, the first
+            // in the other place.
+            //
+            int secondToOutputRead = (reads[1].getOriginalSAMFlags() & SAM_FIRST_SEGMENT) ? 0 : 1;
+            *(0 == secondToOutputRead ? read1 : read2) = reads[1];
+            *(0 == secondToOutputRead ? read2 : read1) = reads[0];
+            return true;
+        }
+    }
+
+    if (0 == nReads) {
+        //
+        // Cleanly at eof.
+        //
+        for (int i = 0; i < 2; i++) {
+            if (! batch[i].isZero()) {
+                source->releaseBatch(batch[i]);
+                batch[i] = DataBatch();
+            }
+        }
+        return false;
+    }
+
+    //
+    // Not name grouped after all (or at eof with a read left over, or there's a read to drop).  Let the matcher have
+    // these reads and the rest of the file.
+    //
+    for (int i = 0; i < nReads; i++) {
+        source->pushBack(reads[i]);
+    }
+    matcher = new PairedReadMatcher(source, quicklyDropUnpairedReads);
+    return getNextReadPair(read1, read2);
+}
+
+    static bool
+HeaderSaysNameGrouped(
+    const ReaderContext* context)
+{
+    //
+    // @HD with SO:queryname, or GO:query (which is how SNAP's own -sn output says it).
+    //
+    if (NULL == context->header || context->headerLength < 3 || strncmp(context->header, "@HD", 3)) {
+        return false;
+    }
+    const char* end = (const char*) memchr(context->header, '\n', context->headerLength);
+    size_t lineLength = NULL == end ? context->headerLength : end - context->header;
+    std::string line(context->header, lineLength);
+    return std::string::npos != line.find("\tSO:queryname") || std::string::npos != line.find("\tGO:query");
+}
+
 // define static factory function
 
     PairedReadReader*
@@ -429,5 +1138,19 @@ PairedReadReader::PairMatcher(
     ReadReader* single,
     bool quicklyDropUnpairedReads)
 {
+    if (HeaderSaysNameGrouped(single->getContext())) {
+        return new AdjacentPairReader(single, quicklyDropUnpairedReads);
+    }
     return new PairedReadMatcher(single, quicklyDropUnpairedReads);
 }
+
+    void
+PairedReadReader::SpillUnpairedReads(
+    size_t memoryLimit,
+    const char* tempFilePrefix)
+{
+    SpillMemoryLimit = memoryLimit;
+    if (NULL != tempFilePrefix) {
+        SpillFilePrefix = tempFilePrefix;
+    }
+}
@@ -0,0 +1,875 @@
+/*++
+
+Module Name:
+
+    ParallelInflate.cpp
+
+Abstract:
+
+    Inflating an ordinary gzip file on several threads.  See ParallelInflate.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ParallelInflate.h"
+#include "BigAlloc.h"
+#include "Error.h"
+#include "exit.h"
+#include "ProgressReport.h"
+#include "PipelineTrace.h"
+
+const _int64 ParallelInflater::OverflowBytes;
+const _int64 ParallelInflater::MinChunkBytes;
+const int ParallelInflater::WindowSize;
+
+//
+// Split the output into pieces no bigger than this to copy it out and work out its CRC, so one chunk that ends up with most
+// of a batch's output doesn't leave that to one thread.
+//
+static const _int64 MaxSegmentBytes = 1024 * 1024;
+
+    static z_stream *
+NewRawStream()
+{
+    z_stream *stream = new z_stream;
+    memset(stream, 0, sizeof(*stream));     // zlib's own allocator
+    int status = inflateInit2(stream, -MAX_WBITS);
+    if (Z_OK != status) {
+        WriteErrorMessage("ParallelInflater: inflateInit2 failed with %d\n", status);
+        soft_exit(1);
+    }
+    return stream;
+}
+
+    static void
+DeleteStream(z_stream *stream)
+{
+    inflateEnd(stream);
+    delete stream;
+}
+
+ParallelInflater::ParallelInflater(int i_numThreads) :
+    numThreads(__max(1, i_numThreads)), nChunks(0), outputBytes(0), outputBuffer(NULL), input(NULL), startBytes(0), validBytes(0),
+    state(MemberHeader), bitOffset(0), memberCrc(0), memberSize(0), chunksUsed(0), chunksDiscarded(0), phase(InflatePhase),
+    manager(this)
+{
+    chunks = new Chunk[numThreads];
+    for (int i = 0; i < numThreads; i++) {
+        Chunk *chunk = &chunks[i];
+        chunk->stream = NewRawStream();
+        chunk->shadow = NewRawStream();
+        chunk->output = NULL;
+        chunk->outputSize = 0;
+        chunk->outputBytes = 0;
+        chunk->shadowOutput = NULL;
+        chunk->shadowSize = 0;
+        chunk->markerBytes = 0;
+        chunk->window = new char[WindowSize];
+    }
+
+    history = new char[WindowSize];
+    memset(history, 0, WindowSize);
+    scratchWindow = new char[WindowSize];
+
+    //
+    // Position p in the window is (p & 0xff) in the first dictionary, and that xor'ed with (p >> 8) + 1 in the second.  So a
+    // byte that comes from the window is different in the two outputs, and the pair of them says where it came from.
+    //
+    for (int i = 0; i < 2; i++) {
+        markerDictionary[i] = new char[WindowSize];
+    }
+    for (int p = 0; p < WindowSize; p++) {
+        markerDictionary[0][p] = (char)(p & 0xff);
+        markerDictionary[1][p] = (char)((p & 0xff) ^ ((p >> 8) + 1));
+    }
+
+    coworker = new ParallelCoworker(numThreads, false, &manager);
+    coworker->start();
+}
+
+ParallelInflater::~ParallelInflater()
+{
+    coworker->stop();
+    delete coworker;
+
+    for (int i = 0; i < numThreads; i++) {
+        Chunk *chunk = &chunks[i];
+        DeleteStream(chunk->stream);
+        DeleteStream(chunk->shadow);
+        if (NULL != chunk->output) {
+            BigDealloc(chunk->output);
+        }
+        if (NULL != chunk->shadowOutput) {
+            BigDealloc(chunk->shadowOutput);
+        }
+        delete [] chunk->window;
+    }
+    delete [] chunks;
+    delete [] history;
+    delete [] scratchWindow;
+    for (int i = 0; i < 2; i++) {
+        delete [] markerDictionary[i];
+    }
+}
+
+    void
+ParallelInflater::Worker::step()
+{
+    _int64 start = timeInNanos();
+    ParallelInflater *inflater = ((Manager *)getManager())->inflater;
+    int count = InflatePhase == inflater->phase ? inflater->nChunks : (int)inflater->segments.size();
+    for (int i = getThreadNum(); i < count; i += getNumThreads()) {
+        if (InflatePhase == inflater->phase) {
+            inflater->inflateChunk(i);
+        } else {
+            inflater->copySegment(i);
+        }
+    }
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::DecompressNanos, EndPipelineTraceSpan(DecompressTraceEvent, start));
+}
+
+    bool
+ParallelInflater::inflate(
+    const char *i_input,
+    _int64 i_startBytes,
+    _int64 i_validBytes,
+    _int64 *o_inputUsed,
+    _int64 *o_outputBytes)
+{
+    if (i_validBytes > 0xffffffff) {
+        WriteErrorMessage("ParallelInflater: batch of %lld bytes is too big for zlib\n", i_validBytes);
+        return false;
+    }
+    input = i_input;
+    startBytes = i_startBytes;
+    validBytes = i_validBytes;
+    pieces.clear();
+    memberEnds.clear();
+    segments.clear();
+    outputBytes = 0;
+
+    //
+    // Get the real stream going in chunk 0, from wherever the last batch left it.
+    //
+    Chunk *first = &chunks[0];
+    first->outputBytes = 0;
+    first->markerBytes = 0;
+    first->speculative = false;
+    first->realWindow = true;
+    memcpy(first->window, history, WindowSize);
+
+    _int64 offset = 0;
+    if (MemberTrailer == state) {
+        if (!readTrailer(0, 0)) {
+            WriteErrorMessage("gzip file is truncated\n");
+            return false;
+        }
+        offset = 8;
+        state = MemberHeader;
+    }
+
+    if (MemberHeader == state) {
+        if (offset == validBytes) {
+            //
+            // Nothing after the trailer.  It's the end of the file.
+            //
+            *o_inputUsed = offset;
+            *o_outputBytes = 0;
+            return true;
+        }
+        _int64 headerBytes = HeaderBytes((const _uint8 *)input + offset, validBytes - offset);
+        if (headerBytes <= 0) {
+            WriteErrorMessage("%s\n", headerBytes < 0 ? "not in gzip format" : "gzip header is truncated or too long");
+            return false;
+        }
+        first->start = (offset + headerBytes) * 8;
+        startStream(first->stream, first->start, NULL);
+    } else if (BlockBoundary == state) {
+        first->start = bitOffset;
+        startStream(first->stream, first->start, history);
+    } else {
+        _ASSERT(MidBlock == state);
+        first->start = 0;
+        first->stream->next_in = (Bytef *)input;
+        first->stream->avail_in = (uInt)validBytes;
+    }
+
+    //
+    // Split the batch into chunks, and inflate them all at once, each but the first from the first thing that looks like a
+    // dynamic Huffman block in its range.  Each stops at the first block boundary in the next chunk's range.  The others
+    // are inflated twice, so the first gets twice as much.
+    //
+    nChunks = (int)__max((_int64)1, __min((_int64)numThreads, startBytes / MinChunkBytes));
+    for (int i = 0; i < nChunks; i++) {
+        Chunk *chunk = &chunks[i];
+        chunk->searchFrom = 0 == i ? 0 : startBytes * (i + 1) / (nChunks + 1) * 8;
+        chunk->searchTo = chunk->limit = startBytes * (i + 2) / (nChunks + 1) * 8;
+        if (i > 0) {
+            chunk->speculative = true;
+            chunk->realWindow = false;
+        }
+    }
+    phase = InflatePhase;
+    coworker->step();
+
+    _int64 start = timeInNanos();
+    if (!first->ok) {
+        WriteErrorMessage("error in gzip compressed data\n");
+        return false;
+    }
+
+    //
+    // Follow the real stream through the chunks.  Wherever it gets to a block boundary that one of them started on, that
+    // chunk's output comes next; anywhere else, it's inflated on here to the next chunk's start.
+    //
+    pieces.push_back(0);
+    int real = 0;
+    int next = 1;
+    for (;;) {
+        Chunk *chunk = &chunks[real];
+        if (StoppedAtInputEnd == chunk->stop) {
+            //
+            // The block goes on into the next batch, so the stream itself carries on there.
+            //
+            fixDictionary(chunk);
+            if (0 != real) {
+                z_stream *stream = chunks[0].stream;
+                chunks[0].stream = chunk->stream;
+                chunk->stream = stream;
+            }
+            state = MidBlock;
+            *o_inputUsed = validBytes;
+            break;
+        }
+
+        _int64 position;
+        if (StoppedAtMemberEnd == chunk->stop) {
+            _int64 trailer = (chunk->end + 7) / 8;
+            if (trailer >= startBytes || !readTrailer(trailer, outputBytes + chunk->outputBytes)) {
+                state = MemberTrailer;
+                *o_inputUsed = trailer;
+                break;
+            }
+            _int64 header = trailer + 8;
+            if (header >= startBytes) {
+                state = MemberHeader;
+                *o_inputUsed = header;
+                break;
+            }
+            _int64 headerBytes = HeaderBytes((const _uint8 *)input + header, validBytes - header);
+            if (headerBytes <= 0) {
+                WriteErrorMessage("%s\n", headerBytes < 0 ? "trailing garbage after gzip data" : "gzip header is truncated or too long");
+                return false;
+            }
+            //
+            // A new member doesn't refer back to the last one, so the stream can start on it whatever window it had.
+            //
+            position = (header + headerBytes) * 8;
+            startStream(chunk->stream, position, NULL);
+            chunk->realWindow = true;
+        } else {
+            position = chunk->end;
+            if (position >= startBytes * 8) {
+                state = BlockBoundary;
+                bitOffset = (int)(position % 8);
+                *o_inputUsed = position / 8;
+                break;
+            }
+        }
+
+        while (next < nChunks && (!chunks[next].ok || chunks[next].start < position)) {
+            chunksDiscarded++;
+            next++;
+        }
+        if (next < nChunks && chunks[next].start == position && StoppedAtBoundary == chunk->stop) {
+            windowAfter(chunk, chunks[next].window);
+            outputBytes += chunk->outputBytes;
+            pieces.push_back(next);
+            chunksUsed++;
+            real = next++;
+            continue;
+        }
+
+        fixDictionary(chunk);
+        if (!inflateTo(chunk, next < nChunks ? chunks[next].start : startBytes * 8)) {
+            WriteErrorMessage("error in gzip compressed data\n");
+            return false;
+        }
+    }
+    chunksDiscarded += nChunks - next;
+    outputBytes += chunks[real].outputBytes;
+
+    //
+    // Lay out the output, and cut it up for copying out and working out its CRC.  No piece of it spans the end of a member.
+    //
+    _int64 outputOffset = 0;
+    int whichEnd = 0;
+    for (int i = 0; i < pieces.size(); i++) {
+        Chunk *chunk = &chunks[pieces[i]];
+        chunk->outputOffset = outputOffset;
+        _int64 pieceEnd = outputOffset + chunk->outputBytes;
+        while (outputOffset < pieceEnd) {
+            while (whichEnd < memberEnds.size() && memberEnds[whichEnd].outputOffset <= outputOffset) {
+                whichEnd++;
+            }
+            _int64 segmentEnd = __min(pieceEnd, outputOffset + MaxSegmentBytes);
+            if (whichEnd < memberEnds.size()) {
+                segmentEnd = __min(segmentEnd, memberEnds[whichEnd].outputOffset);
+            }
+            CrcSegment segment = {pieces[i], outputOffset, segmentEnd - outputOffset, 0};
+            segments.push_back(segment);
+            outputOffset = segmentEnd;
+        }
+    }
+    _ASSERT(outputOffset == outputBytes);
+
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::DecompressNanos, EndPipelineTraceSpan(DecompressTraceEvent, start));
+    *o_outputBytes = outputBytes;
+    return true;
+}
+
+    bool
+ParallelInflater::getOutput(
+    char *output)
+{
+    outputBuffer = output;
+    phase = CopyPhase;
+    coworker->step();
+
+    int whichEnd = 0;
+    for (int i = 0; i <= segments.size(); i++) {
+        _int64 segmentStart = i < segments.size() ? segments[i].outputOffset : outputBytes;
+        for (; whichEnd < memberEnds.size() && memberEnds[whichEnd].outputOffset <= segmentStart; whichEnd++) {
+            if (memberEnds[whichEnd].crc != memberCrc || memberEnds[whichEnd].size != memberSize) {
+                WriteErrorMessage("gzip data doesn't match its %s\n", memberEnds[whichEnd].crc != memberCrc ? "CRC" : "length");
+                return false;
+            }
+            memberCrc = 0;
+            memberSize = 0;
+        }
+        if (i < segments.size()) {
+            memberCrc = (_uint32)crc32_combine(memberCrc, segments[i].crc, (z_off_t)segments[i].length);
+            memberSize += (_uint32)segments[i].length;
+        }
+    }
+
+    if (outputBytes >= WindowSize) {
+        memcpy(history, output + outputBytes - WindowSize, WindowSize);
+    } else {
+        memmove(history, history + outputBytes, WindowSize - outputBytes);
+        memcpy(history + WindowSize - outputBytes, output, outputBytes);
+    }
+    return true;
+}
+
+    bool
+ParallelInflater::atMemberEnd()
+{
+    return MemberHeader == state;
+}
+
+    void
+ParallelInflater::getStats(
+    _int64 *o_chunksUsed,
+    _int64 *o_chunksDiscarded)
+{
+    *o_chunksUsed = chunksUsed;
+    *o_chunksDiscarded = chunksDiscarded;
+}
+
+    void
+ParallelInflater::inflateChunk(
+    int whichChunk)
+{
+    Chunk *chunk = &chunks[whichChunk];
+    if (!chunk->speculative) {
+        chunk->ok = inflateTo(chunk, chunk->limit);
+        return;
+    }
+
+    //
+    // A false boundary almost always fails in its first block, so just look for the next one.
+    //
+    chunk->ok = false;
+    for (_int64 from = chunk->searchFrom; ; from = chunk->start + 1) {
+        chunk->start = FindBlock((const _uint8 *)input, validBytes, from, chunk->searchTo);
+        if (chunk->start < 0) {
+            return;
+        }
+        chunk->outputBytes = 0;
+        startStream(chunk->stream, chunk->start, markerDictionary[0]);
+        if (inflateTo(chunk, chunk->limit) && inflateShadow(chunk)) {
+            chunk->ok = true;
+            return;
+        }
+    }
+}
+
+    void
+ParallelInflater::copySegment(
+    int whichSegment)
+{
+    CrcSegment *segment = &segments[whichSegment];
+    Chunk *chunk = &chunks[segment->chunk];
+    _int64 from = segment->outputOffset - chunk->outputOffset;
+    resolve(chunk, from, from + segment->length, outputBuffer + segment->outputOffset);
+    segment->crc = (_uint32)crc32(0, (const Bytef *)outputBuffer + segment->outputOffset, (uInt)segment->length);
+}
+
+    void
+ParallelInflater::startStream(
+    z_stream *stream,
+    _int64 bitOffset,
+    const char *dictionary)
+{
+    inflateReset(stream);
+    _int64 byte = bitOffset / 8;
+    int bits = (int)(bitOffset % 8);
+    if (0 != bits) {
+        inflatePrime(stream, 8 - bits, (_uint8)input[byte] >> bits);
+        byte++;
+    }
+    stream->next_in = (Bytef *)input + byte;
+    stream->avail_in = (uInt)(validBytes - byte);
+    if (NULL != dictionary) {
+        inflateSetDictionary(stream, (const Bytef *)dictionary, WindowSize);
+    }
+}
+
+    bool
+ParallelInflater::inflateTo(
+    Chunk *chunk,
+    _int64 limit)
+/*++
+
+Routine Description:
+
+    Inflate a chunk's stream on from wherever it is to a block boundary at or after limit (a bit offset into the input), the end
+    of its gzip member, or the end of the input, whichever comes first.
+
+Return Value:
+
+    false if the data isn't valid deflate.
+
+--*/
+{
+    z_stream *stream = chunk->stream;
+    for (;;) {
+        if (chunk->outputBytes == chunk->outputSize) {
+            growOutput(&chunk->output, &chunk->outputSize, chunk->outputBytes);
+        }
+        stream->next_out = (Bytef *)chunk->output + chunk->outputBytes;
+        stream->avail_out = (uInt)(chunk->outputSize - chunk->outputBytes);
+        int status = ::inflate(stream, Z_BLOCK);
+        chunk->outputBytes = (char *)stream->next_out - chunk->output;
+
+        chunk->end = ((const char *)stream->next_in - input) * 8 - (stream->data_type & 7);
+        if (Z_STREAM_END == status) {
+            chunk->stop = StoppedAtMemberEnd;
+            return true;
+        }
+        if (Z_OK != status && !(Z_BUF_ERROR == status && 0 == stream->avail_in)) {
+            return false;
+        }
+        if ((stream->data_type & 128) && chunk->end >= limit) {
+            chunk->stop = StoppedAtBoundary;
+            return true;
+        }
+        if (0 == stream->avail_in && 0 != stream->avail_out) {
+            chunk->stop = StoppedAtInputEnd;
+            return true;
+        }
+    }
+}
+
+    bool
+ParallelInflater::inflateShadow(
+    Chunk *chunk)
+/*++
+
+Routine Description:
+
+    Inflate a speculative chunk again with the second marker dictionary, as far as it takes to find the last byte of its
+    output that might have come from the window: until 32KB in a row comes out the same as the first time, or it's all done.
+
+--*/
+{
+    z_stream *shadow = chunk->shadow;
+    startStream(shadow, chunk->start, markerDictionary[1]);
+    _int64 produced = 0;
+    _int64 lastDifference = -1;
+    while (produced < chunk->outputBytes && produced - (lastDifference + 1) < WindowSize) {
+        if (produced == chunk->shadowSize) {
+            growOutput(&chunk->shadowOutput, &chunk->shadowSize, produced);
+        }
+        shadow->next_out = (Bytef *)chunk->shadowOutput + produced;
+        shadow->avail_out = (uInt)__min(chunk->outputBytes - produced, __min(chunk->shadowSize - produced, (_int64)WindowSize));
+        int status = ::inflate(shadow, Z_NO_FLUSH);
+        _int64 newlyProduced = (char *)shadow->next_out - (chunk->shadowOutput + produced);
+        produced += newlyProduced;
+        for (_int64 i = produced; i > __max(produced - newlyProduced, lastDifference + 1); i--) {
+            if (chunk->shadowOutput[i - 1] != chunk->output[i - 1]) {
+                lastDifference = i - 1;
+                break;
+            }
+        }
+        if ((Z_OK != status && Z_STREAM_END != status) || 0 == newlyProduced) {
+            if (produced < chunk->outputBytes && produced - (lastDifference + 1) < WindowSize) {
+                return false;   // Can't happen: it's the same stream as before
+            }
+            break;
+        }
+    }
+    chunk->markerBytes = lastDifference + 1;
+    return true;
+}
+
+    void
+ParallelInflater::resolve(
+    Chunk *chunk,
+    _int64 from,
+    _int64 to,
+    char *output)
+/*++
+
+Routine Description:
+
+    Copy bytes from..to of a chunk's output, with those that came from the window looked up in it.
+
+--*/
+{
+    const _uint8 *first = (const _uint8 *)chunk->output;
+    const _uint8 *second = (const _uint8 *)chunk->shadowOutput;
+    _int64 markerEnd = __max(from, __min(to, chunk->markerBytes));
+    for (_int64 i = from; i < markerEnd; ) {
+        if (i + 8 <= markerEnd) {
+            _uint64 firstWord, secondWord;
+            memcpy(&firstWord, first + i, 8);
+            memcpy(&secondWord, second + i, 8);
+            if (firstWord == secondWord) {  // As most of it is
+                memcpy(output + i - from, first + i, 8);
+                i += 8;
+                continue;
+            }
+        }
+        output[i - from] = first[i] == second[i] ? first[i] : chunk->window[first[i] | (((first[i] ^ second[i]) - 1) << 8)];
+        i++;
+    }
+    memcpy(output + markerEnd - from, chunk->output + markerEnd, to - markerEnd);
+}
+
+    void
+ParallelInflater::windowAfter(
+    Chunk *chunk,
+    char *window)
+{
+    _ASSERT(window != chunk->window);
+    _int64 n = chunk->outputBytes;
+    if (n < WindowSize) {
+        memcpy(window, chunk->window + n, WindowSize - n);
+        resolve(chunk, 0, n, window + WindowSize - n);
+    } else {
+        resolve(chunk, n - WindowSize, n, window);
+    }
+}
+
+    void
+ParallelInflater::fixDictionary(
+    Chunk *chunk)
+/*++
+
+Routine Description:
+
+    Before inflating on a stream that was started with a marker dictionary, give it the window it really has.  (zlib lets
+    a raw stream have its dictionary set at any time.)
+
+--*/
+{
+    if (chunk->realWindow) {
+        return;
+    }
+    windowAfter(chunk, scratchWindow);
+    inflateSetDictionary(chunk->stream, (const Bytef *)scratchWindow, WindowSize);
+    chunk->realWindow = true;
+}
+
+    void
+ParallelInflater::growOutput(
+    char **buffer,
+    _int64 *size,
+    _int64 keep)
+{
+    _int64 newSize = __max(2 * *size, (_int64)4 * 1024 * 1024);
+    char *newBuffer = (char *)BigAlloc(newSize);
+    if (keep > 0) {
+        memcpy(newBuffer, *buffer, keep);
+    }
+    if (NULL != *buffer) {
+        BigDealloc(*buffer);
+    }
+    *buffer = newBuffer;
+    *size = newSize;
+}
+
+    bool
+ParallelInflater::readTrailer(
+    _int64 offset,
+    _int64 outputOffset)
+{
+    if (offset + 8 > validBytes) {
+        return false;
+    }
+    const _uint8 *trailer = (const _uint8 *)input + offset;
+    MemberEnd end;
+    end.outputOffset = outputOffset;
+    end.crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((_uint32)trailer[3] << 24);
+    end.size = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((_uint32)trailer[7] << 24);
+    memberEnds.push_back(end);
+    return true;
+}
+
+    _int64
+ParallelInflater::HeaderBytes(
+    const _uint8 *header,
+    _int64 bytes)
+/*++
+
+Routine Description:
+
+    Find the length of a gzip member header.
+
+Return Value:
+
+    The length, 0 if it runs off the end of the data, or -1 if it isn't a gzip header.
+
+--*/
+{
+    static const _uint8 magic[3] = {0x1f, 0x8b, 8};    // ID1, ID2 and CM (deflate)
+    for (int i = 0; i < 3 && i < bytes; i++) {
+        if (header[i] != magic[i]) {
+            return -1;
+        }
+    }
+    if (bytes < 10) {
+        return 0;
+    }
+    int flags = header[3];
+    if (flags & 0xe0) {
+        return -1;
+    }
+    _int64 length = 10;
+    if (flags & 4) {    // FEXTRA
+        if (length + 2 > bytes) {
+            return 0;
+        }
+        length += 2 + (header[length] | (header[length + 1] << 8));
+    }
+    for (int flag = 8; flag <= 16; flag <<= 1) {   // FNAME and FCOMMENT, both zero terminated
+        if (flags & flag) {
+            while (length < bytes && 0 != header[length]) {
+                length++;
+            }
+            length++;
+        }
+    }
+    if (flags & 2) {    // FHCRC
+        length += 2;
+    }
+    return length <= bytes ? length : 0;
+}
+
+//
+// The n (up to 25) bits at bitOffset, or -1 if they run off the end.
+//
+    static inline int
+GetBits(const _uint8 *input, _int64 inputBytes, _int64 bitOffset, int n)
+{
+    if (bitOffset + n > inputBytes * 8) {
+        return -1;
+    }
+    _int64 byte = bitOffset / 8;
+    _uint32 word;
+    if (byte + 4 <= inputBytes) {
+        memcpy(&word, input + byte, 4);
+    } else {
+        word = 0;
+        for (int i = 0; byte + i < inputBytes; i++) {
+            word |= (_uint32)input[byte + i] << (8 * i);
+        }
+    }
+    return (int)((word >> (bitOffset % 8)) & ((1 << n) - 1));
+}
+
+//
+// Check a set of Huffman code lengths the way zlib does: not over-subscribed, and complete unless there's at most one code
+// (or mustBeComplete).
+//
+    static bool
+IsValidCode(const int *lengths, int n, bool mustBeComplete)
+{
+    int count[16] = {0};
+    int maxLength = 0;
+    for (int i = 0; i < n; i++) {
+        count[lengths[i]]++;
+        maxLength = __max(maxLength, lengths[i]);
+    }
+    int left = 1;
+    for (int length = 1; length < 16; length++) {
+        left = (left << 1) - count[length];
+        if (left < 0) {
+            return false;
+        }
+    }
+    return 0 == left || (!mustBeComplete && maxLength <= 1);
+}
+
+    bool
+ParallelInflater::IsBlockHeader(
+    const _uint8 *input,
+    _int64 inputBytes,
+    _int64 bitOffset)
+/*++
+
+Routine Description:
+
+    See whether there's what could be the header of a dynamic Huffman block at bitOffset: a complete code length code that
+    decodes to literal/length and distance codes zlib would take, with an end of block code.
+
+--*/
+{
+    int header = GetBits(input, inputBytes, bitOffset, 17);
+    if (header < 0 || 2 != ((header >> 1) & 3)) {  // BFINAL, then BTYPE
+        return false;
+    }
+    int nLengths = 257 + ((header >> 3) & 31);
+    int nDistances = 1 + ((header >> 8) & 31);
+    int nCodeLengths = 4 + ((header >> 13) & 15);
+    if (nLengths > 286 || nDistances > 30) {
+        return false;
+    }
+
+    static const int order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    int codeLengths[19] = {0};
+    _int64 bit = bitOffset + 17;
+    for (int i = 0; i < nCodeLengths; i++, bit += 3) {
+        int length = GetBits(input, inputBytes, bit, 3);
+        if (length < 0) {
+            return false;
+        }
+        codeLengths[order[i]] = length;
+    }
+    if (!IsValidCode(codeLengths, 19, true)) {
+        return false;
+    }
+
+    //
+    // Canonical decoding, as in zlib's puff.c.
+    //
+    int count[8] = {0};
+    int offsets[8];
+    int symbols[19];
+    for (int i = 0; i < 19; i++) {
+        count[codeLengths[i]]++;
+    }
+    offsets[1] = 0;
+    for (int length = 1; length < 7; length++) {
+        offsets[length + 1] = offsets[length] + count[length];
+    }
+    for (int i = 0; i < 19; i++) {
+        if (0 != codeLengths[i]) {
+            symbols[offsets[codeLengths[i]]++] = i;
+        }
+    }
+
+    int lengths[286 + 30];
+    int total = nLengths + nDistances;
+    for (int i = 0; i < total; ) {
+        int code = 0, firstCode = 0, index = 0, symbol = -1;
+        for (int length = 1; length <= 7; length++) {
+            int b = GetBits(input, inputBytes, bit++, 1);
+            if (b < 0) {
+                return false;
+            }
+            code |= b;
+            if (code - count[length] < firstCode) {
+                symbol = symbols[index + code - firstCode];
+                break;
+            }
+            index += count[length];
+            firstCode = (firstCode + count[length]) << 1;
+            code <<= 1;
+        }
+        if (symbol < 0) {
+            return false;
+        }
+        if (symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+        }
+        int value = 0, repeat;
+        if (16 == symbol) {
+            if (0 == i) {
+                return false;
+            }
+            value = lengths[i - 1];
+            repeat = 3 + GetBits(input, inputBytes, bit, 2);
+            bit += 2;
+        } else if (17 == symbol) {
+            repeat = 3 + GetBits(input, inputBytes, bit, 3);
+            bit += 3;
+        } else {
+            repeat = 11 + GetBits(input, inputBytes, bit, 7);
+            bit += 7;
+        }
+        if (bit > inputBytes * 8 || i + repeat > total) {
+            return false;
+        }
+        while (repeat-- > 0) {
+            lengths[i++] = value;
+        }
+    }
+
+    return 0 != lengths[256] && IsValidCode(lengths, nLengths, false) && IsValidCode(lengths + nLengths, nDistances, false);
+}
+
+    _int64
+ParallelInflater::FindBlock(
+    const _uint8 *input,
+    _int64 inputBytes,
+    _int64 from,
+    _int64 to)
+{
+    for (_int64 bit = from; bit < to; bit++) {
+        _int64 byte = bit / 8;
+        if (byte + 16 <= inputBytes) {
+            //
+            // Most places fail on the first few fields or the code length code, so check those quickly first.
+            //
+            _uint64 header, codeLengths;
+            memcpy(&header, input + byte, 8);
+            header >>= bit % 8;
+            if (2 != ((header >> 1) & 3) || ((header >> 3) & 31) > 29 || ((header >> 8) & 31) > 29) {
+                continue;
+            }
+            int nCodeLengths = 4 + (int)((header >> 13) & 15);
+            memcpy(&codeLengths, input + (bit + 17) / 8, 8);
+            codeLengths >>= (bit + 17) % 8;
+            int kraft = 0;
+            for (int i = 0; i < nCodeLengths; i++, codeLengths >>= 3) {
+                int length = (int)(codeLengths & 7);
+                kraft += 0 == length ? 0 : 128 >> length;
+            }
+            if (128 != kraft) {
+                continue;
+            }
+        }
+        if (IsBlockHeader(input, inputBytes, bit)) {
+            return bit;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,179 @@
+/*++
+
+Module Name:
+
+    ParallelInflate.h
+
+Abstract:
+
+    Inflate an ordinary gzip file (one that isn't BGZF) on several threads at once.
+
+    A gzip member is one deflate stream, and each block in it may copy from the 32KB before it, so it can't simply be
+    cut up like BGZF.  What can be done (as pugz and rapidgzip do) is to split each batch of compressed data into chunks,
+    and for each chunk but the first, look for something that parses as the header of a dynamic Huffman block, and
+    inflate from there on the chance that it really is a block boundary.  The 32KB the chunk would copy from isn't known
+    yet, so it's inflated twice, with dictionaries that give each position in the window a different pair of bytes;
+    where the two outputs differ, the pair says which byte of the window it was.  The second pass stops once 32KB has come
+    out the same both ways, since nothing after that can reach back into the window.
+
+    The chunks are then put together in order.  The chunk before each one stops at its first block boundary past the
+    start of the next chunk's range, and if that's exactly where the next chunk's block starts, the guess was right, and
+    its window is the end of what came before.  If not (a false boundary, or one of the stored or fixed Huffman blocks
+    that aren't looked for), the stream is inflated on from where the earlier chunk stopped, on one thread, until it
+    catches up with a chunk that started in the right place, or the batch ends.  So whatever the data, the output is
+    just what zlib would make of it.  Each gzip member's CRC and length are checked against its trailer.
+
+    A batch ends at the first block boundary at or after the end of its compressed data, which it reads on into the
+    overflow to find, and the next batch starts there, with the bit offset and window carried over.  If a block runs
+    past the end of the overflow, the stream itself carries over.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "BigAlloc.h"
+#include "VariableSizeVector.h"
+#include "ParallelTask.h"
+#include "zlib.h"
+
+class ParallelInflater {
+public:
+    ParallelInflater(int i_numThreads);
+    ~ParallelInflater();
+
+    static const _int64 OverflowBytes = 1024 * 1024;    // How much of the next batch to ask the inner reader for, to finish a block
+    static const _int64 MinChunkBytes = 256 * 1024;     // The least compressed data worth a thread of its own
+
+    //
+    // Inflate the next batch of the file.  input has the rest of the compressed data that's been read, the first startBytes
+    // of it belonging to this batch, and the rest of validBytes the overflow into the next.  *o_inputUsed is how much of it the
+    // batch took, which is at least startBytes unless it's the end of the file, and *o_outputBytes how much it inflated to.
+    // Returns false, having written an error message, if the data isn't gzip.
+    //
+    bool inflate(const char *input, _int64 startBytes, _int64 validBytes, _int64 *o_inputUsed, _int64 *o_outputBytes);
+
+    //
+    // Copy what the last inflate inflated into output, which has room for *o_outputBytes.  Returns false, having written an
+    // error message, if a gzip member's CRC or length doesn't match its trailer.
+    //
+    bool getOutput(char *output);
+
+    bool atMemberEnd();     // After the last batch: false if the file was truncated
+
+    void getStats(_int64 *o_chunksUsed, _int64 *o_chunksDiscarded);   // Of the chunks that were inflated on a guess
+
+private:
+
+    static const int WindowSize = 32 * 1024;
+
+    enum StreamState {
+        MemberHeader,       // Next comes a gzip header, or the end of the file
+        BlockBoundary,      // Next comes a deflate block, bitOffset into the first byte
+        MidBlock,           // The stream in chunk 0 carries on
+        MemberTrailer       // Next comes a gzip trailer
+    };
+
+    enum ChunkStop {
+        StoppedAtBoundary,  // At a block boundary at or after the limit
+        StoppedAtMemberEnd, // After the last block of a gzip member
+        StoppedAtInputEnd   // Used up all of the input, partway through a block
+    };
+
+    struct Chunk {
+        z_stream *stream;           // Inflating with the first marker dictionary, or for real if !speculative
+        z_stream *shadow;           // Inflating with the second marker dictionary
+        char *output;
+        _int64 outputSize;
+        _int64 outputBytes;
+        char *shadowOutput;
+        _int64 shadowSize;
+        _int64 markerBytes;         // The output before this may refer to the window
+        char *window;               // The WindowSize bytes before the chunk's output, once it's known
+        bool speculative;           // Started on a guessed block boundary, with a marker dictionary
+        bool realWindow;            // The stream's window is what was really there, not markers
+        bool ok;                    // Found a block that inflated
+        _int64 searchFrom, searchTo;// Bit offsets to look for the first block in
+        _int64 limit;               // Bit offset to stop at the first block boundary at or after
+        _int64 start;               // Bit offset it started at
+        _int64 end;                 // Bit offset it stopped at
+        ChunkStop stop;
+        _int64 outputOffset;        // Where its output goes in the batch's
+    };
+
+    struct MemberEnd {
+        _int64 outputOffset;
+        _uint32 crc;
+        _uint32 size;
+    };
+
+    struct CrcSegment {
+        int chunk;
+        _int64 outputOffset;
+        _int64 length;
+        _uint32 crc;
+    };
+
+    enum Phase {InflatePhase, CopyPhase};
+
+    class Worker : public ParallelWorker {
+    public:
+        virtual void step();
+    };
+
+    class Manager : public ParallelWorkerManager {
+    public:
+        Manager(ParallelInflater *i_inflater) : inflater(i_inflater) {}
+        virtual ParallelWorker *createWorker() {return new Worker();}
+        ParallelInflater *inflater;
+    };
+
+    // The parallel parts
+    void inflateChunk(int whichChunk);
+    void copySegment(int whichSegment);
+
+    bool inflateTo(Chunk *chunk, _int64 limit);
+    void startStream(z_stream *stream, _int64 bitOffset, const char *dictionary);
+    bool inflateShadow(Chunk *chunk);
+    void resolve(Chunk *chunk, _int64 from, _int64 to, char *output);
+    void windowAfter(Chunk *chunk, char *window);
+    void fixDictionary(Chunk *chunk);
+    void growOutput(char **buffer, _int64 *size, _int64 keep);
+    bool readTrailer(_int64 offset, _int64 outputOffset);
+
+    static _int64 FindBlock(const _uint8 *input, _int64 inputBytes, _int64 from, _int64 to);
+    static bool IsBlockHeader(const _uint8 *input, _int64 inputBytes, _int64 bitOffset);
+    static _int64 HeaderBytes(const _uint8 *input, _int64 inputBytes);
+
+    const int numThreads;
+    Chunk *chunks;
+    int nChunks;
+    VariableSizeVector<int> pieces;             // The chunks whose output makes up the batch's, in order
+    VariableSizeVector<MemberEnd> memberEnds;
+    VariableSizeVector<CrcSegment> segments;
+    _int64 outputBytes;
+    char *outputBuffer;                         // Where getOutput is putting it
+
+    const char *input;
+    _int64 startBytes;
+    _int64 validBytes;
+
+    StreamState state;
+    int bitOffset;
+    char *history;                              // The last WindowSize bytes of output, oldest first
+    char *scratchWindow;
+    char *markerDictionary[2];
+    _uint32 memberCrc;
+    _uint32 memberSize;
+
+    _int64 chunksUsed;
+    _int64 chunksDiscarded;
+
+    Phase phase;
+    Manager manager;
+    ParallelCoworker *coworker;
+};
@@ -17,9 +17,90 @@ Environment:
 #include "stdafx.h"
 #include "ParallelTask.h"
 #include "Error.h"
+#include "CommandProcessor.h"
 
 using std::max;
 
+struct PooledThread
+{
+    ThreadMainFunction  mainFunction;
+    void               *mainFunctionParameter;
+    NamedPipe          *commandPipe;   // The starting thread's, so that messages go to the same daemon client
+    EventObject         workReady;
+    PooledThread       *next;      // in the idle list
+};
+
+struct ThreadPool
+{
+    ExclusiveLock       lock;
+    PooledThread       *idle;
+
+    ThreadPool() : idle(NULL) {
+        InitializeExclusiveLock(&lock);
+        SetExclusiveLockWholeProgramScope(&lock);
+    }
+};
+
+    static ThreadPool *
+GetThreadPool()
+{
+    static ThreadPool pool;    // Constructed the first time through, which C++ makes thread safe
+    return &pool;
+}
+
+    static void
+PooledThreadMain(void *param)
+{
+    PooledThread *thread = (PooledThread *)param;
+    ThreadPool *pool = GetThreadPool();
+    for (;;) {
+        CommandPipe = thread->commandPipe;
+        (*thread->mainFunction)(thread->mainFunctionParameter);
+        CommandPipe = NULL;
+
+        AcquireExclusiveLock(&pool->lock);
+        thread->next = pool->idle;
+        pool->idle = thread;
+        ReleaseExclusiveLock(&pool->lock);
+
+        WaitForEvent(&thread->workReady);
+        PreventEventWaitersFromProceeding(&thread->workReady);
+    }
+}
+
+    bool
+StartPooledThread(ThreadMainFunction threadMainFunction, void *threadMainFunctionParameter)
+{
+    ThreadPool *pool = GetThreadPool();
+    AcquireExclusiveLock(&pool->lock);
+    PooledThread *thread = pool->idle;
+    if (NULL != thread) {
+        pool->idle = thread->next;
+    }
+    ReleaseExclusiveLock(&pool->lock);
+
+    if (NULL != thread) {
+        thread->mainFunction = threadMainFunction;
+        thread->mainFunctionParameter = threadMainFunctionParameter;
+        thread->commandPipe = CommandPipe;
+        AllowEventWaitersToProceed(&thread->workReady);
+        return true;
+    }
+
+    thread = new PooledThread;
+    thread->mainFunction = threadMainFunction;
+    thread->mainFunctionParameter = threadMainFunctionParameter;
+    thread->commandPipe = CommandPipe;
+    CreateEventObject(&thread->workReady);
+    PreventEventWaitersFromProceeding(&thread->workReady);
+    if (!StartNewThread(PooledThreadMain, thread)) {
+        DestroyEventObject(&thread->workReady);
+        delete thread;
+        return false;
+    }
+    return true;
+}
+
 ParallelCoworker::ParallelCoworker(int i_numThreads, bool i_bindToProcessors, ParallelWorkerManager* i_manager, Callback i_callback, void* i_parameter)
     : stopped(false), numThreads(i_numThreads), bindToProcessors(i_bindToProcessors), manager(i_manager), callback(i_callback), parameter(i_parameter)
 {
@@ -56,7 +137,7 @@ void ParallelCoworker::start()
     context = new WorkerContext();
     context->shared = this;
     context->totalThreads = numThreads;
-    context->bindToProcessors = bindToProcessors;
+    context->bindToProcessors = bindToProcessors && 0 == GetNumberOfHelperProcessors();   // or they go on the helper processors
 #ifdef _MSC_VER
     context->useTimingBarrier = false;
 #endif
@@ -67,8 +148,11 @@ void ParallelCoworker::start()
 void ParallelCoworker::step()
 {
     manager->beginStep();
+    // reset all of them before starting any, or thread 0 could finish and see another's done from the last step
     for (int i = 0; i < numThreads; i++) {
         PreventEventWaitersFromProceeding(&workDone[i]);
+    }
+    for (int i = 0; i < numThreads; i++) {
         AllowEventWaitersToProceed(&workReady[i]);
     }
     // if async, thread 0 will callback when all workers finish
@@ -102,11 +186,23 @@ WorkerContext::initializeThread()
     void
 WorkerContext::runThread()
 {
+    //
+    // Coworkers do reading, decompression and compression, so if there are processors set aside for that, that's where
+    // they go.  ParallelTask doesn't undo this, so we do, before the thread goes back to the pool.
+    //
+    bool onHelperProcessors = 0 != GetNumberOfHelperProcessors();
+    if (onHelperProcessors) {
+        BindThreadToHelperProcessors();
+    }
+
     while (true) {
         //fprintf(stderr, "worker task thread %d waiting to begin\n", GetCurrentThreadId());
         WaitForEvent(&shared->workReady[threadNum]);
         PreventEventWaitersFromProceeding(&shared->workReady[threadNum]);
         if (shared->stopped) {
+            if (onHelperProcessors) {
+                UnbindThreadFromProcessor();
+            }
             return;
         }
         //fprintf(stderr, "worker task thread %d begin\n", GetCurrentThreadId());
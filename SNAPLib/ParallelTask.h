@@ -26,6 +26,14 @@ Revision History:
 #include "exit.h"
 #include "Error.h"
 
+//
+// Run threadMainFunction on a thread from a process-wide pool, starting a new one only if they're all busy.  When the
+// function returns, the thread waits in the pool for the next one, so a daemon or a chain of commands (or the
+// iterations of one) don't start and tear down a set of threads for every run, and what a thread keeps for itself
+// between runs, like its cached BigAllocator memory, stays warm.  The pool's threads never exit.
+//
+bool StartPooledThread(ThreadMainFunction threadMainFunction, void *threadMainFunctionParameter);
+
 /*++
     Simple class to handle parallelized algorithms.
     TContext should extend TContextBase, and provide the following methods:
@@ -131,7 +139,7 @@ ParallelTask<TContext>::run()
         contexts[i].threadNum = i;
         contexts[i].initializeThread();
 
-        if (!StartNewThread(ParallelTask<TContext>::threadWorker, &contexts[i])) {
+        if (!StartPooledThread(ParallelTask<TContext>::threadWorker, &contexts[i])) {
             WriteErrorMessage( "Unable to start worker thread.\n");
             soft_exit(1);
         }
@@ -154,18 +162,23 @@ ParallelTask<TContext>::run()
     DestroyEventObject(&memoryAllocationCompleteBarrier);
 #endif  // _MSC_VER
 
-    for (int i = 0; i < common->totalThreads; i++) {
+    common->time = timeInMillis() - start;
+
+    //
+    // The last finishThread can let whoever forked us delete the task and common (see ParallelCoworker::stop), so
+    // don't touch either of them after it.
+    //
+    int totalThreads = common->totalThreads;
+    for (int i = 0; i < totalThreads; i++) {
         contexts[i].finishThread(common);
     }
-
-    common->time = timeInMillis() - start;
 }
 
     template <class TContext>
     void
 ParallelTask<TContext>::fork()
 {
-    if (!StartNewThread(ParallelTask<TContext>::forkWorker, this)) {
+    if (!StartPooledThread(ParallelTask<TContext>::forkWorker, this)) {
         WriteErrorMessage( "Unable to fork task thread.\n");
         soft_exit(1);
     }
@@ -186,11 +199,15 @@ ParallelTask<TContext>::threadWorker(
 {
     TContext* context = (TContext*) threadArg;
     if (context->bindToProcessors) {
-        BindThreadToProcessor(context->threadNum);
+        BindThreadToProcessor(GetProcessorForThread(context->threadNum));
     }
 
     context->runThread();
 
+    if (context->bindToProcessors) {
+        UnbindThreadFromProcessor();    // It goes back to the pool, which might give it to something that isn't bound
+    }
+
     // Decrement the running thread count and wake up the waiter if it hits 0.
     if (0 == InterlockedDecrementAndReturnNewValue(context->pRunningThreads)) {
         SignalSingleWaiterObject(context->doneWaiter);
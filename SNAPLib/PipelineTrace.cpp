@@ -0,0 +1,178 @@
+/*++
+
+Module Name:
+
+    PipelineTrace.cpp
+
+Abstract:
+
+    Recording pipeline spans per thread, and writing them as Chrome trace events.  See PipelineTrace.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "PipelineTrace.h"
+#include "Error.h"
+
+volatile bool PipelineTracing = false;
+
+static const int RingSize = 64 * 1024;
+static const _int64 MergeGapNanos = 50 * 1000;
+
+static const char *TraceEventNames[NumPipelineTraceEvents] = {
+    "read", "decompress", "align", "compress", "write", "sort", "merge"
+};
+
+struct TraceRecord {
+    _int64              start;
+    _int64              end;
+    PipelineTraceEvent  event;
+};
+
+struct ThreadTrace {
+    TraceRecord     records[RingSize];
+    _int64          nRecords;                           // ever recorded, so the next goes in records[nRecords % RingSize]
+    _int64          lastRecord[NumPipelineTraceEvents]; // the last of each kind, to add to; -1 for none
+    int             threadNum;
+    ThreadTrace    *next;
+};
+
+static thread_local ThreadTrace *CurrentThreadTrace = NULL;
+
+static ThreadTrace * volatile AllThreadTraces = NULL;
+static volatile int nThreadTraces = 0;
+static _int64 TraceStart = 0;
+
+    static void
+ResetThreadTrace(ThreadTrace *trace)
+{
+    trace->nRecords = 0;
+    for (int i = 0; i < NumPipelineTraceEvents; i++) {
+        trace->lastRecord[i] = -1;
+    }
+}
+
+    static ThreadTrace *
+GetThreadTraceForNewThread()
+{
+    ThreadTrace *trace = new ThreadTrace;
+    ResetThreadTrace(trace);
+    trace->threadNum = InterlockedIncrementAndReturnNewValue(&nThreadTraces);
+
+    ThreadTrace *head;
+    do {
+        head = AllThreadTraces;
+        trace->next = head;
+    } while (head != InterlockedCompareExchangePointerAndReturnOldValue((void * volatile *)&AllThreadTraces, trace, head));
+
+    return trace;
+}
+
+    void
+RecordPipelineTraceEvent(PipelineTraceEvent event, _int64 start, _int64 end)
+{
+    if (! PipelineTracing) {
+        return;
+    }
+    ThreadTrace *trace = CurrentThreadTrace;
+    if (NULL == trace) {
+        trace = CurrentThreadTrace = GetThreadTraceForNewThread();
+    }
+
+    _int64 last = trace->lastRecord[event];
+    if (last >= 0 && trace->nRecords - last <= RingSize) {
+        TraceRecord *record = &trace->records[last % RingSize];
+        if (start - record->end < MergeGapNanos) {
+            record->end = __max(record->end, end);
+            return;
+        }
+    }
+
+    TraceRecord *record = &trace->records[trace->nRecords % RingSize];
+    record->start = start;
+    record->end = end;
+    record->event = event;
+    trace->lastRecord[event] = trace->nRecords;
+    trace->nRecords++;
+}
+
+    void
+StartPipelineTrace()
+{
+    for (ThreadTrace *trace = AllThreadTraces; NULL != trace; trace = trace->next) {
+        ResetThreadTrace(trace);
+    }
+    TraceStart = timeInNanos();
+    PipelineTracing = true;
+}
+
+    bool
+WritePipelineTrace(const char *fileName)
+{
+    PipelineTracing = false;
+
+    FILE *file = fopen(fileName, "w");
+    if (NULL == file) {
+        WriteErrorMessage("Unable to open trace file '%s'\n", fileName);
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"snap-aligner\"}}");
+    _int64 nEvents = 0;
+    _int64 nDropped = 0;
+    int nThreads = 0;
+    for (ThreadTrace *trace = AllThreadTraces; NULL != trace; trace = trace->next) {
+        if (0 == trace->nRecords) {
+            continue;
+        }
+
+        //
+        // Name the thread for what it did, so the pool threads that do a bit of everything can be told apart.
+        //
+        bool did[NumPipelineTraceEvents];
+        memset(did, 0, sizeof(did));
+        _int64 first = __max(0, trace->nRecords - RingSize);
+        for (_int64 i = first; i < trace->nRecords; i++) {
+            did[trace->records[i % RingSize].event] = true;
+        }
+        char name[200];
+        int used = 0;
+        for (int i = 0; i < NumPipelineTraceEvents; i++) {
+            if (did[i]) {
+                used += snprintf(name + used, sizeof(name) - used, "%s%s", used == 0 ? "" : ", ", TraceEventNames[i]);
+            }
+        }
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", trace->threadNum, name);
+        fprintf(file, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"sort_index\":%d}}",
+            trace->threadNum, trace->threadNum);
+
+        for (_int64 i = first; i < trace->nRecords; i++) {
+            TraceRecord *record = &trace->records[i % RingSize];
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"pipeline\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                TraceEventNames[record->event], trace->threadNum, (double)(record->start - TraceStart) / 1000,
+                (double)(record->end - record->start) / 1000);
+        }
+        nEvents += trace->nRecords - first;
+        nDropped += first;
+        nThreads++;
+    }
+    fprintf(file, "\n]}\n");
+
+    bool ok = 0 == ferror(file);
+    if (0 != fclose(file) || ! ok) {
+        WriteErrorMessage("Error writing trace file '%s'\n", fileName);
+        return false;
+    }
+
+    WriteStatusMessage("Wrote %lld trace events for %d threads to %s", nEvents, nThreads, fileName);
+    if (nDropped > 0) {
+        WriteStatusMessage(" (the first %lld were overwritten)", nDropped);
+    }
+    WriteStatusMessage("\n");
+    return true;
+}
@@ -0,0 +1,94 @@
+/*++
+
+Module Name:
+
+    PipelineTrace.h
+
+Abstract:
+
+    A timeline of what every thread in the pipeline was doing, for finding where it stalls: the reader threads
+    filling batches of reads, decompression, the aligners, compression, writes, and sorting and merging the output.
+    With -trace, each thread records the begin and end of its spans into a ring of its own (so recording takes no
+    locks or interlocked operations), and at the end of the alignment they're all written out in the Chrome trace
+    event format, which chrome://tracing and ui.perfetto.dev can show.  The gaps are the pipeline's bubbles.
+
+    A span of the same kind that starts within MergeGapNanos of the last one on its thread ends is added to it, so an
+    aligner shows as busy from when it gets reads until it has to wait for them, rather than as a span per read.  Each
+    ring keeps the last RingSize spans of its thread; older ones are overwritten.  Writes are asynchronous, so a write
+    span is the time a thread takes to hand a buffer to the file and wait for the write before it to finish.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+enum PipelineTraceEvent {
+    ReadTraceEvent,
+    DecompressTraceEvent,
+    AlignTraceEvent,
+    CompressTraceEvent,
+    WriteTraceEvent,
+    SortTraceEvent,
+    MergeTraceEvent,
+    NumPipelineTraceEvents
+};
+
+extern volatile bool PipelineTracing;
+
+//
+// Start recording (dropping anything recorded before), and stop and write what's been recorded to fileName.  Call
+// them while the pipeline's threads are idle.
+//
+void StartPipelineTrace();
+bool WritePipelineTrace(const char *fileName);
+
+void RecordPipelineTraceEvent(PipelineTraceEvent event, _int64 start, _int64 end);
+
+//
+// The end of a span timed from start by the caller, who wants its length too.
+//
+inline _int64 EndPipelineTraceSpan(PipelineTraceEvent event, _int64 start) {
+    _int64 end = timeInNanos();
+    if (PipelineTracing) {
+        RecordPipelineTraceEvent(event, start, end);
+    }
+    return end - start;
+}
+
+//
+// Times a span from begin() to end(), or from construction to destruction for TRACE_SPAN.
+//
+class PipelineTraceSpan {
+public:
+    PipelineTraceSpan(PipelineTraceEvent i_event, bool start = false) : event(i_event), startTime(0) {
+        if (start) {
+            begin();
+        }
+    }
+
+    ~PipelineTraceSpan() {
+        end();
+    }
+
+    void begin() {
+        startTime = PipelineTracing ? timeInNanos() : 0;
+    }
+
+    void end() {
+        if (0 != startTime) {
+            RecordPipelineTraceEvent(event, startTime, timeInNanos());
+            startTime = 0;
+        }
+    }
+
+private:
+    PipelineTraceEvent  event;
+    _int64              startTime;
+};
+
+#define TRACE_SPAN(event) PipelineTraceSpan traceSpan##event(event, true)
@@ -115,3 +115,118 @@ private:
 
     EntryVector queue; // sorted list
 };
+
+//
+// A tournament tree of losers for merging count sorted sources, each with the priority of its next element.  Each
+// internal node keeps the source that lost the match there, and the overall winner is kept above the root, so
+// replacing the winner's priority replays just the log2(count) matches along its own path, always the same ones,
+// where a heap has to pick which child to follow at each level.  Ties go to the lower numbered source.
+//
+template <typename P>
+class LoserTree
+{
+public:
+    LoserTree(int i_count)
+        : count(i_count), priorities(new P[max(i_count, 1)]), live(new bool[max(i_count, 1)]), tree(new int[max(i_count, 1)])
+    {
+        for (int i = 0; i < count; i++) {
+            live[i] = false;
+        }
+    }
+
+    ~LoserTree()
+    {
+        delete [] priorities;
+        delete [] live;
+        delete [] tree;
+    }
+
+    // before build(), give a source its first priority; sources that never get one are empty
+    void set(int source, P priority)
+    {
+        priorities[source] = priority;
+        live[source] = true;
+    }
+
+    void build()
+    {
+        tree[0] = count > 0 ? playOff(1) : -1;
+    }
+
+    // the source with the smallest priority, or -1 if they're all empty
+    int top() const
+    { return tree[0] != -1 && live[tree[0]] ? tree[0] : -1; }
+
+    // the smallest priority of any other source, which lost to top() on its way up; false if the rest are empty
+    bool runnerUp(P* o_priority) const
+    {
+        int best = -1;
+        for (int node = (tree[0] + count) / 2; node >= 1; node /= 2) {
+            if (beats(tree[node], best)) {
+                best = tree[node];
+            }
+        }
+        if (best == -1) {
+            return false;
+        }
+        *o_priority = priorities[best];
+        return true;
+    }
+
+    // top() has a new priority
+    void update(P priority)
+    {
+        priorities[tree[0]] = priority;
+        replay(tree[0]);
+    }
+
+    // top() is empty
+    void remove()
+    {
+        live[tree[0]] = false;
+        replay(tree[0]);
+    }
+
+private:
+
+    // whether a wins against b; anything wins against an empty source or -1
+    bool beats(int a, int b) const
+    {
+        return a != -1 && live[a] &&
+            (b == -1 || ! live[b] || priorities[a] < priorities[b] || (priorities[a] == priorities[b] && a < b));
+    }
+
+    // nodes 1..count-1 are matches and count..2*count-1 are the sources; returns the winner below node
+    int playOff(int node)
+    {
+        if (node >= count) {
+            return node - count;
+        }
+        int a = playOff(2 * node);
+        int b = playOff(2 * node + 1);
+        if (beats(a, b)) {
+            tree[node] = b;
+            return a;
+        }
+        tree[node] = a;
+        return b;
+    }
+
+    void replay(int source)
+    {
+        int winner = source;
+        for (int node = (source + count) / 2; node >= 1; node /= 2) {
+            if (beats(tree[node], winner)) {
+                int loser = winner;
+                winner = tree[node];
+                tree[node] = loser;
+            }
+        }
+        tree[0] = winner;
+    }
+
+    const int count;
+    P* priorities;
+    bool* live;
+    int* tree; // the loser of each match, and the overall winner in tree[0]
+};
@@ -2,6 +2,8 @@
 #include "ProbabilityDistance.h"
 #include "Compat.h"
 
+#include "Simd.h"
+
 
 #ifdef TRACE_PROBABILITY_DISTANCE
 #define TRACE printf
@@ -10,6 +12,16 @@
 #endif
 
 
+//
+// fillAVX2 is compiled for AVX2 by itself, so the rest of SNAP still runs on processors without it.  MSVC doesn't need
+// to be told.
+//
+#ifdef _MSC_VER
+#define PROBABILITY_DISTANCE_VECTOR_TARGET(instructionSets)
+#else
+#define PROBABILITY_DISTANCE_VECTOR_TARGET(instructionSets) __attribute__((target(instructionSets)))
+#endif
+
 namespace {
     inline double max3(double d1, double d2, double d3) {
         if (d1 > d2) {
@@ -64,47 +76,18 @@ int ProbabilityDistance::compute(
     _ASSERT(maxStartShift <= maxShift);
 
     // Fill in the readPos = 0 row to allow us to start only at -maxStartShift..+maxStartShift
-    for (int s = -maxShift-1; s <= maxShift+1; s++) {
-        d[0][MAX_SHIFT+s][READ_GAP] = NO_PROB;
-        d[0][MAX_SHIFT+s][REF_GAP] = NO_PROB;
-        if (s < -maxStartShift || s > maxStartShift) {
-            d[0][MAX_SHIFT+s][NO_GAP] = NO_PROB;
-        } else {
-            d[0][MAX_SHIFT+s][NO_GAP] = log(1.0);
-        }
+    // (all of it, so the vector version only ever sees real numbers past the last shift)
+    for (int i = 0; i < SHIFT_STRIDE; i++) {
+        d[0][READ_GAP][i] = NO_PROB;
+        d[0][REF_GAP][i] = NO_PROB;
+        d[0][NO_GAP][i] = NO_PROB;
+    }
+    for (int s = -maxStartShift; s <= maxStartShift; s++) {
+        d[0][NO_GAP][MAX_SHIFT+s] = log(1.0);
     }
 
     // Now go through each readPos from 1 to readLen and compute how to best get there
-    for (int r = 1; r <= readLen; r++) {
-        // Add sentinels at the end of the array
-        d[r][MAX_SHIFT-maxShift-1][READ_GAP] = NO_PROB;
-        d[r][MAX_SHIFT+maxShift+1][READ_GAP] = NO_PROB;
-        d[r][MAX_SHIFT-maxShift-1][REF_GAP] = NO_PROB;
-        d[r][MAX_SHIFT+maxShift+1][REF_GAP] = NO_PROB;
-        d[r][MAX_SHIFT-maxShift-1][NO_GAP] = NO_PROB;
-        d[r][MAX_SHIFT+maxShift+1][NO_GAP] = NO_PROB;
-
-        // Fill in the rest of the values using dynamic program recurrence
-        for (int s = -maxShift; s <= maxShift; s++) {
-            // The NO_GAP case; we get here either from a previous NO_GAP or by closing a gap from the
-            // previous readPos, and in either case, we need to match the current base
-            double thisBaseProb = (read[r-1] == reference[r-1+s]) ? matchLogProb[quality[r-1]] : mismatchLogProb[quality[r-1]];
-            d[r][MAX_SHIFT+s][NO_GAP] = max3(d[r-1][MAX_SHIFT+s][NO_GAP] + thisBaseProb,
-                                             d[r-1][MAX_SHIFT+s][REF_GAP] + thisBaseProb,
-                                             d[r-1][MAX_SHIFT+s][READ_GAP] + thisBaseProb);
-
-            // The READ_GAP case; we can either open a new gap from the previous NO_GAP or REF_GAP cases, or
-            // extend a gap computed in the previous READ_GAP case
-            d[r][MAX_SHIFT+s][READ_GAP] = max3(d[r-1][MAX_SHIFT+s+1][NO_GAP] + gapOpenLogProb,
-                                               d[r-1][MAX_SHIFT+s+1][REF_GAP] + gapOpenLogProb,
-                                               d[r-1][MAX_SHIFT+s+1][READ_GAP] + gapExtensionLogProb);
-
-            // The REF_GAP case; we can either open a new gap from NO_GAP/READ_GAP, or extend one
-            d[r][MAX_SHIFT+s][REF_GAP] = max3(d[r][MAX_SHIFT+s-1][NO_GAP] + gapOpenLogProb,
-                                              d[r][MAX_SHIFT+s-1][REF_GAP] + gapExtensionLogProb,
-                                              d[r][MAX_SHIFT+s-1][READ_GAP] + gapOpenLogProb);
-        }
-    }
+    (this->*fillImplementation)(reference, read, quality, readLen, maxShift);
 
 #ifdef TRACE_PROBABILITY_DISTANCE
     printf("Here is the final matrix:\n");
@@ -112,7 +95,7 @@ int ProbabilityDistance::compute(
         printf("%d: ", r);
         for (int g = 0; g < 3; g++) {
             for (int s = -maxShift; s <= maxShift; s++) {
-                printf("%7.2g ", d[r][MAX_SHIFT+s][g]);
+                printf("%7.2g ", d[r][g][MAX_SHIFT+s]);
             }
             if (g < 2) {
                 printf("| ");
@@ -126,10 +109,136 @@ int ProbabilityDistance::compute(
     double best = NO_PROB;
     for (int s = -maxShift; s <= maxShift; s++) {
         for (int g = 0; g < 3; g++) {
-            best = __max(best, d[readLen][MAX_SHIFT+s][g]);
+            best = __max(best, d[readLen][g][MAX_SHIFT+s]);
         }
     }
     *matchProbability = exp(best);
     TRACE("Best match probability: %g (log: %.2g)\n", exp(best), best);
     return 5;
 }
+
+
+ProbabilityDistance::FillFunction ProbabilityDistance::fillImplementation = KernelChooser<ProbabilityDistance::FillFunction>("probability distance")
+    .avx2(X86_ONLY(&ProbabilityDistance::fillAVX2)).scalar(&ProbabilityDistance::fillScalar);
+
+
+void ProbabilityDistance::fillScalar(
+        const char *reference,
+        const char *read,
+        const char *quality,
+        int readLen,
+        int maxShift)
+{
+    for (int r = 1; r <= readLen; r++) {
+        // Add sentinels at the end of the array
+        d[r][READ_GAP][MAX_SHIFT-maxShift-1] = NO_PROB;
+        d[r][READ_GAP][MAX_SHIFT+maxShift+1] = NO_PROB;
+        d[r][REF_GAP][MAX_SHIFT-maxShift-1] = NO_PROB;
+        d[r][REF_GAP][MAX_SHIFT+maxShift+1] = NO_PROB;
+        d[r][NO_GAP][MAX_SHIFT-maxShift-1] = NO_PROB;
+        d[r][NO_GAP][MAX_SHIFT+maxShift+1] = NO_PROB;
+
+        // Fill in the rest of the values using dynamic program recurrence
+        for (int s = -maxShift; s <= maxShift; s++) {
+            // The NO_GAP case; we get here either from a previous NO_GAP or by closing a gap from the
+            // previous readPos, and in either case, we need to match the current base
+            double thisBaseProb = (read[r-1] == reference[r-1+s]) ? matchLogProb[(unsigned char)quality[r-1]] : mismatchLogProb[(unsigned char)quality[r-1]];
+            d[r][NO_GAP][MAX_SHIFT+s] = max3(d[r-1][NO_GAP][MAX_SHIFT+s] + thisBaseProb,
+                                             d[r-1][REF_GAP][MAX_SHIFT+s] + thisBaseProb,
+                                             d[r-1][READ_GAP][MAX_SHIFT+s] + thisBaseProb);
+
+            // The READ_GAP case; we can either open a new gap from the previous NO_GAP or REF_GAP cases, or
+            // extend a gap computed in the previous READ_GAP case
+            d[r][READ_GAP][MAX_SHIFT+s] = max3(d[r-1][NO_GAP][MAX_SHIFT+s+1] + gapOpenLogProb,
+                                               d[r-1][REF_GAP][MAX_SHIFT+s+1] + gapOpenLogProb,
+                                               d[r-1][READ_GAP][MAX_SHIFT+s+1] + gapExtensionLogProb);
+
+            // The REF_GAP case; we can either open a new gap from NO_GAP/READ_GAP, or extend one
+            d[r][REF_GAP][MAX_SHIFT+s] = max3(d[r][NO_GAP][MAX_SHIFT+s-1] + gapOpenLogProb,
+                                              d[r][REF_GAP][MAX_SHIFT+s-1] + gapExtensionLogProb,
+                                              d[r][READ_GAP][MAX_SHIFT+s-1] + gapOpenLogProb);
+        }
+    }
+}
+
+
+#ifdef SNAP_SIMD_X86
+void PROBABILITY_DISTANCE_VECTOR_TARGET("avx2") ProbabilityDistance::fillAVX2(
+        const char *reference,
+        const char *read,
+        const char *quality,
+        int readLen,
+        int maxShift)
+/*++
+
+Routine Description:
+
+    The same recurrence as fillScalar, four shifts to a vector.  Adding the same number to each term of max3 and
+    then taking the max is exactly the same as taking the max and adding it once, so that's how these do it, and
+    the results are bit for bit the same.  The REF_GAP case needs the shift before it in the same row, so the gap
+    opening half of it is done in vectors and then it's run along the row extending.
+
+    Vectors past the last shift compute junk from the padding, which is set back to NO_PROB at the end of each row.
+
+--*/
+{
+    const int lo = MAX_SHIFT - maxShift;
+    const int hi = MAX_SHIFT + maxShift;
+    const __m256d open = _mm256_set1_pd(gapOpenLogProb);
+    const __m256d extend = _mm256_set1_pd(gapExtensionLogProb);
+
+    for (int r = 1; r <= readLen; r++) {
+        const double *prevNoGap = d[r-1][NO_GAP];
+        const double *prevReadGap = d[r-1][READ_GAP];
+        const double *prevRefGap = d[r-1][REF_GAP];
+        double *noGap = d[r][NO_GAP];
+        double *readGap = d[r][READ_GAP];
+        double *refGap = d[r][REF_GAP];
+
+        noGap[lo-1] = NO_PROB;
+        readGap[lo-1] = NO_PROB;
+        refGap[lo-1] = NO_PROB;
+
+        const __m256d match = _mm256_set1_pd(matchLogProb[(unsigned char)quality[r-1]]);
+        const __m256d mismatch = _mm256_set1_pd(mismatchLogProb[(unsigned char)quality[r-1]]);
+        const __m128i readBase = _mm_set1_epi8(read[r-1]);
+        const char *referenceBases = reference + r - 1 - MAX_SHIFT;   // indexed by shift + MAX_SHIFT
+
+        for (int i = lo; i <= hi; i += 4) {
+            // the last vector may have shifts past maxShift, and the reference isn't to be read there
+            _int32 bases = 0;
+            if (i + 3 <= hi) {
+                memcpy(&bases, referenceBases + i, 4);
+            } else {
+                for (int j = 0; i + j <= hi; j++) {
+                    bases |= (_int32)(_uint8)referenceBases[i + j] << (8 * j);
+                }
+            }
+            __m256d equal = _mm256_castsi256_pd(_mm256_cvtepi8_epi64(_mm_cmpeq_epi8(_mm_cvtsi32_si128(bases), readBase)));
+            __m256d thisBaseProb = _mm256_blendv_pd(mismatch, match, equal);
+
+            __m256d best = _mm256_max_pd(_mm256_max_pd(_mm256_loadu_pd(prevNoGap + i), _mm256_loadu_pd(prevRefGap + i)),
+                _mm256_loadu_pd(prevReadGap + i));
+            _mm256_storeu_pd(noGap + i, _mm256_add_pd(best, thisBaseProb));
+
+            __m256d opened = _mm256_add_pd(_mm256_max_pd(_mm256_loadu_pd(prevNoGap + i + 1), _mm256_loadu_pd(prevRefGap + i + 1)), open);
+            __m256d extended = _mm256_add_pd(_mm256_loadu_pd(prevReadGap + i + 1), extend);
+            _mm256_storeu_pd(readGap + i, _mm256_max_pd(opened, extended));
+        }
+
+        for (int i = lo; i <= hi; i += 4) {
+            __m256d opened = _mm256_add_pd(_mm256_max_pd(_mm256_loadu_pd(noGap + i - 1), _mm256_loadu_pd(readGap + i - 1)), open);
+            _mm256_storeu_pd(refGap + i, opened);
+        }
+        for (int i = lo; i <= hi; i++) {
+            refGap[i] = __max(refGap[i], refGap[i-1] + gapExtensionLogProb);
+        }
+
+        for (int i = hi + 1; i < SHIFT_STRIDE; i++) {
+            noGap[i] = NO_PROB;
+            readGap[i] = NO_PROB;
+            refGap[i] = NO_PROB;
+        }
+    }
+}
+#endif // SNAP_SIMD_X86
@@ -14,6 +14,7 @@ class ProbabilityDistance {
 public:
     static const int MAX_READ = MAX_READ_LENGTH;
     static const int MAX_SHIFT = 20;
+    static const int SHIFT_STRIDE = 2*MAX_SHIFT+4;  // 2*MAX_SHIFT+1 shifts, padded to whole vectors of 4 doubles
 
     ProbabilityDistance(double snpProb, double gapOpenProb, double gapExtensionProb);
 
@@ -38,11 +39,24 @@ private:
 
     enum GapStatus { NO_GAP, READ_GAP, REF_GAP };
 
-    // d[readPos][shift][gapStatus] is the best possible log probability for aligning the
+    // d[readPos][gapStatus][shift] is the best possible log probability for aligning the
     // substring read[0..readPos] to reference[?..readPos + shift]. The "?" in reference is
     // because we allow starting an alignment from reference[-maxStartShift..maxStartShift]
     // instead of just reference[0], to deal with indels toward the start of the read.
-    double d[MAX_READ][2*MAX_SHIFT+1][3];   // [readPos][shift][gapStatus]
+    // It's shift-major so that all the shifts of a row can be done at once in vectors.
+    double d[MAX_READ][3][SHIFT_STRIDE];   // [readPos][gapStatus][shift]
+
+    //
+    // Fill in rows 1..readLen of d from row 0.  One of these is picked at startup for the processor; they get the
+    // same answers, the AVX2 one doing four shifts at a time (all but the REF_GAP case, which depends on the shift
+    // before it in the same row).
+    //
+    typedef void (ProbabilityDistance::*FillFunction)(const char *reference, const char *read, const char *quality,
+        int readLen, int maxShift);
+    static FillFunction fillImplementation;
+
+    void fillScalar(const char *reference, const char *read, const char *quality, int readLen, int maxShift);
+    void fillAVX2(const char *reference, const char *read, const char *quality, int readLen, int maxShift);
 
     // A state in the D array, used for backtracking pointers
     struct State {
@@ -0,0 +1,231 @@
+/*++
+
+Module Name:
+
+    ProgressReport.cpp
+
+Abstract:
+
+    Live alignment progress reports.  See ProgressReport.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ProgressReport.h"
+#include "DataReader.h"
+#include "DataWriter.h"
+#include "BigAlloc.h"
+#include "Error.h"
+
+volatile _int64 ProgressReporter::ReadElementsReady = 0;
+volatile _int64 ProgressReporter::WriteBatchesPending = 0;
+volatile _int64 ProgressReporter::DecompressNanos = 0;
+volatile _int64 ProgressReporter::CompressNanos = 0;
+
+ProgressReporter::ProgressReporter(const char *i_fileName, unsigned i_intervalSeconds, int i_nThreads) :
+    intervalSeconds(__max(i_intervalSeconds, 1u)), nThreads(i_nThreads), failed(false), stopping(false)
+{
+    fileName = new char[strlen(i_fileName) + 1];
+    strcpy(fileName, i_fileName);
+
+    const char *tempSuffix = ".tmp";
+    tempFileName = new char[strlen(i_fileName) + strlen(tempSuffix) + 1];
+    sprintf(tempFileName, "%s%s", i_fileName, tempSuffix);
+
+    size_t nameLength = strlen(fileName);
+    prometheus = nameLength >= 5 && 0 == strcmp(fileName + nameLength - 5, ".prom");
+
+    threads = (AlignerThreadProgress *)BigAlloc(sizeof(AlignerThreadProgress) * nThreads);
+    memset(threads, 0, sizeof(AlignerThreadProgress) * nThreads);
+
+    startTime = lastTime = timeInNanos();
+    startDecompressNanos = lastDecompressNanos = DecompressNanos;
+    startCompressNanos = lastCompressNanos = CompressNanos;
+    startReadWaitNanos = DataReader::ReadWaitTime;
+    startWriteWaitNanos = DataWriter::WaitTime;
+    lastReads = 0;
+    lastBases = 0;
+
+    CreateEventObject(&wakeup);
+    CreateSingleWaiterObject(&reporterDone);
+}
+
+ProgressReporter::~ProgressReporter()
+{
+    _ASSERT(stopping);
+    DestroyEventObject(&wakeup);
+    DestroySingleWaiterObject(&reporterDone);
+    BigDealloc(threads);
+    delete[] fileName;
+    delete[] tempFileName;
+}
+
+    ProgressReporter *
+ProgressReporter::start(const char *fileName, unsigned intervalSeconds, int nThreads)
+{
+    ProgressReporter *reporter = new ProgressReporter(fileName, intervalSeconds, nThreads);
+
+    //
+    // Write a first report now, so that a bad file name shows up before the alignment rather than part way through.
+    //
+    if (!reporter->writeReport(false)) {
+        reporter->stopping = true;
+        delete reporter;
+        return NULL;
+    }
+
+    if (!StartNewThread(ReporterThreadMain, reporter)) {
+        WriteErrorMessage("Unable to start the progress report thread\n");
+        reporter->stopping = true;
+        delete reporter;
+        return NULL;
+    }
+
+    return reporter;
+}
+
+    void
+ProgressReporter::stop()
+{
+    stopping = true;
+    AllowEventWaitersToProceed(&wakeup);
+    WaitForSingleWaiterObject(&reporterDone);
+    writeReport(true);
+}
+
+    void
+ProgressReporter::ReporterThreadMain(void *param)
+{
+    ((ProgressReporter *)param)->reporterThread();
+}
+
+    void
+ProgressReporter::reporterThread()
+{
+    while (!WaitForEventWithTimeout(&wakeup, (_int64)intervalSeconds * 1000) && !stopping) {
+        writeReport(false);
+    }
+
+    SignalSingleWaiterObject(&reporterDone);
+}
+
+    bool
+ProgressReporter::writeReport(bool done)
+/*++
+
+Routine Description:
+
+    Add up what the threads have done and write it to the temporary file, then rename it over the report.  The rates
+    for the interval are since the last report, so the last one (which comes whenever the alignment finishes) may be
+    over a shorter time.
+
+--*/
+{
+    _int64 now = timeInNanos();
+    _int64 reads = 0, bases = 0;
+    for (int i = 0; i < nThreads; i++) {
+        reads += threads[i].reads;
+        bases += threads[i].bases;
+    }
+    _int64 decompressNanos = DecompressNanos;
+    _int64 compressNanos = CompressNanos;
+
+    double seconds = (now - startTime) / 1e9;
+    double sinceLast = (now - lastTime) / 1e9;
+    double readsPerSecond = sinceLast > 0 ? (reads - lastReads) / sinceLast : 0;
+    double basesPerSecond = sinceLast > 0 ? (bases - lastBases) / sinceLast : 0;
+    double decompressThreadsBusy = sinceLast > 0 ? (decompressNanos - lastDecompressNanos) / 1e9 / sinceLast : 0;
+    double compressThreadsBusy = sinceLast > 0 ? (compressNanos - lastCompressNanos) / 1e9 / sinceLast : 0;
+
+    lastTime = now;
+    lastReads = reads;
+    lastBases = bases;
+    lastDecompressNanos = decompressNanos;
+    lastCompressNanos = compressNanos;
+
+    FILE *reportFile = fopen(tempFileName, "w");
+    if (NULL == reportFile) {
+        if (!failed) {
+            WriteErrorMessage("Unable to open progress report file '%s'\n", tempFileName);
+            failed = true;
+        }
+        return false;
+    }
+
+    if (prometheus) {
+        fprintf(reportFile, "# HELP snap_done Whether the alignment has finished.\n# TYPE snap_done gauge\nsnap_done %d\n", done ? 1 : 0);
+        fprintf(reportFile, "# HELP snap_elapsed_seconds Time since the alignment started.\n# TYPE snap_elapsed_seconds gauge\nsnap_elapsed_seconds %.3f\n", seconds);
+        fprintf(reportFile, "# HELP snap_reads_total Reads aligned.\n# TYPE snap_reads_total counter\nsnap_reads_total %lld\n", reads);
+        fprintf(reportFile, "# HELP snap_bases_total Bases in the reads aligned.\n# TYPE snap_bases_total counter\nsnap_bases_total %lld\n", bases);
+        fprintf(reportFile, "# HELP snap_reads_per_second Reads aligned per second since the last report.\n# TYPE snap_reads_per_second gauge\nsnap_reads_per_second %.1f\n", readsPerSecond);
+        fprintf(reportFile, "# HELP snap_bases_per_second Bases aligned per second since the last report.\n# TYPE snap_bases_per_second gauge\nsnap_bases_per_second %.1f\n", basesPerSecond);
+
+        fprintf(reportFile, "# HELP snap_thread_busy_seconds_total Time an aligner thread spent aligning.\n# TYPE snap_thread_busy_seconds_total counter\n");
+        for (int i = 0; i < nThreads; i++) {
+            fprintf(reportFile, "snap_thread_busy_seconds_total{thread=\"%d\"} %.3f\n", i, threads[i].busyNanos / 1e9);
+        }
+        fprintf(reportFile, "# HELP snap_thread_idle_seconds_total Time an aligner thread spent waiting for reads.\n# TYPE snap_thread_idle_seconds_total counter\n");
+        for (int i = 0; i < nThreads; i++) {
+            fprintf(reportFile, "snap_thread_idle_seconds_total{thread=\"%d\"} %.3f\n", i, threads[i].idleNanos / 1e9);
+        }
+
+        fprintf(reportFile, "# HELP snap_read_queue_elements Elements of reads waiting for the aligners.\n# TYPE snap_read_queue_elements gauge\nsnap_read_queue_elements %lld\n", ReadElementsReady);
+        fprintf(reportFile, "# HELP snap_write_batches_pending Output batches waiting to be compressed and written.\n# TYPE snap_write_batches_pending gauge\nsnap_write_batches_pending %lld\n", WriteBatchesPending);
+        fprintf(reportFile, "# HELP snap_read_wait_seconds_total Time spent waiting for input reads to finish.\n# TYPE snap_read_wait_seconds_total counter\nsnap_read_wait_seconds_total %.3f\n", (DataReader::ReadWaitTime - startReadWaitNanos) / 1e9);
+        fprintf(reportFile, "# HELP snap_write_wait_seconds_total Time the aligners spent waiting for output writes to finish.\n# TYPE snap_write_wait_seconds_total counter\nsnap_write_wait_seconds_total %.3f\n", (DataWriter::WaitTime - startWriteWaitNanos) / 1e9);
+        fprintf(reportFile, "# HELP snap_decompress_seconds_total Thread time spent decompressing input.\n# TYPE snap_decompress_seconds_total counter\nsnap_decompress_seconds_total %.3f\n", (decompressNanos - startDecompressNanos) / 1e9);
+        fprintf(reportFile, "# HELP snap_decompress_threads_busy Threads' worth of decompressing since the last report.\n# TYPE snap_decompress_threads_busy gauge\nsnap_decompress_threads_busy %.3f\n", decompressThreadsBusy);
+        fprintf(reportFile, "# HELP snap_compress_seconds_total Thread time spent compressing output.\n# TYPE snap_compress_seconds_total counter\nsnap_compress_seconds_total %.3f\n", (compressNanos - startCompressNanos) / 1e9);
+        fprintf(reportFile, "# HELP snap_compress_threads_busy Threads' worth of compressing since the last report.\n# TYPE snap_compress_threads_busy gauge\nsnap_compress_threads_busy %.3f\n", compressThreadsBusy);
+    } else {
+        fprintf(reportFile, "{\n");
+        fprintf(reportFile, "  \"done\": %s,\n", done ? "true" : "false");
+        fprintf(reportFile, "  \"seconds\": %.3f,\n", seconds);
+        fprintf(reportFile, "  \"reads\": %lld,\n", reads);
+        fprintf(reportFile, "  \"bases\": %lld,\n", bases);
+        fprintf(reportFile, "  \"readsPerSecond\": %.1f,\n", readsPerSecond);
+        fprintf(reportFile, "  \"basesPerSecond\": %.1f,\n", basesPerSecond);
+        fprintf(reportFile, "  \"averageReadsPerSecond\": %.1f,\n", seconds > 0 ? reads / seconds : 0);
+        fprintf(reportFile, "  \"threads\": [");
+        for (int i = 0; i < nThreads; i++) {
+            fprintf(reportFile, "%s\n    {\"reads\": %lld, \"busySeconds\": %.3f, \"idleSeconds\": %.3f}",
+                i == 0 ? "" : ",", threads[i].reads, threads[i].busyNanos / 1e9, threads[i].idleNanos / 1e9);
+        }
+        fprintf(reportFile, "%s],\n", nThreads == 0 ? "" : "\n  ");
+        fprintf(reportFile, "  \"readQueueElements\": %lld,\n", ReadElementsReady);
+        fprintf(reportFile, "  \"writeBatchesPending\": %lld,\n", WriteBatchesPending);
+        fprintf(reportFile, "  \"readWaitSeconds\": %.3f,\n", (DataReader::ReadWaitTime - startReadWaitNanos) / 1e9);
+        fprintf(reportFile, "  \"writeWaitSeconds\": %.3f,\n", (DataWriter::WaitTime - startWriteWaitNanos) / 1e9);
+        fprintf(reportFile, "  \"decompressSeconds\": %.3f,\n", (decompressNanos - startDecompressNanos) / 1e9);
+        fprintf(reportFile, "  \"decompressThreadsBusy\": %.3f,\n", decompressThreadsBusy);
+        fprintf(reportFile, "  \"compressSeconds\": %.3f,\n", (compressNanos - startCompressNanos) / 1e9);
+        fprintf(reportFile, "  \"compressThreadsBusy\": %.3f\n", compressThreadsBusy);
+        fprintf(reportFile, "}\n");
+    }
+
+    bool worked = !ferror(reportFile);
+    if (0 != fclose(reportFile) || !worked) {
+        if (!failed) {
+            WriteErrorMessage("Error writing progress report file '%s'\n", tempFileName);
+            failed = true;
+        }
+        return false;
+    }
+
+#ifdef _MSC_VER
+    DeleteSingleFile(fileName);     // MoveFile won't replace it
+#endif // _MSC_VER
+    if (!MoveSingleFile(tempFileName, fileName)) {
+        if (!failed) {
+            WriteErrorMessage("Unable to rename progress report file '%s' to '%s'\n", tempFileName, fileName);
+            failed = true;
+        }
+        return false;
+    }
+
+    return true;
+}
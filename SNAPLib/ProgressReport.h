@@ -0,0 +1,124 @@
+/*++
+
+Module Name:
+
+    ProgressReport.h
+
+Abstract:
+
+    Live progress of an alignment (-metrics), rewritten every few seconds while it runs, so that a fleet's monitoring
+    can tell whether a run is limited by its input, its output or the aligners.  It's JSON, or the Prometheus text
+    format if the file name ends in .prom (which is what node_exporter's textfile collector reads).  Each report is
+    written to a temporary file and renamed into place, so a reader never sees half of one.
+
+    The report has the reads and bases aligned so far and per second (over the last interval and the whole run), how
+    much of its time each aligner thread spent aligning and how much waiting for reads, how many elements of reads
+    are waiting in ReadSupplierQueues for the aligners, how many output batches are waiting to be compressed and
+    written, and how many threads' worth of time went into decompressing input and compressing output.  The queue,
+    writer and compression numbers are for the whole process, so when a daemon runs several commands at once they
+    include the others'.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// What one aligner thread has done.  Only the thread itself writes it, so it doesn't need interlocked operations;
+// the reporter just reads whatever's there.
+//
+struct AlignerThreadProgress {
+    volatile _int64     reads;
+    volatile _int64     bases;
+    volatile _int64     busyNanos;          // Aligning and writing what it aligned
+    volatile _int64     idleNanos;          // Waiting for reads
+    _int64              lastChange;         // When it started or stopped waiting
+    char                pad[24];            // Keep the threads off of each other's cache lines
+
+    void begin() {lastChange = timeInNanos();}
+
+    //
+    // Call these right before asking for reads and right after getting them.
+    //
+    void waiting() {
+        _int64 now = timeInNanos();
+        busyNanos += now - lastChange;
+        lastChange = now;
+    }
+
+    void working() {
+        _int64 now = timeInNanos();
+        idleNanos += now - lastChange;
+        lastChange = now;
+    }
+};
+
+class ProgressReporter {
+public:
+    //
+    // Start writing reports to fileName every intervalSeconds, for an alignment with nThreads aligner threads.
+    // Returns NULL if it can't.
+    //
+    static ProgressReporter *start(const char *fileName, unsigned intervalSeconds, int nThreads);
+
+    AlignerThreadProgress *getThreadProgress(int threadNum) {
+        _ASSERT(threadNum >= 0 && threadNum < nThreads);
+        return &threads[threadNum];
+    }
+
+    //
+    // Write a last report, marked done, and stop.
+    //
+    void stop();
+
+    ~ProgressReporter();
+
+    //
+    // The process wide counts that go into the report, which the parts of SNAP that they're about keep up to date
+    // with interlocked operations.
+    //
+    static volatile _int64 ReadElementsReady;        // ReadSupplierQueue elements waiting for an aligner
+    static volatile _int64 WriteBatchesPending;      // Output batches handed off to be compressed but not yet written
+    static volatile _int64 DecompressNanos;          // Time spent decompressing input, summed over threads
+    static volatile _int64 CompressNanos;            // Time spent compressing output, summed over threads
+
+private:
+    ProgressReporter(const char *i_fileName, unsigned i_intervalSeconds, int i_nThreads);
+
+    static void ReporterThreadMain(void *param);
+    void reporterThread();
+
+    bool writeReport(bool done);
+
+    char                    *fileName;
+    char                    *tempFileName;
+    unsigned                 intervalSeconds;
+    int                      nThreads;
+    AlignerThreadProgress   *threads;
+
+    _int64                   startTime;
+    _int64                   startDecompressNanos;
+    _int64                   startCompressNanos;
+    _int64                   startReadWaitNanos;
+    _int64                   startWriteWaitNanos;
+
+    //
+    // As of the last report, for the rates over the interval.
+    //
+    _int64                   lastTime;
+    _int64                   lastReads;
+    _int64                   lastBases;
+    _int64                   lastDecompressNanos;
+    _int64                   lastCompressNanos;
+
+    bool                     prometheus;
+    bool                     failed;            // So we complain about a file we can't write only once
+    volatile bool            stopping;
+    EventObject              wakeup;
+    SingleWaiterObject       reporterDone;
+};
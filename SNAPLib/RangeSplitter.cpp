@@ -100,12 +100,206 @@ bool RangeSplitter::getNextRange(_int64 *rangeStart, _int64 *rangeLength)
     return true;
 }
 
+WorkStealingRangeSplitter::WorkStealingRangeSplitter(RangeSplitter *i_splitter, int i_numThreads, _int64 i_pieceSize, bool i_inOrder) :
+    splitter(i_splitter), numThreads(max(i_numThreads, 1)), pieceSize(max(i_pieceSize, (_int64)1)), nThreadsAdded(0), inOrder(i_inOrder),
+    nextUnit(0)
+{
+    threads = new ThreadRanges[numThreads];
+    for (int i = 0; i < numThreads; i++) {
+        InitializeExclusiveLock(&threads[i].lock);
+        threads[i].nextPiece = threads[i].end = 0;
+    }
+}
+
+WorkStealingRangeSplitter::~WorkStealingRangeSplitter()
+{
+    for (int i = 0; i < numThreads; i++) {
+        DestroyExclusiveLock(&threads[i].lock);
+    }
+    delete [] threads;
+    delete splitter;
+}
+
+    int
+WorkStealingRangeSplitter::addThread()
+{
+    //
+    // If there are ever more callers than we were told about, they share deques, which is fine since they're locked.
+    //
+    return (InterlockedIncrementAndReturnNewValue(&nThreadsAdded) - 1) % numThreads;
+}
+
+    bool
+WorkStealingRangeSplitter::getNextRange(int whichThread, _int64 *rangeStart, _int64 *rangeLength, _int64 *unit)
+/*++
+
+Routine Description:
+
+    Get the next piece of work for a thread: the front piece of its own deque, or failing that of a new range from
+    the splitter, or failing that of what it can steal.
+
+Arguments:
+
+    whichThread     - the caller's number from addThread
+    rangeStart      - returns the start of the piece
+    rangeLength     - and its length
+    unit            - optionally returns its number in input order, or -1 if they aren't in order
+
+Return Value:
+
+    false if there's no work left anywhere that's worth taking.
+
+--*/
+{
+    if (inOrder) {
+        //
+        // Everyone takes from the one deque, and refills it from the splitter while still holding its lock, so that the
+        // ranges (which the splitter hands out in order) are used up in order too.
+        //
+        ThreadRanges *shared = &threads[0];
+        AcquireExclusiveLock(&shared->lock);
+        while (shared->nextPiece >= shared->end) {
+            _int64 newStart, newLength;
+            if (!splitter->getNextRange(&newStart, &newLength)) {
+                ReleaseExclusiveLock(&shared->lock);
+                return false;
+            }
+            shared->nextPiece = newStart;
+            shared->end = newStart + newLength;
+        }
+        *rangeStart = shared->nextPiece;
+        *rangeLength = shared->end - shared->nextPiece;
+        if (*rangeLength >= pieceSize + pieceSize / 2) {
+            *rangeLength = pieceSize;
+        }
+        shared->nextPiece += *rangeLength;
+        if (NULL != unit) {
+            *unit = nextUnit;
+        }
+        nextUnit++;
+        ReleaseExclusiveLock(&shared->lock);
+        return true;
+    }
+
+    if (NULL != unit) {
+        *unit = -1;
+    }
+
+    ThreadRanges *mine = &threads[whichThread];
+
+    while (true) {
+        AcquireExclusiveLock(&mine->lock);
+        if (mine->nextPiece < mine->end) {
+            *rangeStart = mine->nextPiece;
+            //
+            // Don't leave a sliver at the end of the range.
+            //
+            *rangeLength = mine->end - mine->nextPiece;
+            if (*rangeLength >= pieceSize + pieceSize / 2) {
+                *rangeLength = pieceSize;
+            }
+            mine->nextPiece += *rangeLength;
+            ReleaseExclusiveLock(&mine->lock);
+            return true;
+        }
+        ReleaseExclusiveLock(&mine->lock);
+
+        _int64 newStart, newLength;
+        if (splitter->getNextRange(&newStart, &newLength)) {
+            AcquireExclusiveLock(&mine->lock);
+            mine->nextPiece = newStart;
+            mine->end = newStart + newLength;
+            ReleaseExclusiveLock(&mine->lock);
+        } else if (!steal(whichThread)) {
+            return false;
+        }
+    }
+}
+
+    bool
+WorkStealingRangeSplitter::steal(int whichThread)
+/*++
+
+Routine Description:
+
+    Look around the other threads for one with at least two pieces left, and take the back half of them.  Only one
+    lock is held at a time; our own deque is empty, so there's nothing there for anyone else to steal meanwhile.
+
+--*/
+{
+    for (int i = 1; i < numThreads; i++) {
+        ThreadRanges *victim = &threads[(whichThread + i) % numThreads];
+
+        AcquireExclusiveLock(&victim->lock);
+        _int64 nPieces = (victim->end - victim->nextPiece + pieceSize - 1) / pieceSize;
+        if (nPieces < 2) {
+            ReleaseExclusiveLock(&victim->lock);
+            continue;
+        }
+
+        _int64 stolenStart = victim->nextPiece + (nPieces - nPieces / 2) * pieceSize;
+        _int64 stolenEnd = victim->end;
+        victim->end = stolenStart;
+        ReleaseExclusiveLock(&victim->lock);
+
+        ThreadRanges *mine = &threads[whichThread];
+        AcquireExclusiveLock(&mine->lock);
+        mine->nextPiece = stolenStart;
+        mine->end = stolenEnd;
+        ReleaseExclusiveLock(&mine->lock);
+
+        return true;
+    }
+
+    return false;
+}
+
+    WorkStealingRangeSplitter *
+NewInputFileSplitter(
+    const char *fileName,
+    int numThreads,
+    _int64 rangeBegin,
+    unsigned minRangeSize,
+    const ReaderContext& context)
+/*++
+
+Routine Description:
+
+    Make the splitter for a range split input file.  A remote file gets handed out in ranges (and stolen in pieces)
+    of at least its split size: a block of an HDFS file, so that each thread mostly reads blocks of its own rather
+    than every thread reading a bit of every block, and enough of an object that the GETs for it are efficient.
+
+    With -inputPart, the splitter only covers that part of the file.  Like the threads' ranges, each read belongs to
+    the part it starts in, so the parts of a file between them have each of its reads once.
+
+--*/
+{
+    _int64 splitSize = __min(DataSupplier::InputSplitSize(fileName), (_int64)0x80000000);
+    _int64 pieceSize = 1024 * 1024;
+    if (splitSize > 0) {
+        minRangeSize = __max(minRangeSize, (unsigned)splitSize);
+        pieceSize = splitSize;
+    }
+
+    _int64 rangeEnd = DataSupplier::InputFileSize(fileName);
+    if (context.nInputParts > 1) {
+        _int64 partSize = rangeEnd - rangeBegin;
+        _int64 partBegin = rangeBegin + partSize * context.inputPart / context.nInputParts;
+        rangeEnd = rangeBegin + partSize * (context.inputPart + 1) / context.nInputParts;
+        rangeBegin = partBegin;
+    }
+
+    return new WorkStealingRangeSplitter(new RangeSplitter(rangeEnd, numThreads, 5, rangeBegin, 200, minRangeSize),
+        numThreads, pieceSize, context.inputOrder);
+}
+
 RangeSplittingReadSupplierGenerator::RangeSplittingReadSupplierGenerator(
     const char *i_fileName,
     bool i_isSAM, 
     unsigned i_numThreads,
-    const ReaderContext& i_context)
-    : isSAM(i_isSAM), context(i_context), numThreads(i_numThreads)
+    const ReaderContext& i_context,
+    DataSupplier *i_dataSupplier)
+    : isSAM(i_isSAM), context(i_context), numThreads(i_numThreads), dataSupplier(i_dataSupplier)
 {
     fileName = new char[strlen(i_fileName) + 1];
     strcpy(fileName, i_fileName);
@@ -130,14 +324,15 @@ RangeSplittingReadSupplierGenerator::RangeSplittingReadSupplierGenerator(
 		headerSize = 0;
 	}
 
-	splitter = new RangeSplitter(QueryFileSize(fileName), numThreads, 5, headerSize, 200, 10 * MAX_READ_LENGTH);
+	splitter = NewInputFileSplitter(fileName, numThreads, headerSize, 10 * MAX_READ_LENGTH, context);
 }
 
 ReadSupplier *
 RangeSplittingReadSupplierGenerator::generateNewReadSupplier()
 {
-    _int64 rangeStart, rangeLength;
-    if (!splitter->getNextRange(&rangeStart, &rangeLength)) {
+    int whichThread = splitter->addThread();
+    _int64 rangeStart, rangeLength, unit;
+    if (!splitter->getNextRange(whichThread, &rangeStart, &rangeLength, &unit)) {
         return NULL;
     }
 
@@ -146,38 +341,146 @@ RangeSplittingReadSupplierGenerator::generateNewReadSupplier()
     if (isSAM) {
         underlyingReader = SAMReader::create(DataSupplier::Default, fileName, 2, context, rangeStart, rangeLength);
     } else {
-        underlyingReader = FASTQReader::create(DataSupplier::Default, fileName, 2, rangeStart, rangeLength, context);
+        underlyingReader = FASTQReader::create(dataSupplier, fileName, 2, rangeStart, rangeLength, context);
     }
-    return new RangeSplittingReadSupplier(splitter,underlyingReader);
+    return new RangeSplittingReadSupplier(splitter, whichThread, underlyingReader, unit);
 }
 
 RangeSplittingReadSupplier::~RangeSplittingReadSupplier()
 {
+    releaseHeldBatches();
+    delete [] batchReads;
+}
+
+    void
+RangeSplittingReadSupplier::setInputUnitListener(InputUnitListener *i_listener)
+{
+    listener = i_listener;
+    if (NULL != listener && -1 != unit) {
+        listener->beginInputUnit(unit);
+    }
 }
 
+    bool
+RangeSplittingReadSupplier::getNextRange(_int64 *rangeStart, _int64 *rangeLength)
+{
+    if (!splitter->getNextRange(whichThread, rangeStart, rangeLength, &unit)) {
+        return false;
+    }
+    if (NULL != listener) {
+        listener->beginInputUnit(unit);
+    }
+    return true;
+}
+
+    void
+RangeSplittingReadSupplier::releaseHeldBatches()
+{
+    for (int i = 0; i < nHeldBatches; i++) {
+        underlyingReader->releaseBatch(heldBatches[i]);
+    }
+    nHeldBatches = 0;
+}
 
     Read * 
 RangeSplittingReadSupplier::getNextRead()
 {
+    releaseHeldBatches();
+
     if (underlyingReader->getNextRead(&read)) {
         return &read;
     }
 
+    //
+    // A range can have no reads in it (with seekable zstd, one that's all the middle of a frame), which isn't the end of
+    // the ranges.
+    //
     _int64 rangeStart, rangeLength;
-    if (!splitter->getNextRange(&rangeStart, &rangeLength)) {
-        return NULL;
+    while (getNextRange(&rangeStart, &rangeLength)) {
+        underlyingReader->reinit(rangeStart,rangeLength);
+        if (underlyingReader->getNextRead(&read)) {
+            return &read;
+        }
     }
-    underlyingReader->reinit(rangeStart,rangeLength);
-    if (!underlyingReader->getNextRead(&read)) {
-        return NULL;
+    return NULL;
+}
+
+    int
+RangeSplittingReadSupplier::getNextReadBatch(Read **reads, int maxReads)
+/*++
+
+Routine Description:
+
+    Read up to maxReads (and no more than ReadsPerBatch) reads from the underlying reader into our own Read objects, holding the
+    reader's buffers that they point into.  We stop at the end of a range rather than remapping the file under reads that we've
+    already got, and when the reads have spread across two buffers, so the reader always has one to switch to.
+
+--*/
+{
+    releaseHeldBatches();
+
+    if (NULL == batchReads) {
+        batchReads = new Read[ReadsPerBatch];
     }
-    return &read;
+
+    int limit = __min(maxReads, ReadsPerBatch);
+    int nReads = 0;
+    while (nReads < limit) {
+        if (!underlyingReader->getNextRead(&batchReads[nReads])) {
+            if (0 != nReads) {
+                break;
+            }
+
+            _int64 rangeStart, rangeLength;
+            do {
+                if (!getNextRange(&rangeStart, &rangeLength)) {
+                    return 0;
+                }
+                underlyingReader->reinit(rangeStart, rangeLength);
+            } while (!underlyingReader->getNextRead(&batchReads[nReads]));
+        }
+
+        reads[nReads] = &batchReads[nReads];
+        DataBatch batch = batchReads[nReads].getBatch();
+        nReads++;
+
+        if (0 == nHeldBatches || heldBatches[nHeldBatches - 1] != batch) {
+            underlyingReader->holdBatch(batch);
+            heldBatches[nHeldBatches++] = batch;
+            if (MaxHeldBatches == nHeldBatches) {
+                break;
+            }
+        }
+    }
+
+    return nReads;
 }
 
 RangeSplittingPairedReadSupplier::~RangeSplittingPairedReadSupplier()
 {
 }
 
+    void
+RangeSplittingPairedReadSupplier::setInputUnitListener(InputUnitListener *i_listener)
+{
+    listener = i_listener;
+    if (NULL != listener && -1 != unit) {
+        listener->beginInputUnit(unit);
+    }
+}
+
+    bool
+RangeSplittingPairedReadSupplier::getNextRange(_int64 *rangeStart, _int64 *rangeLength)
+{
+    if (!splitter->getNextRange(whichThread, rangeStart, rangeLength, &unit)) {
+        return false;
+    }
+    if (NULL != listener) {
+        listener->beginInputUnit(unit);
+    }
+    return true;
+}
+
     bool 
 RangeSplittingPairedReadSupplier::getNextReadPair(Read **read1, Read **read2)
 {
@@ -193,20 +496,32 @@ RangeSplittingPairedReadSupplier::getNextReadPair(Read **read1, Read **read2)
     // still live in read.
     //
 
+    //
+    // A range can have no reads in it (one that's all the middle of a long read, or with FASTQ record indices, one with
+    // no checkpoints), which isn't the end of the ranges.
+    //
     _int64 rangeStart, rangeLength;
-    if (!splitter->getNextRange(&rangeStart, &rangeLength)) {
-        return false;
+    while (getNextRange(&rangeStart, &rangeLength)) {
+        underlyingReader->reinit(rangeStart,rangeLength);
+        if (underlyingReader->getNextReadPair(&internalRead1, &internalRead2)) {
+            return true;
+        }
     }
- 
-    underlyingReader->reinit(rangeStart,rangeLength);
-    return underlyingReader->getNextReadPair(&internalRead1, &internalRead2);
+
+    return false;
 }
 
 RangeSplittingPairedReadSupplierGenerator::RangeSplittingPairedReadSupplierGenerator(
     const char *i_fileName1, const char *i_fileName2, FileType i_fileType, unsigned i_numThreads, 
-    bool i_quicklyDropUnpairedReads, const ReaderContext& i_context) :
-        fileType(i_fileType), numThreads(i_numThreads), context(i_context), quicklyDropUnpairedReads(i_quicklyDropUnpairedReads)
+    bool i_quicklyDropUnpairedReads, const ReaderContext& i_context, DataSupplier *i_dataSupplier, FASTQRecordIndex **i_recordIndices) :
+        fileType(i_fileType), numThreads(i_numThreads), context(i_context), quicklyDropUnpairedReads(i_quicklyDropUnpairedReads),
+        dataSupplier(i_dataSupplier)
 {
+    _ASSERT(NULL == i_recordIndices || FASTQFile == fileType);
+    for (int i = 0; i < 2; i++) {
+        recordIndices[i] = NULL == i_recordIndices ? NULL : i_recordIndices[i];
+    }
+
     _ASSERT(strcmp(i_fileName1, "-") && (NULL == i_fileName2 || strcmp(i_fileName2, "-"))); // Can't use range splitter on stdin, because you can't seek or query size
     fileName1 = new char[strlen(i_fileName1) + 1];
     strcpy(fileName1, i_fileName1); 
@@ -218,7 +533,7 @@ RangeSplittingPairedReadSupplierGenerator::RangeSplittingPairedReadSupplierGener
         fileName2 = NULL;
     }
 
-    splitter = new RangeSplitter(QueryFileSize(fileName1),numThreads);
+    splitter = NewInputFileSplitter(fileName1, numThreads, 0, 32768, context);
 }
 
 RangeSplittingPairedReadSupplierGenerator::~RangeSplittingPairedReadSupplierGenerator()
@@ -226,13 +541,17 @@ RangeSplittingPairedReadSupplierGenerator::~RangeSplittingPairedReadSupplierGene
     delete [] fileName1;
     delete [] fileName2;
     delete splitter;
+    for (int i = 0; i < 2; i++) {
+        delete recordIndices[i];
+    }
 }
 
     PairedReadSupplier *
 RangeSplittingPairedReadSupplierGenerator::generateNewPairedReadSupplier()
 {
-    _int64 rangeStart, rangeLength;
-    if (!splitter->getNextRange(&rangeStart, &rangeLength)) {
+    int whichThread = splitter->addThread();
+    _int64 rangeStart, rangeLength, unit;
+    if (!splitter->getNextRange(whichThread, &rangeStart, &rangeLength, &unit)) {
         return NULL;
     }
 
@@ -243,11 +562,12 @@ RangeSplittingPairedReadSupplierGenerator::generateNewPairedReadSupplier()
          break;
 
     case FASTQFile:
-         underlyingReader = PairedFASTQReader::create(DataSupplier::Default, fileName1, fileName2, 2, rangeStart, rangeLength, context);
+         underlyingReader = PairedFASTQReader::create(DataSupplier::Default, fileName1, fileName2, 2, rangeStart, rangeLength, context,
+             NULL == recordIndices[0] ? NULL : recordIndices);
          break;
 
     case InterleavedFASTQFile:
-        underlyingReader = PairedInterleavedFASTQReader::create(DataSupplier::Default, fileName1, 2, rangeStart, rangeLength, context);
+        underlyingReader = PairedInterleavedFASTQReader::create(dataSupplier, fileName1, 2, rangeStart, rangeLength, context);
         break;
 
     default:
@@ -255,6 +575,6 @@ RangeSplittingPairedReadSupplierGenerator::generateNewPairedReadSupplier()
         soft_exit(1);
     }
  
-    return new RangeSplittingPairedReadSupplier(splitter,underlyingReader);
+    return new RangeSplittingPairedReadSupplier(splitter, whichThread, underlyingReader, unit);
 }
 
@@ -54,14 +54,71 @@ private:
     volatile _int64 startTime;
 };
 
+//
+// A RangeSplitter with a work stealing layer on top.  Each thread works through the range it got from the
+// splitter a piece at a time, and the pieces it hasn't gotten to yet are its deque (they're contiguous, so the
+// deque is just the start of the next piece and the end of the range).  A thread that's out of its own pieces
+// takes a new range from the splitter, and once that's used up it steals the back half of the pieces of another
+// thread, so the last few slow ranges get shared out rather than leaving everyone else idle at the end of the run.
+//
+// For -inputOrder, there's no stealing: the threads share one deque, so the pieces go out in order, and each is
+// numbered as it goes (see InputUnitListener).
+//
+class WorkStealingRangeSplitter
+{
+public:
+    WorkStealingRangeSplitter(RangeSplitter *i_splitter, int i_numThreads, _int64 i_pieceSize = 1024 * 1024,  // We own the splitter
+        bool i_inOrder = false);
+    ~WorkStealingRangeSplitter();
+
+    //
+    // Each thread that's going to call getNextRange gets a number from here first.
+    //
+    int addThread();
+
+    //
+    // unit gets the piece's number in input order, or -1 if they aren't in order.
+    //
+    bool getNextRange(int whichThread, _int64 *rangeStart, _int64 *rangeLength, _int64 *unit = NULL);
+
+private:
+
+    bool steal(int whichThread);
+
+    struct ThreadRanges {
+        ExclusiveLock   lock;
+        _int64          nextPiece;      // The deque is [nextPiece, end)
+        _int64          end;
+    };
+
+    RangeSplitter  *splitter;
+    int             numThreads;
+    _int64          pieceSize;
+    ThreadRanges   *threads;
+    volatile int    nThreadsAdded;
+    const bool      inOrder;
+    _int64          nextUnit;       // Under threads[0].lock, for inOrder
+};
+
+//
+// The splitter for an input file of numThreads range split readers, whose reads start at rangeBegin.  It takes
+// account of -inputPart and of the split size of remote files.
+//
+WorkStealingRangeSplitter *NewInputFileSplitter(const char *fileName, int numThreads, _int64 rangeBegin, unsigned minRangeSize, const ReaderContext& context);
+
 class RangeSplittingReadSupplier : public ReadSupplier {
 public:
-    RangeSplittingReadSupplier(RangeSplitter *i_splitter, ReadReader *i_underlyingReader) : 
-      splitter(i_splitter), underlyingReader(i_underlyingReader), read() {}
+    RangeSplittingReadSupplier(WorkStealingRangeSplitter *i_splitter, int i_whichThread, ReadReader *i_underlyingReader, _int64 i_unit) :
+      splitter(i_splitter), whichThread(i_whichThread), underlyingReader(i_underlyingReader), read(), batchReads(NULL), nHeldBatches(0),
+      unit(i_unit), listener(NULL) {}
 
     virtual ~RangeSplittingReadSupplier();
 
     Read *getNextRead();
+
+    virtual int getNextReadBatch(Read **reads, int maxReads);
+
+    virtual void setInputUnitListener(InputUnitListener *i_listener);
  
     virtual void holdBatch(DataBatch batch)
     { underlyingReader->holdBatch(batch); }
@@ -70,34 +127,64 @@ public:
     { return underlyingReader->releaseBatch(batch); }
 
 private:
-    RangeSplitter *splitter;
+    void releaseHeldBatches();
+
+    bool getNextRange(_int64 *rangeStart, _int64 *rangeLength);   // And tell the listener about it
+
+    //
+    // Reads handed out by getNextReadBatch live here, and point into at most two of the reader's buffers, which we hold until
+    // the next call.  A batch never crosses into a new range, since moving to one remaps the file.
+    //
+#ifdef LONG_READS
+    static const int ReadsPerBatch = 1;
+#else
+    static const int ReadsPerBatch = 32;
+#endif
+    static const int MaxHeldBatches = 2;
+
+    WorkStealingRangeSplitter *splitter;
+    int whichThread;
     ReadReader *underlyingReader;
     Read read;
+    Read *batchReads;
+    DataBatch heldBatches[MaxHeldBatches];
+    int nHeldBatches;
+    _int64 unit;                    // Of the range we're in, -1 if they aren't numbered
+    InputUnitListener *listener;
 };
 
 class RangeSplittingReadSupplierGenerator: public ReadSupplierGenerator {
 public:
-    RangeSplittingReadSupplierGenerator(const char *i_fileName, bool i_isSAM, unsigned numThreads, const ReaderContext& context);
+    //
+    // dataSupplier is DataSupplier::BgzfRangeDefault for a FASTQ file that's BGZF compressed, or ZstdRangeDefault for a seekable
+    // zstd one; the ranges are then in compressed bytes.
+    //
+    RangeSplittingReadSupplierGenerator(const char *i_fileName, bool i_isSAM, unsigned numThreads, const ReaderContext& context,
+        DataSupplier *i_dataSupplier = DataSupplier::Default);
     ~RangeSplittingReadSupplierGenerator() {delete splitter; delete [] fileName;}
 
     ReadSupplier *generateNewReadSupplier();
     ReaderContext* getContext() { return &context; }
 
 private:
-    RangeSplitter *splitter;
+    WorkStealingRangeSplitter *splitter;
     char *fileName;
     const bool isSAM;
     const int numThreads;
     ReaderContext context;
+    DataSupplier *dataSupplier;
 };
 
 
 class RangeSplittingPairedReadSupplier : public PairedReadSupplier {
 public:
-    RangeSplittingPairedReadSupplier(RangeSplitter *i_splitter, PairedReadReader *i_underlyingReader) : splitter(i_splitter), underlyingReader(i_underlyingReader) {}
+    RangeSplittingPairedReadSupplier(WorkStealingRangeSplitter *i_splitter, int i_whichThread, PairedReadReader *i_underlyingReader, _int64 i_unit) :
+        splitter(i_splitter), whichThread(i_whichThread), underlyingReader(i_underlyingReader), unit(i_unit), listener(NULL) {}
     virtual ~RangeSplittingPairedReadSupplier();
 
     virtual bool getNextReadPair(Read **read1, Read **read2);
+
+    virtual void setInputUnitListener(InputUnitListener *i_listener);
        
     virtual void holdBatch(DataBatch batch)
     { underlyingReader->releaseBatch(batch); }
@@ -106,27 +193,41 @@ public:
     { return underlyingReader->releaseBatch(batch); }
 
  private:
+    bool getNextRange(_int64 *rangeStart, _int64 *rangeLength);   // See RangeSplittingReadSupplier
+
     PairedReadReader *underlyingReader;
-    RangeSplitter *splitter;
+    WorkStealingRangeSplitter *splitter;
+    int whichThread;
     Read internalRead1;
     Read internalRead2;
+    _int64 unit;
+    InputUnitListener *listener;
  };
 
+class FASTQRecordIndex;
+
 class RangeSplittingPairedReadSupplierGenerator: public PairedReadSupplierGenerator {
 public:
-    RangeSplittingPairedReadSupplierGenerator(const char *i_fileName1, const char *i_fileName2, enum FileType i_fileType, unsigned numThreads, bool i_quicklyDropUnpairedReads, const ReaderContext& context);
+    //
+    // i_recordIndices (which this takes over) are for FASTQ files that aren't the same size; see FASTQRecordIndex.
+    //
+    RangeSplittingPairedReadSupplierGenerator(const char *i_fileName1, const char *i_fileName2, enum FileType i_fileType, unsigned numThreads, bool i_quicklyDropUnpairedReads, const ReaderContext& context,
+        DataSupplier *i_dataSupplier = DataSupplier::Default,    // BgzfRangeDefault and ZstdRangeDefault only work for interleaved FASTQ
+        FASTQRecordIndex **i_recordIndices = NULL);
     ~RangeSplittingPairedReadSupplierGenerator();
 
     PairedReadSupplier *generateNewPairedReadSupplier();
     ReaderContext* getContext() { return &context; }
 
 private:
-    RangeSplitter *splitter;
+    WorkStealingRangeSplitter *splitter;
     char *fileName1;
     char *fileName2;
     const int numThreads;
     enum FileType fileType;
     ReaderContext context;
     bool quicklyDropUnpairedReads;
+    DataSupplier *dataSupplier;
+    FASTQRecordIndex *recordIndices[2];
 };
 
@@ -48,6 +48,40 @@ Read::checkIdMatch(
     }
 }
 
+    bool
+Read::getIdField(int fieldFromEnd, const char **o_field, unsigned *o_fieldLength) const
+{
+    unsigned end = idLength;
+    if (end >= 2 && id[end - 2] == '/' && (id[end - 1] == '1' || id[end - 1] == '2')) {
+        end -= 2;
+    }
+
+    //
+    // Walk back over fieldFromEnd - 1 separators to the end of the field we want, and then to its start.
+    //
+    for (int field = 1; field < fieldFromEnd; field++) {
+        while (end > 0 && id[end - 1] != ':') {
+            end--;
+        }
+        if (0 == end) {
+            return false;
+        }
+        end--;
+    }
+
+    unsigned start = end;
+    while (start > 0 && id[start - 1] != ':') {
+        start--;
+    }
+    if (start == end) {
+        return false;
+    }
+
+    *o_field = id + start;
+    *o_fieldLength = end - start;
+    return true;
+}
+
     
 const unsigned Read::localBufferLength = 3 * MAX_READ_LENGTH;
 const unsigned DEFAULT_MIN_READ_LENGTH = 50;
@@ -26,6 +26,7 @@ Revision History:
 #pragma once
 
 #include "Compat.h"
+#include "BigAlloc.h"
 #include "Tables.h"
 #include "DataReader.h"
 #include "DataWriter.h"
@@ -33,20 +34,24 @@ Revision History:
 #include "Error.h"
 #include "Genome.h"
 #include "AlignmentResult.h"
+#include "ReverseComplement.h"
 
 class FileFormat;
 
 class Genome;
 
+struct AlignerOptions;
+
 struct PairedAlignmentResult;
 
 
 
 //#define LONG_READS
+#define SHORT_READ_MAX_LENGTH 400       // The regular build's limit.  The snapxl build tunes for reads up to this long as it does.
 #ifdef LONG_READS
 #define MAX_READ_LENGTH 400000
 #else
-#define MAX_READ_LENGTH 400
+#define MAX_READ_LENGTH SHORT_READ_MAX_LENGTH
 #endif
 
 //
@@ -84,6 +89,9 @@ struct PairedAlignmentResult;
 const int MaxReadLength = MAX_READ_LENGTH;
 
 class Read;
+class ReadTrimmer;
+struct SplitAlignment;
+class SpliceJunctions;
 
 enum ReadClippingType {NoClipping, ClipFront, ClipBack, ClipFrontAndBack};
 
@@ -101,6 +109,18 @@ struct ReaderContext
     size_t              headerLength; // length of string
     size_t              headerBytes; // bytes used for header in file
     bool                headerMatchesIndex; // header refseq matches current index
+    bool                preserveClipping; // -pc, which also keeps all the optional fields of CRAM input
+    bool                binQualities; // -qbin, Illumina's 8 quality levels on output
+    bool                omitQualities; // -noQual, no qualities on output ('*' in SAM, 0xff in BAM)
+    bool                dropAuxData; // -dropAux, don't copy the input's optional fields (other than its RG) to the output
+    int                 compressionLevel; // -cl for BAM output, noted in the @PG line; -1 if it wasn't given
+    const ReadTrimmer*  trimmer; // -trimAdapter and -trimQuality for FASTQ input, or NULL
+    int                 inputPart; // -inputPart, which of nInputParts equal byte ranges of each input to read
+    int                 nInputParts; // 0 (or 1) to read all of it
+    const char*         region; // -region, only the records of BAM input that overlap chr:begin-end, found with its BAI; NULL for all
+    bool                unmappedOnly; // -unmappedOnly, only the unmapped records of BAM input (and their mates, if paired)
+    const SpliceJunctions* junctions; // The index's -gtf junction contigs, whose alignments the writers put in the genome; or NULL
+    bool                inputOrder; // -inputOrder, hand out range split input a piece at a time in order, so it can be written in order
 };
 
 class ReadReader {
@@ -143,7 +163,27 @@ public:
 
     // wrap a single read source with a matcher that buffers reads until their mate is found
     static PairedReadReader* PairMatcher(ReadReader* single, bool quicklyDropUnpairedReads);
-    static const int MatchBuffers = 2;
+
+    // have matchers write reads whose mates they haven't found to temporary files once they're holding more than
+    // memoryLimit bytes of them (0 for no limit), and pair them up at eof; the files are tempFilePrefix.unpaired.*.tmp
+    static void SpillUnpairedReads(size_t memoryLimit, const char* tempFilePrefix);
+
+    // batches the matcher holds on to: the current and previous ones, and ones whose unpaired reads it's kept in place
+    static const int MatchHeldOverflowBatches = 4;
+    static const int MatchBuffers = 2 + MatchHeldOverflowBatches;
+};
+
+//
+// Told by a read supplier, for -inputOrder, each time it starts handing out the reads of another input unit (an element
+// of a ReadSupplierQueue, or a piece of a range split file).  The units are numbered from 0 in the order they're in the
+// input, and each goes to just one supplier, so the output of a thread's units can be put back in order with the other
+// threads' (see DataWriter::beginInputUnit).
+//
+class InputUnitListener {
+public:
+    virtual ~InputUnitListener() {}
+
+    virtual void beginInputUnit(_int64 unit) = 0;
 };
 
 class ReadSupplier {
@@ -151,6 +191,24 @@ public:
     virtual Read *getNextRead() = 0;    // This read is valid until you call getNextRead, then it's done.  Don't worry about deallocating it.
     virtual ~ReadSupplier() {}
 
+    //
+    // Get up to maxReads reads at once, returning how many (0 at the end).  They're valid until the next call to getNextReadBatch
+    // or getNextRead.  Suppliers that have a bunch of reads at hand override this to hand them all out without a call per read;
+    // the rest just hand out one.
+    //
+    virtual int getNextReadBatch(Read **reads, int maxReads) {
+        _ASSERT(maxReads > 0);
+        return NULL == (reads[0] = getNextRead()) ? 0 : 1;
+    }
+
+    static const int MaxReadBatchSize = 256;  // The most that callers ask for at once
+
+    //
+    // For -inputOrder.  The listener hears right away about the unit the supplier's in the middle of, if it's started one.
+    // Only the suppliers that read straight from a ReadSupplierQueue or a range split file number their units.
+    //
+    virtual void setInputUnitListener(InputUnitListener *listener) {}
+
     virtual void holdBatch(DataBatch batch) = 0;
     virtual bool releaseBatch(DataBatch batch) = 0;
 };
@@ -161,6 +219,8 @@ public:
     virtual bool getNextReadPair(Read **read0, Read **read1) = 0;
     virtual ~PairedReadSupplier() {}
 
+    virtual void setInputUnitListener(InputUnitListener *listener) {}  // See ReadSupplier
+
     virtual void holdBatch(DataBatch batch) = 0;
     virtual bool releaseBatch(DataBatch batch) = 0;
 };
@@ -179,13 +239,18 @@ public:
     virtual ~PairedReadSupplierGenerator() {}
 };
 
+//
+// How output is sorted, which its header says (@HD SO:).
+//
+enum SortOrder {Unsorted, SortedByLocation, SortedByName};
+
 class ReadWriter {
 public:
 
     virtual ~ReadWriter() {}
 
     // write out header
-	virtual bool writeHeader(const ReaderContext& context, bool sorted, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) = 0;
+	virtual bool writeHeader(const ReaderContext& context, SortOrder sortOrder, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) = 0;
 
     //
     // write a batch of single reads, the first one of which is a primary alignment and the rest secondary.
@@ -200,6 +265,11 @@ public:
     virtual bool writePairs(const ReaderContext& context, Read **reads /* array of size 2 */, PairedAlignmentResult *result, int nResults,
         SingleAlignmentResult **singleResults /* array of size 2*/, int *nSingleResults /* array of size 2*/, bool firstIsPrimary) = 0;
 
+    //
+    // For -inputOrder: what's written from here on is from this input unit (see InputUnitListener and DataWriter::beginInputUnit).
+    //
+    virtual void beginInputUnit(_int64 unit) {}
+
 
     // close out this thread
     virtual void close() = 0;
@@ -214,8 +284,12 @@ public:
 
     virtual void close() = 0;
 
+    // affineGapPenalty is -G, for LandauVishkinWithCigar::setAffineGapPenalty
     static ReadWriterSupplier* create(const FileFormat* format, DataWriterSupplier* dataSupplier,
-        const Genome* genome);
+        const Genome* genome, int affineGapPenalty);
+
+    // -split, one of format's writer suppliers for each read group (or read name field) as they turn up
+    static ReadWriterSupplier* createSplit(const FileFormat* format, AlignerOptions* options, const Genome* genome);
 };
 
 #define READ_GROUP_FROM_AUX     ((const char*) -1)
@@ -229,7 +303,9 @@ public:
             upcaseForwardRead(NULL), auxiliaryData(NULL), auxiliaryDataLength(0),
             readGroup(NULL), originalAlignedLocation(-1), originalMAPQ(-1), originalSAMFlags(0),
             originalFrontClipping(0), originalBackClipping(0), originalFrontHardClipping(0), originalBackHardClipping(0),
-            originalRNEXT(NULL), originalRNEXTLength(0), originalPNEXT(0), additionalFrontClipping(0)
+            originalRNEXT(NULL), originalRNEXTLength(0), originalPNEXT(0), additionalFrontClipping(0), alignmentTruncated(false), consensusFamilySize(0),
+            splitAlignment(NULL), splitFrontClipping(0), splitBackClipping(0), supplementary(false), saTag(NULL),
+            deferredDecoder(NULL), deferredSource(NULL), deferredClipping(NoClipping)
         {}
 
         Read(const Read& other) :  localBufferAllocationOffset(0)
@@ -245,6 +321,7 @@ public:
         {
             localBufferAllocationOffset = 0;
             data = quality = unclippedData = unclippedQuality = externalData = NULL;
+            deferredDecoder = NULL;
          }
 
         void operator=(const Read& other)
@@ -352,6 +429,16 @@ public:
             originalRNEXTLength = other.originalRNEXTLength;
             originalPNEXT = other.originalPNEXT;
             additionalFrontClipping = other.additionalFrontClipping;
+            alignmentTruncated = other.alignmentTruncated;
+            consensusFamilySize = other.consensusFamilySize;
+            splitAlignment = other.splitAlignment;
+            splitFrontClipping = other.splitFrontClipping;
+            splitBackClipping = other.splitBackClipping;
+            supplementary = other.supplementary;
+            saTag = other.saTag;
+            deferredDecoder = other.deferredDecoder;
+            deferredSource = other.deferredSource;
+            deferredClipping = other.deferredClipping;
         }
 
         //
@@ -410,6 +497,13 @@ public:
             originalRNEXTLength = i_originalRNEXTLength;
             originalPNEXT = i_originalPNEXT;
             currentReadDirection = FORWARD;
+            alignmentTruncated = false;
+            consensusFamilySize = 0;
+            splitAlignment = NULL;
+            splitFrontClipping = splitBackClipping = 0;
+            supplementary = false;
+            saTag = NULL;
+            deferredDecoder = NULL;
 
             localBufferAllocationOffset = 0;    // Clears out any allocations that might previously have been in the buffer
             upcaseForwardRead = rcData = rcQuality = NULL;
@@ -418,22 +512,13 @@ public:
             // Check for lower case letters in the data, and convert to upper case if there are any.  Also convert
             // '.' to N.
             //
-            if (! allUpper) {
-                unsigned anyLowerCase = 0;
-                for (unsigned i = 0; i < dataLength; i++) {
-                    anyLowerCase |= IS_LOWER_CASE_OR_DOT[data[i]];
-                }
-
-                if (anyLowerCase) {
-                    assureLocalBufferLargeEnough();
-                    upcaseForwardRead = localBuffer;
-                    localBufferAllocationOffset += unclippedLength;
-                    for (unsigned i = 0; i < dataLength; i++) {
-                        upcaseForwardRead[i] = TO_UPPER_CASE_DOT_TO_N[data[i]];
-                    }
+            if (! allUpper && ReadNeedsUpcasing(data, dataLength)) {
+                assureLocalBufferLargeEnough();
+                upcaseForwardRead = localBuffer;
+                localBufferAllocationOffset += unclippedLength;
+                UpcaseRead(data, upcaseForwardRead, dataLength);
 
-                    unclippedData = data = upcaseForwardRead;
-                }
+                unclippedData = data = upcaseForwardRead;
             }
         }
 
@@ -466,6 +551,64 @@ public:
         inline const char *getOriginalRNEXT() {return originalRNEXT;}
         inline unsigned getOriginalRNEXTLength() {return originalRNEXTLength;}
         inline unsigned getOriginalPNEXT() {return originalPNEXT;}
+
+        //
+        // The aligner ran out of its -workBudget on this read and settled for the best it had found, which the writers tag.
+        //
+        inline bool wasAlignmentTruncated() const {return alignmentTruncated;}
+        inline void setAlignmentTruncated() {alignmentTruncated = true;}
+
+        //
+        // With -umi, how many reads this one is the consensus of, which the writers tag; 0 otherwise.
+        //
+        inline unsigned getConsensusFamilySize() const {return consensusFamilySize;}
+        inline void setConsensusFamilySize(unsigned size) {consensusFamilySize = size;}
+
+        //
+        // With -splitReads, the pieces that the aligner split the read into when it didn't align whole (see
+        // SplitReadAligner.h), or NULL.
+        //
+        inline const SplitAlignment *getSplitAlignment() const {return splitAlignment;}
+        inline void setSplitAlignment(const SplitAlignment *split) {splitAlignment = split;}
+
+        //
+        // While a writer writes the record for one of those pieces: soft clip the read to the piece (start and length
+        // are in the clipped read), and say whether the record is supplementary and what its SA tag is.
+        //
+        inline void setSplitRecord(unsigned start, unsigned length, bool i_supplementary, const char *i_saTag)
+        {
+            clearSplitRecord();
+            _ASSERT(start + length <= dataLength);
+            splitFrontClipping = start;
+            splitBackClipping = dataLength - start - length;
+            data += start;
+            quality += start;
+            dataLength = length;
+            supplementary = i_supplementary;
+            saTag = i_saTag;
+        }
+
+        inline void clearSplitRecord()
+        {
+            data -= splitFrontClipping;
+            quality -= splitFrontClipping;
+            dataLength += splitFrontClipping + splitBackClipping;
+            splitFrontClipping = splitBackClipping = 0;
+            supplementary = false;
+            saTag = NULL;
+        }
+
+        inline bool isSupplementary() const {return supplementary;}
+        inline const char *getSATag() const {return saTag;}     // NULL for none
+        //
+        // Drops all but the first newLength bases of the clipped read by back clipping the rest (see ReadTrimmer.h).
+        //
+        inline void trimBack(unsigned newLength)
+        {
+            _ASSERT(newLength <= dataLength);
+            dataLength = newLength;
+        }
+
         inline void setAdditionalFrontClipping(int clipping)
         {
             data += clipping - additionalFrontClipping;
@@ -483,6 +626,90 @@ public:
         inline void setAuxiliaryData(char* data, unsigned len)
         { auxiliaryData = data; auxiliaryDataLength = len; }
 
+        //
+        // The number of bytes this read points to outside of itself (id, data, quality, RNEXT and auxiliary data), and
+        // a way to copy them into a buffer of at least that size and point there instead, for a caller that needs to keep
+        // the read after the memory it came from has gone away.  The read then no longer belongs to any batch.
+        //
+        inline size_t getExternalDataSize() const
+        {
+            return (size_t)idLength + 2 * (size_t)unclippedLength + originalRNEXTLength + auxiliaryDataLength;
+        }
+
+        void moveExternalDataTo(char *buffer)
+        {
+            decodeDeferredData();
+
+            const char *oldExternalData = externalData;
+            const char *oldExternalQuality = externalQuality;
+
+            memcpy(buffer, id, idLength);
+            id = buffer;
+            buffer += idLength;
+
+            memcpy(buffer, externalData, unclippedLength);
+            externalData = buffer;
+            buffer += unclippedLength;
+
+            memcpy(buffer, externalQuality, unclippedLength);
+            externalQuality = buffer;
+            buffer += unclippedLength;
+
+            //
+            // Whichever of the data and quality pointers aren't into our local buffer are into the external copies.
+            //
+            if (unclippedData >= oldExternalData && unclippedData <= oldExternalData + unclippedLength) {
+                data = externalData + (data - oldExternalData);
+                unclippedData = externalData + (unclippedData - oldExternalData);
+            }
+
+            if (unclippedQuality >= oldExternalQuality && unclippedQuality <= oldExternalQuality + unclippedLength) {
+                quality = externalQuality + (quality - oldExternalQuality);
+                unclippedQuality = externalQuality + (unclippedQuality - oldExternalQuality);
+            }
+
+            if (0 != originalRNEXTLength) {
+                memcpy(buffer, originalRNEXT, originalRNEXTLength);
+                originalRNEXT = buffer;
+                buffer += originalRNEXTLength;
+            }
+
+            if (0 != auxiliaryDataLength) {
+                memcpy(buffer, auxiliaryData, auxiliaryDataLength);
+                auxiliaryData = buffer;
+            }
+
+            batch = DataBatch();
+        }
+
+        //
+        // A reader can leave unpacking a read's bases and qualities (into the buffers it was init()ed with, which it
+        // must have allocated to the full length) until the read is handed out to be aligned, so that the work happens
+        // on the aligner thread rather than the reader's.  The clipping, which looks at the qualities, waits too.
+        // decodeDeferredData does both; the queue that hands out reads calls it, as does anything that copies a read's
+        // data before then.
+        //
+        typedef void (*DeferredDecoder)(const void *source, char *data, char *quality, unsigned length);
+
+        void deferDecoding(DeferredDecoder decoder, const void *source, ReadClippingType clipping)
+        {
+            deferredDecoder = decoder;
+            deferredSource = source;
+            deferredClipping = clipping;
+        }
+
+        inline bool hasDeferredData() const {return NULL != deferredDecoder;}
+
+        inline void decodeDeferredData()
+        {
+            if (NULL != deferredDecoder) {
+                DeferredDecoder decoder = deferredDecoder;
+                deferredDecoder = NULL;
+                (*decoder)(deferredSource, (char *)externalData, (char *)externalQuality, unclippedLength);
+                clip(deferredClipping);
+            }
+        }
+
         void clip(ReadClippingType clipping, bool maintainOriginalClipping = false) {
             if (clipping == clippingState) {
                 //
@@ -555,9 +782,7 @@ public:
         }
 
         void computeReverseCompliment(char *outputBuffer) { // Caller guarantees that outputBuffer is at least getDataLength() bytes
-            for (unsigned i = 0; i < dataLength; i++) {
-                outputBuffer[i] = COMPLEMENT[data[dataLength - i - 1]];
-            }
+            ReverseComplementRead(data, NULL, dataLength, outputBuffer, NULL);
         }
 
         void becomeRC()
@@ -591,10 +816,7 @@ public:
 
                     _ASSERT(localBufferAllocationOffset <= localBufferLength);
 
-                    for (unsigned i = 0; i < unclippedLength; i++) {
-                        rcData[i] = COMPLEMENT[unclippedData[unclippedLength - i - 1]];
-                        rcQuality[unclippedLength-i-1] = unclippedQuality[i];
-                    }
+                    ReverseComplementRead(unclippedData, unclippedQuality, unclippedLength, rcData, rcQuality);
 
                     unclippedData = rcData;
                     unclippedQuality = rcQuality;
@@ -621,6 +843,13 @@ public:
 
 		static void checkIdMatch(Read* read0, Read* read1);
 
+        //
+        // Find a ':' separated field of the read's ID, counting from the end (so 1 is the last one), after dropping any
+        // /1 or /2.  That's where bcl2fastq and friends put UMIs and barcodes.  Returns false if the ID hasn't that many
+        // fields, or the field is empty.
+        //
+        bool getIdField(int fieldFromEnd, const char **o_field, unsigned *o_fieldLength) const;
+
         static void computeClippingFromCigar(const char *cigarBuffer, unsigned *originalFrontClipping, unsigned *originalBackClipping, unsigned *originalFrontHardClipping, unsigned *originalBackHardClipping)
         {
             size_t cigarSize;
@@ -652,18 +881,46 @@ public:
 
 private:
 
+        //
+        // The fields are laid out hot first: what aligning and writing a read touch, then the metadata that's only passed
+        // through from the input to the output, and last the local buffer, which most reads never use.  Reads are
+        // handed around in arrays (ReadQueueElement has thousands) and copied by copyFromOtherRead, so this keeps what
+        // gets looked at together in the first few cache lines instead of on either side of the buffer.
+        //
         const char *id;
         const char *data;
+        const char *quality;
         const char *unclippedData;
         const char *unclippedQuality;
-        const char *quality;
-        const char *readGroup;
         unsigned idLength;
         unsigned dataLength;
         unsigned unclippedLength;
         unsigned frontClippedLength;
         ReadClippingType clippingState;
         int additionalFrontClipping;
+        Direction currentReadDirection;
+        unsigned localBufferAllocationOffset;   // The next location to allocate in the local buffer.
+        char *upcaseForwardRead;                // Either NULL or points into localBuffer.  Used when the incoming read isn't all capitalized.  Unclipped.
+        char *rcData;                           // Either NULL or points into localBuffer.  Used when we've computed a reverse complement of the read, whether we're using it or not.  Unclipped.
+        char *rcQuality;                        // Ditto for quality.
+        const char *externalData;               // The data that was passed in at init() time, memory doesn't belong to this.
+        const char *externalQuality;            // The quality that was passed in at init() time, memory doens't belong to this.
+
+        // batch for managing lifetime during input
+        DataBatch batch;
+
+        // see deferDecoding()
+        DeferredDecoder deferredDecoder;
+        const void *deferredSource;
+        ReadClippingType deferredClipping;
+
+        bool alignmentTruncated;
+        unsigned consensusFamilySize;
+        const SplitAlignment *splitAlignment;
+        unsigned splitFrontClipping;            // For the split record being written
+        unsigned splitBackClipping;
+        bool supplementary;
+        const char *saTag;
 
         //
         // Alignment data that was in the read when it was read from a file.  While this should probably also be the place to put
@@ -680,6 +937,11 @@ private:
         unsigned originalRNEXTLength;
         unsigned originalPNEXT;
 
+        const char *readGroup;
+
+         // auxiliary data in BAM or SAM format (can tell by looking at 3rd byte), if available
+        char* auxiliaryData;
+        unsigned auxiliaryDataLength;
 
         //
         // Memory that's local to this read and that is used to contain an upcased version of the read as well as 
@@ -687,13 +949,6 @@ private:
         //
         char localBuffer[MAX_READ_LENGTH * 3];
         static const unsigned localBufferLength;
-        unsigned localBufferAllocationOffset;   // The next location to allocate in the local buffer.
-        char *upcaseForwardRead;                // Either NULL or points into localBuffer.  Used when the incoming read isn't all capitalized.  Unclipped.
-        char *rcData;                           // Either NULL or points into localBuffer.  Used when we've computed a reverse complement of the read, whether we're using it or not.  Unclipped.
-        char *rcQuality;                        // Ditto for quality.
-        const char *externalData;               // The data that was passed in at init() time, memory doesn't belong to this.
-        const char *externalQuality;            // The quality that was passed in at init() time, memory doens't belong to this.
-        Direction currentReadDirection;
 
         inline void assureLocalBufferLargeEnough()
         {
@@ -710,13 +965,6 @@ private:
 #endif // 0
         }
 
-        // batch for managing lifetime during input
-        DataBatch batch;
-
-         // auxiliary data in BAM or SAM format (can tell by looking at 3rd byte), if available
-        char* auxiliaryData;
-        unsigned auxiliaryDataLength;
-
         //
         // Pull the clipping info from the front and back of a cigar string.  
         static void ExtractClipping(const char *cigarBuffer, size_t cigarSize, unsigned *frontClipping, unsigned *backClipping, char clippingChar, size_t *frontClippingChars, size_t *backClippingChars)
@@ -769,20 +1017,26 @@ private:
 //
 // Reads that copy the memory for their strings.  They're less efficient than the base
 // Read class, but you can keep them around without holding references to the IO buffers
-// and eventually stopping the IO.
+// and eventually stopping the IO.  An id or auxiliary data too big for the internal buffer goes
+// in an extra buffer, which comes from extraBufferPool if there is one.
 //
 class ReadWithOwnMemory : public Read {
 public:
-    ReadWithOwnMemory() : Read(), extraBuffer(NULL), dataBuffer(NULL), idBuffer(NULL), qualityBuffer(NULL), auxBuffer(NULL) {}
+    ReadWithOwnMemory() : Read(), extraBuffer(NULL), extraBufferSize(0), extraBufferPool(NULL), dataBuffer(NULL), idBuffer(NULL), qualityBuffer(NULL), auxBuffer(NULL) {}
 
-    ReadWithOwnMemory(const Read &baseRead) {
+    ReadWithOwnMemory(const Read &baseRead, BufferPool *i_extraBufferPool = NULL) : extraBufferPool(i_extraBufferPool) {
         set(baseRead);
     }
     
     // must manually call destructor!
     void dispose() {
         if (extraBuffer != NULL) {
-            delete [] extraBuffer;
+            if (extraBufferPool != NULL) {
+                extraBufferPool->free(extraBuffer, extraBufferSize);
+            } else {
+                delete [] extraBuffer;
+            }
+            extraBuffer = NULL;
         }
     }
 
@@ -790,6 +1044,11 @@ private:
 
     void set(const Read &baseRead)
     {
+        //
+        // The copy outlives the buffer that a deferred read would be unpacked from, so unpack it first.
+        //
+        const_cast<Read &>(baseRead).decodeDeferredData();
+
         // allocate space in ownBuffer if possible; id/aux might need extraBuffer
         dataBuffer = ownBuffer;
         int ownBufferUsed = baseRead.getUnclippedLength() + 1;
@@ -811,7 +1070,8 @@ private:
             auxBuffer = NULL;
         }
         if (idBuffer == NULL || (auxLen > 0 && auxBuffer == NULL)) {
-            extraBuffer = new char[(idBuffer == NULL ? baseRead.getIdLength() + 1 : 0) + auxLen];
+            extraBufferSize = (idBuffer == NULL ? baseRead.getIdLength() + 1 : 0) + auxLen;
+            extraBuffer = extraBufferPool != NULL ? extraBufferPool->alloc(extraBufferSize) : new char[extraBufferSize];
             int extraBufferUsed = 0;
             if (idBuffer == NULL) {
                 idBuffer = extraBuffer;
@@ -849,6 +1109,8 @@ private:
         
     char ownBuffer[MAX_READ_LENGTH * 2 + 1000]; // internal buffer for copied data
     char* extraBuffer; // extra buffer if internal buffer not big enough
+    size_t extraBufferSize;
+    BufferPool *extraBufferPool;
 
     // should all point into ownBuffer or extraBuffer
     char *idBuffer;
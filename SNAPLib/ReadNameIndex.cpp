@@ -0,0 +1,467 @@
+/*++
+
+Module Name:
+
+    ReadNameIndex.cpp
+
+Abstract:
+
+    BAM read name index.  See ReadNameIndex.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ReadNameIndex.h"
+#include "Bam.h"
+#include "BigAlloc.h"
+#include "Error.h"
+#include "GzipBlockCodec.h"
+#include "GzipDataWriter.h"
+#include "Util.h"
+#include <algorithm>
+#include <queue>
+
+const char *ReadNameIndexSuffix = ".rni";
+
+static const char ReadNameIndexMagic[8] = {'S', 'N', 'A', 'P', 'R', 'N', 'I', '1'};
+
+volatile int ReadNameIndexBuilder::Instances = 0;
+
+    static void
+RunFileName(char *buffer, size_t bufferSize, const char *prefix, int instance, int run)
+{
+    snprintf(buffer, bufferSize, "%s.%d.%d.tmp", prefix, instance, run);
+}
+
+    _uint64
+ReadNameIndex::HashName(const char *name, size_t nameLength)
+{
+    _uint64 hash = 0xcbf29ce484222325;  // FNV-1a, as for contig names
+    for (size_t i = 0; i < nameLength; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3;
+    }
+    return util::fmix64(hash);
+}
+
+ReadNameIndexBuilder::ReadNameIndexBuilder(const char *i_tempFilePrefix, GzipWriterFilterSupplier *i_gzipSupplier)
+    : tempFilePrefix(i_tempFilePrefix), gzipSupplier(i_gzipSupplier), nRuns(0)
+{
+    instance = InterlockedIncrementAndReturnNewValue(&Instances);
+}
+
+ReadNameIndexBuilder::~ReadNameIndexBuilder()
+{
+    for (int i = 0; i < nRuns; i++) {
+        char fileName[MAX_PATH];
+        RunFileName(fileName, sizeof(fileName), tempFilePrefix, instance, i);
+        DeleteSingleFile(fileName);
+    }
+}
+
+    void
+ReadNameIndexBuilder::add(const char *name, size_t nameLength, _uint64 offset)
+{
+    if (entries.size() >= MaxEntriesInMemory) {
+        spill();
+    }
+    Entry entry;
+    entry.hash = ReadNameIndex::HashName(name, nameLength);
+    entry.offset = offset;
+    entries.push_back(entry);
+}
+
+    void
+ReadNameIndexBuilder::spill()
+{
+    std::sort(entries.begin(), entries.end());
+    char fileName[MAX_PATH];
+    RunFileName(fileName, sizeof(fileName), tempFilePrefix, instance, nRuns);
+    FILE *file = fopen(fileName, "wb");
+    if (NULL == file || entries.size() != fwrite(&entries[0], sizeof(Entry), entries.size(), file) || 0 != fclose(file)) {
+        WriteErrorMessage("Unable to write read name index temp file '%s'\n", fileName);
+        soft_exit(1);
+    }
+    nRuns++;
+    entries.clear();
+}
+
+//
+// A sorted run of entries to merge, from a temp file or a builder's memory, with their offsets translated to virtual
+// offsets in the whole file.
+//
+class ReadNameIndexRun {
+public:
+    ReadNameIndexRun(ReadNameIndexBuilder *i_builder, _uint64 i_partOffset, const char *fileName)
+        : builder(i_builder), partOffset(i_partOffset), file(NULL), used(0), valid(0)
+    {
+        if (NULL != fileName) {
+            file = fopen(fileName, "rb");
+            if (NULL == file) {
+                WriteErrorMessage("Unable to read read name index temp file '%s'\n", fileName);
+                soft_exit(1);
+            }
+            buffer = new ReadNameIndexBuilder::Entry[BufferEntries];
+        } else {
+            buffer = builder->entries.empty() ? NULL : &builder->entries[0];
+            valid = builder->entries.size();
+        }
+    }
+
+    ~ReadNameIndexRun()
+    {
+        if (NULL != file) {
+            fclose(file);
+            delete [] buffer;
+        }
+    }
+
+    //
+    // False once it's used up.
+    //
+    bool next()
+    {
+        if (used >= valid) {
+            if (NULL == file) {
+                return false;
+            }
+            valid = fread(buffer, sizeof(ReadNameIndexBuilder::Entry), BufferEntries, file);
+            used = 0;
+            if (0 == valid) {
+                return false;
+            }
+        }
+        current = buffer[used++];
+        if (NULL != builder->gzipSupplier) {
+            current.offset = builder->gzipSupplier->toVirtualOffset(current.offset);
+        }
+        current.offset += partOffset << 16;
+        return true;
+    }
+
+    ReadNameIndexBuilder::Entry current;
+
+    struct Later {
+        bool operator()(const ReadNameIndexRun *a, const ReadNameIndexRun *b) const { return b->current < a->current; }
+    };
+
+private:
+    static const size_t BufferEntries = 64 * 1024;
+
+    ReadNameIndexBuilder           *builder;
+    _uint64                         partOffset;
+    FILE                           *file;
+    ReadNameIndexBuilder::Entry    *buffer;
+    size_t                          used;
+    size_t                          valid;
+};
+
+    bool
+ReadNameIndexBuilder::WriteIndex(
+    const char *indexFileName,
+    int nParts,
+    ReadNameIndexBuilder **parts,
+    const size_t *partOffsets)
+{
+    std::vector<ReadNameIndexRun *> runs;
+    std::priority_queue<ReadNameIndexRun *, std::vector<ReadNameIndexRun *>, ReadNameIndexRun::Later> queue;
+    for (int i = 0; i < nParts; i++) {
+        ReadNameIndexBuilder *part = parts[i];
+        _uint64 partOffset = NULL == partOffsets ? 0 : partOffsets[i];
+        std::sort(part->entries.begin(), part->entries.end());
+        for (int j = 0; j <= part->nRuns; j++) {
+            char fileName[MAX_PATH];
+            RunFileName(fileName, sizeof(fileName), part->tempFilePrefix, part->instance, j);
+            runs.push_back(new ReadNameIndexRun(part, partOffset, j < part->nRuns ? fileName : NULL));
+            if (runs.back()->next()) {
+                queue.push(runs.back());
+            }
+        }
+    }
+
+    FILE *file = fopen(indexFileName, "wb");
+    if (NULL == file) {
+        WriteErrorMessage("Unable to create read name index '%s'\n", indexFileName);
+        return false;
+    }
+
+    //
+    // The count and the table go in once they're known.
+    //
+    const size_t fanoutSize = 1 << ReadNameIndex::FanoutBits;
+    _uint64 *fanout = new _uint64[fanoutSize];
+    memset(fanout, 0, fanoutSize * sizeof(_uint64));
+    _uint64 nEntries = 0;
+    bool worked = 1 == fwrite(ReadNameIndexMagic, sizeof(ReadNameIndexMagic), 1, file) && 1 == fwrite(&nEntries, sizeof(nEntries), 1, file) &&
+        fanoutSize == fwrite(fanout, sizeof(_uint64), fanoutSize, file);
+
+    const size_t outputEntries = 64 * 1024;
+    Entry *output = new Entry[outputEntries];
+    size_t outputUsed = 0;
+    while (worked && !queue.empty()) {
+        ReadNameIndexRun *run = queue.top();
+        queue.pop();
+        output[outputUsed++] = run->current;
+        fanout[run->current.hash >> (64 - ReadNameIndex::FanoutBits)]++;
+        nEntries++;
+        if (run->next()) {
+            queue.push(run);
+        }
+        if (outputUsed == outputEntries || queue.empty()) {
+            worked = outputUsed == fwrite(output, sizeof(Entry), outputUsed, file);
+            outputUsed = 0;
+        }
+    }
+
+    for (size_t i = 1; i < fanoutSize; i++) {
+        fanout[i] += fanout[i - 1];
+    }
+    worked = worked && 0 == _fseek64bit(file, sizeof(ReadNameIndexMagic), SEEK_SET) && 1 == fwrite(&nEntries, sizeof(nEntries), 1, file) &&
+        fanoutSize == fwrite(fanout, sizeof(_uint64), fanoutSize, file);
+    worked = 0 == fclose(file) && worked;
+    if (!worked) {
+        WriteErrorMessage("Unable to write read name index '%s'\n", indexFileName);
+    }
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        delete runs[i];
+    }
+    delete [] output;
+    delete [] fanout;
+    return worked;
+}
+
+    bool
+ReadNameIndexBuilder::IndexBAMFile(const char *bamFileName, const char *indexFileName)
+{
+    BgzfFile *bam = BgzfFile::open(bamFileName);
+    if (NULL == bam) {
+        return false;
+    }
+
+    //
+    // The header: the text, and then the reference sequences' names and lengths.
+    //
+    _int32 magic, textLength, nRefs;
+    bool worked = bam->read(&magic, 4) && BAMHeader::BAM_MAGIC == magic && bam->read(&textLength, 4) && textLength >= 0;
+    char *buffer = new char[BAMReader::MAX_RECORD_LENGTH];
+    for (_int32 left = textLength; worked && left > 0; ) {
+        _int32 bytes = __min(left, BAMReader::MAX_RECORD_LENGTH);
+        worked = bam->read(buffer, bytes);
+        left -= bytes;
+    }
+    worked = worked && bam->read(&nRefs, 4);
+    for (_int32 i = 0; worked && i < nRefs; i++) {
+        _int32 nameLength;
+        worked = bam->read(&nameLength, 4) && nameLength >= 0 && nameLength < BAMReader::MAX_RECORD_LENGTH && bam->read(buffer, nameLength + 4);
+    }
+    if (!worked) {
+        WriteErrorMessage("'%s' isn't a BAM file\n", bamFileName);
+        delete [] buffer;
+        delete bam;
+        return false;
+    }
+
+    ReadNameIndexBuilder builder(indexFileName);
+    _uint32 blockSize;
+    for (;;) {
+        _uint64 offset = bam->tell();
+        if (!bam->read(&blockSize, 4)) {
+            break;
+        }
+        if (blockSize < sizeof(BAMAlignment) - 4 || blockSize + 4 > (_uint32)BAMReader::MAX_RECORD_LENGTH ||
+                !bam->read(buffer + 4, blockSize)) {
+            WriteErrorMessage("Bad BAM record in '%s' at virtual offset %llu\n", bamFileName, offset);
+            delete [] buffer;
+            delete bam;
+            return false;
+        }
+        *(_uint32 *)buffer = blockSize;
+        BAMAlignment *record = (BAMAlignment *)buffer;
+        builder.add(record->read_name(), record->l_read_name > 0 ? record->l_read_name - 1 : 0, offset);
+    }
+
+    delete [] buffer;
+    delete bam;
+    ReadNameIndexBuilder *self = &builder;
+    return WriteIndex(indexFileName, 1, &self, NULL);
+}
+
+    ReadNameIndex *
+ReadNameIndex::open(const char *indexFileName)
+{
+    FILE *file = fopen(indexFileName, "rb");
+    if (NULL == file) {
+        return NULL;
+    }
+
+    ReadNameIndex *index = new ReadNameIndex();
+    index->file = file;
+    index->fanout = new _uint64[1 << FanoutBits];
+    char magic[sizeof(ReadNameIndexMagic)];
+    if (1 != fread(magic, sizeof(magic), 1, file) || memcmp(magic, ReadNameIndexMagic, sizeof(magic)) ||
+            1 != fread(&index->nEntries, sizeof(index->nEntries), 1, file) ||
+            (size_t)(1 << FanoutBits) != fread(index->fanout, sizeof(_uint64), 1 << FanoutBits, file)) {
+        WriteErrorMessage("'%s' isn't a read name index\n", indexFileName);
+        delete index;
+        return NULL;
+    }
+    return index;
+}
+
+ReadNameIndex::~ReadNameIndex()
+{
+    if (NULL != file) {
+        fclose(file);
+    }
+    delete [] fanout;
+}
+
+    void
+ReadNameIndex::lookup(const char *name, size_t nameLength, VariableSizeVector<_uint64> *o_offsets)
+{
+    _uint64 hash = HashName(name, nameLength);
+    size_t top = (size_t)(hash >> (64 - FanoutBits));
+    _uint64 begin = 0 == top ? 0 : fanout[top - 1];
+    _uint64 end = fanout[top];
+    if (begin >= end) {
+        return;
+    }
+
+    //
+    // The entries with the same top bits, which there aren't many of.
+    //
+    const _int64 headerSize = sizeof(ReadNameIndexMagic) + sizeof(nEntries) + sizeof(_uint64) * ((_int64)1 << FanoutBits);
+    _uint64 (*entries)[2] = new _uint64[end - begin][2];
+    if (0 != _fseek64bit(file, headerSize + begin * sizeof(entries[0]), SEEK_SET) ||
+            end - begin != fread(entries, sizeof(entries[0]), end - begin, file)) {
+        WriteErrorMessage("Unable to read read name index\n");
+        soft_exit(1);
+    }
+    for (_uint64 i = 0; i < end - begin; i++) {
+        if (entries[i][0] == hash) {
+            o_offsets->push_back(entries[i][1]);
+        }
+    }
+    delete [] entries;
+}
+
+    BgzfFile *
+BgzfFile::open(const char *fileName)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (NULL == file) {
+        WriteErrorMessage("Unable to open '%s'\n", fileName);
+        return NULL;
+    }
+    BgzfFile *bgzf = new BgzfFile();
+    bgzf->file = file;
+    bgzf->compressed = new char[BAM_BLOCK];
+    bgzf->block = new char[BAM_BLOCK];
+    bgzf->decompressor = GzipBlockDecompressor::Create();
+    memset(&bgzf->zstream, 0, sizeof(bgzf->zstream));
+    if (Z_OK != inflateInit2(&bgzf->zstream, -15)) {
+        WriteErrorMessage("Unable to initialize zlib\n");
+        soft_exit(1);
+    }
+    return bgzf;
+}
+
+BgzfFile::~BgzfFile()
+{
+    fclose(file);
+    inflateEnd(&zstream);
+    delete decompressor;
+    delete [] compressed;
+    delete [] block;
+}
+
+    bool
+BgzfFile::loadBlock(_uint64 offset)
+/*++
+
+Routine Description:
+
+    Read and decompress the block at offset in the compressed file.  An empty block (like the one at the end of a BAM
+    file) is fine; there's just nothing in it to read.
+
+--*/
+{
+    const size_t headerSize = 18;   // With the one subfield, BC, that BGZF blocks have
+    if (offset != nextBlockOffset && 0 != _fseek64bit(file, offset, SEEK_SET)) {     // (else the file's already there)
+        return false;
+    }
+    blockOffset = offset;
+    blockBytes = blockPos = 0;
+    if (1 != fread(compressed, headerSize, 1, file)) {
+        return false;
+    }
+    _uint16 xlen = *(_uint16 *)(compressed + 10);
+    if ((unsigned char)compressed[0] != 0x1f || (unsigned char)compressed[1] != 0x8b || !(compressed[3] & 4) || 6 != xlen ||
+            'B' != compressed[12] || 'C' != compressed[13]) {
+        WriteErrorMessage("Not a BGZF block at offset %llu\n", offset);
+        return false;
+    }
+    size_t compressedSize = *(_uint16 *)(compressed + 16) + 1;
+    if (compressedSize < headerSize + 8 || 1 != fread(compressed + headerSize, compressedSize - headerSize, 1, file)) {
+        return false;
+    }
+    nextBlockOffset = offset + compressedSize;
+
+    size_t uncompressedSize = *(_uint32 *)(compressed + compressedSize - 4);
+    if (uncompressedSize > BAM_BLOCK) {
+        return false;
+    }
+    size_t written;
+    if (NULL == decompressor || !decompressor->decompressBlock(compressed, compressedSize, block, uncompressedSize, &written)) {
+        inflateReset(&zstream);
+        zstream.next_in = (Bytef *)compressed + headerSize;
+        zstream.avail_in = (uInt)(compressedSize - headerSize - 8);
+        zstream.next_out = (Bytef *)block;
+        zstream.avail_out = (uInt)uncompressedSize;
+        int status = inflate(&zstream, Z_FINISH);
+        if (Z_STREAM_END != status) {
+            WriteErrorMessage("Unable to decompress BGZF block at offset %llu\n", offset);
+            return false;
+        }
+        written = uncompressedSize - zstream.avail_out;
+    }
+    blockBytes = written;
+    return written == uncompressedSize;
+}
+
+    _uint64
+BgzfFile::tell()
+{
+    return blockPos < blockBytes ? (blockOffset << 16) | blockPos : nextBlockOffset << 16;
+}
+
+    bool
+BgzfFile::seek(_uint64 virtualOffset)
+{
+    if (!loadBlock(virtualOffset >> 16)) {
+        return false;
+    }
+    blockPos = (size_t)(virtualOffset & 0xffff);
+    return blockPos <= blockBytes;
+}
+
+    bool
+BgzfFile::read(void *buffer, size_t bytes)
+{
+    char *p = (char *)buffer;
+    while (bytes > 0) {
+        if (blockPos == blockBytes && !loadBlock(nextBlockOffset)) {
+            return false;
+        }
+        size_t n = __min(bytes, blockBytes - blockPos);
+        memcpy(p, block + blockPos, n);
+        p += n;
+        blockPos += n;
+        bytes -= n;
+    }
+    return true;
+}
@@ -0,0 +1,151 @@
+/*++
+
+Module Name:
+
+    ReadNameIndex.h
+
+Abstract:
+
+    An index of a BAM file by read name, so that the records for a few read names can be pulled out of a big BAM without
+    reading all of it (see apps/ExtractReads).  It's built as SNAP writes sorted BAM output (-nameIndex), or afterwards
+    by reading the BAM through once.
+
+    The index file (the BAM's name with .rni on the end) has a 64 bit hash of the name of each record in the BAM and the
+    record's BGZF virtual offset, sorted by hash, after a table of how many hashes there are up to each value of their
+    top 16 bits.  A lookup reads the table entry and then the few hashes with the same top bits.  Different names can
+    have the same hash, so a reader has to check the names of the records it finds.
+
+    A builder holds up to a limit of entries in memory, sorted, and spills the rest to temp files in sorted runs, which
+    are merged when the index is written.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "BigAlloc.h"
+#include "VariableSizeVector.h"
+#include "zlib.h"
+#include <vector>
+
+class GzipWriterFilterSupplier;
+class GzipBlockDecompressor;
+
+extern const char *ReadNameIndexSuffix;     // ".rni"
+
+class ReadNameIndexBuilder {
+public:
+    //
+    // Offsets are BGZF virtual offsets, or, if gzipSupplier isn't NULL, uncompressed offsets in what it compressed, which
+    // are translated when the index is written.  Temp files are named for tempFilePrefix.
+    //
+    ReadNameIndexBuilder(const char *i_tempFilePrefix, GzipWriterFilterSupplier *i_gzipSupplier = NULL);
+
+    ~ReadNameIndexBuilder();
+
+    void add(const char *name, size_t nameLength, _uint64 offset);
+
+    //
+    // Write the index of a BAM file made of parts with a builder each, appended at partOffsets (in the compressed file;
+    // NULL for one part at the start).
+    //
+    static bool WriteIndex(const char *indexFileName, int nParts, ReadNameIndexBuilder **parts, const size_t *partOffsets);
+
+    //
+    // Read a BAM file through and write its index.
+    //
+    static bool IndexBAMFile(const char *bamFileName, const char *indexFileName);
+
+private:
+    struct Entry {
+        _uint64     hash;
+        _uint64     offset;
+
+        bool operator<(const Entry& peer) const {
+            return hash != peer.hash ? hash < peer.hash : offset < peer.offset;
+        }
+    };
+
+    void spill();
+
+    static const size_t MaxEntriesInMemory = 16 * 1024 * 1024;   // 256MB
+
+    const char                 *tempFilePrefix;
+    int                         instance;
+    GzipWriterFilterSupplier   *gzipSupplier;
+    std::vector<Entry>          entries;
+    int                         nRuns;  // Spilled to temp files
+
+    static volatile int         Instances;
+
+    friend class ReadNameIndexRun;
+};
+
+class ReadNameIndex {
+public:
+    //
+    // NULL if the file isn't there or isn't an index.
+    //
+    static ReadNameIndex *open(const char *indexFileName);
+
+    ~ReadNameIndex();
+
+    //
+    // The virtual offsets of the records whose names have the same hash as name, in file order.
+    //
+    void lookup(const char *name, size_t nameLength, VariableSizeVector<_uint64> *o_offsets);
+
+    inline _uint64 getNumEntries() const { return nEntries; }
+
+    static _uint64 HashName(const char *name, size_t nameLength);
+
+    static const int FanoutBits = 16;
+
+private:
+    ReadNameIndex() : file(NULL), nEntries(0), fanout(NULL) {}
+
+    FILE       *file;
+    _uint64     nEntries;
+    _uint64    *fanout;     // Entries with top bits up to and including each value
+};
+
+//
+// Sequential and random access reads of the uncompressed data of a BGZF file, a block at a time, by virtual offset.
+//
+class BgzfFile {
+public:
+    static BgzfFile *open(const char *fileName);
+
+    ~BgzfFile();
+
+    //
+    // The virtual offset of the next byte that read gets.
+    //
+    _uint64 tell();
+
+    bool seek(_uint64 virtualOffset);
+
+    //
+    // False if the file ends (or is bad) first.
+    //
+    bool read(void *buffer, size_t bytes);
+
+private:
+    BgzfFile() : file(NULL), blockOffset(0), nextBlockOffset(0), blockBytes(0), blockPos(0), decompressor(NULL) {}
+
+    bool loadBlock(_uint64 offset);
+
+    FILE                   *file;
+    _uint64                 blockOffset;        // In the compressed file, of the block in block
+    _uint64                 nextBlockOffset;
+    size_t                  blockBytes;
+    size_t                  blockPos;
+    char                   *compressed;
+    char                   *block;
+    z_stream                zstream;
+    GzipBlockDecompressor  *decompressor;       // NULL to just use zlib
+};
@@ -0,0 +1,583 @@
+/*++
+
+Module Name:
+
+    ReadPack.cpp
+
+Abstract:
+
+    SNAP's columnar read store.  See ReadPack.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ReadPack.h"
+#include "AlignerOptions.h"
+#include "SAM.h"
+#include "ReadTrimmer.h"
+#include "Tables.h"
+#include "Util.h"
+#include "Error.h"
+#include "exit.h"
+#include "zlib.h"
+#include <algorithm>
+
+extern char *FormatUIntWithCommas(_uint64 val, char *outputBuffer, size_t outputBufferSize);   // As in AlignerContext.cpp, not the one in Util.h
+
+static const char PackedBases[] = "AGCT";   // As VALUE_BASE, which may not be set up yet when our statics are
+
+static inline _uint64 RoundUpToAlignment(_uint64 size)
+{
+    return (size + 7) & ~(_uint64)7;
+}
+
+//
+// Each byte of packed bases as the four it holds.
+//
+static class UnpackTable {
+public:
+    UnpackTable() {
+        for (unsigned i = 0; i < 256; i++) {
+            for (unsigned j = 0; j < 4; j++) {
+                bases[i][j] = PackedBases[(i >> (2 * j)) & 3];
+            }
+        }
+    }
+
+    char bases[256][4];
+} Unpack;
+
+ReadPackReader::ReadPackReader(const ReaderContext& i_context) : ReadReader(i_context), fileName(NULL), mappedFile(NULL), contents(NULL),
+    fileSize(0), header(NULL), blockOffsets(NULL), nextBlock(0), endBlock(0), current(NULL)
+{
+}
+
+ReadPackReader::~ReadPackReader()
+{
+    for (size_t i = 0; i < slots.size(); i++) {
+        delete slots[i];
+    }
+    if (NULL != mappedFile) {
+        CloseMemoryMappedFile(mappedFile);
+    }
+    delete [] fileName;
+}
+
+    ReadPackReader *
+ReadPackReader::create(const char *fileName, _int64 startingOffset, _int64 amountOfFileToProcess, const ReaderContext& context)
+{
+    ReadPackReader *reader = new ReadPackReader(context);
+    reader->fileName = new char[strlen(fileName) + 1];
+    strcpy(reader->fileName, fileName);
+
+    reader->fileSize = QueryFileSize(fileName);
+    if (reader->fileSize < (_int64)sizeof(ReadPackFileHeader)) {
+        WriteErrorMessage("%s is too small to be a SNAP read pack file\n", fileName);
+        delete reader;
+        return NULL;
+    }
+
+    void *contents;
+    reader->mappedFile = OpenMemoryMappedFile(fileName, 0, reader->fileSize, &contents, false, true);
+    if (NULL == reader->mappedFile) {
+        WriteErrorMessage("Unable to map SNAP read pack file %s\n", fileName);
+        delete reader;
+        return NULL;
+    }
+    reader->contents = (const char *)contents;
+    reader->header = (const ReadPackFileHeader *)contents;
+
+    const ReadPackFileHeader *header = reader->header;
+    if (ReadPackMagic != header->magic || ReadPackVersion != header->version ||
+        header->blockIndexOffset + header->nBlocks * sizeof(_uint64) > (_uint64)reader->fileSize) {
+        WriteErrorMessage("%s isn't a SNAP read pack file (or was made by a different version of SNAP)\n", fileName);
+        delete reader;
+        return NULL;
+    }
+    reader->blockOffsets = (const _uint64 *)(reader->contents + header->blockIndexOffset);
+
+    reader->reinit(startingOffset, amountOfFileToProcess);
+    return reader;
+}
+
+    void
+ReadPackReader::reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
+{
+    //
+    // A block belongs to the range that it starts in.
+    //
+    const _uint64 *end = blockOffsets + header->nBlocks;
+    nextBlock = std::lower_bound(blockOffsets, end, (_uint64)startingOffset) - blockOffsets;
+    endBlock = std::lower_bound(blockOffsets, end, (_uint64)(startingOffset + amountOfFileToProcess)) - blockOffsets;
+    current = NULL;
+}
+
+    void
+ReadPackReader::unpackBlock(_int64 block, Slot *slot)
+{
+    const char *base = contents + blockOffsets[block];
+    const ReadPackBlockHeader *blockHeader = (const ReadPackBlockHeader *)base;
+    _uint64 totalBases = blockHeader->totalBases;
+    const char *column = base + RoundUpToAlignment(sizeof(ReadPackBlockHeader));
+
+    slot->block = block;
+    slot->nReads = blockHeader->nReads;
+    slot->nextRead = 0;
+    slot->nextBase = 0;
+    slot->lengths = (const _uint32 *)column;
+    column += RoundUpToAlignment(blockHeader->nReads * sizeof(_uint32));
+    slot->nameEnds = (const _uint32 *)column;
+    column += RoundUpToAlignment(blockHeader->nReads * sizeof(_uint32));
+    slot->names = column;
+    column += RoundUpToAlignment(blockHeader->namesBytes);
+    const unsigned char *packedBases = (const unsigned char *)column;
+    column += RoundUpToAlignment((totalBases + 3) / 4);
+    const unsigned char *nMask = (const unsigned char *)column;
+    column += RoundUpToAlignment((totalBases + 7) / 8);
+
+    if (column + blockHeader->qualityBytes > contents + fileSize) {
+        WriteErrorMessage("SNAP read pack file %s is truncated or corrupt at block %lld\n", fileName, block);
+        soft_exit(1);
+    }
+
+    if (slot->bufferSize < totalBases + 4) {
+        delete [] slot->data;
+        delete [] slot->quality;
+        slot->bufferSize = totalBases + totalBases / 4 + 4;   // +4 so the bases can be unpacked a whole byte at a time
+        slot->data = new char[slot->bufferSize];
+        slot->quality = new char[slot->bufferSize];
+    }
+
+    for (_uint64 i = 0; i < (totalBases + 3) / 4; i++) {
+        memcpy(slot->data + i * 4, Unpack.bases[packedBases[i]], 4);
+    }
+    for (_uint64 i = 0; i < (totalBases + 7) / 8; i++) {
+        if (0 != nMask[i]) {
+            for (unsigned bit = 0; bit < 8; bit++) {
+                if (nMask[i] & (1 << bit)) {
+                    slot->data[i * 8 + bit] = 'N';
+                }
+            }
+        }
+    }
+
+    uLongf qualityLength = (uLongf)totalBases;
+    if (Z_OK != uncompress((Bytef *)slot->quality, &qualityLength, (const Bytef *)column, (uLong)blockHeader->qualityBytes) ||
+        qualityLength != totalBases) {
+        WriteErrorMessage("Unable to decompress the qualities of block %lld of SNAP read pack file %s\n", block, fileName);
+        soft_exit(1);
+    }
+}
+
+    bool
+ReadPackReader::loadNextBlock()
+{
+    if (nextBlock >= endBlock) {
+        return false;
+    }
+
+    //
+    // Any slot that no one's holding will do, including the one we're moving off of.
+    //
+    Slot *slot = NULL;
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (0 == slots[i]->holds) {
+            slot = slots[i];
+            break;
+        }
+    }
+    if (NULL == slot) {
+        slot = new Slot;
+        slots.push_back(slot);
+    }
+
+    unpackBlock(nextBlock, slot);
+    nextBlock++;
+    current = slot;
+    return true;
+}
+
+    bool
+ReadPackReader::getNextRead(Read *readToUpdate)
+{
+    while (NULL == current || current->nextRead == current->nReads) {
+        if (!loadNextBlock()) {
+            return false;
+        }
+    }
+
+    unsigned whichRead = current->nextRead;
+    unsigned nameStart = 0 == whichRead ? 0 : current->nameEnds[whichRead - 1];
+    unsigned length = current->lengths[whichRead];
+
+    readToUpdate->init(current->names + nameStart, current->nameEnds[whichRead] - nameStart, current->data + current->nextBase,
+        current->quality + current->nextBase, length);
+    readToUpdate->clip(context.clipping);
+    if (NULL != context.trimmer) {
+        context.trimmer->trim(readToUpdate);
+    }
+    readToUpdate->setBatch(DataBatch((_uint32)(current->block + 1)));
+    readToUpdate->setReadGroup(context.defaultReadGroup);
+
+    current->nextRead++;
+    current->nextBase += length;
+    return true;
+}
+
+    bool
+ReadPackReader::getNextReadPair(Read *read0, Read *read1)
+{
+    //
+    // Blocks hold whole pairs, so both mates come from the same one.
+    //
+    return getNextRead(read0) && getNextRead(read1);
+}
+
+    void
+ReadPackReader::holdBatch(DataBatch batch)
+{
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i]->block + 1 == batch.batchID) {
+            slots[i]->holds++;
+            return;
+        }
+    }
+    _ASSERT(false);
+}
+
+    bool
+ReadPackReader::releaseBatch(DataBatch batch)
+{
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i]->block + 1 == batch.batchID && slots[i]->holds > 0) {
+            slots[i]->holds--;
+            return 0 == slots[i]->holds;
+        }
+    }
+    return true;
+}
+
+//
+// Range splitting over the blocks, for both single and paired alignments.
+//
+class ReadPackSupplierGenerator : public ReadSupplierGenerator, public PairedReadSupplierGenerator {
+public:
+    ReadPackSupplierGenerator(const char *i_fileName, int numThreads, const ReaderContext& i_context) : context(i_context)
+    {
+        fileName = new char[strlen(i_fileName) + 1];
+        strcpy(fileName, i_fileName);
+        splitter = NewInputFileSplitter(fileName, numThreads, sizeof(ReadPackFileHeader), 32768, context);
+    }
+
+    ~ReadPackSupplierGenerator()
+    {
+        delete splitter;
+        delete [] fileName;
+    }
+
+    ReadSupplier *generateNewReadSupplier()
+    {
+        int whichThread = splitter->addThread();
+        _int64 rangeStart, rangeLength, unit;
+        if (!splitter->getNextRange(whichThread, &rangeStart, &rangeLength, &unit)) {
+            return NULL;
+        }
+        return new RangeSplittingReadSupplier(splitter, whichThread, createReader(rangeStart, rangeLength), unit);
+    }
+
+    PairedReadSupplier *generateNewPairedReadSupplier()
+    {
+        int whichThread = splitter->addThread();
+        _int64 rangeStart, rangeLength, unit;
+        if (!splitter->getNextRange(whichThread, &rangeStart, &rangeLength, &unit)) {
+            return NULL;
+        }
+        return new RangeSplittingPairedReadSupplier(splitter, whichThread, createReader(rangeStart, rangeLength), unit);
+    }
+
+    ReaderContext *getContext() { return &context; }
+
+private:
+    ReadPackReader *createReader(_int64 rangeStart, _int64 rangeLength)
+    {
+        ReadPackReader *reader = ReadPackReader::create(fileName, rangeStart, rangeLength, context);
+        if (NULL == reader) {
+            soft_exit(1);
+        }
+        return reader;
+    }
+
+    WorkStealingRangeSplitter  *splitter;
+    char                       *fileName;
+    ReaderContext               context;
+};
+
+    ReadSupplierGenerator *
+ReadPackReader::createReadSupplierGenerator(const char *fileName, int numThreads, const ReaderContext& context)
+{
+    //
+    // Both mates of a paired pack are just reads to a single-end alignment.
+    //
+    return new ReadPackSupplierGenerator(fileName, numThreads, context);
+}
+
+    PairedReadSupplierGenerator *
+ReadPackReader::createPairedReadSupplierGenerator(const char *fileName, int numThreads, const ReaderContext& context)
+{
+    ReadPackReader *reader = ReadPackReader::create(fileName, 0, 0, context);
+    if (NULL == reader) {
+        soft_exit(1);
+    }
+    bool paired = reader->isPaired();
+    delete reader;
+
+    if (!paired) {
+        WriteErrorMessage("%s was packed with 'snap-aligner pack single', so it can't be used for a paired alignment\n", fileName);
+        soft_exit(1);
+    }
+    return new ReadPackSupplierGenerator(fileName, numThreads, context);
+}
+
+//
+// Collects reads into blocks and writes them out a block at a time.
+//
+class ReadPackWriter {
+public:
+    ReadPackWriter(const char *i_fileName, bool paired, bool i_binQualities);
+    ~ReadPackWriter();
+
+    void add(Read *read);
+    void close();
+
+    _uint64 getReadCount() const { return fileHeader.nReads; }
+    _uint64 getBlockCount() const { return fileHeader.nBlocks; }
+    _uint64 getBytesWritten() const { return offset; }
+
+private:
+    void write(const void *buffer, _uint64 size);   // Padded out to an 8 byte boundary
+    void flushBlock();
+
+    const char         *fileName;
+    FILE               *file;
+    bool                binQualities;
+    ReadPackFileHeader  fileHeader;
+    _uint64             offset;
+
+    std::vector<_uint64>        blockOffsets;
+    std::vector<_uint32>        lengths;
+    std::vector<_uint32>        nameEnds;
+    std::vector<char>           names;
+    std::vector<char>           bases;
+    std::vector<char>           qualities;
+};
+
+ReadPackWriter::ReadPackWriter(const char *i_fileName, bool paired, bool i_binQualities) : fileName(i_fileName), binQualities(i_binQualities), offset(0)
+{
+    file = fopen(fileName, "wb");
+    if (NULL == file) {
+        WriteErrorMessage("Unable to open %s for write\n", fileName);
+        soft_exit(1);
+    }
+
+    memset(&fileHeader, 0, sizeof(fileHeader));
+    fileHeader.magic = ReadPackMagic;
+    fileHeader.version = ReadPackVersion;
+    fileHeader.flags = (paired ? ReadPackPaired : 0) | (binQualities ? ReadPackQualitiesBinned : 0);
+    write(&fileHeader, sizeof(fileHeader));     // For now; close rewrites it
+}
+
+ReadPackWriter::~ReadPackWriter()
+{
+    if (NULL != file) {
+        fclose(file);
+    }
+}
+
+    void
+ReadPackWriter::write(const void *buffer, _uint64 size)
+{
+    static const char zeros[8] = {0};
+    _uint64 padding = RoundUpToAlignment(size) - size;
+    if ((0 != size && 1 != fwrite(buffer, size, 1, file)) || (0 != padding && 1 != fwrite(zeros, padding, 1, file))) {
+        WriteErrorMessage("Error writing %s\n", fileName);
+        soft_exit(1);
+    }
+    offset += size + padding;
+}
+
+    void
+ReadPackWriter::add(Read *read)
+{
+    unsigned length = read->getUnclippedLength();
+    const char *quality = read->getUnclippedQuality();
+    size_t baseOffset = bases.size();
+
+    lengths.push_back(length);
+    names.insert(names.end(), read->getId(), read->getId() + read->getIdLength());
+    nameEnds.push_back((_uint32)names.size());
+    bases.insert(bases.end(), read->getUnclippedData(), read->getUnclippedData() + length);
+    qualities.resize(baseOffset + length);
+    if (binQualities) {
+        SAMFormat::binQualities(&qualities[baseOffset], quality, length);
+    } else if (0 != length) {
+        memcpy(&qualities[baseOffset], quality, length);
+    }
+
+    fileHeader.nReads++;
+    if (lengths.size() == ReadPackReader::ReadsPerBlock) {
+        flushBlock();
+    }
+}
+
+    void
+ReadPackWriter::flushBlock()
+{
+    if (lengths.empty()) {
+        return;
+    }
+
+    ReadPackBlockHeader blockHeader;
+    memset(&blockHeader, 0, sizeof(blockHeader));
+    blockHeader.nReads = (_uint32)lengths.size();
+    blockHeader.totalBases = bases.size();
+    blockHeader.namesBytes = names.size();
+
+    std::vector<unsigned char> packedBases((bases.size() + 3) / 4, 0);
+    std::vector<unsigned char> nMask((bases.size() + 7) / 8, 0);
+    for (size_t i = 0; i < bases.size(); i++) {
+        int value = BASE_VALUE[(unsigned char)bases[i]];
+        if (value > 3) {
+            nMask[i / 8] |= 1 << (i % 8);
+            value = 0;
+        }
+        packedBases[i / 4] |= value << (2 * (i % 4));
+    }
+
+    uLongf compressedSize = compressBound((uLong)qualities.size());
+    std::vector<Bytef> compressedQualities(compressedSize);
+    if (Z_OK != compress2(&compressedQualities[0], &compressedSize, (const Bytef *)qualities.data(), (uLong)qualities.size(), Z_DEFAULT_COMPRESSION)) {
+        WriteErrorMessage("Unable to compress qualities for %s\n", fileName);
+        soft_exit(1);
+    }
+    blockHeader.qualityBytes = compressedSize;
+
+    blockOffsets.push_back(offset);
+    write(&blockHeader, sizeof(blockHeader));
+    write(lengths.data(), lengths.size() * sizeof(_uint32));
+    write(nameEnds.data(), nameEnds.size() * sizeof(_uint32));
+    write(names.data(), names.size());
+    write(packedBases.data(), packedBases.size());
+    write(nMask.data(), nMask.size());
+    write(compressedQualities.data(), compressedSize);
+
+    fileHeader.nBlocks++;
+    lengths.clear();
+    nameEnds.clear();
+    names.clear();
+    bases.clear();
+    qualities.clear();
+}
+
+    void
+ReadPackWriter::close()
+{
+    flushBlock();
+
+    fileHeader.blockIndexOffset = offset;
+    write(blockOffsets.data(), blockOffsets.size() * sizeof(_uint64));
+
+    if (0 != _fseek64bit(file, 0, SEEK_SET) || 1 != fwrite(&fileHeader, sizeof(fileHeader), 1, file) || 0 != fclose(file)) {
+        WriteErrorMessage("Error writing %s\n", fileName);
+        soft_exit(1);
+    }
+    file = NULL;
+}
+
+static void usage()
+{
+    WriteErrorMessage(
+        "Usage: snap-aligner pack single|paired <output.snappack> [-qbin] <input files>\n"
+        "Copies the reads of FASTQ, SAM or BAM inputs (given as for an alignment) into a SNAP read pack file, which\n"
+        "alignments read without parsing.  A paired pack holds the pairs that a paired alignment of the inputs would find,\n"
+        "and can be used for single or paired alignments.  Only ids, bases and qualities are kept.\n"
+        "  -qbin  Bin the qualities to Illumina's eight levels, which makes them much smaller\n");
+    soft_exit_no_print(1);
+}
+
+    void
+RunPack(int argc, const char **argv)
+{
+    if (argc < 3 || (strcmp(argv[0], "single") != 0 && strcmp(argv[0], "paired") != 0)) {
+        usage();
+    }
+    bool paired = strcmp(argv[0], "paired") == 0;
+    const char *outputFileName = argv[1];
+    if (!util::stringEndsWith(outputFileName, ".snappack")) {
+        WriteErrorMessage("The output file name should end in .snappack, so alignments know what it is\n");
+        soft_exit_no_print(1);
+    }
+
+    bool binQualities = false;
+    std::vector<SNAPFile> inputs;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-qbin") == 0) {
+            binQualities = true;
+            continue;
+        }
+
+        SNAPFile input;
+        int argsConsumed;
+        if (!SNAPFile::generateFromCommandLine(argv + i, argc - i, &argsConsumed, &input, paired, true)) {
+            usage();
+        }
+        if (ReadPackFile == input.fileType || CRAMFile == input.fileType) {
+            WriteErrorMessage("pack can't read %s\n", input.fileName);
+            soft_exit_no_print(1);
+        }
+        inputs.push_back(input);
+        i += argsConsumed - 1;
+    }
+    if (inputs.empty()) {
+        usage();
+    }
+
+    ReaderContext context;
+    memset(&context, 0, sizeof(context));
+    context.clipping = NoClipping;
+    context.paired = paired;
+
+    _int64 start = timeInMillis();
+    ReadPackWriter writer(outputFileName, paired, binQualities);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        ReaderContext inputContext(context);
+        if (paired) {
+            PairedReadSupplierGenerator *generator = inputs[i].createPairedReadSupplierGenerator(1, false, inputContext);
+            PairedReadSupplier *supplier = generator->generateNewPairedReadSupplier();
+            Read *read0, *read1;
+            while (NULL != supplier && supplier->getNextReadPair(&read0, &read1)) {
+                writer.add(read0);
+                writer.add(read1);
+            }
+            delete supplier;
+            delete generator;
+        } else {
+            ReadSupplierGenerator *generator = inputs[i].createReadSupplierGenerator(1, inputContext);
+            ReadSupplier *supplier = generator->generateNewReadSupplier();
+            Read *read;
+            while (NULL != supplier && NULL != (read = supplier->getNextRead())) {
+                writer.add(read);
+            }
+            delete supplier;
+            delete generator;
+        }
+    }
+    writer.close();
+
+    char readsString[50], bytesString[50];
+    WriteStatusMessage("Packed %s reads into %s (%s bytes) in %llds\n", FormatUIntWithCommas(writer.getReadCount(), readsString, sizeof(readsString)),
+        outputFileName, FormatUIntWithCommas(writer.getBytesWritten(), bytesString, sizeof(bytesString)), (timeInMillis() - start + 500) / 1000);
+}
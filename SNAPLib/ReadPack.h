@@ -0,0 +1,133 @@
+/*++
+
+Module Name:
+
+    ReadPack.h
+
+Abstract:
+
+    SNAP's own columnar read store (.snappack), and snap-aligner pack, which makes one from any input SNAP reads.
+    Parsing FASTQ, SAM and BAM is a large part of the time an aligner thread spends on a read, and a pack file has
+    nothing to parse: it's memory mapped, and its reads are cut out of it a block at a time.
+
+    A pack file is a header, blocks of up to ReadsPerBlock reads (whole pairs, in order, for a paired pack), and an
+    index of where each block starts.  Each block holds its reads a column at a time: their lengths, the ends of their
+    names and the names themselves, their bases two bits apiece with a mask of the ones that are N, and their qualities,
+    zlib compressed (and, with -qbin, binned to Illumina's eight levels first, which makes them far smaller).  The names
+    are used where they lie in the mapping, and a block's bases and qualities are unpacked together when a reader gets
+    to it.
+
+    Like the other range split inputs, aligner threads take byte ranges of the file, and a block belongs to the range
+    that it starts in.
+
+    Only the reads are kept: their ids, bases and qualities.  Any alignment, read group or optional fields that they
+    had in SAM, BAM or CRAM input aren't, and bases other than A, C, G and T become N.
+
+Environment:
+
+    User mode service.
+
+    A ReadPackReader belongs to one thread at a time, as with the other readers.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Read.h"
+#include "RangeSplitter.h"
+#include <vector>
+
+struct ReadPackFileHeader {
+    _uint64     magic;              // ReadPackMagic
+    _uint32     version;
+    _uint32     flags;              // ReadPackPaired, ReadPackQualitiesBinned
+    _uint64     nReads;             // Counting each mate of a pair
+    _uint64     nBlocks;
+    _uint64     blockIndexOffset;   // nBlocks _uint64 file offsets of the blocks, in order
+};
+
+struct ReadPackBlockHeader {
+    _uint32     nReads;
+    _uint32     unused;
+    _uint64     totalBases;
+    _uint64     namesBytes;
+    _uint64     qualityBytes;       // Compressed
+
+    //
+    // The columns follow the header, each starting on an 8 byte boundary: _uint32 lengths[nReads], _uint32
+    // nameEnds[nReads], the names, the bases (four to a byte, low bits first, valued as in BASE_VALUE), the N mask
+    // (a bit for each base) and the compressed qualities.
+    //
+};
+
+const _uint64 ReadPackMagic = 0x4b4341504e414e53;    // "SNAPPACK" as little endian bytes
+const _uint32 ReadPackVersion = 1;
+const _uint32 ReadPackPaired = 0x1;
+const _uint32 ReadPackQualitiesBinned = 0x2;
+
+class ReadPackReader : public ReadReader, public PairedReadReader {
+public:
+    //
+    // Returns NULL if the file can't be opened or isn't a pack file.
+    //
+    static ReadPackReader *create(const char *fileName, _int64 startingOffset, _int64 amountOfFileToProcess, const ReaderContext& context);
+    virtual ~ReadPackReader();
+
+    virtual bool getNextRead(Read *readToUpdate);
+    virtual bool getNextReadPair(Read *read0, Read *read1);
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+    virtual void holdBatch(DataBatch batch);
+    virtual bool releaseBatch(DataBatch batch);
+    virtual ReaderContext *getContext() { return &context; }
+
+    bool isPaired() const { return 0 != (header->flags & ReadPackPaired); }
+
+    static ReadSupplierGenerator *createReadSupplierGenerator(const char *fileName, int numThreads, const ReaderContext& context);
+    static PairedReadSupplierGenerator *createPairedReadSupplierGenerator(const char *fileName, int numThreads, const ReaderContext& context);
+
+    static const unsigned ReadsPerBlock = 4096;     // Even, so a pair is never split between blocks
+
+private:
+    ReadPackReader(const ReaderContext& i_context);
+
+    //
+    // A block's unpacked bases and qualities, which stay put while the batch for the block is held.
+    //
+    struct Slot {
+        Slot() : block(-1), holds(0), bufferSize(0), data(NULL), quality(NULL) {}
+        ~Slot() { delete [] data; delete [] quality; }
+
+        _int64          block;
+        int             holds;
+        _uint64         bufferSize;
+        char           *data;
+        char           *quality;
+        unsigned        nReads;
+        unsigned        nextRead;
+        _uint64         nextBase;
+        const _uint32  *lengths;
+        const _uint32  *nameEnds;
+        const char     *names;
+    };
+
+    bool loadNextBlock();
+    void unpackBlock(_int64 block, Slot *slot);
+
+    char                   *fileName;
+    MemoryMappedFile       *mappedFile;
+    const char             *contents;
+    _int64                  fileSize;
+    const ReadPackFileHeader *header;
+    const _uint64          *blockOffsets;
+
+    _int64                  nextBlock;
+    _int64                  endBlock;           // Of the range we're reading
+    std::vector<Slot *>     slots;
+    Slot                   *current;
+};
+
+//
+// snap-aligner pack single|paired <output.snappack> [-qbin] <inputs>
+//
+void RunPack(int argc, const char **argv);
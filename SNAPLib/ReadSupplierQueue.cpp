@@ -27,9 +27,79 @@ Revision History:
 #include "ReadSupplierQueue.h"
 #include "exit.h"
 #include "SAM.h"
+#include "ProgressReport.h"
+#include "PipelineTrace.h"
 
 //#define PAIR_MATCH_DEBUG
 
+ReadQueueElementRing::ReadQueueElementRing() : enqueuePosition(0), dequeuePosition(0)
+{
+    for (unsigned i = 0; i < Capacity; i++) {
+        cells[i].sequence = i;
+        cells[i].element = NULL;
+    }
+}
+
+    bool
+ReadQueueElementRing::push(ReadQueueElement *element)
+{
+    _uint64 position = enqueuePosition;
+    Cell *cell;
+    for (;;) {
+        cell = &cells[position & (Capacity - 1)];
+        _int64 difference = (_int64)cell->sequence - (_int64)position;
+        if (0 == difference) {
+            //
+            // The cell's free for this trip around.  Try to claim it.
+            //
+            _uint64 previous = InterlockedCompareExchange64AndReturnOldValue(&enqueuePosition, position + 1, position);
+            if (previous == position) {
+                break;
+            }
+            position = previous;
+        } else if (difference < 0) {
+            //
+            // The consumers haven't gotten to it from the last trip, so we're full.
+            //
+            return false;
+        } else {
+            position = enqueuePosition;
+        }
+    }
+
+    cell->element = element;
+    cell->sequence = position + 1;  // Publishes the element to the consumers
+
+    return true;
+}
+
+    ReadQueueElement *
+ReadQueueElementRing::pop()
+{
+    _uint64 position = dequeuePosition;
+    Cell *cell;
+    for (;;) {
+        cell = &cells[position & (Capacity - 1)];
+        _int64 difference = (_int64)cell->sequence - (_int64)(position + 1);
+        if (0 == difference) {
+            _uint64 previous = InterlockedCompareExchange64AndReturnOldValue(&dequeuePosition, position + 1, position);
+            if (previous == position) {
+                break;
+            }
+            position = previous;
+        } else if (difference < 0) {
+            return NULL;    // Empty
+        } else {
+            position = dequeuePosition;
+        }
+    }
+
+    ReadQueueElement *element = cell->element;
+    cell->sequence = position + Capacity;   // Frees the cell for the next trip around
+
+    return element;
+}
+
  ReadSupplierQueue::ReadSupplierQueue(ReadReader *reader)
      : tracker(64)
 {
@@ -60,10 +130,10 @@ ReadSupplierQueue::commonInit()
     nReadersRunning = 0;
     nSuppliersRunning = 0;
     allReadsQueued = false;
+    nextInputUnit = 0;
 
     balance = 0;
 
-    emptyQueue->next = emptyQueue->prev = emptyQueue;
     readyQueue[0].next = readyQueue[0].prev = &readyQueue[0];
     readyQueue[1].next = readyQueue[1].prev = &readyQueue[1];
 
@@ -76,8 +146,7 @@ ReadSupplierQueue::commonInit()
     // Create 2 buffers for the reader.  We'll add more buffers as we add suppliers.
     //
     for (int i = 0 ; i < 2; i++) {
-        ReadQueueElement *element = new ReadQueueElement;
-        element->addToTail(emptyQueue);
+        addEmptyElement(new ReadQueueElement);
     }
 
     AllowEventWaitersToProceed(&emptyBuffersAvailable);
@@ -147,8 +216,7 @@ ReadSupplierQueue::generateNewReadSupplier()
     // Add more queue elements for this supplier.
     //
     for (int i = 0; i < 2; i++) {
-        ReadQueueElement *element = new ReadQueueElement;
-        element->addToTail(emptyQueue);
+        addEmptyElement(new ReadQueueElement);
     }
 
     AllowEventWaitersToProceed(&emptyBuffersAvailable);
@@ -172,8 +240,7 @@ ReadSupplierQueue::generateNewPairedReadSupplier()
     // Add two more queue elements (4+MaxImbalance for paired-end, double file).
     //
     for (int i = 0; i < addElements; i++) {
-        ReadQueueElement *element = newElements[i];
-        element->addToTail(emptyQueue);
+        addEmptyElement(newElements[i]);
     }
 
     AllowEventWaitersToProceed(&emptyBuffersAvailable);
@@ -192,39 +259,50 @@ ReadSupplierQueue::getContext()
 ReadSupplierQueue::getElement()
 {
     _ASSERT(singleReader[1] == NULL);   // i.e., we're doing file (but possibly single or paired end) reads
-    //WriteErrorMessage("Thread %u: getElement wait acquire lock\n", GetThreadId());
-    AcquireExclusiveLock(&lock);
-    //WriteErrorMessage("Thread %u: getElement acquired lock\n", GetThreadId());
-    while (!areAnyReadsReady()) {
-        //WriteErrorMessage("Thread %u: getElement loop releasing lock\n", GetThreadId());
-        ReleaseExclusiveLock(&lock);
-        //WriteErrorMessage("Thread %u: getElement loop released lock\n", GetThreadId());
-        if (allReadsQueued) {
+
+    //
+    // This doesn't take the lock: the reader pushes full elements onto readyRing, and we're done when it's said
+    // everything's queued (which it does after pushing the last one) and the ring's empty.
+    //
+    ReadQueueElement *element = waitForElement(&readyRing, &readsReady, &allReadsQueued);
+    if (NULL != element) {
+        InterlockedAdd64AndReturnNewValue(&ProgressReporter::ReadElementsReady, -1);
+    }
+    return element;
+}
+
+    ReadQueueElement *
+ReadSupplierQueue::waitForElement(ReadQueueElementRing *ring, EventObject *available, volatile bool *giveUp)
+{
+    for (;;) {
+        for (int i = 0; i < SpinsBeforeBlocking; i++) {
+            ReadQueueElement *element = ring->pop();
+            if (NULL != element) {
+                return element;
+            }
+        }
+
+        //
+        // Close the event before looking one last time, so that a push after we look opens it again and we don't
+        // sleep through it.
+        //
+        PreventEventWaitersFromProceeding(available);
+
+        bool givingUp = NULL != giveUp && *giveUp;
+        ReadQueueElement *element = ring->pop();
+        if (NULL != element || givingUp) {
             //
-            // Everything's queued and the queue is empty.  No more work.
+            // Someone else may have closed the event on an element that's still there, or be waiting to hear that
+            // we're done, so leave it open for them.
             //
-            //WriteErrorMessage("Thread %u: getElement loop exit allReadsQueued\n", GetThreadId());
-            return NULL;
+            if (givingUp || !ring->isEmpty()) {
+                AllowEventWaitersToProceed(available);
+            }
+            return element;
         }
-        //WriteErrorMessage("Thread %u: getElement loop wait readsReady\n", GetThreadId());
-        WaitForEvent(&readsReady);
-        //WriteErrorMessage("Thread %u: getElement loop wait acquire lock\n", GetThreadId());
-        AcquireExclusiveLock(&lock);
-        //WriteErrorMessage("Thread %u: getElement loop acquired lock\n", GetThreadId());
-    }
-
-    ReadQueueElement *element = readyQueue[0].next;
-    _ASSERT(element != &readyQueue[0]);
-    element->removeFromQueue();
 
-    if (!areAnyReadsReady() && !allReadsQueued) {
-        //WriteErrorMessage("Thread %u: getElement block readsReady\n", GetThreadId());
-        PreventEventWaitersFromProceeding(&readsReady);
+        WaitForEvent(available);
     }
-    ReleaseExclusiveLock(&lock);
-    //WriteErrorMessage("Thread %u: getElement released lock\n", GetThreadId());
-
-    return element;
 }
 
         bool 
@@ -268,6 +346,7 @@ ReadSupplierQueue::getElements(ReadQueueElement **element1, ReadQueueElement **e
     if ((*element1)->totalReads == (*element2)->totalReads) {
         (*element1)->removeFromQueue();
         (*element2)->removeFromQueue();
+        InterlockedAdd64AndReturnNewValue(&ProgressReporter::ReadElementsReady, -2);
     } else {
         //fprintf(stderr,"getElements different sizes %d %d\n", (*element1)->totalReads, (*element2)->totalReads);
         // need to balance out reads between the two
@@ -295,9 +374,11 @@ ReadSupplierQueue::getElements(ReadQueueElement **element1, ReadQueueElement **e
             (*element1)->removeFromQueue();
             *element2 = copyOut;
         }
+        InterlockedAdd64AndReturnNewValue(&ProgressReporter::ReadElementsReady, -1);   // The larger one stays queued
         //WriteErrorMessage("Thread %u: balanced sizes %d %d\n", GetThreadId(), sizes[0], sizes[1]);
     }
     //fprintf(stderr,"getElements %x/%x with %d/%d reads\n", (int) (*element1), (int) (*element2), (*element1)->totalReads, (*element2)->totalReads);
+    (*element1)->inputUnit = nextInputUnit++;
 
     if (!areAnyReadsReady() && !allReadsQueued) {
         //WriteErrorMessage("Thread %u: getElements block readsReady\n", GetThreadId());
@@ -327,22 +408,25 @@ ReadSupplierQueue::areAnyReadsReady() // must hold the lock to call this.
     void 
 ReadSupplierQueue::doneWithElement(ReadQueueElement *element)
 {
-    //WriteErrorMessage("Thread %u: doneWithElement wait acquire lock\n", GetThreadId());
-    AcquireExclusiveLock(&lock);
-    //WriteErrorMessage("Thread %u: doneWithElement acquired lock\n", GetThreadId());
     _ASSERT(element->totalReads > 0);
     VariableSizeVector<DataBatch> batches = element->batches;
     element->batches.clear();
-    element->addToTail(emptyQueue);
+    addEmptyElement(element);
     AllowEventWaitersToProceed(&emptyBuffersAvailable);
-    //WriteErrorMessage("Thread %u: doneWithElement releasing lock\n", GetThreadId());
-    ReleaseExclusiveLock(&lock);
-    //WriteErrorMessage("Thread %u: doneWithElement released lock\n", GetThreadId());
     for (VariableSizeVector<DataBatch>::iterator b = batches.begin(); b != batches.end(); b++) {
         releaseBatch(*b);
     }
 }
 
+    void
+ReadSupplierQueue::addEmptyElement(ReadQueueElement *element)
+{
+    if (!emptyRing.push(element)) {
+        WriteErrorMessage("ReadSupplierQueue: more than %d queue elements; too many threads?\n", ReadQueueElementRing::Capacity);
+        soft_exit(1);
+    }
+}
+
     void 
 ReadSupplierQueue::supplierFinished()
 {
@@ -390,6 +474,7 @@ ReadSupplierQueue::releaseBatch(
 ReadSupplierQueue::ReaderThreadMain(void *param)
 {
     ReaderThreadParams *params = (ReaderThreadParams *)param;
+    BindThreadToHelperProcessors();
     params->queue->ReaderThread(params);
     delete params;
 }
@@ -397,21 +482,14 @@ ReadSupplierQueue::ReaderThreadMain(void *param)
     ReadQueueElement*
 ReadSupplierQueue::getEmptyElement()
 {
-    while (emptyQueue->next == emptyQueue) {
-        // Wait for a buffer.
-        //WriteErrorMessage("Thread %u: getEmptyElement releasing lock\n", GetThreadId());
+    ReadQueueElement *element = emptyRing.pop();
+    if (NULL == element) {
+        //
+        // Wait for a buffer, without the lock.
+        //
         ReleaseExclusiveLock(&lock);
-        //WriteErrorMessage("Thread %u: getEmptyElement released lock\n", GetThreadId());
-        WaitForEvent(&emptyBuffersAvailable);
-        //WriteErrorMessage("Thread %u: getEmptyElement acquiring lock\n", GetThreadId());
+        element = waitForElement(&emptyRing, &emptyBuffersAvailable, NULL);
         AcquireExclusiveLock(&lock);
-        //WriteErrorMessage("Thread %u: getEmptyElement acquired lock\n", GetThreadId());
-    }
-
-    ReadQueueElement *element = emptyQueue->next;
-    element->removeFromQueue();
-    if (emptyQueue->next == emptyQueue) {
-        PreventEventWaitersFromProceeding(&emptyBuffersAvailable);
     }
 
     return element;
@@ -477,6 +555,7 @@ ReadSupplierQueue::ReaderThread(ReaderThreadParams *params)
         // full or the reader finishes or it exceeds batch count
         //
         ReleaseExclusiveLock(&lock);
+        PipelineTraceSpan readSpan(ReadTraceEvent, true);
         element->totalReads = 0;
         for (; element->totalReads <= (int) elementSize - increment; element->totalReads += increment) {
             
@@ -557,8 +636,34 @@ ReadSupplierQueue::ReaderThread(ReaderThreadParams *params)
         }
 
         //WriteErrorMessage("ReadSupplierQueue element[%d] %x with %d reads %d batches\n", firstOrSecond, (int) element, element->totalReads, element->batches.size());
+        readSpan.end();
         
         AcquireExclusiveLock(&lock);
+
+        if (isSingleReader) {
+            //
+            // Push the element before saying that everything's queued, since getElement doesn't take the lock and
+            // will give up as soon as it sees allReadsQueued with an empty ring.
+            //
+            if (element->totalReads > 0) {
+                element->inputUnit = nextInputUnit++;
+                if (!readyRing.push(element)) {
+                    WriteErrorMessage("ReadSupplierQueue: ready ring overflowed\n");
+                    soft_exit(1);
+                }
+                InterlockedAdd64AndReturnNewValue(&ProgressReporter::ReadElementsReady, 1);
+            } else {
+                addEmptyElement(element);
+            }
+
+            if (done) {
+                _ASSERT(1 == nReadersRunning);
+                allReadsQueued = true;
+            }
+
+            AllowEventWaitersToProceed(&readsReady);
+            continue;
+        }
         
         // do this before AllowEventWaitersToProceed to avoid race condition
         if (done && 1 == nReadersRunning) {
@@ -569,6 +674,7 @@ ReadSupplierQueue::ReaderThread(ReaderThreadParams *params)
 
         if (element->totalReads > 0) {
             element->addToTail(&readyQueue[firstOrSecond]);
+            InterlockedAdd64AndReturnNewValue(&ProgressReporter::ReadElementsReady, 1);
             if (isSingleReader || &readyQueue[1-firstOrSecond] != readyQueue[1-firstOrSecond].next) {
                 //
                 // Signal that an element is ready.
@@ -615,10 +721,20 @@ ReadSupplierFromQueue::ReadSupplierFromQueue(
     outOfReads(false),
     currentElement(NULL),
     nextReadIndex(0),
-    done(false)
+    done(false),
+    listener(NULL)
 {
 }
 
+    void
+ReadSupplierFromQueue::setInputUnitListener(InputUnitListener *i_listener)
+{
+    listener = i_listener;
+    if (NULL != listener && NULL != currentElement) {
+        listener->beginInputUnit(currentElement->inputUnit);
+    }
+}
+
     Read *
 ReadSupplierFromQueue::getNextRead()
 {
@@ -643,18 +759,74 @@ ReadSupplierFromQueue::getNextRead()
             return NULL;
         }
         nextReadIndex = 0;
+        if (NULL != listener) {
+            listener->beginInputUnit(currentElement->inputUnit);
+        }
+    }
+
+    Read *read = &currentElement->reads[nextReadIndex++]; // Note the post increment.
+    read->decodeDeferredData();
+    return read;
+}
+
+    int
+ReadSupplierFromQueue::getNextReadBatch(Read **reads, int maxReads)
+/*++
+
+Routine Description:
+
+    Hand out whatever's left of the current element (up to maxReads), moving on to the next element first if it's empty.  The
+    queue is only touched once per element, the same as getNextRead, but the caller doesn't have to come back for every read.
+
+--*/
+{
+    if (done) {
+        return 0;
+    }
+
+    while (NULL == currentElement || nextReadIndex >= currentElement->totalReads) {
+        ReadQueueElement* doneElement = currentElement;
+        currentElement = queue->getElement();
+        if (doneElement != NULL) {
+            queue->doneWithElement(doneElement);
+        }
+        if (NULL == currentElement) {
+            done = true;
+            queue->supplierFinished();
+            return 0;
+        }
+        nextReadIndex = 0;
+        if (NULL != listener) {
+            listener->beginInputUnit(currentElement->inputUnit);
+        }
+    }
+
+    int nReads = __min(maxReads, currentElement->totalReads - nextReadIndex);
+    for (int i = 0; i < nReads; i++) {
+        reads[i] = &currentElement->reads[nextReadIndex + i];
+        reads[i]->decodeDeferredData();
     }
+    nextReadIndex += nReads;
 
-    return &currentElement->reads[nextReadIndex++]; // Note the post increment.
+    return nReads;
 }
 
 PairedReadSupplierFromQueue::PairedReadSupplierFromQueue(ReadSupplierQueue *i_queue, bool i_twoFiles) :
     queue(i_queue), twoFiles(i_twoFiles), done(false), 
-    currentElement(NULL), currentSecondElement(NULL), nextReadIndex(0) {}
+    currentElement(NULL), currentSecondElement(NULL), nextReadIndex(0), listener(NULL) {}
 
 PairedReadSupplierFromQueue::~PairedReadSupplierFromQueue()
 {}
 
+    void
+PairedReadSupplierFromQueue::setInputUnitListener(InputUnitListener *i_listener)
+{
+    listener = i_listener;
+    if (NULL != listener && NULL != currentElement) {
+        listener->beginInputUnit(currentElement->inputUnit);
+    }
+}
+
 
     bool
 PairedReadSupplierFromQueue::getNextReadPair(Read **read0, Read **read1)
@@ -687,6 +859,9 @@ PairedReadSupplierFromQueue::getNextReadPair(Read **read0, Read **read1)
             return false;
         }
 		nextReadIndex = 0;
+        if (NULL != listener) {
+            listener->beginInputUnit(currentElement->inputUnit);
+        }
     }
     if (twoFiles) {
         // Assert that both elements match.
@@ -724,6 +899,9 @@ PairedReadSupplierFromQueue::getNextReadPair(Read **read0, Read **read1)
         nextReadIndex += 2;
     }
 
+    (*read0)->decodeDeferredData();
+    (*read1)->decodeDeferredData();
+
     return true;
 }
     
@@ -58,6 +58,7 @@ struct ReadQueueElement {
     int                 totalReads;
     Read*               reads;
     BatchVector         batches;
+    _int64              inputUnit;      // Its number in input order, for -inputOrder (see InputUnitListener)
 
     void addToTail(ReadQueueElement *queueHead) {
         next = queueHead;
@@ -72,6 +73,36 @@ struct ReadQueueElement {
         prev = next = NULL;
     }
 };
+
+
+//
+// A bounded multi-producer, multi-consumer ring of element pointers (Vyukov's), so that the aligner threads can take
+// elements from the readers and give them back without any of them taking a lock.  Each cell has a sequence number that
+// says whether it's ready to be written or read for a given trip around the ring, and the producers and consumers each
+// claim a position with a compare-and-swap.  This relies on x86 ordering of volatile accesses, as does the rest of SNAP.
+//
+class ReadQueueElementRing {
+public:
+    ReadQueueElementRing();
+
+    bool push(ReadQueueElement *element);   // Returns false if the ring is full
+    ReadQueueElement *pop();                // Returns NULL if the ring is empty
+
+    bool isEmpty() const {return dequeuePosition == enqueuePosition;}  // Only a hint when there are other threads using it
+
+    static const unsigned Capacity = 4096;  // Has to be a power of 2, and more than the number of elements there'll ever be
+
+private:
+    struct Cell {
+        volatile _uint64                sequence;
+        ReadQueueElement * volatile     element;
+    };
+
+    Cell                cells[Capacity];
+    volatile _uint64    enqueuePosition;
+    char                pad[64];            // Keep the producers and consumers off each other's cache line
+    volatile _uint64    dequeuePosition;
+};
     
 class ReadSupplierQueue: public ReadSupplierGenerator, public PairedReadSupplierGenerator {
 public:
@@ -145,18 +176,35 @@ private:
     int                 nReadersRunning;
     int                 nSuppliersRunning;
     volatile bool       allReadsQueued;
+    _int64              nextInputUnit;      // Numbered as they're queued by one reader, or matched up for two (under the lock either way)
 
-    ReadQueueElement* getEmptyElement(); // must hold the lock to call this
+    ReadQueueElement* getEmptyElement(); // must hold the lock to call this; it's released while waiting
 
     bool areAnyReadsReady(); // must hold the lock to call this.
 
+    void addEmptyElement(ReadQueueElement *element);
+
+    //
+    // Pop an element from ring, spinning for a little while and then blocking on available if there isn't one.
+    // If giveUp is non-NULL, return NULL once it's set and the ring is empty.
+    //
+    ReadQueueElement *waitForElement(ReadQueueElementRing *ring, EventObject *available, volatile bool *giveUp);
+
+    static const int SpinsBeforeBlocking = 1000;
+
     //
     // Empty buffers waiting for the readers.
     //
-    ReadQueueElement    emptyQueue[1];
+    ReadQueueElementRing emptyRing;
+
+    //
+    // Full elements waiting for the suppliers when there's just one reader (readyQueue is used instead when there are
+    // two, since matching their elements up takes the lock).
+    //
+    ReadQueueElementRing readyRing;
   
     //
-    // Just one lock for all of the shared objects (the queues and Waiter objects, and counts of
+    // Just one lock for all of the other shared objects (the queues that aren't rings and Waiter objects, and counts of
     // readers and suppliers running, as well as allReadsQueued).
     //
     ExclusiveLock       lock;
@@ -183,6 +231,10 @@ public:
     ~ReadSupplierFromQueue() {}
 
     Read *getNextRead();
+
+    virtual int getNextReadBatch(Read **reads, int maxReads);
+
+    virtual void setInputUnitListener(InputUnitListener *i_listener);
     
     virtual void holdBatch(DataBatch batch)
     { queue->holdBatch(batch); }
@@ -196,6 +248,7 @@ private:
     bool                outOfReads;
     ReadQueueElement    *currentElement;
     int                 nextReadIndex;          
+    InputUnitListener   *listener;
 };
 
 class PairedReadSupplierFromQueue: public PairedReadSupplier {
@@ -205,6 +258,8 @@ public:
 
     bool getNextReadPair(Read **read0, Read **read1);
 
+    virtual void setInputUnitListener(InputUnitListener *i_listener);
+
     virtual void holdBatch(DataBatch batch)
     { queue->holdBatch(batch); }
 
@@ -218,4 +273,5 @@ private:
     ReadQueueElement    *currentElement;
     ReadQueueElement    *currentSecondElement;
     int                 nextReadIndex;          
+    InputUnitListener   *listener;
 };
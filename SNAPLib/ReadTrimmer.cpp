@@ -0,0 +1,140 @@
+/*++
+
+Module Name:
+
+    ReadTrimmer.cpp
+
+Abstract:
+
+    Adapter and quality trimming as reads are parsed.  See ReadTrimmer.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ReadTrimmer.h"
+#include "Read.h"
+
+#include "Simd.h"
+
+//
+// findAdapterAVX2 is compiled for AVX2 by itself, so the rest of SNAP still runs on processors without it.  MSVC doesn't
+// need to be told.
+//
+#ifdef _MSC_VER
+#define TRIMMER_VECTOR_TARGET(instructionSets)
+#else
+#define TRIMMER_VECTOR_TARGET(instructionSets) __attribute__((target(instructionSets)))
+#endif
+
+ReadTrimmer::FindAdapterFunction ReadTrimmer::findAdapterImplementation = KernelChooser<ReadTrimmer::FindAdapterFunction>("adapter trimming")
+    .avx2(X86_ONLY(ReadTrimmer::findAdapterAVX2)).scalar(ReadTrimmer::findAdapterScalar);
+
+ReadTrimmer::ReadTrimmer(const char *adapter, int i_minQuality, int i_window) :
+    adapterLength(0), minQuality(i_minQuality), window(i_window)
+{
+    memset(paddedAdapter, 0, sizeof(paddedAdapter));
+    if (NULL != adapter) {
+        adapterLength = __min((int)strlen(adapter), MaxAdapterLength);
+        for (int i = 0; i < adapterLength; i++) {
+            paddedAdapter[MaxAdapterLength + i] = TO_UPPER_CASE_DOT_TO_N[(unsigned char)adapter[i]];
+        }
+    }
+
+    for (int overlap = 0; overlap <= MaxAdapterLength; overlap++) {
+        maxMismatches[overlap] = overlap / 10;
+    }
+}
+
+    void
+ReadTrimmer::trim(Read *read) const
+{
+    unsigned length = read->getDataLength();
+    if (minQuality > 0) {
+        length = qualityTrimmedLength(read->getQuality(), length);
+    }
+    if (adapterLength > 0) {
+        length = (*findAdapterImplementation)(this, read->getData(), length);
+    }
+    if (length < read->getDataLength()) {
+        read->trimBack(length);
+    }
+}
+
+    unsigned
+ReadTrimmer::qualityTrimmedLength(const char *quality, unsigned length) const
+{
+    while (length > 0) {
+        unsigned windowLength = __min((unsigned)window, length);
+        int sum = 0;
+        for (unsigned i = length - windowLength; i < length; i++) {
+            sum += quality[i] - '!';
+        }
+        if (sum >= minQuality * (int)windowLength) {
+            break;
+        }
+        length--;
+    }
+    return length;
+}
+
+    unsigned
+ReadTrimmer::findAdapterScalar(const ReadTrimmer *trimmer, const char *bases, unsigned length)
+{
+    const char *adapter = trimmer->paddedAdapter + MaxAdapterLength;
+    for (unsigned start = 0; start + MinAdapterOverlap <= length; start++) {
+        int overlap = __min(trimmer->adapterLength, (int)(length - start));
+        int mismatches = 0;
+        for (int i = 0; i < overlap && mismatches <= trimmer->maxMismatches[overlap]; i++) {
+            mismatches += bases[start + i] != adapter[i];
+        }
+        if (mismatches <= trimmer->maxMismatches[overlap]) {
+            return start;
+        }
+    }
+    return length;
+}
+
+#ifdef SNAP_SIMD_X86
+    unsigned TRIMMER_VECTOR_TARGET("avx2")
+ReadTrimmer::findAdapterAVX2(const ReadTrimmer *trimmer, const char *bases, unsigned length)
+/*++
+
+Routine Description:
+
+    findAdapter comparing the adapter against all 32 bases at a start position at once.  Where a 32 byte load from the
+    start would run off the end of the read, it loads the last 32 bases of the read instead and compares them against
+    the adapter shifted over by as much, which the padding in paddedAdapter allows.  Reads shorter than that go the
+    scalar way.
+
+--*/
+{
+    if (length < 32) {
+        return findAdapterScalar(trimmer, bases, length);
+    }
+
+    const __m256i adapter = _mm256_loadu_si256((const __m256i *)(trimmer->paddedAdapter + MaxAdapterLength));
+    const __m256i end = _mm256_loadu_si256((const __m256i *)(bases + length - 32));
+
+    for (unsigned start = 0; start + MinAdapterOverlap <= length; start++) {
+        int overlap = __min(trimmer->adapterLength, (int)(length - start));
+        _uint32 lanes = overlap == 32 ? 0xffffffff : (1u << overlap) - 1;
+        _uint32 matches;
+        if (start + 32 <= length) {
+            matches = (_uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(bases + start)), adapter));
+        } else {
+            unsigned shift = start - (length - 32);
+            const __m256i shiftedAdapter = _mm256_loadu_si256((const __m256i *)(trimmer->paddedAdapter + MaxAdapterLength - shift));
+            matches = (_uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(end, shiftedAdapter));
+            lanes <<= shift;
+        }
+        if (CountOneBits(~matches & lanes) <= trimmer->maxMismatches[overlap]) {
+            return start;
+        }
+    }
+    return length;
+}
+#endif // SNAP_SIMD_X86
@@ -0,0 +1,68 @@
+/*++
+
+Module Name:
+
+    ReadTrimmer.h
+
+Abstract:
+
+    Adapter and quality trimming of FASTQ reads as they're parsed (-trimAdapter and -trimQuality), so that a separate
+    trimming pass (and the extra read and write of the whole input) isn't needed.  The trimmed bases are back clipped,
+    so the aligner doesn't see them, -mrl applies to what's left, and SAM and BAM output keeps them as soft clipping.
+
+    Quality trimming goes first: starting at the end of the read, it drops bases while the mean quality of the window
+    of -trimWindow bases ending at the last one is below -trimQuality.  Then it looks for the adapter: the first place
+    in the read where at least MinAdapterOverlap bases match the start of the adapter with no more than one mismatch in
+    ten, running off the end of the read if it needs to, and trims there.  Only the first MaxAdapterLength bases of the
+    adapter are compared, which is plenty to recognize it.  That's the same test cutadapt does for 3' adapters, less
+    indels.
+
+    Each start position's comparison is a single AVX2 compare of 32 bases where the processor has it.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class Read;
+
+class ReadTrimmer {
+public:
+    //
+    // adapter may be NULL for no adapter trimming, and minQuality 0 for no quality trimming.
+    //
+    ReadTrimmer(const char *adapter, int minQuality, int window);
+
+    void trim(Read *read) const;
+
+    static const int MaxAdapterLength = 32;
+    static const int MinAdapterOverlap = 3;
+
+private:
+    unsigned qualityTrimmedLength(const char *quality, unsigned length) const;
+
+    //
+    // Where the adapter starts in bases, or length if it's not there.
+    //
+    typedef unsigned (*FindAdapterFunction)(const ReadTrimmer *trimmer, const char *bases, unsigned length);
+    static FindAdapterFunction findAdapterImplementation;
+
+    static unsigned findAdapterScalar(const ReadTrimmer *trimmer, const char *bases, unsigned length);
+    static unsigned findAdapterAVX2(const ReadTrimmer *trimmer, const char *bases, unsigned length);
+
+    int         adapterLength;
+    int         minQuality;
+    int         window;
+    int         maxMismatches[MaxAdapterLength + 1];   // By overlap length
+
+    //
+    // The adapter with MaxAdapterLength bytes of padding on each side, so that a vector load at paddedAdapter +
+    // MaxAdapterLength - shift lines its start up with any of the last lanes of a load of the read.
+    //
+    char        paddedAdapter[3 * MaxAdapterLength];
+};
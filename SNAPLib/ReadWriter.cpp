@@ -30,26 +30,48 @@ Environment:
 #include "exit.h"
 #include "Error.h"
 #include "Genome.h"
+#include "StageTiming.h"
+#include "Bam.h"
+#include "SplitReadAligner.h"
+#include "SpliceJunctions.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+//
+// Where a record sorts: its location, except that one on a splice junction contig (index -gtf) goes where the writers
+// put it in the genome.
+//
+    static inline GenomeLocation
+sortLocation(const ReaderContext& context, GenomeLocation location)
+{
+    return NULL == context.junctions ? location : context.junctions->liftLocation(location);
+}
 
 class SimpleReadWriter : public ReadWriter
 {
 public:
-    SimpleReadWriter(const FileFormat* i_format, DataWriter* i_writer, const Genome* i_genome)
+    SimpleReadWriter(const FileFormat* i_format, DataWriter* i_writer, const Genome* i_genome, int affineGapPenalty)
         : format(i_format), writer(i_writer), genome(i_genome)
-    {}
+    {
+        lvc.setAffineGapPenalty(affineGapPenalty);
+    }
 
     virtual ~SimpleReadWriter()
     {
         delete writer;
     }
 
-	virtual bool writeHeader(const ReaderContext& context, bool sorted, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines);
+	virtual bool writeHeader(const ReaderContext& context, SortOrder sortOrder, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines);
 
     virtual bool writeReads(const ReaderContext& context, Read *read, SingleAlignmentResult *results, int nResults, bool firstIsPrimary);
 
     virtual bool writePairs(const ReaderContext& context, Read **reads /* array of size 2 */, PairedAlignmentResult *result, int nResults, 
         SingleAlignmentResult **singleResults /* array of size 2*/, int *nSingleResults /* array of size 2*/, bool firstIsPrimary);
 
+    virtual void beginInputUnit(_int64 unit)
+    { writer->beginInputUnit(unit); }
+
     virtual void close();
 
 private:
@@ -62,7 +84,7 @@ private:
     bool
 SimpleReadWriter::writeHeader(
     const ReaderContext& context,
-    bool sorted,
+    SortOrder sortOrder,
     int argc,
     const char **argv,
     const char *version,
@@ -83,7 +105,7 @@ SimpleReadWriter::writeHeader(
     char *writerBuffer = buffer;
     size_t writerBufferSize = size;
 
-	while (!format->writeHeader(context, buffer, size, &used, sorted, argc, argv, version, rgLine, omitSQLines)) {
+	while (!format->writeHeader(context, buffer, size, &used, sortOrder, argc, argv, version, rgLine, omitSQLines)) {
         delete[] localBuffer;
         size = 2 * size;
         localBuffer = new char[size];
@@ -124,6 +146,7 @@ SimpleReadWriter::writeReads(
     int nResults,
     bool firstIsPrimary)
 {
+    TIME_STAGE(FormatStage);
     char* buffer;
     size_t size;
     size_t used;
@@ -225,7 +248,7 @@ SimpleReadWriter::writeReads(
             // Everything worked OK.
             //
             for (int whichResult = 0; whichResult < nResults; whichResult++) {
-                writer->advance((unsigned)usedBuffer[whichResult], finalLocations[whichResult]);
+                writer->advance((unsigned)usedBuffer[whichResult], sortLocation(context, finalLocations[whichResult]));
             }
             result = true;
             goto done;
@@ -265,6 +288,7 @@ SimpleReadWriter::writePairs(
     int *nSingleResults /* array of size NUM_READS_PER_PAIR*/, 
     bool firstIsPrimary)
 {
+    TIME_STAGE(FormatStage);
     bool retVal = false;
     //
     // We need to write all alignments for the pair into the same buffer, so that a write from
@@ -309,6 +333,30 @@ SimpleReadWriter::writePairs(
         }
     }
 
+    //
+    // With -splitReads, a read that the aligner split into pieces is written as its first piece, soft clipped to it, and
+    // the other pieces follow the rest of the pair's records as supplementary ones.  That's as long as its primary
+    // alignment is still the first piece, which it isn't if it was filtered away.
+    //
+    const int MaxSATagLength = 1000;
+    const SplitAlignment *split[NUM_READS_PER_PAIR] = {NULL, NULL};
+    char saTagBuffers[NUM_READS_PER_PAIR][SplitAlignment::MaxSegments][MaxSATagLength];
+    const char *saTags[NUM_READS_PER_PAIR][SplitAlignment::MaxSegments];
+    size_t supplementaryUsed[NUM_READS_PER_PAIR][SplitAlignment::MaxSegments];
+    GenomeLocation supplementaryLocations[NUM_READS_PER_PAIR][SplitAlignment::MaxSegments];
+    for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+        const SplitAlignment *readSplit = reads[whichRead]->getSplitAlignment();
+        if (NULL != readSplit && nResults > 0 && firstIsPrimary && NotFound != result[0].status[whichRead] &&
+            result[0].location[whichRead] == readSplit->segments[0].location && result[0].direction[whichRead] == readSplit->segments[0].direction) {
+
+            split[whichRead] = readSplit;
+            for (int segment = 0; segment < readSplit->nSegments; segment++) {
+                saTags[whichRead][segment] = readSplit->getSATag(genome, segment, saTagBuffers[whichRead][segment], MaxSATagLength) ?
+                    saTagBuffers[whichRead][segment] : NULL;
+            }
+        }
+    }
+
     for (int pass = 0; pass < 2; pass++) {
 
         char* buffer;
@@ -356,6 +404,11 @@ SimpleReadWriter::writePairs(
                     //
                     int addFrontClipping = 0;
 
+                    if (0 == whichAlignmentPair && NULL != split[whichRead]) {
+                        reads[whichRead]->setSplitRecord(split[whichRead]->segments[0].readStart, split[whichRead]->segments[0].readLength, false,
+                            saTags[whichRead][0]);
+                    }
+
                     while (!format->writeRead(context, &lvc, buffer + used + tentativeUsed, size - used - tentativeUsed, &usedBuffer[firstOrSecond][whichAlignmentPair],
                         idLengths[whichRead], reads[whichRead], result[whichAlignmentPair].status[whichRead], result[whichAlignmentPair].mapq[whichRead], locations[whichRead], result[whichAlignmentPair].direction[whichRead],
                         whichAlignmentPair != 0 || !firstIsPrimary, &addFrontClipping, true, writeOrder[firstOrSecond] == 0,
@@ -393,6 +446,7 @@ SimpleReadWriter::writePairs(
                             locations[whichRead] += addFrontClipping;
                         }
                     } // While formatting didn't work
+                    reads[whichRead]->clearSplitRecord();
                     tentativeUsed += usedBuffer[firstOrSecond][whichAlignmentPair];
                 } // for first or second read
 
@@ -447,6 +501,49 @@ SimpleReadWriter::writePairs(
             } // For each single alignment of a read
         } // For each read
 
+        //
+        // And the supplementary records of split reads, with the primary alignment of the mate as their mate.
+        //
+        for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+            for (int segment = 1; NULL != split[whichRead] && segment < split[whichRead]->nSegments; segment++) {
+                const SplitSegment *piece = &split[whichRead]->segments[segment];
+                GenomeLocation location = piece->location;
+                int addFrontClipping = 0;
+                int cumulativePositiveAddFrontClipping = 0;
+                reads[whichRead]->setAdditionalFrontClipping(0);
+                reads[whichRead]->setSplitRecord(piece->readStart, piece->readLength, true, saTags[whichRead][segment]);
+
+                while (!format->writeRead(context, &lvc, buffer + used, size - used, &supplementaryUsed[whichRead][segment], idLengths[whichRead],
+                    reads[whichRead], SingleHit, piece->mapq, location, piece->direction, false, &addFrontClipping, true, 0 == whichRead,
+                    reads[1 - whichRead], result[0].status[1 - whichRead], finalLocations[1 - whichRead][0], result[0].direction[1 - whichRead], false)) {
+
+                    if (0 == addFrontClipping) {
+                        goto blownBuffer;
+                    }
+
+                    const Genome::Contig *originalContig = genome->getContigAtLocation(location);
+                    const Genome::Contig *newContig = genome->getContigAtLocation(location + addFrontClipping);
+                    if (newContig != originalContig || NULL == newContig || location + addFrontClipping > originalContig->beginningLocation + originalContig->length - genome->getChromosomePadding()) {
+                        //
+                        // Just leave this piece out.
+                        //
+                        supplementaryUsed[whichRead][segment] = 0;
+                        break;
+                    }
+                    if (addFrontClipping > 0) {
+                        cumulativePositiveAddFrontClipping += addFrontClipping;
+                        reads[whichRead]->setAdditionalFrontClipping(cumulativePositiveAddFrontClipping);
+                    }
+                    location += addFrontClipping;
+                }
+
+                reads[whichRead]->clearSplitRecord();
+                reads[whichRead]->setAdditionalFrontClipping(0);
+                supplementaryLocations[whichRead][segment] = location;
+                used += supplementaryUsed[whichRead][segment];
+            } // For each supplementary piece
+        } // For each read
+
         //
         // They all fit into the buffer.
         //
@@ -458,8 +555,8 @@ SimpleReadWriter::writePairs(
             for (int firstOrSecond = 0; firstOrSecond < NUM_READS_PER_PAIR; firstOrSecond++) {
                 // adjust for write order
                 int writeFirstOrSecond = (!!firstOrSecond) ^ (finalLocations[0][whichReadPair] > finalLocations[1][whichReadPair]); // goofy looking !! converts int to bool
-                writer->advance((unsigned)usedBuffer[firstOrSecond][whichReadPair],
-                    finalLocations[writeFirstOrSecond][whichReadPair] == InvalidGenomeLocation ? finalLocations[1 - writeFirstOrSecond][whichReadPair] : finalLocations[writeFirstOrSecond][whichReadPair]);
+                writer->advance((unsigned)usedBuffer[firstOrSecond][whichReadPair], sortLocation(context,
+                    finalLocations[writeFirstOrSecond][whichReadPair] == InvalidGenomeLocation ? finalLocations[1 - writeFirstOrSecond][whichReadPair] : finalLocations[writeFirstOrSecond][whichReadPair]));
             }
         }
 
@@ -468,7 +565,15 @@ SimpleReadWriter::writePairs(
         //
         for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
             for (int whichAlignment = 0; whichAlignment < nSingleResults[whichRead]; whichAlignment++) {
-                writer->advance((unsigned)usedBuffer[whichRead][nResults + whichAlignment], finalLocations[whichRead][nResults + whichAlignment]);
+                writer->advance((unsigned)usedBuffer[whichRead][nResults + whichAlignment], sortLocation(context, finalLocations[whichRead][nResults + whichAlignment]));
+            }
+        }
+
+        for (int whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+            for (int segment = 1; NULL != split[whichRead] && segment < split[whichRead]->nSegments; segment++) {
+                if (0 != supplementaryUsed[whichRead][segment]) {
+                    writer->advance((unsigned)supplementaryUsed[whichRead][segment], sortLocation(context, supplementaryLocations[whichRead][segment]));
+                }
             }
         }
 
@@ -476,6 +581,8 @@ SimpleReadWriter::writePairs(
         break;
 
 blownBuffer:
+        reads[0]->clearSplitRecord();
+        reads[1]->clearSplitRecord();
         if (pass > 0) {
             WriteErrorMessage("Unable to fit all alignments for one read pair into a single write buffer.  Increase the size of the write buffer with -wbs, or reduce the number of alignments with -om or -omax\n");
             WriteErrorMessage("Read id: '%.*s'\n", reads[0]->getIdLength(), reads[0]->getId());
@@ -514,11 +621,13 @@ SimpleReadWriter::close()
 class SimpleReadWriterSupplier : public ReadWriterSupplier
 {
 public:
-    SimpleReadWriterSupplier(const FileFormat* i_format, DataWriterSupplier* i_dataSupplier, const Genome* i_genome)
+    SimpleReadWriterSupplier(const FileFormat* i_format, DataWriterSupplier* i_dataSupplier, const Genome* i_genome,
+            int i_affineGapPenalty)
         :
         format(i_format),
         dataSupplier(i_dataSupplier),
-        genome(i_genome)
+        genome(i_genome),
+        affineGapPenalty(i_affineGapPenalty)
     {}
 
     ~SimpleReadWriterSupplier()
@@ -528,7 +637,7 @@ public:
 
     virtual ReadWriter* getWriter()
     {
-        return new SimpleReadWriter(format, dataSupplier->getWriter(), genome);
+        return new SimpleReadWriter(format, dataSupplier->getWriter(), genome, affineGapPenalty);
     }
 
     virtual void close()
@@ -540,14 +649,277 @@ private:
     const FileFormat* format;
     DataWriterSupplier* dataSupplier;
     const Genome* genome;
+    int affineGapPenalty;
 };
 
     ReadWriterSupplier*
 ReadWriterSupplier::create(
     const FileFormat* format,
     DataWriterSupplier* dataSupplier,
-    const Genome* genome)
+    const Genome* genome,
+    int affineGapPenalty)
 {
-    return new SimpleReadWriterSupplier(format, dataSupplier, genome);
+    return new SimpleReadWriterSupplier(format, dataSupplier, genome, affineGapPenalty);
 }
 
+
+//
+// -split: the records go to one output file per read group (or per field of the read name, such as a barcode), each
+// with its own writer supplier, and so its own sorter with -so.  The files are made as their keys turn up, named
+// after the output file with the key before its extension, and each gets the same header.
+//
+class SplitReadWriterSupplier : public ReadWriterSupplier
+{
+public:
+    SplitReadWriterSupplier(const FileFormat* i_format, AlignerOptions* i_options, const Genome* i_genome)
+        : format(i_format), options(i_options), genome(i_genome), haveHeader(false)
+    {
+        InitializeExclusiveLock(&lock);
+    }
+
+    ~SplitReadWriterSupplier()
+    {
+        for (std::unordered_map<std::string, ReadWriterSupplier*>::iterator it = suppliers.begin(); it != suppliers.end(); it++) {
+            delete it->second;
+        }
+        for (size_t i = 0; i < fileNames.size(); i++) {
+            delete[] fileNames[i];
+        }
+        DestroyExclusiveLock(&lock);
+    }
+
+    virtual ReadWriter* getWriter();
+
+    virtual void close()
+    {
+        for (std::unordered_map<std::string, ReadWriterSupplier*>::iterator it = suppliers.begin(); it != suppliers.end(); it++) {
+            it->second->close();
+        }
+    }
+
+    void setHeader(const ReaderContext& context, SortOrder sortOrder, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines);
+
+    //
+    // The file that read goes to.
+    //
+    std::string getKey(Read *read) const;
+
+    //
+    // A new writer for the key's file, making the file if it's the first.
+    //
+    ReadWriter* getWriterForKey(const std::string& key);
+
+private:
+    char* getFileName(const std::string& key) const;
+
+    const FileFormat*   format;
+    AlignerOptions*     options;
+    const Genome*       genome;
+
+    ExclusiveLock       lock;
+    std::unordered_map<std::string, ReadWriterSupplier*> suppliers;
+    std::vector<char*>  fileNames;
+
+    bool                haveHeader;
+    const ReaderContext* headerContext;
+    SortOrder           headerSortOrder;
+    int                 headerArgc;
+    const char**        headerArgv;
+    const char*         headerVersion;
+    const char*         headerRGLine;
+    bool                headerOmitSQLines;
+};
+
+class SplitReadWriter : public ReadWriter
+{
+public:
+    SplitReadWriter(SplitReadWriterSupplier* i_supplier) : supplier(i_supplier) {}
+
+    virtual ~SplitReadWriter()
+    {
+        for (std::unordered_map<std::string, ReadWriter*>::iterator it = writers.begin(); it != writers.end(); it++) {
+            delete it->second;
+        }
+    }
+
+    virtual bool writeHeader(const ReaderContext& context, SortOrder sortOrder, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines)
+    {
+        supplier->setHeader(context, sortOrder, argc, argv, version, rgLine, omitSQLines);
+        return true;
+    }
+
+    virtual bool writeReads(const ReaderContext& context, Read *read, SingleAlignmentResult *results, int nResults, bool firstIsPrimary)
+    {
+        return getWriter(read)->writeReads(context, read, results, nResults, firstIsPrimary);
+    }
+
+    virtual bool writePairs(const ReaderContext& context, Read **reads, PairedAlignmentResult *result, int nResults,
+        SingleAlignmentResult **singleResults, int *nSingleResults, bool firstIsPrimary)
+    {
+        return getWriter(reads[0])->writePairs(context, reads, result, nResults, singleResults, nSingleResults, firstIsPrimary);
+    }
+
+    virtual void close()
+    {
+        for (std::unordered_map<std::string, ReadWriter*>::iterator it = writers.begin(); it != writers.end(); it++) {
+            it->second->close();
+        }
+    }
+
+private:
+    ReadWriter* getWriter(Read *read)
+    {
+        std::string key = supplier->getKey(read);
+        std::unordered_map<std::string, ReadWriter*>::iterator it = writers.find(key);
+        if (it != writers.end()) {
+            return it->second;
+        }
+        ReadWriter* writer = supplier->getWriterForKey(key);
+        writers[key] = writer;
+        return writer;
+    }
+
+    SplitReadWriterSupplier* supplier;
+    std::unordered_map<std::string, ReadWriter*> writers;   // This thread's, by key
+};
+
+    ReadWriter*
+SplitReadWriterSupplier::getWriter()
+{
+    return new SplitReadWriter(this);
+}
+
+    void
+SplitReadWriterSupplier::setHeader(
+    const ReaderContext& context,
+    SortOrder sortOrder,
+    int argc,
+    const char **argv,
+    const char *version,
+    const char *rgLine,
+    bool omitSQLines)
+{
+    AcquireExclusiveLock(&lock);
+    haveHeader = true;
+    headerContext = &context;
+    headerSortOrder = sortOrder;
+    headerArgc = argc;
+    headerArgv = argv;
+    headerVersion = version;
+    headerRGLine = rgLine;
+    headerOmitSQLines = omitSQLines;
+    ReleaseExclusiveLock(&lock);
+}
+
+    std::string
+SplitReadWriterSupplier::getKey(Read *read) const
+{
+    const char *key = NULL;
+    unsigned keyLength = 0;
+    if (0 != options->splitNameField) {
+        if (!read->getIdField(options->splitNameField, &key, &keyLength)) {
+            key = NULL;
+        }
+    } else if (read->getReadGroup() == READ_GROUP_FROM_AUX) {
+        unsigned auxLength;
+        bool auxIsSAM;
+        char *aux = read->getAuxiliaryData(&auxLength, &auxIsSAM);
+        if (auxIsSAM) {
+            for (char* p = aux; p != NULL && p < aux + auxLength; p = SAMReader::skipToBeyondNextFieldSeparator(p, aux + auxLength)) {
+                if (strncmp(p, "RG:Z:", 5) == 0) {
+                    size_t fieldLength;
+                    SAMReader::skipToBeyondNextFieldSeparator(p, aux + auxLength, &fieldLength);
+                    key = p + 5;
+                    keyLength = (unsigned)fieldLength - 5;
+                    break;
+                }
+            }
+        } else {
+            for (BAMAlignAux* bamAux = (BAMAlignAux*) aux; (char*) bamAux < aux + auxLength; bamAux = bamAux->next()) {
+                if (bamAux->tag[0] == 'R' && bamAux->tag[1] == 'G' && bamAux->val_type == 'Z') {
+                    key = (const char *)bamAux->value();
+                    keyLength = (unsigned)strlen(key);
+                    break;
+                }
+            }
+        }
+    } else if (NULL != read->getReadGroup()) {
+        key = read->getReadGroup();
+        keyLength = (unsigned)strlen(key);
+    }
+
+    if (NULL == key || 0 == keyLength) {
+        return "unassigned";
+    }
+
+    //
+    // It's going into a file name, so anything but letters, digits, '-' and '_' becomes '_'.
+    //
+    std::string result(key, keyLength);
+    for (size_t i = 0; i < result.size(); i++) {
+        if (!isalnum((unsigned char)result[i]) && result[i] != '-' && result[i] != '_') {
+            result[i] = '_';
+        }
+    }
+    return result;
+}
+
+    char*
+SplitReadWriterSupplier::getFileName(const std::string& key) const
+{
+    const char *outputFileName = options->outputFile.fileName;
+    const char *extension = strrchr(outputFileName, '.');
+    const char *lastSlash = __max(strrchr(outputFileName, '/'), strrchr(outputFileName, '\\'));
+    size_t baseLength = (NULL != extension && extension > lastSlash) ? extension - outputFileName : strlen(outputFileName);
+
+    char *fileName = new char[strlen(outputFileName) + key.size() + 2];
+    memcpy(fileName, outputFileName, baseLength);
+    fileName[baseLength] = '.';
+    memcpy(fileName + baseLength + 1, key.c_str(), key.size());
+    strcpy(fileName + baseLength + 1 + key.size(), outputFileName + baseLength);
+    return fileName;
+}
+
+    ReadWriter*
+SplitReadWriterSupplier::getWriterForKey(const std::string& key)
+{
+    AcquireExclusiveLock(&lock);
+
+    ReadWriterSupplier *supplier;
+    std::unordered_map<std::string, ReadWriterSupplier*>::iterator it = suppliers.find(key);
+    if (it != suppliers.end()) {
+        supplier = it->second;
+    } else {
+        //
+        // The formats make their writers for options->outputFile.fileName, so point it at this key's file while they do.
+        // They only look at it here and at the start of the run, and the lock keeps other keys out.
+        //
+        char *fileName = getFileName(key);
+        fileNames.push_back(fileName);
+        const char *outputFileName = options->outputFile.fileName;
+        options->outputFile.fileName = fileName;
+        supplier = format->getWriterSupplier(options, genome);
+        options->outputFile.fileName = outputFileName;
+        suppliers[key] = supplier;
+
+        if (haveHeader) {
+            ReadWriter* headerWriter = supplier->getWriter();
+            headerWriter->writeHeader(*headerContext, headerSortOrder, headerArgc, headerArgv, headerVersion, headerRGLine, headerOmitSQLines);
+            headerWriter->close();
+            delete headerWriter;
+        }
+    }
+
+    ReadWriter *writer = supplier->getWriter();
+    ReleaseExclusiveLock(&lock);
+    return writer;
+}
+
+    ReadWriterSupplier*
+ReadWriterSupplier::createSplit(
+    const FileFormat* format,
+    AlignerOptions* options,
+    const Genome* genome)
+{
+    return new SplitReadWriterSupplier(format, options, genome);
+}
@@ -0,0 +1,111 @@
+/*++
+
+Module Name:
+
+    ResourcePlan.cpp
+
+Abstract:
+
+    Sizing threads and buffers to the container's limits.  See ResourcePlan.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ResourcePlan.h"
+#include "AlignerOptions.h"
+#include "GenomeIndex.h"
+#include "Error.h"
+
+static const _int64 GB = (_int64)1 << 30;
+static const _int64 MB = (_int64)1 << 20;
+
+//
+// What isn't known until the index is loaded and the aligners are built is estimated: this is about what the aligners
+// use per thread on a human genome (see -mem for the real numbers), and each input buffer is about this big before
+// -xf's room for decompressing.
+//
+static const _int64 AlignerBytesPerThread = 256 * MB;
+static const _int64 InputBufferBytes = 4 * MB;
+static const int InputBuffersPerThread = 4;    // for each input file (see ReadSupplierQueue::BufferCount)
+
+static const _int64 MinSortBytes = 256 * MB;
+static const size_t MinWriteBufferSize = 4 * MB;
+static const int WriteBuffersPerThread = 4;
+
+    static _int64
+BytesPerThread(AlignerOptions *options, size_t writeBufferSize)
+{
+    int inputFiles = options->isPaired() ? 2 : 1;
+    _int64 input = (_int64)(InputBuffersPerThread * inputFiles * InputBufferBytes * (1 + options->expansionFactor));
+    return AlignerBytesPerThread + input + WriteBuffersPerThread * (_int64)writeBufferSize;
+}
+
+    void
+PlanResources(AlignerOptions *options)
+{
+    unsigned processorLimit = GetContainerProcessorLimit();
+    _int64 memoryLimit = GetContainerMemoryLimit();
+    if (options->memoryLimit > 0 && (0 == memoryLimit || options->memoryLimit * GB < memoryLimit)) {
+        memoryLimit = (_int64)(options->memoryLimit * GB);
+    }
+    if (0 == processorLimit && 0 == memoryLimit) {
+        return;
+    }
+
+    if (0 != processorLimit && ! options->numThreadsGiven && options->numThreads > (int)processorLimit) {
+        options->numThreads = (int)processorLimit;
+    }
+
+    if (0 == memoryLimit) {
+        WriteStatusMessage("Resource plan: %u processors allowed, so %d thread%s\n", processorLimit, options->numThreads,
+            options->numThreads == 1 ? "" : "s");
+        return;
+    }
+
+    //
+    // A tenth is left for everything that isn't counted, like the process itself, the sort's merge and the page cache
+    // the output goes through.
+    //
+    _int64 indexBytes = strcmp(options->indexDir, "-") == 0 ? 0 : GenomeIndex::getSizeOnDisk(options->indexDir);
+    _int64 available = memoryLimit - memoryLimit / 10 - indexBytes;
+    bool planSort = options->sortOutput && 0 == options->sortMemory;
+    _int64 sortBytes = ! options->sortOutput ? 0 : planSort ? MinSortBytes : (_int64)(options->sortMemory * GB);
+
+    if (! options->numThreadsGiven) {
+        while (options->numThreads > 1 && options->numThreads * BytesPerThread(options, options->writeBufferSize) + sortBytes > available) {
+            options->numThreads--;
+        }
+    }
+    if (! options->writeBufferSizeGiven) {
+        while (options->writeBufferSize / 2 >= MinWriteBufferSize &&
+            options->numThreads * BytesPerThread(options, options->writeBufferSize) + sortBytes > available) {
+            options->writeBufferSize /= 2;
+        }
+    }
+    _int64 threadBytes = options->numThreads * BytesPerThread(options, options->writeBufferSize);
+    if (planSort) {
+        // the default is a Gb a thread (see DataWriterSupplier::sorted)
+        sortBytes = __max(MinSortBytes, __min(options->numThreads * GB, available - threadBytes));
+        options->sortMemory = (double)sortBytes / GB;
+    }
+
+    char processors[40] = "";
+    if (0 != processorLimit) {
+        snprintf(processors, sizeof(processors), "%u processors and ", processorLimit);
+    }
+    char sorting[40] = "";
+    if (options->sortOutput) {
+        snprintf(sorting, sizeof(sorting), ", %.2f Gb for sorting", options->sortMemory);
+    }
+    WriteStatusMessage("Resource plan: %s%.1f Gb allowed, so %d thread%s, %lld Mb write buffers%s (index %.1f Gb)\n", processors,
+        (double)memoryLimit / GB, options->numThreads, options->numThreads == 1 ? "" : "s", (_int64)(options->writeBufferSize / MB),
+        sorting, (double)indexBytes / GB);
+    if (threadBytes + sortBytes > available) {
+        WriteErrorMessage("Warning: the index (%.1f Gb) and %d thread%s probably need more than the %.1f Gb memory limit\n",
+            (double)indexBytes / GB, options->numThreads, options->numThreads == 1 ? "" : "s", (double)memoryLimit / GB);
+    }
+}
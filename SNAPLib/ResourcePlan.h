@@ -0,0 +1,36 @@
+/*++
+
+Module Name:
+
+    ResourcePlan.h
+
+Abstract:
+
+    Fitting SNAP into the container it runs in.  By default SNAP uses a thread per processor on the host and a Gb of
+    sort buffer per thread, which under a cgroup CPU quota or memory limit (a Kubernetes pod, say) oversubscribes the
+    processors or gets the process killed.  So before the index is loaded, the processors the quota allows cap -t,
+    and the memory limit (or -memLimit, if that's less) is shared out: the index and a tenth for everything that isn't
+    counted come off the top, each thread needs its aligner's working memory, its share of the input buffers and its
+    output buffers (-wbs), and sorted output gets what's left, up to its usual size.  If that doesn't fit, there are
+    fewer threads and then smaller output buffers.
+
+    Only the defaults are planned; -t, -wbs and -sm from the command line are kept as they are.  The reading,
+    decompression and compression threads all follow -t, so they're capped along with it.  Without a container limit
+    (or -memLimit) nothing changes.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class AlignerOptions;
+
+//
+// Adjust options to the container's limits, and say what was chosen.  Call once the options have been parsed.
+//
+void PlanResources(AlignerOptions *options);
@@ -0,0 +1,166 @@
+/*++
+
+Module Name:
+
+    ReverseComplement.cpp
+
+Abstract:
+
+    Reverse complementing and upper casing reads 16 bases at a time.  See ReverseComplement.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ReverseComplement.h"
+#include "Tables.h"
+
+#include "Simd.h"
+
+static inline char ComplementBase(char base)
+{
+    switch (base) {
+        case 'A': return 'T';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        case 'T': return 'A';
+        default: return 'N';
+    }
+}
+
+//
+// The bases from start on, one at a time.
+//
+static unsigned ReverseComplementTail(const char *data, const char *quality, unsigned start, unsigned length, char *rcData, char *rcQuality,
+    char *reversedData, char *complementData)
+{
+    unsigned nNs = 0;
+    for (unsigned i = start; i < length; i++) {
+        char complement = ComplementBase(data[i]);
+        nNs += 'N' == data[i];
+        if (NULL != rcData) {
+            rcData[length - i - 1] = complement;
+        }
+        if (NULL != rcQuality) {
+            rcQuality[length - i - 1] = quality[i];
+        }
+        if (NULL != reversedData) {
+            reversedData[length - i - 1] = data[i];
+        }
+        if (NULL != complementData) {
+            complementData[i] = complement;
+        }
+    }
+    return nNs;
+}
+
+static unsigned ReverseComplementScalar(const char *data, const char *quality, unsigned length, char *rcData, char *rcQuality,
+    char *reversedData, char *complementData)
+{
+    return ReverseComplementTail(data, quality, 0, length, rcData, rcQuality, reversedData, complementData);
+}
+
+    static unsigned SIMD_TARGET("ssse3")
+ReverseComplementVector(const char *data, const char *quality, unsigned length, char *rcData, char *rcQuality,
+    char *reversedData, char *complementData)
+/*++
+
+Routine Description:
+
+    ReverseComplementRead 16 bases at a time.  A, C, G, T and N all have different low nibbles (1, 3, 7, 4 and 14), so
+    one lookup (pshufb or tbl) on the low nibble gives the complement of each base and another gives the base that it
+    would have to be for that complement to be right; anything that isn't that base becomes N.
+
+--*/
+{
+    static const char complementByNibble[16] = {'N', 'T', 'N', 'G', 'A', 'N', 'N', 'C', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N'};
+    static const char baseByNibble[16] = {0, 'A', 0, 'C', 'T', 0, 0, 'G', 0, 0, 0, 0, 0, 0, 'N', 0};
+    const Vector16 complementTable = Vector16Load(complementByNibble);
+    const Vector16 baseTable = Vector16Load(baseByNibble);
+    const Vector16 n = Vector16Set1('N');
+
+    unsigned nNs = 0;
+    unsigned i;
+    for (i = 0; i + 16 <= length; i += 16) {
+        Vector16 bases = Vector16Load(data + i);
+        Vector16 nibbles = Vector16LowNibbles(bases);
+        Vector16 isBase = Vector16Equal(Vector16Lookup(baseTable, nibbles), bases);
+        Vector16 complement = Vector16Select(isBase, Vector16Lookup(complementTable, nibbles), n);
+
+        nNs += CountOneBits(Vector16MoveMask(Vector16Equal(bases, n)));
+
+        if (NULL != rcData) {
+            Vector16Store(rcData + length - i - 16, Vector16Reverse(complement));
+        }
+        if (NULL != rcQuality) {
+            Vector16Store(rcQuality + length - i - 16, Vector16Reverse(Vector16Load(quality + i)));
+        }
+        if (NULL != reversedData) {
+            Vector16Store(reversedData + length - i - 16, Vector16Reverse(bases));
+        }
+        if (NULL != complementData) {
+            Vector16Store(complementData + i, complement);
+        }
+    }
+
+    return nNs + ReverseComplementTail(data, quality, i, length, rcData, rcQuality, reversedData, complementData);
+}
+
+typedef unsigned (*ReverseComplementFunction)(const char *data, const char *quality, unsigned length, char *rcData, char *rcQuality,
+    char *reversedData, char *complementData);
+
+static ReverseComplementFunction ReverseComplementImplementation = KernelChooser<ReverseComplementFunction>("reverse complement")
+    .vector16Lookup(ReverseComplementVector).scalar(ReverseComplementScalar);
+
+    unsigned
+ReverseComplementRead(const char *data, const char *quality, unsigned length, char *rcData, char *rcQuality, char *reversedData, char *complementData)
+{
+    return (*ReverseComplementImplementation)(data, quality, length, rcData, rcQuality, reversedData, complementData);
+}
+
+//
+// Lower case letters and dots, 16 at a time.  SSE2 (or NEON) is all this needs, so there's nothing to choose.
+//
+static inline Vector16 LowerCaseOrDot(Vector16 text, Vector16 *dots)
+{
+    *dots = Vector16Equal(text, Vector16Set1('.'));
+    return Vector16And(Vector16Greater(text, Vector16Set1('a' - 1)), Vector16Greater(Vector16Set1('z' + 1), text));
+}
+
+    bool
+ReadNeedsUpcasing(const char *data, unsigned length)
+{
+    Vector16 any = Vector16Zero();
+    unsigned i;
+    for (i = 0; i + 16 <= length; i += 16) {
+        Vector16 dots;
+        Vector16 lower = LowerCaseOrDot(Vector16Load(data + i), &dots);
+        any = Vector16Or(any, Vector16Or(lower, dots));
+    }
+
+    unsigned anyLowerCase = Vector16MoveMask(any);
+    for (; i < length; i++) {
+        anyLowerCase |= IS_LOWER_CASE_OR_DOT[(unsigned char)data[i]];
+    }
+    return 0 != anyLowerCase;
+}
+
+    void
+UpcaseRead(const char *data, char *upcased, unsigned length)
+{
+    unsigned i;
+    for (i = 0; i + 16 <= length; i += 16) {
+        Vector16 text = Vector16Load(data + i);
+        Vector16 dots;
+        Vector16 lower = LowerCaseOrDot(text, &dots);
+        text = Vector16Sub(text, Vector16And(lower, Vector16Set1(0x20)));
+        Vector16Store(upcased + i, Vector16Select(dots, Vector16Set1('N'), text));
+    }
+
+    for (; i < length; i++) {
+        upcased[i] = TO_UPPER_CASE_DOT_TO_N[(unsigned char)data[i]];
+    }
+}
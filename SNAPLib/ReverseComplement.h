@@ -0,0 +1,43 @@
+/*++
+
+Module Name:
+
+    ReverseComplement.h
+
+Abstract:
+
+    Building the reverse complement of a read (and the reversed and complemented copies that the backward Landau-Vishkin
+    wants), and upper casing reads as they come in.  Read, BaseAligner and IntersectingPairedEndAligner all do this for
+    every read, so it's done 16 bases at a time: with SSSE3 (or NEON) the complement and the reversal are each one
+    table lookup.
+
+    A, C, G and T complement to T, G, C and A, and anything else (N included) becomes N.  Reads have already been upper
+    cased (with '.' made N) by the time they're complemented.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// Fill in any of rcData (the reverse complement of data), rcQuality (quality reversed), reversedData (data reversed) and
+// complementData (data complemented but not reversed) that aren't NULL, and return the number of Ns in data.  The
+// outputs must not overlap data or quality.
+//
+unsigned ReverseComplementRead(const char *data, const char *quality, unsigned length, char *rcData, char *rcQuality,
+    char *reversedData = NULL, char *complementData = NULL);
+
+//
+// Does data have any lower case letters or dots in it?
+//
+bool ReadNeedsUpcasing(const char *data, unsigned length);
+
+//
+// Copy data to upcased with lower case letters made upper case, and dots made N.
+//
+void UpcaseRead(const char *data, char *upcased, unsigned length);
@@ -31,11 +31,26 @@ Environment:
 #include "AlignerOptions.h"
 #include "directions.h"
 #include "exit.h"
+#include "StageTiming.h"
+#include "ZstdDataWriter.h"
+
+#include "Simd.h"
+#include "SpliceJunctions.h"
 
 using std::max;
 using std::min;
 using util::strnchr;
 
+//
+// The vector versions of parseLine and reverseComplement are compiled for their instruction set function by function, so
+// the rest of SNAP still runs on processors without it.  MSVC doesn't need to be told.
+//
+#ifdef _MSC_VER
+#define SAM_VECTOR_TARGET(instructionSets)
+#else
+#define SAM_VECTOR_TARGET(instructionSets) __attribute__((target(instructionSets)))
+#endif
+
 bool readIdsMatch(const char* id0, const char* id1)
 {
     for (unsigned i = 0; ; i++) {
@@ -118,10 +133,11 @@ SAMReader::create(
     int bufferCount,
     const ReaderContext& context,
     _int64 startingOffset, 
-    _int64 amountOfFileToProcess)
+    _int64 amountOfFileToProcess,
+    bool compressed)
 {
     DataReader* data = supplier->getDataReader(bufferCount, maxLineLen, 0.0, 0);
-    SAMReader *reader = new SAMReader(data, context);
+    SAMReader *reader = new SAMReader(data, context, compressed);
     reader->init(fileName, startingOffset, amountOfFileToProcess);
     return reader;
 }
@@ -161,8 +177,9 @@ SAMReader::readHeader(const char *fileName)
 
 SAMReader::SAMReader(
     DataReader* i_data,
-    const ReaderContext& i_context)
-    : ReadReader(i_context), data(i_data), headerSize(-1), clipping(i_context.clipping)
+    const ReaderContext& i_context,
+    bool i_compressed)
+    : ReadReader(i_context), data(i_data), headerSize(-1), clipping(i_context.clipping), compressed(i_compressed)
 {
 }
 
@@ -288,8 +305,17 @@ SAMReader::parseHeader(
     return true;
 }
 
+SAMReader::ParseLineFunction SAMReader::parseLineImplementation = KernelChooser<SAMReader::ParseLineFunction>("SAM parsing")
+    .avx2(X86_ONLY(SAMReader::parseLineAVX2)).scalar(SAMReader::parseLineScalar);
+
     bool
 SAMReader::parseLine(char *line, char *endOfBuffer, char *result[], size_t *linelength, size_t fieldLengths[])
+{
+    return (*parseLineImplementation)(line, endOfBuffer, result, linelength, fieldLengths);
+}
+
+    bool
+SAMReader::parseLineScalar(char *line, char *endOfBuffer, char *result[], size_t *linelength, size_t fieldLengths[])
 {
     *linelength = 0;
 
@@ -334,6 +360,124 @@ SAMReader::parseLine(char *line, char *endOfBuffer, char *result[], size_t *line
     return true;
 }
 
+#ifdef SNAP_SIMD_X86
+    bool SAM_VECTOR_TARGET("avx2")
+SAMReader::parseLineAVX2(char *line, char *endOfBuffer, char *result[], size_t *linelength, size_t fieldLengths[])
+/*++
+
+Routine Description:
+
+    The same as parseLineScalar, but in one pass over the line: for each 32 bytes, get bit masks of where the field
+    separators (tab and, for CRLF text, CR) and the end of the line (newline, or a NUL, which is a failure the same as
+    running out of buffer) are, and walk the field boundaries out of them.  A run of separators counts as one, and the
+    last (OPT) field is the rest of the line.
+
+--*/
+{
+    *linelength = 0;
+
+    //
+    // Skip over any leading spaces and tabs
+    //
+    char *next = line;
+    while (next < endOfBuffer && (*next == ' ' || *next == '\t')) {
+        next++;
+    }
+
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+
+    unsigned whichField = 0;    // The field we're in, or the one whose start we're looking for
+    bool inField = true;        // The first field starts right here, whatever's in it
+    result[0] = next;
+
+    for (char *chunk = next; ; chunk += 32) {
+        if (chunk >= endOfBuffer) {
+            return false;   // No end of line
+        }
+
+        _uint32 separators, ends, valid;
+        if (endOfBuffer - chunk >= 32) {
+            __m256i bytes = _mm256_loadu_si256((const __m256i *)chunk);
+            separators = (_uint32)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, tab), _mm256_cmpeq_epi8(bytes, cr)));
+            ends = (_uint32)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, newline), _mm256_cmpeq_epi8(bytes, zero)));
+            valid = ~(_uint32)0;
+        } else {
+            //
+            // Don't read past the end of the buffer.
+            //
+            int chunkLength = (int)(endOfBuffer - chunk);
+            separators = ends = 0;
+            for (int i = 0; i < chunkLength; i++) {
+                separators |= (_uint32)('\t' == chunk[i] || '\r' == chunk[i]) << i;
+                ends |= (_uint32)('\n' == chunk[i] || 0 == chunk[i]) << i;
+            }
+            valid = ((_uint32)1 << chunkLength) - 1;
+        }
+
+        if (0 != ends) {
+            valid &= (ends & (0 - ends)) - 1;   // Just what's before the end of the line
+        }
+        separators &= valid;
+        _uint32 nonSeparators = ~separators & valid;
+
+        _uint32 done = 0;       // The bits of this chunk that we've gotten past
+        while (!(inField && OPT == whichField)) {
+            _uint32 candidates = (inField ? separators : nonSeparators) & ~done;
+            if (0 == candidates) {
+                break;
+            }
+
+            unsigned long bit;
+            CountTrailingZeroes(candidates, bit);
+            if (inField) {
+                fieldLengths[whichField] = chunk + bit - result[whichField];
+                whichField++;
+            } else {
+                result[whichField] = chunk + bit;
+            }
+            inField = !inField;
+            done = ((_uint32)2 << bit) - 1;
+        }
+
+        if (0 == ends) {
+            continue;
+        }
+
+        unsigned long endBit;
+        CountTrailingZeroes(ends, endBit);
+        char *endOfLine = chunk + endBit;
+        if ('\n' != *endOfLine) {
+            return false;   // A NUL before the end of the line
+        }
+
+        *linelength = endOfLine - line + 1;    // +1 skips over the \n
+
+        if (inField) {
+            fieldLengths[whichField] = endOfLine - result[whichField];
+            if (OPT == whichField) {
+                return true;
+            }
+            whichField++;
+        }
+
+        if (whichField < OPT) {
+            //
+            // Too few fields.
+            //
+            *linelength = 0;
+            return false;
+        }
+
+        // no optional fields
+        result[OPT] = NULL;
+        return true;
+    }
+}
+#endif // SNAP_SIMD_X86
+
     void
 SAMReader::getReadFromLine(
     const Genome        *genome,
@@ -474,6 +618,11 @@ SAMReader::getReadFromLine(
     }
 }
 
+//
+// The contig that parseContigName found last on this thread (see there).
+//
+static thread_local int LastContigNum = 0;
+
     size_t
 SAMReader::parseContigName(
     const Genome* genome,
@@ -493,7 +642,30 @@ SAMReader::parseContigName(
     contigName[fieldLength[rfield]] = '\0';
 
     *o_locationOfContig = 0;
-    if ('*' != contigName[0] && genome != NULL && !genome->getLocationOfContig(contigName, o_locationOfContig, o_indexOfContig)) {
+    if ('*' == contigName[0] || genome == NULL) {
+        return 0;
+    }
+
+    //
+    // Sorted input has long runs of records on the same contig, so check the one this thread found last before
+    // hashing the name.
+    //
+    const Genome::Contig *last = LastContigNum < genome->getNumContigs() ? &genome->getContigs()[LastContigNum] : NULL;
+    if (NULL != last && last->nameLength == fieldLength[rfield] && !memcmp(last->name, contigName, fieldLength[rfield])) {
+        *o_locationOfContig = last->beginningLocation;
+        if (NULL != o_indexOfContig) {
+            *o_indexOfContig = LastContigNum;
+        }
+        return 0;
+    }
+
+    int contigNum;
+    if (genome->lookupContig(contigName, fieldLength[rfield], o_locationOfContig, &contigNum)) {
+        LastContigNum = contigNum;
+        if (NULL != o_indexOfContig) {
+            *o_indexOfContig = contigNum;
+        }
+    } else {
         //WriteErrorMessage("Unable to find contig '%s' in genome.  SAM file malformed.\n",contigName);
         //soft_exit(1);
     }
@@ -563,6 +735,28 @@ SAMReader::init(
 SAMReader::reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
 {
     _ASSERT(-1 != headerSize && startingOffset >= headerSize);  // Must call init() before reinit()
+    if (compressed) {
+        //
+        // The header size is in decompressed bytes, which can't be seeked to, so start at the beginning and skip over it.
+        //
+        _ASSERT(startingOffset == headerSize && amountOfFileToProcess == 0);
+        data->reinit(0, 0);
+        for (_int64 toSkip = headerSize; toSkip > 0; ) {
+            char* buffer;
+            _int64 validBytes, startBytes;
+            if (!data->getData(&buffer, &validBytes, &startBytes)) {
+                if (data->isEOF()) {
+                    return;
+                }
+                data->nextBatch();
+                continue;
+            }
+            _int64 skip = __min(toSkip, startBytes);
+            data->advance(skip);
+            toSkip -= skip;
+        }
+        return;
+    }
     //
     // There's no way to tell if we start at the very beginning of a read, we need to see the previous newline.
     // So, read one byte before our assigned read in case that was the terminating newline of the previous read.
@@ -639,9 +833,11 @@ SAMReader::createReadSupplierGenerator(
     const ReaderContext& context)
 {
     //
-    // single-ended SAM files always can be read with the range splitter, unless reading from stdin, which needs a queue
+    // single-ended SAM files always can be read with the range splitter, unless reading from stdin, which needs a queue,
+    // or zstd compressed, since SAM ranges are in decompressed bytes
     //
-    if (!strcmp(fileName, "-")) {
+    bool isStdin = !strcmp(fileName, "-");
+    if (isStdin || DataSupplier::IsZstdFile(fileName)) {
         //
         // Stdin must run from a queue, not range splitter.
         //
@@ -649,7 +845,12 @@ SAMReader::createReadSupplierGenerator(
         //
         // Because we can only have one stdin reader, we need to use a queue if we're reading from stdin
         //
-        reader = SAMReader::create(DataSupplier::Stdio, "-", ReadSupplierQueue::BufferCount(numThreads), context, 0, 0);
+        if (isStdin) {
+            reader = SAMReader::create(DataSupplier::Stdio, "-", ReadSupplierQueue::BufferCount(numThreads), context, 0, 0);
+        } else {
+            reader = SAMReader::create(DataSupplier::CompressedDefaultForFile(fileName), fileName, ReadSupplierQueue::BufferCount(numThreads),
+                context, 0, 0, true);
+        }
    
         if (reader == NULL) {
             return NULL;
@@ -658,7 +859,7 @@ SAMReader::createReadSupplierGenerator(
         queue->startReaders();
         return queue;
     } else {
-        RangeSplitter *splitter = new RangeSplitter(QueryFileSize(fileName), numThreads, 100);
+        RangeSplitter *splitter = new RangeSplitter(DataSupplier::InputFileSize(fileName), numThreads, 100);
         return new RangeSplittingReadSupplierGenerator(fileName, true, numThreads, context);
     }
 }
@@ -674,13 +875,17 @@ SAMReader::createPairedReader(
     const ReaderContext& context)
 {
     DataSupplier *data;
+    bool compressed = false;
     if (!strcmp("-", fileName)) {
         data = DataSupplier::Stdio;
+    } else if (DataSupplier::IsZstdFile(fileName)) {
+        data = DataSupplier::CompressedDefaultForFile(fileName);
+        compressed = true;
     } else {
         data = DataSupplier::Default;
     }
 
-    SAMReader* reader = SAMReader::create(data, fileName, bufferCount + PairedReadReader::MatchBuffers, context, 0, 0);
+    SAMReader* reader = SAMReader::create(data, fileName, bufferCount + PairedReadReader::MatchBuffers, context, 0, 0, compressed);
     if (reader == NULL) {
         return NULL;
     }
@@ -713,6 +918,18 @@ SAMReader::createPairedReadSupplierGenerator(
 
 const FileFormat* FileFormat::SAM[] = { new SAMFormat(false), new SAMFormat(true) };
 
+    void
+SAMFormat::getReadName(
+    char* buffer,
+    _int64 bytes,
+    const char** o_name,
+    size_t* o_nameLength) const
+{
+    const char* tab = (const char*) memchr(buffer, '\t', bytes);
+    *o_name = buffer;
+    *o_nameLength = tab == NULL ? 0 : tab - buffer;
+}
+
     void
 SAMFormat::getSortInfo(
     const Genome* genome,
@@ -872,6 +1089,20 @@ SAMFormat::getWriterSupplier(
     const Genome* genome) const
 {
     DataWriterSupplier* dataSupplier;
+    //
+    // .sam.zst output is compressed into zstd frames the way BAM is into BGZF blocks, by an encoder for a sorted file's
+    // merge, or a pool shared by the aligner threads.
+    //
+    ZstdWriterFilterSupplier* zstdSupplier = NULL;
+    int zstdLevel = options->compressionLevel >= 0 ? options->compressionLevel : 0;
+    if (options->outputFile.isCompressed) {
+        zstdSupplier = DataWriterSupplier::zstd(true, zstdLevel);
+        if (NULL == zstdSupplier) {
+            WriteErrorMessage("%s is zstd compressed SAM, but this SNAP was built without zstd support (see LIBZSTD_HOME in the Makefile)\n",
+                options->outputFile.fileName);
+            soft_exit(1);
+        }
+    }
     if (options->sortOutput) {
         size_t len = strlen(options->outputFile.fileName);
         // todo: this is going to leak, but there's no easy way to free it, and it's small...
@@ -879,11 +1110,20 @@ SAMFormat::getWriterSupplier(
         strcpy(tempFileName, options->outputFile.fileName);
         strcpy(tempFileName + len, ".tmp");
         dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName, options->sortMemory * (1ULL << 30),
-            options->numThreads, options->outputFile.fileName, NULL, options->writeBufferSize);
+            options->numThreads, options->outputFile.fileName, zstdSupplier, options->writeBufferSize,
+            NULL == zstdSupplier ? NULL : FileEncoder::zstd(zstdSupplier, options->numThreads, options->bindToProcessors),
+            options->sortInMemory * (1ULL << 30), options->sortTempDirectories, options->sortMergeThreads,
+            NULL != zstdSupplier && (options->sortMergeThreads > 1 || options->sortShards > 1)
+                ? DataWriterSupplier::zstdSortedParts(options->numThreads, zstdLevel) : NULL,
+            options->sortShards, options->evenShards, options->sortTempZstd, options->sortByName);
+    } else if (NULL != zstdSupplier) {
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, zstdSupplier, NULL, 4,
+            FileEncoderPool::zstd(zstdSupplier, max(1, options->numThreads - 1)), options->inputOrder);
     } else {
-        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize);
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, NULL, NULL, 4, NULL,
+            options->inputOrder);
     }
-    return ReadWriterSupplier::create(this, dataSupplier, genome);
+    return ReadWriterSupplier::create(this, dataSupplier, genome, options->gapPenalty);
 }
 
     bool
@@ -892,7 +1132,7 @@ SAMFormat::writeHeader(
     char *header,
     size_t headerBufferSize,
     size_t *headerActualSize,
-    bool sorted,
+    SortOrder sortOrder,
     int argc,
     const char **argv,
     const char *version,
@@ -914,11 +1154,18 @@ SAMFormat::writeHeader(
 		}
 	}
 
-    size_t bytesConsumed = snprintf(header, headerBufferSize, "@HD\tVN:1.4\tSO:%s\n%s%s@PG\tID:SNAP\tPN:SNAP\tCL:%s\tVN:%s\n", 
-		sorted ? "coordinate" : "unsorted",
+    char description[40];
+    description[0] = '\0';
+    if (context.compressionLevel >= 0) {
+        snprintf(description, sizeof(description), "\tDS:BGZF compression level %d", context.compressionLevel);
+    }
+
+    size_t bytesConsumed = snprintf(header, headerBufferSize, "@HD\tVN:1.4\tSO:%s\n%s%s@PG\tID:SNAP\tPN:SNAP\tCL:%s\tVN:%s%s\n", 
+		// (-son's order is by a hash of the name, which groups each read's records the way samtools collate does)
+		sortOrder == SortedByLocation ? "coordinate" : sortOrder == SortedByName ? "unsorted\tGO:query" : "unsorted",
         context.header == NULL ? (rgLine == NULL ? "@RG\tID:FASTQ\tSM:sample" : rgLine) : "",
         context.header == NULL ? "\n" : "",
-        commandLine,version);
+        commandLine,version,description);
 
 	delete [] commandLine;
 	commandLine = NULL;
@@ -985,6 +1232,70 @@ SAMFormat::writeHeader(
     *headerActualSize = bytesConsumed;
     return true;
 }
+
+SAMFormat::ReverseComplementFunction SAMFormat::reverseComplementImplementation = KernelChooser<SAMFormat::ReverseComplementFunction>("SAM writing")
+    .avx2(X86_ONLY(SAMFormat::reverseComplementAVX2)).scalar(SAMFormat::reverseComplementScalar);
+
+    void
+SAMFormat::reverseComplementScalar(
+    char* o_data,
+    char* o_quality,
+    const char* data,
+    const char* quality,
+    unsigned length)
+{
+    for (unsigned i = 0; i < length; i++) {
+        o_data[length - 1 - i] = COMPLEMENT[(unsigned char)data[i]];
+        o_quality[length - 1 - i] = quality[i];
+    }
+}
+
+#ifdef SNAP_SIMD_X86
+    void SAM_VECTOR_TARGET("avx2")
+SAMFormat::reverseComplementAVX2(
+    char* o_data,
+    char* o_quality,
+    const char* data,
+    const char* quality,
+    unsigned length)
+/*++
+
+Routine Description:
+
+    reverseComplement 32 bases at a time.  COMPLEMENT is zero outside of the rows 0x40, 0x50 and 0x60 (it only has
+    ACGTNn), so each base is looked up in those three rows with pshufb on its low nibble and the one that matches its
+    high nibble is kept.  Each block is reversed into place from the end of the output, and the leftovers at the end
+    of the input go through the scalar code to the front.
+
+--*/
+{
+    const __m256i reverseInLane = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                                   15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256i row4 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(COMPLEMENT + 0x40)));
+    const __m256i row5 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(COMPLEMENT + 0x50)));
+    const __m256i row6 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(COMPLEMENT + 0x60)));
+    const __m256i lowNibble = _mm256_set1_epi8(0xf);
+
+    unsigned i;
+    for (i = 0; i + 32 <= length; i += 32) {
+        __m256i bases = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i low = _mm256_and_si256(bases, lowNibble);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(bases, 4), lowNibble);
+
+        __m256i complemented = _mm256_or_si256(
+            _mm256_and_si256(_mm256_shuffle_epi8(row4, low), _mm256_cmpeq_epi8(high, _mm256_set1_epi8(4))),
+            _mm256_or_si256(
+                _mm256_and_si256(_mm256_shuffle_epi8(row5, low), _mm256_cmpeq_epi8(high, _mm256_set1_epi8(5))),
+                _mm256_and_si256(_mm256_shuffle_epi8(row6, low), _mm256_cmpeq_epi8(high, _mm256_set1_epi8(6)))));
+        __m256i qualities = _mm256_loadu_si256((const __m256i *)(quality + i));
+
+        _mm256_storeu_si256((__m256i *)(o_data + length - i - 32), _mm256_permute4x64_epi64(_mm256_shuffle_epi8(complemented, reverseInLane), 0x4e));
+        _mm256_storeu_si256((__m256i *)(o_quality + length - i - 32), _mm256_permute4x64_epi64(_mm256_shuffle_epi8(qualities, reverseInLane), 0x4e));
+    }
+
+    reverseComplementScalar(o_data, o_quality, data + i, quality + i, length - i);
+}
+#endif // SNAP_SIMD_X86
     
     bool
 SAMFormat::createSAMLine(
@@ -1033,6 +1344,9 @@ SAMFormat::createSAMLine(
     if (secondaryAlignment) {
         flags |= SAM_SECONDARY;
     }
+    if (read->isSupplementary()) {
+        flags |= SAM_SUPPLEMENTARY;     // -splitReads
+    }
     
     if (0 == qnameLen) {
          qnameLen = read->getIdLength();
@@ -1064,10 +1378,7 @@ SAMFormat::createSAMLine(
     }
 
     if (direction == RC) {
-      for (unsigned i = 0; i < fullLength; i++) {
-        data[fullLength - 1 - i] = COMPLEMENT[read->getUnclippedData()[i]];
-        quality[fullLength - 1 - i] = read->getUnclippedQuality()[i];
-      }
+      (*reverseComplementImplementation)(data, quality, read->getUnclippedData(), read->getUnclippedQuality(), fullLength);
       clippedData = &data[fullLength - clippedLength - read->getFrontClippedLength()];
       basesClippedBefore = fullLength - clippedLength - read->getFrontClippedLength();
       basesClippedAfter = read->getFrontClippedLength();
@@ -1163,6 +1474,173 @@ SAMFormat::createSAMLine(
     return true;
 }
 
+    void
+SAMFormat::createUnmappedSAMLine(
+    const Genome * genome,
+    // output data
+    const char*& contigName,
+    int& contigIndex,
+    int& flags,
+    GenomeDistance& positionInContig,
+    const char*& matecontigName,
+    int& mateContigIndex,
+    GenomeDistance& matePositionInContig,
+    // input data
+    size_t& qnameLen,
+    Read * read,
+    bool secondaryAlignment,
+    bool hasMate,
+    bool firstInPair,
+    Read * mate,
+    GenomeLocation mateLocation,
+    Direction mateDirection)
+{
+    contigName = "*";
+    positionInContig = 0;
+
+    flags |= SAM_UNMAPPED;
+    if (secondaryAlignment) {
+        flags |= SAM_SECONDARY;
+    }
+
+    if (0 == qnameLen) {
+         qnameLen = read->getIdLength();
+    }
+
+    if (!hasMate) {
+        return;
+    }
+
+    flags |= SAM_MULTI_SEGMENT;
+    flags |= (firstInPair ? SAM_FIRST_SEGMENT : SAM_LAST_SEGMENT);
+    if (mateLocation != InvalidGenomeLocation) {
+        //
+        // The SAM spec says that for paired reads where exactly one end is unmapped that the unmapped
+        // half should just have RNAME and POS copied from the mate.
+        //
+        GenomeDistance mateExtraBasesClippedBefore;
+        const Genome::Contig *mateContig = genome->getContigForRead(mateLocation, mate->getDataLength(), &mateExtraBasesClippedBefore);
+        mateLocation += mateExtraBasesClippedBefore;
+        mateContigIndex = (int)(mateContig - genome->getContigs());
+        matePositionInContig = mateLocation - mateContig->beginningLocation + 1;
+
+        if (mateDirection == RC) {
+            flags |= SAM_NEXT_REVERSED;
+        }
+
+        contigName = mateContig->name;
+        contigIndex = mateContigIndex;
+        matecontigName = "=";
+        positionInContig = matePositionInContig;
+    } else {
+        //
+        // Both ends are unmapped, and the mate points at us.
+        //
+        flags |= SAM_NEXT_UNMAPPED;
+        matecontigName = "=";
+        mateContigIndex = contigIndex;
+        matePositionInContig = positionInContig;
+    }
+}
+
+//
+// Puts a SAM line together straight in the writer's buffer, noting (rather than writing past the end) if it doesn't fit.
+//
+class SAMLineBuilder
+{
+public:
+    SAMLineBuilder(char* i_buffer, size_t i_bufferSpace) : buffer(i_buffer), next(i_buffer), end(i_buffer + i_bufferSpace), fits(true) {}
+
+    void add(const char* string, size_t length)
+    {
+        if (fits && length <= (size_t)(end - next)) {
+            memcpy(next, string, length);
+            next += length;
+        } else {
+            fits = false;
+        }
+    }
+
+    void add(const char* string)
+    { add(string, strlen(string)); }
+
+    void add(char c)
+    { add(&c, 1); }
+
+    void addTab()
+    { add('\t'); }
+
+    void addUInt(_uint64 value)
+    {
+        if (end - next >= 20) {
+            next += FormatUInt(value, next);
+        } else {
+            char digits[20];
+            add(digits, FormatUInt(value, digits));
+        }
+    }
+
+    void addInt(_int64 value)
+    {
+        if (end - next >= 21) {
+            next += FormatInt(value, next);
+        } else {
+            char digits[21];
+            add(digits, FormatInt(value, digits));
+        }
+    }
+
+    bool fit()
+    { return fits; }
+
+    size_t used()
+    { return next - buffer; }
+
+private:
+    char* buffer;
+    char* next;
+    char* end;
+    bool fits;
+};
+
+//
+// The name of a contig from createSAMLine, using the length that the genome already has for it when it's one of the genome's.
+//
+    static inline size_t
+ContigNameLength(const Genome* genome, const char* contigName, int contigIndex)
+{
+    if (contigIndex >= 0 && genome != NULL && genome->getContigs()[contigIndex].name == contigName) {
+        return genome->getContigs()[contigIndex].nameLength;
+    }
+    return strlen(contigName);
+}
+
+//
+// QualityBins[c] is the binned value of quality character c; characters that aren't qualities map to themselves.
+//
+class QualityBinTable {
+public:
+    QualityBinTable() {
+        for (int c = 0; c < 256; c++) {
+            int q = c - 33;
+            int binned = q < 2 ? q : q < 10 ? 6 : q < 20 ? 15 : q < 25 ? 22 : q < 30 ? 27 : q < 35 ? 33 : q < 40 ? 37 : 40;
+            bins[c] = (char)(q < 0 || q > 93 ? c : binned + 33);
+        }
+    }
+
+    char bins[256];
+};
+
+static const QualityBinTable QualityBins;
+
+    void
+SAMFormat::binQualities(char* o_quality, const char* quality, unsigned length)
+{
+    for (unsigned i = 0; i < length; i++) {
+        o_quality[i] = QualityBins.bins[(unsigned char)quality[i]];
+    }
+}
+
     bool
 SAMFormat::writeRead(
     const ReaderContext& context,
@@ -1204,8 +1682,10 @@ SAMFormat::writeRead(
     GenomeDistance matePositionInContig = 0;
     _int64 templateLength = 0;
 
-    char data[MAX_READ];
-    char quality[MAX_READ];
+    char dataBuffer[MAX_READ];
+    char qualityBuffer[MAX_READ];
+    const char* data = dataBuffer;
+    const char* quality = qualityBuffer;
 
     const char* clippedData;
     unsigned fullLength;
@@ -1217,17 +1697,27 @@ SAMFormat::writeRead(
 
     *o_addFrontClipping = 0;
 
-	if (!createSAMLine(context.genome, lv, data, quality, MAX_READ, contigName, contigIndex,
-        flags, positionInContig, mapQuality, matecontigName, mateContigIndex, matePositionInContig, templateLength,
-        fullLength, clippedData, clippedLength, basesClippedBefore, basesClippedAfter,
-        qnameLen, read, result, genomeLocation, direction, secondaryAlignment, useM,
-        hasMate, firstInPair, alignedAsPair, mate, mateResult, mateLocation, mateDirection, 
-        &extraBasesClippedBefore))
-    {
-        return false;
-    }
+    if (NotFound == result || InvalidGenomeLocation == genomeLocation) {
+        createUnmappedSAMLine(context.genome, contigName, contigIndex, flags, positionInContig, matecontigName, mateContigIndex,
+            matePositionInContig, qnameLen, read, secondaryAlignment, hasMate, firstInPair, mate, mateLocation, mateDirection);
+        mapQuality = 0;
+        fullLength = read->getUnclippedLength();
+        if (fullLength > MAX_READ) {
+            return false;
+        }
+        data = read->getUnclippedData();
+        quality = read->getUnclippedQuality();
+    } else {
+        if (!createSAMLine(context.genome, lv, dataBuffer, qualityBuffer, MAX_READ, contigName, contigIndex,
+            flags, positionInContig, mapQuality, matecontigName, mateContigIndex, matePositionInContig, templateLength,
+            fullLength, clippedData, clippedLength, basesClippedBefore, basesClippedAfter,
+            qnameLen, read, result, genomeLocation, direction, secondaryAlignment, useM,
+            hasMate, firstInPair, alignedAsPair, mate, mateResult, mateLocation, mateDirection, 
+            &extraBasesClippedBefore))
+        {
+            return false;
+        }
 
-	if (genomeLocation != InvalidGenomeLocation) {
 		cigar = computeCigarString(context.genome, lv, cigarBuf, cigarBufSize, cigarBufWithClipping, cigarBufWithClippingSize,
 			clippedData, clippedLength, basesClippedBefore, extraBasesClippedBefore, basesClippedAfter, 
 			read->getOriginalFrontHardClipping(), read->getOriginalBackHardClipping(), genomeLocation, direction, useM,
@@ -1237,6 +1727,38 @@ SAMFormat::writeRead(
 		}
 	}
 
+    //
+    // index -gtf: an alignment to a splice junction contig (ours or our mate's) goes in the genome, with its intron as N.
+    //
+    std::vector<_uint32> liftedCigarOps;
+    std::vector<char> liftedCigar;
+    if (NULL != context.junctions && context.junctions->needsLift(contigIndex, mateContigIndex)) {
+        liftedCigarOps.resize(strlen(cigar) / 2 + 3);
+        int nCigarOps = 0;
+        for (const char *p = cigar; '*' != *p && '\0' != *p; nCigarOps++) {
+            char *opChar;
+            _uint32 count = (_uint32)strtoul(p, &opChar, 10);
+            liftedCigarOps[nCigarOps] = (count << 4) | BAMAlignment::CigarToCode[(unsigned char)*opChar];
+            p = opChar + 1;
+        }
+
+        context.junctions->liftRecord(contigIndex, positionInContig, read->getDataLength(), liftedCigarOps.data(), nCigarOps, mateContigIndex,
+            matePositionInContig, hasMate ? mate->getDataLength() : 0, hasMate && 0 == (flags & (SAM_UNMAPPED | SAM_NEXT_UNMAPPED)), templateLength);
+        if (0 != nCigarOps) {
+            liftedCigar.resize(strlen(cigar) + 32);
+            BAMAlignment::decodeCigar(liftedCigar.data(), (int)liftedCigar.size(), liftedCigarOps.data(), nCigarOps);
+            cigar = liftedCigar.data();
+        }
+        contigName = contigIndex < 0 ? "*" : context.genome->getContigs()[contigIndex].name;
+        matecontigName = mateContigIndex < 0 ? "*" : mateContigIndex == contigIndex ? "=" : context.genome->getContigs()[mateContigIndex].name;
+    }
+
+    if (context.omitQualities) {
+        quality = NULL;
+    } else if (context.binQualities) {
+        binQualities(qualityBuffer, quality, fullLength);
+        quality = qualityBuffer;
+    }
 
     // Write the SAM entry, which requires the following fields:
     //
@@ -1260,10 +1782,6 @@ SAMFormat::writeRead(
         qnameLen = (unsigned)(firstSpace - read->getId());
     }
 
-    const int nmStringSize = 30;// Big enough that it won't buffer overflow regardless of the value of editDistance
-    char nmString[nmStringSize];  
-    snprintf(nmString, nmStringSize, "\tNM:i:%d",editDistance);
-
     unsigned auxLen;
     bool auxSAM;
     char* aux = read->getAuxiliaryData(&auxLen, &auxSAM);
@@ -1286,6 +1804,23 @@ SAMFormat::writeRead(
         }
         aux = NULL;
         auxLen = 0;
+    } else if (aux != NULL && context.dropAuxData) {
+        //
+        // -dropAux keeps just the RG field, when that's where the read group is.
+        //
+        char* readGroupField = NULL;
+        size_t fieldLen = 0;
+        if (read->getReadGroup() == READ_GROUP_FROM_AUX) {
+            for (char* p = aux; p != NULL && p < aux + auxLen; p = SAMReader::skipToBeyondNextFieldSeparator(p, aux + auxLen)) {
+                if (strncmp(p, "RG:Z:", 5) == 0) {
+                    SAMReader::skipToBeyondNextFieldSeparator(p, aux + auxLen, &fieldLen);
+                    readGroupField = p;
+                    break;
+                }
+            }
+        }
+        aux = readGroupField;
+        auxLen = (unsigned)fieldLen;
     }
     const char* rglineAux = "";
     int rglineAuxLen = 0;
@@ -1300,32 +1835,62 @@ SAMFormat::writeRead(
             readGroupString = read->getReadGroup();
         }
     }
-    int charsInString = snprintf(buffer, bufferSpace, "%.*s\t%d\t%s\t%u\t%d\t%s\t%s\t%u\t%lld\t%.*s\t%.*s%s%.*s%s%s\tPG:Z:SNAP%s%.*s\n",
-        qnameLen, read->getId(),
-        flags,
-        contigName,
-        positionInContig,
-        mapQuality,
-        cigar,
-        matecontigName,
-        matePositionInContig,
-        templateLength,
-        fullLength, data,
-        fullLength, quality,
-        aux != NULL ? "\t" : "", auxLen, aux != NULL ? aux : "",
-        readGroupSeparator, readGroupString,
-        nmString, rglineAuxLen, rglineAux);
-
-    if (charsInString > bufferSpace) {
+    SAMLineBuilder line(buffer, bufferSpace);
+    line.add(read->getId(), qnameLen);
+    line.addTab();
+    line.addInt(flags);
+    line.addTab();
+    line.add(contigName, ContigNameLength(context.genome, contigName, contigIndex));
+    line.addTab();
+    line.addUInt((unsigned)positionInContig);
+    line.addTab();
+    line.addInt(mapQuality);
+    line.addTab();
+    line.add(cigar);
+    line.addTab();
+    line.add(matecontigName, ContigNameLength(context.genome, matecontigName, mateContigIndex));
+    line.addTab();
+    line.addUInt((unsigned)matePositionInContig);
+    line.addTab();
+    line.addInt(templateLength);
+    line.addTab();
+    line.add(data, fullLength);
+    line.addTab();
+    if (quality != NULL) {
+        line.add(quality, fullLength);
+    } else {
+        line.add('*');      // -noQual
+    }
+    if (aux != NULL) {
+        line.addTab();
+        line.add(aux, strnlen(aux, auxLen));
+    }
+    line.add(readGroupSeparator);
+    line.add(readGroupString);
+    line.add("\tPG:Z:SNAP\tNM:i:");
+    line.addInt(editDistance);
+    if (read->wasAlignmentTruncated()) {
+        line.add("\tZT:i:1");     // -workBudget ran out
+    }
+    if (read->getConsensusFamilySize() != 0) {
+        line.add("\tcD:i:");      // -umi family size
+        line.addInt(read->getConsensusFamilySize());
+    }
+    if (read->getSATag() != NULL) {
+        line.add("\tSA:Z:");       // -splitReads, the read's other pieces
+        line.add(read->getSATag());
+    }
+    line.add(rglineAux, rglineAuxLen);
+    line.add('\n');
+
+    if (!line.fit()) {
         //
         // Out of buffer space.
         //
         return false;
-    } else if (charsInString == bufferSpace) {
-      buffer[bufferSpace-1] = '\n'; // overwrite trailing null with newline
     }
 
-
+    size_t charsInString = line.used();
     if (NULL != spaceUsed) {
         *spaceUsed = charsInString;
     }
@@ -1354,6 +1919,7 @@ SAMFormat::computeCigar(
     int *o_cigarBufUsed, 
     int * o_addFrontClipping)
 {
+    TIME_STAGE(CigarStage);
     if (dataLength > INT32_MAX - MAX_K) {
         dataLength = INT32_MAX - MAX_K;
     }
@@ -1393,6 +1959,34 @@ SAMFormat::computeCigar(
         return;
     }
 
+    //
+    // Most reads match the reference exactly, and then the CIGAR string is a single M (or =), so there's no need to go
+    // through LV and normalize what it comes up with.  With no indels the clipping at the end of the contig is already right.
+    //
+    int matchedLength = (int)(dataLength - *o_extraBasesClippedAfter);
+    if (matchedLength > 0 && (cigarFormat == BAM_CIGAR_OPS || cigarFormat == COMPACT_CIGAR_STRING) &&
+        memcmp(reference, data, matchedLength) == 0) {
+
+        _uint32 op = ((_uint32)matchedLength << 4) | BAMAlignment::CigarToCode[(unsigned char)(useM ? 'M' : '=')];
+        *o_editDistance = 0;
+        *o_addFrontClipping = 0;
+        if (cigarFormat == BAM_CIGAR_OPS) {
+            if (cigarBufLen < (int)sizeof(op)) {
+                *o_editDistance = -2;
+                return;
+            }
+            *(_uint32*)cigarBuf = op;
+            *o_cigarBufUsed = sizeof(op);
+        } else {
+            if (!BAMAlignment::decodeCigar(cigarBuf, cigarBufLen, &op, 1)) {
+                *o_editDistance = -1;
+                return;
+            }
+            *o_cigarBufUsed = (int)strlen(cigarBuf) + 1;
+        }
+        return;
+    }
+
     *o_editDistance = lv->computeEditDistanceNormalized(
         reference,
         (int)(dataLength - *o_extraBasesClippedAfter + MAX_K), // Add space incase of indels.  We know there's enough, because the reference is padded.
@@ -1499,23 +2093,25 @@ SAMFormat::computeCigarString(
         return "*";
     } else {
         // Add some CIGAR instructions for soft-clipping if we've ignored some bases in the read.
-        char clipBefore[16] = {'\0'};
-        char clipAfter[16] = {'\0'};
-        char hardClipBefore[16] = {'\0'};
-        char hardClipAfter[16] = {'\0'};
+        SAMLineBuilder clipped(cigarBufWithClipping, cigarBufWithClippingLen - 1);
         if (frontHardClipping > 0) {
-            snprintf(hardClipBefore, sizeof(hardClipBefore), "%uH", frontHardClipping);
+            clipped.addUInt(frontHardClipping);
+            clipped.add('H');
         }
         if (basesClippedBefore + extraBasesClippedBefore > 0) {
-            snprintf(clipBefore, sizeof(clipBefore), "%lluS", basesClippedBefore + extraBasesClippedBefore);
+            clipped.addUInt(basesClippedBefore + extraBasesClippedBefore);
+            clipped.add('S');
         }
+        clipped.add(cigarBuf);
         if (basesClippedAfter + extraBasesClippedAfter > 0) {
-            snprintf(clipAfter, sizeof(clipAfter), "%lluS", basesClippedAfter + extraBasesClippedAfter);
+            clipped.addUInt(basesClippedAfter + extraBasesClippedAfter);
+            clipped.add('S');
         }
         if (backHardClipping > 0) {
-            snprintf(hardClipAfter, sizeof(hardClipAfter), "%uH", backHardClipping);
+            clipped.addUInt(backHardClipping);
+            clipped.add('H');
         }
-        snprintf(cigarBufWithClipping, cigarBufWithClippingLen, "%s%s%s%s%s", hardClipBefore, clipBefore, cigarBuf, clipAfter, hardClipAfter);
+        cigarBufWithClipping[clipped.used()] = '\0';
 
 		validateCigarString(genome, cigarBufWithClipping, cigarBufWithClippingLen, 
 			data - basesClippedBefore, dataLength + (basesClippedBefore + basesClippedAfter), genomeLocation + extraBasesClippedBefore, direction, useM);
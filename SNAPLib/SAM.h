@@ -53,7 +53,7 @@ class SAMReader : public ReadReader {
 public:
         virtual ~SAMReader() {}
 
-        SAMReader(DataReader* i_data, const ReaderContext& i_context);
+        SAMReader(DataReader* i_data, const ReaderContext& i_context, bool i_compressed = false);
 
         virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
 
@@ -71,9 +71,12 @@ public:
         virtual bool releaseBatch(DataBatch batch)
         { return data->releaseBatch(batch); }
         
+        //
+        // compressed is for a supplier that decompresses (zstd), which can only read the whole file from the start.
+        //
         static SAMReader* create(DataSupplier* supplier, const char *fileName,
                 int bufferCount, const ReaderContext& i_context,
-                _int64 startingOffset, _int64 amountOfFileToProcess);
+                _int64 startingOffset, _int64 amountOfFileToProcess, bool compressed = false);
         
         static PairedReadReader* createPairedReader(const DataSupplier* supplier,
                 const char *fileName, int bufferCount, _int64 startingOffset, _int64 amountOfFileToProcess, 
@@ -90,6 +93,20 @@ public:
         
         static char* skipToBeyondNextFieldSeparator(char *str, const char *endOfBuffer, size_t *o_charsUntilFirstSeparator = NULL);
 
+        static const unsigned nSAMFields = 12;  // The number of fields parseLine finds, the last being all of the optional ones
+
+        //
+        // parseLine goes to one of these, picked at startup for the processor.  They get the same answers; the AVX2 one
+        // finds the tabs and the end of the line 32 bytes at a time.  They're public so the tests can check one against the other.
+        //
+        typedef bool (*ParseLineFunction)(char *line, char *endOfBuffer, char *result[], size_t *lineLength, size_t fieldLengths[]);
+        static ParseLineFunction parseLineImplementation;
+
+        static bool parseLineScalar(char *line, char *endOfBuffer, char *result[],
+            size_t *lineLength, size_t fieldLengths[]);
+        static bool parseLineAVX2(char *line, char *endOfBuffer, char *result[],
+            size_t *lineLength, size_t fieldLengths[]);
+
 
 protected:
 
@@ -108,7 +125,6 @@ protected:
         static const unsigned  SEQ          = 9;
         static const unsigned  QUAL         = 10;
         static const unsigned  OPT          = 11;
-        static const unsigned  nSAMFields   = 12;
 
         static const int maxLineLen = MAX_READ_LENGTH * 5;
 
@@ -139,6 +155,7 @@ private:
         DataReader*         data;
         _int64              headerSize;
         ReadClippingType    clipping;
+        const bool          compressed;       // data decompresses, so offsets into it can't be seeked to
 
         bool                didInitialSkip;   // Have we skipped to the beginning of the first SAM line?  We may start in the middle of one.
 
@@ -152,6 +169,8 @@ public:
 
     virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, GenomeDistance* o_readBytes, int* o_refID, int* o_pos) const;
 
+    virtual void getReadName(char* buffer, _int64 bytes, const char** o_name, size_t* o_nameLength) const;
+
     virtual void setupReaderContext(AlignerOptions* options, ReaderContext* readerContext) const
     { FileFormat::setupReaderContext(options, readerContext, false); }
 
@@ -159,7 +178,7 @@ public:
 
     virtual bool writeHeader(
         const ReaderContext& context, char *header, size_t headerBufferSize, size_t *headerActualSize,
-        bool sorted, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) const;
+        SortOrder sortOrder, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) const;
 
     virtual bool writeRead(
         const ReaderContext& context, LandauVishkinWithCigar * lv, char * buffer, size_t bufferSpace,
@@ -212,13 +231,53 @@ public:
         Direction mateDirection,
         GenomeDistance *extraBasesClippedBefore);
 
+    //
+    // What createSAMLine works out for an unmapped read, which only depends on whether (and where) its mate is.  The
+    // bases and qualities go out as they are in the Read, so they aren't copied, and no contig is looked up for the read.
+    //
+    static void createUnmappedSAMLine(
+        const Genome * genome,
+        // output data
+        const char*& contigName,
+        int& contigIndex,
+        int& flags,
+        GenomeDistance& positionInContig,
+        const char*& mateContigName,
+        int& mateContigIndex,
+        GenomeDistance& matePositionInContig,
+        // input data
+        size_t& qnameLen,
+        Read * read,
+        bool secondaryAlignment,
+        bool hasMate,
+        bool firstInPair,
+        Read * mate,
+        GenomeLocation mateLocation,
+        Direction mateDirection);
+
     static void computeCigar(CigarFormat cigarFormat, const Genome * genome, LandauVishkinWithCigar * lv,
         char * cigarBuf, int cigarBufLen,
         const char * data, GenomeDistance dataLength, unsigned basesClippedBefore, GenomeDistance extraBasesClippedBefore, unsigned basesClippedAfter,
         GenomeDistance *o_extraBasesClippedAfter, 
         GenomeLocation genomeLocation, bool useM, int * o_editDistance, int *o_cigarBufUsed, int * o_addFrontClipping);
 
+    //
+    // -qbin: copy length (phred+33) qualities into o_quality (which may be quality itself) in Illumina's 8 levels
+    // (2-9 -> 6, 10-19 -> 15, 20-24 -> 22, 25-29 -> 27, 30-34 -> 33, 35-39 -> 37, 40 and up -> 40, with 0 and 1 kept).
+    //
+    static void binQualities(char* o_quality, const char* quality, unsigned length);
+
 private:
+    //
+    // createSAMLine reverse complements the bases (and reverses the qualities) of RC reads with one of these, picked at
+    // startup for the processor.  They get the same answers; the AVX2 one does 32 bases at a time.
+    //
+    typedef void (*ReverseComplementFunction)(char* o_data, char* o_quality, const char* data, const char* quality, unsigned length);
+    static ReverseComplementFunction reverseComplementImplementation;
+
+    static void reverseComplementScalar(char* o_data, char* o_quality, const char* data, const char* quality, unsigned length);
+    static void reverseComplementAVX2(char* o_data, char* o_quality, const char* data, const char* quality, unsigned length);
+
     static const char * computeCigarString(const Genome * genome, LandauVishkinWithCigar * lv,
         char * cigarBuf, int cigarBufLen, char * cigarBufWithClipping, int cigarBufWithClippingLen,
         const char * data, GenomeDistance dataLength, unsigned basesClippedBefore, GenomeDistance extraBasesClippedBefore, unsigned basesClippedAfter, 
@@ -25,6 +25,8 @@ Revision History:
 #include "stdafx.h"
 #include "Seed.h"
 
+#include "Simd.h"
+
     bool
 Seed::DoesTextRepresentASeed(const char *textBases, unsigned seedLen)
 {
@@ -53,4 +55,86 @@ Seed::fromBases(
         b = b >> 2;
     }
     return Seed(bases, rc);
-}
\ No newline at end of file
+}
+
+//
+// Spread the 16 bits of x out to the even bits of a 32 bit word.
+//
+static inline _uint64 SpreadBits(_uint64 x)
+{
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    return (x | (x << 1)) & 0x55555555;
+}
+
+    void
+PackedReadSeeds::set(const char *data, unsigned length)
+/*++
+
+Routine Description:
+
+    Pack a read 16 bases at a time.  The base values (A=0, G=1, C=2, T=3) happen to be bit 2 of the ASCII code for
+    the low order bit and bit 1 xor bit 2 for the high order one, so testing those two bits gets them for 16 bases at once,
+    and comparing against each of ACGT gets the not-ACGT bits.  The last partial chunk is copied out padded with Ns.
+
+--*/
+{
+    const Vector16 a = Vector16Set1('A');
+    const Vector16 c = Vector16Set1('C');
+    const Vector16 g = Vector16Set1('G');
+    const Vector16 t = Vector16Set1('T');
+    const Vector16 mask1 = Vector16Set1(0x02);
+    const Vector16 mask2 = Vector16Set1(0x04);
+
+    memset(bases, 0, sizeof(_uint64) * nBaseWords(length));
+    memset(notACGT, 0, sizeof(_uint64) * nNotACGTWords(length));
+
+    for (unsigned chunk = 0; chunk * 16 < length; chunk++) {
+        Vector16 text;
+        if (chunk * 16 + 16 <= length) {
+            text = Vector16Load(data + chunk * 16);
+        } else {
+            char tail[16];
+            memset(tail, 'N', sizeof(tail));
+            memcpy(tail, data + chunk * 16, length - chunk * 16);
+            text = Vector16Load(tail);
+        }
+
+        _uint64 bit1 = Vector16MoveMask(Vector16Equal(Vector16And(text, mask1), mask1));
+        _uint64 bit2 = Vector16MoveMask(Vector16Equal(Vector16And(text, mask2), mask2));
+        _uint64 isACGT = Vector16MoveMask(Vector16Or(Vector16Or(Vector16Equal(text, a), Vector16Equal(text, c)),
+            Vector16Or(Vector16Equal(text, g), Vector16Equal(text, t))));
+
+        _uint64 packed = SpreadBits(bit2) | (SpreadBits(bit1 ^ bit2) << 1);
+        bases[chunk / 2] |= packed << ((chunk & 1) * 32);
+        notACGT[chunk / 4] |= (~isACGT & 0xffff) << ((chunk & 3) * 16);
+    }
+}
+
+    void
+PackedReadSeeds::setQuality(const char *quality, unsigned length, unsigned minQuality)
+{
+    //
+    // FASTQ qualities are printable, so signed byte compares work on them.  The partial chunk is padded with the
+    // highest quality.
+    //
+    const Vector16 threshold = Vector16Set1((char)('!' + minQuality));
+
+    memset(lowQuality, 0, sizeof(_uint64) * nNotACGTWords(length));
+
+    for (unsigned chunk = 0; chunk * 16 < length; chunk++) {
+        Vector16 text;
+        if (chunk * 16 + 16 <= length) {
+            text = Vector16Load(quality + chunk * 16);
+        } else {
+            char tail[16];
+            memset(tail, '~', sizeof(tail));
+            memcpy(tail, quality + chunk * 16, length - chunk * 16);
+            text = Vector16Load(tail);
+        }
+
+        _uint64 isLow = Vector16MoveMask(Vector16Greater(threshold, text));
+        lowQuality[chunk / 4] |= isLow << ((chunk & 3) * 16);
+    }
+}
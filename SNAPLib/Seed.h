@@ -79,6 +79,14 @@ struct Seed {
         return bases;
     }
 
+    //
+    // For spaced seed indices: the seed with the bases that mask (two bits per base, laid out as in bases) doesn't
+    // keep set to A.  Masks are symmetric end to end, so masking the seed and taking the reverse complement commute.
+    //
+    inline Seed masked(_uint64 mask) const {
+        return Seed((_int64)(bases & mask), (_int64)(reverseComplement & mask));
+    }
+
     inline _uint64 getRCBases() const {
         return reverseComplement;
     }
@@ -198,3 +206,83 @@ private:
     //
     _uint64   reverseComplement;
 };
+
+//
+// A read packed 2 bits per base (with a separate bit per base for anything that isn't ACGT) once, so that the seed at
+// any offset, its reverse complement and whether it has an N in it all come from a couple of shifts rather than going
+// back over the text for each seed.  The seeds are the same as Seed(data + offset, seedLen) and DoesTextRepresentASeed
+// would give.  The storage (of size GetStorageSize) belongs to the caller.
+//
+class PackedReadSeeds {
+public:
+    PackedReadSeeds() : bases(NULL), notACGT(NULL), lowQuality(NULL) {}
+
+    static size_t GetStorageSize(unsigned maxReadSize) {
+        return sizeof(_uint64) * (nBaseWords(maxReadSize) + 2 * nNotACGTWords(maxReadSize));
+    }
+
+    void init(void *storage, unsigned maxReadSize) {
+        bases = (_uint64 *)storage;
+        notACGT = bases + nBaseWords(maxReadSize);
+        lowQuality = notACGT + nNotACGTWords(maxReadSize);
+    }
+
+    //
+    // Pack a read, which must be no longer than maxReadSize.
+    //
+    void set(const char *data, unsigned length);
+
+    //
+    // Mark the bases of the read (after set) with FASTQ quality below minQuality, for isHighQuality.  Only needed for
+    // callers that use isHighQuality.
+    //
+    void setQuality(const char *quality, unsigned length, unsigned minQuality);
+
+    inline bool isSeed(unsigned offset, unsigned seedLen) const {
+        return !anyBitSet(notACGT, offset, seedLen);
+    }
+
+    //
+    // Whether none of the seed's bases were below the quality given to setQuality.
+    //
+    inline bool isHighQuality(unsigned offset, unsigned seedLen) const {
+        return !anyBitSet(lowQuality, offset, seedLen);
+    }
+
+    //
+    // Only meaningful if isSeed.
+    //
+    inline Seed getSeed(unsigned offset, unsigned seedLen) const {
+        _ASSERT(seedLen > 0 && seedLen <= LargestSeedSize);
+        unsigned shift = (offset & 31) * 2;
+        const _uint64 *word = bases + (offset >> 5);
+        _uint64 x = (word[0] >> shift) | ((word[1] << (63 - shift)) << 1);     // The first base is in the low order bits
+
+        //
+        // The seed has the first base in the high order bits and its reverse complement the complement of the first base
+        // in the low order ones, so it's x with its bases reversed and the reverse complement is just x complemented.
+        //
+        _uint64 reverseComplement = ~x & (seedLen == 32 ? ~(_uint64)0 : (((_uint64)1) << (seedLen * 2)) - 1);
+        x = ByteSwapUI64(x);
+        x = ((x >> 4) & 0x0f0f0f0f0f0f0f0f) | ((x & 0x0f0f0f0f0f0f0f0f) << 4);
+        x = ((x >> 2) & 0x3333333333333333) | ((x & 0x3333333333333333) << 2);
+
+        return Seed(x >> (64 - seedLen * 2), reverseComplement);
+    }
+
+private:
+    static unsigned nBaseWords(unsigned maxReadSize) {return (maxReadSize + 31) / 32 + 2;}    // +2 for the word past the end that getSeed reads and the partial chunk
+    static unsigned nNotACGTWords(unsigned maxReadSize) {return (maxReadSize + 63) / 64 + 2;}   // Also the size of lowQuality
+
+    static inline bool anyBitSet(const _uint64 *bits, unsigned offset, unsigned seedLen) {
+        _ASSERT(seedLen > 0 && seedLen <= LargestSeedSize);
+        unsigned shift = offset & 63;
+        const _uint64 *word = bits + (offset >> 6);
+        _uint64 x = (word[0] >> shift) | ((word[1] << (63 - shift)) << 1);    // Split in two so a shift of 0 doesn't shift by 64
+        return 0 != (x & ((((_uint64)1) << seedLen) - 1));
+    }
+
+    _uint64    *bases;
+    _uint64    *notACGT;
+    _uint64    *lowQuality;
+};
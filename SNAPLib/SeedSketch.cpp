@@ -0,0 +1,180 @@
+/*++
+
+Module Name:
+
+    SeedSketch.cpp
+
+Abstract:
+
+    The Bloom filter and popular key table that the seed lookups check before the hash tables.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "SeedSketch.h"
+#include "BigAlloc.h"
+#include "Error.h"
+
+static const _uint64 SeedSketchMagic = 0x48434b5350414e53;    // "SNAPSKCH" as little endian bytes
+static const _uint64 SeedSketchVersion = 1;
+
+SeedSketch::SeedSketch(_int64 nKeys, unsigned bitsPerKey, _int64 i_nPopularKeys) : blocks(NULL), nBlocks(0), popularKeys(NULL), nPopularSlots(0), nPopularKeys(0)
+{
+    _int64 nPopularSlotsNeeded = 1;
+    while (nPopularSlotsNeeded < i_nPopularKeys * 2) {   // At most half full, so the probes stay short
+        nPopularSlotsNeeded *= 2;
+    }
+
+    allocate(__max((nKeys * bitsPerKey + sizeof(Block) * 8 - 1) / (sizeof(Block) * 8), (_int64)1), nPopularSlotsNeeded);
+}
+
+    void
+SeedSketch::allocate(_int64 i_nBlocks, _int64 i_nPopularSlots)
+{
+    nBlocks = i_nBlocks;
+    blocks = (Block *)BigAlloc(nBlocks * sizeof(Block));
+    memset(blocks, 0, nBlocks * sizeof(Block));
+
+    nPopularSlots = i_nPopularSlots;
+    popularKeys = new PopularKey[nPopularSlots];
+    for (_int64 i = 0; i < nPopularSlots; i++) {
+        popularKeys[i].whichTable = EmptyTable;
+    }
+}
+
+SeedSketch::~SeedSketch()
+{
+    if (NULL != blocks) {
+        BigDealloc(blocks);
+    }
+    delete[] popularKeys;
+}
+
+    void
+SeedSketch::addKey(unsigned whichTable, _uint64 key)
+{
+    _uint64 keyHash = hash(whichTable, key);
+    _uint64 *block = blocks[keyHash % nBlocks].words;
+    _uint64 bits = rehash(keyHash);
+    for (unsigned i = 0; i < BitsPerKeyInBlock; i++, bits >>= 9) {
+        block[(bits & 0x1ff) >> 6] |= (_uint64)1 << (bits & 0x3f);
+    }
+}
+
+    void
+SeedSketch::addPopularKey(unsigned whichTable, _uint64 key, const _int64 *nHits, unsigned nValues)
+{
+    _ASSERT(nPopularKeys * 2 < nPopularSlots && nValues <= 2);
+
+    _int64 slot = hash(whichTable, key) & (nPopularSlots - 1);
+    while (EmptyTable != popularKeys[slot].whichTable) {
+        _ASSERT(popularKeys[slot].whichTable != whichTable || popularKeys[slot].key != key);
+        slot = (slot + 1) & (nPopularSlots - 1);
+    }
+
+    popularKeys[slot].key = key;
+    popularKeys[slot].whichTable = whichTable;
+    for (unsigned i = 0; i < 2; i++) {
+        popularKeys[slot].nHits[i] = i < nValues ? (unsigned)__min(nHits[i], (_int64)0xffffffff) : 0;
+    }
+    nPopularKeys++;
+}
+
+    bool
+SeedSketch::findPopularKey(unsigned whichTable, _uint64 key, _int64 *nHits) const
+{
+    for (_int64 slot = hash(whichTable, key) & (nPopularSlots - 1); EmptyTable != popularKeys[slot].whichTable; slot = (slot + 1) & (nPopularSlots - 1)) {
+        if (popularKeys[slot].whichTable == whichTable && popularKeys[slot].key == key) {
+            nHits[0] = popularKeys[slot].nHits[0];
+            nHits[1] = popularKeys[slot].nHits[1];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+    bool
+SeedSketch::saveToFile(const char *fileName, unsigned nHashTables, _int64 countOfBases) const
+/*++
+
+Routine Description:
+
+    The file is a header of _uint64s (magic, version, nHashTables, countOfBases, nBlocks, nPopularSlots, nPopularKeys),
+    then the blocks and then the popular key slots, all in memory order.  The index's table count and genome size are
+    there so that a sketch left over from a different index doesn't get used.
+
+--*/
+{
+    FILE *file = fopen(fileName, "wb");
+    if (NULL == file) {
+        WriteErrorMessage("SeedSketch: unable to open '%s' for write\n", fileName);
+        return false;
+    }
+
+    _uint64 header[] = {SeedSketchMagic, SeedSketchVersion, nHashTables, (_uint64)countOfBases, (_uint64)nBlocks, (_uint64)nPopularSlots, (_uint64)nPopularKeys};
+    bool worked = fwrite(header, sizeof(header), 1, file) == 1;
+
+    const size_t writeSize = 32 * 1024 * 1024;
+    for (size_t offset = 0; worked && offset < nBlocks * sizeof(Block); offset += writeSize) {
+        size_t amountToWrite = __min(writeSize, nBlocks * sizeof(Block) - offset);
+        worked = fwrite((const char *)blocks + offset, 1, amountToWrite, file) == amountToWrite;
+    }
+
+    worked = worked && fwrite(popularKeys, sizeof(PopularKey), nPopularSlots, file) == (size_t)nPopularSlots;
+    worked = (0 == fclose(file)) && worked;
+
+    if (!worked) {
+        WriteErrorMessage("SeedSketch: unable to write '%s'\n", fileName);
+    }
+
+    return worked;
+}
+
+    SeedSketch *
+SeedSketch::loadFromFile(const char *fileName, unsigned nHashTables, _int64 countOfBases)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (NULL == file) {
+        return NULL;
+    }
+
+    _uint64 header[7];
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != SeedSketchMagic || header[1] != SeedSketchVersion) {
+        WriteErrorMessage("'%s' isn't a seed sketch file, ignoring it\n", fileName);
+        fclose(file);
+        return NULL;
+    }
+
+    if (header[2] != nHashTables || header[3] != (_uint64)countOfBases) {
+        WriteErrorMessage("The seed sketch in '%s' is for a different index, ignoring it\n", fileName);
+        fclose(file);
+        return NULL;
+    }
+
+    SeedSketch *sketch = new SeedSketch();
+    sketch->allocate((_int64)header[4], (_int64)header[5]);
+    sketch->nPopularKeys = (_int64)header[6];
+
+    const size_t readSize = 32 * 1024 * 1024;
+    bool worked = true;
+    for (size_t offset = 0; worked && offset < sketch->nBlocks * sizeof(Block); offset += readSize) {
+        size_t amountToRead = __min(readSize, sketch->nBlocks * sizeof(Block) - offset);
+        worked = fread((char *)sketch->blocks + offset, 1, amountToRead, file) == amountToRead;
+    }
+
+    worked = worked && fread(sketch->popularKeys, sizeof(PopularKey), sketch->nPopularSlots, file) == (size_t)sketch->nPopularSlots;
+    fclose(file);
+
+    if (!worked) {
+        WriteErrorMessage("Seed sketch file '%s' is truncated, ignoring it\n", fileName);
+        delete sketch;
+        return NULL;
+    }
+
+    return sketch;
+}
@@ -0,0 +1,126 @@
+/*++
+
+Module Name:
+
+    SeedSketch.h
+
+Abstract:
+
+    A small summary of an index's hash tables (index -seedSketch) that the seed lookups check before they touch
+    the tables themselves.  It has two parts:
+
+    A blocked Bloom filter of every key in the hash tables.  Each key sets a few bits in one 64 byte block, so
+    checking it costs at most one cache line.  A key that isn't in the filter certainly isn't in the tables, so a
+    lookup of a seed that's not in the genome (which is the most expensive kind of hash table lookup, since it has to
+    probe until it finds an empty slot) usually never touches them.
+
+    A table of the most popular keys with their hit counts.  A caller that's going to ignore a seed with more than
+    some number of hits only needs to know the count, so for these it gets that without the hash table or overflow
+    table lookups.
+
+    Keys are hash table number and key within the table, the way the index stores them, so a seed and its reverse
+    complement are different keys unless the index is -large.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class SeedSketch {
+public:
+    //
+    // An empty sketch with room for nKeys keys in the Bloom filter (at bitsPerKey bits each) and nPopularKeys popular keys.
+    //
+    SeedSketch(_int64 nKeys, unsigned bitsPerKey, _int64 nPopularKeys);
+    ~SeedSketch();
+
+    void addKey(unsigned whichTable, _uint64 key);
+
+    //
+    // nHits has a count for each value in the hash table entry (one, or two for -large indices).
+    //
+    void addPopularKey(unsigned whichTable, _uint64 key, const _int64 *nHits, unsigned nValues);
+
+    inline void prefetch(unsigned whichTable, _uint64 key) const {
+        _mm_prefetch((const char *)&blocks[hash(whichTable, key) % nBlocks], _MM_HINT_T0);
+    }
+
+    //
+    // False means the key certainly isn't in the index.  True means it probably is.
+    //
+    inline bool mightContain(unsigned whichTable, _uint64 key) const {
+        _uint64 keyHash = hash(whichTable, key);
+        const _uint64 *block = blocks[keyHash % nBlocks].words;
+        _uint64 bits = rehash(keyHash);
+        for (unsigned i = 0; i < BitsPerKeyInBlock; i++, bits >>= 9) {
+            if (0 == (block[(bits & 0x1ff) >> 6] & ((_uint64)1 << (bits & 0x3f)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //
+    // If the key is one of the popular ones, fill in its hit counts (two of them) and return true.
+    //
+    bool findPopularKey(unsigned whichTable, _uint64 key, _int64 *nHits) const;
+
+    _int64 getPopularKeyCount() const {return nPopularKeys;}
+    _int64 getSizeInBytes() const {return nBlocks * sizeof(Block) + nPopularSlots * sizeof(PopularKey);}
+
+    bool saveToFile(const char *fileName, unsigned nHashTables, _int64 countOfBases) const;
+
+    //
+    // Returns NULL if the file can't be read or isn't for an index with these nHashTables and countOfBases.
+    //
+    static SeedSketch *loadFromFile(const char *fileName, unsigned nHashTables, _int64 countOfBases);
+
+    static const unsigned DefaultBitsPerKey = 8;
+    static const _int64 MaxPopularKeys = 65536;
+    static const _int64 MinPopularKeyHits = 100;    // Fewer hits than this isn't popular, even if there's room
+
+private:
+    SeedSketch() : blocks(NULL), nBlocks(0), popularKeys(NULL), nPopularSlots(0), nPopularKeys(0) {}
+    void allocate(_int64 i_nBlocks, _int64 i_nPopularSlots);
+
+    static const unsigned BitsPerKeyInBlock = 6;
+
+    struct Block {
+        _uint64 words[8];
+    };
+
+    static const unsigned EmptyTable = 0xffffffff;
+
+    struct PopularKey {
+        _uint64     key;
+        unsigned    whichTable;     // EmptyTable for an unused slot
+        unsigned    nHits[2];       // Saturating
+    };
+
+    //
+    // The MurmurHash3 finalizer, applied to the key mixed with the table number.
+    //
+    static inline _uint64 rehash(_uint64 value) {
+        value ^= (value >> 33);
+        value *= 0xff51afd7ed558ccdULL;
+        value ^= (value >> 33);
+        value *= 0xc4ceb9fe1a85ec53ULL;
+        value ^= (value >> 33);
+        return value;
+    }
+
+    static inline _uint64 hash(unsigned whichTable, _uint64 key) {
+        return rehash(key ^ ((_uint64)whichTable * 0x9e3779b97f4a7c15ULL));
+    }
+
+    Block *     blocks;
+    _int64      nBlocks;
+    PopularKey *popularKeys;
+    _int64      nPopularSlots;  // A power of two
+    _int64      nPopularKeys;
+};
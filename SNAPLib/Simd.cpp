@@ -0,0 +1,86 @@
+/*++
+
+Module Name:
+
+    Simd.cpp
+
+Abstract:
+
+    Keeping track of which version of each vector kernel was picked for the processor.  See Simd.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "Simd.h"
+#include "Error.h"
+#include <string>
+
+//
+// Filled in by static initializers, so it has to be plain data that's there (zeroed) before any of them run.
+//
+struct VectorKernelRecord {
+    const char *kernel;
+    const char *version;
+};
+
+static const int MaxVectorKernelRecords = 64;
+static VectorKernelRecord VectorKernelRecords[MaxVectorKernelRecords];
+static int NVectorKernelRecords;
+
+    void
+RecordVectorKernel(const char *kernel, const char *version)
+{
+    for (int i = 0; i < NVectorKernelRecords; i++) {
+        if (!strcmp(VectorKernelRecords[i].kernel, kernel) && !strcmp(VectorKernelRecords[i].version, version)) {
+            return;     // Another function of the same kernel, picked the same way
+        }
+    }
+
+    if (NVectorKernelRecords < MaxVectorKernelRecords) {
+        VectorKernelRecords[NVectorKernelRecords].kernel = kernel;
+        VectorKernelRecords[NVectorKernelRecords].version = version;
+        NVectorKernelRecords++;
+    }
+}
+
+    void
+ReportVectorKernels()
+{
+    //
+    // The ones that are decided when SNAP is built rather than at startup.
+    //
+    RecordVectorKernel("seed packing", VECTOR16_NAME);
+    RecordVectorKernel("hash probing", VECTOR16_NAME);
+#ifdef SNAP_LIBDEFLATE
+    RecordVectorKernel("BGZF", "libdeflate");
+#else
+    RecordVectorKernel("BGZF", "zlib");
+#endif
+
+    std::string report;
+    bool reported[MaxVectorKernelRecords] = {false};
+    for (int i = 0; i < NVectorKernelRecords; i++) {
+        if (reported[i]) {
+            continue;
+        }
+
+        report += report.empty() ? "" : "; ";
+        report += VectorKernelRecords[i].version;
+        report += " for ";
+        const char *separator = "";
+        for (int j = i; j < NVectorKernelRecords; j++) {
+            if (!reported[j] && !strcmp(VectorKernelRecords[i].version, VectorKernelRecords[j].version)) {
+                report += separator;
+                report += VectorKernelRecords[j].kernel;
+                reported[j] = true;
+                separator = ", ";
+            }
+        }
+    }
+
+    WriteStatusMessage("Using %s\n", report.c_str());
+}
@@ -0,0 +1,290 @@
+/*++
+
+Module Name:
+
+    Simd.h
+
+Abstract:
+
+    What the vector code needs to know about the processor it's built for, and 16 byte vector operations for code that
+    runs the same way on x86 (SSE2) and 64 bit ARM (NEON).
+
+    SNAP_SIMD_X86 is defined on x86 and x64.  SSE2 is always there; the AVX2 and AVX-512 kernels are compiled for
+    their instruction sets one function at a time (SIMD_TARGET), so one binary runs everywhere, and KernelChooser picks
+    the best version of each kernel that the processor has at startup.  They're all inside #ifdef SNAP_SIMD_X86, and
+    X86_ONLY leaves them out of the choice elsewhere.
+
+    SNAP_SIMD_NEON is defined on 64 bit ARM (Graviton, Ampere, Apple), where NEON is always there.  Anywhere else, or
+    if SNAP_SIMD_SCALAR is defined when building, the Vector16 operations are plain C++ on 16 byte arrays, which gets
+    the same answers a byte at a time; building that way on x86 is how the portable paths get checked without an ARM
+    machine, and tests/SimdTest.cpp checks each operation against its definition on whatever it's built for.
+
+    Vector16Lookup and Vector16Reverse need SSSE3 on x86, so code that uses them is compiled with SIMD_TARGET("ssse3")
+    and only picked where ProcessorSupportsVector16Lookup().
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+#if (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)) && ! defined(SNAP_SIMD_SCALAR)
+#define SNAP_SIMD_X86
+#include <immintrin.h>
+#elif (defined(__aarch64__) || defined(_M_ARM64)) && ! defined(SNAP_SIMD_SCALAR)
+#define SNAP_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+//
+// Compile one function for an x86 instruction set beyond SSE2.  MSVC doesn't need to be told.
+//
+#if defined(SNAP_SIMD_X86) && ! defined(_MSC_VER)
+#define SIMD_TARGET(instructionSets) __attribute__((target(instructionSets)))
+#else
+#define SIMD_TARGET(instructionSets)
+#endif
+
+//
+// A kernel version that only exists on x86 (KernelChooser never picks one elsewhere).
+//
+#ifdef SNAP_SIMD_X86
+#define X86_ONLY(function) (function)
+#else
+#define X86_ONLY(function) NULL
+#endif
+
+#if defined(SNAP_SIMD_X86)
+
+typedef __m128i Vector16;
+
+inline Vector16 Vector16Load(const void *p) { return _mm_loadu_si128((const __m128i *)p); }
+inline void Vector16Store(void *p, Vector16 v) { _mm_storeu_si128((__m128i *)p, v); }
+inline Vector16 Vector16Set1(char c) { return _mm_set1_epi8(c); }
+inline Vector16 Vector16Zero() { return _mm_setzero_si128(); }
+inline Vector16 Vector16And(Vector16 a, Vector16 b) { return _mm_and_si128(a, b); }
+inline Vector16 Vector16Or(Vector16 a, Vector16 b) { return _mm_or_si128(a, b); }
+inline Vector16 Vector16Add(Vector16 a, Vector16 b) { return _mm_add_epi8(a, b); }
+inline Vector16 Vector16Sub(Vector16 a, Vector16 b) { return _mm_sub_epi8(a, b); }
+inline Vector16 Vector16Equal(Vector16 a, Vector16 b) { return _mm_cmpeq_epi8(a, b); }
+inline Vector16 Vector16Greater(Vector16 a, Vector16 b) { return _mm_cmpgt_epi8(a, b); }
+inline Vector16 Vector16Select(Vector16 mask, Vector16 a, Vector16 b) { return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+inline Vector16 Vector16LowNibbles(Vector16 a) { return _mm_and_si128(a, _mm_set1_epi8(0x0f)); }
+inline Vector16 Vector16HighNibbles(Vector16 a) { return _mm_and_si128(_mm_srli_epi16(a, 4), _mm_set1_epi8(0x0f)); }
+inline _uint32 Vector16MoveMask(Vector16 a) { return (_uint32)_mm_movemask_epi8(a); }
+inline Vector16 Vector16InterleaveLow(Vector16 a, Vector16 b) { return _mm_unpacklo_epi8(a, b); }
+
+SIMD_TARGET("ssse3") inline Vector16 Vector16Lookup(Vector16 table, Vector16 indices) { return _mm_shuffle_epi8(table, indices); }
+
+SIMD_TARGET("ssse3") inline Vector16 Vector16Reverse(Vector16 a)
+{
+    return _mm_shuffle_epi8(a, _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+#elif defined(SNAP_SIMD_NEON)
+
+typedef uint8x16_t Vector16;
+
+inline Vector16 Vector16Load(const void *p) { return vld1q_u8((const uint8_t *)p); }
+inline void Vector16Store(void *p, Vector16 v) { vst1q_u8((uint8_t *)p, v); }
+inline Vector16 Vector16Set1(char c) { return vdupq_n_u8((uint8_t)c); }
+inline Vector16 Vector16Zero() { return vdupq_n_u8(0); }
+inline Vector16 Vector16And(Vector16 a, Vector16 b) { return vandq_u8(a, b); }
+inline Vector16 Vector16Or(Vector16 a, Vector16 b) { return vorrq_u8(a, b); }
+inline Vector16 Vector16Add(Vector16 a, Vector16 b) { return vaddq_u8(a, b); }
+inline Vector16 Vector16Sub(Vector16 a, Vector16 b) { return vsubq_u8(a, b); }
+inline Vector16 Vector16Equal(Vector16 a, Vector16 b) { return vceqq_u8(a, b); }
+inline Vector16 Vector16Greater(Vector16 a, Vector16 b) { return vcgtq_s8(vreinterpretq_s8_u8(a), vreinterpretq_s8_u8(b)); }
+inline Vector16 Vector16Select(Vector16 mask, Vector16 a, Vector16 b) { return vbslq_u8(mask, a, b); }
+inline Vector16 Vector16LowNibbles(Vector16 a) { return vandq_u8(a, vdupq_n_u8(0x0f)); }
+inline Vector16 Vector16HighNibbles(Vector16 a) { return vshrq_n_u8(a, 4); }
+inline Vector16 Vector16InterleaveLow(Vector16 a, Vector16 b) { return vzip1q_u8(a, b); }
+
+inline _uint32 Vector16MoveMask(Vector16 a)
+{
+    //
+    // NEON has no movemask.  Move each byte's top bit to its place in its half, and add up the halves.
+    //
+    static const int8_t shifts[16] = {0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7};
+    uint8x16_t bits = vshlq_u8(vshrq_n_u8(a, 7), vld1q_s8(shifts));
+    return (_uint32)vaddv_u8(vget_low_u8(bits)) | ((_uint32)vaddv_u8(vget_high_u8(bits)) << 8);
+}
+
+// tbl gives 0 for any index past the table, which covers the top bit being set the way pshufb does
+inline Vector16 Vector16Lookup(Vector16 table, Vector16 indices) { return vqtbl1q_u8(table, indices); }
+
+inline Vector16 Vector16Reverse(Vector16 a)
+{
+    uint8x16_t reversedHalves = vrev64q_u8(a);
+    return vextq_u8(reversedHalves, reversedHalves, 8);
+}
+
+#else   // neither, so a byte at a time
+
+struct Vector16 {
+    _uint8 bytes[16];
+};
+
+inline Vector16 Vector16Load(const void *p) { Vector16 v; memcpy(v.bytes, p, 16); return v; }
+inline void Vector16Store(void *p, Vector16 v) { memcpy(p, v.bytes, 16); }
+inline Vector16 Vector16Set1(char c) { Vector16 v; memset(v.bytes, c, 16); return v; }
+inline Vector16 Vector16Zero() { return Vector16Set1(0); }
+
+#define VECTOR16_BYTEWISE(name, expression)                                     \
+    inline Vector16 name(Vector16 a, Vector16 b)                                \
+    {                                                                           \
+        Vector16 v;                                                             \
+        for (int i = 0; i < 16; i++) {                                          \
+            v.bytes[i] = (_uint8)(expression);                                  \
+        }                                                                       \
+        return v;                                                               \
+    }
+
+VECTOR16_BYTEWISE(Vector16And, a.bytes[i] & b.bytes[i])
+VECTOR16_BYTEWISE(Vector16Or, a.bytes[i] | b.bytes[i])
+VECTOR16_BYTEWISE(Vector16Add, a.bytes[i] + b.bytes[i])
+VECTOR16_BYTEWISE(Vector16Sub, a.bytes[i] - b.bytes[i])
+VECTOR16_BYTEWISE(Vector16Equal, a.bytes[i] == b.bytes[i] ? 0xff : 0)
+VECTOR16_BYTEWISE(Vector16Greater, (signed char)a.bytes[i] > (signed char)b.bytes[i] ? 0xff : 0)
+VECTOR16_BYTEWISE(Vector16Lookup, (b.bytes[i] & 0x80) ? 0 : a.bytes[b.bytes[i] & 0x0f])
+
+#undef VECTOR16_BYTEWISE
+
+inline Vector16 Vector16Select(Vector16 mask, Vector16 a, Vector16 b)
+{
+    return Vector16Or(Vector16And(mask, a), Vector16And(Vector16Equal(mask, Vector16Zero()), b));
+}
+
+inline Vector16 Vector16LowNibbles(Vector16 a) { return Vector16And(a, Vector16Set1(0x0f)); }
+
+inline Vector16 Vector16HighNibbles(Vector16 a)
+{
+    for (int i = 0; i < 16; i++) {
+        a.bytes[i] >>= 4;
+    }
+    return a;
+}
+
+inline _uint32 Vector16MoveMask(Vector16 a)
+{
+    _uint32 mask = 0;
+    for (int i = 0; i < 16; i++) {
+        mask |= (_uint32)(a.bytes[i] >> 7) << i;
+    }
+    return mask;
+}
+
+inline Vector16 Vector16Reverse(Vector16 a)
+{
+    Vector16 v;
+    for (int i = 0; i < 16; i++) {
+        v.bytes[i] = a.bytes[15 - i];
+    }
+    return v;
+}
+
+// a0 b0 a1 b1 ... a7 b7
+inline Vector16 Vector16InterleaveLow(Vector16 a, Vector16 b)
+{
+    Vector16 v;
+    for (int i = 0; i < 8; i++) {
+        v.bytes[2 * i] = a.bytes[i];
+        v.bytes[2 * i + 1] = b.bytes[i];
+    }
+    return v;
+}
+
+#endif
+
+//
+// Whether the Vector16 operations are vector instructions here (and so worth using instead of the scalar versions),
+// and whether Vector16Lookup and Vector16Reverse are.
+//
+inline bool ProcessorSupportsVector16()
+{
+#if defined(SNAP_SIMD_X86) || defined(SNAP_SIMD_NEON)
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline bool ProcessorSupportsVector16Lookup()
+{
+#if defined(SNAP_SIMD_X86)
+    return ProcessorSupportsSSSE3();
+#elif defined(SNAP_SIMD_NEON)
+    return true;
+#else
+    return false;
+#endif
+}
+
+//
+// The instruction sets the Vector16 operations use here, as ReportVectorKernels puts them.
+//
+#if defined(SNAP_SIMD_X86)
+#define VECTOR16_NAME "SSE2"
+#define VECTOR16_LOOKUP_NAME "SSSE3"
+#elif defined(SNAP_SIMD_NEON)
+#define VECTOR16_NAME "NEON"
+#define VECTOR16_LOOKUP_NAME "NEON"
+#else
+#define VECTOR16_NAME "scalar"
+#define VECTOR16_LOOKUP_NAME "scalar"
+#endif
+
+//
+// Note which version of a kernel was picked, and write them all out (grouped by instruction set) as a status message,
+// so that it's clear what one binary did on a particular machine.  Recording is meant for static initializers, and
+// isn't thread safe.
+//
+void RecordVectorKernel(const char *kernel, const char *version);
+void ReportVectorKernels();
+
+//
+// Pick the best version of a kernel for the processor at startup and record it.  The versions are offered best first,
+// ending with the scalar one, which always runs:
+//
+//      Function f = KernelChooser<Function>("FASTQ parsing").avx2(X86_ONLY(FindNewlinesAVX2))
+//          .vector16(FindNewlinesVector16).scalar(FindNewlinesScalar);
+//
+template<class F> class KernelChooser {
+public:
+    KernelChooser(const char *i_kernel) : kernel(i_kernel), chosen(), version(NULL) {}
+
+#ifdef SNAP_SIMD_X86
+    KernelChooser &avx512(F f) { return offer(ProcessorSupportsAVX512F(), "AVX-512", f); }
+    KernelChooser &avx2(F f) { return offer(ProcessorSupportsAVX2(), "AVX2", f); }
+#else
+    KernelChooser &avx512(F f) { return *this; }
+    KernelChooser &avx2(F f) { return *this; }
+#endif
+    KernelChooser &vector16(F f) { return offer(ProcessorSupportsVector16(), VECTOR16_NAME, f); }
+    KernelChooser &vector16Lookup(F f) { return offer(ProcessorSupportsVector16Lookup(), VECTOR16_LOOKUP_NAME, f); }
+
+    F scalar(F f)
+    {
+        offer(true, "scalar", f);
+        RecordVectorKernel(kernel, version);
+        return chosen;
+    }
+
+private:
+    KernelChooser &offer(bool usable, const char *i_version, F f)
+    {
+        if (NULL == version && usable) {
+            version = i_version;
+            chosen = f;
+        }
+        return *this;
+    }
+
+    const char *kernel;
+    F           chosen;
+    const char *version;
+};
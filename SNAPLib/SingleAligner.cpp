@@ -36,6 +36,11 @@ Revision History:
 #include "Util.h"
 #include "SingleAligner.h"
 #include "MultiInputReadSupplier.h"
+#include "LookaheadReadSupplier.h"
+#include "LongReadAligner.h"
+#include "KmerFilter.h"
+#include "UmiConsensus.h"
+#include "PipelineTrace.h"
 
 using namespace std;
 using util::stringEndsWith;
@@ -75,24 +80,81 @@ SingleAlignerContext::runIterationThread()
 		delete supplier;
 		return;
 	}
+
+    if (options->inputOrder) {
+        supplier->setInputUnitListener(this);
+    }
+
+    //
+    // (not for -inputOrder, since the lookahead would take the reads of the next unit before the writers had finished this one)
+    //
+    unsigned readLookahead = options->inputOrder ? 0 : 0 == options->readLookahead && options->outOfCoreIndex ? DEFAULT_OUT_OF_CORE_LOOKAHEAD : options->readLookahead;
+    if (NULL != index && 0 != readLookahead) {
+        supplier = new LookaheadReadSupplier(supplier, index, readLookahead);
+    }
+
     if (index == NULL) {
         // no alignment, just input/output
         Read *read;
-        while (NULL != (read = supplier->getNextRead())) {
-            stats->totalReads++;
-            SingleAlignmentResult result;
-            result.status = NotFound;
-            result.direction = FORWARD;
-            result.mapq = 0;
-            result.score = 0;
-            result.location = InvalidGenomeLocation;
-            if (options->passFilter(read, NotFound, read->getDataLength() < minReadLength || read->countOfNs() > maxDist, false)) {
-                stats->notFound++;
-                if (NULL != readWriter) {
-                    readWriter->writeReads(readerContext, read, &result, 1, true);
+        Read *readBatch[ReadSupplier::MaxReadBatchSize];
+        int nReadsInBatch;
+        while (0 != (nReadsInBatch = supplier->getNextReadBatch(readBatch, ReadSupplier::MaxReadBatchSize))) {
+            for (int whichRead = 0; whichRead < nReadsInBatch; whichRead++) {
+                read = readBatch[whichRead];
+                stats->totalReads++;
+                SingleAlignmentResult result;
+                result.status = NotFound;
+                result.direction = FORWARD;
+                result.mapq = 0;
+                result.score = 0;
+                result.location = InvalidGenomeLocation;
+                if (options->passFilter(read, NotFound, read->getDataLength() < minReadLength || read->countOfNs() > maxDist, false)) {
+                    stats->notFound++;
+                    if (NULL != readWriter) {
+                        readWriter->writeReads(readerContext, read, &result, 1, true);
+                    }
+                } else {
+                    stats->filtered++;
+                }
+            }
+        }
+        delete supplier;
+        return;
+    }
+
+    if (options->kmerFilterSeeds > 0) {
+        //
+        // Just look up a few seeds, see KmerFilter.h.
+        //
+        KmerFilter kmerFilter(index, options->kmerFilterSeeds, options->kmerFilterHits);
+        Read *readBatch[ReadSupplier::MaxReadBatchSize];
+        int nReadsInBatch;
+        while (0 != (nReadsInBatch = supplier->getNextReadBatch(readBatch, ReadSupplier::MaxReadBatchSize))) {
+            for (int whichRead = 0; whichRead < nReadsInBatch; whichRead++) {
+                Read *read = readBatch[whichRead];
+                stats->totalReads++;
+                bool tooShort = read->getDataLength() < minReadLength || read->countOfNs() > maxDist;
+                AlignmentResult status = !tooShort && kmerFilter.matches(read) ? MultipleHits : NotFound;
+                if (options->passFilter(read, status, tooShort, false)) {
+                    if (tooShort) {
+                        stats->uselessReads++;
+                    } else if (MultipleHits == status) {
+                        stats->multiHits++;
+                    } else {
+                        stats->notFound++;
+                    }
+                    if (NULL != readWriter) {
+                        SingleAlignmentResult result;
+                        result.status = NotFound;   // There's no location to write
+                        result.direction = FORWARD;
+                        result.mapq = 0;
+                        result.score = 0;
+                        result.location = InvalidGenomeLocation;
+                        readWriter->writeReads(readerContext, read, &result, 1, true);
+                    }
+                } else {
+                    stats->filtered++;
                 }
-            } else {
-                stats->filtered++;
             }
         }
         delete supplier;
@@ -106,12 +168,38 @@ SingleAlignerContext::runIterationThread()
     if (maxSecondaryAlignmentAdditionalEditDistance < 0) {
         alignmentResultBufferCount = 1; // For the primary alignment
     } else {
-        alignmentResultBufferCount = BaseAligner::getMaxSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength()) + 1; // +1 for the primary alignment
+        alignmentResultBufferCount = BaseAligner::getMaxSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength());
+        for (int i = 0; i < nOtherIndices; i++) {
+            alignmentResultBufferCount = __max(alignmentResultBufferCount,
+                BaseAligner::getMaxSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, otherIndices[i]->getSeedLength()));
+        }
+        if (maxSecondaryAlignmentsPerContig <= 0) {
+            alignmentResultBufferCount = __min(alignmentResultBufferCount, (unsigned)maxSecondaryAlignments);   // AlignRead keeps only the best -omax of them
+        }
+        alignmentResultBufferCount++; // +1 for the primary alignment
     }
     size_t alignmentResultBufferSize = sizeof(*alignmentResults) * (alignmentResultBufferCount + 1); // +1 is for primary result
  
-    BigAllocator *allocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(index, true, maxHits, maxReadSize, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxSecondaryAlignmentsPerContig) 
-        + alignmentResultBufferSize);
+    //
+    // With an index that has long seed tables (index -longSeedSize), reads of at least -lsr bases get an aligner of
+    // their own that uses them.  Longer seeds mean fewer of them per read, so the result buffer is big enough for both.
+    //
+    GenomeIndex *longSeedIndex = options->longReads ? NULL : index->getLongSeedIndex();
+    size_t alignerReservation = BaseAligner::getBigAllocatorReservation(index, true, maxHits, maxReadSize, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxSecondaryAlignmentsPerContig);
+    size_t longSeedAlignerReservation = NULL == longSeedIndex ? 0 :
+        BaseAligner::getBigAllocatorReservation(longSeedIndex, true, maxHits, maxReadSize, longSeedIndex->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxSecondaryAlignmentsPerContig);
+
+    //
+    // With -otherIndex, each read is aligned against the other indices too, each with an aligner and results of its own.
+    //
+    size_t otherAlignerReservation = 0;
+    for (int i = 0; i < nOtherIndices; i++) {
+        otherAlignerReservation += alignmentResultBufferSize + BaseAligner::getBigAllocatorReservation(otherIndices[i], true, maxHits, maxReadSize,
+            otherIndices[i]->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxSecondaryAlignmentsPerContig);
+    }
+    BigAllocator *allocator = new BigAllocator(alignerReservation + longSeedAlignerReservation + alignmentResultBufferSize + otherAlignerReservation);
+    size_t allocatorUsed[5];
+    allocatorUsed[0] = allocator->getMemoryUsed();
    
     BaseAligner *aligner = new (allocator) BaseAligner(
             index,
@@ -130,13 +218,73 @@ SingleAlignerContext::runIterationThread()
             NULL,               // reverse LV
             stats,
             allocator);
+    allocatorUsed[1] = allocator->getMemoryUsed();
+
+    BaseAligner *longSeedAligner = NULL;
+    if (NULL != longSeedIndex) {
+        longSeedAligner = new (allocator) BaseAligner(
+                longSeedIndex,
+                maxHits,
+                maxDist,
+                maxReadSize,
+                numSeedsFromCommandLine,
+                seedCoverage,
+                minWeightToCheck,
+                extraSearchDepth,
+                noUkkonen,
+                noOrderedEvaluation,
+                noTruncation,
+                maxSecondaryAlignmentsPerContig,
+                NULL,
+                NULL,
+                stats,
+                allocator);
+    }
+    allocatorUsed[2] = allocator->getMemoryUsed();
 
     alignmentResults = (SingleAlignmentResult *)allocator->allocate(alignmentResultBufferSize);
+    allocatorUsed[3] = allocator->getMemoryUsed();
+
+    BaseAligner *otherAligners[MAX_OTHER_INDICES];
+    SingleAlignmentResult *otherAlignmentResults[MAX_OTHER_INDICES];
+    for (int i = 0; i < nOtherIndices; i++) {
+        otherAligners[i] = new (allocator) BaseAligner(otherIndices[i], maxHits, maxDist, maxReadSize, numSeedsFromCommandLine, seedCoverage,
+            minWeightToCheck, extraSearchDepth, noUkkonen, noOrderedEvaluation, noTruncation, maxSecondaryAlignmentsPerContig, NULL, NULL, stats, allocator);
+        otherAlignmentResults[i] = (SingleAlignmentResult *)allocator->allocate(alignmentResultBufferSize);
+    }
+    allocatorUsed[4] = allocator->getMemoryUsed();
+
+    if (options->memoryReport) {
+        const char *componentNames[] = {"Aligner", "Results", "Long seed aligner", "Other index aligners"};
+        size_t reserved[] = {alignerReservation, alignmentResultBufferSize, longSeedAlignerReservation, otherAlignerReservation};
+        size_t used[] = {allocatorUsed[1] - allocatorUsed[0], allocatorUsed[3] - allocatorUsed[2], allocatorUsed[2] - allocatorUsed[1], allocatorUsed[4] - allocatorUsed[3]};
+        ReportBigAllocatorUse(0 != nOtherIndices ? 4 : NULL == longSeedAligner ? 2 : 3, componentNames, reserved, used, options->numThreads);
+    }
  
     allocator->checkCanaries();
 
-    aligner->setExplorePopularSeeds(options->explorePopularSeeds);
-    aligner->setStopOnFirstHit(options->stopOnFirstHit);
+    BaseAligner *aligners[2 + MAX_OTHER_INDICES] = {aligner};
+    int nAligners = 1;
+    if (NULL != longSeedAligner) {
+        aligners[nAligners++] = longSeedAligner;
+    }
+    for (int i = 0; i < nOtherIndices; i++) {
+        aligners[nAligners++] = otherAligners[i];
+    }
+    for (int i = 0; i < nAligners; i++) {
+        aligners[i]->setExplorePopularSeeds(options->explorePopularSeeds);
+        aligners[i]->setStopOnFirstHit(options->stopOnFirstHit);
+        aligners[i]->setAdaptiveSeeding(options->adaptiveSeeding);
+        aligners[i]->setExactMatchFastPath(!options->noExactMatchFastPath);
+        aligners[i]->setWorkBudget(options->workBudget);
+        aligners[i]->setMinSeedQuality(options->minSeedQuality);
+        aligners[i]->setMaxSeedsWithoutHits(options->maxSeedsWithoutHits);
+    }
+
+    LongReadAligner *longReadAligner = NULL;
+    if (options->longReads) {
+        longReadAligner = new LongReadAligner(index, maxHits, options->longReadHelpers);
+    }
 
 #ifdef  _MSC_VER
     if (options->useTimingBarrier) {
@@ -150,106 +298,211 @@ SingleAlignerContext::runIterationThread()
 
     // Align the reads.
     Read *read;
+    Read *readBatch[ReadSupplier::MaxReadBatchSize];
+    int nReadsInBatch;
     _uint64 lastReportTime = timeInMillis();
     _uint64 readsWhenLastReported = 0;
 
-    while (NULL != (read = supplier->getNextRead())) {
-        stats->totalReads++;
+    AlignerThreadProgress *threadProgress = NULL == progress ? NULL : progress->getThreadProgress(threadNum);
+    if (NULL != threadProgress) {
+        threadProgress->begin();
+    }
+    SlowReadTracker *slowReadTracker = NULL == slowReads ? NULL : slowReads->getThreadTracker(threadNum);
 
-        if (AlignerOptions::useHadoopErrorMessages && stats->totalReads % 10000 == 0 && timeInMillis() - lastReportTime > 10000) {
-            fprintf(stderr,"reporter:counter:SNAP,readsAligned,%lu\n",stats->totalReads - readsWhenLastReported);
-            readsWhenLastReported = stats->totalReads;
-            lastReportTime = timeInMillis();
+    PipelineTraceSpan alignSpan(AlignTraceEvent);
+    for (;;) {
+        alignSpan.end();
+        if (NULL != threadProgress) {
+            threadProgress->waiting();
+        }
+        nReadsInBatch = supplier->getNextReadBatch(readBatch, ReadSupplier::MaxReadBatchSize);
+        if (NULL != threadProgress) {
+            threadProgress->working();
+        }
+        if (0 == nReadsInBatch) {
+            break;
         }
+        alignSpan.begin();
 
-        // Skip the read if it has too many Ns or trailing 2 quality scores.
-        if (read->getDataLength() < minReadLength || read->countOfNs() > maxDist) {
-            if (!options->passFilter(read, NotFound, true, false)) {
-                stats->filtered++;
-            } else {
-                if (NULL != readWriter) {
-                    SingleAlignmentResult result;
-                    result.status = NotFound;
-                    result.location = InvalidGenomeLocation;
-                    result.mapq = 0;
-                    result.direction = FORWARD;
-                    readWriter->writeReads(readerContext, read, &result, 1, true);
+        for (int whichRead = 0; whichRead < nReadsInBatch; whichRead++) {
+            read = readBatch[whichRead];
+            stats->totalReads++;
+            if (NULL != threadProgress) {
+                threadProgress->reads++;
+                threadProgress->bases += read->getDataLength();
+            }
+
+            if (AlignerOptions::useHadoopErrorMessages && stats->totalReads % 10000 == 0 && timeInMillis() - lastReportTime > 10000) {
+                fprintf(stderr,"reporter:counter:SNAP,readsAligned,%lu\n",stats->totalReads - readsWhenLastReported);
+                readsWhenLastReported = stats->totalReads;
+                lastReportTime = timeInMillis();
+            }
+
+            // Skip the read if it has too many Ns or trailing 2 quality scores.
+            if (read->getDataLength() < minReadLength || (NULL == longReadAligner && read->countOfNs() > maxDist)) {
+                if (!options->passFilter(read, NotFound, true, false)) {
+                    stats->filtered++;
+                } else {
+                    if (NULL != readWriter) {
+                        SingleAlignmentResult result;
+                        result.status = NotFound;
+                        result.location = InvalidGenomeLocation;
+                        result.mapq = 0;
+                        result.direction = FORWARD;
+                        readWriter->writeReads(readerContext, read, &result, 1, true);
+                    }
+                    stats->uselessReads++;
                 }
-                stats->uselessReads++;
+                continue;
             }
-            continue;
-        }
 
 #if     TIME_HISTOGRAM
-        _int64 startTime = timeInNanos();
+            _int64 startTime = timeInNanos();
 #endif // TIME_HISTOGRAM
 
-        int nSecondaryResults = 0;
+            BaseAligner *readAligner = (NULL != longSeedAligner && read->getDataLength() >= options->longSeedMinReadLength) ? longSeedAligner : aligner;
+
+            AlignerWorkCounters workBefore;
+            _int64 slowReadStart = 0;
+            if (NULL != slowReadTracker) {
+                readAligner->getWorkCounters(&workBefore);
+                slowReadStart = timeInNanos();
+            }
+
+            int nSecondaryResults = 0;
 
+            bool reused = NULL != originalAlignments && originalAlignments->verify(read, alignmentResults);
+            bool cached = !reused && NULL != alignmentCache && alignmentCache->lookup(read, alignmentResults, alignmentResultBufferCount - 1, &nSecondaryResults);
+            if (reused) {
+                stats->reusedAlignments++;
+            } else if (cached) {
+                stats->cachedAlignments++;
+            } else if (NULL != longReadAligner) {
+                longReadAligner->AlignRead(read, alignmentResults);
+            } else {
 #ifdef LONG_READS
-        int oldMaxK = aligner->getMaxK();
-        if (options->maxDistFraction > 0.0) {
-            aligner->setMaxK(min(MAX_K, (int)(read->getDataLength() * options->maxDistFraction)));
-        }
+                int oldMaxK = readAligner->getMaxK();
+                if (options->maxDistFraction > 0.0) {
+                    readAligner->setMaxK(min(MAX_K, (int)(read->getDataLength() * options->maxDistFraction)));
+                }
 #endif
 
-        aligner->AlignRead(read, alignmentResults, maxSecondaryAlignmentAdditionalEditDistance, alignmentResultBufferCount - 1, &nSecondaryResults, maxSecondaryAlignments, alignmentResults + 1);
+                readAligner->AlignRead(read, alignmentResults, maxSecondaryAlignmentAdditionalEditDistance, alignmentResultBufferCount - 1, &nSecondaryResults, maxSecondaryAlignments, alignmentResults + 1);
 #ifdef LONG_READS
-        aligner->setMaxK(oldMaxK);
+                readAligner->setMaxK(oldMaxK);
 #endif
+            }
 
-#if     TIME_HISTOGRAM
-        _int64 runTime = timeInNanos() - startTime;
-        int timeBucket = min(30, cheezyLogBase2(runTime));
-        stats->countByTimeBucket[timeBucket]++;
-        stats->nanosByTimeBucket[timeBucket] += runTime;
-#endif // TIME_HISTOGRAM
-
-        allocator->checkCanaries();
+            if (NULL != alignmentCache && !cached && !reused) {
+                alignmentCache->add(read, alignmentResults, nSecondaryResults);
+            }
 
-        bool containsPrimary = true;
-        if (NULL != readWriter) {
             //
-            // Remove any reads that don't pass the filter, then send the remainder down to the writer.
+            // -otherIndex: align it against each of the other indices as well, and write it (with that index's
+            // secondary alignments) to the output of whichever one it aligned best to.  Ties go to the earlier index.
             //
-            for (int i = 0; i <= nSecondaryResults; i++) {
-                if (!options->passFilter(read, alignmentResults[i].status, false, i != 0 || !containsPrimary)) {
-                    if (i == 0) {
-                        containsPrimary = false;
-                    }
-                    //
-                    // Copy the last result here.
-                    //
-                    alignmentResults[i] = alignmentResults[nSecondaryResults];
-                    nSecondaryResults--;
-
-                    //
-                    // And back up so it gets checked.
-                    //
-                    i--;
+            SingleAlignmentResult *results = alignmentResults;
+            ReadWriter *writer = readWriter;
+            ReaderContext *context = &readerContext;
+            int bestOtherIndex = -1;
+            for (int i = 0; i < nOtherIndices; i++) {
+                int nOtherSecondaryResults = 0;
+                otherAligners[i]->AlignRead(read, otherAlignmentResults[i], maxSecondaryAlignmentAdditionalEditDistance, alignmentResultBufferCount - 1,
+                    &nOtherSecondaryResults, maxSecondaryAlignments, otherAlignmentResults[i] + 1);
+                if (otherAlignmentResults[i][0].isBetterThan(results[0])) {
+                    bestOtherIndex = i;
+                    results = otherAlignmentResults[i];
+                    nSecondaryResults = nOtherSecondaryResults;
+                    writer = otherReadWriters[i];
+                    context = &otherReaderContexts[i];
                 }
-            } // For each result
+            }
+            if (-1 != bestOtherIndex) {
+                stats->readsToOtherIndices[bestOtherIndex]++;
+            }
 
-            stats->extraAlignments += nSecondaryResults + (containsPrimary ? 0 : 1);    // If it doesn't contain the primary, then it's a secondary.
-            readWriter->writeReads(readerContext, read, alignmentResults, nSecondaryResults + 1, containsPrimary);
+            if (read->wasAlignmentTruncated()) {
+                stats->truncatedAlignments++;
+            }
 
-        }
+            if (NULL != slowReadTracker) {
+                _int64 nanos = timeInNanos() - slowReadStart;
+                AlignerWorkCounters work;
+                readAligner->getWorkCounters(&work);
+                work.subtract(workBefore);
+                slowReadTracker->record(nanos, work, read);
+            }
 
-        if (containsPrimary) {
-            updateStats(stats, read, alignmentResults[0].status, alignmentResults[0].score, alignmentResults[0].mapq);
-        } else {
-            stats->filtered++;
-        }
+#if     TIME_HISTOGRAM
+            _int64 runTime = timeInNanos() - startTime;
+            int timeBucket = min(30, cheezyLogBase2(runTime));
+            stats->countByTimeBucket[timeBucket]++;
+            stats->nanosByTimeBucket[timeBucket] += runTime;
+#endif // TIME_HISTOGRAM
+
+            allocator->checkCanaries();
+
+            bool containsPrimary = true;
+            if (NULL != writer) {
+                //
+                // Remove any reads that don't pass the filter, then send the remainder down to the writer.
+                //
+                for (int i = 0; i <= nSecondaryResults; i++) {
+                    if (!options->passFilter(read, results[i].status, false, i != 0 || !containsPrimary)) {
+                        if (i == 0) {
+                            containsPrimary = false;
+                        }
+                        //
+                        // Copy the last result here.
+                        //
+                        results[i] = results[nSecondaryResults];
+                        nSecondaryResults--;
+
+                        //
+                        // And back up so it gets checked.
+                        //
+                        i--;
+                    }
+                } // For each result
+
+                stats->extraAlignments += nSecondaryResults + (containsPrimary ? 0 : 1);    // If it doesn't contain the primary, then it's a secondary.
+                writer->writeReads(*context, read, results, nSecondaryResults + 1, containsPrimary);
+
+            }
 
+            if (containsPrimary) {
+                updateStats(stats, read, results[0].status, results[0].score, results[0].mapq);
+            } else {
+                stats->filtered++;
+            }
 
+
+        }
     }
 
+    stats->lowQualitySeedsSkipped = aligner->getNLowQualitySeedsSkipped();
+    stats->readsGivenUp = aligner->getNReadsGivenUp();
+
     aligner->~BaseAligner(); // This calls the destructor without calling operator delete, allocator owns the memory.
+    if (NULL != longSeedAligner) {
+        stats->lowQualitySeedsSkipped += longSeedAligner->getNLowQualitySeedsSkipped();
+        stats->readsGivenUp += longSeedAligner->getNReadsGivenUp();
+        longSeedAligner->~BaseAligner();
+    }
+    for (int i = 0; i < nOtherIndices; i++) {
+        stats->lowQualitySeedsSkipped += otherAligners[i]->getNLowQualitySeedsSkipped();
+        stats->readsGivenUp += otherAligners[i]->getNReadsGivenUp();
+        otherAligners[i]->~BaseAligner();
+    }
+    delete longReadAligner;
  
     if (supplier != NULL) {
         delete supplier;
     }
 
+    if (options->memoryReport) {
+        stats->alignerMemoryTouched = stats->maxAlignerMemoryTouched = allocator->getMemoryTouched();
+    }
     delete allocator;   // This is what actually frees the memory.
 }
 
@@ -296,6 +549,9 @@ SingleAlignerContext::typeSpecificBeginIteration()
         }
         readSupplierGenerator = new MultiInputReadSupplierGenerator(options->nInputs,generators);
     }
+    if (0 != options->umiField) {
+        readSupplierGenerator = new UmiConsensusReadSupplierGenerator(readSupplierGenerator, options->umiField, options->umiPrefix);
+    }
     ReaderContext* context = readSupplierGenerator->getContext();
     readerContext.header = context->header;
     readerContext.headerBytes = context->headerBytes;
@@ -0,0 +1,104 @@
+/*++
+
+Module Name:
+
+    SlowReads.cpp
+
+Abstract:
+
+    Keeping and writing the slowest reads to align.  See SlowReads.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "SlowReads.h"
+#include "Read.h"
+#include "Error.h"
+#include <algorithm>
+
+using std::vector;
+
+static bool SlowerThan(const SlowRead &a, const SlowRead &b)
+{
+    return a.nanos > b.nanos;   // As a heap comparison, this keeps the fastest on top
+}
+
+    void
+SlowReadTracker::keep(_int64 nanos, const AlignerWorkCounters &work, Read *read0, Read *read1)
+{
+    if ((int)kept.size() >= maxToKeep) {
+        std::pop_heap(kept.begin(), kept.end(), SlowerThan);
+        kept.pop_back();
+    }
+
+    SlowRead slowRead;
+    slowRead.nanos = nanos;
+    slowRead.work = work;
+    slowRead.nReads = NULL == read1 ? 1 : 2;
+    Read *reads[2] = {read0, read1};
+    for (int i = 0; i < slowRead.nReads; i++) {
+        slowRead.id[i].assign(reads[i]->getId(), reads[i]->getIdLength());
+        slowRead.bases[i].assign(reads[i]->getUnclippedData(), reads[i]->getUnclippedLength());
+        slowRead.qualities[i].assign(reads[i]->getUnclippedQuality(), reads[i]->getUnclippedLength());
+    }
+
+    kept.push_back(slowRead);
+    std::push_heap(kept.begin(), kept.end(), SlowerThan);
+}
+
+SlowReadCollector::SlowReadCollector(const char *i_fileName, int i_maxToKeep, int i_nThreads) :
+    fileName(i_fileName), maxToKeep(i_maxToKeep), nThreads(i_nThreads)
+{
+    trackers = new SlowReadTracker[nThreads];
+    for (int i = 0; i < nThreads; i++) {
+        trackers[i].init(maxToKeep);
+    }
+}
+
+SlowReadCollector::~SlowReadCollector()
+{
+    delete[] trackers;
+}
+
+    void
+SlowReadCollector::write()
+{
+    vector<SlowRead> all;
+    for (int i = 0; i < nThreads; i++) {
+        all.insert(all.end(), trackers[i].kept.begin(), trackers[i].kept.end());
+        trackers[i].kept.clear();
+    }
+    std::sort(all.begin(), all.end(), SlowerThan);
+    if ((int)all.size() > maxToKeep) {
+        all.resize(maxToKeep);
+    }
+
+    FILE *file = fopen(fileName, "w");
+    if (NULL == file) {
+        WriteErrorMessage("Unable to open slow reads file '%s'\n", fileName);
+        return;
+    }
+
+    for (size_t i = 0; i < all.size(); i++) {
+        const SlowRead &slowRead = all[i];
+        for (int whichRead = 0; whichRead < slowRead.nReads; whichRead++) {
+            fprintf(file, "@%s snap_ns=%lld lookups=%lld scored=%lld lv=%lld popular=%lld\n%s\n+\n%s\n",
+                slowRead.id[whichRead].c_str(), slowRead.nanos, slowRead.work.hashTableLookups, slowRead.work.locationsScored,
+                slowRead.work.lvCalls, slowRead.work.popularSeedsSkipped, slowRead.bases[whichRead].c_str(), slowRead.qualities[whichRead].c_str());
+        }
+    }
+
+    if (0 != fclose(file)) {
+        WriteErrorMessage("Error writing slow reads file '%s'\n", fileName);
+        return;
+    }
+
+    if (all.size() > 0) {
+        WriteStatusMessage("Wrote the %lld slowest %s to %s; the slowest took %.1fms\n", (_int64)all.size(), all[0].nReads == 2 ? "pairs" : "reads",
+            fileName, all[0].nanos / 1e6);
+    }
+}
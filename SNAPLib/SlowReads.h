@@ -0,0 +1,91 @@
+/*++
+
+Module Name:
+
+    SlowReads.h
+
+Abstract:
+
+    Finding the reads that take longest to align (-slowReads), so that they can be profiled on their own.  Each
+    aligner thread times every read (or pair) it aligns, counts the work the aligner did on it, and keeps the slowest
+    few.  When the alignment's done they're merged and written out as FASTQ, slowest first, with the time and the
+    counts in each read's comment:
+
+        @readName snap_ns=1234567 lookups=24 scored=1780 lv=2904 popular=3
+
+    Pairs are written interleaved, both mates with the pair's numbers.  Because it's ordinary FASTQ, replaying them is
+    just aligning the file again with one thread (-t 1, and -pairedInterleavedFastq for pairs), which with the same
+    index and options does the same work in the same order every time, so it can be run under a profiler or debugger.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "AlignmentResult.h"
+#include <vector>
+#include <string>
+
+class Read;
+
+struct SlowRead {
+    _int64              nanos;
+    AlignerWorkCounters work;
+    int                 nReads;         // 1, or 2 for a pair
+    std::string         id[2];
+    std::string         bases[2];
+    std::string         qualities[2];
+};
+
+//
+// The slowest reads one aligner thread has seen.  Only that thread uses it.
+//
+class SlowReadTracker {
+public:
+    SlowReadTracker() : maxToKeep(0) {}
+
+    void init(int i_maxToKeep) {maxToKeep = i_maxToKeep;}
+
+    //
+    // Cheap enough to call for every read; it only copies the ones that make the cut.  read1 is NULL for single-end.
+    //
+    void record(_int64 nanos, const AlignerWorkCounters &work, Read *read0, Read *read1 = NULL) {
+        if ((int)kept.size() < maxToKeep || (maxToKeep > 0 && nanos > kept[0].nanos)) {
+            keep(nanos, work, read0, read1);
+        }
+    }
+
+private:
+    friend class SlowReadCollector;
+
+    void keep(_int64 nanos, const AlignerWorkCounters &work, Read *read0, Read *read1);
+
+    int                     maxToKeep;
+    std::vector<SlowRead>   kept;           // A min-heap on nanos once it's full
+};
+
+class SlowReadCollector {
+public:
+    SlowReadCollector(const char *i_fileName, int i_maxToKeep, int i_nThreads);
+    ~SlowReadCollector();
+
+    SlowReadTracker *getThreadTracker(int threadNum) {
+        _ASSERT(threadNum >= 0 && threadNum < nThreads);
+        return &trackers[threadNum];
+    }
+
+    //
+    // Merge what the threads kept and write the file.  Call it after the aligner threads are done.
+    //
+    void write();
+
+private:
+    const char          *fileName;
+    int                  maxToKeep;
+    int                  nThreads;
+    SlowReadTracker     *trackers;
+};
@@ -8,6 +8,31 @@ Abstract:
 
     File writer that sorts records using a temporary file.
 
+    Each writer's batch is sorted as it's finished, and either kept in memory (up to a limit) or written to a
+    temporary file; when everything's been written the sorted blocks are merged into the final file.  With enough
+    memory for all of them nothing goes to disk but the output.  A batch that's kept in memory is left in the order it
+    was written, and a background thread sorts its entries (offset, length & location of each read), which the merge
+    then follows, so the writer's thread only has to copy it.  The temporary files can be spread over several
+    directories (preferably on different devices), in which case each writer goes to one of them in turn.
+
+    Blocks are kept (in memory or the temporary files) as the records the format wrote, BAM records say, without any
+    of the output's filters, so nothing is compressed until the merge writes the final file, and the merge reads the
+    temporary files straight back with no inflating.  The exception is when the temporary files are compressed with
+    zstd (to save disk space and I/O): then each file's batches are compressed into frames on an encoder pool as they're
+    written, and blocks are found in it by their offsets in the uncompressed data, which the frames map to the file.
+
+    The merge can also be split over several threads, each taking a range of contigs and merging it from every block
+    into a file of its own with its own filters (so compression etc. run in parallel too); those are appended to the
+    first at the end.  To find where each range starts in a block, every so often a sorted batch notes the location
+    and offset of a read.
+
+    The same merge also puts together files that are already sorted (see DataWriterSupplier::mergeSorted), with each
+    file a block read through whatever inflates it.
+
+    To sort by read name rather than location (-son), each read's location is replaced by a hash of its name, so
+    everything above works as it is, and ties are broken by the whole name, both when a batch is sorted and in the
+    merge.  That puts all the records of a read together, in an order that looks random otherwise.
+
 Environment:
 
     User mode service.
@@ -28,11 +53,14 @@ Environment:
 #include "exit.h"
 #include "Bam.h"
 #include "Error.h"
+#include "ZstdDataWriter.h"
+#include "PipelineTrace.h"
 
 #define USE_DEVTEAM_OPTIONS 1
 //#define VALIDATE_SORT 1
 
 using std::max;
+using std::pair;
 
 #pragma pack(push, 4)
 struct SortEntry
@@ -52,18 +80,178 @@ struct SortEntry
 
 typedef VariableSizeVector<SortEntry,150,true> SortVector;
 
+    static void
+RadixSortEntries(
+    SortEntry* entries,
+    size_t count)
+/*++
+
+Routine Description:
+
+    Stable LSD radix sort of entries by location, 11 bits at a time, on the distance from the smallest location so there
+    are only as many passes as the range of locations needs.  Passes where everything has the same digit are skipped.
+
+--*/
+{
+    if (count < 2) {
+        return;
+    }
+    GenomeLocation minLocation = entries[0].location, maxLocation = entries[0].location;
+    for (size_t i = 1; i < count; i++) {
+        minLocation = __min(minLocation, entries[i].location);
+        maxLocation = __max(maxLocation, entries[i].location);
+    }
+    const int DigitBits = 11;
+    const size_t nBuckets = (size_t)1 << DigitBits;
+    const _uint64 range = (_uint64)(maxLocation - minLocation);
+    size_t counts[nBuckets];
+    SortEntry* scratch = (SortEntry*)BigAlloc(count * sizeof(SortEntry));
+    SortEntry* from = entries;
+    SortEntry* to = scratch;
+    for (int shift = 0; shift < 64 && (range >> shift) != 0; shift += DigitBits) {
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < count; i++) {
+            counts[((_uint64)(from[i].location - minLocation) >> shift) & (nBuckets - 1)]++;
+        }
+        if (counts[((_uint64)(from[0].location - minLocation) >> shift) & (nBuckets - 1)] == count) {
+            continue;
+        }
+        size_t next = 0;
+        for (size_t b = 0; b < nBuckets; b++) {
+            size_t n = counts[b];
+            counts[b] = next;
+            next += n;
+        }
+        for (size_t i = 0; i < count; i++) {
+            to[counts[((_uint64)(from[i].location - minLocation) >> shift) & (nBuckets - 1)]++] = from[i];
+        }
+        SortEntry* t = from;
+        from = to;
+        to = t;
+    }
+    if (from != entries) {
+        memcpy(entries, from, count * sizeof(SortEntry));
+    }
+    BigDealloc(scratch);
+}
+
+//
+// The sort key for a sort by name: a hash of the name, kept positive like any other location.
+//
+    static GenomeLocation
+NameSortKey(
+    const char* name,
+    size_t nameLength)
+{
+    return (GenomeLocation)(util::hash64(name, (int)nameLength) >> 1);
+}
+
+    static int
+CompareNames(
+    const char* a,
+    size_t aLength,
+    const char* b,
+    size_t bLength)
+{
+    int c = memcmp(a, b, __min(aLength, bLength));
+    return c != 0 ? c : aLength < bLength ? -1 : aLength > bLength ? 1 : 0;
+}
+
+struct SortEntryNameComparator
+{
+    SortEntryNameComparator(const FileFormat* i_format, char* i_data) : format(i_format), data(i_data) {}
+
+    bool operator()(const SortEntry& a, const SortEntry& b) const
+    {
+        const char *aName, *bName;
+        size_t aLength, bLength;
+        format->getReadName(data + a.offset, a.length, &aName, &aLength);
+        format->getReadName(data + b.offset, b.length, &bName, &bLength);
+        return CompareNames(aName, aLength, bName, bLength) < 0;
+    }
+
+    const FileFormat*   format;
+    char*               data;
+};
+
+    static void
+SortNameTies(
+    const FileFormat* format,
+    char* data,
+    SortEntry* entries,
+    size_t count)
+/*++
+
+Routine Description:
+
+    Put runs of entries with the same name hash (sorted by RadixSortEntries) in order by name.  Nearly all of them are
+    the records of a single read, which are left alone.
+
+--*/
+{
+    for (size_t runStart = 0; runStart < count; ) {
+        size_t runEnd = runStart + 1;
+        while (runEnd < count && entries[runEnd].location == entries[runStart].location) {
+            runEnd++;
+        }
+        if (runEnd - runStart > 1) {
+            const char *name, *other;
+            size_t nameLength, otherLength;
+            format->getReadName(data + entries[runStart].offset, entries[runStart].length, &name, &nameLength);
+            for (size_t i = runStart + 1; i < runEnd; i++) {
+                format->getReadName(data + entries[i].offset, entries[i].length, &other, &otherLength);
+                if (0 != CompareNames(name, nameLength, other, otherLength)) {
+                    std::stable_sort(entries + runStart, entries + runEnd, SortEntryNameComparator(format, data));
+                    break;
+                }
+            }
+        }
+        runStart = runEnd;
+    }
+}
+
+// where a read goes in the merge: its location, then for a sort by name the name
+struct MergeKey
+{
+    GenomeLocation  location;
+    const char*     name; // NULL unless sorting by name
+    size_t          nameLength;
+
+    bool operator<(const MergeKey& other) const
+    {
+        return location < other.location ||
+            (location == other.location && NULL != name && CompareNames(name, nameLength, other.name, other.nameLength) < 0);
+    }
+
+    bool operator==(const MergeKey& other) const
+    {
+        return location == other.location && (NULL == name || 0 == CompareNames(name, nameLength, other.name, other.nameLength));
+    }
+};
+
+// location & offset in the block of every CheckpointInterval'th read, for a parallel merge to find its range
+typedef VariableSizeVector< pair<GenomeLocation,size_t> > SortCheckpointVector;
+static const int CheckpointInterval = 1024;
+
 struct SortBlock
 {
 #ifdef VALIDATE_SORT
-    SortBlock() : start(0), bytes(0), location(0), length(0), reader(NULL), minLocation(0), maxLocation(0) {}
+    SortBlock() : start(0), bytes(0), file(0), memory(NULL), allocation(NULL), entries(NULL), checkpoints(NULL), location(0), length(0),
+        name(NULL), nameLength(0), reader(NULL), consumed(0), minLocation(0), maxLocation(0) {}
 #else
-    SortBlock() : start(0), bytes(0), location(0), length(0), reader(NULL) {}
+    SortBlock() : start(0), bytes(0), file(0), memory(NULL), allocation(NULL), entries(NULL), checkpoints(NULL), location(0), length(0),
+        name(NULL), nameLength(0), reader(NULL), consumed(0) {}
 #endif
 	SortBlock(const SortBlock& other) { *this = other; }
     void operator=(const SortBlock& other);
 
     size_t      start;
-    size_t      bytes;
+    size_t      bytes; // or the number of entries, if there are any
+    int         file; // which temp file it's in
+    char*       memory; // or the data, if it was kept in memory instead
+    char*       allocation; // what to BigDealloc when done with memory (it might start with the header)
+    SortEntry*  entries; // the reads in memory in sorted order, if it was kept unsorted
+    SortCheckpointVector* checkpoints; // NULL unless the merge is parallel
 #ifdef VALIDATE_SORT
 	GenomeLocation	minLocation, maxLocation;
 #endif
@@ -72,6 +260,24 @@ struct SortBlock
     GenomeLocation    location; // genome location of current read
     char*       data; // read data in read buffer
     GenomeDistance    length; // length in bytes
+    const char* name; // of the current read, if sorting by name
+    size_t      nameLength;
+    size_t      consumed; // bytes of memory (or entries) merged so far
+
+    MergeKey key() const
+    {
+        MergeKey result = {location, name, nameLength};
+        return result;
+    }
+
+    // the data for the next read(s), false at the end of the block
+    bool getData(char** o_data, _int64* o_bytes);
+
+    void advance(GenomeDistance bytes);
+
+    // offset in the block to start merging a range beginning at location, and to stop merging one ending there
+    size_t getStartOffset(GenomeLocation location);
+    size_t getEndOffset(GenomeLocation location);
 };
 
     void
@@ -80,8 +286,16 @@ SortBlock::operator=(
 {
     start = other.start;
     bytes = other.bytes;
+    file = other.file;
+    memory = other.memory;
+    allocation = other.allocation;
+    entries = other.entries;
+    checkpoints = other.checkpoints;
+    consumed = other.consumed;
     location = other.location;
     length = other.length;
+    name = other.name;
+    nameLength = other.nameLength;
     reader = other.reader;
 #ifdef VALIDATE_SORT
 	minLocation = other.minLocation;
@@ -89,6 +303,76 @@ SortBlock::operator=(
 #endif
 }
 
+    bool
+SortBlock::getData(
+    char** o_data,
+    _int64* o_bytes)
+{
+    if (NULL != entries) {
+        if (consumed >= bytes) {
+            return false;
+        }
+        *o_data = memory + entries[consumed].offset;
+        *o_bytes = entries[consumed].length;
+        if (consumed + 1 < bytes) {
+            // the reads were sorted in place by their entries, so the next one is somewhere else in memory
+            _mm_prefetch(memory + entries[consumed + 1].offset, _MM_HINT_T0);
+        }
+        return true;
+    }
+    if (NULL != memory) {
+        *o_data = memory + consumed;
+        *o_bytes = bytes - consumed;
+        return consumed < bytes;
+    }
+    if (! reader->getData(o_data, o_bytes)) {
+        reader->nextBatch();
+        if (! reader->getData(o_data, o_bytes)) {
+            _ASSERT(reader->isEOF());
+            return false;
+        }
+    }
+    return true;
+}
+
+    void
+SortBlock::advance(
+    GenomeDistance bytes)
+{
+    if (NULL != entries) {
+        consumed++;
+    } else if (NULL != memory) {
+        consumed += bytes;
+    } else {
+        reader->advance(bytes);
+    }
+}
+
+    size_t
+SortBlock::getStartOffset(
+    GenomeLocation location)
+{
+    // the last checkpoint before location; anything earlier in the range gets skipped
+    size_t result = 0;
+    for (SortCheckpointVector::iterator i = checkpoints->begin(); i != checkpoints->end() && i->first < location; i++) {
+        result = i->second;
+    }
+    return result;
+}
+
+    size_t
+SortBlock::getEndOffset(
+    GenomeLocation location)
+{
+    // the first checkpoint at or after location, everything after it is past the range
+    for (SortCheckpointVector::iterator i = checkpoints->begin(); i != checkpoints->end(); i++) {
+        if (i->first >= location) {
+            return i->second;
+        }
+    }
+    return bytes;
+}
+
 typedef VariableSizeVector<SortBlock> SortBlockVector;
     
 class SortedDataFilterSupplier;
@@ -96,8 +380,8 @@ class SortedDataFilterSupplier;
 class SortedDataFilter : public DataWriter::Filter
 {
 public:
-    SortedDataFilter(SortedDataFilterSupplier* i_parent)
-        : Filter(DataWriter::CopyFilter), parent(i_parent), locations(10000000)
+    SortedDataFilter(SortedDataFilterSupplier* i_parent, int i_file)
+        : Filter(DataWriter::CopyFilter), parent(i_parent), file(i_file), locations(10000000), header(false)
     {}
 
     virtual ~SortedDataFilter() {}
@@ -106,8 +390,13 @@ public:
 
     virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes);
 
+    virtual void inHeader(bool flag)
+    { header = flag; }
+
 private:
     SortedDataFilterSupplier*   parent;
+    int                         file; // which temp file our writer writes to
+    bool                        header; // writing the header, which keeps its location whatever the sort
     SortVector                  locations;
 };
 
@@ -118,52 +407,149 @@ public:
     SortedDataFilterSupplier(
         const FileFormat* i_fileFormat,
         const Genome* i_genome,
-        const char* i_tempFileName,
+        int i_nTempFiles,
+        const char** i_tempFileNames,
         const char* i_sortedFileName,
         DataWriter::FilterSupplier* i_sortedFilterSupplier,
         size_t i_bufferSize,
         size_t i_bufferSpace,
-        FileEncoder* i_encoder = NULL)
+        size_t i_memoryLimit,
+        FileEncoder* i_encoder,
+        int i_mergeThreads,
+        SortedPartSupplier* i_parts,
+        int i_shards,
+        bool i_evenShards,
+        ZstdWriterFilterSupplier** i_tempCompressors,
+        bool i_byName)
         :
         format(i_fileFormat),
         genome(i_genome),
         FilterSupplier(DataWriter::CopyFilter),
         encoder(i_encoder),
-        tempFileName(i_tempFileName),
+        nTempFiles(i_nTempFiles),
+        tempFileNames(i_tempFileNames),
+        nTempFilesClosed(0),
         sortedFileName(i_sortedFileName),
         sortedFilterSupplier(i_sortedFilterSupplier),
         bufferSize(i_bufferSize),
         bufferSpace(i_bufferSpace),
+        memoryLimit(i_memoryLimit),
+        memoryUsed(0),
+        headerMemory(NULL),
+        mergeThreads(i_mergeThreads),
+        parts(i_parts),
+        shards(i_shards),
+        evenShards(i_evenShards),
+        inputSupplier(DataSupplier::Default),
+        tempCompressors(i_tempCompressors),
+        byName(i_byName),
+        nextSort(0),
+        sortWorkerStarted(false),
+        sortWorkerStopping(false),
         blocks()
     {
         InitializeExclusiveLock(&lock);
+        CreateEventObject(&sortsPending);
+        CreateSingleWaiterObject(&sortWorkerDone);
     }
 
     virtual ~SortedDataFilterSupplier()
     {
         DestroyExclusiveLock(&lock);
+        DestroyEventObject(&sortsPending);
+        DestroySingleWaiterObject(&sortWorkerDone);
     }
 
+    // for the writer to the first temp file; SortedDataFileFilterSupplier does the rest
     virtual DataWriter::Filter* getFilter();
 
+    DataWriter::Filter* getFilter(int file);
+
+    // room for the temp files' compression
+    virtual size_t getBufferReserve(size_t bufferSize)
+    { return NULL == tempCompressors ? 0 : tempCompressors[0]->getBufferReserve(bufferSize); }
+
     virtual void onClosing(DataWriterSupplier* supplier) {}
+
+    // when the writer supplier for each temp file has closed; merges once they all have
     virtual void onClosed(DataWriterSupplier* supplier);
 
     void setHeaderSize(size_t bytes)
     { headerSize = bytes; }
 
+    // take memory to keep a sorted batch in rather than writing it out, or NULL if that's over the limit
+    char* allocBlockMemory(size_t bytes);
+
+    // whether batches need to note checkpoints for a parallel merge (which is how shards get written, too)
+    bool useCheckpoints()
+    { return (mergeThreads > 1 || shards > 1) && (parts != NULL || (sortedFilterSupplier == NULL && encoder == NULL)); }
+
+    // merge whole files that are each sorted already (tempFileNames, read through i_inputSupplier) rather than the
+    // blocks of a sort, skipping the headerSizes bytes each starts with and writing the first one's header instead
+    bool mergeFiles(DataSupplier* i_inputSupplier, const size_t* headerSizes, _int64* o_total);
+
+    // entries (with bytes the number of them) are for a block kept in memory unsorted, and get sorted in the background
 #ifndef VALIDATE_SORT
-	void addBlock(size_t start, size_t bytes);
+	void addBlock(int file, size_t start, size_t bytes, char* memory, char* allocation, SortCheckpointVector* checkpoints,
+        SortEntry* entries);
 #else
-    void addBlock(size_t start, size_t bytes, GenomeLocation minLocation, GenomeLocation maxLocation);
+    void addBlock(int file, size_t start, size_t bytes, char* memory, char* allocation, SortCheckpointVector* checkpoints,
+        SortEntry* entries, GenomeLocation minLocation, GenomeLocation maxLocation);
 #endif
 
 private:
     bool mergeSort();
 
+    static void SortWorkerThreadMain(void* param);
+
+    void sortWorker();
+
+    // wait for the background worker to sort everything it's been given
+    void finishSorting();
+
+    // split the merge by contig ranges over threads, false if there's only one range worth doing
+    bool mergeParallel(_int64* o_total);
+
+    static void MergePartThreadMain(void* param);
+
+    struct MergePartContext
+    {
+        SortedDataFilterSupplier*   supplier;
+        int                         part;
+        const char*                 fileName;
+        DataWriterSupplier*         writerSupplier;
+        SortBlock*                  blocks; // its own copy of each block, cut down to its range
+        GenomeLocation              begin, end; // end is ignored for the last part, which takes everything after begin
+        bool                        last;
+        _int64                      total;
+        bool                        ok;
+        volatile int*               nRunning;
+        SingleWaiterObject*         doneObject;
+    };
+
+    void mergePart(MergePartContext* context);
+
+    // copy the header into the start of the output
+    void writeHeader(DataWriter* writer);
+
+    // get a reader on each block's file data, sharing bufferSpace between nReaders of them
+    void openBlocks(SortBlock* mergeBlocks, int nMergeBlocks, int nReaders);
+
+    // a reader on bytes of a temp file's data from start, decompressing it if the temp files are compressed
+    DataReader* openTempData(int file, size_t start, size_t bytes, size_t readerBufferSpace);
+
+    // the location (or name key) and length of the read at b->data, and its name if sorting by name
+    void getSortKey(SortBlock* b, _int64 bytes);
+
+    // merge blocks from their current positions into writer, up to end unless toEnd
+    bool mergeRange(DataWriter* writer, SortBlock* mergeBlocks, int nMergeBlocks, GenomeLocation begin, GenomeLocation end, bool toEnd,
+        _int64* o_total);
+
     const Genome*                   genome;
     const FileFormat*               format;
-    const char*                     tempFileName;
+    int                             nTempFiles;
+    const char**                    tempFileNames;
+    int                             nTempFilesClosed;
     const char*                     sortedFileName;
     DataWriter::FilterSupplier*     sortedFilterSupplier;
     FileEncoder*                    encoder;
@@ -172,10 +558,83 @@ private:
     SortBlockVector                 blocks;
     size_t                          bufferSize;
     size_t                          bufferSpace;
+    size_t                          memoryLimit; // for sorted batches kept in memory
+    size_t                          memoryUsed;
+    char*                           headerMemory; // the header, if it was kept in memory
+    int                             mergeThreads;
+    SortedPartSupplier*             parts;
+    int                             shards; // > 1 to leave each part of the merge in a file of its own
+    bool                            evenShards; // split the genome into equal ranges for them, rather than by the reads
+    DataSupplier*                   inputSupplier; // to read the temp files (or the files mergeFiles merges)
+    ZstdWriterFilterSupplier**      tempCompressors; // for each temp file, if they're compressed, with where the frames are
+    int                             nParts; // that the merge actually used
+    bool                            byName; // sort by a hash of the read name, then the name, rather than location
+    VariableSizeVector<int>         pendingSorts; // blocks for the background worker to sort, under lock
+    int                             nextSort;
+    bool                            sortWorkerStarted;
+    bool                            sortWorkerStopping;
+    EventObject                     sortsPending;
+    SingleWaiterObject              sortWorkerDone;
 
 	friend class SortedDataFilter;
 };
 
+//
+// Filters for the writers to the other temp files, which just need to know which one they are.
+//
+class SortedDataFileFilterSupplier : public DataWriter::FilterSupplier
+{
+public:
+    SortedDataFileFilterSupplier(SortedDataFilterSupplier* i_parent, int i_file)
+        : FilterSupplier(DataWriter::CopyFilter), parent(i_parent), file(i_file)
+    {}
+
+    virtual DataWriter::Filter* getFilter()
+    { return parent->getFilter(file); }
+
+    virtual size_t getBufferReserve(size_t bufferSize)
+    { return parent->getBufferReserve(bufferSize); }
+
+    virtual void onClosing(DataWriterSupplier* supplier) {}
+
+    virtual void onClosed(DataWriterSupplier* supplier)
+    { parent->onClosed(supplier); }
+
+private:
+    SortedDataFilterSupplier*   parent;
+    int                         file;
+};
+
+//
+// Hands out writers to each of the temp files in turn.  The first writer, which gets the header, goes to the first file.
+//
+class MultiFileDataWriterSupplier : public DataWriterSupplier
+{
+public:
+    MultiFileDataWriterSupplier(int i_nSuppliers, DataWriterSupplier** i_suppliers)
+        : nSuppliers(i_nSuppliers), suppliers(i_suppliers), nWriters(0)
+    {}
+
+    virtual ~MultiFileDataWriterSupplier()
+    { delete [] suppliers; }
+
+    virtual DataWriter* getWriter()
+    { return suppliers[(InterlockedIncrementAndReturnNewValue(&nWriters) - 1) % nSuppliers]->getWriter(); }
+
+    virtual void close()
+    {
+        for (int i = 0; i < nSuppliers; i++) {
+            suppliers[i]->close();
+            delete suppliers[i];
+        }
+    }
+
+private:
+    int                     nSuppliers;
+    DataWriterSupplier**    suppliers;
+    volatile int            nWriters;
+};
+
     void
 SortedDataFilter::onAdvance(
     DataWriter* writer,
@@ -184,6 +643,12 @@ SortedDataFilter::onAdvance(
     GenomeDistance bytes,
     GenomeLocation location)
 {
+    if (parent->byName && ! header) {
+        const char* name;
+        size_t nameLength;
+        parent->format->getReadName(data, bytes, &name, &nameLength);
+        location = NameSortKey(name, nameLength);
+    }
     SortEntry entry(batchOffset, bytes, location);
 #ifdef VALIDATE_SORT
 		if (memcmp(data, "BAM", 3) != 0 && memcmp(data, "@HD", 3) != 0) { // skip header block
@@ -202,23 +667,65 @@ SortedDataFilter::onNextBatch(
     size_t offset,
     size_t bytes)
 {
-    // sort buffered reads by location for later merge sort
-    std::stable_sort(locations.begin(), locations.end(), SortEntry::comparator);
-    
-    // copy from previous buffer into current in sorted order
     char* fromBuffer;
     size_t fromSize, fromUsed;
     char* toBuffer;
     size_t toSize, toUsed;
-    if (! (writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed) &&
-        writer->getBatch(0, &toBuffer, &toSize, &toUsed)))
-    {
+    if (! writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, NULL, NULL, &offset)) {
         WriteErrorMessage( "SortedDataFilter::onNextBatch getBatch failed\n");
         soft_exit(1);
     }
+    // (offset is in the uncompressed data, which is the same as the file's unless the temp files are compressed)
+
+    //
+    // If we can keep the batch in memory, just copy it as it is with its entries after it, and let the
+    // background worker sort the entries; the merge reads the batch through them.
+    //
+    size_t header = offset > 0 || file > 0 ? 0 : locations[0].length;
+	int first = header > 0;
+    size_t entriesOffset = (bytes + 7) & ~(size_t)7;
+    size_t nEntries = locations.size() - first;
+    char* memory = bytes > 0 ? parent->allocBlockMemory(entriesOffset + nEntries * sizeof(SortEntry)) : NULL;
+    if (NULL != memory) {
+        memcpy(memory, fromBuffer, bytes);
+        SortEntry* entries = (SortEntry*)(memory + entriesOffset);
+        memcpy(entries, locations.begin() + first, nEntries * sizeof(SortEntry));
+        if (header > 0) {
+            parent->setHeaderSize(header);
+            parent->headerMemory = memory;
+        }
+#ifdef VALIDATE_SORT
+        GenomeLocation minLocation = nEntries > 0 ? entries[0].location : 0, maxLocation = minLocation;
+        for (size_t i = 0; i < nEntries; i++) {
+            minLocation = __min(minLocation, entries[i].location);
+            maxLocation = __max(maxLocation, entries[i].location);
+        }
+        parent->addBlock(file, offset + header, nEntries, memory, memory, NULL, entries, minLocation, maxLocation);
+#else
+        parent->addBlock(file, offset + header, nEntries, memory, memory, NULL, entries);
+#endif
+        locations.clear();
+        return 0;
+    }
+
+    // sort buffered reads by location for later merge sort, and copy from previous buffer into current in sorted order
+    PipelineTraceSpan sortSpan(SortTraceEvent, true);
+    RadixSortEntries(locations.begin(), locations.size());
+    if (parent->byName) {
+        SortNameTies(parent->format, fromBuffer, locations.begin() + first, locations.size() - first);
+    }
+    sortSpan.end();
+    if (! writer->getBatch(0, &toBuffer, &toSize, &toUsed)) {
+        WriteErrorMessage( "SortedDataFilter::onNextBatch getBatch failed\n");
+        soft_exit(1);
+    }
+    SortCheckpointVector* checkpoints = parent->useCheckpoints() ? new SortCheckpointVector() : NULL;
     size_t target = 0;
 	GenomeLocation previous = 0;
     for (VariableSizeVector<SortEntry>::iterator i = locations.begin(); i != locations.end(); i++) {
+        if (NULL != checkpoints && (i - locations.begin() - first) % CheckpointInterval == 0 && i - locations.begin() >= first) {
+            checkpoints->push_back(pair<GenomeLocation,size_t>(i->location, target - header));
+        }
 #ifdef VALIDATE_SORT
 		if (locations.size() > 1) { // skip header block
             GenomeLocation loc;
@@ -233,19 +740,15 @@ SortedDataFilter::onNextBatch(
     }
     
     // remember block extent for later merge sort
-    SortBlock block;
-    // handle header specially
-    size_t header = offset > 0 ? 0 : locations[0].length;
     if (header > 0) {
         parent->setHeaderSize(header);
     }
-	int first = offset == 0;
 #ifdef VALIDATE_SORT
 	GenomeLocation minLocation = locations.size() > first ? locations[first].location : 0;
     GenomeLocation maxLocation = locations.size() > first ? locations[locations.size() - 1].location : UINT32_MAX;
-    parent->addBlock(offset + header, bytes - header, minLocation, maxLocation);
+    parent->addBlock(file, offset + header, bytes - header, NULL, NULL, checkpoints, NULL, minLocation, maxLocation);
 #else
-    parent->addBlock(offset + header, bytes - header);
+    parent->addBlock(file, offset + header, bytes - header, NULL, NULL, checkpoints, NULL);
 #endif
     locations.clear();
 
@@ -255,22 +758,50 @@ SortedDataFilter::onNextBatch(
     DataWriter::Filter*
 SortedDataFilterSupplier::getFilter()
 {
-    return new SortedDataFilter(this);
+    return new SortedDataFilter(this, 0);
+}
+
+    DataWriter::Filter*
+SortedDataFilterSupplier::getFilter(
+    int file)
+{
+    return new SortedDataFilter(this, file);
+}
+
+    char*
+SortedDataFilterSupplier::allocBlockMemory(
+    size_t bytes)
+{
+    AcquireExclusiveLock(&lock);
+    bool fits = memoryUsed + bytes <= memoryLimit;
+    if (fits) {
+        memoryUsed += bytes;
+    }
+    ReleaseExclusiveLock(&lock);
+
+    return fits ? (char*)BigAlloc(bytes) : NULL;
 }
 
     void
 SortedDataFilterSupplier::onClosed(
     DataWriterSupplier* supplier)
 {
-    if (blocks.size() == 1 && sortedFilterSupplier == NULL) {
+    if (++nTempFilesClosed < nTempFiles) {
+        return;
+    }
+    if (blocks.size() == 1 && sortedFilterSupplier == NULL && nTempFiles == 1 && NULL == blocks[0].memory && NULL == headerMemory &&
+            shards <= 1 && NULL == tempCompressors) {
         // just rename/move temp file to real file, we're done
         DeleteSingleFile(sortedFileName); // if it exists
-        if (! MoveSingleFile(tempFileName, sortedFileName)) {
-            WriteErrorMessage( "unable to move temp file %s to final sorted file %s\n", tempFileName, sortedFileName);
+        if (! MoveSingleFile(tempFileNames[0], sortedFileName)) {
+            WriteErrorMessage( "unable to move temp file %s to final sorted file %s\n", tempFileNames[0], sortedFileName);
             soft_exit(1);
         }
         return;
     }
+    for (int i = 0; NULL != tempCompressors && i < nTempFiles; i++) {
+        tempCompressors[i]->sortTranslations();
+    }
     // merge sort into final file
     if (! mergeSort()) {
         WriteErrorMessage( "merge sort failed\n");
@@ -280,14 +811,25 @@ SortedDataFilterSupplier::onClosed(
 
     void
 SortedDataFilterSupplier::addBlock(
+    int file,
     size_t start,
-    size_t bytes
+    size_t bytes,
+    char* memory,
+    char* allocation,
+    SortCheckpointVector* checkpoints,
+    SortEntry* entries
 #ifdef VALIDATE_SORT
 	, GenomeLocation minLocation
 	, GenomeLocation maxLocation
 #endif
 	)
 {
+    if (bytes == 0 && NULL != allocation && allocation != headerMemory) {
+        BigDealloc(allocation);
+    }
+    if (bytes == 0) {
+        delete checkpoints;
+    }
     if (bytes > 0) {
         AcquireExclusiveLock(&lock);
 #if VALIDATE_SORT
@@ -298,15 +840,101 @@ SortedDataFilterSupplier::addBlock(
         SortBlock block;
         block.start = start;
         block.bytes = bytes;
+        block.file = file;
+        block.memory = memory;
+        block.allocation = allocation;
+        block.checkpoints = checkpoints;
+        block.entries = entries;
 #if VALIDATE_SORT
 		block.minLocation = minLocation;
 		block.maxLocation = maxLocation;
 #endif
         blocks.push_back(block);
+        if (NULL != entries) {
+            pendingSorts.push_back((int)blocks.size() - 1);
+            AllowEventWaitersToProceed(&sortsPending);
+            if (! sortWorkerStarted) {
+                sortWorkerStarted = true;
+                if (! StartNewThread(SortWorkerThreadMain, this)) {
+                    WriteErrorMessage("SortedDataFilterSupplier: unable to start sort thread\n");
+                    soft_exit(1);
+                }
+            }
+        }
         ReleaseExclusiveLock(&lock);
     }
 }
 
+    void
+SortedDataFilterSupplier::SortWorkerThreadMain(
+    void* param)
+{
+    ((SortedDataFilterSupplier*)param)->sortWorker();
+}
+
+    void
+SortedDataFilterSupplier::sortWorker()
+/*++
+
+Routine Description:
+
+    Sort the entries of blocks kept in memory as they come in, until finishSorting says there won't be any more.
+    The blocks vector can grow (and move) while we're sorting, so only look at it under the lock.
+
+--*/
+{
+    for (;;) {
+        WaitForEvent(&sortsPending);
+        AcquireExclusiveLock(&lock);
+        if (nextSort == pendingSorts.size()) {
+            bool done = sortWorkerStopping;
+            PreventEventWaitersFromProceeding(&sortsPending);
+            ReleaseExclusiveLock(&lock);
+            if (done) {
+                break;
+            }
+            continue;
+        }
+        int index = pendingSorts[nextSort++];
+        SortEntry* entries = blocks[index].entries;
+        size_t nEntries = blocks[index].bytes;
+        char* memory = blocks[index].memory;
+        ReleaseExclusiveLock(&lock);
+
+        PipelineTraceSpan sortSpan(SortTraceEvent, true);
+        RadixSortEntries(entries, nEntries);
+        if (byName) {
+            SortNameTies(format, memory, entries, nEntries);
+        }
+        sortSpan.end();
+        SortCheckpointVector* checkpoints = NULL;
+        if (useCheckpoints()) {
+            checkpoints = new SortCheckpointVector();
+            for (size_t i = 0; i < nEntries; i += CheckpointInterval) {
+                checkpoints->push_back(pair<GenomeLocation,size_t>(entries[i].location, i));
+            }
+        }
+
+        AcquireExclusiveLock(&lock);
+        blocks[index].checkpoints = checkpoints;
+        ReleaseExclusiveLock(&lock);
+    }
+    SignalSingleWaiterObject(&sortWorkerDone);
+}
+
+    void
+SortedDataFilterSupplier::finishSorting()
+{
+    AcquireExclusiveLock(&lock);
+    bool started = sortWorkerStarted;
+    sortWorkerStopping = true;
+    AllowEventWaitersToProceed(&sortsPending);
+    ReleaseExclusiveLock(&lock);
+    if (started) {
+        WaitForSingleWaiterObject(&sortWorkerDone);
+    }
+}
+
     bool
 SortedDataFilterSupplier::mergeSort()
 {
@@ -320,96 +948,550 @@ SortedDataFilterSupplier::mergeSort()
     _int64 startWriteFilterTime = DataWriter::FilterTime;
 #endif
 
-    // set up buffered output
+    finishSorting();
+    if (blocks.size() > 5000) {
+        WriteErrorMessage("warning: merging %d blocks could be slow, try increasing sort memory with -sm option\n", blocks.size());
+    }
+    int nFileBlocks = 0;
+    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+        nFileBlocks += NULL == i->memory;
+    }
+    if (headerSize > 0xffffffff) {
+        WriteErrorMessage("SortedDataFilterSupplier: headerSize too big\n");
+        soft_exit(1);
+    }
+
+    _int64 total = 0;
+    nParts = 1;
+    if (! (useCheckpoints() && mergeParallel(&total))) {
+        // set up buffered output
+        DataWriterSupplier* writerSupplier = DataWriterSupplier::create(sortedFileName, bufferSize, sortedFilterSupplier,
+            encoder, encoder != NULL ? 6 : 4); // use more buffers to let encoder run async
+        DataWriter* writer = writerSupplier->getWriter();
+        if (writer == NULL) {
+            WriteErrorMessage( "open sorted file for write failed\n");
+            return false;
+        }
+        // setup - open all files, read first block, begin read for second
+        openBlocks(blocks.begin(), (int)blocks.size(), nFileBlocks);
+        writeHeader(writer);
+        if (! mergeRange(writer, blocks.begin(), (int)blocks.size(), 0, 0, true, &total)) {
+            return false;
+        }
+
+        // close everything
+        writer->close();
+        delete writer;
+        writerSupplier->close();
+        delete writerSupplier;
+    }
+
+    // a parallel merge leaves the memory blocks for us to free, since they were shared between the parts
+    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+        if (NULL != i->allocation && i->allocation != headerMemory) {
+            BigDealloc(i->allocation);
+        }
+        i->allocation = NULL;
+        i->memory = NULL;
+        delete i->checkpoints;
+        i->checkpoints = NULL;
+    }
+    if (NULL != headerMemory) {
+        BigDealloc(headerMemory);
+        headerMemory = NULL;
+    }
+    for (int i = 0; i < nTempFiles; i++) {
+        if (! DeleteSingleFile(tempFileNames[i])) {
+            WriteErrorMessage( "warning: failure deleting temp file %s\n", tempFileNames[i]);
+        }
+    }
+
+#if USE_DEVTEAM_OPTIONS
+    WriteStatusMessage("sorted %lld reads in %u blocks (%d in memory) and %d parts, %lld s\n"
+        "read wait align %.3f s + merge %.3f s, read release align %.3f s + merge %.3f s\n"
+        "write wait %.3f s align + %.3f s merge, write filter %.3f s align + %.3f s merge\n",
+        total, blocks.size(), (int)blocks.size() - nFileBlocks, nParts, (timeInMillis() - start)/1000,
+        startReadWaitTime * 1e-9, (DataReader::ReadWaitTime - startReadWaitTime) * 1e-9,
+        startReleaseWaitTime * 1e-9, (DataReader::ReleaseWaitTime - startReleaseWaitTime) * 1e-9,
+        startWriteWaitTime * 1e-9, (DataWriter::WaitTime - startWriteWaitTime) * 1e-9,
+        startWriteFilterTime * 1e-9, (DataWriter::FilterTime - startWriteFilterTime) * 1e-9);
+#endif
+    return true;
+}
+
+    bool
+SortedDataFilterSupplier::mergeParallel(
+    _int64* o_total)
+/*++
+
+Routine Description:
+
+    Merge ranges of contigs on their own threads, each into a file of its own (the first into the real output, after
+    the header), and append the rest to the first.  The ranges are chosen from the checkpoints to get about the same
+    number of reads in each, but start at contig boundaries so anything that works a contig at a time (like the BAM
+    index) only sees each contig in one part.  Unmapped reads sort last and go in the last part.
+
+    Shards are merged the same way, one part per shard, except that each part is a whole file (with the header, and
+    its own index) that's left where it is.  Since nothing has to see a whole contig, they start wherever the
+    checkpoints put them (or at equal divisions of the genome, with evenShards) rather than at contig boundaries,
+    and there are always as many as were asked for, even if some of them are empty.
+
+    A sort by name has no contigs to go by, so it's split wherever the checkpoints say, like shards (with evenShards,
+    into equal ranges of the name hash).
+
+Arguments:
+
+    o_total     - gets the number of reads merged
+
+Return Value:
+
+    true if it merged, false if there was only one range worth doing, in which case nothing's been touched
+
+--*/
+{
+    // pick where the parts begin, from a sample of the read locations
+    VariableSizeVector<GenomeLocation> sample;
+    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+        for (SortCheckpointVector::iterator j = i->checkpoints->begin(); j != i->checkpoints->end(); j++) {
+            if (byName || j->first < genome->getCountOfBases()) {
+                sample.push_back(j->first);
+            }
+        }
+    }
+    if ((sample.size() == 0 && shards <= 1) || 0 == strcmp(sortedFileName, "-")) {
+        return false;
+    }
+    std::sort(sample.begin(), sample.end());
+    int nWanted = shards > 1 ? shards : mergeThreads;
+    GenomeLocation* begins = new GenomeLocation[nWanted];
+    begins[0] = 0;
+    nParts = 1;
+    for (int i = 1; i < nWanted; i++) {
+        if (shards > 1 || byName) {
+            GenomeLocation evenLocation = byName ? GenomeLocation((((_uint64)1 << 63) / nWanted) * i) :
+                GenomeLocation(genome->getCountOfBases() * i / nWanted);
+            GenomeLocation location = evenShards ? evenLocation : sample.size() > 0 ? sample[sample.size() * i / nWanted] : 0;
+            begins[nParts] = max(location, begins[nParts - 1] + 1);
+            nParts++;
+            continue;
+        }
+        GenomeLocation location = sample[sample.size() * i / mergeThreads];
+        const Genome::Contig* contig = genome->getContigAtLocation(location);
+        if (NULL == contig) {
+            continue;
+        }
+        // whichever end of the contig is nearer
+        GenomeLocation boundary = contig->beginningLocation;
+        if (location - contig->beginningLocation > contig->length / 2) {
+            const Genome::Contig* next = genome->getNextContigAfterLocation(location);
+            if (NULL == next) {
+                continue;
+            }
+            boundary = next->beginningLocation;
+        }
+        if (boundary > begins[nParts - 1] && boundary > genome->getContigs()[0].beginningLocation) {
+            begins[nParts++] = boundary;
+        }
+    }
+    if (nParts == 1) {
+        delete [] begins;
+        return false;
+    }
+
+    // each part gets its own view of the blocks, cut down to its range, and its own output
+    int nBlocks = (int)blocks.size();
+    int nFileBlocks = 0;
+    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+        nFileBlocks += NULL == i->memory;
+    }
+    SortBlock* partBlocks = new SortBlock[nParts * nBlocks];
+    MergePartContext* contexts = new MergePartContext[nParts];
+    volatile int nRunning = nParts;
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    size_t nameSize = strlen(sortedFileName) + 20;
+    for (int p = 0; p < nParts; p++) {
+        MergePartContext* context = &contexts[p];
+        context->supplier = this;
+        context->part = p;
+        context->begin = begins[p];
+        context->last = p == nParts - 1;
+        context->end = context->last ? 0 : begins[p + 1];
+        context->blocks = &partBlocks[p * nBlocks];
+        context->total = 0;
+        context->ok = false;
+        context->nRunning = &nRunning;
+        context->doneObject = &doneObject;
+        if (shards > 1) {
+            context->fileName = DataWriterSupplier::shardFileName(sortedFileName, p, nParts);
+        } else if (p == 0) {
+            context->fileName = sortedFileName;
+        } else {
+            char* name = new char[nameSize];
+            snprintf(name, nameSize, "%s.part%d.tmp", sortedFileName, p);
+            context->fileName = name;
+        }
+        for (int b = 0; b < nBlocks; b++) {
+            SortBlock* block = &context->blocks[b];
+            *block = blocks[b];
+            block->allocation = NULL; // freed at the end, after all the parts are done with it
+            size_t startOffset = p == 0 ? 0 : block->getStartOffset(context->begin);
+            size_t endOffset = context->last ? block->bytes : block->getEndOffset(context->end);
+            if (NULL != block->memory) {
+                block->consumed = startOffset;
+                block->bytes = endOffset;
+            } else {
+                block->start += startOffset;
+                block->bytes = endOffset - startOffset;
+            }
+        }
+        openBlocks(context->blocks, nBlocks, nFileBlocks * nParts);
+        DataWriter::FilterSupplier* filters = NULL;
+        FileEncoder* partEncoder = NULL;
+        if (NULL != parts) {
+            parts->getPart(p, nParts, shards > 1 ? context->fileName : NULL, &filters, &partEncoder);
+        }
+        context->writerSupplier = DataWriterSupplier::create(context->fileName, bufferSize, filters, partEncoder,
+            partEncoder != NULL ? 6 : 4);
+    }
+    delete [] begins;
+
+    for (int p = 0; p < nParts; p++) {
+        if (! StartNewThread(MergePartThreadMain, &contexts[p])) {
+            WriteErrorMessage("SortedDataFilterSupplier: unable to start merge thread\n");
+            soft_exit(1);
+        }
+    }
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+
+    bool ok = true;
+    *o_total = 0;
+    for (int p = 0; p < nParts; p++) {
+        ok &= contexts[p].ok;
+        *o_total += contexts[p].total;
+    }
+
+    if (shards > 1) {
+        for (int p = 0; p < nParts; p++) {
+            delete [] contexts[p].fileName;
+        }
+        if (ok && NULL != parts) {
+            parts->onAppended(nParts, NULL);
+        }
+        delete parts;   // and with it each part's filters, now that the indices and metrics they collected are written
+        parts = NULL;
+        delete [] contexts;
+        delete [] partBlocks;
+        if (! ok) {
+            WriteErrorMessage("sharded merge failed\n");
+            soft_exit(1);
+        }
+        WriteStatusMessage("Wrote %d shards of %s\n", nParts, sortedFileName);
+        return true;
+    }
+
+    // append the other parts to the first, each over the trailer of the one before (in the kernel, see CopyFileRange)
+    size_t* partOffsets = new size_t[nParts];
+    size_t trailer = NULL != parts ? parts->getTrailerSize() : 0;
+    _int64 end = QueryFileSize(sortedFileName) - trailer;
+    partOffsets[0] = 0;
+    for (int p = 1; p < nParts; p++) {
+        MergePartContext* context = &contexts[p];
+        if (ok) {
+            partOffsets[p] = end;
+            _int64 bytes = QueryFileSize(context->fileName) - (context->last ? 0 : trailer);
+            if (! CopyFileRange(context->fileName, sortedFileName, end, bytes)) {
+                WriteErrorMessage("error appending %s to sorted file %s\n", context->fileName, sortedFileName);
+                ok = false;
+            }
+            end += bytes;
+        }
+        if (! DeleteSingleFile(context->fileName)) {
+            WriteErrorMessage("warning: failure deleting temp file %s\n", context->fileName);
+        }
+        delete [] context->fileName;
+    }
+    if (ok && NULL != parts) {
+        parts->onAppended(nParts, partOffsets);
+    }
+    delete parts;   // and with it each part's filters, now that the indices and metrics they collected are written
+    parts = NULL;
+
+    delete [] partOffsets;
+    delete [] contexts;
+    delete [] partBlocks;
+
+    if (! ok) {
+        WriteErrorMessage("parallel merge failed\n");
+        soft_exit(1);
+    }
+    return true;
+}
+
+    bool
+SortedDataFilterSupplier::mergeFiles(
+    DataSupplier* i_inputSupplier,
+    const size_t* headerSizes,
+    _int64* o_total)
+{
+    inputSupplier = i_inputSupplier;
+    headerSize = headerSizes[0];
+    for (int i = 0; i < nTempFiles; i++) {
+        SortBlock block;
+        block.file = i;
+        block.start = 0;
+        block.bytes = QueryFileSize(tempFileNames[i]);
+        if (0 == block.bytes) {
+            WriteErrorMessage("%s is empty\n", tempFileNames[i]);
+            return false;
+        }
+        blocks.push_back(block);
+    }
+
     DataWriterSupplier* writerSupplier = DataWriterSupplier::create(sortedFileName, bufferSize, sortedFilterSupplier,
-        encoder, encoder != NULL ? 6 : 4); // use more buffers to let encoder run async
+        encoder, encoder != NULL ? 6 : 4);
     DataWriter* writer = writerSupplier->getWriter();
     if (writer == NULL) {
         WriteErrorMessage( "open sorted file for write failed\n");
         return false;
     }
-    DataSupplier* readerSupplier = DataSupplier::Default; // autorelease
-    // setup - open all files, read first block, begin read for second
-    if (blocks.size() > 5000) {
-        WriteErrorMessage("warning: merging %d blocks could be slow, try increasing sort memory with -sm option\n", blocks.size());
+    openBlocks(blocks.begin(), nTempFiles, nTempFiles);
+    headerMemory = (char*)BigAlloc(headerSize);
+    for (int i = 0; i < nTempFiles; i++) {
+        // past the header, which may span batches, keeping the first file's to write
+        for (size_t done = 0; done < headerSizes[i]; ) {
+            char* data;
+            _int64 bytes;
+            if (! blocks[i].getData(&data, &bytes)) {
+                WriteErrorMessage("unable to read the header of %s\n", tempFileNames[i]);
+                return false;
+            }
+            size_t skip = min(headerSizes[i] - done, (size_t)bytes);
+            if (0 == i) {
+                memcpy(headerMemory + done, data, skip);
+            }
+            blocks[i].advance(skip);
+            done += skip;
+        }
     }
-    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
-        i->reader = readerSupplier->getDataReader(1, MAX_READ_LENGTH * 8, 0.0,
-            min(1UL << 23, max(1UL << 17, bufferSpace / blocks.size()))); // 128kB to 8MB buffer space per block
-        i->reader->init(tempFileName);
-        i->reader->reinit(i->start, i->bytes);
+    writeHeader(writer);
+    bool ok = mergeRange(writer, blocks.begin(), nTempFiles, 0, 0, true, o_total);
+
+    writer->close();
+    delete writer;
+    writerSupplier->close();
+    delete writerSupplier;
+    BigDealloc(headerMemory);
+    headerMemory = NULL;
+    return ok;
+}
+
+    void
+SortedDataFilterSupplier::MergePartThreadMain(
+    void* param)
+{
+    MergePartContext* context = (MergePartContext*)param;
+    context->supplier->mergePart(context);
+    if (0 == InterlockedDecrementAndReturnNewValue(context->nRunning)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
+
+    void
+SortedDataFilterSupplier::mergePart(
+    MergePartContext* context)
+{
+    DataWriter* writer = context->writerSupplier->getWriter();
+    if (writer == NULL) {
+        WriteErrorMessage( "open sorted file %s for write failed\n", context->fileName);
+        context->ok = false;
+        return;
+    }
+    if (context->part == 0 || shards > 1) {
+        writeHeader(writer);
     }
+    context->ok = mergeRange(writer, context->blocks, (int)blocks.size(), context->begin, context->end, context->last, &context->total);
+    writer->close();
+    delete writer;
+    context->writerSupplier->close();
+    delete context->writerSupplier;
+}
 
-    // write out header
-    if (headerSize > 0xffffffff) {
-        WriteErrorMessage("SortedDataFilterSupplier: headerSize too big\n");
+    void
+SortedDataFilterSupplier::openBlocks(
+    SortBlock* mergeBlocks,
+    int nMergeBlocks,
+    int nReaders)
+{
+    for (SortBlock* i = mergeBlocks; i < mergeBlocks + nMergeBlocks; i++) {
+        if (NULL != i->memory || 0 == i->bytes) {
+            continue;
+        }
+        i->reader = openTempData(i->file, i->start, i->bytes,
+            min(1UL << 23, max(1UL << 17, bufferSpace / nReaders))); // 128kB to 8MB buffer space per block
+    }
+}
+
+    DataReader*
+SortedDataFilterSupplier::openTempData(
+    int file,
+    size_t start,
+    size_t bytes,
+    size_t readerBufferSpace)
+{
+    if (NULL == tempCompressors) {
+        // (an inflating reader needs a second batch to inflate into while the merge is in the first)
+        DataReader* reader = inputSupplier->getDataReader(inputSupplier == DataSupplier::Default ? 1 : 2, MAX_READ_LENGTH * 8, 0.0,
+            readerBufferSpace);
+        reader->init(tempFileNames[file]);
+        reader->reinit(start, bytes);
+        return reader;
+    }
+
+    //
+    // Read the frames the data is in, and skip whatever's in the first one before it.  A block is a whole batch, so
+    // its frames are the batch's, and nothing after it gets read, other than the rest of the last frame when a
+    // parallel merge cuts the block short at a checkpoint (and mergeRange stops at the range's end anyway).
+    //
+    _uint64 physical, delta, physicalEnd;
+    if (! (tempCompressors[file]->translate(start, &physical, &delta) && tempCompressors[file]->translateEnd(start + bytes - 1, &physicalEnd))) {
+        WriteErrorMessage("SortedDataFilterSupplier: no compressed data at %lld in %s\n", (_int64)start, tempFileNames[file]);
         soft_exit(1);
     }
-    if (headerSize > 0) {
-        blocks[0].reader->reinit(0, headerSize);
-		writer->inHeader(true);
-        char* rbuffer;
-        _int64 rbytes;
-        char* wbuffer;
-        size_t wbytes;
-		for (size_t left = headerSize; left > 0; ) {
-			if ((! blocks[0].reader->getData(&rbuffer, &rbytes)) || rbytes == 0) {
-				blocks[0].reader->nextBatch();
-				if (! blocks[0].reader->getData(&rbuffer, &rbytes)) {
-					WriteErrorMessage( "read header failed\n");
-					soft_exit(1);
-				}
-			}
-			if ((! writer->getBuffer(&wbuffer, &wbytes)) || wbytes == 0) {
-				writer->nextBatch();
-				if (! writer->getBuffer(&wbuffer, &wbytes)) {
-					WriteErrorMessage( "write header failed\n");
-					soft_exit(1);
-				}
+    DataReader* reader = DataSupplier::ZstdDefault->getDataReader(2, MAX_READ_LENGTH * 8, 0.0, readerBufferSpace);
+    reader->init(tempFileNames[file]);
+    reader->reinit(physical, physicalEnd - physical);
+    for (_uint64 left = delta; left > 0; ) {
+        char* data;
+        _int64 available;
+        if (! reader->getData(&data, &available)) {
+            reader->nextBatch();
+            if (! reader->getData(&data, &available)) {
+                WriteErrorMessage("SortedDataFilterSupplier: %s ends early\n", tempFileNames[file]);
+                soft_exit(1);
+            }
+        }
+        _int64 skip = (_int64) min(left, (_uint64) available);
+        reader->advance(skip);
+        left -= skip;
+    }
+    return reader;
+}
+
+    void
+SortedDataFilterSupplier::writeHeader(
+    DataWriter* writer)
+{
+    if (headerSize == 0) {
+        return;
+    }
+    //
+    // It's at the start of the first temp file, unless it was kept in memory.
+    //
+    SortBlock header;
+    header.bytes = headerSize;
+    header.memory = headerMemory;
+    if (NULL == headerMemory) {
+        header.reader = openTempData(0, 0, headerSize, 1UL << 17);
+    }
+	writer->inHeader(true);
+    char* rbuffer;
+    _int64 rbytes;
+    char* wbuffer;
+    size_t wbytes;
+	for (size_t left = headerSize; left > 0; ) {
+		if ((! header.getData(&rbuffer, &rbytes)) || rbytes == 0) {
+            WriteErrorMessage( "read header failed\n");
+            soft_exit(1);
+		}
+		if ((! writer->getBuffer(&wbuffer, &wbytes)) || wbytes == 0) {
+			writer->nextBatch();
+			if (! writer->getBuffer(&wbuffer, &wbytes)) {
+				WriteErrorMessage( "write header failed\n");
+				soft_exit(1);
 			}
-			size_t xfer = min(left, min((size_t) rbytes, wbytes));
-			_ASSERT(xfer > 0 && xfer <= UINT32_MAX);
-			memcpy(wbuffer, rbuffer, xfer);
-			blocks[0].reader->advance(xfer);
-			writer->advance((unsigned) xfer);
-			left -= xfer;
 		}
-        blocks[0].reader->reinit(blocks[0].start, blocks[0].bytes);
-		writer->nextBatch();
-		writer->inHeader(false);
+		size_t xfer = min(left, min((size_t) rbytes, wbytes));
+		_ASSERT(xfer > 0 && xfer <= UINT32_MAX);
+		memcpy(wbuffer, rbuffer, xfer);
+		header.advance(xfer);
+		writer->advance((unsigned) xfer);
+		left -= xfer;
+	}
+    delete header.reader;
+	writer->nextBatch();
+	writer->inHeader(false);
+}
+
+    void
+SortedDataFilterSupplier::getSortKey(
+    SortBlock* b,
+    _int64 bytes)
+{
+    format->getSortInfo(genome, b->data, bytes, &b->location, &b->length);
+    if (byName) {
+        format->getReadName(b->data, b->length, &b->name, &b->nameLength);
+        b->location = NameSortKey(b->name, b->nameLength);
     }
+}
 
+    bool
+SortedDataFilterSupplier::mergeRange(
+    DataWriter* writer,
+    SortBlock* mergeBlocks,
+    int nMergeBlocks,
+    GenomeLocation begin,
+    GenomeLocation end,
+    bool toEnd,
+    _int64* o_total)
+{
+    TRACE_SPAN(MergeTraceEvent);
     // merge temp blocks into output
     _int64 total = 0;
-    // get initial merge sort data
-    typedef PriorityQueue<GenomeLocation, _int64> BlockQueue;
-    BlockQueue queue;
-    for (SortBlockVector::iterator b = blocks.begin(); b != blocks.end(); b++) {
+    // get initial merge sort data, skipping anything before the range
+    // (the range is of locations, or name keys, so ties are never split between ranges)
+    LoserTree<MergeKey> tree(nMergeBlocks);
+    for (SortBlock* b = mergeBlocks; b < mergeBlocks + nMergeBlocks; b++) {
         _int64 bytes;
-        b->reader->getData(&b->data, &bytes);
-        format->getSortInfo(genome, b->data, bytes, &b->location, &b->length);
-        queue.add((_uint32) (b - blocks.begin()), b->location); 
+        if ((NULL == b->memory && NULL == b->reader) || ! b->getData(&b->data, &bytes)) {
+            continue; // nothing in range
+        }
+        getSortKey(b, bytes);
+        bool more = true;
+        while (more && b->location < begin) {
+            b->advance(b->length);
+            more = b->getData(&b->data, &bytes);
+            if (more) {
+                getSortKey(b, bytes);
+            }
+        }
+        if (more) {
+            tree.set((int) (b - mergeBlocks), b->key());
+        }
     }
+    tree.build();
     GenomeLocation current = 0; // current location for validation
 	int lastRefID = -1, lastPos = 0;
-    while (queue.size() > 0) {
+    int smallestIndex;
+    while ((smallestIndex = tree.top()) != -1) {
+        MergeKey limit;
+        bool second = tree.runnerUp(&limit);
+        SortBlock* b = &mergeBlocks[smallestIndex];
 #if VALIDATE_SORT
-        GenomeLocation check;
-		queue.peek(&check);
-		_ASSERT(check >= current);
+		_ASSERT(b->location >= current);
 #endif
-        GenomeLocation secondLocation;
-        _int64 smallestIndex = queue.pop();
-        _int64 secondIndex = queue.size() > 0 ? queue.peek(&secondLocation) : -1;
-        GenomeLocation limit = secondIndex != -1 ? secondLocation : InvalidGenomeLocation;
-        SortBlock* b = &blocks[smallestIndex];
+        if (! (toEnd || b->location < end)) {
+            break; // it's the smallest left, so that's the end of the range
+        }
         char* writeBuffer;
         size_t writeBytes;
         writer->getBuffer(&writeBuffer, &writeBytes);
         const int NBLOCKS = 20;
         SortBlock oldBlocks[NBLOCKS];
         int oldBlockIndex = 0;
-        while (b->location <= limit) {
+        // (a merge of files without the index doesn't have InvalidGenomeLocation to go by)
+        while ((! second || ! (limit < b->key())) && (toEnd || b->location < end)) {
 #if VALIDATE_SORT
 			_ASSERT(b->location >= b->minLocation && b->location <= b->maxLocation);
 #endif
@@ -442,47 +1524,36 @@ SortedDataFilterSupplier::mergeSort()
             writeBuffer += b->length;
             oldBlocks[oldBlockIndex] = *b;
             oldBlockIndex = (oldBlockIndex + 1) % NBLOCKS;
-            b->reader->advance(b->length);
+            b->advance(b->length);
             _ASSERT(b->location >= current);
             current = b->location;
             _int64 readBytes;
-            if (! b->reader->getData(&b->data, &readBytes)) {
-                b->reader->nextBatch();
-                if (! b->reader->getData(&b->data, &readBytes)) {
-                    _ASSERT(b->reader->isEOF());
-                    delete b->reader;
-                    b->reader = NULL;
-                    break;
+            if (! b->getData(&b->data, &readBytes)) {
+                delete b->reader;
+                b->reader = NULL;
+                if (NULL != b->allocation && b->allocation != headerMemory) {
+                    BigDealloc(b->allocation);
                 }
+                b->allocation = NULL;
+                b->memory = NULL;
+                break;
             }
             GenomeLocation previous = b->location;
-            format->getSortInfo(genome, b->data, readBytes, &b->location, &b->length);
+            getSortKey(b, readBytes);
             _ASSERT(b->length <= readBytes && b->location >= previous);
         }
-        if (b->reader != NULL) {
-            queue.add(smallestIndex, b->location);
+        if (b->reader != NULL || b->memory != NULL) {
+            tree.update(b->key());
+        } else {
+            tree.remove();
         }
     }
-    
-    // close everything
-    writer->close();
-    delete writer;
-    writerSupplier->close();
-    delete writerSupplier;
-    if (! DeleteSingleFile(tempFileName)) {
-        WriteErrorMessage( "warning: failure deleting temp file %s\n", tempFileName);
+    // readers stopped at the end of the range
+    for (SortBlock* b = mergeBlocks; b < mergeBlocks + nMergeBlocks; b++) {
+        delete b->reader;
+        b->reader = NULL;
     }
-
-#if USE_DEVTEAM_OPTIONS
-    WriteStatusMessage("sorted %lld reads in %u blocks, %lld s\n"
-        "read wait align %.3f s + merge %.3f s, read release align %.3f s + merge %.3f s\n"
-        "write wait %.3f s align + %.3f s merge, write filter %.3f s align + %.3f s merge\n",
-        total, blocks.size(), (timeInMillis() - start)/1000,
-        startReadWaitTime * 1e-9, (DataReader::ReadWaitTime - startReadWaitTime) * 1e-9,
-        startReleaseWaitTime * 1e-9, (DataReader::ReleaseWaitTime - startReleaseWaitTime) * 1e-9,
-        startWriteWaitTime * 1e-9, (DataWriter::WaitTime - startWriteWaitTime) * 1e-9,
-        startWriteFilterTime * 1e-9, (DataWriter::FilterTime - startWriteFilterTime) * 1e-9);
-#endif
+    *o_total = total;
     return true;
 }
 
@@ -496,12 +1567,122 @@ DataWriterSupplier::sorted(
     const char* sortedFileName,
     DataWriter::FilterSupplier* sortedFilterSuppler,
     size_t maxBufferSize,
-    FileEncoder* encoder)
+    FileEncoder* encoder,
+    size_t inMemoryLimit,
+    const char* tempDirectories,
+    int mergeThreads,
+    SortedPartSupplier* parts,
+    int shards,
+    bool evenShards,
+    bool zstdTemp,
+    bool byName)
 {
-    const int bufferCount = 3;
+    const int bufferCount = zstdTemp ? 4 : 3; // (one more to be compressing a sorted batch while the next one fills)
     const size_t bufferSpace = tempBufferMemory > 0 ? tempBufferMemory : (numThreads * (size_t)1 << 30);
     const size_t bufferSize = bufferSpace / (bufferCount * numThreads);
-    DataWriter::FilterSupplier* filterSupplier =
-        new SortedDataFilterSupplier(format, genome, tempFileName, sortedFileName, sortedFilterSuppler, bufferSize, bufferSpace, encoder);
-    return DataWriterSupplier::create(tempFileName, bufferSize, filterSupplier, NULL, bufferCount);
+
+    //
+    // One temp file next to the output, or one in each of the directories, named after the output.
+    //
+    int nTempFiles = 1;
+    for (const char* c = tempDirectories; NULL != c && *c != '\0'; c++) {
+        nTempFiles += *c == ',';
+    }
+    const char** tempFileNames = new const char*[nTempFiles];   // These last as long as the run, like tempFileName
+    if (NULL == tempDirectories) {
+        tempFileNames[0] = tempFileName;
+    } else {
+        const char* baseName = strrchr(sortedFileName, PATH_SEP);
+        baseName = NULL == baseName ? sortedFileName : baseName + 1;
+        const char* directory = tempDirectories;
+        for (int i = 0; i < nTempFiles; i++) {
+            const char* comma = strchr(directory, ',');
+            size_t directoryLength = NULL == comma ? strlen(directory) : comma - directory;
+            size_t nameSize = directoryLength + strlen(baseName) + 20;
+            char* name = new char[nameSize];
+            snprintf(name, nameSize, "%.*s%c%s.%d.tmp", (int)directoryLength, directory, PATH_SEP, baseName, i);
+            tempFileNames[i] = name;
+            directory = NULL == comma ? directory + directoryLength : comma + 1;
+        }
+    }
+
+    //
+    // Compressed temp files are each written through a pool of encoders (the writers' batches are sorted on their own
+    // threads, and then compressed on the pool's), sharing the threads between them, at zstd's fastest level.
+    //
+    ZstdWriterFilterSupplier** tempCompressors = NULL;
+    if (zstdTemp) {
+        tempCompressors = new ZstdWriterFilterSupplier*[nTempFiles];
+        for (int i = 0; i < nTempFiles; i++) {
+            tempCompressors[i] = DataWriterSupplier::zstd(true, 1);
+            if (NULL == tempCompressors[i]) {
+                WriteErrorMessage("Compressed temp files need zstd, but this SNAP was built without zstd support (see LIBZSTD_HOME in the Makefile)\n");
+                soft_exit(1);
+            }
+        }
+    }
+
+    SortedDataFilterSupplier* filterSupplier =
+        new SortedDataFilterSupplier(format, genome, nTempFiles, tempFileNames, sortedFileName, sortedFilterSuppler, bufferSize, bufferSpace,
+            inMemoryLimit, encoder, mergeThreads, parts, shards, evenShards, tempCompressors, byName);
+    if (1 == nTempFiles) {
+        return DataWriterSupplier::create(tempFileNames[0], bufferSize, filterSupplier, NULL, bufferCount,
+            zstdTemp ? FileEncoderPool::zstd(tempCompressors[0], numThreads) : NULL);
+    }
+
+    DataWriterSupplier** suppliers = new DataWriterSupplier*[nTempFiles];
+    for (int i = 0; i < nTempFiles; i++) {
+        suppliers[i] = DataWriterSupplier::create(tempFileNames[i], bufferSize,
+            0 == i ? (DataWriter::FilterSupplier*)filterSupplier : new SortedDataFileFilterSupplier(filterSupplier, i), NULL, bufferCount,
+            zstdTemp ? FileEncoderPool::zstd(tempCompressors[i], max(1, numThreads / nTempFiles)) : NULL);
+    }
+    return new MultiFileDataWriterSupplier(nTempFiles, suppliers);
+}
+
+    bool
+DataWriterSupplier::mergeSorted(
+    const FileFormat* format,
+    const Genome* genome,
+    int nFiles,
+    const char** fileNames,
+    const size_t* headerSizes,
+    DataSupplier* inputSupplier,
+    const char* sortedFileName,
+    DataWriter::FilterSupplier* sortedFilterSupplier,
+    size_t bufferSize,
+    FileEncoder* encoder,
+    _int64* o_total)
+{
+    // the files stand in for the temp files of a sort that's been written
+    SortedDataFilterSupplier merger(format, genome, nFiles, fileNames, sortedFileName, sortedFilterSupplier, bufferSize,
+        bufferSize * nFiles, 0, encoder, 1, NULL, 0, false, NULL, false);
+    return merger.mergeFiles(inputSupplier, headerSizes, o_total);
+}
+
+    char*
+DataWriterSupplier::shardFileName(
+    const char* sortedFileName,
+    int shard,
+    int nShards)
+{
+    int digits = 1;
+    for (int n = nShards - 1; n >= 10; n /= 10) {
+        digits++;
+    }
+    const char* baseName = strrchr(sortedFileName, PATH_SEP);
+    const char* extension = strrchr(NULL == baseName ? sortedFileName : baseName, '.');
+    if (NULL != extension && 0 == strcmp(extension, ".zst")) {
+        // out.shard0.sam.zst for out.sam.zst
+        for (const char* p = extension - 1; p >= (NULL == baseName ? sortedFileName : baseName); p--) {
+            if ('.' == *p) {
+                extension = p;
+                break;
+            }
+        }
+    }
+    size_t prefixLength = NULL == extension ? strlen(sortedFileName) : extension - sortedFileName;
+    size_t nameSize = strlen(sortedFileName) + digits + 20;
+    char* name = new char[nameSize];
+    snprintf(name, nameSize, "%.*s.shard%0*d%s", (int)prefixLength, sortedFileName, digits, shard, NULL == extension ? "" : extension);
+    return name;
 }
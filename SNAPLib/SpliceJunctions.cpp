@@ -0,0 +1,419 @@
+/*++
+
+Module Name:
+
+    SpliceJunctions.cpp
+
+Abstract:
+
+    Splice junction contigs for index -gtf.  See SpliceJunctions.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "SpliceJunctions.h"
+#include "Bam.h"
+#include "Error.h"
+#include "Util.h"
+#include "zlib.h"
+#include <algorithm>
+#include <string>
+
+using std::max;
+using std::min;
+
+namespace {
+
+class GzipFGetsObject : public FgetsObject
+{
+public:
+    GzipFGetsObject(gzFile _file) : file(_file) {}
+    virtual char *fgets(char *s, int size) {
+        return gzgets(file, s, size);
+    }
+private:
+    gzFile file;
+};
+
+struct Exon {
+    std::string     transcriptId;
+    int             contigNum;
+    GenomeDistance  start;  // 0-based
+    GenomeDistance  end;    // Exclusive
+
+    bool operator<(const Exon& peer) const {
+        return transcriptId != peer.transcriptId ? transcriptId < peer.transcriptId : contigNum != peer.contigNum ? contigNum < peer.contigNum : start < peer.start;
+    }
+};
+
+//
+// The value of attribute (like transcript_id "ENST00000456328.2";) in a GTF attributes field, or false if it's not there.
+//
+    bool
+getGTFAttribute(const char *attributes, const char *attribute, std::string *value)
+{
+    size_t attributeLength = strlen(attribute);
+    for (const char *p = strstr(attributes, attribute); NULL != p; p = strstr(p + 1, attribute)) {
+        if ((p != attributes && ' ' != p[-1] && ';' != p[-1]) || (' ' != p[attributeLength] && '\t' != p[attributeLength])) {
+            continue;   // Part of another attribute's name, like gene_id in havana_gene_id
+        }
+
+        const char *start = p + attributeLength;
+        while (' ' == *start || '\t' == *start) {
+            start++;
+        }
+        bool quoted = '"' == *start;
+        if (quoted) {
+            start++;
+        }
+        const char *end = start;
+        while ('\0' != *end && '\n' != *end && (quoted ? '"' != *end : (';' != *end && ' ' != *end))) {
+            end++;
+        }
+        value->assign(start, end - start);
+        return end != start;
+    }
+
+    return false;
+}
+
+} // namespace
+
+    SpliceJunctions *
+SpliceJunctions::readGTF(const char *gtfFileName, const Genome *genome, unsigned flank)
+{
+    gzFile gtfFile = gzopen(gtfFileName, "rb");
+    if (NULL == gtfFile) {
+        WriteErrorMessage("Unable to open GTF file '%s'\n", gtfFileName);
+        return NULL;
+    }
+    gzbuffer(gtfFile, 1024 * 1024);
+    GzipFGetsObject fgetsObject(gtfFile);
+
+    int lineBufferSize = 0;
+    char *lineBuffer = NULL;
+    std::vector<Exon> exons;
+    _int64 nSkipped = 0;
+    const int nFields = 9;
+
+    while (NULL != genericReallocatingFgets(&lineBuffer, &lineBufferSize, &fgetsObject)) {
+        if ('#' == lineBuffer[0]) {
+            continue;
+        }
+
+        //
+        // seqname, source, feature, start, end, score, strand, frame, attributes.
+        //
+        char *fields[nFields];
+        int nFound = 0;
+        for (char *p = lineBuffer; nFound < nFields && NULL != p; nFound++) {
+            fields[nFound] = p;
+            p = strchr(p, '\t');
+            if (NULL != p && nFound < nFields - 1) {
+                *p++ = '\0';
+            }
+        }
+        if (nFound < nFields || strcmp(fields[2], "exon")) {
+            continue;
+        }
+
+        Exon exon;
+        GenomeLocation contigLocation;
+        _int64 start = atoll(fields[3]), end = atoll(fields[4]);
+        if (!genome->getLocationOfContig(fields[0], &contigLocation, &exon.contigNum) || !getGTFAttribute(fields[8], "transcript_id", &exon.transcriptId) ||
+            start < 1 || end < start || end > genome->getContigs()[exon.contigNum].length - genome->getChromosomePadding()) {
+            nSkipped++;
+            continue;
+        }
+
+        exon.start = start - 1;
+        exon.end = end;
+        exons.push_back(exon);
+    }
+
+    gzclose(gtfFile);
+    delete [] lineBuffer;
+
+    if (0 != nSkipped) {
+        WriteErrorMessage("Skipped %lld exons in '%s' that weren't on a contig in the genome, or had no transcript_id\n", nSkipped, gtfFileName);
+    }
+
+    //
+    // Each gap between the exons of a transcript is an intron.  Transcripts that share one share its junction, which
+    // gets as much of each exon as the longest of theirs (up to flank).
+    //
+    std::sort(exons.begin(), exons.end());
+
+    SpliceJunctions *result = new SpliceJunctions(genome);
+    for (size_t i = 1; i < exons.size(); i++) {
+        const Exon& donor = exons[i - 1];
+        const Exon& acceptor = exons[i];
+        if (donor.transcriptId != acceptor.transcriptId || donor.contigNum != acceptor.contigNum || acceptor.start <= donor.end) {
+            continue;
+        }
+
+        Junction junction;
+        junction.contigNum = donor.contigNum;
+        junction.donorLength = (unsigned)min((GenomeDistance)flank, donor.end - donor.start);
+        junction.donorStart = donor.end - junction.donorLength;
+        junction.acceptorStart = acceptor.start;
+        junction.acceptorLength = (unsigned)min((GenomeDistance)flank, acceptor.end - acceptor.start);
+        junction.junctionContigNum = -1;
+        result->junctions.push_back(junction);
+    }
+
+    std::sort(result->junctions.begin(), result->junctions.end());
+
+    size_t nUnique = 0;
+    for (size_t i = 0; i < result->junctions.size(); i++) {
+        Junction& junction = result->junctions[i];
+        if (0 != nUnique) {
+            Junction& previous = result->junctions[nUnique - 1];
+            if (previous.contigNum == junction.contigNum && previous.donorStart + previous.donorLength == junction.donorStart + junction.donorLength &&
+                previous.acceptorStart == junction.acceptorStart) {
+                GenomeDistance intronStart = previous.donorStart + previous.donorLength;
+                previous.donorLength = max(previous.donorLength, junction.donorLength);
+                previous.donorStart = intronStart - previous.donorLength;
+                previous.acceptorLength = max(previous.acceptorLength, junction.acceptorLength);
+                continue;
+            }
+        }
+        result->junctions[nUnique++] = junction;
+    }
+    result->junctions.resize(nUnique);
+
+    if (0 == nUnique) {
+        WriteErrorMessage("GTF file '%s' has no introns on the genome's contigs\n", gtfFileName);
+        delete result;
+        return NULL;
+    }
+
+    WriteStatusMessage("%lld exons, %lld splice junctions\n", (_int64)exons.size(), (_int64)nUnique);
+    return result;
+}
+
+    void
+SpliceJunctions::getJunctionContigName(const Junction& junction, char *buffer, size_t bufferSize) const
+{
+    snprintf(buffer, bufferSize, "SJ|%s:%lld-%lld", genome->getContigs()[junction.contigNum].name, junction.donorStart + junction.donorLength + 1,
+        junction.acceptorStart);
+}
+
+    Genome *
+SpliceJunctions::buildJunctionGenome() const
+{
+    unsigned chromosomePadding = genome->getChromosomePadding();
+    GenomeDistance nBases = (junctions.size() + 1) * (GenomeDistance)chromosomePadding;
+    for (size_t i = 0; i < junctions.size(); i++) {
+        nBases += junctions[i].donorLength + junctions[i].acceptorLength;
+    }
+
+    Genome *junctionGenome = new Genome(nBases, nBases, chromosomePadding, (unsigned)junctions.size() + 1);
+
+    char *paddingBuffer = new char[chromosomePadding + 1];
+    memset(paddingBuffer, 'n', chromosomePadding);
+    paddingBuffer[chromosomePadding] = '\0';
+
+    const size_t nameBufferSize = 1024;
+    char nameBuffer[nameBufferSize];
+    for (size_t i = 0; i < junctions.size(); i++) {
+        const Junction& junction = junctions[i];
+        GenomeLocation contigStart = genome->getContigs()[junction.contigNum].beginningLocation;
+
+        junctionGenome->addData(paddingBuffer);
+        getJunctionContigName(junction, nameBuffer, nameBufferSize);
+        junctionGenome->startContig(nameBuffer);
+        junctionGenome->addData(genome->getSubstring(contigStart + junction.donorStart, junction.donorLength), junction.donorLength);
+        junctionGenome->addData(genome->getSubstring(contigStart + junction.acceptorStart, junction.acceptorLength), junction.acceptorLength);
+    }
+    junctionGenome->addData(paddingBuffer);
+    junctionGenome->fillInContigLengths();
+    junctionGenome->buildContigNameTable();
+
+    delete [] paddingBuffer;
+    return junctionGenome;
+}
+
+    bool
+SpliceJunctions::saveToFile(const char *fileName) const
+{
+    FILE *file = fopen(fileName, "w");
+    if (NULL == file) {
+        WriteErrorMessage("Unable to open '%s' for write\n", fileName);
+        return false;
+    }
+
+    //
+    // A line for each junction: where its two pieces are in their contig, and then the contig's name, which can have spaces.
+    //
+    bool worked = fprintf(file, "%lld\n", (_int64)junctions.size()) > 0;
+    for (size_t i = 0; worked && i < junctions.size(); i++) {
+        const Junction& junction = junctions[i];
+        worked = fprintf(file, "%lld %u %lld %u %s\n", junction.donorStart, junction.donorLength, junction.acceptorStart, junction.acceptorLength,
+            genome->getContigs()[junction.contigNum].name) > 0;
+    }
+
+    worked = 0 == fclose(file) && worked;
+    if (!worked) {
+        WriteErrorMessage("Error writing '%s'\n", fileName);
+    }
+    return worked;
+}
+
+    SpliceJunctions *
+SpliceJunctions::loadFromFile(const char *fileName, const Genome *genome)
+{
+    FILE *file = fopen(fileName, "r");
+    if (NULL == file) {
+        return NULL;
+    }
+
+    SpliceJunctions *result = new SpliceJunctions(genome);
+    result->junctionByContig.resize(genome->getNumContigs(), -1);
+
+    _int64 nJunctions;
+    const size_t lineBufferSize = 1024 + 64;
+    char lineBuffer[lineBufferSize];
+    char nameBuffer[lineBufferSize];
+    bool worked = NULL != fgets(lineBuffer, lineBufferSize, file) && 1 == sscanf(lineBuffer, "%lld", &nJunctions);
+    for (_int64 i = 0; worked && i < nJunctions; i++) {
+        Junction junction;
+        int nameOffset = 0;
+        worked = NULL != fgets(lineBuffer, lineBufferSize, file) &&
+            4 == sscanf(lineBuffer, "%lld %u %lld %u %n", &junction.donorStart, &junction.donorLength, &junction.acceptorStart, &junction.acceptorLength, &nameOffset) &&
+            0 != nameOffset;
+        if (!worked) {
+            break;
+        }
+
+        char *contigName = lineBuffer + nameOffset;
+        contigName[strcspn(contigName, "\r\n")] = '\0';
+
+        GenomeLocation location;
+        if (!genome->getLocationOfContig(contigName, &location, &junction.contigNum)) {
+            continue;   // -restrict left it out
+        }
+
+        result->getJunctionContigName(junction, nameBuffer, lineBufferSize);
+        if (!genome->getLocationOfContig(nameBuffer, &location, &junction.junctionContigNum)) {
+            continue;
+        }
+
+        result->junctionByContig[junction.junctionContigNum] = (int)result->junctions.size();
+        result->junctions.push_back(junction);
+    }
+    fclose(file);
+
+    if (!worked) {
+        WriteErrorMessage("SpliceJunctions::loadFromFile: '%s' is corrupt\n", fileName);
+    }
+
+    if (!worked || result->junctions.empty()) {
+        delete result;
+        return NULL;
+    }
+
+    return result;
+}
+
+    void
+SpliceJunctions::liftPosition(const Junction& junction, GenomeDistance offset, int *contigNum, GenomeDistance *position) const
+{
+    *contigNum = junction.contigNum;
+    if (offset < junction.donorLength) {
+        *position = junction.donorStart + offset + 1;
+    } else {
+        *position = junction.acceptorStart + min(offset - junction.donorLength, (GenomeDistance)junction.acceptorLength - 1) + 1;
+    }
+}
+
+    GenomeLocation
+SpliceJunctions::liftLocation(GenomeLocation location) const
+{
+    if (InvalidGenomeLocation == location) {
+        return location;
+    }
+
+    int contigNum = genome->getContigNumAtLocation(location);
+    if (!isJunctionContig(contigNum)) {
+        return location;
+    }
+
+    const Genome::Contig *contigs = genome->getContigs();
+    int genomicContigNum;
+    GenomeDistance position;
+    liftPosition(junctions[junctionByContig[contigNum]], location - contigs[contigNum].beginningLocation, &genomicContigNum, &position);
+    return contigs[genomicContigNum].beginningLocation + position - 1;
+}
+
+    void
+SpliceJunctions::liftRecord(int& contigIndex, GenomeDistance& positionInContig, unsigned readLength, _uint32 *cigarOps, int& nCigarOps,
+    int& mateContigIndex, GenomeDistance& matePositionInContig, unsigned mateReadLength, bool bothMapped, _int64& templateLength) const
+{
+    //
+    // Where each read ends, counting its length from where it starts as the writers do (so the two records' TLENs
+    // match); for one on a junction contig, that's where its last base lifts to.
+    //
+    GenomeDistance end = positionInContig + readLength;
+    GenomeDistance mateEnd = matePositionInContig + mateReadLength;
+
+    if (isJunctionContig(contigIndex)) {
+        const Junction& junction = junctions[junctionByContig[contigIndex]];
+        GenomeDistance offset = positionInContig - 1;
+        int endContig;
+        liftPosition(junction, offset + max(readLength, 1u) - 1, &endContig, &end);
+        end++;
+
+        //
+        // If it starts in the donor and doesn't end there, the intron goes before the first base that's past it.
+        //
+        GenomeDistance reference = offset;
+        for (int i = 0; offset < junction.donorLength && i < nCigarOps; i++) {
+            _uint32 op = cigarOps[i] & 0xf;
+            _uint32 length = cigarOps[i] >> 4;
+            if (0 == BAMAlignment::CigarCodeToRefBase[op]) {
+                continue;
+            }
+
+            if (reference + length > junction.donorLength) {
+                _uint32 before = (_uint32)(junction.donorLength - reference);
+                int added = 0 == before ? 1 : 2;
+                memmove(cigarOps + i + added, cigarOps + i, (nCigarOps - i) * sizeof(_uint32));
+                nCigarOps += added;
+                if (0 != before) {
+                    cigarOps[i++] = (before << 4) | op;
+                }
+                cigarOps[i] = ((_uint32)(junction.acceptorStart - junction.donorStart - junction.donorLength) << 4) | BAMAlignment::CigarToCode['N'];
+                cigarOps[i + 1] = ((length - before) << 4) | op;
+                break;
+            }
+            reference += length;
+        }
+
+        liftPosition(junction, offset, &contigIndex, &positionInContig);
+    }
+
+    if (isJunctionContig(mateContigIndex)) {
+        const Junction& junction = junctions[junctionByContig[mateContigIndex]];
+        GenomeDistance offset = matePositionInContig - 1;
+        int endContig;
+        liftPosition(junction, offset + max(mateReadLength, 1u) - 1, &endContig, &mateEnd);
+        mateEnd++;
+        liftPosition(junction, offset, &mateContigIndex, &matePositionInContig);
+    }
+
+    if (bothMapped) {
+        templateLength = 0;
+        if (contigIndex == mateContigIndex) {
+            if (positionInContig < matePositionInContig) {
+                templateLength = mateEnd - positionInContig;
+            } else {
+                templateLength = -(end - matePositionInContig);
+            }
+        }
+    }
+}
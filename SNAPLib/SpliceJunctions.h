@@ -0,0 +1,118 @@
+/*++
+
+Module Name:
+
+    SpliceJunctions.h
+
+Abstract:
+
+    index -gtf: splice junction contigs, so that RNA reads align across introns in the same pass that aligns them to
+    the genome.  Each distinct intron of the transcripts in a GTF file gets a contig of its own, added to the end of
+    the genome: the end of the exon before it joined to the start of the exon after it, up to -junctionFlank bases of
+    each.  A read that spans the intron aligns to that contig in one piece, as though the intron weren't there.
+
+    Whole transcripts would do the same, but then every read from an exon would align equally well to the genome and
+    to each transcript that has the exon, and have a MAPQ of 0.  A junction contig is shorter than a read on each side,
+    so only reads that cross its intron fit in it.
+
+    The index keeps the junctions in the SpliceJunctions file, and the writers use them to put alignments to junction
+    contigs back in the genome: the contig and position become the genomic ones, the CIGAR gets an N for the intron,
+    and the mate's position and TLEN follow.  The junction contigs are still in the index's genome, so they're in the
+    @SQ lines, but no record refers to them.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Genome.h"
+#include <vector>
+
+extern const char *SpliceJunctionsFileName;
+
+class SpliceJunctions {
+public:
+    static const unsigned DefaultFlank = 149;   // Bases of each exon in a junction contig, one less than the longest read
+
+    //
+    // Find the introns of the transcripts in a GTF file (which may be gzip compressed): the gaps between the
+    // consecutive exons of each transcript_id.  Exons on contigs that aren't in genome are skipped.  Returns NULL if
+    // the file can't be read or has no introns.
+    //
+    static SpliceJunctions *readGTF(const char *gtfFileName, const Genome *genome, unsigned flank);
+
+    //
+    // A genome of the junction contigs, with genome's padding, to append to genome (see Genome::appendGenome).
+    //
+    Genome *buildJunctionGenome() const;
+
+    bool saveToFile(const char *fileName) const;
+
+    //
+    // The junctions of the index whose genome is genome, or NULL if it doesn't have any.  Junctions whose contigs aren't
+    // in genome (because of -restrict) are dropped.
+    //
+    static SpliceJunctions *loadFromFile(const char *fileName, const Genome *genome);
+
+    inline int getNumJunctions() const { return (int)junctions.size(); }
+
+    inline bool isJunctionContig(int contigNum) const {
+        return contigNum >= 0 && contigNum < (int)junctionByContig.size() && -1 != junctionByContig[contigNum];
+    }
+
+    //
+    // The genomic location of a location on a junction contig, or location itself if it's not on one.  This is what
+    // sorted output sorts by.
+    //
+    GenomeLocation liftLocation(GenomeLocation location) const;
+
+    inline bool needsLift(int contigIndex, int mateContigIndex) const {
+        return isJunctionContig(contigIndex) || isJunctionContig(mateContigIndex);
+    }
+
+    //
+    // Move a SAM/BAM record and its mate from junction contigs to the genome (positions are 1-based, as in SAM).  If the
+    // record's alignment crosses its junction, an N for the intron goes into cigarOps (in BAM's encoding), which must
+    // have room for two more ops.  TLEN is recomputed from the lifted positions when both are mapped, as the writers
+    // compute it, and is 0 if they're on different contigs.
+    //
+    void liftRecord(int& contigIndex, GenomeDistance& positionInContig, unsigned readLength, _uint32 *cigarOps, int& nCigarOps,
+        int& mateContigIndex, GenomeDistance& matePositionInContig, unsigned mateReadLength, bool bothMapped, _int64& templateLength) const;
+
+    ~SpliceJunctions() {}
+
+private:
+    SpliceJunctions(const Genome *i_genome) : genome(i_genome) {}
+
+    struct Junction {
+        int             contigNum;          // Of the exons, in genome
+        GenomeDistance  donorStart;         // Offset in the contig of the junction contig's first base
+        unsigned        donorLength;        // Bases before the intron
+        GenomeDistance  acceptorStart;      // Offset in the contig of the first base after the intron
+        unsigned        acceptorLength;
+        int             junctionContigNum;  // In genome, once it's loaded with an index; -1 before
+
+        bool operator<(const Junction& peer) const {
+            return contigNum != peer.contigNum ? contigNum < peer.contigNum : donorStart + donorLength != peer.donorStart + peer.donorLength ?
+                donorStart + donorLength < peer.donorStart + peer.donorLength : acceptorStart < peer.acceptorStart;
+        }
+    };
+
+    //
+    // Name a junction contig after its intron, like SJ|chr1:12228-12612 (1-based, inclusive).
+    //
+    void getJunctionContigName(const Junction& junction, char *buffer, size_t bufferSize) const;
+
+    //
+    // The contig and 1-based position in the genome of offset (0-based) on the junction contig for junction.
+    //
+    void liftPosition(const Junction& junction, GenomeDistance offset, int *contigNum, GenomeDistance *position) const;
+
+    const Genome               *genome;
+    std::vector<Junction>       junctions;
+    std::vector<int>            junctionByContig;   // Index in junctions of each contig of genome that's a junction contig, or -1
+};
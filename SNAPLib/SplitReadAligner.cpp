@@ -0,0 +1,342 @@
+/*++
+
+Module Name:
+
+    SplitReadAligner.cpp
+
+Abstract:
+
+    Aligning a read in pieces.  See SplitReadAligner.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "SplitReadAligner.h"
+#include "BaseAligner.h"
+#include "ReverseComplement.h"
+#include "Seed.h"
+#include "mapq.h"
+
+    bool
+SplitAlignment::getSATag(const Genome *genome, int segment, char *buffer, size_t bufferSize) const
+{
+    size_t used = 0;
+    for (int i = 0; i < nSegments; i++) {
+        if (i == segment) {
+            continue;
+        }
+
+        const SplitSegment *other = &segments[i];
+        const Genome::Contig *contig = genome->getContigAtLocation(other->location);
+        if (NULL == contig) {
+            return false;
+        }
+
+        int n = snprintf(buffer + used, bufferSize - used, "%.*s,%lld,%c,%s,%d,%d;", contig->nameLength, contig->name,
+            GenomeLocationAsInt64(other->location - contig->beginningLocation) + 1, FORWARD == other->direction ? '+' : '-', other->cigar,
+            other->mapq, other->score);
+        if (n < 0 || (size_t)n >= bufferSize - used) {
+            return false;
+        }
+        used += n;
+    }
+
+    return true;
+}
+
+SplitReadAligner::SplitReadAligner(GenomeIndex *i_index, unsigned i_maxReadSize, int i_maxK) :
+    index(i_index), genome(i_index->getGenome()), seedLen(i_index->getSeedLength()), maxReadSize(i_maxReadSize), maxK(__min(i_maxK, MAX_K - 1)),
+    nCandidates(0), decodeBufferStorage(NULL)
+{
+    rcData = new char[maxReadSize];
+    rcQuality = new char[maxReadSize];
+
+    if (index->hasCompressedOverflowTable()) {
+        _int64 decodeBufferSize = OverflowDecodeBuffer::getBufferSize(NUM_DIRECTIONS, MaxHitsPerSeed);
+        decodeBufferStorage = new GenomeLocation[decodeBufferSize];
+        decodeBuffer.init(decodeBufferStorage, decodeBufferSize, MaxHitsPerSeed);
+    }
+}
+
+SplitReadAligner::~SplitReadAligner()
+{
+    delete [] rcData;
+    delete [] rcQuality;
+    delete [] decodeBufferStorage;
+}
+
+    void
+SplitReadAligner::addHit(Direction direction, _int64 hit, unsigned seedOffset, unsigned readLength)
+{
+    //
+    // An RC hit is where the seed's reverse complement is, which starts readLength - seedLen - seedOffset into the
+    // read's reverse complement.
+    //
+    unsigned offset = FORWARD == direction ? seedOffset : readLength - seedLen - seedOffset;
+    _int64 diagonal = hit - offset;
+
+    for (int i = 0; i < nCandidates; i++) {
+        Candidate *candidate = &candidates[i];
+        if (candidate->direction == direction && diagonal + MaxDiagonalDrift >= candidate->diagonal && diagonal <= candidate->diagonal + MaxDiagonalDrift) {
+            candidate->seedStart = __min(candidate->seedStart, offset);
+            candidate->seedEnd = __max(candidate->seedEnd, offset + seedLen);
+            return;
+        }
+    }
+
+    if (nCandidates < MaxCandidates) {
+        Candidate *candidate = &candidates[nCandidates++];
+        candidate->direction = direction;
+        candidate->diagonal = diagonal;
+        candidate->seedStart = offset;
+        candidate->seedEnd = offset + seedLen;
+    }
+}
+
+    void
+SplitReadAligner::addHits(unsigned seedOffset, unsigned readLength, const _int64 *nHits, const GenomeLocation * const *hits, const unsigned * const *hits32)
+{
+    for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+        if (nHits[dir] > MaxHitsPerSeed) {
+            continue;
+        }
+        for (_int64 i = 0; i < nHits[dir]; i++) {
+            addHit(dir, NULL != hits32 && NULL != hits32[dir] ? (_int64)hits32[dir][i] : GenomeLocationAsInt64(hits[dir][i]), seedOffset, readLength);
+        }
+    }
+}
+
+    bool
+SplitReadAligner::extend(Candidate *candidate, const char *data, const char *quality, unsigned readLength)
+{
+    //
+    // Stay within the contig that the seeds are in.
+    //
+    const Genome::Contig *contig = genome->getContigAtLocation(candidate->diagonal + candidate->seedStart);
+    if (NULL == contig) {
+        return false;
+    }
+    _int64 contigStart = GenomeLocationAsInt64(contig->beginningLocation);
+    _int64 contigEnd = contigStart + contig->length - genome->getChromosomePadding();
+    unsigned lo = (unsigned)__max((_int64)0, contigStart - candidate->diagonal);
+    unsigned hi = (unsigned)__min((_int64)readLength, contigEnd - candidate->diagonal);
+    if (lo > candidate->seedStart || hi < candidate->seedEnd) {
+        return false;
+    }
+
+    const char *text = genome->getSubstring(candidate->diagonal + lo, hi - lo);
+    if (NULL == text) {
+        return false;
+    }
+    text -= lo;     // So text[i] goes with data[i]
+
+    int score = 0;
+    for (unsigned i = candidate->seedStart; i < candidate->seedEnd; i++) {
+        score += data[i] == text[i] ? 1 : -MismatchPenalty;
+    }
+
+    int running = 0, best = 0;
+    candidate->end = candidate->seedEnd;
+    for (unsigned i = candidate->seedEnd; i < hi && running > best - MaxDrop; i++) {
+        running += data[i] == text[i] ? 1 : -MismatchPenalty;
+        if (running > best) {
+            best = running;
+            candidate->end = i + 1;
+        }
+    }
+    score += best;
+
+    running = best = 0;
+    candidate->start = candidate->seedStart;
+    for (unsigned i = candidate->seedStart; i > lo && running > best - MaxDrop; i--) {
+        running += data[i - 1] == text[i - 1] ? 1 : -MismatchPenalty;
+        if (running > best) {
+            best = running;
+            candidate->start = i - 1;
+        }
+    }
+    score += best;
+    candidate->extensionScore = score;
+
+    unsigned length = candidate->end - candidate->start;
+    if (length < MinSegmentLength) {
+        return false;
+    }
+
+    //
+    // LV gets the rest of the contig past the piece's end to work with, as far as it can use.
+    //
+    _int64 textLength = __min((_int64)length + maxK, contigEnd - (candidate->diagonal + candidate->start));
+    candidate->score = lv.computeEditDistance(text + candidate->start, (int)textLength, data + candidate->start, quality + candidate->start, length,
+        maxK, &candidate->matchProbability);
+    return candidate->score >= 0;
+}
+
+    void
+SplitReadAligner::computeCigar(Read *read, const Candidate *candidate, const char *data, SplitSegment *segment)
+{
+    unsigned readLength = read->getDataLength();
+    unsigned length = candidate->end - candidate->start;
+    unsigned frontClipping = candidate->start + (FORWARD == candidate->direction ? read->getFrontClippedLength() : read->getBackClippedLength());
+    unsigned backClipping = readLength - candidate->end + (FORWARD == candidate->direction ? read->getBackClippedLength() : read->getFrontClippedLength());
+
+    char *cigar = segment->cigar;
+    int used = 0;
+    if (frontClipping > 0) {
+        used = snprintf(cigar, SplitSegment::MaxCigarLength, "%uS", frontClipping);
+    }
+
+    const Genome::Contig *contig = genome->getContigAtLocation(segment->location);
+    _int64 contigEnd = GenomeLocationAsInt64(contig->beginningLocation) + contig->length - genome->getChromosomePadding();
+    _int64 textLength = __min((_int64)length + maxK, contigEnd - GenomeLocationAsInt64(segment->location));
+    const char *text = genome->getSubstring(segment->location, textLength);
+    int cigarUsed = 0;
+    if (NULL == text || lvc.computeEditDistance(text, (int)textLength, data + candidate->start, length, maxK, cigar + used,
+            SplitSegment::MaxCigarLength - used - 16, true, COMPACT_CIGAR_STRING, &cigarUsed) < 0) {
+        cigarUsed = snprintf(cigar + used, SplitSegment::MaxCigarLength - used, "%uM", length);
+    } else {
+        cigarUsed = (int)strlen(cigar + used);
+    }
+    used += cigarUsed;
+
+    if (backClipping > 0) {
+        snprintf(cigar + used, SplitSegment::MaxCigarLength - used, "%uS", backClipping);
+    }
+}
+
+    bool
+SplitReadAligner::align(Read *read, const SeedLookupResults *lookups, SplitAlignment *split)
+{
+    unsigned readLength = read->getDataLength();
+    if (readLength < 2 * MinSegmentLength || readLength > maxReadSize || readLength < seedLen) {
+        return false;
+    }
+
+    const char *data[NUM_DIRECTIONS] = {read->getData(), rcData};
+    const char *quality[NUM_DIRECTIONS] = {read->getQuality(), rcQuality};
+    ReverseComplementRead(read->getData(), read->getQuality(), readLength, rcData, rcQuality);
+
+    //
+    // Group the hits of the seeds that the paired aligner looked up, and then look up the seeds that tile the rest of the
+    // read, which the paired aligner may have skipped.
+    //
+    nCandidates = 0;
+    if (NULL != lookups) {
+        for (int i = 0; i < lookups->nSeeds; i++) {
+            if (lookups->offset[i] + seedLen <= readLength) {
+                _int64 nHits[NUM_DIRECTIONS] = {lookups->nHits[FORWARD][i], lookups->nHits[RC][i]};
+                const GenomeLocation *hits[NUM_DIRECTIONS] = {lookups->hits[FORWARD][i], lookups->hits[RC][i]};
+                const unsigned *hits32[NUM_DIRECTIONS] = {lookups->hits32[FORWARD][i], lookups->hits32[RC][i]};
+                addHits(lookups->offset[i], readLength, nHits, hits, hits32);
+            }
+        }
+    }
+
+    bool has64BitLocations = index->doesGenomeIndexHave64BitLocations();
+    for (unsigned offset = 0; offset + seedLen <= readLength; offset += seedLen) {
+        if ((NULL != lookups && -1 != lookups->find(offset)) || !Seed::DoesTextRepresentASeed(read->getData() + offset, seedLen)) {
+            continue;
+        }
+
+        Seed seed(read->getData() + offset, seedLen);
+        _int64 nHits[NUM_DIRECTIONS];
+        if (has64BitLocations) {
+            const GenomeLocation *hits[NUM_DIRECTIONS];
+            GenomeLocation singleHits[NUM_DIRECTIONS];
+            decodeBuffer.reset();
+            index->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC], &singleHits[FORWARD], &singleHits[RC], &decodeBuffer);
+            addHits(offset, readLength, nHits, hits, NULL);
+        } else {
+            const unsigned *hits32[NUM_DIRECTIONS];
+            index->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
+            addHits(offset, readLength, nHits, NULL, hits32);
+        }
+    }
+
+    bool usable[MaxCandidates];
+    for (int i = 0; i < nCandidates; i++) {
+        usable[i] = extend(&candidates[i], data[candidates[i].direction], quality[candidates[i].direction], readLength);
+    }
+
+    //
+    // Take the best piece, then the best of those that add enough to what's covered without overlapping what's taken
+    // by much.  Pieces are compared in forward read coordinates.
+    //
+    unsigned forwardStart[MaxCandidates], forwardEnd[MaxCandidates];
+    for (int i = 0; i < nCandidates; i++) {
+        if (FORWARD == candidates[i].direction) {
+            forwardStart[i] = candidates[i].start;
+            forwardEnd[i] = candidates[i].end;
+        } else {
+            forwardStart[i] = readLength - candidates[i].end;
+            forwardEnd[i] = readLength - candidates[i].start;
+        }
+    }
+
+    int chosen[SplitAlignment::MaxSegments];
+    int nChosen = 0;
+    while (nChosen < SplitAlignment::MaxSegments) {
+        int best = -1;
+        for (int i = 0; i < nCandidates; i++) {
+            if (!usable[i] || (-1 != best && candidates[i].extensionScore <= candidates[best].extensionScore)) {
+                continue;
+            }
+
+            unsigned overlap = 0;
+            bool overlapsTooMuch = false;
+            for (int j = 0; j < nChosen; j++) {
+                unsigned start = __max(forwardStart[i], forwardStart[chosen[j]]);
+                unsigned end = __min(forwardEnd[i], forwardEnd[chosen[j]]);
+                if (end > start) {
+                    overlap += end - start;
+                    overlapsTooMuch |= end - start > MaxSegmentOverlap;
+                }
+            }
+            if (!overlapsTooMuch && forwardEnd[i] - forwardStart[i] >= overlap + MinSegmentLength) {
+                best = i;
+            }
+        }
+
+        if (-1 == best) {
+            break;
+        }
+        chosen[nChosen++] = best;
+    }
+
+    if (nChosen < 2) {
+        return false;
+    }
+
+    split->nSegments = nChosen;
+    for (int s = 0; s < nChosen; s++) {
+        const Candidate *candidate = &candidates[chosen[s]];
+        SplitSegment *segment = &split->segments[s];
+
+        //
+        // Every group that covers most of the same part of the read is a place this piece could have come from.
+        //
+        double probabilityOfAll = 0;
+        unsigned length = forwardEnd[chosen[s]] - forwardStart[chosen[s]];
+        for (int i = 0; i < nCandidates; i++) {
+            unsigned start = __max(forwardStart[i], forwardStart[chosen[s]]);
+            unsigned end = __min(forwardEnd[i], forwardEnd[chosen[s]]);
+            if (usable[i] && end > start && 2 * (end - start) >= length) {
+                probabilityOfAll += candidates[i].matchProbability;
+            }
+        }
+
+        segment->location = candidate->diagonal + candidate->start;
+        segment->direction = candidate->direction;
+        segment->readStart = forwardStart[chosen[s]];
+        segment->readLength = length;
+        segment->score = candidate->score;
+        segment->mapq = computeMAPQ(probabilityOfAll, candidate->matchProbability, candidate->score, 0);
+        computeCigar(read, candidate, data[candidate->direction], segment);
+    }
+
+    return true;
+}
@@ -0,0 +1,123 @@
+/*++
+
+Module Name:
+
+    SplitReadAligner.h
+
+Abstract:
+
+    -splitReads: aligning a read in pieces when it doesn't align in full.  A read that spans a structural variant's
+    breakpoint, or that's chimeric, has no full length alignment within -d, but each side of the join aligns on its
+    own.  ChimericPairedEndAligner hands such a read here once it has given up on it, along with the seed lookups that
+    the paired aligner already did for it.
+
+    The seed hits are grouped by diagonal (the genome location that would hold the read's first base), in each
+    direction, and each group is extended from its seeds without gaps, stopping where mismatches outweigh what's been
+    gained by more than MaxDrop.  What's left is scored with LV.  The best scoring piece is taken, then the best one
+    that covers at least MinSegmentLength bases of the read that it doesn't, up to MaxSegments of them, and if that's
+    at least two the read is written split: the first (best) as its alignment, soft clipped to the piece, and the others
+    as supplementary (0x800) records, each with an SA tag listing the rest.  A piece's MAPQ comes from the other groups
+    that cover the same part of the read, as the aligners' does from the other candidates.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Genome.h"
+#include "GenomeIndex.h"
+#include "Read.h"
+#include "LandauVishkin.h"
+#include "directions.h"
+
+struct SeedLookupResults;
+
+struct SplitSegment {
+    static const int MaxCigarLength = 200;
+
+    GenomeLocation  location;       // Of the piece's first base, reading in direction
+    Direction       direction;
+    unsigned        readStart;      // Where the piece is in the (clipped, forward) read
+    unsigned        readLength;
+    int             score;
+    int             mapq;
+    char            cigar[MaxCigarLength];  // For the SA tag, with the rest of the read soft clipped
+};
+
+struct SplitAlignment {
+    static const int MaxSegments = 3;
+
+    //
+    // The SA tag value for segment's record: each of the other segments as "contig,pos,strand,CIGAR,MAPQ,NM;".
+    // Returns false if it doesn't fit in bufferSize.
+    //
+    bool getSATag(const Genome *genome, int segment, char *buffer, size_t bufferSize) const;
+
+    int             nSegments;
+    SplitSegment    segments[MaxSegments];  // The first is the primary one
+};
+
+class SplitReadAligner {
+public:
+    SplitReadAligner(GenomeIndex *i_index, unsigned i_maxReadSize, int i_maxK);
+    ~SplitReadAligner();
+
+    //
+    // Look for two or more pieces of read that align (to different places, or at least not as one), using the seed
+    // lookups in lookups if there are any and looking up the rest.  Returns false, with split's contents undefined, if
+    // there aren't two.
+    //
+    bool align(Read *read, const SeedLookupResults *lookups, SplitAlignment *split);
+
+    static const unsigned MinSegmentLength = 30;    // And the least a segment must add to the read's coverage
+    static const unsigned MaxSegmentOverlap = 10;   // That two segments can share, where the join is ambiguous
+    static const int MaxDrop = 20;                  // For the ungapped extension, scoring +1 a match and -MismatchPenalty
+    static const int MismatchPenalty = 3;
+    static const unsigned MaxDiagonalDrift = 8;     // Between seeds of a group, for small indels
+    static const _int64 MaxHitsPerSeed = 32;        // Seeds with more are skipped
+    static const int MaxCandidates = 64;
+
+private:
+    struct Candidate {
+        Direction       direction;
+        _int64          diagonal;       // Where the first base of the read in direction would be (maybe before the genome)
+        unsigned        seedStart;      // The seeds' extent, in direction's read coordinates
+        unsigned        seedEnd;
+        unsigned        start;          // After extension
+        unsigned        end;
+        int             extensionScore;
+        int             score;          // LV, or -1
+        double          matchProbability;
+    };
+
+    void addHit(Direction direction, _int64 hit, unsigned seedOffset, unsigned readLength);
+    void addHits(unsigned seedOffset, unsigned readLength, const _int64 *nHits, const GenomeLocation * const *hits, const unsigned * const *hits32);
+    //
+    // Extend candidate from its seeds and score it, in data (the read in its direction).  Returns false if it's too
+    // short, or too far off to score.
+    //
+    bool extend(Candidate *candidate, const char *data, const char *quality, unsigned readLength);
+    void computeCigar(Read *read, const Candidate *candidate, const char *data, SplitSegment *segment);
+
+    GenomeIndex    *index;
+    const Genome   *genome;
+    unsigned        seedLen;
+    unsigned        maxReadSize;
+    int             maxK;
+
+    Candidate       candidates[MaxCandidates];
+    int             nCandidates;
+
+    char           *rcData;
+    char           *rcQuality;
+
+    GenomeLocation         *decodeBufferStorage;
+    OverflowDecodeBuffer    decodeBuffer;
+
+    LandauVishkin<1>        lv;
+    LandauVishkinWithCigar  lvc;
+};
@@ -0,0 +1,298 @@
+/*++
+
+Module Name:
+
+    StageTiming.cpp
+
+Abstract:
+
+    Per-stage timing of the alignment.  See StageTiming.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "StageTiming.h"
+#include "Error.h"
+
+#if STAGE_TIMING
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#endif // __linux__
+
+thread_local StageTimes *ThreadStageTimes = NULL;
+
+static StageTimes * volatile AllStageTimes = NULL;
+
+volatile bool HardwareCountersEnabled = false;
+
+static volatile bool HardwareCounterOpened[NumHardwareCounters];    // On any thread, so it's worth printing
+
+static const char *StageNames[NumAlignmentStages] = {
+    "seed lookup", "candidates", "LV scoring", "MAPQ", "CIGAR", "format", "compress", "write wait", "read wait"
+};
+
+static const char *HardwareCounterNames[NumHardwareCounters] = {
+    "cycles", "instructions", "LLC misses", "dTLB misses", "branch mispredicts"
+};
+
+    StageTimes *
+GetStageTimesForNewThread()
+{
+    StageTimes *times = new StageTimes;
+    memset(times, 0, sizeof(*times));
+
+    StageTimes *head;
+    do {
+        head = AllStageTimes;
+        times->next = head;
+    } while (head != InterlockedCompareExchangePointerAndReturnOldValue((void * volatile *)&AllStageTimes, times, head));
+
+    return times;
+}
+
+#ifdef __linux__
+
+//
+// The thread's perf_event group.  It's thread local (rather than in StageTimes, which outlives the thread) so that
+// the descriptors close when the thread exits, and no other thread can read them.
+//
+struct HardwareCounterGroup {
+    HardwareCounterGroup() : opened(false), fd(-1) {
+        for (int i = 0; i < NumHardwareCounters; i++) {
+            slot[i] = -1;
+        }
+    }
+
+    ~HardwareCounterGroup() {
+        for (int i = 0; i < NumHardwareCounters; i++) {
+            if (-1 != slot[i]) {
+                close(counterFds[i]);
+            }
+        }
+    }
+
+    bool    opened;
+    int     fd;                                 // The group leader, or -1 if no counter would open
+    int     nInGroup;
+    int     slot[NumHardwareCounters];          // Where each counter comes in what the group reads, or -1
+    int     counterFds[NumHardwareCounters];
+};
+
+static thread_local HardwareCounterGroup ThreadHardwareCounters;
+
+static volatile _uint32 ComplainedAboutHardwareCounters = 0;
+
+    static void
+OpenHardwareCounters(HardwareCounterGroup *group)
+{
+    static const __u32 types[NumHardwareCounters] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    static const __u64 configs[NumHardwareCounters] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_BRANCH_MISSES};
+
+    group->opened = true;
+    group->nInGroup = 0;
+    int lastErrno = 0;
+
+    for (int i = 0; i < NumHardwareCounters; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        int fd = (int)syscall(__NR_perf_event_open, &attr, 0 /* this thread */, -1 /* any CPU */, group->fd, 0);
+        if (-1 == fd) {
+            lastErrno = errno;
+            continue;
+        }
+
+        if (-1 == group->fd) {
+            group->fd = fd;
+        }
+        group->counterFds[i] = fd;
+        group->slot[i] = group->nInGroup++;
+        HardwareCounterOpened[i] = true;
+    }
+
+    if (-1 == group->fd && 0 == InterlockedCompareExchange32AndReturnOldValue(&ComplainedAboutHardwareCounters, 1, 0)) {
+        WriteErrorMessage("Unable to open any hardware performance counters (%s); -hwc needs /proc/sys/kernel/perf_event_paranoid to be 2 or less, and hardware counters that the kernel supports\n",
+            strerror(lastErrno));
+    }
+}
+
+    bool
+ReadHardwareCounters(_int64 *values)
+{
+    HardwareCounterGroup *group = &ThreadHardwareCounters;
+    if (!group->opened) {
+        OpenHardwareCounters(group);
+    }
+
+    if (-1 == group->fd) {
+        return false;
+    }
+
+    _uint64 buffer[1 + NumHardwareCounters];    // The count of counters, then their values
+    if (read(group->fd, buffer, sizeof(buffer)) < (ssize_t)(sizeof(_uint64) * (1 + group->nInGroup))) {
+        return false;
+    }
+
+    for (int i = 0; i < NumHardwareCounters; i++) {
+        values[i] = -1 == group->slot[i] ? 0 : (_int64)buffer[1 + group->slot[i]];
+    }
+
+    return true;
+}
+
+    bool
+EnableHardwareCounters(bool enable)
+{
+    HardwareCountersEnabled = enable;
+    return true;
+}
+
+#else   // __linux__
+
+    bool
+ReadHardwareCounters(_int64 *values)
+{
+    return false;
+}
+
+    bool
+EnableHardwareCounters(bool enable)
+{
+    if (enable) {
+        WriteErrorMessage("Hardware performance counters (-hwc) are only supported on Linux\n");
+        return false;
+    }
+    return true;
+}
+
+#endif  // __linux__
+
+    void
+ResetStageTimes()
+{
+    for (StageTimes *times = AllStageTimes; NULL != times; times = times->next) {
+        for (int i = 0; i < NumAlignmentStages; i++) {
+            times->nanos[i] = times->count[i] = 0;
+            for (int j = 0; j < NumHardwareCounters; j++) {
+                times->hardwareCounts[i][j] = 0;
+            }
+        }
+    }
+}
+
+    void
+PrintStageTimes(_int64 nReads)
+/*++
+
+Routine Description:
+
+    Print the time in each stage summed over all threads, and the hardware counts per read if there are any.  Threads
+    that are still running (the compressors, say) may be part way through updating theirs, so those can be a little
+    off.
+
+--*/
+{
+    _int64 nanos[NumAlignmentStages], count[NumAlignmentStages];
+    _int64 hardwareCounts[NumAlignmentStages][NumHardwareCounters];
+    _int64 totalNanos = 0;
+    for (int i = 0; i < NumAlignmentStages; i++) {
+        nanos[i] = count[i] = 0;
+        for (int j = 0; j < NumHardwareCounters; j++) {
+            hardwareCounts[i][j] = 0;
+        }
+    }
+
+    for (StageTimes *times = AllStageTimes; NULL != times; times = times->next) {
+        for (int i = 0; i < NumAlignmentStages; i++) {
+            nanos[i] += times->nanos[i];
+            count[i] += times->count[i];
+            for (int j = 0; j < NumHardwareCounters; j++) {
+                hardwareCounts[i][j] += times->hardwareCounts[i][j];
+            }
+        }
+    }
+
+    for (int i = 0; i < NumAlignmentStages; i++) {
+        totalNanos += nanos[i];
+    }
+
+    WriteStatusMessage("Time by stage, summed over threads:\nstage\tthread seconds\t%% of total\tcount\tns each\n");
+    for (int i = 0; i < NumAlignmentStages; i++) {
+        WriteStatusMessage("%s\t%.3f\t%.1f%%\t%lld\t%lld\n", StageNames[i], nanos[i] / 1e9, 100.0 * nanos[i] / __max(totalNanos, (_int64)1),
+            count[i], nanos[i] / __max(count[i], (_int64)1));
+    }
+
+    bool anyHardwareCounters = false;
+    for (int j = 0; j < NumHardwareCounters; j++) {
+        anyHardwareCounters |= HardwareCounterOpened[j];
+    }
+
+    if (!anyHardwareCounters || !HardwareCountersEnabled) {
+        return;
+    }
+
+    WriteStatusMessage("Hardware counters by stage, per read (over %lld reads):\nstage", nReads);
+    for (int j = 0; j < NumHardwareCounters; j++) {
+        WriteStatusMessage("\t%s", HardwareCounterNames[j]);
+    }
+    WriteStatusMessage("\tIPC\n");
+
+    for (int i = 0; i < NumAlignmentStages; i++) {
+        WriteStatusMessage("%s", StageNames[i]);
+        for (int j = 0; j < NumHardwareCounters; j++) {
+            if (HardwareCounterOpened[j]) {
+                WriteStatusMessage("\t%.1f", (double)hardwareCounts[i][j] / __max(nReads, (_int64)1));
+            } else {
+                WriteStatusMessage("\tn/a");
+            }
+        }
+        if (HardwareCounterOpened[CyclesCounter] && HardwareCounterOpened[InstructionsCounter] && 0 != hardwareCounts[i][CyclesCounter]) {
+            WriteStatusMessage("\t%.2f\n", (double)hardwareCounts[i][InstructionsCounter] / hardwareCounts[i][CyclesCounter]);
+        } else {
+            WriteStatusMessage("\tn/a\n");
+        }
+    }
+}
+
+#else   // STAGE_TIMING
+
+    void
+ResetStageTimes()
+{
+}
+
+    void
+PrintStageTimes(_int64 nReads)
+{
+}
+
+    bool
+EnableHardwareCounters(bool enable)
+{
+    if (enable) {
+        WriteErrorMessage("Hardware performance counters (-hwc) need SNAP built with STAGE_TIMING (make STAGE_TIMING=1)\n");
+        return false;
+    }
+    return true;
+}
+
+#endif  // STAGE_TIMING
@@ -0,0 +1,180 @@
+/*++
+
+Module Name:
+
+    StageTiming.h
+
+Abstract:
+
+    A breakdown of where alignment time goes, by stage: seed lookup, candidate management, LV scoring, MAPQ, CIGAR
+    computation, formatting output, compressing it, and waiting for writes and for reads.  It costs two clock reads
+    per timed span, so it's compiled in only when STAGE_TIMING is set (make STAGE_TIMING=1); otherwise the macros
+    are empty.  The totals for all threads are printed with the alignment statistics.
+
+    The counts are per thread, so they're updated without interlocked operations.  The times are exclusive: a stage
+    timed inside another (say CIGAR computation inside formatting, or a write wait inside it when the buffer fills)
+    is taken out of the outer one, so the stages add up to the time spent in them.  "Candidates" times all of the
+    aligners' work, so it's what's left of that once the lookups, LV and MAPQ are taken out.
+
+    With -hwc, each timed span also reads the thread's hardware performance counters (cycles, instructions, last
+    level cache misses, dTLB misses and branch mispredicts) with perf_event_open, so they're broken down by stage the
+    same way and printed per read.  That's a system call at each end of a span, so it slows things down more than the
+    timing alone does, but the counts are only of user mode work.  It's Linux only, and needs perf_event_paranoid to
+    allow it (and hardware that the kernel exposes counters for, which most virtual machines don't).
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+#ifndef STAGE_TIMING
+#define STAGE_TIMING    0
+#endif  // STAGE_TIMING
+
+enum AlignmentStage {
+    SeedLookupStage,
+    CandidateStage,
+    LVStage,
+    MapqStage,
+    CigarStage,
+    FormatStage,
+    CompressStage,
+    WriteWaitStage,
+    ReadWaitStage,
+    NumAlignmentStages
+};
+
+//
+// Zero the counts (at the start of an alignment) and print their totals for all threads.  nReads is what the hardware
+// counters are averaged over.
+//
+void ResetStageTimes();
+void PrintStageTimes(_int64 nReads);
+
+//
+// Turn the hardware counters on or off for timers started from now on.  Returns false if they can't be used here.
+//
+bool EnableHardwareCounters(bool enable);
+
+#if STAGE_TIMING
+
+class StageTimer;
+
+enum HardwareCounter {
+    CyclesCounter,
+    InstructionsCounter,
+    LLCMissesCounter,
+    DTLBMissesCounter,
+    BranchMissesCounter,
+    NumHardwareCounters
+};
+
+extern volatile bool HardwareCountersEnabled;
+
+//
+// Read the calling thread's counters into values, opening them if this is the thread's first time.  Counters that
+// couldn't be opened read as 0.  Returns false if the thread has none.
+//
+bool ReadHardwareCounters(_int64 *values);
+
+//
+// One thread's times.  They're on a list that's never freed, so that what a thread did still counts once it's gone.
+//
+struct StageTimes {
+    _int64          nanos[NumAlignmentStages];
+    _int64          count[NumAlignmentStages];
+    _int64          hardwareCounts[NumAlignmentStages][NumHardwareCounters];
+    StageTimer     *current;                        // The innermost timer running on the thread
+    StageTimes     *next;
+};
+
+StageTimes *GetStageTimesForNewThread();
+
+extern thread_local StageTimes *ThreadStageTimes;
+
+inline StageTimes *GetThreadStageTimes()
+{
+    if (NULL == ThreadStageTimes) {
+        ThreadStageTimes = GetStageTimesForNewThread();
+    }
+    return ThreadStageTimes;
+}
+
+//
+// Add time that's already been measured, which is how the places that keep their own wait times report them.
+//
+inline void AddStageTime(AlignmentStage stage, _int64 nanos);
+
+class StageTimer {
+public:
+    StageTimer(AlignmentStage i_stage) : stage(i_stage), running(true) {
+        StageTimes *times = GetThreadStageTimes();
+        outer = times->current;
+        times->current = this;
+        countingHardware = HardwareCountersEnabled && ReadHardwareCounters(startCounts);
+        start = timeInNanos();
+    }
+
+    ~StageTimer() {
+        stop();
+    }
+
+    void stop() {
+        if (running) {
+            running = false;
+            StageTimes *times = ThreadStageTimes;
+            _ASSERT(times->current == this);    // Timers have to stop innermost first
+            times->current = outer;
+            AddStageTime(stage, timeInNanos() - start);
+
+            _int64 counts[NumHardwareCounters];
+            if (countingHardware && ReadHardwareCounters(counts)) {
+                for (int i = 0; i < NumHardwareCounters; i++) {
+                    times->hardwareCounts[stage][i] += counts[i] - startCounts[i];
+                    if (NULL != outer) {
+                        times->hardwareCounts[outer->stage][i] -= counts[i] - startCounts[i];
+                    }
+                }
+            }
+        }
+    }
+
+    AlignmentStage  stage;
+
+private:
+    _int64          start;
+    StageTimer     *outer;
+    bool            running;
+    bool            countingHardware;
+    _int64          startCounts[NumHardwareCounters];
+};
+
+inline void AddStageTime(AlignmentStage stage, _int64 nanos)
+{
+    StageTimes *times = GetThreadStageTimes();
+    times->nanos[stage] += nanos;
+    times->count[stage]++;
+    if (NULL != times->current) {
+        times->nanos[times->current->stage] -= nanos;
+    }
+}
+
+//
+// TIME_STAGE times the rest of the enclosing block, or until END_STAGE if that comes first.
+//
+#define TIME_STAGE(stage)               StageTimer stageTimer##stage(stage)
+#define END_STAGE(stage)                stageTimer##stage.stop()
+#define ADD_STAGE_TIME(stage, nanos)    AddStageTime(stage, nanos)
+
+#else   // STAGE_TIMING
+
+#define TIME_STAGE(stage)
+#define END_STAGE(stage)
+#define ADD_STAGE_TIME(stage, nanos)
+
+#endif  // STAGE_TIMING
@@ -0,0 +1,248 @@
+/*++
+
+Module Name:
+
+    UmiConsensus.cpp
+
+Abstract:
+
+    Collapsing reads with the same UMI into consensus reads before aligning them.  See UmiConsensus.h.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "UmiConsensus.h"
+#include "Error.h"
+#include "Util.h"
+
+using std::string;
+using std::vector;
+
+UmiConsensusBuilder::UmiConsensusBuilder(int i_umiField, int i_prefixLength, int i_nMates) :
+    umiField(i_umiField), prefixLength(i_prefixLength), nMates(i_nMates), nInput(0), nextFamily(0)
+{
+}
+
+    void
+UmiConsensusBuilder::add(Read **reads)
+{
+    string key;
+    const char *umi;
+    unsigned umiLength;
+    if (reads[0]->getIdField(umiField, &umi, &umiLength)) {
+        key.assign(umi, umiLength);
+        for (int mate = 0; mate < nMates; mate++) {
+            key += '\t';
+            key.append(reads[mate]->getData(), __min(reads[mate]->getDataLength(), (unsigned)prefixLength));
+        }
+    } else {
+        //
+        // No UMI, so it's a family by itself.  UMIs don't have newlines in them.
+        //
+        char ordinal[32];
+        snprintf(ordinal, sizeof(ordinal), "\n%lld", nInput);
+        key = ordinal;
+    }
+    nInput++;
+
+    std::unordered_map<string, size_t>::iterator it = familyByKey.find(key);
+    size_t whichFamily;
+    if (it == familyByKey.end()) {
+        whichFamily = families.size();
+        familyByKey[key] = whichFamily;
+        families.push_back(Family());
+        for (int mate = 0; mate < nMates; mate++) {
+            families[whichFamily].id[mate].assign(reads[mate]->getId(), reads[mate]->getIdLength());
+        }
+        families[whichFamily].size = 0;
+    } else {
+        whichFamily = it->second;
+    }
+
+    Family &family = families[whichFamily];
+    for (int mate = 0; mate < nMates; mate++) {
+        family.bases[mate].push_back(string(reads[mate]->getData(), reads[mate]->getDataLength()));
+        family.qualities[mate].push_back(string(reads[mate]->getQuality(), reads[mate]->getDataLength()));
+    }
+    family.size++;
+}
+
+    void
+UmiConsensusBuilder::buildConsensus(vector<string> &bases, vector<string> &qualities)
+{
+    if (bases.size() == 1) {
+        return;
+    }
+
+    size_t length = 0;
+    for (size_t member = 0; member < bases.size(); member++) {
+        length = __max(length, bases[member].size());
+    }
+
+    string consensusBases(length, 'N');
+    string consensusQualities(length, '#');
+    for (size_t i = 0; i < length; i++) {
+        int score[4] = {0, 0, 0, 0};
+        int total = 0;
+        for (size_t member = 0; member < bases.size(); member++) {
+            if (i >= bases[member].size()) {
+                continue;
+            }
+            int value = BASE_VALUE[(unsigned char)bases[member][i]];
+            if (value < 4) {
+                int quality = qualities[member][i] - '!';
+                score[value] += quality;
+                total += quality;
+            }
+        }
+
+        int best = 0;
+        for (int value = 1; value < 4; value++) {
+            if (score[value] > score[best]) {
+                best = value;
+            }
+        }
+
+        int margin = score[best] - (total - score[best]);
+        if (margin > 0) {
+            consensusBases[i] = VALUE_BASE[best];
+            consensusQualities[i] = (char)('!' + __min(margin, MaxConsensusQuality));
+        }
+    }
+
+    bases.assign(1, consensusBases);
+    qualities.assign(1, consensusQualities);
+}
+
+    void
+UmiConsensusBuilder::build()
+{
+    familyByKey.clear();
+    for (size_t whichFamily = 0; whichFamily < families.size(); whichFamily++) {
+        for (int mate = 0; mate < nMates; mate++) {
+            buildConsensus(families[whichFamily].bases[mate], families[whichFamily].qualities[mate]);
+        }
+    }
+}
+
+    bool
+UmiConsensusBuilder::getNext(Read **reads, const ReaderContext *context)
+{
+    _int64 whichFamily = InterlockedAdd64AndReturnNewValue(&nextFamily, 1) - 1;
+    if (whichFamily >= (_int64)families.size()) {
+        return false;
+    }
+
+    const Family &family = families[whichFamily];
+    for (int mate = 0; mate < nMates; mate++) {
+        reads[mate]->init(family.id[mate].c_str(), (unsigned)family.id[mate].size(), family.bases[mate][0].c_str(),
+            family.qualities[mate][0].c_str(), (unsigned)family.bases[mate][0].size());
+        reads[mate]->clip(context->clipping);
+        reads[mate]->setReadGroup(context->defaultReadGroup);
+        reads[mate]->setConsensusFamilySize(family.size);
+    }
+    return true;
+}
+
+class UmiConsensusReadSupplier : public ReadSupplier {
+public:
+    UmiConsensusReadSupplier(UmiConsensusBuilder *i_builder, const ReaderContext *i_context) : builder(i_builder), context(i_context) {}
+
+    virtual Read *getNextRead() {
+        Read *reads[1] = {&read};
+        return builder->getNext(reads, context) ? &read : NULL;
+    }
+
+    virtual void holdBatch(DataBatch batch) {}
+    virtual bool releaseBatch(DataBatch batch) {return true;}
+
+private:
+    UmiConsensusBuilder    *builder;
+    const ReaderContext    *context;
+    Read                    read;
+};
+
+class UmiConsensusPairedReadSupplier : public PairedReadSupplier {
+public:
+    UmiConsensusPairedReadSupplier(UmiConsensusBuilder *i_builder, const ReaderContext *i_context) : builder(i_builder), context(i_context) {}
+
+    virtual bool getNextReadPair(Read **read0, Read **read1) {
+        Read *reads[NUM_READS_PER_PAIR] = {&mates[0], &mates[1]};
+        *read0 = &mates[0];
+        *read1 = &mates[1];
+        return builder->getNext(reads, context);
+    }
+
+    virtual void holdBatch(DataBatch batch) {}
+    virtual bool releaseBatch(DataBatch batch) {return true;}
+
+private:
+    UmiConsensusBuilder    *builder;
+    const ReaderContext    *context;
+    Read                    mates[NUM_READS_PER_PAIR];
+};
+
+static void ReportCollapse(const UmiConsensusBuilder &builder, const char *unit, _int64 startTime)
+{
+    WriteStatusMessage("Collapsed %lld %ss into %lld UMI consensus %ss (%.2fx) in %llds\n", builder.getInputCount(), unit,
+        builder.getFamilyCount(), unit, builder.getFamilyCount() == 0 ? 0.0 : (double)builder.getInputCount() / builder.getFamilyCount(),
+        (timeInMillis() + 500 - startTime) / 1000);
+}
+
+UmiConsensusReadSupplierGenerator::UmiConsensusReadSupplierGenerator(ReadSupplierGenerator *i_inner, int umiField, int prefixLength) :
+    inner(i_inner), builder(umiField, prefixLength, 1)
+{
+    _int64 startTime = timeInMillis();
+    ReadSupplier *supplier = inner->generateNewReadSupplier();
+    if (NULL != supplier) {
+        Read *read;
+        while (NULL != (read = supplier->getNextRead())) {
+            builder.add(&read);
+        }
+        delete supplier;
+    }
+    builder.build();
+    ReportCollapse(builder, "read", startTime);
+}
+
+UmiConsensusReadSupplierGenerator::~UmiConsensusReadSupplierGenerator()
+{
+    delete inner;
+}
+
+    ReadSupplier *
+UmiConsensusReadSupplierGenerator::generateNewReadSupplier()
+{
+    return new UmiConsensusReadSupplier(&builder, inner->getContext());
+}
+
+UmiConsensusPairedReadSupplierGenerator::UmiConsensusPairedReadSupplierGenerator(PairedReadSupplierGenerator *i_inner, int umiField, int prefixLength) :
+    inner(i_inner), builder(umiField, prefixLength, NUM_READS_PER_PAIR)
+{
+    _int64 startTime = timeInMillis();
+    PairedReadSupplier *supplier = inner->generateNewPairedReadSupplier();
+    if (NULL != supplier) {
+        Read *reads[NUM_READS_PER_PAIR];
+        while (supplier->getNextReadPair(&reads[0], &reads[1])) {
+            builder.add(reads);
+        }
+        delete supplier;
+    }
+    builder.build();
+    ReportCollapse(builder, "pair", startTime);
+}
+
+UmiConsensusPairedReadSupplierGenerator::~UmiConsensusPairedReadSupplierGenerator()
+{
+    delete inner;
+}
+
+    PairedReadSupplier *
+UmiConsensusPairedReadSupplierGenerator::generateNewPairedReadSupplier()
+{
+    return new UmiConsensusPairedReadSupplier(&builder, inner->getContext());
+}
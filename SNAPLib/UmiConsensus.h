@@ -0,0 +1,112 @@
+/*++
+
+Module Name:
+
+    UmiConsensus.h
+
+Abstract:
+
+    Collapsing reads (or pairs) with the same UMI into one consensus read before aligning them (-umi).  Deep UMI panels
+    have tens of copies of each molecule, and collapsing them after alignment means aligning every copy.  Instead,
+    these generators read all of the input up front, group the reads by their UMI and the first -umiPrefix bases of
+    each mate (so that UMI collisions between different molecules mostly stay apart), and hand out one consensus read
+    per group for the aligner.  The output has a record per family, named after its first read and tagged with the
+    family size in cD:i (as fgbio does).
+
+    The UMI is a ':' separated field of the read name, counting from the end, so -umi 1 takes bcl2fastq's
+    "...:<x>:<y>:<UMI>".  A read without enough fields is a family of its own.
+
+    At each position the consensus takes the base with the most total quality behind it, with a quality of that less
+    the quality of the bases that disagree (capped at MaxConsensusQuality), or N if nothing has more than that.
+    Families of one pass through as they are.
+
+    Since a read can't be collapsed until the rest of its family has been seen, all of the input is held in memory
+    (once) while the families are built, and the read group and optional fields of SAM and BAM input aren't carried
+    over.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Read.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+class UmiConsensusBuilder {
+public:
+    UmiConsensusBuilder(int i_umiField, int i_prefixLength, int i_nMates);
+
+    //
+    // Add a read (nMates of them for a pair) to its family.  The builder keeps its own copy.
+    //
+    void add(Read **reads);
+
+    //
+    // Once all of the reads are in, replace each family with its consensus.
+    //
+    void build();
+
+    //
+    // Claim the next consensus to align and point reads (nMates of them) at it, returning false when they're all taken.
+    // Thread safe.
+    //
+    bool getNext(Read **reads, const ReaderContext *context);
+
+    _int64 getInputCount() const {return nInput;}
+    _int64 getFamilyCount() const {return (_int64)families.size();}
+
+    static const int MaxConsensusQuality = 60;
+
+private:
+    void buildConsensus(std::vector<std::string> &bases, std::vector<std::string> &qualities);
+
+    struct Family {
+        std::string                 id[NUM_READS_PER_PAIR];
+        std::vector<std::string>    bases[NUM_READS_PER_PAIR];      // Of each member, and then just the consensus
+        std::vector<std::string>    qualities[NUM_READS_PER_PAIR];
+        unsigned                    size;
+    };
+
+    int                                         umiField;
+    int                                         prefixLength;
+    int                                         nMates;
+    _int64                                      nInput;
+    std::unordered_map<std::string, size_t>     familyByKey;
+    std::vector<Family>                         families;
+    volatile _int64                             nextFamily;
+};
+
+class UmiConsensusReadSupplierGenerator : public ReadSupplierGenerator {
+public:
+    //
+    // Reads all of inner's reads, and takes ownership of it.
+    //
+    UmiConsensusReadSupplierGenerator(ReadSupplierGenerator *i_inner, int umiField, int prefixLength);
+    virtual ~UmiConsensusReadSupplierGenerator();
+
+    virtual ReadSupplier *generateNewReadSupplier();
+    virtual ReaderContext* getContext() {return inner->getContext();}
+
+private:
+    ReadSupplierGenerator  *inner;
+    UmiConsensusBuilder     builder;
+};
+
+class UmiConsensusPairedReadSupplierGenerator : public PairedReadSupplierGenerator {
+public:
+    UmiConsensusPairedReadSupplierGenerator(PairedReadSupplierGenerator *i_inner, int umiField, int prefixLength);
+    virtual ~UmiConsensusPairedReadSupplierGenerator();
+
+    virtual PairedReadSupplier *generateNewPairedReadSupplier();
+    virtual ReaderContext* getContext() {return inner->getContext();}
+
+private:
+    PairedReadSupplierGenerator    *inner;
+    UmiConsensusBuilder             builder;
+};
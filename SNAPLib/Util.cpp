@@ -177,16 +177,46 @@ char *FormatUIntWithCommas(_uint64 val, char *outputBuffer, size_t outputBufferS
 	return outputBuffer;
 }
 
+static const char DigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869"
+    "707172737475767778798081828384858687888990919293949596979899";
+
+int FormatUInt(_uint64 val, char *outputBuffer)
+{
+    int nDigits = 1;
+    for (_uint64 power = 10; nDigits < 20 && val >= power; power *= 10) {
+        nDigits++;
+    }
+
+    char *p = outputBuffer + nDigits;
+    while (val >= 100) {
+        unsigned pair = (unsigned)(val % 100);
+        val /= 100;
+        p -= 2;
+        memcpy(p, DigitPairs + 2 * pair, 2);
+    }
+    if (val >= 10) {
+        memcpy(p - 2, DigitPairs + 2 * val, 2);
+    } else {
+        p[-1] = (char)('0' + val);
+    }
+
+    return nDigits;
+}
+
+int FormatInt(_int64 val, char *outputBuffer)
+{
+    if (val < 0) {
+        *outputBuffer = '-';
+        return 1 + FormatUInt(0 - (_uint64)val, outputBuffer + 1);
+    }
+    return FormatUInt((_uint64)val, outputBuffer);
+}
+
 //
 // Version of fgets that dynamically (re-)allocates the buffer to be big enough to fit the whole line
 //
 
-class FgetsObject
-{
-public:
-    virtual char *fgets(char *s, int size) = 0;
-};
-
 char *genericReallocatingFgets(char **buffer, int *io_bufferSize, FgetsObject *getsObject)
 {
     if (*io_bufferSize == 0) {
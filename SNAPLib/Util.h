@@ -495,6 +495,13 @@ void memrevcpy(void* dst, const void* src, size_t bytes);
 
 } // namespace util
 
+//
+// Write the value in decimal, two digits at a time, with no null at the end.  Returns the number of characters written,
+// which is at most 20 (21 for a negative FormatInt).  These are for the writers; printf is a lot slower.
+//
+extern int FormatUInt(_uint64 val, char *outputBuffer);
+extern int FormatInt(_int64 val, char *outputBuffer);
+
 _int64 FirstPowerOf2GreaterThanOrEqualTo(_int64 value);
 int cheezyLogBase2(_int64 value);
 
@@ -541,6 +548,17 @@ private:
 // Version of fgets that dynamically (re-)allocates the buffer to be big enough to fit the whole line
 //
 char *reallocatingFgets(char **buffer, int *io_bufferSize, FILE *stream);
+
+//
+// The same thing for any kind of stream that has an fgets.
+//
+class FgetsObject
+{
+public:
+    virtual char *fgets(char *s, int size) = 0;
+};
+
+char *genericReallocatingFgets(char **buffer, int *io_bufferSize, FgetsObject *getsObject);
 char *reallocatingFgetsGenericFile(char **buffer, int *io_bufferSize, GenericFile *file);
 
 
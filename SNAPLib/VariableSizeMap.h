@@ -3,6 +3,7 @@
 #include "Compat.h"
 #include "BigAlloc.h"
 #include "VariableSizeVector.h"
+#include "Simd.h"
 
 //
 // A hash function for numeric types.
@@ -421,6 +422,340 @@ public:
 
 typedef VariableSizeMap<unsigned,unsigned> IdMap;
 typedef VariableSizeMap<unsigned,int> IdIntMap;
+
+//
+// A single-valued map with the same interface as VariableSizeMap, laid out as a Swiss table.  Each slot has a control
+// byte, which is either 7 bits of its key's hash or a mark that it's empty or deleted, and the slots are probed a
+// group of 16 at a time with one SSE2 compare of the control bytes.  Only the slots whose hash bits match get their
+// keys compared, and a lookup stops at the first group with an empty slot, so probing stays short even when it's
+// nearly full.  Erasing leaves a deleted mark only if the group had no empty slot (since then a probe might have gone
+// past it); otherwise the slot is simply empty again.  clear() only has to reset the control bytes, and no key value
+// is reserved for empty or deleted slots.
+//
+template< typename K, typename V, int growth = 150, typename Hash = MapNumericHash<K>, int fill = 85, bool _big = false >
+class VariableSizeGroupMap
+{
+public:
+    typedef VariableSizeMapEntry<K,V> Entry;
+
+    typedef Entry* iterator;
+
+    VariableSizeGroupMap(int i_capacity = 16)
+        : entries(NULL), control(NULL), capacity(0), count(0), occupied(0), limit(0)
+    {
+        reserve(i_capacity);
+    }
+
+    // like VariableSizeMap, copying takes the other map's entries
+    VariableSizeGroupMap(const VariableSizeGroupMap& other)
+        : entries(NULL), control(NULL), capacity(0), count(0), occupied(0), limit(0)
+    {
+        assign((VariableSizeGroupMap*)&other);
+    }
+
+    inline void operator=(const VariableSizeGroupMap& other)
+    {
+        assign((VariableSizeGroupMap*)&other);
+    }
+
+    ~VariableSizeGroupMap()
+    {
+        release();
+    }
+
+    inline int size()
+    { return count; }
+
+    inline int getCapacity()
+    { return capacity; }
+
+    void reserve(int larger)
+    {
+        Entry* oldEntries = entries;
+        _uint8* oldControl = control;
+        int small = capacity;
+        capacity = (max(larger, (int) GroupSize) + GroupSize - 1) / GroupSize * GroupSize;
+        if (_big) {
+            entries = (Entry*) BigAlloc((size_t) capacity * sizeof(Entry));
+            control = (_uint8*) BigAlloc(capacity);
+        } else {
+            entries = new Entry[capacity];
+            control = new _uint8[capacity];
+        }
+        clear();
+        // always leave an empty slot, so that probing for a missing key stops
+        limit = growth == 0 ? capacity - 1 : min(capacity - 1, (int) (((_int64) capacity * fill) / 100));
+        _ASSERT(limit > 0);
+        if (oldEntries != NULL) {
+            for (int i = 0; i < small; i++) {
+                if (isFull(oldControl[i])) {
+                    _uint64 h = fullHash(oldEntries[i].key);
+                    int slot = findFreeSlot(h);
+                    control[slot] = tag(h);
+                    entries[slot].key = oldEntries[i].key;
+                    entries[slot].value = oldEntries[i].value;
+                    count++;
+                }
+            }
+            occupied = count;
+            deallocate(oldEntries, oldControl);
+        }
+    }
+
+    void clear()
+    {
+        if (control != NULL) {
+            memset(control, Empty, capacity);
+        }
+        count = occupied = 0;
+    }
+
+    iterator begin()
+    {
+        return next(&entries[-1]);
+    }
+
+    iterator next(iterator x)
+    {
+        Entry* final = &entries[capacity];
+        if (x < final) {
+            do {
+                x++;
+            } while (x < final && ! isFull(control[x - entries]));
+        }
+        return x;
+    }
+
+    iterator end()
+    {
+        return &entries[capacity];
+    }
+
+    iterator find(K key)
+    {
+        Entry* p = lookup(key);
+        return p != NULL ? p : end();
+    }
+
+    inline bool tryGet(K key, V* o_value)
+    {
+        Entry* p = lookup(key);
+        if (p != NULL) {
+            *o_value = p->value;
+        }
+        return p != NULL;
+    }
+
+    inline V* tryFind(K key)
+    {
+        Entry* p = lookup(key);
+        return p != NULL ? &p->value : NULL;
+    }
+
+    inline V get(K key)
+    {
+        Entry* p = lookup(key);
+        _ASSERT(p != NULL);
+        return p->value;
+    }
+
+    bool erase(K key)
+    {
+        Entry* p = lookup(key);
+        if (p == NULL) {
+            return false;
+        }
+        int slot = (int) (p - entries);
+        if (matchByte(control + slot / GroupSize * GroupSize, Empty) != 0) {
+            control[slot] = Empty;
+            occupied--;
+        } else {
+            control[slot] = Deleted;
+        }
+        count--;
+        return true;
+    }
+
+    inline V& operator[](K key)
+    {
+        Entry* p = lookup(key);
+        _ASSERT(p != NULL);
+        return p->value;
+    }
+
+    inline void put(K key, V value)
+    {
+        V* p;
+        if (! tryAdd(key, value, &p)) {
+            *p = value;
+        }
+    }
+
+    inline V* getOrAdd(K key)
+    {
+        V* p = tryFind(key);
+        if (p == NULL) {
+            tryAdd(key, V(), &p);
+        }
+        return p;
+    }
+
+    inline bool tryAdd(K key, V value, V** o_pvalue)
+    {
+        Entry* p = lookup(key);
+        if (p != NULL) {
+            *o_pvalue = &p->value;
+            return false;
+        }
+        _uint64 h = fullHash(key);
+        int slot = findFreeSlot(h);
+        if (control[slot] == Empty && occupied >= limit) {
+            //
+            // Out of empty slots.  If it's mostly deleted ones, rehashing at the same size gets them back.
+            //
+            reserve(count < limit / 2 || growth == 0 ? capacity : (int) min((_int64) INT32_MAX, ((_int64) capacity * growth) / 100));
+            slot = findFreeSlot(h);
+        }
+        occupied += control[slot] == Empty;
+        control[slot] = tag(h);
+        entries[slot].key = key;
+        entries[slot].value = value;
+        count++;
+        *o_pvalue = &entries[slot].value;
+        return true;
+    }
+
+    void exchange(VariableSizeGroupMap& other)
+    {
+        Entry* e = entries; entries = other.entries; other.entries = e;
+        _uint8* c = control; control = other.control; other.control = c;
+        int x = capacity; capacity = other.capacity; other.capacity = x;
+        x = count; count = other.count; other.count = x;
+        x = limit; limit = other.limit; other.limit = x;
+        x = occupied; occupied = other.occupied; other.occupied = x;
+    }
+
+private:
+
+    static const int GroupSize = 16;
+    static const _uint8 Empty = 0x80;
+    static const _uint8 Deleted = 0xfe; // full slots have the top bit clear
+
+    static inline bool isFull(_uint8 c)
+    { return (c & 0x80) == 0; }
+
+    // mix the bits of a weak hash like MapNumericHash's, since both ends of it get used
+    inline _uint64 fullHash(K key)
+    { return (_uint64) hash(key) * 0x9e3779b97f4a7c15ull; }
+
+    static inline _uint8 tag(_uint64 h)
+    { return (_uint8) (h >> 57); }
+
+    inline int homeGroup(_uint64 h) const
+    { return (int) ((h >> 7) % (_uint64) (capacity / GroupSize)); }
+
+    // bit i set if control byte i of the group is c
+    static inline unsigned matchByte(const _uint8* group, _uint8 c)
+    {
+        return Vector16MoveMask(Vector16Equal(Vector16Load(group), Vector16Set1((char) c)));
+    }
+
+    // bit i set if slot i of the group is empty or deleted
+    static inline unsigned matchFree(const _uint8* group)
+    {
+        return Vector16MoveMask(Vector16Load(group));
+    }
+
+    static inline int firstMatch(unsigned matches)
+    {
+        unsigned long index;
+        CountTrailingZeroes((_uint64) matches, index);
+        return (int) index;
+    }
+
+    Entry* lookup(K key)
+    {
+        if (entries == NULL) {
+            reserve(capacity); // it was assigned away
+        }
+        _uint64 h = fullHash(key);
+        _uint8 t = tag(h);
+        int groups = capacity / GroupSize;
+        int group = homeGroup(h);
+        for (int probe = 0; probe < groups; probe++) {
+            const _uint8* c = control + group * GroupSize;
+            for (unsigned matches = matchByte(c, t); matches != 0; matches &= matches - 1) {
+                Entry* p = &entries[group * GroupSize + firstMatch(matches)];
+                if (p->key == key) {
+                    return p;
+                }
+            }
+            if (matchByte(c, Empty) != 0) {
+                return NULL;
+            }
+            group = group + 1 == groups ? 0 : group + 1;
+        }
+        return NULL;
+    }
+
+    // the first empty or deleted slot along the probe sequence for a hash; there's always an empty one
+    int findFreeSlot(_uint64 h)
+    {
+        int groups = capacity / GroupSize;
+        int group = homeGroup(h);
+        while (true) {
+            unsigned matches = matchFree(control + group * GroupSize);
+            if (matches != 0) {
+                return group * GroupSize + firstMatch(matches);
+            }
+            group = group + 1 == groups ? 0 : group + 1;
+        }
+    }
+
+    void deallocate(Entry* e, _uint8* c)
+    {
+        if (e != NULL) {
+            if (_big) {
+                BigDealloc(e);
+                BigDealloc(c);
+            } else {
+                delete [] e;
+                delete [] c;
+            }
+        }
+    }
+
+    void release()
+    {
+        deallocate(entries, control);
+        entries = NULL;
+        control = NULL;
+        count = occupied = 0;
+    }
+
+    void assign(VariableSizeGroupMap* other)
+    {
+        release();
+        entries = other->entries;
+        control = other->control;
+        capacity = other->capacity;
+        count = other->count;
+        occupied = other->occupied;
+        limit = other->limit;
+        hash = other->hash;
+        other->entries = NULL;
+        other->control = NULL;
+        other->count = other->occupied = 0;
+    }
+
+    Entry* entries;
+    _uint8* control; // a byte for each entry
+    int capacity; // a multiple of GroupSize
+    int count;
+    int occupied; // number of slots that aren't empty (includes deleted ones)
+    int limit; // current limit (capacity * fill / 100)
+    Hash hash;
+};
 // 
 // Single-valued map
 //
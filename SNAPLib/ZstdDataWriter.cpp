@@ -0,0 +1,414 @@
+/*++
+
+Module Name:
+
+    ZstdDataWriter.cpp
+
+Abstract:
+
+    File writer that compresses data into zstd frames.
+
+Environment:
+
+    User mode service.
+
+    Not thread safe.
+
+--*/
+
+#include "stdafx.h"
+#include "ZstdDataWriter.h"
+#include "BigAlloc.h"
+#include "VariableSizeVector.h"
+#include "ParallelTask.h"
+#include "exit.h"
+#include "Error.h"
+#include "ProgressReport.h"
+#include "StageTiming.h"
+#include "PipelineTrace.h"
+#ifdef SNAP_ZSTD
+#include <zstd.h>
+#endif // SNAP_ZSTD
+
+using std::min;
+using std::max;
+
+#ifdef SNAP_ZSTD
+
+class ZstdCompressWorkerManager : public ParallelWorkerManager
+{
+public:
+    ZstdCompressWorkerManager(ZstdWriterFilterSupplier* i_filterSupplier)
+        : filterSupplier(i_filterSupplier), buffer(NULL),
+        chunkSize(i_filterSupplier->chunkSize), inputChunkSize(i_filterSupplier->inputChunkSize),
+        level(i_filterSupplier->compressionLevel)
+    {}
+
+    virtual ~ZstdCompressWorkerManager();
+
+    virtual void initialize(void* i_encoder);
+
+    virtual ParallelWorker* createWorker();
+
+    virtual void beginStep();
+
+    virtual void finishStep();
+
+private:
+    VariableSizeVector<size_t> sizes;
+    volatile int nChunks;
+    const size_t chunkSize; // room for each compressed chunk in buffer
+    const size_t inputChunkSize;
+    const int level;
+    FileEncoder* encoder;
+    ZstdWriterFilterSupplier* filterSupplier;
+    char* input;
+    size_t inputSize;
+    size_t inputUsed;
+    char* buffer;
+    VariableSizeVector<ZstdChunkTranslation> translation;
+
+    friend class ZstdCompressWorker;
+};
+
+class ZstdCompressWorker : public ParallelWorker
+{
+public:
+    ZstdCompressWorker() : cctx(ZSTD_createCCtx()) {}
+
+    virtual ~ZstdCompressWorker() { ZSTD_freeCCtx(cctx); }
+
+    virtual void step();
+
+private:
+    ZSTD_CCtx* cctx;
+};
+
+// used for case where each thread compresses by itself
+
+class ZstdWriterFilter : public DataWriter::Filter
+{
+public:
+    ZstdWriterFilter(ZstdWriterFilterSupplier* i_supplier)
+        : DataWriter::Filter(DataWriter::ResizeFilter), supplier(i_supplier), manager(NULL), worker(NULL), encoder(NULL)
+    {}
+
+    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, GenomeDistance bytes, GenomeLocation location) {}
+
+    virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes);
+
+private:
+
+    ZstdWriterFilterSupplier* supplier;
+    // if doing inline compression, filled in with minimally initialized objects
+    ZstdCompressWorkerManager* manager;
+    ParallelWorker* worker;
+    FileEncoder* encoder;
+};
+
+ZstdCompressWorkerManager::~ZstdCompressWorkerManager()
+{
+    if (buffer != NULL) {
+        BigDealloc(buffer);
+    }
+}
+
+    void
+ZstdCompressWorkerManager::initialize(
+    void* i_encoder)
+{
+    encoder = (FileEncoder*) i_encoder;
+}
+
+    ParallelWorker*
+ZstdCompressWorkerManager::createWorker()
+{
+    return new ZstdCompressWorker();
+}
+
+    void
+ZstdCompressWorkerManager::beginStep()
+{
+    encoder->getEncodeBatch(&input, &inputSize, &inputUsed);
+    nChunks = (int) ((inputUsed + inputChunkSize - 1) / inputChunkSize);
+    sizes.clear();
+    sizes.extend(nChunks);
+
+    if (buffer == NULL) {
+        buffer = (char*) BigAlloc(((inputSize + inputChunkSize - 1) / inputChunkSize) * chunkSize);
+    }
+}
+
+    void
+ZstdCompressWorkerManager::finishStep()
+{
+    size_t toUsed = 0, logicalOffset, physicalOffset, encodedBytes = 0;
+    for (int i = 0; i < nChunks; i++) {
+        encodedBytes += sizes[i];
+    }
+    encoder->getOffsets(encodedBytes, &logicalOffset, &physicalOffset);
+    for (int i = 0; i < nChunks; i++) {
+        ZstdChunkTranslation chunk = {logicalOffset, physicalOffset + toUsed, sizes[i]};
+        translation.push_back(chunk);
+        _ASSERT(sizes[i] <= chunkSize);
+        logicalOffset += min(inputChunkSize, inputUsed - i * inputChunkSize);
+        memcpy(input + toUsed, buffer + i * chunkSize, sizes[i]);
+        toUsed += sizes[i];
+    }
+    _ASSERT(toUsed <= inputSize); // (see ZstdWriterFilterSupplier::getBufferReserve)
+    encoder->setEncodedBatchSize(toUsed);
+    filterSupplier->addTranslations(&translation);
+    translation.clear();
+}
+
+    void
+ZstdCompressWorker::step()
+{
+    ZstdCompressWorkerManager* supplier = (ZstdCompressWorkerManager*) getManager();
+    TIME_STAGE(CompressStage);
+    _int64 start = timeInNanos();
+    int begin = (getThreadNum() * supplier->nChunks) / getNumThreads();
+    int end = ((1 + getThreadNum()) * supplier->nChunks) / getNumThreads();
+    for (int i = begin; i < end; i++) {
+        size_t bytes = min(supplier->inputChunkSize, supplier->inputUsed - i * supplier->inputChunkSize);
+        // (a frame of its own, with the content size in the header so it can be decompressed in parallel)
+        size_t status = ZSTD_compressCCtx(cctx, supplier->buffer + i * supplier->chunkSize, supplier->chunkSize,
+            supplier->input + i * supplier->inputChunkSize, bytes, supplier->level);
+        if (ZSTD_isError(status)) {
+            WriteErrorMessage("ZstdWriterFilter: compress failed: %s\n", ZSTD_getErrorName(status));
+            soft_exit(1);
+        }
+        supplier->sizes[i] = status;
+    }
+    InterlockedAdd64AndReturnNewValue(&ProgressReporter::CompressNanos, EndPipelineTraceSpan(CompressTraceEvent, start));
+}
+
+    size_t
+ZstdWriterFilter::onNextBatch(
+    DataWriter* writer,
+    size_t offset,
+    size_t bytes)
+{
+    char* fromBuffer;
+    size_t fromSize, fromUsed, physicalOffset, logicalOffset;
+    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, &physicalOffset, NULL, &logicalOffset);
+    if (fromUsed == 0 || supplier->multiThreaded) {
+        return fromUsed;
+    }
+    // do compress buffer synchronously in-place
+    if (manager == NULL) {
+        manager = new ZstdCompressWorkerManager(supplier);
+        worker = manager->createWorker();
+        encoder = new FileEncoder(0, false, manager);
+        encoder->initialize((AsyncDataWriter*) writer);
+        manager->initialize(encoder);
+        manager->configure(worker, 0, 1);
+    }
+    encoder->setupEncode(-1);
+    manager->beginStep();
+    worker->step();
+    manager->finishStep();
+    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, &physicalOffset, NULL, &logicalOffset);
+    return fromUsed;
+}
+
+    DataWriter::Filter*
+ZstdWriterFilterSupplier::getFilter()
+{
+    return new ZstdWriterFilter(this);
+}
+
+    ZstdWriterFilterSupplier*
+DataWriterSupplier::zstd(
+    bool multiThreaded,
+    int compressionLevel,
+    size_t chunkSize)
+{
+    return new ZstdWriterFilterSupplier(chunkSize, ZSTD_compressBound(chunkSize), multiThreaded, compressionLevel);
+}
+
+    FileEncoder*
+FileEncoder::zstd(
+    ZstdWriterFilterSupplier* filterSupplier,
+    int numThreads,
+    bool bindToProcessor)
+{
+    return new FileEncoder(numThreads, bindToProcessor, new ZstdCompressWorkerManager(filterSupplier));
+}
+
+class ZstdEncoderPool : public FileEncoderPool
+{
+public:
+    ZstdEncoderPool(ZstdWriterFilterSupplier* i_filterSupplier, int numThreads)
+        : FileEncoderPool(numThreads), filterSupplier(i_filterSupplier)
+    {}
+
+protected:
+    virtual ParallelWorkerManager* createManager()
+    { return new ZstdCompressWorkerManager(filterSupplier); }
+
+private:
+    ZstdWriterFilterSupplier* filterSupplier;
+};
+
+    FileEncoderPool*
+FileEncoderPool::zstd(
+    ZstdWriterFilterSupplier* filterSupplier,
+    int numThreads)
+{
+    return new ZstdEncoderPool(filterSupplier, numThreads);
+}
+
+//
+// A parallel merge's parts are each compressed on their own, and since a zstd file can be any number of frames one
+// after another, they can be appended as they are.
+//
+class ZstdSortedPartSupplier : public SortedPartSupplier
+{
+public:
+    ZstdSortedPartSupplier(int i_numThreads, int i_compressionLevel)
+        : numThreads(i_numThreads), compressionLevel(i_compressionLevel)
+    {}
+
+    virtual ~ZstdSortedPartSupplier()
+    {
+        for (_int64 i = 0; i < partFilters.size(); i++) {
+            delete partFilters[i];
+        }
+    }
+
+    virtual void getPart(int part, int nParts, const char* shardFileName, DataWriter::FilterSupplier** o_filters,
+        FileEncoder** o_encoder)
+    {
+        // share the threads out between the parts' encoders
+        ZstdWriterFilterSupplier* zstdSupplier = DataWriterSupplier::zstd(true, compressionLevel);
+        partFilters.push_back(zstdSupplier);
+        *o_filters = zstdSupplier;
+        *o_encoder = FileEncoder::zstd(zstdSupplier, max(1, numThreads / nParts), false);
+    }
+
+    virtual size_t getTrailerSize()
+    { return 0; }
+
+    virtual void onAppended(int nParts, const size_t* partOffsets) {}
+
+private:
+    int     numThreads;
+    int     compressionLevel;
+    VariableSizeVector<DataWriter::FilterSupplier*> partFilters;
+};
+
+    SortedPartSupplier*
+DataWriterSupplier::zstdSortedParts(
+    int numThreads,
+    int compressionLevel)
+{
+    return new ZstdSortedPartSupplier(numThreads, compressionLevel);
+}
+
+#else // SNAP_ZSTD
+
+    DataWriter::Filter*
+ZstdWriterFilterSupplier::getFilter()
+{
+    return NULL;
+}
+
+    ZstdWriterFilterSupplier*
+DataWriterSupplier::zstd(
+    bool multiThreaded,
+    int compressionLevel,
+    size_t chunkSize)
+{
+    return NULL;
+}
+
+    FileEncoder*
+FileEncoder::zstd(
+    ZstdWriterFilterSupplier* filterSupplier,
+    int numThreads,
+    bool bindToProcessor)
+{
+    return NULL;
+}
+
+    FileEncoderPool*
+FileEncoderPool::zstd(
+    ZstdWriterFilterSupplier* filterSupplier,
+    int numThreads)
+{
+    return NULL;
+}
+
+    SortedPartSupplier*
+DataWriterSupplier::zstdSortedParts(
+    int numThreads,
+    int compressionLevel)
+{
+    return NULL;
+}
+
+#endif // SNAP_ZSTD
+
+    void
+ZstdWriterFilterSupplier::addTranslations(
+    VariableSizeVector<ZstdChunkTranslation>* moreTranslations)
+{
+    AcquireExclusiveLock(&lock);
+    translation.append(moreTranslations);
+    ReleaseExclusiveLock(&lock);
+}
+
+    static bool
+ZstdChunkTranslationComparator(
+    const ZstdChunkTranslation& a,
+    const ZstdChunkTranslation& b)
+{
+    return a.logical < b.logical;
+}
+
+    void
+ZstdWriterFilterSupplier::sortTranslations()
+{
+    std::sort(translation.begin(), translation.end(), ZstdChunkTranslationComparator);
+}
+
+    ZstdChunkTranslation*
+ZstdWriterFilterSupplier::find(
+    _uint64 logical)
+{
+    ZstdChunkTranslation value = {logical, 0, 0};
+    ZstdChunkTranslation* upper = std::upper_bound(translation.begin(), translation.end(), value, ZstdChunkTranslationComparator);
+    if (upper == translation.begin()) {
+        return NULL;
+    }
+    return upper - 1;
+}
+
+    bool
+ZstdWriterFilterSupplier::translate(
+    _uint64 logical,
+    _uint64* o_physical,
+    _uint64* o_delta)
+{
+    ZstdChunkTranslation* chunk = find(logical);
+    if (NULL == chunk) {
+        return false;
+    }
+    *o_physical = chunk->physical;
+    *o_delta = logical - chunk->logical;
+    return true;
+}
+
+    bool
+ZstdWriterFilterSupplier::translateEnd(
+    _uint64 logical,
+    _uint64* o_physicalEnd)
+{
+    ZstdChunkTranslation* chunk = find(logical);
+    if (NULL == chunk) {
+        return false;
+    }
+    *o_physicalEnd = chunk->physical + chunk->physicalBytes;
+    return true;
+}
@@ -0,0 +1,95 @@
+/*++
+
+Module Name:
+
+    ZstdDataWriter.h
+
+Abstract:
+
+    Headers for the ZstdWriterFilterSupplier & related classes for the SNAP sequencer
+
+    Data is cut into fixed size chunks that are each compressed into a zstd frame of their own, with its decompressed
+    size in the frame header, the way GzipWriterFilterSupplier cuts BAM into BGZF blocks.  So the chunks are
+    compressed in parallel by the same kinds of encoders (FileEncoder::zstd and FileEncoderPool::zstd), a
+    DecompressDataReader decompresses them in parallel again, and files written in parts can just be appended.
+
+    Only in builds with SNAP_ZSTD; without it the factories return NULL.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "DataWriter.h"
+#include "VariableSizeVector.h"
+
+struct ZstdChunkTranslation
+{
+    _uint64     logical; // where the frame's data starts in the uncompressed data
+    _uint64     physical; // where the frame starts in the file
+    _uint64     physicalBytes; // how big it is there
+};
+
+class ZstdWriterFilterSupplier : public DataWriter::FilterSupplier
+{
+public:
+    ZstdWriterFilterSupplier(size_t i_inputChunkSize, size_t i_chunkSize, bool i_multiThreaded, int i_compressionLevel)
+    :
+        FilterSupplier(DataWriter::ResizeFilter),
+        inputChunkSize(i_inputChunkSize),
+        chunkSize(i_chunkSize),
+        multiThreaded(i_multiThreaded),
+        compressionLevel(i_compressionLevel)
+    {
+        InitializeExclusiveLock(&lock);
+    }
+
+    virtual ~ZstdWriterFilterSupplier()
+    {
+        DestroyExclusiveLock(&lock);
+    }
+
+    const bool multiThreaded;
+
+    // zstd level, 0 for zstd's default
+    const int compressionLevel;
+
+    virtual DataWriter::Filter* getFilter();
+
+    // room for incompressible chunks to grow in place
+    virtual size_t getBufferReserve(size_t bufferSize)
+    { return (bufferSize / inputChunkSize + 1) * (chunkSize - inputChunkSize); }
+
+    virtual void onClosing(DataWriterSupplier* supplier)
+    { sortTranslations(); }
+
+    virtual void onClosed(DataWriterSupplier* supplier) {}
+
+    // where each frame is, for reading the file back (see SortedDataWriter's compressed temp files);
+    // sortTranslations once it's all been written, before translating
+    void addTranslations(VariableSizeVector<ZstdChunkTranslation>* translation);
+
+    void sortTranslations();
+
+    // the file offset of the frame holding logical, and how far into its data logical is
+    bool translate(_uint64 logical, _uint64* o_physical, _uint64* o_delta);
+
+    // the file offset just past the frame holding logical
+    bool translateEnd(_uint64 logical, _uint64* o_physicalEnd);
+
+private:
+    friend class ZstdWriterFilter;
+    friend class ZstdCompressWorkerManager;
+
+    // the frame holding logical, or NULL
+    ZstdChunkTranslation* find(_uint64 logical);
+
+    const size_t inputChunkSize; // uncompressed
+    const size_t chunkSize; // room for each compressed chunk
+    ExclusiveLock lock;
+    VariableSizeVector<ZstdChunkTranslation> translation;
+};
@@ -24,6 +24,7 @@ Revision History:
 #pragma once
 
 #include "directions.h"
+#include "StageTiming.h"
 
 void initializeMapqTables();
 
@@ -35,6 +36,7 @@ inline int computeMAPQ(
     int score,
     int popularSeedsSkipped)
 {
+    TIME_STAGE(MapqStage);
     probabilityOfAllCandidates = __max(probabilityOfAllCandidates, probabilityOfBestCandidate); // You'd think this wouldn't be necessary, but floating point limited precision causes it to be.
     _ASSERT(probabilityOfBestCandidate >= 0.0);
     // Special case for MAPQ 70, which we generate only if there is no evidence of a mismatch at all.
@@ -32,12 +32,14 @@ Revision History:
 
 void usage()
 {
-    fprintf(stderr,"usage: ComputeROC genomeDirectory inputFile {-b}\n");
+    fprintf(stderr,"usage: ComputeROC genomeDirectory inputFile {-b} {-t threads}\n");
+    fprintf(stderr,"       inputFile is SAM, or BAM if its name ends in .bam.  It's split into ranges that are read and scored in parallel\n");
     fprintf(stderr,"       -b means to accept reads that match either end of the range regardless of RC\n");
     fprintf(stderr,"       -c means to just count the number of reads that are aligned, not to worry about correctness\n");
     fprintf(stderr,"       -v means to correct for the error in generating the wgsim coordinates in the Venter data\n");
     fprintf(stderr,"       -e means to print out misaligned reads where the aligned location has a lower edit distance than the 'correct' one.\n");
     fprintf(stderr,"       -70 means to print out any misaligned reads with MAPQ 70.\n");
+    fprintf(stderr,"       -t sets the number of threads (default is one per core)\n");
     fprintf(stderr,"You can specify only one of -b or -c\n");
   	exit(1);
 }
@@ -100,21 +102,21 @@ WorkerThreadMain(void *param)
     LandauVishkinWithCigar lv;
     while (NULL != (read = readSupplier->getNextRead())) {
         unsigned mapQ = read->getOriginalMAPQ();
-        unsigned genomeLocation = read->getOriginalAlignedLocation();
+        GenomeLocation genomeLocation = read->getOriginalAlignedLocation();
         unsigned flag = read->getOriginalSAMFlags();
 
         if (flag & SAM_UNMAPPED) {
-            genomeLocation = 0xffffffff;
+            genomeLocation = InvalidGenomeLocation;
         }
 
-        if (mapQ < 0 || mapQ > MaxMAPQ) {
+        if (mapQ > MaxMAPQ) {
             fprintf(stderr,"Invalid MAPQ: %d\n",mapQ);
             exit(1);
         }
 
         context->totalReads++;
 
-        if (0xffffffff == genomeLocation) {
+        if (InvalidGenomeLocation == genomeLocation) {
             context->nUnaligned++;
         } else if (justCount) {
             context->countOfReads[mapQ]++;
@@ -125,9 +127,10 @@ WorkerThreadMain(void *param)
                             
             const Genome::Contig *contig = genome->getContigAtLocation(genomeLocation);
             if (NULL == contig) {
-                fprintf(stderr,"couldn't find genome contig for offset %u\n",genomeLocation);
+                fprintf(stderr,"couldn't find genome contig for location %lld\n", GenomeLocationAsInt64(genomeLocation));
                 exit(1);
             }
+            unsigned offsetInContig = (unsigned)(GenomeLocationAsInt64(genomeLocation) - GenomeLocationAsInt64(contig->beginningLocation));
             unsigned offsetA, offsetB;
             bool matched;
 
@@ -154,7 +157,7 @@ WorkerThreadMain(void *param)
             size_t chrNameLen;
             const char *beginningOfSecondNumber;
             const char *beginningOfFirstNumber; int stage = 0;
-            unsigned offsetOfCorrectChromosome;
+            GenomeLocation locationOfCorrectChromosome;
  
             if (NULL != firstColon && firstColon - 3 > idBuffer && (*(firstColon-1) == '?' || isADigit(*(firstColon - 1)))) {
                 //
@@ -204,7 +207,7 @@ WorkerThreadMain(void *param)
                                 offsetB -= read->getDataLength();
                             }
 
-                            if (!genome->getOffsetOfContig(correctChromosomeName, &offsetOfCorrectChromosome)) {
+                            if (!genome->getLocationOfContig(correctChromosomeName, &locationOfCorrectChromosome)) {
                                 fprintf(stderr, "Couldn't parse chromosome name '%s' from read id\n", correctChromosomeName);
                             } else {
                                 badParse = false;
@@ -214,7 +217,8 @@ WorkerThreadMain(void *param)
                 }
 
                 if (badParse) {
-                    fprintf(stderr,"Unable to parse read ID '%s', perhaps this isn't simulated data.  contiglen = %d, contigName = '%s', contig offset = %u, genome offset = %u\n", idBuffer, strlen(contig->name), contig->name, contig->beginningOffset, genomeLocation);
+                    fprintf(stderr,"Unable to parse read ID '%s', perhaps this isn't simulated data.  contiglen = %d, contigName = '%s', contig location = %lld, genome location = %lld\n",
+                        idBuffer, (int)strlen(contig->name), contig->name, GenomeLocationAsInt64(contig->beginningLocation), GenomeLocationAsInt64(genomeLocation));
                     exit(1);
                 }
 
@@ -226,10 +230,10 @@ WorkerThreadMain(void *param)
                 }  else if(strncmp(contig->name, idBuffer, __min(read->getIdLength(), chrNameLen))) {
                     matched = false;
                 } else {
-                    if (isWithin(offsetA, genomeLocation - contig->beginningOffset, slackAmount)) {
+                    if (isWithin(offsetA, offsetInContig, slackAmount)) {
                         matched = true;
                         match0 = true;
-                    } else if (isWithin(offsetB, genomeLocation - contig->beginningOffset, slackAmount)) {
+                    } else if (isWithin(offsetB, offsetInContig, slackAmount)) {
                         matched = true;
                         match1 = true;
                     } else {
@@ -254,10 +258,10 @@ WorkerThreadMain(void *param)
                         //
                         // We don't know which offset is correct, because neither one matched.  Just take the one with the lower edit distance.
                         //
-                        unsigned correctLocationA = offsetOfCorrectChromosome + offsetA;
-                        unsigned correctLocationB = offsetOfCorrectChromosome + offsetB;
+                        GenomeLocation correctLocationA = locationOfCorrectChromosome + offsetA;
+                        GenomeLocation correctLocationB = locationOfCorrectChromosome + offsetB;
 
-                        unsigned correctLocation = 0;
+                        GenomeLocation correctLocation = 0;
                         const char *correctData = NULL;
 
                         const char *dataA = genome->getSubstring(correctLocationA, 1);
@@ -325,6 +329,12 @@ int main(int argc, char * argv[])
 
     if (argc < 3) usage();
 
+#ifdef _DEBUG
+    unsigned nThreads = 1;
+#else   // _DEBUG
+    unsigned nThreads = GetNumberOfProcessors();
+#endif // _DEBUG
+
     for (int i = 3; i < argc; i++) {
         if (!strcmp(argv[i], "-b")) {
             matchBothWays = true;
@@ -336,6 +346,9 @@ int main(int argc, char * argv[])
             printBetterErrors = true;        
         } else if (!strcmp(argv[i], "-70")) {
             printErrorsAtMAPQ70 = true;
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc && atoi(argv[i+1]) > 0) {
+            nThreads = atoi(argv[i+1]);
+            i++;
         } else {
             usage();
         }
@@ -355,14 +368,6 @@ int main(int argc, char * argv[])
 
     inputFileName = argv[2];
 
-    unsigned nThreads;
-#ifdef _DEBUG
-    nThreads = 1;
-#else   // _DEBUG
-    nThreads = GetNumberOfProcessors();
-#endif // _DEBUG
-
-
     DataSupplier::ThreadCount = nThreads;
     nRunningThreads = nThreads;
 
@@ -375,6 +380,13 @@ int main(int argc, char * argv[])
 	readerContext.header = NULL;
 	readerContext.headerLength = 0;
 	readerContext.headerBytes = 0;
+    readerContext.nInputParts = 0;
+    readerContext.region = NULL;
+    readerContext.unmappedOnly = false;
+    readerContext.junctions = NULL;
+    readerContext.binQualities = false;
+    readerContext.omitQualities = false;
+    readerContext.dropAuxData = false;
 
     if (NULL != strrchr(inputFileName, '.') && !_stricmp(strrchr(inputFileName, '.'), ".bam")) {
         readSupplierGenerator = BAMReader::createReadSupplierGenerator(inputFileName, nThreads, readerContext);
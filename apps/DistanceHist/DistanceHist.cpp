@@ -6,9 +6,12 @@ Module Name:
 
 Abstract:
 
-    Compute a histogram of the edit distances between simulated reads and their correct 
+    Compute a histogram of the edit distances between simulated reads and their correct
     alignments.
 
+    The input (FASTQ, SAM or BAM) is split into ranges that are read and scored in parallel, each thread
+    counting into its own histogram, which are added up at the end.
+
 Authors:
 
     Bill Bolosky, May 2013
@@ -19,6 +22,7 @@ Environment:
 
 Revision History:
 
+    Ported to the range splitting read supplier generators, with BAM input and a thread count.
 
 --*/
 
@@ -28,16 +32,18 @@ Revision History:
 #include "Genome.h"
 #include "exit.h"
 #include "SAM.h"
+#include "Bam.h"
 #include "FASTQ.h"
-#include "WGsim.h"
+#include "RangeSplitter.h"
+#include "BigAlloc.h"
 #include "LandauVishkin.h"
 #include "Tables.h"
 
 const Genome *genome = NULL;
 
 struct DistHistogram {
-    static const unsigned MaxDistance = 100;
-    unsigned counts[MaxDistance+2];
+    static const unsigned MaxDistance = MAX_K - 1;  // The most LandauVishkin finds; anything further is counted as More
+    _int64 counts[MaxDistance+2];
 
     DistHistogram() {
         for (unsigned i = 0 ; i < MaxDistance+2; i++) {
@@ -59,25 +65,87 @@ SingleWaiterObject threadsDone;
 void
 usage()
 {
-    fprintf(stderr,"usage: DistanceHist index inputFile\n");
+    fprintf(stderr,"usage: DistanceHist index inputFile {-t threads}\n");
+    fprintf(stderr,"       inputFile is FASTQ, SAM, or BAM if its name ends in .bam, of reads simulated by wgsim, whose IDs\n");
+    fprintf(stderr,"       are chr_offsetA_offsetB_... with the (1-based) ends of the fragment they came from.  Reads with\n");
+    fprintf(stderr,"       qualities below 30 or indels against the genome are skipped.\n");
+    fprintf(stderr,"       -t sets the number of threads (default is one per core)\n");
     soft_exit(1);
 }
 
+bool inline isADigit(char x) {
+    return x >= '0' && x <= '9';
+}
+
+//
+// Get the genome locations of the two ends of the fragment a wgsim read came from, out of its ID.  The format is
+// ChrName_OffsetA_OffsetB_stuff, where ChrName can include '_', so it's parsed backward from the end of OffsetB.
+//
+    bool
+ParseWgsimLocations(Read *read, GenomeLocation *o_low, GenomeLocation *o_high)
+{
+    char idBuffer[1000];
+    unsigned idLength = __min(read->getIdLength(), (unsigned)sizeof(idBuffer) - 1);
+    memcpy(idBuffer, read->getId(), idLength);
+    idBuffer[idLength] = '\0';
+
+    //
+    // Find the last _number_number_ in the ID.
+    //
+    for (int end = (int)idLength - 1; end > 0; end--) {
+        if (idBuffer[end] != '_' || !isADigit(idBuffer[end - 1])) {
+            continue;
+        }
+        int beginningOfSecondNumber = end - 1;
+        while (beginningOfSecondNumber > 0 && isADigit(idBuffer[beginningOfSecondNumber - 1])) {
+            beginningOfSecondNumber--;
+        }
+        if (beginningOfSecondNumber < 3 || idBuffer[beginningOfSecondNumber - 1] != '_' || !isADigit(idBuffer[beginningOfSecondNumber - 2])) {
+            continue;
+        }
+        int beginningOfFirstNumber = beginningOfSecondNumber - 2;
+        while (beginningOfFirstNumber > 0 && isADigit(idBuffer[beginningOfFirstNumber - 1])) {
+            beginningOfFirstNumber--;
+        }
+        if (beginningOfFirstNumber < 2 || idBuffer[beginningOfFirstNumber - 1] != '_') {
+            continue;
+        }
+
+        unsigned offsetA = atoi(idBuffer + beginningOfFirstNumber);
+        unsigned offsetB = atoi(idBuffer + beginningOfSecondNumber);
+        idBuffer[beginningOfFirstNumber - 1] = '\0';
+        GenomeLocation contigLocation;
+        if (!genome->getLocationOfContig(idBuffer, &contigLocation) || offsetA < 1 || offsetB < read->getDataLength()) {
+            return false;
+        }
+
+        //
+        // The read from the low end starts at offsetA, and the one from the high end ends at offsetB.
+        //
+        *o_low = contigLocation + (offsetA - 1);
+        *o_high = contigLocation + (offsetB - read->getDataLength());
+        return true;
+    }
+    return false;
+}
+
 void workerThreadMain(void *context)
 {
     DistHistogram histogram;    // Don't use the context one until the end to avoid false sharing
 
-    LandauVishkinWithCigar lv;
+    LandauVishkin<1> lv;
+    LandauVishkinWithCigar lvWithCigar;
 
     ReadSupplier *readSupplier = readSupplierGenerator->generateNewReadSupplier();
 
     const unsigned maxReadLen = MAX_READ_LENGTH;
     char *rcBuffer = new char[maxReadLen];
+    const int cigarBufLen = 1000;
+    char cigar[cigarBufLen];
 
     Read *read;
     while (NULL != (read = readSupplier->getNextRead())) {
         unsigned readLen = read->getDataLength();
-        unsigned highOffset, lowOffset;
         const char *readData = read->getData();
         const char *quality = read->getQuality();
 
@@ -88,89 +156,88 @@ void workerThreadMain(void *context)
                 break;
             }
         }
-        if (lowQual) {
+        if (lowQual || readLen > maxReadLen) {
             continue;
         }
 
-        char cigar[4][100];
-        const char *genomeData[4];
-        int edit[4];
-
         //
         // We don't care if it's misaligned (or in fact if it's aligned at all).  Just get the
         // offsets from the wgsim name.
         //
-        wgsimReadMisaligned(read, 0, genome, 0, &lowOffset, &highOffset);
-
-        unsigned bestAt = 0;
-        cigar[0][0] = '\0';
-        int bestDistance = read->getDataLength();
-        genomeData[0] = genome->getSubstring(lowOffset, readLen + 20);
-        int dist = edit[0] = lv.computeEditDistance(genome->getSubstring(lowOffset, readLen + 20), readLen + 20, readData, readLen, MAX_K - 1, cigar[0], 100, false);
-        if (dist >= 0) {
-            bestDistance = dist;
-        }
-
-        genomeData[1] = genome->getSubstring(highOffset, readLen + 20);
-        edit[1] = dist = lv.computeEditDistance(genome->getSubstring(highOffset, readLen + 20), readLen + 20, readData, readLen, MAX_K - 1, cigar[1], 100, false);
-
-        if (dist >= 0 && dist < bestDistance) {
-            bestDistance = dist;
-            bestAt = 1;
+        GenomeLocation locations[2];
+        if (!ParseWgsimLocations(read, &locations[0], &locations[1])) {
+            WriteErrorMessage("Unable to parse read ID '%.*s', perhaps this isn't wgsim data\n", read->getIdLength(), read->getId());
+            soft_exit(1);
         }
 
         for (unsigned i = 0; i < readLen; i++) {
             rcBuffer[readLen - i - 1] = COMPLEMENT[readData[i]];
         }
 
-        genomeData[2] = genome->getSubstring(lowOffset, readLen + 20);
-        edit[2] = dist = lv.computeEditDistance(genome->getSubstring(lowOffset, readLen + 20), readLen + 20, rcBuffer, readLen, MAX_K - 1, cigar[2], 100, false);
-        if (dist >= 0 && dist < bestDistance) {
-            bestDistance =dist;
-            bestAt = 2;
-        }
-
-        genomeData[3] = genome->getSubstring(highOffset, readLen + 20);
-        edit[3] = dist = lv.computeEditDistance(genome->getSubstring(highOffset, readLen + 20), readLen + 20, rcBuffer, readLen, MAX_K - 1, cigar[3], 100, false);
-
-        if (dist >= 0 && dist < bestDistance) {
-            bestDistance = dist;
-            bestAt = 3;
-        }
-
-        bool containsIndels = false;
-        for (size_t i = 0; i < strlen(cigar[bestAt]); i++) {
-            if (cigar[bestAt][i] == 'I' || cigar[bestAt][i] == 'D') {
-                containsIndels = true;
-                break;
+        //
+        // Try both ends of the fragment, each way round, and take the closest.  Three of the four are usually
+        // nowhere near, so they're scored without a CIGAR string, each only up to the best distance so far, which
+        // the bit vector check throws out quickly; the CIGAR string is only worked out for the best one.
+        //
+        int bestDistance = -1;
+        const char *bestGenomeData = NULL;
+        const char *bestPattern = NULL;
+        for (int whichEnd = 0; whichEnd < 2 && 0 != bestDistance; whichEnd++) {
+            const char *genomeData = genome->getSubstring(locations[whichEnd], readLen + 20);
+            if (NULL == genomeData) {
+                continue;
+            }
+            for (int rc = 0; rc < 2 && 0 != bestDistance; rc++) {
+                const char *pattern = rc ? rcBuffer : readData;
+                int dist = lv.computeEditDistance(genomeData, readLen + 20, pattern, readLen, bestDistance < 0 ? MAX_K - 1 : bestDistance - 1);
+                if (dist >= 0) {
+                    bestDistance = dist;
+                    bestGenomeData = genomeData;
+                    bestPattern = pattern;
+                }
             }
         }
 
-        if (containsIndels) {
-            continue;
+        if (bestDistance > 0) {
+            lvWithCigar.computeEditDistance(bestGenomeData, readLen + 20, bestPattern, readLen, bestDistance, cigar, cigarBufLen, false);
+            if (NULL != strchr(cigar, 'I') || NULL != strchr(cigar, 'D')) {
+                continue;
+            }
         }
 
-        if (bestDistance <0 || bestDistance > DistHistogram::MaxDistance) {
-            histogram.counts[DistHistogram::MaxDistance]++;
+        if (bestDistance < 0 || bestDistance > DistHistogram::MaxDistance) {
+            histogram.counts[DistHistogram::MaxDistance+1]++;
         } else {
             histogram.counts[bestDistance]++;
         }
     }
 
     ((DistHistogram *)context)->addIn(histogram);
+    delete [] rcBuffer;
+
     if (0 == InterlockedDecrementAndReturnNewValue(&nRunningThreads)) {
         SignalSingleWaiterObject(&threadsDone);
     }
-
-    delete rcBuffer;    // Cause I'm just that kinda guy.
 }
 
-void main(int argc, char * argv[])
+int main(int argc, char * argv[])
 {
-	if (3 != argc) usage();
+	if (3 != argc && 5 != argc) usage();
 
     BigAllocUseHugePages = false;
 
+#ifdef _DEBUG
+    unsigned threadCount = 1; // BJB
+#else   // _DEBUG
+    unsigned threadCount = GetNumberOfProcessors();
+#endif // _DEBUG
+    if (5 == argc) {
+        if (strcmp(argv[3], "-t") || atoi(argv[4]) <= 0) {
+            usage();
+        }
+        threadCount = atoi(argv[4]);
+    }
+
     const char *genomeFileName = "Genome";
     char *pathname = new char[strlen(argv[1]) + 1 /* for directory separator */ + strlen(genomeFileName) + 1 /* for null */];
     sprintf(pathname, "%s%c%s", argv[1], PATH_SEP, genomeFileName);
@@ -183,24 +250,34 @@ void main(int argc, char * argv[])
         soft_exit(1);
     }
     printf("%llds.\n", (timeInMillis() + 500 - start) / 1000);
-
-    unsigned threadCount = GetNumberOfProcessors();
-#ifdef _DEBUG
-    threadCount = 1; // BJB
-#endif // _DEBUG
-
-    const char *lastDot = strchr(argv[2], '.');
-    if (NULL != lastDot && !_stricmp(lastDot,".sam")) {
-        readSupplierGenerator = SAMReader::createReadSupplierGenerator(argv[2], threadCount, genome);
+    delete [] pathname;
+
+    start = timeInMillis();
+    DataSupplier::ThreadCount = threadCount;
+
+    ReaderContext readerContext;
+    memset(&readerContext, 0, sizeof(readerContext));
+    readerContext.compressionLevel = -1;
+    readerContext.clipping = NoClipping;
+    readerContext.defaultReadGroup = "";
+    readerContext.genome = genome;
+    readerContext.ignoreSecondaryAlignments = true;
+    readerContext.ignoreSupplementaryAlignments = true;
+
+    const char *lastDot = strrchr(argv[2], '.');
+    if (NULL != lastDot && !_stricmp(lastDot, ".bam")) {
+        readSupplierGenerator = BAMReader::createReadSupplierGenerator(argv[2], threadCount, readerContext);
+    } else if (NULL != lastDot && !_stricmp(lastDot, ".sam")) {
+        readSupplierGenerator = SAMReader::createReadSupplierGenerator(argv[2], threadCount, readerContext);
     } else {
-        readSupplierGenerator = FASTQReader::createReadSupplierGenerator(argv[2], threadCount);
+        readSupplierGenerator = FASTQReader::createReadSupplierGenerator(argv[2], threadCount, readerContext);
     }
 
     if (NULL == readSupplierGenerator) {
         fprintf(stderr,"Unable to open file '%s' to get reads\n", argv[2]);
         soft_exit(1);
     }
-    
+
     nRunningThreads = threadCount;
     DistHistogram *histograms = new DistHistogram[threadCount];
     CreateSingleWaiterObject(&threadsDone);
@@ -215,20 +292,21 @@ void main(int argc, char * argv[])
         histograms[0].addIn(histograms[i]);
     }
 
-
-    unsigned totalReads = 0;
+    _int64 totalReads = 0;
     for (unsigned i = 0; i < DistHistogram::MaxDistance+1; i++) {
-        printf("%d\t%d\n",i,histograms[0].counts[i]);
+        printf("%d\t%lld\n", i, histograms[0].counts[i]);
         totalReads += histograms[0].counts[i];
     }
 
     if (histograms[0].counts[DistHistogram::MaxDistance+1] != 0) {
-        printf("More\t%d\n", histograms[0].counts[DistHistogram::MaxDistance+1]);
+        printf("More\t%lld\n", histograms[0].counts[DistHistogram::MaxDistance+1]);
         totalReads += histograms[0].counts[DistHistogram::MaxDistance+1];
     }
 
     _int64 stop = timeInMillis();
-    printf("\nProcessed %d reads in %llds, %lld reads/s\n", totalReads, (stop + 500 - start) / 1000, ((_int64) totalReads) * 1000 / (stop - start));
+    printf("\nProcessed %lld reads in %llds, %lld reads/s\n", totalReads, (stop + 500 - start) / 1000, totalReads * 1000 / __max((_int64)1, stop - start));
 
+    delete [] histograms;
+    return 0;
 }
 
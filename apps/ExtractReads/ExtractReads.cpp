@@ -2,11 +2,12 @@
 
 Module Name:
 
-    ComputeROC.cpp
+    ExtractReads.cpp
 
 Abstract:
 
-   Take a SAM file with simulated reads and compute a ROC curve from it.
+   Pull the records for some read names out of a BAM file, using its read name index (see ReadNameIndex.h) if it
+   has one, or build the index for a BAM file that SNAP didn't write one for.
 
 Authors:
 
@@ -18,92 +19,230 @@ Environment:
 
 Revision History:
 
-    
+    Rewritten to extract reads by name rather than by chromosome.
+
 --*/
 
 #include "stdafx.h"
-#include "SAM.h"
-#include "BAM.h"
-#include "Genome.h"
+#include "Bam.h"
 #include "Compat.h"
-#include "Read.h"
-#include "RangeSplitter.h"
 #include "BigAlloc.h"
+#include "DataWriter.h"
+#include "GzipDataWriter.h"
+#include "ReadNameIndex.h"
+#include <set>
+#include <string>
+#include <algorithm>
 
 void usage()
 {
-    fprintf(stderr,"usage: ExtractReads genomeDirectory input.bam output.sam chromosome\n");
+    fprintf(stderr,"usage: ExtractReads -index input.bam\n");
+    fprintf(stderr,"       ExtractReads input.bam output.bam {readName ... | -f namesFile}\n");
+    fprintf(stderr,"       The first form writes input.bam%s, the read name index that snap-aligner -nameIndex writes as it\n", ReadNameIndexSuffix);
+    fprintf(stderr,"       goes.  The second writes the header and the records for the given read names (one per line in\n");
+    fprintf(stderr,"       namesFile) from input.bam to output.bam, in the order they're in in input.bam.  Without an index,\n");
+    fprintf(stderr,"       it reads all of input.bam.\n");
   	exit(1);
 }
 
+std::set<std::string> names;
+
+    bool
+Wanted(BAMAlignment *record)
+{
+    return record->l_read_name > 0 && names.count(std::string(record->read_name(), record->l_read_name - 1)) > 0;
+}
+
+    void
+Write(DataWriter *writer, const char *data, size_t bytes)
+{
+    char *buffer;
+    size_t size;
+    if (!writer->getBuffer(&buffer, &size) || size < bytes) {
+        writer->nextBatch();
+        if (!writer->getBuffer(&buffer, &size) || size < bytes) {
+            WriteErrorMessage("ExtractReads: unable to get a write buffer\n");
+            soft_exit(1);
+        }
+    }
+    memcpy(buffer, data, bytes);
+    writer->advance(bytes);
+}
+
+//
+// Copy the header, a few bytes at a time, since it's parsed to find out how long it is.
+//
+    bool
+CopyHeader(BgzfFile *bam, DataWriter *writer, char *buffer)
+{
+    _int32 magic, textLength, nRefs;
+    if (!(bam->read(&magic, 4) && BAMHeader::BAM_MAGIC == magic && bam->read(&textLength, 4) && textLength >= 0)) {
+        return false;
+    }
+    Write(writer, (char *)&magic, 4);
+    Write(writer, (char *)&textLength, 4);
+    for (_int32 left = textLength; left > 0; ) {
+        _int32 bytes = __min(left, BAMReader::MAX_RECORD_LENGTH);
+        if (!bam->read(buffer, bytes)) {
+            return false;
+        }
+        Write(writer, buffer, bytes);
+        left -= bytes;
+    }
+    if (!bam->read(&nRefs, 4)) {
+        return false;
+    }
+    Write(writer, (char *)&nRefs, 4);
+    for (_int32 i = 0; i < nRefs; i++) {
+        _int32 nameLength;
+        if (!(bam->read(&nameLength, 4) && nameLength >= 0 && nameLength < BAMReader::MAX_RECORD_LENGTH - 8 &&
+                bam->read(buffer + 4, nameLength + 4))) {
+            return false;
+        }
+        *(_int32 *)buffer = nameLength;
+        Write(writer, buffer, nameLength + 8);
+    }
+    return true;
+}
+
+//
+// Read the record at the current offset into buffer, or return false at the end of the file.
+//
+    bool
+ReadRecord(BgzfFile *bam, const char *fileName, char *buffer)
+{
+    _uint64 offset = bam->tell();
+    _uint32 blockSize;
+    if (!bam->read(&blockSize, 4)) {
+        return false;
+    }
+    if (blockSize < sizeof(BAMAlignment) - 4 || blockSize + 4 > (_uint32)BAMReader::MAX_RECORD_LENGTH ||
+            !bam->read(buffer + 4, blockSize)) {
+        WriteErrorMessage("Bad BAM record in '%s' at virtual offset %llu\n", fileName, offset);
+        soft_exit(1);
+    }
+    *(_uint32 *)buffer = blockSize;
+    return true;
+}
+
+    void
+ReadNames(const char *namesFileName)
+{
+    FILE *file = fopen(namesFileName, "r");
+    if (NULL == file) {
+        WriteErrorMessage("Unable to open names file '%s'\n", namesFileName);
+        soft_exit(1);
+    }
+    char line[1024];
+    while (NULL != fgets(line, sizeof(line), file)) {
+        size_t length = strlen(line);
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            length--;
+        }
+        if (length > 0) {
+            names.insert(std::string(line, length));
+        }
+    }
+    fclose(file);
+}
 
 int main(int argc, char * argv[])
 {
     BigAllocUseHugePages = false;
 
-    if (argc != 5) usage();
-
-    static const char *genomeSuffix = "Genome";
-	size_t filenameLen = strlen(argv[1]) + 1 + strlen(genomeSuffix) + 1;
-	char *fileName = new char[strlen(argv[1]) + 1 + strlen(genomeSuffix) + 1];
-	snprintf(fileName,filenameLen,"%s%c%s",argv[1],PATH_SEP,genomeSuffix);
-	const Genome *genome = Genome::loadFromFile(fileName, 0);
-	if (NULL == genome) {
-		fprintf(stderr,"Unable to load genome from file '%s'\n",fileName);
-		return -1;
-	}
-	delete [] fileName;
-	fileName = NULL;
-
-    ReaderContext readerContext;
-    readerContext.header = NULL;
-    readerContext.genome = genome;
-    readerContext.clipping = NoClipping;
-    readerContext.paired = false;
-    readerContext.ignoreSecondaryAlignments = true;
-    readerContext.ignoreSupplementaryAlignments = true;
-    readerContext.defaultReadGroup = "";
-
-    ReadSupplierGenerator *readSupplierGenerator = BAMReader::createReadSupplierGenerator(fileName,1, readerContext);
-    ReadSupplier *readSupplier = readSupplierGenerator->generateNewReadSupplier();
-
-    AlignerOptions options("");
-    options.outputFileTemplate = argv[4];
-    options.sortOutput = false;
-    
-    const FileFormat* format = 
-    FileFormat::SAM[0]->isFormatOf(argv[3]) ? FileFormat::SAM[false] :
-    FileFormat::BAM[0]->isFormatOf(argv[3]) ? FileFormat::BAM[false] :
-    NULL;
-
-    if (NULL == format) {
-        fprintf(stderr,"Can't determine format for output file (does it end in .sam or .bam?)\n");
+    if (argc == 3 && !strcmp(argv[1], "-index")) {
+        size_t length = strlen(argv[2]);
+        char *indexFileName = new char[length + strlen(ReadNameIndexSuffix) + 1];
+        strcpy(indexFileName, argv[2]);
+        strcpy(indexFileName + length, ReadNameIndexSuffix);
+        _int64 start = timeInMillis();
+        if (!ReadNameIndexBuilder::IndexBAMFile(argv[2], indexFileName)) {
+            WriteErrorMessage("Unable to index '%s'\n", argv[2]);
+            return 1;
+        }
+        WriteStatusMessage("Wrote '%s' in %llds\n", indexFileName, (timeInMillis() - start + 500) / 1000);
+        delete [] indexFileName;
         return 0;
     }
 
-    ReadWriterSupplier *writerSupplier = format->getWriterSupplier(&options, readerContext.genome);
-    ReadWriter* writer = writerSupplier->getWriter();
-    writer->writeHeader(readerContext, options.sortOutput, argc, (const char **)argv, "", "");
-
-    Read *read;
-    AlignmentResult alignmentResult;
-    unsigned genomeLocation;
-    bool isRC;
-    unsigned mapQ;
-    _int64 totalReads = 0;
-    _int64 emittedReads = 0;
-    while (readSupplier->getNextRead()) {
-        totalReads++;
-        const Genome::Contig *contig = genome->getContigAtLocation(genomeLocation);
-        if (NULL != contig && !strcmp(contig->name, argv[4])) {
-            emittedReads++;
-            writer->writeRead(read, alignmentResult, mapQ, genomeLocation, isRC ? RC : FORWARD);
+    if (argc < 4) usage();
+    const char *inputFileName = argv[1];
+    const char *outputFileName = argv[2];
+    if (!strcmp(argv[3], "-f")) {
+        if (argc != 5) usage();
+        ReadNames(argv[4]);
+    } else {
+        for (int i = 3; i < argc; i++) {
+            names.insert(std::string(argv[i]));
         }
     }
-    writer->close();
 
-    printf("Processed %lld reads, of which %lld were emitted\n", totalReads, emittedReads);
+    BgzfFile *bam = BgzfFile::open(inputFileName);
+    if (NULL == bam) {
+        WriteErrorMessage("Unable to open '%s'\n", inputFileName);
+        return 1;
+    }
 
-	return 0;
-}
+    const unsigned nThreads = 1;
+    GzipWriterFilterSupplier *gzipSupplier = DataWriterSupplier::gzip(true, BAM_BLOCK, nThreads, false, true, -1);
+    DataWriterSupplier *writerSupplier = DataWriterSupplier::create(outputFileName, 16 * 1024 * 1024, gzipSupplier, NULL, 4,
+        FileEncoderPool::gzip(gzipSupplier, nThreads));
+    DataWriter *writer = writerSupplier->getWriter();
+
+    char *buffer = new char[BAMReader::MAX_RECORD_LENGTH];
+    if (!CopyHeader(bam, writer, buffer)) {
+        WriteErrorMessage("'%s' isn't a BAM file\n", inputFileName);
+        soft_exit(1);
+    }
+
+    size_t length = strlen(inputFileName);
+    char *indexFileName = new char[length + strlen(ReadNameIndexSuffix) + 1];
+    strcpy(indexFileName, inputFileName);
+    strcpy(indexFileName + length, ReadNameIndexSuffix);
+    ReadNameIndex *index = ReadNameIndex::open(indexFileName);
+
+    _int64 nRecords = 0;
+    if (NULL != index) {
+        //
+        // Look up each name, and read the records in file order.  Names with the same hash as one we want are skipped.
+        //
+        VariableSizeVector<_uint64> offsets;
+        for (std::set<std::string>::iterator i = names.begin(); i != names.end(); ++i) {
+            index->lookup(i->c_str(), i->length(), &offsets);
+        }
+        std::sort(offsets.begin(), offsets.end());
+        for (_int64 i = 0; i < offsets.size(); i++) {
+            if (i > 0 && offsets[i] == offsets[i - 1]) {
+                continue;
+            }
+            if (!bam->seek(offsets[i]) || !ReadRecord(bam, inputFileName, buffer)) {
+                WriteErrorMessage("'%s' doesn't match its index '%s'\n", inputFileName, indexFileName);
+                soft_exit(1);
+            }
+            if (Wanted((BAMAlignment *)buffer)) {
+                Write(writer, buffer, ((BAMAlignment *)buffer)->block_size + 4);
+                nRecords++;
+            }
+        }
+        delete index;
+    } else {
+        WriteStatusMessage("No read name index '%s'; reading all of '%s'\n", indexFileName, inputFileName);
+        while (ReadRecord(bam, inputFileName, buffer)) {
+            if (Wanted((BAMAlignment *)buffer)) {
+                Write(writer, buffer, ((BAMAlignment *)buffer)->block_size + 4);
+                nRecords++;
+            }
+        }
+    }
 
+    writer->close();
+    delete writer;
+    writerSupplier->close();
+    delete writerSupplier;
+    delete bam;
+    delete [] buffer;
+    delete [] indexFileName;
+
+    WriteStatusMessage("Wrote %lld records for %lld names to '%s'\n", nRecords, (_int64)names.size(), outputFileName);
+    return 0;
+}
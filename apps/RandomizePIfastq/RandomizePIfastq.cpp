@@ -6,7 +6,18 @@ Module Name:
 
 Abstract:
 
-   Cheezy little app that takes a paired, interleaved FASTQ and more-or-less randomizes it.
+   Shuffle a paired, interleaved FASTQ into a random order of its pairs, for benchmarking and training on random
+   subsets (the first n pairs of the output are a random sample of the input).
+
+   It's an external bucket shuffle, so the input doesn't have to fit in memory.  First all of the threads read pairs
+   (through the SNAPLib readers, so gzip and BGZF input decompress in parallel) and scatter each to one of -b temp
+   files chosen at random.  Then each thread takes a bucket at a time, reads it into memory, shuffles its pairs and
+   writes them to the output.  Output files whose names end in .gz are written BGZF compressed in parallel, as
+   ToFASTQ writes them.
+
+   Every pair is equally likely to land in every bucket, and then in every place in it, so the result is a uniform
+   shuffle no matter which order the buckets' pairs reach the output in.  Pairs are written as @ID, bases, + and
+   qualities; anything after the ID on the header line isn't kept.
 
 Authors:
 
@@ -14,164 +25,429 @@ Authors:
 
 Revision History:
 
-    
+    Rebuilt on the SNAPLib readers and writers, multithreaded, with the shuffle as well as the scatter.
+
 --*/
 
 #include "stdafx.h"
-#include "GoodRandom.h"
+#include "Compat.h"
+#include "Read.h"
+#include "FASTQ.h"
+#include "Bam.h"
+#include "BigAlloc.h"
+#include "DataWriter.h"
+#include "GzipDataWriter.h"
+#include "GzipBlockCodec.h"
+#include "exit.h"
+#include "Error.h"
+#include <vector>
+
+void usage()
+{
+    fprintf(stderr,"usage: RandomizePIfastq inputFile outputFile {-t threads} {-b buckets} {-seed n} {-cl level} {-tmp prefix}\n");
+    fprintf(stderr,"       The input is a paired, interleaved FASTQ (mates' IDs end in /1 and /2), which may be gzip compressed.\n");
+    fprintf(stderr,"       Output files whose names end in .gz are written BGZF compressed, at zlib level -cl (default 6).\n");
+    fprintf(stderr,"       -t is the number of threads to use; default all of the cores.\n");
+    fprintf(stderr,"       -b is the number of temp files to scatter the pairs to.  Each thread holds one in memory at a time, so\n");
+    fprintf(stderr,"          there should be enough of them that threads times the input size over buckets fits.  The default is\n");
+    fprintf(stderr,"          about 256MB of FASTQ per bucket.\n");
+    fprintf(stderr,"       -seed seeds the random choices.  The same seed gives the same output only with -t 1; default the time.\n");
+    fprintf(stderr,"       -tmp is the prefix for the temp file names (default the output file name).\n");
+    soft_exit(1);
+}
 
-class IntermediateFile {
+//
+// A small, fast generator (as in SNAPBench), one per thread.
+//
+class ShuffleRandom {
 public:
-    IntermediateFile(const char *fileName, size_t i_bufferSize);
-    ~IntermediateFile();
+    ShuffleRandom(_uint64 seed) : state(seed * 0x9e3779b97f4a7c15ull + 1) {}
 
- 
-    void addLines(char *lines, size_t size);
-    void close();
+    _uint64 next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    //
+    // The modulo bias is at most n / 2^64, which is nothing for the numbers of buckets and pairs here.
+    //
+    _uint64 below(_uint64 n) { return next() % n; }
 
 private:
-       void flush();
+    _uint64 state;
+};
 
+PairedReadSupplierGenerator *pairedReadSupplierGenerator = NULL;
+DataWriterSupplier *writerSupplier = NULL;
 
-    HANDLE       hFile;
-    size_t       bufferSize;
-    size_t       bufferUsed;
-    char        *buffer;
-};
+unsigned nBuckets;
+const char *tempPrefix;
+_uint64 seed;
 
-IntermediateFile::IntermediateFile(const char *fileName, size_t i_bufferSize) : bufferSize(i_bufferSize)
-{
-    hFile = CreateFile(fileName, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (INVALID_HANDLE_VALUE == hFile) {
-        fprintf(stderr,"Unable to open intermediate file '%s', %d\n", fileName, GetLastError());
-        return;
+FILE **bucketFiles;
+ExclusiveLock *bucketLocks;
+volatile int nextBucket;
+
+volatile _int64 nRunningThreads;
+SingleWaiterObject allThreadsDone;
+
+//
+// What each thread buffers for each bucket before appending it to the bucket's file.
+//
+const size_t ScatterBufferSize = 64 * 1024;
+
+struct ThreadContext {
+    unsigned    whichThread;
+    bool        shuffling;  // Else scattering
+
+    _int64      totalPairs;
+
+    ThreadContext() {
+        totalPairs = 0;
     }
-    buffer = new char[bufferSize];
-    bufferUsed = 0;
-}
+};
 
-IntermediateFile::~IntermediateFile()
+    void
+BucketFileName(char *buffer, size_t bufferSize, unsigned bucket)
 {
-    close();
+    snprintf(buffer, bufferSize, "%s.bucket.%d.tmp", tempPrefix, bucket);
 }
 
-    void
-IntermediateFile::addLines(char *lines, size_t size)
+    DataWriterSupplier *
+CreateWriterSupplier(const char *fileName, unsigned nThreads, int compressionLevel)
 {
-    if (size + bufferUsed > bufferSize) {
-        flush();
+    const size_t bufferSize = 16 * 1024 * 1024;
+    size_t nameLength = strlen(fileName);
+    if (nameLength > 3 && !_stricmp(fileName + nameLength - 3, ".gz")) {
+        GzipWriterFilterSupplier *gzipSupplier = DataWriterSupplier::gzip(true, BAM_BLOCK, nThreads, false, true, compressionLevel);
+        return DataWriterSupplier::create(fileName, bufferSize, gzipSupplier, NULL, 4, FileEncoderPool::gzip(gzipSupplier, nThreads));
     }
+    return DataWriterSupplier::create(fileName, bufferSize);
+}
 
-    memcpy(buffer + bufferUsed, lines, size);
+//
+// The most a read can take as FASTQ: @, the ID, the bases, +, the qualities and the newlines.
+//
+    size_t
+FASTQSize(Read *read)
+{
+    return read->getIdLength() + 2 * read->getUnclippedLength() + 6;
+}
 
-    bufferUsed += size;
+    size_t
+WriteFASTQ(char *buffer, Read *read)
+{
+    char *p = buffer;
+    *p++ = '@';
+    memcpy(p, read->getId(), read->getIdLength());
+    p += read->getIdLength();
+    *p++ = '\n';
+    memcpy(p, read->getUnclippedData(), read->getUnclippedLength());
+    p += read->getUnclippedLength();
+    *p++ = '\n';
+    *p++ = '+';
+    *p++ = '\n';
+    memcpy(p, read->getUnclippedQuality(), read->getUnclippedLength());
+    p += read->getUnclippedLength();
+    *p++ = '\n';
+    return p - buffer;
 }
 
     void
-IntermediateFile::close()
+FlushBucket(unsigned bucket, char *buffer, size_t *used)
 {
-    flush();
-    CloseHandle(hFile);
-    hFile = NULL;
+    if (0 == *used) {
+        return;
+    }
+    AcquireExclusiveLock(&bucketLocks[bucket]);
+    bool worked = 1 == fwrite(buffer, *used, 1, bucketFiles[bucket]);
+    ReleaseExclusiveLock(&bucketLocks[bucket]);
+    if (!worked) {
+        WriteErrorMessage("RandomizePIfastq: unable to write temp file for bucket %d\n", bucket);
+        soft_exit(1);
+    }
+    *used = 0;
 }
 
     void
-IntermediateFile::flush()
+Scatter(ThreadContext *context)
 {
-    DWORD bytesWritten;
-    if (!WriteFile(hFile, buffer, bufferUsed, &bytesWritten, NULL)) {
-        fprintf(stderr,"WriteFile failed, %d\n", GetLastError());
+    PairedReadSupplier *readSupplier = pairedReadSupplierGenerator->generateNewPairedReadSupplier();
+    if (NULL == readSupplier) {
+        //
+        // The input's already been handed out to the other threads.
+        //
         return;
     }
-    bufferUsed = 0;
+
+    char *buffers = (char *)BigAlloc(ScatterBufferSize * nBuckets);
+    size_t *used = new size_t[nBuckets];
+    memset(used, 0, sizeof(size_t) * nBuckets);
+    ShuffleRandom random(seed + context->whichThread);
+
+    Read *read[NUM_READS_PER_PAIR];
+    while (readSupplier->getNextReadPair(&read[0], &read[1])) {
+        unsigned bucket = (unsigned)random.below(nBuckets);
+        char *buffer = buffers + bucket * ScatterBufferSize;
+        size_t size = FASTQSize(read[0]) + FASTQSize(read[1]);
+        if (size > ScatterBufferSize) {
+            WriteErrorMessage("RandomizePIfastq: pair '%.*s' is too big\n", read[0]->getIdLength(), read[0]->getId());
+            soft_exit(1);
+        }
+        if (used[bucket] + size > ScatterBufferSize) {
+            FlushBucket(bucket, buffer, &used[bucket]);
+        }
+        for (int i = 0; i < NUM_READS_PER_PAIR; i++) {
+            used[bucket] += WriteFASTQ(buffer + used[bucket], read[i]);
+        }
+        context->totalPairs++;
+    }
+
+    for (unsigned i = 0; i < nBuckets; i++) {
+        FlushBucket(i, buffers + i * ScatterBufferSize, &used[i]);
+    }
+    delete [] used;
+    BigDealloc(buffers);
+    delete readSupplier;
 }
 
     void
-usage()
+Shuffle(ThreadContext *context)
 {
-    fprintf(stderr,"usage: RandomizePIfastq inputFile outputFile\n");
-}
+    DataWriter *writer = writerSupplier->getWriter();
+
+    for (;;) {
+        int bucket = InterlockedIncrementAndReturnNewValue(&nextBucket) - 1;
+        if (bucket >= (int)nBuckets) {
+            break;
+        }
 
-const int inputBufferSize = 100 * 1024 * 1024;
-char *inputBuffer[2];
+        char fileName[MAX_PATH];
+        BucketFileName(fileName, sizeof(fileName), bucket);
+        _int64 size = QueryFileSize(fileName);
+        FILE *file = fopen(fileName, "rb");
+        if (NULL == file || size < 0) {
+            WriteErrorMessage("RandomizePIfastq: unable to open temp file '%s'\n", fileName);
+            soft_exit(1);
+        }
+        if (0 == size) {
+            fclose(file);
+            DeleteSingleFile(fileName);
+            continue;
+        }
 
-    void
-main(int argc, const char **argv)
+        char *data = (char *)BigAlloc(size);
+        if (1 != fread(data, size, 1, file)) {
+            WriteErrorMessage("RandomizePIfastq: unable to read temp file '%s'\n", fileName);
+            soft_exit(1);
+        }
+        fclose(file);
+        DeleteSingleFile(fileName);
+
+        //
+        // A pair is 8 lines.  pairStart gets a last entry for the end, so pair i is pairStart[i] to pairStart[i+1].
+        //
+        std::vector<_int64> pairStart;
+        pairStart.push_back(0);
+        int nLines = 0;
+        for (_int64 i = 0; i < size; i++) {
+            if ('\n' == data[i] && 0 == ++nLines % 8) {
+                pairStart.push_back(i + 1);
+            }
+        }
+        _int64 nPairs = pairStart.size() - 1;
+
+        std::vector<_int64> order(nPairs);
+        for (_int64 i = 0; i < nPairs; i++) {
+            order[i] = i;
+        }
+        ShuffleRandom random(seed ^ ((_uint64)(bucket + 1) << 32));
+        for (_int64 i = nPairs - 1; i > 0; i--) {
+            _int64 j = (_int64)random.below(i + 1);
+            _int64 t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+
+        for (_int64 i = 0; i < nPairs; i++) {
+            size_t pairSize = pairStart[order[i] + 1] - pairStart[order[i]];
+            char *buffer;
+            size_t bufferSize;
+            if (!writer->getBuffer(&buffer, &bufferSize) || bufferSize < pairSize) {
+                writer->nextBatch();
+                if (!writer->getBuffer(&buffer, &bufferSize) || bufferSize < pairSize) {
+                    WriteErrorMessage("RandomizePIfastq: unable to get a write buffer\n");
+                    soft_exit(1);
+                }
+            }
+            memcpy(buffer, data + pairStart[order[i]], pairSize);
+            writer->advance(pairSize);
+        }
+        context->totalPairs += nPairs;
+
+        BigDealloc(data);
+    }
+
+    writer->close();
+    delete writer;
+}
+
+void
+WorkerThreadMain(void *param)
 {
-    for (int i = 0; i < 2; i++) {
-        inputBuffer[i] = new char[inputBufferSize];
+    ThreadContext *context = (ThreadContext *)param;
+
+    if (context->shuffling) {
+        Shuffle(context);
+    } else {
+        Scatter(context);
     }
-    const int nFiles = 1000;
 
-    if (3 != argc) {
-        usage();
-        return;
+    if (0 == InterlockedAdd64AndReturnNewValue(&nRunningThreads, -1)) {
+        SignalSingleWaiterObject(&allThreadsDone);
     }
+}
 
-    HANDLE hInputFile = CreateFile(argv[1],GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,NULL);
-    if (INVALID_HANDLE_VALUE == hInputFile) {
-        fprintf(stderr,"Unable to open '%s' for input, error %d\n", argv[1], GetLastError());
-        return;
+    _int64
+RunThreads(ThreadContext *contexts, unsigned nThreads, bool shuffling)
+{
+    nRunningThreads = nThreads;
+    CreateSingleWaiterObject(&allThreadsDone);
+    for (unsigned i = 0; i < nThreads; i++) {
+        contexts[i].whichThread = i;
+        contexts[i].shuffling = shuffling;
+        contexts[i].totalPairs = 0;
+        StartNewThread(WorkerThreadMain, &contexts[i]);
+    }
+    WaitForSingleWaiterObject(&allThreadsDone);
+    DestroySingleWaiterObject(&allThreadsDone);
+
+    _int64 totalPairs = 0;
+    for (unsigned i = 0; i < nThreads; i++) {
+        totalPairs += contexts[i].totalPairs;
     }
+    return totalPairs;
+}
 
-    IntermediateFile **files = new IntermediateFile *[nFiles];
-    for (int i = 0; i < nFiles; i++) {
-        char fileName[100];
-        sprintf(fileName,"piFQ.piece.%04d", i);
-        files[i] = new IntermediateFile(fileName, 10 * 1024 * 1024);
+int main(int argc, char * argv[])
+{
+    BigAllocUseHugePages = false;
+
+    unsigned nThreads = GetNumberOfProcessors();
+    int compressionLevel = GzipBlockCompressor::DefaultLevel;
+    nBuckets = 0;
+    seed = timeInMillis();
+    tempPrefix = NULL;
+
+    const char *fileArgs[2];
+    int nFileArgs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc && atoi(argv[i+1]) > 0) {
+            nThreads = atoi(argv[i+1]);
+            i++;
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc && atoi(argv[i+1]) > 0) {
+            nBuckets = atoi(argv[i+1]);
+            i++;
+        } else if (!strcmp(argv[i], "-seed") && i + 1 < argc) {
+            seed = strtoull(argv[i+1], NULL, 10);
+            i++;
+        } else if (!strcmp(argv[i], "-cl") && i + 1 < argc && argv[i+1][0] >= '0' && argv[i+1][0] <= '9' && atoi(argv[i+1]) <= 9) {
+            compressionLevel = atoi(argv[i+1]);
+            i++;
+        } else if (!strcmp(argv[i], "-tmp") && i + 1 < argc) {
+            tempPrefix = argv[i+1];
+            i++;
+        } else if (nFileArgs < 2) {
+            fileArgs[nFileArgs++] = argv[i];
+        } else {
+            usage();
+        }
     }
 
+    if (2 != nFileArgs) usage();
 
-    const int nLinesPerItem = 8;
+    const char *inputFileName = fileArgs[0];
+    if (NULL == tempPrefix) {
+        tempPrefix = fileArgs[1];
+    }
 
-    int whichInputBuffer = 0;
-    DWORD usedBytes = 0;
-    DWORD validBytes = 0;
-    bool done = false;
-    for (;;) {
-        DWORD leftoverBytes = validBytes - usedBytes;   // i.e., how much was in the old buffer minus what we used.
-        memcpy(inputBuffer[whichInputBuffer], inputBuffer[1 - whichInputBuffer] + usedBytes, leftoverBytes);
-        DWORD bytesRead;
-        if (!ReadFile(hInputFile, inputBuffer[whichInputBuffer] + leftoverBytes, inputBufferSize - leftoverBytes, &bytesRead, NULL)) {
-            fprintf(stderr,"Read error on input file %d\n", GetLastError());
-            return;
+    size_t inputNameLength = strlen(inputFileName);
+    bool gzipInput = inputNameLength > 3 && !_stricmp(inputFileName + inputNameLength - 3, ".gz");
+
+    if (0 == nBuckets) {
+        //
+        // FASTQ compresses about 4:1.
+        //
+        const _int64 bucketSize = (_int64)256 * 1024 * 1024;
+        _int64 inputSize = QueryFileSize(inputFileName);
+        if (inputSize < 0) {
+            fprintf(stderr, "Unable to open input file '%s'\n", inputFileName);
+            return 1;
         }
+        nBuckets = (unsigned)__max(nThreads, (inputSize * (gzipInput ? 4 : 1) + bucketSize - 1) / bucketSize);
+    }
 
-        if (0 == bytesRead) {
-            if (0 != leftoverBytes) {
-                fprintf(stderr,"Input file doesn't seem to have a multiple of %d lines\n", nLinesPerItem);
-            }
-            break;
-        }
+    DataSupplier::ThreadCount = nThreads;
 
-        validBytes = leftoverBytes + bytesRead; // i.e., what we copied from the last one, plus what's new
-        usedBytes = 0;
+    ReaderContext readerContext;
+    memset(&readerContext, 0, sizeof(readerContext));
+    readerContext.clipping = NoClipping;
+    readerContext.defaultReadGroup = "";
+    readerContext.compressionLevel = -1;
 
-        for (;;) {
- 
-            char *nextItem = inputBuffer[whichInputBuffer] + usedBytes;
+    pairedReadSupplierGenerator = PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(inputFileName, nThreads, readerContext, gzipInput);
+    if (NULL == pairedReadSupplierGenerator) {
+        fprintf(stderr, "Unable to open input file '%s'\n", inputFileName);
+        return 1;
+    }
 
-            int nNewLines = 0;
-            while (nNewLines < nLinesPerItem && usedBytes < validBytes) {
-                if (inputBuffer[whichInputBuffer][usedBytes] == '\n') {
-                    nNewLines++;
-                }
-                usedBytes++;    // NB: deliberately eating the \n
-            }
+    bucketFiles = new FILE *[nBuckets];
+    bucketLocks = new ExclusiveLock[nBuckets];
+    for (unsigned i = 0; i < nBuckets; i++) {
+        char fileName[MAX_PATH];
+        BucketFileName(fileName, sizeof(fileName), i);
+        bucketFiles[i] = fopen(fileName, "wb");
+        if (NULL == bucketFiles[i]) {
+            fprintf(stderr, "Unable to create temp file '%s'\n", fileName);
+            return 1;
+        }
+        InitializeExclusiveLock(&bucketLocks[i]);
+    }
 
-            if (nNewLines < nLinesPerItem) {
-                usedBytes = nextItem - inputBuffer[whichInputBuffer];
-                break;
-            }
+    ThreadContext *contexts = new ThreadContext[nThreads];
+    _int64 start = timeInMillis();
 
-            _uint64 whichFile = GoodFastRandom(nFiles - 1);
-            files[whichFile]->addLines(nextItem, usedBytes - (nextItem - inputBuffer[whichInputBuffer]));
-        }
+    _int64 totalPairs = RunThreads(contexts, nThreads, false);
+    delete pairedReadSupplierGenerator;
 
-        whichInputBuffer = 1 - whichInputBuffer;
+    for (unsigned i = 0; i < nBuckets; i++) {
+        if (0 != fclose(bucketFiles[i])) {
+            fprintf(stderr, "Unable to write temp file for bucket %d\n", i);
+            return 1;
+        }
+        DestroyExclusiveLock(&bucketLocks[i]);
     }
-
-    for (int i = 0; i < nFiles; i++) {
-        delete files[i];    // This also flushes them
+    delete [] bucketFiles;
+    delete [] bucketLocks;
+
+    _int64 scatterDone = timeInMillis();
+    fprintf(stderr, "Scattered %lld pairs to %d buckets in %llds\n", totalPairs, nBuckets, (scatterDone - start + 500) / 1000);
+
+    writerSupplier = CreateWriterSupplier(fileArgs[1], nThreads, compressionLevel);
+    nextBucket = 0;
+    _int64 shuffledPairs = RunThreads(contexts, nThreads, true);
+    writerSupplier->close();
+    delete writerSupplier;
+    delete [] contexts;
+
+    if (shuffledPairs != totalPairs) {
+        fprintf(stderr, "Wrote %lld pairs, but read %lld\n", shuffledPairs, totalPairs);
+        return 1;
     }
-}
\ No newline at end of file
+
+    fprintf(stderr, "Shuffled and wrote them in %llds\n", (timeInMillis() - scatterDone + 500) / 1000);
+
+    return 0;
+}
@@ -0,0 +1,679 @@
+/*++
+
+Module Name:
+
+    SNAPBench.cpp
+
+Abstract:
+
+    End to end throughput benchmark for SNAP that needs no data.  It makes a synthetic reference, with a controllable
+    amount of repeated sequence, and simulated paired reads from it with a controllable error profile and insert size
+    distribution.  Then it runs a snap-aligner binary on them to build an index, align the reads single and paired, and
+    align them paired into a sorted BAM, and reports each stage's wall time, reads per second, CPU time and peak RSS.
+
+    For the alignment stages it also has SNAP write a -metrics report and picks the time spent aligning, waiting for
+    input and output, and compressing and decompressing out of the last one, so a regression can be pinned on a stage.
+
+    Everything is generated from -seed, so two builds or two machines given the same arguments do exactly the same work.
+    Pass -snap to say which snap-aligner to run, so that builds can be compared side by side.
+
+Environment:
+
+    User mode app.  It runs snap-aligner as a child process, so it's for Linux and OS X.
+
+--*/
+
+#include "stdafx.h"
+#include "Compat.h"
+
+#ifdef _MSC_VER
+
+int main(int argc, const char **argv)
+{
+    fprintf(stderr, "SNAPBench runs snap-aligner as a child process, and is only supported on Linux and OS X.\n");
+    return 1;
+}
+
+#else   // _MSC_VER
+
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern char *FormatUIntWithCommas(_uint64 val, char *outputBuffer, size_t outputBufferSize);   // As in AlignerContext.cpp, not the one in Util.h
+
+//
+// A small, fast generator, so that everything comes out the same for a given -seed.
+//
+class BenchRandom {
+public:
+    BenchRandom(_uint64 seed) : state(seed * 0x9e3779b97f4a7c15ull + 1) {}
+
+    _uint64 next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    unsigned below(unsigned n) { return (unsigned)(next() % n); }
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    bool chance(double p) { return uniform() < p; }
+    char base() { return "ACGT"[next() & 3]; }
+
+    double normal(double mean, double sd) {   // Box-Muller
+        double u1 = uniform(), u2 = uniform();
+        return mean + sd * sqrt(-2.0 * log(u1 > 0 ? u1 : 1e-300)) * cos(2 * 3.14159265358979 * u2);
+    }
+
+private:
+    _uint64 state;
+};
+
+struct BenchOptions {
+    const char  *snap;
+    const char  *workDir;
+    _int64       genomeSize;
+    int          nContigs;
+    double       repeatFraction;
+    int          repeatLength;
+    int          nRepeatFamilies;
+    double       repeatDivergence;
+    _int64       nPairs;
+    int          readLength;
+    double       substitutionRate;          // At the 5' end of a read
+    double       substitutionRateAt3Prime;  // Rising linearly to this at the 3' end
+    double       indelRate;
+    double       nRate;
+    int          insertMean;
+    int          insertSD;
+    int          nThreads;
+    _uint64      seed;
+    const char  *stages;
+    const char  *jsonFile;
+    bool         keep;
+    bool         regenerate;
+
+    BenchOptions() : snap("./snap-aligner"), workDir("snapbench-work"), genomeSize(50 * 1000 * 1000), nContigs(4),
+        repeatFraction(0.1), repeatLength(1000), nRepeatFamilies(50), repeatDivergence(0.01), nPairs(500 * 1000),
+        readLength(150), substitutionRate(0.002), substitutionRateAt3Prime(0.01), indelRate(0.0002), nRate(0.0005),
+        insertMean(350), insertSD(50), nThreads(0), seed(1), stages("index,single,paired,sorted"), jsonFile(NULL),
+        keep(false), regenerate(false) {}
+};
+
+static void usage()
+{
+    BenchOptions defaults;
+    fprintf(stderr,
+        "usage: SNAPBench [options]\n"
+        "Generates a reference and simulated reads, runs snap-aligner on them, and reports how fast each stage was.\n"
+        "  -snap path    the snap-aligner to benchmark (default %s)\n"
+        "  -dir dir      where to put the reference, reads, index and outputs (default %s)\n"
+        "  -keep         leave the work directory behind.  Its reference and reads are reused by later runs with the\n"
+        "                same generation options unless -regenerate is given\n"
+        "  -o file       also write the results to file, as one JSON object per stage\n"
+        "  -stages list  comma separated, from index, single, paired and sorted (default %s)\n"
+        "  -t n          threads for SNAP (default is SNAP's default, one per core)\n"
+        "  -seed n       seed for everything generated (default %llu)\n"
+        "Reference:\n"
+        "  -g bases      genome size (default %lld)\n"
+        "  -contigs n    number of contigs (default %d)\n"
+        "  -repeat f     fraction of the genome made of copies of repeat families (default %g)\n"
+        "  -repeatLen n  length of a repeat (default %d)\n"
+        "  -families n   number of repeat families (default %d)\n"
+        "  -divergence f substitution rate between copies of a repeat (default %g)\n"
+        "Reads:\n"
+        "  -n pairs      read pairs to simulate; the single end stage aligns the first read of each (default %lld)\n"
+        "  -len n        read length (default %d)\n"
+        "  -sub f        substitution error rate at the 5' end (default %g)\n"
+        "  -sub3 f       substitution error rate at the 3' end, rising linearly from -sub (default %g)\n"
+        "  -indel f      rate of one base insertions and deletions (default %g)\n"
+        "  -N f          rate of N calls (default %g)\n"
+        "  -insert n     mean insert size (default %d)\n"
+        "  -insertSD n   insert size standard deviation (default %d)\n",
+        defaults.snap, defaults.workDir, defaults.stages, defaults.seed, defaults.genomeSize, defaults.nContigs,
+        defaults.repeatFraction, defaults.repeatLength, defaults.nRepeatFamilies, defaults.repeatDivergence, defaults.nPairs,
+        defaults.readLength, defaults.substitutionRate, defaults.substitutionRateAt3Prime, defaults.indelRate, defaults.nRate,
+        defaults.insertMean, defaults.insertSD);
+    exit(1);
+}
+
+static void parseOptions(int argc, const char **argv, BenchOptions *options)
+{
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (!strcmp(arg, "-keep")) {
+            options->keep = true;
+            continue;
+        }
+        if (!strcmp(arg, "-regenerate")) {
+            options->regenerate = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage();
+        }
+        const char *value = argv[++i];
+        if (!strcmp(arg, "-snap")) {
+            options->snap = value;
+        } else if (!strcmp(arg, "-dir")) {
+            options->workDir = value;
+        } else if (!strcmp(arg, "-o")) {
+            options->jsonFile = value;
+        } else if (!strcmp(arg, "-stages")) {
+            options->stages = value;
+        } else if (!strcmp(arg, "-t")) {
+            options->nThreads = atoi(value);
+        } else if (!strcmp(arg, "-seed")) {
+            options->seed = strtoull(value, NULL, 10);
+        } else if (!strcmp(arg, "-g")) {
+            options->genomeSize = atoll(value);
+        } else if (!strcmp(arg, "-contigs")) {
+            options->nContigs = atoi(value);
+        } else if (!strcmp(arg, "-repeat")) {
+            options->repeatFraction = atof(value);
+        } else if (!strcmp(arg, "-repeatLen")) {
+            options->repeatLength = atoi(value);
+        } else if (!strcmp(arg, "-families")) {
+            options->nRepeatFamilies = atoi(value);
+        } else if (!strcmp(arg, "-divergence")) {
+            options->repeatDivergence = atof(value);
+        } else if (!strcmp(arg, "-n")) {
+            options->nPairs = atoll(value);
+        } else if (!strcmp(arg, "-len")) {
+            options->readLength = atoi(value);
+        } else if (!strcmp(arg, "-sub")) {
+            options->substitutionRate = atof(value);
+        } else if (!strcmp(arg, "-sub3")) {
+            options->substitutionRateAt3Prime = atof(value);
+        } else if (!strcmp(arg, "-indel")) {
+            options->indelRate = atof(value);
+        } else if (!strcmp(arg, "-N")) {
+            options->nRate = atof(value);
+        } else if (!strcmp(arg, "-insert")) {
+            options->insertMean = atoi(value);
+        } else if (!strcmp(arg, "-insertSD")) {
+            options->insertSD = atoi(value);
+        } else {
+            usage();
+        }
+    }
+
+    if (options->nContigs < 1 || options->genomeSize / options->nContigs < 10 * (options->insertMean + 4 * options->insertSD) ||
+        options->readLength < 20 || options->readLength > options->insertMean || options->nPairs < 1 ||
+        options->repeatFraction < 0 || options->repeatFraction > 0.9 || options->repeatLength < 1 || options->nRepeatFamilies < 1) {
+        fprintf(stderr, "SNAPBench: the contigs must be much longer than the inserts, which must be at least a read long, and the repeat\n"
+            "fraction must be between 0 and 0.9.\n");
+        exit(1);
+    }
+}
+
+//
+// The reference: nContigs contigs of random bases, with repeatFraction of them overwritten by diverged copies of
+// nRepeatFamilies repeats.
+//
+static char **GenerateReference(const BenchOptions &options, const char *fileName, _int64 *o_contigLength)
+{
+    BenchRandom random(options.seed);
+    _int64 contigLength = options.genomeSize / options.nContigs;
+
+    char **repeats = new char *[options.nRepeatFamilies];
+    for (int f = 0; f < options.nRepeatFamilies; f++) {
+        repeats[f] = new char[options.repeatLength];
+        for (int i = 0; i < options.repeatLength; i++) {
+            repeats[f][i] = random.base();
+        }
+    }
+
+    FILE *file = fopen(fileName, "w");
+    if (file == NULL) {
+        fprintf(stderr, "SNAPBench: unable to create %s\n", fileName);
+        exit(1);
+    }
+
+    char **contigs = new char *[options.nContigs];
+    for (int c = 0; c < options.nContigs; c++) {
+        char *contig = contigs[c] = new char[contigLength];
+        for (_int64 i = 0; i < contigLength; i++) {
+            contig[i] = random.base();
+        }
+
+        _int64 nCopies = (_int64)(contigLength * options.repeatFraction / options.repeatLength);
+        for (_int64 copy = 0; copy < nCopies; copy++) {
+            const char *repeat = repeats[random.below(options.nRepeatFamilies)];
+            _int64 where = (_int64)(random.uniform() * (contigLength - options.repeatLength));
+            for (int i = 0; i < options.repeatLength; i++) {
+                contig[where + i] = random.chance(options.repeatDivergence) ? random.base() : repeat[i];
+            }
+        }
+
+        fprintf(file, ">chr%d\n", c + 1);
+        for (_int64 i = 0; i < contigLength; i += 80) {
+            fprintf(file, "%.*s\n", (int)__min((_int64)80, contigLength - i), contig + i);
+        }
+    }
+
+    fclose(file);
+    for (int f = 0; f < options.nRepeatFamilies; f++) {
+        delete[] repeats[f];
+    }
+    delete[] repeats;
+
+    *o_contigLength = contigLength;
+    return contigs;
+}
+
+static char ComplementOf(char base)
+{
+    switch (base) {
+    case 'A': return 'T';
+    case 'C': return 'G';
+    case 'G': return 'C';
+    case 'T': return 'A';
+    default: return 'N';
+    }
+}
+
+//
+// Sequence one end of a fragment, applying the error profile.  source is the fragment in the sense the read is
+// sequenced in, with enough bases after it for the deletions.  Qualities are lower where the errors are.
+//
+static void SequenceRead(const BenchOptions &options, BenchRandom &random, const char *source, char *bases, char *qualities)
+{
+    int len = options.readLength;
+    int from = 0;
+    for (int i = 0; i < len; i++) {
+        double subRate = options.substitutionRate + (options.substitutionRateAt3Prime - options.substitutionRate) * i / len;
+        char quality = (char)('!' + 37 - (int)(8.0 * i / len));
+        if (random.chance(options.indelRate)) {
+            if (random.next() & 1) {
+                bases[i] = random.base();   // Insertion
+                qualities[i] = quality;
+                continue;
+            }
+            from++;                         // Deletion
+        }
+        char base = source[from++];
+        if (random.chance(options.nRate)) {
+            base = 'N';
+            quality = '#';
+        } else if (random.chance(subRate)) {
+            char substitute;
+            while ((substitute = random.base()) == base) {
+            }
+            base = substitute;
+            quality = (char)('!' + 5 + random.below(15));
+        }
+        bases[i] = base;
+        qualities[i] = quality;
+    }
+    bases[len] = qualities[len] = '\0';
+}
+
+static void GenerateReads(const BenchOptions &options, char **contigs, _int64 contigLength, const char *fileName0, const char *fileName1)
+{
+    BenchRandom random(options.seed + 1);
+    FILE *files[2] = {fopen(fileName0, "w"), fopen(fileName1, "w")};
+    if (files[0] == NULL || files[1] == NULL) {
+        fprintf(stderr, "SNAPBench: unable to create the read files in %s\n", options.workDir);
+        exit(1);
+    }
+
+    int len = options.readLength;
+    int maxInsert = options.insertMean + 4 * options.insertSD;
+    char *forward = new char[2 * len];  // Twice the read length leaves room for deletions
+    char *reverse = new char[2 * len];
+    char *bases = new char[len + 1];
+    char *qualities = new char[len + 1];
+
+    for (_int64 pair = 0; pair < options.nPairs; pair++) {
+        int insert = (int)random.normal(options.insertMean, options.insertSD);
+        insert = __max(len, __min(maxInsert, insert));
+        int contig = random.below(options.nContigs);
+        _int64 start = len + (_int64)(random.uniform() * (contigLength - insert - 3 * len));
+        bool flip = random.next() & 1;
+
+        //
+        // One end reads the forward strand from the start of the fragment, the other the reverse strand from its end.
+        // Which is first depends on which strand the fragment came from.
+        //
+        const char *fragment = contigs[contig] + start;
+        for (int i = 0; i < 2 * len; i++) {
+            forward[i] = fragment[i];
+            reverse[i] = ComplementOf(fragment[insert - 1 - i]);
+        }
+
+        for (int end = 0; end < 2; end++) {
+            SequenceRead(options, random, (end == 0) != flip ? forward : reverse, bases, qualities);
+            fprintf(files[end], "@sim_%lld_chr%d_%lld_%d%s/%d\n%s\n+\n%s\n", pair, contig + 1, start + 1, insert,
+                flip ? "_rc" : "", end + 1, bases, qualities);
+        }
+    }
+
+    fclose(files[0]);
+    fclose(files[1]);
+    delete[] forward;
+    delete[] reverse;
+    delete[] bases;
+    delete[] qualities;
+}
+
+//
+// The generation options, written next to the reference and reads so that a later -keep run can tell whether they
+// can be reused.
+//
+static void DescribeInputs(const BenchOptions &options, char *buffer, size_t bufferSize)
+{
+    snprintf(buffer, bufferSize, "seed=%llu g=%lld contigs=%d repeat=%g repeatLen=%d families=%d divergence=%g n=%lld len=%d "
+        "sub=%g sub3=%g indel=%g N=%g insert=%d insertSD=%d\n", options.seed, options.genomeSize, options.nContigs,
+        options.repeatFraction, options.repeatLength, options.nRepeatFamilies, options.repeatDivergence, options.nPairs,
+        options.readLength, options.substitutionRate, options.substitutionRateAt3Prime, options.indelRate, options.nRate,
+        options.insertMean, options.insertSD);
+}
+
+struct StageResult {
+    const char  *name;
+    bool         succeeded;
+    _int64       reads;             // Reads aligned, or 0 for the index build
+    double       wallSeconds;
+    double       userSeconds;
+    double       systemSeconds;
+    _int64       peakRSSKB;
+
+    //
+    // From SNAP's last -metrics report, for the alignment stages.  Negative if there wasn't one.
+    //
+    double       aligningSeconds;
+    double       readWaitSeconds;
+    double       writeWaitSeconds;
+    double       decompressSeconds;
+    double       compressSeconds;
+};
+
+//
+// Run snap-aligner with args, with its output going to logFile, and fill in the wall time and what getrusage says
+// about it.
+//
+static bool RunSnap(const BenchOptions &options, std::vector<const char *> &args, const char *logFile, StageResult *result)
+{
+    args.insert(args.begin(), options.snap);
+    args.push_back(NULL);
+
+    fprintf(stderr, "SNAPBench:");
+    for (size_t i = 0; args[i] != NULL; i++) {
+        fprintf(stderr, " %s", args[i]);
+    }
+    fprintf(stderr, "\n");
+
+    _int64 start = timeInMillis();
+    pid_t child = fork();
+    if (child < 0) {
+        fprintf(stderr, "SNAPBench: fork failed, errno %d\n", errno);
+        exit(1);
+    }
+    if (child == 0) {
+        int log = open(logFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log >= 0) {
+            dup2(log, 1);
+            dup2(log, 2);
+            close(log);
+        }
+        execv(options.snap, (char * const *)&args[0]);
+        fprintf(stderr, "SNAPBench: unable to run %s, errno %d\n", options.snap, errno);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) != child) {
+        fprintf(stderr, "SNAPBench: wait4 failed, errno %d\n", errno);
+        exit(1);
+    }
+    result->wallSeconds = (timeInMillis() - start) / 1000.0;
+    result->userSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    result->systemSeconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+    result->peakRSSKB = usage.ru_maxrss / 1024;     // Bytes on OS X
+#else
+    result->peakRSSKB = usage.ru_maxrss;            // KB on Linux
+#endif
+    result->succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!result->succeeded) {
+        fprintf(stderr, "SNAPBench: %s failed; see %s\n", result->name, logFile);
+    }
+    return result->succeeded;
+}
+
+//
+// Pick the totals out of the last Prometheus format report that -metrics wrote.
+//
+static void ReadMetrics(const char *fileName, StageResult *result)
+{
+    result->aligningSeconds = result->readWaitSeconds = result->writeWaitSeconds = -1;
+    result->decompressSeconds = result->compressSeconds = -1;
+
+    FILE *file = fopen(fileName, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char line[1000];
+    double busy = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char name[200];
+        double value;
+        if (line[0] == '#' || sscanf(line, "%199s %lf", name, &value) != 2) {
+            continue;
+        }
+        if (!strcmp(name, "snap_reads_total")) {
+            result->reads = (_int64)value;
+        } else if (!strncmp(name, "snap_thread_busy_seconds_total{", 31)) {
+            busy += value;
+        } else if (!strcmp(name, "snap_read_wait_seconds_total")) {
+            result->readWaitSeconds = value;
+        } else if (!strcmp(name, "snap_write_wait_seconds_total")) {
+            result->writeWaitSeconds = value;
+        } else if (!strcmp(name, "snap_decompress_seconds_total")) {
+            result->decompressSeconds = value;
+        } else if (!strcmp(name, "snap_compress_seconds_total")) {
+            result->compressSeconds = value;
+        }
+    }
+    result->aligningSeconds = busy;
+    fclose(file);
+}
+
+static bool HasStage(const BenchOptions &options, const char *stage)
+{
+    size_t len = strlen(stage);
+    for (const char *p = options.stages; *p != '\0'; ) {
+        const char *comma = strchr(p, ',');
+        size_t itemLen = comma == NULL ? strlen(p) : comma - p;
+        if (itemLen == len && !strncmp(p, stage, len)) {
+            return true;
+        }
+        if (comma == NULL) {
+            break;
+        }
+        p = comma + 1;
+    }
+    return false;
+}
+
+static void PrintResult(const StageResult &result, FILE *json, const BenchOptions &options)
+{
+    char rss[30], reads[30], rate[30];
+    printf("%-8s %10.1f %10.1f %10.1f %12s %12s %14s", result.name, result.wallSeconds, result.userSeconds, result.systemSeconds,
+        FormatUIntWithCommas(result.peakRSSKB / 1024, rss, sizeof(rss)), FormatUIntWithCommas(result.reads, reads, sizeof(reads)),
+        FormatUIntWithCommas(result.reads == 0 ? 0 : (_uint64)(result.reads / __max(result.wallSeconds, 0.001)), rate, sizeof(rate)));
+    if (result.aligningSeconds >= 0) {
+        printf("  aligning %.1fs, read wait %.1fs, write wait %.1fs, decompress %.1fs, compress %.1fs", result.aligningSeconds,
+            result.readWaitSeconds, result.writeWaitSeconds, result.decompressSeconds, result.compressSeconds);
+    }
+    printf("%s\n", result.succeeded ? "" : "  FAILED");
+
+    if (json != NULL) {
+        fprintf(json, "{\"stage\":\"%s\",\"succeeded\":%s,\"genomeSize\":%lld,\"readLength\":%d,\"reads\":%lld,"
+            "\"wallSeconds\":%.3f,\"userSeconds\":%.3f,\"systemSeconds\":%.3f,\"peakRSSKB\":%lld,\"readsPerSecond\":%.1f",
+            result.name, result.succeeded ? "true" : "false", options.genomeSize, options.readLength, result.reads,
+            result.wallSeconds, result.userSeconds, result.systemSeconds, result.peakRSSKB,
+            result.reads / __max(result.wallSeconds, 0.001));
+        if (result.aligningSeconds >= 0) {
+            fprintf(json, ",\"aligningThreadSeconds\":%.3f,\"readWaitSeconds\":%.3f,\"writeWaitSeconds\":%.3f,"
+                "\"decompressSeconds\":%.3f,\"compressSeconds\":%.3f", result.aligningSeconds, result.readWaitSeconds,
+                result.writeWaitSeconds, result.decompressSeconds, result.compressSeconds);
+        }
+        fprintf(json, "}\n");
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    BenchOptions options;
+    parseOptions(argc, argv, &options);
+
+    mkdir(options.workDir, 0755);
+    const size_t pathSize = 4096;
+    char reference[pathSize], reads0[pathSize], reads1[pathSize], index[pathSize], paramsFile[pathSize];
+    snprintf(reference, pathSize, "%s/reference.fa", options.workDir);
+    snprintf(reads0, pathSize, "%s/reads_1.fq", options.workDir);
+    snprintf(reads1, pathSize, "%s/reads_2.fq", options.workDir);
+    snprintf(index, pathSize, "%s/index", options.workDir);
+    snprintf(paramsFile, pathSize, "%s/inputs.txt", options.workDir);
+
+    char params[1000], oldParams[1000] = "";
+    DescribeInputs(options, params, sizeof(params));
+    FILE *file = fopen(paramsFile, "r");
+    if (file != NULL) {
+        if (fgets(oldParams, sizeof(oldParams), file) == NULL) {
+            oldParams[0] = '\0';
+        }
+        fclose(file);
+    }
+
+    struct stat statBuffer;
+    if (options.regenerate || strcmp(params, oldParams) != 0 || stat(reads1, &statBuffer) != 0) {
+        _int64 start = timeInMillis();
+        fprintf(stderr, "SNAPBench: generating a %lld base reference and %lld read pairs in %s... ", options.genomeSize,
+            options.nPairs, options.workDir);
+        unlink(paramsFile);
+        _int64 contigLength;
+        char **contigs = GenerateReference(options, reference, &contigLength);
+        GenerateReads(options, contigs, contigLength, reads0, reads1);
+        for (int c = 0; c < options.nContigs; c++) {
+            delete[] contigs[c];
+        }
+        delete[] contigs;
+        file = fopen(paramsFile, "w");
+        if (file != NULL) {
+            fputs(params, file);
+            fclose(file);
+        }
+        fprintf(stderr, "%llds\n", (timeInMillis() - start) / 1000);
+    } else {
+        fprintf(stderr, "SNAPBench: reusing the reference and reads in %s\n", options.workDir);
+    }
+
+    char threads[20];
+    snprintf(threads, sizeof(threads), "-t%d", options.nThreads);
+
+    FILE *json = NULL;
+    if (options.jsonFile != NULL && (json = fopen(options.jsonFile, "w")) == NULL) {
+        fprintf(stderr, "SNAPBench: unable to create %s\n", options.jsonFile);
+        exit(1);
+    }
+
+    std::vector<StageResult> results;
+    static const char *stageNames[] = {"index", "single", "paired", "sorted"};
+    bool allSucceeded = true;
+    for (int s = 0; s < 4; s++) {
+        const char *stage = stageNames[s];
+        if (!HasStage(options, stage)) {
+            continue;
+        }
+        if (s > 0 && stat(index, &statBuffer) != 0) {
+            fprintf(stderr, "SNAPBench: there's no index in %s for the %s stage; include the index stage\n", index, stage);
+            exit(1);
+        }
+
+        StageResult result;
+        memset(&result, 0, sizeof(result));
+        result.name = stage;
+        result.aligningSeconds = -1;
+
+        char logFile[pathSize], metricsFile[pathSize], outputFile[pathSize];
+        snprintf(logFile, pathSize, "%s/%s.log", options.workDir, stage);
+        snprintf(metricsFile, pathSize, "%s/%s.prom", options.workDir, stage);
+        snprintf(outputFile, pathSize, "%s/%s.%s", options.workDir, stage, s == 3 ? "bam" : "sam");
+
+        std::vector<const char *> args;
+        if (s == 0) {
+            args.push_back("index");
+            args.push_back(reference);
+            args.push_back(index);
+            if (options.nThreads > 0) {
+                args.push_back(threads);
+            }
+        } else {
+            args.push_back(s == 1 ? "single" : "paired");
+            args.push_back(index);
+            args.push_back(reads0);
+            if (s > 1) {
+                args.push_back(reads1);
+            }
+            args.push_back("-o");
+            args.push_back(outputFile);
+            if (s == 3) {
+                args.push_back("-so");
+            }
+            if (options.nThreads > 0) {
+                args.push_back("-t");
+                args.push_back(threads + 2);
+            }
+            args.push_back("-metrics");
+            args.push_back(metricsFile);
+            unlink(metricsFile);
+        }
+
+        allSucceeded &= RunSnap(options, args, logFile, &result);
+        if (s > 0) {
+            ReadMetrics(metricsFile, &result);
+        }
+        results.push_back(result);
+    }
+
+    printf("\n%-8s %10s %10s %10s %12s %12s %14s\n", "stage", "wall (s)", "user (s)", "sys (s)", "peak RSS MB", "reads", "reads/s");
+    for (size_t i = 0; i < results.size(); i++) {
+        PrintResult(results[i], json, options);
+    }
+    if (json != NULL) {
+        fclose(json);
+    }
+
+    if (!options.keep) {
+        for (size_t i = 0; i < results.size(); i++) {
+            char path[pathSize];
+            static const char *suffixes[] = {"log", "prom", "sam", "bam", "bam.bai"};
+            for (int j = 0; j < 5; j++) {
+                snprintf(path, pathSize, "%s/%s.%s", options.workDir, results[i].name, suffixes[j]);
+                unlink(path);
+            }
+        }
+        static const char *indexFiles[] = {"Genome", "GenomeIndex", "GenomeIndexHash", "OverflowTable"};
+        for (int j = 0; j < 4; j++) {
+            char path[pathSize];
+            snprintf(path, pathSize, "%s/%s", index, indexFiles[j]);
+            unlink(path);
+        }
+        rmdir(index);
+        unlink(reference);
+        unlink(reads0);
+        unlink(reads1);
+        unlink(paramsFile);
+        rmdir(options.workDir);
+    }
+
+    return allSucceeded ? 0 : 1;
+}
+
+#endif  // _MSC_VER
@@ -30,8 +30,10 @@ Adapted from cSNAP, which was in turn adapted from the scala prototype
 void
 usage()
 {
-	fprintf(stderr, "usage: SNAPCommand {-p PipeName} <command to send to SNAP>\n");
+	fprintf(stderr, "usage: SNAPCommand {-p PipeName | -s Socket} <command to send to SNAP>\n");
+	fprintf(stderr, "Use -s to talk to a daemon started with -s, giving it the same socket ([host:]port or a Unix socket path).\n");
 	fprintf(stderr, "Send command 'exit' to SNAP to have the server process exit.\n");
+	fprintf(stderr, "Input and output of '-' are our own stdin and stdout, streamed to and from SNAP.\n");
 	soft_exit_no_print(1);
 }
 
@@ -43,19 +45,24 @@ int main(int argc, const char **argv)
 	}
 
 	const char *pipeName;
+	const char *socketAddress = NULL;
 	int startingArg;
 
-	if (strcmp(argv[1], "-p") == 0) {
+	if (strcmp(argv[1], "-p") == 0 || strcmp(argv[1], "-s") == 0) {
 		if (argc < 4) usage();
 
-		pipeName = argv[2];
+		if (strcmp(argv[1], "-s") == 0) {
+			socketAddress = argv[2];
+		} else {
+			pipeName = argv[2];
+		}
 		startingArg = 3;
 	} else {
 		pipeName = DEFAULT_NAMED_PIPE_NAME;
 		startingArg = 1;
 	}
 
-	NamedPipe *serverPipe = OpenNamedPipe(pipeName, false);
+	NamedPipe *serverPipe = (NULL != socketAddress) ? ConnectToCommandSocket(socketAddress) : OpenNamedPipe(pipeName, false);
 
 	if (NULL == serverPipe) {
 		fprintf(stderr, "Unable to open pipe to server\n");
@@ -85,17 +92,55 @@ int main(int argc, const char **argv)
 	}
 
 	//
-	// Now process the results from SNAP, printing them out and waiting for the terminator.
+	// If stdout is carrying the command's output, its messages go to stderr instead.
 	//
-	const size_t outputBufferSize = 100000;
-	char outputBuffer[outputBufferSize];
+	FILE *messageFile = stdout;
+	for (int i = startingArg; i < argc; i++) {
+		if (strcmp(argv[i], "-") == 0) {
+			messageFile = stderr;
+		}
+	}
+
+#ifdef _MSC_VER
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif // _MSC_VER
+
+	//
+	// Now process the results from SNAP, printing them out and waiting for the terminator, and sending our stdin
+	// when SNAP asks for it.
+	//
+	const size_t outputBufferSize = DaemonStreamTagSize + DaemonStreamChunkSize + 1;
+	char *outputBuffer = new char[outputBufferSize];
+	char *inputBuffer = new char[DaemonStreamTagSize + DaemonStreamChunkSize];
+	size_t messageLength;
+
+	while (ReadBytesFromNamedPipe(serverPipe, outputBuffer, outputBufferSize - 1, &messageLength)) {
+		if (messageLength >= DaemonStreamTagSize && '\0' == outputBuffer[0]) {
+			if ('D' == outputBuffer[1]) {
+				fwrite(outputBuffer + DaemonStreamTagSize, 1, messageLength - DaemonStreamTagSize, stdout);
+			} else if ('R' == outputBuffer[1]) {
+				outputBuffer[messageLength] = '\0';
+				size_t bytesWanted = __min((size_t)atoll(outputBuffer + DaemonStreamTagSize), DaemonStreamChunkSize);
+				inputBuffer[0] = '\0';
+				inputBuffer[1] = 'D';
+				fflush(stdout);
+				size_t bytesRead = fread(inputBuffer + DaemonStreamTagSize, 1, bytesWanted, stdin);
+				if (!WriteBytesToNamedPipe(serverPipe, inputBuffer, DaemonStreamTagSize + bytesRead)) {
+					fprintf(stderr, "Error sending input to server\n");
+					soft_exit(1);
+				}
+			}
+			continue;
+		}
 
-	while (ReadFromNamedPipe(serverPipe, outputBuffer, outputBufferSize)) {
+		outputBuffer[messageLength] = '\0';
 		if (strcmp(outputBuffer, CommandExecutedString) == 0) {
+			fflush(stdout);
 			soft_exit_no_print(0);
 		}
-		printf("%s", outputBuffer);
-		fflush(stdout);
+		fprintf(messageFile, "%s", outputBuffer);
+		fflush(messageFile);
 	}
 
 	fprintf(stderr, "Error reading from server pipe\n");
@@ -29,25 +29,38 @@ Revision History:
 #include "Read.h"
 #include "RangeSplitter.h"
 #include "BigAlloc.h"
-#include "FASTQ.h"
+#include "DataWriter.h"
+#include "GzipDataWriter.h"
+#include "GzipBlockCodec.h"
 
 void usage()
 {
-    fprintf(stderr,"usage: ToFASTQ genomeIndex inputFile outputFile {outputFile2}\n");
+    fprintf(stderr,"usage: ToFASTQ genomeIndex inputFile outputFile {outputFile2} {-t threads} {-cl level}\n");
     fprintf(stderr,"       Specifying two output files means that the input is paired.  If you specify only one output file, then\n");
     fprintf(stderr,"       ToFASTQ will generate a single-ended FASTQ even for a paired input.\n");
     fprintf(stderr,"       The genomeIndex must contain the same set of contigs used to align the input file.\n");
     fprintf(stderr,"       To produce interleaved paired-end FASTQ, specify outputFile2 as '-i'.\n");
+    fprintf(stderr,"       Output files whose names end in .gz are written BGZF compressed, at zlib level -cl (default 6).\n");
+    fprintf(stderr,"       -t is the number of threads to use for reading, converting and compressing; default all of the cores.\n");
   	soft_exit(1);
 }
 
 ReadSupplierGenerator *readSupplierGenerator = NULL;
+PairedReadSupplierGenerator *pairedReadSupplierGenerator = NULL;
 
 volatile _int64 nRunningThreads;
 SingleWaiterObject allThreadsDone;
 const char *inputFileName;
 const Genome *genome;
-FASTQWriter *fastqWriter[2] = {NULL, NULL};
+DataWriterSupplier *writerSupplier[2] = {NULL, NULL};
+bool interleaved = false;
+
+//
+// The two files of a pair have to hold the same reads in the same order, but each thread's batches land in a file in
+// whatever order the threads finish them.  So a thread moves both of its writers on to the next batch together while
+// holding this lock, which puts its batches at the same place in both files.
+//
+ExclusiveLock pairedBatchLock;
 
 struct ThreadContext {
     unsigned    whichThread;
@@ -63,55 +76,163 @@ bool inline isADigit(char x) {
     return x >= '0' && x <= '9';
 }
 
-void
-WorkerThreadMain(void *param)
+    DataWriterSupplier *
+CreateWriterSupplier(const char *fileName, unsigned nThreads, int compressionLevel)
 {
-    ThreadContext *context = (ThreadContext *)param;
+    const size_t bufferSize = 16 * 1024 * 1024;
+    size_t nameLength = strlen(fileName);
+    if (nameLength > 3 && !_stricmp(fileName + nameLength - 3, ".gz")) {
+        GzipWriterFilterSupplier *gzipSupplier = DataWriterSupplier::gzip(true, BAM_BLOCK, nThreads, false, true, compressionLevel);
+        return DataWriterSupplier::create(fileName, bufferSize, gzipSupplier, NULL, 4, FileEncoderPool::gzip(gzipSupplier, nThreads));
+    }
+    return DataWriterSupplier::create(fileName, bufferSize);
+}
+
+//
+// The most a read can take as FASTQ: @, the ID with /1 or /2, the bases, +, the qualities and the newlines.
+//
+    size_t
+FASTQSize(Read *read)
+{
+    return read->getIdLength() + 2 * read->getDataLength() + 10;
+}
+
+    bool
+HasRoom(DataWriter *writer, size_t bytes)
+{
+    char *buffer;
+    size_t size;
+    return writer->getBuffer(&buffer, &size) && size > bytes;
+}
+
+//
+// whichMate is 0 for a single-end read, otherwise 1 or 2 to add /1 or /2 to its ID.  The caller has made sure it fits.
+//
+    void
+WriteFASTQ(DataWriter *writer, Read *read, int whichMate)
+{
+    char *buffer;
+    size_t size;
+    if (!writer->getBuffer(&buffer, &size)) {
+        WriteErrorMessage("ToFASTQ: unable to get a write buffer\n");
+        soft_exit(1);
+    }
+
+    int bytesUsed;
+    if (0 == whichMate) {
+        bytesUsed = snprintf(buffer, size, "@%.*s\n%.*s\n+\n%.*s\n", read->getIdLength(), read->getId(),
+            read->getDataLength(), read->getData(), read->getDataLength(), read->getQuality());
+    } else {
+        bytesUsed = snprintf(buffer, size, "@%.*s/%d\n%.*s\n+\n%.*s\n", read->getIdLength(), read->getId(), whichMate,
+            read->getUnclippedLength(), read->getUnclippedData(), read->getUnclippedLength(), read->getUnclippedQuality());
+    }
+
+    if (bytesUsed < 0 || (size_t)bytesUsed >= size) {
+        WriteErrorMessage("ToFASTQ: read '%.*s' doesn't fit in a write buffer\n", read->getIdLength(), read->getId());
+        soft_exit(1);
+    }
+    writer->advance(bytesUsed);
+}
 
+    void
+ProcessSingleInput(ThreadContext *context)
+{
     ReadSupplier *readSupplier = readSupplierGenerator->generateNewReadSupplier();
+    if (NULL == readSupplier) {
+        //
+        // The input's already been handed out to the other threads.
+        //
+        return;
+    }
+    DataWriter *writer = writerSupplier[0]->getWriter();
 
     Read *read;
-     while (NULL != (read = readSupplier->getNextRead())) {
+    while (NULL != (read = readSupplier->getNextRead())) {
         context->totalReads++;
-        fastqWriter[0]->writeRead(read);
-     } // for each read from the reader
+        if (!HasRoom(writer, FASTQSize(read))) {
+            writer->nextBatch();
+        }
+        WriteFASTQ(writer, read, 0);
+    } // for each read from the reader
 
-     if (0 == InterlockedAdd64AndReturnNewValue(&nRunningThreads, -1)) {
-        SignalSingleWaiterObject(&allThreadsDone);
-    }
+    writer->close();
+    delete writer;
+    delete readSupplier;
 }
 
-_int64
-ProcessPairedInput(PairedReadSupplierGenerator *pairedReadSupplierGenerator)
+    void
+ProcessPairedInput(ThreadContext *context)
 {
+    PairedReadSupplier *readSupplier = pairedReadSupplierGenerator->generateNewPairedReadSupplier();
+    if (NULL == readSupplier) {
+        return;
+    }
+
     //
-    // This runs single threaded, because it's the only easy way to assure that the two output files match.
+    // For interleaved output both mates go to the one writer, and have to be in the same batch so that no other thread's
+    // batch ends up between them.
     //
-    PairedReadSupplier *readSupplier = pairedReadSupplierGenerator->generateNewPairedReadSupplier();
-    
-    Read *read[NUM_READS_PER_PAIR];
+    DataWriter *writer[NUM_READS_PER_PAIR];
+    writer[0] = writerSupplier[0]->getWriter();
+    writer[1] = interleaved ? writer[0] : writerSupplier[1]->getWriter();
 
-    const size_t idBufferSize = 10000;
-    char idBuffer[idBufferSize];
+    Read *read[NUM_READS_PER_PAIR];
+    while (readSupplier->getNextReadPair(&read[0], &read[1])) {
+        bool fits;
+        if (interleaved) {
+            fits = HasRoom(writer[0], FASTQSize(read[0]) + FASTQSize(read[1]));
+        } else {
+            fits = HasRoom(writer[0], FASTQSize(read[0])) && HasRoom(writer[1], FASTQSize(read[1]));
+        }
 
-    _int64 totalReads = 0;
+        if (!fits) {
+            if (interleaved) {
+                writer[0]->nextBatch();
+            } else {
+                AcquireExclusiveLock(&pairedBatchLock);
+                writer[0]->nextBatch();
+                writer[1]->nextBatch();
+                ReleaseExclusiveLock(&pairedBatchLock);
+            }
+        }
 
-    while (readSupplier->getNextReadPair(&read[0], &read[1])) {
         for (int i = 0; i < NUM_READS_PER_PAIR; i++) {
-            //
-            // Create a new read with an ID that includes /1 or /2.  Don't bother to fill in the stuff that the
-            // FASTQ writer doesn't care about anyway.
-            //
-            snprintf(idBuffer, idBufferSize-1,"%.*s/%d", read[i]->getIdLength(), read[i]->getId(), i+1);
-            Read local;
-            local.init(idBuffer, (unsigned)strlen(idBuffer),read[i]->getUnclippedData(), read[i]->getUnclippedQuality(), read[i]->getUnclippedLength(),
-                0,0,0,0,0,0,0,NULL,0,0);
-            fastqWriter[i]->writeRead(&local);
+            WriteFASTQ(writer[i], read[i], i + 1);
         }
-        totalReads += 2;
+        context->totalReads += 2;
     }
 
-    return totalReads;
+    //
+    // Closing writes the last batch, so it's in lockstep too.
+    //
+    if (interleaved) {
+        writer[0]->close();
+        delete writer[0];
+    } else {
+        AcquireExclusiveLock(&pairedBatchLock);
+        writer[0]->close();
+        writer[1]->close();
+        ReleaseExclusiveLock(&pairedBatchLock);
+        delete writer[0];
+        delete writer[1];
+    }
+    delete readSupplier;
+}
+
+void
+WorkerThreadMain(void *param)
+{
+    ThreadContext *context = (ThreadContext *)param;
+
+    if (NULL != pairedReadSupplierGenerator) {
+        ProcessPairedInput(context);
+    } else {
+        ProcessSingleInput(context);
+    }
+
+     if (0 == InterlockedAdd64AndReturnNewValue(&nRunningThreads, -1)) {
+        SignalSingleWaiterObject(&allThreadsDone);
+    }
 }
 
 
@@ -119,12 +240,35 @@ int main(int argc, char * argv[])
 {
     BigAllocUseHugePages = false;
 
-    if (4 != argc && 5 != argc) usage();
+#ifdef _DEBUG
+    unsigned nThreads = 1;
+#else   // _DEBUG
+    unsigned nThreads = GetNumberOfProcessors();
+#endif // _DEBUG
+    int compressionLevel = GzipBlockCompressor::DefaultLevel;
+
+    const char *fileArgs[4];
+    int nFileArgs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc && atoi(argv[i+1]) > 0) {
+            nThreads = atoi(argv[i+1]);
+            i++;
+        } else if (!strcmp(argv[i], "-cl") && i + 1 < argc && isADigit(argv[i+1][0]) && atoi(argv[i+1]) <= 9) {
+            compressionLevel = atoi(argv[i+1]);
+            i++;
+        } else if (nFileArgs < 4) {
+            fileArgs[nFileArgs++] = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    if (3 != nFileArgs && 4 != nFileArgs) usage();
 
     static const char *genomeSuffix = "Genome";
-	size_t filenameLen = strlen(argv[1]) + 1 + strlen(genomeSuffix) + 1;
-	char *fileName = new char[strlen(argv[1]) + 1 + strlen(genomeSuffix) + 1];
-	snprintf(fileName,filenameLen,"%s%c%s",argv[1],PATH_SEP,genomeSuffix);
+	size_t filenameLen = strlen(fileArgs[0]) + 1 + strlen(genomeSuffix) + 1;
+	char *fileName = new char[strlen(fileArgs[0]) + 1 + strlen(genomeSuffix) + 1];
+	snprintf(fileName,filenameLen,"%s%c%s",fileArgs[0],PATH_SEP,genomeSuffix);
 	genome = Genome::loadFromFile(fileName, 0);
 	if (NULL == genome) {
 		fprintf(stderr,"Unable to load genome from file '%s'\n",fileName);
@@ -133,32 +277,16 @@ int main(int argc, char * argv[])
 	delete [] fileName;
 	fileName = NULL;
 
-    inputFileName = argv[2];
-
-    fastqWriter[0] = FASTQWriter::Factory(argv[3]);
-    if (NULL == fastqWriter[0]) {
-        fprintf(stderr,"Unable to open FASTQ writer for output file '%s'\n", argv[3]);
-        soft_exit(1);
-    }
-
-    _int64 totalReads = 0;
-    unsigned nThreads;
-
-#ifdef _DEBUG
-    nThreads = 1;
-#else   // _DEBUG
-    if (5 == argc) {
-        nThreads = 1;
-    } else {
-        nThreads = GetNumberOfProcessors();
-    }
-#endif // _DEBUG
+    inputFileName = fileArgs[1];
 
+    writerSupplier[0] = CreateWriterSupplier(fileArgs[2], nThreads, compressionLevel);
 
     DataSupplier::ThreadCount = nThreads;
     nRunningThreads = nThreads;
 
     ReaderContext readerContext;
+    memset(&readerContext, 0, sizeof(readerContext));
+    readerContext.compressionLevel = -1;
     readerContext.clipping = NoClipping;
     readerContext.defaultReadGroup = "";
     readerContext.genome = genome;
@@ -168,56 +296,53 @@ int main(int argc, char * argv[])
 	readerContext.headerLength = 0;
 	readerContext.headerBytes = 0;
 
-    if (5 == argc) {
-        if (!strcmp(argv[4], "-i")) {
-            fastqWriter[1] = fastqWriter[0];    // Interleaved
+    bool bamInput = NULL != strrchr(inputFileName, '.') && !_stricmp(strrchr(inputFileName, '.'), ".bam");
+    if (4 == nFileArgs) {
+        if (!strcmp(fileArgs[3], "-i")) {
+            interleaved = true;
         } else {
-            fastqWriter[1] = FASTQWriter::Factory(argv[4]);
-            if (NULL == fastqWriter[1]) {
-                fprintf(stderr,"Unable to open FASTQ writer for output file '%s'\n", argv[4]);
-                soft_exit(1);
-            }
+            writerSupplier[1] = CreateWriterSupplier(fileArgs[3], nThreads, compressionLevel);
         }
 
-        PairedReadSupplierGenerator *pairedReadSupplierGenerator;
-        if (NULL != strrchr(inputFileName, '.') && !_stricmp(strrchr(inputFileName, '.'), ".bam")) {
+        if (bamInput) {
             pairedReadSupplierGenerator = BAMReader::createPairedReadSupplierGenerator(inputFileName, nThreads, true, readerContext);
         } else {
             pairedReadSupplierGenerator = SAMReader::createPairedReadSupplierGenerator(inputFileName, nThreads, true, readerContext);
         }
-
-
-        totalReads = ProcessPairedInput(pairedReadSupplierGenerator);
-        if (fastqWriter[1] != fastqWriter[0]) {
-            delete fastqWriter[1];
-        } else {
-            fastqWriter[1] = NULL;
-        }
     } else {
-        if (NULL != strrchr(inputFileName, '.') && !_stricmp(strrchr(inputFileName, '.'), ".bam")) {
+        if (bamInput) {
             readSupplierGenerator = BAMReader::createReadSupplierGenerator(inputFileName, nThreads, readerContext);
         } else {
             readSupplierGenerator = SAMReader::createReadSupplierGenerator(inputFileName, nThreads, readerContext);
         }
+    }
 
-        CreateSingleWaiterObject(&allThreadsDone);
-        ThreadContext *contexts = new ThreadContext[nThreads];
+    InitializeExclusiveLock(&pairedBatchLock);
+    CreateSingleWaiterObject(&allThreadsDone);
+    ThreadContext *contexts = new ThreadContext[nThreads];
 
-        for (unsigned i = 0; i < nThreads; i++) {
-            contexts[i].whichThread = i;
+    for (unsigned i = 0; i < nThreads; i++) {
+        contexts[i].whichThread = i;
 
-            StartNewThread(WorkerThreadMain, &contexts[i]);
-        }
+        StartNewThread(WorkerThreadMain, &contexts[i]);
+    }
 
-        WaitForSingleWaiterObject(&allThreadsDone);
+    WaitForSingleWaiterObject(&allThreadsDone);
 
-        for (unsigned i = 0; i < nThreads; i++) {
-            totalReads += contexts[i].totalReads;
+    _int64 totalReads = 0;
+    for (unsigned i = 0; i < nThreads; i++) {
+        totalReads += contexts[i].totalReads;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (NULL != writerSupplier[i]) {
+            writerSupplier[i]->close();
+            delete writerSupplier[i];
         }
     }
+    DestroyExclusiveLock(&pairedBatchLock);
+
     printf("%lld reads\n", totalReads);
-    delete fastqWriter[0];
 
 	return 0;
 }
-
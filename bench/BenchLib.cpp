@@ -0,0 +1,166 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "BenchLib.h"
+
+using namespace std;
+using namespace bench;
+
+volatile _uint64 bench::sink = 0;
+
+BenchCase::BenchCase(const std::string &name_, BenchFunction func_, const char *argName0, int arg0, const char *argName1, int arg1)
+    : name(name_), func(func_), nArgs(argName1 == NULL ? 1 : 2)
+{
+    argNames[0] = argName0;
+    argNames[1] = argName1;
+    args[0] = arg0;
+    args[1] = arg1;
+
+    char buffer[100];
+    for (int i = 0; i < nArgs; i++) {
+        snprintf(buffer, sizeof(buffer), "/%s=%d", argNames[i], args[i]);
+        name += buffer;
+    }
+    getCases().push_back(this);
+}
+
+Sweep::Sweep(const char *name, BenchFunction func, const char *argName0, const int *values0, int nValues0,
+    const char *argName1, const int *values1, int nValues1)
+{
+    for (int i = 0; i < nValues0; i++) {
+        if (argName1 == NULL) {
+            new BenchCase(name, func, argName0, values0[i], NULL, 0);
+        } else {
+            for (int j = 0; j < nValues1; j++) {
+                new BenchCase(name, func, argName0, values0[i], argName1, values1[j]);
+            }
+        }
+    }
+}
+
+int Random::mutate(const char *from, int fromLen, char *to, int nEdits)
+{
+    memcpy(to, from, fromLen);
+    int len = fromLen;
+    for (int i = 0; i < nEdits && len > 1; i++) {
+        int where = nextBelow(len);
+        switch (next() % 3) {
+        case 0: {   // substitution, always to a different base
+            const char *bases = "ACGT";
+            int base = (int)(strchr(bases, to[where]) - bases);
+            to[where] = bases[(base + 1 + nextBelow(3)) & 3];
+            break;
+        }
+        case 1:     // insertion
+            memmove(to + where + 1, to + where, len - where);
+            to[where] = "ACGT"[next() & 3];
+            len++;
+            break;
+        default:    // deletion
+            memmove(to + where, to + where + 1, len - where - 1);
+            len--;
+            break;
+        }
+    }
+    return len;
+}
+
+static void runOnce(BenchCase *bc, State *state)
+{
+    state->args[0] = bc->args[0];
+    state->args[1] = bc->args[1];
+    bc->func(*state);
+}
+
+static void printString(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            putchar('\\');
+        }
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+int bench::runAllBenchmarks(const char *filter, double minSeconds, int repetitions)
+{
+    const vector<BenchCase*> &cases = BenchCase::getCases();
+    const _int64 minNanos = (_int64)(minSeconds * 1e9);
+    int nRun = 0;
+
+    printf("{\"context\":{\"processors\":%u,\"minSeconds\":%g,\"repetitions\":%d,\"time\":%lld}}\n",
+        GetNumberOfProcessors(), minSeconds, repetitions, (long long)time(NULL));
+
+    for (size_t i = 0; i < cases.size(); i++) {
+        BenchCase *bc = cases[i];
+        if (filter != NULL && strstr(bc->name.c_str(), filter) == NULL) {
+            continue;
+        }
+
+        //
+        // Grow the iteration count until one run takes long enough to time reliably.
+        //
+        _int64 iterations = 1;
+        const char *skipReason = NULL;
+        for (;;) {
+            State state(iterations);
+            runOnce(bc, &state);
+            if (state.skipReason != NULL) {
+                skipReason = state.skipReason;
+                break;
+            }
+            if (state.elapsedNanos >= minNanos || iterations >= ((_int64)1 << 40)) {
+                break;
+            }
+            double scale = state.elapsedNanos <= 0 ? 100.0 : min(100.0, max(2.0, 1.4 * minNanos / state.elapsedNanos));
+            iterations = (_int64)(iterations * scale);
+        }
+
+        if (skipReason != NULL) {
+            printf("{\"benchmark\":");
+            printString(bc->name.c_str());
+            printf(",\"skipped\":");
+            printString(skipReason);
+            printf("}\n");
+            continue;
+        }
+
+        vector<double> nanosPerOp;
+        double itemsPerIteration = 1, bytesPerIteration = 0;
+        for (int r = 0; r < repetitions; r++) {
+            State state(iterations);
+            runOnce(bc, &state);
+            nanosPerOp.push_back((double)state.elapsedNanos / iterations);
+            itemsPerIteration = state.itemsPerIteration;
+            bytesPerIteration = state.bytesPerIteration;
+        }
+        sort(nanosPerOp.begin(), nanosPerOp.end());
+        double median = nanosPerOp[nanosPerOp.size() / 2];
+
+        printf("{\"benchmark\":");
+        printString(bc->name.c_str());
+        if (bc->nArgs > 0) {
+            printf(",\"args\":{");
+            for (int a = 0; a < bc->nArgs; a++) {
+                printf("%s\"%s\":%d", a == 0 ? "" : ",", bc->argNames[a], bc->args[a]);
+            }
+            printf("}");
+        }
+        printf(",\"iterations\":%lld,\"ns_per_op\":%.2f,\"min_ns_per_op\":%.2f,\"max_ns_per_op\":%.2f",
+            (long long)iterations, median, nanosPerOp[0], nanosPerOp.back());
+        if (median > 0) {
+            printf(",\"items_per_second\":%.1f", itemsPerIteration * 1e9 / median);
+            if (bytesPerIteration > 0) {
+                printf(",\"bytes_per_second\":%.1f", bytesPerIteration * 1e9 / median);
+            }
+        }
+        printf("}\n");
+        fflush(stdout);
+        nRun++;
+    }
+
+    return nRun == 0 && filter != NULL ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+/**
+ * A tiny microbenchmark library in the spirit of TestLib (see tests/TestLib.h).
+ *
+ * To implement a benchmark, write:
+ *
+ *    BENCH("name") { body }
+ *
+ * The body does its setup, then times the work it wants measured with
+ *
+ *    BENCH_LOOP(state) { one operation }
+ *
+ * which runs the operation state.iterations times between starting and stopping
+ * the clock.  The runner calls the body as many times as it needs to find an
+ * iteration count that takes at least the minimum time, and then several more
+ * times at that count, reporting the median.  A body may call
+ * state.setItemsPerIteration() and state.setBytesPerIteration() to have rates
+ * reported as well as times, or state.skip() (and return) if what it measures
+ * isn't in this build.
+ *
+ * For a sweep over one or two parameters, write the body as a function and
+ * register it for the cross product of the values:
+ *
+ *    static void lvBench(bench::State &state) { ... state.arg(0) ... state.arg(1) ... }
+ *    static const int ks[] = {4, 8, 16};
+ *    static const int lens[] = {100, 250};
+ *    static bench::Sweep lvSweep("lv", &lvBench, "k", ks, 3, "readLen", lens, 2);
+ *
+ * Results go to stdout as one JSON object per line, so that they can be kept and
+ * compared for regressions.  The inputs are made with a fixed seed (bench::Random),
+ * so the same build on the same machine does the same work every time.
+ */
+
+#include <string>
+#include <vector>
+#include "Compat.h"
+
+namespace bench {
+
+class State {
+public:
+    State(_int64 i_iterations) : iterations(i_iterations), elapsedNanos(0), startNanos(0),
+        itemsPerIteration(1), bytesPerIteration(0), skipReason(NULL) { args[0] = args[1] = 0; }
+
+    _int64 iterations;
+
+    int arg(int which) const { return args[which]; }
+
+    void setItemsPerIteration(double items) { itemsPerIteration = items; }
+    void setBytesPerIteration(double bytes) { bytesPerIteration = bytes; }
+
+    void skip(const char *reason) { skipReason = reason; }
+
+    void startTimer() { startNanos = timeInNanos(); }
+    void stopTimer() { elapsedNanos += timeInNanos() - startNanos; }
+
+    int args[2];
+    _int64 elapsedNanos;
+    _int64 startNanos;
+    double itemsPerIteration;
+    double bytesPerIteration;
+    const char *skipReason;
+};
+
+typedef void (*BenchFunction)(State &state);
+
+struct BenchCase {
+    BenchCase(const char *name_, BenchFunction func_) : name(name_), func(func_), nArgs(0) {
+        getCases().push_back(this);
+    }
+
+    BenchCase(const std::string &name_, BenchFunction func_, const char *argName0, int arg0, const char *argName1, int arg1);
+
+    std::string name;
+    BenchFunction func;
+    int nArgs;
+    const char *argNames[2];
+    int args[2];
+
+    static std::vector<BenchCase*>& getCases() {
+        static std::vector<BenchCase*> cases;
+        return cases;
+    }
+};
+
+//
+// Registers one BenchCase for each combination of values.  For a one-parameter sweep leave argName1 NULL.
+//
+struct Sweep {
+    Sweep(const char *name, BenchFunction func, const char *argName0, const int *values0, int nValues0,
+        const char *argName1 = NULL, const int *values1 = NULL, int nValues1 = 0);
+};
+
+//
+// A small, fast generator with a fixed default seed, so the inputs are the same on every run.
+//
+class Random {
+public:
+    Random(_uint64 seed = 0x5eed5eed5eed5eedull) : state(seed) {}
+
+    _uint64 next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    unsigned nextBelow(unsigned n) { return (unsigned)(next() % n); }
+
+    void fillBases(char *bases, int len) {
+        for (int i = 0; i < len; i++) {
+            bases[i] = "ACGT"[next() & 3];
+        }
+    }
+
+    //
+    // Copy from into to, applying nEdits random substitutions, insertions and deletions.  Returns the length of to,
+    // which has room for at least fromLen + nEdits.
+    //
+    int mutate(const char *from, int fromLen, char *to, int nEdits);
+
+private:
+    _uint64 state;
+};
+
+//
+// Keep the compiler from throwing away a result that nothing else uses.
+//
+extern volatile _uint64 sink;
+inline void keep(_uint64 value) { sink += value; }
+
+int runAllBenchmarks(const char *filter, double minSeconds, int repetitions);
+
+}
+
+#define BENCH_CONCAT1( x, y ) x ## y
+#define BENCH_CONCAT2( x, y ) BENCH_CONCAT1( x, y ) /* To escape weird macro expansion rules */
+#define BENCH_FUNC(line)  BENCH_CONCAT2(_bench_func_,  line)
+#define BENCH_CASE(line)  BENCH_CONCAT2(_bench_case_,  line)
+
+#define BENCH(name) \
+    static void BENCH_FUNC(__LINE__) (bench::State &state); \
+    static bench::BenchCase BENCH_CASE(__LINE__) (name, &BENCH_FUNC(__LINE__)); \
+    static void BENCH_FUNC(__LINE__) (bench::State &state) /* body follows */
+
+#define BENCH_LOOP(state) \
+    for (_int64 _bench_i = ((state).startTimer(), 0); _bench_i < (state).iterations || ((state).stopTimer(), false); _bench_i++)
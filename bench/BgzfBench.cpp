@@ -0,0 +1,157 @@
+#include "stdafx.h"
+#include "BenchLib.h"
+#include "Bam.h"
+#include "GzipBlockCodec.h"
+#include <zlib.h>
+
+//
+// BGZF blocks of SAM-like text, compressed and decompressed the way GzipDataWriter and the BAM reader do it: one
+// whole gzip member per BAM_BLOCK of input, with zlib and, if this build has it (LIBDEFLATE_HOME), with the block
+// codec.  The level is a parameter because -cl changes it.
+//
+static const int nBlocks = 16;
+static const int blockInput = BAM_BLOCK - 1024;    // What GzipDataWriter leaves itself room for
+
+struct BgzfBlocks {
+    char *text;
+    char *compressed;
+    size_t compressedSize[nBlocks];
+
+    static const size_t compressedStride = BAM_BLOCK + 1024;
+
+    BgzfBlocks(int level) {
+        text = new char[nBlocks * blockInput];
+        compressed = new char[nBlocks * compressedStride];
+
+        //
+        // Mostly random bases and qualities, with the fixed fields and tags that make real SAM compress as well as it does.
+        //
+        bench::Random random(level);
+        char *p = text, *end = text + nBlocks * blockInput;
+        while (p < end) {
+            char line[600];
+            int n = sprintf(line, "SIM:1:FCX:%d:%d\t99\tchr%d\t%d\t60\t150M\t=\t%d\t350\t",
+                (int)random.nextBelow(8), (int)random.nextBelow(30000), (int)random.nextBelow(22) + 1, (int)random.nextBelow(1 << 27), (int)random.nextBelow(1 << 27));
+            random.fillBases(line + n, 150);
+            n += 150;
+            line[n++] = '\t';
+            for (int i = 0; i < 150; i++) {
+                line[n++] = (char)('F' - (random.nextBelow(8) == 0 ? random.nextBelow(30) : 0));
+            }
+            n += sprintf(line + n, "\tRG:Z:bench\tPG:Z:SNAP\tNM:i:%d\n", (int)random.nextBelow(4));
+            memcpy(p, line, __min((size_t)n, (size_t)(end - p)));
+            p += n;
+        }
+
+        for (int i = 0; i < nBlocks; i++) {
+            compressedSize[i] = compressWithZlib(level, block(i), blockInput, compressedBlock(i), compressedStride);
+        }
+    }
+
+    ~BgzfBlocks() {
+        delete[] text;
+        delete[] compressed;
+    }
+
+    char *block(int i) { return text + i * blockInput; }
+    char *compressedBlock(int i) { return compressed + i * compressedStride; }
+
+    static size_t compressWithZlib(int level, char *input, size_t inputSize, char *output, size_t outputSize) {
+        z_stream zstream;
+        memset(&zstream, 0, sizeof(zstream));
+        deflateInit2(&zstream, level, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
+        zstream.next_in = (Bytef *)input;
+        zstream.avail_in = (uInt)inputSize;
+        zstream.next_out = (Bytef *)output;
+        zstream.avail_out = (uInt)outputSize;
+        deflate(&zstream, Z_FINISH);
+        size_t used = outputSize - zstream.avail_out;
+        deflateEnd(&zstream);
+        return used;
+    }
+
+    static size_t decompressWithZlib(char *input, size_t inputSize, char *output, size_t outputSize) {
+        z_stream zstream;
+        memset(&zstream, 0, sizeof(zstream));
+        inflateInit2(&zstream, 15 | 32);
+        zstream.next_in = (Bytef *)input;
+        zstream.avail_in = (uInt)inputSize;
+        zstream.next_out = (Bytef *)output;
+        zstream.avail_out = (uInt)outputSize;
+        inflate(&zstream, Z_FINISH);
+        size_t used = outputSize - zstream.avail_out;
+        inflateEnd(&zstream);
+        return used;
+    }
+};
+
+static BgzfBlocks *getBlocks(int level)
+{
+    static BgzfBlocks *blocks[10];
+    if (blocks[level] == NULL) {
+        blocks[level] = new BgzfBlocks(level);
+    }
+    return blocks[level];
+}
+
+static void compress(bench::State &state)
+{
+    const int level = state.arg(0);
+    const bool useCodec = state.arg(1) != 0;
+    BgzfBlocks *blocks = getBlocks(level);
+    GzipBlockCompressor *codec = useCodec ? GzipBlockCompressor::Create(level) : NULL;
+    if (useCodec && codec == NULL) {
+        state.skip("no block codec in this build");
+        return;
+    }
+    char *output = new char[BgzfBlocks::compressedStride];
+
+    int i = 0;
+    state.setBytesPerIteration(blockInput);
+    BENCH_LOOP(state) {
+        size_t used;
+        if (codec != NULL) {
+            codec->compressBlock(true, blocks->block(i), blockInput, output, BgzfBlocks::compressedStride, &used);
+        } else {
+            used = BgzfBlocks::compressWithZlib(level, blocks->block(i), blockInput, output, BgzfBlocks::compressedStride);
+        }
+        bench::keep(used);
+        i = (i + 1) % nBlocks;
+    }
+
+    delete[] output;
+    delete codec;
+}
+
+static void decompress(bench::State &state)
+{
+    const bool useCodec = state.arg(0) != 0;
+    BgzfBlocks *blocks = getBlocks(GzipBlockCompressor::DefaultLevel);
+    GzipBlockDecompressor *codec = useCodec ? GzipBlockDecompressor::Create() : NULL;
+    if (useCodec && codec == NULL) {
+        state.skip("no block codec in this build");
+        return;
+    }
+    char *output = new char[BAM_BLOCK];
+
+    int i = 0;
+    state.setBytesPerIteration(blockInput);
+    BENCH_LOOP(state) {
+        size_t used;
+        if (codec != NULL) {
+            codec->decompressBlock(blocks->compressedBlock(i), blocks->compressedSize[i], output, BAM_BLOCK, &used);
+        } else {
+            used = BgzfBlocks::decompressWithZlib(blocks->compressedBlock(i), blocks->compressedSize[i], output, BAM_BLOCK);
+        }
+        bench::keep(used);
+        i = (i + 1) % nBlocks;
+    }
+
+    delete[] output;
+    delete codec;
+}
+
+static const int levels[] = {1, 6};
+static const int codecs[] = {0, 1};
+static bench::Sweep compressSweep("bgzf/compress", &compress, "level", levels, 2, "codec", codecs, 2);
+static bench::Sweep decompressSweep("bgzf/decompress", &decompress, "codec", codecs, 2);
@@ -0,0 +1,106 @@
+#include "stdafx.h"
+#include "BenchLib.h"
+#include "LandauVishkin.h"
+#include "ProbabilityDistance.h"
+
+//
+// Each iteration scores nPairs read-sized patterns against their reference text.  The patterns have about half of k
+// edits each, which is the interesting case for the aligner: most candidates it scores are near misses that it has
+// to run out most of the rows for.
+//
+static const int nPairs = 256;
+static const int textSlack = 2 * MAX_K;
+
+struct EditDistanceInput {
+    char *texts;
+    char *patterns;
+    char *qualities;
+    int patternLens[nPairs];
+    int readLen;
+    int textStride;
+
+    EditDistanceInput(int i_readLen, int nEdits) : readLen(i_readLen), textStride(i_readLen + textSlack) {
+        texts = new char[nPairs * textStride];
+        patterns = new char[nPairs * patternStride()];
+        qualities = new char[patternStride()];
+        memset(qualities, 'I', patternStride());
+
+        bench::Random random(readLen * 1000 + nEdits);
+        for (int i = 0; i < nPairs; i++) {
+            random.fillBases(text(i), textStride);
+            patternLens[i] = __min(readLen, random.mutate(text(i), readLen, pattern(i), nEdits));
+        }
+    }
+
+    ~EditDistanceInput() {
+        delete[] texts;
+        delete[] patterns;
+        delete[] qualities;
+    }
+
+    char *text(int i) { return texts + i * textStride; }
+    int patternStride() { return readLen + MAX_K + 1; }    // Room for any number of insertions
+    char *pattern(int i) { return patterns + i * patternStride(); }
+};
+
+static void landauVishkin(bench::State &state)
+{
+    const int k = state.arg(0);
+    EditDistanceInput input(state.arg(1), k / 2);
+    initializeLVProbabilitiesToPhredPlus33();   // As the aligners do; it's needed for the match probabilities
+    LandauVishkin<> *lv = new LandauVishkin<>;
+
+    state.setItemsPerIteration(nPairs);
+    state.setBytesPerIteration((double)nPairs * input.readLen);
+    BENCH_LOOP(state) {
+        for (int i = 0; i < nPairs; i++) {
+            double matchProbability;
+            bench::keep(lv->computeEditDistance(input.text(i), input.textStride, input.pattern(i), input.qualities,
+                input.patternLens[i], k, &matchProbability));
+        }
+    }
+    delete lv;
+}
+
+static void landauVishkinWithCigar(bench::State &state)
+{
+    const int k = state.arg(0);
+    EditDistanceInput input(state.arg(1), k / 2);
+    LandauVishkinWithCigar *lvc = new LandauVishkinWithCigar;
+    char cigarBuf[2 * MAX_READ_LENGTH];
+
+    state.setItemsPerIteration(nPairs);
+    state.setBytesPerIteration((double)nPairs * input.readLen);
+    BENCH_LOOP(state) {
+        for (int i = 0; i < nPairs; i++) {
+            bench::keep(lvc->computeEditDistanceNormalized(input.text(i), input.textStride, input.pattern(i), input.patternLens[i], k,
+                cigarBuf, sizeof(cigarBuf), false));
+        }
+    }
+    delete lvc;
+}
+
+static void probabilityDistance(bench::State &state)
+{
+    const int maxShift = state.arg(0);
+    EditDistanceInput input(state.arg(1), 4);
+    ProbabilityDistance *pd = new ProbabilityDistance(0.001, 0.0001, 0.01);
+
+    state.setItemsPerIteration(nPairs);
+    state.setBytesPerIteration((double)nPairs * input.readLen);
+    BENCH_LOOP(state) {
+        for (int i = 0; i < nPairs; i++) {
+            double matchProbability;
+            bench::keep(pd->compute(input.text(i), input.pattern(i), input.qualities, input.patternLens[i], maxShift, maxShift, &matchProbability));
+        }
+    }
+    delete pd;
+}
+
+static const int ks[] = {4, 8, 16, 32};
+static const int readLens[] = {100, 150, 250, 400};
+static const int shifts[] = {5, 20};
+
+static bench::Sweep lvSweep("lv/computeEditDistance", &landauVishkin, "k", ks, 4, "readLen", readLens, 4);
+static bench::Sweep lvcSweep("lv/LandauVishkinWithCigar", &landauVishkinWithCigar, "k", ks, 4, "readLen", readLens, 4);
+static bench::Sweep pdSweep("ProbabilityDistance/compute", &probabilityDistance, "maxShift", shifts, 2, "readLen", readLens, 4);
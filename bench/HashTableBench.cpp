@@ -0,0 +1,58 @@
+#include "stdafx.h"
+#include "BenchLib.h"
+#include "HashTable.h"
+
+//
+// A table like a seed table's: 5 byte keys, 5 byte values, about 70% full.  It's big enough (well past the caches) that
+// the lookups cost what they do in the aligner, and it's built once per layout and kept for all of the runs.
+//
+static const unsigned nKeys = 4 * 1024 * 1024;
+static const unsigned nLookups = 64 * 1024;
+
+static SNAPHashTable *getTable(bool useBuckets)
+{
+    static SNAPHashTable *tables[2] = {NULL, NULL};
+    if (tables[useBuckets] == NULL) {
+        SNAPHashTable *table = new SNAPHashTable(nKeys * 10 / 7, 5, 5, 1, 0xffffffffff, useBuckets);
+        bench::Random random;
+        for (unsigned i = 0; i < nKeys; i++) {
+            SNAPHashTable::ValueType value = i;
+            table->Insert((random.next() & 0xffffffffff) | 1, &value);  // Present keys are odd
+        }
+        tables[useBuckets] = table;
+    }
+    return tables[useBuckets];
+}
+
+static void getFirstValueForKey(bench::State &state)
+{
+    const int hitPercent = state.arg(0);
+    SNAPHashTable *table = getTable(state.arg(1) != 0);
+
+    //
+    // Replay the insertion sequence for the hits and use even keys, which were never inserted, for the misses.
+    //
+    static SNAPHashTable::KeyType keys[nLookups];
+    bench::Random present, absent(12345);
+    for (unsigned i = 0; i < nLookups; i++) {
+        if (absent.nextBelow(100) < (unsigned)hitPercent) {
+            keys[i] = (present.next() & 0xffffffffff) | 1;
+        } else {
+            keys[i] = absent.next() & 0xfffffffffe;
+        }
+    }
+
+    state.setItemsPerIteration(nLookups);
+    BENCH_LOOP(state) {
+        _uint64 found = 0;
+        for (unsigned i = 0; i < nLookups; i++) {
+            found += table->GetFirstValueForKey(keys[i]) != NULL;
+        }
+        bench::keep(found);
+    }
+}
+
+static const int hitPercents[] = {0, 50, 100};
+static const int layouts[] = {0, 1};
+static bench::Sweep getFirstValueForKeySweep("hashtable/GetFirstValueForKey", &getFirstValueForKey,
+    "hitPercent", hitPercents, 3, "buckets", layouts, 2);
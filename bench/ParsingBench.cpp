@@ -0,0 +1,192 @@
+#include "stdafx.h"
+#include "BenchLib.h"
+#include "Read.h"
+#include "FASTQ.h"
+#include "SAM.h"
+#include "Bam.h"
+#include "DataReader.h"
+#include "Util.h"
+
+//
+// Synthetic input: nReads reads of 150 bases with Illumina-ish names and qualities, as FASTQ text and as SAM lines.
+//
+static const int nReads = 64 * 1024;
+static const int readLen = 150;
+
+static void makeRead(bench::Random &random, int i, char *name, char *bases, char *qualities)
+{
+    sprintf(name, "SIM:1:FCX:%d:%d:%d:%d", (i >> 12) & 7, i & 0xfff, (int)random.nextBelow(30000), (int)random.nextBelow(30000));
+    random.fillBases(bases, readLen);
+    for (int j = 0; j < readLen; j++) {
+        qualities[j] = (char)('#' + random.nextBelow(40));
+    }
+    bases[readLen] = qualities[readLen] = '\0';
+}
+
+static const char *getFastqFile(size_t *o_size)
+{
+    static char fileName[100] = "";
+    static size_t size = 0;
+    if (fileName[0] == '\0') {
+        const char *tmp = getenv("TMPDIR");
+        snprintf(fileName, sizeof(fileName), "%s/snap-bench-%d.fq", tmp == NULL ? "/tmp" : tmp, (int)getpid());
+        FILE *f = fopen(fileName, "w");
+        if (f == NULL) {
+            return NULL;
+        }
+        bench::Random random;
+        char name[100], bases[readLen + 1], qualities[readLen + 1];
+        for (int i = 0; i < nReads; i++) {
+            makeRead(random, i, name, bases, qualities);
+            size += fprintf(f, "@%s 1:N:0:ACGT\n%s\n+\n%s\n", name, bases, qualities);
+        }
+        fclose(f);
+        atexit([] { unlink(fileName); });
+    }
+    *o_size = size;
+    return fileName;
+}
+
+static ReaderContext makeContext()
+{
+    ReaderContext context;
+    memset(&context, 0, sizeof(context));
+    context.clipping = NoClipping;
+    context.defaultReadGroup = "";
+    context.compressionLevel = -1;
+    return context;
+}
+
+BENCH("fastq/FASTQReader::getNextRead") {
+    size_t fileSize;
+    const char *fileName = getFastqFile(&fileSize);
+    if (fileName == NULL) {
+        state.skip("can't write a FASTQ file in TMPDIR");
+        return;
+    }
+    ReaderContext context = makeContext();
+    FASTQReader *reader = FASTQReader::create(DataSupplier::Default, fileName, 2, 0, 0, context);
+    Read read;
+
+    state.setBytesPerIteration((double)fileSize / nReads);
+    BENCH_LOOP(state) {
+        if (!reader->getNextRead(&read)) {
+            reader->reinit(0, 0);
+            reader->getNextRead(&read);
+        }
+        bench::keep(read.getDataLength());
+    }
+    delete reader;
+}
+
+//
+// getReadFromLine is for SAMReader and its subclasses, which this is only so that it can call it.
+//
+struct SAMLineParser : public SAMReader {
+    using SAMReader::getReadFromLine;
+};
+
+BENCH("sam/SAMReader::getReadFromLine") {
+    static char *sam = NULL;
+    static char *samEnd;
+    if (sam == NULL) {
+        sam = new char[nReads * (readLen * 2 + 200)];
+        samEnd = sam;
+        bench::Random random;
+        char name[100], bases[readLen + 1], qualities[readLen + 1];
+        for (int i = 0; i < nReads; i++) {
+            makeRead(random, i, name, bases, qualities);
+            samEnd += sprintf(samEnd, "%s\t%d\tchr%d\t%d\t60\t%dM\t=\t%d\t350\t%s\t%s\tRG:Z:bench\tNM:i:%d\tPG:Z:SNAP\n",
+                name, (i & 1) ? 83 : 99, (int)random.nextBelow(22) + 1, (int)random.nextBelow(100000000) + 1, readLen,
+                (int)random.nextBelow(100000000) + 1, bases, qualities, (int)random.nextBelow(5));
+        }
+    }
+
+    Read read;
+    char *line = sam;
+    state.setBytesPerIteration((double)(samEnd - sam) / nReads);
+    BENCH_LOOP(state) {
+        if (line >= samEnd) {
+            line = sam;
+        }
+        size_t lineLength;
+        unsigned flag, mapQ;
+        const char *cigar;
+        SAMLineParser::getReadFromLine(NULL, line, samEnd, &read, NULL, NULL, NULL, &mapQ, &lineLength, &flag, &cigar, NoClipping);
+        line += lineLength;
+        bench::keep(mapQ);
+    }
+}
+
+//
+// What the BAM reader does to each record after it's decompressed: turn the sequence, quality and CIGAR back into
+// text.
+//
+static const int nRecords = 1024;
+
+struct BamRecords {
+    _uint8 nibbles[nRecords][(readLen + 1) / 2];
+    char qualities[nRecords][readLen];
+    char bases[nRecords][readLen + 1];
+    _uint32 cigars[nRecords][3];
+
+    BamRecords() {
+        bench::Random random;
+        char name[100], q[readLen + 1];
+        for (int i = 0; i < nRecords; i++) {
+            makeRead(random, i, name, bases[i], q);
+            BAMAlignment::encodeSeq(nibbles[i], bases[i], readLen);
+            BAMAlignment::encodeQual(qualities[i], q, readLen);
+            cigars[i][0] = (100 << 4) | 0;  // 100M
+            cigars[i][1] = (2 << 4) | 1;    // 2I
+            cigars[i][2] = ((readLen - 102) << 4) | 0;
+        }
+    }
+};
+
+static BamRecords *getBamRecords()
+{
+    static BamRecords *records = NULL;
+    if (records == NULL) {
+        records = new BamRecords;
+    }
+    return records;
+}
+
+BENCH("bam/encodeSeq") {
+    BamRecords *records = getBamRecords();
+    _uint8 nibbles[(readLen + 1) / 2];
+    int i = 0;
+    state.setBytesPerIteration(readLen);
+    BENCH_LOOP(state) {
+        BAMAlignment::encodeSeq(nibbles, records->bases[i], readLen);
+        bench::keep(nibbles[0]);
+        i = (i + 1) % nRecords;
+    }
+}
+
+BENCH("bam/decodeSeq") {
+    BamRecords *records = getBamRecords();
+    char bases[readLen];
+    int i = 0;
+    state.setBytesPerIteration(readLen);
+    BENCH_LOOP(state) {
+        BAMAlignment::decodeSeq(bases, records->nibbles[i], readLen);
+        bench::keep(bases[0]);
+        i = (i + 1) % nRecords;
+    }
+}
+
+BENCH("bam/decodeRecord") {
+    BamRecords *records = getBamRecords();
+    char bases[readLen], qualities[readLen], cigar[100];
+    int i = 0;
+    state.setBytesPerIteration(readLen);
+    BENCH_LOOP(state) {
+        BAMAlignment::decodeSeq(bases, records->nibbles[i], readLen);
+        BAMAlignment::decodeQual(qualities, records->qualities[i], readLen);
+        BAMAlignment::decodeCigar(cigar, sizeof(cigar), records->cigars[i], 3);
+        bench::keep(bases[0] + qualities[0] + cigar[0]);
+        i = (i + 1) % nRecords;
+    }
+}
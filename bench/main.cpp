@@ -0,0 +1,37 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "BenchLib.h"
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: bench [-t minSecondsPerRun] [-r repetitions] [filter]\n"
+        "  Runs the benchmarks whose names contain filter (all of them if there's none), and writes\n"
+        "  one JSON object per benchmark to stdout.  Defaults are -t 0.2 -r 5.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    double minSeconds = 0.2;
+    int repetitions = 5;
+    const char *filter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            minSeconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+        } else if (argv[i][0] == '-' || filter != NULL) {
+            usage();
+        } else {
+            filter = argv[i];
+        }
+    }
+    if (minSeconds <= 0 || repetitions < 1) {
+        usage();
+    }
+
+    return bench::runAllBenchmarks(filter, minSeconds, repetitions);
+}
@@ -0,0 +1,256 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "Cram.h"
+#include "Genome.h"
+#include "Read.h"
+#include "SAM.h"
+#include "DataReader.h"
+
+struct CramTest {
+};
+
+//
+// Encode in, check the block header, and decode it back, returning the compressed size.
+//
+static size_t ransRoundTrip(const _uint8 *in, size_t inSize, CramRansTables *tables)
+{
+    CramBuffer compressed;
+    compressed.putBytes("xyz", 3);     // It appends, so anything already there is left alone
+    if (!RansEncode0(in, inSize, &compressed)) {
+        throw test::TestFailedException(__FILE__, __LINE__, "RansEncode0 failed");
+    }
+    const _uint8 *block = (const _uint8 *)compressed.getData() + 3;
+    size_t blockSize = compressed.getUsed() - 3;
+    ASSERT(!memcmp("xyz", compressed.getData(), 3));
+    ASSERT_EQ(0, (int)block[0]);   // Order 0
+    ASSERT_EQ(blockSize - 9, (size_t)(block[1] | (block[2] << 8) | (block[3] << 16) | ((_uint32)block[4] << 24)));
+    ASSERT_EQ(inSize, (size_t)(block[5] | (block[6] << 8) | (block[7] << 16) | ((_uint32)block[8] << 24)));
+
+    _uint8 *out = new _uint8[inSize + 1];
+    out[inSize] = 0xa5;     // Nothing past the end gets written
+    bool decoded = RansDecode(block, blockSize, out, inSize, tables);
+    bool same = decoded && !memcmp(in, out, inSize) && 0xa5 == out[inSize];
+
+    //
+    // Cutting it short or giving the wrong size fails rather than running off the end.
+    //
+    bool shortFails = !RansDecode(block, blockSize - 1, out, inSize, tables);
+    bool wrongSizeFails = !RansDecode(block, blockSize, out, inSize - 1, tables);
+    delete [] out;
+
+    ASSERT(decoded);
+    ASSERT(same);
+    ASSERT(shortFails);
+    ASSERT(wrongSizeFails);
+    return blockSize;
+}
+
+TEST_F(CramTest, "rANS order 0 round trips") {
+    CramRansTables *tables = new CramRansTables();
+    const size_t maxSize = 100000;
+    _uint8 *in = new _uint8[maxSize];
+
+    //
+    // Too short to code.
+    //
+    CramBuffer compressed;
+    ASSERT(!RansEncode0((const _uint8 *)"abc", 3, &compressed));
+
+    //
+    // One symbol (which gets nearly all of the frequency), two, and every byte value, at sizes that do and don't
+    // divide among the four states.
+    //
+    for (size_t size = 4; size <= 11; size++) {
+        memset(in, 'A', size);
+        ransRoundTrip(in, size, tables);
+        in[size / 2] = 'C';
+        ransRoundTrip(in, size, tables);
+    }
+    memset(in, 0, maxSize);
+    ASSERT(ransRoundTrip(in, maxSize, tables) < 100);
+    for (size_t i = 0; i < 256 * 7; i++) {
+        in[i] = (_uint8)(i * 37);
+    }
+    ransRoundTrip(in, 256 * 7, tables);
+
+    //
+    // Skewed, like qualities, where the rare symbols get rounded up to a frequency of one, and then random, where
+    // there's nothing to gain.
+    //
+    unsigned seed = 19;
+    for (size_t i = 0; i < maxSize; i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned r = (seed >> 16) & 0x7fff;
+        in[i] = r < 30000 ? (_uint8)('F' + r % 3) : (_uint8)(r % 256);
+    }
+    ASSERT(ransRoundTrip(in, maxSize, tables) < maxSize / 2);
+    for (size_t size = 4; size < maxSize; size = size * 3 + 1) {
+        ransRoundTrip(in + 1000, size, tables);
+    }
+    for (size_t i = 0; i < maxSize; i++) {
+        seed = seed * 1103515245 + 12345;
+        in[i] = (_uint8)(seed >> 16);
+    }
+    ransRoundTrip(in, maxSize, tables);
+    ransRoundTrip(in, 1001, tables);
+
+    delete [] in;
+    delete tables;
+}
+
+//
+// A small CRAM 3.0 file, built by hand from the specification by cram_fixture.py (not by SNAP's writer, so this checks
+// the reader against the format rather than against the writer).  See there for what's in it: four reads on a 60 base
+// chr1, using most of the codecs, raw, gzip and both orders of rANS blocks, and a substitution matrix that isn't the
+// default.
+//
+static const unsigned char cramFixture[] = {
+    0x43, 0x52, 0x41, 0x4d, 0x03, 0x00, 0x63, 0x72, 0x61, 0x6d, 0x5f, 0x66, 0x69, 0x78, 0x74, 0x75,
+    0x72, 0x65, 0x2e, 0x70, 0x79, 0x00, 0x00, 0x00, 0x00, 0x00, 0x48, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x20, 0x36, 0xa1, 0x54, 0x00, 0x00, 0x00, 0x3f, 0x3f, 0x3b,
+    0x00, 0x00, 0x00, 0x40, 0x48, 0x44, 0x09, 0x56, 0x4e, 0x3a, 0x31, 0x2e, 0x36, 0x09, 0x53, 0x4f,
+    0x3a, 0x75, 0x6e, 0x73, 0x6f, 0x72, 0x74, 0x65, 0x64, 0x0a, 0x40, 0x53, 0x51, 0x09, 0x53, 0x4e,
+    0x3a, 0x63, 0x68, 0x72, 0x31, 0x09, 0x4c, 0x4e, 0x3a, 0x36, 0x30, 0x0a, 0x40, 0x52, 0x47, 0x09,
+    0x49, 0x44, 0x3a, 0x67, 0x72, 0x70, 0x31, 0x09, 0x53, 0x4d, 0x3a, 0x73, 0x31, 0x0a, 0x9e, 0x17,
+    0xf0, 0x38, 0xfd, 0x02, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0e, 0x00, 0x00, 0x04, 0x00, 0x26,
+    0x1c, 0x01, 0x80, 0xb9, 0xe7, 0xbb, 0xff, 0x3f, 0x00, 0x01, 0x00, 0x80, 0xae, 0x80, 0xae, 0x19,
+    0x05, 0x52, 0x4e, 0x01, 0x41, 0x50, 0x00, 0x52, 0x52, 0x01, 0x53, 0x4d, 0xe4, 0x1b, 0x1b, 0x1b,
+    0x1b, 0x54, 0x44, 0x05, 0x4e, 0x4d, 0x63, 0x00, 0x00, 0x80, 0x89, 0x18, 0x42, 0x46, 0x01, 0x01,
+    0x01, 0x43, 0x46, 0x03, 0x08, 0x03, 0x03, 0x00, 0x05, 0x03, 0x01, 0x02, 0x02, 0x52, 0x49, 0x06,
+    0x02, 0x01, 0x01, 0x52, 0x4c, 0x01, 0x01, 0x04, 0x41, 0x50, 0x09, 0x01, 0x01, 0x52, 0x47, 0x01,
+    0x01, 0x06, 0x52, 0x4e, 0x05, 0x02, 0x09, 0x07, 0x4d, 0x46, 0x01, 0x01, 0x08, 0x4e, 0x53, 0x01,
+    0x01, 0x09, 0x4e, 0x50, 0x01, 0x01, 0x0a, 0x54, 0x53, 0x01, 0x01, 0x0b, 0x4e, 0x46, 0x01, 0x01,
+    0x0c, 0x54, 0x4c, 0x07, 0x02, 0x00, 0x01, 0x46, 0x4e, 0x01, 0x01, 0x0d, 0x46, 0x43, 0x01, 0x01,
+    0x0e, 0x46, 0x50, 0x01, 0x01, 0x0f, 0x44, 0x4c, 0x01, 0x01, 0x10, 0x42, 0x41, 0x01, 0x01, 0x11,
+    0x51, 0x53, 0x01, 0x01, 0x12, 0x42, 0x53, 0x01, 0x01, 0x13, 0x49, 0x4e, 0x04, 0x06, 0x01, 0x01,
+    0x14, 0x01, 0x01, 0x15, 0x53, 0x43, 0x05, 0x02, 0x00, 0x16, 0x48, 0x43, 0x01, 0x01, 0x17, 0x4d,
+    0x51, 0x01, 0x01, 0x18, 0x08, 0x01, 0xe0, 0x4e, 0x4d, 0x63, 0x01, 0x01, 0x1e, 0xe6, 0x9a, 0x74,
+    0xda, 0x00, 0x02, 0x00, 0x39, 0x39, 0xff, 0xff, 0xff, 0xff, 0x0e, 0x00, 0x00, 0x04, 0x00, 0x1a,
+    0x19, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x1e, 0xff, 0xff, 0xff, 0xff, 0x0f, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0a,
+    0x7b, 0xb9, 0x21, 0x00, 0x05, 0x00, 0x06, 0x06, 0xe6, 0x28, 0x7d, 0x2a, 0x0c, 0xd0, 0xe0, 0xfc,
+    0x54, 0x9f, 0x04, 0x04, 0x01, 0x29, 0x05, 0x00, 0x20, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,
+    0x05, 0x83, 0x33, 0x41, 0x83, 0x33, 0x43, 0x83, 0x33, 0x80, 0x83, 0x33, 0x93, 0x83, 0x34, 0x00,
+    0x6b, 0x86, 0x81, 0x0c, 0x33, 0x2b, 0x80, 0x02, 0xd4, 0x6c, 0x7f, 0x02, 0x9a, 0x21, 0x80, 0x02,
+    0x66, 0xc9, 0x9a, 0x5d, 0x00, 0x04, 0x02, 0x00, 0x00, 0x24, 0xb4, 0xc4, 0x4a, 0x00, 0x04, 0x03,
+    0x00, 0x00, 0x13, 0xde, 0x06, 0x4b, 0x00, 0x04, 0x04, 0x04, 0x04, 0x0c, 0x0a, 0x08, 0x08, 0xc5,
+    0xe2, 0x5e, 0x79, 0x00, 0x04, 0x05, 0x00, 0x00, 0xa1, 0xa2, 0x8b, 0x4f, 0x00, 0x04, 0x06, 0x0c,
+    0x0c, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0f, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0f, 0x97, 0x6a, 0x39,
+    0x44, 0x01, 0x04, 0x07, 0x29, 0x19, 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03,
+    0x2b, 0x48, 0xcc, 0x2c, 0x32, 0xe4, 0x2c, 0x00, 0x93, 0x39, 0xf9, 0x79, 0xa9, 0x39, 0x95, 0x9c,
+    0x05, 0x39, 0x89, 0x99, 0x79, 0x9c, 0x00, 0x7d, 0x03, 0x08, 0x96, 0x19, 0x00, 0x00, 0x00, 0x02,
+    0x1d, 0x96, 0x53, 0x00, 0x04, 0x08, 0x02, 0x02, 0x02, 0x00, 0xce, 0xa8, 0x36, 0xad, 0x00, 0x04,
+    0x09, 0x06, 0x06, 0xff, 0xff, 0xff, 0xff, 0x0f, 0x00, 0xe3, 0xd9, 0xd5, 0xa2, 0x00, 0x04, 0x0a,
+    0x02, 0x02, 0x00, 0x64, 0x6d, 0x3c, 0x1f, 0xaf, 0x00, 0x04, 0x0b, 0x02, 0x02, 0x00, 0x00, 0x9c,
+    0xb0, 0xa0, 0xd8, 0x00, 0x04, 0x0c, 0x01, 0x01, 0x00, 0xad, 0xe3, 0x4d, 0x16, 0x00, 0x04, 0x0d,
+    0x03, 0x03, 0x03, 0x04, 0x00, 0xc7, 0x46, 0xcc, 0x1e, 0x00, 0x04, 0x0e, 0x07, 0x07, 0x58, 0x49,
+    0x44, 0x53, 0x69, 0x42, 0x48, 0xb5, 0x57, 0x89, 0x0a, 0x00, 0x04, 0x0f, 0x07, 0x07, 0x03, 0x03,
+    0x03, 0x01, 0x05, 0x02, 0x03, 0xe5, 0x0e, 0x37, 0xb1, 0x00, 0x04, 0x10, 0x01, 0x01, 0x02, 0xa6,
+    0x6a, 0x8c, 0xe2, 0x00, 0x04, 0x11, 0x0a, 0x0a, 0x41, 0x4e, 0x47, 0x41, 0x54, 0x54, 0x41, 0x43,
+    0x41, 0x41, 0x1d, 0x62, 0x3b, 0xea, 0x04, 0x04, 0x12, 0x7b, 0x1d, 0x01, 0x72, 0x00, 0x00, 0x00,
+    0x1d, 0x00, 0x00, 0x00, 0x00, 0x14, 0x84, 0x00, 0x1b, 0x84, 0x00, 0x1f, 0x84, 0x00, 0x28, 0x84,
+    0x00, 0x00, 0x0a, 0x1e, 0x90, 0x00, 0x00, 0x14, 0x15, 0x90, 0x00, 0x00, 0x15, 0x04, 0x16, 0x90,
+    0x00, 0x00, 0x17, 0x90, 0x00, 0x00, 0x18, 0x90, 0x00, 0x00, 0x19, 0x90, 0x00, 0x00, 0x1a, 0x90,
+    0x00, 0x00, 0x1b, 0x1c, 0x90, 0x00, 0x00, 0x1c, 0x08, 0x1d, 0x90, 0x00, 0x00, 0x1e, 0x90, 0x00,
+    0x00, 0x1f, 0x90, 0x00, 0x00, 0x0a, 0x88, 0x00, 0x20, 0x88, 0x00, 0x00, 0x21, 0x90, 0x00, 0x00,
+    0x22, 0x90, 0x00, 0x00, 0x23, 0x90, 0x00, 0x00, 0x24, 0x90, 0x00, 0x00, 0x25, 0x90, 0x00, 0x00,
+    0x28, 0x28, 0x90, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x04, 0x00, 0x04, 0x00, 0x28,
+    0x00, 0x04, 0x00, 0x0c, 0x00, 0x02, 0xe5, 0x09, 0xc6, 0x71, 0x00, 0x04, 0x13, 0x01, 0x01, 0x01,
+    0xf2, 0x94, 0x30, 0x69, 0x00, 0x04, 0x14, 0x01, 0x01, 0x02, 0xf1, 0xfd, 0xee, 0x6d, 0x00, 0x04,
+    0x15, 0x02, 0x02, 0x47, 0x47, 0x8e, 0x94, 0xf0, 0x50, 0x00, 0x04, 0x16, 0x03, 0x03, 0x54, 0x54,
+    0x00, 0xfe, 0xd1, 0x95, 0xa4, 0x00, 0x04, 0x17, 0x01, 0x01, 0x05, 0xbc, 0xc7, 0x3f, 0xe1, 0x00,
+    0x04, 0x18, 0x03, 0x03, 0x3c, 0x25, 0x0c, 0x8a, 0x2e, 0xc9, 0xe7, 0x00, 0x04, 0x1e, 0x01, 0x01,
+    0x02, 0x95, 0x1d, 0x53, 0x02, 0x0f, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0f, 0xe0, 0x45,
+    0x4f, 0x46, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x05, 0xbd, 0xd9, 0x4f, 0x00, 0x01, 0x00, 0x06,
+    0x06, 0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0xee, 0x63, 0x01, 0x4b,
+};
+
+//
+// Check everything getNextRead fills in for a read.
+//
+static void checkRead(Read *read, const Genome *genome, const char *name, const char *bases, const char *qualities,
+    _int64 offsetOnChr1, unsigned mapq, unsigned flags, const char *rnext, unsigned pnext, unsigned frontClipping,
+    unsigned backClipping, unsigned frontHardClipping, unsigned backHardClipping, const char *aux, unsigned auxLength)
+{
+    unsigned length = (unsigned)strlen(bases);
+    ASSERT_EQ(std::string(name), std::string(read->getId(), read->getIdLength()));
+    ASSERT_EQ(std::string(bases), std::string(read->getData(), read->getDataLength()));
+    ASSERT_EQ(std::string(qualities), std::string(read->getQuality(), length));
+    if (offsetOnChr1 < 0) {
+        ASSERT(InvalidGenomeLocation == read->getOriginalAlignedLocation());
+    } else {
+        ASSERT_EQ(GenomeLocationAsInt64(genome->getContigs()[0].beginningLocation) + offsetOnChr1,
+            GenomeLocationAsInt64(read->getOriginalAlignedLocation()));
+        ASSERT_EQ(mapq, read->getOriginalMAPQ());
+    }
+    ASSERT_EQ(flags, read->getOriginalSAMFlags());
+    ASSERT_EQ(std::string(rnext), std::string(read->getOriginalRNEXT(), read->getOriginalRNEXTLength()));
+    ASSERT_EQ(pnext, read->getOriginalPNEXT());
+    ASSERT_EQ(frontClipping, read->getOriginalFrontClipping());
+    ASSERT_EQ(backClipping, read->getOriginalBackClipping());
+    ASSERT_EQ(frontHardClipping, read->getOriginalFrontHardClipping());
+    ASSERT_EQ(backHardClipping, read->getOriginalBackHardClipping());
+
+    unsigned actualAuxLength;
+    bool isSAM;
+    char *actualAux = read->getAuxiliaryData(&actualAuxLength, &isSAM);
+    ASSERT_EQ(auxLength, actualAuxLength);
+    ASSERT(0 == auxLength || !memcmp(aux, actualAux, auxLength));
+    ASSERT(0 == auxLength || !isSAM);
+}
+
+TEST_F(CramTest, "decodes a CRAM 3.0 file built from the specification") {
+    const char *fileName = "CramTest.tmp.cram";
+    FILE *file = fopen(fileName, "wb");
+    ASSERT(NULL != file);
+    ASSERT_EQ((size_t)1, fwrite(cramFixture, sizeof(cramFixture), 1, file));
+    fclose(file);
+
+    //
+    // The reference the reads were encoded against.  The base at offset 6 is an A, for the substitution.
+    //
+    const char *chr1 = "ACGTACATTGCAGGCTTAACGTGCATCGGATCCTAGAGCTTACAGGTCCATGACTTGCAG";
+    Genome *genome = new Genome(60, 60, 0, 2);
+    genome->startContig("chr1");
+    genome->addData(chr1);
+    genome->fillInContigLengths();
+    genome->buildContigNameTable();
+
+    ReaderContext context;
+    memset(&context, 0, sizeof(context));
+    context.genome = genome;
+    context.defaultReadGroup = "";
+    context.clipping = NoClipping;
+    context.preserveClipping = true;    // Keep all of the tags
+    context.compressionLevel = -1;
+
+    CramReader *reader = CramReader::create(fileName, 2, context);
+    ASSERT(reader->getContext()->headerMatchesIndex);
+
+    Read read;
+    ASSERT(reader->getNextRead(&read));
+    static const char pair1Aux[] = "NMc\x02RGZgrp1";   // The NM tag, and then the RG series' read group
+    checkRead(&read, genome, "pair1", "ACTTTGGGGGCT", "56789:;<=>?@", 4, 60, 0x63, "chr1", 30, 0, 0, 0, 0, pair1Aux, sizeof(pair1Aux));
+    ASSERT(READ_GROUP_FROM_AUX == read.getReadGroup());
+
+    //
+    // The mate is reversed, so its bases, qualities and clipping come back the other way round.
+    //
+    ASSERT(reader->getNextRead(&read));
+    checkRead(&read, genome, "pair1", "CTNGTGATAA", "!!+!!!!!!!", 29, 37, 0x93, "chr1", 5, 0, 2, 5, 0, NULL, 0);
+    ASSERT_STREQ("", read.getReadGroup());
+
+    ASSERT(reader->getNextRead(&read));
+    static const char lonelyAux[] = "RGZgrp1";
+    checkRead(&read, genome, "lonely", "GATTACAA", "?@ABCDEF", -1, 0, 0xd, "*", 0, 0, 0, 0, 0, lonelyAux, sizeof(lonelyAux));
+
+    ASSERT(reader->getNextRead(&read));
+    checkRead(&read, genome, "plain", "ATGACTTG", "IIIIIIII", 49, 12, 0x41, "chr1", 100, 0, 0, 0, 0, NULL, 0);
+
+    ASSERT(!reader->getNextRead(&read));
+
+    delete reader;
+    delete genome;
+    DeleteSingleFile(fileName);
+}
@@ -0,0 +1,213 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "HashTable.h"
+#include "GenericFile_Blob.h"
+#include "BigAlloc.h"
+
+//
+// Fill a table with keys 1..nKeys (value = key * 3) and check lookups for both present and absent keys.
+//
+static void fillAndCheck(SNAPHashTable *table, unsigned nKeys)
+{
+    for (_uint64 key = 1; key <= nKeys; key++) {
+        SNAPHashTable::ValueType values[2] = {key * 3, key * 3 + 1};
+        ASSERT(table->Insert(key, values));
+    }
+    ASSERT_EQ((size_t)nKeys, table->GetUsedElementCount());
+
+    for (_uint64 key = 1; key <= nKeys; key++) {
+        SNAPHashTable::ValueType values[2];
+        ASSERT(table->Lookup(key, table->GetValueCount(), values));
+        ASSERT_EQ(key * 3, values[0]);
+        if (table->GetValueCount() == 2) {
+            ASSERT_EQ(key * 3 + 1, values[1]);
+        }
+    }
+
+    for (_uint64 key = nKeys + 1; key <= 2 * nKeys; key++) {
+        ASSERT(NULL == table->GetFirstValueForKey(key));
+    }
+}
+
+struct HashTableTest {
+};
+
+TEST_F(HashTableTest, "flat layout") {
+    SNAPHashTable table(1000, 4, 4, 1, 0xffffffff);
+    ASSERT(!table.UsesBuckets());
+    fillAndCheck(&table, 700);
+}
+
+TEST_F(HashTableTest, "bucketed layout") {
+    SNAPHashTable table(1000, 4, 4, 1, 0xffffffff, true);
+    ASSERT(table.UsesBuckets());
+    ASSERT(table.GetTableSize() >= 1000);
+    fillAndCheck(&table, 700);
+}
+
+TEST_F(HashTableTest, "bucketed layout with two odd-sized values") {
+    SNAPHashTable table(1000, 5, 5, 2, 0xffffffffff, true);
+    fillAndCheck(&table, 700);
+}
+
+TEST_F(HashTableTest, "bucketed fixed-width lookup matches the general one") {
+    SNAPHashTable table(2000, 5, 4, 2, 0xffffffff, true);
+    fillAndCheck(&table, 1800);
+    for (_uint64 key = 1; key <= 4000; key++) {
+        ASSERT(table.GetFirstValueForKeyInBuckets(key) == (table.GetFirstValueForKeyInBucketsFixed<5, 4, 2>(key)));
+    }
+}
+
+TEST_F(HashTableTest, "bucketed layout with a key size that has no fixed-width lookup") {
+    SNAPHashTable table(1000, 7, 4, 1, 0xffffffff, true);
+    fillAndCheck(&table, 700);
+}
+
+TEST_F(HashTableTest, "bucketed layout nearly full") {
+    SNAPHashTable table(640, 4, 4, 1, 0xffffffff, true);
+    unsigned nSlots = (unsigned)table.GetTableSize();
+    _uint64 nInserted = 0;
+    for (_uint64 key = 1; key <= nSlots; key++) {
+        SNAPHashTable::ValueType value = key;
+        if (!table.Insert(key, &value)) {
+            break;
+        }
+        nInserted++;
+    }
+    ASSERT(nInserted >= nSlots * 9 / 10);
+    for (_uint64 key = 1; key <= nInserted; key++) {
+        ASSERT(NULL != table.SlowLookup(key));
+    }
+    ASSERT(NULL == table.SlowLookup(nSlots + 1));
+}
+
+TEST_F(HashTableTest, "robin hood lookups stop early without losing keys") {
+    //
+    // Nearly full, so there are plenty of long probe sequences and displaced entries.  A lookup that stops early has to
+    // agree with SlowLookup, which always probes to an empty slot.
+    //
+    SNAPHashTable table(4000, 4, 4, 1, 0xffffffff, true);
+    ASSERT(table.UsesRobinHood());
+    unsigned nKeys = (unsigned)table.GetTableSize() * 97 / 100;
+    for (_uint64 key = 1; key <= nKeys; key++) {
+        SNAPHashTable::ValueType value = key * 3;
+        ASSERT(table.Insert(key, &value));
+    }
+
+    for (_uint64 key = 1; key <= 3 * nKeys; key++) {
+        SNAPHashTable::ValueType *value = table.GetFirstValueForKey(key);
+        ASSERT(value == table.SlowLookup(key));
+        ASSERT((key <= nKeys) == (NULL != value));
+        if (NULL != value) {
+            ASSERT_EQ(key * 3, (_uint64)*(unsigned *)value);
+        }
+    }
+}
+
+TEST_F(HashTableTest, "robin hood insert into a table small enough for the probe sequence to wrap") {
+    SNAPHashTable table(24, 4, 4, 1, 0xffffffff, true);
+    unsigned nSlots = (unsigned)table.GetTableSize();
+    for (_uint64 key = 1; key <= nSlots; key++) {
+        SNAPHashTable::ValueType value = key;
+        ASSERT(table.Insert(key, &value));
+    }
+    SNAPHashTable::ValueType value = nSlots + 1;
+    ASSERT(!table.Insert(nSlots + 1, &value));
+
+    for (_uint64 key = 1; key <= nSlots; key++) {
+        ASSERT(NULL != table.GetFirstValueForKey(key));
+    }
+    ASSERT(NULL == table.GetFirstValueForKey(nSlots + 1));
+}
+
+TEST_F(HashTableTest, "perfect hash copy finds every key and no others") {
+    SNAPHashTable source(3000, 5, 5, 2, 0xffffffffff, true);
+    fillAndCheck(&source, 2000);
+
+    SNAPHashTable *table = SNAPHashTable::BuildPerfectHash(&source);
+    ASSERT(NULL != table);
+    ASSERT(table->UsesPerfectHash());
+    ASSERT_EQ((size_t)2000, table->GetTableSize());
+    ASSERT_EQ((size_t)2000, table->GetUsedElementCount());
+
+    for (_uint64 key = 1; key <= 4000; key++) {
+        SNAPHashTable::ValueType values[2];
+        ASSERT((key <= 2000) == table->Lookup(key, 2, values));
+        if (key <= 2000) {
+            ASSERT_EQ(key * 3, values[0]);
+            ASSERT_EQ(key * 3 + 1, values[1]);
+        }
+    }
+
+    SNAPHashTable::KeyType key;
+    SNAPHashTable::ValueType values[2];
+    for (_uint64 slot = 0; slot < table->GetTableSize(); slot++) {
+        ASSERT(table->GetSlotContents(slot, &key, values));
+        ASSERT_EQ(key * 3, values[0]);
+    }
+    ASSERT(!table->Insert(4001, values));
+
+    FILE *file = tmpfile();
+    ASSERT(NULL != file);
+    size_t bytesWritten;
+    ASSERT(table->saveToFile(file, &bytesWritten));
+    ASSERT(bytesWritten < table->GetTableSize() * 16 + 500);   // 15 byte entries with no empty slots, and 2 bytes of pilot per 4 keys
+
+    char *blob = (char *)BigAlloc(bytesWritten);
+    rewind(file);
+    ASSERT_EQ(bytesWritten, fread(blob, 1, bytesWritten, file));
+    fclose(file);
+
+    GenericFile_Blob *blobFile = GenericFile_Blob::open(blob, bytesWritten);
+    SNAPHashTable *loaded = SNAPHashTable::loadFromBlob(blobFile);
+    ASSERT(loaded->UsesPerfectHash());
+    for (_uint64 key = 1; key <= 4000; key++) {
+        ASSERT((key <= 2000) == (NULL != loaded->GetFirstValueForKey(key)));
+    }
+
+    delete loaded;
+    blobFile->close();
+    delete blobFile;
+    BigDealloc(blob);
+    delete table;
+}
+
+TEST_F(HashTableTest, "perfect hash copy of an empty table") {
+    SNAPHashTable source(100, 4, 4, 1, 0xffffffff, true);
+    ASSERT(NULL == SNAPHashTable::BuildPerfectHash(&source));
+}
+
+TEST_F(HashTableTest, "bucketed save and load") {
+    SNAPHashTable table(1000, 4, 4, 2, 0xffffffff, true);
+    fillAndCheck(&table, 500);
+
+    FILE *file = tmpfile();
+    ASSERT(NULL != file);
+    size_t bytesWritten;
+    ASSERT(table.saveToFile(file, &bytesWritten));
+    ASSERT_EQ((size_t)0, bytesWritten % 64);    // Keeps buckets in a blob cache-line aligned
+
+    char *blob = (char *)BigAlloc(bytesWritten);
+    rewind(file);
+    ASSERT_EQ(bytesWritten, fread(blob, 1, bytesWritten, file));
+    fclose(file);
+
+    GenericFile_Blob *blobFile = GenericFile_Blob::open(blob, bytesWritten);
+    SNAPHashTable *loaded = SNAPHashTable::loadFromBlob(blobFile);
+    ASSERT(loaded->UsesBuckets());
+    ASSERT(loaded->UsesRobinHood());
+    ASSERT_EQ(table.GetTableSize(), loaded->GetTableSize());
+
+    for (_uint64 key = 1; key <= 500; key++) {
+        SNAPHashTable::ValueType values[2];
+        ASSERT(loaded->Lookup(key, 2, values));
+        ASSERT_EQ(key * 3, values[0]);
+        ASSERT_EQ(key * 3 + 1, values[1]);
+    }
+    ASSERT(NULL == loaded->GetFirstValueForKey(501));
+
+    delete loaded;
+    blobFile->close();
+    delete blobFile;
+    BigDealloc(blob);
+}
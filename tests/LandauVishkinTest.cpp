@@ -1,10 +1,12 @@
 #include "stdafx.h"
 #include "TestLib.h"
 #include "LandauVishkin.h"
+#include "PackedBases.h"
 
 // Test fixture for all the Landau-Viskhin Tests
 struct LandauVishkinTest {
   LandauVishkin<> lv;
+    LandauVishkin<-1> reverseLv;
     LandauVishkinWithCigar lvc;
 };
 
@@ -127,3 +129,260 @@ TEST_F(LandauVishkinTest, "CIGAR strings") {
     lvc.computeEditDistance("abc", 3, "abXde", 5, 3, cigarBuf, bufLen, true);
     ASSERT_STREQ("5M", cigarBuf);
 }
+
+TEST_F(LandauVishkinTest, "packed bases") {
+    //
+    // Mutate pieces of a random sequence a few different ways, and check that scoring them packed gives the same
+    // answers as scoring the chars, in both directions.
+    //
+    const int textLen = 400;
+    const int patternLen = 150;
+    char text[textLen];
+    char pattern[patternLen + 64];
+    char reversed[patternLen + 64];
+    _uint64 storage[64];
+    _uint64 patternStorage[32];
+    _uint64 reversedStorage[32];
+    PackedBases packedText, packedPattern, packedReversed;
+
+    ASSERT_M(sizeof(storage) >= PackedBases::GetStorageSize(textLen) && sizeof(patternStorage) >= PackedBases::GetStorageSize(patternLen), "storage too small");
+
+    unsigned random = 12345;
+    for (int i = 0; i < textLen; i++) {
+        random = random * 1103515245 + 12345;
+        text[i] = "ACGT"[(random >> 16) & 3];
+    }
+    packedText.init(storage, 0, textLen);
+    packedText.pack(0, text, textLen);
+    packedPattern.init(patternStorage, 0, patternLen);
+    packedReversed.init(reversedStorage, 0, patternLen);
+
+    for (int trial = 0; trial < 200; trial++) {
+        int start = 100 + trial % 50;
+        memcpy(pattern, text + start, patternLen);
+        memset(pattern + patternLen, 0, 64);
+        int nChanges = trial % 8;
+        for (int c = 0; c < nChanges; c++) {
+            random = random * 1103515245 + 12345;
+            int where = (random >> 8) % (patternLen - 1);
+            switch ((random >> 4) % 4) {
+            case 0: pattern[where] = "ACGT"[(random >> 20) & 3]; break;                         // substitution (maybe to the same base)
+            case 1: memmove(pattern + where, pattern + where + 1, patternLen - where - 1); break;   // deletion
+            case 2: memmove(pattern + where + 1, pattern + where, patternLen - where - 1); break;   // insertion
+            case 3: pattern[where] = 'N'; break;
+            }
+        }
+        for (int i = 0; i < patternLen; i++) {
+            reversed[i] = pattern[patternLen - i - 1];
+        }
+        memset(reversed + patternLen, 0, 64);
+        packedPattern.set(pattern, patternLen);
+        packedReversed.set(reversed, patternLen);
+
+        int netIndel, packedNetIndel;
+        ASSERT_EQ(lv.computeEditDistance(text + start, textLen - start, pattern, NULL, patternLen, 20, NULL, &netIndel),
+                  lv.computeEditDistance(&packedText, start, textLen - start, &packedPattern, 0, NULL, patternLen, 20, NULL, &packedNetIndel));
+
+        int end = start + patternLen;
+        ASSERT_EQ(reverseLv.computeEditDistance(text + end, end, reversed, NULL, patternLen, 20, NULL, &netIndel),
+                  reverseLv.computeEditDistance(&packedText, end, end, &packedReversed, 0, NULL, patternLen, 20, NULL, &packedNetIndel));
+    }
+}
+
+TEST_F(LandauVishkinTest, "vector rows") {
+    //
+    // Computing whole rows with vector instructions has to give exactly the same answers, including the match
+    // probability, as doing the diagonals one at a time.  It depends on the processor, so there's nothing to check without it.
+    //
+    LVComputeRowFunction computeRow = lv_computeRow;
+    int minVectorRowErrors = lv_minVectorRowErrors;
+    if (NULL == computeRow) {
+        return;
+    }
+
+    initializeLVProbabilitiesToPhredPlus33();
+
+    const int textLen = 600;
+    const int patternLen = 250;
+    char text[textLen + 64];
+    char pattern[patternLen + 64];
+    char reversed[patternLen + 64];
+    char quality[patternLen + 1];
+    LandauVishkin<> *scalarLv = new LandauVishkin<>;
+    LandauVishkin<-1> *scalarReverseLv = new LandauVishkin<-1>;
+
+    unsigned random = 54321;
+    memset(text, 'n', sizeof(text));
+    for (int i = 32; i < textLen; i++) {
+        random = random * 1103515245 + 12345;
+        text[i] = "ACGT"[(random >> 16) & 3];
+    }
+
+    for (int trial = 0; trial < 500; trial++) {
+        int start = 100 + trial % 60;
+        memcpy(pattern, text + start, patternLen);
+        memset(pattern + patternLen, 0, 64);
+        int nChanges = trial % 24;
+        for (int c = 0; c < nChanges; c++) {
+            random = random * 1103515245 + 12345;
+            int where = (random >> 8) % (patternLen - 1);
+            switch ((random >> 4) % 4) {
+            case 0: pattern[where] = "ACGT"[(random >> 20) & 3]; break;
+            case 1: memmove(pattern + where, pattern + where + 1, patternLen - where - 1); break;
+            case 2: memmove(pattern + where + 1, pattern + where, patternLen - where - 1); break;
+            case 3: pattern[where] = 'N'; break;
+            }
+        }
+        for (int i = 0; i < patternLen; i++) {
+            reversed[i] = pattern[patternLen - i - 1];
+            random = random * 1103515245 + 12345;
+            quality[i] = (char)(33 + (random >> 16) % 40);
+        }
+        memset(reversed + patternLen, 0, 64);
+        quality[patternLen] = '\0';
+
+        int k = 1 + trial % 40;
+        lv_minVectorRowErrors = (trial % 2) ? 1 : minVectorRowErrors;   // Sometimes do even the narrowest rows with vectors
+        int thisPatternLen = patternLen - trial % 7;
+        int thisTextLen = (trial % 5 == 0) ? thisPatternLen - 3 : textLen - start;  // Sometimes the text runs out first
+        double probability, scalarProbability;
+        int netIndel, scalarNetIndel;
+
+        lv_computeRow = NULL;
+        int scalarResult = scalarLv->computeEditDistance(text + start, thisTextLen, pattern, quality, thisPatternLen, k, &scalarProbability, &scalarNetIndel);
+        lv_computeRow = computeRow;
+        int result = lv.computeEditDistance(text + start, thisTextLen, pattern, quality, thisPatternLen, k, &probability, &netIndel);
+        ASSERT_EQ(scalarResult, result);
+        ASSERT_EQ(scalarNetIndel, netIndel);
+        ASSERT_M(scalarProbability == probability, "forward match probabilities differ");
+
+        int end = start + patternLen;
+        lv_computeRow = NULL;
+        scalarResult = scalarReverseLv->computeEditDistance(text + end, end, reversed, quality, thisPatternLen, k, &scalarProbability, &scalarNetIndel);
+        lv_computeRow = computeRow;
+        result = reverseLv.computeEditDistance(text + end, end, reversed, quality, thisPatternLen, k, &probability, &netIndel);
+        ASSERT_EQ(scalarResult, result);
+        ASSERT_EQ(scalarNetIndel, netIndel);
+        ASSERT_M(scalarProbability == probability, "reverse match probabilities differ");
+    }
+
+    lv_minVectorRowErrors = minVectorRowErrors;
+    delete scalarLv;
+    delete scalarReverseLv;
+}
+
+TEST_F(LandauVishkinTest, "bit vectors") {
+    //
+    // Checking with the bit-vector edit distance partway through the rows mustn't change any answer, even when the
+    // text runs out before the pattern or has Ns in it.  Compare with it turned off, over patterns both near and far
+    // from the text.
+    //
+    int bitVectorCheckErrors = lv_bitVectorCheckErrors;
+    int minBitVectorK = lv_minBitVectorK;
+
+    initializeLVProbabilitiesToPhredPlus33();
+
+    const int textLen = 600;
+    const int patternLen = 250;
+    char text[textLen + 64];
+    char pattern[patternLen + 64];
+    char reversed[patternLen + 64];
+    char quality[patternLen + 1];
+
+    unsigned random = 24680;
+    memset(text, 'n', sizeof(text));
+    for (int i = 32; i < textLen; i++) {
+        random = random * 1103515245 + 12345;
+        text[i] = (random >> 28) == 0 ? 'N' : "ACGT"[(random >> 16) & 3];
+    }
+
+    for (int trial = 0; trial < 1000; trial++) {
+        int start = 100 + trial % 60;
+        int thisPatternLen = 1 + (trial * 37) % patternLen;
+        memcpy(pattern, text + ((trial % 3 == 0) ? 350 - start : start), thisPatternLen);   // A third of the time, somewhere else
+        memset(pattern + thisPatternLen, 0, 64);
+        int nChanges = trial % 30;
+        for (int c = 0; c < nChanges && thisPatternLen > 1; c++) {
+            random = random * 1103515245 + 12345;
+            int where = (random >> 8) % (thisPatternLen - 1);
+            switch ((random >> 4) % 4) {
+            case 0: pattern[where] = "ACGT"[(random >> 20) & 3]; break;
+            case 1: memmove(pattern + where, pattern + where + 1, thisPatternLen - where - 1); break;
+            case 2: memmove(pattern + where + 1, pattern + where, thisPatternLen - where - 1); break;
+            case 3: pattern[where] = 'N'; break;
+            }
+        }
+        for (int i = 0; i < thisPatternLen; i++) {
+            reversed[i] = pattern[thisPatternLen - i - 1];
+            random = random * 1103515245 + 12345;
+            quality[i] = (char)(33 + (random >> 16) % 40);
+        }
+        memset(reversed + thisPatternLen, 0, 64);
+        quality[thisPatternLen] = '\0';
+
+        int k = trial % MAX_K;
+        int thisTextLen = (trial % 5 == 0) ? __max(0, thisPatternLen - 1 - trial % 11) : textLen - start;
+        double probability, plainProbability;
+        int netIndel, plainNetIndel;
+
+        for (int direction = 0; direction < 2; direction++) {
+            int plainResult, result;
+            int end = start + thisPatternLen;
+
+            lv_bitVectorCheckErrors = MAX_K + 1;
+            if (0 == direction) {
+                plainResult = lv.computeEditDistance(text + start, thisTextLen, pattern, quality, thisPatternLen, k, &plainProbability, &plainNetIndel);
+            } else {
+                plainResult = reverseLv.computeEditDistance(text + end, __min(thisTextLen, end), reversed, quality, thisPatternLen, k, &plainProbability, &plainNetIndel);
+            }
+
+            lv_bitVectorCheckErrors = 1 + trial % 4;
+            lv_minBitVectorK = 0;
+            if (0 == direction) {
+                result = lv.computeEditDistance(text + start, thisTextLen, pattern, quality, thisPatternLen, k, &probability, &netIndel);
+            } else {
+                result = reverseLv.computeEditDistance(text + end, __min(thisTextLen, end), reversed, quality, thisPatternLen, k, &probability, &netIndel);
+            }
+
+            ASSERT_EQ(plainResult, result);
+            ASSERT_EQ(plainNetIndel, netIndel);
+            ASSERT_M(plainProbability == probability, "match probabilities differ");
+        }
+    }
+
+    lv_bitVectorCheckErrors = bitVectorCheckErrors;
+    lv_minBitVectorK = minBitVectorK;
+}
+
+TEST_F(LandauVishkinTest, "affine gap CIGAR strings") {
+    char text[64] = "abcdefghijklmnopqrstuvwxyz";     // The rest is zeroes, so reading past the end stops
+    char cigarBuf[1024];
+    int bufLen = sizeof(cigarBuf);
+    int used, addFrontClipping, netIndel;
+
+    //
+    // Two deletions a base apart are the fewest edits, but with affine gaps one deletion and a mismatch is better.
+    //
+    ASSERT_EQ(2, lvc.computeEditDistanceNormalized(text, 20, "abcdegijklmnopqrst", 18, 10, cigarBuf, bufLen, false,
+        COMPACT_CIGAR_STRING, &used, &addFrontClipping, &netIndel));
+    ASSERT_STREQ("5=1D1=1D12=", cigarBuf);
+
+    lvc.setAffineGapPenalty(6);
+    ASSERT_EQ(3, lvc.computeEditDistanceNormalized(text, 20, "abcdegijklmnopqrst", 18, 10, cigarBuf, bufLen, false,
+        COMPACT_CIGAR_STRING, &used, &addFrontClipping, &netIndel));
+    ASSERT_STREQ("5=2D1X12=", cigarBuf);
+    ASSERT_EQ(2, netIndel);
+
+    ASSERT_EQ(3, lvc.computeEditDistanceNormalized(text, 26, "abcdefghijklmqrstuvwxyz", 23, 10, cigarBuf, bufLen, false,
+        COMPACT_CIGAR_STRING, &used, &addFrontClipping, &netIndel));
+    ASSERT_STREQ("13=3D10=", cigarBuf);
+
+    ASSERT_EQ(3, lvc.computeEditDistanceNormalized(text, 26, "abcdefghijklmXYZnopqrstuvwxyz", 29, 10, cigarBuf, bufLen, true,
+        COMPACT_CIGAR_STRING, &used, &addFrontClipping, &netIndel));
+    ASSERT_STREQ("13M3I13M", cigarBuf);
+    ASSERT_EQ(-3, netIndel);
+
+    ASSERT_EQ(1, lvc.computeEditDistanceNormalized(text, 26, "abcdefghijklmnopqrstuvwxz", 25, 10, cigarBuf, bufLen, false,
+        COMPACT_CIGAR_STRING, &used, &addFrontClipping, &netIndel));
+    ASSERT_STREQ("24=1X", cigarBuf);
+}
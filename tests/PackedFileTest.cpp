@@ -0,0 +1,73 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "GenericFile_packed.h"
+
+struct PackedFileTest {
+};
+
+TEST_F(PackedFileTest, "packed file reads back the same as the original") {
+    //
+    // A header line like the genome file's and then bases, in small chunks so that there are lots of them and the reads
+    // start and end in the middle of some.
+    //
+    const size_t size = 200000;
+    const size_t chunkSize = 4096;
+    char *data = new char[size];
+    unsigned seed = 3;
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = "ACGTN"[(seed >> 16) % ((seed >> 28) == 0 ? 5 : 4)];
+    }
+    const char *headerLine = "12345 2\n";
+    memcpy(data, headerLine, strlen(headerLine));
+
+    const char *fileName = "PackedFileTest.tmp";
+    const char *packedFileName = "PackedFileTest.packed.tmp";
+    FILE *file = fopen(fileName, "wb");
+    ASSERT(NULL != file);
+    ASSERT_EQ((size_t)1, fwrite(data, size, 1, file));
+    fclose(file);
+
+    _int64 packedSize;
+    ASSERT(GenericFile_packed::PackFile(fileName, packedFileName, 4, &packedSize, chunkSize));
+    DeleteSingleFile(fileName);
+    ASSERT(GenericFile_packed::IsPackedFile(packedFileName));
+    ASSERT(packedSize < (_int64)size);
+
+    GenericFile *packedFile = GenericFile::open(packedFileName, GenericFile::ReadOnly);
+    ASSERT(NULL != packedFile);
+
+    char line[100];
+    ASSERT(NULL != packedFile->gets(line, sizeof(line)));
+    ASSERT(!strcmp(headerLine, line));
+
+    ASSERT_EQ(0, packedFile->advance(chunkSize * 3 - 1000));
+    _int64 offset = packedFile->tell();
+    char *readBack = new char[size];
+    ASSERT_EQ(size - (size_t)offset, packedFile->readInParallel(readBack, size));  // Asking for too much gets the rest
+    ASSERT(!memcmp(data + offset, readBack, size - offset));
+    ASSERT_EQ((_int64)size, packedFile->tell());
+
+    ASSERT_EQ(0, packedFile->advance(-(long long)(size - 10)));
+    ASSERT_EQ((size_t)(chunkSize * 2), packedFile->read(readBack, chunkSize * 2));
+    ASSERT(!memcmp(data + 10, readBack, chunkSize * 2));
+    ASSERT_EQ((int)data[10 + chunkSize * 2], packedFile->getchar());
+
+    //
+    // Checksums, of the chunks in parallel and then combined, with and without somewhere to put the data.
+    //
+    _uint32 checksum;
+    ASSERT_EQ(0, packedFile->advance(100 - packedFile->tell()));
+    ASSERT_EQ(size - 100, packedFile->readInParallel(readBack, size, &checksum));
+    ASSERT_EQ(GenericFile::Checksum(data + 100, size - 100), checksum);
+    ASSERT_EQ(0, packedFile->advance(-(long long)(size - 5000)));
+    ASSERT_EQ((size_t)(chunkSize * 20), packedFile->readInParallel(NULL, chunkSize * 20, &checksum));
+    ASSERT_EQ(GenericFile::Checksum(data + 5000, chunkSize * 20), checksum);
+    ASSERT_EQ(GenericFile::Checksum(data, size), GenericFile::CombineChecksums(GenericFile::Checksum(data, 1000), GenericFile::Checksum(data + 1000, size - 1000), size - 1000));
+
+    packedFile->close();
+    delete packedFile;
+    DeleteSingleFile(packedFileName);
+    delete[] readBack;
+    delete[] data;
+}
@@ -0,0 +1,177 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "ParallelInflate.h"
+
+struct ParallelInflateTest {
+};
+
+//
+// Something like FASTQ, which compresses about as well.
+//
+static char *makeFastq(size_t size)
+{
+    char *data = new char[size];
+    unsigned seed = 47;
+    size_t used = 0;
+    for (int read = 0; used < size; read++) {
+        char record[400];
+        int length = sprintf(record, "@SRR062634.%d %d length=100\n", read, read);
+        for (int i = 0; i < 100; i++) {
+            seed = seed * 1103515245 + 12345;
+            record[length++] = "ACGT"[(seed >> 16) & 3];
+        }
+        length += sprintf(record + length, "\n+\n");
+        char quality = 'I';
+        for (int i = 0; i < 100; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (0 == ((seed >> 16) & 7)) {
+                quality = "#+5?DFHIJ"[(seed >> 20) % 9];
+            }
+            record[length++] = quality;
+        }
+        record[length++] = '\n';
+        size_t n = __min((size_t)length, size - used);
+        memcpy(data + used, record, n);
+        used += n;
+    }
+    return data;
+}
+
+//
+// Append the gzip of in to out (which has room), returning how long it made it.
+//
+static size_t gzip(const char *in, size_t inSize, char *out, size_t outSize, int level, int strategy = Z_DEFAULT_STRATEGY)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    ASSERT_EQ(Z_OK, deflateInit2(&stream, level, Z_DEFLATED, MAX_WBITS + 16, 8, strategy));
+    stream.next_in = (Bytef *)in;
+    stream.avail_in = (uInt)inSize;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = (uInt)outSize;
+    ASSERT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+    size_t written = stream.total_out;
+    deflateEnd(&stream);
+    return written;
+}
+
+//
+// Inflate a gzip file the way DecompressDataReader does, in batches of batchSize with the overflow after them, as the memory
+// mapped reader hands them out.  Returns false if the inflater found something wrong.
+//
+static bool inflateInBatches(const char *compressed, _int64 compressedSize, _int64 batchSize, int nThreads, char *output,
+    _int64 *o_outputBytes, _int64 *o_chunksUsed = NULL)
+{
+    ParallelInflater inflater(nThreads);
+    _int64 consumed = 0;
+    _int64 outputBytes = 0;
+    for (_int64 batch = 0; batch < compressedSize; batch += batchSize) {
+        _int64 startEnd = __min(batch + batchSize, compressedSize);
+        _int64 validEnd = __min(batch + batchSize + ParallelInflater::OverflowBytes, compressedSize);
+        if (consumed >= startEnd) {
+            ASSERT_EQ(compressedSize, consumed);
+            break;
+        }
+        _int64 inputUsed, batchOutput;
+        if (!inflater.inflate(compressed + consumed, startEnd - consumed, validEnd - consumed, &inputUsed, &batchOutput)) {
+            return false;
+        }
+        ASSERT(inputUsed >= startEnd - consumed || validEnd == compressedSize);
+        ASSERT(inputUsed <= validEnd - consumed);
+        consumed += inputUsed;
+        if (!inflater.getOutput(output + outputBytes)) {
+            return false;
+        }
+        outputBytes += batchOutput;
+    }
+    *o_outputBytes = outputBytes;
+    _int64 chunksUsed, chunksDiscarded;
+    inflater.getStats(&chunksUsed, &chunksDiscarded);
+    if (NULL != o_chunksUsed) {
+        *o_chunksUsed = chunksUsed;
+    }
+    return consumed == compressedSize && inflater.atMemberEnd();
+}
+
+TEST_F(ParallelInflateTest, "inflates gzip in speculative chunks the same as zlib") {
+    const size_t size = 12 * 1024 * 1024;
+    char *data = makeFastq(size);
+    const size_t compressedMax = size + size / 100 + 1024;
+    char *compressed = new char[compressedMax];
+    char *output = new char[size + 1];
+    _int64 outputBytes, chunksUsed;
+
+    //
+    // One member at a few levels, on four threads and one, in batches the size the readers use and smaller.
+    //
+    for (int level = 1; level <= 9; level += 4) {
+        size_t compressedSize = gzip(data, size, compressed, compressedMax, level);
+        for (int nThreads = 1; nThreads <= 4; nThreads += 3) {
+            for (_int64 batchSize = 2 * 1024 * 1024; batchSize <= 4 * 1024 * 1024; batchSize *= 2) {
+                memset(output, 0, size + 1);
+                ASSERT(inflateInBatches(compressed, compressedSize, batchSize, nThreads, output, &outputBytes, &chunksUsed));
+                ASSERT_EQ((_int64)size, outputBytes);
+                ASSERT(!memcmp(data, output, size));
+                if (nThreads > 1) {
+                    ASSERT(chunksUsed > 0);    // So the guessing worked, not just following on from the first chunk
+                } else {
+                    ASSERT_EQ((_int64)0, chunksUsed);
+                }
+            }
+        }
+    }
+
+    //
+    // Fixed Huffman codes and stored blocks aren't looked for, so it all gets inflated the slow way, but the same.
+    //
+    size_t compressedSize = gzip(data, size, compressed, compressedMax, 6, Z_FIXED);
+    ASSERT(inflateInBatches(compressed, compressedSize, 2 * 1024 * 1024, 4, output, &outputBytes));
+    ASSERT_EQ((_int64)size, outputBytes);
+    ASSERT(!memcmp(data, output, size));
+
+    compressedSize = gzip(data, size, compressed, compressedMax, 0);
+    ASSERT(inflateInBatches(compressed, compressedSize, 2 * 1024 * 1024, 4, output, &outputBytes));
+    ASSERT_EQ((_int64)size, outputBytes);
+    ASSERT(!memcmp(data, output, size));
+
+    //
+    // Several members, as from cat'ing gzip files together, including an empty one, one with a file name in its header, and one
+    // small enough to end in the middle of a chunk.
+    //
+    const size_t parts[] = {5 * 1024 * 1024, 0, 1000, size - 5 * 1024 * 1024 - 1000};
+    compressedSize = 0;
+    size_t offset = 0;
+    for (int i = 0; i < 4; i++) {
+        size_t memberStart = compressedSize;
+        compressedSize += gzip(data + offset, parts[i], compressed + compressedSize, compressedMax - compressedSize, 6);
+        offset += parts[i];
+        if (2 == i) {
+            //
+            // Set FNAME and put a name after the 10 byte header.
+            //
+            const char name[] = "reads.fq";
+            memmove(compressed + memberStart + 10 + sizeof(name), compressed + memberStart + 10, compressedSize - memberStart - 10);
+            memcpy(compressed + memberStart + 10, name, sizeof(name));
+            compressed[memberStart + 3] |= 8;
+            compressedSize += sizeof(name);
+        }
+    }
+    ASSERT(inflateInBatches(compressed, compressedSize, 2 * 1024 * 1024, 4, output, &outputBytes));
+    ASSERT_EQ((_int64)size, outputBytes);
+    ASSERT(!memcmp(data, output, size));
+
+    //
+    // A wrong CRC, a truncated file and something that isn't gzip all fail.
+    //
+    compressedSize = gzip(data, size, compressed, compressedMax, 6);
+    compressed[compressedSize - 8] ^= 1;
+    ASSERT(!inflateInBatches(compressed, compressedSize, 2 * 1024 * 1024, 4, output, &outputBytes));
+    compressed[compressedSize - 8] ^= 1;
+    ASSERT(!inflateInBatches(compressed, compressedSize - 4, 2 * 1024 * 1024, 4, output, &outputBytes));
+    ASSERT(!inflateInBatches(compressed, compressedSize / 2, 2 * 1024 * 1024, 4, output, &outputBytes));
+    ASSERT(!inflateInBatches(data, 1000, 2 * 1024 * 1024, 4, output, &outputBytes));
+
+    delete [] data;
+    delete [] compressed;
+    delete [] output;
+}
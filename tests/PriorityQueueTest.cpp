@@ -0,0 +1,62 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "PriorityQueue.h"
+#include <vector>
+#include <algorithm>
+
+//
+// Merge nSources sorted runs of random lengths (some empty) with a LoserTree, checking each step against everything
+// that's left.
+//
+static void mergeAndCheck(int nSources, unsigned seed)
+{
+    std::vector< std::vector<int> > sources(nSources);
+    std::vector<size_t> next(nSources, 0);
+    std::vector<int> all;
+    for (int s = 0; s < nSources; s++) {
+        int length = (int)((seed = seed * 1103515245 + 12345) >> 16) % 50;
+        for (int i = 0; i < length; i++) {
+            sources[s].push_back((int)((seed = seed * 1103515245 + 12345) >> 16) % 1000);
+        }
+        std::sort(sources[s].begin(), sources[s].end());
+        all.insert(all.end(), sources[s].begin(), sources[s].end());
+    }
+    std::sort(all.begin(), all.end());
+
+    LoserTree<int> tree(nSources);
+    for (int s = 0; s < nSources; s++) {
+        if (sources[s].size() > 0) {
+            tree.set(s, sources[s][0]);
+        }
+    }
+    tree.build();
+
+    size_t merged = 0;
+    int source;
+    while ((source = tree.top()) != -1) {
+        ASSERT(merged < all.size());
+        ASSERT_EQ(all[merged], sources[source][next[source]]);
+        int second;
+        if (tree.runnerUp(&second)) {
+            ASSERT(merged + 1 < all.size());
+            ASSERT_EQ(all[merged + 1], std::min(second, next[source] + 1 < sources[source].size() ? sources[source][next[source] + 1] : second));
+        }
+        merged++;
+        if (++next[source] < sources[source].size()) {
+            tree.update(sources[source][next[source]]);
+        } else {
+            tree.remove();
+        }
+    }
+    ASSERT_EQ(all.size(), merged);
+}
+
+struct PriorityQueueTest {
+};
+
+TEST_F(PriorityQueueTest, "loser tree merges sorted sources") {
+    for (int nSources = 0; nSources <= 40; nSources++) {
+        mergeAndCheck(nSources, 17 + nSources);
+    }
+    mergeAndCheck(333, 5);
+}
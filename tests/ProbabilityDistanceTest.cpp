@@ -68,3 +68,30 @@ TEST_F(ProbabilityDistanceTest, "indels") {
     dist.compute("ACGTTTACGT", "ACGTACGT", "IIIIIIII", 8, 1, 2, &prob);
     ASSERT_NEAR(pow(0.9, 8) * 0.01 * 0.2, prob);
 }
+
+
+TEST_F(ProbabilityDistanceTest, "long reads") {
+    // enough bases and shifts that every shift gets used, with reference to spare on both sides
+    char reference[200], read[101], quality[101];
+    for (int i = 0; i < 200; i++) {
+        reference[i] = "ACGT"[(i * 7 + i / 3) % 4];
+    }
+    memcpy(read, reference + 50, 100);
+    memset(quality, 'I', 101);
+    double match = 0.9 * (1 - 1e-4); // over 100 bases, Q40 isn't close enough to perfect to leave out
+
+    dist.compute(reference + 50, read, quality, 100, 5, 15, &prob);
+    ASSERT_NEAR(pow(match, 100), prob);
+
+    // one base changed
+    read[60] = read[60] == 'A' ? 'C' : 'A';
+    dist.compute(reference + 50, read, quality, 100, 5, 15, &prob);
+    ASSERT_NEAR(pow(match, 99) * (1 - match), prob);
+
+    // one base inserted instead
+    memcpy(read, reference + 50, 60);
+    read[60] = reference[110] == 'A' ? 'C' : 'A';
+    memcpy(read + 61, reference + 110, 40);
+    dist.compute(reference + 50, read, quality, 101, 5, 15, &prob);
+    ASSERT_NEAR(pow(match, 100) * 0.01, prob);
+}
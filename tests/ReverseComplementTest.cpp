@@ -0,0 +1,42 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "ReverseComplement.h"
+
+struct ReverseComplementTest {
+};
+
+TEST_F(ReverseComplementTest, "reverse complement, reversal and complement") {
+    //
+    // Long enough for a couple of vector chunks and a tail, with Ns and a base that isn't ACGTN in both.
+    //
+    const char *data =    "ACGTNACGTTGCAGTCAGRCAGGTCAATGCNNAGCTAGGCTAGTACGA";
+    const char *quality = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKL";
+    unsigned length = (unsigned)strlen(data);
+
+    char rcData[64], rcQuality[64], reversedData[64], complementData[64];
+    ASSERT_EQ(3u, ReverseComplementRead(data, quality, length, rcData, rcQuality, reversedData, complementData));
+
+    for (unsigned i = 0; i < length; i++) {
+        char base = data[length - i - 1];
+        char complement = base == 'A' ? 'T' : base == 'C' ? 'G' : base == 'G' ? 'C' : base == 'T' ? 'A' : 'N';
+        ASSERT_EQ(complement, rcData[i]);
+        ASSERT_EQ(quality[length - i - 1], rcQuality[i]);
+        ASSERT_EQ(base, reversedData[i]);
+        ASSERT_EQ(complement, complementData[length - i - 1]);
+    }
+
+    ASSERT_EQ(0u, ReverseComplementRead(data, NULL, 4, rcData, NULL));
+}
+
+TEST_F(ReverseComplementTest, "upcasing") {
+    const char *mixed = "ACGTacgtn.ACGTACGTACGTACGTACGTAC";
+    const char *upper = "ACGTACGTNNACGTACGTACGTACGTACGTAC";
+    char upcased[64];
+
+    ASSERT(ReadNeedsUpcasing(mixed, (unsigned)strlen(mixed)));
+    ASSERT(ReadNeedsUpcasing(mixed + 4, 4));
+    ASSERT(!ReadNeedsUpcasing(upper, (unsigned)strlen(upper)));
+
+    UpcaseRead(mixed, upcased, (unsigned)strlen(mixed));
+    ASSERT(!memcmp(upper, upcased, strlen(upper)));
+}
@@ -0,0 +1,81 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "SeedSketch.h"
+
+//
+// Keys spread over a few tables, the way the index has them.
+//
+static void keyFor(int i, unsigned *whichTable, _uint64 *key)
+{
+    *whichTable = (unsigned)(i % 16);
+    *key = (_uint64)i * 0x9e3779b97f4a7c15ULL >> 20;
+}
+
+struct SeedSketchTest {
+};
+
+TEST_F(SeedSketchTest, "bloom filter has every key and few others") {
+    const int nKeys = 20000;
+    SeedSketch sketch(nKeys, SeedSketch::DefaultBitsPerKey, 0);
+    for (int i = 0; i < nKeys; i++) {
+        unsigned whichTable;
+        _uint64 key;
+        keyFor(i, &whichTable, &key);
+        sketch.addKey(whichTable, key);
+    }
+
+    for (int i = 0; i < nKeys; i++) {
+        unsigned whichTable;
+        _uint64 key;
+        keyFor(i, &whichTable, &key);
+        ASSERT(sketch.mightContain(whichTable, key));
+    }
+
+    int falsePositives = 0;
+    for (int i = nKeys; i < 2 * nKeys; i++) {
+        unsigned whichTable;
+        _uint64 key;
+        keyFor(i, &whichTable, &key);
+        if (sketch.mightContain(whichTable, key)) {
+            falsePositives++;
+        }
+    }
+    ASSERT(falsePositives < nKeys / 20);  // About 3% at 8 bits per key
+}
+
+TEST_F(SeedSketchTest, "popular keys keep their counts through a save and load") {
+    SeedSketch sketch(100, SeedSketch::DefaultBitsPerKey, 50);
+    for (int i = 0; i < 50; i++) {
+        unsigned whichTable;
+        _uint64 key;
+        keyFor(i, &whichTable, &key);
+        _int64 nHits[2] = {1000 + i, i % 2 == 0 ? 0 : 5000000000LL};
+        sketch.addKey(whichTable, key);
+        sketch.addPopularKey(whichTable, key, nHits, 2);
+    }
+
+    const char *fileName = "SeedSketchTest.tmp";
+    ASSERT(sketch.saveToFile(fileName, 16, 12345));
+    ASSERT(NULL == SeedSketch::loadFromFile(fileName, 16, 54321));    // For some other genome
+    SeedSketch *loaded = SeedSketch::loadFromFile(fileName, 16, 12345);
+    ASSERT(NULL != loaded);
+    DeleteSingleFile(fileName);
+
+    ASSERT_EQ((_int64)50, loaded->getPopularKeyCount());
+    for (int i = 0; i < 100; i++) {
+        unsigned whichTable;
+        _uint64 key;
+        keyFor(i, &whichTable, &key);
+        _int64 nHits[2];
+        if (i < 50) {
+            ASSERT(loaded->mightContain(whichTable, key));
+            ASSERT(loaded->findPopularKey(whichTable, key, nHits));
+            ASSERT_EQ((_int64)(1000 + i), nHits[0]);
+            ASSERT_EQ((_int64)(i % 2 == 0 ? 0 : 0xffffffff), nHits[1]);    // The counts saturate
+        } else {
+            ASSERT(!loaded->findPopularKey(whichTable, key, nHits));
+        }
+    }
+
+    delete loaded;
+}
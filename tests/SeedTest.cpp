@@ -0,0 +1,109 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "Seed.h"
+#include "BigAlloc.h"
+#include "GenomeIndex.h"
+
+//
+// Check every seed of every length in a read against the text versions.
+//
+static void checkAllSeeds(const char *data)
+{
+    unsigned length = (unsigned)strlen(data);
+    void *storage = BigAlloc(PackedReadSeeds::GetStorageSize(length));
+    PackedReadSeeds packed;
+    packed.init(storage, length);
+    packed.set(data, length);
+
+    for (unsigned seedLen = 1; seedLen <= __min(length, LargestSeedSize); seedLen++) {
+        for (unsigned offset = 0; offset + seedLen <= length; offset++) {
+            ASSERT_EQ(Seed::DoesTextRepresentASeed(data + offset, seedLen), packed.isSeed(offset, seedLen));
+            if (packed.isSeed(offset, seedLen)) {
+                Seed fromText(data + offset, seedLen);
+                Seed fromPacked = packed.getSeed(offset, seedLen);
+                ASSERT_EQ(fromText.getBases(), fromPacked.getBases());
+                ASSERT_EQ(fromText.getRCBases(), fromPacked.getRCBases());
+            }
+        }
+    }
+
+    BigDealloc(storage);
+}
+
+struct SeedTest {
+};
+
+TEST_F(SeedTest, "packed seeds match text seeds") {
+    checkAllSeeds("ACGTTGCAAGGCTTAACCGGTTAACGTACGTAGCTAGCTAGGATCCATGCATGCAAATTTGGGCCCATATGCGC");
+}
+
+TEST_F(SeedTest, "packed seeds with Ns and a short tail") {
+    checkAllSeeds("ACGTNACGTTGCAGTCAGTCAGGTCAATGCNNAGCTAGGCTAGTACGATCGATGCATGCAGTCAn.GATTACAGATTACA");
+    checkAllSeeds("GATTACA");
+}
+
+TEST_F(SeedTest, "packed seed quality matches the quality string") {
+    //
+    // Longer than a vector and not a multiple of one, with low quality bases scattered and in a tail.
+    //
+    const char *data = "ACGTTGCAAGGCTTAACCGGTTAACGTACGTAGCTAGCTAGGATCCATGCATGCAAATTTGGGCCCATATGCGC";
+    const char *quality = "IIIIII#IIIIIIIIIIIIIIIIIIIIII5IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII&#####!!!!!!";
+    unsigned length = (unsigned)strlen(data);
+    const unsigned minQuality = 10;
+
+    void *storage = BigAlloc(PackedReadSeeds::GetStorageSize(length));
+    PackedReadSeeds packed;
+    packed.init(storage, length);
+    packed.set(data, length);
+    packed.setQuality(quality, length, minQuality);
+
+    for (unsigned seedLen = 1; seedLen <= LargestSeedSize; seedLen++) {
+        for (unsigned offset = 0; offset + seedLen <= length; offset++) {
+            bool highQuality = true;
+            for (unsigned i = offset; i < offset + seedLen; i++) {
+                highQuality = highQuality && quality[i] - '!' >= (int)minQuality;
+            }
+            ASSERT_EQ(highQuality, packed.isHighQuality(offset, seedLen));
+        }
+    }
+
+    packed.setQuality(quality, length, 0);
+    ASSERT(packed.isHighQuality(length - LargestSeedSize, LargestSeedSize));
+
+    BigDealloc(storage);
+}
+
+TEST_F(SeedTest, "spaced seed masks ignore the 0 positions in both directions") {
+    const char *pattern = "110110110111111011011011";
+    int seedLen = (int)strlen(pattern);
+    _uint64 mask = GenomeIndex::SeedMaskForPattern(pattern, seedLen);
+    ASSERT_NE((_uint64)0, mask);
+    ASSERT_EQ((_uint64)0, GenomeIndex::SeedMaskForPattern("110110110111111011011001", seedLen));   // Not symmetric
+    ASSERT_EQ((_uint64)0, GenomeIndex::SeedMaskForPattern("011011011111111110110110", seedLen));   // Starts with 0
+    ASSERT_EQ((_uint64)0, GenomeIndex::SeedMaskForPattern(pattern, seedLen - 1));
+
+    const char *text = "ACGTTGCAAGGCTTAACCGGTTAA";
+    char changed[32];
+    strcpy(changed, text);
+    changed[2] = 'A';   // Positions 2 and 21 are 0s in the pattern
+    changed[21] = 'C';
+
+    Seed seed = Seed(text, seedLen).masked(mask);
+    Seed changedSeed = Seed(changed, seedLen).masked(mask);
+    ASSERT_EQ(seed.getBases(), changedSeed.getBases());
+    ASSERT_EQ(seed.getRCBases(), changedSeed.getRCBases());
+
+    changed[3] = 'A';   // A 1
+    ASSERT_NE(seed.getBases(), Seed(changed, seedLen).masked(mask).getBases());
+
+    //
+    // Masking and taking the reverse complement commute.
+    //
+    char rcText[32];
+    for (int i = 0; i < seedLen; i++) {
+        rcText[i] = COMPLEMENT[(unsigned char)text[seedLen - i - 1]];
+    }
+    Seed rcSeed = Seed(rcText, seedLen).masked(mask);
+    ASSERT_EQ((~seed).getBases(), rcSeed.getBases());
+    ASSERT_EQ((~seed).getRCBases(), rcSeed.getRCBases());
+}
@@ -0,0 +1,348 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "Simd.h"
+#include "Bam.h"
+#include "GenomeIndex.h"
+#include "SAM.h"
+#include "FASTQ.h"
+
+//
+// Each Vector16 operation against what it's supposed to do a byte at a time, on random bytes (and some bytes picked to
+// hit the edges of the signed compares and the lookup's top bit).  This is what checks the NEON and scalar versions
+// when the tests are built for them.
+//
+static void randomBytes(_uint8 *bytes, unsigned *seed)
+{
+    static const _uint8 edges[] = {0x00, 0x01, 0x0f, 0x10, 0x7f, 0x80, 0x81, 0xf0, 0xff};
+    for (int i = 0; i < 16; i++) {
+        *seed = *seed * 1103515245 + 12345;
+        _uint8 r = (_uint8)(*seed >> 16);
+        bytes[i] = (r & 0x80) ? edges[r % sizeof(edges)] : (_uint8)(*seed >> 24);
+    }
+}
+
+//
+// Whether Vector16Lookup and Vector16Reverse can run here, which they always can when they're a byte at a time.
+//
+static bool canLookup()
+{
+    return ProcessorSupportsVector16Lookup() || !ProcessorSupportsVector16();
+}
+
+struct SimdTest {
+};
+
+TEST_F(SimdTest, "vector16 operations match their byte at a time definitions") {
+    unsigned seed = 7;
+    for (int trial = 0; trial < 2000; trial++) {
+        _uint8 a[16], b[16], m[16], out[16];
+        randomBytes(a, &seed);
+        randomBytes(b, &seed);
+        randomBytes(m, &seed);
+        for (int i = 0; i < 16; i++) {
+            m[i] = (m[i] & 1) ? 0xff : 0;   // Select wants whole byte masks
+        }
+
+        Vector16 va = Vector16Load(a), vb = Vector16Load(b), vm = Vector16Load(m);
+
+#define CHECK_BYTES(vector, expected)                                                       \
+        Vector16Store(out, vector);                                                         \
+        for (int i = 0; i < 16; i++) {                                                      \
+            ASSERT_EQ((_uint8)(expected), out[i]);                                          \
+        }
+
+        CHECK_BYTES(Vector16Set1((char)a[0]), a[0]);
+        CHECK_BYTES(Vector16Zero(), 0);
+        CHECK_BYTES(Vector16And(va, vb), a[i] & b[i]);
+        CHECK_BYTES(Vector16Or(va, vb), a[i] | b[i]);
+        CHECK_BYTES(Vector16Add(va, vb), a[i] + b[i]);
+        CHECK_BYTES(Vector16Sub(va, vb), a[i] - b[i]);
+        CHECK_BYTES(Vector16Equal(va, vb), a[i] == b[i] ? 0xff : 0);
+        CHECK_BYTES(Vector16Equal(va, va), 0xff);
+        CHECK_BYTES(Vector16Greater(va, vb), (signed char)a[i] > (signed char)b[i] ? 0xff : 0);
+        CHECK_BYTES(Vector16Select(vm, va, vb), m[i] ? a[i] : b[i]);
+        CHECK_BYTES(Vector16LowNibbles(va), a[i] & 0x0f);
+        CHECK_BYTES(Vector16HighNibbles(va), a[i] >> 4);
+        CHECK_BYTES(Vector16InterleaveLow(va, vb), (i % 2) ? b[i / 2] : a[i / 2]);
+
+        _uint32 mask = 0;
+        for (int i = 0; i < 16; i++) {
+            mask |= (_uint32)(a[i] >> 7) << i;
+        }
+        ASSERT_EQ(mask, Vector16MoveMask(va));
+
+        if (canLookup()) {
+            CHECK_BYTES(Vector16Lookup(va, vb), (b[i] & 0x80) ? 0 : a[b[i] & 0x0f]);
+            CHECK_BYTES(Vector16Reverse(va), a[15 - i]);
+        }
+
+#undef CHECK_BYTES
+    }
+}
+
+TEST_F(SimdTest, "vector16 BAM coding matches scalar") {
+    //
+    // Long enough for a few vectors and an odd tail, with every base code and every quality (including BAM's 0xff).
+    //
+    const int length = 77;
+    _uint8 nibbles[(length + 1) / 2];
+    char quality[length], sam[length];
+    unsigned seed = 11;
+    for (int i = 0; i < (length + 1) / 2; i++) {
+        nibbles[i] = (_uint8)((seed = seed * 1103515245 + 12345) >> 16);
+    }
+    for (int i = 0; i < length; i++) {
+        quality[i] = (char)(i == 3 ? 0xff : (i * 7) % 100);
+        sam[i] = (char)('!' + (i * 3) % 94);
+    }
+
+    char expected[length], actual[length];
+    if (canLookup()) {
+        BAMAlignment::decodeSeqScalar(expected, nibbles, length);
+        BAMAlignment::decodeSeqVector16(actual, nibbles, length);
+        ASSERT(!memcmp(expected, actual, length));
+
+        BAMAlignment::decodeSeqRCScalar(expected, nibbles, length);
+        BAMAlignment::decodeSeqRCVector16(actual, nibbles, length);
+        ASSERT(!memcmp(expected, actual, length));
+
+        BAMAlignment::decodeQualRCScalar(expected, quality, length);
+        BAMAlignment::decodeQualRCVector16(actual, quality, length);
+        ASSERT(!memcmp(expected, actual, length));
+    }
+
+    BAMAlignment::decodeQualScalar(expected, quality, length);
+    BAMAlignment::decodeQualVector16(actual, quality, length);
+    ASSERT(!memcmp(expected, actual, length));
+
+    BAMAlignment::encodeQualScalar(expected, sam, length);
+    BAMAlignment::encodeQualVector16(actual, sam, length);
+    ASSERT(!memcmp(expected, actual, length));
+}
+
+TEST_F(SimdTest, "location unpacking matches a location at a time") {
+    //
+    // Every location size and a range of counts, so that each version's main loop and tail both get used.
+    //
+    const int maxCount = 37;
+    unsigned char packed[maxCount * 8];
+    unsigned seed = 13;
+    for (int i = 0; i < (int)sizeof(packed); i++) {
+        packed[i] = (unsigned char)((seed = seed * 1103515245 + 12345) >> 16);
+    }
+
+    GenomeLocation expected[maxCount], actual[maxCount + 1];
+    for (unsigned locationSize = 5; locationSize <= 8; locationSize++) {
+        for (int count = 0; count <= maxCount; count++) {
+            for (int i = 0; i < count; i++) {
+                _int64 location = 0;
+                memcpy(&location, packed + i * locationSize, locationSize);
+                expected[i] = location;
+            }
+
+            actual[count] = -7;     // Nothing past the end gets written
+            GenomeIndex::UnpackLocationsScalar(packed, locationSize, count, actual);
+            ASSERT(!memcmp(expected, actual, count * sizeof(GenomeLocation)));
+            ASSERT_EQ(-7, GenomeLocationAsInt64(actual[count]));
+
+            if (canLookup()) {
+                GenomeIndex::UnpackLocationsVector16(packed, locationSize, count, actual);
+                ASSERT(!memcmp(expected, actual, count * sizeof(GenomeLocation)));
+                ASSERT_EQ(-7, GenomeLocationAsInt64(actual[count]));
+            }
+        }
+    }
+}
+
+static int versionAVX2() { return 2; }
+static int versionVector16() { return 1; }
+static int versionScalar() { return 0; }
+
+TEST_F(SimdTest, "kernel chooser picks the first version the processor has") {
+    typedef int (*Version)();
+    Version chosen = KernelChooser<Version>("chooser test").avx2(X86_ONLY(versionAVX2)).vector16(versionVector16).scalar(versionScalar);
+#ifdef SNAP_SIMD_X86
+    ASSERT_EQ(ProcessorSupportsAVX2() ? 2 : 1, (*chosen)());
+#else
+    ASSERT_EQ(ProcessorSupportsVector16() ? 1 : 0, (*chosen)());
+#endif
+
+    chosen = KernelChooser<Version>("chooser test").scalar(versionScalar);
+    ASSERT_EQ(0, (*chosen)());
+}
+
+#ifdef SNAP_SIMD_X86
+//
+// Run parseLineScalar and parseLineAVX2 on the first length bytes of text, copied to a buffer of just that size so that
+// reading past the end would be noticed under a memory checker, and check that they agree.
+//
+static void checkParseLine(const char *text, size_t length)
+{
+    char *buffer = new char[length];
+    memcpy(buffer, text, length);
+
+    char *expectedFields[SAMReader::nSAMFields], *actualFields[SAMReader::nSAMFields];
+    size_t expectedLengths[SAMReader::nSAMFields], actualLengths[SAMReader::nSAMFields];
+    size_t expectedLineLength, actualLineLength;
+    bool expected = SAMReader::parseLineScalar(buffer, buffer + length, expectedFields, &expectedLineLength, expectedLengths);
+    bool actual = SAMReader::parseLineAVX2(buffer, buffer + length, actualFields, &actualLineLength, actualLengths);
+
+    ASSERT_EQ(expected, actual);
+    ASSERT_EQ(expectedLineLength, actualLineLength);
+    if (expected) {
+        for (unsigned i = 0; i < SAMReader::nSAMFields; i++) {
+            ASSERT(expectedFields[i] == actualFields[i]);
+            if (NULL != expectedFields[i]) {
+                ASSERT_EQ(expectedLengths[i], actualLengths[i]);
+            }
+        }
+    }
+
+    delete [] buffer;
+}
+
+static void checkParseLine(const char *text)
+{
+    checkParseLine(text, strlen(text));
+}
+#endif // SNAP_SIMD_X86
+
+TEST_F(SimdTest, "AVX2 SAM line parsing matches scalar") {
+#ifdef SNAP_SIMD_X86
+    if (!ProcessorSupportsAVX2()) {
+        return;
+    }
+
+    //
+    // An ordinary line, and then the same with more than 32 bytes, so the fields cross vector boundaries.
+    //
+    checkParseLine("r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\tNM:i:0\tRG:Z:x\n");
+    checkParseLine("read_with_a_long_name_to_cross_a_vector\t99\tchr1\t1000000\t60\t20M\t=\t1000200\t220\t"
+        "ACGTACGTACGTACGTACGT\tIIIIIIIIIIIIIIIIIIII\tNM:i:0\n");
+
+    //
+    // Runs of tabs, including one that crosses a 32 byte boundary, and a tab run at the end of the line.
+    //
+    checkParseLine("r1\t\t\t0\tchr1\t100\t\t60\t4M\t*\t0\t0\tACGT\tIIII\tNM:i:0\n");
+    checkParseLine("r1_padded_out_to_30_bytes_xxx\t\t\t\t\t\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\n");
+    checkParseLine("r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\t\t\t\n");
+    checkParseLine("  \t r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\n");
+
+    //
+    // CRLF line ends, with and without optional fields.
+    //
+    checkParseLine("r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\tNM:i:0\r\n");
+    checkParseLine("r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\r\n");
+
+    //
+    // No optional fields, and too few fields.
+    //
+    checkParseLine("r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\n");
+    checkParseLine("r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\n");
+    checkParseLine("\n");
+    checkParseLine("   \n");
+
+    //
+    // An embedded NUL, in a field and in the optional fields, in the first vector and after it.
+    //
+    static const char nulInField[] = "r1\t0\tch\0r1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\n";
+    checkParseLine(nulInField, sizeof(nulInField) - 1);
+    static const char nulInOptional[] = "r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\tNM:i:0\0RG:Z:x\n";
+    checkParseLine(nulInOptional, sizeof(nulInOptional) - 1);
+
+    //
+    // A tail shorter than 32 bytes, both as the whole buffer and after some full vectors, and lines followed by more.
+    //
+    checkParseLine("a\tb\tc\td\te\tf\tg\th\ti\tj\tk\n");
+    checkParseLine("a\tb\tc\td\te\tf\tg\th\ti\tj\tk\tl\n");
+    checkParseLine("read_name_that_fills_a_vector___\t0\tchr1\t1\t0\t1M\t*\t0\t0\tA\tI\n");
+    checkParseLine("r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\nr2\t0\tchr1\t200\t60\t4M\t*\t0\t0\tACGT\tIIII\n");
+
+    //
+    // No final newline, with and without optional fields, so the end of the buffer comes first.
+    //
+    checkParseLine("r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\tNM:i:0");
+    checkParseLine("r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII");
+    checkParseLine("r1\t0\tchr1\t100\t60\t4M\t*\t0\t0\tACGT\tIIII\tNM:i:0_and_then_enough_to_fill_another_vector");
+#endif // SNAP_SIMD_X86
+}
+
+//
+// Each FindNewlines version on the first length bytes of text, copied to a buffer of just that size, against what the
+// scalar one finds.
+//
+static void checkFindNewlines(const char *text, _int64 length, int maxNewlines, int expectedCount)
+{
+    char *buffer = new char[length > 0 ? length : 1];
+    memcpy(buffer, text, length);
+
+    const int maxOffsets = 200;
+    _int64 expected[maxOffsets], actual[maxOffsets];
+    int nExpected = FASTQReader::FindNewlinesScalar(buffer, length, expected, maxNewlines);
+    if (expectedCount >= 0) {
+        ASSERT_EQ(expectedCount, nExpected);
+    }
+    for (int i = 0; i < nExpected; i++) {
+        ASSERT('\n' == buffer[expected[i]]);
+        ASSERT(NULL == memchr(buffer + (i == 0 ? 0 : expected[i - 1] + 1), 0, expected[i] - (i == 0 ? 0 : expected[i - 1] + 1)));
+    }
+
+    int nActual = FASTQReader::FindNewlinesVector16(buffer, length, actual, maxNewlines);
+    ASSERT_EQ(nExpected, nActual);
+    ASSERT(!memcmp(expected, actual, nExpected * sizeof(_int64)));
+
+#ifdef SNAP_SIMD_X86
+    if (ProcessorSupportsAVX2()) {
+        nActual = FASTQReader::FindNewlinesAVX2(buffer, length, actual, maxNewlines);
+        ASSERT_EQ(nExpected, nActual);
+        ASSERT(!memcmp(expected, actual, nExpected * sizeof(_int64)));
+    }
+#endif // SNAP_SIMD_X86
+
+    delete [] buffer;
+}
+
+TEST_F(SimdTest, "FASTQ newline finding matches scalar") {
+    //
+    // Stopping at a NUL, in the first vector, in a later one and in the tail, with newlines after it that don't count.
+    //
+    static const char nulEarly[] = "@r1\nACGT\0+\nIIII\n";
+    checkFindNewlines(nulEarly, sizeof(nulEarly) - 1, 100, 1);
+    static const char nulLater[] = "@read_one_with_a_long_name_to_fill_a_vector\nACGTACGTACGTACGTACGTACGTACGTACGTACGTACGT\n\0+\nIIII\n";
+    checkFindNewlines(nulLater, sizeof(nulLater) - 1, 100, 2);
+    static const char nulInTail[] = "@read_one_with_a_long_name_to_fill_a_vec\nAC\0GT\n";
+    checkFindNewlines(nulInTail, sizeof(nulInTail) - 1, 100, 1);
+
+    //
+    // The maxNewlines cap, hit in the first vector, in a later one and in the tail.
+    //
+    const char *fourLines = "@r1\nACGTACGTACGTACGTACGTACGTACGTACGTACGTACGT\n+\nIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII\n@r2\nA\n+\nI\n";
+    for (int maxNewlines = 1; maxNewlines <= 9; maxNewlines++) {
+        checkFindNewlines(fourLines, strlen(fourLines), maxNewlines, __min(maxNewlines, 8));
+    }
+
+    //
+    // Partial tails of every length, including ones that cut off the last newline.
+    //
+    for (_int64 length = 0; length <= (_int64)strlen(fourLines); length++) {
+        checkFindNewlines(fourLines, length, 100, -1);
+    }
+    checkFindNewlines(fourLines, 0, 100, 0);
+    checkFindNewlines("\n", 1, 100, 1);
+    checkFindNewlines("no newline at all, and longer than one vector of 32 bytes", 57, 100, 0);
+
+    //
+    // Random bytes that are mostly newlines and NULs, at every length up to a few vectors, with a range of caps.
+    //
+    char text[100];
+    unsigned seed = 17;
+    for (int trial = 0; trial < 2000; trial++) {
+        _int64 length = trial % (sizeof(text) + 1);
+        for (_int64 i = 0; i < length; i++) {
+            seed = seed * 1103515245 + 12345;
+            unsigned r = (seed >> 16) % 64;
+            text[i] = r < 12 ? '\n' : (r == 12 ? 0 : 'A' + r % 26);
+        }
+        checkFindNewlines(text, length, 1 + (trial / 7) % 40, -1);
+    }
+}
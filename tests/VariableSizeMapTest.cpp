@@ -0,0 +1,71 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "VariableSizeMap.h"
+#include <map>
+
+typedef VariableSizeGroupMap<_uint64,int> GroupMap;
+
+//
+// Check the map against a std::map holding the same things, both ways.
+//
+static void checkSame(GroupMap &map, std::map<_uint64,int> &expected)
+{
+    ASSERT_EQ((int)expected.size(), map.size());
+    for (std::map<_uint64,int>::iterator i = expected.begin(); i != expected.end(); ++i) {
+        int value;
+        ASSERT(map.tryGet(i->first, &value));
+        ASSERT_EQ(i->second, value);
+    }
+    int n = 0;
+    for (GroupMap::iterator i = map.begin(); i != map.end(); i = map.next(i)) {
+        ASSERT(expected.find(i->key) != expected.end());
+        ASSERT_EQ(expected[i->key], i->value);
+        n++;
+    }
+    ASSERT_EQ((int)expected.size(), n);
+}
+
+struct VariableSizeMapTest {
+};
+
+TEST_F(VariableSizeMapTest, "group map adds, erases and grows") {
+    GroupMap map(16);
+    std::map<_uint64,int> expected;
+    _uint64 random = 12345;
+    for (int step = 0; step < 200000; step++) {
+        random = random * 6364136223846793005ull + 1442695040888963407ull;
+        _uint64 key = (random >> 33) % 5000; // zero and the VariableSizeMap tombstone value are keys like any other
+        if ((random >> 20) % 3 == 0) {
+            ASSERT_EQ(expected.erase(key) == 1, map.erase(key));
+        } else {
+            expected[key] = step;
+            map.put(key, step);
+        }
+        if (step % 20000 == 0) {
+            checkSame(map, expected);
+        }
+    }
+    checkSame(map, expected);
+    ASSERT(map.find(5000) == map.end());
+    ASSERT(NULL == map.tryFind(0xffffffffffffffffull));
+}
+
+TEST_F(VariableSizeMapTest, "group map clear and exchange") {
+    GroupMap a, b;
+    for (int i = 0; i < 1000; i++) {
+        a.put(i, i);
+    }
+    ASSERT(*a.getOrAdd(999) == 999);
+    *b.getOrAdd(7) = 70;
+    a.exchange(b);
+    ASSERT_EQ(1, a.size());
+    ASSERT_EQ(1000, b.size());
+    ASSERT_EQ(70, a[7]);
+    ASSERT_EQ(500, b.get(500));
+    b.clear();
+    ASSERT_EQ(0, b.size());
+    ASSERT(b.begin() == b.end());
+    ASSERT(NULL == b.tryFind(500));
+    b.put(500, 1);
+    ASSERT_EQ(1, b[500]);
+}
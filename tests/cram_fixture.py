@@ -0,0 +1,346 @@
+# cram_fixture.py
+#
+# Build the small CRAM 3.0 file that CramTest.cpp decodes, straight from the CRAM 3.0 specification (the file
+# layout, the ITF8/LTF8 integers, the codecs and the rANS order 0 and order 1 block formats), without SNAP's writer
+# or samtools, and print it as a C array.
+#
+# The reference is one contig, chr1, and there are four reads in one multi-reference slice:
+#   pair1   mapped forward at 5, with a substitution, an insertion and a deletion, whose mate is the next record
+#   pair1   mapped reverse at 30, with a soft clip, a single base insertion, a base with its quality and a hard clip
+#   lonely  unmapped, detached, with an unmapped mate
+#   plain   mapped forward at 50 with no read features, detached, with a mate on chr1 at 100
+#
+# The data series use most of the codecs (EXTERNAL, HUFFMAN, BETA, GAMMA, SUBEXP, BYTE_ARRAY_LEN and
+# BYTE_ARRAY_STOP), the blocks are raw, gzip, rANS order 0 and rANS order 1, and the substitution matrix isn't the
+# default one.  Run it with python3 and paste the output into CramTest.cpp if the fixture needs to change.
+#
+
+import struct
+import zlib
+
+def itf8(v):
+    v &= 0xffffffff
+    if v < 1 << 7:
+        return bytes([v])
+    if v < 1 << 14:
+        return bytes([0x80 | (v >> 8), v & 0xff])
+    if v < 1 << 21:
+        return bytes([0xc0 | (v >> 16), (v >> 8) & 0xff, v & 0xff])
+    if v < 1 << 28:
+        return bytes([0xe0 | (v >> 24), (v >> 16) & 0xff, (v >> 8) & 0xff, v & 0xff])
+    return bytes([0xf0 | (v >> 28), (v >> 20) & 0xff, (v >> 12) & 0xff, (v >> 4) & 0xff, v & 0x0f])
+
+def ltf8(v):
+    assert 0 <= v < 1 << 7  # all this file needs
+    return bytes([v])
+
+def int32(v):
+    return struct.pack('<i', v)
+
+def crc(data):
+    return struct.pack('<I', zlib.crc32(data) & 0xffffffff)
+
+#
+# rANS, 4x8 with 12 bit frequencies.  The decoder takes symbols from the four states in a fixed order, reading
+# renormalization bytes from one stream, so the encoder just codes that same sequence backwards.
+#
+TF_SHIFT = 12
+RANS_L = 1 << 23
+
+def normalize(counts):
+    total = sum(counts.values())
+    freqs = {s: max(1, c * (1 << TF_SHIFT) // total) for s, c in counts.items()}
+    biggest = max(freqs, key=lambda s: (freqs[s], s))
+    freqs[biggest] += (1 << TF_SHIFT) - sum(freqs.values())
+    assert freqs[biggest] > 0
+    return freqs
+
+def starts(freqs):
+    result, x = {}, 0
+    for s in sorted(freqs):
+        result[s] = x
+        x += freqs[s]
+    return result
+
+def frequency_table(freqs):
+    # symbols in order, each followed by its frequency; after two consecutive symbols, a count of how many more
+    # consecutive ones follow (without their symbols); a zero symbol at the end
+    out = bytearray()
+    symbols = sorted(freqs)
+    rle = 0
+    for i, s in enumerate(symbols):
+        if rle > 0:
+            rle -= 1
+        else:
+            out.append(s)
+            if i > 0 and symbols[i - 1] == s - 1:
+                j = i + 1
+                while j < len(symbols) and symbols[j] == symbols[j - 1] + 1:
+                    j += 1
+                rle = j - i - 1
+                out.append(rle)
+        f = freqs[s]
+        out += bytes([f]) if f < 128 else bytes([0x80 | (f >> 8), f & 0xff])
+    out.append(0)
+    return out
+
+def rans_code(sequence):
+    # sequence is (state, freq, start) in the order the decoder takes them
+    states = [RANS_L] * 4
+    renorm = bytearray()
+    for k, f, c in reversed(sequence):
+        x = states[k]
+        x_max = ((RANS_L >> TF_SHIFT) << 8) * f
+        while x >= x_max:
+            renorm.append(x & 0xff)
+            x >>= 8
+        states[k] = ((x // f) << TF_SHIFT) + (x % f) + c
+    return b''.join(struct.pack('<I', s) for s in states) + bytes(reversed(renorm))
+
+def rans0(data):
+    counts = {}
+    for b in data:
+        counts[b] = counts.get(b, 0) + 1
+    freqs = normalize(counts)
+    start = starts(freqs)
+    body = frequency_table(freqs) + rans_code([(i & 3, freqs[b], start[b]) for i, b in enumerate(data)])
+    return bytes([0]) + struct.pack('<II', len(body), len(data)) + body
+
+def rans1(data):
+    # each state does a quarter of the data, the last one the remainder too, with the symbol before as the context
+    # (0 at the start of each quarter)
+    n = len(data)
+    quarter = n // 4
+    order = []
+    context = [0, 0, 0, 0]
+    for i in range(n):
+        k = i & 3 if i < 4 * quarter else 3
+        position = k * quarter + (i >> 2) if i < 4 * quarter else i
+        order.append((k, context[k], data[position]))
+        context[k] = data[position]
+    counts = {}
+    for k, c, s in order:
+        counts.setdefault(c, {})
+        counts[c][s] = counts[c].get(s, 0) + 1
+    freqs = {c: normalize(counts[c]) for c in counts}
+    start = {c: starts(freqs[c]) for c in freqs}
+    # the contexts are run length coded the same way as the symbols in each table
+    table = bytearray()
+    contexts = sorted(freqs)
+    rle = 0
+    for i, c in enumerate(contexts):
+        if rle > 0:
+            rle -= 1
+        else:
+            table.append(c)
+            if i > 0 and contexts[i - 1] == c - 1:
+                j = i + 1
+                while j < len(contexts) and contexts[j] == contexts[j - 1] + 1:
+                    j += 1
+                rle = j - i - 1
+                table.append(rle)
+        table += frequency_table(freqs[c])
+    table.append(0)
+    body = table + rans_code([(k, freqs[c][s], start[c][s]) for k, c, s in order])
+    return bytes([1]) + struct.pack('<II', len(body), len(data)) + body
+
+RAW, GZIP, RANS = 0, 1, 4
+FILE_HEADER, COMPRESSION_HEADER, SLICE_HEADER, EXTERNAL, CORE = 0, 1, 2, 4, 5
+
+def block(method, content_type, content_id, raw, compressed=None):
+    data = raw if compressed is None else compressed
+    b = bytes([method, content_type]) + itf8(content_id) + itf8(len(data)) + itf8(len(raw)) + data
+    return b + crc(b)
+
+def gzip(data):
+    c = zlib.compressobj(9, zlib.DEFLATED, 31)
+    return c.compress(data) + c.flush()
+
+def container(ref_id, start, span, n_records, record_counter, bases, blocks, landmarks):
+    data = b''.join(blocks)
+    header = int32(len(data)) + itf8(ref_id) + itf8(start) + itf8(span) + itf8(n_records) + ltf8(record_counter) + \
+        ltf8(bases) + itf8(len(blocks)) + itf8(len(landmarks)) + b''.join(itf8(l) for l in landmarks)
+    return header + crc(header) + data
+
+class Bits:
+    def __init__(self):
+        self.bits = []
+    def put(self, value, n):
+        for i in range(n - 1, -1, -1):
+            self.bits.append((value >> i) & 1)
+    def gamma(self, value):     # value >= 1
+        n = value.bit_length() - 1
+        self.put(0, n)
+        self.put(1, 1)
+        self.put(value - (1 << n), n)
+    def subexp(self, value, k):
+        if value < 1 << k:
+            self.put(0, 1)
+            self.put(value, k)
+        else:
+            b = value.bit_length() - 1
+            self.put((1 << (b - k + 1)) - 1, b - k + 1)
+            self.put(0, 1)
+            self.put(value - (1 << b), b)
+    def bytes(self):
+        bits = self.bits + [0] * (-len(self.bits) % 8)
+        return bytes(int(''.join(map(str, bits[i:i + 8])), 2) for i in range(0, len(bits), 8))
+
+def encoding(codec, params):
+    return itf8(codec) + itf8(len(params)) + params
+
+def external(content_id):
+    return encoding(1, itf8(content_id))
+
+def huffman(symbols, lengths):
+    return encoding(3, itf8(len(symbols)) + b''.join(itf8(s) for s in symbols) + itf8(len(lengths)) +
+        b''.join(itf8(l) for l in lengths))
+
+def byte_array_len(lengths, values):
+    return encoding(4, lengths + values)
+
+def byte_array_stop(stop, content_id):
+    return encoding(5, bytes([stop]) + itf8(content_id))
+
+def beta(offset, bits):
+    return encoding(6, itf8(offset) + itf8(bits))
+
+def subexp(offset, k):
+    return encoding(7, itf8(offset) + itf8(k))
+
+def gamma(offset):
+    return encoding(9, itf8(offset))
+
+def sized_map(entries):
+    body = itf8(len(entries)) + b''.join(entries)
+    return itf8(len(body)) + body
+
+#
+# The header container.
+#
+text = b'@HD\tVN:1.6\tSO:unsorted\n@SQ\tSN:chr1\tLN:60\n@RG\tID:grp1\tSM:s1\n'
+file_header = block(RAW, FILE_HEADER, 0, int32(len(text)) + text)
+out = b'CRAM' + bytes([3, 0]) + b'cram_fixture.py\0\0\0\0\0'
+out += container(0, 0, 0, 0, 0, 0, [file_header], [])
+
+#
+# The compression header.  For A (the first of ACGTN) the substitution codes of C, G, T and N are 3, 2, 1 and 0;
+# the others are the default 0, 1, 2, 3 in order.
+#
+td = b'NMc\0\0'    # tag line 0 is NM:c, line 1 has no tags
+preservation = sized_map([b'RN\x01', b'AP\x00', b'RR\x01', b'SM' + bytes([0xe4, 0x1b, 0x1b, 0x1b, 0x1b]),
+    b'TD' + itf8(len(td)) + td])
+series = sized_map([
+    b'BF' + external(1),
+    b'CF' + huffman([3, 0, 5], [1, 2, 2]),
+    b'RI' + beta(1, 1),
+    b'RL' + external(4),
+    b'AP' + gamma(1),
+    b'RG' + external(6),
+    b'RN' + byte_array_stop(ord('\t'), 7),
+    b'MF' + external(8),
+    b'NS' + external(9),
+    b'NP' + external(10),
+    b'TS' + external(11),
+    b'NF' + external(12),
+    b'TL' + subexp(0, 1),
+    b'FN' + external(13),
+    b'FC' + external(14),
+    b'FP' + external(15),
+    b'DL' + external(16),
+    b'BA' + external(17),
+    b'QS' + external(18),
+    b'BS' + external(19),
+    b'IN' + byte_array_len(external(20), external(21)),
+    b'SC' + byte_array_stop(0, 22),
+    b'HC' + external(23),
+    b'MQ' + external(24),
+])
+tags = sized_map([itf8((ord('N') << 16) | (ord('M') << 8) | ord('c')) + external(30)])
+compression_header = block(RAW, COMPRESSION_HEADER, 0, preservation + series + tags)
+
+#
+# The records, a data series at a time, in the order the specification decodes them.
+#
+core = Bits()
+ext = {i: bytearray() for i in list(range(1, 25)) + [30]}
+
+def put_int(content_id, value):
+    ext[content_id] += itf8(value)
+
+def record(bf, cf, ri, rl, ap, rg, name):
+    put_int(1, bf)
+    core.put({3: 0b0, 0: 0b10, 5: 0b11}[cf], 1 if cf == 3 else 2)
+    core.put(ri + 1, 1)
+    put_int(4, rl)
+    core.gamma(ap + 1)
+    put_int(6, rg)
+    ext[7] += name + b'\t'
+
+# pair1, first of the pair: flags paired, proper, first; qualities; the mate is the next record
+record(0x43, 0x5, 0, 12, 5, 0, b'pair1')
+put_int(12, 0)
+core.subexp(0, 1)           # tag line 0
+ext[30] += bytes([2])       # NM:c:2
+put_int(13, 3)
+ext[14] += b'X'; put_int(15, 3); ext[19] += bytes([1])          # A at read position 3 becomes T
+ext[14] += b'I'; put_int(15, 3); put_int(20, 2); ext[21] += b'GG'
+ext[14] += b'D'; put_int(15, 3); put_int(16, 2)
+put_int(24, 60)
+ext[18] += bytes(range(20, 32))
+
+# pair1, second of the pair: paired, proper, reversed, second; no quality array
+record(0x93, 0x0, 0, 10, 30, -1, b'pair1')
+core.subexp(1, 1)
+put_int(13, 4)
+ext[14] += b'S'; put_int(15, 1); ext[22] += b'TT\0'
+ext[14] += b'i'; put_int(15, 5); ext[17] += b'A'
+ext[14] += b'B'; put_int(15, 2); ext[17] += b'N'; ext[18] += bytes([10])
+ext[14] += b'H'; put_int(15, 3); put_int(23, 5)
+put_int(24, 37)
+
+# lonely: unmapped, detached with an unmapped mate, in read group grp1
+record(0x4 | 0x1, 0x3, -1, 8, 0, 0, b'lonely')
+put_int(8, 0x2)
+put_int(9, -1)
+put_int(10, 0)
+put_int(11, 0)
+core.subexp(1, 1)
+ext[17] += b'GATTACAA'
+ext[18] += bytes([30, 31, 32, 33, 34, 35, 36, 37])
+
+# plain: no read features, detached with its mate on chr1 at 100
+record(0x1 | 0x40, 0x3, 0, 8, 50, -1, b'plain')
+put_int(8, 0)
+put_int(9, 0)
+put_int(10, 100)
+put_int(11, 0)
+core.subexp(1, 1)
+put_int(13, 0)
+put_int(24, 12)
+ext[18] += bytes([40] * 8)
+
+compression = {1: RANS, 7: GZIP, 18: RANS}
+blocks = [block(RAW, CORE, 0, core.bytes())]
+for content_id, data in sorted(ext.items()):
+    data = bytes(data)
+    method = compression.get(content_id, RAW)
+    packed = rans0(data) if content_id == 1 else rans1(data) if content_id == 18 else gzip(data) if method == GZIP else None
+    blocks.append(block(method, EXTERNAL, content_id, data, packed))
+
+content_ids = sorted(ext)
+slice_header = itf8(-2) + itf8(0) + itf8(0) + itf8(4) + ltf8(0) + itf8(len(blocks)) + itf8(len(content_ids)) + \
+    b''.join(itf8(i) for i in content_ids) + itf8(-1) + bytes(16)
+slice_blocks = [block(RAW, SLICE_HEADER, 0, slice_header)] + blocks
+out += container(-2, 0, 0, 4, 0, 38, [compression_header] + slice_blocks, [len(compression_header)])
+
+#
+# The end of file container, as the specification gives it for 3.0: no records, and a compression header of three
+# empty maps.
+#
+out += container(-1, 0x454f46, 0, 0, 0, 0, [block(RAW, COMPRESSION_HEADER, 0, bytes([1, 0, 1, 0, 1, 0]))], [])
+
+print('static const unsigned char cramFixture[] = {')
+for i in range(0, len(out), 16):
+    print('    ' + ' '.join('0x%02x,' % b for b in out[i:i + 16]))
+print('};')